@@ -35,6 +35,10 @@ static const int dns_port = 53;
 static const int default_io_cnt = 8;
 
 #define UDP_PACKET_SIZE 4096
+#define MIN_EDNS_PAYLOAD 512
+
+/* Marks IO channels, so they could be told from requests in write events */
+#define RDNS_IO_CHANNEL_TAG UINT64_C(0x5244e5a1c0ffee01)
 
 #define DNS_COMPRESSION_BITS 0xC0
 
@@ -52,6 +56,7 @@ struct rdns_server {
 	unsigned int io_cnt;
 
 	struct rdns_io_channel **io_channels;
+	struct rdns_io_channel *tcp_io; /**< persistent TCP channel, created on demand */
 	void *ups_elt;
 	upstream_entry_t up;
 };
@@ -63,6 +68,8 @@ enum rdns_request_state {
 	RDNS_REQUEST_WAIT_REPLY,
 	RDNS_REQUEST_REPLIED,
 	RDNS_REQUEST_FAKE,
+	RDNS_REQUEST_CACHED,
+	RDNS_REQUEST_WAIT_LEADER,
 };
 
 struct rdns_request {
@@ -93,20 +100,53 @@ struct rdns_request {
 	void *curve_plugin_data;
 #endif
 
+	/* Coalescing of requests for the same name and type */
+	char *inflight_key;
+	struct rdns_request *leader;
+	struct rdns_request *followers;
+	struct rdns_request *prev, *next;
+
 	UT_hash_handle hh;
+	UT_hash_handle inflight_hh;
 	ref_entry_t ref;
 };
 
+/**
+ * Packet waiting to be written to a TCP channel
+ */
+struct rdns_tcp_output_chain {
+	uint16_t next_write_size; /**< packet length in network byte order */
+	size_t cur_write; /**< bytes written including length prefix */
+	uint8_t *write_buf;
+	struct rdns_tcp_output_chain *prev, *next;
+};
+
+/**
+ * State of a TCP channel, packets are prefixed with 2 bytes length
+ */
+struct rdns_tcp_channel {
+	uint8_t size_buf[2]; /**< length prefix of the packet being read */
+	uint16_t next_read_size; /**< length of the packet being read, 0 if unknown */
+	uint16_t cur_read; /**< bytes of prefix or packet read */
+	uint8_t *read_buf;
+	size_t read_buf_allocated;
+	struct rdns_tcp_output_chain *output_chain;
+	void *async_write;
+};
+
 /**
  * IO channel for a specific DNS server
  */
 struct rdns_io_channel {
+	uint64_t tag; /**< RDNS_IO_CHANNEL_TAG, must be the first field */
 	struct rdns_server *srv;
 	struct rdns_resolver *resolver;
 	int sock; /**< persistent socket                                          */
 	bool active;
+	bool connected; /**< TCP connection is established */
 	void *async_io; /** async opaque ptr */
 	struct rdns_request *requests; /**< requests in flight                                         */
+	struct rdns_tcp_channel *tcp; /**< NULL for UDP channels */
 	uint64_t uses;
 	ref_entry_t ref;
 };
@@ -131,6 +171,8 @@ struct rdns_resolver {
 	struct rdns_async_context *async; /** async callbacks */
 	void *periodic; /** periodic event for resolver */
 	struct rdns_upstream_context *ups;
+	struct rdns_cache_context *cache;
+	struct rdns_request *inflight; /**< hash of requests that could be joined */
 	struct rdns_plugin *curve_plugin;
 	struct rdns_fake_reply *fake_elts;
 
@@ -140,10 +182,13 @@ struct rdns_resolver {
 
 	uint64_t max_ioc_uses;
 	void *refresh_ioc_periodic;
+	uint16_t edns_payload;
 
 	bool async_binded;
 	bool initialized;
 	bool enable_dnssec;
+	bool coalesce_requests;
+	bool enable_tcp;
 	ref_entry_t ref;
 };
 
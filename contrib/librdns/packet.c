@@ -265,7 +265,7 @@ rdns_add_edns0 (struct rdns_request *req)
 	p8 = (req->packet + req->pos);
 	*p8++ = '\0'; /* Name is root */
 	U16_TO_WIRE_ADVANCE (DNS_T_OPT, p8);
-	U16_TO_WIRE_ADVANCE (UDP_PACKET_SIZE, p8);
+	U16_TO_WIRE_ADVANCE (req->resolver->edns_payload, p8);
 	U16_TO_WIRE_ADVANCE (0, p8);
 
 	if (req->resolver->enable_dnssec) {
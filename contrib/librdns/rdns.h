@@ -197,6 +197,19 @@ struct rdns_plugin {
 	void *data;
 };
 
+/*
+ * Cache of replies consulted before sending requests
+ */
+struct rdns_cache_context {
+	void *data;
+	/* Returns true and sets rcode and entries (owned by reply) if name is cached */
+	bool (*lookup)(const char *name, size_t len, enum rdns_request_type type,
+			enum dns_rcode *rcode, struct rdns_reply_entry **entries,
+			void *cache_data);
+	void (*store)(const char *name, size_t len, enum rdns_request_type type,
+			struct rdns_reply *reply, void *cache_data);
+};
+
 /*
  * RDNS logger types
  */
@@ -247,6 +260,29 @@ void rdns_resolver_async_bind (struct rdns_resolver *resolver,
  */
 void rdns_resolver_set_dnssec (struct rdns_resolver *resolver, bool enabled);
 
+/**
+ * Share one request between concurrent requests for the same name and type,
+ * all of them get the same reply
+ * @param resolver
+ */
+void rdns_resolver_set_coalescing (struct rdns_resolver *resolver, bool enabled);
+
+/**
+ * Repeat requests with truncated replies over TCP, a single TCP connection to
+ * each server is kept open and shared by all requests
+ * @param resolver
+ */
+void rdns_resolver_set_tcp (struct rdns_resolver *resolver, bool enabled);
+
+/**
+ * Set UDP payload size advertised in EDNS0, larger replies are truncated
+ * by servers
+ * @param resolver
+ * @param size payload size from 512 to 4096 bytes
+ */
+void rdns_resolver_set_edns_payload (struct rdns_resolver *resolver,
+		unsigned int size);
+
 /**
  * Add new DNS server definition to the resolver
  * @param resolver resolver object
@@ -310,6 +346,16 @@ void rdns_resolver_set_upstream_lib (struct rdns_resolver *resolver,
 		struct rdns_upstream_context *ups_ctx,
 		void *ups_data);
 
+/**
+ * Set cache library for replies
+ * @param resolver resolver object
+ * @param cache_ctx cache functions
+ * @param cache_data opaque data
+ */
+void rdns_resolver_set_cache_lib (struct rdns_resolver *resolver,
+		struct rdns_cache_context *cache_ctx,
+		void *cache_data);
+
 /**
  * Set maximum number of dns requests to be sent to a socket to be refreshed
  * @param resolver resolver object
@@ -24,6 +24,7 @@
  */
 
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
@@ -31,6 +32,7 @@
 #include <string.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <stdio.h>
 
 #include "rdns.h"
 #include "dns_private.h"
@@ -126,6 +128,105 @@ rdns_make_reply (struct rdns_request *req, enum dns_rcode rcode)
 	return rep;
 }
 
+static char *
+rdns_strdup_maybe (const char *s)
+{
+	return s ? strdup (s) : NULL;
+}
+
+/* Deep copy of reply for another request */
+static struct rdns_reply *
+rdns_reply_copy (struct rdns_request *req, struct rdns_reply *orig)
+{
+	struct rdns_reply *rep;
+	struct rdns_reply_entry *entry, *elt;
+
+	rep = rdns_make_reply (req, orig->code);
+
+	if (rep == NULL) {
+		return NULL;
+	}
+
+	rep->authenticated = orig->authenticated;
+
+	LL_FOREACH (orig->entries, entry) {
+		elt = malloc (sizeof (*elt));
+
+		if (elt == NULL) {
+			break;
+		}
+
+		memcpy (elt, entry, sizeof (*elt));
+
+		switch (entry->type) {
+		case RDNS_REQUEST_PTR:
+			elt->content.ptr.name = rdns_strdup_maybe (entry->content.ptr.name);
+			break;
+		case RDNS_REQUEST_NS:
+			elt->content.ns.name = rdns_strdup_maybe (entry->content.ns.name);
+			break;
+		case RDNS_REQUEST_MX:
+			elt->content.mx.name = rdns_strdup_maybe (entry->content.mx.name);
+			break;
+		case RDNS_REQUEST_TXT:
+		case RDNS_REQUEST_SPF:
+			elt->content.txt.data = rdns_strdup_maybe (entry->content.txt.data);
+			break;
+		case RDNS_REQUEST_SRV:
+			elt->content.srv.target = rdns_strdup_maybe (entry->content.srv.target);
+			break;
+		case RDNS_REQUEST_TLSA:
+			elt->content.tlsa.data = malloc (entry->content.tlsa.datalen + 1);
+
+			if (elt->content.tlsa.data) {
+				memcpy (elt->content.tlsa.data, entry->content.tlsa.data,
+						entry->content.tlsa.datalen);
+			}
+			break;
+		case RDNS_REQUEST_SOA:
+			elt->content.soa.mname = rdns_strdup_maybe (entry->content.soa.mname);
+			elt->content.soa.admin = rdns_strdup_maybe (entry->content.soa.admin);
+			break;
+		default:
+			break;
+		}
+
+		DL_APPEND (rep->entries, elt);
+	}
+
+	return rep;
+}
+
+/*
+ * Passes reply to the requests joined to this one and then to the request
+ * itself (unless it has been released by its owner)
+ */
+static void
+rdns_request_deliver (struct rdns_request *req, struct rdns_reply *rep)
+{
+	struct rdns_request *follower;
+	struct rdns_reply *frep;
+
+	rdns_request_remove_inflight (req);
+
+	while ((follower = req->followers) != NULL) {
+		DL_DELETE (req->followers, follower);
+		follower->leader = NULL;
+		follower->state = RDNS_REQUEST_REPLIED;
+		frep = rdns_reply_copy (follower, rep);
+
+		if (frep != NULL) {
+			follower->func (frep, follower->arg);
+		}
+
+		REF_RELEASE (follower);
+	}
+
+	if (req->func) {
+		req->func (rep, req->arg);
+	}
+}
+
 static struct rdns_request *
 rdns_find_dns_request (uint8_t *in, struct rdns_io_channel *ioc)
 {
@@ -239,6 +340,154 @@ rdns_parse_reply (uint8_t *in, int r, struct rdns_request *req,
 	return true;
 }
 
+static void rdns_process_tcp_read (int fd, struct rdns_io_channel *ioc);
+
+/*
+ * Detaches the request from its UDP channel and queues it to the persistent
+ * TCP channel of the same server
+ */
+static bool
+rdns_reschedule_req_over_tcp (struct rdns_request *req)
+{
+	struct rdns_resolver *resolver = req->resolver;
+	struct rdns_server *serv = req->io->srv;
+	struct rdns_io_channel *ioc;
+	struct rdns_request *tmp;
+	struct rdns_tcp_output_chain *oc;
+	struct dns_header *header;
+	const int max_id_cycles = 32;
+	int r = 0;
+
+	ioc = serv->tcp_io;
+
+	if (ioc == NULL) {
+		ioc = calloc (1, sizeof (*ioc));
+
+		if (ioc == NULL) {
+			return false;
+		}
+
+		ioc->tcp = calloc (1, sizeof (*ioc->tcp));
+
+		if (ioc->tcp == NULL) {
+			free (ioc);
+			return false;
+		}
+
+		ioc->tag = RDNS_IO_CHANNEL_TAG;
+		ioc->srv = serv;
+		ioc->resolver = resolver;
+		ioc->sock = -1;
+		ioc->active = true;
+		REF_INIT_RETAIN (ioc, rdns_ioc_free);
+		serv->tcp_io = ioc;
+	}
+
+	if (ioc->sock == -1) {
+		ioc->sock = rdns_make_client_socket (serv->name, serv->port,
+				SOCK_STREAM);
+
+		if (ioc->sock == -1) {
+			rdns_info ("cannot connect to %s:%d over tcp: %s", serv->name,
+					(int)serv->port, strerror (errno));
+			return false;
+		}
+
+		ioc->connected = false;
+		ioc->async_io = resolver->async->add_read (resolver->async->data,
+				ioc->sock, ioc);
+	}
+
+	/* Id must be unique among requests in the TCP channel */
+	HASH_FIND_INT (ioc->requests, &req->id, tmp);
+
+	while (tmp != NULL) {
+		header = (struct dns_header *)req->packet;
+		header->qid = rdns_permutor_generate_id ();
+		req->id = header->qid;
+
+		if (++r > max_id_cycles) {
+			return false;
+		}
+
+		HASH_FIND_INT (ioc->requests, &req->id, tmp);
+	}
+
+	/* Packet is copied, as the request can be released before it is written */
+	oc = malloc (sizeof (*oc) + req->pos);
+
+	if (oc == NULL) {
+		return false;
+	}
+
+	oc->write_buf = (uint8_t *)(oc + 1);
+	memcpy (oc->write_buf, req->packet, req->pos);
+	oc->next_write_size = htons (req->pos);
+	oc->cur_write = 0;
+	DL_APPEND (ioc->tcp->output_chain, oc);
+
+	if (ioc->tcp->async_write == NULL) {
+		/* Also signals that the connection is established */
+		ioc->tcp->async_write = resolver->async->add_write (
+				resolver->async->data, ioc->sock, ioc);
+	}
+
+	rdns_request_unschedule (req);
+	REF_RELEASE (req->io);
+	req->io = ioc;
+	REF_RETAIN (ioc);
+
+	HASH_ADD_INT (ioc->requests, id, req);
+	req->async_event = resolver->async->add_timer (resolver->async->data,
+			req->timeout, req);
+	req->state = RDNS_REQUEST_WAIT_REPLY;
+
+	return true;
+}
+
+static void
+rdns_process_reply (struct rdns_io_channel *ioc, struct rdns_request *req,
+		uint8_t *in, ssize_t r)
+{
+	struct dns_header *header = (struct dns_header *)in;
+	struct rdns_resolver *resolver = ioc->resolver;
+	struct rdns_reply *rep;
+
+	if (header->tc && ioc->tcp == NULL && resolver->enable_tcp &&
+			resolver->curve_plugin == NULL) {
+		if (rdns_reschedule_req_over_tcp (req)) {
+			rdns_debug ("reply for %s is truncated, repeat request over tcp",
+					req->requested_names[0].name);
+
+			return;
+		}
+
+		/* Use truncated reply as is */
+	}
+
+	if (rdns_parse_reply (in, r, req, &rep)) {
+		UPSTREAM_OK (req->io->srv);
+
+		if (req->resolver->ups && req->io->srv->ups_elt) {
+			req->resolver->ups->ok (req->io->srv->ups_elt,
+					req->resolver->ups->data);
+		}
+
+		rdns_request_unschedule (req);
+		req->state = RDNS_REQUEST_REPLIED;
+
+		if (req->resolver->cache && req->qcount == 1) {
+			req->resolver->cache->store (req->requested_names[0].name,
+					req->requested_names[0].len,
+					req->requested_names[0].type,
+					rep, req->resolver->cache->data);
+		}
+
+		rdns_request_deliver (req, rep);
+		REF_RELEASE (req);
+	}
+}
+
 void
 rdns_process_read (int fd, void *arg)
 {
@@ -246,11 +495,16 @@ rdns_process_read (int fd, void *arg)
 	struct rdns_resolver *resolver;
 	struct rdns_request *req = NULL;
 	ssize_t r;
-	struct rdns_reply *rep;
 	uint8_t in[UDP_PACKET_SIZE];
 
 	resolver = ioc->resolver;
 
+	if (ioc->tcp != NULL) {
+		rdns_process_tcp_read (fd, ioc);
+
+		return;
+	}
+
 	/* First read packet from socket */
 	if (resolver->curve_plugin == NULL) {
 		r = read (fd, in, sizeof (in));
@@ -268,24 +522,230 @@ rdns_process_read (int fd, void *arg)
 	}
 
 	if (req != NULL) {
-		if (rdns_parse_reply (in, r, req, &rep)) {
-			UPSTREAM_OK (req->io->srv);
+		rdns_process_reply (ioc, req, in, r);
+	}
+	else {
+		/* Still want to increase uses */
+		ioc->uses ++;
+	}
+}
+
+/*
+ * Closes TCP connection and fails all requests waiting for it, the next
+ * truncated reply opens a new connection
+ */
+static void
+rdns_ioc_tcp_reset (struct rdns_io_channel *ioc, const char *reason)
+{
+	struct rdns_resolver *resolver = ioc->resolver;
+	struct rdns_tcp_channel *tcp = ioc->tcp;
+	struct rdns_request *reqs, *req, *rtmp;
+	struct rdns_tcp_output_chain *oc, *otmp;
+	struct rdns_reply *rep;
+
+	if (ioc->requests != NULL) {
+		rdns_info ("tcp connection to %s is lost: %s", ioc->srv->name, reason);
+	}
+
+	if (tcp->async_write != NULL) {
+		resolver->async->del_write (resolver->async->data, tcp->async_write);
+		tcp->async_write = NULL;
+	}
+
+	if (ioc->async_io != NULL) {
+		resolver->async->del_read (resolver->async->data, ioc->async_io);
+		ioc->async_io = NULL;
+	}
 
-			if (req->resolver->ups && req->io->srv->ups_elt) {
-				req->resolver->ups->ok (req->io->srv->ups_elt,
-						req->resolver->ups->data);
+	if (ioc->sock != -1) {
+		close (ioc->sock);
+		ioc->sock = -1;
+	}
+
+	ioc->connected = false;
+	tcp->next_read_size = 0;
+	tcp->cur_read = 0;
+
+	DL_FOREACH_SAFE (tcp->output_chain, oc, otmp) {
+		DL_DELETE (tcp->output_chain, oc);
+		free (oc);
+	}
+
+	/* Callbacks can add new requests to the channel */
+	reqs = ioc->requests;
+	ioc->requests = NULL;
+
+	HASH_ITER (hh, reqs, req, rtmp) {
+		HASH_DEL (reqs, req);
+
+		if (req->async_event) {
+			req->async->del_timer (req->async->data, req->async_event);
+			req->async_event = NULL;
+		}
+
+		rep = rdns_make_reply (req, RDNS_RC_NETERR);
+		req->state = RDNS_REQUEST_REPLIED;
+		rdns_request_deliver (req, rep);
+		REF_RELEASE (req);
+	}
+}
+
+static void
+rdns_process_tcp_read (int fd, struct rdns_io_channel *ioc)
+{
+	struct rdns_tcp_channel *tcp = ioc->tcp;
+	struct rdns_request *req;
+	uint8_t *nbuf;
+	ssize_t r;
+	uint16_t len;
+
+	for (;;) {
+		if (tcp->next_read_size == 0) {
+			r = read (fd, tcp->size_buf + tcp->cur_read,
+					sizeof (tcp->size_buf) - tcp->cur_read);
+		}
+		else {
+			r = read (fd, tcp->read_buf + tcp->cur_read,
+					tcp->next_read_size - tcp->cur_read);
+		}
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				rdns_ioc_tcp_reset (ioc, strerror (errno));
 			}
 
-			rdns_request_unschedule (req);
-			req->state = RDNS_REQUEST_REPLIED;
-			req->func (rep, req->arg);
-			REF_RELEASE (req);
+			return;
+		}
+		else if (r == 0) {
+			/* Servers close idle connections */
+			rdns_ioc_tcp_reset (ioc, "connection closed by server");
+
+			return;
+		}
+
+		tcp->cur_read += r;
+
+		if (tcp->next_read_size == 0) {
+			if (tcp->cur_read < sizeof (tcp->size_buf)) {
+				continue;
+			}
+
+			tcp->next_read_size = ((uint16_t)tcp->size_buf[0] << 8) |
+					tcp->size_buf[1];
+			tcp->cur_read = 0;
+
+			if (tcp->next_read_size < sizeof (struct dns_header)) {
+				rdns_ioc_tcp_reset (ioc, "invalid packet length");
+
+				return;
+			}
+
+			if (tcp->read_buf_allocated < tcp->next_read_size) {
+				nbuf = realloc (tcp->read_buf, tcp->next_read_size);
+
+				if (nbuf == NULL) {
+					rdns_ioc_tcp_reset (ioc, strerror (errno));
+
+					return;
+				}
+
+				tcp->read_buf = nbuf;
+				tcp->read_buf_allocated = tcp->next_read_size;
+			}
+		}
+		else if (tcp->cur_read == tcp->next_read_size) {
+			len = tcp->next_read_size;
+			tcp->next_read_size = 0;
+			tcp->cur_read = 0;
+
+			if (len > sizeof (struct dns_header) + sizeof (struct dns_query)) {
+				req = rdns_find_dns_request (tcp->read_buf, ioc);
+
+				if (req != NULL) {
+					rdns_process_reply (ioc, req, tcp->read_buf, len);
+				}
+			}
+
+			if (ioc->sock != fd) {
+				/* Reset by a callback */
+				return;
+			}
 		}
 	}
-	else {
-		/* Still want to increase uses */
-		ioc->uses ++;
+}
+
+static void
+rdns_process_tcp_write (int fd, struct rdns_io_channel *ioc)
+{
+	struct rdns_resolver *resolver = ioc->resolver;
+	struct rdns_tcp_channel *tcp = ioc->tcp;
+	struct rdns_tcp_output_chain *oc;
+	struct iovec iov[2];
+	int niov, s_error = 0;
+	socklen_t optlen;
+	size_t len;
+	ssize_t r;
+
+	if (!ioc->connected) {
+		optlen = sizeof (s_error);
+		getsockopt (fd, SOL_SOCKET, SO_ERROR, (void *)&s_error, &optlen);
+
+		if (s_error) {
+			rdns_ioc_tcp_reset (ioc, strerror (s_error));
+
+			return;
+		}
+
+		ioc->connected = true;
 	}
+
+	while ((oc = tcp->output_chain) != NULL) {
+		len = ntohs (oc->next_write_size);
+
+		/* Length prefix and packet are written by a single call */
+		if (oc->cur_write < sizeof (oc->next_write_size)) {
+			iov[0].iov_base = ((uint8_t *)&oc->next_write_size) + oc->cur_write;
+			iov[0].iov_len = sizeof (oc->next_write_size) - oc->cur_write;
+			iov[1].iov_base = oc->write_buf;
+			iov[1].iov_len = len;
+			niov = 2;
+		}
+		else {
+			iov[0].iov_base = oc->write_buf + oc->cur_write -
+					sizeof (oc->next_write_size);
+			iov[0].iov_len = len + sizeof (oc->next_write_size) - oc->cur_write;
+			niov = 1;
+		}
+
+		r = writev (fd, iov, niov);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				rdns_ioc_tcp_reset (ioc, strerror (errno));
+			}
+
+			return;
+		}
+
+		oc->cur_write += r;
+
+		if (oc->cur_write < len + sizeof (oc->next_write_size)) {
+			/* Wait for the socket to be writable again */
+			return;
+		}
+
+		DL_DELETE (tcp->output_chain, oc);
+		free (oc);
+	}
+
+	resolver->async->del_write (resolver->async->data, tcp->async_write);
+	tcp->async_write = NULL;
 }
 
 void
@@ -314,12 +774,19 @@ rdns_process_timer (void *arg)
 		rep = rdns_make_reply (req, RDNS_RC_TIMEOUT);
 		rdns_request_unschedule (req);
 		req->state = RDNS_REQUEST_REPLIED;
-		req->func (rep, req->arg);
+		rdns_request_deliver (req, rep);
 		REF_RELEASE (req);
 
 		return;
 	}
 
+	if (req->io->tcp != NULL) {
+		/* Requests are not lost in TCP connections, just wait for reply */
+		req->async->repeat_timer (req->async->data, req->async_event);
+
+		return;
+	}
+
 	if (!req->io->active || req->retransmits == 1) {
 
 		if (resolver->ups) {
@@ -360,7 +827,7 @@ rdns_process_timer (void *arg)
 				rdns_warn ("cannot find suitable server for request");
 				rep = rdns_make_reply (req, RDNS_RC_SERVFAIL);
 				req->state = RDNS_REQUEST_REPLIED;
-				req->func (rep, req->arg);
+				rdns_request_deliver (req, rep);
 				REF_RELEASE (req);
 
 				return;
@@ -409,7 +876,7 @@ rdns_process_timer (void *arg)
 		/* We have not scheduled timeout actually due to send error */
 		rep = rdns_make_reply (req, RDNS_RC_NETERR);
 		req->state = RDNS_REQUEST_REPLIED;
-		req->func (rep, req->arg);
+		rdns_request_deliver (req, rep);
 		REF_RELEASE (req);
 	}
 	else {
@@ -453,6 +920,7 @@ rdns_process_ioc_refresh (void *arg)
 						free (nioc);
 						continue;
 					}
+					nioc->tag = RDNS_IO_CHANNEL_TAG;
 					nioc->srv = serv;
 					nioc->active = true;
 					nioc->resolver = resolver;
@@ -476,17 +944,28 @@ rdns_process_retransmit (int fd, void *arg)
 	struct rdns_request *req = (struct rdns_request *)arg;
 	struct rdns_resolver *resolver;
 	struct rdns_reply *rep;
+	uint64_t tag;
 	int r;
 
+	/* TCP channels are also waiting for write events */
+	memcpy (&tag, arg, sizeof (tag));
+
+	if (tag == RDNS_IO_CHANNEL_TAG) {
+		rdns_process_tcp_write (fd, (struct rdns_io_channel *)arg);
+
+		return;
+	}
+
 	resolver = req->resolver;
 
 	resolver->async->del_write (resolver->async->data,
 			req->async_event);
 	req->async_event = NULL;
 
-	if (req->state == RDNS_REQUEST_FAKE) {
+	if (req->state == RDNS_REQUEST_FAKE ||
+			req->state == RDNS_REQUEST_CACHED) {
 		/* Reply is ready */
-		req->func (req->reply, req->arg);
+		rdns_request_deliver (req, req->reply);
 		REF_RELEASE (req);
 
 		return;
@@ -511,7 +990,7 @@ rdns_process_retransmit (int fd, void *arg)
 
 		rep = rdns_make_reply (req, RDNS_RC_NETERR);
 		req->state = RDNS_REQUEST_REPLIED;
-		req->func (rep, req->arg);
+		rdns_request_deliver (req, rep);
 		REF_RELEASE (req);
 	}
 	else {
@@ -546,6 +1025,11 @@ rdns_make_request_full (
 	struct rdns_fake_reply *fake_rep = NULL;
 	char fake_buf[MAX_FAKE_NAME + sizeof (struct rdns_fake_reply_idx) + 16];
 	struct rdns_fake_reply_idx *idx;
+	struct rdns_request *leader = NULL;
+	struct rdns_reply_entry *cached_entries;
+	enum dns_rcode cached_rcode;
+	char *inflight_key = NULL;
+	size_t keylen;
 
 	if (resolver == NULL || !resolver->initialized) {
 		if (resolver == NULL) {
@@ -574,6 +1058,9 @@ rdns_make_request_full (
 	req->packet = NULL;
 	req->requested_names = calloc (queries, sizeof (struct rdns_request_name));
 	req->async_event = NULL;
+	req->inflight_key = NULL;
+	req->leader = NULL;
+	req->followers = NULL;
 
 	if (req->requested_names == NULL) {
 		free (req);
@@ -650,7 +1137,45 @@ rdns_make_request_full (
 
 	va_end (args);
 
-	if (req->state != RDNS_REQUEST_FAKE) {
+	if (req->state != RDNS_REQUEST_FAKE && queries == 1 && resolver->cache) {
+		cached_entries = NULL;
+
+		if (resolver->cache->lookup (req->requested_names[0].name,
+				req->requested_names[0].len, req->requested_names[0].type,
+				&cached_rcode, &cached_entries, resolver->cache->data)) {
+			req->reply = rdns_make_reply (req, cached_rcode);
+			req->reply->entries = cached_entries;
+			req->state = RDNS_REQUEST_CACHED;
+		}
+	}
+
+	if (req->state != RDNS_REQUEST_FAKE && req->state != RDNS_REQUEST_CACHED &&
+			queries == 1 && resolver->coalesce_requests) {
+		/* Join the same request in flight if any */
+		keylen = req->requested_names[0].len + 8;
+		inflight_key = malloc (keylen);
+
+		if (inflight_key != NULL) {
+			keylen = snprintf (inflight_key, keylen, "%d:%s",
+					(int)req->requested_names[0].type,
+					req->requested_names[0].name);
+			HASH_FIND (inflight_hh, resolver->inflight, inflight_key,
+					keylen, leader);
+
+			if (leader != NULL) {
+				rdns_debug ("join request in flight for %s",
+						req->requested_names[0].name);
+				free (inflight_key);
+				inflight_key = NULL;
+				req->leader = leader;
+				req->state = RDNS_REQUEST_WAIT_LEADER;
+				DL_APPEND (leader->followers, req);
+			}
+		}
+	}
+
+	if (req->state != RDNS_REQUEST_FAKE && req->state != RDNS_REQUEST_CACHED &&
+			req->state != RDNS_REQUEST_WAIT_LEADER) {
 		rdns_allocate_packet (req, tlen);
 		rdns_make_dns_header (req, queries);
 
@@ -707,6 +1232,7 @@ rdns_make_request_full (
 
 	if (serv == NULL) {
 		rdns_warn ("cannot find suitable server for request");
+		free (inflight_key);
 		REF_RELEASE (req);
 		return NULL;
 	}
@@ -714,10 +1240,13 @@ rdns_make_request_full (
 	/* Select random IO channel */
 	req->io = serv->io_channels[ottery_rand_uint32 () % serv->io_cnt];
 
-	if (req->state == RDNS_REQUEST_FAKE) {
+	if (req->state == RDNS_REQUEST_FAKE || req->state == RDNS_REQUEST_CACHED) {
 		req->async_event = resolver->async->add_write (resolver->async->data,
 				req->io->sock, req);
 	}
+	else if (req->state == RDNS_REQUEST_WAIT_LEADER) {
+		/* Reply is passed by the leader */
+	}
 	else {
 		req->io->uses++;
 
@@ -726,9 +1255,16 @@ rdns_make_request_full (
 
 		if (r == -1) {
 			rdns_info ("cannot send DNS request");
+			free (inflight_key);
 			REF_RELEASE (req);
 			return NULL;
 		}
+
+		if (inflight_key != NULL) {
+			req->inflight_key = inflight_key;
+			HASH_ADD_KEYPTR (inflight_hh, resolver->inflight, req->inflight_key,
+					keylen, req);
+		}
 	}
 
 	REF_RETAIN (req->io);
@@ -774,6 +1310,7 @@ rdns_resolver_init (struct rdns_resolver *resolver)
 				return false;
 			}
 			else {
+				ioc->tag = RDNS_IO_CHANNEL_TAG;
 				ioc->srv = serv;
 				ioc->resolver = resolver;
 				ioc->async_io = resolver->async->add_read (resolver->async->data,
@@ -873,6 +1410,15 @@ rdns_resolver_set_upstream_lib (struct rdns_resolver *resolver,
 }
 
 
+void
+rdns_resolver_set_cache_lib (struct rdns_resolver *resolver,
+		struct rdns_cache_context *cache_ctx,
+		void *cache_data)
+{
+	resolver->cache = cache_ctx;
+	resolver->cache->data = cache_data;
+}
+
 void
 rdns_resolver_set_max_io_uses (struct rdns_resolver *resolver,
 		uint64_t max_ioc_uses, double check_time)
@@ -915,6 +1461,9 @@ rdns_resolver_free (struct rdns_resolver *resolver)
 				ioc = serv->io_channels[i];
 				REF_RELEASE (ioc);
 			}
+			if (serv->tcp_io != NULL) {
+				REF_RELEASE (serv->tcp_io);
+			}
 			serv->io_cnt = 0;
 			UPSTREAM_DEL (resolver->servers, serv);
 			free (serv->io_channels);
@@ -938,6 +1487,7 @@ rdns_resolver_new (void)
 
 	new->logger = rdns_logger_internal;
 	new->log_data = new;
+	new->edns_payload = UDP_PACKET_SIZE;
 
 	return new;
 }
@@ -960,6 +1510,39 @@ rdns_resolver_set_dnssec (struct rdns_resolver *resolver, bool enabled)
 	}
 }
 
+void
+rdns_resolver_set_coalescing (struct rdns_resolver *resolver, bool enabled)
+{
+	if (resolver) {
+		resolver->coalesce_requests = enabled;
+	}
+}
+
+void
+rdns_resolver_set_tcp (struct rdns_resolver *resolver, bool enabled)
+{
+	if (resolver) {
+		resolver->enable_tcp = enabled;
+	}
+}
+
+void
+rdns_resolver_set_edns_payload (struct rdns_resolver *resolver,
+		unsigned int size)
+{
+	if (resolver) {
+		/* Replies are read to the buffer of UDP_PACKET_SIZE */
+		if (size < MIN_EDNS_PAYLOAD) {
+			size = MIN_EDNS_PAYLOAD;
+		}
+		else if (size > UDP_PACKET_SIZE) {
+			size = UDP_PACKET_SIZE;
+		}
+
+		resolver->edns_payload = size;
+	}
+}
+
 
 void rdns_resolver_set_fake_reply (struct rdns_resolver *resolver,
 								   const char *name,
@@ -422,12 +422,36 @@ rdns_reply_free (struct rdns_reply *rep)
 	free (rep);
 }
 
+void
+rdns_request_remove_inflight (struct rdns_request *req)
+{
+	if (req->inflight_key != NULL) {
+		HASH_DELETE (inflight_hh, req->resolver->inflight, req);
+		free (req->inflight_key);
+		req->inflight_key = NULL;
+	}
+}
+
 void
 rdns_request_free (struct rdns_request *req)
 {
 	unsigned int i;
+	struct rdns_request *follower;
 
 	if (req != NULL) {
+		rdns_request_remove_inflight (req);
+
+		if (req->leader != NULL) {
+			DL_DELETE (req->leader->followers, req);
+			req->leader = NULL;
+		}
+
+		/* Followers of a destroyed request are never replied */
+		while ((follower = req->followers) != NULL) {
+			DL_DELETE (req->followers, follower);
+			follower->leader = NULL;
+		}
+
 		if (req->packet != NULL) {
 			free (req->packet);
 		}
@@ -456,7 +480,8 @@ rdns_request_free (struct rdns_request *req)
 				HASH_DEL (req->io->requests, req);
 				req->async_event = NULL;
 			}
-			else if (req->state == RDNS_REQUEST_FAKE) {
+			else if (req->state == RDNS_REQUEST_FAKE ||
+					req->state == RDNS_REQUEST_CACHED) {
 				req->async->del_write (req->async->data,
 						req->async_event);
 				req->async_event = NULL;
@@ -481,13 +506,35 @@ void
 rdns_ioc_free (struct rdns_io_channel *ioc)
 {
 	struct rdns_request *req, *rtmp;
+	struct rdns_tcp_output_chain *oc, *otmp;
 
 	HASH_ITER (hh, ioc->requests, req, rtmp) {
 		REF_RELEASE (req);
 	}
-	ioc->resolver->async->del_read (ioc->resolver->async->data,
-			ioc->async_io);
-	close (ioc->sock);
+
+	if (ioc->tcp != NULL) {
+		DL_FOREACH_SAFE (ioc->tcp->output_chain, oc, otmp) {
+			free (oc);
+		}
+
+		if (ioc->tcp->async_write != NULL) {
+			ioc->resolver->async->del_write (ioc->resolver->async->data,
+					ioc->tcp->async_write);
+		}
+
+		free (ioc->tcp->read_buf);
+		free (ioc->tcp);
+	}
+
+	if (ioc->async_io != NULL) {
+		ioc->resolver->async->del_read (ioc->resolver->async->data,
+				ioc->async_io);
+	}
+
+	if (ioc->sock != -1) {
+		close (ioc->sock);
+	}
+
 	free (ioc);
 }
 
@@ -523,11 +570,26 @@ rdns_request_unschedule (struct rdns_request *req)
 			req->async_event = NULL;
 		}
 	}
+	else if (req->state == RDNS_REQUEST_WAIT_LEADER && req->leader != NULL) {
+		DL_DELETE (req->leader->followers, req);
+		req->leader = NULL;
+	}
 }
 
 void
 rdns_request_release (struct rdns_request *req)
 {
+	if (req->followers != NULL && (req->state == RDNS_REQUEST_WAIT_REPLY ||
+			req->state == RDNS_REQUEST_WAIT_SEND)) {
+		/*
+		 * Other requests wait for this reply, so the request stays in flight
+		 * and it is released when reply is delivered to them
+		 */
+		req->func = NULL;
+
+		return;
+	}
+
 	rdns_request_unschedule (req);
 	REF_RELEASE (req);
 }
@@ -61,4 +61,10 @@ void rdns_reply_free (struct rdns_reply *rep);
 
 void rdns_request_unschedule (struct rdns_request *req);
 
+/**
+ * Remove request from the hash of requests that could be joined
+ * @param req
+ */
+void rdns_request_remove_inflight (struct rdns_request *req);
+
 #endif /* UTIL_H_ */
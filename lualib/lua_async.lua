@@ -0,0 +1,120 @@
+--[[
+Copyright (c) 2019, Vsevolod Stakhov <vsevolod@highsecure.ru>
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+]]--
+
+--[[[
+-- @module lua_async
+-- This module provides coroutines based versions of asynchronous requests
+-- with the same calling convention: each function must be called from a
+-- coroutine (e.g. symbol callback), blocks the current coroutine only and
+-- returns `err, result` where `err` is `nil` on success.
+-- Several requests could be executed in parallel by `lua_async.all`.
+-- @example
+local lua_async = require "lua_async"
+
+local function cb(task)
+  local results = lua_async.all(task, {
+    function(t) return lua_async.dns(t, {type = 'a', name = 'example.com'}) end,
+    function(t) return lua_async.http(t, {url = 'http://example.com'}) end,
+  })
+  local dns_err, dns_reply = results[1][1], results[1][2]
+end
+--]]
+
+local rspamd_async = require "rspamd_async"
+local lua_util = require "lua_util"
+
+local exports = {}
+
+local function prepare_params(task, params)
+  local opts = lua_util.shallowcopy(params)
+  opts.task = task
+  opts.callback = nil
+
+  return opts
+end
+
+--[[[
+-- @function lua_async.http(task, params)
+-- Performs HTTP request, params are the same as for `rspamd_http.request`
+-- @return {string,table} error and reply table
+--]]
+exports.http = function(task, params)
+  local rspamd_http = require "rspamd_http"
+
+  return rspamd_http.request(prepare_params(task, params))
+end
+
+--[[[
+-- @function lua_async.dns(task, params)
+-- Performs DNS request, params are the same as for `rspamd_dns.request`
+-- @return {string,table} error and list of replies
+--]]
+exports.dns = function(task, params)
+  local rspamd_dns = require "rspamd_dns"
+  local is_ok, res = rspamd_dns.request(prepare_params(task, params))
+
+  if is_ok then
+    return nil, res
+  end
+
+  return res or 'cannot make DNS request', nil
+end
+
+--[[[
+-- @function lua_async.redis(task, redis_params, req[, attrs])
+-- Performs redis request as `lua_redis.request` does
+-- @param {table} redis_params redis servers parameters
+-- @param {table|string} req command and its arguments
+-- @param {table} attrs optional attributes of request (e.g. `key` or `is_write`)
+-- @return {string,any} error and redis reply
+--]]
+exports.redis = function(task, redis_params, req, attrs)
+  local lua_redis = require "lua_redis"
+  local is_ok, res = lua_redis.request(redis_params,
+      prepare_params(task, attrs or {}), req)
+
+  if is_ok then
+    return nil, res
+  end
+
+  return res or 'cannot make redis request', nil
+end
+
+--[[[
+-- @function lua_async.tcp(task, params)
+-- Connects to a TCP server, params are the same as for `rspamd_tcp.connect_sync`
+-- @return {string,tcp_sync} error and connection object from `lua_tcp_sync`
+--]]
+exports.tcp = function(task, params)
+  local lua_tcp_sync = require "lua_tcp_sync"
+  local is_ok, res = lua_tcp_sync.connect(prepare_params(task, params))
+
+  if is_ok then
+    return nil, res
+  end
+
+  return res or 'cannot connect', nil
+end
+
+--[[[
+-- @function lua_async.all(task, functions)
+-- Executes functions in parallel, each of them in its own coroutine from the
+-- shared pool, and waits for all of them. Each function is called with task.
+-- @return {table,table} values returned by each function packed in tables and errors
+--]]
+exports.all = rspamd_async.all
+
+return exports
@@ -300,7 +300,7 @@ end
 --   * password: HTTP password
 -- @param {params} HTTP request params
 -- @param {string} query select query (passed in `query` request element with spaces escaped)
--- @param {table|mixed} rows mix of strings, numbers or tables (for arrays)
+-- @param {table|mixed} rows mix of strings, numbers or tables (for arrays) or `rspamd_rows` batch, which is flushed
 -- @param {function} ok_cb callback to be called in case of success
 -- @param {function} fail_cb callback to be called in case of some error
 -- @return {boolean} whether a connection was successful
@@ -322,9 +322,14 @@ exports.insert = function (upstream, settings, params, query, rows,
   http_params.user = settings.user
   http_params.password = settings.password
   http_params.method = 'POST'
-  http_params.body = {table.concat(fun.totable(fun.map(function(row)
-    return row_to_tsv(row)
-  end, rows)), '\n'), '\n'}
+  if type(rows) == 'userdata' then
+    -- Already serialised by rspamd_rows
+    http_params.body = rows:flush()
+  else
+    http_params.body = {table.concat(fun.totable(fun.map(function(row)
+      return row_to_tsv(row)
+    end, rows)), '\n'), '\n'}
+  end
   http_params.log_obj = params.task or params.config
 
   if not http_params.url then
@@ -0,0 +1,195 @@
+--[[
+Copyright (c) 2019, Vsevolod Stakhov <vsevolod@highsecure.ru>
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+]]--
+
+--[[[
+-- @module lua_ffi_accessors
+-- This module provides the most frequently used accessors of task, mime parts
+-- and urls. When running under LuaJIT they are called via FFI with no userdata
+-- checks, otherwise the usual methods are used. Functions accept an object as
+-- the first argument and behave like the corresponding methods, e.g.
+-- `acc.get_header(task, 'Subject')` is the same as `task:get_header('Subject')`.
+--]]
+
+local exports = {}
+
+-- Must be kept in sync with src/lua/lua_ffi.h
+local cdecls = [[
+  int rspamd_ffi_task_header_count (void *ptask, const char *name,
+      int is_strong);
+  const char *rspamd_ffi_task_header (void *ptask, const char *name,
+      int is_strong, int is_raw, size_t *len);
+  int rspamd_ffi_task_insert_result (void *ptask, const char *symbol,
+      double weight, const char *opt);
+  int rspamd_ffi_task_has_symbol (void *ptask, const char *symbol);
+  size_t rspamd_ffi_task_len (void *ptask);
+  size_t rspamd_ffi_mimepart_length (void *ppart);
+  unsigned int rspamd_ffi_mimepart_flags (void *ppart);
+  size_t rspamd_ffi_textpart_length (void *ppart);
+  unsigned int rspamd_ffi_textpart_flags (void *ppart);
+  const char *rspamd_ffi_url_host (void *purl, size_t *len);
+  const char *rspamd_ffi_url_tld (void *purl, size_t *len);
+  unsigned int rspamd_ffi_url_flags (void *purl);
+]]
+
+-- Flags values from src/libmime/message.h and src/libserver/url.h
+local TEXT_PART_FLAG_EMPTY = 4
+local TEXT_PART_FLAG_HTML = 8
+local URL_FLAG_PHISHED = 1
+local URL_FLAG_OBSCURED = 4
+local URL_FLAG_REDIRECTED = 8
+
+local ffi, bit
+
+if type(jit) == 'table' then
+  ffi = require "ffi"
+  bit = require "bit"
+
+  -- Declarations could be already loaded by another module
+  pcall(ffi.cdef, cdecls)
+end
+
+exports.is_ffi = ffi ~= nil
+
+if ffi then
+  local C = ffi.C
+  local lenbuf = ffi.new('size_t[1]')
+
+  local function get_header_common(task, name, strong, raw)
+    local s = C.rspamd_ffi_task_header(task, name, strong and 1 or 0,
+        raw and 1 or 0, lenbuf)
+
+    if s ~= nil then
+      return ffi.string(s, lenbuf[0])
+    end
+
+    return nil
+  end
+
+  exports.get_header = function(task, name, strong)
+    return get_header_common(task, name, strong, false)
+  end
+  exports.get_header_raw = function(task, name, strong)
+    return get_header_common(task, name, strong, true)
+  end
+  exports.get_header_count = function(task, name, strong)
+    return tonumber(C.rspamd_ffi_task_header_count(task, name,
+        strong and 1 or 0))
+  end
+  exports.insert_result = function(task, symbol, weight, opt)
+    return C.rspamd_ffi_task_insert_result(task, symbol, weight, opt) ~= 0
+  end
+  exports.has_symbol = function(task, symbol)
+    return C.rspamd_ffi_task_has_symbol(task, symbol) ~= 0
+  end
+  exports.get_size = function(task)
+    return tonumber(C.rspamd_ffi_task_len(task))
+  end
+
+  exports.part_get_length = function(part)
+    return tonumber(C.rspamd_ffi_mimepart_length(part))
+  end
+  exports.textpart_get_length = function(part)
+    return tonumber(C.rspamd_ffi_textpart_length(part))
+  end
+  exports.textpart_is_html = function(part)
+    return bit.band(C.rspamd_ffi_textpart_flags(part), TEXT_PART_FLAG_HTML) ~= 0
+  end
+  exports.textpart_is_empty = function(part)
+    return bit.band(C.rspamd_ffi_textpart_flags(part), TEXT_PART_FLAG_EMPTY) ~= 0
+  end
+
+  exports.url_get_host = function(url)
+    local s = C.rspamd_ffi_url_host(url, lenbuf)
+
+    if s ~= nil then
+      return ffi.string(s, lenbuf[0])
+    end
+
+    return nil
+  end
+  exports.url_get_tld = function(url)
+    local s = C.rspamd_ffi_url_tld(url, lenbuf)
+
+    if s ~= nil then
+      return ffi.string(s, lenbuf[0])
+    end
+
+    return nil
+  end
+  exports.url_is_phished = function(url)
+    return bit.band(C.rspamd_ffi_url_flags(url), URL_FLAG_PHISHED) ~= 0
+  end
+  exports.url_is_obscured = function(url)
+    return bit.band(C.rspamd_ffi_url_flags(url), URL_FLAG_OBSCURED) ~= 0
+  end
+  exports.url_is_redirected = function(url)
+    return bit.band(C.rspamd_ffi_url_flags(url), URL_FLAG_REDIRECTED) ~= 0
+  end
+else
+  exports.get_header = function(task, name, strong)
+    return task:get_header(name, strong)
+  end
+  exports.get_header_raw = function(task, name, strong)
+    return task:get_header_raw(name, strong)
+  end
+  exports.get_header_count = function(task, name, strong)
+    return task:get_header_count(name, strong)
+  end
+  exports.insert_result = function(task, symbol, weight, opt)
+    if opt then
+      return task:insert_result(symbol, weight, opt)
+    end
+
+    return task:insert_result(symbol, weight)
+  end
+  exports.has_symbol = function(task, symbol)
+    return task:has_symbol(symbol)
+  end
+  exports.get_size = function(task)
+    return task:get_size()
+  end
+
+  exports.part_get_length = function(part)
+    return part:get_length()
+  end
+  exports.textpart_get_length = function(part)
+    return part:get_length()
+  end
+  exports.textpart_is_html = function(part)
+    return part:is_html()
+  end
+  exports.textpart_is_empty = function(part)
+    return part:is_empty()
+  end
+
+  exports.url_get_host = function(url)
+    return url:get_host()
+  end
+  exports.url_get_tld = function(url)
+    return url:get_tld()
+  end
+  exports.url_is_phished = function(url)
+    return url:is_phished()
+  end
+  exports.url_is_obscured = function(url)
+    return url:is_obscured()
+  end
+  exports.url_is_redirected = function(url)
+    return url:is_redirected()
+  end
+end
+
+return exports
@@ -561,11 +561,12 @@ end
 local function rspamd_redis_make_request(task, redis_params, key, is_write,
     callback, command, args, extra_opts)
   local addr
+  local start_ts = rspamd_util.get_ticks()
   local function rspamd_redis_make_request_cb(err, data)
     if err then
       addr:fail()
     else
-      addr:ok()
+      addr:ok(rspamd_util.get_ticks() - start_ts)
     end
     callback(err, data, addr)
   end
@@ -661,11 +662,12 @@ local function redis_make_request_taskless(ev_base, cfg, redis_params, key,
   end
 
   local addr
+  local start_ts = rspamd_util.get_ticks()
   local function rspamd_redis_make_request_cb(err, data)
     if err then
       addr:fail()
     else
-      addr:ok()
+      addr:ok(rspamd_util.get_ticks() - start_ts)
     end
     callback(err, data, addr)
   end
@@ -31,8 +31,12 @@ local logger = require 'rspamd_logger'
 local fun = require 'fun'
 local lua_util = require "lua_util"
 local ts = require("tableshape").types
+local rspamd_selectors = require "rspamd_selectors"
 local M = "selectors"
 local E = {}
+-- Extractors and transforms redefined by `register_extractor` and
+-- `register_transform`, their C versions must not be used
+local redefined = {}
 
 local extractors = {
   ['id'] = {
@@ -81,6 +85,7 @@ uses any type by default)]],
   },
   -- Get country (ASN module must be executed first)
   ['country'] = {
+    ['volatile'] = true,
     ['get_value'] = function(task)
       local country = task:get_mempool():get_variable('country')
       if not country then
@@ -94,6 +99,7 @@ uses any type by default)]],
   -- Get ASN number
   ['asn'] = {
     ['type'] = 'string',
+    ['volatile'] = true,
     ['get_value'] = function(task)
       local asn = task:get_mempool():get_variable('asn')
       if not asn then
@@ -247,6 +253,7 @@ e.g. `get_user`]],
   -- Get specific pool var. The first argument must be variable name,
   -- the second argument is optional and defines the type (string by default)
   ['pool_var'] = {
+    ['volatile'] = true,
     ['get_value'] = function(task, args)
       local type = args[2] or 'string'
       return task:get_mempool():get_variable(args[1], type),(type)
@@ -498,7 +505,58 @@ Returns either nil or its input if input is not in args list]],
   },
 }
 
-local function process_selector(task, sel)
+-- Selectors that are equal share the same id and so the same per-task cached
+-- value, see `memoize_key`
+local selectors_ids = {}
+-- Keys are pinned here as the task cache does not copy them
+local selectors_keys = {}
+
+local function memoize_key(sel)
+  if sel.selector.volatile then return nil end
+
+  local function args_str(args)
+    return table.concat(fun.totable(fun.map(tostring, args or E)), ',')
+  end
+
+  local canon = {string.format('%s(%s)', sel.selector.name,
+      args_str(sel.selector.args))}
+
+  for _,proc in ipairs(sel.processor_pipe) do
+    if proc.volatile then return nil end
+    table.insert(canon, string.format('%s%s(%s)',
+        proc.method and ':' or '.', proc.name, args_str(proc.args)))
+  end
+
+  local canon_str = table.concat(canon)
+  local id = selectors_ids[canon_str]
+
+  if not id then
+    id = #selectors_keys + 1
+    selectors_ids[canon_str] = id
+    selectors_keys[id] = 'selector:' .. tostring(id)
+  end
+
+  return selectors_keys[id]
+end
+
+-- Selectors that use built-in extractors and transforms only are executed by
+-- C code (see `rspamd_selectors`), nil is returned for all other selectors
+local function compile_selector(sel)
+  if redefined[sel.selector.name] then return nil end
+
+  for _,proc in ipairs(sel.processor_pipe) do
+    if not proc.method and redefined[proc.name] then return nil end
+  end
+
+  return rspamd_selectors.compile(sel.selector.name, sel.selector.args,
+      sel.processor_pipe)
+end
+
+local function process_selector_uncached(task, sel)
+  if sel.compiled then
+    return sel.compiled:process(task)
+  end
+
   local function allowed_type(t)
     if t == 'string' or t == 'text' or t == 'string_list' or t == 'text_list' then
       return true
@@ -652,6 +710,30 @@ local function process_selector(task, sel)
   return res[1]
 end
 
+-- Values are cached in the task, so all consumers get the same object
+local function process_selector(task, sel)
+  if not sel.cache_key then
+    return process_selector_uncached(task, sel)
+  end
+
+  local cached = task:cache_get(sel.cache_key)
+
+  if cached ~= nil then
+    lua_util.debugm(M, task, 'use cached value for %s', sel.cache_key)
+    if cached == false then return nil end
+    return cached
+  end
+
+  local res = process_selector_uncached(task, sel)
+  if res == nil then
+    task:cache_set(sel.cache_key, false)
+  else
+    task:cache_set(sel.cache_key, res)
+  end
+
+  return res
+end
+
 local function make_grammar()
   local l = require "lpeg"
   local spc = l.S(" \t\n")^0
@@ -807,6 +889,10 @@ exports.parse_selector = function(cfg, str)
       return nil
     end
 
+    res.cache_key = memoize_key(res)
+    res.compiled = compile_selector(res)
+    lua_util.debugm(M, cfg, 'selector %s is executed by %s',
+        res.selector.name, res.compiled and 'C' or 'Lua')
     table.insert(output, res)
   end
 
@@ -822,6 +908,7 @@ exports.register_extractor = function(cfg, name, selector)
       logger.warnx(cfg, 'redefining selector %s', name)
     end
     extractors[name] = selector
+    redefined[name] = true
 
     return true
   end
@@ -839,6 +926,7 @@ exports.register_transform = function(cfg, name, transform)
       logger.warnx(cfg, 'redefining transform function %s', name)
     end
     transform_function[name] = transform
+    redefined[name] = true
 
     return true
   end
@@ -133,6 +133,36 @@ end
 
 exports.convert_bayes_schema = convert_bayes_schema
 
+-- Removes old statistics for the symbols specified from redis
+local function reset_redis_stat(conn, symbol_spam, symbol_ham, learn_cache_db)
+  -- Do a more complicated cleanup
+  -- execute a lua script that cleans up data
+  local script = [[
+local members = redis.call('SMEMBERS', KEYS[1]..'_keys')
+
+for _,prefix in ipairs(members) do
+  local keys = redis.call('KEYS', prefix..'*')
+  redis.call('DEL', keys)
+end
+]]
+  -- Common keys
+  for _,sym in ipairs({symbol_spam, symbol_ham}) do
+    logger.messagex('Cleaning up old data for %s', sym)
+    conn:add_cmd('EVAL', {script, '1', sym})
+    conn:exec()
+    conn:add_cmd('DEL', {sym .. "_version"})
+    conn:add_cmd('DEL', {sym .. "_keys"})
+    conn:exec()
+  end
+
+  if learn_cache_db then
+    -- Cleanup learned_cache
+    logger.messagex('Cleaning up old data learned cache')
+    conn:add_cmd('DEL', {"learned_ids"})
+    conn:exec()
+  end
+end
+
 -- It now accepts both ham and spam databases
 -- parameters:
 -- redis_params - how do we connect to a redis server
@@ -143,13 +173,26 @@ exports.convert_bayes_schema = convert_bayes_schema
 -- learn_cache_spam - name for sqlite database with spam learn cache
 -- learn_cache_ham - name for sqlite database with ham learn cache
 -- reset_previous - if true, then the old database is flushed (slow)
+-- opts - optional table:
+--   batch - number of tokens sent in a single pipeline (1000 by default)
+--   jobs, worker - tokens are split between `jobs` processes and only
+--     those with rowid % jobs == worker are converted, metadata is converted
+--     by the worker 0 only
 local function convert_sqlite_to_redis(redis_params,
           sqlite_db_spam, sqlite_db_ham, symbol_spam, symbol_ham,
-          learn_cache_db, expire, reset_previous)
+          learn_cache_db, expire, reset_previous, opts)
+  opts = opts or {}
   local nusers = 0
-  local lim = 1000 -- Update each 1000 tokens
+  local lim = tonumber(opts.batch) or 1000 -- Update each 1000 tokens
+  local jobs = tonumber(opts.jobs) or 1
+  local worker = tonumber(opts.worker) or 0
   local users_map = {}
   local converted = 0
+  local what_prefix = ''
+
+  if jobs > 1 then
+    what_prefix = string.format('worker %s: ', worker)
+  end
 
   local db_spam = sqlite3.open(sqlite_db_spam)
   if not db_spam then
@@ -170,32 +213,7 @@ local function convert_sqlite_to_redis(redis_params,
   end
 
   if reset_previous then
-    -- Do a more complicated cleanup
-    -- execute a lua script that cleans up data
-    local script = [[
-local members = redis.call('SMEMBERS', KEYS[1]..'_keys')
-
-for _,prefix in ipairs(members) do
-  local keys = redis.call('KEYS', prefix..'*')
-  redis.call('DEL', keys)
-end
-]]
-    -- Common keys
-    for _,sym in ipairs({symbol_spam, symbol_ham}) do
-      logger.messagex('Cleaning up old data for %s', sym)
-      conn:add_cmd('EVAL', {script, '1', sym})
-      conn:exec()
-      conn:add_cmd('DEL', {sym .. "_version"})
-      conn:add_cmd('DEL', {sym .. "_keys"})
-      conn:exec()
-    end
-
-    if learn_cache_db then
-      -- Cleanup learned_cache
-      logger.messagex('Cleaning up old data learned cache')
-      conn:add_cmd('DEL', {"learned_ids"})
-      conn:exec()
-    end
+    reset_redis_stat(conn, symbol_spam, symbol_ham, learn_cache_db)
   end
 
   local function convert_db(db, is_spam)
@@ -255,8 +273,16 @@ end
     local tokens = {}
     local num = 0
     local total = 0
+    local tokens_query = 'SELECT token,value,user FROM tokens;'
 
-    for row in db:rows('SELECT token,value,user FROM tokens;') do
+    if jobs > 1 then
+      tokens_query = string.format(
+          'SELECT token,value,user FROM tokens WHERE rowid %% %d = %d;',
+          jobs, worker)
+      ntokens = math.floor(ntokens / jobs)
+    end
+
+    for row in db:rows(tokens_query) do
       local user = ''
       if row.user ~= 0 and users_map[row.user] then
         user = users_map[row.user]
@@ -277,9 +303,17 @@ end
 
         num = 0
         tokens = {}
+
+        if jobs > 1 then
+          -- Carriage return is useless when several processes write
+          logger.messagex('%sprocessed batch %s: %s/%s', what_prefix, what,
+              total, ntokens)
+        end
       end
 
-      io.write(string.format('Processed batch %s: %s/%s\r', what, total, ntokens))
+      if jobs == 1 then
+        io.write(string.format('Processed batch %s: %s/%s\r', what, total, ntokens))
+      end
     end
     -- Last batch
     if #tokens > 0 then
@@ -290,14 +324,24 @@ end
         return false
       end
 
-      io.write(string.format('Processed batch %s: %s/%s\r', what, total, ntokens))
+      if jobs == 1 then
+        io.write(string.format('Processed batch %s: %s/%s\r', what, total, ntokens))
+      end
+    end
+
+    if jobs == 1 then
+      io.write('\n')
     end
-    io.write('\n')
 
     converted = converted + total
 
     -- Close DB
     db:sql('COMMIT;')
+
+    if worker ~= 0 then
+      return true
+    end
+
     local symbol = symbol_ham
     local learns_elt = "learns_ham"
 
@@ -332,7 +376,7 @@ end
     return false
   end
 
-  if learn_cache_db then
+  if learn_cache_db and worker == 0 then
     logger.messagex('Convert learned ids from %s', learn_cache_db)
     local db = sqlite3.open(learn_cache_db)
     local ret = true
@@ -376,13 +420,127 @@ end
     end
   end
 
-  logger.messagex('Migrated %s tokens for %s users for symbols (%s, %s)',
-      converted, nusers, symbol_spam, symbol_ham)
+  logger.messagex('%sMigrated %s tokens for %s users for symbols (%s, %s)',
+      what_prefix, converted, nusers, symbol_spam, symbol_ham)
   return true
 end
 
 exports.convert_sqlite_to_redis = convert_sqlite_to_redis
 
+-- Removes statistics converted by the previous runs, it is done separately
+-- when conversion is split between several processes
+local function reset_redis(redis_params, symbol_spam, symbol_ham, learn_cache_db)
+  local res,conn = lua_redis.redis_connect_sync(redis_params, true)
+
+  if not res then
+    logger.errx("cannot connect to redis server")
+    return false
+  end
+
+  reset_redis_stat(conn, symbol_spam, symbol_ham, learn_cache_db)
+
+  return true
+end
+
+exports.reset_redis = reset_redis
+
+-- Removes garbage tokens from redis, tokens are scanned by SCAN in batches,
+-- so the server is not blocked
+-- parameters:
+-- redis_params - how do we connect to a redis server
+-- prefix - prefix of token keys ('RS' by default)
+-- min_count - tokens with sum of ham and spam counts less than this are removed
+-- batch - number of keys requested per SCAN iteration
+local function compact_redis_stat(redis_params, prefix, min_count, batch)
+  prefix = prefix or 'RS'
+  batch = batch or 1000
+  local res,conn = lua_redis.redis_connect_sync(redis_params, true)
+
+  if not res then
+    logger.errx("cannot connect to redis server")
+    return false
+  end
+
+  local function used_memory()
+    conn:add_cmd('INFO', {'memory'})
+    local ret,info = conn:exec()
+
+    if ret and type(info) == 'string' then
+      return tonumber(string.match(info, 'used_memory:(%d+)'))
+    end
+  end
+
+  local mem_before = used_memory()
+  local cursor = '0'
+  local ntokens, ndropped = 0, 0
+
+  repeat
+    conn:add_cmd('SCAN', {cursor, 'MATCH', prefix .. '*_*', 'COUNT',
+                          tostring(batch)})
+    local ret,reply = conn:exec()
+
+    if not ret then
+      logger.errx('cannot scan keys: %s', reply)
+      return false
+    end
+
+    cursor = reply[1]
+    local keys = reply[2]
+
+    if #keys > 0 then
+      for _,k in ipairs(keys) do
+        conn:add_cmd('HMGET', {k, 'H', 'S'})
+      end
+
+      local results = {conn:exec()}
+      local to_drop = {}
+
+      for i,k in ipairs(keys) do
+        local vals = results[i * 2]
+
+        -- Keys that are not tokens have neither field (or are not hashes)
+        if results[i * 2 - 1] and type(vals) == 'table' then
+          local ham,spam = tonumber(vals[1]),tonumber(vals[2])
+
+          if ham or spam then
+            ntokens = ntokens + 1
+
+            if (ham or 0) + (spam or 0) < min_count then
+              table.insert(to_drop, k)
+            end
+          end
+        end
+      end
+
+      if #to_drop > 0 then
+        conn:add_cmd('DEL', to_drop)
+        ret,reply = conn:exec()
+
+        if not ret then
+          logger.errx('cannot delete keys: %s', reply)
+          return false
+        end
+
+        ndropped = ndropped + #to_drop
+      end
+    end
+  until cursor == '0'
+
+  local mem_after = used_memory()
+
+  logger.messagex('Scanned %s tokens, dropped %s tokens with less than %s learns',
+      ntokens, ndropped, min_count)
+
+  if mem_before and mem_after then
+    logger.messagex('Redis memory usage: %s -> %s bytes (%s bytes saved)',
+        mem_before, mem_after, mem_before - mem_after)
+  end
+
+  return true
+end
+
+exports.compact_redis_stat = compact_redis_stat
+
 -- Loads sqlite3 based classifiers and output data in form of array of objects:
 -- [
 --  {
@@ -15,24 +15,58 @@ return function (_, res)
     return false
   end
 
+  local function fail()
+    -- Parallel workers report failure by their exit code
+    if res.jobs and res.jobs > 1 then
+      os.exit(1)
+    end
+
+    return false
+  end
+
+  if res.compact then
+    if not stat_tools.compact_redis_stat(redis_params, res.prefix,
+        res.min_count or 1, res.batch) then
+      logger.errx('compaction failed')
+
+      return fail()
+    end
+
+    return true
+  end
+
   local sqlite_params = stat_tools.load_sqlite_config(res)
 
   if #sqlite_params == 0 then
     logger.errx('cannot load sqlite classifiers')
-    return false
+    return fail()
   end
 
   for _,cls in ipairs(sqlite_params) do
-    if not stat_tools.convert_sqlite_to_redis(redis_params, cls.db_spam,
-        cls.db_ham, cls.symbol_spam, cls.symbol_ham, cls.learn_cache, res.expire,
-        res.reset_previous) then
-      logger.errx('conversion failed')
+    if res.reset_only then
+      if not stat_tools.reset_redis(redis_params, cls.symbol_spam,
+          cls.symbol_ham, cls.learn_cache) then
+        return fail()
+      end
+    else
+      if not stat_tools.convert_sqlite_to_redis(redis_params, cls.db_spam,
+          cls.db_ham, cls.symbol_spam, cls.symbol_ham, cls.learn_cache, res.expire,
+          res.reset_previous, {
+            batch = res.batch,
+            jobs = res.jobs,
+            worker = res.worker,
+          }) then
+        logger.errx('conversion failed')
+
+        return fail()
+      end
 
-      return false
+      if not res.worker or res.worker == 0 then
+        logger.messagex('Converted classifier to the from sqlite to redis')
+        logger.messagex('Suggested configuration:')
+        logger.messagex(ucl.to_format(stat_tools.redis_classifier_from_sqlite(cls, res.expire),
+          'config'))
+      end
     end
-    logger.messagex('Converted classifier to the from sqlite to redis')
-    logger.messagex('Suggested configuration:')
-    logger.messagex(ucl.to_format(stat_tools.redis_classifier_from_sqlite(cls, res.expire),
-      'config'))
   end
 end
@@ -0,0 +1,103 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Bayes expiry worker: performs native expiry of redis statistics in a
+ * dedicated process, so controllers are not loaded by long expiry cycles
+ */
+#include "config.h"
+
+#include "libutil/util.h"
+#include "libserver/cfg_file.h"
+#include "libserver/cfg_rcl.h"
+#include "libserver/worker_util.h"
+#include "libserver/dns.h"
+#include "libstat/stat_api.h"
+#include "unix-std.h"
+
+static gpointer init_bayes_expiry (struct rspamd_config *cfg);
+static void start_bayes_expiry (struct rspamd_worker *worker);
+
+worker_t bayes_expiry_worker = {
+		"bayes_expiry",              /* Name */
+		init_bayes_expiry,           /* Init function */
+		start_bayes_expiry,          /* Start function */
+		RSPAMD_WORKER_UNIQUE | RSPAMD_WORKER_KILLABLE,
+		RSPAMD_WORKER_SOCKET_NONE,   /* No socket */
+		RSPAMD_WORKER_VER            /* Version info */
+};
+
+static const guint64 rspamd_bayes_expiry_magic = 0x5f1c7a3e9b20d46bULL;
+
+/*
+ * Worker's context
+ */
+struct bayes_expiry_ctx {
+	guint64 magic;
+	/* Events base */
+	struct event_base *ev_base;
+	/* DNS resolver */
+	struct rspamd_dns_resolver *resolver;
+	/* Config */
+	struct rspamd_config *cfg;
+	/* END OF COMMON PART */
+};
+
+static gpointer
+init_bayes_expiry (struct rspamd_config *cfg)
+{
+	struct bayes_expiry_ctx *ctx;
+
+	ctx = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*ctx));
+	ctx->magic = rspamd_bayes_expiry_magic;
+	ctx->cfg = cfg;
+
+	return ctx;
+}
+
+static void
+start_bayes_expiry (struct rspamd_worker *worker)
+{
+	struct bayes_expiry_ctx *ctx = worker->ctx;
+	guint nstarted;
+
+	ctx->ev_base = rspamd_prepare_worker (worker,
+			"bayes_expiry",
+			NULL);
+	ctx->cfg = worker->srv->cfg;
+	ctx->resolver = dns_resolver_init (worker->srv->logger,
+			ctx->ev_base,
+			worker->srv->cfg);
+	rspamd_upstreams_library_config (worker->srv->cfg, ctx->cfg->ups_ctx,
+			ctx->ev_base, ctx->resolver->r);
+
+	rspamd_stat_init (worker->srv->cfg, ctx->ev_base);
+	nstarted = rspamd_stat_start_expiry (ctx->cfg, ctx->ev_base);
+
+	if (nstarted == 0) {
+		msg_warn ("no statfiles suitable for native expiry: redis backend "
+				"with new schema and expire set is required");
+	}
+	else {
+		msg_info ("started bayes_expiry worker for %ud statfiles", nstarted);
+	}
+
+	event_base_loop (ctx->ev_base, 0);
+	rspamd_worker_block_signals ();
+
+	rspamd_stat_close ();
+	REF_RELEASE (ctx->cfg);
+	rspamd_log_close (worker->srv->logger, TRUE);
+
+	exit (EXIT_SUCCESS);
+}
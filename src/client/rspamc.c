@@ -61,10 +61,15 @@ static gboolean mime_output = FALSE;
 static gboolean empty_input = FALSE;
 static gboolean compressed = FALSE;
 static gboolean profile = FALSE;
+static gboolean per_rcpt = FALSE;
 static gboolean skip_images = FALSE;
 static gboolean skip_attachments = FALSE;
+static gboolean msgpack = FALSE;
 static gchar *key = NULL;
 static gchar *user_agent = "rspamc";
+static gdouble bench_rate = 0.0;
+static gdouble bench_duration = 10.0;
+static gint bench_count = 0;
 static GList *children;
 static GPatternSpec **exclude_compiled = NULL;
 
@@ -150,6 +155,8 @@ static GOptionEntry entries[] =
 	   "Enable zstd compression", NULL },
 	{ "profile", '\0', 0, G_OPTION_ARG_NONE, &profile,
 	   "Profile symbols execution time", NULL },
+	{ "per-rcpt", '\0', 0, G_OPTION_ARG_NONE, &per_rcpt,
+	   "Return results of per user classifiers for each recipient", NULL },
 	{ "dictionary", 'D', 0, G_OPTION_ARG_FILENAME, &dictionary,
 	   "Use dictionary to compress data", NULL },
 	{ "skip-images", '\0', 0, G_OPTION_ARG_NONE, &skip_images,
@@ -158,6 +165,14 @@ static GOptionEntry entries[] =
 	   "Skip attachments when learning/unlearning fuzzy", NULL },
 	{ "user-agent", 'U', 0, G_OPTION_ARG_STRING, &user_agent,
 	   "Use specific User-Agent instead of \"rspamc\"", NULL },
+	{ "rate", '\0', 0, G_OPTION_ARG_DOUBLE, &bench_rate,
+	  "Send requests at this rate per second in bench mode (default: as fast as -n allows)", NULL },
+	{ "duration", '\0', 0, G_OPTION_ARG_DOUBLE, &bench_duration,
+	  "Duration of bench mode in seconds (default: 10)", NULL },
+	{ "count", '\0', 0, G_OPTION_ARG_INT, &bench_count,
+	  "Send this number of requests in bench mode instead of using duration", NULL },
+	{ "msgpack", '\0', 0, G_OPTION_ARG_NONE, &msgpack,
+	   "Use binary msgpack protocol for checkv2 requests", NULL },
 	{ NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL }
 };
 
@@ -191,7 +206,8 @@ enum rspamc_command_type {
 	RSPAMC_COMMAND_COUNTERS,
 	RSPAMC_COMMAND_UPTIME,
 	RSPAMC_COMMAND_ADD_SYMBOL,
-	RSPAMC_COMMAND_ADD_ACTION
+	RSPAMC_COMMAND_ADD_ACTION,
+	RSPAMC_COMMAND_BENCH
 };
 
 struct rspamc_command {
@@ -326,6 +342,16 @@ struct rspamc_command {
 		.is_privileged = TRUE,
 		.need_input = FALSE,
 		.command_output_func = NULL
+	},
+	{
+		.cmd = RSPAMC_COMMAND_BENCH,
+		.name = "bench",
+		.path = "checkv2",
+		.description = "replay messages and measure throughput and latency",
+		.is_controller = FALSE,
+		.is_privileged = FALSE,
+		.need_input = TRUE,
+		.command_output_func = NULL
 	}
 };
 
@@ -500,6 +526,9 @@ check_rspamc_command (const gchar *cmd)
 	else if (g_ascii_strcasecmp (cmd, "ADD_ACTION") == 0) {
 		ct = RSPAMC_COMMAND_ADD_ACTION;
 	}
+	else if (g_ascii_strcasecmp (cmd, "BENCH") == 0) {
+		ct = RSPAMC_COMMAND_BENCH;
+	}
 
 	for (i = 0; i < G_N_ELEMENTS (rspamc_commands); i++) {
 		if (rspamc_commands[i].cmd == ct) {
@@ -666,6 +695,10 @@ add_options (GQueue *opts)
 		ADD_CLIENT_HEADER (opts, "Profile", "true");
 	}
 
+	if (per_rcpt) {
+		ADD_CLIENT_HEADER (opts, "Per-Rcpt", "true");
+	}
+
 	if (skip_images) {
 		ADD_CLIENT_HEADER (opts, "Skip-Images", "true");
 	}
@@ -887,6 +920,21 @@ rspamc_symbols_output (FILE *out, ucl_object_t *obj)
 
 	PRINT_PROTOCOL_STRING ("dkim-signature", "DKIM-Signature");
 
+	elt = ucl_object_lookup (obj, "recipients");
+	if (elt && elt->type == UCL_OBJECT) {
+		const ucl_object_t *rcpt;
+
+		mit = NULL;
+		while ((rcpt = ucl_object_iterate (elt, &mit, true)) != NULL) {
+			rspamd_fprintf (out, "Recipient %s: %s; %.2f / %.2f\n",
+					ucl_object_key (rcpt),
+					ucl_object_tostring (ucl_object_lookup (rcpt, "action")),
+					ucl_object_todouble (ucl_object_lookup (rcpt, "score")),
+					ucl_object_todouble (ucl_object_lookup (rcpt,
+							"required_score")));
+		}
+	}
+
 	elt = ucl_object_lookup (obj, "profile");
 
 	if (elt) {
@@ -1590,15 +1638,14 @@ rspamc_client_cb (struct rspamd_client_connection *conn,
 	g_free (cbdata);
 }
 
-static void
-rspamc_process_input (struct event_base *ev_base, struct rspamc_command *cmd,
-	FILE *in, const gchar *name, GQueue *attrs)
+/*
+ * Splits connect string to a host name and a port, returned host must be freed
+ */
+static gchar *
+rspamc_parse_connect_str (struct rspamc_command *cmd, guint16 *pport)
 {
-	struct rspamd_client_connection *conn;
 	gchar *hostbuf = NULL, *p;
 	guint16 port;
-	GError *err = NULL;
-	struct rspamc_callback_data *cbdata;
 
 	if (connect_str[0] == '[') {
 		p = strrchr (connect_str, ']');
@@ -1649,6 +1696,22 @@ rspamc_process_input (struct event_base *ev_base, struct rspamc_command *cmd,
 
 	}
 
+	*pport = port;
+
+	return hostbuf;
+}
+
+static void
+rspamc_process_input (struct event_base *ev_base, struct rspamc_command *cmd,
+	FILE *in, const gchar *name, GQueue *attrs)
+{
+	struct rspamd_client_connection *conn;
+	gchar *hostbuf;
+	guint16 port;
+	GError *err = NULL;
+	struct rspamc_callback_data *cbdata;
+
+	hostbuf = rspamc_parse_connect_str (cmd, &port);
 	conn = rspamd_client_init (ev_base, hostbuf, port, timeout, key);
 
 	if (conn != NULL) {
@@ -1661,7 +1724,8 @@ rspamc_process_input (struct event_base *ev_base, struct rspamc_command *cmd,
 
 		if (cmd->need_input) {
 			rspamd_client_command (conn, cmd->path, attrs, in, rspamc_client_cb,
-				cbdata, compressed, dictionary, cbdata->filename, &err);
+				cbdata, compressed, dictionary, cbdata->filename,
+				msgpack && strcmp (cmd->path, "checkv2") == 0, &err);
 		}
 		else {
 			rspamd_client_command (conn,
@@ -1673,6 +1737,7 @@ rspamc_process_input (struct event_base *ev_base, struct rspamc_command *cmd,
 					compressed,
 					dictionary,
 					cbdata->filename,
+					FALSE,
 					&err);
 		}
 	}
@@ -1825,6 +1890,455 @@ rspamc_process_dir (struct event_base *ev_base, struct rspamc_command *cmd,
 	event_base_loop (ev_base, 0);
 }
 
+/*
+ * Bench mode: replays the input files in loop keeping `max_requests` requests
+ * in flight or sending them at a fixed rate and reports throughput, latency
+ * percentiles and errors
+ */
+#define RSPAMC_BENCH_RATE_TICK 0.01
+
+struct rspamc_bench {
+	struct event_base *ev_base;
+	struct rspamc_command *cmd;
+	GQueue *attrs;
+	GPtrArray *files;
+	gchar *host;
+	guint16 port;
+	guint next_file;
+	guint inflight;
+	guint64 sent;
+	guint64 ok;
+	guint64 failed;
+	guint64 dropped;
+	GArray *latencies;
+	GHashTable *errors;
+	gdouble start;
+	gdouble finish;
+	gboolean stopped;
+	struct event rate_ev;
+};
+
+static void rspamc_bench_fill (struct rspamc_bench *bench);
+
+static void
+rspamc_bench_collect (struct rspamc_bench *bench, const gchar *path)
+{
+	DIR *d;
+	GPatternSpec **ex;
+	struct dirent *pentry;
+	gchar fpath[PATH_MAX];
+	struct stat st;
+	gint r;
+
+	if (stat (path, &st) == -1) {
+		rspamd_fprintf (stderr, "cannot stat file %s: %s\n",
+				path, strerror (errno));
+		return;
+	}
+
+	if (S_ISREG (st.st_mode)) {
+		g_ptr_array_add (bench->files, g_strdup (path));
+		return;
+	}
+	else if (!S_ISDIR (st.st_mode)) {
+		return;
+	}
+
+	d = opendir (path);
+
+	if (d == NULL) {
+		rspamd_fprintf (stderr, "cannot open directory %s: %s\n",
+				path, strerror (errno));
+		return;
+	}
+
+	while ((pentry = readdir (d)) != NULL) {
+		if (pentry->d_name[0] == '.') {
+			continue;
+		}
+
+		r = rspamd_snprintf (fpath, sizeof (fpath), "%s%c%s",
+				path, G_DIR_SEPARATOR, pentry->d_name);
+
+		for (ex = exclude_compiled; ex != NULL && *ex != NULL; ex ++) {
+			if (g_pattern_match (*ex, r, fpath, NULL)) {
+				break;
+			}
+		}
+
+		if (ex == NULL || *ex == NULL) {
+			rspamc_bench_collect (bench, fpath);
+		}
+	}
+
+	closedir (d);
+}
+
+static gboolean
+rspamc_bench_done (struct rspamc_bench *bench)
+{
+	if (bench_count > 0) {
+		return bench->sent + bench->dropped >= (guint64)bench_count;
+	}
+
+	return rspamd_get_ticks (FALSE) - bench->start >= bench_duration;
+}
+
+static void
+rspamc_bench_error (struct rspamc_bench *bench, const gchar *message)
+{
+	gpointer cnt;
+
+	bench->failed ++;
+	cnt = g_hash_table_lookup (bench->errors, message);
+
+	if (cnt == NULL) {
+		g_hash_table_insert (bench->errors, g_strdup (message),
+				GUINT_TO_POINTER (1));
+	}
+	else {
+		g_hash_table_replace (bench->errors, g_strdup (message),
+				GUINT_TO_POINTER (GPOINTER_TO_UINT (cnt) + 1));
+	}
+}
+
+static void
+rspamc_bench_maybe_stop (struct rspamc_bench *bench)
+{
+	if (bench->stopped && bench->inflight == 0) {
+		bench->finish = rspamd_get_ticks (FALSE);
+
+		if (bench_rate > 0) {
+			event_del (&bench->rate_ev);
+		}
+
+		event_base_loopexit (bench->ev_base, NULL);
+	}
+}
+
+static void
+rspamc_bench_cb (struct rspamd_client_connection *conn,
+		struct rspamd_http_message *msg,
+		const gchar *name, ucl_object_t *result, GString *input,
+		gpointer ud, gdouble start_time, gdouble send_time,
+		GError *err)
+{
+	struct rspamc_bench *bench = ud;
+	gdouble latency = rspamd_get_ticks (FALSE) - start_time;
+
+	if (result != NULL && err == NULL) {
+		bench->ok ++;
+		g_array_append_val (bench->latencies, latency);
+	}
+	else {
+		rspamc_bench_error (bench, err ? err->message : "empty reply");
+	}
+
+	if (result) {
+		ucl_object_unref (result);
+	}
+
+	rspamd_client_destroy (conn);
+	bench->inflight --;
+
+	if (bench_rate <= 0) {
+		rspamc_bench_fill (bench);
+	}
+
+	rspamc_bench_maybe_stop (bench);
+}
+
+static void
+rspamc_bench_send (struct rspamc_bench *bench)
+{
+	struct rspamd_client_connection *conn;
+	const gchar *fname;
+	GError *err = NULL;
+	FILE *in;
+
+	fname = g_ptr_array_index (bench->files,
+			bench->next_file ++ % bench->files->len);
+	bench->sent ++;
+	in = fopen (fname, "r");
+
+	if (in == NULL) {
+		rspamc_bench_error (bench, strerror (errno));
+		return;
+	}
+
+	conn = rspamd_client_init (bench->ev_base, bench->host, bench->port,
+			timeout, key);
+
+	if (conn == NULL) {
+		rspamc_bench_error (bench, "cannot connect");
+		fclose (in);
+		return;
+	}
+
+	if (!rspamd_client_command (conn, bench->cmd->path, bench->attrs, in,
+			rspamc_bench_cb, bench, compressed, dictionary, fname,
+			msgpack, &err)) {
+		rspamc_bench_error (bench, err ? err->message : "cannot send request");
+		rspamd_client_destroy (conn);
+
+		if (err) {
+			g_error_free (err);
+		}
+	}
+	else {
+		bench->inflight ++;
+	}
+
+	fclose (in);
+}
+
+static void
+rspamc_bench_fill (struct rspamc_bench *bench)
+{
+	while (!bench->stopped && bench->inflight < (guint)max_requests) {
+		if (rspamc_bench_done (bench)) {
+			bench->stopped = TRUE;
+		}
+		else {
+			rspamc_bench_send (bench);
+		}
+	}
+}
+
+static void
+rspamc_bench_rate_tick (gint fd, short what, gpointer ud)
+{
+	struct rspamc_bench *bench = ud;
+	gdouble due;
+
+	due = (rspamd_get_ticks (FALSE) - bench->start) * bench_rate;
+
+	/* Requests that do not fit the in flight limit are not postponed */
+	while (!bench->stopped && bench->sent + bench->dropped < due) {
+		if (rspamc_bench_done (bench)) {
+			bench->stopped = TRUE;
+		}
+		else if (bench->inflight >= (guint)max_requests) {
+			bench->dropped ++;
+		}
+		else {
+			rspamc_bench_send (bench);
+		}
+	}
+
+	if (!bench->stopped && rspamc_bench_done (bench)) {
+		bench->stopped = TRUE;
+	}
+
+	rspamc_bench_maybe_stop (bench);
+}
+
+static gint
+rspamc_bench_latency_cmp (gconstpointer a, gconstpointer b)
+{
+	gdouble d1 = *(const gdouble *)a, d2 = *(const gdouble *)b;
+
+	if (d1 < d2) {
+		return -1;
+	}
+	else if (d1 > d2) {
+		return 1;
+	}
+
+	return 0;
+}
+
+static gdouble
+rspamc_bench_percentile (GArray *latencies, gdouble q)
+{
+	guint idx;
+
+	if (latencies->len == 0) {
+		return 0.0;
+	}
+
+	idx = q * latencies->len;
+
+	if (idx >= latencies->len) {
+		idx = latencies->len - 1;
+	}
+
+	return g_array_index (latencies, gdouble, idx) * 1000.0;
+}
+
+static void
+rspamc_bench_report (struct rspamc_bench *bench)
+{
+	ucl_object_t *top, *lat, *errors;
+	GHashTableIter it;
+	gpointer k, v;
+	gdouble elapsed, mean = 0.0, err_rate = 0.0;
+	guint i;
+	gchar *ucl_out;
+
+	elapsed = bench->finish - bench->start;
+	g_array_sort (bench->latencies, rspamc_bench_latency_cmp);
+
+	for (i = 0; i < bench->latencies->len; i ++) {
+		mean += g_array_index (bench->latencies, gdouble, i);
+	}
+
+	if (bench->latencies->len > 0) {
+		mean = mean * 1000.0 / bench->latencies->len;
+	}
+
+	if (bench->sent > 0) {
+		err_rate = (gdouble)bench->failed / bench->sent;
+	}
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (top, ucl_object_fromint (bench->sent),
+			"sent", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromint (bench->ok),
+			"succeeded", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromint (bench->failed),
+			"failed", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromint (bench->dropped),
+			"dropped", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromdouble (err_rate),
+			"error_rate", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromdouble (elapsed),
+			"elapsed", 0, false);
+	ucl_object_insert_key (top,
+			ucl_object_fromdouble (elapsed > 0 ? bench->ok / elapsed : 0.0),
+			"throughput", 0, false);
+
+	lat = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (lat,
+			ucl_object_fromdouble (rspamc_bench_percentile (bench->latencies, 0)),
+			"min", 0, false);
+	ucl_object_insert_key (lat, ucl_object_fromdouble (mean),
+			"mean", 0, false);
+	ucl_object_insert_key (lat,
+			ucl_object_fromdouble (rspamc_bench_percentile (bench->latencies, 0.5)),
+			"p50", 0, false);
+	ucl_object_insert_key (lat,
+			ucl_object_fromdouble (rspamc_bench_percentile (bench->latencies, 0.99)),
+			"p99", 0, false);
+	ucl_object_insert_key (lat,
+			ucl_object_fromdouble (rspamc_bench_percentile (bench->latencies, 0.999)),
+			"p999", 0, false);
+	ucl_object_insert_key (lat,
+			ucl_object_fromdouble (rspamc_bench_percentile (bench->latencies, 1.0)),
+			"max", 0, false);
+	ucl_object_insert_key (top, lat, "latency_ms", 0, false);
+
+	errors = ucl_object_typed_new (UCL_OBJECT);
+	g_hash_table_iter_init (&it, bench->errors);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		ucl_object_insert_key (errors,
+				ucl_object_fromint (GPOINTER_TO_UINT (v)),
+				k, 0, true);
+	}
+
+	ucl_object_insert_key (top, errors, "errors", 0, false);
+
+	if (json) {
+		ucl_out = ucl_object_emit (top,
+				compact ? UCL_EMIT_JSON_COMPACT : UCL_EMIT_JSON);
+		rspamd_fprintf (stdout, "%s\n", ucl_out);
+		free (ucl_out);
+	}
+	else {
+		rspamd_fprintf (stdout, "Requests: %uL sent, %uL succeeded, "
+				"%uL failed (%.2f%%), %uL dropped\n",
+				bench->sent, bench->ok, bench->failed, err_rate * 100.0,
+				bench->dropped);
+		rspamd_fprintf (stdout, "Elapsed: %.3f seconds, %.2f requests per second\n",
+				elapsed, elapsed > 0 ? bench->ok / elapsed : 0.0);
+		rspamd_fprintf (stdout, "Latency (ms): min %.3f, mean %.3f, p50 %.3f, "
+				"p99 %.3f, p999 %.3f, max %.3f\n",
+				rspamc_bench_percentile (bench->latencies, 0),
+				mean,
+				rspamc_bench_percentile (bench->latencies, 0.5),
+				rspamc_bench_percentile (bench->latencies, 0.99),
+				rspamc_bench_percentile (bench->latencies, 0.999),
+				rspamc_bench_percentile (bench->latencies, 1.0));
+
+		if (g_hash_table_size (bench->errors) > 0) {
+			rspamd_fprintf (stdout, "Errors:\n");
+			g_hash_table_iter_init (&it, bench->errors);
+
+			while (g_hash_table_iter_next (&it, &k, &v)) {
+				rspamd_fprintf (stdout, "  %ud: %s\n", GPOINTER_TO_UINT (v),
+						(const gchar *)k);
+			}
+		}
+	}
+
+	ucl_object_unref (top);
+}
+
+static gint
+rspamc_bench_run (struct event_base *ev_base, struct rspamc_command *cmd,
+		gchar **paths, gint npaths, GQueue *attrs)
+{
+	struct rspamc_bench bench;
+	struct timeval tv;
+	gint i, ret;
+
+	memset (&bench, 0, sizeof (bench));
+	bench.ev_base = ev_base;
+	bench.cmd = cmd;
+	bench.attrs = attrs;
+	bench.files = g_ptr_array_new_with_free_func (g_free);
+	bench.latencies = g_array_new (FALSE, FALSE, sizeof (gdouble));
+	bench.errors = g_hash_table_new_full (g_str_hash, g_str_equal,
+			g_free, NULL);
+
+	for (i = 0; i < npaths; i ++) {
+		rspamc_bench_collect (&bench, paths[i]);
+	}
+
+	if (bench.files->len == 0) {
+		rspamd_fprintf (stderr, "no input files for bench\n");
+		exit (EXIT_FAILURE);
+	}
+
+	if (max_requests <= 0) {
+		max_requests = 1;
+	}
+
+	msgpack = msgpack && strcmp (cmd->path, "checkv2") == 0;
+	bench.host = rspamc_parse_connect_str (cmd, &bench.port);
+	bench.start = rspamd_get_ticks (FALSE);
+
+	if (bench_rate > 0) {
+		event_set (&bench.rate_ev, -1, EV_TIMEOUT|EV_PERSIST,
+				rspamc_bench_rate_tick, &bench);
+		event_base_set (ev_base, &bench.rate_ev);
+		double_to_tv (MIN (RSPAMC_BENCH_RATE_TICK, 1.0 / bench_rate), &tv);
+		event_add (&bench.rate_ev, &tv);
+		rspamc_bench_rate_tick (-1, EV_TIMEOUT, &bench);
+	}
+	else {
+		rspamc_bench_fill (&bench);
+		rspamc_bench_maybe_stop (&bench);
+	}
+
+	event_base_loop (ev_base, 0);
+
+	if (bench.finish == 0) {
+		bench.finish = rspamd_get_ticks (FALSE);
+	}
+
+	rspamc_bench_report (&bench);
+	ret = bench.ok > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+
+	g_free (bench.host);
+	g_ptr_array_free (bench.files, TRUE);
+	g_array_free (bench.latencies, TRUE);
+	g_hash_table_unref (bench.errors);
+
+	return ret;
+}
+
 gint
 main (gint argc, gchar **argv, gchar **env)
 {
@@ -1931,6 +2445,14 @@ main (gint argc, gchar **argv, gchar **env)
 
 	add_options (kwattrs);
 
+	if (cmd->cmd == RSPAMC_COMMAND_BENCH) {
+		ret = rspamc_bench_run (ev_base, cmd, &argv[start_argc],
+				argc - start_argc, kwattrs);
+		g_queue_free_full (kwattrs, g_free);
+
+		return ret;
+	}
+
 	if (start_argc == argc) {
 		/* Do command without input or with stdin */
 		if (empty_input) {
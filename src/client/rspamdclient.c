@@ -44,7 +44,6 @@ struct rspamd_client_connection {
 	gdouble start_time;
 	gdouble send_time;
 	struct rspamd_client_request *req;
-	struct rspamd_keypair_cache *keys_cache;
 };
 
 struct rspamd_client_request {
@@ -55,6 +54,8 @@ struct rspamd_client_request {
 	gpointer ud;
 };
 
+#define RSPAMD_CLIENT_MSGPACK_CTYPE "application/msgpack"
+
 #define RCLIENT_ERROR rspamd_client_error_quark ()
 GQuark
 rspamd_client_error_quark (void)
@@ -109,6 +110,7 @@ rspamd_client_finish_handler (struct rspamd_http_connection *conn,
 	struct ucl_parser *parser;
 	GError *err;
 	const rspamd_ftok_t *tok;
+	enum ucl_parse_type parse_type = UCL_PARSE_UCL;
 
 	c = req->conn;
 
@@ -135,6 +137,19 @@ rspamd_client_finish_handler (struct rspamd_http_connection *conn,
 			return 0;
 		}
 
+		tok = rspamd_http_message_find_header (msg, "Content-Type");
+
+		if (tok) {
+			rspamd_ftok_t t;
+
+			t.begin = RSPAMD_CLIENT_MSGPACK_CTYPE;
+			t.len = sizeof (RSPAMD_CLIENT_MSGPACK_CTYPE) - 1;
+
+			if (rspamd_ftok_casecmp (tok, &t) == 0) {
+				parse_type = UCL_PARSE_MSGPACK;
+			}
+		}
+
 		tok = rspamd_http_message_find_header (msg, "compression");
 
 		if (tok) {
@@ -194,7 +209,8 @@ rspamd_client_finish_handler (struct rspamd_http_connection *conn,
 				ZSTD_freeDStream (zstream);
 
 				parser = ucl_parser_new (0);
-				if (!ucl_parser_add_chunk (parser, zout.dst, zout.pos)) {
+				if (!ucl_parser_add_chunk_full (parser, zout.dst, zout.pos, 0,
+						UCL_DUPLICATE_APPEND, parse_type)) {
 					err = g_error_new (RCLIENT_ERROR, msg->code, "Cannot parse UCL: %s",
 							ucl_parser_get_error (parser));
 					ucl_parser_free (parser);
@@ -220,7 +236,8 @@ rspamd_client_finish_handler (struct rspamd_http_connection *conn,
 		}
 		else {
 			parser = ucl_parser_new (0);
-			if (!ucl_parser_add_chunk (parser, msg->body_buf.begin, msg->body_buf.len)) {
+			if (!ucl_parser_add_chunk_full (parser, msg->body_buf.begin,
+					msg->body_buf.len, 0, UCL_DUPLICATE_APPEND, parse_type)) {
 				err = g_error_new (RCLIENT_ERROR, msg->code, "Cannot parse UCL: %s",
 						ucl_parser_get_error (parser));
 				ucl_parser_free (parser);
@@ -240,6 +257,66 @@ rspamd_client_finish_handler (struct rspamd_http_connection *conn,
 	return 0;
 }
 
+static void
+rspamd_client_envelope_add (ucl_object_t *envelope, const gchar *name,
+		const gchar *value)
+{
+	ucl_object_t *cur, *ar;
+
+	cur = ucl_object_pop_key (envelope, name);
+
+	if (cur == NULL) {
+		ucl_object_insert_key (envelope, ucl_object_fromstring (value),
+				name, 0, true);
+
+		return;
+	}
+
+	/* Repeated values, e.g. recipients, are sent as arrays */
+	if (ucl_object_type (cur) != UCL_ARRAY) {
+		ar = ucl_object_typed_new (UCL_ARRAY);
+		ucl_array_append (ar, cur);
+	}
+	else {
+		ar = cur;
+	}
+
+	ucl_array_append (ar, ucl_object_fromstring (value));
+	ucl_object_insert_key (envelope, ar, name, 0, true);
+}
+
+/*
+ * Encode attributes and message as msgpack request:
+ * {"envelope": {<header>: <value(s)>}, "message": <binary>}
+ */
+static rspamd_fstring_t *
+rspamd_client_msgpack_body (GQueue *attrs, GString *input)
+{
+	ucl_object_t *top, *envelope, *message;
+	struct rspamd_http_client_header *nh;
+	rspamd_fstring_t *body;
+	GList *cur;
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+	envelope = ucl_object_typed_new (UCL_OBJECT);
+
+	for (cur = attrs->head; cur != NULL; cur = g_list_next (cur)) {
+		nh = cur->data;
+		rspamd_client_envelope_add (envelope, nh->name, nh->value);
+	}
+
+	message = ucl_object_fromlstring (input->str, input->len);
+	message->flags |= UCL_OBJECT_BINARY;
+	ucl_object_insert_key (top, envelope, "envelope", 0, false);
+	ucl_object_insert_key (top, message, "message", 0, false);
+
+	body = rspamd_fstring_sized_new (input->len + 1024);
+	rspamd_ucl_emit_fstring (top, UCL_EMIT_MSGPACK, &body);
+	ucl_object_unref (top);
+
+	return body;
+}
+
 struct rspamd_client_connection *
 rspamd_client_init (struct event_base *ev_base, const gchar *name,
 	guint16 port, gdouble timeout, const gchar *key)
@@ -256,13 +333,12 @@ rspamd_client_init (struct event_base *ev_base, const gchar *name,
 	conn->ev_base = ev_base;
 	conn->fd = fd;
 	conn->req_sent = FALSE;
-	conn->keys_cache = rspamd_keypair_cache_new (32);
 	conn->http_conn = rspamd_http_connection_new (rspamd_client_body_handler,
 			rspamd_client_error_handler,
 			rspamd_client_finish_handler,
 			0,
 			RSPAMD_HTTP_CLIENT,
-			conn->keys_cache,
+			NULL,
 			NULL);
 
 	conn->server_name = g_string_new (name);
@@ -277,8 +353,8 @@ rspamd_client_init (struct event_base *ev_base, const gchar *name,
 				RSPAMD_CRYPTOBOX_MODE_25519);
 
 		if (conn->key) {
-			conn->keypair = rspamd_keypair_new (RSPAMD_KEYPAIR_KEX,
-					RSPAMD_CRYPTOBOX_MODE_25519);
+			/* Requests of this process reuse the same shared key */
+			conn->keypair = rspamd_http_session_keypair ();
 			rspamd_http_connection_set_key (conn->http_conn, conn->keypair);
 		}
 		else {
@@ -297,6 +373,7 @@ rspamd_client_command (struct rspamd_client_connection *conn,
 		gpointer ud, gboolean compressed,
 		const gchar *comp_dictionary,
 		const gchar *filename,
+		gboolean msgpack,
 		GError **err)
 {
 	struct rspamd_client_request *req;
@@ -305,7 +382,9 @@ rspamd_client_command (struct rspamd_client_connection *conn,
 	gsize remain, old_len;
 	GList *cur;
 	GString *input = NULL;
-	rspamd_fstring_t *body;
+	rspamd_fstring_t *body, *packed = NULL;
+	const gchar *data;
+	gsize dlen;
 	guint dict_id = 0;
 	gsize dict_len = 0;
 	void *dict = NULL;
@@ -348,8 +427,24 @@ rspamd_client_command (struct rspamd_client_connection *conn,
 			return FALSE;
 		}
 
+		if (msgpack) {
+			packed = rspamd_client_msgpack_body (attrs, input);
+			data = packed->str;
+			dlen = packed->len;
+		}
+		else {
+			data = input->str;
+			dlen = input->len;
+		}
+
 		if (!compressed) {
-			body = rspamd_fstring_new_init (input->str, input->len);
+			if (packed) {
+				body = packed;
+				packed = NULL;
+			}
+			else {
+				body = rspamd_fstring_new_init (data, dlen);
+			}
 		}
 		else {
 			if (comp_dictionary) {
@@ -363,6 +458,7 @@ rspamd_client_command (struct rspamd_client_connection *conn,
 							strerror (errno));
 					g_free (req);
 					g_string_free (input, TRUE);
+					rspamd_fstring_free (packed);
 
 					return FALSE;
 				}
@@ -376,21 +472,27 @@ rspamd_client_command (struct rspamd_client_connection *conn,
 							strerror (errno));
 					g_free (req);
 					g_string_free (input, TRUE);
+					rspamd_fstring_free (packed);
 					munmap (dict, dict_len);
 
 					return FALSE;
 				}
 			}
 
-			body = rspamd_fstring_sized_new (ZSTD_compressBound (input->len));
+			body = rspamd_fstring_sized_new (ZSTD_compressBound (dlen));
 			zctx = ZSTD_createCCtx ();
 			body->len = ZSTD_compress_usingDict (zctx, body->str, body->allocated,
-					input->str, input->len,
+					data, dlen,
 					dict, dict_len,
 					1);
 
 			munmap (dict, dict_len);
 
+			if (packed) {
+				rspamd_fstring_free (packed);
+				packed = NULL;
+			}
+
 			if (ZSTD_isError (body->len)) {
 				g_set_error (err, RCLIENT_ERROR, ferror (
 						in), "compression error");
@@ -410,10 +512,12 @@ rspamd_client_command (struct rspamd_client_connection *conn,
 	}
 	else {
 		req->input = NULL;
+		/* Nothing to pack attributes with */
+		msgpack = FALSE;
 	}
 
-	/* Convert headers */
-	cur = attrs->head;
+	/* Convert headers, msgpack request carries them in the envelope */
+	cur = msgpack ? NULL : attrs->head;
 	while (cur != NULL) {
 		nh = cur->data;
 
@@ -442,7 +546,13 @@ rspamd_client_command (struct rspamd_client_connection *conn,
 	conn->req = req;
 	conn->start_time = rspamd_get_ticks (FALSE);
 
-	if (compressed) {
+	if (msgpack) {
+		/* Compression is signalled by header, so it does not clash */
+		rspamd_http_connection_write_message (conn->http_conn, req->msg, NULL,
+				RSPAMD_CLIENT_MSGPACK_CTYPE, req, conn->fd,
+				&conn->timeout, conn->ev_base);
+	}
+	else if (compressed) {
 		rspamd_http_connection_write_message (conn->http_conn, req->msg, NULL,
 				"application/x-compressed", req, conn->fd,
 				&conn->timeout, conn->ev_base);
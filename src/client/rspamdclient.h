@@ -70,6 +70,8 @@ struct rspamd_client_connection * rspamd_client_init (
  * @param in input file or NULL if no input required
  * @param cb callback to be called on command completion
  * @param ud opaque user data
+ * @param msgpack send attributes and input as msgpack request and expect
+ * msgpack reply (checkv2 only)
  * @return
  */
 gboolean rspamd_client_command (
@@ -82,6 +84,7 @@ gboolean rspamd_client_command (
 		gboolean compressed,
 		const gchar *comp_dictionary,
 		const gchar *filename,
+		gboolean msgpack,
 		GError **err);
 
 /**
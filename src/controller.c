@@ -30,6 +30,8 @@
 #include "unix-std.h"
 #include "utlist.h"
 #include "libmime/lang_detection.h"
+#include "libmime/images.h"
+#include "libutil/shared_cache.h"
 #include <math.h>
 
 /* 60 seconds for worker's IO */
@@ -49,15 +51,21 @@
 #define PATH_HISTORY_RESET "/historyreset"
 #define PATH_LEARN_SPAM "/learnspam"
 #define PATH_LEARN_HAM "/learnham"
+#define PATH_LEARN_SPAM_BULK "/learnspambulk"
+#define PATH_LEARN_HAM_BULK "/learnhambulk"
 #define PATH_SAVE_ACTIONS "/saveactions"
 #define PATH_SAVE_SYMBOLS "/savesymbols"
 #define PATH_SAVE_MAP "/savemap"
 #define PATH_SCAN "/scan"
 #define PATH_CHECK "/check"
 #define PATH_CHECKV2 "/checkv2"
+#define PATH_CLASSIFY "/classify"
 #define PATH_STAT "/stat"
 #define PATH_STAT_RESET "/statreset"
 #define PATH_COUNTERS "/counters"
+#define PATH_HISTOGRAMS "/histograms"
+#define PATH_METRICS "/metrics"
+#define PATH_REGEXPS "/regexps"
 #define PATH_ERRORS "/errors"
 #define PATH_NEIGHBOURS "/neighbours"
 #define PATH_PLUGINS "/plugins"
@@ -106,6 +114,8 @@ const struct timeval rrd_update_time = {
 		.tv_sec = 1,
 		.tv_usec = 0
 };
+/* Per second rrd records are written to the file in batches of this size */
+#define RRD_FLUSH_RECORDS 10
 
 const guint64 rspamd_controller_ctx_magic = 0xf72697805e6941faULL;
 
@@ -126,6 +136,13 @@ worker_t controller_worker = {
 /*
  * Worker's context
  */
+/* Data source stored in rrd after the actions counters */
+struct rspamd_controller_rrd_source {
+	const gchar *symbol;      /* symbol hits or NULL for actions scan time */
+	gint action;
+	guint64 last;             /* last value to keep the counter monotonic */
+};
+
 struct rspamd_controller_worker_ctx {
 	guint64 magic;
 	/* Events base */
@@ -180,8 +197,52 @@ struct rspamd_controller_worker_ctx {
 
 	struct event *rrd_event;
 	struct rspamd_rrd_file *rrd;
+	/* Extra rrd data sources, struct rspamd_controller_rrd_source */
+	GArray *rrd_sources;
+	guint rrd_queued;
 	struct event save_stats_event;
 	struct rspamd_lang_detector *lang_det;
+	/* Number of messages learned in parallel by bulk learns */
+	guint bulk_learn_parallel;
+	/* Skip message processing not required for statistics when learning */
+	gboolean learn_tokenize_only;
+	/* Scanner workers that process scans and learns instead of controller */
+	const ucl_object_t *scan_workers;
+	struct upstream_list *scan_ups;
+};
+
+/* Scan or learn request forwarded to a scanner worker */
+struct rspamd_controller_forward {
+	struct rspamd_controller_session *session;
+	struct rspamd_http_connection_entry *conn_ent;
+	struct rspamd_http_connection *conn;
+	struct upstream *up;
+	gint sock;
+	gboolean is_learn;
+};
+
+#define DEFAULT_BULK_LEARN_PARALLEL 8
+#define BULK_LEARN_PROGRESS_STEP 1000
+
+/*
+ * State of a bulk learn: messages are learned from a queue with at most
+ * `max_parallel` tasks running at the same time
+ */
+struct rspamd_controller_bulk_learn {
+	struct rspamd_controller_session *session;
+	struct rspamd_http_connection_entry *conn_ent;
+	struct rspamd_http_message *msg;
+	GArray *messages;		/* rspamd_ftok_t slices of the request body */
+	GPtrArray *running;
+	GPtrArray *finished;	/* tasks to be freed on the next step */
+	struct event step_ev;
+	gdouble start_time;
+	guint next;
+	guint max_parallel;
+	guint learned;
+	guint skipped;
+	guint failed;
+	gboolean is_spam;
 };
 
 struct rspamd_controller_plugin_cbdata {
@@ -1162,9 +1223,11 @@ rspamd_controller_handle_pie_chart (
 	return 0;
 }
 
-void
+static void
 rspamd_controller_graph_point (gulong t, gulong step,
 		struct rspamd_rrd_query_result* rrd_result,
+		const guint *ds_idx,
+		guint nds,
 		gdouble *acc,
 		ucl_object_t **elt)
 {
@@ -1173,14 +1236,14 @@ rspamd_controller_graph_point (gulong t, gulong step,
 	ucl_object_t* data_elt;
 	guint i, j;
 
-	for (i = 0; i < rrd_result->ds_count; i++) {
+	for (i = 0; i < nds; i++) {
 		sum = 0.0;
 		nan_cnt = 0;
 		data_elt = ucl_object_typed_new (UCL_OBJECT);
 		ucl_object_insert_key (data_elt, ucl_object_fromint (t), "x", 1, false);
 
 		for (j = 0; j < step; j++) {
-			yval = acc[i + j * rrd_result->ds_count];
+			yval = acc[ds_idx[i] + j * rrd_result->ds_count];
 			if (!isfinite (yval)) {
 				nan_cnt++;
 			}
@@ -1201,9 +1264,53 @@ rspamd_controller_graph_point (gulong t, gulong step,
 	}
 }
 
+/*
+ * Selects data sources from comma separated list of names,
+ * returns number of selected sources or 0 if some name is unknown
+ */
+static guint
+rspamd_controller_graph_ds (struct rspamd_rrd_file *rrd,
+		const rspamd_ftok_t *names, guint *ds_idx)
+{
+	const gchar *p = names->begin, *end = names->begin + names->len, *c;
+	guint nds = 0, i;
+	gsize len;
+
+	while (p < end) {
+		c = memchr (p, ',', end - p);
+
+		if (c == NULL) {
+			c = end;
+		}
+
+		len = c - p;
+
+		for (i = 0; i < rrd->stat_head->ds_cnt; i ++) {
+			if (strlen (rrd->ds_def[i].ds_nam) == len &&
+					memcmp (rrd->ds_def[i].ds_nam, p, len) == 0) {
+				break;
+			}
+		}
+
+		if (i == rrd->stat_head->ds_cnt) {
+			return 0;
+		}
+
+		ds_idx[nds++] = i;
+		p = c + 1;
+
+		if (nds == rrd->stat_head->ds_cnt) {
+			break;
+		}
+	}
+
+	return nds;
+}
+
 /*
  * Graph command handler:
- * request: /graph?type=<hourly|daily|weekly|monthly>
+ * request: /graph?type=<realtime|hourly|daily|weekly|monthly>
+ * optional: from=<timestamp>&to=<timestamp>&ds=<name1,name2,...>
  * headers: Password
  * reply: json [
  *      { label: "Foo", data: 11 },
@@ -1219,16 +1326,18 @@ rspamd_controller_handle_graph (
 	GHashTable *query;
 	struct rspamd_controller_session *session = conn_ent->ud;
 	struct rspamd_controller_worker_ctx *ctx;
-	rspamd_ftok_t srch, *value;
+	rspamd_ftok_t srch, *value, *ds_names = NULL;
 	struct rspamd_rrd_query_result *rrd_result;
-	gulong i, k, start_row, cnt, t, ts, step;
+	gulong i, k, cnt, t, ts, step, from = 0, to = 0;
 	gdouble *acc;
-	ucl_object_t *res, *elt[METRIC_ACTION_MAX];
+	guint *ds_idx, nds;
+	ucl_object_t *res, **elt;
 	enum {
 		rra_hourly = 0,
 		rra_daily,
 		rra_weekly,
 		rra_monthly,
+		rra_realtime,
 		rra_invalid
 	} rra_num = rra_invalid;
 	/* How many points are we going to send to display */
@@ -1274,17 +1383,53 @@ rspamd_controller_handle_graph (
 	else if (value->len == 7 && rspamd_lc_cmp (value->begin, "monthly", value->len) == 0) {
 		rra_num = rra_monthly;
 	}
+	else if (value->len == 8 && rspamd_lc_cmp (value->begin, "realtime", value->len) == 0) {
+		rra_num = rra_realtime;
+	}
+
+	srch.begin = (gchar *)"from";
+	srch.len = 4;
+	value = g_hash_table_lookup (query, &srch);
+
+	if (value && !rspamd_strtoul (value->begin, value->len, &from)) {
+		rra_num = rra_invalid;
+	}
+
+	srch.begin = (gchar *)"to";
+	srch.len = 2;
+	value = g_hash_table_lookup (query, &srch);
+
+	if (value && !rspamd_strtoul (value->begin, value->len, &to)) {
+		rra_num = rra_invalid;
+	}
+
+	ds_idx = g_alloca (ctx->rrd->stat_head->ds_cnt * sizeof (*ds_idx));
+	srch.begin = (gchar *)"ds";
+	srch.len = 2;
+	ds_names = g_hash_table_lookup (query, &srch);
+
+	if (ds_names) {
+		nds = rspamd_controller_graph_ds (ctx->rrd, ds_names, ds_idx);
+	}
+	else {
+		/* Actions counters by default */
+		nds = MIN (METRIC_ACTION_MAX, ctx->rrd->stat_head->ds_cnt);
+
+		for (i = 0; i < nds; i ++) {
+			ds_idx[i] = i;
+		}
+	}
 
 	g_hash_table_unref (query);
 
-	if (rra_num == rra_invalid) {
+	if (rra_num == rra_invalid || nds == 0) {
 		msg_err_session ("invalid graph type query");
 		rspamd_controller_send_error (conn_ent, 400, "Invalid graph type");
 
 		return 0;
 	}
 
-	rrd_result = rspamd_rrd_query (ctx->rrd, rra_num);
+	rrd_result = rspamd_rrd_query_window (ctx->rrd, rra_num, from, to);
 
 	if (rrd_result == NULL) {
 		msg_err_session ("cannot query rrd");
@@ -1293,27 +1438,24 @@ rspamd_controller_handle_graph (
 		return 0;
 	}
 
-	g_assert (rrd_result->ds_count == G_N_ELEMENTS (elt));
-
 	res = ucl_object_typed_new (UCL_ARRAY);
-	/* How much full updates happened since the last update */
-	ts = rrd_result->last_update / rrd_result->pdp_per_cdp - rrd_result->rra_rows;
+	elt = g_alloca (nds * sizeof (*elt));
+	ts = rrd_result->first_cdp;
 
-	for (i = 0; i < rrd_result->ds_count; i ++) {
+	for (i = 0; i < nds; i ++) {
 		elt[i] = ucl_object_typed_new (UCL_ARRAY);
 	}
 
-	start_row = rrd_result->cur_row == rrd_result->rra_rows - 1 ?
-				0 : rrd_result->cur_row;
 	t = ts * rrd_result->pdp_per_cdp;
 	k = 0;
 
 	/* Create window */
-	step = ceil (((gdouble)rrd_result->rra_rows) / desired_points);
-	g_assert (step >= 1);
+	step = ceil (((gdouble)rrd_result->rows) / desired_points);
+	step = MAX (step, 1);
 	acc = g_malloc0 (sizeof (double) * rrd_result->ds_count * step);
 
-	for (i = start_row, cnt = 0; cnt < rrd_result->rra_rows;
+	/* Read only rows within the requested window */
+	for (i = rrd_result->first_row, cnt = 0; cnt < rrd_result->rows;
 			cnt ++) {
 
 		memcpy (&acc[k * rrd_result->ds_count],
@@ -1327,7 +1469,8 @@ rspamd_controller_handle_graph (
 			t = ts * rrd_result->pdp_per_cdp;
 
 			/* Need a fresh point */
-			rspamd_controller_graph_point (t, step, rrd_result, acc, elt);
+			rspamd_controller_graph_point (t, step, rrd_result, ds_idx, nds,
+					acc, elt);
 			k = 0;
 		}
 
@@ -1342,20 +1485,139 @@ rspamd_controller_handle_graph (
 	}
 
 	if (k > 0) {
-		rspamd_controller_graph_point (t, k, rrd_result, acc, elt);
+		rspamd_controller_graph_point (t, k, rrd_result, ds_idx, nds, acc, elt);
 	}
 
-	for (i = 0; i < rrd_result->ds_count; i++) {
+	for (i = 0; i < nds; i++) {
 		ucl_array_append (res, elt[i]);
 	}
 
 	rspamd_controller_send_ucl (conn_ent, res);
 	ucl_object_unref (res);
 	g_free (acc);
+	g_free (rrd_result);
 
 	return 0;
 }
 
+struct rspamd_controller_history_cbdata {
+	rspamd_fstring_rope_t *rope;
+	guint nrows;
+	gdouble last_time;
+};
+
+static void
+rspamd_controller_history_row_cb (const struct roll_history_row *row,
+		gpointer ud)
+{
+	struct rspamd_controller_history_cbdata *cbd = ud;
+	ucl_object_t *obj, *syms_obj, *cur;
+	struct tm tm;
+	gchar timebuf[32];
+	guint j;
+
+	rspamd_localtime (row->tv.tv_sec, &tm);
+	strftime (timebuf, sizeof (timebuf) - 1, "%Y-%m-%d %H:%M:%S", &tm);
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (obj, ucl_object_fromstring (
+			timebuf),		  "time", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (
+			row->tv.tv_sec), "unix_time", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromstring (
+			row->message_id), "id",	  0, false);
+	ucl_object_insert_key (obj, ucl_object_fromstring (row->from_addr),
+			"ip", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromstring (rspamd_action_to_str (
+					row->action)), "action", 0, false);
+
+	if (!isnan (row->score)) {
+		ucl_object_insert_key (obj, ucl_object_fromdouble (
+				row->score),		  "score",			0, false);
+	}
+	else {
+		ucl_object_insert_key (obj,
+				ucl_object_fromdouble (0.0), "score", 0, false);
+	}
+
+	if (!isnan (row->required_score)) {
+		ucl_object_insert_key (obj,
+				ucl_object_fromdouble (
+						row->required_score), "required_score", 0, false);
+	}
+	else {
+		ucl_object_insert_key (obj,
+				ucl_object_fromdouble (0.0), "required_score", 0, false);
+	}
+
+	syms_obj = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_reserve (syms_obj, row->nsymbols);
+
+	for (j = 0; j < row->nsymbols; j++) {
+		cur = ucl_object_typed_new (UCL_OBJECT);
+
+		ucl_object_insert_key (cur,
+				ucl_object_fromdouble (row->symbols[j].score),
+				"score", 0, false);
+		ucl_object_insert_key (syms_obj, cur, row->symbols[j].name, 0, true);
+	}
+
+	ucl_object_insert_key (obj, syms_obj, "symbols", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (row->len),
+			"size", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble (row->scan_time),
+			"scan_time", 0, false);
+
+	if (row->user[0] != '\0') {
+		ucl_object_insert_key (obj, ucl_object_fromstring (row->user),
+				"user", 0, false);
+	}
+	if (row->from_addr[0] != '\0') {
+		ucl_object_insert_key (obj, ucl_object_fromstring (
+				row->from_addr), "from", 0, false);
+	}
+
+	/* Rows are emitted one by one, so we never build the whole tree */
+	if (cbd->nrows > 0) {
+		rspamd_fstring_rope_append (cbd->rope, ",", 1);
+	}
+
+	rspamd_ucl_emit_rope (obj, UCL_EMIT_JSON_COMPACT, cbd->rope);
+	ucl_object_unref (obj);
+	cbd->nrows ++;
+	cbd->last_time = tv_to_double (&row->tv);
+}
+
+static gboolean
+rspamd_controller_history_parse_double (GHashTable *params,
+		const gchar *name, gdouble *target)
+{
+	rspamd_ftok_t srch, *found;
+	gchar numbuf[64], *endptr;
+
+	RSPAMD_FTOK_FROM_STR (&srch, name);
+	found = g_hash_table_lookup (params, &srch);
+
+	if (found == NULL) {
+		return FALSE;
+	}
+
+	rspamd_strlcpy (numbuf, found->begin, MIN (sizeof (numbuf), found->len + 1));
+	*target = g_ascii_strtod (numbuf, &endptr);
+
+	return endptr != numbuf && *endptr == '\0';
+}
+
+/*
+ * Supported query arguments:
+ * - `action`, `symbol`: rows with the specified action or symbol
+ * - `min_score`, `max_score`: score range
+ * - `since`, `until`: time window (unix time)
+ * - `limit`, `cursor`: enable pagination, rows are returned from the newest
+ *   ones as `{"rows": [...], "cursor": N}`, where `cursor` should be passed to
+ *   get the next page (it is null for the last page)
+ */
 static void
 rspamd_controller_handle_legacy_history (
 		struct rspamd_controller_session *session,
@@ -1363,111 +1625,91 @@ rspamd_controller_handle_legacy_history (
 		struct rspamd_http_connection_entry *conn_ent,
 		struct rspamd_http_message *msg)
 {
-	struct roll_history_row *row, *copied_rows;
-	guint i, rows_proc, row_num;
-	struct tm tm;
-	gchar timebuf[32], **syms;
-	ucl_object_t *top, *obj;
+	struct roll_history_filter filter;
+	struct rspamd_controller_history_cbdata cbd;
+	GHashTable *params;
+	rspamd_ftok_t srch, *found;
+	gboolean paginated = FALSE;
+	gdouble dval;
+	gchar numbuf[64];
+
+	memset (&filter, 0, sizeof (filter));
+	filter.min_score = NAN;
+	filter.max_score = NAN;
+	filter.action = -1;
+	params = rspamd_http_message_parse_query (msg);
 
-	top = ucl_object_typed_new (UCL_ARRAY);
+	if (params) {
+		RSPAMD_FTOK_ASSIGN (&srch, "action");
+		found = g_hash_table_lookup (params, &srch);
 
-	/* Set lock on history */
-	copied_rows = g_malloc (sizeof (*copied_rows) * ctx->srv->history->nrows);
-	memcpy (copied_rows, ctx->srv->history->rows,
-			sizeof (*copied_rows) * ctx->srv->history->nrows);
-
-	/* Go through all rows */
-	row_num = ctx->srv->history->cur_row;
-
-	for (i = 0, rows_proc = 0; i < ctx->srv->history->nrows; i++, row_num++) {
-		if (row_num == ctx->srv->history->nrows) {
-			row_num = 0;
-		}
-		row = &copied_rows[row_num];
-		/* Get only completed rows */
-		if (row->completed) {
-			rspamd_localtime (row->tv.tv_sec, &tm);
-			strftime (timebuf, sizeof (timebuf) - 1, "%Y-%m-%d %H:%M:%S", &tm);
-			obj = ucl_object_typed_new (UCL_OBJECT);
-			ucl_object_insert_key (obj, ucl_object_fromstring (
-					timebuf),		  "time", 0, false);
-			ucl_object_insert_key (obj, ucl_object_fromint (
-					row->tv.tv_sec), "unix_time", 0, false);
-			ucl_object_insert_key (obj, ucl_object_fromstring (
-					row->message_id), "id",	  0, false);
-			ucl_object_insert_key (obj, ucl_object_fromstring (row->from_addr),
-					"ip", 0, false);
-			ucl_object_insert_key (obj,
-					ucl_object_fromstring (rspamd_action_to_str (
-							row->action)), "action", 0, false);
-
-			if (!isnan (row->score)) {
-				ucl_object_insert_key (obj, ucl_object_fromdouble (
-						row->score),		  "score",			0, false);
-			}
-			else {
-				ucl_object_insert_key (obj,
-						ucl_object_fromdouble (0.0), "score", 0, false);
-			}
+		if (found && !rspamd_action_from_str (
+				rspamd_mempool_ftokdup (session->pool, found), &filter.action)) {
+			g_hash_table_unref (params);
+			rspamd_controller_send_error (conn_ent, 400, "Invalid action");
 
-			if (!isnan (row->required_score)) {
-				ucl_object_insert_key (obj,
-						ucl_object_fromdouble (
-								row->required_score), "required_score", 0, false);
-			}
-			else {
-				ucl_object_insert_key (obj,
-						ucl_object_fromdouble (0.0), "required_score", 0, false);
-			}
+			return;
+		}
 
-			syms = g_strsplit_set (row->symbols, ", ", -1);
+		RSPAMD_FTOK_ASSIGN (&srch, "symbol");
+		found = g_hash_table_lookup (params, &srch);
 
-			if (syms) {
-				guint nelts = g_strv_length (syms);
-				ucl_object_t *syms_obj = ucl_object_typed_new (UCL_OBJECT);
-				ucl_object_reserve (syms_obj, nelts);
+		if (found) {
+			filter.symbol = rspamd_mempool_ftokdup (session->pool, found);
+		}
 
-				for (guint j = 0; j < nelts; j++) {
-					g_strstrip (syms[j]);
+		rspamd_controller_history_parse_double (params, "min_score",
+				&filter.min_score);
+		rspamd_controller_history_parse_double (params, "max_score",
+				&filter.max_score);
+		rspamd_controller_history_parse_double (params, "since", &filter.since);
+		rspamd_controller_history_parse_double (params, "until", &filter.until);
+
+		if (rspamd_controller_history_parse_double (params, "cursor", &dval)) {
+			/* Next page contains rows older than the last returned one */
+			filter.until = dval;
+			paginated = TRUE;
+		}
 
-					if (strlen (syms[j]) == 0) {
-						/* Empty garbadge */
-						continue;
-					}
+		if (rspamd_controller_history_parse_double (params, "limit", &dval) &&
+				dval > 0) {
+			filter.limit = dval;
+			paginated = TRUE;
+		}
 
-					ucl_object_t *cur = ucl_object_typed_new (UCL_OBJECT);
+		g_hash_table_unref (params);
+	}
 
-					ucl_object_insert_key (cur, ucl_object_fromdouble (0.0),
-							"score", 0, false);
-					ucl_object_insert_key (syms_obj, cur, syms[j], 0, true);
-				}
+	filter.newest_first = paginated;
+	memset (&cbd, 0, sizeof (cbd));
+	cbd.rope = rspamd_fstring_rope_new (BUFSIZ);
 
-				ucl_object_insert_key (obj, syms_obj, "symbols", 0, false);
-				g_strfreev (syms);
-			}
+	if (paginated) {
+		rspamd_fstring_rope_append (cbd.rope, "{\"rows\":[",
+				sizeof ("{\"rows\":[") - 1);
+	}
+	else {
+		rspamd_fstring_rope_append (cbd.rope, "[", 1);
+	}
 
-			ucl_object_insert_key (obj, ucl_object_fromint (row->len),
-					"size", 0, false);
-			ucl_object_insert_key (obj,
-					ucl_object_fromdouble (row->scan_time),
-					"scan_time", 0, false);
+	/* Rows from all workers are merged and ordered by time */
+	rspamd_roll_history_foreach (ctx->srv->history, ctx->cfg, &filter,
+			rspamd_controller_history_row_cb, &cbd);
+	rspamd_fstring_rope_append (cbd.rope, "]", 1);
 
-			if (row->user[0] != '\0') {
-				ucl_object_insert_key (obj, ucl_object_fromstring (row->user),
-						"user", 0, false);
-			}
-			if (row->from_addr[0] != '\0') {
-				ucl_object_insert_key (obj, ucl_object_fromstring (
-						row->from_addr), "from", 0, false);
-			}
-			ucl_array_append (top, obj);
-			rows_proc++;
+	if (paginated) {
+		if (filter.limit > 0 && cbd.nrows == filter.limit) {
+			rspamd_snprintf (numbuf, sizeof (numbuf), ",\"cursor\":%.6f}",
+					cbd.last_time);
+		}
+		else {
+			rspamd_strlcpy (numbuf, ",\"cursor\":null}", sizeof (numbuf));
 		}
+
+		rspamd_fstring_rope_append (cbd.rope, numbuf, strlen (numbuf));
 	}
 
-	rspamd_controller_send_ucl (conn_ent, top);
-	ucl_object_unref (top);
-	g_free (copied_rows);
+	rspamd_controller_send_rope (conn_ent, cbd.rope);
 }
 
 static gboolean
@@ -1679,8 +1921,6 @@ rspamd_controller_handle_history_reset (struct rspamd_http_connection_entry *con
 {
 	struct rspamd_controller_session *session = conn_ent->ud;
 	struct rspamd_controller_worker_ctx *ctx;
-	struct roll_history_row *row;
-	guint start_row, i, t;
 	lua_State *L;
 
 	ctx = session->ctx;
@@ -1691,26 +1931,7 @@ rspamd_controller_handle_history_reset (struct rspamd_http_connection_entry *con
 	}
 
 	if (!ctx->srv->history->disabled) {
-		/* Clean from start to the current row */
-		start_row = g_atomic_int_get (&ctx->srv->history->cur_row);
-
-		for (i = 0; i < start_row; i ++) {
-			t = g_atomic_int_get (&ctx->srv->history->cur_row);
-
-			/* We somehow come to the race condition */
-			if (i >= t) {
-				break;
-			}
-
-			row = &ctx->srv->history->rows[i];
-			memset (row, 0, sizeof (*row));
-		}
-
-		start_row = g_atomic_int_get (&ctx->srv->history->cur_row);
-		/* Optimistically set all bytes to zero (might cause race) */
-		memset (ctx->srv->history->rows,
-				0,
-				sizeof (*row) * (ctx->srv->history->nrows - start_row));
+		rspamd_roll_history_reset (ctx->srv->history);
 
 		msg_info_session ("<%s> reset history",
 				rspamd_inet_address_to_string (session->from_addr));
@@ -1979,6 +2200,41 @@ rspamd_controller_check_fin_task (void *ud)
 	return FALSE;
 }
 
+static gboolean
+rspamd_controller_classify_fin_task (void *ud)
+{
+	struct rspamd_task *task = ud;
+	struct rspamd_http_connection_entry *conn_ent;
+
+	msg_debug_task ("finish task");
+	conn_ent = task->fin_arg;
+
+	if (task->err) {
+		msg_info_task ("cannot classify <%s>: %e", task->message_id, task->err);
+		rspamd_controller_send_error (conn_ent, task->err->code, "%s",
+				task->err->message);
+		return TRUE;
+	}
+
+	if (RSPAMD_TASK_IS_PROCESSED (task)) {
+		rspamd_controller_scan_reply (task);
+		return TRUE;
+	}
+
+	if (!rspamd_task_process (task, RSPAMD_TASK_PROCESS_CLASSIFY)) {
+		rspamd_controller_scan_reply (task);
+		return TRUE;
+	}
+
+	if (RSPAMD_TASK_IS_PROCESSED (task)) {
+		rspamd_controller_scan_reply (task);
+		return TRUE;
+	}
+
+	/* One more iteration */
+	return FALSE;
+}
+
 static int
 rspamd_controller_handle_learn_common (
 	struct rspamd_http_connection_entry *conn_ent,
@@ -2004,6 +2260,10 @@ rspamd_controller_handle_learn_common (
 		return 0;
 	}
 
+	if (rspamd_controller_forward_task (conn_ent, msg, TRUE, is_spam)) {
+		return 0;
+	}
+
 	task = rspamd_task_new (session->ctx->worker, session->cfg, session->pool,
 			session->ctx->lang_det, ctx->ev_base);
 
@@ -2026,6 +2286,10 @@ rspamd_controller_handle_learn_common (
 		session->classifier = NULL;
 	}
 
+	if (ctx->learn_tokenize_only) {
+		task->flags |= RSPAMD_TASK_FLAG_TOKENIZE_ONLY;
+	}
+
 	if (!rspamd_task_load_message (task, msg, msg->body_buf.begin, msg->body_buf.len)) {
 		goto end;
 	}
@@ -2044,62 +2308,574 @@ end:
 	return 0;
 }
 
-/*
- * Learn spam command handler:
- * request: /learnspam
- * headers: Password
- * input: plaintext data
- * reply: json {"success":true} or {"error":"error message"}
- */
-static int
-rspamd_controller_handle_learnspam (
-	struct rspamd_http_connection_entry *conn_ent,
-	struct rspamd_http_message *msg)
+static void
+rspamd_controller_forward_free (struct rspamd_controller_forward *fwd)
 {
-	return rspamd_controller_handle_learn_common (conn_ent, msg, TRUE);
+	fwd->session->forward = NULL;
+	rspamd_http_connection_reset (fwd->conn);
+	rspamd_http_connection_unref (fwd->conn);
+	close (fwd->sock);
+	g_free (fwd);
 }
-/*
- * Learn ham command handler:
- * request: /learnham
- * headers: Password
- * input: plaintext data
- * reply: json {"success":true} or {"error":"error message"}
- */
-static int
-rspamd_controller_handle_learnham (
-	struct rspamd_http_connection_entry *conn_ent,
-	struct rspamd_http_message *msg)
+
+static void
+rspamd_controller_forward_error_handler (struct rspamd_http_connection *conn,
+		GError *err)
 {
-	return rspamd_controller_handle_learn_common (conn_ent, msg, FALSE);
+	struct rspamd_controller_forward *fwd = conn->ud;
+	struct rspamd_controller_session *session = fwd->session;
+
+	msg_err_session ("cannot process message on scanner %s: %e",
+			rspamd_inet_address_to_string (rspamd_upstream_addr (fwd->up)),
+			err);
+	rspamd_upstream_fail (fwd->up, FALSE);
+	rspamd_controller_send_error (fwd->conn_ent, 502,
+			"Scanner worker error: %s", err->message);
+	rspamd_controller_forward_free (fwd);
+}
+
+static gint
+rspamd_controller_forward_finish_handler (struct rspamd_http_connection *conn,
+		struct rspamd_http_message *msg)
+{
+	struct rspamd_controller_forward *fwd = conn->ud;
+	struct rspamd_controller_session *session = fwd->session;
+	struct rspamd_http_connection_entry *conn_ent = fwd->conn_ent;
+	struct rspamd_http_message *reply;
+
+	rspamd_upstream_ok (fwd->up);
+
+	if (fwd->is_learn && msg->code == 200) {
+		msg_info_session ("<%s> learned message as %s on scanner %s",
+				rspamd_inet_address_to_string (session->from_addr),
+				session->is_spam ? "spam" : "ham",
+				rspamd_inet_address_to_string (rspamd_upstream_addr (fwd->up)));
+		rspamd_controller_send_string (conn_ent, "{\"success\":true}");
+	}
+	else {
+		/* Scan results and errors are passed to the client as is */
+		reply = rspamd_http_connection_steal_msg (conn);
+		rspamd_http_message_remove_header (reply, "Content-Length");
+		rspamd_http_message_remove_header (reply, "Key");
+		rspamd_http_message_remove_header (reply, "Connection");
+		rspamd_http_connection_reset (conn_ent->conn);
+		rspamd_http_router_insert_headers (conn_ent->rt, reply);
+		rspamd_http_connection_write_message (conn_ent->conn,
+				reply,
+				NULL,
+				"application/json",
+				conn_ent,
+				conn_ent->conn->fd,
+				conn_ent->rt->ptv,
+				conn_ent->rt->ev_base);
+		conn_ent->is_reply = TRUE;
+	}
+
+	rspamd_controller_forward_free (fwd);
+
+	return 0;
 }
 
 /*
- * Scan command handler:
- * request: /scan
- * headers: Password
- * input: plaintext data
- * reply: json {scan data} or {"error":"error message"}
+ * Sends scan or learn request to a scanner worker, so the controller's
+ * event loop is not blocked by the message processing. Returns FALSE if no
+ * scanner is available and the request should be processed locally
  */
-static int
-rspamd_controller_handle_scan (struct rspamd_http_connection_entry *conn_ent,
-	struct rspamd_http_message *msg)
+static gboolean
+rspamd_controller_forward_task (struct rspamd_http_connection_entry *conn_ent,
+		struct rspamd_http_message *msg, gboolean is_learn, gboolean is_spam)
 {
 	struct rspamd_controller_session *session = conn_ent->ud;
-	struct rspamd_controller_worker_ctx *ctx;
-	struct rspamd_task *task;
-
-	ctx = session->ctx;
+	struct rspamd_controller_worker_ctx *ctx = session->ctx;
+	struct rspamd_controller_forward *fwd;
+	struct rspamd_http_message *fwd_msg;
+	struct upstream *up;
+	GError *err = NULL;
+	gint sock;
 
-	if (!rspamd_controller_check_password (conn_ent, session, msg, FALSE)) {
-		return 0;
+	if (ctx->scan_ups == NULL) {
+		return FALSE;
 	}
 
-	if (rspamd_http_message_get_body (msg, NULL) == NULL) {
-		msg_err_session ("got zero length body, cannot continue");
-		rspamd_controller_send_error (conn_ent,
-			400,
-			"Empty body is not permitted");
-		return 0;
+	up = rspamd_upstream_get (ctx->scan_ups, RSPAMD_UPSTREAM_ROUND_ROBIN,
+			NULL, 0);
+
+	if (up == NULL) {
+		msg_warn_session ("no scanner workers alive, process message locally");
+		return FALSE;
+	}
+
+	sock = rspamd_inet_address_connect (rspamd_upstream_addr (up),
+			SOCK_STREAM, TRUE);
+
+	if (sock == -1) {
+		msg_warn_session ("cannot connect to scanner %s, process message "
+				"locally: %s",
+				rspamd_inet_address_to_string (rspamd_upstream_addr (up)),
+				strerror (errno));
+		rspamd_upstream_fail (up, TRUE);
+		return FALSE;
+	}
+
+	fwd_msg = rspamd_http_connection_copy_msg (msg, &err);
+
+	if (fwd_msg == NULL) {
+		msg_err_session ("cannot copy message to send to scanner: %e", err);
+
+		if (err) {
+			g_error_free (err);
+		}
+
+		close (sock);
+		return FALSE;
+	}
+
+	rspamd_http_message_remove_header (fwd_msg, "Password");
+	rspamd_http_message_remove_header (fwd_msg, "Key");
+	fwd_msg->url = rspamd_fstring_assign (fwd_msg->url, "/checkv2",
+			sizeof ("/checkv2") - 1);
+	fwd_msg->method = HTTP_POST;
+
+	if (is_learn) {
+		rspamd_http_message_remove_header (fwd_msg, "Learn-Type");
+		rspamd_http_message_add_header (fwd_msg, "Learn-Type",
+				is_spam ? "spam" : "ham");
+		session->is_spam = is_spam;
+	}
+
+	fwd = g_malloc0 (sizeof (*fwd));
+	fwd->session = session;
+	fwd->conn_ent = conn_ent;
+	fwd->up = up;
+	fwd->sock = sock;
+	fwd->is_learn = is_learn;
+	fwd->conn = rspamd_http_connection_new (NULL,
+			rspamd_controller_forward_error_handler,
+			rspamd_controller_forward_finish_handler,
+			RSPAMD_HTTP_CLIENT_SIMPLE,
+			RSPAMD_HTTP_CLIENT,
+			NULL,
+			NULL);
+	session->forward = fwd;
+
+	rspamd_http_connection_write_message (fwd->conn,
+			fwd_msg, NULL, NULL, fwd, sock,
+			&ctx->io_tv, ctx->ev_base);
+
+	return TRUE;
+}
+
+/*
+ * Splits mbox formatted buffer to messages, returns NULL if the buffer is
+ * not in mbox format
+ */
+static GArray *
+rspamd_controller_split_mbox (const gchar *begin, gsize len)
+{
+	GArray *res;
+	const gchar *p = begin, *end = begin + len, *next, *msg_start = NULL;
+	rspamd_ftok_t tok;
+
+	if (len < sizeof ("From ") - 1 || memcmp (begin, "From ", 5) != 0) {
+		return NULL;
+	}
+
+	res = g_array_new (FALSE, FALSE, sizeof (rspamd_ftok_t));
+
+	while (p < end) {
+		next = memchr (p, '\n', end - p);
+		next = next ? next + 1 : end;
+
+		if (end - p >= 5 && memcmp (p, "From ", 5) == 0) {
+			/* Separator line */
+			if (msg_start != NULL && p > msg_start) {
+				tok.begin = msg_start;
+				tok.len = p - msg_start;
+				g_array_append_val (res, tok);
+			}
+
+			msg_start = next;
+		}
+
+		p = next;
+	}
+
+	if (msg_start != NULL && end > msg_start) {
+		tok.begin = msg_start;
+		tok.len = end - msg_start;
+		g_array_append_val (res, tok);
+	}
+
+	return res;
+}
+
+static void rspamd_controller_bulk_learn_schedule (
+		struct rspamd_controller_bulk_learn *bulk);
+
+static void
+rspamd_controller_bulk_learn_done (struct rspamd_task *task,
+		struct rspamd_controller_bulk_learn *bulk)
+{
+	struct rspamd_controller_session *session = bulk->session;
+
+	if (task->err) {
+		if (task->err->code == 404) {
+			/* Already learned */
+			bulk->skipped ++;
+		}
+		else {
+			msg_info_session ("cannot learn <%s>: %e", task->message_id,
+					task->err);
+			bulk->failed ++;
+		}
+	}
+	else {
+		bulk->learned ++;
+	}
+
+	g_ptr_array_remove_fast (bulk->running, task);
+	/* Task cannot be freed from its own finaliser */
+	g_ptr_array_add (bulk->finished, task);
+	rspamd_controller_bulk_learn_schedule (bulk);
+}
+
+static gboolean
+rspamd_controller_bulk_learn_fin_task (void *ud)
+{
+	struct rspamd_task *task = ud;
+	struct rspamd_controller_bulk_learn *bulk = task->fin_arg;
+
+	if (bulk == NULL) {
+		/* Bulk learn has been aborted */
+		return TRUE;
+	}
+
+	if (task->err == NULL && !RSPAMD_TASK_IS_PROCESSED (task)) {
+		if (rspamd_task_process (task, RSPAMD_TASK_PROCESS_LEARN) &&
+				!RSPAMD_TASK_IS_PROCESSED (task)) {
+			/* One more iteration */
+			return FALSE;
+		}
+
+		if (task->err == NULL && !RSPAMD_TASK_IS_PROCESSED (task)) {
+			g_set_error (&task->err, g_quark_from_static_string ("controller"),
+					500, "Internal error");
+		}
+	}
+
+	rspamd_controller_bulk_learn_done (task, bulk);
+
+	return TRUE;
+}
+
+static void
+rspamd_controller_bulk_learn_start (struct rspamd_controller_bulk_learn *bulk)
+{
+	struct rspamd_controller_session *session = bulk->session;
+	struct rspamd_controller_worker_ctx *ctx = session->ctx;
+	struct rspamd_task *task;
+	rspamd_ftok_t *part;
+
+	part = &g_array_index (bulk->messages, rspamd_ftok_t, bulk->next);
+	bulk->next ++;
+
+	/* Each task has its own pool, so memory is released after each message */
+	task = rspamd_task_new (ctx->worker, session->cfg, NULL,
+			ctx->lang_det, ctx->ev_base);
+	task->resolver = ctx->resolver;
+	task->s = rspamd_session_create (task->task_pool,
+			rspamd_controller_bulk_learn_fin_task,
+			NULL,
+			(event_finalizer_t )rspamd_task_free,
+			task);
+	task->fin_arg = bulk;
+	task->sock = -1;
+	g_ptr_array_add (bulk->running, task);
+
+	if (ctx->learn_tokenize_only) {
+		task->flags |= RSPAMD_TASK_FLAG_TOKENIZE_ONLY;
+	}
+
+	if (rspamd_task_load_message (task, bulk->msg, part->begin, part->len)) {
+		rspamd_learn_task_spam (task, bulk->is_spam, session->classifier, NULL);
+
+		if (!rspamd_task_process (task, RSPAMD_TASK_PROCESS_LEARN)) {
+			msg_debug_session ("<%s> message cannot be processed",
+					task->message_id);
+		}
+	}
+
+	rspamd_session_pending (task->s);
+}
+
+static void
+rspamd_controller_bulk_learn_free (struct rspamd_controller_bulk_learn *bulk)
+{
+	struct rspamd_task *task;
+	guint i;
+
+	if (rspamd_event_pending (&bulk->step_ev, EV_TIMEOUT)) {
+		event_del (&bulk->step_ev);
+	}
+
+	PTR_ARRAY_FOREACH (bulk->finished, i, task) {
+		rspamd_session_destroy (task->s);
+	}
+
+	/* Running tasks are aborted */
+	while (bulk->running->len > 0) {
+		task = g_ptr_array_index (bulk->running, bulk->running->len - 1);
+		g_ptr_array_remove_index_fast (bulk->running, bulk->running->len - 1);
+		task->fin_arg = NULL;
+		rspamd_session_destroy (task->s);
+	}
+
+	g_ptr_array_free (bulk->finished, TRUE);
+	g_ptr_array_free (bulk->running, TRUE);
+	g_array_free (bulk->messages, TRUE);
+	rspamd_http_message_unref (bulk->msg);
+	bulk->session->bulk = NULL;
+	g_free (bulk);
+}
+
+static void
+rspamd_controller_bulk_learn_step (gint fd, short what, gpointer ud)
+{
+	struct rspamd_controller_bulk_learn *bulk = ud;
+	struct rspamd_controller_session *session = bulk->session;
+	struct rspamd_http_connection_entry *conn_ent = bulk->conn_ent;
+	struct rspamd_task *task;
+	ucl_object_t *top;
+	guint i;
+
+	PTR_ARRAY_FOREACH (bulk->finished, i, task) {
+		rspamd_session_destroy (task->s);
+	}
+
+	g_ptr_array_set_size (bulk->finished, 0);
+
+	while (bulk->running->len < bulk->max_parallel &&
+			bulk->next < bulk->messages->len) {
+		rspamd_controller_bulk_learn_start (bulk);
+
+		if (bulk->next % BULK_LEARN_PROGRESS_STEP == 0) {
+			msg_info_session ("bulk learn as %s: started %ud of %ud messages; "
+					"learned: %ud, skipped: %ud, failed: %ud",
+					bulk->is_spam ? "spam" : "ham",
+					bulk->next, bulk->messages->len,
+					bulk->learned, bulk->skipped, bulk->failed);
+		}
+	}
+
+	if (bulk->running->len == 0 && bulk->finished->len == 0 &&
+			bulk->next >= bulk->messages->len) {
+		msg_info_session ("<%s> bulk learned %ud messages as %s in %.2f seconds; "
+				"learned: %ud, skipped: %ud, failed: %ud",
+				rspamd_inet_address_to_string (session->from_addr),
+				bulk->messages->len,
+				bulk->is_spam ? "spam" : "ham",
+				rspamd_get_ticks (FALSE) - bulk->start_time,
+				bulk->learned, bulk->skipped, bulk->failed);
+
+		top = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (top, ucl_object_frombool (true),
+				"success", 0, false);
+		ucl_object_insert_key (top, ucl_object_fromint (bulk->messages->len),
+				"total", 0, false);
+		ucl_object_insert_key (top, ucl_object_fromint (bulk->learned),
+				"learned", 0, false);
+		ucl_object_insert_key (top, ucl_object_fromint (bulk->skipped),
+				"skipped", 0, false);
+		ucl_object_insert_key (top, ucl_object_fromint (bulk->failed),
+				"failed", 0, false);
+		ucl_object_insert_key (top, ucl_object_fromdouble (
+				rspamd_get_ticks (FALSE) - bulk->start_time),
+				"time", 0, false);
+
+		rspamd_controller_bulk_learn_free (bulk);
+		rspamd_controller_send_ucl (conn_ent, top);
+		ucl_object_unref (top);
+	}
+}
+
+static void
+rspamd_controller_bulk_learn_schedule (struct rspamd_controller_bulk_learn *bulk)
+{
+	struct timeval tv = {0, 0};
+
+	if (!rspamd_event_pending (&bulk->step_ev, EV_TIMEOUT)) {
+		event_add (&bulk->step_ev, &tv);
+	}
+}
+
+static int
+rspamd_controller_handle_learn_bulk_common (
+	struct rspamd_http_connection_entry *conn_ent,
+	struct rspamd_http_message *msg,
+	gboolean is_spam)
+{
+	struct rspamd_controller_session *session = conn_ent->ud;
+	struct rspamd_controller_worker_ctx *ctx;
+	struct rspamd_controller_bulk_learn *bulk;
+	const rspamd_ftok_t *cl_header;
+	GArray *messages;
+	gsize len;
+	const gchar *body;
+
+	ctx = session->ctx;
+
+	if (!rspamd_controller_check_password (conn_ent, session, msg, TRUE)) {
+		return 0;
+	}
+
+	body = rspamd_http_message_get_body (msg, &len);
+
+	if (body == NULL) {
+		msg_err_session ("got zero length body, cannot continue");
+		rspamd_controller_send_error (conn_ent,
+			400,
+			"Empty body is not permitted");
+		return 0;
+	}
+
+	messages = rspamd_controller_split_mbox (body, len);
+
+	if (messages == NULL || messages->len == 0) {
+		if (messages) {
+			g_array_free (messages, TRUE);
+		}
+
+		rspamd_controller_send_error (conn_ent,
+				400,
+				"Body is not in mbox format");
+		return 0;
+	}
+
+	cl_header = rspamd_http_message_find_header (msg, "classifier");
+
+	if (cl_header) {
+		session->classifier = rspamd_mempool_ftokdup (session->pool, cl_header);
+	}
+	else {
+		session->classifier = NULL;
+	}
+
+	bulk = g_malloc0 (sizeof (*bulk));
+	bulk->session = session;
+	bulk->conn_ent = conn_ent;
+	bulk->msg = rspamd_http_message_ref (msg);
+	bulk->messages = messages;
+	bulk->running = g_ptr_array_new ();
+	bulk->finished = g_ptr_array_new ();
+	bulk->max_parallel = MAX (ctx->bulk_learn_parallel, 1);
+	bulk->is_spam = is_spam;
+	bulk->start_time = rspamd_get_ticks (FALSE);
+	session->is_spam = is_spam;
+	session->bulk = bulk;
+
+	event_set (&bulk->step_ev, -1, EV_TIMEOUT, rspamd_controller_bulk_learn_step,
+			bulk);
+	event_base_set (ctx->ev_base, &bulk->step_ev);
+
+	msg_info_session ("start bulk learn of %ud messages as %s",
+			messages->len, is_spam ? "spam" : "ham");
+	rspamd_controller_bulk_learn_step (-1, EV_TIMEOUT, bulk);
+
+	return 0;
+}
+
+/*
+ * Learn spam command handler:
+ * request: /learnspam
+ * headers: Password
+ * input: plaintext data
+ * reply: json {"success":true} or {"error":"error message"}
+ */
+static int
+rspamd_controller_handle_learnspam (
+	struct rspamd_http_connection_entry *conn_ent,
+	struct rspamd_http_message *msg)
+{
+	return rspamd_controller_handle_learn_common (conn_ent, msg, TRUE);
+}
+/*
+ * Learn ham command handler:
+ * request: /learnham
+ * headers: Password
+ * input: plaintext data
+ * reply: json {"success":true} or {"error":"error message"}
+ */
+static int
+rspamd_controller_handle_learnham (
+	struct rspamd_http_connection_entry *conn_ent,
+	struct rspamd_http_message *msg)
+{
+	return rspamd_controller_handle_learn_common (conn_ent, msg, FALSE);
+}
+
+/*
+ * Bulk learn spam command handler:
+ * request: /learnspambulk
+ * headers: Password
+ * input: messages in mbox format
+ * reply: json {"success":true,"total":N,"learned":N,"skipped":N,"failed":N,
+ * "time":N} or {"error":"error message"}
+ */
+static int
+rspamd_controller_handle_learnspam_bulk (
+	struct rspamd_http_connection_entry *conn_ent,
+	struct rspamd_http_message *msg)
+{
+	return rspamd_controller_handle_learn_bulk_common (conn_ent, msg, TRUE);
+}
+
+/*
+ * Bulk learn ham command handler:
+ * request: /learnhambulk
+ * headers: Password
+ * input: messages in mbox format
+ * reply: json {"success":true,"total":N,"learned":N,"skipped":N,"failed":N,
+ * "time":N} or {"error":"error message"}
+ */
+static int
+rspamd_controller_handle_learnham_bulk (
+	struct rspamd_http_connection_entry *conn_ent,
+	struct rspamd_http_message *msg)
+{
+	return rspamd_controller_handle_learn_bulk_common (conn_ent, msg, FALSE);
+}
+
+/*
+ * Scan command handler:
+ * request: /scan
+ * headers: Password
+ * input: plaintext data
+ * reply: json {scan data} or {"error":"error message"}
+ */
+static int
+rspamd_controller_handle_scan (struct rspamd_http_connection_entry *conn_ent,
+	struct rspamd_http_message *msg)
+{
+	struct rspamd_controller_session *session = conn_ent->ud;
+	struct rspamd_controller_worker_ctx *ctx;
+	struct rspamd_task *task;
+
+	ctx = session->ctx;
+
+	if (!rspamd_controller_check_password (conn_ent, session, msg, FALSE)) {
+		return 0;
+	}
+
+	if (rspamd_http_message_get_body (msg, NULL) == NULL) {
+		msg_err_session ("got zero length body, cannot continue");
+		rspamd_controller_send_error (conn_ent,
+			400,
+			"Empty body is not permitted");
+		return 0;
+	}
+
+	if (rspamd_controller_forward_task (conn_ent, msg, FALSE, FALSE)) {
+		return 0;
 	}
 
 	task = rspamd_task_new (session->ctx->worker, session->cfg, session->pool,
@@ -2136,6 +2912,69 @@ end:
 	return 0;
 }
 
+/*
+ * Classify command handler, message is processed merely to obtain
+ * statistical tokens and only classifiers are checked:
+ * request: /classify
+ * headers: Password
+ * input: plaintext data
+ * reply: json {scan data} or {"error":"error message"}
+ */
+static int
+rspamd_controller_handle_classify (struct rspamd_http_connection_entry *conn_ent,
+	struct rspamd_http_message *msg)
+{
+	struct rspamd_controller_session *session = conn_ent->ud;
+	struct rspamd_controller_worker_ctx *ctx;
+	struct rspamd_task *task;
+
+	ctx = session->ctx;
+
+	if (!rspamd_controller_check_password (conn_ent, session, msg, FALSE)) {
+		return 0;
+	}
+
+	if (rspamd_http_message_get_body (msg, NULL) == NULL) {
+		msg_err_session ("got zero length body, cannot continue");
+		rspamd_controller_send_error (conn_ent,
+			400,
+			"Empty body is not permitted");
+		return 0;
+	}
+
+	task = rspamd_task_new (session->ctx->worker, session->cfg, session->pool,
+			ctx->lang_det, ctx->ev_base);
+
+	task->resolver = ctx->resolver;
+	task->s = rspamd_session_create (session->pool,
+			rspamd_controller_classify_fin_task,
+			NULL,
+			(event_finalizer_t )rspamd_task_free,
+			task);
+	task->fin_arg = conn_ent;
+	task->http_conn = rspamd_http_connection_ref (conn_ent->conn);
+	task->sock = conn_ent->conn->fd;
+	task->flags |= RSPAMD_TASK_FLAG_MIME|RSPAMD_TASK_FLAG_TOKENIZE_ONLY;
+
+	if (!rspamd_protocol_handle_request (task, msg)) {
+		goto end;
+	}
+
+	if (!rspamd_task_load_message (task, msg, msg->body_buf.begin, msg->body_buf.len)) {
+		goto end;
+	}
+
+	if (!rspamd_task_process (task, RSPAMD_TASK_PROCESS_CLASSIFY)) {
+		goto end;
+	}
+
+end:
+	session->task = task;
+	rspamd_session_pending (task->s);
+
+	return 0;
+}
+
 /*
  * Save actions command handler:
  * request: /saveactions
@@ -2360,6 +3199,8 @@ rspamd_controller_handle_savesymbols (
 	ucl_object_iterate_free (iter);
 
 	if (added > 0) {
+		rspamd_symcache_update_weights (ctx->cfg->cache);
+
 		if (ctx->cfg->dynamic_conf) {
 			if (dump_dynamic_config (ctx->cfg)) {
 				msg_info_session ("<%s> modified %d symbols",
@@ -2562,6 +3403,31 @@ rspamd_controller_stat_cleanup_task (void *ud)
 	ucl_object_unref (cbdata->top);
 }
 
+/* Upstreams as they are seen by the controller process */
+static void
+rspamd_controller_stat_upstream_cb (struct upstream *up, guint idx, void *ud)
+{
+	ucl_object_t *ar = ud, *obj;
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (obj,
+			ucl_object_fromstring (rspamd_upstream_name (up)),
+			"name", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_frombool (rspamd_upstream_is_alive (up)),
+			"alive", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromint (rspamd_upstream_get_errors (up)),
+			"errors", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble (rspamd_upstream_get_latency (up)),
+			"latency", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble (rspamd_upstream_get_latency_p95 (up)),
+			"latency_p95", 0, false);
+	ucl_array_append (ar, obj);
+}
+
 /*
  * Stat command handler:
  * request: /stat (/resetstat)
@@ -2649,6 +3515,69 @@ rspamd_controller_handle_stat_common (
 		ucl_object_fromint (stat->control_connections_count),
 		"control_connections", 0, false);
 
+	sub = ucl_object_typed_new (UCL_ARRAY);
+
+	for (i = 0; i < RSPAMD_MAX_WORKERS_STAT; i ++) {
+		const struct rspamd_worker_stat *ws = &stat->workers[i];
+		struct rspamd_worker_usage usage;
+		ucl_object_t *wobj;
+
+		if (ws->pid <= 0) {
+			continue;
+		}
+
+		rspamd_worker_stat_read_usage (ws, &usage);
+
+		wobj = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (wobj,
+				ucl_object_fromstring (g_quark_to_string (ws->type)),
+				"type", 0, false);
+		ucl_object_insert_key (wobj, ucl_object_fromint (ws->index),
+				"index", 0, false);
+		ucl_object_insert_key (wobj, ucl_object_fromint (ws->pid),
+				"pid", 0, false);
+		ucl_object_insert_key (wobj, ucl_object_fromint (ws->connections_count),
+				"connections", 0, false);
+		ucl_object_insert_key (wobj, ucl_object_fromint (ws->inflight),
+				"inflight", 0, false);
+		ucl_object_insert_key (wobj, ucl_object_fromint (ws->shed_count),
+				"shed", 0, false);
+		ucl_object_insert_key (wobj, ucl_object_frombool (ws->overloaded),
+				"overloaded", 0, false);
+		ucl_object_insert_key (wobj, ucl_object_fromdouble (ws->loop_lag),
+				"loop_lag", 0, false);
+		ucl_object_insert_key (wobj, ucl_object_fromdouble (ws->cpu_load),
+				"cpu_load", 0, false);
+
+		if (ws->numa_node >= 0) {
+			ucl_object_insert_key (wobj, ucl_object_fromint (ws->numa_node),
+					"numa_node", 0, false);
+		}
+
+		if (ws->cpus[0] != '\0') {
+			ucl_object_insert_key (wobj, ucl_object_fromstring (ws->cpus),
+					"cpus", 0, false);
+		}
+		ucl_object_insert_key (wobj, ucl_object_fromdouble (usage.utime),
+				"utime", 0, false);
+		ucl_object_insert_key (wobj, ucl_object_fromdouble (usage.systime),
+				"systime", 0, false);
+		ucl_object_insert_key (wobj, ucl_object_fromint (usage.maxrss),
+				"maxrss", 0, false);
+		ucl_object_insert_key (wobj, ucl_object_fromint (usage.lua_mem),
+				"lua_mem", 0, false);
+		ucl_array_append (sub, wobj);
+	}
+
+	ucl_object_insert_key (top, sub, "workers", 0, false);
+
+	if (session->cfg->ups_ctx) {
+		sub = ucl_object_typed_new (UCL_ARRAY);
+		rspamd_upstream_ctx_foreach (session->cfg->ups_ctx,
+				rspamd_controller_stat_upstream_cb, sub);
+		ucl_object_insert_key (top, sub, "upstreams", 0, false);
+	}
+
 	ucl_object_insert_key (top,
 		ucl_object_fromint (mem_st.pools_allocated), "pools_allocated", 0,
 		false);
@@ -2671,11 +3600,32 @@ rspamd_controller_handle_stat_common (
 	ucl_object_insert_key (top,
 			ucl_object_fromint (mem_st.fragmented_size), "fragmented", 0, false);
 
+	sub = rspamd_images_cache_stat (session->cfg, do_reset);
+
+	if (sub) {
+		ucl_object_insert_key (top, sub, "images_cache", 0, false);
+	}
+
+	sub = rspamd_dns_cache_stat (session->cfg, do_reset);
+
+	if (sub) {
+		ucl_object_insert_key (top, sub, "dns_cache", 0, false);
+	}
+
+	ucl_object_insert_key (top, rspamd_shared_caches_stat (do_reset),
+			"shared_caches", 0, false);
+
 	if (do_reset) {
 		session->ctx->srv->stat->messages_scanned = 0;
 		session->ctx->srv->stat->messages_learned = 0;
 		session->ctx->srv->stat->connections_count = 0;
 		session->ctx->srv->stat->control_connections_count = 0;
+
+		for (i = 0; i < RSPAMD_MAX_WORKERS_STAT; i ++) {
+			session->ctx->srv->stat->workers[i].connections_count = 0;
+			session->ctx->srv->stat->workers[i].shed_count = 0;
+		}
+
 		rspamd_mempool_stat_reset ();
 	}
 
@@ -2734,6 +3684,55 @@ rspamd_controller_handle_counters (
 	struct rspamd_controller_session *session = conn_ent->ud;
 	ucl_object_t *top;
 	struct rspamd_symcache *cache;
+	GHashTable *query;
+	rspamd_ftok_t srch, *value;
+	gboolean histograms = FALSE;
+
+	if (!rspamd_controller_check_password (conn_ent, session, msg, FALSE)) {
+		return 0;
+	}
+
+	cache = session->ctx->cfg->cache;
+	query = rspamd_http_message_parse_query (msg);
+
+	if (query) {
+		srch.begin = (gchar *)"histograms";
+		srch.len = sizeof ("histograms") - 1;
+		value = g_hash_table_lookup (query, &srch);
+
+		if (value && value->len > 0 && value->begin[0] != '0') {
+			histograms = TRUE;
+		}
+
+		g_hash_table_unref (query);
+	}
+
+	if (cache != NULL) {
+		top = rspamd_symcache_counters_full (cache, histograms);
+		rspamd_controller_send_ucl (conn_ent, top);
+		ucl_object_unref (top);
+	}
+	else {
+		rspamd_controller_send_error (conn_ent, 500, "Invalid cache");
+	}
+
+	return 0;
+}
+
+/*
+ * Histograms command handler:
+ * request: /histograms
+ * headers: Password
+ * reply: symbols execution time histograms in Prometheus text format
+ */
+static int
+rspamd_controller_handle_histograms (
+	struct rspamd_http_connection_entry *conn_ent,
+	struct rspamd_http_message *msg)
+{
+	struct rspamd_controller_session *session = conn_ent->ud;
+	struct rspamd_symcache *cache;
+	rspamd_fstring_t *reply;
 
 	if (!rspamd_controller_check_password (conn_ent, session, msg, FALSE)) {
 		return 0;
@@ -2742,7 +3741,441 @@ rspamd_controller_handle_counters (
 	cache = session->ctx->cfg->cache;
 
 	if (cache != NULL) {
-		top = rspamd_symcache_counters (cache);
+		reply = rspamd_fstring_sized_new (BUFSIZ);
+		rspamd_symcache_histograms_text (cache, &reply);
+		rspamd_controller_send_text (conn_ent, reply,
+				"text/plain; version=0.0.4");
+	}
+	else {
+		rspamd_controller_send_error (conn_ent, 500, "Invalid cache");
+	}
+
+	return 0;
+}
+
+static void
+rspamd_controller_metrics_label (rspamd_fstring_t **out, const gchar *s)
+{
+	const gchar *p;
+
+	for (p = s; *p != '\0'; p ++) {
+		switch (*p) {
+		case '\\':
+			*out = rspamd_fstring_append (*out, "\\\\", 2);
+			break;
+		case '"':
+			*out = rspamd_fstring_append (*out, "\\\"", 2);
+			break;
+		case '\n':
+			*out = rspamd_fstring_append (*out, "\\n", 2);
+			break;
+		default:
+			*out = rspamd_fstring_append (*out, p, 1);
+			break;
+		}
+	}
+}
+
+static void
+rspamd_controller_metrics_header (rspamd_fstring_t **out, const gchar *name,
+		const gchar *type, const gchar *help)
+{
+	rspamd_printf_fstring (out, "# HELP %s %s\n# TYPE %s %s\n",
+			name, help, name, type);
+}
+
+enum rspamd_controller_worker_metric {
+	RSPAMD_WORKER_METRIC_CONNECTIONS = 0,
+	RSPAMD_WORKER_METRIC_INFLIGHT,
+	RSPAMD_WORKER_METRIC_SHED,
+	RSPAMD_WORKER_METRIC_OVERLOADED,
+	RSPAMD_WORKER_METRIC_LOOP_LAG,
+	RSPAMD_WORKER_METRIC_CPU_LOAD,
+	RSPAMD_WORKER_METRIC_MAX,
+};
+
+static const struct {
+	const gchar *name;
+	const gchar *type;
+	const gchar *help;
+} rspamd_controller_worker_metrics[RSPAMD_WORKER_METRIC_MAX] = {
+	[RSPAMD_WORKER_METRIC_CONNECTIONS] = {
+		"rspamd_worker_connections_total", "counter",
+		"Connections accepted by a worker"},
+	[RSPAMD_WORKER_METRIC_INFLIGHT] = {
+		"rspamd_worker_inflight", "gauge",
+		"Tasks being processed by a worker"},
+	[RSPAMD_WORKER_METRIC_SHED] = {
+		"rspamd_worker_shed_total", "counter",
+		"Tasks rejected by admission control"},
+	[RSPAMD_WORKER_METRIC_OVERLOADED] = {
+		"rspamd_worker_overloaded", "gauge",
+		"Whether a worker is shedding load now"},
+	[RSPAMD_WORKER_METRIC_LOOP_LAG] = {
+		"rspamd_worker_loop_lag_seconds", "gauge",
+		"Smoothed event loop lag of a worker"},
+	[RSPAMD_WORKER_METRIC_CPU_LOAD] = {
+		"rspamd_worker_cpu_load", "gauge",
+		"Smoothed share of cpu time used by a worker"},
+};
+
+static void
+rspamd_controller_metrics_workers (rspamd_fstring_t **out,
+		const struct rspamd_stat *stat)
+{
+	const struct rspamd_worker_stat *ws;
+	guint i, j;
+
+	for (j = 0; j < RSPAMD_WORKER_METRIC_MAX; j ++) {
+		rspamd_controller_metrics_header (out,
+				rspamd_controller_worker_metrics[j].name,
+				rspamd_controller_worker_metrics[j].type,
+				rspamd_controller_worker_metrics[j].help);
+
+		for (i = 0; i < RSPAMD_MAX_WORKERS_STAT; i ++) {
+			ws = &stat->workers[i];
+
+			if (ws->pid <= 0) {
+				continue;
+			}
+
+			rspamd_printf_fstring (out,
+					"%s{type=\"%s\",index=\"%ud\",pid=\"%P\"} ",
+					rspamd_controller_worker_metrics[j].name,
+					g_quark_to_string (ws->type), ws->index, ws->pid);
+
+			switch (j) {
+			case RSPAMD_WORKER_METRIC_CONNECTIONS:
+				rspamd_printf_fstring (out, "%ud\n", ws->connections_count);
+				break;
+			case RSPAMD_WORKER_METRIC_INFLIGHT:
+				rspamd_printf_fstring (out, "%ud\n", ws->inflight);
+				break;
+			case RSPAMD_WORKER_METRIC_SHED:
+				rspamd_printf_fstring (out, "%ud\n", ws->shed_count);
+				break;
+			case RSPAMD_WORKER_METRIC_OVERLOADED:
+				rspamd_printf_fstring (out, "%d\n", ws->overloaded ? 1 : 0);
+				break;
+			case RSPAMD_WORKER_METRIC_LOOP_LAG:
+				rspamd_printf_fstring (out, "%.6f\n", ws->loop_lag);
+				break;
+			case RSPAMD_WORKER_METRIC_CPU_LOAD:
+				rspamd_printf_fstring (out, "%.6f\n", ws->cpu_load);
+				break;
+			default:
+				break;
+			}
+		}
+	}
+}
+
+static void
+rspamd_controller_metrics_stages (rspamd_fstring_t **out,
+		const struct rspamd_stat *stat)
+{
+	guint64 counts[RSPAMD_TASK_STAGE_HIST_BUCKETS], cumulative, sum_usec;
+	guint i, j, k;
+
+	rspamd_controller_metrics_header (out,
+			"rspamd_task_stage_duration_seconds", "histogram",
+			"Wall time of task processing stages");
+
+	for (j = 0; j < RSPAMD_TASK_STAGES_COUNT; j ++) {
+		memset (counts, 0, sizeof (counts));
+		cumulative = 0;
+		sum_usec = 0;
+
+		for (i = 0; i < RSPAMD_MAX_WORKERS_STAT; i ++) {
+			if (stat->workers[i].pid <= 0) {
+				continue;
+			}
+
+			for (k = 0; k < RSPAMD_TASK_STAGE_HIST_BUCKETS; k ++) {
+				counts[k] += stat->stages[i].hist[j][k];
+				cumulative += stat->stages[i].hist[j][k];
+			}
+
+			sum_usec += stat->stages[i].sum_usec[j];
+		}
+
+		if (cumulative == 0) {
+			continue;
+		}
+
+		cumulative = 0;
+
+		for (k = 0; k < RSPAMD_TASK_STAGE_HIST_BUCKETS; k ++) {
+			cumulative += counts[k];
+
+			if (k == RSPAMD_TASK_STAGE_HIST_BUCKETS - 1) {
+				rspamd_printf_fstring (out,
+						"rspamd_task_stage_duration_seconds_bucket"
+						"{stage=\"%s\",le=\"+Inf\"} %uL\n",
+						rspamd_task_stage_name (1 << j), cumulative);
+			}
+			else {
+				rspamd_printf_fstring (out,
+						"rspamd_task_stage_duration_seconds_bucket"
+						"{stage=\"%s\",le=\"%.6f\"} %uL\n",
+						rspamd_task_stage_name (1 << j),
+						rspamd_task_stage_hist_bound (k), cumulative);
+			}
+		}
+
+		rspamd_printf_fstring (out, "rspamd_task_stage_duration_seconds_sum"
+				"{stage=\"%s\"} %.6f\n",
+				rspamd_task_stage_name (1 << j), sum_usec / 1e6);
+		rspamd_printf_fstring (out, "rspamd_task_stage_duration_seconds_count"
+				"{stage=\"%s\"} %uL\n",
+				rspamd_task_stage_name (1 << j), cumulative);
+	}
+}
+
+static void
+rspamd_controller_metrics_upstream_alive_cb (struct upstream *up, guint idx,
+		void *ud)
+{
+	rspamd_fstring_t **out = ud;
+
+	rspamd_printf_fstring (out, "rspamd_upstream_alive{upstream=\"");
+	rspamd_controller_metrics_label (out, rspamd_upstream_name (up));
+	rspamd_printf_fstring (out, "\"} %d\n",
+			rspamd_upstream_is_alive (up) ? 1 : 0);
+}
+
+static void
+rspamd_controller_metrics_upstream_errors_cb (struct upstream *up, guint idx,
+		void *ud)
+{
+	rspamd_fstring_t **out = ud;
+
+	rspamd_printf_fstring (out, "rspamd_upstream_errors{upstream=\"");
+	rspamd_controller_metrics_label (out, rspamd_upstream_name (up));
+	rspamd_printf_fstring (out, "\"} %ud\n", rspamd_upstream_get_errors (up));
+}
+
+static void
+rspamd_controller_metrics_upstream_latency_cb (struct upstream *up, guint idx,
+		void *ud)
+{
+	rspamd_fstring_t **out = ud;
+
+	rspamd_printf_fstring (out, "rspamd_upstream_latency_seconds{upstream=\"");
+	rspamd_controller_metrics_label (out, rspamd_upstream_name (up));
+	rspamd_printf_fstring (out, "\",quantile=\"avg\"} %.6f\n",
+			rspamd_upstream_get_latency (up));
+	rspamd_printf_fstring (out, "rspamd_upstream_latency_seconds{upstream=\"");
+	rspamd_controller_metrics_label (out, rspamd_upstream_name (up));
+	rspamd_printf_fstring (out, "\",quantile=\"0.95\"} %.6f\n",
+			rspamd_upstream_get_latency_p95 (up));
+}
+
+static void
+rspamd_controller_metrics_maps (rspamd_fstring_t **out,
+		struct rspamd_config *cfg)
+{
+	GList *cur;
+	struct rspamd_map *map;
+
+	rspamd_controller_metrics_header (out, "rspamd_map_elements", "gauge",
+			"Number of elements loaded from a map");
+
+	for (cur = cfg->maps; cur != NULL; cur = g_list_next (cur)) {
+		map = cur->data;
+		rspamd_printf_fstring (out, "rspamd_map_elements{map=\"");
+		rspamd_controller_metrics_label (out, map->name ? map->name :
+				(map->description ? map->description : "unknown"));
+		rspamd_printf_fstring (out, "\",id=\"%ud\"} %uz\n", map->id, map->nelts);
+	}
+
+	rspamd_controller_metrics_header (out, "rspamd_map_next_check_timestamp",
+			"gauge", "Unix time of the next scheduled map check");
+
+	for (cur = cfg->maps; cur != NULL; cur = g_list_next (cur)) {
+		map = cur->data;
+		rspamd_printf_fstring (out, "rspamd_map_next_check_timestamp{map=\"");
+		rspamd_controller_metrics_label (out, map->name ? map->name :
+				(map->description ? map->description : "unknown"));
+		rspamd_printf_fstring (out, "\",id=\"%ud\"} %T\n", map->id,
+				map->next_check);
+	}
+}
+
+/*
+ * Metrics command handler:
+ * request: /metrics
+ * headers: Password
+ * reply: server, workers, symbols, maps and upstreams metrics in
+ * Prometheus text format
+ */
+static int
+rspamd_controller_handle_metrics (
+	struct rspamd_http_connection_entry *conn_ent,
+	struct rspamd_http_message *msg)
+{
+	struct rspamd_controller_session *session = conn_ent->ud;
+	struct rspamd_config *cfg = session->ctx->cfg;
+	const struct rspamd_lua_gc_stat *gc_st;
+	struct rspamd_stat stat;
+	rspamd_mempool_stat_t mem_st;
+	rspamd_fstring_t *reply;
+	gint i;
+
+	if (!rspamd_controller_check_password (conn_ent, session, msg, FALSE)) {
+		return 0;
+	}
+
+	memcpy (&stat, session->ctx->srv->stat, sizeof (stat));
+	memset (&mem_st, 0, sizeof (mem_st));
+	rspamd_mempool_stat (&mem_st);
+	reply = rspamd_fstring_sized_new (BUFSIZ * 4);
+
+	rspamd_controller_metrics_header (&reply, "rspamd_scanned_total",
+			"counter", "Messages scanned");
+	rspamd_printf_fstring (&reply, "rspamd_scanned_total %ud\n",
+			stat.messages_scanned);
+	rspamd_controller_metrics_header (&reply, "rspamd_learned_total",
+			"counter", "Messages learned");
+	rspamd_printf_fstring (&reply, "rspamd_learned_total %ud\n",
+			stat.messages_learned);
+	rspamd_controller_metrics_header (&reply, "rspamd_actions_total",
+			"counter", "Messages scanned per action");
+
+	for (i = METRIC_ACTION_REJECT; i <= METRIC_ACTION_NOACTION; i++) {
+		rspamd_printf_fstring (&reply, "rspamd_actions_total{action=\"%s\"} %ud\n",
+				rspamd_action_to_str (i), stat.actions_stat[i]);
+	}
+
+	rspamd_controller_metrics_header (&reply, "rspamd_connections_total",
+			"counter", "Connections to scanners");
+	rspamd_printf_fstring (&reply, "rspamd_connections_total %ud\n",
+			stat.connections_count);
+	rspamd_controller_metrics_header (&reply,
+			"rspamd_control_connections_total",
+			"counter", "Connections to the control interface");
+	rspamd_printf_fstring (&reply, "rspamd_control_connections_total %ud\n",
+			stat.control_connections_count);
+
+	rspamd_controller_metrics_workers (&reply, &stat);
+
+	if (stat.stages) {
+		rspamd_controller_metrics_stages (&reply, &stat);
+	}
+
+	/* Memory of this process */
+	rspamd_controller_metrics_header (&reply, "rspamd_mempool_pools",
+			"gauge", "Memory pools allocated and freed");
+	rspamd_printf_fstring (&reply,
+			"rspamd_mempool_pools{state=\"allocated\"} %ud\n"
+			"rspamd_mempool_pools{state=\"freed\"} %ud\n",
+			mem_st.pools_allocated, mem_st.pools_freed);
+	rspamd_controller_metrics_header (&reply, "rspamd_mempool_chunks",
+			"gauge", "Memory pool chunks by state");
+	rspamd_printf_fstring (&reply,
+			"rspamd_mempool_chunks{state=\"allocated\"} %ud\n"
+			"rspamd_mempool_chunks{state=\"shared\"} %ud\n"
+			"rspamd_mempool_chunks{state=\"freed\"} %ud\n"
+			"rspamd_mempool_chunks{state=\"oversized\"} %ud\n",
+			mem_st.chunks_allocated, mem_st.shared_chunks_allocated,
+			mem_st.chunks_freed, mem_st.oversized_chunks);
+	rspamd_controller_metrics_header (&reply, "rspamd_mempool_bytes",
+			"gauge", "Memory pool bytes allocated and wasted by fragmentation");
+	rspamd_printf_fstring (&reply,
+			"rspamd_mempool_bytes{state=\"allocated\"} %ud\n"
+			"rspamd_mempool_bytes{state=\"fragmented\"} %ud\n",
+			mem_st.bytes_allocated, mem_st.fragmented_size);
+
+	if (cfg->lua_state) {
+		gc_st = rspamd_lua_gc_get_stat ();
+		rspamd_controller_metrics_header (&reply, "rspamd_lua_memory_bytes",
+				"gauge", "Memory used by Lua");
+		rspamd_printf_fstring (&reply, "rspamd_lua_memory_bytes %uL\n",
+				(guint64)lua_gc (cfg->lua_state, LUA_GCCOUNT, 0) * 1024 +
+				lua_gc (cfg->lua_state, LUA_GCCOUNTB, 0));
+		rspamd_controller_metrics_header (&reply, "rspamd_lua_gc_steps_total",
+				"counter", "Incremental Lua GC steps");
+		rspamd_printf_fstring (&reply, "rspamd_lua_gc_steps_total %uL\n",
+				gc_st->steps);
+		rspamd_controller_metrics_header (&reply, "rspamd_lua_gc_seconds_total",
+				"counter", "Time spent in incremental Lua GC steps");
+		rspamd_printf_fstring (&reply, "rspamd_lua_gc_seconds_total %.6f\n",
+				gc_st->total_time);
+		rspamd_controller_metrics_header (&reply,
+				"rspamd_lua_gc_max_pause_seconds",
+				"gauge", "Longest incremental Lua GC step");
+		rspamd_printf_fstring (&reply, "rspamd_lua_gc_max_pause_seconds %.6f\n",
+				gc_st->max_pause);
+	}
+
+	if (cfg->ups_ctx) {
+		rspamd_controller_metrics_header (&reply, "rspamd_upstream_alive",
+				"gauge", "Whether an upstream is alive");
+		rspamd_upstream_ctx_foreach (cfg->ups_ctx,
+				rspamd_controller_metrics_upstream_alive_cb, &reply);
+		rspamd_controller_metrics_header (&reply, "rspamd_upstream_errors",
+				"gauge", "Recent errors of an upstream");
+		rspamd_upstream_ctx_foreach (cfg->ups_ctx,
+				rspamd_controller_metrics_upstream_errors_cb, &reply);
+		rspamd_controller_metrics_header (&reply,
+				"rspamd_upstream_latency_seconds",
+				"gauge", "Average and 95th percentile latency of an upstream");
+		rspamd_upstream_ctx_foreach (cfg->ups_ctx,
+				rspamd_controller_metrics_upstream_latency_cb, &reply);
+	}
+
+	rspamd_controller_metrics_maps (&reply, cfg);
+
+	if (cfg->cache) {
+		rspamd_symcache_counters_text (cfg->cache, &reply);
+		rspamd_symcache_histograms_text (cfg->cache, &reply);
+	}
+
+	rspamd_controller_send_text (conn_ent, reply,
+			"text/plain; version=0.0.4");
+
+	return 0;
+}
+
+/*
+ * Regexps command handler:
+ * request: /regexps?limit=N
+ * headers: Password
+ * reply: the most expensive regexps according to pcre execution costs
+ */
+static int
+rspamd_controller_handle_regexps (
+	struct rspamd_http_connection_entry *conn_ent,
+	struct rspamd_http_message *msg)
+{
+	struct rspamd_controller_session *session = conn_ent->ud;
+	struct rspamd_re_cache *cache;
+	ucl_object_t *top;
+	GHashTable *query;
+	rspamd_ftok_t srch, *value;
+	gulong limit = 100;
+
+	if (!rspamd_controller_check_password (conn_ent, session, msg, FALSE)) {
+		return 0;
+	}
+
+	cache = session->ctx->cfg->re_cache;
+	query = rspamd_http_message_parse_query (msg);
+
+	if (query) {
+		srch.begin = (gchar *)"limit";
+		srch.len = sizeof ("limit") - 1;
+		value = g_hash_table_lookup (query, &srch);
+
+		if (value && !rspamd_strtoul (value->begin, value->len, &limit)) {
+			limit = 100;
+		}
+
+		g_hash_table_unref (query);
+	}
+
+	if (cache != NULL) {
+		top = rspamd_re_cache_costs (cache, limit);
 		rspamd_controller_send_ucl (conn_ent, top);
 		ucl_object_unref (top);
 	}
@@ -3019,6 +4452,16 @@ rspamd_controller_finish_handler (struct rspamd_http_connection_entry *conn_ent)
 		rspamd_session_destroy (session->task->s);
 	}
 
+	if (session->bulk != NULL) {
+		/* Client has gone before bulk learn has been finished */
+		rspamd_controller_bulk_learn_free (session->bulk);
+	}
+
+	if (session->forward != NULL) {
+		/* Client has gone before scanner has replied */
+		rspamd_controller_forward_free (session->forward);
+	}
+
 	session->wrk->nconns --;
 	rspamd_inet_address_free (session->from_addr);
 	REF_RELEASE (session->cfg);
@@ -3052,6 +4495,7 @@ rspamd_controller_accept_socket (gint fd, short what, void *arg)
 		return;
 	}
 
+	rspamd_worker_count_connection (worker);
 	session = g_malloc0 (sizeof (struct rspamd_controller_session));
 	session->pool = rspamd_mempool_new (rspamd_mempool_suggest_size (),
 			"csession");
@@ -3071,26 +4515,57 @@ static void
 rspamd_controller_rrd_update (gint fd, short what, void *arg)
 {
 	struct rspamd_controller_worker_ctx *ctx = arg;
+	struct rspamd_controller_rrd_source *src;
 	struct rspamd_stat *stat;
 	GArray ar;
-	gdouble points[METRIC_ACTION_MAX];
+	gdouble *points;
+	guint64 hits;
 	GError *err = NULL;
-	guint i;
+	guint i, npoints;
 
 	g_assert (ctx->rrd != NULL);
 	stat = ctx->srv->stat;
+	npoints = METRIC_ACTION_MAX + ctx->rrd_sources->len;
+	points = g_alloca (npoints * sizeof (*points));
 
 	for (i = METRIC_ACTION_REJECT; i < METRIC_ACTION_MAX; i ++) {
 		points[i] = stat->actions_stat[i];
 	}
 
+	for (i = 0; i < ctx->rrd_sources->len; i ++) {
+		src = &g_array_index (ctx->rrd_sources,
+				struct rspamd_controller_rrd_source, i);
+
+		if (src->symbol == NULL) {
+			/* Seconds spent to scan messages with this action */
+			points[METRIC_ACTION_MAX + i] = stat->actions_time[src->action] / 1e6;
+		}
+		else if (ctx->cfg->cache && rspamd_symcache_symbol_hits (ctx->cfg->cache,
+				src->symbol, &hits)) {
+			src->last = MAX (src->last, hits);
+			points[METRIC_ACTION_MAX + i] = src->last;
+		}
+		else {
+			points[METRIC_ACTION_MAX + i] = NAN;
+		}
+	}
+
 	ar.data = (gchar *)points;
-	ar.len = sizeof (points);
+	ar.len = npoints * sizeof (*points);
 
-	if (!rspamd_rrd_add_record (ctx->rrd, &ar, rspamd_get_calendar_ticks (),
+	if (!rspamd_rrd_queue_record (ctx->rrd, &ar, rspamd_get_calendar_ticks (),
 			&err)) {
 		msg_err_ctx ("cannot update rrd file: %e", err);
 		g_error_free (err);
+		err = NULL;
+	}
+	else if (++ctx->rrd_queued >= RRD_FLUSH_RECORDS) {
+		ctx->rrd_queued = 0;
+
+		if (!rspamd_rrd_flush (ctx->rrd, &err)) {
+			msg_err_ctx ("cannot update rrd file: %e", err);
+			g_error_free (err);
+		}
 	}
 
 	/* Plan new event */
@@ -3098,6 +4573,51 @@ rspamd_controller_rrd_update (gint fd, short what, void *arg)
 	evtimer_add (ctx->rrd_event, &rrd_update_time);
 }
 
+/*
+ * Configures extra rrd data sources: scan time of each action and
+ * hits of the selected symbols
+ */
+static GArray *
+rspamd_controller_rrd_extra_ds (struct rspamd_controller_worker_ctx *ctx)
+{
+	GArray *ds;
+	struct rrd_ds_def def;
+	struct rspamd_controller_rrd_source src;
+	gchar name[RRD_DS_NAM_SIZE];
+	GList *cur;
+	guint i;
+
+	ds = g_array_new (FALSE, FALSE, sizeof (def));
+	ctx->rrd_sources = g_array_new (FALSE, FALSE, sizeof (src));
+
+	if (ctx->cfg->rrd_latency) {
+		for (i = METRIC_ACTION_REJECT; i < METRIC_ACTION_MAX; i ++) {
+			rspamd_snprintf (name, sizeof (name), "time_%s",
+					rspamd_action_to_str (i));
+			g_strdelimit (name, " ", '_');
+			rrd_make_default_ds (name, rrd_dst_to_string (RRD_DST_COUNTER),
+					1, &def);
+			g_array_append_val (ds, def);
+			memset (&src, 0, sizeof (src));
+			src.action = i;
+			g_array_append_val (ctx->rrd_sources, src);
+		}
+	}
+
+	for (cur = ctx->cfg->rrd_symbols; cur != NULL; cur = g_list_next (cur)) {
+		/* Names are truncated to the rrd limit */
+		rspamd_snprintf (name, sizeof (name), "sym_%s", (gchar *)cur->data);
+		rrd_make_default_ds (name, rrd_dst_to_string (RRD_DST_COUNTER),
+				1, &def);
+		g_array_append_val (ds, def);
+		memset (&src, 0, sizeof (src));
+		src.symbol = cur->data;
+		g_array_append_val (ctx->rrd_sources, src);
+	}
+
+	return ds;
+}
+
 static void
 rspamd_controller_load_saved_stats (struct rspamd_controller_worker_ctx *ctx)
 {
@@ -3168,7 +4688,8 @@ rspamd_controller_load_saved_stats (struct rspamd_controller_worker_ctx *ctx)
 	}
 
 	ucl_object_unref (obj);
-	memcpy (stat, &stat_copy, sizeof (stat_copy));
+	/* Per worker counters are owned by the main process, do not touch them */
+	memcpy (stat, &stat_copy, G_STRUCT_OFFSET (struct rspamd_stat, workers));
 }
 
 static void
@@ -3276,6 +4797,7 @@ init_controller_worker (struct rspamd_config *cfg)
 
 	ctx->magic = rspamd_controller_ctx_magic;
 	ctx->timeout = DEFAULT_WORKER_IO_TIMEOUT;
+	ctx->bulk_learn_parallel = DEFAULT_BULK_LEARN_PARALLEL;
 
 	rspamd_rcl_register_worker_option (cfg,
 			type,
@@ -3380,6 +4902,38 @@ init_controller_worker (struct rspamd_config *cfg)
 			0,
 			"Directory where controller saves server's statistics between restarts");
 
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"bulk_learn_parallel",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_controller_worker_ctx,
+					bulk_learn_parallel),
+			RSPAMD_CL_FLAG_UINT,
+			"Number of messages learned in parallel by bulk learn commands");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"learn_tokenize_only",
+			rspamd_rcl_parse_struct_boolean,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_controller_worker_ctx,
+					learn_tokenize_only),
+			0,
+			"Skip urls, archives and other processing not required for "
+			"statistics when learning messages");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"scan_workers",
+			rspamd_rcl_parse_struct_ucl,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_controller_worker_ctx,
+					scan_workers),
+			0,
+			"Normal workers that process /scan and /learn requests instead "
+			"of controller (they must have allow_learn enabled)");
+
 	return ctx;
 }
 
@@ -3519,6 +5073,7 @@ rspamd_controller_on_terminate (struct rspamd_worker *worker)
 		msg_info ("closing rrd file: %s", ctx->rrd->filename);
 		event_del (ctx->rrd_event);
 		rspamd_rrd_close (ctx->rrd);
+		g_array_free (ctx->rrd_sources, TRUE);
 	}
 
 	return FALSE;
@@ -3627,6 +5182,25 @@ rspamd_controller_register_plugins_paths (struct rspamd_controller_worker_ctx *c
 	lua_pop (L, 1); /* rspamd_plugins global */
 }
 
+/* Native expiry is delegated to a dedicated worker if it is configured */
+static gboolean
+rspamd_controller_has_expiry_worker (struct rspamd_config *cfg)
+{
+	struct rspamd_worker_conf *cf;
+	GList *cur;
+	GQuark type = g_quark_try_string ("bayes_expiry");
+
+	for (cur = cfg->workers; cur != NULL; cur = g_list_next (cur)) {
+		cf = cur->data;
+
+		if (cf->type == type && cf->enabled && cf->count > 0) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
 /*
  * Start worker process
  */
@@ -3664,6 +5238,18 @@ start_controller_worker (struct rspamd_worker *worker)
 				&ctx->secure_map, NULL);
 	}
 
+	if (ctx->scan_workers != NULL) {
+		ctx->scan_ups = rspamd_upstreams_create (ctx->cfg->ups_ctx);
+
+		if (!rspamd_upstreams_from_ucl (ctx->scan_ups, ctx->scan_workers,
+				11333, NULL)) {
+			msg_err_ctx ("cannot parse scan_workers, process scans and "
+					"learns locally");
+			rspamd_upstreams_destroy (ctx->scan_ups);
+			ctx->scan_ups = NULL;
+		}
+	}
+
 	if (ctx->saved_stats_path == NULL) {
 		/* Assume default path */
 		ctx->saved_stats_path = rspamd_mempool_strdup (worker->srv->cfg->cfg_pool,
@@ -3678,8 +5264,12 @@ start_controller_worker (struct rspamd_worker *worker)
 	/* RRD collector */
 	if (ctx->cfg->rrd_file && worker->index == 0) {
 		GError *rrd_err = NULL;
+		GArray *extra_ds;
 
-		ctx->rrd = rspamd_rrd_file_default (ctx->cfg->rrd_file, &rrd_err);
+		extra_ds = rspamd_controller_rrd_extra_ds (ctx);
+		ctx->rrd = rspamd_rrd_file_default_ds (ctx->cfg->rrd_file, extra_ds,
+				&rrd_err);
+		g_array_free (extra_ds, TRUE);
 
 		if (ctx->rrd) {
 			ctx->rrd_event = g_malloc0 (sizeof (*ctx->rrd_event));
@@ -3744,6 +5334,12 @@ start_controller_worker (struct rspamd_worker *worker)
 	rspamd_http_router_add_path (ctx->http,
 			PATH_LEARN_HAM,
 			rspamd_controller_handle_learnham);
+	rspamd_http_router_add_path (ctx->http,
+			PATH_LEARN_SPAM_BULK,
+			rspamd_controller_handle_learnspam_bulk);
+	rspamd_http_router_add_path (ctx->http,
+			PATH_LEARN_HAM_BULK,
+			rspamd_controller_handle_learnham_bulk);
 	rspamd_http_router_add_path (ctx->http,
 			PATH_SAVE_ACTIONS,
 			rspamd_controller_handle_saveactions);
@@ -3762,6 +5358,9 @@ start_controller_worker (struct rspamd_worker *worker)
 	rspamd_http_router_add_path (ctx->http,
 			PATH_CHECKV2,
 			rspamd_controller_handle_scan);
+	rspamd_http_router_add_path (ctx->http,
+			PATH_CLASSIFY,
+			rspamd_controller_handle_classify);
 	rspamd_http_router_add_path (ctx->http,
 			PATH_STAT,
 			rspamd_controller_handle_stat);
@@ -3771,6 +5370,15 @@ start_controller_worker (struct rspamd_worker *worker)
 	rspamd_http_router_add_path (ctx->http,
 			PATH_COUNTERS,
 			rspamd_controller_handle_counters);
+	rspamd_http_router_add_path (ctx->http,
+			PATH_HISTOGRAMS,
+			rspamd_controller_handle_histograms);
+	rspamd_http_router_add_path (ctx->http,
+			PATH_METRICS,
+			rspamd_controller_handle_metrics);
+	rspamd_http_router_add_path (ctx->http,
+			PATH_REGEXPS,
+			rspamd_controller_handle_regexps);
 	rspamd_http_router_add_path (ctx->http,
 			PATH_ERRORS,
 			rspamd_controller_handle_errors);
@@ -3829,6 +5437,11 @@ start_controller_worker (struct rspamd_worker *worker)
 			worker);
 	rspamd_stat_init (worker->srv->cfg, ctx->ev_base);
 
+	if (rspamd_worker_is_primary_controller (worker) &&
+			!rspamd_controller_has_expiry_worker (ctx->cfg)) {
+		rspamd_stat_start_expiry (ctx->cfg, ctx->ev_base);
+	}
+
 	if (worker->index == 0) {
 		if (!ctx->cfg->disable_monitored) {
 			rspamd_worker_init_monitored (worker, ctx->ev_base, ctx->resolver);
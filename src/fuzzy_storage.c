@@ -38,13 +38,26 @@
 #include "libutil/hash.h"
 #include "libutil/http_private.h"
 #include "unix-std.h"
+#include "contrib/zstd/zstd.h"
 
 /* Resync value in seconds */
 #define DEFAULT_SYNC_TIMEOUT 60.0
-#define DEFAULT_KEYPAIR_CACHE_SIZE 512
+#define DEFAULT_KEYPAIR_CACHE_SIZE 8192
 #define DEFAULT_MASTER_TIMEOUT 10.0
 #define DEFAULT_UPDATES_MAXFAIL 3
+#define DEFAULT_HOT_CACHE_TTL 10.0
+#define DEFAULT_IO_BATCH 16
+#define DEFAULT_REPLICATION_LOG_SIZE 128
+/* Should fit the largest multi-command frame */
+#define FUZZY_INPUT_BUFLEN RSPAMD_FUZZY_MULTI_MAX_LEN
+#define HOT_CACHE_PROBES 4
 #define COOKIE_SIZE 128
+/* Streaming replication frames, see rspamd_fuzzy_replication_serialize */
+#define FUZZY_REPLICATION_MAGIC "rsfr"
+#define FUZZY_REPLICATION_VERSION 1
+#define FUZZY_REPLICATION_FLAG_ZSTD (1u << 0)
+#define FUZZY_REPLICATION_COMPRESS_MIN 1024
+#define FUZZY_REPLICATION_MAX_LEN (256 * 1024 * 1024)
 
 static const gchar *local_db_name = "local";
 
@@ -98,6 +111,10 @@ struct fuzzy_global_stat {
 	guint64 fuzzy_hashes_found[RSPAMD_FUZZY_EPOCH_MAX];
 	/**< amount of hashes found by epoch				*/
 	guint64 invalid_requests;
+	guint64 hot_cache_hits;
+	guint64 hot_cache_misses;
+	guint64 updates_coalesced;
+	/**< updates merged with pending ones for the same digest	*/
 };
 
 struct fuzzy_key_stat {
@@ -109,10 +126,45 @@ struct fuzzy_key_stat {
 	rspamd_lru_hash_t *last_ips;
 };
 
+/*
+ * Element of the open addressing table of recently checked digests
+ */
+struct fuzzy_hot_cache_elt {
+	guchar digest[rspamd_cryptobox_HASHBYTES];
+	guint32 is_shingle;
+	guint64 expire;
+	struct rspamd_fuzzy_reply rep;
+};
+
+struct fuzzy_hot_cache {
+	struct fuzzy_hot_cache_elt *elts;
+	guint mask;
+};
+
 struct rspamd_fuzzy_mirror {
 	gchar *name;
 	struct upstream_list *u;
 	struct rspamd_cryptobox_pubkey *key;
+	/* 1 - http request per flush, 2 - replication stream */
+	guint version;
+	/* The last revision confirmed by the slave */
+	guint64 acked_rev;
+	gboolean rev_known;
+	gboolean in_flight;
+};
+
+RSPAMD_PACKED(fuzzy_replication_hdr) {
+	guchar magic[4];
+	guint32 version;
+	guint32 flags;
+	guint32 nbatches;
+	guint64 raw_len;
+};
+
+/* Updates applied by a single backend transaction */
+struct fuzzy_replication_batch {
+	guint64 rev;
+	GArray *updates;
 };
 
 static const guint64 rspamd_fuzzy_storage_magic = 0x291a3253eb1b3ea5ULL;
@@ -162,6 +214,17 @@ struct rspamd_fuzzy_storage_ctx {
 	rspamd_lru_hash_t *errors_ips;
 	struct rspamd_fuzzy_backend *backend;
 	GArray *updates_pending;
+	/* Recently applied batches to be streamed to mirrors, oldest first */
+	GQueue *replication_log;
+	guint replication_log_size;
+	/* Source -> the last revision received from the master stream */
+	GHashTable *master_revs;
+	/* Digest -> index + 1 of the last pending update for this digest */
+	GHashTable *updates_index;
+	/* Updates transaction is being executed by backend */
+	gboolean updates_in_flight;
+	/* Source of the flush requested while transaction was in flight */
+	gchar *updates_deferred_source;
 	guint updates_failed;
 	guint updates_maxfail;
 	guint32 collection_id;
@@ -169,6 +232,17 @@ struct rspamd_fuzzy_storage_ctx {
 	struct rspamd_http_connection_router *collection_rt;
 	const ucl_object_t *skip_map;
 	struct rspamd_hash_map_helper *skip_hashes;
+	guint hot_cache_size;
+	gdouble hot_cache_ttl;
+	struct fuzzy_hot_cache *hot_cache;
+	guint io_batch;
+	gboolean reuseport;
+	guchar **io_bufs;
+	/* Replies are collected here while a batch of datagrams is processed */
+	GPtrArray *replies_batch;
+	/* Sessions waiting for a single multi-check backend lookup */
+	GPtrArray *checks_batch;
+	GArray *reuseport_fds;
 	guchar cookie[COOKIE_SIZE];
 };
 
@@ -179,6 +253,8 @@ enum fuzzy_cmd_type {
 	CMD_ENCRYPTED_SHINGLE
 };
 
+struct fuzzy_multi_session;
+
 struct fuzzy_session {
 	struct rspamd_worker *worker;
 	rspamd_inet_addr_t *addr;
@@ -201,6 +277,27 @@ struct fuzzy_session {
 	struct event io;
 	ref_entry_t ref;
 	struct fuzzy_key_stat *key_stat;
+	/* Parent frame for commands received in a multi-command frame */
+	struct fuzzy_multi_session *multi;
+	guint multi_idx;
+	guchar nm[rspamd_cryptobox_MAX_NMBYTES];
+};
+
+/*
+ * Multi-command frame, each command is processed by its own fuzzy_session
+ * and a single encrypted reply is sent when all commands are finished
+ */
+struct fuzzy_multi_session {
+	struct rspamd_worker *worker;
+	rspamd_inet_addr_t *addr;
+	struct rspamd_fuzzy_storage_ctx *ctx;
+	guchar *reply;
+	gsize reply_len;
+	guint ncmds;
+	guint pending;
+	gint fd;
+	struct event io;
+	ref_entry_t ref;
 	guchar nm[rspamd_cryptobox_MAX_NMBYTES];
 };
 
@@ -225,11 +322,122 @@ struct fuzzy_master_update_session {
 	gchar *psrc;
 	rspamd_inet_addr_t *addr;
 	gboolean replied;
+	/* Update is a frame of the replication stream */
+	gboolean stream;
 	gint sock;
 };
 
 static void rspamd_fuzzy_write_reply (struct fuzzy_session *session);
 
+static struct fuzzy_hot_cache *
+rspamd_fuzzy_hot_cache_new (guint size)
+{
+	struct fuzzy_hot_cache *hc;
+	guint nelts = 1;
+
+	while (nelts < size) {
+		nelts <<= 1;
+	}
+
+	hc = g_malloc0 (sizeof (*hc));
+	hc->elts = g_malloc0 (sizeof (*hc->elts) * nelts);
+	hc->mask = nelts - 1;
+
+	return hc;
+}
+
+static void
+rspamd_fuzzy_hot_cache_destroy (struct fuzzy_hot_cache *hc)
+{
+	g_free (hc->elts);
+	g_free (hc);
+}
+
+static inline guint
+rspamd_fuzzy_hot_cache_idx (struct fuzzy_hot_cache *hc, const guchar *digest,
+		guint32 is_shingle)
+{
+	guint64 h;
+
+	/* Digests are distributed uniformly already */
+	memcpy (&h, digest, sizeof (h));
+
+	return (h ^ is_shingle) & hc->mask;
+}
+
+static const struct rspamd_fuzzy_reply *
+rspamd_fuzzy_hot_cache_lookup (struct fuzzy_hot_cache *hc,
+		const guchar *digest, guint32 is_shingle, guint64 now)
+{
+	struct fuzzy_hot_cache_elt *elt;
+	guint idx, i;
+
+	idx = rspamd_fuzzy_hot_cache_idx (hc, digest, is_shingle);
+
+	for (i = 0; i < HOT_CACHE_PROBES; i ++) {
+		elt = &hc->elts[(idx + i) & hc->mask];
+
+		if (elt->expire > now && elt->is_shingle == is_shingle &&
+				memcmp (elt->digest, digest, sizeof (elt->digest)) == 0) {
+			return &elt->rep;
+		}
+	}
+
+	return NULL;
+}
+
+static void
+rspamd_fuzzy_hot_cache_insert (struct fuzzy_hot_cache *hc,
+		const guchar *digest, guint32 is_shingle,
+		const struct rspamd_fuzzy_reply *rep,
+		guint64 now, gdouble ttl)
+{
+	struct fuzzy_hot_cache_elt *elt, *victim = NULL;
+	guint idx, i;
+
+	idx = rspamd_fuzzy_hot_cache_idx (hc, digest, is_shingle);
+
+	for (i = 0; i < HOT_CACHE_PROBES; i ++) {
+		elt = &hc->elts[(idx + i) & hc->mask];
+
+		if (elt->expire <= now || (elt->is_shingle == is_shingle &&
+				memcmp (elt->digest, digest, sizeof (elt->digest)) == 0)) {
+			victim = elt;
+			break;
+		}
+
+		/* Otherwise evict an element that expires first */
+		if (victim == NULL || elt->expire < victim->expire) {
+			victim = elt;
+		}
+	}
+
+	memcpy (victim->digest, digest, sizeof (victim->digest));
+	victim->is_shingle = is_shingle;
+	victim->expire = now + (guint64)ttl;
+	memcpy (&victim->rep, rep, sizeof (victim->rep));
+}
+
+static void
+rspamd_fuzzy_hot_cache_invalidate (struct fuzzy_hot_cache *hc,
+		const guchar *digest)
+{
+	struct fuzzy_hot_cache_elt *elt;
+	guint idx, i, is_shingle;
+
+	for (is_shingle = 0; is_shingle <= 1; is_shingle ++) {
+		idx = rspamd_fuzzy_hot_cache_idx (hc, digest, is_shingle);
+
+		for (i = 0; i < HOT_CACHE_PROBES; i ++) {
+			elt = &hc->elts[(idx + i) & hc->mask];
+
+			if (memcmp (elt->digest, digest, sizeof (elt->digest)) == 0) {
+				elt->expire = 0;
+			}
+		}
+	}
+}
+
 static gboolean
 rspamd_fuzzy_check_client (struct fuzzy_session *session, gboolean is_write)
 {
@@ -291,6 +499,7 @@ fuzzy_count_callback (guint64 count, void *ud)
 }
 
 struct fuzzy_slave_connection {
+	struct rspamd_fuzzy_storage_ctx *ctx;
 	struct rspamd_cryptobox_keypair *local_key;
 	struct rspamd_cryptobox_pubkey *remote_key;
 	struct upstream *up;
@@ -419,6 +628,9 @@ fuzzy_mirror_updates_to_http (struct rspamd_fuzzy_mirror *m,
 			fuzzy_mirror_updates_version_cb, cbdata);
 }
 
+static void rspamd_fuzzy_replication_push (struct rspamd_fuzzy_storage_ctx *ctx,
+		struct rspamd_fuzzy_mirror *m);
+
 static void
 fuzzy_mirror_error_handler (struct rspamd_http_connection *conn, GError *err)
 {
@@ -429,6 +641,9 @@ fuzzy_mirror_error_handler (struct rspamd_http_connection *conn, GError *err)
 			rspamd_inet_address_to_string (rspamd_upstream_addr (bk_conn->up)),
 			err);
 
+	/* Stream is resent starting from the last acked revision */
+	bk_conn->mirror->in_flight = FALSE;
+	rspamd_upstream_fail (bk_conn->up, FALSE);
 	fuzzy_mirror_close_connection (bk_conn);
 }
 
@@ -437,28 +652,74 @@ fuzzy_mirror_finish_handler (struct rspamd_http_connection *conn,
 	struct rspamd_http_message *msg)
 {
 	struct fuzzy_slave_connection *bk_conn = conn->ud;
+	struct rspamd_fuzzy_mirror *m = bk_conn->mirror;
+	struct rspamd_fuzzy_storage_ctx *ctx = bk_conn->ctx;
+	const gchar *body;
+	gchar *end;
+	gsize len;
+	guint64 rev;
+
+	msg_info ("finished mirror connection to %s", m->name);
+
+	if (m->version >= 2) {
+		m->in_flight = FALSE;
+		body = rspamd_http_message_get_body (msg, &len);
+
+		if (msg->code == 200 && body && len > 0 && len < 32) {
+			/* Slave replies with the last applied revision */
+			gchar revbuf[32];
+
+			rspamd_strlcpy (revbuf, body, len + 1);
+			rev = g_ascii_strtoull (revbuf, &end, 10);
+
+			if (end != revbuf) {
+				if (rev < m->acked_rev) {
+					msg_warn ("mirror %s has gone back from revision %L to %L",
+							m->name, m->acked_rev, rev);
+				}
+
+				m->acked_rev = rev;
+				m->rev_known = TRUE;
+			}
+		}
+
+		if (!m->rev_known || msg->code != 200) {
+			msg_err ("mirror %s has refused replication stream: %d",
+					m->name, msg->code);
+			fuzzy_mirror_close_connection (bk_conn);
+
+			return 0;
+		}
+
+		fuzzy_mirror_close_connection (bk_conn);
+		/* Continue if more batches have been logged meanwhile */
+		rspamd_fuzzy_replication_push (ctx, m);
+
+		return 0;
+	}
 
-	msg_info ("finished mirror connection to %s", bk_conn->mirror->name);
 	fuzzy_mirror_close_connection (bk_conn);
 
 	return 0;
 }
 
-static void
-rspamd_fuzzy_send_update_mirror (struct rspamd_fuzzy_storage_ctx *ctx,
-		struct rspamd_fuzzy_mirror *m, GArray *updates)
+static struct fuzzy_slave_connection *
+fuzzy_mirror_connection_new (struct rspamd_fuzzy_storage_ctx *ctx,
+		struct rspamd_fuzzy_mirror *m)
 {
 	struct fuzzy_slave_connection *conn;
-	struct rspamd_http_message *msg;
 
 	conn = g_malloc0 (sizeof (*conn));
 	conn->up = rspamd_upstream_get (m->u,
 			RSPAMD_UPSTREAM_MASTER_SLAVE, NULL, 0);
 	conn->mirror = m;
+	conn->ctx = ctx;
 
 	if (conn->up == NULL) {
 		msg_err ("cannot select upstream for %s", m->name);
-		return;
+		g_free (conn);
+
+		return NULL;
 	}
 
 	conn->sock = rspamd_inet_address_connect (
@@ -468,11 +729,10 @@ rspamd_fuzzy_send_update_mirror (struct rspamd_fuzzy_storage_ctx *ctx,
 	if (conn->sock == -1) {
 		msg_err ("cannot connect upstream for %s", m->name);
 		rspamd_upstream_fail (conn->up, TRUE);
-		return;
-	}
+		g_free (conn);
 
-	msg = rspamd_http_new_message (HTTP_REQUEST);
-	rspamd_printf_fstring (&msg->url, "/update_v1/%s", m->name);
+		return NULL;
+	}
 
 	conn->http_conn = rspamd_http_connection_new (NULL,
 			fuzzy_mirror_error_handler,
@@ -484,10 +744,386 @@ rspamd_fuzzy_send_update_mirror (struct rspamd_fuzzy_storage_ctx *ctx,
 
 	rspamd_http_connection_set_key (conn->http_conn,
 			ctx->sync_keypair);
+
+	return conn;
+}
+
+static void
+rspamd_fuzzy_send_update_mirror (struct rspamd_fuzzy_storage_ctx *ctx,
+		struct rspamd_fuzzy_mirror *m, GArray *updates)
+{
+	struct fuzzy_slave_connection *conn;
+	struct rspamd_http_message *msg;
+
+	conn = fuzzy_mirror_connection_new (ctx, m);
+
+	if (conn == NULL) {
+		return;
+	}
+
+	msg = rspamd_http_new_message (HTTP_REQUEST);
+	rspamd_printf_fstring (&msg->url, "/update_v1/%s", m->name);
 	msg->peer_key = rspamd_pubkey_ref (m->key);
 	fuzzy_mirror_updates_to_http (m, conn, ctx, msg, updates);
 }
 
+static void
+rspamd_fuzzy_replication_append_cmds (rspamd_fstring_t **buf, GArray *updates)
+{
+	struct fuzzy_peer_cmd *io_cmd;
+	guint32 len;
+	guint i;
+
+	for (i = 0; i < updates->len; i ++) {
+		io_cmd = &g_array_index (updates, struct fuzzy_peer_cmd, i);
+
+		if (io_cmd->is_shingle) {
+			len = sizeof (guint32) + sizeof (struct rspamd_fuzzy_shingle_cmd);
+		}
+		else {
+			len = sizeof (guint32) + sizeof (struct rspamd_fuzzy_cmd);
+		}
+
+		len = GUINT32_TO_LE (len);
+		*buf = rspamd_fstring_append (*buf, (const gchar *)&len, sizeof (len));
+		*buf = rspamd_fstring_append (*buf, (const gchar *)io_cmd,
+				GUINT32_FROM_LE (len));
+	}
+}
+
+/*
+ * Frame format:
+ * <fuzzy_replication_hdr>
+ * payload, compressed by zstd if FUZZY_REPLICATION_FLAG_ZSTD is set:
+ * for each batch:
+ *   <uint64_le> - revision
+ *   <uint32_le> - number of commands
+ *   <uint32_le> - size of the next element, <data> - command data
+ *   ...
+ * Frame with no batches is used to get the revision of a slave
+ */
+static rspamd_fstring_t *
+rspamd_fuzzy_replication_serialize (GPtrArray *batches)
+{
+	struct fuzzy_replication_hdr hdr;
+	struct fuzzy_replication_batch *batch;
+	rspamd_fstring_t *payload, *frame;
+	guint64 rev;
+	guint32 ncmds;
+	gsize bound, r;
+	guint i;
+
+	payload = rspamd_fstring_sized_new (64);
+
+	PTR_ARRAY_FOREACH (batches, i, batch) {
+		rev = GUINT64_TO_LE (batch->rev);
+		ncmds = GUINT32_TO_LE (batch->updates->len);
+		payload = rspamd_fstring_append (payload, (const gchar *)&rev,
+				sizeof (rev));
+		payload = rspamd_fstring_append (payload, (const gchar *)&ncmds,
+				sizeof (ncmds));
+		rspamd_fuzzy_replication_append_cmds (&payload, batch->updates);
+	}
+
+	memset (&hdr, 0, sizeof (hdr));
+	memcpy (hdr.magic, FUZZY_REPLICATION_MAGIC, sizeof (hdr.magic));
+	hdr.version = GUINT32_TO_LE (FUZZY_REPLICATION_VERSION);
+	hdr.nbatches = GUINT32_TO_LE (batches->len);
+	hdr.raw_len = GUINT64_TO_LE (payload->len);
+
+	if (payload->len >= FUZZY_REPLICATION_COMPRESS_MIN) {
+		bound = ZSTD_compressBound (payload->len);
+		frame = rspamd_fstring_sized_new (sizeof (hdr) + bound);
+		r = ZSTD_compress (frame->str + sizeof (hdr), bound,
+				payload->str, payload->len, 1);
+
+		if (!ZSTD_isError (r)) {
+			hdr.flags = GUINT32_TO_LE (FUZZY_REPLICATION_FLAG_ZSTD);
+			memcpy (frame->str, &hdr, sizeof (hdr));
+			frame->len = sizeof (hdr) + r;
+			rspamd_fstring_free (payload);
+
+			return frame;
+		}
+
+		msg_err ("cannot compress replication frame: %s",
+				ZSTD_getErrorName (r));
+		rspamd_fstring_free (frame);
+	}
+
+	frame = rspamd_fstring_sized_new (sizeof (hdr) + payload->len);
+	frame = rspamd_fstring_append (frame, (const gchar *)&hdr, sizeof (hdr));
+	frame = rspamd_fstring_append (frame, payload->str, payload->len);
+	rspamd_fstring_free (payload);
+
+	return frame;
+}
+
+/*
+ * Sends all logged batches that are not yet confirmed by the mirror in a
+ * single frame, only one frame per mirror is in flight
+ */
+static void
+rspamd_fuzzy_replication_push (struct rspamd_fuzzy_storage_ctx *ctx,
+		struct rspamd_fuzzy_mirror *m)
+{
+	struct fuzzy_slave_connection *conn;
+	struct rspamd_http_message *msg;
+	struct fuzzy_replication_batch *batch, *oldest, *newest;
+	struct timeval tv;
+	GPtrArray *batches;
+	GList *cur;
+
+	if (m->in_flight || ctx->replication_log == NULL ||
+			g_queue_is_empty (ctx->replication_log)) {
+		return;
+	}
+
+	oldest = g_queue_peek_head (ctx->replication_log);
+	newest = g_queue_peek_tail (ctx->replication_log);
+
+	if (m->rev_known && m->acked_rev >= newest->rev) {
+		return;
+	}
+
+	batches = g_ptr_array_new ();
+
+	/* Unknown revision of the mirror is asked by an empty frame */
+	if (m->rev_known) {
+		if (oldest->rev > m->acked_rev + 1) {
+			msg_warn ("mirror %s is too far behind: revision %L, oldest "
+					"logged revision %L, cold sync is recommended",
+					m->name, m->acked_rev, oldest->rev);
+		}
+
+		for (cur = ctx->replication_log->head; cur != NULL; cur = g_list_next (cur)) {
+			batch = cur->data;
+
+			if (batch->rev > m->acked_rev) {
+				g_ptr_array_add (batches, batch);
+			}
+		}
+	}
+
+	conn = fuzzy_mirror_connection_new (ctx, m);
+
+	if (conn == NULL) {
+		g_ptr_array_free (batches, TRUE);
+
+		return;
+	}
+
+	msg = rspamd_http_new_message (HTTP_REQUEST);
+	rspamd_printf_fstring (&msg->url, "/update_v2/%s", m->name);
+	msg->peer_key = rspamd_pubkey_ref (m->key);
+	rspamd_http_message_set_body_from_fstring_steal (msg,
+			rspamd_fuzzy_replication_serialize (batches));
+	m->in_flight = TRUE;
+	double_to_tv (ctx->sync_timeout, &tv);
+	rspamd_http_connection_write_message (conn->http_conn,
+			msg, NULL, NULL, conn,
+			conn->sock,
+			&tv, ctx->ev_base);
+	msg_info ("send %ud replication batches (revisions %L..%L) to %s",
+			batches->len,
+			batches->len > 0 ?
+				((struct fuzzy_replication_batch *)g_ptr_array_index (batches, 0))->rev :
+				(guint64)0,
+			newest->rev, m->name);
+	g_ptr_array_free (batches, TRUE);
+}
+
+static void
+fuzzy_replication_batch_free (gpointer p)
+{
+	struct fuzzy_replication_batch *batch = p;
+
+	g_array_free (batch->updates, TRUE);
+	g_free (batch);
+}
+
+struct fuzzy_replication_log_cbdata {
+	struct rspamd_fuzzy_storage_ctx *ctx;
+	struct fuzzy_replication_batch *batch;
+};
+
+static void
+rspamd_fuzzy_replication_log_version_cb (guint64 rev, void *ud)
+{
+	struct fuzzy_replication_log_cbdata *cbdata = ud;
+	struct fuzzy_replication_batch *batch = cbdata->batch, *newest;
+	struct rspamd_fuzzy_storage_ctx *ctx = cbdata->ctx;
+	struct rspamd_fuzzy_mirror *m;
+	guint i;
+
+	g_free (cbdata);
+	newest = g_queue_peek_tail (ctx->replication_log);
+
+	if (newest && newest->rev >= rev) {
+		/* Backend has not changed revision, e.g. for duplicates only */
+		fuzzy_replication_batch_free (batch);
+
+		return;
+	}
+
+	batch->rev = rev;
+	g_queue_push_tail (ctx->replication_log, batch);
+
+	while (g_queue_get_length (ctx->replication_log) > ctx->replication_log_size) {
+		fuzzy_replication_batch_free (g_queue_pop_head (ctx->replication_log));
+	}
+
+	PTR_ARRAY_FOREACH (ctx->mirrors, i, m) {
+		if (m->version >= 2) {
+			rspamd_fuzzy_replication_push (ctx, m);
+		}
+	}
+}
+
+/*
+ * Stores a copy of the applied batch in the replication log
+ */
+static void
+rspamd_fuzzy_replication_log_updates (struct rspamd_fuzzy_storage_ctx *ctx,
+		GArray *updates)
+{
+	struct fuzzy_replication_log_cbdata *cbdata;
+	struct fuzzy_replication_batch *batch;
+
+	batch = g_malloc0 (sizeof (*batch));
+	batch->updates = g_array_sized_new (FALSE, FALSE,
+			sizeof (struct fuzzy_peer_cmd), updates->len);
+	g_array_append_vals (batch->updates, updates->data, updates->len);
+	cbdata = g_malloc (sizeof (*cbdata));
+	cbdata->ctx = ctx;
+	cbdata->batch = batch;
+	rspamd_fuzzy_backend_version (ctx->backend, local_db_name,
+			rspamd_fuzzy_replication_log_version_cb, cbdata);
+}
+
+static guint
+rspamd_fuzzy_digest_hash (gconstpointer key)
+{
+	guint ret;
+
+	/* Digests are distributed uniformly already */
+	memcpy (&ret, key, sizeof (ret));
+
+	return ret;
+}
+
+static gboolean
+rspamd_fuzzy_digest_equal (gconstpointer v, gconstpointer v2)
+{
+	return memcmp (v, v2, rspamd_cryptobox_HASHBYTES) == 0;
+}
+
+/*
+ * Adds update to the pending queue, merging it with the last pending update
+ * for the same digest if applying the merged command gives the same result
+ */
+static void
+rspamd_fuzzy_queue_update (struct rspamd_fuzzy_storage_ctx *ctx,
+		const struct fuzzy_peer_cmd *io_cmd)
+{
+	struct fuzzy_peer_cmd *prev;
+	const struct rspamd_fuzzy_cmd *cmd = &io_cmd->cmd.normal;
+	struct rspamd_fuzzy_cmd *pcmd;
+	guchar *key;
+	gpointer idx;
+
+	if (cmd->cmd != FUZZY_DUP &&
+			(idx = g_hash_table_lookup (ctx->updates_index, cmd->digest))) {
+		prev = &g_array_index (ctx->updates_pending, struct fuzzy_peer_cmd,
+				GPOINTER_TO_UINT (idx) - 1);
+		pcmd = &prev->cmd.normal;
+
+		switch (cmd->cmd) {
+		case FUZZY_WRITE:
+			if (pcmd->cmd == FUZZY_WRITE && pcmd->flag == cmd->flag) {
+				/* Backends sum weights for the same flag */
+				pcmd->value += cmd->value;
+
+				if (io_cmd->is_shingle) {
+					prev->is_shingle = TRUE;
+					pcmd->shingles_count = cmd->shingles_count;
+					memcpy (&prev->cmd.shingle.sgl, &io_cmd->cmd.shingle.sgl,
+							sizeof (prev->cmd.shingle.sgl));
+				}
+
+				ctx->stat.updates_coalesced ++;
+
+				return;
+			}
+			else if (pcmd->cmd == FUZZY_WRITE || pcmd->cmd == FUZZY_REFRESH) {
+				/* Relearn with another flag replaces value */
+				memcpy (prev, io_cmd, sizeof (*prev));
+				ctx->stat.updates_coalesced ++;
+
+				return;
+			}
+			/* Write after delete starts from zero weight, so keep both */
+			break;
+		case FUZZY_DEL:
+			if (prev->is_shingle && !io_cmd->is_shingle) {
+				/* Keep shingles to delete them as well */
+				pcmd->cmd = FUZZY_DEL;
+				pcmd->flag = cmd->flag;
+			}
+			else {
+				memcpy (prev, io_cmd, sizeof (*prev));
+			}
+
+			ctx->stat.updates_coalesced ++;
+
+			return;
+		case FUZZY_REFRESH:
+			/* Pending command either refreshes or removes the digest */
+			ctx->stat.updates_coalesced ++;
+
+			return;
+		default:
+			break;
+		}
+	}
+
+	g_array_append_val (ctx->updates_pending, *io_cmd);
+
+	if (cmd->cmd != FUZZY_DUP) {
+		key = g_malloc (sizeof (cmd->digest));
+		memcpy (key, cmd->digest, sizeof (cmd->digest));
+		g_hash_table_replace (ctx->updates_index, key,
+				GUINT_TO_POINTER (ctx->updates_pending->len));
+	}
+}
+
+static void
+rspamd_fuzzy_clear_updates (struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	ctx->updates_pending->len = 0;
+	g_hash_table_remove_all (ctx->updates_index);
+}
+
+static void
+rspamd_fuzzy_hot_cache_invalidate_updates (struct rspamd_fuzzy_storage_ctx *ctx,
+		GArray *updates)
+{
+	struct fuzzy_peer_cmd *io_cmd;
+	guint i;
+
+	if (ctx->hot_cache) {
+		for (i = 0; i < updates->len; i ++) {
+			io_cmd = &g_array_index (updates, struct fuzzy_peer_cmd, i);
+
+			if (io_cmd->cmd.normal.cmd == FUZZY_WRITE ||
+					io_cmd->cmd.normal.cmd == FUZZY_DEL) {
+				rspamd_fuzzy_hot_cache_invalidate (ctx->hot_cache,
+						io_cmd->cmd.normal.digest);
+			}
+		}
+	}
+}
+
 struct rspamd_updates_cbdata {
 	GArray *updates_pending;
 	struct rspamd_fuzzy_storage_ctx *ctx;
@@ -520,6 +1156,10 @@ rspamd_fuzzy_stat_callback (gint fd, gshort what, gpointer ud)
 	rspamd_fuzzy_backend_count (ctx->backend, fuzzy_stat_count_callback, ctx);
 }
 
+static void rspamd_fuzzy_process_updates_queue (
+		struct rspamd_fuzzy_storage_ctx *ctx,
+		const gchar *source, gboolean forced);
+
 static void
 rspamd_fuzzy_updates_cb (gboolean success,
 						 guint nadded,
@@ -533,6 +1173,7 @@ rspamd_fuzzy_updates_cb (gboolean success,
 	guint i;
 	struct rspamd_fuzzy_storage_ctx *ctx;
 	const gchar *source;
+	gchar *deferred_source;
 
 	ctx = cbdata->ctx;
 	source = cbdata->source;
@@ -540,11 +1181,22 @@ rspamd_fuzzy_updates_cb (gboolean success,
 	if (success) {
 		rspamd_fuzzy_backend_count (ctx->backend, fuzzy_count_callback, ctx);
 
-		if (ctx->updates_pending->len > 0) {
+		rspamd_fuzzy_hot_cache_invalidate_updates (ctx,
+				cbdata->updates_pending);
+
+		if (cbdata->updates_pending->len > 0) {
 			for (i = 0; i < ctx->mirrors->len; i ++) {
 				m = g_ptr_array_index (ctx->mirrors, i);
 
-				rspamd_fuzzy_send_update_mirror (ctx, m,
+				if (m->version < 2) {
+					rspamd_fuzzy_send_update_mirror (ctx, m,
+							cbdata->updates_pending);
+				}
+			}
+
+			/* Updates received from masters are not streamed further */
+			if (ctx->replication_log && strcmp (source, local_db_name) == 0) {
+				rspamd_fuzzy_replication_log_updates (ctx,
 						cbdata->updates_pending);
 			}
 		}
@@ -568,20 +1220,48 @@ rspamd_fuzzy_updates_cb (gboolean success,
 			ctx->updates_failed = 0;
 		}
 		else {
+			GArray *newer = ctx->updates_pending;
+
 			msg_err ("cannot commit update transaction to fuzzy backend, "
 					 "%ud updates are still left; %ud currently pending;"
 					 " %d updates left",
 					cbdata->updates_pending->len,
 					ctx->updates_pending->len,
 					ctx->updates_maxfail - ctx->updates_failed);
-			/* Move the remaining updates to ctx queue */
-			g_array_append_vals (ctx->updates_pending,
-					cbdata->updates_pending->data,
-					cbdata->updates_pending->len);
+			/*
+			 * Move the remaining updates to ctx queue before the newer ones
+			 * to preserve the order of commands for the same digest
+			 */
+			ctx->updates_pending = g_array_sized_new (FALSE, FALSE,
+					sizeof (struct fuzzy_peer_cmd),
+					cbdata->updates_pending->len + newer->len);
+			g_hash_table_remove_all (ctx->updates_index);
+
+			for (i = 0; i < cbdata->updates_pending->len; i ++) {
+				rspamd_fuzzy_queue_update (ctx, &g_array_index (
+						cbdata->updates_pending, struct fuzzy_peer_cmd, i));
+			}
+
+			for (i = 0; i < newer->len; i ++) {
+				rspamd_fuzzy_queue_update (ctx, &g_array_index (
+						newer, struct fuzzy_peer_cmd, i));
+			}
+
+			g_array_free (newer, TRUE);
 		}
 	}
 
-	if (ctx->worker->wanna_die) {
+	ctx->updates_in_flight = FALSE;
+	deferred_source = ctx->updates_deferred_source;
+	ctx->updates_deferred_source = NULL;
+
+	if (ctx->updates_pending->len > 0 &&
+			(deferred_source || ctx->worker->wanna_die)) {
+		/* Flush the updates collected while transaction was in flight */
+		rspamd_fuzzy_process_updates_queue (ctx,
+				deferred_source ? deferred_source : local_db_name, TRUE);
+	}
+	else if (ctx->worker->wanna_die) {
 		/* Plan exit */
 		struct timeval tv;
 
@@ -592,6 +1272,7 @@ rspamd_fuzzy_updates_cb (gboolean success,
 	}
 
 	g_array_free (cbdata->updates_pending, TRUE);
+	g_free (deferred_source);
 	g_free (cbdata->source);
 	g_free (cbdata);
 }
@@ -603,6 +1284,18 @@ rspamd_fuzzy_process_updates_queue (struct rspamd_fuzzy_storage_ctx *ctx,
 
 	struct rspamd_updates_cbdata *cbdata;
 
+	if (ctx->updates_in_flight) {
+		/*
+		 * Only one transaction is executed at a time, new updates are
+		 * collected and coalesced in the second queue meanwhile
+		 */
+		if (forced && ctx->updates_deferred_source == NULL) {
+			ctx->updates_deferred_source = g_strdup (source);
+		}
+
+		return;
+	}
+
 	if ((forced ||ctx->updates_pending->len > 0)) {
 		cbdata = g_malloc (sizeof (*cbdata));
 		cbdata->ctx = ctx;
@@ -610,6 +1303,8 @@ rspamd_fuzzy_process_updates_queue (struct rspamd_fuzzy_storage_ctx *ctx,
 		ctx->updates_pending = g_array_sized_new (FALSE, FALSE,
 				sizeof (struct fuzzy_peer_cmd),
 				MAX (cbdata->updates_pending->len, 1024));
+		g_hash_table_remove_all (ctx->updates_index);
+		ctx->updates_in_flight = TRUE;
 		cbdata->source = g_strdup (source);
 		rspamd_fuzzy_backend_process_updates (ctx->backend,
 				cbdata->updates_pending,
@@ -626,10 +1321,9 @@ rspamd_fuzzy_reply_io (gint fd, gshort what, gpointer d)
 	REF_RELEASE (session);
 }
 
-static void
-rspamd_fuzzy_write_reply (struct fuzzy_session *session)
+static gconstpointer
+rspamd_fuzzy_reply_data (struct fuzzy_session *session, gsize *plen)
 {
-	gssize r;
 	gsize len;
 	gconstpointer data;
 
@@ -656,6 +1350,93 @@ rspamd_fuzzy_write_reply (struct fuzzy_session *session)
 		}
 	}
 
+	*plen = len;
+
+	return data;
+}
+
+static void rspamd_fuzzy_multi_reply_io (gint fd, gshort what, gpointer d);
+
+static void
+rspamd_fuzzy_multi_write_reply (struct fuzzy_multi_session *multi)
+{
+	gssize r;
+
+	r = rspamd_inet_address_sendto (multi->fd, multi->reply, multi->reply_len,
+			0, multi->addr);
+
+	if (r == -1) {
+		if (errno == EINTR || errno == EWOULDBLOCK || errno == EAGAIN) {
+			/* Grab reference to avoid early destruction */
+			REF_RETAIN (multi);
+			event_set (&multi->io, multi->fd, EV_WRITE,
+					rspamd_fuzzy_multi_reply_io, multi);
+			event_base_set (multi->ctx->ev_base, &multi->io);
+			event_add (&multi->io, NULL);
+		}
+		else {
+			msg_err ("error while writing reply: %s", strerror (errno));
+		}
+	}
+}
+
+static void
+rspamd_fuzzy_multi_reply_io (gint fd, gshort what, gpointer d)
+{
+	struct fuzzy_multi_session *multi = d;
+
+	rspamd_fuzzy_multi_write_reply (multi);
+	REF_RELEASE (multi);
+}
+
+static void
+rspamd_fuzzy_multi_add_reply (struct fuzzy_session *session)
+{
+	struct fuzzy_multi_session *multi = session->multi;
+	struct rspamd_fuzzy_encrypted_rep_hdr *hdr;
+	guchar *payload;
+
+	hdr = (struct rspamd_fuzzy_encrypted_rep_hdr *)multi->reply;
+	payload = multi->reply + sizeof (*hdr);
+	memcpy (payload + sizeof (struct rspamd_fuzzy_multi_hdr) +
+			session->multi_idx * sizeof (struct rspamd_fuzzy_reply),
+			&session->reply.rep, sizeof (struct rspamd_fuzzy_reply));
+
+	if (-- multi->pending == 0) {
+		/* All replies are here, encrypt them at once */
+		ottery_rand_bytes (hdr->nonce, sizeof (hdr->nonce));
+		rspamd_cryptobox_encrypt_nm_inplace (payload,
+				multi->reply_len - sizeof (*hdr),
+				hdr->nonce,
+				multi->nm,
+				hdr->mac,
+				RSPAMD_CRYPTOBOX_MODE_25519);
+		rspamd_fuzzy_multi_write_reply (multi);
+	}
+}
+
+static void
+rspamd_fuzzy_write_reply (struct fuzzy_session *session)
+{
+	gssize r;
+	gsize len;
+	gconstpointer data;
+
+	if (session->multi) {
+		rspamd_fuzzy_multi_add_reply (session);
+
+		return;
+	}
+
+	if (session->ctx->replies_batch) {
+		/* Sent with all other replies when the whole batch is processed */
+		REF_RETAIN (session);
+		g_ptr_array_add (session->ctx->replies_batch, session);
+
+		return;
+	}
+
+	data = rspamd_fuzzy_reply_data (session, &len);
 	r = rspamd_inet_address_sendto (session->fd, data, len, 0,
 			session->addr);
 
@@ -674,6 +1455,49 @@ rspamd_fuzzy_write_reply (struct fuzzy_session *session)
 	}
 }
 
+static void
+rspamd_fuzzy_flush_replies (struct rspamd_fuzzy_storage_ctx *ctx,
+		GPtrArray *replies)
+{
+	struct fuzzy_session *session;
+	const void **bufs;
+	gsize *lens;
+	rspamd_inet_addr_t **addrs;
+	gint sent = 0;
+	guint i;
+
+	if (replies->len > 0) {
+		bufs = g_alloca (sizeof (*bufs) * replies->len);
+		lens = g_alloca (sizeof (*lens) * replies->len);
+		addrs = g_alloca (sizeof (*addrs) * replies->len);
+
+		PTR_ARRAY_FOREACH (replies, i, session) {
+			bufs[i] = rspamd_fuzzy_reply_data (session, &lens[i]);
+			addrs[i] = session->addr;
+		}
+
+		/* All sessions in a batch are read from the same socket */
+		session = g_ptr_array_index (replies, 0);
+		sent = rspamd_inet_address_sendmmsg (session->fd, bufs, lens, addrs,
+				replies->len);
+
+		if (sent == -1) {
+			sent = 0;
+		}
+	}
+
+	PTR_ARRAY_FOREACH (replies, i, session) {
+		if (i >= (guint)sent) {
+			/* Retry sending with the usual error handling */
+			rspamd_fuzzy_write_reply (session);
+		}
+
+		REF_RELEASE (session);
+	}
+
+	g_ptr_array_set_size (replies, 0);
+}
+
 static void
 fuzzy_peer_send_io (gint fd, gshort what, gpointer d)
 {
@@ -772,7 +1596,7 @@ rspamd_fuzzy_make_reply (struct rspamd_fuzzy_cmd *cmd,
 				cmd->cmd,
 				result->v1.value);
 
-		if (encrypted) {
+		if (encrypted && session->multi == NULL) {
 			/* We need also to encrypt reply */
 			ottery_rand_bytes (session->reply.hdr.nonce,
 					sizeof (session->reply.hdr.nonce));
@@ -855,7 +1679,7 @@ rspamd_fuzzy_check_callback (struct rspamd_fuzzy_reply *result, void *ud)
 						sizeof (up_cmd.cmd.shingle.sgl));
 			}
 
-			g_array_append_val (session->ctx->updates_pending, up_cmd);
+			rspamd_fuzzy_queue_update (session->ctx, &up_cmd);
 		}
 		else {
 			/* We need to send request to the peer */
@@ -883,12 +1707,98 @@ rspamd_fuzzy_check_callback (struct rspamd_fuzzy_reply *result, void *ud)
 	REF_RELEASE (session);
 }
 
+static void
+rspamd_fuzzy_backend_check_callback (struct rspamd_fuzzy_reply *result,
+		void *ud)
+{
+	struct fuzzy_session *session = ud;
+	struct rspamd_fuzzy_storage_ctx *ctx = session->ctx;
+	struct rspamd_fuzzy_cmd *cmd;
+
+	if (ctx->hot_cache) {
+		/* Shingle commands start with the basic command */
+		if (session->cmd_type == CMD_ENCRYPTED_NORMAL ||
+				session->cmd_type == CMD_ENCRYPTED_SHINGLE) {
+			cmd = &session->cmd.enc_normal.cmd;
+		}
+		else {
+			cmd = &session->cmd.normal;
+		}
+
+		rspamd_fuzzy_hot_cache_insert (ctx->hot_cache, cmd->digest,
+				session->cmd_type == CMD_SHINGLE ||
+				session->cmd_type == CMD_ENCRYPTED_SHINGLE,
+				result, session->time, ctx->hot_cache_ttl);
+	}
+
+	rspamd_fuzzy_check_callback (result, ud);
+}
+
+static void
+rspamd_fuzzy_backend_check_multi_callback (struct rspamd_fuzzy_reply *reps,
+		guint nreps, void *ud)
+{
+	GPtrArray *sessions = ud;
+	struct fuzzy_session *session;
+	guint i;
+
+	PTR_ARRAY_FOREACH (sessions, i, session) {
+		/* Releases session */
+		rspamd_fuzzy_backend_check_callback (&reps[i], session);
+	}
+
+	g_ptr_array_free (sessions, TRUE);
+}
+
+static const struct rspamd_fuzzy_cmd *
+rspamd_fuzzy_session_cmd (struct fuzzy_session *session)
+{
+	switch (session->cmd_type) {
+	case CMD_NORMAL:
+		return &session->cmd.normal;
+	case CMD_SHINGLE:
+		return &session->cmd.shingle.basic;
+	case CMD_ENCRYPTED_NORMAL:
+		return &session->cmd.enc_normal.cmd;
+	case CMD_ENCRYPTED_SHINGLE:
+		return &session->cmd.enc_shingle.cmd.basic;
+	}
+
+	return NULL;
+}
+
+static void
+rspamd_fuzzy_flush_checks (struct rspamd_fuzzy_storage_ctx *ctx,
+		GPtrArray *sessions)
+{
+	const struct rspamd_fuzzy_cmd **cmds;
+	struct fuzzy_session *session;
+	guint i;
+
+	if (sessions->len == 0) {
+		g_ptr_array_free (sessions, TRUE);
+
+		return;
+	}
+
+	cmds = g_alloca (sizeof (*cmds) * sessions->len);
+
+	PTR_ARRAY_FOREACH (sessions, i, session) {
+		cmds[i] = rspamd_fuzzy_session_cmd (session);
+	}
+
+	/* Sessions are retained, so commands are alive till the callback */
+	rspamd_fuzzy_backend_check_multi (ctx->backend, cmds, sessions->len,
+			rspamd_fuzzy_backend_check_multi_callback, sessions);
+}
+
 static void
 rspamd_fuzzy_process_command (struct fuzzy_session *session)
 {
 	gboolean encrypted = FALSE, is_shingle = FALSE;
 	struct rspamd_fuzzy_cmd *cmd = NULL;
 	struct rspamd_fuzzy_reply result;
+	const struct rspamd_fuzzy_reply *hot_rep;
 	struct fuzzy_peer_cmd up_cmd;
 	struct fuzzy_peer_request *up_req;
 	struct fuzzy_key_stat *ip_stat = NULL;
@@ -923,6 +1833,11 @@ rspamd_fuzzy_process_command (struct fuzzy_session *session)
 		return;
 	}
 
+	if (session->multi) {
+		/* Commands from multi-command frames are always encrypted */
+		encrypted = TRUE;
+	}
+
 	memset (&result, 0, sizeof (result));
 	memcpy (result.digest, cmd->digest, sizeof (result.digest));
 	result.v1.flag = cmd->flag;
@@ -965,10 +1880,30 @@ rspamd_fuzzy_process_command (struct fuzzy_session *session)
 				result.v1.flag = 0;
 				rspamd_fuzzy_make_reply (cmd, &result, session, encrypted,
 						is_shingle);
-			} else {
+			}
+			else if (session->ctx->hot_cache &&
+					(hot_rep = rspamd_fuzzy_hot_cache_lookup (
+							session->ctx->hot_cache, cmd->digest,
+							is_shingle, session->time)) != NULL) {
+				session->ctx->stat.hot_cache_hits ++;
+				memcpy (&result, hot_rep, sizeof (result));
+				REF_RETAIN (session);
+				rspamd_fuzzy_check_callback (&result, session);
+			}
+			else {
+				if (session->ctx->hot_cache) {
+					session->ctx->stat.hot_cache_misses ++;
+				}
+
 				REF_RETAIN (session);
-				rspamd_fuzzy_backend_check (session->ctx->backend, cmd,
-						rspamd_fuzzy_check_callback, session);
+
+				if (session->ctx->checks_batch) {
+					g_ptr_array_add (session->ctx->checks_batch, session);
+				}
+				else {
+					rspamd_fuzzy_backend_check (session->ctx->backend, cmd,
+							rspamd_fuzzy_backend_check_callback, session);
+				}
 			}
 		}
 		else {
@@ -1006,6 +1941,11 @@ rspamd_fuzzy_process_command (struct fuzzy_session *session)
 				}
 			}
 
+			if (session->ctx->hot_cache) {
+				rspamd_fuzzy_hot_cache_invalidate (session->ctx->hot_cache,
+						cmd->digest);
+			}
+
 			if (session->worker->index == 0 || session->ctx->peer_fd == -1) {
 				/* Just add to the queue */
 				up_cmd.is_shingle = is_shingle;
@@ -1013,7 +1953,7 @@ rspamd_fuzzy_process_command (struct fuzzy_session *session)
 						(gpointer)&up_cmd.cmd.shingle :
 						(gpointer)&up_cmd.cmd.normal;
 				memcpy (ptr, cmd, up_len);
-				g_array_append_val (session->ctx->updates_pending, up_cmd);
+				rspamd_fuzzy_queue_update (session->ctx, &up_cmd);
 			}
 			else {
 				/* We need to send request to the peer */
@@ -1094,45 +2034,35 @@ rspamd_fuzzy_command_valid (struct rspamd_fuzzy_cmd *cmd, gint r)
 }
 
 static gboolean
-rspamd_fuzzy_decrypt_command (struct fuzzy_session *s)
+rspamd_fuzzy_decrypt_payload (struct rspamd_fuzzy_storage_ctx *ctx,
+		struct rspamd_fuzzy_encrypted_req_hdr *hdr,
+		const guchar *magic,
+		guchar *payload, gsize payload_len,
+		guchar *nm, struct fuzzy_key_stat **key_stat)
 {
-	struct rspamd_fuzzy_encrypted_req_hdr *hdr;
-	guchar *payload;
-	gsize payload_len;
 	struct rspamd_cryptobox_pubkey *rk;
 	struct fuzzy_key *key;
 
-	if (s->ctx->default_key == NULL) {
+	if (ctx->default_key == NULL) {
 		msg_warn ("received encrypted request when encryption is not enabled");
 		return FALSE;
 	}
 
-	if (s->cmd_type == CMD_ENCRYPTED_NORMAL) {
-		hdr = &s->cmd.enc_normal.hdr;
-		payload = (guchar *)&s->cmd.enc_normal.cmd;
-		payload_len = sizeof (s->cmd.enc_normal.cmd);
-	}
-	else {
-		hdr = &s->cmd.enc_shingle.hdr;
-		payload = (guchar *) &s->cmd.enc_shingle.cmd;
-		payload_len = sizeof (s->cmd.enc_shingle.cmd);
-	}
-
 	/* Compare magic */
-	if (memcmp (hdr->magic, fuzzy_encrypted_magic, sizeof (hdr->magic)) != 0) {
+	if (memcmp (hdr->magic, magic, sizeof (hdr->magic)) != 0) {
 		msg_debug ("invalid magic for the encrypted packet");
 		return FALSE;
 	}
 
 	/* Try to find the desired key */
-	key = g_hash_table_lookup (s->ctx->keys, hdr->key_id);
+	key = g_hash_table_lookup (ctx->keys, hdr->key_id);
 
 	if (key == NULL) {
 		/* Unknown key, assume default one */
-		key = s->ctx->default_key;
+		key = ctx->default_key;
 	}
 
-	s->key_stat = key->stat;
+	*key_stat = key->stat;
 
 	/* Now process keypair */
 	rk = rspamd_pubkey_from_bin (hdr->pubkey, sizeof (hdr->pubkey),
@@ -1143,7 +2073,7 @@ rspamd_fuzzy_decrypt_command (struct fuzzy_session *s)
 		return FALSE;
 	}
 
-	rspamd_keypair_cache_process (s->ctx->keypair_cache, key->key, rk);
+	rspamd_keypair_cache_process (ctx->keypair_cache, key->key, rk);
 
 	/* Now decrypt request */
 	if (!rspamd_cryptobox_decrypt_nm_inplace (payload, payload_len, hdr->nonce,
@@ -1155,12 +2085,35 @@ rspamd_fuzzy_decrypt_command (struct fuzzy_session *s)
 		return FALSE;
 	}
 
-	memcpy (s->nm, rspamd_pubkey_get_nm (rk, key->key), sizeof (s->nm));
+	memcpy (nm, rspamd_pubkey_get_nm (rk, key->key),
+			rspamd_cryptobox_MAX_NMBYTES);
 	rspamd_pubkey_unref (rk);
 
 	return TRUE;
 }
 
+static gboolean
+rspamd_fuzzy_decrypt_command (struct fuzzy_session *s)
+{
+	struct rspamd_fuzzy_encrypted_req_hdr *hdr;
+	guchar *payload;
+	gsize payload_len;
+
+	if (s->cmd_type == CMD_ENCRYPTED_NORMAL) {
+		hdr = &s->cmd.enc_normal.hdr;
+		payload = (guchar *)&s->cmd.enc_normal.cmd;
+		payload_len = sizeof (s->cmd.enc_normal.cmd);
+	}
+	else {
+		hdr = &s->cmd.enc_shingle.hdr;
+		payload = (guchar *) &s->cmd.enc_shingle.cmd;
+		payload_len = sizeof (s->cmd.enc_shingle.cmd);
+	}
+
+	return rspamd_fuzzy_decrypt_payload (s->ctx, hdr, fuzzy_encrypted_magic,
+			payload, payload_len, s->nm, &s->key_stat);
+}
+
 static gboolean
 rspamd_fuzzy_cmd_from_wire (guchar *buf, guint buflen, struct fuzzy_session *s)
 {
@@ -1232,6 +2185,18 @@ rspamd_fuzzy_cmd_from_wire (guchar *buf, guint buflen, struct fuzzy_session *s)
 	return TRUE;
 }
 
+static void
+rspamd_fuzzy_mirror_map_flags (struct rspamd_fuzzy_storage_ctx *ctx,
+		struct fuzzy_peer_cmd *cmd)
+{
+	gpointer flag_ptr;
+
+	if ((flag_ptr = g_hash_table_lookup (ctx->master_flags,
+			GUINT_TO_POINTER (cmd->cmd.normal.flag))) != NULL) {
+		cmd->cmd.normal.flag = GPOINTER_TO_UINT (flag_ptr);
+	}
+}
+
 static void
 rspamd_fuzzy_mirror_process_update (struct fuzzy_master_update_session *session,
 		struct rspamd_http_message *msg, guint our_rev)
@@ -1247,8 +2212,6 @@ rspamd_fuzzy_mirror_process_update (struct fuzzy_master_update_session *session,
 		finish_processing
 	} state = read_len;
 
-	gpointer flag_ptr;
-
 	/*
 	 * Message format:
 	 * <uint32_le> - revision
@@ -1333,100 +2296,357 @@ rspamd_fuzzy_mirror_process_update (struct fuzzy_master_update_session *session,
 				goto err;
 			}
 
-			if (cmd.is_shingle) {
-				if ((flag_ptr = g_hash_table_lookup (session->ctx->master_flags,
-						GUINT_TO_POINTER (cmd.cmd.shingle.basic.flag))) != NULL) {
-					cmd.cmd.shingle.basic.flag = GPOINTER_TO_UINT (flag_ptr);
-				}
+			rspamd_fuzzy_mirror_map_flags (session->ctx, &cmd);
+			rspamd_fuzzy_queue_update (session->ctx, &cmd);
+
+			p += len;
+			remain -= len;
+			len = 0;
+			state = read_len;
+			cnt ++;
+			break;
+		case finish_processing:
+			/* Do nothing */
+			remain = 0;
+			break;
+		}
+	}
+
+
+	rspamd_fuzzy_process_updates_queue (session->ctx, session->src, TRUE);
+	msg_info_fuzzy_update ("processed updates from the master %s, "
+			"%ud operations processed,"
+			" revision: %d (local revision: %d)",
+			rspamd_inet_address_to_string (session->addr),
+			cnt, revision, our_rev);
+
+err:
+	return;
+}
+
+
+static void
+fuzzy_session_destroy (gpointer d)
+{
+	struct fuzzy_session *session = d;
+
+	rspamd_inet_address_free (session->addr);
+	rspamd_explicit_memzero (session->nm, sizeof (session->nm));
+	session->worker->nconns--;
+
+	if (session->multi) {
+		REF_RELEASE (session->multi);
+	}
+
+	g_free (session);
+}
+
+static void
+rspamd_fuzzy_mirror_session_destroy (struct fuzzy_master_update_session *session)
+{
+	if (session) {
+		rspamd_http_connection_reset (session->conn);
+		rspamd_http_connection_unref (session->conn);
+		rspamd_inet_address_free (session->addr);
+		close (session->sock);
+
+		if (session->psrc) {
+			g_free (session->psrc);
+		}
+		g_free (session);
+	}
+}
+
+static void
+rspamd_fuzzy_mirror_error_handler (struct rspamd_http_connection *conn, GError *err)
+{
+	struct fuzzy_master_update_session *session = conn->ud;
+
+	msg_err_fuzzy_update ("abnormally closing connection from: %s, error: %e",
+		rspamd_inet_address_to_string (session->addr), err);
+	/* Terminate session immediately */
+	rspamd_fuzzy_mirror_session_destroy (session);
+}
+
+static void
+rspamd_fuzzy_mirror_send_reply (struct fuzzy_master_update_session *session,
+		guint code, const gchar *str)
+{
+	struct rspamd_http_message *msg;
+
+	msg = rspamd_http_new_message (HTTP_RESPONSE);
+	msg->url = rspamd_fstring_new_init (str, strlen (str));
+	msg->code = code;
+	session->replied = TRUE;
+
+	rspamd_http_connection_reset (session->conn);
+	rspamd_http_connection_write_message (session->conn, msg, NULL, "text/plain",
+			session, session->sock, &session->ctx->master_io_tv,
+			session->ctx->ev_base);
+}
+
+/*
+ * Parses replication frame and returns batches newer than our revision
+ */
+static gboolean
+rspamd_fuzzy_stream_parse (struct fuzzy_master_update_session *session,
+		struct rspamd_http_message *msg, guint64 our_rev, GPtrArray *batches)
+{
+	struct fuzzy_replication_hdr hdr;
+	struct fuzzy_replication_batch *batch;
+	struct fuzzy_peer_cmd cmd;
+	const guchar *p;
+	guchar *out = NULL;
+	gsize remain, r;
+	guint64 raw_len, rev, prev_rev = our_rev;
+	guint32 nbatches, ncmds, len, flags;
+	guint i, j;
+
+	p = rspamd_http_message_get_body (msg, &remain);
+
+	if (p == NULL || remain < sizeof (hdr)) {
+		msg_err_fuzzy_update ("short replication frame, not processing");
+		return FALSE;
+	}
+
+	memcpy (&hdr, p, sizeof (hdr));
+	p += sizeof (hdr);
+	remain -= sizeof (hdr);
+	raw_len = GUINT64_FROM_LE (hdr.raw_len);
+	flags = GUINT32_FROM_LE (hdr.flags);
+	nbatches = GUINT32_FROM_LE (hdr.nbatches);
+
+	if (memcmp (hdr.magic, FUZZY_REPLICATION_MAGIC, sizeof (hdr.magic)) != 0 ||
+			GUINT32_FROM_LE (hdr.version) != FUZZY_REPLICATION_VERSION ||
+			raw_len > FUZZY_REPLICATION_MAX_LEN) {
+		msg_err_fuzzy_update ("invalid replication frame header, not processing");
+		return FALSE;
+	}
+
+	if (flags & FUZZY_REPLICATION_FLAG_ZSTD) {
+		out = g_malloc (MAX (raw_len, 1));
+		r = ZSTD_decompress (out, raw_len, p, remain);
+
+		if (ZSTD_isError (r) || r != raw_len) {
+			msg_err_fuzzy_update ("cannot decompress replication frame: %s",
+					ZSTD_isError (r) ? ZSTD_getErrorName (r) : "bad length");
+			g_free (out);
+
+			return FALSE;
+		}
+
+		p = out;
+		remain = raw_len;
+	}
+	else if (remain != raw_len) {
+		msg_err_fuzzy_update ("bad replication frame length: %z, %L expected",
+				remain, raw_len);
+		return FALSE;
+	}
+
+	for (i = 0; i < nbatches; i ++) {
+		if (remain < sizeof (rev) + sizeof (ncmds)) {
+			goto err;
+		}
+
+		memcpy (&rev, p, sizeof (rev));
+		rev = GUINT64_FROM_LE (rev);
+		memcpy (&ncmds, p + sizeof (rev), sizeof (ncmds));
+		ncmds = GUINT32_FROM_LE (ncmds);
+		p += sizeof (rev) + sizeof (ncmds);
+		remain -= sizeof (rev) + sizeof (ncmds);
+		batch = NULL;
+
+		/* Batches that are already applied are just skipped */
+		if (rev > prev_rev) {
+			if (rev > prev_rev + 1) {
+				msg_warn_fuzzy_update ("replication stream gap: revision %L "
+						"follows %L, cold sync is recommended", rev, prev_rev);
 			}
-			else {
-				if ((flag_ptr = g_hash_table_lookup (session->ctx->master_flags,
-						GUINT_TO_POINTER (cmd.cmd.normal.flag))) != NULL) {
-					cmd.cmd.normal.flag = GPOINTER_TO_UINT (flag_ptr);
-				}
+
+			batch = g_malloc0 (sizeof (*batch));
+			batch->rev = rev;
+			batch->updates = g_array_sized_new (FALSE, FALSE,
+					sizeof (struct fuzzy_peer_cmd), ncmds);
+			g_ptr_array_add (batches, batch);
+			prev_rev = rev;
+		}
+
+		for (j = 0; j < ncmds; j ++) {
+			if (remain < sizeof (len)) {
+				goto err;
+			}
+
+			memcpy (&len, p, sizeof (len));
+			len = GUINT32_FROM_LE (len);
+			p += sizeof (len);
+			remain -= sizeof (len);
+
+			if (remain < len ||
+					len < sizeof (struct rspamd_fuzzy_cmd) + sizeof (guint32) ||
+					len > sizeof (cmd)) {
+				goto err;
+			}
+
+			memset (&cmd, 0, sizeof (cmd));
+			memcpy (&cmd, p, len);
+
+			if (cmd.is_shingle && len != sizeof (cmd)) {
+				goto err;
 			}
 
-			g_array_append_val (session->ctx->updates_pending, cmd);
+			if (batch) {
+				rspamd_fuzzy_mirror_map_flags (session->ctx, &cmd);
+				g_array_append_val (batch->updates, cmd);
+			}
 
 			p += len;
 			remain -= len;
-			len = 0;
-			state = read_len;
-			cnt ++;
-			break;
-		case finish_processing:
-			/* Do nothing */
-			remain = 0;
-			break;
 		}
 	}
 
+	g_free (out);
 
-	rspamd_fuzzy_process_updates_queue (session->ctx, session->src, TRUE);
-	msg_info_fuzzy_update ("processed updates from the master %s, "
-			"%ud operations processed,"
-			" revision: %d (local revision: %d)",
-			rspamd_inet_address_to_string (session->addr),
-			cnt, revision, our_rev);
+	return TRUE;
 
 err:
-	return;
-}
+	msg_err_fuzzy_update ("malformed replication frame from %s, not processing",
+			rspamd_inet_address_to_string (session->addr));
+	g_free (out);
 
+	return FALSE;
+}
 
 static void
-fuzzy_session_destroy (gpointer d)
+rspamd_fuzzy_mirror_send_ack (struct fuzzy_master_update_session *session,
+		guint64 rev)
 {
-	struct fuzzy_session *session = d;
+	struct rspamd_http_message *msg;
+	rspamd_fstring_t *reply;
 
-	rspamd_inet_address_free (session->addr);
-	rspamd_explicit_memzero (session->nm, sizeof (session->nm));
-	session->worker->nconns--;
-	g_free (session);
+	msg = rspamd_http_new_message (HTTP_RESPONSE);
+	msg->url = rspamd_fstring_new_init ("OK", 2);
+	msg->code = 200;
+	reply = rspamd_fstring_sized_new (sizeof ("18446744073709551616"));
+	rspamd_printf_fstring (&reply, "%uL", rev);
+	rspamd_http_message_set_body_from_fstring_steal (msg, reply);
+	session->replied = TRUE;
+
+	rspamd_http_connection_reset (session->conn);
+	rspamd_http_connection_write_message (session->conn, msg, NULL, "text/plain",
+			session, session->sock, &session->ctx->master_io_tv,
+			session->ctx->ev_base);
 }
 
+struct fuzzy_stream_apply {
+	struct fuzzy_master_update_session *session;
+	GPtrArray *batches;
+	guint cur;
+	guint64 applied_rev;
+};
+
+static void rspamd_fuzzy_stream_apply_next (struct fuzzy_stream_apply *st);
+
 static void
-rspamd_fuzzy_mirror_session_destroy (struct fuzzy_master_update_session *session)
+rspamd_fuzzy_stream_updates_cb (gboolean success,
+		guint nadded,
+		guint ndeleted,
+		guint nextended,
+		guint nignored,
+		void *ud)
 {
-	if (session) {
-		rspamd_http_connection_reset (session->conn);
-		rspamd_http_connection_unref (session->conn);
-		rspamd_inet_address_free (session->addr);
-		close (session->sock);
+	struct fuzzy_stream_apply *st = ud;
+	struct fuzzy_master_update_session *session = st->session;
+	struct fuzzy_replication_batch *batch;
 
-		if (session->psrc) {
-			g_free (session->psrc);
-		}
-		g_free (session);
+	batch = g_ptr_array_index (st->batches, st->cur);
+
+	if (success) {
+		rspamd_fuzzy_hot_cache_invalidate_updates (session->ctx, batch->updates);
+		msg_info_fuzzy_update ("applied replication batch from %s, "
+				"revision %L: %d added, %d deleted, %d extended, %d duplicates",
+				session->src, batch->rev,
+				nadded, ndeleted, nextended, nignored);
+		st->applied_rev = batch->rev;
+		st->cur ++;
+	}
+	else {
+		/* Master resends batches starting from the acked revision */
+		msg_err_fuzzy_update ("cannot apply replication batch from %s, "
+				"revision %L", session->src, batch->rev);
+		st->cur = st->batches->len;
 	}
+
+	rspamd_fuzzy_stream_apply_next (st);
 }
 
+/*
+ * Batches are applied one by one, each in its own transaction, so
+ * backend revision follows revision of the master
+ */
 static void
-rspamd_fuzzy_mirror_error_handler (struct rspamd_http_connection *conn, GError *err)
+rspamd_fuzzy_stream_apply_next (struct fuzzy_stream_apply *st)
 {
-	struct fuzzy_master_update_session *session = conn->ud;
+	struct fuzzy_master_update_session *session = st->session;
+	struct fuzzy_replication_batch *batch;
+	guint64 *prev;
 
-	msg_err_fuzzy_update ("abnormally closing connection from: %s, error: %e",
-		rspamd_inet_address_to_string (session->addr), err);
-	/* Terminate session immediately */
-	rspamd_fuzzy_mirror_session_destroy (session);
+	if (st->cur < st->batches->len) {
+		batch = g_ptr_array_index (st->batches, st->cur);
+		rspamd_fuzzy_backend_process_updates (session->ctx->backend,
+				batch->updates, session->src,
+				rspamd_fuzzy_stream_updates_cb, st);
+
+		return;
+	}
+
+	prev = g_hash_table_lookup (session->ctx->master_revs, session->src);
+
+	if (prev == NULL) {
+		prev = g_malloc (sizeof (*prev));
+		g_hash_table_insert (session->ctx->master_revs,
+				g_strdup (session->src), prev);
+	}
+
+	*prev = st->applied_rev;
+	rspamd_fuzzy_mirror_send_ack (session, st->applied_rev);
+	g_ptr_array_free (st->batches, TRUE);
+	g_free (st);
 }
 
 static void
-rspamd_fuzzy_mirror_send_reply (struct fuzzy_master_update_session *session,
-		guint code, const gchar *str)
+rspamd_fuzzy_mirror_process_stream (struct fuzzy_master_update_session *session,
+		struct rspamd_http_message *msg, guint64 our_rev)
 {
-	struct rspamd_http_message *msg;
+	struct fuzzy_stream_apply *st;
+	guint64 *known;
 
-	msg = rspamd_http_new_message (HTTP_RESPONSE);
-	msg->url = rspamd_fstring_new_init (str, strlen (str));
-	msg->code = code;
-	session->replied = TRUE;
+	if (session->ctx->master_revs == NULL) {
+		session->ctx->master_revs = g_hash_table_new_full (rspamd_str_hash,
+				rspamd_str_equal, g_free, g_free);
+	}
 
-	rspamd_http_connection_reset (session->conn);
-	rspamd_http_connection_write_message (session->conn, msg, NULL, "text/plain",
-			session, session->sock, &session->ctx->master_io_tv,
-			session->ctx->ev_base);
+	/* Revision might be ahead of backend if some batches were gaps */
+	known = g_hash_table_lookup (session->ctx->master_revs, session->src);
+
+	if (known && *known > our_rev) {
+		our_rev = *known;
+	}
+
+	st = g_malloc0 (sizeof (*st));
+	st->session = session;
+	st->applied_rev = our_rev;
+	st->batches = g_ptr_array_new_with_free_func (fuzzy_replication_batch_free);
+
+	if (!rspamd_fuzzy_stream_parse (session, msg, our_rev, st->batches)) {
+		g_ptr_array_free (st->batches, TRUE);
+		g_free (st);
+		rspamd_fuzzy_mirror_send_reply (session, 400, "Malformed stream");
+
+		return;
+	}
+
+	rspamd_fuzzy_stream_apply_next (st);
 }
 
 static void
@@ -1434,6 +2654,12 @@ rspamd_fuzzy_update_version_callback (guint64 version, void *ud)
 {
 	struct fuzzy_master_update_session *session = ud;
 
+	if (session->stream) {
+		rspamd_fuzzy_mirror_process_stream (session, session->msg, version);
+
+		return;
+	}
+
 	rspamd_fuzzy_mirror_process_update (session, session->msg, version);
 	rspamd_fuzzy_mirror_send_reply (session, 200, "OK");
 }
@@ -1489,6 +2715,9 @@ rspamd_fuzzy_mirror_finish_handler (struct rspamd_http_connection *conn,
 
 		/* Detect source from url: /update_v1/<source>, so we look for the last '/' */
 		remain = msg->url->len;
+		session->stream = msg->url->len > sizeof ("/update_v2/") - 1 &&
+				memcmp (msg->url->str, "/update_v2/",
+						sizeof ("/update_v2/") - 1) == 0;
 		psrc = rspamd_fstringdup (msg->url);
 		src = psrc;
 
@@ -1711,7 +2940,7 @@ rspamd_fuzzy_collection_data (struct rspamd_http_connection_entry *conn_ent,
 	reply = rspamd_fstring_append (reply, (const gchar *)&cmdlen,
 			sizeof (cmdlen));
 
-	ctx->updates_pending->len = 0;
+	rspamd_fuzzy_clear_updates (ctx);
 	/* Clear failed attempts counter */
 	ctx->updates_failed = 0;
 	ctx->collection_id ++;
@@ -1775,7 +3004,7 @@ rspamd_fuzzy_collection_periodic (gint fd, gshort what, gpointer ud)
 				ctx->updates_pending->len,
 				ctx->updates_maxfail);
 		ctx->updates_failed = 0;
-		ctx->updates_pending->len = 0;
+		rspamd_fuzzy_clear_updates (ctx);
 		/* Regenerate cookie */
 		ottery_rand_bytes (ctx->cookie, sizeof (ctx->cookie));
 	}
@@ -1871,30 +3100,219 @@ accept_fuzzy_mirror_socket (gint fd, short what, void *arg)
 			ctx->ev_base);
 }
 
+static void
+fuzzy_multi_session_destroy (gpointer d)
+{
+	struct fuzzy_multi_session *multi = d;
+
+	rspamd_inet_address_free (multi->addr);
+	rspamd_explicit_memzero (multi->nm, sizeof (multi->nm));
+	g_free (multi->reply);
+	g_free (multi);
+}
+
+static gboolean
+rspamd_fuzzy_process_multi (struct rspamd_worker *worker, gint fd,
+		guchar *buf, gsize len, rspamd_inet_addr_t *addr)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = worker->ctx;
+	struct rspamd_fuzzy_encrypted_req_hdr *hdr;
+	struct rspamd_fuzzy_multi_hdr mhdr;
+	struct rspamd_fuzzy_cmd cmd;
+	struct fuzzy_multi_session *multi;
+	struct fuzzy_session *session;
+	struct fuzzy_key_stat *key_stat = NULL;
+	guchar nm[rspamd_cryptobox_MAX_NMBYTES], *p, *end;
+	gsize cmdlen, cmdlens[RSPAMD_FUZZY_MULTI_MAX_CMDS];
+	guint i;
+
+	if (len < sizeof (*hdr) + sizeof (mhdr)) {
+		return FALSE;
+	}
+
+	hdr = (struct rspamd_fuzzy_encrypted_req_hdr *)buf;
+	p = buf + sizeof (*hdr);
+	end = buf + len;
+
+	if (!rspamd_fuzzy_decrypt_payload (ctx, hdr, fuzzy_multi_magic,
+			p, end - p, nm, &key_stat)) {
+		return FALSE;
+	}
+
+	memcpy (&mhdr, p, sizeof (mhdr));
+	p += sizeof (mhdr);
+
+	if (mhdr.version != RSPAMD_FUZZY_MULTI_VERSION || mhdr.ncmds == 0 ||
+			mhdr.ncmds > RSPAMD_FUZZY_MULTI_MAX_CMDS) {
+		msg_debug ("invalid multi-command frame header");
+		rspamd_explicit_memzero (nm, sizeof (nm));
+
+		return FALSE;
+	}
+
+	/* Validate the whole frame before processing any command */
+	for (i = 0; i < mhdr.ncmds; i ++) {
+		if (end - p < (gssize)sizeof (cmd)) {
+			break;
+		}
+
+		memcpy (&cmd, p, sizeof (cmd));
+		cmdlen = cmd.shingles_count > 0 ?
+				sizeof (struct rspamd_fuzzy_shingle_cmd) : sizeof (cmd);
+
+		if (end - p < (gssize)cmdlen ||
+				rspamd_fuzzy_command_valid (&cmd, cmdlen) !=
+				RSPAMD_FUZZY_EPOCH11) {
+			break;
+		}
+
+		cmdlens[i] = cmdlen;
+		p += cmdlen;
+	}
+
+	if (i != mhdr.ncmds || p != end) {
+		msg_debug ("invalid multi-command frame of size %z received", len);
+		rspamd_explicit_memzero (nm, sizeof (nm));
+
+		return FALSE;
+	}
+
+	multi = g_malloc0 (sizeof (*multi));
+	REF_INIT_RETAIN (multi, fuzzy_multi_session_destroy);
+	multi->worker = worker;
+	multi->ctx = ctx;
+	multi->fd = fd;
+	multi->addr = addr;
+	multi->ncmds = mhdr.ncmds;
+	multi->pending = mhdr.ncmds;
+	memcpy (multi->nm, nm, sizeof (multi->nm));
+	rspamd_explicit_memzero (nm, sizeof (nm));
+	multi->reply_len = sizeof (struct rspamd_fuzzy_encrypted_rep_hdr) +
+			sizeof (mhdr) + mhdr.ncmds * sizeof (struct rspamd_fuzzy_reply);
+	multi->reply = g_malloc0 (multi->reply_len);
+	mhdr.reserved[0] = 0;
+	mhdr.reserved[1] = 0;
+	memcpy (multi->reply + sizeof (struct rspamd_fuzzy_encrypted_rep_hdr),
+			&mhdr, sizeof (mhdr));
+
+	/* Each command is accounted as a separate connection */
+	worker->nconns += mhdr.ncmds - 1;
+	p = buf + sizeof (*hdr) + sizeof (mhdr);
+
+	for (i = 0; i < mhdr.ncmds; i ++) {
+		session = g_malloc0 (sizeof (*session));
+		REF_INIT_RETAIN (session, fuzzy_session_destroy);
+		session->worker = worker;
+		session->fd = fd;
+		session->ctx = ctx;
+		session->time = (guint64) time (NULL);
+		session->addr = rspamd_inet_address_copy (addr);
+		session->epoch = RSPAMD_FUZZY_EPOCH11;
+		session->key_stat = key_stat;
+		session->multi = multi;
+		session->multi_idx = i;
+		REF_RETAIN (multi);
+
+		if (cmdlens[i] == sizeof (struct rspamd_fuzzy_shingle_cmd)) {
+			session->cmd_type = CMD_SHINGLE;
+			memcpy (&session->cmd.shingle, p, cmdlens[i]);
+		}
+		else {
+			session->cmd_type = CMD_NORMAL;
+			memcpy (&session->cmd.normal, p, cmdlens[i]);
+		}
+
+		p += cmdlens[i];
+		rspamd_fuzzy_process_command (session);
+		REF_RELEASE (session);
+	}
+
+	REF_RELEASE (multi);
+
+	return TRUE;
+}
+
+static void
+rspamd_fuzzy_count_invalid (struct rspamd_fuzzy_storage_ctx *ctx,
+		rspamd_inet_addr_t *addr, gsize len)
+{
+	guint64 *nerrors;
+
+	ctx->stat.invalid_requests ++;
+	msg_debug ("invalid fuzzy command of size %z received", len);
+
+	nerrors = rspamd_lru_hash_lookup (ctx->errors_ips, addr, -1);
+
+	if (nerrors == NULL) {
+		nerrors = g_malloc (sizeof (*nerrors));
+		*nerrors = 1;
+		rspamd_lru_hash_insert (ctx->errors_ips,
+				rspamd_inet_address_copy (addr),
+				nerrors, -1, -1);
+	}
+	else {
+		*nerrors = *nerrors + 1;
+	}
+}
+
 /*
  * Accept new connection and construct task
  */
+static void
+rspamd_fuzzy_process_datagram (struct rspamd_worker *worker, gint fd,
+		guchar *buf, gsize len, rspamd_inet_addr_t *addr)
+{
+	struct fuzzy_session *session;
+
+	if (len >= sizeof (fuzzy_multi_magic) &&
+			memcmp (buf, fuzzy_multi_magic, sizeof (fuzzy_multi_magic)) == 0) {
+		if (!rspamd_fuzzy_process_multi (worker, fd, buf, len, addr)) {
+			rspamd_fuzzy_count_invalid (worker->ctx, addr, len);
+			rspamd_inet_address_free (addr);
+			worker->nconns --;
+		}
+
+		return;
+	}
+
+	session = g_malloc0 (sizeof (*session));
+	REF_INIT_RETAIN (session, fuzzy_session_destroy);
+	session->worker = worker;
+	session->fd = fd;
+	session->ctx = worker->ctx;
+	session->time = (guint64) time (NULL);
+	session->addr = addr;
+
+	if (rspamd_fuzzy_cmd_from_wire (buf, len, session)) {
+		/* Check shingles count sanity */
+		rspamd_fuzzy_process_command (session);
+	}
+	else {
+		/* Discard input */
+		rspamd_fuzzy_count_invalid (session->ctx, addr, len);
+	}
+
+	REF_RELEASE (session);
+}
+
 static void
 accept_fuzzy_socket (gint fd, short what, void *arg)
 {
 	struct rspamd_worker *worker = (struct rspamd_worker *)arg;
-	struct fuzzy_session *session;
-	rspamd_inet_addr_t *addr;
-	gssize r;
-	guint8 buf[512];
-	guint64 *nerrors;
+	struct rspamd_fuzzy_storage_ctx *ctx = worker->ctx;
+	rspamd_inet_addr_t **addrs;
+	gsize *lens;
+	gint r, i;
+	GPtrArray *replies, *checks;
 
 	/* Got some data */
 	if (what == EV_READ) {
+		addrs = g_alloca (sizeof (*addrs) * ctx->io_batch);
+		lens = g_alloca (sizeof (*lens) * ctx->io_batch);
 
 		for (;;) {
-			worker->nconns++;
-
-			r = rspamd_inet_address_recvfrom (fd,
-					buf,
-					sizeof (buf),
-					0,
-					&addr);
+			r = rspamd_inet_address_recvmmsg (fd, ctx->io_bufs,
+					FUZZY_INPUT_BUFLEN, lens, addrs, ctx->io_batch);
 
 			if (r == -1) {
 				if (errno == EINTR) {
@@ -1911,39 +3329,32 @@ accept_fuzzy_socket (gint fd, short what, void *arg)
 				return;
 			}
 
-			session = g_malloc0 (sizeof (*session));
-			REF_INIT_RETAIN (session, fuzzy_session_destroy);
-			session->worker = worker;
-			session->fd = fd;
-			session->ctx = worker->ctx;
-			session->time = (guint64) time (NULL);
-			session->addr = addr;
+			worker->nconns += r;
 
-			if (rspamd_fuzzy_cmd_from_wire (buf, r, session)) {
-				/* Check shingles count sanity */
-				rspamd_fuzzy_process_command (session);
+			if (r > 1) {
+				replies = g_ptr_array_sized_new (r);
+				ctx->replies_batch = replies;
+				ctx->checks_batch = g_ptr_array_sized_new (r);
 			}
 			else {
-				/* Discard input */
-				session->ctx->stat.invalid_requests ++;
-				msg_debug ("invalid fuzzy command of size %z received", r);
-
-				nerrors = rspamd_lru_hash_lookup (session->ctx->errors_ips,
-						addr, -1);
-
-				if (nerrors == NULL) {
-					nerrors = g_malloc (sizeof (*nerrors));
-					*nerrors = 1;
-					rspamd_lru_hash_insert (session->ctx->errors_ips,
-							rspamd_inet_address_copy (addr),
-							nerrors, -1, -1);
-				}
-				else {
-					*nerrors = *nerrors + 1;
-				}
+				replies = NULL;
 			}
 
-			REF_RELEASE (session);
+			for (i = 0; i < r; i ++) {
+				rspamd_fuzzy_process_datagram (worker, fd, ctx->io_bufs[i],
+						lens[i], addrs[i]);
+			}
+
+			if (replies) {
+				checks = ctx->checks_batch;
+				ctx->checks_batch = NULL;
+				rspamd_fuzzy_flush_checks (ctx, checks);
+
+				/* Replies from asynchronous backends are sent one by one */
+				ctx->replies_batch = NULL;
+				rspamd_fuzzy_flush_replies (ctx, replies);
+				g_ptr_array_free (replies, TRUE);
+			}
 		}
 	}
 }
@@ -2006,6 +3417,11 @@ rspamd_fuzzy_storage_reload (struct rspamd_main *rspamd_main,
 		rspamd_fuzzy_backend_close (ctx->backend);
 	}
 
+	if (ctx->hot_cache) {
+		memset (ctx->hot_cache->elts, 0,
+				sizeof (*ctx->hot_cache->elts) * (ctx->hot_cache->mask + 1));
+	}
+
 	memset (&rep, 0, sizeof (rep));
 	rep.type = RSPAMD_CONTROL_RELOAD;
 
@@ -2122,6 +3538,42 @@ rspamd_fuzzy_stat_to_ucl (struct rspamd_fuzzy_storage_ctx *ctx, gboolean ip_stat
 			"invalid_requests",
 			0,
 			false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromint (ctx->stat.updates_coalesced),
+			"updates_coalesced",
+			0,
+			false);
+
+	if (ctx->hot_cache) {
+		ucl_object_insert_key (obj,
+				ucl_object_fromint (ctx->stat.hot_cache_hits),
+				"hot_cache_hits",
+				0,
+				false);
+		ucl_object_insert_key (obj,
+				ucl_object_fromint (ctx->stat.hot_cache_misses),
+				"hot_cache_misses",
+				0,
+				false);
+	}
+
+	if (ctx->keypair_cache) {
+		guint64 hits, misses;
+		guint size, max_items;
+
+		rspamd_keypair_cache_stat (ctx->keypair_cache, &hits, &misses,
+				&size, &max_items);
+		elt = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (elt, ucl_object_fromint (hits),
+				"hits", 0, false);
+		ucl_object_insert_key (elt, ucl_object_fromint (misses),
+				"misses", 0, false);
+		ucl_object_insert_key (elt, ucl_object_fromint (size),
+				"size", 0, false);
+		ucl_object_insert_key (elt, ucl_object_fromint (max_items),
+				"max_size", 0, false);
+		ucl_object_insert_key (obj, elt, "keypair_cache", 0, false);
+	}
 
 	if (ctx->errors_ips && ip_stat) {
 		ip_hash = rspamd_lru_hash_get_htable (ctx->errors_ips);
@@ -2294,6 +3746,19 @@ fuzzy_storage_parse_mirror (rspamd_mempool_t *pool,
 
 	up = g_malloc0 (sizeof (*up));
 	up->name = g_strdup (ucl_object_tostring (elt));
+	up->version = 1;
+
+	elt = ucl_object_lookup (obj, "version");
+	if (elt != NULL) {
+		up->version = ucl_object_toint (elt);
+
+		if (up->version < 1 || up->version > 2) {
+			g_set_error (err, g_quark_try_string ("fuzzy"), 100,
+					"invalid mirror protocol version: %d", up->version);
+
+			goto err;
+		}
+	}
 
 	elt = ucl_object_lookup (obj, "key");
 	if (elt != NULL) {
@@ -2491,6 +3956,9 @@ init_fuzzy (struct rspamd_config *cfg)
 	rspamd_mempool_add_destructor (cfg->cfg_pool,
 			(rspamd_mempool_destruct_t)rspamd_ptr_array_free_hard, ctx->mirrors);
 	ctx->updates_maxfail = DEFAULT_UPDATES_MAXFAIL;
+	ctx->replication_log_size = DEFAULT_REPLICATION_LOG_SIZE;
+	ctx->hot_cache_ttl = DEFAULT_HOT_CACHE_TTL;
+	ctx->io_batch = DEFAULT_IO_BATCH;
 	ctx->collection_id_file = RSPAMD_DBDIR "/fuzzy_collection.id";
 
 	rspamd_rcl_register_worker_option (cfg,
@@ -2641,6 +4109,14 @@ init_fuzzy (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, updates_maxfail),
 			RSPAMD_CL_FLAG_UINT,
 			"Maximum number of updates to be failed before discarding");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"replication_log_size",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, replication_log_size),
+			RSPAMD_CL_FLAG_UINT,
+			"Number of recent update batches kept to stream to mirrors with version = 2");
 	rspamd_rcl_register_worker_option (cfg,
 			type,
 			"collection_only",
@@ -2681,6 +4157,41 @@ init_fuzzy (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, skip_map),
 			0,
 			"Skip specific hashes from the map");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"hot_cache_size",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, hot_cache_size),
+			RSPAMD_CL_FLAG_UINT,
+			"Number of recently checked hashes to keep in memory, default: 0 (disabled)");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"hot_cache_ttl",
+			rspamd_rcl_parse_struct_time,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, hot_cache_ttl),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Time to keep hashes in memory, default: "
+			G_STRINGIFY (DEFAULT_HOT_CACHE_TTL) " seconds");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"io_batch",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, io_batch),
+			RSPAMD_CL_FLAG_UINT,
+			"Maximum number of datagrams to read and reply at once, default: "
+			G_STRINGIFY (DEFAULT_IO_BATCH));
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"reuseport",
+			rspamd_rcl_parse_struct_boolean,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, reuseport),
+			0,
+			"Use a separate UDP socket in each worker to let the kernel "
+			"distribute requests between workers");
 
 	return ctx;
 }
@@ -2704,7 +4215,7 @@ rspamd_fuzzy_peer_io (gint fd, gshort what, gpointer d)
 		}
 	}
 	else {
-		g_array_append_val (ctx->updates_pending, cmd);
+		rspamd_fuzzy_queue_update (ctx, &cmd);
 	}
 }
 
@@ -2740,8 +4251,25 @@ fuzzy_peer_rep (struct rspamd_worker *worker,
 					rspamd_inet_address_to_string_pretty (ls->addr));
 
 			if (ls->type == RSPAMD_WORKER_SOCKET_UDP) {
+				gint fd = ls->fd;
+
+				if (ctx->reuseport && worker->index > 0) {
+					/* The first worker still listens on the shared socket */
+					fd = rspamd_inet_address_listen (ls->addr, SOCK_DGRAM, TRUE);
+
+					if (fd == -1) {
+						msg_warn ("cannot create own socket for %s, "
+								"use the shared one",
+								rspamd_inet_address_to_string_pretty (ls->addr));
+						fd = ls->fd;
+					}
+					else {
+						g_array_append_val (ctx->reuseport_fds, fd);
+					}
+				}
+
 				accept_events = g_malloc0 (sizeof (struct event) * 2);
-				event_set (&accept_events[0], ls->fd, EV_READ | EV_PERSIST,
+				event_set (&accept_events[0], fd, EV_READ | EV_PERSIST,
 						accept_fuzzy_socket, worker);
 				event_base_set (ctx->ev_base, &accept_events[0]);
 				event_add (&accept_events[0], NULL);
@@ -2789,6 +4317,8 @@ start_fuzzy (struct rspamd_worker *worker)
 	GError *err = NULL;
 	struct rspamd_srv_command srv_cmd;
 	struct rspamd_config *cfg = worker->srv->cfg;
+	struct rspamd_fuzzy_mirror *m;
+	guint i;
 
 	ctx->ev_base = rspamd_prepare_worker (worker,
 			"fuzzy",
@@ -2796,6 +4326,18 @@ start_fuzzy (struct rspamd_worker *worker)
 	ctx->peer_fd = -1;
 	ctx->worker = worker;
 	ctx->cfg = worker->srv->cfg;
+	ctx->reuseport_fds = g_array_new (FALSE, FALSE, sizeof (gint));
+
+	if (ctx->io_batch == 0) {
+		ctx->io_batch = 1;
+	}
+
+	ctx->io_bufs = g_malloc (sizeof (*ctx->io_bufs) * ctx->io_batch);
+	ctx->io_bufs[0] = g_malloc (FUZZY_INPUT_BUFLEN * ctx->io_batch);
+
+	for (i = 1; i < ctx->io_batch; i ++) {
+		ctx->io_bufs[i] = ctx->io_bufs[0] + FUZZY_INPUT_BUFLEN * i;
+	}
 	double_to_tv (ctx->master_timeout, &ctx->master_io_tv);
 
 	ctx->resolver = dns_resolver_init (worker->srv->logger,
@@ -2823,10 +4365,23 @@ start_fuzzy (struct rspamd_worker *worker)
 
 		rspamd_fuzzy_backend_count (ctx->backend, fuzzy_count_callback, ctx);
 
+		if (ctx->hot_cache_size > 0) {
+			ctx->hot_cache = rspamd_fuzzy_hot_cache_new (ctx->hot_cache_size);
+		}
 
 		if (worker->index == 0) {
 			ctx->updates_pending = g_array_sized_new (FALSE, FALSE,
 					sizeof (struct fuzzy_peer_cmd), 1024);
+			ctx->updates_index = g_hash_table_new_full (
+					rspamd_fuzzy_digest_hash, rspamd_fuzzy_digest_equal,
+					g_free, NULL);
+
+			PTR_ARRAY_FOREACH (ctx->mirrors, i, m) {
+				if (m->version >= 2 && ctx->replication_log == NULL) {
+					ctx->replication_log = g_queue_new ();
+				}
+			}
+
 			rspamd_fuzzy_backend_start_update (ctx->backend, ctx->sync_timeout,
 					rspamd_fuzzy_storage_periodic_callback, ctx);
 		}
@@ -2852,6 +4407,9 @@ start_fuzzy (struct rspamd_worker *worker)
 		if (worker->index == 0) {
 			ctx->updates_pending = g_array_sized_new (FALSE, FALSE,
 					sizeof (struct fuzzy_peer_cmd), 1024);
+			ctx->updates_index = g_hash_table_new_full (
+					rspamd_fuzzy_digest_hash, rspamd_fuzzy_digest_equal,
+					g_free, NULL);
 			double_to_tv (ctx->sync_timeout, &ctx->stat_tv);
 			event_set (&ctx->stat_ev, -1, EV_TIMEOUT|EV_PERSIST,
 					rspamd_fuzzy_collection_periodic, ctx);
@@ -2979,7 +4537,8 @@ start_fuzzy (struct rspamd_worker *worker)
 	event_base_loop (ctx->ev_base, 0);
 	rspamd_worker_block_signals ();
 
-	if (worker->index == 0 && ctx->updates_pending->len > 0) {
+	if (worker->index == 0 &&
+			(ctx->updates_pending->len > 0 || ctx->updates_in_flight)) {
 		if (!ctx->collection_mode) {
 			rspamd_fuzzy_process_updates_queue (ctx, local_db_name, FALSE);
 			event_base_loop (ctx->ev_base, 0);
@@ -2988,6 +4547,10 @@ start_fuzzy (struct rspamd_worker *worker)
 
 	if (!ctx->collection_mode) {
 		rspamd_fuzzy_backend_close (ctx->backend);
+
+		if (ctx->hot_cache) {
+			rspamd_fuzzy_hot_cache_destroy (ctx->hot_cache);
+		}
 	}
 	else if (worker->index == 0) {
 		gint fd;
@@ -3017,6 +4580,17 @@ start_fuzzy (struct rspamd_worker *worker)
 
 	if (worker->index == 0) {
 		g_array_free (ctx->updates_pending, TRUE);
+		g_hash_table_unref (ctx->updates_index);
+		g_free (ctx->updates_deferred_source);
+
+		if (ctx->replication_log) {
+			g_queue_free_full (ctx->replication_log,
+					fuzzy_replication_batch_free);
+		}
+	}
+
+	if (ctx->master_revs) {
+		g_hash_table_unref (ctx->master_revs);
 	}
 
 	if (ctx->peer_fd != -1) {
@@ -3026,6 +4600,14 @@ start_fuzzy (struct rspamd_worker *worker)
 		close (ctx->peer_fd);
 	}
 
+	for (i = 0; i < ctx->reuseport_fds->len; i ++) {
+		close (g_array_index (ctx->reuseport_fds, gint, i));
+	}
+
+	g_array_free (ctx->reuseport_fds, TRUE);
+	g_free (ctx->io_bufs[0]);
+	g_free (ctx->io_bufs);
+
 	if (ctx->keypair_cache) {
 		rspamd_keypair_cache_destroy (ctx->keypair_cache);
 	}
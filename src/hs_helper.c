@@ -39,6 +39,7 @@ worker_t hs_helper_worker = {
 
 static const gdouble default_max_time = 1.0;
 static const gdouble default_recompile_time = 60.0;
+static const guint default_max_jobs = 1;
 static const guint64 rspamd_hs_helper_magic = 0x22d310157a2288a0ULL;
 
 /*
@@ -57,6 +58,7 @@ struct hs_helper_ctx {
 	gboolean loaded;
 	gdouble max_time;
 	gdouble recompile_time;
+	guint max_jobs;
 	struct event recompile_timer;
 };
 
@@ -74,6 +76,7 @@ init_hs_helper (struct rspamd_config *cfg)
 	ctx->hs_dir = NULL;
 	ctx->max_time = default_max_time;
 	ctx->recompile_time = default_recompile_time;
+	ctx->max_jobs = default_max_jobs;
 
 	rspamd_rcl_register_worker_option (cfg,
 			type,
@@ -107,6 +110,14 @@ init_hs_helper (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct hs_helper_ctx, max_time),
 			RSPAMD_CL_FLAG_TIME_FLOAT,
 			"Maximum time to wait for compilation of a single expression");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"jobs",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct hs_helper_ctx, max_jobs),
+			RSPAMD_CL_FLAG_UINT,
+			"Number of processes used to compile hyperscan classes in parallel");
 
 	return ctx;
 }
@@ -172,6 +183,32 @@ rspamd_hs_helper_cleanup_dir (struct hs_helper_ctx *ctx, gboolean forced)
 		ret = FALSE;
 	}
 
+	globfree (&globbuf);
+
+	/* Shared database images are regenerated by workers on load */
+	memset (&globbuf, 0, sizeof (globbuf));
+	rspamd_snprintf (pattern, len, "%s%c%s", ctx->hs_dir, G_DIR_SEPARATOR, "*.hsmap");
+	if ((rc = glob (pattern, 0, NULL, &globbuf)) == 0) {
+		for (i = 0; i < globbuf.gl_pathc; i++) {
+			gchar *hs_path = g_strndup (globbuf.gl_pathv[i],
+					strlen (globbuf.gl_pathv[i]) - (sizeof ("map") - 1));
+
+			if (forced || access (hs_path, R_OK) == -1) {
+				if (unlink (globbuf.gl_pathv[i]) == -1) {
+					msg_err ("cannot unlink %s: %s", globbuf.gl_pathv[i],
+							strerror (errno));
+					ret = FALSE;
+				}
+			}
+
+			g_free (hs_path);
+		}
+	}
+	else if (rc != GLOB_NOMATCH) {
+		msg_err ("glob %s failed: %s", pattern, strerror (errno));
+		ret = FALSE;
+	}
+
 	globfree (&globbuf);
 	g_free (pattern);
 
@@ -198,6 +235,7 @@ rspamd_rs_compile (struct hs_helper_ctx *ctx, struct rspamd_worker *worker,
 
 	if ((ncompiled = rspamd_re_cache_compile_hyperscan (ctx->cfg->re_cache,
 			ctx->hs_dir, ctx->max_time, !forced,
+			ctx->max_jobs,
 			&err)) == -1) {
 		msg_err ("failed to compile re cache: %e", err);
 		g_error_free (err);
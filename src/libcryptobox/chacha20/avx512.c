@@ -0,0 +1,248 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "chacha.h"
+#include "cryptobox.h"
+#include "platform_config.h"
+
+#if defined(HAVE_AVX512) && defined(RSPAMD_HAS_TARGET_ATTR)
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#ifndef __SSE2__
+#define __SSE2__
+#endif
+#ifndef __SSE__
+#define __SSE__
+#endif
+#ifndef __AVX__
+#define __AVX__
+#endif
+#ifndef __AVX2__
+#define __AVX2__
+#endif
+#ifndef __AVX512F__
+#define __AVX512F__
+#endif
+
+#include <immintrin.h>
+
+/*
+ * Sixteen blocks are processed at once: each vector holds one word of the
+ * state for all blocks, so rounds need no shuffles and blocks are
+ * transposed back to the memory layout at the end
+ */
+#define CHACHA_AVX512_BLOCKS 16
+#define CHACHA_AVX512_BYTES (CHACHA_AVX512_BLOCKS * CHACHA_BLOCKBYTES)
+
+void hchacha_ref (const unsigned char key[32], const unsigned char iv[16],
+		unsigned char out[32], size_t rounds);
+
+#define QUARTER_AVX512(a, b, c, d) do { \
+	a = _mm512_add_epi32 (a, b); d = _mm512_rol_epi32 (_mm512_xor_si512 (d, a), 16); \
+	c = _mm512_add_epi32 (c, d); b = _mm512_rol_epi32 (_mm512_xor_si512 (b, c), 12); \
+	a = _mm512_add_epi32 (a, b); d = _mm512_rol_epi32 (_mm512_xor_si512 (d, a), 8); \
+	c = _mm512_add_epi32 (c, d); b = _mm512_rol_epi32 (_mm512_xor_si512 (b, c), 7); \
+} while (0)
+
+static void
+chacha_avx512_16 (const guint32 *j, guint64 ctr, size_t rounds,
+		const unsigned char *in, unsigned char *out)
+	__attribute__((__target__("avx512f")));
+
+static void
+chacha_avx512_16 (const guint32 *j, guint64 ctr, size_t rounds,
+		const unsigned char *in, unsigned char *out)
+{
+	static const guint32 constants[4] = {
+		0x61707865, 0x3320646e, 0x79622d32, 0x6b206574
+	};
+	guint32 ctr_lo[CHACHA_AVX512_BLOCKS], ctr_hi[CHACHA_AVX512_BLOCKS];
+	__m512i x[16], orig[16], y[16], t0, t1, t2, t3;
+	guint i, g, m, k;
+	size_t r;
+
+	for (i = 0; i < CHACHA_AVX512_BLOCKS; i ++) {
+		ctr_lo[i] = (guint32)(ctr + i);
+		ctr_hi[i] = (guint32)((ctr + i) >> 32);
+	}
+
+	for (i = 0; i < 4; i ++) {
+		orig[i] = _mm512_set1_epi32 (constants[i]);
+	}
+
+	for (i = 0; i < 8; i ++) {
+		orig[i + 4] = _mm512_set1_epi32 (j[i]);
+	}
+
+	orig[12] = _mm512_loadu_si512 ((const void *)ctr_lo);
+	orig[13] = _mm512_loadu_si512 ((const void *)ctr_hi);
+	orig[14] = _mm512_set1_epi32 (j[10]);
+	orig[15] = _mm512_set1_epi32 (j[11]);
+
+	for (i = 0; i < 16; i ++) {
+		x[i] = orig[i];
+	}
+
+	for (r = rounds; r > 0; r -= 2) {
+		QUARTER_AVX512 (x[0], x[4], x[8], x[12]);
+		QUARTER_AVX512 (x[1], x[5], x[9], x[13]);
+		QUARTER_AVX512 (x[2], x[6], x[10], x[14]);
+		QUARTER_AVX512 (x[3], x[7], x[11], x[15]);
+		QUARTER_AVX512 (x[0], x[5], x[10], x[15]);
+		QUARTER_AVX512 (x[1], x[6], x[11], x[12]);
+		QUARTER_AVX512 (x[2], x[7], x[8], x[13]);
+		QUARTER_AVX512 (x[3], x[4], x[9], x[14]);
+	}
+
+	for (i = 0; i < 16; i ++) {
+		x[i] = _mm512_add_epi32 (x[i], orig[i]);
+	}
+
+	/*
+	 * Transpose 4x4 words inside of 128 bit lanes: lane k of y[4 * g + m]
+	 * holds words 4 * g .. 4 * g + 3 of block 4 * k + m
+	 */
+	for (g = 0; g < 4; g ++) {
+		t0 = _mm512_unpacklo_epi32 (x[g * 4], x[g * 4 + 1]);
+		t1 = _mm512_unpackhi_epi32 (x[g * 4], x[g * 4 + 1]);
+		t2 = _mm512_unpacklo_epi32 (x[g * 4 + 2], x[g * 4 + 3]);
+		t3 = _mm512_unpackhi_epi32 (x[g * 4 + 2], x[g * 4 + 3]);
+		y[g * 4] = _mm512_unpacklo_epi64 (t0, t2);
+		y[g * 4 + 1] = _mm512_unpackhi_epi64 (t0, t2);
+		y[g * 4 + 2] = _mm512_unpacklo_epi64 (t1, t3);
+		y[g * 4 + 3] = _mm512_unpackhi_epi64 (t1, t3);
+	}
+
+	/* Then transpose 128 bit lanes to get whole blocks */
+	for (m = 0; m < 4; m ++) {
+		t0 = _mm512_shuffle_i32x4 (y[m], y[4 + m], 0x44);
+		t1 = _mm512_shuffle_i32x4 (y[m], y[4 + m], 0xee);
+		t2 = _mm512_shuffle_i32x4 (y[8 + m], y[12 + m], 0x44);
+		t3 = _mm512_shuffle_i32x4 (y[8 + m], y[12 + m], 0xee);
+		x[0] = _mm512_shuffle_i32x4 (t0, t2, 0x88);
+		x[1] = _mm512_shuffle_i32x4 (t0, t2, 0xdd);
+		x[2] = _mm512_shuffle_i32x4 (t1, t3, 0x88);
+		x[3] = _mm512_shuffle_i32x4 (t1, t3, 0xdd);
+
+		for (k = 0; k < 4; k ++) {
+			i = (k * 4 + m) * CHACHA_BLOCKBYTES;
+
+			if (in) {
+				x[k] = _mm512_xor_si512 (x[k],
+						_mm512_loadu_si512 ((const void *)(in + i)));
+			}
+
+			_mm512_storeu_si512 ((void *)(out + i), x[k]);
+		}
+	}
+}
+
+void
+chacha_blocks_avx512 (chacha_state_internal *state, const unsigned char *in,
+		unsigned char *out, size_t bytes)
+	__attribute__((__target__("avx512f")));
+
+void
+chacha_blocks_avx512 (chacha_state_internal *state, const unsigned char *in,
+		unsigned char *out, size_t bytes)
+{
+	guint32 j[12];
+	guint64 ctr;
+	unsigned char tmp[CHACHA_AVX512_BYTES];
+	size_t i;
+
+	if (!bytes) {
+		return;
+	}
+
+	memcpy (j, state->s, sizeof (j));
+	ctr = ((guint64)j[9] << 32) | j[8];
+
+	while (bytes >= CHACHA_AVX512_BYTES) {
+		chacha_avx512_16 (j, ctr, state->rounds, in, out);
+		ctr += CHACHA_AVX512_BLOCKS;
+		bytes -= CHACHA_AVX512_BYTES;
+		out += CHACHA_AVX512_BYTES;
+
+		if (in) {
+			in += CHACHA_AVX512_BYTES;
+		}
+	}
+
+	if (bytes > 0) {
+		/* Generate key stream for the tail and use as much as needed */
+		chacha_avx512_16 (j, ctr, state->rounds, NULL, tmp);
+		ctr += (bytes + CHACHA_BLOCKBYTES - 1) / CHACHA_BLOCKBYTES;
+
+		if (in) {
+			for (i = 0; i < bytes; i ++) {
+				out[i] = in[i] ^ tmp[i];
+			}
+		}
+		else {
+			memcpy (out, tmp, bytes);
+		}
+
+		rspamd_explicit_memzero (tmp, sizeof (tmp));
+	}
+
+	j[8] = (guint32)ctr;
+	j[9] = (guint32)(ctr >> 32);
+	memcpy (state->s + 32, &j[8], sizeof (guint32) * 2);
+	rspamd_explicit_memzero (j, sizeof (j));
+}
+
+void
+hchacha_avx512 (const unsigned char key[32], const unsigned char iv[16],
+		unsigned char out[32], size_t rounds)
+{
+	/* Single block, nothing to parallelize */
+	hchacha_ref (key, iv, out, rounds);
+}
+
+void
+chacha_avx512 (const chacha_key *key, const chacha_iv *iv,
+		const unsigned char *in, unsigned char *out, size_t inlen,
+		size_t rounds)
+{
+	chacha_state_internal state;
+
+	memcpy (state.s, key->b, 32);
+	memset (state.s + 32, 0, 8);
+	memcpy (state.s + 40, iv->b, 8);
+	state.rounds = rounds;
+	chacha_blocks_avx512 (&state, in, out, inlen);
+	rspamd_explicit_memzero (&state, 48);
+}
+
+void
+xchacha_avx512 (const chacha_key *key, const chacha_iv24 *iv,
+		const unsigned char *in, unsigned char *out, size_t inlen,
+		size_t rounds)
+{
+	chacha_state_internal state;
+
+	hchacha_ref (key->b, iv->b, state.s, rounds);
+	memset (state.s + 32, 0, 8);
+	memcpy (state.s + 40, iv->b + 16, 8);
+	state.rounds = rounds;
+	chacha_blocks_avx512 (&state, in, out, inlen);
+	rspamd_explicit_memzero (&state, 48);
+}
+
+#pragma GCC pop_options
+#endif
@@ -52,6 +52,10 @@ typedef struct chacha_impl_t {
 #define CHACHA_IMPL(cpuflags, desc, ext) \
 		{(cpuflags), desc, chacha_##ext, xchacha_##ext, chacha_blocks_##ext, hchacha_##ext}
 
+#if defined(HAVE_AVX512) && defined(RSPAMD_HAS_TARGET_ATTR)
+	CHACHA_DECLARE(avx512)
+	#define CHACHA_AVX512 CHACHA_IMPL(CPUID_AVX512, "avx512", avx512)
+#endif
 #if defined(HAVE_AVX2)
 	CHACHA_DECLARE(avx2)
 	#define CHACHA_AVX2 CHACHA_IMPL(CPUID_AVX2, "avx2", avx2)
@@ -64,12 +68,19 @@ typedef struct chacha_impl_t {
 	CHACHA_DECLARE(sse2)
 	#define CHACHA_SSE2 CHACHA_IMPL(CPUID_SSE2, "sse2", sse2)
 #endif
+#if defined(__aarch64__) && defined(__ARM_NEON) && !defined(__ARM_BIG_ENDIAN)
+	CHACHA_DECLARE(neon)
+	#define CHACHA_NEON CHACHA_IMPL(CPUID_NEON, "neon", neon)
+#endif
 
 CHACHA_DECLARE(ref)
 #define CHACHA_GENERIC CHACHA_IMPL(0, "generic", ref)
 
 static const chacha_impl_t chacha_list[] = {
 	CHACHA_GENERIC,
+#if defined(CHACHA_AVX512)
+	CHACHA_AVX512,
+#endif
 #if defined(CHACHA_AVX2)
 	CHACHA_AVX2,
 #endif
@@ -77,7 +88,10 @@ static const chacha_impl_t chacha_list[] = {
 	CHACHA_AVX,
 #endif
 #if defined(CHACHA_SSE2)
-	CHACHA_SSE2
+	CHACHA_SSE2,
+#endif
+#if defined(CHACHA_NEON)
+	CHACHA_NEON,
 #endif
 };
 
@@ -106,6 +120,37 @@ chacha_load (void)
 	return chacha_impl->desc;
 }
 
+const char *
+chacha_impl_desc (guint idx)
+{
+	if (idx < G_N_ELEMENTS (chacha_list)) {
+		return chacha_list[idx].desc;
+	}
+
+	return NULL;
+}
+
+int
+chacha_load_impl (const char *desc)
+{
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (chacha_list); i ++) {
+		if (strcmp (chacha_list[i].desc, desc) == 0) {
+			if (chacha_list[i].cpu_flags != 0 &&
+					!(chacha_list[i].cpu_flags & cpu_config)) {
+				return FALSE;
+			}
+
+			chacha_impl = &chacha_list[i];
+
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
 void chacha_init (chacha_state *S, const chacha_key *key,
 		const chacha_iv *iv, size_t rounds)
 {
@@ -74,5 +74,9 @@ void xchacha (const chacha_key *key, const chacha_iv24 *iv,
 		size_t rounds);
 
 const char* chacha_load (void);
+/* Returns description of the implementation number idx or NULL */
+const char* chacha_impl_desc (unsigned int idx);
+/* Switches to the implementation with the specified description if CPU allows */
+int chacha_load_impl (const char *desc);
 
 #endif /* CHACHA_H_ */
@@ -0,0 +1,207 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "chacha.h"
+#include "cryptobox.h"
+
+/* Advanced SIMD is a mandatory part of ARMv8-A, so it is always available */
+#if defined(__aarch64__) && defined(__ARM_NEON) && !defined(__ARM_BIG_ENDIAN)
+#include <arm_neon.h>
+
+/*
+ * Four blocks are processed at once: each vector holds one word of the
+ * state for all blocks, so rounds need no shuffles and blocks are
+ * transposed back to the memory layout at the end
+ */
+#define CHACHA_NEON_BLOCKS 4
+#define CHACHA_NEON_BYTES (CHACHA_NEON_BLOCKS * CHACHA_BLOCKBYTES)
+
+void hchacha_ref (const unsigned char key[32], const unsigned char iv[16],
+		unsigned char out[32], size_t rounds);
+
+#define ROTL_NEON(x, n) vsriq_n_u32 (vshlq_n_u32 ((x), (n)), (x), 32 - (n))
+#define ROTL16_NEON(x) \
+	vreinterpretq_u32_u16 (vrev32q_u16 (vreinterpretq_u16_u32 (x)))
+
+#define QUARTER_NEON(a, b, c, d) do { \
+	a = vaddq_u32 (a, b); d = ROTL16_NEON (veorq_u32 (d, a)); \
+	c = vaddq_u32 (c, d); b = veorq_u32 (b, c); b = ROTL_NEON (b, 12); \
+	a = vaddq_u32 (a, b); d = veorq_u32 (d, a); d = ROTL_NEON (d, 8); \
+	c = vaddq_u32 (c, d); b = veorq_u32 (b, c); b = ROTL_NEON (b, 7); \
+} while (0)
+
+static void
+chacha_neon_4 (const guint32 *j, guint64 ctr, size_t rounds,
+		const unsigned char *in, unsigned char *out)
+{
+	static const guint32 constants[4] = {
+		0x61707865, 0x3320646e, 0x79622d32, 0x6b206574
+	};
+	guint32 ctr_lo[CHACHA_NEON_BLOCKS], ctr_hi[CHACHA_NEON_BLOCKS];
+	uint32x4_t x[16], orig[16];
+	uint32x4x2_t t0, t1;
+	uint32x4_t b0, b1, b2, b3;
+	guint i, g;
+	size_t r;
+
+	for (i = 0; i < CHACHA_NEON_BLOCKS; i ++) {
+		ctr_lo[i] = (guint32)(ctr + i);
+		ctr_hi[i] = (guint32)((ctr + i) >> 32);
+	}
+
+	for (i = 0; i < 4; i ++) {
+		orig[i] = vdupq_n_u32 (constants[i]);
+	}
+
+	for (i = 0; i < 8; i ++) {
+		orig[i + 4] = vdupq_n_u32 (j[i]);
+	}
+
+	orig[12] = vld1q_u32 (ctr_lo);
+	orig[13] = vld1q_u32 (ctr_hi);
+	orig[14] = vdupq_n_u32 (j[10]);
+	orig[15] = vdupq_n_u32 (j[11]);
+
+	for (i = 0; i < 16; i ++) {
+		x[i] = orig[i];
+	}
+
+	for (r = rounds; r > 0; r -= 2) {
+		QUARTER_NEON (x[0], x[4], x[8], x[12]);
+		QUARTER_NEON (x[1], x[5], x[9], x[13]);
+		QUARTER_NEON (x[2], x[6], x[10], x[14]);
+		QUARTER_NEON (x[3], x[7], x[11], x[15]);
+		QUARTER_NEON (x[0], x[5], x[10], x[15]);
+		QUARTER_NEON (x[1], x[6], x[11], x[12]);
+		QUARTER_NEON (x[2], x[7], x[8], x[13]);
+		QUARTER_NEON (x[3], x[4], x[9], x[14]);
+	}
+
+	/* Transpose 4x4 words, so b<k> holds words 4 * g .. 4 * g + 3 of block k */
+	for (g = 0; g < 4; g ++) {
+		t0 = vtrnq_u32 (vaddq_u32 (x[g * 4], orig[g * 4]),
+				vaddq_u32 (x[g * 4 + 1], orig[g * 4 + 1]));
+		t1 = vtrnq_u32 (vaddq_u32 (x[g * 4 + 2], orig[g * 4 + 2]),
+				vaddq_u32 (x[g * 4 + 3], orig[g * 4 + 3]));
+		b0 = vcombine_u32 (vget_low_u32 (t0.val[0]), vget_low_u32 (t1.val[0]));
+		b1 = vcombine_u32 (vget_low_u32 (t0.val[1]), vget_low_u32 (t1.val[1]));
+		b2 = vcombine_u32 (vget_high_u32 (t0.val[0]), vget_high_u32 (t1.val[0]));
+		b3 = vcombine_u32 (vget_high_u32 (t0.val[1]), vget_high_u32 (t1.val[1]));
+
+		if (in) {
+			b0 = veorq_u32 (b0, vld1q_u32 ((const guint32 *)(in + g * 16)));
+			b1 = veorq_u32 (b1, vld1q_u32 ((const guint32 *)(in + 64 + g * 16)));
+			b2 = veorq_u32 (b2, vld1q_u32 ((const guint32 *)(in + 128 + g * 16)));
+			b3 = veorq_u32 (b3, vld1q_u32 ((const guint32 *)(in + 192 + g * 16)));
+		}
+
+		vst1q_u32 ((guint32 *)(out + g * 16), b0);
+		vst1q_u32 ((guint32 *)(out + 64 + g * 16), b1);
+		vst1q_u32 ((guint32 *)(out + 128 + g * 16), b2);
+		vst1q_u32 ((guint32 *)(out + 192 + g * 16), b3);
+	}
+}
+
+void
+chacha_blocks_neon (chacha_state_internal *state, const unsigned char *in,
+		unsigned char *out, size_t bytes)
+{
+	guint32 j[12];
+	guint64 ctr;
+	unsigned char tmp[CHACHA_NEON_BYTES];
+	size_t i;
+
+	if (!bytes) {
+		return;
+	}
+
+	memcpy (j, state->s, sizeof (j));
+	ctr = ((guint64)j[9] << 32) | j[8];
+
+	while (bytes >= CHACHA_NEON_BYTES) {
+		chacha_neon_4 (j, ctr, state->rounds, in, out);
+		ctr += CHACHA_NEON_BLOCKS;
+		bytes -= CHACHA_NEON_BYTES;
+		out += CHACHA_NEON_BYTES;
+
+		if (in) {
+			in += CHACHA_NEON_BYTES;
+		}
+	}
+
+	if (bytes > 0) {
+		/* Generate key stream for the tail and use as much as needed */
+		chacha_neon_4 (j, ctr, state->rounds, NULL, tmp);
+		ctr += (bytes + CHACHA_BLOCKBYTES - 1) / CHACHA_BLOCKBYTES;
+
+		if (in) {
+			for (i = 0; i < bytes; i ++) {
+				out[i] = in[i] ^ tmp[i];
+			}
+		}
+		else {
+			memcpy (out, tmp, bytes);
+		}
+
+		rspamd_explicit_memzero (tmp, sizeof (tmp));
+	}
+
+	j[8] = (guint32)ctr;
+	j[9] = (guint32)(ctr >> 32);
+	memcpy (state->s + 32, &j[8], sizeof (guint32) * 2);
+	rspamd_explicit_memzero (j, sizeof (j));
+}
+
+void
+hchacha_neon (const unsigned char key[32], const unsigned char iv[16],
+		unsigned char out[32], size_t rounds)
+{
+	/* Single block, nothing to parallelize */
+	hchacha_ref (key, iv, out, rounds);
+}
+
+void
+chacha_neon (const chacha_key *key, const chacha_iv *iv,
+		const unsigned char *in, unsigned char *out, size_t inlen,
+		size_t rounds)
+{
+	chacha_state_internal state;
+
+	memcpy (state.s, key->b, 32);
+	memset (state.s + 32, 0, 8);
+	memcpy (state.s + 40, iv->b, 8);
+	state.rounds = rounds;
+	chacha_blocks_neon (&state, in, out, inlen);
+	rspamd_explicit_memzero (&state, 48);
+}
+
+void
+xchacha_neon (const chacha_key *key, const chacha_iv24 *iv,
+		const unsigned char *in, unsigned char *out, size_t inlen,
+		size_t rounds)
+{
+	chacha_state_internal state;
+
+	hchacha_ref (key->b, iv->b, state.s, rounds);
+	memset (state.s + 32, 0, 8);
+	memcpy (state.s + 40, iv->b + 16, 8);
+	state.rounds = rounds;
+	chacha_blocks_neon (&state, in, out, inlen);
+	rspamd_explicit_memzero (&state, 48);
+}
+
+#endif
@@ -33,6 +33,7 @@
 #include "ottery.h"
 #include "printf.h"
 #include "xxhash.h"
+#include "str_util.h"
 #define MUM_TARGET_INDEPENDENT_HASH 1 /* For 32/64 bit equal hashes */
 #include "../../contrib/mumhash/mum.h"
 #include "../../contrib/t1ha/t1ha.h"
@@ -236,6 +237,11 @@ rspamd_cryptobox_test_instr (gint instr)
 	case CPUID_AVX2:
 		__asm__ volatile ("vpaddq %ymm0, %ymm0, %ymm0");\
 		break;
+#endif
+#ifdef HAVE_AVX512
+	case CPUID_AVX512:
+		__asm__ volatile ("vpaddq %zmm0, %zmm0, %zmm0");
+		break;
 #endif
 	default:
 		return FALSE;
@@ -321,10 +327,22 @@ rspamd_cryptobox_init (void)
 						cpu_config |= CPUID_AVX2;
 					}
 				}
+
+				/* AVX512F */
+				if ((cpu[1] & ((guint32)1 << 16))) {
+					if (rspamd_cryptobox_test_instr (CPUID_AVX512)) {
+						cpu_config |= CPUID_AVX512;
+					}
+				}
 			}
 		}
 	}
 
+#if defined(__aarch64__) && defined(__ARM_NEON)
+	/* Advanced SIMD is mandatory for ARMv8-A */
+	cpu_config |= CPUID_NEON;
+#endif
+
 	buf = g_string_new ("");
 
 	for (bit = 0x1; bit != 0; bit <<= 1) {
@@ -354,6 +372,12 @@ rspamd_cryptobox_init (void)
 			case CPUID_RDRAND:
 				rspamd_printf_gstring (buf, "rdrand, ");
 				break;
+			case CPUID_NEON:
+				rspamd_printf_gstring (buf, "neon, ");
+				break;
+			case CPUID_AVX512:
+				rspamd_printf_gstring (buf, "avx512, ");
+				break;
 			}
 		}
 	}
@@ -374,6 +398,7 @@ rspamd_cryptobox_init (void)
 	ctx->blake2_impl = blake2b_load ();
 	ctx->ed25519_impl = ed25519_load ();
 	ctx->base64_impl = base64_load ();
+	ctx->str_util_impl = rspamd_str_util_load ();
 #if defined(HAVE_USABLE_OPENSSL) && (OPENSSL_VERSION_NUMBER < 0x10100000L || defined(LIBRESSL_VERSION_NUMBER))
 	/* Needed for old openssl api, not sure about LibreSSL */
 	ERR_load_EC_strings ();
@@ -627,6 +652,48 @@ rspamd_cryptobox_verify (const guchar *sig,
 	return ret;
 }
 
+bool
+rspamd_cryptobox_verify_batch (const guchar **sigs,
+		const gsize *siglens,
+		const guchar **ms,
+		const gsize *mlens,
+		const guchar **pks,
+		gsize n,
+		bool *valid,
+		enum rspamd_cryptobox_mode mode)
+{
+	bool ret = true, cur;
+	gsize i;
+
+	if (G_LIKELY (mode == RSPAMD_CRYPTOBOX_MODE_25519)) {
+		G_STATIC_ASSERT (sizeof (gsize) == sizeof (size_t));
+
+		for (i = 0; i < n; i ++) {
+			g_assert (siglens[i] == rspamd_cryptobox_signature_bytes (mode));
+		}
+
+		return ed25519_verify_batch (sigs, ms, (const size_t *)mlens, pks,
+				n, valid);
+	}
+
+	/* No batch verification for ECDSA */
+	for (i = 0; i < n; i ++) {
+		cur = rspamd_cryptobox_verify (sigs[i], siglens[i],
+				ms[i], mlens[i], pks[i], mode);
+
+		if (valid) {
+			valid[i] = cur;
+		}
+		else if (!cur) {
+			return false;
+		}
+
+		ret = ret && cur;
+	}
+
+	return ret;
+}
+
 static gsize
 rspamd_cryptobox_encrypt_ctx_len (enum rspamd_cryptobox_mode mode)
 {
@@ -1556,3 +1623,185 @@ rspamd_cryptobox_fast_hash_specific (
 		return rspamd_cryptobox_fast_hash_machdep (data, len, seed);
 	}
 }
+
+#define XXH64_MULTI_P1 11400714785074694791ULL
+#define XXH64_MULTI_P2 14029467366897019727ULL
+#define XXH64_MULTI_P3 1609587929392839161ULL
+#define XXH64_MULTI_P4 9650029242287828579ULL
+#define XXH64_MULTI_P5 2870177450012600261ULL
+#define XXH64_MULTI_ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static inline guint64
+rspamd_xxh64_multi_read64 (const guchar *p)
+{
+	guint64 v;
+
+	memcpy (&v, p, sizeof (v));
+
+	return GUINT64_FROM_LE (v);
+}
+
+static inline guint32
+rspamd_xxh64_multi_read32 (const guchar *p)
+{
+	guint32 v;
+
+	memcpy (&v, p, sizeof (v));
+
+	return GUINT32_FROM_LE (v);
+}
+
+static inline guint64
+rspamd_xxh64_multi_round (guint64 acc, guint64 input)
+{
+	acc += input * XXH64_MULTI_P2;
+	acc = XXH64_MULTI_ROTL (acc, 31);
+
+	return acc * XXH64_MULTI_P1;
+}
+
+static inline guint64
+rspamd_xxh64_multi_merge (guint64 acc, guint64 val)
+{
+	acc ^= rspamd_xxh64_multi_round (0, val);
+
+	return acc * XXH64_MULTI_P1 + XXH64_MULTI_P4;
+}
+
+/*
+ * XXH64 of up to RSPAMD_CRYPTOBOX_HASH_LANES inputs of the same length: every
+ * stage is done for all lanes before the next one, so independent
+ * multiplications are pipelined instead of waiting for each other as in
+ * consequent calls. Control flow depends on length only, so lanes never
+ * diverge
+ */
+static void
+rspamd_xxh64_multi (const void **data, gsize len,
+		const guint64 *seeds, guint64 *out)
+{
+	const guchar *p[RSPAMD_CRYPTOBOX_HASH_LANES];
+	guint64 h[RSPAMD_CRYPTOBOX_HASH_LANES],
+			v[RSPAMD_CRYPTOBOX_HASH_LANES][4];
+	gsize off = 0;
+	guint i;
+
+	for (i = 0; i < RSPAMD_CRYPTOBOX_HASH_LANES; i ++) {
+		p[i] = data[i];
+	}
+
+	if (len >= 32) {
+		for (i = 0; i < RSPAMD_CRYPTOBOX_HASH_LANES; i ++) {
+			v[i][0] = seeds[i] + XXH64_MULTI_P1 + XXH64_MULTI_P2;
+			v[i][1] = seeds[i] + XXH64_MULTI_P2;
+			v[i][2] = seeds[i];
+			v[i][3] = seeds[i] - XXH64_MULTI_P1;
+		}
+
+		for (; off + 32 <= len; off += 32) {
+			for (i = 0; i < RSPAMD_CRYPTOBOX_HASH_LANES; i ++) {
+				v[i][0] = rspamd_xxh64_multi_round (v[i][0],
+						rspamd_xxh64_multi_read64 (p[i] + off));
+				v[i][1] = rspamd_xxh64_multi_round (v[i][1],
+						rspamd_xxh64_multi_read64 (p[i] + off + 8));
+				v[i][2] = rspamd_xxh64_multi_round (v[i][2],
+						rspamd_xxh64_multi_read64 (p[i] + off + 16));
+				v[i][3] = rspamd_xxh64_multi_round (v[i][3],
+						rspamd_xxh64_multi_read64 (p[i] + off + 24));
+			}
+		}
+
+		for (i = 0; i < RSPAMD_CRYPTOBOX_HASH_LANES; i ++) {
+			h[i] = XXH64_MULTI_ROTL (v[i][0], 1) +
+					XXH64_MULTI_ROTL (v[i][1], 7) +
+					XXH64_MULTI_ROTL (v[i][2], 12) +
+					XXH64_MULTI_ROTL (v[i][3], 18);
+			h[i] = rspamd_xxh64_multi_merge (h[i], v[i][0]);
+			h[i] = rspamd_xxh64_multi_merge (h[i], v[i][1]);
+			h[i] = rspamd_xxh64_multi_merge (h[i], v[i][2]);
+			h[i] = rspamd_xxh64_multi_merge (h[i], v[i][3]) + len;
+		}
+	}
+	else {
+		for (i = 0; i < RSPAMD_CRYPTOBOX_HASH_LANES; i ++) {
+			h[i] = seeds[i] + XXH64_MULTI_P5 + len;
+		}
+	}
+
+	for (; off + 8 <= len; off += 8) {
+		for (i = 0; i < RSPAMD_CRYPTOBOX_HASH_LANES; i ++) {
+			h[i] ^= rspamd_xxh64_multi_round (0,
+					rspamd_xxh64_multi_read64 (p[i] + off));
+			h[i] = XXH64_MULTI_ROTL (h[i], 27) * XXH64_MULTI_P1 +
+					XXH64_MULTI_P4;
+		}
+	}
+
+	if (off + 4 <= len) {
+		for (i = 0; i < RSPAMD_CRYPTOBOX_HASH_LANES; i ++) {
+			h[i] ^= (guint64)rspamd_xxh64_multi_read32 (p[i] + off) *
+					XXH64_MULTI_P1;
+			h[i] = XXH64_MULTI_ROTL (h[i], 23) * XXH64_MULTI_P2 +
+					XXH64_MULTI_P3;
+		}
+
+		off += 4;
+	}
+
+	for (; off < len; off ++) {
+		for (i = 0; i < RSPAMD_CRYPTOBOX_HASH_LANES; i ++) {
+			h[i] ^= p[i][off] * XXH64_MULTI_P5;
+			h[i] = XXH64_MULTI_ROTL (h[i], 11) * XXH64_MULTI_P1;
+		}
+	}
+
+	for (i = 0; i < RSPAMD_CRYPTOBOX_HASH_LANES; i ++) {
+		h[i] ^= h[i] >> 33;
+		h[i] *= XXH64_MULTI_P2;
+		h[i] ^= h[i] >> 29;
+		h[i] *= XXH64_MULTI_P3;
+		h[i] ^= h[i] >> 32;
+		out[i] = h[i];
+	}
+}
+
+void
+rspamd_cryptobox_fast_hash_multi (
+		enum rspamd_cryptobox_fast_hash_type type,
+		const void **data,
+		const gsize *lens,
+		const guint64 *seeds,
+		gsize n,
+		guint64 *out)
+{
+	gsize i = 0, j;
+
+	if (type == RSPAMD_CRYPTOBOX_XXHASH64) {
+		/*
+		 * Lanes are useful for inputs of the same length only (e.g. the same
+		 * data with many seeds), otherwise branches of lanes diverge
+		 */
+		while (i + RSPAMD_CRYPTOBOX_HASH_LANES <= n) {
+			for (j = 1; j < RSPAMD_CRYPTOBOX_HASH_LANES; j ++) {
+				if (lens[i + j] != lens[i]) {
+					break;
+				}
+			}
+
+			if (j == RSPAMD_CRYPTOBOX_HASH_LANES) {
+				rspamd_xxh64_multi (data + i, lens[i], seeds + i, out + i);
+				i += RSPAMD_CRYPTOBOX_HASH_LANES;
+			}
+			else {
+				for (; j > 0; j --, i ++) {
+					out[i] = XXH64 (data[i], lens[i], seeds[i]);
+				}
+			}
+		}
+	}
+
+	/* Other hashes have no interleaved implementation */
+	for (; i < n; i ++) {
+		out[i] = rspamd_cryptobox_fast_hash_specific (type, data[i],
+				lens[i], seeds[i]);
+	}
+}
@@ -50,6 +50,8 @@ struct rspamd_cryptobox_segment {
 #define CPUID_SSE41 0x20
 #define CPUID_SSE42 0x40
 #define CPUID_RDRAND 0x80
+#define CPUID_NEON 0x100
+#define CPUID_AVX512 0x200
 
 typedef guchar rspamd_pk_t[rspamd_cryptobox_MAX_PKBYTES];
 typedef guchar rspamd_sk_t[rspamd_cryptobox_MAX_SKBYTES];
@@ -75,6 +77,7 @@ struct rspamd_cryptobox_library_ctx {
 	const gchar *siphash_impl;
 	const gchar *blake2_impl;
 	const gchar *base64_impl;
+	const gchar *str_util_impl;
 	unsigned long cpu_config;
 };
 
@@ -220,6 +223,29 @@ bool rspamd_cryptobox_verify (const guchar *sig,
 		const rspamd_pk_t pk,
 		enum rspamd_cryptobox_mode mode);
 
+/**
+ * Verifies several digital signatures at once. In curve25519 mode it is much
+ * faster than checking signatures one by one, if the batch check fails then
+ * signatures are checked individually to find invalid ones
+ * @param sigs array of signatures
+ * @param siglens array of signatures lengths
+ * @param ms array of messages
+ * @param mlens array of messages lengths
+ * @param pks array of public keys
+ * @param n number of signatures
+ * @param valid if not NULL, array of `n` elements to store result for each
+ * signature
+ * @return true if all signatures are valid, false otherwise
+ */
+bool rspamd_cryptobox_verify_batch (const guchar **sigs,
+		const gsize *siglens,
+		const guchar **ms,
+		const gsize *mlens,
+		const guchar **pks,
+		gsize n,
+		bool *valid,
+		enum rspamd_cryptobox_mode mode);
+
 /**
  * Securely clear the buffer specified
  * @param buf buffer to zero
@@ -389,6 +415,23 @@ guint64 rspamd_cryptobox_fast_hash_specific (
 		const void *data,
 		gsize len, guint64 seed);
 
+/* Number of inputs hashed together by rspamd_cryptobox_fast_hash_multi */
+#define RSPAMD_CRYPTOBOX_HASH_LANES 4
+
+/**
+ * Hashes `n` independent inputs, so `out[i]` is equal to
+ * rspamd_cryptobox_fast_hash_specific (type, data[i], lens[i], seeds[i]).
+ * Inputs are processed in interleaved lanes to hide multiplication latency
+ * of each single hash
+ */
+void rspamd_cryptobox_fast_hash_multi (
+		enum rspamd_cryptobox_fast_hash_type type,
+		const void **data,
+		const gsize *lens,
+		const guint64 *seeds,
+		gsize n,
+		guint64 *out);
+
 /**
  * Decode base64 using platform optimized code
  * @param in
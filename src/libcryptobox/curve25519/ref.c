@@ -1795,6 +1795,67 @@ void ge_scalarmult_vartime(ge_p3 *r, const unsigned char *a, const ge_p3 *A)
 	}
 }
 
+/*
+r = a[0] * A[0] + ... + a[n - 1] * A[n - 1]
+where a[i] are 32 byte scalars with a[i][31] <= 127.
+Sliding windows of all scalars are processed together, so doublings are
+shared between all points. Caller provides scratch space: 256 * n bytes
+for slides and 8 * n elements for Ai.
+*/
+
+void ge_multi_scalarmult_vartime(ge_p3 *r, const unsigned char *a,
+		const ge_p3 *A, size_t n, signed char *slides, ge_cached *Ai)
+{
+	ge_p1p1 t;
+	ge_p3 u;
+	ge_p3 A2;
+	signed char d;
+	size_t j;
+	int i, k, top = -1;
+
+	for (j = 0; j < n; j ++) {
+		slide (slides + j * 256, a + j * 32);
+
+		ge_p3_to_cached (&Ai[j * 8], &A[j]);
+		ge_p3_dbl (&t, &A[j]);
+		ge_p1p1_to_p3 (&A2, &t);
+
+		for (k = 1; k < 8; k ++) {
+			ge_add (&t, &A2, &Ai[j * 8 + k - 1]);
+			ge_p1p1_to_p3 (&u, &t);
+			ge_p3_to_cached (&Ai[j * 8 + k], &u);
+		}
+
+		for (i = 255; i > top; --i) {
+			if (slides[j * 256 + i]) {
+				top = i;
+				break;
+			}
+		}
+	}
+
+	ge_p3_0 (r);
+
+	for (i = top; i >= 0; --i) {
+		ge_p3_dbl (&t, r);
+
+		for (j = 0; j < n; j ++) {
+			d = slides[j * 256 + i];
+
+			if (d > 0) {
+				ge_p1p1_to_p3 (&u, &t);
+				ge_add (&t, &u, &Ai[j * 8 + d / 2]);
+			}
+			else if (d < 0) {
+				ge_p1p1_to_p3 (&u, &t);
+				ge_sub (&t, &u, &Ai[j * 8 + (-d) / 2]);
+			}
+		}
+
+		ge_p1p1_to_p3 (r, &t);
+	}
+}
+
 void ge_scalarmult_base(ge_p3 *h, const unsigned char *a)
 {
 	signed char e[64];
@@ -33,6 +33,12 @@ typedef struct ed25519_impl_s {
 			const unsigned char *m,
 			size_t mlen,
 			const unsigned char *pk);
+	int (*verify_batch) (const unsigned char **sigs,
+			const unsigned char **ms,
+			const size_t *mlens,
+			const unsigned char **pks,
+			size_t n,
+			bool *valid);
 } ed25519_impl_t;
 
 #define ED25519_DECLARE(ext) \
@@ -43,10 +49,17 @@ typedef struct ed25519_impl_s {
     int ed_verify_##ext(const unsigned char *sig, \
         const unsigned char *m, \
 		size_t mlen, \
-        const unsigned char *pk)
+        const unsigned char *pk); \
+    int ed_verify_batch_##ext(const unsigned char **sigs, \
+        const unsigned char **ms, \
+        const size_t *mlens, \
+        const unsigned char **pks, \
+        size_t n, \
+        bool *valid)
 
 #define ED25519_IMPL(cpuflags, desc, ext) \
-    {(cpuflags), desc, ed_keypair_##ext, ed_sign_##ext, ed_verify_##ext}
+    {(cpuflags), desc, ed_keypair_##ext, ed_sign_##ext, ed_verify_##ext, \
+		ed_verify_batch_##ext}
 
 ED25519_DECLARE(ref);
 #define ED25519_REF ED25519_IMPL(0, "ref", ref)
@@ -103,6 +116,19 @@ ed25519_verify (const unsigned char *sig,
 	return (ret == 0 ? true : false);
 }
 
+bool
+ed25519_verify_batch (const unsigned char **sigs,
+		const unsigned char **ms,
+		const size_t *mlens,
+		const unsigned char **pks,
+		size_t n,
+		bool *valid)
+{
+	int ret = ed25519_opt->verify_batch (sigs, ms, mlens, pks, n, valid);
+
+	return (ret == 0 ? true : false);
+}
+
 struct ed25519_test_vector {
 	const char *message;
 	const char *pk;
@@ -257,6 +283,12 @@ ed25519_test (const ed25519_impl_t *impl)
 	gchar sig[rspamd_cryptobox_MAX_SIGBYTES];
 	gchar joint_sk[rspamd_cryptobox_MAX_SIGSKBYTES];
 	guchar *sk, *pk, *expected, *msg;
+	const guchar *bsigs[G_N_ELEMENTS (test_vectors)],
+			*bmsgs[G_N_ELEMENTS (test_vectors)],
+			*bpks[G_N_ELEMENTS (test_vectors)];
+	size_t blens[G_N_ELEMENTS (test_vectors)];
+	bool bvalid[G_N_ELEMENTS (test_vectors)];
+	bool ret = true;
 
 	for (i = 0; i < G_N_ELEMENTS (test_vectors); i ++) {
 		sk = rspamd_decode_hex (test_vectors[i].sk, strlen (test_vectors[i].sk));
@@ -281,10 +313,34 @@ ed25519_test (const ed25519_impl_t *impl)
 		}
 
 		g_free (sk);
-		g_free (pk);
-		g_free (expected);
-		g_free (msg);
+		bsigs[i] = expected;
+		bmsgs[i] = msg;
+		bpks[i] = pk;
+		blens[i] = strlen (test_vectors[i].message) / 2;
+	}
+
+	if (impl->verify_batch (bsigs, bmsgs, blens, bpks,
+			G_N_ELEMENTS (test_vectors), bvalid) != 0) {
+		ret = false;
+	}
+
+	/* Batch with a wrong signature must fail and point to it */
+	pk = (guchar *)bpks[0];
+	bpks[0] = bpks[1];
+
+	if (impl->verify_batch (bsigs, bmsgs, blens, bpks,
+			G_N_ELEMENTS (test_vectors), bvalid) == 0 ||
+			bvalid[0] || !bvalid[1]) {
+		ret = false;
+	}
+
+	bpks[0] = pk;
+
+	for (i = 0; i < G_N_ELEMENTS (test_vectors); i ++) {
+		g_free ((gpointer)bsigs[i]);
+		g_free ((gpointer)bmsgs[i]);
+		g_free ((gpointer)bpks[i]);
 	}
 
-	return true;
+	return ret;
 }
@@ -29,5 +29,11 @@ bool ed25519_verify (const unsigned char *sig,
 		const unsigned char *m,
 		size_t mlen,
 		const unsigned char *pk);
+bool ed25519_verify_batch (const unsigned char **sigs,
+		const unsigned char **ms,
+		const size_t *mlens,
+		const unsigned char **pks,
+		size_t n,
+		bool *valid);
 
 #endif /* SRC_LIBCRYPTOBOX_ED25519_ED25519_H_ */
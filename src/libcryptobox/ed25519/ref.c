@@ -105,6 +105,134 @@ ed_verify_ref(const unsigned char *sig, const unsigned char *m,
 	return verify_32 (rcheck, sig) | (-(rcheck == sig));
 }
 
+/*
+ * Checks that sum (z[i] * (S[i] * B - h[i] * A[i] - R[i])) is zero for random
+ * 128 bit z[i], which holds if all signatures are valid and does not hold
+ * with an overwhelming probability otherwise. Scalar multiplications for
+ * all points are done at once. If the check fails, then signatures are
+ * verified one by one to find invalid ones
+ */
+int
+ed_verify_batch_ref(const unsigned char **sigs, const unsigned char **ms,
+		const size_t *mlens, const unsigned char **pks, size_t n,
+		bool *valid)
+{
+	EVP_MD_CTX *sha_ctx;
+	unsigned char h[64];
+	unsigned char z[32];
+	unsigned char sum[32];
+	unsigned char zero[32];
+	unsigned char check[32];
+	unsigned char *scalars;
+	signed char *slides;
+	ge_cached *Ai;
+	ge_cached cached;
+	ge_p3 *points;
+	ge_p3 P, Q;
+	ge_p1p1 t;
+	unsigned int j;
+	unsigned char d;
+	size_t i;
+	int ret = 0;
+	bool batch_ok = true;
+
+	if (n == 0) {
+		return 0;
+	}
+
+	points = g_malloc (sizeof (*points) * n * 2);
+	scalars = g_malloc (32 * n * 2);
+	memset (sum, 0, sizeof (sum));
+	memset (zero, 0, sizeof (zero));
+	memset (z, 0, sizeof (z));
+	sha_ctx = EVP_MD_CTX_create ();
+	g_assert (sha_ctx != NULL);
+
+	for (i = 0; i < n; i ++) {
+		/* Points are negated, so the whole sum is computed at once */
+		if ((sigs[i][63] & 224) ||
+				ge_frombytes_negate_vartime (&points[i * 2], pks[i]) != 0 ||
+				ge_frombytes_negate_vartime (&points[i * 2 + 1], sigs[i]) != 0) {
+			batch_ok = false;
+			break;
+		}
+
+		for (j = 0, d = 0; j < 32; ++j) {
+			d |= pks[i][j];
+		}
+
+		if (d == 0) {
+			batch_ok = false;
+			break;
+		}
+
+		g_assert (EVP_DigestInit (sha_ctx, EVP_sha512()) == 1);
+		EVP_DigestUpdate (sha_ctx, sigs[i], 32);
+		EVP_DigestUpdate (sha_ctx, pks[i], 32);
+		EVP_DigestUpdate (sha_ctx, ms[i], mlens[i]);
+		EVP_DigestFinal (sha_ctx, h, NULL);
+		sc_reduce (h);
+
+		ottery_rand_bytes (z, 16);
+		/* z * h for A, z for R and z * S for B */
+		sc_muladd (scalars + i * 64, z, h, zero);
+		memcpy (scalars + i * 64 + 32, z, 32);
+		sc_muladd (sum, z, sigs[i] + 32, sum);
+	}
+
+	EVP_MD_CTX_destroy (sha_ctx);
+
+	if (batch_ok) {
+		slides = g_malloc (256 * n * 2);
+		Ai = g_malloc (sizeof (*Ai) * 8 * n * 2);
+
+		ge_multi_scalarmult_vartime (&P, scalars, points, n * 2, slides, Ai);
+		ge_scalarmult_base (&Q, sum);
+		ge_p3_to_cached (&cached, &P);
+		ge_add (&t, &Q, &cached);
+		ge_p1p1_to_p3 (&Q, &t);
+		ge_p3_tobytes (check, &Q);
+
+		/* Neutral element is encoded as y = 1 */
+		memset (zero, 0, sizeof (zero));
+		zero[0] = 1;
+		batch_ok = verify_32 (check, zero) == 0;
+
+		g_free (slides);
+		g_free (Ai);
+	}
+
+	g_free (points);
+	g_free (scalars);
+
+	if (batch_ok) {
+		if (valid) {
+			for (i = 0; i < n; i ++) {
+				valid[i] = true;
+			}
+		}
+
+		return 0;
+	}
+
+	for (i = 0; i < n; i ++) {
+		if (ed_verify_ref (sigs[i], ms[i], mlens[i], pks[i]) != 0) {
+			ret = -1;
+
+			if (valid == NULL) {
+				break;
+			}
+
+			valid[i] = false;
+		}
+		else if (valid) {
+			valid[i] = true;
+		}
+	}
+
+	return ret;
+}
+
 void
 ed_sign_ref(unsigned char *sig, size_t *siglen_p,
 		const unsigned char *m, size_t mlen,
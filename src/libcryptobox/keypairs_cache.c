@@ -26,6 +26,9 @@ struct rspamd_keypair_elt {
 
 struct rspamd_keypair_cache {
 	rspamd_lru_hash_t *hash;
+	guint64 hits;
+	guint64 misses;
+	guint max_items;
 };
 
 static void
@@ -63,6 +66,7 @@ rspamd_keypair_cache_new (guint max_items)
 	g_assert (max_items > 0);
 
 	c = g_malloc0 (sizeof (*c));
+	c->max_items = max_items;
 	c->hash = rspamd_lru_hash_new_full (max_items, NULL,
 			rspamd_keypair_destroy, rspamd_keypair_hash, rspamd_keypair_equal);
 
@@ -94,6 +98,7 @@ rspamd_keypair_cache_process (struct rspamd_keypair_cache *c,
 	}
 
 	if (new == NULL) {
+		c->misses ++;
 		new = g_malloc0 (sizeof (*new));
 
 		if (posix_memalign ((void **)&new->nm, 32, sizeof (*new->nm)) != 0) {
@@ -126,6 +131,9 @@ rspamd_keypair_cache_process (struct rspamd_keypair_cache *c,
 
 		rspamd_lru_hash_insert (c->hash, new, new, time (NULL), -1);
 	}
+	else {
+		c->hits ++;
+	}
 
 	g_assert (new != NULL);
 
@@ -133,6 +141,29 @@ rspamd_keypair_cache_process (struct rspamd_keypair_cache *c,
 	REF_RETAIN (rk->nm);
 }
 
+void
+rspamd_keypair_cache_stat (struct rspamd_keypair_cache *c,
+		guint64 *hits, guint64 *misses, guint *size, guint *max_items)
+{
+	g_assert (c != NULL);
+
+	if (hits) {
+		*hits = c->hits;
+	}
+
+	if (misses) {
+		*misses = c->misses;
+	}
+
+	if (size) {
+		*size = g_hash_table_size (rspamd_lru_hash_get_htable (c->hash));
+	}
+
+	if (max_items) {
+		*max_items = c->max_items;
+	}
+}
+
 void
 rspamd_keypair_cache_destroy (struct rspamd_keypair_cache *c)
 {
@@ -39,6 +39,17 @@ void rspamd_keypair_cache_process (struct rspamd_keypair_cache *c,
 		struct rspamd_cryptobox_keypair *lk,
 		struct rspamd_cryptobox_pubkey *rk);
 
+/**
+ * Get statistics for the keypair cache, any output argument can be NULL
+ * @param c cache object
+ * @param hits number of shared keys found in the cache
+ * @param misses number of shared keys calculated
+ * @param size current number of elements
+ * @param max_items maximum number of elements
+ */
+void rspamd_keypair_cache_stat (struct rspamd_keypair_cache *c,
+		guint64 *hits, guint64 *misses, guint *size, guint *max_items);
+
 /**
  * Destroy old keypair cache
  * @param c cache object
@@ -118,6 +118,37 @@ poly1305_load(void)
 	return poly1305_opt->desc;
 }
 
+const char*
+poly1305_impl_desc(guint idx)
+{
+	if (idx < G_N_ELEMENTS(poly1305_list)) {
+		return poly1305_list[idx].desc;
+	}
+
+	return NULL;
+}
+
+int
+poly1305_load_impl(const char *desc)
+{
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS(poly1305_list); i++) {
+		if (strcmp(poly1305_list[i].desc, desc) == 0) {
+			if (poly1305_list[i].cpu_flags != 0 &&
+					!(poly1305_list[i].cpu_flags & cpu_config)) {
+				return FALSE;
+			}
+
+			poly1305_opt = &poly1305_list[i];
+
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
 /* processes inlen bytes (full blocks only), handling input alignment */
 static void poly1305_consume(poly1305_state_internal *state,
 		const unsigned char *in, size_t inlen)
@@ -29,6 +29,10 @@ void poly1305_auth(unsigned char *mac, const unsigned char *in, size_t inlen,
 int poly1305_verify(const unsigned char mac1[16], const unsigned char mac2[16]);
 
 const char* poly1305_load(void);
+/* Returns description of the implementation number idx or NULL */
+const char* poly1305_impl_desc(unsigned int idx);
+/* Switches to the implementation with the specified description if CPU allows */
+int poly1305_load_impl(const char *desc);
 
 #if defined(__cplusplus)
 }
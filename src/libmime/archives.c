@@ -47,6 +47,7 @@ rspamd_archive_process_zip (struct rspamd_task *task,
 		struct rspamd_mime_part *part)
 {
 	const guchar *p, *start, *end, *eocd = NULL, *cd;
+	const rspamd_ftok_t *parsed;
 	const guint32 eocd_magic = 0x06054b50, cd_basic_len = 46;
 	const guchar cd_magic[] = {0x50, 0x4b, 0x01, 0x02};
 	const guint max_processed = 1024;
@@ -56,8 +57,9 @@ rspamd_archive_process_zip (struct rspamd_task *task,
 	struct rspamd_archive_file *f;
 
 	/* Zip files have interesting data at the end of archive */
-	p = part->parsed_data.begin + part->parsed_data.len - 1;
-	start = part->parsed_data.begin;
+	parsed = rspamd_mime_part_get_parsed (part);
+	p = parsed->begin + parsed->len - 1;
+	start = parsed->begin;
 	end = p;
 
 	/* Search for EOCD:
@@ -146,6 +148,11 @@ rspamd_archive_process_zip (struct rspamd_task *task,
 			return;
 		}
 
+		if (arch->files->len >= task->cfg->max_archive_files) {
+			msg_debug_task ("zip archive has too many files, stop listing");
+			break;
+		}
+
 		f = g_malloc0 (sizeof (*f));
 		f->fname = g_string_new_len (cd + cd_basic_len, fname_len);
 		f->compressed_size = comp_size;
@@ -340,6 +347,11 @@ rspamd_archive_process_rar_v4 (struct rspamd_task *task, const guchar *start,
 				uncomp_sz += tmp;
 			}
 
+			if (arch->files->len >= task->cfg->max_archive_files) {
+				msg_debug_task ("rar archive has too many files, stop listing");
+				goto end;
+			}
+
 			f = g_malloc0 (sizeof (*f));
 
 			if (flags & 0x200) {
@@ -387,6 +399,7 @@ rspamd_archive_process_rar (struct rspamd_task *task,
 		struct rspamd_mime_part *part)
 {
 	const guchar *p, *end, *section_start;
+	const rspamd_ftok_t *parsed;
 	const guchar rar_v5_magic[] = {0x52, 0x61, 0x72, 0x21, 0x1A, 0x07, 0x01, 0x00},
 			rar_v4_magic[] = {0x52, 0x61, 0x72, 0x21, 0x1A, 0x07, 0x00};
 	const guint rar_encrypted_header = 4, rar_main_header = 1,
@@ -396,8 +409,9 @@ rspamd_archive_process_rar (struct rspamd_task *task,
 	struct rspamd_archive_file *f;
 	gint r;
 
-	p = part->parsed_data.begin;
-	end = p + part->parsed_data.len;
+	parsed = rspamd_mime_part_get_parsed (part);
+	p = parsed->begin;
+	end = p + parsed->len;
 
 	if ((gsize)(end - p) <= sizeof (rar_v5_magic)) {
 		msg_debug_task ("rar archive is invalid (too small)");
@@ -541,6 +555,11 @@ rspamd_archive_process_rar (struct rspamd_task *task,
 				return;
 			}
 
+			if (arch->files->len >= task->cfg->max_archive_files) {
+				msg_debug_task ("rar archive has too many files, stop listing");
+				goto end;
+			}
+
 			f = g_malloc0 (sizeof (*f));
 			f->uncompressed_size = uncomp_sz;
 			f->compressed_size = comp_sz;
@@ -1311,15 +1330,28 @@ rspamd_7zip_read_files_info (struct rspamd_task *task,
 						tp += 2;
 					}
 
-					if (fend == NULL || fend - p == 0) {
+					if (fend == NULL) {
+						/* Unterminated name, we cannot go further */
+						msg_debug_task ("bad 7zip name; %s", G_STRLOC);
+						p = NULL;
+						goto end;
+					}
+					else if (fend - p == 0) {
 						/* Crap instead of fname */
 						msg_debug_task ("bad 7zip name; %s", G_STRLOC);
 					}
 
+					if (arch->files->len >= task->cfg->max_archive_files) {
+						msg_debug_task ("7zip archive has too many files, "
+								"stop listing");
+						p = NULL;
+						goto end;
+					}
+
 					res = rspamd_7zip_ucs2_to_utf8 (task, p, fend);
 
 					if (res != NULL) {
-						fentry = g_malloc0 (sizeof (fentry));
+						fentry = g_malloc0 (sizeof (*fentry));
 						fentry->fname = res;
 						g_ptr_array_add (arch->files, fentry);
 					}
@@ -1400,12 +1432,14 @@ rspamd_archive_process_7zip (struct rspamd_task *task,
 {
 	struct rspamd_archive *arch;
 	const guchar *start, *p, *end;
+	const rspamd_ftok_t *parsed;
 	const guchar sz_magic[] = {'7', 'z', 0xBC, 0xAF, 0x27, 0x1C};
 	guint64 section_offset = 0, section_length = 0;
 
-	start = part->parsed_data.begin;
+	parsed = rspamd_mime_part_get_parsed (part);
+	start = parsed->begin;
 	p = start;
-	end = p + part->parsed_data.len;
+	end = p + parsed->len;
 
 	if (end - p <= sizeof (guint64) + sizeof (guint32) ||
 			memcmp (p, sz_magic, sizeof (sz_magic)) != 0) {
@@ -1454,6 +1488,26 @@ rspamd_archive_process_7zip (struct rspamd_task *task,
 	arch->size = part->parsed_data.len;
 }
 
+/* Checks magic without decoding parts that are not decoded yet */
+static gboolean
+rspamd_archive_has_magic (struct rspamd_mime_part *part,
+		const guchar *magic_start, gsize magic_len)
+{
+	const guchar *data;
+
+	g_assert (magic_len <= RSPAMD_MIME_PART_HEAD_LEN);
+
+	if (part->flags & RSPAMD_MIME_PART_LAZY) {
+		data = part->head;
+	}
+	else {
+		data = part->parsed_data.begin;
+	}
+
+	return part->parsed_data.len > magic_len &&
+			memcmp (data, magic_start, magic_len) == 0;
+}
+
 static gboolean
 rspamd_archive_cheat_detect (struct rspamd_mime_part *part, const gchar *str,
 		const guchar *magic_start, gsize magic_len)
@@ -1471,9 +1525,7 @@ rspamd_archive_cheat_detect (struct rspamd_mime_part *part, const gchar *str,
 				str, strlen (str)) != -1) {
 			/* We still need to check magic, see #1848 */
 			if (magic_start != NULL) {
-				if (part->parsed_data.len > magic_len &&
-						memcmp (part->parsed_data.begin,
-								magic_start, magic_len) == 0) {
+				if (rspamd_archive_has_magic (part, magic_start, magic_len)) {
 					return TRUE;
 				}
 				/* No magic, refuse this type of archive */
@@ -1494,9 +1546,7 @@ rspamd_archive_cheat_detect (struct rspamd_mime_part *part, const gchar *str,
 			if (rspamd_lc_cmp (p, str, strlen (str)) == 0) {
 				if (*(p - 1) == '.') {
 					if (magic_start != NULL) {
-						if (part->parsed_data.len > magic_len &&
-								memcmp (part->parsed_data.begin,
-										magic_start, magic_len) == 0) {
+						if (rspamd_archive_has_magic (part, magic_start, magic_len)) {
 							return TRUE;
 						}
 						/* No magic, refuse this type of archive */
@@ -1509,8 +1559,7 @@ rspamd_archive_cheat_detect (struct rspamd_mime_part *part, const gchar *str,
 		}
 
 		if (magic_start != NULL) {
-			if (part->parsed_data.len > magic_len && memcmp (part->parsed_data.begin,
-					magic_start, magic_len) == 0) {
+			if (rspamd_archive_has_magic (part, magic_start, magic_len)) {
 				return TRUE;
 			}
 		}
@@ -1532,6 +1581,17 @@ rspamd_archives_process (struct rspamd_task *task)
 		part = g_ptr_array_index (task->parts, i);
 
 		if (part->parsed_data.len > 0) {
+			if (part->parsed_data.len > task->cfg->max_archive_size) {
+				/*
+				 * Do not decode and walk huge parts on the event loop: it
+				 * would block all other tasks of this worker
+				 */
+				msg_debug_task ("skip archive inspection for part of size %z, "
+						"limit is %z", part->parsed_data.len,
+						task->cfg->max_archive_size);
+				continue;
+			}
+
 			if (rspamd_archive_cheat_detect (part, "zip",
 					zip_magic, sizeof (zip_magic))) {
 				rspamd_archive_process_zip (task, part);
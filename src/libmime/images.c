@@ -21,12 +21,9 @@
 
 #ifdef USABLE_GD
 #include "gd.h"
-#include "hash.h"
 #include <math.h>
 
 #define RSPAMD_NORMALIZED_DIM 64
-
-static rspamd_lru_hash_t *images_hash = NULL;
 #endif
 
 static const guint8 png_signature[] = {137, 80, 78, 71, 13, 10, 26, 10};
@@ -346,88 +343,182 @@ rspamd_image_dct_block (gint pixels[8][8], gdouble *out)
 	}
 }
 
-struct rspamd_image_cache_entry {
-	guchar digest[64];
+/* Number of elements in a bucket of the shared cache */
+#define RSPAMD_IMAGE_CACHE_BUCKET 4
+
+struct rspamd_image_cache_elt {
+	guchar digest[rspamd_cryptobox_HASHBYTES];
 	guchar dct[RSPAMD_DCT_LEN / NBBY];
+	gdouble atime;
 };
 
-static void
-rspamd_image_cache_entry_dtor (gpointer p)
-{
-	struct rspamd_image_cache_entry *entry = p;
-	g_free (entry);
-}
+struct rspamd_image_cache_stat {
+	guint64 hits;
+	guint64 misses;
+	guint64 stores;
+};
 
-static guint32
-rspamd_image_dct_hash (gconstpointer p)
-{
-	return rspamd_cryptobox_fast_hash (p, rspamd_cryptobox_HASHBYTES,
-			rspamd_hash_seed ());
-}
+struct rspamd_image_cache {
+	struct rspamd_image_cache_elt *elts;
+	struct rspamd_image_cache_stat *stat;
+	rspamd_mempool_mutex_t *lock;
+	guint nelts;
+};
 
-static gboolean
-rspamd_image_dct_equal (gconstpointer a, gconstpointer b)
+static struct rspamd_image_cache_elt *
+rspamd_image_cache_bucket (struct rspamd_image_cache *cache,
+		const guchar *digest)
 {
-	return memcmp (a, b, rspamd_cryptobox_HASHBYTES) == 0;
-}
+	guint64 h;
 
-static void
-rspamd_image_create_cache (struct rspamd_config *cfg)
-{
-	images_hash = rspamd_lru_hash_new_full (cfg->images_cache_size, NULL,
-			rspamd_image_cache_entry_dtor,
-			rspamd_image_dct_hash, rspamd_image_dct_equal);
+	memcpy (&h, digest, sizeof (h));
+
+	return &cache->elts[(h % (cache->nelts / RSPAMD_IMAGE_CACHE_BUCKET)) *
+			RSPAMD_IMAGE_CACHE_BUCKET];
 }
 
 static gboolean
 rspamd_image_check_hash (struct rspamd_task *task, struct rspamd_image *img)
 {
-	struct rspamd_image_cache_entry *found;
+	struct rspamd_image_cache *cache = task->cfg->images_cache;
+	struct rspamd_image_cache_elt *bucket, *found = NULL;
+	guint i;
 
-	if (images_hash == NULL) {
-		rspamd_image_create_cache (task->cfg);
+	if (cache == NULL) {
+		return FALSE;
 	}
 
-	found = rspamd_lru_hash_lookup (images_hash, img->parent->digest,
-			task->tv.tv_sec);
+	bucket = rspamd_image_cache_bucket (cache, img->parent->digest);
+
+	rspamd_mempool_lock_mutex (cache->lock);
+
+	for (i = 0; i < RSPAMD_IMAGE_CACHE_BUCKET; i ++) {
+		if (bucket[i].atime > 0 && memcmp (bucket[i].digest,
+				img->parent->digest, sizeof (bucket[i].digest)) == 0) {
+			found = &bucket[i];
+			break;
+		}
+	}
 
 	if (found) {
-		/* We need to decompress */
 		img->dct = g_malloc (RSPAMD_DCT_LEN / NBBY);
 		rspamd_mempool_add_destructor (task->task_pool, g_free,
 				img->dct);
-		/* Copy as found could be destroyed by LRU */
+		/* Copy under lock as found could be replaced by another worker */
 		memcpy (img->dct, found->dct, RSPAMD_DCT_LEN / NBBY);
+		found->atime = task->tv.tv_sec;
 		img->is_normalized = TRUE;
-
-		return TRUE;
+		cache->stat->hits ++;
+	}
+	else {
+		cache->stat->misses ++;
 	}
 
-	return FALSE;
+	rspamd_mempool_unlock_mutex (cache->lock);
+
+	return found != NULL;
 }
 
 static void
 rspamd_image_save_hash (struct rspamd_task *task, struct rspamd_image *img)
 {
-	struct rspamd_image_cache_entry *found;
+	struct rspamd_image_cache *cache = task->cfg->images_cache;
+	struct rspamd_image_cache_elt *bucket, *victim = NULL;
+	guint i;
+
+	if (cache == NULL || !img->is_normalized) {
+		return;
+	}
 
-	if (img->is_normalized) {
-		found = rspamd_lru_hash_lookup (images_hash, img->parent->digest,
-				task->tv.tv_sec);
+	bucket = rspamd_image_cache_bucket (cache, img->parent->digest);
 
-		if (!found) {
-			found = g_malloc0 (sizeof (*found));
-			memcpy (found->dct, img->dct, RSPAMD_DCT_LEN / NBBY);
-			memcpy (found->digest, img->parent->digest, sizeof (found->digest));
+	rspamd_mempool_lock_mutex (cache->lock);
+
+	/* Replace the same digest, otherwise the least recently used element */
+	for (i = 0; i < RSPAMD_IMAGE_CACHE_BUCKET; i ++) {
+		if (memcmp (bucket[i].digest, img->parent->digest,
+				sizeof (bucket[i].digest)) == 0) {
+			victim = &bucket[i];
+			break;
+		}
 
-			rspamd_lru_hash_insert (images_hash, found->digest, found,
-					task->tv.tv_sec, 0);
+		if (victim == NULL || bucket[i].atime < victim->atime) {
+			victim = &bucket[i];
 		}
 	}
+
+	memcpy (victim->digest, img->parent->digest, sizeof (victim->digest));
+	memcpy (victim->dct, img->dct, RSPAMD_DCT_LEN / NBBY);
+	victim->atime = task->tv.tv_sec;
+	cache->stat->stores ++;
+
+	rspamd_mempool_unlock_mutex (cache->lock);
 }
 
 #endif
 
+void
+rspamd_images_cache_init (struct rspamd_config *cfg)
+{
+#ifdef USABLE_GD
+	struct rspamd_image_cache *cache;
+	gsize nelts;
+
+	if (cfg->images_cache != NULL || cfg->images_cache_size == 0) {
+		return;
+	}
+
+	nelts = cfg->images_cache_size;
+	nelts = MAX (nelts - nelts % RSPAMD_IMAGE_CACHE_BUCKET,
+			RSPAMD_IMAGE_CACHE_BUCKET);
+
+	cache = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*cache));
+	cache->nelts = nelts;
+	/* Allocated before workers are forked, so it is shared between them */
+	cache->elts = rspamd_mempool_alloc0_shared (cfg->cfg_pool,
+			sizeof (*cache->elts) * nelts);
+	cache->stat = rspamd_mempool_alloc0_shared (cfg->cfg_pool,
+			sizeof (*cache->stat));
+	cache->lock = rspamd_mempool_get_mutex (cfg->cfg_pool);
+	cfg->images_cache = cache;
+#endif
+}
+
+ucl_object_t *
+rspamd_images_cache_stat (struct rspamd_config *cfg, gboolean reset)
+{
+	ucl_object_t *obj = NULL;
+#ifdef USABLE_GD
+	struct rspamd_image_cache *cache = cfg->images_cache;
+	struct rspamd_image_cache_stat st;
+
+	if (cache == NULL) {
+		return NULL;
+	}
+
+	rspamd_mempool_lock_mutex (cache->lock);
+	memcpy (&st, cache->stat, sizeof (st));
+
+	if (reset) {
+		memset (cache->stat, 0, sizeof (*cache->stat));
+	}
+
+	rspamd_mempool_unlock_mutex (cache->lock);
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (obj, ucl_object_fromint (cache->nelts),
+			"size", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (st.hits),
+			"hits", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (st.misses),
+			"misses", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (st.stores),
+			"stores", 0, false);
+#endif
+
+	return obj;
+}
+
 void
 rspamd_image_normalize (struct rspamd_task *task, struct rspamd_image *img)
 {
@@ -566,20 +657,32 @@ process_image (struct rspamd_task *task, struct rspamd_mime_part *part)
 	const gchar *cid, *html_cid;
 	guint cid_len, i, j;
 	GPtrArray *ar;
+	rspamd_ftok_t data;
+
+	if (part->flags & RSPAMD_MIME_PART_LAZY) {
+		/* Do not decode parts that are not images */
+		data.begin = part->head;
+		data.len = MIN (part->parsed_data.len, sizeof (part->head));
+	}
+	else {
+		data = part->parsed_data;
+	}
+
+	if ((type = detect_image_type (&data)) != IMAGE_TYPE_UNKNOWN) {
+		data = *rspamd_mime_part_get_parsed (part);
 
-	if ((type = detect_image_type (&part->parsed_data)) != IMAGE_TYPE_UNKNOWN) {
 		switch (type) {
 		case IMAGE_TYPE_PNG:
-			img = process_png_image (task, &part->parsed_data);
+			img = process_png_image (task, &data);
 			break;
 		case IMAGE_TYPE_JPG:
-			img = process_jpg_image (task, &part->parsed_data);
+			img = process_jpg_image (task, &data);
 			break;
 		case IMAGE_TYPE_GIF:
-			img = process_gif_image (task, &part->parsed_data);
+			img = process_gif_image (task, &data);
 			break;
 		case IMAGE_TYPE_BMP:
-			img = process_bmp_image (task, &part->parsed_data);
+			img = process_bmp_image (task, &data);
 			break;
 		default:
 			img = NULL;
@@ -608,7 +711,7 @@ process_image (struct rspamd_task *task, struct rspamd_mime_part *part)
 
 		if (ar != NULL && ar->len > 0) {
 			rh = g_ptr_array_index (ar, 0);
-			cid = rh->decoded;
+			cid = rspamd_mime_header_get_decoded (task->task_pool, rh);
 
 			if (*cid == '<') {
 				cid ++;
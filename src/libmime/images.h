@@ -3,9 +3,11 @@
 
 #include "config.h"
 #include "fstring.h"
+#include "ucl.h"
 
 struct html_image;
 struct rspamd_task;
+struct rspamd_config;
 struct rspamd_mime_part;
 
 #define RSPAMD_DCT_LEN (64 * 64)
@@ -42,4 +44,15 @@ const gchar * rspamd_image_type_str (enum rspamd_image_type type);
 
 void rspamd_image_normalize (struct rspamd_task *task, struct rspamd_image *img);
 
+/*
+ * Allocate DCT hashes cache in shared memory, must be called before fork
+ */
+void rspamd_images_cache_init (struct rspamd_config *cfg);
+
+/*
+ * Get hits and misses of the images cache, reset them if requested
+ */
+ucl_object_t * rspamd_images_cache_stat (struct rspamd_config *cfg,
+		gboolean reset);
+
 #endif /* IMAGES_H_ */
@@ -18,8 +18,10 @@
 #include "libutil/logger.h"
 #include "libcryptobox/cryptobox.h"
 #include "libutil/multipattern.h"
+#include "libutil/hash.h"
 #include "ucl.h"
 #include "khash.h"
+#include "unix-std.h"
 #include <glob.h>
 #include <unicode/utf8.h>
 #include <unicode/ucnv.h>
@@ -29,6 +31,11 @@
 
 static const gsize default_short_text_limit = 20;
 static const gsize default_words = 80;
+static const gsize default_cache_size = 1024;
+/* Stop when the best candidate is 2^early_stop times more probable */
+static const gdouble default_early_stop = 2.0;
+/* Check confidence once per this number of words */
+static const guint early_stop_step = 4;
 static const gdouble update_prob = 0.6;
 static const gchar *default_languages_path = RSPAMD_PLUGINSDIR "/languages";
 
@@ -155,20 +162,28 @@ rspamd_language_search_str (const gchar *key, const gchar *elts[], size_t nelts)
 	return FALSE;
 }
 
-static guint
-rspamd_trigram_hash_func (gconstpointer key)
+/*
+ * Trigramms are packed into 64 bit integers: each lowercased code point
+ * takes 21 bits, so no conversion to UChar is needed to look them up
+ */
+#define RSPAMD_TRIGRAM_BITS 21
+#define RSPAMD_TRIGRAM_MASK ((G_GUINT64_CONSTANT(1) << (RSPAMD_TRIGRAM_BITS * 3)) - 1)
+
+static inline guint64
+rspamd_trigram_push (guint64 trigram, UChar32 uc)
 {
-	return rspamd_cryptobox_fast_hash (key, 3 * sizeof (UChar), rspamd_hash_seed ());
+	return ((trigram << RSPAMD_TRIGRAM_BITS) | (guint64)uc) & RSPAMD_TRIGRAM_MASK;
 }
 
-static gboolean
-rspamd_trigram_equal_func (gconstpointer v, gconstpointer v2)
+static inline khint_t
+rspamd_trigram_hash_func (guint64 key)
 {
-	return memcmp (v, v2, 3 * sizeof (UChar)) == 0;
+	/* Fibonacci hashing, as code points use only a few low bits */
+	return (khint_t)((key * G_GUINT64_CONSTANT(0x9E3779B97F4A7C15)) >> 32);
 }
 
-KHASH_INIT (rspamd_trigram_hash, const UChar *, struct rspamd_ngramm_chain, true,
-		rspamd_trigram_hash_func, rspamd_trigram_equal_func);
+KHASH_INIT (rspamd_trigram_hash, guint64, struct rspamd_ngramm_chain, true,
+		rspamd_trigram_hash_func, kh_int64_hash_equal);
 KHASH_INIT (rspamd_candidates_hash, const gchar *,
 		struct rspamd_lang_detector_res *, true,
 		rspamd_str_hash, rspamd_str_equal);
@@ -178,11 +193,34 @@ struct rspamd_lang_detector {
 	khash_t(rspamd_trigram_hash) *trigramms[RSPAMD_LANGUAGE_MAX]; /* trigramms frequencies */
 	struct rspamd_stop_word_elt stop_words[RSPAMD_LANGUAGE_MAX];
 	UConverter *uchar_converter;
+	rspamd_lru_hash_t *cache; /* results by part digest */
 	gsize short_text_limit;
+	gdouble early_stop;
 	gsize total_occurencies; /* number of all languages found */
 	ref_entry_t ref;
 };
 
+struct rspamd_lang_detector_cache_elt {
+	guchar digest[rspamd_cryptobox_HASHBYTES];
+	guint unicode_scripts;
+	gboolean detected;
+	guint nlangs;
+	struct rspamd_lang_detector_res langs[0];
+};
+
+static guint
+rspamd_language_detector_cache_hash (gconstpointer key)
+{
+	return rspamd_cryptobox_fast_hash (key, rspamd_cryptobox_HASHBYTES,
+			rspamd_hash_seed ());
+}
+
+static gboolean
+rspamd_language_detector_cache_equal (gconstpointer a, gconstpointer b)
+{
+	return memcmp (a, b, rspamd_cryptobox_HASHBYTES) == 0;
+}
+
 static void
 rspamd_language_detector_ucs_lowercase (UChar *s, gsize len)
 {
@@ -194,7 +232,7 @@ rspamd_language_detector_ucs_lowercase (UChar *s, gsize len)
 }
 
 static gboolean
-rspamd_language_detector_ucs_is_latin (UChar *s, gsize len)
+rspamd_language_detector_ucs_is_latin (const UChar32 *s, gsize len)
 {
 	gsize i;
 	gboolean ret = TRUE;
@@ -213,15 +251,40 @@ rspamd_language_detector_ucs_is_latin (UChar *s, gsize len)
 struct rspamd_language_ucs_elt {
 	guint freq;
 	const gchar *utf;
-	UChar s[0];
+	UChar32 s[3];
 };
 
+/*
+ * Decodes and lowercases utf8 string, returns number of code points or -1 if
+ * the string is invalid or it has more than `max` code points
+ */
+static gint
+rspamd_language_detector_utf8_lower (const gchar *str, gsize len,
+		UChar32 *out, gint max)
+{
+	const guchar *p = (const guchar *)str;
+	gint32 i = 0, slen = len;
+	gint n = 0;
+	UChar32 uc;
+
+	while (i < slen) {
+		U8_NEXT (p, i, slen, uc);
+
+		if (uc < 0 || n >= max) {
+			return -1;
+		}
+
+		out[n ++] = u_tolower (uc);
+	}
+
+	return n;
+}
+
 static void
 rspamd_language_detector_init_ngramm (struct rspamd_config *cfg,
 									  struct rspamd_lang_detector *d,
 									  struct rspamd_language_elt *lelt,
 									  struct rspamd_language_ucs_elt *ucs,
-									  guint len,
 									  guint freq,
 									  guint total,
 									  khash_t (rspamd_trigram_hash) *htb)
@@ -230,22 +293,16 @@ rspamd_language_detector_init_ngramm (struct rspamd_config *cfg,
 	struct rspamd_ngramm_elt *elt;
 	khiter_t k;
 	guint i;
+	guint64 key = 0;
 	gboolean found;
 
-	switch (len) {
-	case 1:
-	case 2:
-		g_assert_not_reached ();
-		break;
-	case 3:
-		k = kh_get (rspamd_trigram_hash, htb, ucs->s);
-		if (k != kh_end (htb)) {
-			chain = &kh_value (htb, k);
-		}
-		break;
-	default:
-		g_assert_not_reached ();
-		break;
+	for (i = 0; i < G_N_ELEMENTS (ucs->s); i ++) {
+		key = rspamd_trigram_push (key, ucs->s[i]);
+	}
+
+	k = kh_get (rspamd_trigram_hash, htb, key);
+	if (k != kh_end (htb)) {
+		chain = &kh_value (htb, k);
 	}
 
 	if (chain == NULL) {
@@ -261,7 +318,7 @@ rspamd_language_detector_init_ngramm (struct rspamd_config *cfg,
 		elt->prob = ((gdouble)freq) / ((gdouble)total);
 		g_ptr_array_add (chain->languages, elt);
 
-		k = kh_put (rspamd_trigram_hash, htb, ucs->s, &i);
+		k = kh_put (rspamd_trigram_hash, htb, key, &i);
 		kh_value (htb, k) = *chain;
 	}
 	else {
@@ -338,17 +395,102 @@ rspamd_language_detector_cmp_ngramm (gconstpointer a, gconstpointer b)
 	return (gint)e2->freq - (gint)e1->freq;
 }
 
+/*
+ * Language files are parsed by a set of threads as parsing is the most
+ * expensive part of the detector's initialisation. Threads use no shared
+ * state: they neither log nor allocate from the config pool
+ */
+struct rspamd_language_parse_job {
+	const gchar *path;
+	ucl_object_t *top;
+	gchar *err;
+};
+
+struct rspamd_language_parse_ctx {
+	struct rspamd_language_parse_job *jobs;
+	guint njobs;
+	volatile gint next;
+};
+
+#define RSPAMD_LANGUAGE_MAX_PARSE_THREADS 8
+
+static gpointer
+rspamd_language_detector_parse_thread (gpointer ud)
+{
+	struct rspamd_language_parse_ctx *ctx = ud;
+	struct rspamd_language_parse_job *job;
+	struct ucl_parser *parser;
+	gint i;
+
+	while ((i = g_atomic_int_add (&ctx->next, 1)) < (gint)ctx->njobs) {
+		job = &ctx->jobs[i];
+		parser = ucl_parser_new (UCL_PARSER_NO_FILEVARS);
+
+		if (!ucl_parser_add_file (parser, job->path)) {
+			job->err = g_strdup (ucl_parser_get_error (parser));
+		}
+		else {
+			job->top = ucl_parser_get_object (parser);
+		}
+
+		ucl_parser_free (parser);
+	}
+
+	return NULL;
+}
+
+static void
+rspamd_language_detector_parse_files (struct rspamd_language_parse_job *jobs,
+		guint njobs)
+{
+	struct rspamd_language_parse_ctx ctx;
+	guint nthreads = 1, i;
+#if GLIB_CHECK_VERSION(2, 32, 0)
+	GThread *threads[RSPAMD_LANGUAGE_MAX_PARSE_THREADS];
+	guint nstarted = 0;
+#endif
+
+	ctx.jobs = jobs;
+	ctx.njobs = njobs;
+	ctx.next = 0;
+
+#ifdef HAVE_SC_NPROCESSORS_ONLN
+	nthreads = MAX (1, sysconf (_SC_NPROCESSORS_ONLN));
+#endif
+	nthreads = MIN (nthreads, RSPAMD_LANGUAGE_MAX_PARSE_THREADS);
+	nthreads = MIN (nthreads, njobs);
+
+#if GLIB_CHECK_VERSION(2, 32, 0)
+	/* The current thread is a parser as well */
+	for (i = 1; i < nthreads; i ++) {
+		threads[nstarted] = g_thread_try_new ("langdet",
+				rspamd_language_detector_parse_thread, &ctx, NULL);
+
+		if (threads[nstarted] != NULL) {
+			nstarted ++;
+		}
+	}
+
+	rspamd_language_detector_parse_thread (&ctx);
+
+	for (i = 0; i < nstarted; i ++) {
+		g_thread_join (threads[i]);
+	}
+#else
+	(void)i;
+	rspamd_language_detector_parse_thread (&ctx);
+#endif
+}
+
 static void
 rspamd_language_detector_read_file (struct rspamd_config *cfg,
 		struct rspamd_lang_detector *d,
 		const gchar *path,
+		ucl_object_t *top,
 		const ucl_object_t *stop_words)
 {
-	struct ucl_parser *parser;
-	ucl_object_t *top;
 	const ucl_object_t *freqs, *n_words, *cur, *type;
 	ucl_object_iter_t it = NULL;
-	UErrorCode uc_err = U_ZERO_ERROR;
 	struct rspamd_language_elt *nelt;
 	struct rspamd_language_ucs_elt *ucs_elt;
 	khash_t (rspamd_trigram_hash) *htb = NULL;
@@ -358,18 +500,6 @@ rspamd_language_detector_read_file (struct rspamd_config *cfg,
 	gdouble mean = 0, std = 0, delta = 0, delta2 = 0, m2 = 0;
 	enum rspamd_language_category cat = RSPAMD_LANGUAGE_MAX;
 
-	parser = ucl_parser_new (UCL_PARSER_NO_FILEVARS);
-	if (!ucl_parser_add_file (parser, path)) {
-		msg_warn_config ("cannot parse file %s: %s", path,
-				ucl_parser_get_error (parser));
-		ucl_parser_free (parser);
-
-		return;
-	}
-
-	top = ucl_parser_get_object (parser);
-	ucl_parser_free (parser);
-
 	freqs = ucl_object_lookup (top, "freq");
 
 	if (freqs == NULL) {
@@ -469,7 +599,7 @@ rspamd_language_detector_read_file (struct rspamd_config *cfg,
 	htb = d->trigramms[cat];
 
 	GPtrArray *ngramms;
-	guint nsym;
+	gint nsym;
 
 	if (rspamd_language_search_str (nelt->name, tier1_langs,
 			G_N_ELEMENTS (tier1_langs))) {
@@ -502,28 +632,16 @@ rspamd_language_detector_read_file (struct rspamd_config *cfg,
 		m2 += delta * delta2;
 
 		if (key != NULL) {
-			ucs_elt = rspamd_mempool_alloc (cfg->cfg_pool,
-					sizeof (*ucs_elt) + (keylen + 1) * sizeof (UChar));
-
-			nsym = ucnv_toUChars (d->uchar_converter,
-					ucs_elt->s, keylen + 1,
-					key,
-					keylen, &uc_err);
+			ucs_elt = rspamd_mempool_alloc (cfg->cfg_pool, sizeof (*ucs_elt));
+			nsym = rspamd_language_detector_utf8_lower (key, keylen,
+					ucs_elt->s, G_N_ELEMENTS (ucs_elt->s));
 			ucs_elt->utf = key;
 
-			if (uc_err != U_ZERO_ERROR) {
-				msg_warn_config ("cannot convert key to unicode: %s",
-						u_errorName (uc_err));
-
-				continue;
-			}
-
-			rspamd_language_detector_ucs_lowercase (ucs_elt->s, nsym);
-
 			if (nsym == 3) {
 				g_ptr_array_add (ngramms, ucs_elt);
 			}
 			else {
+				/* Not a trigramm or invalid utf8 */
 				continue;
 			}
 
@@ -567,7 +685,7 @@ rspamd_language_detector_read_file (struct rspamd_config *cfg,
 	PTR_ARRAY_FOREACH (ngramms, i, ucs_elt) {
 		if (ucs_elt->freq > 0) {
 			rspamd_language_detector_init_ngramm (cfg, d,
-					nelt, ucs_elt, nsym,
+					nelt, ucs_elt,
 					ucs_elt->freq, total, htb);
 		}
 	}
@@ -672,6 +790,10 @@ rspamd_language_detector_dtor (struct rspamd_lang_detector *d)
 			ucnv_close (d->uchar_converter);
 		}
 
+		if (d->cache) {
+			rspamd_lru_hash_destroy (d->cache);
+		}
+
 		for (guint i = 0; i < RSPAMD_LANGUAGE_MAX; i ++) {
 			kh_destroy (rspamd_trigram_hash, d->trigramms[i]);
 			rspamd_multipattern_destroy (d->stop_words[i].mp);
@@ -691,7 +813,9 @@ rspamd_language_detector_init (struct rspamd_config *cfg)
 			*languages_disable = NULL;
 	const gchar *languages_path = default_languages_path;
 	glob_t gl;
-	size_t i, short_text_limit = default_short_text_limit, total = 0;
+	size_t i, short_text_limit = default_short_text_limit, total = 0,
+			cache_size = default_cache_size;
+	gdouble early_stop = default_early_stop;
 	UErrorCode uc_err = U_ZERO_ERROR;
 	GString *languages_pattern;
 	struct rspamd_ngramm_chain *chain, schain;
@@ -699,6 +823,8 @@ rspamd_language_detector_init (struct rspamd_config *cfg)
 	struct rspamd_lang_detector *ret = NULL;
 	struct ucl_parser *parser;
 	ucl_object_t *stop_words;
+	struct rspamd_language_parse_job *jobs;
+	guint njobs = 0;
 
 	section = ucl_object_lookup (cfg->rcl_obj, "lang_detection");
 
@@ -715,6 +841,18 @@ rspamd_language_detector_init (struct rspamd_config *cfg)
 			short_text_limit = ucl_object_toint (elt);
 		}
 
+		elt = ucl_object_lookup (section, "early_stop");
+
+		if (elt) {
+			early_stop = ucl_object_todouble (elt);
+		}
+
+		elt = ucl_object_lookup (section, "cache_size");
+
+		if (elt) {
+			cache_size = ucl_object_toint (elt);
+		}
+
 		languages_enable = ucl_object_lookup (section, "languages_enable");
 		languages_disable = ucl_object_lookup (section, "languages_disable");
 	}
@@ -748,6 +886,13 @@ rspamd_language_detector_init (struct rspamd_config *cfg)
 	ret->languages = g_ptr_array_sized_new (gl.gl_pathc);
 	ret->uchar_converter = ucnv_open ("UTF-8", &uc_err);
 	ret->short_text_limit = short_text_limit;
+	ret->early_stop = early_stop;
+
+	if (cache_size > 0) {
+		ret->cache = rspamd_lru_hash_new_full (cache_size, NULL, g_free,
+				rspamd_language_detector_cache_hash,
+				rspamd_language_detector_cache_equal);
+	}
 	/* Map from ngramm in ucs32 to GPtrArray of rspamd_language_elt */
 	for (i = 0; i < RSPAMD_LANGUAGE_MAX; i ++) {
 		ret->trigramms[i] = kh_init (rspamd_trigram_hash);
@@ -759,14 +904,15 @@ rspamd_language_detector_init (struct rspamd_config *cfg)
 
 	g_assert (uc_err == U_ZERO_ERROR);
 
+	jobs = g_malloc0 (sizeof (*jobs) * gl.gl_pathc);
+
 	for (i = 0; i < gl.gl_pathc; i ++) {
 		fname = g_path_get_basename (gl.gl_pathv[i]);
 
 		if (!rspamd_ucl_array_find_str (fname, languages_disable) ||
 				(languages_enable == NULL ||
 						rspamd_ucl_array_find_str (fname, languages_enable))) {
-			rspamd_language_detector_read_file (cfg, ret, gl.gl_pathv[i],
-					stop_words);
+			jobs[njobs ++].path = gl.gl_pathv[i];
 		}
 		else {
 			msg_info_config ("skip language file %s: disabled", fname);
@@ -775,6 +921,23 @@ rspamd_language_detector_init (struct rspamd_config *cfg)
 		g_free (fname);
 	}
 
+	rspamd_language_detector_parse_files (jobs, njobs);
+
+	/* Files are processed in the order of glob to keep the detector stable */
+	for (i = 0; i < njobs; i ++) {
+		if (jobs[i].top == NULL) {
+			msg_warn_config ("cannot parse file %s: %s", jobs[i].path,
+					jobs[i].err);
+			g_free (jobs[i].err);
+		}
+		else {
+			rspamd_language_detector_read_file (cfg, ret, jobs[i].path,
+					jobs[i].top, stop_words);
+		}
+	}
+
+	g_free (jobs);
+
 	for (i = 0; i < RSPAMD_LANGUAGE_MAX; i ++) {
 		GError *err = NULL;
 
@@ -841,6 +1004,23 @@ rspamd_language_detector_to_ucs (struct rspamd_lang_detector *d,
 	}
 }
 
+/*
+ * Checks that utf8 word starts and ends with letters
+ */
+static gboolean
+rspamd_language_detector_is_alpha_word (const rspamd_stat_token_t *tok)
+{
+	const guchar *p = (const guchar *)tok->begin;
+	gint32 i = 0, len = tok->len;
+	UChar32 first, last;
+
+	U8_NEXT (p, i, len, first);
+	i = len;
+	U8_PREV (p, 0, i, last);
+
+	return first >= 0 && last >= 0 && u_isalpha (first) && u_isalpha (last);
+}
+
 static void
 rspamd_language_detector_random_select (GArray *ucs_tokens, guint nwords,
 		goffset *offsets_out)
@@ -885,8 +1065,7 @@ rspamd_language_detector_random_select (GArray *ucs_tokens, guint nwords,
 		for (;;) {
 			tok = &g_array_index (ucs_tokens, rspamd_stat_token_t, sel);
 			/* Filter bad tokens */
-			if (tok->len >= 2 && u_isalpha (*(UChar *)tok->begin)
-					&& u_isalpha (*(((UChar *)tok->begin) + (tok->len - 1)))) {
+			if (tok->len >= 2 && rspamd_language_detector_is_alpha_word (tok)) {
 				offsets_out[out_idx] = sel;
 				break;
 			}
@@ -930,58 +1109,13 @@ rspamd_language_detector_random_select (GArray *ucs_tokens, guint nwords,
 #endif
 }
 
-static goffset
-rspamd_language_detector_next_ngramm (rspamd_stat_token_t *tok, UChar *window,
-		guint wlen, goffset cur_off)
-{
-	guint i;
-
-	if (wlen > 1) {
-		/* Deal with spaces at the beginning and ending */
-
-		if (cur_off == 0) {
-			window[0] = (UChar)' ';
-
-			for (i = 0; i < wlen - 1; i ++) {
-				window[i + 1] = *(((UChar *)tok->begin) + i);
-			}
-		}
-		else if (cur_off + wlen == tok->len + 1) {
-			/* Add trailing space */
-			for (i = 0; i < wlen - 1; i ++) {
-				window[i] = *(((UChar *)tok->begin) + cur_off + i);
-			}
-			window[wlen - 1] = (UChar)' ';
-		}
-		else if (cur_off + wlen > tok->len + 1) {
-			/* No more fun */
-			return -1;
-		}
-		else {
-			/* Normal case */
-			for (i = 0; i < wlen; i++) {
-				window[i] = *(((UChar *) tok->begin) + cur_off + i);
-			}
-		}
-	}
-	else {
-		if (tok->len <= cur_off) {
-			return -1;
-		}
-
-		window[0] = *(((UChar *)tok->begin) + cur_off);
-	}
-
-	return cur_off + 1;
-}
-
 /*
  * Do full guess for a specific ngramm, checking all languages defined
  */
 static void
 rspamd_language_detector_process_ngramm_full (struct rspamd_task *task,
 											  struct rspamd_lang_detector *d,
-											  UChar *window,
+											  guint64 trigram,
 											  khash_t(rspamd_candidates_hash) *candidates,
 											  khash_t(rspamd_trigram_hash) *trigramms)
 {
@@ -993,7 +1127,7 @@ rspamd_language_detector_process_ngramm_full (struct rspamd_task *task,
 	khiter_t k;
 	gdouble prob;
 
-	k = kh_get (rspamd_trigram_hash, trigramms, window);
+	k = kh_get (rspamd_trigram_hash, trigramms, trigram);
 	if (k != kh_end (trigramms)) {
 		chain = &kh_value (trigramms, k);
 	}
@@ -1042,15 +1176,39 @@ rspamd_language_detector_detect_word (struct rspamd_task *task,
 									  khash_t(rspamd_candidates_hash) *candidates,
 									  khash_t(rspamd_trigram_hash) *trigramms)
 {
-	const guint wlen = 3;
-	UChar window[3];
-	goffset cur = 0;
+	const guchar *p = (const guchar *)tok->begin;
+	gint32 i = 0, len = tok->len;
+	guint nsym = 1;
+	guint64 trigram;
+	UChar32 uc;
+
+	/*
+	 * Slide over the utf8 word padded with spaces: " word " gives
+	 * " wo", "wor", "ord" and "rd "
+	 */
+	trigram = rspamd_trigram_push (0, ' ');
+
+	while (i < len) {
+		U8_NEXT (p, i, len, uc);
+
+		if (uc < 0) {
+			/* Invalid utf8, skip the rest of the word */
+			return;
+		}
+
+		trigram = rspamd_trigram_push (trigram, u_tolower (uc));
 
-	/* Split words */
-	while ((cur = rspamd_language_detector_next_ngramm (tok, window, wlen, cur))
-			!= -1) {
+		if (++nsym >= 3) {
+			rspamd_language_detector_process_ngramm_full (task,
+					d, trigram, candidates, trigramms);
+		}
+	}
+
+	trigram = rspamd_trigram_push (trigram, ' ');
+
+	if (++nsym >= 3) {
 		rspamd_language_detector_process_ngramm_full (task,
-				d, window, candidates, trigramms);
+				d, trigram, candidates, trigramms);
 	}
 }
 
@@ -1122,6 +1280,38 @@ rspamd_language_detector_filter_negligible (struct rspamd_task *task,
 	msg_debug_lang_det ("removed %d languages", filtered);
 }
 
+/*
+ * Checks if the best candidate is 2^threshold times more probable than the
+ * next one, so the remaining words are unlikely to change the guess
+ */
+static gboolean
+rspamd_language_detector_is_confident (khash_t(rspamd_candidates_hash) *candidates,
+		gdouble threshold)
+{
+	struct rspamd_lang_detector_res *cand;
+	gdouble best = 0, second = 0;
+
+	kh_foreach_value (candidates, cand, {
+		if (cand->prob > best) {
+			second = best;
+			best = cand->prob;
+		}
+		else if (cand->prob > second) {
+			second = cand->prob;
+		}
+	});
+
+	if (best <= 0) {
+		return FALSE;
+	}
+
+	if (second <= 0) {
+		return TRUE;
+	}
+
+	return log2 (best) - log2 (second) >= threshold;
+}
+
 static void
 rspamd_language_detector_detect_type (struct rspamd_task *task,
 									  guint nwords,
@@ -1132,7 +1322,7 @@ rspamd_language_detector_detect_type (struct rspamd_task *task,
 {
 	guint nparts = MIN (words->len, nwords);
 	goffset *selected_words;
-	rspamd_stat_token_t *tok, ucs_w;
+	rspamd_stat_token_t *tok;
 	guint i;
 
 	selected_words = g_new0 (goffset, nparts);
@@ -1142,11 +1332,17 @@ rspamd_language_detector_detect_type (struct rspamd_task *task,
 	for (i = 0; i < nparts; i++) {
 		tok = &g_array_index (words, rspamd_stat_token_t,
 				selected_words[i]);
-		rspamd_language_detector_to_ucs (task->lang_det,
-				task->task_pool,
-				tok, &ucs_w);
-		rspamd_language_detector_detect_word (task, d, &ucs_w, candidates,
+		rspamd_language_detector_detect_word (task, d, tok, candidates,
 				d->trigramms[cat]);
+
+		if (d->early_stop > 0 && i + 1 >= d->short_text_limit &&
+				(i + 1) % early_stop_step == 0 &&
+				rspamd_language_detector_is_confident (candidates,
+						d->early_stop)) {
+			msg_debug_lang_det ("stop after %d of %d words: confident guess",
+					i + 1, nparts);
+			break;
+		}
 	}
 
 	/* Filter negligible candidates */
@@ -1588,6 +1784,76 @@ rspamd_language_detector_try_stop_words (struct rspamd_task *task,
 	return ret;
 }
 
+/*
+ * Text of a part depends on its raw content and on the detected charset
+ */
+static void
+rspamd_language_detector_part_digest (struct rspamd_mime_text_part *part,
+		guchar *out)
+{
+	rspamd_cryptobox_hash_state_t st;
+
+	rspamd_cryptobox_hash_init (&st, NULL, 0);
+	rspamd_cryptobox_hash_update (&st, part->mime_part->digest,
+			sizeof (part->mime_part->digest));
+
+	if (part->real_charset) {
+		rspamd_cryptobox_hash_update (&st, part->real_charset,
+				strlen (part->real_charset));
+	}
+
+	rspamd_cryptobox_hash_final (&st, out);
+}
+
+static void
+rspamd_language_detector_cache_restore (struct rspamd_task *task,
+		struct rspamd_mime_text_part *part,
+		struct rspamd_lang_detector_cache_elt *elt)
+{
+	struct rspamd_lang_detector_res *r;
+	guint i;
+
+	part->unicode_scripts = elt->unicode_scripts;
+
+	if (elt->nlangs > 0) {
+		part->languages = g_ptr_array_sized_new (elt->nlangs);
+
+		for (i = 0; i < elt->nlangs; i ++) {
+			r = rspamd_mempool_alloc (task->task_pool, sizeof (*r));
+			memcpy (r, &elt->langs[i], sizeof (*r));
+			g_ptr_array_add (part->languages, r);
+		}
+
+		part->language = elt->langs[0].lang;
+	}
+}
+
+static void
+rspamd_language_detector_cache_save (struct rspamd_task *task,
+		struct rspamd_lang_detector *d,
+		struct rspamd_mime_text_part *part,
+		const guchar *digest,
+		gboolean detected)
+{
+	struct rspamd_lang_detector_cache_elt *elt;
+	struct rspamd_lang_detector_res *r;
+	guint i, nlangs;
+
+	nlangs = part->languages ? part->languages->len : 0;
+	elt = g_malloc (sizeof (*elt) + nlangs * sizeof (elt->langs[0]));
+	memcpy (elt->digest, digest, sizeof (elt->digest));
+	elt->unicode_scripts = part->unicode_scripts;
+	elt->detected = detected;
+	elt->nlangs = nlangs;
+
+	for (i = 0; i < nlangs; i ++) {
+		r = g_ptr_array_index (part->languages, i);
+		memcpy (&elt->langs[i], r, sizeof (*r));
+	}
+
+	rspamd_lru_hash_insert (d->cache, elt->digest, elt, task->tv.tv_sec, 0);
+}
+
 gboolean
 rspamd_language_detector_detect (struct rspamd_task *task,
 								 struct rspamd_lang_detector *d,
@@ -1601,13 +1867,29 @@ rspamd_language_detector_detect (struct rspamd_task *task,
 	struct rspamd_lang_detector_res *cand;
 	enum rspamd_language_detected_type r;
 	struct rspamd_frequency_sort_cbdata cbd;
+	struct rspamd_lang_detector_cache_elt *cached;
+	guchar digest[rspamd_cryptobox_HASHBYTES];
 	/* Check if we have sorted candidates based on frequency */
-	gboolean frequency_heuristic_applied = FALSE, ret = FALSE;
+	gboolean frequency_heuristic_applied = FALSE, ret = FALSE,
+			use_cache = FALSE;
 
 	if (!part->utf_stripped_content) {
 		return FALSE;
 	}
 
+	if (d->cache && part->mime_part) {
+		use_cache = TRUE;
+		rspamd_language_detector_part_digest (part, digest);
+		cached = rspamd_lru_hash_lookup (d->cache, digest, task->tv.tv_sec);
+
+		if (cached) {
+			msg_debug_lang_det ("use cached languages of the part");
+			rspamd_language_detector_cache_restore (task, part, cached);
+
+			return cached->detected;
+		}
+	}
+
 	start_ticks = rspamd_get_ticks (TRUE);
 
 	rspamd_language_detector_unicode_scripts (task, part);
@@ -1729,6 +2011,10 @@ rspamd_language_detector_detect (struct rspamd_task *task,
 		kh_destroy (rspamd_candidates_hash, candidates);
 	}
 
+	if (use_cache) {
+		rspamd_language_detector_cache_save (task, d, part, digest, ret);
+	}
+
 	end_ticks = rspamd_get_ticks (TRUE);
 	msg_debug_lang_det ("detected languages in %.0f ticks",
 			(end_ticks - start_ticks));
@@ -27,6 +27,8 @@
 #include "lang_detection.h"
 #include "libutil/multipattern.h"
 #include "libserver/mempool_vars_internal.h"
+#include "libserver/task_snapshot.h"
+#include "khash.h"
 
 #ifdef WITH_SNOWBALL
 #include "libstemmer.h"
@@ -48,6 +50,146 @@ static const gchar gtube_pattern_rewrite_subject[] = "ZJS*C4JDBQADN1.NSBN3*2IDNE
 struct rspamd_multipattern *gtube_matcher = NULL;
 static const guint64 words_hash_seed = 0xdeadbabe;
 
+#define RSPAMD_WORDS_CACHE_SIZE 65536
+#define RSPAMD_WORDS_CACHE_TTL 86400
+
+/*
+ * Normalised (stemmed and lowercased) form of a word, shared by all tasks of
+ * a worker. Both raw and normalised words are stored inline, `stem` and `utf`
+ * are part of the key as they define the normalisation
+ */
+struct rspamd_word_cache_elt {
+	const gchar *raw;
+	guint rawlen;
+	guint normlen;
+	gboolean utf;
+	gpointer stem;
+	guint64 key_hash;
+	guint64 h; /* words_hash_seed hash of the normalised word */
+	gchar *norm;
+};
+
+static rspamd_lru_hash_t *words_cache = NULL;
+
+static guint
+rspamd_word_cache_hash (gconstpointer key)
+{
+	const struct rspamd_word_cache_elt *elt = key;
+
+	return (guint)elt->key_hash;
+}
+
+static gboolean
+rspamd_word_cache_equal (gconstpointer v1, gconstpointer v2)
+{
+	const struct rspamd_word_cache_elt *e1 = v1, *e2 = v2;
+
+	return e1->key_hash == e2->key_hash && e1->rawlen == e2->rawlen &&
+			e1->stem == e2->stem && e1->utf == e2->utf &&
+			memcmp (e1->raw, e2->raw, e1->rawlen) == 0;
+}
+
+/*
+ * Writes stemmed (if `stem` is not NULL) and lowercased word to `out` that
+ * must have at least `len` bytes, returns length of the normalised word
+ */
+static guint
+rspamd_mime_normalize_word (gpointer stem, gboolean utf, gboolean ascii,
+		const gchar *word, guint len, gchar *out)
+{
+	const guchar *r = NULL;
+	guint nlen = len;
+
+#ifdef WITH_SNOWBALL
+	if (stem) {
+		r = sb_stemmer_stem (stem, word, len);
+	}
+#endif
+
+	if (r != NULL) {
+		nlen = strlen (r);
+		nlen = MIN (nlen, len);
+		memcpy (out, r, nlen);
+	}
+	else {
+		memcpy (out, word, len);
+	}
+
+	if (utf && !ascii) {
+		rspamd_str_lc_utf8 (out, nlen);
+	}
+	else {
+		rspamd_str_lc (out, nlen);
+	}
+
+	return nlen;
+}
+
+/*
+ * Normalises text word using per worker cache, so stemming and unicode
+ * lowercasing are performed once for frequent words
+ */
+static void
+rspamd_mime_word_normalize_cached (struct rspamd_task *task, gpointer stem,
+		gboolean utf, gboolean ascii, rspamd_stat_token_t *w, guint64 *h)
+{
+	struct rspamd_word_cache_elt srch, *found;
+	gchar *temp_word;
+
+	if (ascii && stem == NULL) {
+		/* Plain ASCII lowercasing is cheaper than a cache lookup */
+		temp_word = rspamd_mempool_alloc (task->task_pool, w->len);
+		memcpy (temp_word, w->begin, w->len);
+		rspamd_str_lc (temp_word, w->len);
+		w->begin = temp_word;
+		*h = rspamd_cryptobox_fast_hash_specific (
+				RSPAMD_CRYPTOBOX_HASHFAST_INDEPENDENT,
+				w->begin, w->len, words_hash_seed);
+
+		return;
+	}
+
+	if (words_cache == NULL) {
+		words_cache = rspamd_lru_hash_new_full (RSPAMD_WORDS_CACHE_SIZE,
+				g_free, NULL,
+				rspamd_word_cache_hash, rspamd_word_cache_equal);
+	}
+
+	srch.raw = w->begin;
+	srch.rawlen = w->len;
+	srch.utf = utf;
+	srch.stem = stem;
+	srch.key_hash = rspamd_cryptobox_fast_hash (w->begin, w->len,
+			((guint64)(guintptr)stem) ^ utf);
+
+	found = rspamd_lru_hash_lookup (words_cache, &srch, task->tv.tv_sec);
+
+	if (found == NULL) {
+		found = g_malloc (sizeof (*found) + w->len * 2);
+		found->raw = ((gchar *)found) + sizeof (*found);
+		found->norm = ((gchar *)found) + sizeof (*found) + w->len;
+		memcpy ((gchar *)found->raw, w->begin, w->len);
+		found->rawlen = w->len;
+		found->utf = utf;
+		found->stem = stem;
+		found->key_hash = srch.key_hash;
+		found->normlen = rspamd_mime_normalize_word (stem, utf, ascii,
+				w->begin, w->len, found->norm);
+		found->h = rspamd_cryptobox_fast_hash_specific (
+				RSPAMD_CRYPTOBOX_HASHFAST_INDEPENDENT,
+				found->norm, found->normlen, words_hash_seed);
+		rspamd_lru_hash_insert (words_cache, found, found, task->tv.tv_sec,
+				RSPAMD_WORDS_CACHE_TTL);
+	}
+
+	/* Cached element can be evicted, so copy it to the task pool */
+	temp_word = rspamd_mempool_alloc (task->task_pool, found->normlen);
+	memcpy (temp_word, found->norm, found->normlen);
+	w->begin = temp_word;
+	w->len = found->normlen;
+	*h = found->h;
+}
+
 
 static void
 free_byte_array_callback (void *pointer)
@@ -56,18 +198,52 @@ free_byte_array_callback (void *pointer)
 	g_byte_array_free (arr, TRUE);
 }
 
+static void
+rspamd_mime_part_words_stat (struct rspamd_task *task,
+		struct rspamd_mime_text_part *part, guint total_len, guint short_len)
+{
+	if (part->utf_words && part->utf_words->len) {
+		gdouble *avg_len_p, *short_len_p;
+
+		avg_len_p = rspamd_mempool_get_variable (task->task_pool,
+				RSPAMD_MEMPOOL_AVG_WORDS_LEN);
+
+		if (avg_len_p == NULL) {
+			avg_len_p = rspamd_mempool_alloc (task->task_pool,
+					sizeof (double));
+			*avg_len_p = total_len;
+			rspamd_mempool_set_variable (task->task_pool,
+					RSPAMD_MEMPOOL_AVG_WORDS_LEN, avg_len_p, NULL);
+		}
+		else {
+			*avg_len_p += total_len;
+		}
+
+		short_len_p = rspamd_mempool_get_variable (task->task_pool,
+				RSPAMD_MEMPOOL_SHORT_WORDS_CNT);
+
+		if (short_len_p == NULL) {
+			short_len_p = rspamd_mempool_alloc (task->task_pool,
+					sizeof (double));
+			*short_len_p = short_len;
+			rspamd_mempool_set_variable (task->task_pool,
+					RSPAMD_MEMPOOL_SHORT_WORDS_CNT, avg_len_p, NULL);
+		}
+		else {
+			*short_len_p += short_len;
+		}
+	}
+}
+
 static void
 rspamd_mime_part_extract_words (struct rspamd_task *task,
 		struct rspamd_mime_text_part *part)
 {
-#ifdef WITH_SNOWBALL
-	struct sb_stemmer *stem = NULL;
-#endif
+	gpointer stem = NULL;
 	rspamd_stat_token_t *w;
-	gchar *temp_word;
-	const guchar *r;
-	guint i, nlen, total_len = 0, short_len = 0;
+	guint i, total_len = 0, short_len = 0;
 	gdouble avg_len = 0;
+	gboolean part_ascii;
 
 	if (part->utf_words) {
 #ifdef WITH_SNOWBALL
@@ -99,52 +275,32 @@ rspamd_mime_part_extract_words (struct rspamd_task *task,
 #endif
 
 
+		/* Most of the parts are ASCII only, so avoid checking each word */
+		part_ascii = part->utf_stripped_content != NULL &&
+				!rspamd_str_has_8bit (part->utf_stripped_content->data,
+						part->utf_stripped_content->len);
+
 		for (i = 0; i < part->utf_words->len; i++) {
 			guint64 h;
 
 			w = &g_array_index (part->utf_words, rspamd_stat_token_t, i);
-			r = NULL;
-#ifdef WITH_SNOWBALL
-			if (stem) {
-				r = sb_stemmer_stem (stem, w->begin, w->len);
-			}
-#endif
 
 			if (w->len > 0 && (w->flags & RSPAMD_STAT_TOKEN_FLAG_TEXT)) {
-				avg_len = avg_len + (w->len - avg_len) / (double) (i + 1);
-
-				if (r != NULL) {
-					nlen = strlen (r);
-					nlen = MIN (nlen, w->len);
-					temp_word = rspamd_mempool_alloc (task->task_pool, nlen);
-					memcpy (temp_word, r, nlen);
+				gboolean ascii = TRUE;
 
-					if (IS_PART_UTF (part)) {
-						rspamd_str_lc_utf8 (temp_word, nlen);
-					}
-					else {
-						rspamd_str_lc (temp_word, nlen);
-					}
+				avg_len = avg_len + (w->len - avg_len) / (double) (i + 1);
 
-					w->begin = temp_word;
-					w->len = nlen;
+				/* Lets consumers skip pure ASCII words without rescanning them */
+				if (!part_ascii && rspamd_str_has_8bit (w->begin, w->len)) {
+					w->flags |= RSPAMD_STAT_TOKEN_FLAG_NON_ASCII;
+					part->non_ascii_words ++;
+					ascii = FALSE;
 				}
-				else {
-					temp_word = rspamd_mempool_alloc (task->task_pool, w->len);
-					memcpy (temp_word, w->begin, w->len);
-
-					if (IS_PART_UTF (part)) {
-						rspamd_str_lc_utf8 (temp_word, w->len);
-					}
-					else {
-						rspamd_str_lc (temp_word, w->len);
-					}
 
-					w->begin = temp_word;
-				}
+				rspamd_mime_word_normalize_cached (task, stem, IS_PART_UTF (part),
+						ascii, w, &h);
 			}
-
-			if (w->len > 0) {
+			else if (w->len > 0) {
 				/*
 				 * We use static hash seed if we would want to use that in shingles
 				 * computation in future
@@ -152,6 +308,9 @@ rspamd_mime_part_extract_words (struct rspamd_task *task,
 				h = rspamd_cryptobox_fast_hash_specific (
 						RSPAMD_CRYPTOBOX_HASHFAST_INDEPENDENT,
 						w->begin, w->len, words_hash_seed);
+			}
+
+			if (w->len > 0) {
 				g_array_append_val (part->normalized_hashes, h);
 				total_len += w->len;
 
@@ -161,37 +320,32 @@ rspamd_mime_part_extract_words (struct rspamd_task *task,
 			}
 		}
 
-		if (part->utf_words && part->utf_words->len) {
-			gdouble *avg_len_p, *short_len_p;
+		rspamd_mime_part_words_stat (task, part, total_len, short_len);
+	}
+}
 
-			avg_len_p = rspamd_mempool_get_variable (task->task_pool,
-					RSPAMD_MEMPOOL_AVG_WORDS_LEN);
+/* Words restored from a snapshot are already normalized */
+static void
+rspamd_mime_part_restored_words_stat (struct rspamd_task *task,
+		struct rspamd_mime_text_part *part)
+{
+	rspamd_stat_token_t *w;
+	guint i, total_len = 0, short_len = 0;
 
-			if (avg_len_p == NULL) {
-				avg_len_p = rspamd_mempool_alloc (task->task_pool,
-						sizeof (double));
-				*avg_len_p = total_len;
-				rspamd_mempool_set_variable (task->task_pool,
-						RSPAMD_MEMPOOL_AVG_WORDS_LEN, avg_len_p, NULL);
-			}
-			else {
-				*avg_len_p += total_len;
-			}
+	if (part->utf_words) {
+		for (i = 0; i < part->utf_words->len; i++) {
+			w = &g_array_index (part->utf_words, rspamd_stat_token_t, i);
 
-			short_len_p = rspamd_mempool_get_variable (task->task_pool,
-					RSPAMD_MEMPOOL_SHORT_WORDS_CNT);
+			if (w->len > 0) {
+				total_len += w->len;
 
-			if (short_len_p == NULL) {
-				short_len_p = rspamd_mempool_alloc (task->task_pool,
-						sizeof (double));
-				*short_len_p = short_len;
-				rspamd_mempool_set_variable (task->task_pool,
-						RSPAMD_MEMPOOL_SHORT_WORDS_CNT, avg_len_p, NULL);
-			}
-			else {
-				*short_len_p += short_len;
+				if (w->len <= 3) {
+					short_len++;
+				}
 			}
 		}
+
+		rspamd_mime_part_words_stat (task, part, total_len, short_len);
 	}
 }
 
@@ -538,55 +692,115 @@ rspamd_normalize_text_part (struct rspamd_task *task,
 			part->newlines);
 }
 
-#define MIN3(a, b, c) ((a) < (b) ? ((a) < (c) ? (a) : (c)) : ((b) < (c) ? (b) : (c)))
+KHASH_MAP_INIT_INT64 (rspamd_words_pos_hash, guint);
 
+/*
+ * Returns edit distance between two arrays of word hashes where replacement
+ * costs twice more than insertion or deletion (to calculate percentage
+ * properly), so it is equal to `len1 + len2 - 2 * LCS`. LCS is calculated
+ * using bit-parallel algorithm (Hyyro) over the shorter array, so each word
+ * of the longer array costs a single pass over ceil(shorter / 64) words
+ */
 static guint
 rspamd_words_levenshtein_distance (struct rspamd_task *task,
 		GArray *w1, GArray *w2)
 {
-	guint s1len, s2len, x, y, lastdiag, olddiag;
-	guint *column, ret;
-	guint64 h1, h2;
-	gint eq;
+	guint s1len, s2len, nblocks, i, k, lcs = 0;
+	guint64 *v, *m, h, sum, u, carry, c1, c2, rem;
+	guint *next;
+	khash_t(rspamd_words_pos_hash) *positions;
+	khiter_t it;
+	gint r;
 	static const guint max_words = 8192;
 
+	if (w1->len > w2->len) {
+		GArray *tmp = w1;
+
+		w1 = w2;
+		w2 = tmp;
+	}
+
 	s1len = w1->len;
 	s2len = w2->len;
 
 	if (s1len + s2len > max_words) {
 		msg_err_task ("cannot compare parts with more than %ud words: %ud",
-				max_words, s1len);
+				max_words, s1len + s2len);
 		return 0;
 	}
 
-	column = g_malloc0 ((s1len + 1) * sizeof (guint));
+	if (s1len == 0) {
+		return s2len;
+	}
 
-	for (y = 1; y <= s1len; y++) {
-		column[y] = y;
+	nblocks = (s1len + 63) / 64;
+	v = g_malloc (nblocks * sizeof (guint64) * 2 + s1len * sizeof (guint));
+	m = v + nblocks;
+	next = (guint *)(m + nblocks);
+	memset (v, 0xff, nblocks * sizeof (guint64));
+	memset (m, 0, nblocks * sizeof (guint64));
+
+	/* Chains of positions of each word in the shorter array */
+	positions = kh_init (rspamd_words_pos_hash);
+	kh_resize (rspamd_words_pos_hash, positions, s1len);
+
+	for (i = s1len; i-- > 0;) {
+		h = g_array_index (w1, guint64, i);
+		it = kh_put (rspamd_words_pos_hash, positions, h, &r);
+
+		next[i] = r == 0 ? kh_value (positions, it) : G_MAXUINT;
+		kh_value (positions, it) = i;
 	}
 
-	for (x = 1; x <= s2len; x++) {
-		column[0] = x;
+	for (i = 0; i < s2len; i++) {
+		h = g_array_index (w2, guint64, i);
+		it = kh_get (rspamd_words_pos_hash, positions, h);
 
-		for (y = 1, lastdiag = x - 1; y <= s1len; y++) {
-			olddiag = column[y];
-			h1 = g_array_index (w1, guint64, y - 1);
-			h2 = g_array_index (w2, guint64, x - 1);
-			eq = (h1 == h2) ? 1 : 0;
-			/*
-			 * Cost of replacement is twice higher than cost of add/delete
-			 * to calculate percentage properly
-			 */
-			column[y] = MIN3 (column[y] + 1, column[y - 1] + 1,
-					lastdiag + (eq * 2));
-			lastdiag = olddiag;
+		if (it == kh_end (positions)) {
+			/* Matching vector is empty, so V is not changed */
+			continue;
+		}
+
+		for (k = kh_value (positions, it); k != G_MAXUINT; k = next[k]) {
+			m[k / 64] |= 1ULL << (k % 64);
+		}
+
+		/* V = (V + (V & M)) | (V & ~M) with carry between blocks */
+		carry = 0;
+
+		for (k = 0; k < nblocks; k++) {
+			u = v[k] & m[k];
+			sum = v[k] + u;
+			c1 = sum < u;
+			sum += carry;
+			c2 = sum < carry;
+			v[k] = sum | (v[k] & ~m[k]);
+			carry = c1 | c2;
+		}
+
+		for (k = kh_value (positions, it); k != G_MAXUINT; k = next[k]) {
+			m[k / 64] = 0;
 		}
 	}
 
-	ret = column[s1len];
-	g_free (column);
+	/* LCS is the number of zero bits in V */
+	for (k = 0; k < nblocks; k++) {
+		rem = ~v[k];
 
-	return ret;
+		if (k == nblocks - 1 && s1len % 64 != 0) {
+			rem &= (1ULL << (s1len % 64)) - 1;
+		}
+
+		while (rem) {
+			rem &= rem - 1;
+			lcs ++;
+		}
+	}
+
+	kh_destroy (rspamd_words_pos_hash, positions);
+	g_free (v);
+
+	return s1len + s2len - lcs * 2;
 }
 
 static gint
@@ -715,13 +929,14 @@ rspamd_message_process_html_text_part (struct rspamd_task *task,
 	text_part->html = rspamd_mempool_alloc0 (task->task_pool,
 			sizeof (*text_part->html));
 	text_part->flags |= RSPAMD_MIME_TEXT_PART_FLAG_BALANCED;
+	/* Urls are not collected when we need merely tokens */
 	text_part->utf_content = rspamd_html_process_part_full (
 			task->task_pool,
 			text_part->html,
 			text_part->utf_raw_content,
 			&text_part->exceptions,
-			task->urls,
-			task->emails);
+			RSPAMD_TASK_IS_TOKENIZE_ONLY (task) ? NULL : task->urls,
+			RSPAMD_TASK_IS_TOKENIZE_ONLY (task) ? NULL : task->emails);
 
 	if (text_part->utf_content->len == 0) {
 		text_part->flags |= RSPAMD_MIME_TEXT_PART_FLAG_EMPTY;
@@ -883,6 +1098,11 @@ rspamd_message_process_text_part_maybe (struct rspamd_task *task,
 	/* Post process part */
 	rspamd_normalize_text_part (task, text_part);
 
+	if (task->snapshot &&
+			rspamd_task_snapshot_restore_text_part (task, text_part)) {
+		return;
+	}
+
 	if (!IS_PART_HTML (text_part)) {
 		rspamd_url_text_extract (task->task_pool, task, text_part, FALSE);
 	}
@@ -906,7 +1126,7 @@ rspamd_message_from_data (struct rspamd_task *task, const guchar *start,
 	struct rspamd_content_type *ct = NULL;
 	struct rspamd_mime_part *part;
 	const char *mb = NULL;
-	gchar *mid;
+	gchar *mid, *tmp;
 	rspamd_ftok_t srch, *tok;
 
 	g_assert (start != NULL);
@@ -941,9 +1161,9 @@ rspamd_message_from_data (struct rspamd_task *task, const guchar *start,
 	part->parsed_data.len = len;
 
 	/* Generate message ID */
-	mid = rspamd_mime_message_id_generate ("localhost.localdomain");
-	rspamd_mempool_add_destructor (task->task_pool,
-			(rspamd_mempool_destruct_t) g_free, mid);
+	tmp = rspamd_mime_message_id_generate ("localhost.localdomain");
+	mid = rspamd_mempool_strdup (task->task_pool, tmp);
+	g_free (tmp);
 	task->message_id = mid;
 	task->queue_id = mid;
 }
@@ -1061,7 +1281,7 @@ rspamd_message_parse (struct rspamd_task *task)
 		gboolean need_recv_correction = FALSE;
 		rspamd_inet_addr_t *raddr;
 
-		recv = g_ptr_array_index (task->received, 0);
+		recv = rspamd_task_get_received (task, 0);
 		/*
 		 * For the first header we must ensure that
 		 * received is consistent with the IP that we obtain through
@@ -1128,8 +1348,8 @@ rspamd_message_parse (struct rspamd_task *task)
 			PTR_ARRAY_FOREACH (task->received, i, recv) {
 				g_ptr_array_add (nar, recv);
 			}
-			rspamd_mempool_add_destructor (task->task_pool,
-						rspamd_ptr_array_free_hard, nar);
+			/* Received array is freed with the task */
+			g_ptr_array_free (task->received, TRUE);
 			task->received = nar;
 #endif
 		}
@@ -1138,7 +1358,7 @@ rspamd_message_parse (struct rspamd_task *task)
 	/* Extract data from received header if we were not given IP */
 	if (task->received->len > 0 && (task->flags & RSPAMD_TASK_FLAG_NO_IP) &&
 			(task->cfg && !task->cfg->ignore_received)) {
-		recv = g_ptr_array_index (task->received, 0);
+		recv = rspamd_task_get_received (task, 0);
 		if (recv->real_ip) {
 			if (!rspamd_parse_inet_address (&task->from_addr,
 					recv->real_ip,
@@ -1158,8 +1378,11 @@ rspamd_message_parse (struct rspamd_task *task)
 		p = task->subject;
 		len = strlen (p);
 		rspamd_cryptobox_hash_update (&st, p, len);
-		rspamd_url_find_multiple (task->task_pool, p, len, FALSE, NULL,
-				rspamd_url_task_subject_callback, task);
+
+		if (!RSPAMD_TASK_IS_TOKENIZE_ONLY (task)) {
+			rspamd_url_find_multiple (task->task_pool, p, len, FALSE, NULL,
+					rspamd_url_task_subject_callback, task);
+		}
 	}
 
 	for (i = 0; i < task->parts->len; i ++) {
@@ -1203,8 +1426,15 @@ rspamd_message_process (struct rspamd_task *task)
 		rspamd_message_process_text_part_maybe (task, part);
 	}
 
+	/*
+	 * Images are still required for tokenize only mode as they provide
+	 * statistical tokens, whilst archives do not
+	 */
 	rspamd_images_process (task);
-	rspamd_archives_process (task);
+
+	if (!RSPAMD_TASK_IS_TOKENIZE_ONLY (task)) {
+		rspamd_archives_process (task);
+	}
 
 	/* Calculate distance for 2-parts messages */
 	if (task->text_parts->len == 2) {
@@ -1243,7 +1473,9 @@ rspamd_message_process (struct rspamd_task *task)
 						}
 					}
 
-					rspamd_mime_part_detect_language (task, sel);
+					if (!(sel->flags & RSPAMD_MIME_TEXT_PART_FLAG_SNAPSHOT)) {
+						rspamd_mime_part_detect_language (task, sel);
+					}
 
 					if (sel->language && sel->language[0]) {
 						/* Propagate language */
@@ -1259,7 +1491,7 @@ rspamd_message_process (struct rspamd_task *task)
 
 					tw = p1->normalized_hashes->len + p2->normalized_hashes->len;
 
-					if (tw > 0) {
+					if (tw > 0 && !RSPAMD_TASK_IS_TOKENIZE_ONLY (task)) {
 						dw = rspamd_words_levenshtein_distance (task,
 								p1->normalized_hashes,
 								p2->normalized_hashes);
@@ -1301,6 +1533,16 @@ rspamd_message_process (struct rspamd_task *task)
 	guint total_words = 0;
 
 	PTR_ARRAY_FOREACH (task->text_parts, i, text_part) {
+		if (text_part->flags & RSPAMD_MIME_TEXT_PART_FLAG_SNAPSHOT) {
+			rspamd_mime_part_restored_words_stat (task, text_part);
+
+			if (text_part->utf_words) {
+				total_words += text_part->utf_words->len;
+			}
+
+			continue;
+		}
+
 		if (!text_part->language) {
 			rspamd_mime_part_detect_language (task, text_part);
 		}
@@ -1312,6 +1554,10 @@ rspamd_message_process (struct rspamd_task *task)
 		}
 	}
 
+	if (task->snapshot) {
+		rspamd_task_snapshot_restore_urls (task);
+	}
+
 	if (total_words > 0) {
 		var = rspamd_mempool_get_variable (task->task_pool,
 				RSPAMD_MEMPOOL_AVG_WORDS_LEN);
@@ -1348,18 +1594,15 @@ rspamd_message_get_header_from_hash (GHashTable *htb,
 
 	if (strong && pool != NULL) {
 		/* Need to filter what we have */
-		ret = g_ptr_array_sized_new (ar->len);
+		ret = rspamd_mempool_ptr_array_new (pool, ar->len);
 
 		PTR_ARRAY_FOREACH (ar, i, cur) {
 			if (strcmp (cur->name, field) != 0) {
 				continue;
 			}
 
-			g_ptr_array_add (ret, cur);
+			ret->pdata[ret->len ++] = cur;
 		}
-
-		rspamd_mempool_add_destructor (pool,
-				(rspamd_mempool_destruct_t)rspamd_ptr_array_free_hard, ret);
 	}
 	else {
 		ret = ar;
@@ -1373,10 +1616,51 @@ rspamd_message_get_header_array (struct rspamd_task *task,
 		const gchar *field,
 		gboolean strong)
 {
+	if (task->headers_index) {
+		return rspamd_message_get_header_array_by_hash (task,
+				rspamd_mime_header_hash (field, strlen (field)),
+				field, strong);
+	}
+
 	return rspamd_message_get_header_from_hash (task->raw_headers,
 			task->task_pool, field, strong);
 }
 
+GPtrArray *
+rspamd_message_get_header_array_by_hash (struct rspamd_task *task,
+		guint64 hash,
+		const gchar *field,
+		gboolean strong)
+{
+	GPtrArray *ret, *ar;
+	struct rspamd_mime_header *cur;
+	guint i;
+
+	if (task->headers_index == NULL) {
+		return rspamd_message_get_header_from_hash (task->raw_headers,
+				task->task_pool, field, strong);
+	}
+
+	ar = rspamd_mime_headers_index_lookup (task->headers_index, hash);
+
+	if (ar == NULL || !strong) {
+		return ar;
+	}
+
+	/* Need to filter what we have */
+	ret = rspamd_mempool_ptr_array_new (task->task_pool, ar->len);
+
+	PTR_ARRAY_FOREACH (ar, i, cur) {
+		if (strcmp (cur->name, field) != 0) {
+			continue;
+		}
+
+		ret->pdata[ret->len ++] = cur;
+	}
+
+	return ret;
+}
+
 GPtrArray *
 rspamd_message_get_mime_header_array (struct rspamd_task *task,
 		const gchar *field,
@@ -1402,7 +1686,7 @@ rspamd_message_get_mime_header_array (struct rspamd_task *task,
 		return NULL;
 	}
 
-	ret = g_ptr_array_sized_new (nelems);
+	ret = rspamd_mempool_ptr_array_new (task->task_pool, nelems);
 
 	for (i = 0; i < task->parts->len; i ++) {
 		mp = g_ptr_array_index (task->parts, i);
@@ -1415,12 +1699,9 @@ rspamd_message_get_mime_header_array (struct rspamd_task *task,
 				}
 			}
 
-			g_ptr_array_add (ret, cur);
+			ret->pdata[ret->len ++] = cur;
 		}
 	}
 
-	rspamd_mempool_add_destructor (task->task_pool,
-		(rspamd_mempool_destruct_t)rspamd_ptr_array_free_hard, ret);
-
 	return ret;
 }
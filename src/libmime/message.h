@@ -28,9 +28,13 @@ enum rspamd_mime_part_flags {
 	RSPAMD_MIME_PART_IMAGE = (1 << 2),
 	RSPAMD_MIME_PART_ARCHIVE = (1 << 3),
 	RSPAMD_MIME_PART_BAD_CTE = (1 << 4),
-	RSPAMD_MIME_PART_MISSING_CTE = (1 << 5)
+	RSPAMD_MIME_PART_MISSING_CTE = (1 << 5),
+	RSPAMD_MIME_PART_LAZY = (1 << 6)
 };
 
+/* Number of decoded bytes kept for parts that are not decoded yet */
+#define RSPAMD_MIME_PART_HEAD_LEN 16
+
 enum rspamd_cte {
 	RSPAMD_CTE_UNKNOWN = 0,
 	RSPAMD_CTE_7BIT = 1,
@@ -49,8 +53,13 @@ struct rspamd_mime_part {
 	struct rspamd_content_type *ct;
 	struct rspamd_content_disposition *cd;
 	rspamd_ftok_t raw_data;
+	/*
+	 * For RSPAMD_MIME_PART_LAZY parts only len is valid until
+	 * rspamd_mime_part_get_parsed is called
+	 */
 	rspamd_ftok_t parsed_data;
 	struct rspamd_mime_part *parent_part;
+	rspamd_mempool_t *pool;
 
 	GQueue *headers_order;
 	GHashTable *raw_headers;
@@ -70,6 +79,8 @@ struct rspamd_mime_part {
 	} specific;
 
 	guchar digest[rspamd_cryptobox_HASHBYTES];
+	/* First decoded bytes, used to detect type without decoding */
+	guchar head[RSPAMD_MIME_PART_HEAD_LEN];
 };
 
 #define RSPAMD_MIME_TEXT_PART_FLAG_UTF (1 << 0)
@@ -80,6 +91,8 @@ struct rspamd_mime_part {
 #define RSPAMD_MIME_TEXT_PART_FLAG_8BIT_ENCODED (1 << 5)
 #define RSPAMD_MIME_TEXT_PART_HAS_SUBNORMAL (1 << 6)
 #define RSPAMD_MIME_TEXT_PART_NORMALISED (1 << 7)
+/* Words and languages are restored from the task snapshot */
+#define RSPAMD_MIME_TEXT_PART_FLAG_SNAPSHOT (1 << 8)
 
 #define IS_PART_EMPTY(part) ((part)->flags & RSPAMD_MIME_TEXT_PART_FLAG_EMPTY)
 #define IS_PART_UTF(part) ((part)->flags & RSPAMD_MIME_TEXT_PART_FLAG_UTF)
@@ -124,6 +137,7 @@ struct rspamd_mime_text_part {
 	guint capital_letters;
 	guint numeric_characters;
 	guint unicode_scripts;
+	guint non_ascii_words;
 };
 
 enum rspamd_received_type {
@@ -140,6 +154,7 @@ enum rspamd_received_type {
 #define RSPAMD_RECEIVED_FLAG_ARTIFICIAL (1 << 0)
 #define RSPAMD_RECEIVED_FLAG_SSL (1 << 1)
 #define RSPAMD_RECEIVED_FLAG_AUTHENTICATED (1 << 2)
+#define RSPAMD_RECEIVED_FLAG_UNPARSED (1 << 3)
 
 struct received_header {
 	gchar *from_hostname;
@@ -156,6 +171,16 @@ struct received_header {
 	gint flags;
 };
 
+/**
+ * Returns n-th received header of a task, headers are parsed on the first
+ * access only
+ * @param task task object
+ * @param n index of header, 0 is the closest hop
+ * @return received header or NULL if there are less than n + 1 headers
+ */
+struct received_header *rspamd_task_get_received (struct rspamd_task *task,
+		guint n);
+
 /**
  * Parse and pre-process mime message
  * @param task worker_task object
@@ -179,6 +204,20 @@ void rspamd_message_process (struct rspamd_task *task);
 GPtrArray *rspamd_message_get_header_array (struct rspamd_task *task,
 		const gchar *field,
 		gboolean strong);
+
+/**
+ * Same as `rspamd_message_get_header_array` but uses hash of header's name
+ * precomputed by `rspamd_mime_header_hash`
+ * @param task worker task structure
+ * @param hash hash of header's name
+ * @param field header's name (used for strong comparison and if headers are not indexed)
+ * @param strong if this flag is TRUE header's name is case sensitive, otherwise it is not
+ * @return An array of header's values or NULL. It is NOT permitted to free array or values.
+ */
+GPtrArray *rspamd_message_get_header_array_by_hash (struct rspamd_task *task,
+		guint64 hash,
+		const gchar *field,
+		gboolean strong);
 /**
  * Get an array of mime parts header's values with specified header's name using raw headers
  * @param task worker task structure
@@ -202,6 +241,13 @@ GPtrArray *rspamd_message_get_header_from_hash (GHashTable *htb,
 		const gchar *field,
 		gboolean strong);
 
+/**
+ * Returns decoded content of a mime part, decoding it on the first call
+ * for parts with RSPAMD_MIME_PART_LAZY flag
+ * @param part
+ * @return
+ */
+const rspamd_ftok_t *rspamd_mime_part_get_parsed (struct rspamd_mime_part *part);
 
 /**
  * Converts string to cte
@@ -515,36 +515,22 @@ rspamd_mime_to_utf8_byte_array (GByteArray *in,
 void
 rspamd_mime_charset_utf_enforce (gchar *in, gsize len)
 {
-	const gchar *end, *p;
-	gsize remain = len;
+	gchar *p = in, *end = in + len, *valid;
+	gsize remain = len, vlen;
 
 	/* Now we validate input and replace bad characters with '?' symbol */
-	p = in;
-
-	while (remain > 0 && !g_utf8_validate (p, remain, &end)) {
-		gchar *valid;
-
-		if (end >= in + len) {
-			if (p < in + len) {
-				memset ((gchar *)p, '?', (in + len) - p);
-			}
-			break;
-		}
-
-		valid = g_utf8_find_next_char (end, in + len);
+	while (remain > 0 && (vlen = rspamd_fast_utf8_validate ((guchar *)p,
+			remain)) < remain) {
+		p += vlen;
+		valid = g_utf8_find_next_char (p, end);
 
 		if (!valid) {
-			valid = in + len;
+			valid = end;
 		}
 
-		if (valid > end) {
-			memset ((gchar *)end, '?', valid - end);
-			p = valid;
-			remain = (in + len) - p;
-		}
-		else {
-			break;
-		}
+		memset (p, '?', valid - p);
+		p = valid;
+		remain = end - p;
 	}
 }
 
@@ -564,16 +550,10 @@ rspamd_mime_charset_find_by_content (gchar *in, gsize inlen)
 	}
 
 	/* If text is ascii, then we can treat it as utf8 data */
-	for (i = 0; i < inlen; i++) {
-		if ((((guchar)in[i]) & 0x80) != 0) {
-			goto detect;
-		}
+	if (!rspamd_str_has_8bit ((const guchar *)in, inlen)) {
+		return UTF8_CHARSET;
 	}
 
-	return UTF8_CHARSET;
-
-detect:
-
 	ucsdet_setText (csd, in, inlen, &uc_err);
 	csm = ucsdet_detectAll(csd, &matches, &uc_err);
 
@@ -615,6 +595,13 @@ rspamd_mime_charset_utf_check (rspamd_ftok_t *charset,
 		 * corner cases
 		 */
 		if (content_check) {
+			/* Declared charset is confirmed by valid content, skip ICU detection */
+			if (rspamd_fast_utf8_validate ((guchar *)in, len) == len) {
+				RSPAMD_FTOK_ASSIGN (charset, UTF8_CHARSET);
+
+				return TRUE;
+			}
+
 			real_charset = rspamd_mime_charset_find_by_content (in,
 					MIN (RSPAMD_CHARSET_MAX_CONTENT, len));
 
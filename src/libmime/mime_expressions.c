@@ -161,7 +161,8 @@ const struct rspamd_atom_subr mime_expr_subr = {
 	.parse = rspamd_mime_expr_parse,
 	.process = rspamd_mime_expr_process,
 	.priority = rspamd_mime_expr_priority,
-	.destroy = rspamd_mime_expr_destroy
+	.destroy = rspamd_mime_expr_destroy,
+	.share_atoms = TRUE
 };
 
 static struct _fl *list_ptr = &rspamd_functions_list[0];
@@ -1463,7 +1464,7 @@ rspamd_raw_header_exists (struct rspamd_task *task, GArray * args, void *unused)
 		return FALSE;
 	}
 
-	return g_hash_table_lookup (task->raw_headers, arg->data) != NULL;
+	return rspamd_message_get_header_array (task, arg->data, FALSE) != NULL;
 }
 
 static gboolean
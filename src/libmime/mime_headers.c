@@ -18,62 +18,186 @@
 #include "smtp_parsers.h"
 #include "mime_encoding.h"
 #include "libserver/mempool_vars_internal.h"
+#include "libutil/hash.h"
+
+#define RSPAMD_RECEIVED_CACHE_SIZE 4096
+#define RSPAMD_RECEIVED_CACHE_TTL 3600
+
+/*
+ * Parsed Received headers keyed by the decoded value, headers added by the
+ * same relays are often identical
+ */
+struct rspamd_received_cache_elt {
+	gchar *raw;
+	struct received_header rh;
+};
+
+static rspamd_lru_hash_t *received_cache = NULL;
+
+static void
+rspamd_received_cache_elt_free (gpointer p)
+{
+	struct rspamd_received_cache_elt *elt = p;
+
+	g_free (elt->rh.from_hostname);
+	g_free (elt->rh.from_ip);
+	g_free (elt->rh.real_hostname);
+	g_free (elt->rh.real_ip);
+	g_free (elt->rh.by_hostname);
+	g_free (elt->rh.for_mbox);
+	g_free (elt->rh.comment_ip);
+
+	if (elt->rh.addr) {
+		rspamd_inet_address_free (elt->rh.addr);
+	}
+
+	g_free (elt->raw);
+	g_free (elt);
+}
+
+static void
+rspamd_received_copy (struct rspamd_task *task,
+		struct received_header *dst, const struct received_header *src)
+{
+	dst->from_hostname = rspamd_mempool_strdup (task->task_pool,
+			src->from_hostname);
+	dst->from_ip = rspamd_mempool_strdup (task->task_pool, src->from_ip);
+	dst->real_hostname = rspamd_mempool_strdup (task->task_pool,
+			src->real_hostname);
+	dst->real_ip = rspamd_mempool_strdup (task->task_pool, src->real_ip);
+	dst->by_hostname = rspamd_mempool_strdup (task->task_pool,
+			src->by_hostname);
+	dst->for_mbox = rspamd_mempool_strdup (task->task_pool, src->for_mbox);
+	dst->comment_ip = rspamd_mempool_strdup (task->task_pool,
+			src->comment_ip);
+
+	if (src->addr) {
+		dst->addr = rspamd_inet_address_copy (src->addr);
+		rspamd_mempool_add_destructor (task->task_pool,
+				(rspamd_mempool_destruct_t)rspamd_inet_address_free,
+				dst->addr);
+	}
+
+	dst->timestamp = src->timestamp;
+	dst->type = src->type;
+}
+
+static void
+rspamd_received_parse (struct rspamd_task *task, struct received_header *recv)
+{
+	struct rspamd_received_cache_elt *elt;
+	const gchar *decoded = rspamd_mime_header_get_decoded (task->task_pool,
+			recv->hdr);
+
+	if (received_cache == NULL) {
+		received_cache = rspamd_lru_hash_new_full (RSPAMD_RECEIVED_CACHE_SIZE,
+				NULL, rspamd_received_cache_elt_free,
+				rspamd_str_hash, rspamd_str_equal);
+	}
+
+	elt = rspamd_lru_hash_lookup (received_cache, decoded,
+			task->tv.tv_sec);
+
+	if (elt) {
+		rspamd_received_copy (task, recv, &elt->rh);
+	}
+	else {
+		rspamd_smtp_received_parse (task, decoded, strlen (decoded), recv);
+
+		elt = g_malloc0 (sizeof (*elt));
+		elt->raw = g_strdup (decoded);
+		elt->rh.from_hostname = g_strdup (recv->from_hostname);
+		elt->rh.from_ip = g_strdup (recv->from_ip);
+		elt->rh.real_hostname = g_strdup (recv->real_hostname);
+		elt->rh.real_ip = g_strdup (recv->real_ip);
+		elt->rh.by_hostname = g_strdup (recv->by_hostname);
+		elt->rh.for_mbox = g_strdup (recv->for_mbox);
+		elt->rh.comment_ip = g_strdup (recv->comment_ip);
+
+		if (recv->addr) {
+			elt->rh.addr = rspamd_inet_address_copy (recv->addr);
+		}
+
+		elt->rh.timestamp = recv->timestamp;
+		elt->rh.type = recv->type;
+		rspamd_lru_hash_insert (received_cache, elt->raw, elt,
+				task->tv.tv_sec, RSPAMD_RECEIVED_CACHE_TTL);
+	}
+
+	/* Parser resets the whole structure */
+	recv->hdr = rh;
+	recv->flags = 0;
+
+	if (recv->type == RSPAMD_RECEIVED_ESMTPA ||
+			recv->type == RSPAMD_RECEIVED_ESMTPSA) {
+		recv->flags |= RSPAMD_RECEIVED_FLAG_AUTHENTICATED;
+	}
+	if (recv->type == RSPAMD_RECEIVED_ESMTPS ||
+			recv->type == RSPAMD_RECEIVED_ESMTPSA) {
+		recv->flags |= RSPAMD_RECEIVED_FLAG_SSL;
+	}
+}
+
+struct received_header *
+rspamd_task_get_received (struct rspamd_task *task, guint n)
+{
+	struct received_header *recv;
+
+	if (task->received == NULL || n >= task->received->len) {
+		return NULL;
+	}
+
+	recv = g_ptr_array_index (task->received, n);
+
+	if (recv->flags & RSPAMD_RECEIVED_FLAG_UNPARSED) {
+		rspamd_received_parse (task, recv);
+	}
+
+	return recv;
+}
 
 static void
 rspamd_mime_header_check_special (struct rspamd_task *task,
 		struct rspamd_mime_header *rh)
 {
-	guint64 h;
 	struct received_header *recv;
 	const gchar *p, *end;
 	gchar *id;
 
-	h = rspamd_icase_hash (rh->name, strlen (rh->name), 0xdeadbabe);
-
-	switch (h) {
-	case 0x88705DC4D9D61ABULL:	/* received */
+	switch (rh->hash) {
+	case 0xAF1F72BD45F2BC84ULL:	/* received */
 		recv = rspamd_mempool_alloc0 (task->task_pool,
 				sizeof (struct received_header));
 		recv->hdr = rh;
-		rspamd_smtp_received_parse (task, rh->decoded,
-				strlen (rh->decoded), recv);
-		/* Set flags */
-		if (recv->type == RSPAMD_RECEIVED_ESMTPA ||
-				recv->type == RSPAMD_RECEIVED_ESMTPSA) {
-			recv->flags |= RSPAMD_RECEIVED_FLAG_AUTHENTICATED;
-		}
-		if (recv->type == RSPAMD_RECEIVED_ESMTPS ||
-				recv->type == RSPAMD_RECEIVED_ESMTPSA) {
-			recv->flags |= RSPAMD_RECEIVED_FLAG_SSL;
-		}
-
+		/* Parsed on the first access, see rspamd_task_get_received */
+		recv->flags = RSPAMD_RECEIVED_FLAG_UNPARSED;
 		g_ptr_array_add (task->received, recv);
 		rh->type = RSPAMD_HEADER_RECEIVED;
 		break;
-	case 0x76F31A09F4352521ULL:	/* to */
+	case 0x90892750D00EF658ULL:	/* to */
 		task->rcpt_mime = rspamd_email_address_from_mime (task->task_pool,
 				rh->value, strlen (rh->value), task->rcpt_mime);
 		rh->type = RSPAMD_HEADER_TO|RSPAMD_HEADER_RCPT|RSPAMD_HEADER_UNIQUE;
 		break;
-	case 0x7EB117C1480B76ULL:	/* cc */
+	case 0xC31935A2F7C4E163ULL:	/* cc */
 		task->rcpt_mime = rspamd_email_address_from_mime (task->task_pool,
 				rh->value, strlen (rh->value), task->rcpt_mime);
 		rh->type = RSPAMD_HEADER_CC|RSPAMD_HEADER_RCPT|RSPAMD_HEADER_UNIQUE;
 		break;
-	case 0xE4923E11C4989C8DULL:	/* bcc */
+	case 0x8AF6AEBC9C25363FULL:	/* bcc */
 		task->rcpt_mime = rspamd_email_address_from_mime (task->task_pool,
 				rh->value, strlen (rh->value), task->rcpt_mime);
 		rh->type = RSPAMD_HEADER_BCC|RSPAMD_HEADER_RCPT|RSPAMD_HEADER_UNIQUE;
 		break;
-	case 0x41E1985EDC1CBDE4ULL:	/* from */
+	case 0x3DCD9C4B39273208ULL:	/* from */
 		task->from_mime = rspamd_email_address_from_mime (task->task_pool,
 				rh->value, strlen (rh->value), task->from_mime);
 		rh->type = RSPAMD_HEADER_FROM|RSPAMD_HEADER_SENDER|RSPAMD_HEADER_UNIQUE;
 		break;
-	case 0x43A558FC7C240226ULL:	/* message-id */ {
+	case 0x97B7841696956766ULL:	/* message-id */ {
 
 		rh->type = RSPAMD_HEADER_MESSAGE_ID|RSPAMD_HEADER_UNIQUE;
-		p = rh->decoded;
+		p = rspamd_mime_header_get_decoded (task->task_pool, rh);
 		end = p + strlen (p);
 
 		if (*p == '<') {
@@ -107,31 +231,34 @@ rspamd_mime_header_check_special (struct rspamd_task *task,
 
 		break;
 	}
-	case 0xB91D3910358E8212ULL:	/* subject */
+	case 0x2CFB4520D2968414ULL:	/* subject */
 		if (task->subject == NULL) {
-			task->subject = rh->decoded;
+			task->subject = (gchar *)rspamd_mime_header_get_decoded (
+					task->task_pool, rh);
 		}
 		rh->type = RSPAMD_HEADER_SUBJECT|RSPAMD_HEADER_UNIQUE;
 		break;
-	case 0xEE4AA2EAAC61D6F4ULL:	/* return-path */
+	case 0x830AF4C3C82B5760ULL:	/* return-path */
 		if (task->from_envelope == NULL) {
-			task->from_envelope = rspamd_email_address_from_smtp (rh->decoded,
-					strlen (rh->decoded));
+			p = rspamd_mime_header_get_decoded (task->task_pool, rh);
+			task->from_envelope = rspamd_email_address_from_smtp (p,
+					strlen (p));
 		}
 		rh->type = RSPAMD_HEADER_RETURN_PATH|RSPAMD_HEADER_UNIQUE;
 		break;
-	case 0xB9EEFAD2E93C2161ULL:	/* delivered-to */
+	case 0xD30E4F3F734D0F9CULL:	/* delivered-to */
 		if (task->deliver_to == NULL) {
-			task->deliver_to = rh->decoded;
+			task->deliver_to = (gchar *)rspamd_mime_header_get_decoded (
+					task->task_pool, rh);
 		}
 		rh->type = RSPAMD_HEADER_DELIVERED_TO;
 		break;
-	case 0x2EC3BFF3C393FC10ULL: /* date */
-	case 0xAC0DDB1A1D214CAULL: /* sender */
-	case 0x54094572367AB695ULL: /* in-reply-to */
-	case 0x81CD9E9131AB6A9AULL: /* content-type */
-	case 0xC39BD9A75AA25B60ULL: /* content-transfer-encoding */
-	case 0xB3F6704CB3AD6589ULL: /* references */
+	case 0x40307386EB130217ULL: /* date */
+	case 0xF2B082AE781D4FE5ULL: /* sender */
+	case 0x290D4FE3F18E3D79ULL: /* in-reply-to */
+	case 0xCD5E2118E5CA37C8ULL: /* content-type */
+	case 0x75DE247B49D344B8ULL: /* content-transfer-encoding */
+	case 0xC0BAFE396DAD261EULL: /* references */
 		rh->type = RSPAMD_HEADER_UNIQUE;
 		break;
 	}
@@ -174,6 +301,7 @@ rspamd_mime_headers_process (struct rspamd_task *task, GHashTable *target,
 	const gchar *p, *c, *end;
 	gchar *tmp, *tp;
 	gint state = 0, l, next_state = 100, err_state = 100, t_state;
+	gsize r;
 	gboolean valid_folding = FALSE;
 	guint nlines_count[RSPAMD_TASK_NEWLINES_MAX];
 	guint norder = 0;
@@ -208,6 +336,7 @@ rspamd_mime_headers_process (struct rspamd_task *task, GHashTable *target,
 				tmp = rspamd_mempool_alloc (task->task_pool, l + 1);
 				rspamd_strlcpy (tmp, c, l + 1);
 				nh->name = tmp;
+				nh->hash = rspamd_mime_header_hash (tmp, l);
 				nh->empty_separator = TRUE;
 				nh->raw_value = c;
 				nh->raw_len = p - c; /* Including trailing ':' */
@@ -296,7 +425,8 @@ rspamd_mime_headers_process (struct rspamd_task *task, GHashTable *target,
 				state = 4;
 			}
 			else {
-				p++;
+				/* Jump to the end of line, the last char is checked above */
+				p += 1 + rspamd_memcspn (p + 1, "\r\n", end - p - 2);
 			}
 			break;
 		case 4:
@@ -305,26 +435,30 @@ rspamd_mime_headers_process (struct rspamd_task *task, GHashTable *target,
 			tmp = rspamd_mempool_alloc (task->task_pool, l + 1);
 			tp = tmp;
 			t_state = 0;
-			while (l--) {
+			while (l > 0) {
 				if (t_state == 0) {
-					/* Before folding */
-					if (*c == '\n' || *c == '\r') {
+					/* Before folding, copy the whole line at once */
+					r = rspamd_memcspn (c, "\r\n", l);
+					memcpy (tp, c, r);
+					tp += r;
+					c += r;
+					l -= r;
+
+					if (l > 0) {
 						t_state = 1;
 						c++;
+						l--;
 						*tp++ = ' ';
 					}
-					else {
-						*tp++ = *c++;
-					}
 				}
-				else if (t_state == 1) {
+				else {
 					/* Inside folding */
 					if (g_ascii_isspace (*c)) {
 						c++;
+						l--;
 					}
 					else {
 						t_state = 0;
-						*tp++ = *c++;
 					}
 				}
 			}
@@ -346,16 +480,8 @@ rspamd_mime_headers_process (struct rspamd_task *task, GHashTable *target,
 				nh->raw_len = p - nh->raw_value;
 			}
 
+			/* Decoded value is built on demand */
 			nh->value = tmp;
-			nh->decoded = rspamd_mime_header_decode (task->task_pool,
-					nh->value, strlen (tmp));
-
-			if (nh->decoded == NULL) {
-				nh->decoded = "";
-			}
-
-			/* We also validate utf8 and replace all non-valid utf8 chars */
-			rspamd_mime_charset_utf_enforce (nh->decoded, strlen (nh->decoded));
 			nh->order = norder ++;
 			rspamd_mime_header_add (task, target, order, nh, check_newlines);
 			nh = NULL;
@@ -364,7 +490,7 @@ rspamd_mime_headers_process (struct rspamd_task *task, GHashTable *target,
 		case 5:
 			/* Header has only name, no value */
 			nh->value = "";
-			nh->decoded = "";
+			nh->decoded = nh->value;
 			nh->raw_len = p - nh->raw_value;
 			nh->order = norder ++;
 			rspamd_mime_header_add (task, target, order, nh, check_newlines);
@@ -467,9 +593,79 @@ rspamd_mime_headers_process (struct rspamd_task *task, GHashTable *target,
 		rspamd_mempool_set_variable (task->task_pool,
 				RSPAMD_MEMPOOL_HEADERS_HASH,
 				hexout, NULL);
+
+		/* Message headers are looked up many times, so they are indexed */
+		task->headers_index = rspamd_mime_headers_index_build (task->task_pool,
+				target);
 	}
 }
 
+struct rspamd_mime_headers_index *
+rspamd_mime_headers_index_build (rspamd_mempool_t *pool, GHashTable *headers)
+{
+	struct rspamd_mime_headers_index *idx;
+	struct rspamd_mime_header *rh;
+	GHashTableIter it;
+	gpointer k, v;
+	GPtrArray *ar;
+	guint size = 16, i;
+
+	/* Keep load factor below 0.5 */
+	while (size < g_hash_table_size (headers) * 2) {
+		size <<= 1;
+	}
+
+	idx = rspamd_mempool_alloc (pool, sizeof (*idx));
+	idx->elts = rspamd_mempool_alloc0 (pool, sizeof (*idx->elts) * size);
+	idx->mask = size - 1;
+
+	g_hash_table_iter_init (&it, headers);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		ar = v;
+
+		if (ar->len == 0) {
+			continue;
+		}
+
+		/* All headers in array have the same case folded name */
+		rh = g_ptr_array_index (ar, 0);
+		i = rh->hash & idx->mask;
+
+		while (idx->elts[i].ar != NULL) {
+			i = (i + 1) & idx->mask;
+		}
+
+		idx->elts[i].hash = rh->hash;
+		idx->elts[i].ar = ar;
+	}
+
+	return idx;
+}
+
+GPtrArray *
+rspamd_mime_headers_index_lookup (const struct rspamd_mime_headers_index *idx,
+		guint64 hash)
+{
+	guint i;
+
+	if (idx == NULL) {
+		return NULL;
+	}
+
+	i = hash & idx->mask;
+
+	while (idx->elts[i].ar != NULL) {
+		if (idx->elts[i].hash == hash) {
+			return idx->elts[i].ar;
+		}
+
+		i = (i + 1) & idx->mask;
+	}
+
+	return NULL;
+}
+
 static void
 rspamd_mime_header_maybe_save_token (rspamd_mempool_t *pool, GString *out,
 		GByteArray *token, GByteArray *decoded_token,
@@ -707,12 +903,78 @@ rspamd_mime_header_decode (rspamd_mempool_t *pool, const gchar *in,
 	g_byte_array_free (token, TRUE);
 	g_byte_array_free (decoded, TRUE);
 	rspamd_mime_header_sanity_check (out);
-	ret = g_string_free (out, FALSE);
-	rspamd_mempool_add_destructor (pool, g_free, ret);
+	ret = rspamd_mempool_alloc (pool, out->len + 1);
+	memcpy (ret, out->str, out->len + 1);
+	g_string_free (out, TRUE);
 
 	return ret;
 }
 
+/*
+ * Checks if the decoded value of a header is the same as the unfolded one:
+ * no encoded words, no control characters and valid utf8
+ */
+static gboolean
+rspamd_mime_header_is_plain (const gchar *in, gsize len)
+{
+	const guchar *p = (const guchar *)in, *end = p + len;
+	gboolean has_8bit = FALSE;
+
+	while (p < end) {
+		if (*p & 0x80) {
+			has_8bit = TRUE;
+		}
+		else if (*p == '=') {
+			if (p + 1 < end && p[1] == '?') {
+				return FALSE;
+			}
+		}
+		else if (!g_ascii_isgraph (*p) && *p != ' ') {
+			return FALSE;
+		}
+
+		p ++;
+	}
+
+	return !has_8bit ||
+			rspamd_fast_utf8_validate ((const guchar *)in, len) == len;
+}
+
+const gchar *
+rspamd_mime_header_get_decoded (rspamd_mempool_t *pool,
+		struct rspamd_mime_header *rh)
+{
+	gsize len;
+
+	if (rh->decoded == NULL) {
+		if (rh->value == NULL) {
+			rh->decoded = "";
+		}
+		else {
+			len = strlen (rh->value);
+
+			if (rspamd_mime_header_is_plain (rh->value, len)) {
+				/* Most of headers need no copy */
+				rh->decoded = rh->value;
+			}
+			else {
+				rh->decoded = rspamd_mime_header_decode (pool, rh->value, len);
+
+				if (rh->decoded == NULL) {
+					rh->decoded = "";
+				}
+				else {
+					/* Replace all non-valid utf8 chars */
+					rspamd_mime_charset_utf_enforce (rh->decoded,
+							strlen (rh->decoded));
+				}
+			}
+		}
+	}
+
+	return rh->decoded;
+}
+
 gchar *
 rspamd_mime_header_encode (const gchar *in, gsize len)
 {
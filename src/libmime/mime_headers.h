@@ -18,6 +18,7 @@
 
 #include "config.h"
 #include "libutil/mem_pool.h"
+#include "libutil/str_util.h"
 
 struct rspamd_task;
 
@@ -52,9 +53,57 @@ struct rspamd_mime_header {
 	guint order;
 	enum rspamd_mime_header_special_type type;
 	gchar *separator;
-	gchar *decoded;
+	gchar *decoded; /* Lazily, use rspamd_mime_header_get_decoded */
+	guint64 hash; /* Case folded hash of name */
 };
 
+/*
+ * Flat open addressing index of headers arrays by hash of name, it is
+ * allocated in a memory pool and is never modified after creation
+ */
+struct rspamd_mime_headers_index_elt {
+	guint64 hash;
+	GPtrArray *ar;
+};
+
+struct rspamd_mime_headers_index {
+	struct rspamd_mime_headers_index_elt *elts;
+	guint mask;
+};
+
+#define RSPAMD_MIME_HEADER_HASH_SEED 0xdeadbabe
+
+/**
+ * Returns case folded hash of header's name, could be computed once
+ * for constant names
+ * @param name
+ * @param len
+ * @return
+ */
+static inline guint64
+rspamd_mime_header_hash (const gchar *name, gsize len)
+{
+	return rspamd_icase_hash_fast (name, len, RSPAMD_MIME_HEADER_HASH_SEED);
+}
+
+/**
+ * Builds index from hash table of headers arrays
+ * @param pool
+ * @param headers
+ * @return
+ */
+struct rspamd_mime_headers_index *rspamd_mime_headers_index_build (
+		rspamd_mempool_t *pool, GHashTable *headers);
+
+/**
+ * Finds headers array by hash of name
+ * @param idx
+ * @param hash value returned by `rspamd_mime_header_hash`
+ * @return array of headers or NULL
+ */
+GPtrArray *rspamd_mime_headers_index_lookup (
+		const struct rspamd_mime_headers_index *idx, guint64 hash);
+
 /**
  * Process headers and store them in `target`
  * @param task
@@ -78,6 +127,16 @@ void rspamd_mime_headers_process (struct rspamd_task *task, GHashTable *target,
 gchar * rspamd_mime_header_decode (rspamd_mempool_t *pool, const gchar *in,
 		gsize inlen);
 
+/**
+ * Returns rfc2047 decoded value of a header with invalid utf8 replaced,
+ * headers are decoded on the first access only
+ * @param pool pool to allocate decoded value (the pool of the header)
+ * @param rh header
+ * @return decoded value
+ */
+const gchar * rspamd_mime_header_get_decoded (rspamd_mempool_t *pool,
+		struct rspamd_mime_header *rh);
+
 /**
  * Encode mime header if needed
  * @param in
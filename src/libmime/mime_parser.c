@@ -19,11 +19,9 @@
 #include "mime_parser.h"
 #include "mime_headers.h"
 #include "message.h"
-#include "multipattern.h"
 #include "contrib/libottery/ottery.h"
 
 struct rspamd_mime_parser_lib_ctx {
-	struct rspamd_multipattern *mp_boundary;
 	guchar hkey[rspamd_cryptobox_SIPKEYBYTES]; /* Key for hashing */
 	guint key_usages;
 };
@@ -137,11 +135,6 @@ static void
 rspamd_mime_parser_init_lib (void)
 {
 	lib_ctx = g_malloc0 (sizeof (*lib_ctx));
-	lib_ctx->mp_boundary = rspamd_multipattern_create (RSPAMD_MULTIPATTERN_DEFAULT);
-	g_assert (lib_ctx->mp_boundary != NULL);
-	rspamd_multipattern_add_pattern (lib_ctx->mp_boundary, "\r--", 0);
-	rspamd_multipattern_add_pattern (lib_ctx->mp_boundary, "\n--", 0);
-	g_assert (rspamd_multipattern_compile (lib_ctx->mp_boundary, NULL));
 	ottery_rand_bytes (lib_ctx->hkey, sizeof (lib_ctx->hkey));
 }
 
@@ -405,26 +398,197 @@ rspamd_mime_part_get_cd (struct rspamd_task *task, struct rspamd_mime_part *part
 	part->cd = cd;
 }
 
+/* Blake2b applied to string 'rspamd' */
+static const guchar rspamd_mime_digest_key[] = {
+		0xef,0x43,0xae,0x80,0xcc,0x8d,0xc3,0x4c,
+		0x6f,0x1b,0xd6,0x18,0x1b,0xae,0x87,0x74,
+		0x0c,0xca,0xf7,0x8e,0x5f,0x2e,0x54,0x32,
+		0xf6,0x79,0xb9,0x27,0x26,0x96,0x20,0x92,
+		0x70,0x07,0x85,0xeb,0x83,0xf7,0x89,0xe0,
+		0xd7,0x32,0x2a,0xd2,0x1a,0x64,0x41,0xef,
+		0x49,0xff,0xc3,0x8c,0x54,0xf9,0x67,0x74,
+		0x30,0x1e,0x70,0x2e,0xb7,0x12,0x09,0xfe,
+};
+
+/* Size of the encoded input decoded at once when digesting lazy parts */
+#define RSPAMD_MIME_DIGEST_CHUNK 16384
+
 static void
 rspamd_mime_parser_calc_digest (struct rspamd_mime_part *part)
 {
-	/* Blake2b applied to string 'rspamd' */
-	static const guchar hash_key[] = {
-			0xef,0x43,0xae,0x80,0xcc,0x8d,0xc3,0x4c,
-			0x6f,0x1b,0xd6,0x18,0x1b,0xae,0x87,0x74,
-			0x0c,0xca,0xf7,0x8e,0x5f,0x2e,0x54,0x32,
-			0xf6,0x79,0xb9,0x27,0x26,0x96,0x20,0x92,
-			0x70,0x07,0x85,0xeb,0x83,0xf7,0x89,0xe0,
-			0xd7,0x32,0x2a,0xd2,0x1a,0x64,0x41,0xef,
-			0x49,0xff,0xc3,0x8c,0x54,0xf9,0x67,0x74,
-			0x30,0x1e,0x70,0x2e,0xb7,0x12,0x09,0xfe,
-	};
-
 	if (part->parsed_data.len > 0) {
 		rspamd_cryptobox_hash (part->digest,
 				part->parsed_data.begin, part->parsed_data.len,
-				hash_key, sizeof (hash_key));
+				rspamd_mime_digest_key, sizeof (rspamd_mime_digest_key));
+	}
+}
+
+/*
+ * Returns the length of the next base64 chunk starting at `p`: chunks are
+ * split after a multiple of 4 alphabet characters, so the decoder state is
+ * clean at the boundary. Padding and everything after it go to the last chunk
+ */
+static gsize
+rspamd_mime_b64_chunk_len (const gchar *p, gsize remain)
+{
+	gsize i, last_split = 0, nvalid = 0;
+	guchar c;
+
+	for (i = 0; i < remain; i ++) {
+		c = p[i];
+
+		if (c == '=') {
+			return remain;
+		}
+
+		if (g_ascii_isalnum (c) || c == '+' || c == '/') {
+			nvalid ++;
+
+			if ((nvalid & 3) == 0) {
+				last_split = i + 1;
+
+				if (last_split >= RSPAMD_MIME_DIGEST_CHUNK) {
+					return last_split;
+				}
+			}
+		}
+	}
+
+	return remain;
+}
+
+/*
+ * Quoted-printable chunks are split after a newline that is not followed
+ * by another newline, so no escape or soft line break crosses the boundary
+ */
+static gsize
+rspamd_mime_qp_chunk_len (const gchar *p, gsize remain)
+{
+	gsize i;
+
+	for (i = MIN (remain, RSPAMD_MIME_DIGEST_CHUNK); i < remain; i ++) {
+		if (p[i - 1] == '\n' && p[i] != '\r' && p[i] != '\n') {
+			return i;
+		}
+	}
+
+	return remain;
+}
+
+/*
+ * Computes digest, length and head of a part without keeping its decoded
+ * content: the encoded data is decoded chunk by chunk into a scratch buffer
+ */
+static void
+rspamd_mime_parser_stream_digest (struct rspamd_task *task,
+		struct rspamd_mime_part *part)
+{
+	rspamd_cryptobox_hash_state_t st;
+	guchar stbuf[RSPAMD_MIME_DIGEST_CHUNK + 16], *out;
+	const gchar *p;
+	gsize remain, chunk, outlen, total = 0, head_len = 0;
+	gssize r;
+
+	rspamd_cryptobox_hash_init (&st, rspamd_mime_digest_key,
+			sizeof (rspamd_mime_digest_key));
+	p = part->raw_data.begin;
+	remain = part->raw_data.len;
+
+	while (remain > 0) {
+		if (part->cte == RSPAMD_CTE_B64) {
+			chunk = rspamd_mime_b64_chunk_len (p, remain);
+			outlen = chunk / 4 * 3 + 12;
+		}
+		else {
+			chunk = rspamd_mime_qp_chunk_len (p, remain);
+			outlen = chunk;
+		}
+
+		out = outlen <= sizeof (stbuf) ? stbuf : g_malloc (outlen);
+
+		if (part->cte == RSPAMD_CTE_B64) {
+			rspamd_cryptobox_base64_decode (p, chunk, out, &outlen);
+		}
+		else {
+			r = rspamd_decode_qp_buf (p, chunk, out, outlen);
+
+			if (r == -1) {
+				if (out != stbuf) {
+					g_free (out);
+				}
+
+				msg_err_task ("invalid quoted-printable encoded part, "
+						"assume 8bit");
+				part->ct->flags |= RSPAMD_CONTENT_TYPE_BROKEN;
+				part->cte = RSPAMD_CTE_8BIT;
+				part->flags &= ~RSPAMD_MIME_PART_LAZY;
+				part->parsed_data.begin = part->raw_data.begin;
+				part->parsed_data.len = part->raw_data.len;
+				rspamd_mime_parser_calc_digest (part);
+
+				return;
+			}
+
+			outlen = r;
+		}
+
+		if (head_len < sizeof (part->head)) {
+			gsize to_copy = MIN (outlen, sizeof (part->head) - head_len);
+
+			memcpy (part->head + head_len, out, to_copy);
+			head_len += to_copy;
+		}
+
+		rspamd_cryptobox_hash_update (&st, out, outlen);
+		total += outlen;
+
+		if (out != stbuf) {
+			g_free (out);
+		}
+
+		p += chunk;
+		remain -= chunk;
 	}
+
+	part->parsed_data.begin = NULL;
+	part->parsed_data.len = total;
+
+	if (total > 0) {
+		rspamd_cryptobox_hash_final (&st, part->digest);
+	}
+}
+
+const rspamd_ftok_t *
+rspamd_mime_part_get_parsed (struct rspamd_mime_part *part)
+{
+	rspamd_fstring_t *parsed;
+	gssize r;
+
+	if (!(part->flags & RSPAMD_MIME_PART_LAZY)) {
+		return &part->parsed_data;
+	}
+
+	if (part->cte == RSPAMD_CTE_B64) {
+		parsed = rspamd_fstring_sized_new (part->raw_data.len / 4 * 3 + 12);
+		rspamd_cryptobox_base64_decode (part->raw_data.begin,
+				part->raw_data.len,
+				parsed->str, &parsed->len);
+	}
+	else {
+		parsed = rspamd_fstring_sized_new (part->raw_data.len);
+		r = rspamd_decode_qp_buf (part->raw_data.begin, part->raw_data.len,
+				parsed->str, parsed->allocated);
+		/* Already validated when digest has been computed */
+		parsed->len = r != -1 ? r : 0;
+	}
+
+	part->parsed_data.begin = parsed->str;
+	part->parsed_data.len = parsed->len;
+	part->flags &= ~RSPAMD_MIME_PART_LAZY;
+	rspamd_mempool_add_destructor (part->pool,
+			(rspamd_mempool_destruct_t)rspamd_fstring_free, parsed);
+
+	return &part->parsed_data;
 }
 
 static enum rspamd_mime_parse_error
@@ -440,6 +604,19 @@ rspamd_mime_parse_normal_part (struct rspamd_task *task,
 
 	rspamd_mime_part_get_cte (task, part->raw_headers, part, TRUE);
 	rspamd_mime_part_get_cd (task, part);
+	part->pool = task->task_pool;
+
+	if ((part->cte == RSPAMD_CTE_QP || part->cte == RSPAMD_CTE_B64) &&
+			!IS_CT_TEXT (part->ct) &&
+			!(part->ct->flags & RSPAMD_CONTENT_TYPE_MESSAGE)) {
+		/*
+		 * Attachments are decoded on the first access only, here we
+		 * just need their digest and length
+		 */
+		part->flags |= RSPAMD_MIME_PART_LAZY;
+		rspamd_mime_parser_stream_digest (task, part);
+		goto done;
+	}
 
 	switch (part->cte) {
 	case RSPAMD_CTE_7BIT:
@@ -510,12 +687,15 @@ rspamd_mime_parse_normal_part (struct rspamd_task *task,
 		g_assert_not_reached ();
 	}
 
+	rspamd_mime_parser_calc_digest (part);
+
+done:
 	part->id = task->parts->len;
 	g_ptr_array_add (task->parts, part);
-	msg_debug_mime ("parsed data part %T/%T of length %z (%z orig), %s cte",
+	msg_debug_mime ("parsed data part %T/%T of length %z (%z orig), %s cte%s",
 			&part->ct->type, &part->ct->subtype, part->parsed_data.len,
-			part->raw_data.len, rspamd_cte_to_string (part->cte));
-	rspamd_mime_parser_calc_digest (part);
+			part->raw_data.len, rspamd_cte_to_string (part->cte),
+			(part->flags & RSPAMD_MIME_PART_LAZY) ? ", lazy" : "");
 
 	return RSPAMD_MIME_PARSE_OK;
 }
@@ -695,6 +875,31 @@ rspamd_mime_parse_multipart_cb (struct rspamd_task *task,
 	return RSPAMD_MIME_PARSE_OK;
 }
 
+/*
+ * Boundaries are collected in order of their positions, so we can find the
+ * first one that starts after `offset` by a binary search
+ */
+static guint
+rspamd_mime_boundaries_lower_bound (GArray *boundaries, goffset offset)
+{
+	struct rspamd_mime_boundary *cur;
+	guint lo = 0, hi = boundaries->len, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		cur = &g_array_index (boundaries, struct rspamd_mime_boundary, mid);
+
+		if (cur->start < offset) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
 static enum rspamd_mime_parse_error
 rspamd_multipart_boundaries_filter (struct rspamd_task *task,
 		struct rspamd_mime_part *multipart,
@@ -710,7 +915,9 @@ rspamd_multipart_boundaries_filter (struct rspamd_task *task,
 			multipart->raw_data.len;
 
 	/* Find the first offset suitable for this part */
-	for (i = 0; i < st->boundaries->len; i ++) {
+	for (i = rspamd_mime_boundaries_lower_bound (st->boundaries,
+			multipart->raw_data.begin - st->start);
+			i < st->boundaries->len; i ++) {
 		cur = &g_array_index (st->boundaries, struct rspamd_mime_boundary, i);
 
 		if (cur->start >= multipart->raw_data.begin - st->start) {
@@ -850,22 +1057,19 @@ rspamd_mime_parse_multipart_part (struct rspamd_task *task,
 	return ret;
 }
 
-/* Process boundary like structures in a message */
-static gint
-rspamd_mime_preprocess_cb (struct rspamd_multipattern *mp,
-		guint strnum,
-		gint match_start,
-		gint match_pos,
-		const gchar *text,
-		gsize len,
-		void *context)
+/*
+ * Process boundary like structure in a message, `p` points after the leading
+ * `--` that follows a newline
+ */
+static void
+rspamd_mime_preprocess_boundary (struct rspamd_mime_parser_ctx *st,
+		const gchar *p, const gchar *end)
 {
-	const gchar *end = text + len, *p = text + match_pos, *bend;
-	gchar *lc_copy;
+	const gchar *bend;
+	gchar *lc_copy, lc_buf[128];
 	gsize blen;
 	gboolean closing = FALSE;
 	struct rspamd_mime_boundary b;
-	struct rspamd_mime_parser_ctx *st = context;
 	struct rspamd_task *task;
 
 	task = st->task;
@@ -910,14 +1114,16 @@ rspamd_mime_preprocess_cb (struct rspamd_multipattern *mp,
 			b.start = bend - st->start;
 
 			if (closing) {
-				lc_copy = g_malloc (blen + 2);
-				memcpy (lc_copy, p, blen + 2);
-				rspamd_str_lc (lc_copy, blen + 2);
+				blen += 2;
 			}
-			else {
-				lc_copy = g_malloc (blen);
-				memcpy (lc_copy, p, blen);
-				rspamd_str_lc (lc_copy, blen);
+
+			/* Boundaries are short, so we rarely need to allocate */
+			lc_copy = blen <= sizeof (lc_buf) ? lc_buf : g_malloc (blen);
+			memcpy (lc_copy, p, blen);
+			rspamd_str_lc (lc_copy, blen);
+
+			if (closing) {
+				blen -= 2;
 			}
 
 			rspamd_cryptobox_siphash ((guchar *)&b.hash, lc_copy, blen,
@@ -937,12 +1143,13 @@ rspamd_mime_preprocess_cb (struct rspamd_multipattern *mp,
 				b.closed_hash = 0;
 			}
 
-			g_free (lc_copy);
+			if (lc_copy != lc_buf) {
+				g_free (lc_copy);
+			}
+
 			g_array_append_val (st->boundaries, b);
 		}
 	}
-
-	return 0;
 }
 
 static goffset
@@ -1017,17 +1224,31 @@ rspamd_mime_preprocess_message (struct rspamd_task *task,
 		struct rspamd_mime_parser_ctx *st)
 {
 
+	const gchar *start, *end, *p;
+
 	if (top->raw_data.begin >= st->pos) {
-		rspamd_multipattern_lookup (lib_ctx->mp_boundary,
-				top->raw_data.begin - 1,
-				top->raw_data.len + 1,
-				rspamd_mime_preprocess_cb, st, NULL);
+		start = top->raw_data.begin - 1;
+		end = top->raw_data.begin + top->raw_data.len;
 	}
 	else {
-		rspamd_multipattern_lookup (lib_ctx->mp_boundary,
-				st->pos,
-				st->end - st->pos,
-				rspamd_mime_preprocess_cb, st, NULL);
+		start = st->pos;
+		end = st->end;
+	}
+
+	/*
+	 * Look for `\n--` or `\r--` in a single pass: dashes are rare enough
+	 * for memchr to skip most of the text
+	 */
+	p = start + 1;
+
+	while (p + 1 < end && (p = memchr (p, '-', end - p - 1)) != NULL) {
+		if (p[1] == '-' && (p[-1] == '\n' || p[-1] == '\r')) {
+			rspamd_mime_preprocess_boundary (st, p + 2, end);
+			p += 2;
+		}
+		else {
+			p ++;
+		}
 	}
 }
 
@@ -0,0 +1,515 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "cfg_file.h"
+#include "cfg_rcl.h"
+#include "cryptobox.h"
+#include "unix-std.h"
+#include "utlist.h"
+
+/*
+ * Compiled configuration cache stores the final UCL tree, after includes,
+ * macros and lua transform. It is valid while the cache key is the same,
+ * the key is a hash of rspamd version, variables and content of all files
+ * in the configuration directories.
+ *
+ * UCL msgpack is not used, as it keeps only the first value of multi-value
+ * keys and drops priorities. The tree is written as follows (native byte
+ * order, checked by the header):
+ * element: type (u8), binary flag (u8), priority (u16), value
+ * value: i64 for integers, double for floats and time, u8 for booleans,
+ *   u32 length and data for strings, u32 count and elements for arrays,
+ *   u32 count and (u32 key length, key, element) for objects, where
+ *   multiple values of the same key are written as separate entries
+ */
+
+#define CFG_CACHE_MAGIC "rspcfgc1"
+#define CFG_CACHE_BOM 0x01020304U
+/* Symlinks loops and unrelated trees should not be hashed */
+#define CFG_CACHE_MAX_DEPTH 8
+
+struct rspamd_cfg_cache_hdr {
+	gchar magic[8];
+	guint32 bom;
+	guint32 unused;
+	guchar key[rspamd_cryptobox_HASHBYTES];
+};
+
+struct rspamd_cfg_cache_reader {
+	const guchar *pos;
+	const guchar *end;
+};
+
+static gint
+rspamd_config_cache_cmp_names (gconstpointer a, gconstpointer b)
+{
+	return strcmp (*(const gchar **)a, *(const gchar **)b);
+}
+
+static void
+rspamd_config_cache_hash_dir (rspamd_cryptobox_hash_state_t *st,
+		const gchar *dirname, const gchar *skip, guint depth)
+{
+	GDir *dir;
+	GPtrArray *names;
+	const gchar *name;
+	gchar *path, *content;
+	gsize len;
+	guint i;
+
+	if (depth > CFG_CACHE_MAX_DEPTH ||
+			(dir = g_dir_open (dirname, 0, NULL)) == NULL) {
+		return;
+	}
+
+	names = g_ptr_array_new_with_free_func (g_free);
+
+	while ((name = g_dir_read_name (dir)) != NULL) {
+		/* Hidden files are never included and VCS dirs could be huge */
+		if (name[0] != '.') {
+			g_ptr_array_add (names, g_strdup (name));
+		}
+	}
+
+	g_dir_close (dir);
+	/* Order of entries is not defined by readdir */
+	g_ptr_array_sort (names, rspamd_config_cache_cmp_names);
+
+	for (i = 0; i < names->len; i ++) {
+		name = g_ptr_array_index (names, i);
+		path = g_build_filename (dirname, name, NULL);
+
+		/* Cache itself and its temporary file */
+		if (skip && g_str_has_prefix (path, skip)) {
+			g_free (path);
+			continue;
+		}
+
+		if (g_file_test (path, G_FILE_TEST_IS_DIR)) {
+			rspamd_config_cache_hash_dir (st, path, skip, depth + 1);
+		}
+		else if (g_file_get_contents (path, &content, &len, NULL)) {
+			rspamd_cryptobox_hash_update (st, (const guchar *)path, strlen (path) + 1);
+			rspamd_cryptobox_hash_update (st, (const guchar *)&len,
+					sizeof (len));
+			rspamd_cryptobox_hash_update (st, (const guchar *)content, len);
+			g_free (content);
+		}
+
+		g_free (path);
+	}
+
+	g_ptr_array_free (names, TRUE);
+}
+
+static const gchar *
+rspamd_config_cache_var (GHashTable *vars, const gchar *name,
+		const gchar *def)
+{
+	const gchar *val = NULL;
+
+	if (vars) {
+		val = g_hash_table_lookup (vars, name);
+	}
+
+	return val ? val : def;
+}
+
+gboolean
+rspamd_config_cache_key (struct rspamd_config *cfg, const gchar *filename,
+		GHashTable *vars, guchar *key)
+{
+	rspamd_cryptobox_hash_state_t st;
+	GPtrArray *names;
+	GHashTableIter it;
+	gpointer k, v;
+	gchar *dirname, *keypair_path, *transform_path, *content;
+	const gchar *dirs[3];
+	gchar hostbuf[256];
+	gsize len;
+	guint i, j;
+
+	keypair_path = g_strconcat (filename, ".key", NULL);
+
+	if (g_file_test (keypair_path, G_FILE_TEST_EXISTS)) {
+		/* Decrypted configuration must not be stored */
+		g_free (keypair_path);
+
+		return FALSE;
+	}
+
+	g_free (keypair_path);
+	rspamd_cryptobox_hash_init (&st, NULL, 0);
+	rspamd_cryptobox_hash_update (&st, (const guchar *)CFG_CACHE_MAGIC,
+			sizeof (CFG_CACHE_MAGIC));
+	rspamd_cryptobox_hash_update (&st, (const guchar *)RVERSION, sizeof (RVERSION));
+	rspamd_cryptobox_hash_update (&st, (const guchar *)RID, sizeof (RID));
+	rspamd_cryptobox_hash_update (&st, (const guchar *)filename, strlen (filename) + 1);
+
+	/* $HOSTNAME is expanded by the parser */
+	memset (hostbuf, 0, sizeof (hostbuf));
+	gethostname (hostbuf, sizeof (hostbuf) - 1);
+	rspamd_cryptobox_hash_update (&st, (const guchar *)hostbuf, strlen (hostbuf) + 1);
+
+	if (vars) {
+		names = g_ptr_array_new ();
+		g_hash_table_iter_init (&it, vars);
+
+		while (g_hash_table_iter_next (&it, &k, &v)) {
+			g_ptr_array_add (names, k);
+		}
+
+		g_ptr_array_sort (names, rspamd_config_cache_cmp_names);
+
+		for (i = 0; i < names->len; i ++) {
+			k = g_ptr_array_index (names, i);
+			v = g_hash_table_lookup (vars, k);
+			rspamd_cryptobox_hash_update (&st, (const guchar *)k, strlen (k) + 1);
+			rspamd_cryptobox_hash_update (&st, (const guchar *)v, strlen (v) + 1);
+		}
+
+		g_ptr_array_free (names, TRUE);
+	}
+
+	/* The final tree also depends on the lua transform */
+	transform_path = g_build_filename (rspamd_config_cache_var (vars,
+			"LUALIBDIR", RSPAMD_LUALIBDIR), "lua_cfg_transform.lua", NULL);
+
+	if (g_file_get_contents (transform_path, &content, &len, NULL)) {
+		rspamd_cryptobox_hash_update (&st, (const guchar *)content, len);
+		g_free (content);
+	}
+
+	g_free (transform_path);
+
+	dirname = g_path_get_dirname (filename);
+	dirs[0] = dirname;
+	dirs[1] = rspamd_config_cache_var (vars, "CONFDIR", RSPAMD_CONFDIR);
+	dirs[2] = rspamd_config_cache_var (vars, "LOCAL_CONFDIR",
+			RSPAMD_LOCAL_CONFDIR);
+
+	for (i = 0; i < G_N_ELEMENTS (dirs); i ++) {
+		for (j = 0; j < i; j ++) {
+			if (strcmp (dirs[i], dirs[j]) == 0) {
+				break;
+			}
+		}
+
+		if (j == i) {
+			rspamd_config_cache_hash_dir (&st, dirs[i], cfg->config_cache, 0);
+		}
+	}
+
+	g_free (dirname);
+	rspamd_cryptobox_hash_final (&st, key);
+
+	return TRUE;
+}
+
+static void
+rspamd_config_cache_write_elt (GByteArray *out, const ucl_object_t *obj)
+{
+	const ucl_object_t *cur, *elt;
+	ucl_object_iter_t it = NULL;
+	guint8 type, flags;
+	guint16 prio;
+	guint32 n;
+	gint64 iv;
+	gdouble dv;
+	gsize pos;
+
+	type = obj->type;
+	flags = (obj->flags & UCL_OBJECT_BINARY) ? 1 : 0;
+	prio = ucl_object_get_priority (obj);
+
+	if (type == UCL_USERDATA) {
+		/* Parsed configuration has no userdata */
+		type = UCL_NULL;
+	}
+
+	g_byte_array_append (out, &type, sizeof (type));
+	g_byte_array_append (out, &flags, sizeof (flags));
+	g_byte_array_append (out, (const guint8 *)&prio, sizeof (prio));
+
+	switch (type) {
+	case UCL_INT:
+		iv = ucl_object_toint (obj);
+		g_byte_array_append (out, (const guint8 *)&iv, sizeof (iv));
+		break;
+	case UCL_FLOAT:
+	case UCL_TIME:
+		dv = ucl_object_todouble (obj);
+		g_byte_array_append (out, (const guint8 *)&dv, sizeof (dv));
+		break;
+	case UCL_BOOLEAN:
+		flags = ucl_object_toboolean (obj);
+		g_byte_array_append (out, &flags, sizeof (flags));
+		break;
+	case UCL_STRING:
+		n = obj->len;
+		g_byte_array_append (out, (const guint8 *)&n, sizeof (n));
+		g_byte_array_append (out, (const guint8 *)obj->value.sv, n);
+		break;
+	case UCL_ARRAY:
+		n = 0;
+		pos = out->len;
+		g_byte_array_append (out, (const guint8 *)&n, sizeof (n));
+
+		while ((cur = ucl_object_iterate (obj, &it, true)) != NULL) {
+			rspamd_config_cache_write_elt (out, cur);
+			n ++;
+		}
+
+		memcpy (out->data + pos, &n, sizeof (n));
+		break;
+	case UCL_OBJECT:
+		n = 0;
+		pos = out->len;
+		g_byte_array_append (out, (const guint8 *)&n, sizeof (n));
+
+		while ((cur = ucl_object_iterate (obj, &it, false)) != NULL) {
+			LL_FOREACH (cur, elt) {
+				guint32 klen = elt->keylen;
+
+				g_byte_array_append (out, (const guint8 *)&klen, sizeof (klen));
+				g_byte_array_append (out, (const guint8 *)elt->key, klen);
+				rspamd_config_cache_write_elt (out, elt);
+				n ++;
+			}
+		}
+
+		memcpy (out->data + pos, &n, sizeof (n));
+		break;
+	default:
+		break;
+	}
+}
+
+static gboolean
+rspamd_config_cache_read (struct rspamd_cfg_cache_reader *rd, gpointer dst,
+		gsize len)
+{
+	if ((gsize)(rd->end - rd->pos) < len) {
+		return FALSE;
+	}
+
+	memcpy (dst, rd->pos, len);
+	rd->pos += len;
+
+	return TRUE;
+}
+
+static ucl_object_t *
+rspamd_config_cache_read_elt (struct rspamd_cfg_cache_reader *rd, guint depth)
+{
+	ucl_object_t *obj = NULL, *elt;
+	guint8 type, flags, bv;
+	guint16 prio;
+	guint32 n, klen, i;
+	gint64 iv;
+	gdouble dv;
+	const gchar *key;
+
+	if (depth > 128 ||
+			!rspamd_config_cache_read (rd, &type, sizeof (type)) ||
+			!rspamd_config_cache_read (rd, &flags, sizeof (flags)) ||
+			!rspamd_config_cache_read (rd, &prio, sizeof (prio))) {
+		return NULL;
+	}
+
+	switch (type) {
+	case UCL_INT:
+		if (rspamd_config_cache_read (rd, &iv, sizeof (iv))) {
+			obj = ucl_object_fromint (iv);
+		}
+		break;
+	case UCL_FLOAT:
+	case UCL_TIME:
+		if (rspamd_config_cache_read (rd, &dv, sizeof (dv))) {
+			obj = ucl_object_new_full (type, 0);
+			obj->value.dv = dv;
+		}
+		break;
+	case UCL_BOOLEAN:
+		if (rspamd_config_cache_read (rd, &bv, sizeof (bv))) {
+			obj = ucl_object_frombool (bv);
+		}
+		break;
+	case UCL_NULL:
+		obj = ucl_object_typed_new (UCL_NULL);
+		break;
+	case UCL_STRING:
+		if (rspamd_config_cache_read (rd, &n, sizeof (n)) &&
+				(gsize)(rd->end - rd->pos) >= n) {
+			obj = ucl_object_fromlstring ((const gchar *)rd->pos, n);
+			rd->pos += n;
+
+			if (flags) {
+				obj->flags |= UCL_OBJECT_BINARY;
+			}
+		}
+		break;
+	case UCL_ARRAY:
+		if (!rspamd_config_cache_read (rd, &n, sizeof (n))) {
+			break;
+		}
+
+		obj = ucl_object_typed_new (UCL_ARRAY);
+
+		for (i = 0; i < n; i ++) {
+			if ((elt = rspamd_config_cache_read_elt (rd, depth + 1)) == NULL) {
+				ucl_object_unref (obj);
+
+				return NULL;
+			}
+
+			ucl_array_append (obj, elt);
+		}
+		break;
+	case UCL_OBJECT:
+		if (!rspamd_config_cache_read (rd, &n, sizeof (n))) {
+			break;
+		}
+
+		obj = ucl_object_typed_new (UCL_OBJECT);
+
+		for (i = 0; i < n; i ++) {
+			if (!rspamd_config_cache_read (rd, &klen, sizeof (klen)) ||
+					(gsize)(rd->end - rd->pos) < klen) {
+				ucl_object_unref (obj);
+
+				return NULL;
+			}
+
+			key = (const gchar *)rd->pos;
+			rd->pos += klen;
+
+			if ((elt = rspamd_config_cache_read_elt (rd, depth + 1)) == NULL) {
+				ucl_object_unref (obj);
+
+				return NULL;
+			}
+
+			/* Repeated keys are restored as multi-value keys */
+			ucl_object_insert_key (obj, elt, key, klen, true);
+		}
+		break;
+	default:
+		break;
+	}
+
+	if (obj) {
+		ucl_object_set_priority (obj, prio);
+	}
+
+	return obj;
+}
+
+gboolean
+rspamd_config_cache_load (struct rspamd_config *cfg, const guchar *key)
+{
+	struct rspamd_cfg_cache_hdr hdr;
+	struct rspamd_cfg_cache_reader rd;
+	ucl_object_t *top;
+	gchar *data;
+	gsize len;
+
+	if (!g_file_get_contents (cfg->config_cache, &data, &len, NULL)) {
+		return FALSE;
+	}
+
+	rd.pos = (const guchar *)data;
+	rd.end = rd.pos + len;
+
+	if (!rspamd_config_cache_read (&rd, &hdr, sizeof (hdr)) ||
+			memcmp (hdr.magic, CFG_CACHE_MAGIC, sizeof (hdr.magic)) != 0 ||
+			hdr.bom != CFG_CACHE_BOM ||
+			memcmp (hdr.key, key, sizeof (hdr.key)) != 0) {
+		msg_info_config ("config cache %s is outdated", cfg->config_cache);
+		g_free (data);
+
+		return FALSE;
+	}
+
+	top = rspamd_config_cache_read_elt (&rd, 0);
+	g_free (data);
+
+	if (top == NULL || ucl_object_type (top) != UCL_OBJECT) {
+		msg_warn_config ("config cache %s is broken", cfg->config_cache);
+
+		if (top) {
+			ucl_object_unref (top);
+		}
+
+		return FALSE;
+	}
+
+	cfg->rcl_obj = top;
+	msg_info_config ("loaded compiled config from %s", cfg->config_cache);
+
+	return TRUE;
+}
+
+gboolean
+rspamd_config_cache_save (struct rspamd_config *cfg, const guchar *key,
+		GError **err)
+{
+	struct rspamd_cfg_cache_hdr hdr;
+	GByteArray *out;
+	gchar *tmpname;
+	gboolean ret = FALSE;
+	gint fd;
+
+	memset (&hdr, 0, sizeof (hdr));
+	memcpy (hdr.magic, CFG_CACHE_MAGIC, sizeof (hdr.magic));
+	hdr.bom = CFG_CACHE_BOM;
+	memcpy (hdr.key, key, sizeof (hdr.key));
+
+	out = g_byte_array_sized_new (65536);
+	g_byte_array_append (out, (const guint8 *)&hdr, sizeof (hdr));
+	rspamd_config_cache_write_elt (out, cfg->rcl_obj);
+
+	/* Configuration has passwords and keys, so it is readable by owner only */
+	tmpname = g_strconcat (cfg->config_cache, ".new", NULL);
+	(void)unlink (tmpname);
+	fd = open (tmpname, O_WRONLY | O_CREAT | O_EXCL, 00600);
+
+	if (fd == -1) {
+		g_set_error (err, g_quark_from_static_string ("config"), errno,
+				"cannot create %s: %s", tmpname, strerror (errno));
+	}
+	else if (write (fd, out->data, out->len) != (gssize)out->len) {
+		g_set_error (err, g_quark_from_static_string ("config"), errno,
+				"cannot write %s: %s", tmpname, strerror (errno));
+		close (fd);
+		unlink (tmpname);
+	}
+	else {
+		close (fd);
+
+		if (rename (tmpname, cfg->config_cache) == -1) {
+			g_set_error (err, g_quark_from_static_string ("config"), errno,
+					"cannot rename %s: %s", tmpname, strerror (errno));
+			unlink (tmpname);
+		}
+		else {
+			ret = TRUE;
+		}
+	}
+
+	g_free (tmpname);
+	g_byte_array_free (out, TRUE);
+
+	return ret;
+}
@@ -43,7 +43,10 @@ struct module_s;
 struct worker_s;
 struct rspamd_external_libs_ctx;
 struct rspamd_cryptobox_pubkey;
+struct rspamd_image_cache;
 struct rspamd_dns_resolver;
+struct rspamd_worker_template;
+struct rspamd_composites_index;
 
 /**
  * Types of rspamd bind lines
@@ -158,6 +161,10 @@ struct rspamd_tokenizer_config {
  * No backend required for classifier
  */
 #define RSPAMD_FLAG_CLASSIFIER_NO_BACKEND (1 << 2)
+/*
+ * Classifier has per user statistics (`per_user` option)
+ */
+#define RSPAMD_FLAG_CLASSIFIER_PER_USER (1 << 3)
 
 /**
  * Classifier config definition
@@ -210,6 +217,12 @@ struct rspamd_worker_conf {
 	ucl_object_t *options;                          /**< other worker's options								*/
 	struct rspamd_worker_lua_script *scripts;       /**< registered lua scripts								*/
 	gboolean enabled;
+	gboolean reuseport;                             /**< use own SO_REUSEPORT socket in each worker			*/
+	gboolean cpu_affinity;                          /**< pin each worker to a single cpu					*/
+	gchar *cpus;                                    /**< list of cpus to run workers on						*/
+	gint numa_node;                                 /**< numa node to run workers on, -1 if not set		*/
+	gboolean prefork;                               /**< fork workers from a warmed up template process	*/
+	struct rspamd_worker_template *tpl;             /**< running template process or NULL					*/
 	ref_entry_t ref;
 };
 
@@ -237,6 +250,7 @@ enum rspamd_log_format_type {
 	RSPAMD_LOG_DIGEST,
 	RSPAMD_LOG_FILENAME,
 	RSPAMD_LOG_FORCED_ACTION,
+	RSPAMD_LOG_COPIED,
 };
 
 enum rspamd_log_format_flags {
@@ -287,6 +301,7 @@ struct rspamd_config {
 	gchar *rspamd_group;                            /**< group to run as									*/
 	rspamd_mempool_t *cfg_pool;                     /**< memory pool for config								*/
 	gchar *cfg_name;                                /**< name of config file								*/
+	gchar *config_cache;                            /**< compiled config cache, NULL if disabled			*/
 	gchar *pid_file;                                /**< name of pid file									*/
 	gchar *temp_dir;                                /**< dir for temp files									*/
 	gchar *control_socket_path;                     /**< path to the control socket							*/
@@ -308,12 +323,17 @@ struct rspamd_config {
 	gboolean allow_raw_input;                       /**< scan messages with invalid mime					*/
 	gboolean disable_hyperscan;                     /**< disable hyperscan usage							*/
 	gboolean vectorized_hyperscan;                  /**< use vectorized hyperscan matching					*/
+	gboolean shared_hyperscan;                      /**< share deserialized hyperscan databases between workers	*/
+	gdouble regexp_max_ticks;                       /**< average pcre cost to defer a regexp				*/
 	gboolean enable_shutdown_workaround;            /**< enable workaround for legacy SA clients (exim)		*/
 	gboolean ignore_received;                       /**< Ignore data from the first received header			*/
 	gboolean enable_sessions_cache;                 /**< Enable session cache for debug						*/
+	gboolean enable_mempool_profile;                /**< Record pool allocations per call site				*/
+	gboolean mempool_huge_pages;                    /**< Back large pool chunks with huge pages				*/
 	gboolean enable_experimental;                   /**< Enable experimental plugins						*/
 	gboolean disable_pcre_jit;                      /**< Disable pcre JIT									*/
 	gboolean disable_lua_squeeze;                   /**< Disable lua rules squeezing						*/
+	gboolean enable_lua_profile;                    /**< Record Lua CPU and memory usage per symbol			*/
 	gboolean own_lua_state;                         /**< True if we have created lua_state internally		*/
 
 	gsize max_diff;                                 /**< maximum diff size for text parts					*/
@@ -322,7 +342,11 @@ struct rspamd_config {
 	gchar *cores_dir;                               /**< directory for core files							*/
 	gsize max_message;                              /**< maximum size for messages							*/
 	gsize max_pic_size;                             /**< maximum size for a picture to process				*/
-	gsize images_cache_size;                        /**< size of LRU cache for DCT data from images			*/
+	gsize max_archive_size;                         /**< maximum decoded size of an archive to inspect		*/
+	guint max_archive_files;                        /**< maximum number of files listed for an archive		*/
+	gsize images_cache_size;                        /**< number of elements in shared DCT cache for images	*/
+	gdouble http_keepalive_timeout;                 /**< idle time of kept alive lua http connections		*/
+	guint http_keepalive_max_idle;                  /**< idle lua http connections per host					*/
 	gint default_max_shots;                         /**< default maximum count of symbols hits permitted (-1 for unlimited) */
 
 	enum rspamd_log_type log_type;                  /**< log type											*/
@@ -332,6 +356,8 @@ struct rspamd_config {
 	gboolean log_buffered;                          /**< whether logging is buffered						*/
 	gboolean log_silent_workers;                    /**< silence info messages from workers					*/
 	guint32 log_buf_size;                           /**< length of log buffer								*/
+	gboolean log_async;                             /**< workers log via rings drained by main process		*/
+	guint32 log_async_ring_size;                    /**< size of each worker's log ring						*/
 	const ucl_object_t *debug_ip_map;               /**< turn on debugging for specified ip addresses       */
 	gboolean log_urls;                              /**< whether we should log URLs                         */
 	GList *debug_symbols;                           /**< symbols to debug									*/
@@ -355,6 +381,7 @@ struct rspamd_config {
 	ucl_object_t *doc_strings;                      /**< documentation strings for config options			*/
 	GPtrArray *c_modules;                           /**< list of C modules			*/
 	GHashTable * composite_symbols;                 /**< hash of composite symbols indexed by its name		*/
+	struct rspamd_composites_index *composites_index; /**< composites indexed by symbols in expressions */
 	GList *classifiers;                             /**< list of all classifiers defined                    */
 	GList *statfiles;                               /**< list of all statfiles in config file order         */
 	GHashTable *classifiers_symbols;                /**< hashtable indexed by symbol name of classifiers    */
@@ -371,6 +398,7 @@ struct rspamd_config {
 	gdouble map_timeout;                            /**< maps watch timeout									*/
 	gdouble map_file_watch_multiplier;              /**< multiplier for watch timeout when maps are files	*/
 	gchar *maps_cache_dir;                          /**< where to save HTTP cached data						*/
+	gboolean shared_maps;                           /**< share parsed hash maps between processes			*/
 
 	gdouble monitored_interval;                     /**< interval between monitored checks					*/
 	gboolean disable_monitored;                     /**< disable monitoring completely						*/
@@ -382,9 +410,14 @@ struct rspamd_config {
 	gchar * dump_checksum;                          /**< dump checksum of config file						*/
 	gpointer lua_state;                             /**< pointer to lua state								*/
 	gpointer lua_thread_pool;                       /**< pointer to lua thread (coroutine) pool				*/
+	GPtrArray *lua_profile;                         /**< Lua symbols profile elements if enabled			*/
 
 	gchar * rrd_file;                               /**< rrd file to store statistics						*/
+	gboolean rrd_latency;                           /**< store scan time for each action in rrd				*/
+	GList *rrd_symbols;                             /**< symbols whose rates are stored in rrd				*/
 	gchar * history_file;                           /**< file to save rolling history						*/
+	gchar * caches_snapshot;                        /**< file to save shared caches							*/
+	gdouble caches_snapshot_interval;               /**< interval of caches snapshots						*/
 	gchar * tld_file;                               /**< file to load effective tld list from				*/
 	gchar * hs_cache_dir;                           /**< directory to save hyperscan databases				*/
 	gchar * magic_file;                             /**< file to initialize libmagic						*/
@@ -397,6 +430,11 @@ struct rspamd_config {
 	const ucl_object_t *nameservers;                /**< list of nameservers or NULL to parse resolv.conf	*/
 	guint32 dns_max_requests;                       /**< limit of DNS requests per task 					*/
 	gboolean enable_dnssec;                         /**< enable dnssec stub resolver						*/
+	gboolean dns_coalesce_requests;                 /**< share requests for the same name in flight			*/
+	gboolean dns_enable_tcp;                        /**< repeat truncated requests over TCP					*/
+	guint32 dns_edns_payload;                       /**< UDP payload size advertised in EDNS0				*/
+	guint32 dns_cache_size;                         /**< number of DNS replies cached for all workers		*/
+	guint32 dns_cache_negative_ttl;                 /**< time in seconds to cache negative DNS replies		*/
 
 	guint upstream_max_errors;						/**< upstream max errors before shutting off			*/
 	gdouble upstream_error_time;					/**< rate of upstream errors							*/
@@ -409,6 +447,13 @@ struct rspamd_config {
 	guint words_decay;								/**< limit for words for starting adaptive ignoring		*/
 	guint history_rows;								/**< number of history rows stored						*/
 	guint max_sessions_cache;                        /**< maximum number of sessions cache elts				*/
+	guint lua_gc_step;								/**< size of Lua GC step after each task (KB)			*/
+	guint lua_gc_pause;								/**< Lua GC pause, 0 to keep the default				*/
+	guint lua_gc_stepmul;							/**< Lua GC step multiplier, 0 to keep the default		*/
+	gdouble slow_task_time;							/**< tasks slower than this are logged with stages		*/
+	gdouble trace_sample_rate;						/**< part of tasks that are traced (0 - 1)				*/
+	gchar *trace_collector;							/**< upstreams of traces collector						*/
+	guint trace_batch_size;							/**< number of spans sent to collector at once			*/
 
 	GList *classify_headers;						/**< list of headers using for statistics				*/
 	struct module_s **compiled_modules;				/**< list of compiled C modules							*/
@@ -422,6 +467,8 @@ struct rspamd_config {
 	struct rspamd_redis_pool *redis_pool;			/**< redis connectiosn pool								*/
 
 	struct rspamd_re_cache *re_cache;				/**< static regexp cache								*/
+	struct rspamd_image_cache *images_cache;		/**< shared cache of images DCT hashes					*/
+	struct rspamd_dns_cache *dns_cache;				/**< shared cache of DNS replies						*/
 
 	GHashTable *trusted_keys;						/**< list of trusted public keys						*/
 
@@ -434,6 +481,7 @@ struct rspamd_config {
 	ucl_object_t *neighbours;						/**< other servers in the cluster						*/
 
 	struct rspamd_lang_detector *lang_det;			/**< language detector									*/
+	GArray *load_profile;							/**< timings of config load phases						*/
 
 	ref_entry_t ref;								/**< reference counter									*/
 };
@@ -494,6 +542,19 @@ enum rspamd_post_load_options {
 	RSPAMD_CONFIG_INIT_PRELOAD_MAPS = 1 << 5,
 };
 
+enum rspamd_config_load_phase_type {
+	RSPAMD_CONFIG_PHASE_CORE = 0,
+	RSPAMD_CONFIG_PHASE_MODULE,
+	RSPAMD_CONFIG_PHASE_LUA_MODULE,
+	RSPAMD_CONFIG_PHASE_MAP,
+};
+
+struct rspamd_config_load_phase {
+	const gchar *name;
+	enum rspamd_config_load_phase_type type;
+	gdouble time;
+};
+
 #define RSPAMD_CONFIG_LOAD_ALL (RSPAMD_CONFIG_INIT_URL| \
 		RSPAMD_CONFIG_INIT_LIBS| \
 		RSPAMD_CONFIG_INIT_SYMCACHE| \
@@ -507,6 +568,31 @@ enum rspamd_post_load_options {
 gboolean rspamd_config_post_load (struct rspamd_config *cfg,
 		enum rspamd_post_load_options opts);
 
+/**
+ * Record time spent by a phase of config load. Core phases do not overlap,
+ * modules and maps are recorded inside of the corresponding core phases
+ * @param cfg config file
+ * @param type type of phase
+ * @param name name of phase (copied)
+ * @param start value of `rspamd_get_ticks (FALSE)` when the phase has started
+ */
+void rspamd_config_profile_phase (struct rspamd_config *cfg,
+		enum rspamd_config_load_phase_type type,
+		const gchar *name,
+		gdouble start);
+
+/**
+ * Returns a string name of config load phase type
+ */
+const gchar * rspamd_config_phase_type_to_str (
+		enum rspamd_config_load_phase_type type);
+
+/**
+ * Write timings of config load to the log: core phases and slow modules/maps
+ * @param cfg config file
+ */
+void rspamd_config_profile_log (struct rspamd_config *cfg);
+
 /**
  * Calculate checksum for config file
  * @param cfg config file
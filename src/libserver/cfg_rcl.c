@@ -1460,6 +1460,19 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 				G_STRUCT_OFFSET (struct rspamd_config, log_buf_size),
 				RSPAMD_CL_FLAG_INT_32,
 				"Size of log buffer in bytes (for file logging)");
+		rspamd_rcl_add_default_handler (sub,
+				"async",
+				rspamd_rcl_parse_struct_boolean,
+				G_STRUCT_OFFSET (struct rspamd_config, log_async),
+				0,
+				"Workers pass log records to the main process that writes them "
+				"in batches, records are dropped if worker's ring is full");
+		rspamd_rcl_add_default_handler (sub,
+				"async_ring_size",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, log_async_ring_size),
+				RSPAMD_CL_FLAG_INT_32,
+				"Size of log ring for each worker in bytes (1Mb by default)");
 		rspamd_rcl_add_default_handler (sub,
 				"log_urls",
 				rspamd_rcl_parse_struct_boolean,
@@ -1694,6 +1707,12 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 				G_STRUCT_OFFSET (struct rspamd_config, maps_cache_dir),
 				0,
 				"Directory to save maps cached data (default: $DBDIR)");
+		rspamd_rcl_add_default_handler (sub,
+				"shared_maps",
+				rspamd_rcl_parse_struct_boolean,
+				G_STRUCT_OFFSET (struct rspamd_config, shared_maps),
+				0,
+				"Store parsed hash maps in maps_cache_dir and share them between processes");
 		rspamd_rcl_add_default_handler (sub,
 				"monitoring_watch_interval",
 				rspamd_rcl_parse_struct_time,
@@ -1718,12 +1737,36 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 				G_STRUCT_OFFSET (struct rspamd_config, rrd_file),
 				RSPAMD_CL_FLAG_STRING_PATH,
 				"Path to RRD file");
+		rspamd_rcl_add_default_handler (sub,
+				"rrd_latency",
+				rspamd_rcl_parse_struct_boolean,
+				G_STRUCT_OFFSET (struct rspamd_config, rrd_latency),
+				0,
+				"Store average scan time for each action in RRD file");
+		rspamd_rcl_add_default_handler (sub,
+				"rrd_symbols",
+				rspamd_rcl_parse_struct_string_list,
+				G_STRUCT_OFFSET (struct rspamd_config, rrd_symbols),
+				0,
+				"List of symbols whose rates are stored in RRD file");
 		rspamd_rcl_add_default_handler (sub,
 				"history_file",
 				rspamd_rcl_parse_struct_string,
 				G_STRUCT_OFFSET (struct rspamd_config, history_file),
 				RSPAMD_CL_FLAG_STRING_PATH,
 				"Path to history file");
+		rspamd_rcl_add_default_handler (sub,
+				"caches_snapshot",
+				rspamd_rcl_parse_struct_string,
+				G_STRUCT_OFFSET (struct rspamd_config, caches_snapshot),
+				RSPAMD_CL_FLAG_STRING_PATH,
+				"Path to snapshot of shared caches (DNS, SPF, DKIM) preloaded on start and reload");
+		rspamd_rcl_add_default_handler (sub,
+				"caches_snapshot_interval",
+				rspamd_rcl_parse_struct_time,
+				G_STRUCT_OFFSET (struct rspamd_config, caches_snapshot_interval),
+				RSPAMD_CL_FLAG_TIME_FLOAT,
+				"How often snapshot of shared caches is written (default: 60s)");
 		rspamd_rcl_add_default_handler (sub,
 				"check_all_filters",
 				rspamd_rcl_parse_struct_boolean,
@@ -1748,6 +1791,12 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 				G_STRUCT_OFFSET (struct rspamd_config, disable_lua_squeeze),
 				0,
 				"Disable Lua rules squeezing");
+		rspamd_rcl_add_default_handler (sub,
+				"lua_profile",
+				rspamd_rcl_parse_struct_boolean,
+				G_STRUCT_OFFSET (struct rspamd_config, enable_lua_profile),
+				0,
+				"Record CPU time and memory allocated by Lua symbols in workers (debug)");
 		rspamd_rcl_add_default_handler (sub,
 				"min_word_len",
 				rspamd_rcl_parse_struct_integer,
@@ -1802,6 +1851,18 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 				G_STRUCT_OFFSET (struct rspamd_config, vectorized_hyperscan),
 				0,
 				"Use hyperscan in vectorized mode (experimental)");
+		rspamd_rcl_add_default_handler (sub,
+				"shared_hyperscan",
+				rspamd_rcl_parse_struct_boolean,
+				G_STRUCT_OFFSET (struct rspamd_config, shared_hyperscan),
+				0,
+				"Map deserialized hyperscan databases read-only and share them between workers");
+		rspamd_rcl_add_default_handler (sub,
+				"regexp_max_ticks",
+				rspamd_rcl_parse_struct_double,
+				G_STRUCT_OFFSET (struct rspamd_config, regexp_max_ticks),
+				0,
+				"Skip regexps whose average pcre execution takes more CPU ticks (0 to disable)");
 		rspamd_rcl_add_default_handler (sub,
 				"cores_dir",
 				rspamd_rcl_parse_struct_string,
@@ -1880,12 +1941,38 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 				G_STRUCT_OFFSET (struct rspamd_config, max_pic_size),
 				RSPAMD_CL_FLAG_INT_SIZE,
 				"Maximum size of the picture to be normalized (1Mb by default)");
+		rspamd_rcl_add_default_handler (sub,
+				"max_archive",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, max_archive_size),
+				RSPAMD_CL_FLAG_INT_SIZE,
+				"Maximum decoded size of the archive to be inspected (20Mb by default)");
+		rspamd_rcl_add_default_handler (sub,
+				"max_archive_files",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, max_archive_files),
+				RSPAMD_CL_FLAG_INT_32,
+				"Maximum number of files to be listed for an archive (2048 by default)");
 		rspamd_rcl_add_default_handler (sub,
 				"images_cache",
 				rspamd_rcl_parse_struct_integer,
-				G_STRUCT_OFFSET (struct rspamd_config, max_pic_size),
+				G_STRUCT_OFFSET (struct rspamd_config, images_cache_size),
 				RSPAMD_CL_FLAG_INT_SIZE,
-				"Size of DCT data cache for images (256 elements by default)");
+				"Number of DCT hashes of images shared between workers (1024 elements by default)");
+		rspamd_rcl_add_default_handler (sub,
+				"http_keepalive_timeout",
+				rspamd_rcl_parse_struct_time,
+				G_STRUCT_OFFSET (struct rspamd_config, http_keepalive_timeout),
+				RSPAMD_CL_FLAG_TIME_FLOAT,
+				"Close idle connections of lua http requests after this time, "
+				"0 disables keep-alive (10 seconds by default)");
+		rspamd_rcl_add_default_handler (sub,
+				"http_keepalive_max_idle",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, http_keepalive_max_idle),
+				RSPAMD_CL_FLAG_INT_32,
+				"Maximum number of idle connections of lua http requests per host "
+				"(16 by default)");
 		rspamd_rcl_add_default_handler (sub,
 				"zstd_input_dictionary",
 				rspamd_rcl_parse_struct_string,
@@ -1922,6 +2009,61 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 				G_STRUCT_OFFSET (struct rspamd_config, max_sessions_cache),
 				0,
 				"Maximum number of sessions in cache before warning (default: 100)");
+		rspamd_rcl_add_default_handler (sub,
+				"lua_gc_step",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, lua_gc_step),
+				RSPAMD_CL_FLAG_UINT,
+				"Run incremental Lua GC step of this size (KB) after each task (default: 0, disabled)");
+		rspamd_rcl_add_default_handler (sub,
+				"lua_gc_pause",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, lua_gc_pause),
+				RSPAMD_CL_FLAG_UINT,
+				"Lua GC pause in percents, as for collectgarbage('setpause') (default: Lua default)");
+		rspamd_rcl_add_default_handler (sub,
+				"lua_gc_stepmul",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, lua_gc_stepmul),
+				RSPAMD_CL_FLAG_UINT,
+				"Lua GC step multiplier, as for collectgarbage('setstepmul') (default: Lua default)");
+		rspamd_rcl_add_default_handler (sub,
+				"slow_task_time",
+				rspamd_rcl_parse_struct_time,
+				G_STRUCT_OFFSET (struct rspamd_config, slow_task_time),
+				RSPAMD_CL_FLAG_TIME_FLOAT,
+				"Log tasks processed longer than this time with the stages breakdown (default: 2.0, 0 to disable)");
+		rspamd_rcl_add_default_handler (sub,
+				"trace_sample_rate",
+				rspamd_rcl_parse_struct_double,
+				G_STRUCT_OFFSET (struct rspamd_config, trace_sample_rate),
+				0,
+				"Part of tasks that are traced, from 0 to 1 (default: 0, disabled)");
+		rspamd_rcl_add_default_handler (sub,
+				"trace_collector",
+				rspamd_rcl_parse_struct_string,
+				G_STRUCT_OFFSET (struct rspamd_config, trace_collector),
+				0,
+				"Upstreams of OTLP HTTP collector to send traces to (default port: 4318)");
+		rspamd_rcl_add_default_handler (sub,
+				"trace_batch_size",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, trace_batch_size),
+				RSPAMD_CL_FLAG_INT_32,
+				"Number of spans sent to the traces collector at once (default: 128)");
+		rspamd_rcl_add_default_handler (sub,
+				"mempool_profile",
+				rspamd_rcl_parse_struct_boolean,
+				G_STRUCT_OFFSET (struct rspamd_config, enable_mempool_profile),
+				0,
+				"Record memory pool allocations per call site in workers (debug)");
+		rspamd_rcl_add_default_handler (sub,
+				"mempool_huge_pages",
+				rspamd_rcl_parse_struct_boolean,
+				G_STRUCT_OFFSET (struct rspamd_config, mempool_huge_pages),
+				0,
+				"Advise transparent huge pages for large memory pool chunks "
+				"(false by default)");
 
 		/* Neighbours configuration */
 		rspamd_rcl_add_section_doc (&sub->subsections, "neighbours", "name",
@@ -1977,6 +2119,36 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 				G_STRUCT_OFFSET (struct rspamd_config, enable_dnssec),
 				0,
 				"Enable DNSSEC support in Rspamd");
+		rspamd_rcl_add_default_handler (ssub,
+				"coalesce",
+				rspamd_rcl_parse_struct_boolean,
+				G_STRUCT_OFFSET (struct rspamd_config, dns_coalesce_requests),
+				0,
+				"Share one DNS request between concurrent requests for the same name and type");
+		rspamd_rcl_add_default_handler (ssub,
+				"enable_tcp",
+				rspamd_rcl_parse_struct_boolean,
+				G_STRUCT_OFFSET (struct rspamd_config, dns_enable_tcp),
+				0,
+				"Repeat requests with truncated replies over persistent TCP connections");
+		rspamd_rcl_add_default_handler (ssub,
+				"edns_payload",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, dns_edns_payload),
+				RSPAMD_CL_FLAG_INT_32,
+				"UDP payload size advertised in EDNS0 (512 - 4096 bytes, 4096 by default)");
+		rspamd_rcl_add_default_handler (ssub,
+				"cache_size",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, dns_cache_size),
+				RSPAMD_CL_FLAG_INT_32,
+				"Number of DNS replies cached for all workers (0 to disable)");
+		rspamd_rcl_add_default_handler (ssub,
+				"cache_negative_ttl",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, dns_cache_negative_ttl),
+				RSPAMD_CL_FLAG_INT_32,
+				"Time in seconds to cache NXDOMAIN and empty DNS replies");
 
 
 		/* New upstreams configuration */
@@ -2110,6 +2282,41 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 				G_STRUCT_OFFSET (struct rspamd_worker_conf, enabled),
 				0,
 				"Enable or disable a worker (true by default)");
+		rspamd_rcl_add_default_handler (sub,
+				"reuseport",
+				rspamd_rcl_parse_struct_boolean,
+				G_STRUCT_OFFSET (struct rspamd_worker_conf, reuseport),
+				0,
+				"Create a separate SO_REUSEPORT listening socket for each worker "
+				"to let the kernel distribute connections (false by default)");
+		rspamd_rcl_add_default_handler (sub,
+				"cpu_affinity",
+				rspamd_rcl_parse_struct_boolean,
+				G_STRUCT_OFFSET (struct rspamd_worker_conf, cpu_affinity),
+				0,
+				"Pin each worker process to a cpu selected by its index "
+				"(false by default)");
+		rspamd_rcl_add_default_handler (sub,
+				"cpus",
+				rspamd_rcl_parse_struct_string,
+				G_STRUCT_OFFSET (struct rspamd_worker_conf, cpus),
+				0,
+				"Run workers on these cpus only, e.g. \"0-7,16-23\"; with "
+				"cpu_affinity each worker is pinned to one of them");
+		rspamd_rcl_add_default_handler (sub,
+				"numa_node",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_worker_conf, numa_node),
+				RSPAMD_CL_FLAG_INT_32,
+				"Run workers on cpus of this numa node and allocate their "
+				"memory on it (not set by default)");
+		rspamd_rcl_add_default_handler (sub,
+				"prefork",
+				rspamd_rcl_parse_struct_boolean,
+				G_STRUCT_OFFSET (struct rspamd_worker_conf, prefork),
+				0,
+				"Fork workers from a template process with hyperscan "
+				"already loaded to respawn them faster (false by default)");
 	}
 
 	if (!(skip_sections && g_hash_table_lookup (skip_sections, "modules"))) {
@@ -3483,14 +3690,41 @@ rspamd_config_read (struct rspamd_config *cfg, const gchar *filename,
 	GError *err = NULL;
 	struct rspamd_rcl_section *top, *logger_section;
 	const ucl_object_t *logger_obj;
+	guchar cache_key[rspamd_cryptobox_HASHBYTES];
+	gboolean use_cache = FALSE, cached = FALSE;
+	guint nmaps;
+	gdouble start;
 
-	if (!rspamd_config_parse_ucl (cfg, filename, vars, &err)) {
-		msg_err_config_forced ("failed to load config: %e", err);
-		g_error_free (err);
+	start = rspamd_get_ticks (FALSE);
 
-		return FALSE;
+	if (cfg->config_cache) {
+		use_cache = rspamd_config_cache_key (cfg, filename, vars, cache_key);
+
+		if (use_cache) {
+			cached = rspamd_config_cache_load (cfg, cache_key);
+		}
 	}
 
+	if (!cached) {
+		nmaps = g_list_length (cfg->maps);
+
+		if (!rspamd_config_parse_ucl (cfg, filename, vars, &err)) {
+			msg_err_config_forced ("failed to load config: %e", err);
+			g_error_free (err);
+
+			return FALSE;
+		}
+
+		if (use_cache && g_list_length (cfg->maps) != nmaps) {
+			/* .include_map is not a part of the tree, so it cannot be cached */
+			msg_info_config ("config includes maps, do not use config cache");
+			use_cache = FALSE;
+		}
+	}
+
+	rspamd_config_profile_phase (cfg, RSPAMD_CONFIG_PHASE_CORE,
+			"ucl_parse", start);
+	start = rspamd_get_ticks (FALSE);
 	top = rspamd_rcl_config_init (cfg, NULL);
 	rspamd_lua_set_path (cfg->lua_state, cfg->rcl_obj, vars);
 	rspamd_lua_set_globals (cfg, cfg->lua_state, vars);
@@ -3523,9 +3757,21 @@ rspamd_config_read (struct rspamd_config *cfg, const gchar *filename,
 		}
 	}
 
+	rspamd_config_profile_phase (cfg, RSPAMD_CONFIG_PHASE_CORE,
+			"lua_init", start);
+
 	/* Transform config if needed */
-	rspamd_rcl_maybe_apply_lua_transform (cfg);
+	start = rspamd_get_ticks (FALSE);
+	if (!cached) {
+		/* Cached tree has been already transformed */
+		rspamd_rcl_maybe_apply_lua_transform (cfg);
+	}
+
 	rspamd_config_calculate_cksum (cfg);
+	rspamd_config_profile_phase (cfg, RSPAMD_CONFIG_PHASE_CORE,
+			"lua_transform", start);
+
+	start = rspamd_get_ticks (FALSE);
 
 	if (!rspamd_rcl_parse (top, cfg, cfg, cfg->cfg_pool, cfg->rcl_obj, &err)) {
 		msg_err_config ("rcl parse error: %e", err);
@@ -3537,7 +3783,28 @@ rspamd_config_read (struct rspamd_config *cfg, const gchar *filename,
 		return FALSE;
 	}
 
+	if (use_cache && !cached) {
+		if (!rspamd_config_cache_save (cfg, cache_key, &err)) {
+			msg_err_config ("cannot save config cache: %e", err);
+			g_error_free (err);
+		}
+		else {
+			msg_info_config ("saved compiled config to %s", cfg->config_cache);
+		}
+	}
+
+	if (cfg->enable_lua_profile) {
+		/* Squeezed rules are executed by a single symbol, so profile them apart */
+		cfg->disable_lua_squeeze = TRUE;
+	}
+
+	rspamd_config_profile_phase (cfg, RSPAMD_CONFIG_PHASE_CORE,
+			"rcl_parse", start);
+
+	start = rspamd_get_ticks (FALSE);
 	cfg->lang_det = rspamd_language_detector_init (cfg);
+	rspamd_config_profile_phase (cfg, RSPAMD_CONFIG_PHASE_CORE,
+			"lang_detector", start);
 
 	return TRUE;
 }
@@ -484,4 +484,28 @@ gboolean rspamd_config_read (struct rspamd_config *cfg,
 							 rspamd_rcl_section_fin_t logger_fin,
 							 gpointer logger_ud,
 							 GHashTable *vars);
+
+/**
+ * Calculates key of the compiled config cache, it depends on rspamd version,
+ * variables and files in the configuration directories
+ * @param key output buffer of rspamd_cryptobox_HASHBYTES
+ * @return FALSE if config cannot be cached (e.g. it is encrypted)
+ */
+gboolean rspamd_config_cache_key (struct rspamd_config *cfg,
+								  const gchar *filename,
+								  GHashTable *vars,
+								  guchar *key);
+
+/**
+ * Loads cfg->rcl_obj from cfg->config_cache if its key is the same
+ */
+gboolean rspamd_config_cache_load (struct rspamd_config *cfg,
+								   const guchar *key);
+
+/**
+ * Saves cfg->rcl_obj to cfg->config_cache
+ */
+gboolean rspamd_config_cache_save (struct rspamd_config *cfg,
+								   const guchar *key,
+								   GError **err);
 #endif /* CFG_RCL_H_ */
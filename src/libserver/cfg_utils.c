@@ -29,7 +29,9 @@
 #include "stat_api.h"
 #include "unix-std.h"
 #include "libutil/multipattern.h"
+#include "libmime/images.h"
 #include "monitored.h"
+#include "dns.h"
 #include "ref.h"
 #include <math.h>
 
@@ -44,9 +46,14 @@
 #define DEFAULT_WORDS_DECAY 600
 #define DEFAULT_MAX_MESSAGE (50 * 1024 * 1024)
 #define DEFAULT_MAX_PIC (1 * 1024 * 1024)
+#define DEFAULT_MAX_ARCHIVE (20 * 1024 * 1024)
+#define DEFAULT_MAX_ARCHIVE_FILES 2048
 #define DEFAULT_MAX_SHOTS 100
 #define DEFAULT_MAX_SESSIONS 100
 #define DEFAULT_MAX_WORKERS 4
+#define DEFAULT_SLOW_TASK_TIME 2.0
+#define DEFAULT_TRACE_BATCH_SIZE 128
+#define DEFAULT_CACHES_SNAPSHOT_INTERVAL 60.0
 
 struct rspamd_ucl_map_cbdata {
 	struct rspamd_config *cfg;
@@ -130,6 +137,10 @@ rspamd_config_new (enum rspamd_config_init_flags flags)
 	cfg->dns_throttling_time = 10000;
 	/* 16 sockets per DNS server */
 	cfg->dns_io_per_server = 16;
+	cfg->dns_coalesce_requests = TRUE;
+	cfg->dns_enable_tcp = TRUE;
+	cfg->dns_cache_size = 2048;
+	cfg->dns_cache_negative_ttl = 60;
 
 	/* 20 Kb */
 	cfg->max_diff = 20480;
@@ -158,7 +169,11 @@ rspamd_config_new (enum rspamd_config_init_flags flags)
 	cfg->history_rows = 200;
 	cfg->log_error_elts = 10;
 	cfg->log_error_elt_maxlen = 1000;
+	cfg->log_async_ring_size = 1024 * 1024;
 	cfg->cache_reload_time = 30.0;
+	cfg->slow_task_time = DEFAULT_SLOW_TASK_TIME;
+	cfg->trace_batch_size = DEFAULT_TRACE_BATCH_SIZE;
+	cfg->caches_snapshot_interval = DEFAULT_CACHES_SNAPSHOT_INTERVAL;
 
 	/* Default log line */
 	cfg->log_format_str = "id: <$mid>,$if_qid{ qid: <$>,}$if_ip{ ip: $,}"
@@ -191,7 +206,11 @@ rspamd_config_new (enum rspamd_config_init_flags flags)
 	cfg->ssl_ciphers = "HIGH:!aNULL:!kRSA:!PSK:!SRP:!MD5:!RC4";
 	cfg->max_message = DEFAULT_MAX_MESSAGE;
 	cfg->max_pic_size = DEFAULT_MAX_PIC;
-	cfg->images_cache_size = 256;
+	cfg->max_archive_size = DEFAULT_MAX_ARCHIVE;
+	cfg->max_archive_files = DEFAULT_MAX_ARCHIVE_FILES;
+	cfg->images_cache_size = 1024;
+	cfg->http_keepalive_timeout = 10.0;
+	cfg->http_keepalive_max_idle = 16;
 	cfg->monitored_ctx = rspamd_monitored_ctx_init ();
 	cfg->neighbours = ucl_object_typed_new (UCL_OBJECT);
 #ifdef WITH_HIREDIS
@@ -201,6 +220,8 @@ rspamd_config_new (enum rspamd_config_init_flags flags)
 	cfg->max_sessions_cache = DEFAULT_MAX_SESSIONS;
 	cfg->maps_cache_dir = rspamd_mempool_strdup (cfg->cfg_pool, RSPAMD_DBDIR);
 	cfg->c_modules = g_ptr_array_new ();
+	cfg->load_profile = g_array_new (FALSE, FALSE,
+			sizeof (struct rspamd_config_load_phase));
 
 	REF_INIT_RETAIN (cfg, rspamd_config_free);
 
@@ -246,6 +267,11 @@ rspamd_config_free (struct rspamd_config *cfg)
 	rspamd_re_cache_unref (cfg->re_cache);
 	rspamd_upstreams_library_unref (cfg->ups_ctx);
 	g_ptr_array_free (cfg->c_modules, TRUE);
+	g_array_free (cfg->load_profile, TRUE);
+
+	if (cfg->lua_profile) {
+		g_ptr_array_free (cfg->lua_profile, TRUE);
+	}
 
 	if (cfg->lua_state && cfg->own_lua_state) {
 		lua_thread_pool_free (cfg->lua_thread_pool);
@@ -449,6 +475,9 @@ rspamd_config_process_var (struct rspamd_config *cfg, const rspamd_ftok_t *var,
 	else if (rspamd_ftok_cstr_equal (&tok, "forced_action", TRUE)) {
 		type = RSPAMD_LOG_FORCED_ACTION;
 	}
+	else if (rspamd_ftok_cstr_equal (&tok, "copied", TRUE)) {
+		type = RSPAMD_LOG_COPIED;
+	}
 	else {
 		msg_err_config ("unknown log variable: %T", &tok);
 		return FALSE;
@@ -681,6 +710,7 @@ rspamd_config_post_load (struct rspamd_config *cfg,
 	struct timespec ts;
 #endif
 	gboolean ret = TRUE;
+	gdouble start;
 
 #ifdef HAVE_CLOCK_GETTIME
 #ifdef HAVE_CLOCK_PROCESS_CPUTIME_ID
@@ -710,6 +740,7 @@ rspamd_config_post_load (struct rspamd_config *cfg,
 		cfg->default_max_shots = 1;
 	}
 
+	rspamd_lua_gc_setup (cfg);
 	rspamd_regexp_library_init (cfg);
 	rspamd_multipattern_library_init (cfg->hs_cache_dir);
 
@@ -804,15 +835,32 @@ rspamd_config_post_load (struct rspamd_config *cfg,
 		lua_settop (L, err_idx - 1);
 
 		/* Init config cache */
+		start = rspamd_get_ticks (FALSE);
 		rspamd_symcache_init (cfg->cache);
+		rspamd_config_profile_phase (cfg, RSPAMD_CONFIG_PHASE_CORE,
+				"symcache_init", start);
 
 		/* Init re cache */
+		start = rspamd_get_ticks (FALSE);
 		rspamd_re_cache_init (cfg->re_cache, cfg);
+		rspamd_config_profile_phase (cfg, RSPAMD_CONFIG_PHASE_CORE,
+				"re_cache_init", start);
+
+		/* Images cache must be allocated before workers are forked */
+		rspamd_images_cache_init (cfg);
+		/* The same for DNS replies cache */
+		rspamd_dns_cache_init (cfg);
+
+		/* Share immutable symcache data with the workers */
+		rspamd_symcache_freeze (cfg->cache);
 	}
 
 	if (opts & RSPAMD_CONFIG_INIT_LIBS) {
 		/* Config other libraries */
+		start = rspamd_get_ticks (FALSE);
 		rspamd_config_libs (cfg->libs_ctx, cfg);
+		rspamd_config_profile_phase (cfg, RSPAMD_CONFIG_PHASE_CORE,
+				"libs", start);
 	}
 
 	/* Validate cache */
@@ -861,7 +909,10 @@ rspamd_config_post_load (struct rspamd_config *cfg,
 			ret = FALSE;
 		}
 
+		start = rspamd_get_ticks (FALSE);
 		ret = rspamd_symcache_validate (cfg->cache, cfg, FALSE) && ret;
+		rspamd_config_profile_phase (cfg, RSPAMD_CONFIG_PHASE_CORE,
+				"symcache_validate", start);
 	}
 
 	if (opts & RSPAMD_CONFIG_INIT_PRELOAD_MAPS) {
@@ -871,6 +922,79 @@ rspamd_config_post_load (struct rspamd_config *cfg,
 	return ret;
 }
 
+void
+rspamd_config_profile_phase (struct rspamd_config *cfg,
+		enum rspamd_config_load_phase_type type,
+		const gchar *name,
+		gdouble start)
+{
+	struct rspamd_config_load_phase ph;
+
+	ph.name = rspamd_mempool_strdup (cfg->cfg_pool, name);
+	ph.type = type;
+	ph.time = rspamd_get_ticks (FALSE) - start;
+	g_array_append_val (cfg->load_profile, ph);
+}
+
+const gchar *
+rspamd_config_phase_type_to_str (enum rspamd_config_load_phase_type type)
+{
+	switch (type) {
+	case RSPAMD_CONFIG_PHASE_CORE:
+		return "core";
+	case RSPAMD_CONFIG_PHASE_MODULE:
+		return "module";
+	case RSPAMD_CONFIG_PHASE_LUA_MODULE:
+		return "lua";
+	case RSPAMD_CONFIG_PHASE_MAP:
+		return "map";
+	}
+
+	return "unknown";
+}
+
+/* Modules and maps that are slower than this are always logged */
+#define RSPAMD_CONFIG_SLOW_PHASE 0.5
+
+void
+rspamd_config_profile_log (struct rspamd_config *cfg)
+{
+	struct rspamd_config_load_phase *ph;
+	GString *buf;
+	gdouble total = 0;
+	guint i;
+
+	if (cfg->load_profile->len == 0) {
+		return;
+	}
+
+	buf = g_string_sized_new (256);
+
+	for (i = 0; i < cfg->load_profile->len; i ++) {
+		ph = &g_array_index (cfg->load_profile,
+				struct rspamd_config_load_phase, i);
+
+		if (ph->type == RSPAMD_CONFIG_PHASE_CORE) {
+			total += ph->time;
+			rspamd_printf_gstring (buf, "%s%s: %.3f",
+					buf->len > 0 ? ", " : "", ph->name, ph->time);
+		}
+		else if (ph->time >= RSPAMD_CONFIG_SLOW_PHASE) {
+			msg_info_config ("slow config load of %s %s: %.3f seconds",
+					rspamd_config_phase_type_to_str (ph->type), ph->name,
+					ph->time);
+		}
+		else {
+			msg_debug_config ("config load of %s %s: %.3f seconds",
+					rspamd_config_phase_type_to_str (ph->type), ph->name,
+					ph->time);
+		}
+	}
+
+	msg_info_config ("config loaded in %.3f seconds (%v)", total, buf);
+	g_string_free (buf, TRUE);
+}
+
 #if 0
 void
 parse_err (const gchar *fmt, ...)
@@ -1075,6 +1199,7 @@ rspamd_config_new_worker (struct rspamd_config *cfg,
 		c->rlimit_nofile = 0;
 		c->rlimit_maxcore = 0;
 		c->enabled = TRUE;
+		c->numa_node = -1;
 
 		REF_INIT_RETAIN (c, rspamd_worker_conf_dtor);
 		rspamd_mempool_add_destructor (cfg->cfg_pool,
@@ -1467,18 +1592,27 @@ rspamd_init_filters (struct rspamd_config *cfg, bool reconfig)
 	module_t *mod, **pmod;
 	guint i = 0;
 	struct module_ctx *mod_ctx, *cur_ctx;
+	gdouble start, filters_start;
+	gboolean ret;
+
+	filters_start = rspamd_get_ticks (FALSE);
 
 	/* Init all compiled modules */
 
 	for (pmod = cfg->compiled_modules; pmod != NULL && *pmod != NULL; pmod ++) {
 		mod = *pmod;
 		if (rspamd_check_module (cfg, mod)) {
+			start = rspamd_get_ticks (FALSE);
+
 			if (mod->module_init_func (cfg, &mod_ctx) == 0) {
 				g_assert (mod_ctx != NULL);
 				g_ptr_array_add (cfg->c_modules, mod_ctx);
 				mod_ctx->mod = mod;
 				mod->ctx_offset = i ++;
 			}
+
+			rspamd_config_profile_phase (cfg, RSPAMD_CONFIG_PHASE_MODULE,
+					mod->name, start);
 		}
 	}
 
@@ -1499,6 +1633,7 @@ rspamd_init_filters (struct rspamd_config *cfg, bool reconfig)
 		if (mod_ctx) {
 			mod = mod_ctx->mod;
 			mod_ctx->enabled = rspamd_config_is_module_enabled (cfg, mod->name);
+			start = rspamd_get_ticks (FALSE);
 
 			if (reconfig) {
 				(void)mod->module_reconfig_func (cfg);
@@ -1507,6 +1642,9 @@ rspamd_init_filters (struct rspamd_config *cfg, bool reconfig)
 			else {
 				(void)mod->module_config_func (cfg);
 			}
+
+			rspamd_config_profile_phase (cfg, RSPAMD_CONFIG_PHASE_MODULE,
+					mod->name, start);
 		}
 
 		if (mod_ctx == NULL) {
@@ -1516,7 +1654,11 @@ rspamd_init_filters (struct rspamd_config *cfg, bool reconfig)
 		cur = g_list_next (cur);
 	}
 
-	return rspamd_init_lua_filters (cfg, 0);
+	ret = rspamd_init_lua_filters (cfg, 0);
+	rspamd_config_profile_phase (cfg, RSPAMD_CONFIG_PHASE_CORE,
+			"filters", filters_start);
+
+	return ret;
 }
 
 static void
@@ -58,6 +58,23 @@ enum rspamd_composite_action {
 	RSPAMD_COMPOSITE_REMOVE_FORCED = (1 << 2)
 };
 
+/*
+ * Reverse index from symbols to composites that reference them, so we
+ * evaluate only composites that might be matched for a task
+ */
+struct rspamd_composites_index {
+	GHashTable *by_symbol;
+	/* Composites that can match with no symbols or depend on other composites */
+	GPtrArray *always;
+};
+
+struct composites_index_cbdata {
+	struct rspamd_config *cfg;
+	struct rspamd_composites_index *idx;
+	struct rspamd_composite *comp;
+	gboolean always;
+};
+
 struct symbol_remove_data {
 	const gchar *sym;
 	struct rspamd_composite *comp;
@@ -466,6 +483,130 @@ composites_foreach_callback (gpointer key, gpointer value, void *data)
 }
 
 
+static void
+composites_index_add (struct rspamd_composites_index *idx,
+		const gchar *sym, struct rspamd_composite *comp)
+{
+	GPtrArray *comps;
+
+	comps = g_hash_table_lookup (idx->by_symbol, sym);
+
+	if (comps == NULL) {
+		comps = g_ptr_array_new ();
+		g_hash_table_insert (idx->by_symbol, (gpointer)sym, comps);
+	}
+
+	/* Atoms of the same composite are added sequentially */
+	if (comps->len == 0 ||
+			g_ptr_array_index (comps, comps->len - 1) != comp) {
+		g_ptr_array_add (comps, comp);
+	}
+}
+
+static void
+composites_index_atom_cb (const rspamd_ftok_t *atom, gpointer ud)
+{
+	struct composites_index_cbdata *cbd = ud;
+	struct rspamd_symbols_group *gr = NULL;
+	struct rspamd_symbol *sdef;
+	rspamd_ftok_t tok;
+	GHashTableIter it;
+	gpointer k, v;
+	gchar *sym;
+
+	tok.begin = atom->begin;
+	tok.len = atom->len;
+
+	/* Skip removal policy prefixes */
+	while (tok.len > 0 && !g_ascii_isalnum (*tok.begin)) {
+		tok.begin ++;
+		tok.len --;
+	}
+
+	if (tok.len == 0) {
+		return;
+	}
+
+	sym = rspamd_mempool_ftokdup (cbd->cfg->cfg_pool, &tok);
+
+	if (strncmp (sym, "g:", 2) == 0) {
+		gr = g_hash_table_lookup (cbd->cfg->groups, sym + 2);
+	}
+	else if (strncmp (sym, "g+:", 3) == 0 || strncmp (sym, "g-:", 3) == 0) {
+		gr = g_hash_table_lookup (cbd->cfg->groups, sym + 3);
+	}
+	else {
+		if (g_hash_table_lookup (cbd->cfg->composite_symbols, sym) != NULL) {
+			/* Dependent composites are not known before evaluation */
+			cbd->always = TRUE;
+		}
+
+		composites_index_add (cbd->idx, sym, cbd->comp);
+
+		return;
+	}
+
+	if (gr != NULL) {
+		g_hash_table_iter_init (&it, gr->symbols);
+
+		while (g_hash_table_iter_next (&it, &k, &v)) {
+			sdef = v;
+			composites_index_add (cbd->idx, sdef->name, cbd->comp);
+		}
+	}
+}
+
+static void
+composites_index_dtor (gpointer p)
+{
+	struct rspamd_composites_index *idx = p;
+
+	g_hash_table_unref (idx->by_symbol);
+	g_ptr_array_free (idx->always, TRUE);
+	g_free (idx);
+}
+
+static struct rspamd_composites_index *
+composites_get_index (struct rspamd_config *cfg)
+{
+	struct rspamd_composites_index *idx;
+	struct composites_index_cbdata cbd;
+	GHashTableIter it;
+	gpointer k, v;
+
+	if (cfg->composites_index) {
+		return cfg->composites_index;
+	}
+
+	idx = g_malloc0 (sizeof (*idx));
+	idx->by_symbol = g_hash_table_new_full (rspamd_str_hash, rspamd_str_equal,
+			NULL, rspamd_ptr_array_free_hard);
+	idx->always = g_ptr_array_new ();
+
+	g_hash_table_iter_init (&it, cfg->composite_symbols);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		memset (&cbd, 0, sizeof (cbd));
+		cbd.cfg = cfg;
+		cbd.idx = idx;
+		cbd.comp = v;
+
+		rspamd_expression_atom_foreach (cbd.comp->expr,
+				composites_index_atom_cb, &cbd);
+
+		/* Negations and comparisons might match when no atoms are found */
+		if (cbd.always ||
+				rspamd_expression_constant_value (cbd.comp->expr, 0) != 0) {
+			g_ptr_array_add (idx->always, cbd.comp);
+		}
+	}
+
+	rspamd_mempool_add_destructor (cfg->cfg_pool, composites_index_dtor, idx);
+	cfg->composites_index = idx;
+
+	return idx;
+}
+
 static void
 composites_remove_symbols (gpointer key, gpointer value, gpointer data)
 {
@@ -550,18 +691,61 @@ composites_metric_callback (struct rspamd_metric_result *metric_res,
 {
 	struct composites_data *cd =
 		rspamd_mempool_alloc (task->task_pool, sizeof (struct composites_data));
+	struct rspamd_composites_index *idx;
+	struct rspamd_symbol_result *sym;
+	struct rspamd_composite *comp;
+	GPtrArray *candidates, *comps;
+	guint8 *pending;
+	guint ncomposites, i;
 
+	ncomposites = g_hash_table_size (task->cfg->composite_symbols);
 	cd->task = task;
 	cd->metric_res = metric_res;
 	cd->symbols_to_remove = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
 	cd->checked =
-		rspamd_mempool_alloc0 (task->task_pool,
-			NBYTES (g_hash_table_size (task->cfg->composite_symbols) * 2));
+		rspamd_mempool_alloc0 (task->task_pool, NBYTES (ncomposites * 2));
+
+	/*
+	 * Select composites that reference any of the found symbols; composites
+	 * are inserted to the result when processed, so collect them first
+	 */
+	idx = composites_get_index (task->cfg);
+	pending = rspamd_mempool_alloc0 (task->task_pool, NBYTES (ncomposites));
+	candidates = g_ptr_array_sized_new (idx->always->len + 16);
+
+	kh_foreach_value_ptr (metric_res->symbols, sym, {
+		comps = g_hash_table_lookup (idx->by_symbol, sym->name);
+
+		if (comps) {
+			for (i = 0; i < comps->len; i ++) {
+				comp = g_ptr_array_index (comps, i);
+
+				if (isclr (pending, comp->id)) {
+					setbit (pending, comp->id);
+					g_ptr_array_add (candidates, comp);
+				}
+			}
+		}
+	});
+
+	for (i = 0; i < idx->always->len; i ++) {
+		comp = g_ptr_array_index (idx->always, i);
+
+		if (isclr (pending, comp->id)) {
+			setbit (pending, comp->id);
+			g_ptr_array_add (candidates, comp);
+		}
+	}
+
+	msg_debug_composites ("check %ud composites of %ud", candidates->len,
+			ncomposites);
+
+	for (i = 0; i < candidates->len; i ++) {
+		comp = g_ptr_array_index (candidates, i);
+		composites_foreach_callback ((gpointer)comp->sym, comp, cd);
+	}
 
-	/* Process hash table */
-	g_hash_table_foreach (task->cfg->composite_symbols,
-		composites_foreach_callback,
-		cd);
+	g_ptr_array_free (candidates, TRUE);
 
 	/* Remove symbols that are in composites */
 	g_hash_table_foreach (cd->symbols_to_remove, composites_remove_symbols, cd);
@@ -1848,8 +1848,130 @@ end:
 	return p;
 }
 
+/* Appends body converting all CR and LF to CRLF */
+static void
+rspamd_dkim_canon_simple_append (GString *out, const gchar *p,
+		const gchar *end)
+{
+	gsize run;
+
+	while (p < end) {
+		run = rspamd_memcspn (p, "\r\n", end - p);
+		g_string_append_len (out, p, run);
+		p += run;
+
+		if (p == end) {
+			break;
+		}
+
+		g_string_append_len (out, CRLF, sizeof (CRLF) - 1);
+
+		if (*p == '\r' && p + 1 < end && p[1] == '\n') {
+			p += 2;
+		}
+		else {
+			p ++;
+		}
+	}
+}
+
+/*
+ * Appends body converting line endings as simple canonicalization does,
+ * folding runs of spaces to a single space and removing them at the end of
+ * lines. Runs of other characters are copied as is
+ */
+static void
+rspamd_dkim_canon_relaxed_append (GString *out, const gchar *p,
+		const gchar *end)
+{
+	gsize run;
+
+	while (p < end) {
+		run = rspamd_memcspn (p, " \t\v\f\r\n", end - p);
+		g_string_append_len (out, p, run);
+		p += run;
+
+		if (p == end) {
+			break;
+		}
+
+		if (*p == '\r' || *p == '\n') {
+			g_string_append_len (out, CRLF, sizeof (CRLF) - 1);
+
+			if (*p == '\r' && p + 1 < end && p[1] == '\n') {
+				p += 2;
+			}
+			else {
+				p ++;
+			}
+		}
+		else {
+			p += rspamd_memspn (p, " \t\v\f", end - p);
+
+			if (p == end || (*p != '\r' && *p != '\n')) {
+				g_string_append_c (out, ' ');
+			}
+		}
+	}
+}
+
+/*
+ * Returns canonicalized body of the task, it is built once per type of
+ * canonicalization and shared by all signatures with no body length limit
+ */
+static GString *
+rspamd_dkim_get_canon_body (struct rspamd_task *task,
+		const gchar *start,
+		const gchar *end,
+		gint type,
+		gboolean sign)
+{
+	gchar varbuf[64];
+	const gchar *p;
+	gboolean need_crlf = FALSE;
+	GString *out;
+
+	rspamd_snprintf (varbuf, sizeof (varbuf),
+			RSPAMD_MEMPOOL_DKIM_BH_CACHE "_canon_%d_%d",
+			type, !!sign);
+	out = rspamd_mempool_get_variable (task->task_pool, varbuf);
+
+	if (out) {
+		return out;
+	}
+
+	out = g_string_sized_new (end - start + sizeof (CRLF));
+	p = rspamd_dkim_skip_empty_lines (start, end, type, sign, &need_crlf);
+	end = p + 1;
+
+	if (end == start) {
+		/* Empty body */
+		if (type == DKIM_CANON_SIMPLE) {
+			g_string_append_len (out, CRLF, sizeof (CRLF) - 1);
+		}
+	}
+	else {
+		if (type == DKIM_CANON_SIMPLE) {
+			rspamd_dkim_canon_simple_append (out, start, end);
+		}
+		else {
+			rspamd_dkim_canon_relaxed_append (out, start, end);
+		}
+
+		if (need_crlf) {
+			g_string_append_len (out, CRLF, sizeof (CRLF) - 1);
+		}
+	}
+
+	rspamd_mempool_set_variable (task->task_pool, varbuf, out,
+			rspamd_gstring_free_hard);
+
+	return out;
+}
+
 static gboolean
 rspamd_dkim_canonize_body (struct rspamd_dkim_common_ctx *ctx,
+	struct rspamd_task *task,
 	const gchar *start,
 	const gchar *end,
 	gboolean sign)
@@ -1857,6 +1979,17 @@ rspamd_dkim_canonize_body (struct rspamd_dkim_common_ctx *ctx,
 	const gchar *p;
 	guint remain = ctx->len ? ctx->len : (guint)(end - start);
 	gboolean need_crlf = FALSE;
+	GString *canon;
+
+	if (start != NULL && ctx->len == 0) {
+		canon = rspamd_dkim_get_canon_body (task, start, end,
+				ctx->body_canon_type, sign);
+		EVP_DigestUpdate (ctx->body_hash, canon->str, canon->len);
+		msg_debug_dkim ("update signature with canonicalized body "
+				"(%z size)", canon->len);
+
+		return TRUE;
+	}
 
 	if (start == NULL) {
 		/* Empty body */
@@ -2125,7 +2258,7 @@ rspamd_dkim_canonize_header (struct rspamd_dkim_common_ctx *ctx,
 	GPtrArray *ar;
 
 	if (dkim_header == NULL) {
-		ar = g_hash_table_lookup (task->raw_headers, header_name);
+		ar = rspamd_message_get_header_array (task, header_name, FALSE);
 
 		if (ar) {
 			/* Check uniqueness of the header */
@@ -2178,7 +2311,7 @@ rspamd_dkim_canonize_header (struct rspamd_dkim_common_ctx *ctx,
 			/* We need to find our own signature and use it */
 			guint i;
 
-			ar = g_hash_table_lookup (task->raw_headers, header_name);
+			ar = rspamd_message_get_header_array (task, header_name, FALSE);
 
 			if (ar) {
 				/* We need to find our own signature */
@@ -2187,8 +2320,10 @@ rspamd_dkim_canonize_header (struct rspamd_dkim_common_ctx *ctx,
 				}
 
 				PTR_ARRAY_FOREACH (ar, i, rh) {
-					guint64 th = rspamd_cryptobox_fast_hash (rh->decoded,
-							strlen (rh->decoded), rspamd_hash_seed ());
+					const gchar *decoded = rspamd_mime_header_get_decoded (
+							task->task_pool, rh);
+					guint64 th = rspamd_cryptobox_fast_hash (decoded,
+							strlen (decoded), rspamd_hash_seed ());
 
 					if (th == ctx->sig_hash) {
 						rspamd_dkim_signature_update (ctx, rh->raw_value,
@@ -2289,8 +2424,8 @@ rspamd_dkim_check (rspamd_dkim_context_t *ctx,
 
 		if (!cached_bh->digest_normal) {
 			/* Start canonization of body part */
-			if (!rspamd_dkim_canonize_body (&ctx->common, body_start, body_end,
-					FALSE)) {
+			if (!rspamd_dkim_canonize_body (&ctx->common, task,
+					body_start, body_end, FALSE)) {
 				return DKIM_RECORD_ERROR;
 			}
 		}
@@ -2538,6 +2673,43 @@ rspamd_dkim_key_get_ttl (rspamd_dkim_key_t *k)
 	return 0;
 }
 
+gsize
+rspamd_dkim_key_serialize (rspamd_dkim_key_t *key, guchar *out, gsize outlen)
+{
+	/* Key type followed by decoded key data */
+	if (key->decoded_len + 1 > outlen) {
+		return 0;
+	}
+
+	out[0] = key->type;
+	memcpy (out + 1, key->keydata, key->decoded_len);
+
+	return key->decoded_len + 1;
+}
+
+rspamd_dkim_key_t *
+rspamd_dkim_key_deserialize (const guchar *in, gsize inlen, GError **err)
+{
+	rspamd_dkim_key_t *key;
+	gchar *b64;
+	gsize b64len;
+
+	if (inlen < 2 || in[0] > RSPAMD_DKIM_KEY_EDDSA) {
+		g_set_error (err,
+				DKIM_ERROR,
+				DKIM_SIGERROR_KEYFAIL,
+				"invalid serialized DKIM key");
+
+		return NULL;
+	}
+
+	b64 = rspamd_encode_base64 (in + 1, inlen - 1, 0, &b64len);
+	key = rspamd_dkim_make_key (b64, b64len, in[0], err);
+	g_free (b64);
+
+	return key;
+}
+
 const gchar*
 rspamd_dkim_get_dns_key (rspamd_dkim_context_t *ctx)
 {
@@ -2813,8 +2985,8 @@ rspamd_dkim_sign (struct rspamd_task *task, const gchar *selector,
 
 		if (!cached_bh->digest_normal) {
 			/* Start canonization of body part */
-			if (!rspamd_dkim_canonize_body (&ctx->common, body_start, body_end,
-					TRUE)) {
+			if (!rspamd_dkim_canonize_body (&ctx->common, task,
+					body_start, body_end, TRUE)) {
 				return NULL;
 			}
 		}
@@ -2871,7 +3043,7 @@ rspamd_dkim_sign (struct rspamd_task *task, const gchar *selector,
 			GPtrArray *ar;
 			guint count = 0;
 
-			ar = g_hash_table_lookup (task->raw_headers, dh->name);
+			ar = rspamd_message_get_header_array (task, dh->name, FALSE);
 
 			if (ar) {
 				count = ar->len;
@@ -2896,7 +3068,7 @@ rspamd_dkim_sign (struct rspamd_task *task, const gchar *selector,
 			}
 		}
 		else {
-			if (g_hash_table_lookup (task->raw_headers, dh->name)) {
+			if (rspamd_message_get_header_array (task, dh->name, FALSE)) {
 				if (hstat.s.count > 0) {
 
 					cur_len = (strlen (dh->name) + 1) * (hstat.s.count);
@@ -247,6 +247,26 @@ rspamd_dkim_key_t * rspamd_dkim_make_key (const gchar *keydata, guint keylen,
 rspamd_dkim_key_t * rspamd_dkim_parse_key (const gchar *txt, gsize *keylen,
 										   GError **err);
 
+/**
+ * Write public key in a compact binary form suitable for caches
+ * @param key
+ * @param out output buffer
+ * @param outlen size of buffer
+ * @return length of data written or 0 if buffer is too short
+ */
+gsize rspamd_dkim_key_serialize (rspamd_dkim_key_t *key, guchar *out,
+								 gsize outlen);
+
+/**
+ * Create public key from data written by rspamd_dkim_key_serialize
+ * @param in
+ * @param inlen
+ * @param err
+ * @return
+ */
+rspamd_dkim_key_t * rspamd_dkim_key_deserialize (const guchar *in, gsize inlen,
+												 GError **err);
+
 /**
  * Canonocalise header using relaxed algorithm
  * @param hname
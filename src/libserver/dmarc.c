@@ -0,0 +1,348 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "rspamd.h"
+#include "dmarc.h"
+#include "dns.h"
+#include "task.h"
+#include "utlist.h"
+#include "libutil/hash.h"
+
+#define RSPAMD_DMARC_CACHE_SIZE 8192
+/* We have no SOA minimum here, so absent records are cached for this time */
+#define RSPAMD_DMARC_NEGATIVE_TTL 300
+#define RSPAMD_DMARC_SEP(c) ((c) == ';' || (c) == '\\')
+
+struct rspamd_dmarc_lookup_cbdata {
+	struct rspamd_task *task;
+	gchar *domain;
+	rspamd_dmarc_lookup_cb cb;
+	gpointer ud;
+};
+
+/* Parsed records for `_dmarc.<domain>` keyed by lowercased domain */
+static rspamd_lru_hash_t *dmarc_cache = NULL;
+
+static void
+rspamd_dmarc_record_free (struct rspamd_dmarc_record *rec)
+{
+	g_free (rec->rua);
+	g_free (rec->sp);
+	g_free (rec->error);
+	g_free (rec);
+}
+
+static void
+rspamd_dmarc_lookup_free (struct rspamd_dmarc_lookup *res)
+{
+	guint i;
+	struct rspamd_dmarc_record *rec;
+
+	PTR_ARRAY_FOREACH (res->records, i, rec) {
+		REF_RELEASE (rec);
+	}
+
+	g_ptr_array_free (res->records, TRUE);
+	g_free (res);
+}
+
+static void
+rspamd_dmarc_lookup_unref (gpointer p)
+{
+	struct rspamd_dmarc_lookup *res = p;
+
+	REF_RELEASE (res);
+}
+
+static enum rspamd_dmarc_policy
+rspamd_dmarc_parse_policy (const gchar *val, gsize len)
+{
+	if (len == sizeof ("none") - 1 && memcmp (val, "none", len) == 0) {
+		return RSPAMD_DMARC_POLICY_NONE;
+	}
+	else if (len == sizeof ("quarantine") - 1 &&
+			memcmp (val, "quarantine", len) == 0) {
+		return RSPAMD_DMARC_POLICY_QUARANTINE;
+	}
+	else if (len == sizeof ("reject") - 1 && memcmp (val, "reject", len) == 0) {
+		return RSPAMD_DMARC_POLICY_REJECT;
+	}
+
+	return RSPAMD_DMARC_POLICY_INVALID;
+}
+
+/*
+ * Checks `adkim` and `aspf` value, returns FALSE if it is invalid
+ */
+static gboolean
+rspamd_dmarc_parse_alignment (const gchar *val, gsize len, gboolean *strict)
+{
+	if (len == 1 && *val == 's') {
+		*strict = TRUE;
+
+		return TRUE;
+	}
+
+	return len == 1 && *val == 'r';
+}
+
+#define TAG_IS(t) (namelen == sizeof (t) - 1 && memcmp (name, (t), namelen) == 0)
+
+struct rspamd_dmarc_record *
+rspamd_dmarc_parse_record (const gchar *txt, gsize len)
+{
+	const gchar *p = txt, *end = txt + len, *name, *val;
+	const gchar *adkim = NULL, *aspf = NULL, *policy = NULL, *sp = NULL,
+		*pct = NULL, *rua = NULL;
+	gsize namelen, vallen, adkim_len = 0, aspf_len = 0, policy_len = 0,
+		sp_len = 0, pct_len = 0, rua_len = 0;
+	struct rspamd_dmarc_record *rec;
+	glong pct_val;
+
+#define SKIP_SPACES() do { while (p < end && g_ascii_isspace (*p)) { p ++; } } while (0)
+
+	/* v=DMARC1 followed by a separator */
+	if (p == end || *p != 'v') {
+		return NULL;
+	}
+
+	p ++;
+	SKIP_SPACES ();
+
+	if (p == end || *p != '=') {
+		return NULL;
+	}
+
+	p ++;
+	SKIP_SPACES ();
+
+	if (end - p < (gssize)(sizeof ("DMARC1") - 1) ||
+			memcmp (p, "DMARC1", sizeof ("DMARC1") - 1) != 0) {
+		return NULL;
+	}
+
+	p += sizeof ("DMARC1") - 1;
+	SKIP_SPACES ();
+
+	if (p == end || !RSPAMD_DMARC_SEP (*p)) {
+		return NULL;
+	}
+
+	p ++;
+	SKIP_SPACES ();
+
+	/* tag = value pairs, the last duplicate wins, unparsed tail is ignored */
+	while (p < end) {
+		name = p;
+
+		while (p < end && g_ascii_isalpha (*p)) {
+			p ++;
+		}
+
+		namelen = p - name;
+
+		if (namelen == 0) {
+			break;
+		}
+
+		SKIP_SPACES ();
+
+		if (p == end || *p != '=') {
+			break;
+		}
+
+		p ++;
+		SKIP_SPACES ();
+		val = p;
+
+		while (p < end && g_ascii_isgraph (*p) && !RSPAMD_DMARC_SEP (*p)) {
+			p ++;
+		}
+
+		vallen = p - val;
+
+		if (vallen == 0) {
+			break;
+		}
+
+		if (TAG_IS ("adkim")) {
+			adkim = val;
+			adkim_len = vallen;
+		}
+		else if (TAG_IS ("aspf")) {
+			aspf = val;
+			aspf_len = vallen;
+		}
+		else if (TAG_IS ("p")) {
+			policy = val;
+			policy_len = vallen;
+		}
+		else if (TAG_IS ("sp")) {
+			sp = val;
+			sp_len = vallen;
+		}
+		else if (TAG_IS ("pct")) {
+			pct = val;
+			pct_len = vallen;
+		}
+		else if (TAG_IS ("rua")) {
+			rua = val;
+			rua_len = vallen;
+		}
+
+		if (p < end && RSPAMD_DMARC_SEP (*p)) {
+			p ++;
+			SKIP_SPACES ();
+		}
+	}
+
+#undef SKIP_SPACES
+
+	rec = g_malloc0 (sizeof (*rec));
+	REF_INIT_RETAIN (rec, rspamd_dmarc_record_free);
+	rec->pct = -1;
+
+	if (adkim && !rspamd_dmarc_parse_alignment (adkim, adkim_len,
+			&rec->strict_dkim)) {
+		rec->error = g_strdup_printf ("adkim tag has invalid value: %.*s",
+				(gint)adkim_len, adkim);
+	}
+	else if (aspf && !rspamd_dmarc_parse_alignment (aspf, aspf_len,
+			&rec->strict_spf)) {
+		rec->error = g_strdup_printf ("aspf tag has invalid value: %.*s",
+				(gint)aspf_len, aspf);
+	}
+	else if (policy) {
+		rec->policy = rspamd_dmarc_parse_policy (policy, policy_len);
+
+		if (rec->policy == RSPAMD_DMARC_POLICY_INVALID) {
+			rec->error = g_strdup_printf ("p tag has invalid value: %.*s",
+					(gint)policy_len, policy);
+		}
+	}
+
+	if (sp) {
+		rec->subdomain_policy = rspamd_dmarc_parse_policy (sp, sp_len);
+		rec->sp = g_strndup (sp, sp_len);
+	}
+
+	if (pct && rspamd_strtol (pct, pct_len, &pct_val) && pct_val >= 0) {
+		rec->pct = pct_val;
+	}
+
+	if (rua) {
+		rec->rua = g_strndup (rua, rua_len);
+	}
+
+	return rec;
+}
+
+#undef TAG_IS
+
+static void
+rspamd_dmarc_dns_cb (struct rdns_reply *reply, gpointer ud)
+{
+	struct rspamd_dmarc_lookup_cbdata *cbd = ud;
+	struct rspamd_dmarc_lookup *res;
+	struct rspamd_dmarc_record *rec;
+	struct rdns_reply_entry *elt;
+	guint ttl = G_MAXUINT;
+
+	res = g_malloc0 (sizeof (*res));
+	REF_INIT_RETAIN (res, rspamd_dmarc_lookup_free);
+	res->records = g_ptr_array_new ();
+	res->rcode = reply->code;
+
+	if (reply->code == RDNS_RC_NOERROR) {
+		LL_FOREACH (reply->entries, elt) {
+			if (elt->type == RDNS_REQUEST_TXT) {
+				ttl = MIN (ttl, elt->ttl);
+				rec = rspamd_dmarc_parse_record (elt->content.txt.data,
+						strlen (elt->content.txt.data));
+
+				if (rec) {
+					g_ptr_array_add (res->records, rec);
+				}
+			}
+		}
+	}
+	else if (reply->code == RDNS_RC_NXDOMAIN || reply->code == RDNS_RC_NOREC) {
+		ttl = RSPAMD_DMARC_NEGATIVE_TTL;
+	}
+	else {
+		/* Temporary failure, do not cache */
+		ttl = 0;
+	}
+
+	if (ttl > 0 && ttl != G_MAXUINT) {
+		gchar *key = g_strdup (cbd->domain);
+
+		rspamd_str_lc (key, strlen (key));
+		REF_RETAIN (res);
+		rspamd_lru_hash_insert (dmarc_cache, key, res,
+				cbd->task->tv.tv_sec, ttl);
+	}
+
+	cbd->cb (res, cbd->domain, cbd->ud);
+	REF_RELEASE (res);
+}
+
+gboolean
+rspamd_dmarc_lookup (struct rspamd_task *task,
+		const gchar *domain,
+		rspamd_dmarc_lookup_cb cb,
+		gpointer ud)
+{
+	struct rspamd_dmarc_lookup_cbdata *cbd;
+	struct rspamd_dmarc_lookup *res;
+	gchar *key, *dns_name;
+	gsize dlen;
+
+	g_assert (domain != NULL);
+
+	if (dmarc_cache == NULL) {
+		dmarc_cache = rspamd_lru_hash_new (RSPAMD_DMARC_CACHE_SIZE,
+				g_free, rspamd_dmarc_lookup_unref);
+	}
+
+	dlen = strlen (domain);
+	key = g_alloca (dlen + 1);
+	rspamd_strlcpy (key, domain, dlen + 1);
+	rspamd_str_lc (key, dlen);
+	res = rspamd_lru_hash_lookup (dmarc_cache, key, task->tv.tv_sec);
+
+	if (res) {
+		msg_debug_task ("got cached DMARC records for %s", domain);
+		REF_RETAIN (res);
+		cb (res, domain, ud);
+		REF_RELEASE (res);
+
+		return TRUE;
+	}
+
+	cbd = rspamd_mempool_alloc (task->task_pool, sizeof (*cbd));
+	cbd->task = task;
+	cbd->domain = rspamd_mempool_strdup (task->task_pool, domain);
+	cbd->cb = cb;
+	cbd->ud = ud;
+	dns_name = rspamd_mempool_alloc (task->task_pool,
+			dlen + sizeof ("_dmarc."));
+	rspamd_snprintf (dns_name, dlen + sizeof ("_dmarc."), "_dmarc.%s", domain);
+
+	return make_dns_request_task_forced (task,
+			rspamd_dmarc_dns_cb,
+			cbd,
+			RDNS_REQUEST_TXT,
+			dns_name);
+}
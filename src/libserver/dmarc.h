@@ -0,0 +1,83 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef RSPAMD_DMARC_H
+#define RSPAMD_DMARC_H
+
+#include "config.h"
+#include "dns.h"
+#include "ref.h"
+
+struct rspamd_task;
+
+enum rspamd_dmarc_policy {
+	RSPAMD_DMARC_POLICY_UNSET = 0,
+	RSPAMD_DMARC_POLICY_NONE,
+	RSPAMD_DMARC_POLICY_QUARANTINE,
+	RSPAMD_DMARC_POLICY_REJECT,
+	RSPAMD_DMARC_POLICY_INVALID,
+};
+
+/*
+ * Parsed `v=DMARC1` record, tags with invalid values are kept so the caller
+ * can decide whether they are fatal (e.g. `sp` is used for organisational
+ * domains only)
+ */
+struct rspamd_dmarc_record {
+	enum rspamd_dmarc_policy policy;
+	enum rspamd_dmarc_policy subdomain_policy;
+	gboolean strict_dkim;
+	gboolean strict_spf;
+	gint pct; /* -1 if not specified */
+	gchar *rua;
+	gchar *sp; /* raw sp value */
+	gchar *error; /* invalid adkim, aspf or p tag */
+	ref_entry_t ref;
+};
+
+/*
+ * Result of `_dmarc.<domain>` lookup shared by the cache
+ */
+struct rspamd_dmarc_lookup {
+	GPtrArray *records; /* rspamd_dmarc_record, garbage records are skipped */
+	enum dns_rcode rcode;
+	ref_entry_t ref;
+};
+
+typedef void (*rspamd_dmarc_lookup_cb) (struct rspamd_dmarc_lookup *res,
+		const gchar *domain, gpointer ud);
+
+/**
+ * Parses DMARC record
+ * @param txt record text
+ * @param len length of the text
+ * @return new record or NULL if the text is not a DMARC record
+ */
+struct rspamd_dmarc_record *rspamd_dmarc_parse_record (const gchar *txt,
+		gsize len);
+
+/**
+ * Looks up DMARC records for the domain using per process cache of parsed
+ * records, absent records are cached as well. Callback is called
+ * synchronously on cache hit; temporary DNS failures are not cached
+ * @return FALSE if DNS request cannot be made
+ */
+gboolean rspamd_dmarc_lookup (struct rspamd_task *task,
+		const gchar *domain,
+		rspamd_dmarc_lookup_cb cb,
+		gpointer ud);
+
+#define rspamd_dmarc_record_ref(rec) REF_RETAIN (rec)
+#define rspamd_dmarc_record_unref(rec) REF_RELEASE (rec)
+
+#endif
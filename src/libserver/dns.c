@@ -23,6 +23,8 @@
 #include "uthash.h"
 #include "rdns_event.h"
 #include "unix-std.h"
+#include "libutil/shared_cache.h"
+#include "libutil/timer_wheel.h"
 
 static const gchar *M = "rspamd dns";
 
@@ -46,6 +48,62 @@ static struct rdns_upstream_context rspamd_ups_ctx = {
 		.data = NULL
 };
 
+static bool rspamd_dns_cache_lookup (const char *name, size_t len,
+		enum rdns_request_type type,
+		enum dns_rcode *rcode, struct rdns_reply_entry **entries,
+		void *cache_data);
+static void rspamd_dns_cache_store (const char *name, size_t len,
+		enum rdns_request_type type,
+		struct rdns_reply *reply, void *cache_data);
+
+static struct rdns_cache_context rspamd_dns_cache_ctx = {
+		.lookup = rspamd_dns_cache_lookup,
+		.store = rspamd_dns_cache_store,
+		.data = NULL
+};
+
+/* Serialised replies larger than this are not cached */
+#define RSPAMD_DNS_CACHE_VALUE_LEN 1024
+
+/* Record types with their own statistics, the last element is for others */
+static const enum rdns_request_type rspamd_dns_cache_types[] = {
+		RDNS_REQUEST_A,
+		RDNS_REQUEST_AAAA,
+		RDNS_REQUEST_PTR,
+		RDNS_REQUEST_MX,
+		RDNS_REQUEST_TXT,
+		RDNS_REQUEST_NS,
+		RDNS_REQUEST_SOA,
+		RDNS_REQUEST_SRV,
+		RDNS_REQUEST_SPF,
+		RDNS_REQUEST_TLSA,
+};
+#define RSPAMD_DNS_CACHE_NTYPES (G_N_ELEMENTS (rspamd_dns_cache_types) + 1)
+
+struct rspamd_dns_cache_type_stat {
+	guint64 hits;
+	guint64 misses;
+	guint64 stores;
+};
+
+struct rspamd_dns_cache {
+	rspamd_shared_cache_t *cache;
+	struct rspamd_dns_cache_type_stat *stat; /* in shared memory */
+	guint negative_ttl;
+};
+
+/* Serialised reply: header followed by entries */
+struct rspamd_dns_cache_hdr {
+	guint8 rcode;
+	guint8 authenticated;
+	guint16 nentries;
+};
+
+struct rspamd_dns_cache_entry_hdr {
+	guint16 type;
+	guint16 len;
+};
+
 struct rspamd_dns_request_ud {
 	struct rspamd_async_session *session;
 	dns_callback_type cb;
@@ -55,8 +113,526 @@ struct rspamd_dns_request_ud {
 	struct rspamd_symcache_item *item;
 	struct rdns_request *req;
 	struct rdns_reply *reply;
+	struct rspamd_async_event *async_ev;
 };
 
+static guint
+rspamd_dns_cache_type_idx (enum rdns_request_type type)
+{
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (rspamd_dns_cache_types); i ++) {
+		if (rspamd_dns_cache_types[i] == type) {
+			return i;
+		}
+	}
+
+	return G_N_ELEMENTS (rspamd_dns_cache_types);
+}
+
+#ifndef HAVE_ATOMIC_BUILTINS
+#define RSPAMD_DNS_CACHE_STAT_INC(dc, type, field) \
+	(dc)->stat[rspamd_dns_cache_type_idx (type)].field ++
+#else
+#define RSPAMD_DNS_CACHE_STAT_INC(dc, type, field) \
+	__atomic_add_fetch (&(dc)->stat[rspamd_dns_cache_type_idx (type)].field, \
+		1, __ATOMIC_RELEASE)
+#endif
+
+static gsize
+rspamd_dns_cache_key (gchar *key, const char *name, size_t len,
+		enum rdns_request_type type)
+{
+	gint r;
+
+	r = rspamd_snprintf (key, RSPAMD_SHARED_CACHE_KEY_LEN + 1, "%d:%*s",
+			(gint)type, (gint)len, name);
+
+	if (r <= 0 || r >= RSPAMD_SHARED_CACHE_KEY_LEN) {
+		return 0;
+	}
+
+	/* DNS names are case insensitive */
+	rspamd_str_lc (key, r);
+
+	return r;
+}
+
+static gboolean
+rspamd_dns_cache_append (guchar *buf, gsize *pos, gconstpointer data, gsize len)
+{
+	if (*pos + len > RSPAMD_DNS_CACHE_VALUE_LEN) {
+		return FALSE;
+	}
+
+	memcpy (buf + *pos, data, len);
+	*pos += len;
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_dns_cache_append_u16 (guchar *buf, gsize *pos, guint16 val)
+{
+	return rspamd_dns_cache_append (buf, pos, &val, sizeof (val));
+}
+
+static gboolean
+rspamd_dns_cache_append_u32 (guchar *buf, gsize *pos, guint32 val)
+{
+	return rspamd_dns_cache_append (buf, pos, &val, sizeof (val));
+}
+
+static gboolean
+rspamd_dns_cache_append_str (guchar *buf, gsize *pos, const gchar *s)
+{
+	return s != NULL && rspamd_dns_cache_append (buf, pos, s, strlen (s));
+}
+
+/* Returns length of serialised reply or 0 if it cannot be cached */
+static gsize
+rspamd_dns_cache_serialize (struct rdns_reply *reply, guchar *buf)
+{
+	struct rspamd_dns_cache_hdr hdr;
+	struct rspamd_dns_cache_entry_hdr ehdr;
+	struct rdns_reply_entry *entry;
+	gsize pos = sizeof (hdr), epos;
+	gboolean ret;
+
+	memset (&hdr, 0, sizeof (hdr));
+	hdr.rcode = reply->code;
+	hdr.authenticated = reply->authenticated;
+
+	LL_FOREACH (reply->entries, entry) {
+		epos = pos;
+		pos += sizeof (ehdr);
+
+		if (pos > RSPAMD_DNS_CACHE_VALUE_LEN) {
+			return 0;
+		}
+
+		switch (entry->type) {
+		case RDNS_REQUEST_A:
+			ret = rspamd_dns_cache_append (buf, &pos, &entry->content.a.addr,
+					sizeof (entry->content.a.addr));
+			break;
+		case RDNS_REQUEST_AAAA:
+			ret = rspamd_dns_cache_append (buf, &pos, &entry->content.aaa.addr,
+					sizeof (entry->content.aaa.addr));
+			break;
+		case RDNS_REQUEST_PTR:
+			ret = rspamd_dns_cache_append_str (buf, &pos,
+					entry->content.ptr.name);
+			break;
+		case RDNS_REQUEST_NS:
+			ret = rspamd_dns_cache_append_str (buf, &pos,
+					entry->content.ns.name);
+			break;
+		case RDNS_REQUEST_TXT:
+		case RDNS_REQUEST_SPF:
+			ret = rspamd_dns_cache_append_str (buf, &pos,
+					entry->content.txt.data);
+			break;
+		case RDNS_REQUEST_MX:
+			ret = rspamd_dns_cache_append_u16 (buf, &pos,
+					entry->content.mx.priority) &&
+					rspamd_dns_cache_append_str (buf, &pos,
+							entry->content.mx.name);
+			break;
+		case RDNS_REQUEST_SRV:
+			ret = rspamd_dns_cache_append_u16 (buf, &pos,
+					entry->content.srv.priority) &&
+					rspamd_dns_cache_append_u16 (buf, &pos,
+							entry->content.srv.weight) &&
+					rspamd_dns_cache_append_u16 (buf, &pos,
+							entry->content.srv.port) &&
+					rspamd_dns_cache_append_str (buf, &pos,
+							entry->content.srv.target);
+			break;
+		case RDNS_REQUEST_SOA:
+			ret = rspamd_dns_cache_append_u32 (buf, &pos,
+					entry->content.soa.serial) &&
+					rspamd_dns_cache_append_u32 (buf, &pos,
+							entry->content.soa.refresh) &&
+					rspamd_dns_cache_append_u32 (buf, &pos,
+							entry->content.soa.retry) &&
+					rspamd_dns_cache_append_u32 (buf, &pos,
+							entry->content.soa.expire) &&
+					rspamd_dns_cache_append_u32 (buf, &pos,
+							entry->content.soa.minimum) &&
+					rspamd_dns_cache_append_str (buf, &pos,
+							entry->content.soa.mname) &&
+					rspamd_dns_cache_append (buf, &pos, "", 1) &&
+					rspamd_dns_cache_append_str (buf, &pos,
+							entry->content.soa.admin);
+			break;
+		case RDNS_REQUEST_TLSA:
+			ret = rspamd_dns_cache_append (buf, &pos,
+					&entry->content.tlsa.usage, 1) &&
+					rspamd_dns_cache_append (buf, &pos,
+							&entry->content.tlsa.selector, 1) &&
+					rspamd_dns_cache_append (buf, &pos,
+							&entry->content.tlsa.match_type, 1) &&
+					rspamd_dns_cache_append (buf, &pos,
+							entry->content.tlsa.data,
+							entry->content.tlsa.datalen);
+			break;
+		default:
+			ret = FALSE;
+			break;
+		}
+
+		if (!ret || hdr.nentries == G_MAXUINT16) {
+			return 0;
+		}
+
+		ehdr.type = entry->type;
+		ehdr.len = pos - epos - sizeof (ehdr);
+		memcpy (buf + epos, &ehdr, sizeof (ehdr));
+		hdr.nentries ++;
+	}
+
+	memcpy (buf, &hdr, sizeof (hdr));
+
+	return pos;
+}
+
+static gchar *
+rspamd_dns_cache_strdup (const guchar *p, gsize len)
+{
+	gchar *res;
+
+	res = malloc (len + 1);
+	g_assert (res != NULL);
+	memcpy (res, p, len);
+	res[len] = '\0';
+
+	return res;
+}
+
+static void
+rspamd_dns_cache_free_entries (struct rdns_reply_entry *entries)
+{
+	struct rdns_reply_entry *entry, *tmp;
+
+	DL_FOREACH_SAFE (entries, entry, tmp) {
+		switch (entry->type) {
+		case RDNS_REQUEST_PTR:
+			free (entry->content.ptr.name);
+			break;
+		case RDNS_REQUEST_NS:
+			free (entry->content.ns.name);
+			break;
+		case RDNS_REQUEST_MX:
+			free (entry->content.mx.name);
+			break;
+		case RDNS_REQUEST_TXT:
+		case RDNS_REQUEST_SPF:
+			free (entry->content.txt.data);
+			break;
+		case RDNS_REQUEST_SRV:
+			free (entry->content.srv.target);
+			break;
+		case RDNS_REQUEST_TLSA:
+			free (entry->content.tlsa.data);
+			break;
+		case RDNS_REQUEST_SOA:
+			free (entry->content.soa.mname);
+			free (entry->content.soa.admin);
+			break;
+		default:
+			break;
+		}
+
+		free (entry);
+	}
+}
+
+static gsize
+rspamd_dns_cache_min_len (enum rdns_request_type type)
+{
+	switch (type) {
+	case RDNS_REQUEST_A:
+		return sizeof (struct in_addr);
+	case RDNS_REQUEST_AAAA:
+		return sizeof (struct in6_addr);
+	case RDNS_REQUEST_MX:
+		return sizeof (guint16);
+	case RDNS_REQUEST_SRV:
+		return sizeof (guint16) * 3;
+	case RDNS_REQUEST_SOA:
+		/* Numbers and separator of names */
+		return sizeof (guint32) * 5 + 1;
+	case RDNS_REQUEST_TLSA:
+		return 3;
+	default:
+		return 0;
+	}
+}
+
+/* Entries are allocated with malloc as librdns frees them */
+static gboolean
+rspamd_dns_cache_deserialize (const guchar *buf, gsize len, guint ttl,
+		enum dns_rcode *rcode, struct rdns_reply_entry **entries)
+{
+	struct rspamd_dns_cache_hdr hdr;
+	struct rspamd_dns_cache_entry_hdr ehdr;
+	struct rdns_reply_entry *entry, *res = NULL;
+	const guchar *p, *end = buf + len, *sep;
+	guint16 u16;
+	guint32 u32;
+	guint i;
+
+	if (len < sizeof (hdr)) {
+		return FALSE;
+	}
+
+	memcpy (&hdr, buf, sizeof (hdr));
+	p = buf + sizeof (hdr);
+
+	for (i = 0; i < hdr.nentries; i ++) {
+		if (end - p < (gssize)sizeof (ehdr)) {
+			goto err;
+		}
+
+		memcpy (&ehdr, p, sizeof (ehdr));
+		p += sizeof (ehdr);
+
+		if (end - p < ehdr.len || ehdr.len < rspamd_dns_cache_min_len (ehdr.type)) {
+			goto err;
+		}
+
+		sep = NULL;
+
+		if (ehdr.type == RDNS_REQUEST_SOA) {
+			sep = memchr (p + 20, '\0', ehdr.len - 20);
+
+			if (sep == NULL) {
+				goto err;
+			}
+		}
+
+		entry = calloc (1, sizeof (*entry));
+		g_assert (entry != NULL);
+		entry->type = ehdr.type;
+		entry->ttl = ttl;
+
+		switch (entry->type) {
+		case RDNS_REQUEST_A:
+			memcpy (&entry->content.a.addr, p,
+					sizeof (entry->content.a.addr));
+			break;
+		case RDNS_REQUEST_AAAA:
+			memcpy (&entry->content.aaa.addr, p,
+					sizeof (entry->content.aaa.addr));
+			break;
+		case RDNS_REQUEST_PTR:
+			entry->content.ptr.name = rspamd_dns_cache_strdup (p, ehdr.len);
+			break;
+		case RDNS_REQUEST_NS:
+			entry->content.ns.name = rspamd_dns_cache_strdup (p, ehdr.len);
+			break;
+		case RDNS_REQUEST_TXT:
+		case RDNS_REQUEST_SPF:
+			entry->content.txt.data = rspamd_dns_cache_strdup (p, ehdr.len);
+			break;
+		case RDNS_REQUEST_MX:
+			memcpy (&u16, p, sizeof (u16));
+			entry->content.mx.priority = u16;
+			entry->content.mx.name = rspamd_dns_cache_strdup (p + sizeof (u16),
+					ehdr.len - sizeof (u16));
+			break;
+		case RDNS_REQUEST_SRV:
+			memcpy (&u16, p, sizeof (u16));
+			entry->content.srv.priority = u16;
+			memcpy (&u16, p + 2, sizeof (u16));
+			entry->content.srv.weight = u16;
+			memcpy (&u16, p + 4, sizeof (u16));
+			entry->content.srv.port = u16;
+			entry->content.srv.target = rspamd_dns_cache_strdup (p + 6,
+					ehdr.len - 6);
+			break;
+		case RDNS_REQUEST_SOA:
+			memcpy (&u32, p, sizeof (u32));
+			entry->content.soa.serial = u32;
+			memcpy (&u32, p + 4, sizeof (u32));
+			entry->content.soa.refresh = u32;
+			memcpy (&u32, p + 8, sizeof (u32));
+			entry->content.soa.retry = u32;
+			memcpy (&u32, p + 12, sizeof (u32));
+			entry->content.soa.expire = u32;
+			memcpy (&u32, p + 16, sizeof (u32));
+			entry->content.soa.minimum = u32;
+			entry->content.soa.mname = rspamd_dns_cache_strdup (p + 20,
+					sep - p - 20);
+			entry->content.soa.admin = rspamd_dns_cache_strdup (sep + 1,
+					p + ehdr.len - sep - 1);
+			break;
+		case RDNS_REQUEST_TLSA:
+			entry->content.tlsa.usage = p[0];
+			entry->content.tlsa.selector = p[1];
+			entry->content.tlsa.match_type = p[2];
+			entry->content.tlsa.datalen = ehdr.len - 3;
+			entry->content.tlsa.data = (guint8 *)rspamd_dns_cache_strdup (p + 3,
+					ehdr.len - 3);
+			break;
+		default:
+			free (entry);
+			goto err;
+		}
+
+		DL_APPEND (res, entry);
+		p += ehdr.len;
+	}
+
+	*rcode = hdr.rcode;
+	*entries = res;
+
+	return TRUE;
+
+err:
+	rspamd_dns_cache_free_entries (res);
+
+	return FALSE;
+}
+
+static bool
+rspamd_dns_cache_lookup (const char *name, size_t len,
+		enum rdns_request_type type,
+		enum dns_rcode *rcode, struct rdns_reply_entry **entries,
+		void *cache_data)
+{
+	struct rspamd_dns_cache *dc = cache_data;
+	gchar key[RSPAMD_SHARED_CACHE_KEY_LEN + 1];
+	guchar buf[RSPAMD_DNS_CACHE_VALUE_LEN];
+	gsize keylen, vlen = sizeof (buf);
+	guint ttl = 0;
+
+	keylen = rspamd_dns_cache_key (key, name, len, type);
+
+	if (keylen == 0 ||
+			!rspamd_shared_cache_lookup (dc->cache, key, keylen, time (NULL),
+					buf, &vlen, &ttl) ||
+			!rspamd_dns_cache_deserialize (buf, vlen, ttl, rcode, entries)) {
+		RSPAMD_DNS_CACHE_STAT_INC (dc, type, misses);
+
+		return false;
+	}
+
+	RSPAMD_DNS_CACHE_STAT_INC (dc, type, hits);
+
+	return true;
+}
+
+static void
+rspamd_dns_cache_store (const char *name, size_t len,
+		enum rdns_request_type type,
+		struct rdns_reply *reply, void *cache_data)
+{
+	struct rspamd_dns_cache *dc = cache_data;
+	struct rdns_reply_entry *entry;
+	gchar key[RSPAMD_SHARED_CACHE_KEY_LEN + 1];
+	guchar buf[RSPAMD_DNS_CACHE_VALUE_LEN];
+	gsize keylen, vlen;
+	gint64 ttl = G_MAXINT32;
+
+	switch (reply->code) {
+	case RDNS_RC_NOERROR:
+		if (reply->entries == NULL) {
+			return;
+		}
+
+		/* The shortest TTL of records */
+		LL_FOREACH (reply->entries, entry) {
+			ttl = MIN (ttl, entry->ttl);
+		}
+		break;
+	case RDNS_RC_NXDOMAIN:
+	case RDNS_RC_NOREC:
+		/* Authority section is not parsed, so SOA minimum is unknown */
+		ttl = dc->negative_ttl;
+		break;
+	default:
+		/* Temporary failures are not cached */
+		return;
+	}
+
+	if (ttl <= 0) {
+		return;
+	}
+
+	keylen = rspamd_dns_cache_key (key, name, len, type);
+	vlen = rspamd_dns_cache_serialize (reply, buf);
+
+	if (keylen == 0 || vlen == 0) {
+		return;
+	}
+
+	if (rspamd_shared_cache_insert (dc->cache, key, keylen, buf, vlen,
+			time (NULL), ttl)) {
+		RSPAMD_DNS_CACHE_STAT_INC (dc, type, stores);
+	}
+}
+
+void
+rspamd_dns_cache_init (struct rspamd_config *cfg)
+{
+	struct rspamd_dns_cache *dc;
+
+	if (cfg->dns_cache != NULL || cfg->dns_cache_size == 0) {
+		return;
+	}
+
+	dc = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*dc));
+	dc->cache = rspamd_shared_cache_new (cfg->cfg_pool, "dns",
+			cfg->dns_cache_size, RSPAMD_DNS_CACHE_VALUE_LEN);
+	dc->stat = rspamd_mempool_alloc0_shared (cfg->cfg_pool,
+			sizeof (*dc->stat) * RSPAMD_DNS_CACHE_NTYPES);
+	dc->negative_ttl = cfg->dns_cache_negative_ttl;
+	cfg->dns_cache = dc;
+}
+
+ucl_object_t *
+rspamd_dns_cache_stat (struct rspamd_config *cfg, gboolean reset)
+{
+	struct rspamd_dns_cache *dc = cfg->dns_cache;
+	struct rspamd_dns_cache_type_stat *st;
+	ucl_object_t *top, *obj;
+	guint i;
+
+	if (dc == NULL) {
+		return NULL;
+	}
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+
+	for (i = 0; i < RSPAMD_DNS_CACHE_NTYPES; i ++) {
+		st = &dc->stat[i];
+
+		if (st->hits == 0 && st->misses == 0 && st->stores == 0) {
+			continue;
+		}
+
+		obj = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (obj, ucl_object_fromint (st->hits),
+				"hits", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (st->misses),
+				"misses", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (st->stores),
+				"stores", 0, false);
+		ucl_object_insert_key (top, obj,
+				i < G_N_ELEMENTS (rspamd_dns_cache_types) ?
+				rdns_str_from_type (rspamd_dns_cache_types[i]) : "other",
+				0, false);
+
+		if (reset) {
+			memset (st, 0, sizeof (*st));
+		}
+	}
+
+	return top;
+}
+
 static void
 rspamd_dns_fin_cb (gpointer arg)
 {
@@ -106,7 +682,7 @@ rspamd_dns_callback (struct rdns_reply *reply, gpointer ud)
 		 * event removing
 		 */
 		rdns_request_retain (reply->request);
-		rspamd_session_remove_event (reqdata->session, rspamd_dns_fin_cb, reqdata);
+		rspamd_session_remove_event_handle (reqdata->session, reqdata->async_ev);
 	}
 	else {
 		reqdata->cb (reply, reqdata->ud);
@@ -159,7 +735,7 @@ make_dns_request (struct rspamd_dns_resolver *resolver,
 
 	if (session) {
 		if (req != NULL) {
-			rspamd_session_add_event (session,
+			reqdata->async_ev = rspamd_session_add_event_handle (session,
 					(event_finalizer_t) rspamd_dns_fin_cb,
 					reqdata,
 					M);
@@ -526,6 +1102,84 @@ rspamd_dns_resolver_config_ucl (struct rspamd_config *cfg,
 	}
 }
 
+/*
+ * Request timers of rdns are mostly removed before they fire, so they are
+ * kept in the timer wheel rather than in libevent heap
+ */
+struct rspamd_dns_timer {
+	struct rspamd_wheel_timer tm;
+	struct rspamd_timer_wheel *wheel;
+	gdouble after;
+	void *ud;
+};
+
+static void
+rspamd_dns_timer_cb (gpointer ud)
+{
+	struct rspamd_dns_timer *timer = ud;
+
+	/* Timers are persistent, rdns can remove timer from the callback */
+	rspamd_wheel_timer_add (timer->wheel, &timer->tm, timer->after);
+	rdns_process_timer (timer->ud);
+}
+
+static void *
+rspamd_dns_add_timer (void *priv_data, double after, void *user_data)
+{
+	struct rspamd_dns_timer *timer;
+
+	timer = g_malloc (sizeof (*timer));
+	rspamd_wheel_timer_init (&timer->tm, rspamd_dns_timer_cb, timer);
+	timer->wheel = rspamd_timer_wheel_get (priv_data);
+	timer->after = after;
+	timer->ud = user_data;
+	rspamd_wheel_timer_add (timer->wheel, &timer->tm, after);
+
+	return timer;
+}
+
+static void
+rspamd_dns_repeat_timer (void *priv_data, void *ev_data)
+{
+	struct rspamd_dns_timer *timer = ev_data;
+
+	if (timer != NULL) {
+		rspamd_wheel_timer_add (timer->wheel, &timer->tm, timer->after);
+	}
+}
+
+static void
+rspamd_dns_del_timer (void *priv_data, void *ev_data)
+{
+	struct rspamd_dns_timer *timer = ev_data;
+
+	if (timer != NULL) {
+		rspamd_wheel_timer_del (&timer->tm);
+		g_free (timer);
+	}
+}
+
+static void
+rspamd_dns_bind_events (struct rdns_resolver *resolver,
+		struct event_base *ev_base)
+{
+	struct rdns_async_context *nctx;
+
+	/* Like rdns_bind_libevent, but with timers in the wheel */
+	nctx = g_malloc0 (sizeof (*nctx));
+	nctx->data = ev_base;
+	nctx->add_read = rdns_libevent_add_read;
+	nctx->del_read = rdns_libevent_del_read;
+	nctx->add_write = rdns_libevent_add_write;
+	nctx->del_write = rdns_libevent_del_write;
+	nctx->add_timer = rspamd_dns_add_timer;
+	nctx->repeat_timer = rspamd_dns_repeat_timer;
+	nctx->del_timer = rspamd_dns_del_timer;
+	nctx->add_periodic = rdns_libevent_add_periodic;
+	nctx->del_periodic = rdns_libevent_del_periodic;
+	rdns_resolver_async_bind (resolver, nctx);
+}
+
 struct rspamd_dns_resolver *
 dns_resolver_init (rspamd_logger_t *logger,
 	struct event_base *ev_base,
@@ -545,12 +1199,20 @@ dns_resolver_init (rspamd_logger_t *logger,
 	}
 
 	dns_resolver->r = rdns_resolver_new ();
-	rdns_bind_libevent (dns_resolver->r, dns_resolver->ev_base);
+	rspamd_dns_bind_events (dns_resolver->r, dns_resolver->ev_base);
 
 	if (cfg != NULL) {
 		rdns_resolver_set_log_level (dns_resolver->r, cfg->log_level);
 		dns_resolver->cfg = cfg;
 		rdns_resolver_set_dnssec (dns_resolver->r, cfg->enable_dnssec);
+		rdns_resolver_set_coalescing (dns_resolver->r,
+				cfg->dns_coalesce_requests);
+		rdns_resolver_set_tcp (dns_resolver->r, cfg->dns_enable_tcp);
+
+		if (cfg->dns_edns_payload > 0) {
+			rdns_resolver_set_edns_payload (dns_resolver->r,
+					cfg->dns_edns_payload);
+		}
 
 		if (cfg->nameservers == NULL) {
 			/* Parse resolv.conf */
@@ -595,6 +1257,12 @@ dns_resolver_init (rspamd_logger_t *logger,
 				dns_resolver);
 		rdns_resolver_set_upstream_lib (dns_resolver->r, &rspamd_ups_ctx,
 				dns_resolver->ups);
+
+		if (cfg->dns_cache) {
+			rdns_resolver_set_cache_lib (dns_resolver->r, &rspamd_dns_cache_ctx,
+					cfg->dns_cache);
+		}
+
 		cfg->dns_resolver = dns_resolver;
 
 		if (cfg->rcl_obj) {
@@ -23,6 +23,7 @@
 #include "logger.h"
 #include "rdns.h"
 #include "upstream.h"
+#include "ucl.h"
 
 struct rspamd_config;
 
@@ -75,4 +76,20 @@ gboolean make_dns_request_task_forced (struct rspamd_task *task,
 	enum rdns_request_type type,
 	const char *name);
 
+/**
+ * Create cache of DNS replies shared between all workers, it must be called
+ * before workers are forked. Resolvers created with this config use the cache.
+ * @param cfg
+ */
+void rspamd_dns_cache_init (struct rspamd_config *cfg);
+
+/**
+ * Get per record type statistics of DNS cache
+ * @param cfg
+ * @param reset reset counters after reading
+ * @return ucl object or NULL if cache is disabled
+ */
+ucl_object_t * rspamd_dns_cache_stat (struct rspamd_config *cfg,
+		gboolean reset);
+
 #endif
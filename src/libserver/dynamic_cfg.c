@@ -219,6 +219,11 @@ json_config_fin_cb (struct map_cb_data *data)
 	ucl_object_unref (jb->cfg->current_dynamic_conf);
 	apply_dynamic_conf (top, jb->cfg);
 	jb->cfg->current_dynamic_conf = top;
+
+	if (jb->cfg->cache) {
+		/* Patch only the items whose scores have been changed */
+		rspamd_symcache_update_weights (jb->cfg->cache);
+	}
 }
 
 static void
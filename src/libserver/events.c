@@ -18,6 +18,7 @@
 #include "contrib/uthash/utlist.h"
 #include "events.h"
 #include "cryptobox.h"
+#include "tracing.h"
 
 #define RSPAMD_SESSION_FLAG_DESTROYING (1 << 1)
 #define RSPAMD_SESSION_FLAG_CLEANUP (1 << 2)
@@ -47,11 +48,21 @@ INIT_LOG_MODULE(events)
 static struct rspamd_counter_data events_count;
 
 
+/* Event can be found by its finalizer and user data */
+#define RSPAMD_ASYNC_EVENT_HASHED (1u << 0)
+
+/*
+ * Events are linked to the session intrusively, so they can be removed by
+ * a handle with no lookups, records of removed events are reused
+ */
 struct rspamd_async_event {
 	const gchar *subsystem;
 	const gchar *loc;
 	event_finalizer_t fin;
 	void *user_data;
+	struct rspamd_async_event *prev, *next;
+	guint span;
+	guint flags;
 };
 
 static guint rspamd_event_hash (gconstpointer a);
@@ -69,9 +80,13 @@ struct rspamd_async_session {
 	session_finalizer_t fin;
 	event_finalizer_t restore;
 	event_finalizer_t cleanup;
-	khash_t(rspamd_events_hash) *events;
+	khash_t(rspamd_events_hash) *events; /* events added by (fin, user_data) */
+	struct rspamd_async_event *pending; /* all pending events */
+	struct rspamd_async_event *free_events; /* records to reuse */
 	void *user_data;
 	rspamd_mempool_t *pool;
+	struct rspamd_trace *trace;
+	guint npending;
 	guint flags;
 };
 
@@ -145,6 +160,78 @@ rspamd_session_create (rspamd_mempool_t * pool,
 	return s;
 }
 
+static struct rspamd_async_event *
+rspamd_session_new_event (struct rspamd_async_session *session,
+						  event_finalizer_t fin,
+						  gpointer user_data,
+						  const gchar *subsystem,
+						  const gchar *loc)
+{
+	struct rspamd_async_event *new_event;
+
+	if (session->free_events) {
+		new_event = session->free_events;
+		session->free_events = new_event->next;
+	}
+	else {
+		new_event = rspamd_mempool_alloc (session->pool,
+				sizeof (struct rspamd_async_event));
+	}
+
+	new_event->fin = fin;
+	new_event->user_data = user_data;
+	new_event->subsystem = subsystem;
+	new_event->loc = loc;
+	new_event->flags = 0;
+	new_event->span = rspamd_trace_span_start (session->trace, subsystem,
+			RSPAMD_TRACE_NO_SPAN);
+	rspamd_trace_span_set_loc (session->trace, new_event->span, loc);
+
+	msg_debug_session ("added event: %p, pending %d (+1) events, "
+					   "subsystem: %s (%s)",
+			user_data,
+			session->npending,
+			subsystem,
+			loc);
+
+	DL_APPEND (session->pending, new_event);
+	session->npending ++;
+
+	return new_event;
+}
+
+/*
+ * Unlinks event, calls its finalizer and checks if the session is finished
+ */
+static void
+rspamd_session_finish_event (struct rspamd_async_session *session,
+							 struct rspamd_async_event *ev,
+							 const gchar *loc)
+{
+	event_finalizer_t fin = ev->fin;
+	gpointer ud = ev->user_data;
+
+	msg_debug_session ("removed event: %p, pending %d (-1) events, "
+					   "subsystem: %s (%s), added at %s",
+			ud,
+			session->npending,
+			ev->subsystem,
+			loc,
+			ev->loc);
+	rspamd_trace_span_finish (session->trace, ev->span);
+	DL_DELETE (session->pending, ev);
+	session->npending --;
+
+	/* Record can be reused by events added from the finalizer */
+	ev->next = session->free_events;
+	session->free_events = ev;
+
+	/* Remove event */
+	fin (ud);
+
+	rspamd_session_pending (session);
+}
+
 struct rspamd_async_event *
 rspamd_session_add_event_full (struct rspamd_async_session *session,
 							   event_finalizer_t fin,
@@ -168,26 +255,38 @@ rspamd_session_add_event_full (struct rspamd_async_session *session,
 		return NULL;
 	}
 
-	new_event = rspamd_mempool_alloc (session->pool,
-			sizeof (struct rspamd_async_event));
-	new_event->fin = fin;
-	new_event->user_data = user_data;
-	new_event->subsystem = subsystem;
-	new_event->loc = loc;
-
-	msg_debug_session ("added event: %p, pending %d (+1) events, "
-					   "subsystem: %s (%s)",
-			user_data,
-			kh_size (session->events),
-			subsystem,
-			loc);
-
+	new_event = rspamd_session_new_event (session, fin, user_data,
+			subsystem, loc);
+	new_event->flags |= RSPAMD_ASYNC_EVENT_HASHED;
 	kh_put (rspamd_events_hash, session->events, new_event, &ret);
 	g_assert (ret > 0);
 
 	return new_event;
 }
 
+struct rspamd_async_event *
+rspamd_session_add_event_handle_full (struct rspamd_async_session *session,
+									  event_finalizer_t fin,
+									  gpointer user_data,
+									  const gchar *subsystem,
+									  const gchar *loc)
+{
+	if (session == NULL) {
+		msg_err ("session is NULL");
+		g_assert_not_reached ();
+	}
+
+	if (!RSPAMD_SESSION_CAN_ADD_EVENT (session)) {
+		msg_debug_session ("skip adding event subsystem: %s: "
+					 "session is destroying/cleaning",
+				subsystem);
+
+		return NULL;
+	}
+
+	return rspamd_session_new_event (session, fin, user_data, subsystem, loc);
+}
+
 void
 rspamd_session_remove_event_full (struct rspamd_async_session *session,
 								  event_finalizer_t fin,
@@ -212,36 +311,47 @@ rspamd_session_remove_event_full (struct rspamd_async_session *session,
 	search_ev.user_data = ud;
 	k = kh_get (rspamd_events_hash, session->events, &search_ev);
 	if (k == kh_end (session->events)) {
-		gchar t;
-
 		msg_err_session ("cannot find event: %p(%p) from %s", fin, ud, loc);
-		kh_foreach (session->events, found_ev, t, {
+		DL_FOREACH (session->pending, found_ev) {
 			msg_err_session ("existing event %s (%s): %p(%p)",
 					found_ev->subsystem,
 					found_ev->loc,
 					found_ev->fin,
 					found_ev->user_data);
-		});
-
-		(void)t;
+		}
 
 		g_assert_not_reached ();
 	}
 
 	found_ev = kh_key (session->events, k);
-	msg_debug_session ("removed event: %p, pending %d (-1) events, "
-					   "subsystem: %s (%s), added at %s",
-			ud,
-			kh_size (session->events),
-			found_ev->subsystem,
-			loc,
-			found_ev->loc);
 	kh_del (rspamd_events_hash, session->events, k);
+	rspamd_session_finish_event (session, found_ev, loc);
+}
 
-	/* Remove event */
-	fin (ud);
+void
+rspamd_session_remove_event_handle_full (struct rspamd_async_session *session,
+										 struct rspamd_async_event *ev,
+										 const gchar *loc)
+{
+	khiter_t k;
 
-	rspamd_session_pending (session);
+	if (session == NULL) {
+		msg_err ("session is NULL");
+		return;
+	}
+
+	if (!RSPAMD_SESSION_CAN_ADD_EVENT (session) || ev == NULL) {
+		/* Session is already cleaned up, ignore this */
+		return;
+	}
+
+	if (ev->flags & RSPAMD_ASYNC_EVENT_HASHED) {
+		k = kh_get (rspamd_events_hash, session->events, ev);
+		g_assert (k != kh_end (session->events));
+		kh_del (rspamd_events_hash, session->events, k);
+	}
+
+	rspamd_session_finish_event (session, ev, loc);
 }
 
 gboolean
@@ -267,7 +377,7 @@ rspamd_session_destroy (struct rspamd_async_session *session)
 void
 rspamd_session_cleanup (struct rspamd_async_session *session)
 {
-	struct rspamd_async_event *ev;
+	struct rspamd_async_event *ev, *tmp;
 
 	if (session == NULL) {
 		msg_err ("session is NULL");
@@ -276,17 +386,21 @@ rspamd_session_cleanup (struct rspamd_async_session *session)
 
 	session->flags |= RSPAMD_SESSION_FLAG_CLEANUP;
 
-	kh_foreach_key (session->events, ev, {
+	DL_FOREACH_SAFE (session->pending, ev, tmp) {
 		/* Call event's finalizer */
 		msg_debug_session ("removed event on destroy: %p, subsystem: %s",
 				ev->user_data,
 				ev->subsystem);
 
+		rspamd_trace_span_finish (session->trace, ev->span);
+
 		if (ev->fin != NULL) {
 			ev->fin (ev->user_data);
 		}
-	});
+	}
 
+	session->pending = NULL;
+	session->npending = 0;
 	kh_clear (rspamd_events_hash, session->events);
 
 	session->flags &= ~RSPAMD_SESSION_FLAG_CLEANUP;
@@ -297,7 +411,7 @@ rspamd_session_pending (struct rspamd_async_session *session)
 {
 	gboolean ret = TRUE;
 
-	if (kh_size (session->events) == 0) {
+	if (session->npending == 0) {
 		if (session->fin != NULL) {
 			msg_debug_session ("call fin handler, as no events are pending");
 
@@ -326,7 +440,7 @@ rspamd_session_events_pending (struct rspamd_async_session *session)
 
 	g_assert (session != NULL);
 
-	npending = kh_size (session->events);
+	npending = session->npending;
 	msg_debug_session ("pending %d events", npending);
 
 	return npending;
@@ -346,4 +460,22 @@ rspamd_session_blocked (struct rspamd_async_session *session)
 	g_assert (session != NULL);
 
 	return !RSPAMD_SESSION_CAN_ADD_EVENT (session);
-}
\ No newline at end of file
+}
+void
+rspamd_session_set_trace (struct rspamd_async_session *session,
+		struct rspamd_trace *trace)
+{
+	g_assert (session != NULL);
+
+	session->trace = trace;
+}
+
+void
+rspamd_session_event_set_peer (struct rspamd_async_session *session,
+		struct rspamd_async_event *ev,
+		const gchar *peer)
+{
+	if (session != NULL && ev != NULL) {
+		rspamd_trace_span_set_peer (session->trace, ev->span, peer);
+	}
+}
@@ -67,6 +67,35 @@ void rspamd_session_remove_event_full (struct rspamd_async_session *session,
 #define rspamd_session_remove_event(session, fin, user_data) \
 	rspamd_session_remove_event_full(session, fin, user_data, G_STRLOC)
 
+/**
+ * Insert new event to the session, the event can be removed merely by the
+ * returned handle, which is cheaper than adding an event by its user data
+ * @param session session object
+ * @param fin finalizer callback
+ * @param user_data abstract user_data
+ * @return event handle or NULL if session is being destroyed
+ */
+struct rspamd_async_event *
+rspamd_session_add_event_handle_full (struct rspamd_async_session *session,
+									  event_finalizer_t fin,
+									  gpointer user_data,
+									  const gchar *subsystem,
+									  const gchar *loc);
+#define rspamd_session_add_event_handle(session, fin, user_data, subsystem) \
+	rspamd_session_add_event_handle_full(session, fin, user_data, subsystem, G_STRLOC)
+
+/**
+ * Remove event by its handle, NULL handle is ignored
+ * @param session session object
+ * @param ev event returned by `rspamd_session_add_event` or
+ * `rspamd_session_add_event_handle`
+ */
+void rspamd_session_remove_event_handle_full (struct rspamd_async_session *session,
+		struct rspamd_async_event *ev,
+		const gchar *loc);
+#define rspamd_session_remove_event_handle(session, ev) \
+	rspamd_session_remove_event_handle_full(session, ev, G_STRLOC)
+
 /**
  * Must be called at the end of session, it calls fin functions for all non-forced callbacks
  * @return true if the whole session was destroyed and false if there are forced events
@@ -107,4 +136,25 @@ guint rspamd_session_events_pending (struct rspamd_async_session *session);
  */
 gboolean rspamd_session_blocked (struct rspamd_async_session *s);
 
+struct rspamd_trace;
+
+/**
+ * Sets trace for a session, all events added after this call are recorded
+ * as spans of this trace
+ * @param session
+ * @param trace trace or NULL to stop tracing
+ */
+void rspamd_session_set_trace (struct rspamd_async_session *session,
+		struct rspamd_trace *trace);
+
+/**
+ * Sets remote peer (e.g. upstream name) of an event if the session is traced
+ * @param session
+ * @param ev event returned by `rspamd_session_add_event`, can be NULL
+ * @param peer
+ */
+void rspamd_session_event_set_peer (struct rspamd_async_session *session,
+		struct rspamd_async_event *ev,
+		const gchar *peer);
+
 #endif /* RSPAMD_EVENTS_H */
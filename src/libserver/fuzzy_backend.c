@@ -18,14 +18,20 @@
 #include "fuzzy_backend.h"
 #include "fuzzy_backend_sqlite.h"
 #include "fuzzy_backend_redis.h"
+#include "fuzzy_backend_segments.h"
 #include "cfg_file.h"
 #include "fuzzy_wire.h"
+#include "cryptobox.h"
+#include "libutil/sqlite_utils.h"
+
+#include <math.h>
 
 #define DEFAULT_EXPIRE 172800L
 
 enum rspamd_fuzzy_backend_type {
 	RSPAMD_FUZZY_BACKEND_SQLITE = 0,
 	RSPAMD_FUZZY_BACKEND_REDIS = 1,
+	RSPAMD_FUZZY_BACKEND_SEGMENTS = 2,
 };
 
 static void* rspamd_fuzzy_backend_init_sqlite (struct rspamd_fuzzy_backend *bk,
@@ -34,6 +40,10 @@ static void rspamd_fuzzy_backend_check_sqlite (struct rspamd_fuzzy_backend *bk,
 		const struct rspamd_fuzzy_cmd *cmd,
 		rspamd_fuzzy_check_cb cb, void *ud,
 		void *subr_ud);
+static void rspamd_fuzzy_backend_check_multi_sqlite (struct rspamd_fuzzy_backend *bk,
+		const struct rspamd_fuzzy_cmd **cmds, guint ncmds,
+		rspamd_fuzzy_check_multi_cb cb, void *ud,
+		void *subr_ud);
 static void rspamd_fuzzy_backend_update_sqlite (struct rspamd_fuzzy_backend *bk,
 		GArray *updates, const gchar *src,
 		rspamd_fuzzy_update_cb cb, void *ud,
@@ -60,6 +70,11 @@ struct rspamd_fuzzy_backend_subr {
 			const struct rspamd_fuzzy_cmd *cmd,
 			rspamd_fuzzy_check_cb cb, void *ud,
 			void *subr_ud);
+	/* Optional, emulated by multiple check calls if absent */
+	void (*check_multi) (struct rspamd_fuzzy_backend *bk,
+			const struct rspamd_fuzzy_cmd **cmds, guint ncmds,
+			rspamd_fuzzy_check_multi_cb cb, void *ud,
+			void *subr_ud);
 	void (*update) (struct rspamd_fuzzy_backend *bk,
 			GArray *updates, const gchar *src,
 			rspamd_fuzzy_update_cb cb, void *ud,
@@ -80,6 +95,7 @@ static const struct rspamd_fuzzy_backend_subr fuzzy_subrs[] = {
 	[RSPAMD_FUZZY_BACKEND_SQLITE] = {
 		.init = rspamd_fuzzy_backend_init_sqlite,
 		.check = rspamd_fuzzy_backend_check_sqlite,
+		.check_multi = rspamd_fuzzy_backend_check_multi_sqlite,
 		.update = rspamd_fuzzy_backend_update_sqlite,
 		.count = rspamd_fuzzy_backend_count_sqlite,
 		.version = rspamd_fuzzy_backend_version_sqlite,
@@ -91,14 +107,26 @@ static const struct rspamd_fuzzy_backend_subr fuzzy_subrs[] = {
 	[RSPAMD_FUZZY_BACKEND_REDIS] = {
 		.init = rspamd_fuzzy_backend_init_redis,
 		.check = rspamd_fuzzy_backend_check_redis,
+		.check_multi = rspamd_fuzzy_backend_check_multi_redis,
 		.update = rspamd_fuzzy_backend_update_redis,
 		.count = rspamd_fuzzy_backend_count_redis,
 		.version = rspamd_fuzzy_backend_version_redis,
 		.id = rspamd_fuzzy_backend_id_redis,
 		.periodic = rspamd_fuzzy_backend_expire_redis,
 		.close = rspamd_fuzzy_backend_close_redis,
-	}
+	},
 #endif
+	[RSPAMD_FUZZY_BACKEND_SEGMENTS] = {
+		.init = rspamd_fuzzy_backend_init_segments,
+		.check = rspamd_fuzzy_backend_check_segments,
+		.check_multi = rspamd_fuzzy_backend_check_multi_segments,
+		.update = rspamd_fuzzy_backend_update_segments,
+		.count = rspamd_fuzzy_backend_count_segments,
+		.version = rspamd_fuzzy_backend_version_segments,
+		.id = rspamd_fuzzy_backend_id_segments,
+		.periodic = rspamd_fuzzy_backend_periodic_segments,
+		.close = rspamd_fuzzy_backend_close_segments,
+	}
 };
 
 struct rspamd_fuzzy_backend {
@@ -119,11 +147,42 @@ rspamd_fuzzy_backend_quark (void)
 	return g_quark_from_static_string ("fuzzy-backend");
 }
 
+/*
+ * Reads are performed on the event loop, writes and expiration use another
+ * connection in a writer thread, so commits and wal checkpoints do not delay
+ * checks. If writer cannot be started, everything is done synchronously
+ */
+struct rspamd_fuzzy_sqlite_ud {
+	struct rspamd_fuzzy_backend_sqlite *rd;
+	struct rspamd_fuzzy_backend_sqlite *wr;
+	struct rspamd_sqlite3_writer *writer;
+};
+
+struct rspamd_fuzzy_sqlite_update_job {
+	struct rspamd_fuzzy_backend_sqlite *sq;
+	GArray *updates;
+	gchar *src;
+	rspamd_fuzzy_update_cb cb;
+	void *ud;
+	gboolean success;
+	guint nadded;
+	guint ndeleted;
+	guint nextended;
+	guint nignored;
+};
+
+struct rspamd_fuzzy_sqlite_sync_job {
+	struct rspamd_fuzzy_backend_sqlite *sq;
+	gint64 expire;
+};
+
 static void*
 rspamd_fuzzy_backend_init_sqlite (struct rspamd_fuzzy_backend *bk,
 		const ucl_object_t *obj, struct rspamd_config *cfg, GError **err)
 {
 	const ucl_object_t *elt;
+	struct rspamd_fuzzy_sqlite_ud *sq;
+	GError *wr_err = NULL;
 
 	elt = ucl_object_lookup_any (obj, "hashfile", "hash_file", "file",
 			"database", NULL);
@@ -134,8 +193,37 @@ rspamd_fuzzy_backend_init_sqlite (struct rspamd_fuzzy_backend *bk,
 		return NULL;
 	}
 
-	return rspamd_fuzzy_backend_sqlite_open (ucl_object_tostring (elt),
+	sq = g_malloc0 (sizeof (*sq));
+	sq->rd = rspamd_fuzzy_backend_sqlite_open (ucl_object_tostring (elt),
 			FALSE, err);
+
+	if (sq->rd == NULL) {
+		g_free (sq);
+
+		return NULL;
+	}
+
+	if (bk->ev_base) {
+		sq->wr = rspamd_fuzzy_backend_sqlite_open (ucl_object_tostring (elt),
+				FALSE, &wr_err);
+
+		if (sq->wr != NULL) {
+			sq->writer = rspamd_sqlite3_writer_new (bk->ev_base, &wr_err);
+
+			if (sq->writer == NULL) {
+				rspamd_fuzzy_backend_sqlite_close (sq->wr);
+				sq->wr = NULL;
+			}
+		}
+
+		if (sq->writer == NULL) {
+			msg_warn ("cannot start sqlite writer, use synchronous writes: %e",
+					wr_err);
+			g_error_free (wr_err);
+		}
+	}
+
+	return sq;
 }
 
 static void
@@ -144,10 +232,10 @@ rspamd_fuzzy_backend_check_sqlite (struct rspamd_fuzzy_backend *bk,
 		rspamd_fuzzy_check_cb cb, void *ud,
 		void *subr_ud)
 {
-	struct rspamd_fuzzy_backend_sqlite *sq = subr_ud;
+	struct rspamd_fuzzy_sqlite_ud *sq = subr_ud;
 	struct rspamd_fuzzy_reply rep;
 
-	rep = rspamd_fuzzy_backend_sqlite_check (sq, cmd, bk->expire);
+	rep = rspamd_fuzzy_backend_sqlite_check (sq->rd, cmd, bk->expire);
 
 	if (cb) {
 		cb (&rep, ud);
@@ -155,22 +243,38 @@ rspamd_fuzzy_backend_check_sqlite (struct rspamd_fuzzy_backend *bk,
 }
 
 static void
-rspamd_fuzzy_backend_update_sqlite (struct rspamd_fuzzy_backend *bk,
-		GArray *updates, const gchar *src,
-		rspamd_fuzzy_update_cb cb, void *ud,
+rspamd_fuzzy_backend_check_multi_sqlite (struct rspamd_fuzzy_backend *bk,
+		const struct rspamd_fuzzy_cmd **cmds, guint ncmds,
+		rspamd_fuzzy_check_multi_cb cb, void *ud,
 		void *subr_ud)
 {
-	struct rspamd_fuzzy_backend_sqlite *sq = subr_ud;
-	gboolean success = FALSE;
-	guint i;
+	struct rspamd_fuzzy_sqlite_ud *sq = subr_ud;
+	struct rspamd_fuzzy_reply *reps;
+
+	reps = g_malloc (sizeof (*reps) * ncmds);
+	rspamd_fuzzy_backend_sqlite_check_multi (sq->rd, cmds, ncmds, bk->expire,
+			reps);
+
+	if (cb) {
+		cb (reps, ncmds, ud);
+	}
+
+	g_free (reps);
+}
+
+/* Can be called from the writer thread */
+static void
+rspamd_fuzzy_backend_sqlite_apply_updates (gpointer d)
+{
+	struct rspamd_fuzzy_sqlite_update_job *job = d;
+	guint i, nupdates = 0;
 	struct fuzzy_peer_cmd *io_cmd;
 	struct rspamd_fuzzy_cmd *cmd;
 	gpointer ptr;
-	guint nupdates = 0, nadded = 0, ndeleted = 0, nextended = 0, nignored = 0;
 
-	if (rspamd_fuzzy_backend_sqlite_prepare_update (sq, src)) {
-		for (i = 0; i < updates->len; i ++) {
-			io_cmd = &g_array_index (updates, struct fuzzy_peer_cmd, i);
+	if (rspamd_fuzzy_backend_sqlite_prepare_update (job->sq, job->src)) {
+		for (i = 0; i < job->updates->len; i ++) {
+			io_cmd = &g_array_index (job->updates, struct fuzzy_peer_cmd, i);
 
 			if (io_cmd->is_shingle) {
 				cmd = &io_cmd->cmd.shingle.basic;
@@ -182,33 +286,72 @@ rspamd_fuzzy_backend_update_sqlite (struct rspamd_fuzzy_backend *bk,
 			}
 
 			if (cmd->cmd == FUZZY_WRITE) {
-				rspamd_fuzzy_backend_sqlite_add (sq, ptr);
-				nadded ++;
+				rspamd_fuzzy_backend_sqlite_add (job->sq, ptr);
+				job->nadded ++;
 				nupdates ++;
 			}
 			else if (cmd->cmd == FUZZY_DEL) {
-				rspamd_fuzzy_backend_sqlite_del (sq, ptr);
-				ndeleted ++;
+				rspamd_fuzzy_backend_sqlite_del (job->sq, ptr);
+				job->ndeleted ++;
 				nupdates ++;
 			}
 			else {
 				if (cmd->cmd == FUZZY_REFRESH) {
-					nextended ++;
+					job->nextended ++;
 				}
 				else {
-					nignored ++;
+					job->nignored ++;
 				}
 			}
 		}
 
-		if (rspamd_fuzzy_backend_sqlite_finish_update (sq, src,
+		if (rspamd_fuzzy_backend_sqlite_finish_update (job->sq, job->src,
 				nupdates > 0)) {
-			success = TRUE;
+			job->success = TRUE;
 		}
 	}
+}
 
-	if (cb) {
-		cb (success, nadded, ndeleted, nextended, nignored, ud);
+static void
+rspamd_fuzzy_backend_sqlite_updates_fin (gpointer d)
+{
+	struct rspamd_fuzzy_sqlite_update_job *job = d;
+
+	if (job->cb) {
+		job->cb (job->success, job->nadded, job->ndeleted, job->nextended,
+				job->nignored, job->ud);
+	}
+
+	g_free (job->src);
+	g_free (job);
+}
+
+static void
+rspamd_fuzzy_backend_update_sqlite (struct rspamd_fuzzy_backend *bk,
+		GArray *updates, const gchar *src,
+		rspamd_fuzzy_update_cb cb, void *ud,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_sqlite_ud *sq = subr_ud;
+	struct rspamd_fuzzy_sqlite_update_job *job;
+
+	/* Updates array is owned by the caller until callback is called */
+	job = g_malloc0 (sizeof (*job));
+	job->updates = updates;
+	job->src = g_strdup (src);
+	job->cb = cb;
+	job->ud = ud;
+
+	if (sq->writer) {
+		job->sq = sq->wr;
+		rspamd_sqlite3_writer_push (sq->writer,
+				rspamd_fuzzy_backend_sqlite_apply_updates,
+				rspamd_fuzzy_backend_sqlite_updates_fin, job);
+	}
+	else {
+		job->sq = sq->rd;
+		rspamd_fuzzy_backend_sqlite_apply_updates (job);
+		rspamd_fuzzy_backend_sqlite_updates_fin (job);
 	}
 }
 
@@ -217,10 +360,10 @@ rspamd_fuzzy_backend_count_sqlite (struct rspamd_fuzzy_backend *bk,
 		rspamd_fuzzy_count_cb cb, void *ud,
 		void *subr_ud)
 {
-	struct rspamd_fuzzy_backend_sqlite *sq = subr_ud;
+	struct rspamd_fuzzy_sqlite_ud *sq = subr_ud;
 	guint64 nhashes;
 
-	nhashes = rspamd_fuzzy_backend_sqlite_count (sq);
+	nhashes = rspamd_fuzzy_backend_sqlite_count (sq->rd);
 
 	if (cb) {
 		cb (nhashes, ud);
@@ -233,10 +376,10 @@ rspamd_fuzzy_backend_version_sqlite (struct rspamd_fuzzy_backend *bk,
 		rspamd_fuzzy_version_cb cb, void *ud,
 		void *subr_ud)
 {
-	struct rspamd_fuzzy_backend_sqlite *sq = subr_ud;
+	struct rspamd_fuzzy_sqlite_ud *sq = subr_ud;
 	guint64 rev;
 
-	rev = rspamd_fuzzy_backend_sqlite_version (sq, src);
+	rev = rspamd_fuzzy_backend_sqlite_version (sq->rd, src);
 
 	if (cb) {
 		cb (rev, ud);
@@ -247,26 +390,52 @@ static const gchar*
 rspamd_fuzzy_backend_id_sqlite (struct rspamd_fuzzy_backend *bk,
 		void *subr_ud)
 {
-	struct rspamd_fuzzy_backend_sqlite *sq = subr_ud;
+	struct rspamd_fuzzy_sqlite_ud *sq = subr_ud;
+
+	return rspamd_fuzzy_sqlite_backend_id (sq->rd);
+}
+
+static void
+rspamd_fuzzy_backend_sqlite_sync_job (gpointer d)
+{
+	struct rspamd_fuzzy_sqlite_sync_job *job = d;
 
-	return rspamd_fuzzy_sqlite_backend_id (sq);
+	rspamd_fuzzy_backend_sqlite_sync (job->sq, job->expire, TRUE);
 }
+
 static void
 rspamd_fuzzy_backend_expire_sqlite (struct rspamd_fuzzy_backend *bk,
 		void *subr_ud)
 {
-	struct rspamd_fuzzy_backend_sqlite *sq = subr_ud;
-
-	rspamd_fuzzy_backend_sqlite_sync (sq, bk->expire, TRUE);
+	struct rspamd_fuzzy_sqlite_ud *sq = subr_ud;
+	struct rspamd_fuzzy_sqlite_sync_job *job;
+
+	if (sq->writer) {
+		job = g_malloc (sizeof (*job));
+		job->sq = sq->wr;
+		job->expire = bk->expire;
+		rspamd_sqlite3_writer_push (sq->writer,
+				rspamd_fuzzy_backend_sqlite_sync_job, g_free, job);
+	}
+	else {
+		rspamd_fuzzy_backend_sqlite_sync (sq->rd, bk->expire, TRUE);
+	}
 }
 
 static void
 rspamd_fuzzy_backend_close_sqlite (struct rspamd_fuzzy_backend *bk,
 		void *subr_ud)
 {
-	struct rspamd_fuzzy_backend_sqlite *sq = subr_ud;
+	struct rspamd_fuzzy_sqlite_ud *sq = subr_ud;
 
-	rspamd_fuzzy_backend_sqlite_close (sq);
+	if (sq->writer) {
+		/* Finishes pending writes */
+		rspamd_sqlite3_writer_destroy (sq->writer);
+		rspamd_fuzzy_backend_sqlite_close (sq->wr);
+	}
+
+	rspamd_fuzzy_backend_sqlite_close (sq->rd);
+	g_free (sq);
 }
 
 
@@ -291,6 +460,9 @@ rspamd_fuzzy_backend_create (struct event_base *ev_base,
 			else if (strcmp (ucl_object_tostring (elt), "redis") == 0) {
 				type = RSPAMD_FUZZY_BACKEND_REDIS;
 			}
+			else if (strcmp (ucl_object_tostring (elt), "segments") == 0) {
+				type = RSPAMD_FUZZY_BACKEND_SEGMENTS;
+			}
 			else {
 				g_set_error (err, rspamd_fuzzy_backend_quark (),
 						EINVAL, "invalid backend type: %s",
@@ -332,6 +504,87 @@ rspamd_fuzzy_backend_check (struct rspamd_fuzzy_backend *bk,
 	bk->subr->check (bk, cmd, cb, ud, bk->subr_ud);
 }
 
+struct rspamd_fuzzy_multi_emul {
+	struct rspamd_fuzzy_reply *reps;
+	guint ncmds;
+	guint pending;
+	rspamd_fuzzy_check_multi_cb cb;
+	void *ud;
+};
+
+struct rspamd_fuzzy_multi_emul_item {
+	struct rspamd_fuzzy_multi_emul *parent;
+	guint idx;
+};
+
+static void
+rspamd_fuzzy_multi_emul_unref (struct rspamd_fuzzy_multi_emul *emul)
+{
+	if (-- emul->pending == 0) {
+		if (emul->cb) {
+			emul->cb (emul->reps, emul->ncmds, emul->ud);
+		}
+
+		g_free (emul->reps);
+		g_free (emul);
+	}
+}
+
+static void
+rspamd_fuzzy_multi_emul_cb (struct rspamd_fuzzy_reply *rep, void *ud)
+{
+	struct rspamd_fuzzy_multi_emul_item *item = ud;
+	struct rspamd_fuzzy_multi_emul *emul = item->parent;
+
+	memcpy (&emul->reps[item->idx], rep, sizeof (*rep));
+	g_free (item);
+	rspamd_fuzzy_multi_emul_unref (emul);
+}
+
+void
+rspamd_fuzzy_backend_check_multi (struct rspamd_fuzzy_backend *bk,
+		const struct rspamd_fuzzy_cmd **cmds, guint ncmds,
+		rspamd_fuzzy_check_multi_cb cb, void *ud)
+{
+	struct rspamd_fuzzy_multi_emul *emul;
+	struct rspamd_fuzzy_multi_emul_item *item;
+	guint i;
+
+	g_assert (bk != NULL);
+
+	if (ncmds == 0) {
+		if (cb) {
+			cb (NULL, 0, ud);
+		}
+
+		return;
+	}
+
+	if (bk->subr->check_multi) {
+		bk->subr->check_multi (bk, cmds, ncmds, cb, ud, bk->subr_ud);
+
+		return;
+	}
+
+	emul = g_malloc0 (sizeof (*emul));
+	emul->reps = g_malloc0 (sizeof (*emul->reps) * ncmds);
+	emul->ncmds = ncmds;
+	/* Extra reference to survive synchronous callbacks */
+	emul->pending = ncmds + 1;
+	emul->cb = cb;
+	emul->ud = ud;
+
+	for (i = 0; i < ncmds; i ++) {
+		item = g_malloc (sizeof (*item));
+		item->parent = emul;
+		item->idx = i;
+		bk->subr->check (bk, cmds[i], rspamd_fuzzy_multi_emul_cb, item,
+				bk->subr_ud);
+	}
+
+	rspamd_fuzzy_multi_emul_unref (emul);
+}
+
 static guint
 rspamd_fuzzy_digest_hash (gconstpointer key)
 {
@@ -570,3 +823,36 @@ rspamd_fuzzy_backend_get_expire (struct rspamd_fuzzy_backend *backend)
 {
 	return backend->expire;
 }
+
+void
+rspamd_fuzzy_backend_lsh_bands (const struct rspamd_shingle *sgl,
+		guint64 *bands)
+{
+	guint i;
+
+	for (i = 0; i < RSPAMD_FUZZY_LSH_BANDS; i ++) {
+		bands[i] = rspamd_cryptobox_fast_hash (
+				&sgl->hashes[i * RSPAMD_FUZZY_LSH_ROWS],
+				sizeof (sgl->hashes[0]) * RSPAMD_FUZZY_LSH_ROWS,
+				i);
+	}
+}
+
+gdouble
+rspamd_fuzzy_backend_lsh_prob (guint nmatched)
+{
+	/*
+	 * A band matches with probability s^rows for similarity s, so we
+	 * invert the fraction of matched bands
+	 */
+	if (nmatched == 0) {
+		return 0.0;
+	}
+
+	if (nmatched >= RSPAMD_FUZZY_LSH_BANDS) {
+		return 1.0;
+	}
+
+	return pow ((gdouble)nmatched / RSPAMD_FUZZY_LSH_BANDS,
+			1.0 / RSPAMD_FUZZY_LSH_ROWS);
+}
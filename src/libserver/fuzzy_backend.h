@@ -23,10 +23,19 @@
 struct rspamd_fuzzy_backend;
 struct rspamd_config;
 
+/*
+ * Banded similarity index: each band is a hash of RSPAMD_FUZZY_LSH_ROWS
+ * consecutive shingles, so a single probe per band finds candidates
+ */
+#define RSPAMD_FUZZY_LSH_ROWS 4
+#define RSPAMD_FUZZY_LSH_BANDS (RSPAMD_SHINGLE_SIZE / RSPAMD_FUZZY_LSH_ROWS)
+
 /*
  * Callbacks for fuzzy methods
  */
 typedef void (*rspamd_fuzzy_check_cb) (struct rspamd_fuzzy_reply *rep, void *ud);
+typedef void (*rspamd_fuzzy_check_multi_cb) (struct rspamd_fuzzy_reply *reps,
+		guint nreps, void *ud);
 typedef void (*rspamd_fuzzy_update_cb) (gboolean success,
 										guint nadded,
 										guint ndeleted,
@@ -60,6 +69,18 @@ void rspamd_fuzzy_backend_check (struct rspamd_fuzzy_backend *bk,
 		const struct rspamd_fuzzy_cmd *cmd,
 		rspamd_fuzzy_check_cb cb, void *ud);
 
+/**
+ * Check several hashes at once, callback is called once with replies in
+ * the same order as commands
+ * @param cmds array of commands, must be alive until callback is called
+ * @param ncmds number of commands
+ * @param cb
+ * @param ud
+ */
+void rspamd_fuzzy_backend_check_multi (struct rspamd_fuzzy_backend *bk,
+		const struct rspamd_fuzzy_cmd **cmds, guint ncmds,
+		rspamd_fuzzy_check_multi_cb cb, void *ud);
+
 /**
  * Process updates for a specific queue
  * @param bk
@@ -109,6 +130,21 @@ void rspamd_fuzzy_backend_start_update (struct rspamd_fuzzy_backend *backend,
 struct event_base* rspamd_fuzzy_backend_event_base (struct rspamd_fuzzy_backend *backend);
 gdouble rspamd_fuzzy_backend_get_expire (struct rspamd_fuzzy_backend *backend);
 
+/**
+ * Computes RSPAMD_FUZZY_LSH_BANDS band hashes for shingles
+ * @param sgl
+ * @param bands output array of RSPAMD_FUZZY_LSH_BANDS elements
+ */
+void rspamd_fuzzy_backend_lsh_bands (const struct rspamd_shingle *sgl,
+		guint64 *bands);
+
+/**
+ * Estimates similarity from the number of matched bands
+ * @param nmatched
+ * @return similarity in range [0, 1]
+ */
+gdouble rspamd_fuzzy_backend_lsh_prob (guint nmatched);
+
 /**
  * Closes backend
  * @param backend
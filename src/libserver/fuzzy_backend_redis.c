@@ -57,6 +57,7 @@ struct rspamd_fuzzy_backend_redis {
 	gchar *id;
 	struct rspamd_redis_pool *pool;
 	gdouble timeout;
+	gboolean lsh;
 	ref_entry_t ref;
 };
 
@@ -280,6 +281,12 @@ rspamd_fuzzy_backend_init_redis (struct rspamd_fuzzy_backend *bk,
 		return NULL;
 	}
 
+	elt = ucl_object_lookup (obj, "lsh");
+
+	if (elt) {
+		backend->lsh = ucl_object_toboolean (elt);
+	}
+
 	REF_INIT_RETAIN (backend, rspamd_fuzzy_backend_redis_dtor);
 	backend->pool = cfg->redis_pool;
 	rspamd_cryptobox_hash_init (&st, NULL, 0);
@@ -326,6 +333,49 @@ rspamd_fuzzy_redis_timeout (gint fd, short what, gpointer priv)
 static void rspamd_fuzzy_redis_check_callback (redisAsyncContext *c, gpointer r,
 		gpointer priv);
 
+static inline guint
+rspamd_fuzzy_redis_nshingle_keys (struct rspamd_fuzzy_backend_redis *backend)
+{
+	return backend->lsh ? RSPAMD_FUZZY_LSH_BANDS : RSPAMD_SHINGLE_SIZE;
+}
+
+/*
+ * Fills keys of shingles index and returns their number:
+ * <prefix>_<number>_<value> for each shingle, or
+ * <prefix>_b<band>_<value> for each band if lsh index is used
+ */
+static guint
+rspamd_fuzzy_redis_shingle_keys (struct rspamd_fuzzy_backend_redis *backend,
+		const struct rspamd_shingle *sgl, GString **keys)
+{
+	guint64 bands[RSPAMD_FUZZY_LSH_BANDS];
+	guint i, init_len;
+
+	init_len = strlen (backend->redis_object);
+
+	if (backend->lsh) {
+		rspamd_fuzzy_backend_lsh_bands (sgl, bands);
+
+		for (i = 0; i < RSPAMD_FUZZY_LSH_BANDS; i ++) {
+			keys[i] = g_string_sized_new (init_len + 3 + 2 +
+					sizeof ("18446744073709551616"));
+			rspamd_printf_gstring (keys[i], "%s_b%d_%uL", backend->redis_object,
+					i, bands[i]);
+		}
+
+		return RSPAMD_FUZZY_LSH_BANDS;
+	}
+
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+		keys[i] = g_string_sized_new (init_len + 2 + 2 +
+				sizeof ("18446744073709551616"));
+		rspamd_printf_gstring (keys[i], "%s_%d_%uL", backend->redis_object,
+				i, sgl->hashes[i]);
+	}
+
+	return RSPAMD_SHINGLE_SIZE;
+}
+
 struct _rspamd_fuzzy_shingles_helper {
 	guchar digest[64];
 	guint found;
@@ -350,20 +400,23 @@ rspamd_fuzzy_redis_shingles_callback (redisAsyncContext *c, gpointer r,
 	struct timeval tv;
 	GString *key;
 	struct _rspamd_fuzzy_shingles_helper *shingles, *prev = NULL, *sel = NULL;
-	guint i, found = 0, max_found = 0, cur_found = 0;
+	guint i, found = 0, max_found = 0, cur_found = 0, nkeys, min_found;
 
 	event_del (&session->timeout);
 	memset (&rep, 0, sizeof (rep));
+	nkeys = rspamd_fuzzy_redis_nshingle_keys (session->backend);
+	/* Any band match is a candidate, shingles require majority */
+	min_found = session->backend->lsh ? 1 : RSPAMD_SHINGLE_SIZE / 2 + 1;
 
 	if (c->err == 0) {
 		rspamd_upstream_ok (session->up);
 
 		if (reply->type == REDIS_REPLY_ARRAY &&
-				reply->elements == RSPAMD_SHINGLE_SIZE) {
+				reply->elements == nkeys) {
 			shingles = g_alloca (sizeof (struct _rspamd_fuzzy_shingles_helper) *
-					RSPAMD_SHINGLE_SIZE);
+					nkeys);
 
-			for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			for (i = 0; i < nkeys; i ++) {
 				cur = reply->element[i];
 
 				if (cur->type == REDIS_REPLY_STRING) {
@@ -377,35 +430,39 @@ rspamd_fuzzy_redis_shingles_callback (redisAsyncContext *c, gpointer r,
 				}
 			}
 
-			if (found > RSPAMD_SHINGLE_SIZE / 2) {
+			if (found >= min_found) {
 				/* Now sort to find the most frequent element */
-				qsort (shingles, RSPAMD_SHINGLE_SIZE,
+				qsort (shingles, nkeys,
 						sizeof (struct _rspamd_fuzzy_shingles_helper),
 						rspamd_fuzzy_backend_redis_shingles_cmp);
 
-				prev = &shingles[0];
-
-				for (i = 1; i < RSPAMD_SHINGLE_SIZE; i ++) {
+				for (i = 0; i < nkeys; i ++) {
 					if (!shingles[i].found) {
 						continue;
 					}
 
-					if (memcmp (shingles[i].digest, prev->digest, 64) == 0) {
+					if (prev && memcmp (shingles[i].digest, prev->digest, 64) == 0) {
 						cur_found ++;
-
-						if (cur_found > max_found) {
-							max_found = cur_found;
-							sel = &shingles[i];
-						}
 					}
 					else {
 						cur_found = 1;
 						prev = &shingles[i];
 					}
+
+					if (cur_found > max_found) {
+						max_found = cur_found;
+						sel = &shingles[i];
+					}
 				}
 
-				if (max_found > RSPAMD_SHINGLE_SIZE / 2) {
-					session->prob = ((float)max_found) / RSPAMD_SHINGLE_SIZE;
+				if (max_found >= min_found) {
+					if (session->backend->lsh) {
+						session->prob = rspamd_fuzzy_backend_lsh_prob (max_found);
+					}
+					else {
+						session->prob = ((float)max_found) / RSPAMD_SHINGLE_SIZE;
+					}
+
 					rep.v1.prob = session->prob;
 
 					g_assert (sel != NULL);
@@ -486,28 +543,24 @@ rspamd_fuzzy_backend_check_shingles (struct rspamd_fuzzy_redis_session *session)
 	struct timeval tv;
 	struct rspamd_fuzzy_reply rep;
 	const struct rspamd_fuzzy_shingle_cmd *shcmd;
-	GString *key;
-	guint i, init_len;
+	GString *keys[RSPAMD_SHINGLE_SIZE];
+	guint i, nkeys;
 
 	rspamd_fuzzy_redis_session_free_args (session);
-	/* First of all check digest */
-	session->nargs = RSPAMD_SHINGLE_SIZE + 1;
+	shcmd = (const struct rspamd_fuzzy_shingle_cmd *)session->cmd;
+	nkeys = rspamd_fuzzy_redis_shingle_keys (session->backend, &shcmd->sgl,
+			keys);
+	session->nargs = nkeys + 1;
 	session->argv = g_malloc (sizeof (gchar *) * session->nargs);
 	session->argv_lens = g_malloc (sizeof (gsize) * session->nargs);
-	shcmd = (const struct rspamd_fuzzy_shingle_cmd *)session->cmd;
 
 	session->argv[0] = g_strdup ("MGET");
 	session->argv_lens[0] = 4;
-	init_len = strlen (session->backend->redis_object);
-
-	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
 
-		key = g_string_sized_new (init_len + 2 + 2 + sizeof ("18446744073709551616"));
-		rspamd_printf_gstring (key, "%s_%d_%uL", session->backend->redis_object,
-				i, shcmd->sgl.hashes[i]);
-		session->argv[i + 1] = key->str;
-		session->argv_lens[i + 1] = key->len;
-		g_string_free (key, FALSE); /* Do not free underlying array */
+	for (i = 0; i < nkeys; i ++) {
+		session->argv[i + 1] = keys[i]->str;
+		session->argv_lens[i + 1] = keys[i]->len;
+		g_string_free (keys[i], FALSE); /* Do not free underlying array */
 	}
 
 	session->shingles_checked = TRUE;
@@ -536,53 +589,64 @@ rspamd_fuzzy_backend_check_shingles (struct rspamd_fuzzy_redis_session *session)
 	}
 }
 
-static void
-rspamd_fuzzy_redis_check_callback (redisAsyncContext *c, gpointer r,
-		gpointer priv)
+/*
+ * Parses reply for `HMGET key V F C`, returns number of value fields found
+ */
+static guint
+rspamd_fuzzy_redis_parse_hmget (redisReply *reply,
+		struct rspamd_fuzzy_reply *rep)
 {
-	struct rspamd_fuzzy_redis_session *session = priv;
-	redisReply *reply = r, *cur;
-	struct rspamd_fuzzy_reply rep;
-	gulong value;
+	redisReply *cur;
 	guint found_elts = 0;
 
-	event_del (&session->timeout);
-	memset (&rep, 0, sizeof (rep));
+	if (reply->type == REDIS_REPLY_ARRAY && reply->elements >= 2) {
+		cur = reply->element[0];
 
-	if (c->err == 0) {
-		rspamd_upstream_ok (session->up);
+		if (cur->type == REDIS_REPLY_STRING) {
+			rep->v1.value = strtoul (cur->str, NULL, 10);
+			found_elts ++;
+		}
 
-		if (reply->type == REDIS_REPLY_ARRAY && reply->elements >= 2) {
-			cur = reply->element[0];
+		cur = reply->element[1];
 
-			if (cur->type == REDIS_REPLY_STRING) {
-				value = strtoul (cur->str, NULL, 10);
-				rep.v1.value = value;
-				found_elts ++;
-			}
+		if (cur->type == REDIS_REPLY_STRING) {
+			rep->v1.flag = strtoul (cur->str, NULL, 10);
+			found_elts ++;
+		}
 
-			cur = reply->element[1];
+		rep->ts = 0;
+
+		if (reply->elements > 2) {
+			cur = reply->element[2];
 
 			if (cur->type == REDIS_REPLY_STRING) {
-				value = strtoul (cur->str, NULL, 10);
-				rep.v1.flag = value;
-				found_elts ++;
+				rep->ts = strtoul (cur->str, NULL, 10);
 			}
+		}
+	}
 
-			if (found_elts >= 2) {
-				rep.v1.prob = session->prob;
-				memcpy (rep.digest, session->found_digest, sizeof (rep.digest));
-			}
+	return found_elts;
+}
 
-			rep.ts = 0;
+static void
+rspamd_fuzzy_redis_check_callback (redisAsyncContext *c, gpointer r,
+		gpointer priv)
+{
+	struct rspamd_fuzzy_redis_session *session = priv;
+	redisReply *reply = r;
+	struct rspamd_fuzzy_reply rep;
+	guint found_elts = 0;
 
-			if (reply->elements > 2) {
-				cur = reply->element[2];
+	event_del (&session->timeout);
+	memset (&rep, 0, sizeof (rep));
 
-				if (cur->type == REDIS_REPLY_STRING) {
-					rep.ts = strtoul (cur->str, NULL, 10);
-				}
-			}
+	if (c->err == 0) {
+		rspamd_upstream_ok (session->up);
+		found_elts = rspamd_fuzzy_redis_parse_hmget (reply, &rep);
+
+		if (found_elts >= 2) {
+			rep.v1.prob = session->prob;
+			memcpy (rep.digest, session->found_digest, sizeof (rep.digest));
 		}
 
 		if (found_elts != 2) {
@@ -619,21 +683,66 @@ rspamd_fuzzy_redis_check_callback (redisAsyncContext *c, gpointer r,
 	rspamd_fuzzy_redis_session_dtor (session, FALSE);
 }
 
-void
-rspamd_fuzzy_backend_check_redis (struct rspamd_fuzzy_backend *bk,
-		const struct rspamd_fuzzy_cmd *cmd,
-		rspamd_fuzzy_check_cb cb, void *ud,
-		void *subr_ud)
+static inline void
+rspamd_fuzzy_redis_hmget_args (struct rspamd_fuzzy_backend_redis *backend,
+		const guchar *digest, gchar **argv, gsize *argv_lens)
+{
+	GString *key;
+
+	key = g_string_new (backend->redis_object);
+	g_string_append_len (key, digest, rspamd_cryptobox_HASHBYTES);
+	argv[0] = g_strdup ("HMGET");
+	argv_lens[0] = 5;
+	argv[1] = key->str;
+	argv_lens[1] = key->len;
+	argv[2] = g_strdup ("V");
+	argv_lens[2] = 1;
+	argv[3] = g_strdup ("F");
+	argv_lens[3] = 1;
+	argv[4] = g_strdup ("C");
+	argv_lens[4] = 1;
+	g_string_free (key, FALSE); /* Do not free underlying array */
+}
+
+static redisAsyncContext *
+rspamd_fuzzy_redis_connect_read (struct rspamd_fuzzy_backend_redis *backend,
+		struct upstream **pup)
 {
-	struct rspamd_fuzzy_backend_redis *backend = subr_ud;
-	struct rspamd_fuzzy_redis_session *session;
 	struct upstream *up;
-	struct timeval tv;
 	rspamd_inet_addr_t *addr;
-	struct rspamd_fuzzy_reply rep;
-	GString *key;
+	redisAsyncContext *ctx;
 
-	g_assert (backend != NULL);
+	up = rspamd_upstream_get (backend->read_servers,
+			RSPAMD_UPSTREAM_ROUND_ROBIN,
+			NULL,
+			0);
+
+	*pup = up;
+	addr = rspamd_upstream_addr (up);
+	g_assert (addr != NULL);
+	ctx = rspamd_redis_pool_connect (backend->pool,
+			backend->dbname, backend->password,
+			rspamd_inet_address_to_string (addr),
+			rspamd_inet_address_get_port (addr));
+
+	if (ctx == NULL) {
+		rspamd_upstream_fail (up, TRUE);
+	}
+
+	return ctx;
+}
+
+/*
+ * Creates check session connected to a read server, returns NULL if
+ * connection has failed
+ */
+static struct rspamd_fuzzy_redis_session *
+rspamd_fuzzy_redis_check_session_new (struct rspamd_fuzzy_backend *bk,
+		struct rspamd_fuzzy_backend_redis *backend,
+		const struct rspamd_fuzzy_cmd *cmd,
+		rspamd_fuzzy_check_cb cb, void *ud)
+{
+	struct rspamd_fuzzy_redis_session *session;
 
 	session = g_malloc0 (sizeof (*session));
 	session->backend = backend;
@@ -644,44 +753,54 @@ rspamd_fuzzy_backend_check_redis (struct rspamd_fuzzy_backend *bk,
 	session->command = RSPAMD_FUZZY_REDIS_COMMAND_CHECK;
 	session->cmd = cmd;
 	session->prob = 1.0;
-	memcpy (rep.digest, session->cmd->digest, sizeof (rep.digest));
-	memcpy (session->found_digest, session->cmd->digest, sizeof (rep.digest));
+	memcpy (session->found_digest, session->cmd->digest,
+			sizeof (session->found_digest));
 	session->ev_base = rspamd_fuzzy_backend_event_base (bk);
+	session->ctx = rspamd_fuzzy_redis_connect_read (backend, &session->up);
+
+	if (session->ctx == NULL) {
+		rspamd_fuzzy_redis_session_dtor (session, TRUE);
+
+		return NULL;
+	}
+
+	return session;
+}
+
+void
+rspamd_fuzzy_backend_check_redis (struct rspamd_fuzzy_backend *bk,
+		const struct rspamd_fuzzy_cmd *cmd,
+		rspamd_fuzzy_check_cb cb, void *ud,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_redis *backend = subr_ud;
+	struct rspamd_fuzzy_redis_session *session;
+	struct timeval tv;
+	struct rspamd_fuzzy_reply rep;
+
+	g_assert (backend != NULL);
+
+	session = rspamd_fuzzy_redis_check_session_new (bk, backend, cmd, cb, ud);
+
+	if (session == NULL) {
+		if (cb) {
+			memset (&rep, 0, sizeof (rep));
+			cb (&rep, ud);
+		}
+
+		return;
+	}
 
 	/* First of all check digest */
 	session->nargs = 5;
 	session->argv = g_malloc (sizeof (gchar *) * session->nargs);
 	session->argv_lens = g_malloc (sizeof (gsize) * session->nargs);
+	rspamd_fuzzy_redis_hmget_args (backend, cmd->digest, session->argv,
+			session->argv_lens);
 
-	key = g_string_new (backend->redis_object);
-	g_string_append_len (key, cmd->digest, sizeof (cmd->digest));
-	session->argv[0] = g_strdup ("HMGET");
-	session->argv_lens[0] = 5;
-	session->argv[1] = key->str;
-	session->argv_lens[1] = key->len;
-	session->argv[2] = g_strdup ("V");
-	session->argv_lens[2] = 1;
-	session->argv[3] = g_strdup ("F");
-	session->argv_lens[3] = 1;
-	session->argv[4] = g_strdup ("C");
-	session->argv_lens[4] = 1;
-	g_string_free (key, FALSE); /* Do not free underlying array */
-
-	up = rspamd_upstream_get (backend->read_servers,
-			RSPAMD_UPSTREAM_ROUND_ROBIN,
-			NULL,
-			0);
-
-	session->up = up;
-	addr = rspamd_upstream_addr (up);
-	g_assert (addr != NULL);
-	session->ctx = rspamd_redis_pool_connect (backend->pool,
-			backend->dbname, backend->password,
-			rspamd_inet_address_to_string (addr),
-			rspamd_inet_address_get_port (addr));
-
-	if (session->ctx == NULL) {
-		rspamd_upstream_fail (up, TRUE);
+	if (redisAsyncCommandArgv (session->ctx, rspamd_fuzzy_redis_check_callback,
+			session, session->nargs,
+			(const gchar **)session->argv, session->argv_lens) != REDIS_OK) {
 		rspamd_fuzzy_redis_session_dtor (session, TRUE);
 
 		if (cb) {
@@ -690,27 +809,241 @@ rspamd_fuzzy_backend_check_redis (struct rspamd_fuzzy_backend *bk,
 		}
 	}
 	else {
-		if (redisAsyncCommandArgv (session->ctx, rspamd_fuzzy_redis_check_callback,
-				session, session->nargs,
-				(const gchar **)session->argv, session->argv_lens) != REDIS_OK) {
-			rspamd_fuzzy_redis_session_dtor (session, TRUE);
+		/* Add timeout */
+		event_set (&session->timeout, -1, EV_TIMEOUT, rspamd_fuzzy_redis_timeout,
+				session);
+		event_base_set (session->ev_base, &session->timeout);
+		double_to_tv (backend->timeout, &tv);
+		event_add (&session->timeout, &tv);
+	}
+}
 
-			if (cb) {
-				memset (&rep, 0, sizeof (rep));
-				cb (&rep, ud);
+/*
+ * Multiple checks are pipelined over a single connection: all direct
+ * digests are requested at once and only the misses that have shingles
+ * are then processed by the ordinary check sessions
+ */
+struct rspamd_fuzzy_redis_multi_session;
+
+struct rspamd_fuzzy_redis_multi_item {
+	struct rspamd_fuzzy_redis_multi_session *multi;
+	guint idx;
+	gchar *argv[5];
+	gsize argv_lens[5];
+};
+
+struct rspamd_fuzzy_redis_multi_session {
+	struct rspamd_fuzzy_backend_redis *backend;
+	struct rspamd_fuzzy_backend *bk;
+	redisAsyncContext *ctx;
+	struct event timeout;
+	struct upstream *up;
+	const struct rspamd_fuzzy_cmd **cmds;
+	struct rspamd_fuzzy_redis_multi_item *items;
+	struct rspamd_fuzzy_reply *reps;
+	guint ncmds;
+	guint inflight; /* Commands pending on the pipelined connection */
+	guint pending; /* Commands without final reply */
+	gboolean is_fatal;
+	rspamd_fuzzy_check_multi_cb cb;
+	void *cbdata;
+};
+
+static void
+rspamd_fuzzy_redis_multi_unref (struct rspamd_fuzzy_redis_multi_session *multi)
+{
+	guint i, j;
+
+	if (-- multi->pending == 0) {
+		if (multi->cb) {
+			multi->cb (multi->reps, multi->ncmds, multi->cbdata);
+		}
+
+		for (i = 0; i < multi->ncmds; i ++) {
+			for (j = 0; j < G_N_ELEMENTS (multi->items[i].argv); j ++) {
+				g_free (multi->items[i].argv[j]);
 			}
 		}
-		else {
-			/* Add timeout */
-			event_set (&session->timeout, -1, EV_TIMEOUT, rspamd_fuzzy_redis_timeout,
-					session);
-			event_base_set (session->ev_base, &session->timeout);
-			double_to_tv (backend->timeout, &tv);
-			event_add (&session->timeout, &tv);
+
+		REF_RELEASE (multi->backend);
+		g_free (multi->items);
+		g_free (multi->reps);
+		g_free (multi);
+	}
+}
+
+static void
+rspamd_fuzzy_redis_multi_unref_conn (
+		struct rspamd_fuzzy_redis_multi_session *multi)
+{
+	redisAsyncContext *ac;
+
+	if (-- multi->inflight == 0) {
+		if (rspamd_event_pending (&multi->timeout, EV_TIMEOUT)) {
+			event_del (&multi->timeout);
+		}
+
+		if (multi->ctx) {
+			ac = multi->ctx;
+			multi->ctx = NULL;
+			rspamd_redis_pool_release_connection (multi->backend->pool,
+					ac, multi->is_fatal);
 		}
 	}
 }
 
+static void
+rspamd_fuzzy_redis_multi_timeout (gint fd, short what, gpointer priv)
+{
+	struct rspamd_fuzzy_redis_multi_session *multi = priv;
+	redisAsyncContext *ac;
+	static char errstr[128];
+
+	if (multi->ctx) {
+		ac = multi->ctx;
+		multi->ctx = NULL;
+		ac->err = REDIS_ERR_IO;
+		/* Should be safe as in hiredis it is char[128] */
+		rspamd_snprintf (errstr, sizeof (errstr), "%s", strerror (ETIMEDOUT));
+		ac->errstr = errstr;
+
+		/* This will call all pending callbacks with an error */
+		rspamd_redis_pool_release_connection (multi->backend->pool,
+				ac, TRUE);
+	}
+}
+
+static void
+rspamd_fuzzy_redis_multi_shingles_cb (struct rspamd_fuzzy_reply *rep,
+		void *ud)
+{
+	struct rspamd_fuzzy_redis_multi_item *item = ud;
+	struct rspamd_fuzzy_redis_multi_session *multi = item->multi;
+
+	memcpy (&multi->reps[item->idx], rep, sizeof (*rep));
+	rspamd_fuzzy_redis_multi_unref (multi);
+}
+
+static void
+rspamd_fuzzy_redis_multi_check_callback (redisAsyncContext *c, gpointer r,
+		gpointer priv)
+{
+	struct rspamd_fuzzy_redis_multi_item *item = priv;
+	struct rspamd_fuzzy_redis_multi_session *multi = item->multi;
+	struct rspamd_fuzzy_redis_session *session;
+	const struct rspamd_fuzzy_cmd *cmd = multi->cmds[item->idx];
+	struct rspamd_fuzzy_reply *rep = &multi->reps[item->idx];
+	guint found_elts = 0;
+
+	if (c->err == 0) {
+		rspamd_upstream_ok (multi->up);
+		found_elts = rspamd_fuzzy_redis_parse_hmget (r, rep);
+
+		if (found_elts >= 2) {
+			rep->v1.prob = 1.0;
+			memcpy (rep->digest, cmd->digest, sizeof (rep->digest));
+		}
+	}
+	else {
+		if (c->errstr && !multi->is_fatal) {
+			msg_err ("error getting hashes: %s", c->errstr);
+		}
+
+		if (!multi->is_fatal) {
+			rspamd_upstream_fail (multi->up, FALSE);
+		}
+
+		multi->is_fatal = TRUE;
+	}
+
+	rspamd_fuzzy_redis_multi_unref_conn (multi);
+
+	if (c->err == 0 && found_elts != 2 && cmd->shingles_count > 0) {
+		memset (rep, 0, sizeof (*rep));
+		session = rspamd_fuzzy_redis_check_session_new (multi->bk,
+				multi->backend, cmd,
+				rspamd_fuzzy_redis_multi_shingles_cb, item);
+
+		if (session != NULL) {
+			/* Direct digest has been already checked */
+			rspamd_fuzzy_backend_check_shingles (session);
+
+			return;
+		}
+	}
+	else if (found_elts != 2) {
+		memset (rep, 0, sizeof (*rep));
+	}
+
+	rspamd_fuzzy_redis_multi_unref (multi);
+}
+
+void
+rspamd_fuzzy_backend_check_multi_redis (struct rspamd_fuzzy_backend *bk,
+		const struct rspamd_fuzzy_cmd **cmds, guint ncmds,
+		rspamd_fuzzy_check_multi_cb cb, void *ud,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_redis *backend = subr_ud;
+	struct rspamd_fuzzy_redis_multi_session *multi;
+	struct rspamd_fuzzy_redis_multi_item *item;
+	struct timeval tv;
+	guint i;
+
+	g_assert (backend != NULL);
+
+	multi = g_malloc0 (sizeof (*multi));
+	multi->backend = backend;
+	REF_RETAIN (multi->backend);
+	multi->bk = bk;
+	multi->cmds = cmds;
+	multi->ncmds = ncmds;
+	multi->items = g_malloc0 (sizeof (*multi->items) * ncmds);
+	multi->reps = g_malloc0 (sizeof (*multi->reps) * ncmds);
+	multi->cb = cb;
+	multi->cbdata = ud;
+	/* Extra references are dropped when all commands are sent */
+	multi->pending = ncmds + 1;
+	multi->inflight = ncmds + 1;
+	multi->ctx = rspamd_fuzzy_redis_connect_read (backend, &multi->up);
+
+	if (multi->ctx == NULL) {
+		multi->inflight = 0;
+		multi->pending = 1;
+		rspamd_fuzzy_redis_multi_unref (multi);
+
+		return;
+	}
+
+	for (i = 0; i < ncmds; i ++) {
+		item = &multi->items[i];
+		item->multi = multi;
+		item->idx = i;
+		rspamd_fuzzy_redis_hmget_args (backend, cmds[i]->digest,
+				item->argv, item->argv_lens);
+
+		if (redisAsyncCommandArgv (multi->ctx,
+				rspamd_fuzzy_redis_multi_check_callback,
+				item, G_N_ELEMENTS (item->argv),
+				(const gchar **)item->argv, item->argv_lens) != REDIS_OK) {
+			multi->is_fatal = TRUE;
+			multi->inflight --;
+			multi->pending --;
+		}
+	}
+
+	if (multi->inflight > 1) {
+		event_set (&multi->timeout, -1, EV_TIMEOUT,
+				rspamd_fuzzy_redis_multi_timeout, multi);
+		event_base_set (rspamd_fuzzy_backend_event_base (bk), &multi->timeout);
+		double_to_tv (backend->timeout, &tv);
+		event_add (&multi->timeout, &tv);
+	}
+
+	rspamd_fuzzy_redis_multi_unref_conn (multi);
+	rspamd_fuzzy_redis_multi_unref (multi);
+}
+
 static void
 rspamd_fuzzy_redis_count_callback (redisAsyncContext *c, gpointer r,
 		gpointer priv)
@@ -980,9 +1313,9 @@ rspamd_fuzzy_update_append_command (struct rspamd_fuzzy_backend *bk,
 		struct rspamd_fuzzy_redis_session *session,
 		struct fuzzy_peer_cmd *io_cmd, guint *shift)
 {
-	GString *key, *value;
+	GString *key, *value, *keys[RSPAMD_SHINGLE_SIZE];
 	guint cur_shift = *shift;
-	guint i, klen;
+	guint i, klen, nkeys, nargs;
 	struct rspamd_fuzzy_cmd *cmd;
 
 	if (io_cmd->is_shingle) {
@@ -1206,23 +1539,26 @@ rspamd_fuzzy_update_append_command (struct rspamd_fuzzy_backend *bk,
 	}
 
 	if (io_cmd->is_shingle) {
-		if (cmd->cmd == FUZZY_WRITE) {
-			klen = strlen (session->backend->redis_object) +
-							64 + 1;
+		if (cmd->cmd == FUZZY_DUP) {
+			/* Ignore */
+			*shift = cur_shift;
 
-			for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			return TRUE;
+		}
+
+		nkeys = rspamd_fuzzy_redis_shingle_keys (session->backend,
+				&io_cmd->cmd.shingle.sgl, keys);
+
+		for (i = 0; i < nkeys; i ++) {
+			key = keys[i];
+
+			if (cmd->cmd == FUZZY_WRITE) {
 				guchar *hval;
 				/*
-				 * For each command with shingles we additionally emit 32 commands:
-				 * SETEX <prefix>_<number>_<value> <expire> <digest>
+				 * For each command with shingles we additionally emit
+				 * a command per shingle or per band:
+				 * SETEX <shingle_key> <expire> <digest>
 				 */
-
-				/* SETEX */
-				key = g_string_sized_new (klen);
-				rspamd_printf_gstring (key, "%s_%d_%uL",
-						session->backend->redis_object,
-						i,
-						io_cmd->cmd.shingle.sgl.hashes[i]);
 				value = g_string_sized_new (sizeof ("4294967296"));
 				rspamd_printf_gstring (value, "%d",
 						(gint)rspamd_fuzzy_backend_get_expire (bk));
@@ -1239,57 +1575,18 @@ rspamd_fuzzy_update_append_command (struct rspamd_fuzzy_backend *bk,
 				session->argv_lens[cur_shift++] = sizeof (io_cmd->cmd.shingle.basic.digest);
 				g_string_free (key, FALSE);
 				g_string_free (value, FALSE);
-
-				if (redisAsyncCommandArgv (session->ctx, NULL, NULL,
-						4,
-						(const gchar **)&session->argv[cur_shift - 4],
-						&session->argv_lens[cur_shift - 4]) != REDIS_OK) {
-
-					return FALSE;
-				}
+				nargs = 4;
 			}
-		}
-		else if (cmd->cmd == FUZZY_DEL) {
-			klen = strlen (session->backend->redis_object) +
-					64 + 1;
-
-			for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
-				key = g_string_sized_new (klen);
-				rspamd_printf_gstring (key, "%s_%d_%uL",
-						session->backend->redis_object,
-						i,
-						io_cmd->cmd.shingle.sgl.hashes[i]);
+			else if (cmd->cmd == FUZZY_DEL) {
 				session->argv[cur_shift] = g_strdup ("DEL");
 				session->argv_lens[cur_shift++] = sizeof ("DEL") - 1;
 				session->argv[cur_shift] = key->str;
 				session->argv_lens[cur_shift++] = key->len;
 				g_string_free (key, FALSE);
-
-				if (redisAsyncCommandArgv (session->ctx, NULL, NULL,
-						2,
-						(const gchar **)&session->argv[cur_shift - 2],
-						&session->argv_lens[cur_shift - 2]) != REDIS_OK) {
-
-					return FALSE;
-				}
+				nargs = 2;
 			}
-		}
-		else if (cmd->cmd == FUZZY_REFRESH) {
-			klen = strlen (session->backend->redis_object) +
-				   64 + 1;
-
-			for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
-				/*
-				 * For each command with shingles we additionally emit 32 commands:
-				 * EXPIRE <prefix>_<number>_<value> <expire>
-				 */
-
-				/* Expire */
-				key = g_string_sized_new (klen);
-				rspamd_printf_gstring (key, "%s_%d_%uL",
-						session->backend->redis_object,
-						i,
-						io_cmd->cmd.shingle.sgl.hashes[i]);
+			else if (cmd->cmd == FUZZY_REFRESH) {
+				/* EXPIRE <shingle_key> <expire> */
 				value = g_string_sized_new (sizeof ("18446744073709551616"));
 				rspamd_printf_gstring (value, "%d",
 						(gint)rspamd_fuzzy_backend_get_expire (bk));
@@ -1301,22 +1598,24 @@ rspamd_fuzzy_update_append_command (struct rspamd_fuzzy_backend *bk,
 				session->argv_lens[cur_shift++] = value->len;
 				g_string_free (key, FALSE);
 				g_string_free (value, FALSE);
+				nargs = 3;
+			}
+			else {
+				g_assert_not_reached ();
+			}
 
-				if (redisAsyncCommandArgv (session->ctx, NULL, NULL,
-						3,
-						(const gchar **)&session->argv[cur_shift - 3],
-						&session->argv_lens[cur_shift - 3]) != REDIS_OK) {
-
-					return FALSE;
+			if (redisAsyncCommandArgv (session->ctx, NULL, NULL,
+					nargs,
+					(const gchar **)&session->argv[cur_shift - nargs],
+					&session->argv_lens[cur_shift - nargs]) != REDIS_OK) {
+				/* Keys for the remaining shingles are not used */
+				for (i = i + 1; i < nkeys; i ++) {
+					g_string_free (keys[i], TRUE);
 				}
+
+				return FALSE;
 			}
 		}
-		else if (cmd->cmd == FUZZY_DUP) {
-			/* Ignore */
-		}
-		else {
-			g_assert_not_reached ();
-		}
 	}
 
 	*shift = cur_shift;
@@ -1382,9 +1681,10 @@ rspamd_fuzzy_backend_update_redis (struct rspamd_fuzzy_backend *bk,
 	GString *key;
 	struct fuzzy_peer_cmd *io_cmd;
 	struct rspamd_fuzzy_cmd *cmd;
-	guint nargs, ncommands, cur_shift;
+	guint nargs, ncommands, cur_shift, nkeys;
 
 	g_assert (backend != NULL);
+	nkeys = rspamd_fuzzy_redis_nshingle_keys (backend);
 
 	session = g_malloc0 (sizeof (*session));
 	session->backend = backend;
@@ -1399,7 +1699,8 @@ rspamd_fuzzy_backend_update_redis (struct rspamd_fuzzy_backend *bk,
 	 *
 	 * Where <key> is <prefix> || <digest>
 	 *
-	 * For each command with shingles we additionally emit 32 commands:
+	 * For each command with shingles we additionally emit 32 commands
+	 * (or one per band if lsh index is used):
 	 * SETEX <prefix>_<number>_<value> <expire> <digest>
 	 *
 	 * For each delete command we emit:
@@ -1429,8 +1730,8 @@ rspamd_fuzzy_backend_update_redis (struct rspamd_fuzzy_backend *bk,
 			session->nadded ++;
 
 			if (io_cmd->is_shingle) {
-				ncommands += RSPAMD_SHINGLE_SIZE;
-				nargs += RSPAMD_SHINGLE_SIZE * 4;
+				ncommands += nkeys;
+				nargs += nkeys * 4;
 			}
 
 		}
@@ -1440,8 +1741,8 @@ rspamd_fuzzy_backend_update_redis (struct rspamd_fuzzy_backend *bk,
 			session->ndeleted ++;
 
 			if (io_cmd->is_shingle) {
-				ncommands += RSPAMD_SHINGLE_SIZE;
-				nargs += RSPAMD_SHINGLE_SIZE * 2;
+				ncommands += nkeys;
+				nargs += nkeys * 2;
 			}
 		}
 		else if (cmd->cmd == FUZZY_REFRESH) {
@@ -1450,8 +1751,8 @@ rspamd_fuzzy_backend_update_redis (struct rspamd_fuzzy_backend *bk,
 			session->nextended ++;
 
 			if (io_cmd->is_shingle) {
-				ncommands += RSPAMD_SHINGLE_SIZE;
-				nargs += RSPAMD_SHINGLE_SIZE * 3;
+				ncommands += nkeys;
+				nargs += nkeys * 3;
 			}
 		}
 		else {
@@ -0,0 +1,1742 @@
+/*-
+ * Copyright 2019 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Fuzzy storage backend based on immutable memory mapped segments.
+ *
+ * Each segment is a file with records sorted by digest, shingles sorted by
+ * value and a bloom filter to skip segments quickly. Updates are collected
+ * in a memtable and written as new segments, segments are merged when there
+ * are too many of them and expired or deleted records are dropped on merge.
+ *
+ * Only the process that applies updates writes segments, other processes
+ * reload the list of segments when the generation in the shared manifest
+ * is changed.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "fuzzy_backend.h"
+#include "fuzzy_backend_segments.h"
+#include "cryptobox.h"
+#include "str_util.h"
+#include "unix-std.h"
+
+#include <sys/mman.h>
+#include <dirent.h>
+
+#define SEGMENTS_MAGIC "rsfs"
+#define SEGMENTS_VERSION 1
+#define SEGMENTS_MAX_SOURCES 32
+#define SEGMENTS_SUFFIX ".fseg"
+#define SEGMENTS_MANIFEST "manifest"
+#define SEGMENTS_WRITE_BUF 65536
+#define SEGMENTS_BLOOM_BITS 10
+#define SEGMENTS_BLOOM_HASHES 4
+#define SEGMENT_REC_DELETED (1u << 0)
+
+#define DEFAULT_MEMTABLE_SIZE 65536
+#define DEFAULT_MAX_SEGMENTS 8
+#define DEFAULT_COMPACT_INTERVAL 86400.0
+
+#define msg_err_fuzzy_segments(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
+        "fuzzy_segments", backend->id, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+#define msg_warn_fuzzy_segments(...)   rspamd_default_log_function (G_LOG_LEVEL_WARNING, \
+        "fuzzy_segments", backend->id, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+#define msg_info_fuzzy_segments(...)   rspamd_default_log_function (G_LOG_LEVEL_INFO, \
+        "fuzzy_segments", backend->id, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+#define msg_debug_fuzzy_segments(...)  rspamd_conditional_debug_fast (NULL, NULL, \
+        rspamd_fuzzy_segments_log_id, "fuzzy_segments", backend->id, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+
+INIT_LOG_MODULE(fuzzy_segments)
+
+RSPAMD_PACKED(rspamd_fuzzy_segment_rec) {
+	guchar digest[rspamd_cryptobox_HASHBYTES];
+	gint32 value;
+	guint32 flag;
+	guint32 ts;
+	guint32 flags;
+};
+
+RSPAMD_PACKED(rspamd_fuzzy_segment_shingle) {
+	guint64 hash;
+	guint32 number;
+	guint32 rec_idx;
+};
+
+RSPAMD_PACKED(rspamd_fuzzy_segment_hdr) {
+	guchar magic[4];
+	guint32 version;
+	guint64 nrecs;
+	guint64 nshingles;
+	guint64 bloom_bytes;
+	guchar reserved[32];
+};
+
+RSPAMD_PACKED(rspamd_fuzzy_segments_source) {
+	gchar name[56];
+	guint64 rev;
+};
+
+/* Shared between all processes using the same directory */
+RSPAMD_PACKED(rspamd_fuzzy_segments_manifest) {
+	guchar magic[4];
+	guint32 version;
+	guint64 generation;
+	guint64 next_id;
+	guint32 nsources;
+	guint32 reserved;
+	struct rspamd_fuzzy_segments_source sources[SEGMENTS_MAX_SOURCES];
+};
+
+struct rspamd_fuzzy_segment {
+	guint64 id;
+	gchar *path;
+	guchar *map;
+	gsize len;
+	const guchar *bloom;
+	guint64 bloom_bits;
+	const struct rspamd_fuzzy_segment_rec *recs;
+	guint64 nrecs;
+	const struct rspamd_fuzzy_segment_shingle *shingles;
+	guint64 nshingles;
+};
+
+struct rspamd_fuzzy_memtable_elt {
+	struct rspamd_fuzzy_segment_rec rec;
+	gboolean has_shingles;
+	struct rspamd_shingle sgl;
+};
+
+struct rspamd_fuzzy_memtable_shingle {
+	guint64 hash;
+	guint32 number;
+};
+
+struct rspamd_fuzzy_backend_segments {
+	gchar *path;
+	gchar *id;
+	gint manifest_fd;
+	struct rspamd_fuzzy_segments_manifest *manifest;
+	guint64 generation;
+	/* Sorted from the newest to the oldest */
+	GPtrArray *segments;
+	/* Digest -> rspamd_fuzzy_memtable_elt */
+	GHashTable *memtable;
+	/* rspamd_fuzzy_memtable_shingle -> rspamd_fuzzy_memtable_elt */
+	GHashTable *memtable_shingles;
+	guint memtable_size;
+	guint max_segments;
+	gdouble flush_interval;
+	gdouble compact_interval;
+	gdouble last_flush;
+	gdouble last_compact;
+	gboolean lsh;
+};
+
+struct rspamd_fuzzy_segment_writer {
+	gint fd;
+	gchar *tmp_path;
+	gchar *path;
+	guint64 id;
+	guint64 nrecs;
+	guint64 nshingles;
+	guint64 max_recs;
+	guchar *bloom;
+	guint64 bloom_bits;
+	guchar *buf;
+	gsize buflen;
+};
+
+static GQuark
+rspamd_fuzzy_segments_quark (void)
+{
+	return g_quark_from_static_string ("fuzzy-segments");
+}
+
+static guint
+rspamd_fuzzy_segments_digest_hash (gconstpointer key)
+{
+	guint ret;
+
+	/* Digests are uniformly distributed */
+	memcpy (&ret, key, sizeof (ret));
+
+	return ret;
+}
+
+static gboolean
+rspamd_fuzzy_segments_digest_equal (gconstpointer v, gconstpointer v2)
+{
+	return memcmp (v, v2, rspamd_cryptobox_HASHBYTES) == 0;
+}
+
+static guint
+rspamd_fuzzy_segments_shingle_hash (gconstpointer key)
+{
+	const struct rspamd_fuzzy_memtable_shingle *sh = key;
+
+	return (guint)(sh->hash ^ (sh->hash >> 32)) ^ (sh->number * 0x9e3779b1U);
+}
+
+static gboolean
+rspamd_fuzzy_segments_shingle_equal (gconstpointer v, gconstpointer v2)
+{
+	const struct rspamd_fuzzy_memtable_shingle *s1 = v, *s2 = v2;
+
+	return s1->hash == s2->hash && s1->number == s2->number;
+}
+
+static gint
+rspamd_fuzzy_segments_shingle_cmp (guint64 h1, guint32 n1,
+		guint64 h2, guint32 n2)
+{
+	if (h1 != h2) {
+		return h1 < h2 ? -1 : 1;
+	}
+
+	if (n1 != n2) {
+		return n1 < n2 ? -1 : 1;
+	}
+
+	return 0;
+}
+
+static inline void
+rspamd_fuzzy_segments_bloom_bits (const guchar *digest, guint64 nbits,
+		guint64 *bits)
+{
+	guint64 h1, h2;
+	guint i;
+
+	/* Digest is a cryptographic hash, so we can use its parts directly */
+	memcpy (&h1, digest, sizeof (h1));
+	memcpy (&h2, digest + sizeof (h1), sizeof (h2));
+
+	for (i = 0; i < SEGMENTS_BLOOM_HASHES; i ++) {
+		bits[i] = (h1 + i * h2) % nbits;
+	}
+}
+
+static gboolean
+rspamd_fuzzy_segment_maybe_contains (struct rspamd_fuzzy_segment *seg,
+		const guchar *digest)
+{
+	guint64 bits[SEGMENTS_BLOOM_HASHES];
+	guint i;
+
+	rspamd_fuzzy_segments_bloom_bits (digest, seg->bloom_bits, bits);
+
+	for (i = 0; i < SEGMENTS_BLOOM_HASHES; i ++) {
+		if (!(seg->bloom[bits[i] / NBBY] & (1u << (bits[i] % NBBY)))) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static const struct rspamd_fuzzy_segment_rec *
+rspamd_fuzzy_segment_find (struct rspamd_fuzzy_segment *seg,
+		const guchar *digest)
+{
+	guint64 lo = 0, hi = seg->nrecs, mid;
+	gint r;
+
+	if (seg->nrecs == 0 || !rspamd_fuzzy_segment_maybe_contains (seg, digest)) {
+		return NULL;
+	}
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		r = memcmp (seg->recs[mid].digest, digest, rspamd_cryptobox_HASHBYTES);
+
+		if (r == 0) {
+			return &seg->recs[mid];
+		}
+		else if (r < 0) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+
+	return NULL;
+}
+
+static const struct rspamd_fuzzy_segment_rec *
+rspamd_fuzzy_segment_find_shingle (struct rspamd_fuzzy_segment *seg,
+		guint64 hash, guint32 number)
+{
+	guint64 lo = 0, hi = seg->nshingles, mid;
+	const struct rspamd_fuzzy_segment_shingle *sh;
+	gint r;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		sh = &seg->shingles[mid];
+		r = rspamd_fuzzy_segments_shingle_cmp (sh->hash, sh->number,
+				hash, number);
+
+		if (r == 0) {
+			if (sh->rec_idx < seg->nrecs) {
+				return &seg->recs[sh->rec_idx];
+			}
+
+			return NULL;
+		}
+		else if (r < 0) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+
+	return NULL;
+}
+
+static void
+rspamd_fuzzy_segment_close (struct rspamd_fuzzy_segment *seg)
+{
+	if (seg->map) {
+		munmap (seg->map, seg->len);
+	}
+
+	g_free (seg->path);
+	g_free (seg);
+}
+
+static struct rspamd_fuzzy_segment *
+rspamd_fuzzy_segment_open (struct rspamd_fuzzy_backend_segments *backend,
+		const gchar *path, guint64 id)
+{
+	struct rspamd_fuzzy_segment *seg;
+	struct rspamd_fuzzy_segment_hdr hdr;
+	gsize expected;
+	gint fd;
+	struct stat st;
+	guchar *map;
+
+	fd = rspamd_file_xopen (path, O_RDONLY, 0, FALSE);
+
+	if (fd == -1) {
+		msg_err_fuzzy_segments ("cannot open segment %s: %s", path,
+				strerror (errno));
+		return NULL;
+	}
+
+	if (fstat (fd, &st) == -1 || (gsize)st.st_size < sizeof (hdr)) {
+		msg_err_fuzzy_segments ("cannot use segment %s: bad size", path);
+		close (fd);
+
+		return NULL;
+	}
+
+	map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+
+	if (map == MAP_FAILED) {
+		msg_err_fuzzy_segments ("cannot mmap segment %s: %s", path,
+				strerror (errno));
+		return NULL;
+	}
+
+	memcpy (&hdr, map, sizeof (hdr));
+	expected = sizeof (hdr) + hdr.bloom_bytes +
+			hdr.nrecs * sizeof (struct rspamd_fuzzy_segment_rec) +
+			hdr.nshingles * sizeof (struct rspamd_fuzzy_segment_shingle);
+
+	if (memcmp (hdr.magic, SEGMENTS_MAGIC, sizeof (hdr.magic)) != 0 ||
+			hdr.version != SEGMENTS_VERSION ||
+			hdr.bloom_bytes == 0 ||
+			expected != (gsize)st.st_size) {
+		msg_err_fuzzy_segments ("cannot use segment %s: bad header", path);
+		munmap (map, st.st_size);
+
+		return NULL;
+	}
+
+	if (madvise (map, st.st_size, MADV_RANDOM) == -1) {
+		msg_debug_fuzzy_segments ("madvise failed: %s", strerror (errno));
+	}
+
+	seg = g_malloc0 (sizeof (*seg));
+	seg->id = id;
+	seg->path = g_strdup (path);
+	seg->map = map;
+	seg->len = st.st_size;
+	seg->bloom = map + sizeof (hdr);
+	seg->bloom_bits = hdr.bloom_bytes * NBBY;
+	seg->recs = (const struct rspamd_fuzzy_segment_rec *)
+			(seg->bloom + hdr.bloom_bytes);
+	seg->nrecs = hdr.nrecs;
+	seg->shingles = (const struct rspamd_fuzzy_segment_shingle *)
+			(seg->recs + hdr.nrecs);
+	seg->nshingles = hdr.nshingles;
+
+	return seg;
+}
+
+static gint
+rspamd_fuzzy_segments_id_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct rspamd_fuzzy_segment *s1 = *(const struct rspamd_fuzzy_segment **)a,
+			*s2 = *(const struct rspamd_fuzzy_segment **)b;
+
+	/* Newest first */
+	if (s1->id == s2->id) {
+		return 0;
+	}
+
+	return s1->id > s2->id ? -1 : 1;
+}
+
+/*
+ * Rescan directory if any segment has been added or removed
+ */
+static void
+rspamd_fuzzy_segments_reload (struct rspamd_fuzzy_backend_segments *backend)
+{
+	GPtrArray *nsegs;
+	GHashTable *existing;
+	struct rspamd_fuzzy_segment *seg;
+	struct dirent *de;
+	DIR *dir;
+	guint64 generation, id;
+	gchar *end, path[PATH_MAX];
+	guint i;
+
+	generation = backend->manifest->generation;
+
+	if (generation == backend->generation) {
+		return;
+	}
+
+	dir = opendir (backend->path);
+
+	if (dir == NULL) {
+		msg_err_fuzzy_segments ("cannot open directory %s: %s", backend->path,
+				strerror (errno));
+		return;
+	}
+
+	existing = g_hash_table_new (g_int64_hash, g_int64_equal);
+
+	PTR_ARRAY_FOREACH (backend->segments, i, seg) {
+		g_hash_table_insert (existing, &seg->id, seg);
+	}
+
+	nsegs = g_ptr_array_new ();
+
+	while ((de = readdir (dir)) != NULL) {
+		if (!g_str_has_suffix (de->d_name, SEGMENTS_SUFFIX)) {
+			continue;
+		}
+
+		id = g_ascii_strtoull (de->d_name, &end, 16);
+
+		if (end == de->d_name || strcmp (end, SEGMENTS_SUFFIX) != 0) {
+			continue;
+		}
+
+		seg = g_hash_table_lookup (existing, &id);
+
+		if (seg) {
+			g_hash_table_remove (existing, &id);
+		}
+		else {
+			rspamd_snprintf (path, sizeof (path), "%s%c%s", backend->path,
+					G_DIR_SEPARATOR, de->d_name);
+			seg = rspamd_fuzzy_segment_open (backend, path, id);
+		}
+
+		if (seg) {
+			g_ptr_array_add (nsegs, seg);
+		}
+	}
+
+	closedir (dir);
+
+	/* Segments that are left have been removed by compaction */
+	PTR_ARRAY_FOREACH (backend->segments, i, seg) {
+		if (g_hash_table_lookup (existing, &seg->id) == seg) {
+			rspamd_fuzzy_segment_close (seg);
+		}
+	}
+
+	g_hash_table_unref (existing);
+	g_ptr_array_free (backend->segments, TRUE);
+	g_ptr_array_sort (nsegs, rspamd_fuzzy_segments_id_cmp);
+	backend->segments = nsegs;
+	backend->generation = generation;
+
+	msg_debug_fuzzy_segments ("loaded %ud segments, generation %L",
+			nsegs->len, generation);
+}
+
+/*
+ * Returns the most recent record for the digest including deleted ones
+ */
+static gboolean
+rspamd_fuzzy_segments_find (struct rspamd_fuzzy_backend_segments *backend,
+		const guchar *digest, struct rspamd_fuzzy_segment_rec *rec)
+{
+	struct rspamd_fuzzy_memtable_elt *elt;
+	struct rspamd_fuzzy_segment *seg;
+	const struct rspamd_fuzzy_segment_rec *found;
+	guint i;
+
+	elt = g_hash_table_lookup (backend->memtable, digest);
+
+	if (elt) {
+		memcpy (rec, &elt->rec, sizeof (*rec));
+
+		return TRUE;
+	}
+
+	PTR_ARRAY_FOREACH (backend->segments, i, seg) {
+		found = rspamd_fuzzy_segment_find (seg, digest);
+
+		if (found) {
+			memcpy (rec, found, sizeof (*rec));
+
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static gboolean
+rspamd_fuzzy_segments_find_shingle (
+		struct rspamd_fuzzy_backend_segments *backend,
+		guint64 hash, guint32 number, guchar *digest)
+{
+	struct rspamd_fuzzy_memtable_elt *elt;
+	struct rspamd_fuzzy_memtable_shingle key;
+	struct rspamd_fuzzy_segment *seg;
+	const struct rspamd_fuzzy_segment_rec *found;
+	guint i;
+
+	key.hash = hash;
+	key.number = number;
+	elt = g_hash_table_lookup (backend->memtable_shingles, &key);
+
+	if (elt) {
+		memcpy (digest, elt->rec.digest, sizeof (elt->rec.digest));
+
+		return TRUE;
+	}
+
+	PTR_ARRAY_FOREACH (backend->segments, i, seg) {
+		found = rspamd_fuzzy_segment_find_shingle (seg, hash, number);
+
+		if (found) {
+			memcpy (digest, found->digest, sizeof (found->digest));
+
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/*
+ * Returns keys of shingles index: a key per shingle or, if lsh index is
+ * used, a key per band with numbers following shingles numbers
+ */
+static guint
+rspamd_fuzzy_segments_shingle_keys (
+		struct rspamd_fuzzy_backend_segments *backend,
+		const struct rspamd_shingle *sgl, guint64 *hashes, guint32 *numbers)
+{
+	guint i;
+
+	if (backend->lsh) {
+		rspamd_fuzzy_backend_lsh_bands (sgl, hashes);
+
+		for (i = 0; i < RSPAMD_FUZZY_LSH_BANDS; i ++) {
+			numbers[i] = RSPAMD_SHINGLE_SIZE + i;
+		}
+
+		return RSPAMD_FUZZY_LSH_BANDS;
+	}
+
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+		hashes[i] = sgl->hashes[i];
+		numbers[i] = i;
+	}
+
+	return RSPAMD_SHINGLE_SIZE;
+}
+
+static inline gboolean
+rspamd_fuzzy_segments_rec_alive (const struct rspamd_fuzzy_segment_rec *rec,
+		gdouble expire, time_t now)
+{
+	if (rec->flags & SEGMENT_REC_DELETED) {
+		return FALSE;
+	}
+
+	return now - (time_t)rec->ts <= expire;
+}
+
+static gint
+rspamd_fuzzy_segments_digest_cmp (const void *a, const void *b)
+{
+	return memcmp (a, b, rspamd_cryptobox_HASHBYTES);
+}
+
+static void
+rspamd_fuzzy_segments_check_cmd (struct rspamd_fuzzy_backend_segments *backend,
+		const struct rspamd_fuzzy_cmd *cmd, gdouble expire,
+		struct rspamd_fuzzy_reply *rep)
+{
+	const struct rspamd_fuzzy_shingle_cmd *shcmd;
+	struct rspamd_fuzzy_segment_rec rec;
+	guchar (*digests)[rspamd_cryptobox_HASHBYTES];
+	guchar *sel = NULL;
+	guint64 hashes[RSPAMD_SHINGLE_SIZE];
+	guint32 numbers[RSPAMD_SHINGLE_SIZE];
+	guint i, nfound = 0, cur_cnt, max_cnt = 0, nkeys, min_found;
+	gdouble prob;
+	time_t now = time (NULL);
+
+	memset (rep, 0, sizeof (*rep));
+	memcpy (rep->digest, cmd->digest, sizeof (rep->digest));
+
+	if (rspamd_fuzzy_segments_find (backend, cmd->digest, &rec) &&
+			rspamd_fuzzy_segments_rec_alive (&rec, expire, now)) {
+		rep->v1.value = rec.value;
+		rep->v1.flag = rec.flag;
+		rep->v1.prob = 1.0;
+		rep->ts = rec.ts;
+
+		return;
+	}
+
+	if (cmd->shingles_count == 0) {
+		return;
+	}
+
+	shcmd = (const struct rspamd_fuzzy_shingle_cmd *)cmd;
+	nkeys = rspamd_fuzzy_segments_shingle_keys (backend, &shcmd->sgl,
+			hashes, numbers);
+	/* Any band match is a candidate, shingles require majority */
+	min_found = backend->lsh ? 1 : RSPAMD_SHINGLE_SIZE / 2 + 1;
+	digests = g_alloca (nkeys * sizeof (*digests));
+
+	for (i = 0; i < nkeys; i ++) {
+		if (rspamd_fuzzy_segments_find_shingle (backend,
+				hashes[i], numbers[i], digests[nfound])) {
+			nfound ++;
+		}
+	}
+
+	if (nfound < min_found) {
+		return;
+	}
+
+	/* Select the most frequent digest */
+	qsort (digests, nfound, sizeof (*digests), rspamd_fuzzy_segments_digest_cmp);
+	cur_cnt = 0;
+
+	for (i = 0; i < nfound; i ++) {
+		if (i > 0 && memcmp (digests[i], digests[i - 1],
+				sizeof (digests[i])) == 0) {
+			cur_cnt ++;
+		}
+		else {
+			cur_cnt = 1;
+		}
+
+		if (cur_cnt > max_cnt) {
+			max_cnt = cur_cnt;
+			sel = digests[i];
+		}
+	}
+
+	if (backend->lsh) {
+		prob = rspamd_fuzzy_backend_lsh_prob (max_cnt);
+	}
+	else {
+		prob = (gdouble)max_cnt / RSPAMD_SHINGLE_SIZE;
+	}
+
+	if (max_cnt >= min_found && sel != NULL &&
+			rspamd_fuzzy_segments_find (backend, sel, &rec) &&
+			rspamd_fuzzy_segments_rec_alive (&rec, expire, now)) {
+		msg_debug_fuzzy_segments ("found fuzzy hash with probability %.2f",
+				prob);
+		rep->v1.value = rec.value;
+		rep->v1.flag = rec.flag;
+		rep->v1.prob = prob;
+		rep->ts = rec.ts;
+		memcpy (rep->digest, rec.digest, sizeof (rep->digest));
+	}
+}
+
+static gboolean
+rspamd_fuzzy_segment_writer_flush (struct rspamd_fuzzy_segment_writer *w)
+{
+	gsize written = 0;
+	gssize r;
+
+	while (written < w->buflen) {
+		r = write (w->fd, w->buf + written, w->buflen - written);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return FALSE;
+		}
+
+		written += r;
+	}
+
+	w->buflen = 0;
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_fuzzy_segment_writer_append (struct rspamd_fuzzy_segment_writer *w,
+		const void *data, gsize len)
+{
+	if (w->buflen + len > SEGMENTS_WRITE_BUF) {
+		if (!rspamd_fuzzy_segment_writer_flush (w)) {
+			return FALSE;
+		}
+	}
+
+	memcpy (w->buf + w->buflen, data, len);
+	w->buflen += len;
+
+	return TRUE;
+}
+
+static void
+rspamd_fuzzy_segment_writer_free (struct rspamd_fuzzy_segment_writer *w)
+{
+	if (w->fd != -1) {
+		close (w->fd);
+		unlink (w->tmp_path);
+	}
+
+	g_free (w->tmp_path);
+	g_free (w->path);
+	g_free (w->bloom);
+	g_free (w->buf);
+	g_free (w);
+}
+
+/*
+ * Records must be added in digest order and shingles must be added after
+ * all records in (hash, number) order
+ */
+static struct rspamd_fuzzy_segment_writer *
+rspamd_fuzzy_segment_writer_new (struct rspamd_fuzzy_backend_segments *backend,
+		guint64 max_recs, GError **err)
+{
+	struct rspamd_fuzzy_segment_writer *w;
+	guint64 bloom_bytes;
+
+	w = g_malloc0 (sizeof (*w));
+	w->id = backend->manifest->next_id;
+	w->max_recs = max_recs;
+	w->path = g_strdup_printf ("%s%c%016" G_GINT64_MODIFIER "x%s",
+			backend->path, G_DIR_SEPARATOR, w->id, SEGMENTS_SUFFIX);
+	w->tmp_path = g_strdup_printf ("%s.tmp", w->path);
+	/* Bloom is sized by the maximum number of records and 64 bit aligned */
+	bloom_bytes = MAX (max_recs * SEGMENTS_BLOOM_BITS / NBBY, 8);
+	bloom_bytes = (bloom_bytes + 7) & ~7ULL;
+	w->bloom = g_malloc0 (bloom_bytes);
+	w->bloom_bits = bloom_bytes * NBBY;
+	w->buf = g_malloc (SEGMENTS_WRITE_BUF);
+	w->fd = rspamd_file_xopen (w->tmp_path, O_WRONLY | O_CREAT | O_TRUNC,
+			00644, FALSE);
+
+	if (w->fd == -1) {
+		g_set_error (err, rspamd_fuzzy_segments_quark (), errno,
+				"cannot create %s: %s", w->tmp_path, strerror (errno));
+		rspamd_fuzzy_segment_writer_free (w);
+
+		return NULL;
+	}
+
+	/* Header and bloom are written when the segment is finished */
+	if (lseek (w->fd, sizeof (struct rspamd_fuzzy_segment_hdr) + bloom_bytes,
+			SEEK_SET) == -1) {
+		g_set_error (err, rspamd_fuzzy_segments_quark (), errno,
+				"cannot seek %s: %s", w->tmp_path, strerror (errno));
+		rspamd_fuzzy_segment_writer_free (w);
+
+		return NULL;
+	}
+
+	return w;
+}
+
+static gboolean
+rspamd_fuzzy_segment_writer_add_rec (struct rspamd_fuzzy_segment_writer *w,
+		const struct rspamd_fuzzy_segment_rec *rec)
+{
+	guint64 bits[SEGMENTS_BLOOM_HASHES];
+	guint i;
+
+	g_assert (w->nshingles == 0);
+	g_assert (w->nrecs < w->max_recs);
+
+	rspamd_fuzzy_segments_bloom_bits (rec->digest, w->bloom_bits, bits);
+
+	for (i = 0; i < SEGMENTS_BLOOM_HASHES; i ++) {
+		w->bloom[bits[i] / NBBY] |= (1u << (bits[i] % NBBY));
+	}
+
+	w->nrecs ++;
+
+	return rspamd_fuzzy_segment_writer_append (w, rec, sizeof (*rec));
+}
+
+static gboolean
+rspamd_fuzzy_segment_writer_add_shingle (struct rspamd_fuzzy_segment_writer *w,
+		guint64 hash, guint32 number, guint32 rec_idx)
+{
+	struct rspamd_fuzzy_segment_shingle sh;
+
+	sh.hash = hash;
+	sh.number = number;
+	sh.rec_idx = rec_idx;
+	w->nshingles ++;
+
+	return rspamd_fuzzy_segment_writer_append (w, &sh, sizeof (sh));
+}
+
+/*
+ * Writes header and bloom filter, moves segment to the final path and opens it
+ */
+static struct rspamd_fuzzy_segment *
+rspamd_fuzzy_segment_writer_finish (
+		struct rspamd_fuzzy_backend_segments *backend,
+		struct rspamd_fuzzy_segment_writer *w, GError **err)
+{
+	struct rspamd_fuzzy_segment_hdr hdr;
+	struct rspamd_fuzzy_segment *seg;
+	gsize bloom_bytes = w->bloom_bits / NBBY;
+
+	memset (&hdr, 0, sizeof (hdr));
+	memcpy (hdr.magic, SEGMENTS_MAGIC, sizeof (hdr.magic));
+	hdr.version = SEGMENTS_VERSION;
+	hdr.nrecs = w->nrecs;
+	hdr.nshingles = w->nshingles;
+	hdr.bloom_bytes = bloom_bytes;
+
+	if (!rspamd_fuzzy_segment_writer_flush (w) ||
+			pwrite (w->fd, &hdr, sizeof (hdr), 0) != sizeof (hdr) ||
+			pwrite (w->fd, w->bloom, bloom_bytes, sizeof (hdr)) !=
+			(gssize)bloom_bytes ||
+			fsync (w->fd) == -1) {
+		g_set_error (err, rspamd_fuzzy_segments_quark (), errno,
+				"cannot write %s: %s", w->tmp_path, strerror (errno));
+		rspamd_fuzzy_segment_writer_free (w);
+
+		return NULL;
+	}
+
+	close (w->fd);
+	w->fd = -1;
+
+	if (rename (w->tmp_path, w->path) == -1) {
+		g_set_error (err, rspamd_fuzzy_segments_quark (), errno,
+				"cannot rename %s: %s", w->tmp_path, strerror (errno));
+		unlink (w->tmp_path);
+		rspamd_fuzzy_segment_writer_free (w);
+
+		return NULL;
+	}
+
+	seg = rspamd_fuzzy_segment_open (backend, w->path, w->id);
+
+	if (seg == NULL) {
+		g_set_error (err, rspamd_fuzzy_segments_quark (), EINVAL,
+				"cannot open written segment %s", w->path);
+	}
+
+	backend->manifest->next_id = w->id + 1;
+	rspamd_fuzzy_segment_writer_free (w);
+
+	return seg;
+}
+
+static void
+rspamd_fuzzy_segments_publish (struct rspamd_fuzzy_backend_segments *backend)
+{
+	/* Other processes reload segments when generation is changed */
+	backend->manifest->generation ++;
+	backend->generation = backend->manifest->generation;
+
+	if (msync (backend->manifest, sizeof (*backend->manifest), MS_ASYNC) == -1) {
+		msg_warn_fuzzy_segments ("cannot sync manifest: %s", strerror (errno));
+	}
+}
+
+static gint
+rspamd_fuzzy_memtable_elt_cmp (const void *a, const void *b)
+{
+	const struct rspamd_fuzzy_memtable_elt *e1 =
+			*(const struct rspamd_fuzzy_memtable_elt **)a,
+			*e2 = *(const struct rspamd_fuzzy_memtable_elt **)b;
+
+	return memcmp (e1->rec.digest, e2->rec.digest, sizeof (e1->rec.digest));
+}
+
+static gint
+rspamd_fuzzy_segment_shingle_sort_cmp (const void *a, const void *b)
+{
+	const struct rspamd_fuzzy_segment_shingle *s1 = a, *s2 = b;
+
+	return rspamd_fuzzy_segments_shingle_cmp (s1->hash, s1->number,
+			s2->hash, s2->number);
+}
+
+/*
+ * Writes memtable as a new segment
+ */
+static gboolean
+rspamd_fuzzy_segments_flush (struct rspamd_fuzzy_backend_segments *backend)
+{
+	struct rspamd_fuzzy_memtable_elt **elts, *elt;
+	struct rspamd_fuzzy_segment_writer *w;
+	struct rspamd_fuzzy_segment_shingle *sh;
+	struct rspamd_fuzzy_segment *seg;
+	GHashTableIter it;
+	GArray *shingles;
+	GError *err = NULL;
+	gpointer k, v;
+	guint64 hashes[RSPAMD_SHINGLE_SIZE];
+	guint32 numbers[RSPAMD_SHINGLE_SIZE];
+	guint n, i, j, nkeys;
+
+	n = g_hash_table_size (backend->memtable);
+
+	if (n == 0) {
+		return TRUE;
+	}
+
+	elts = g_malloc (n * sizeof (*elts));
+	i = 0;
+	g_hash_table_iter_init (&it, backend->memtable);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		elts[i++] = v;
+	}
+
+	qsort (elts, n, sizeof (*elts), rspamd_fuzzy_memtable_elt_cmp);
+	shingles = g_array_new (FALSE, FALSE,
+			sizeof (struct rspamd_fuzzy_segment_shingle));
+
+	for (i = 0; i < n; i ++) {
+		elt = elts[i];
+
+		if (elt->has_shingles && !(elt->rec.flags & SEGMENT_REC_DELETED)) {
+			nkeys = rspamd_fuzzy_segments_shingle_keys (backend, &elt->sgl,
+					hashes, numbers);
+
+			for (j = 0; j < nkeys; j ++) {
+				g_array_set_size (shingles, shingles->len + 1);
+				sh = &g_array_index (shingles,
+						struct rspamd_fuzzy_segment_shingle, shingles->len - 1);
+				sh->hash = hashes[j];
+				sh->number = numbers[j];
+				sh->rec_idx = i;
+			}
+		}
+	}
+
+	g_array_sort (shingles, rspamd_fuzzy_segment_shingle_sort_cmp);
+	w = rspamd_fuzzy_segment_writer_new (backend, n, &err);
+
+	if (w == NULL) {
+		goto err;
+	}
+
+	for (i = 0; i < n; i ++) {
+		if (!rspamd_fuzzy_segment_writer_add_rec (w, &elts[i]->rec)) {
+			g_set_error (&err, rspamd_fuzzy_segments_quark (), errno,
+					"cannot write segment: %s", strerror (errno));
+			rspamd_fuzzy_segment_writer_free (w);
+			goto err;
+		}
+	}
+
+	for (i = 0; i < shingles->len; i ++) {
+		sh = &g_array_index (shingles, struct rspamd_fuzzy_segment_shingle, i);
+
+		if (!rspamd_fuzzy_segment_writer_add_shingle (w, sh->hash, sh->number,
+				sh->rec_idx)) {
+			g_set_error (&err, rspamd_fuzzy_segments_quark (), errno,
+					"cannot write segment: %s", strerror (errno));
+			rspamd_fuzzy_segment_writer_free (w);
+			goto err;
+		}
+	}
+
+	seg = rspamd_fuzzy_segment_writer_finish (backend, w, &err);
+
+	if (seg == NULL) {
+		goto err;
+	}
+
+	g_ptr_array_insert (backend->segments, 0, seg);
+	rspamd_fuzzy_segments_publish (backend);
+	msg_info_fuzzy_segments ("written segment %s: %ud records, %ud shingles",
+			seg->path, n, shingles->len);
+
+	g_hash_table_remove_all (backend->memtable_shingles);
+	g_hash_table_remove_all (backend->memtable);
+	g_array_free (shingles, TRUE);
+	g_free (elts);
+	backend->last_flush = rspamd_get_calendar_ticks ();
+
+	return TRUE;
+
+err:
+	msg_err_fuzzy_segments ("cannot flush memtable: %e", err);
+	g_error_free (err);
+	g_array_free (shingles, TRUE);
+	g_free (elts);
+
+	return FALSE;
+}
+
+/*
+ * Merges all segments into a single one dropping deleted and expired records
+ */
+static void
+rspamd_fuzzy_segments_compact (struct rspamd_fuzzy_backend_segments *backend,
+		gdouble expire)
+{
+	struct rspamd_fuzzy_segment *seg, *nseg;
+	struct rspamd_fuzzy_segment_writer *w;
+	const struct rspamd_fuzzy_segment_rec *rec, *min_rec;
+	const struct rspamd_fuzzy_segment_shingle *sh, *min_sh;
+	guint32 **remap, new_idx;
+	guint64 *pos, max_recs = 0, ndropped = 0;
+	guint nsegs, i, winner;
+	time_t now = time (NULL);
+	GError *err = NULL;
+	gint r;
+
+	nsegs = backend->segments->len;
+
+	if (nsegs == 0) {
+		return;
+	}
+
+	PTR_ARRAY_FOREACH (backend->segments, i, seg) {
+		max_recs += seg->nrecs;
+	}
+
+	w = rspamd_fuzzy_segment_writer_new (backend, MAX (max_recs, 1), &err);
+
+	if (w == NULL) {
+		msg_err_fuzzy_segments ("cannot compact segments: %e", err);
+		g_error_free (err);
+
+		return;
+	}
+
+	/* Old record index -> new record index for each segment */
+	remap = g_malloc (nsegs * sizeof (*remap));
+	pos = g_malloc0 (nsegs * sizeof (*pos));
+
+	PTR_ARRAY_FOREACH (backend->segments, i, seg) {
+		remap[i] = g_malloc (MAX (seg->nrecs, 1) * sizeof (guint32));
+		memset (remap[i], 0xff, MAX (seg->nrecs, 1) * sizeof (guint32));
+	}
+
+	/* Merge sorted records, the newest segment wins for equal digests */
+	for (;;) {
+		min_rec = NULL;
+		winner = 0;
+
+		for (i = 0; i < nsegs; i ++) {
+			seg = g_ptr_array_index (backend->segments, i);
+
+			if (pos[i] >= seg->nrecs) {
+				continue;
+			}
+
+			rec = &seg->recs[pos[i]];
+
+			if (min_rec == NULL || memcmp (rec->digest, min_rec->digest,
+					sizeof (rec->digest)) < 0) {
+				min_rec = rec;
+				winner = i;
+			}
+		}
+
+		if (min_rec == NULL) {
+			break;
+		}
+
+		if (rspamd_fuzzy_segments_rec_alive (min_rec, expire, now)) {
+			new_idx = w->nrecs;
+
+			if (!rspamd_fuzzy_segment_writer_add_rec (w, min_rec)) {
+				g_set_error (&err, rspamd_fuzzy_segments_quark (), errno,
+						"cannot write segment: %s", strerror (errno));
+				goto err;
+			}
+		}
+		else {
+			new_idx = G_MAXUINT32;
+			ndropped ++;
+		}
+
+		/* Advance all cursors that point to the same digest */
+		for (i = winner; i < nsegs; i ++) {
+			seg = g_ptr_array_index (backend->segments, i);
+
+			if (pos[i] < seg->nrecs && (i == winner ||
+					memcmp (seg->recs[pos[i]].digest, min_rec->digest,
+							sizeof (min_rec->digest)) == 0)) {
+				remap[i][pos[i]] = new_idx;
+				pos[i] ++;
+			}
+		}
+	}
+
+	memset (pos, 0, nsegs * sizeof (*pos));
+
+	/* Merge shingles, the newest alive mapping wins */
+	for (;;) {
+		min_sh = NULL;
+		winner = 0;
+
+		for (i = 0; i < nsegs; i ++) {
+			seg = g_ptr_array_index (backend->segments, i);
+
+			/* Skip mappings to dropped records */
+			while (pos[i] < seg->nshingles &&
+					(seg->shingles[pos[i]].rec_idx >= seg->nrecs ||
+					remap[i][seg->shingles[pos[i]].rec_idx] == G_MAXUINT32)) {
+				pos[i] ++;
+			}
+
+			if (pos[i] >= seg->nshingles) {
+				continue;
+			}
+
+			sh = &seg->shingles[pos[i]];
+
+			if (min_sh == NULL || rspamd_fuzzy_segments_shingle_cmp (sh->hash,
+					sh->number, min_sh->hash, min_sh->number) < 0) {
+				min_sh = sh;
+				winner = i;
+			}
+		}
+
+		if (min_sh == NULL) {
+			break;
+		}
+
+		if (!rspamd_fuzzy_segment_writer_add_shingle (w, min_sh->hash,
+				min_sh->number, remap[winner][min_sh->rec_idx])) {
+			g_set_error (&err, rspamd_fuzzy_segments_quark (), errno,
+					"cannot write segment: %s", strerror (errno));
+			goto err;
+		}
+
+		for (i = winner; i < nsegs; i ++) {
+			seg = g_ptr_array_index (backend->segments, i);
+
+			if (pos[i] < seg->nshingles) {
+				sh = &seg->shingles[pos[i]];
+				r = rspamd_fuzzy_segments_shingle_cmp (sh->hash, sh->number,
+						min_sh->hash, min_sh->number);
+
+				if (r == 0) {
+					pos[i] ++;
+				}
+			}
+		}
+	}
+
+	nseg = rspamd_fuzzy_segment_writer_finish (backend, w, &err);
+	w = NULL;
+
+	if (nseg == NULL) {
+		goto err;
+	}
+
+	msg_info_fuzzy_segments ("merged %ud segments into %s: %L records, "
+			"%L dropped", nsegs, nseg->path, nseg->nrecs, ndropped);
+
+	PTR_ARRAY_FOREACH (backend->segments, i, seg) {
+		if (unlink (seg->path) == -1) {
+			msg_warn_fuzzy_segments ("cannot unlink %s: %s", seg->path,
+					strerror (errno));
+		}
+
+		/* Readers keep using their mappings until they reload */
+		rspamd_fuzzy_segment_close (seg);
+	}
+
+	g_ptr_array_set_size (backend->segments, 0);
+	g_ptr_array_add (backend->segments, nseg);
+	rspamd_fuzzy_segments_publish (backend);
+	backend->last_compact = rspamd_get_calendar_ticks ();
+
+	goto end;
+
+err:
+	msg_err_fuzzy_segments ("cannot compact segments: %e", err);
+	g_error_free (err);
+
+	if (w) {
+		rspamd_fuzzy_segment_writer_free (w);
+	}
+
+end:
+	for (i = 0; i < nsegs; i ++) {
+		g_free (remap[i]);
+	}
+
+	g_free (remap);
+	g_free (pos);
+}
+
+static gboolean
+rspamd_fuzzy_segments_init_manifest (
+		struct rspamd_fuzzy_backend_segments *backend, GError **err)
+{
+	struct rspamd_fuzzy_segments_manifest manifest;
+	gchar path[PATH_MAX];
+	struct stat st;
+	gpointer map;
+	gint fd;
+
+	rspamd_snprintf (path, sizeof (path), "%s%c%s", backend->path,
+			G_DIR_SEPARATOR, SEGMENTS_MANIFEST);
+	fd = rspamd_file_xopen (path, O_RDWR | O_CREAT, 00644, FALSE);
+
+	if (fd == -1) {
+		g_set_error (err, rspamd_fuzzy_segments_quark (), errno,
+				"cannot open %s: %s", path, strerror (errno));
+		return FALSE;
+	}
+
+	/* Several processes might try to create manifest at the same time */
+	rspamd_file_lock (fd, FALSE);
+
+	if (fstat (fd, &st) == -1) {
+		g_set_error (err, rspamd_fuzzy_segments_quark (), errno,
+				"cannot stat %s: %s", path, strerror (errno));
+		rspamd_file_unlock (fd, FALSE);
+		close (fd);
+
+		return FALSE;
+	}
+
+	if (st.st_size == 0) {
+		memset (&manifest, 0, sizeof (manifest));
+		memcpy (manifest.magic, SEGMENTS_MAGIC, sizeof (manifest.magic));
+		manifest.version = SEGMENTS_VERSION;
+		manifest.generation = 1;
+		manifest.next_id = 1;
+
+		if (write (fd, &manifest, sizeof (manifest)) != sizeof (manifest)) {
+			g_set_error (err, rspamd_fuzzy_segments_quark (), errno,
+					"cannot write %s: %s", path, strerror (errno));
+			rspamd_file_unlock (fd, FALSE);
+			close (fd);
+
+			return FALSE;
+		}
+	}
+	else if (st.st_size != sizeof (manifest)) {
+		g_set_error (err, rspamd_fuzzy_segments_quark (), EINVAL,
+				"invalid manifest size: %s", path);
+		rspamd_file_unlock (fd, FALSE);
+		close (fd);
+
+		return FALSE;
+	}
+
+	rspamd_file_unlock (fd, FALSE);
+	map = mmap (NULL, sizeof (manifest), PROT_READ | PROT_WRITE, MAP_SHARED,
+			fd, 0);
+
+	if (map == MAP_FAILED) {
+		g_set_error (err, rspamd_fuzzy_segments_quark (), errno,
+				"cannot mmap %s: %s", path, strerror (errno));
+		close (fd);
+
+		return FALSE;
+	}
+
+	backend->manifest = map;
+	backend->manifest_fd = fd;
+
+	if (memcmp (backend->manifest->magic, SEGMENTS_MAGIC,
+			sizeof (backend->manifest->magic)) != 0 ||
+			backend->manifest->version != SEGMENTS_VERSION) {
+		g_set_error (err, rspamd_fuzzy_segments_quark (), EINVAL,
+				"invalid manifest: %s", path);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void
+rspamd_fuzzy_backend_segments_free (
+		struct rspamd_fuzzy_backend_segments *backend)
+{
+	struct rspamd_fuzzy_segment *seg;
+	guint i;
+
+	if (backend->segments) {
+		PTR_ARRAY_FOREACH (backend->segments, i, seg) {
+			rspamd_fuzzy_segment_close (seg);
+		}
+
+		g_ptr_array_free (backend->segments, TRUE);
+	}
+
+	if (backend->memtable_shingles) {
+		g_hash_table_unref (backend->memtable_shingles);
+	}
+
+	if (backend->memtable) {
+		g_hash_table_unref (backend->memtable);
+	}
+
+	if (backend->manifest) {
+		munmap (backend->manifest, sizeof (*backend->manifest));
+	}
+
+	if (backend->manifest_fd != -1) {
+		close (backend->manifest_fd);
+	}
+
+	g_free (backend->path);
+	g_free (backend->id);
+	g_free (backend);
+}
+
+void*
+rspamd_fuzzy_backend_init_segments (struct rspamd_fuzzy_backend *bk,
+		const ucl_object_t *obj, struct rspamd_config *cfg, GError **err)
+{
+	struct rspamd_fuzzy_backend_segments *backend;
+	const ucl_object_t *elt;
+	guchar id_hash[rspamd_cryptobox_HASHBYTES];
+
+	elt = ucl_object_lookup_any (obj, "path", "dir", "directory", NULL);
+
+	if (elt == NULL || ucl_object_type (elt) != UCL_STRING) {
+		g_set_error (err, rspamd_fuzzy_segments_quark (),
+				EINVAL, "missing segments directory");
+		return NULL;
+	}
+
+	backend = g_malloc0 (sizeof (*backend));
+	backend->manifest_fd = -1;
+	backend->path = g_strdup (ucl_object_tostring (elt));
+	backend->memtable_size = DEFAULT_MEMTABLE_SIZE;
+	backend->max_segments = DEFAULT_MAX_SEGMENTS;
+	backend->compact_interval = DEFAULT_COMPACT_INTERVAL;
+
+	elt = ucl_object_lookup (obj, "memtable_size");
+
+	if (elt && ucl_object_toint (elt) > 0) {
+		backend->memtable_size = ucl_object_toint (elt);
+	}
+
+	elt = ucl_object_lookup (obj, "max_segments");
+
+	if (elt && ucl_object_toint (elt) > 0) {
+		backend->max_segments = ucl_object_toint (elt);
+	}
+
+	elt = ucl_object_lookup (obj, "flush_interval");
+
+	if (elt) {
+		backend->flush_interval = ucl_object_todouble (elt);
+	}
+
+	elt = ucl_object_lookup (obj, "compact_interval");
+
+	if (elt) {
+		backend->compact_interval = ucl_object_todouble (elt);
+	}
+
+	elt = ucl_object_lookup (obj, "lsh");
+
+	if (elt) {
+		backend->lsh = ucl_object_toboolean (elt);
+	}
+
+	rspamd_cryptobox_hash (id_hash, backend->path, strlen (backend->path),
+			NULL, 0);
+	backend->id = rspamd_encode_base32 (id_hash, sizeof (id_hash));
+
+	if (g_mkdir_with_parents (backend->path, 0755) == -1) {
+		g_set_error (err, rspamd_fuzzy_segments_quark (), errno,
+				"cannot create directory %s: %s", backend->path,
+				strerror (errno));
+		rspamd_fuzzy_backend_segments_free (backend);
+
+		return NULL;
+	}
+
+	if (!rspamd_fuzzy_segments_init_manifest (backend, err)) {
+		rspamd_fuzzy_backend_segments_free (backend);
+
+		return NULL;
+	}
+
+	backend->memtable = g_hash_table_new_full (
+			rspamd_fuzzy_segments_digest_hash,
+			rspamd_fuzzy_segments_digest_equal,
+			NULL, g_free);
+	backend->memtable_shingles = g_hash_table_new_full (
+			rspamd_fuzzy_segments_shingle_hash,
+			rspamd_fuzzy_segments_shingle_equal,
+			g_free, NULL);
+	backend->segments = g_ptr_array_new ();
+	backend->last_flush = rspamd_get_calendar_ticks ();
+	backend->last_compact = backend->last_flush;
+	rspamd_fuzzy_segments_reload (backend);
+
+	return backend;
+}
+
+void
+rspamd_fuzzy_backend_check_segments (struct rspamd_fuzzy_backend *bk,
+		const struct rspamd_fuzzy_cmd *cmd,
+		rspamd_fuzzy_check_cb cb, void *ud,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_segments *backend = subr_ud;
+	struct rspamd_fuzzy_reply rep;
+
+	rspamd_fuzzy_segments_reload (backend);
+	rspamd_fuzzy_segments_check_cmd (backend, cmd,
+			rspamd_fuzzy_backend_get_expire (bk), &rep);
+
+	if (cb) {
+		cb (&rep, ud);
+	}
+}
+
+void
+rspamd_fuzzy_backend_check_multi_segments (struct rspamd_fuzzy_backend *bk,
+		const struct rspamd_fuzzy_cmd **cmds, guint ncmds,
+		rspamd_fuzzy_check_multi_cb cb, void *ud,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_segments *backend = subr_ud;
+	struct rspamd_fuzzy_reply *reps;
+	gdouble expire = rspamd_fuzzy_backend_get_expire (bk);
+	guint i;
+
+	reps = g_malloc (sizeof (*reps) * ncmds);
+	rspamd_fuzzy_segments_reload (backend);
+
+	for (i = 0; i < ncmds; i ++) {
+		rspamd_fuzzy_segments_check_cmd (backend, cmds[i], expire, &reps[i]);
+	}
+
+	if (cb) {
+		cb (reps, ncmds, ud);
+	}
+
+	g_free (reps);
+}
+
+static struct rspamd_fuzzy_memtable_elt *
+rspamd_fuzzy_segments_memtable_get (
+		struct rspamd_fuzzy_backend_segments *backend,
+		const guchar *digest, gboolean *found)
+{
+	struct rspamd_fuzzy_memtable_elt *elt;
+
+	elt = g_hash_table_lookup (backend->memtable, digest);
+
+	if (elt == NULL) {
+		elt = g_malloc0 (sizeof (*elt));
+
+		/* Copy the current state of digest from segments */
+		*found = rspamd_fuzzy_segments_find (backend, digest, &elt->rec);
+
+		if (!*found) {
+			memcpy (elt->rec.digest, digest, sizeof (elt->rec.digest));
+		}
+
+		g_hash_table_insert (backend->memtable, elt->rec.digest, elt);
+	}
+	else {
+		*found = TRUE;
+	}
+
+	return elt;
+}
+
+void
+rspamd_fuzzy_backend_update_segments (struct rspamd_fuzzy_backend *bk,
+		GArray *updates, const gchar *src,
+		rspamd_fuzzy_update_cb cb, void *ud,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_segments *backend = subr_ud;
+	struct rspamd_fuzzy_memtable_elt *elt;
+	struct rspamd_fuzzy_memtable_shingle *shkey;
+	struct fuzzy_peer_cmd *io_cmd;
+	struct rspamd_fuzzy_cmd *cmd;
+	struct rspamd_fuzzy_segments_source *source = NULL;
+	gboolean success = TRUE, found;
+	guint64 hashes[RSPAMD_SHINGLE_SIZE];
+	guint32 numbers[RSPAMD_SHINGLE_SIZE];
+	guint i, j, nkeys, nupdates = 0, nadded = 0, ndeleted = 0, nextended = 0,
+			nignored = 0;
+	gdouble expire = rspamd_fuzzy_backend_get_expire (bk), now;
+	guint32 ts = time (NULL);
+
+	rspamd_fuzzy_segments_reload (backend);
+
+	for (i = 0; i < updates->len; i ++) {
+		io_cmd = &g_array_index (updates, struct fuzzy_peer_cmd, i);
+
+		if (io_cmd->is_shingle) {
+			cmd = &io_cmd->cmd.shingle.basic;
+		}
+		else {
+			cmd = &io_cmd->cmd.normal;
+		}
+
+		if (cmd->cmd == FUZZY_WRITE) {
+			elt = rspamd_fuzzy_segments_memtable_get (backend,
+					(const guchar *)cmd->digest, &found);
+
+			if (found && !(elt->rec.flags & SEGMENT_REC_DELETED) &&
+					elt->rec.flag == cmd->flag) {
+				/* We need to increase weight */
+				elt->rec.value += cmd->value;
+			}
+			else {
+				/* New hash or relearn */
+				elt->rec.value = cmd->value;
+				elt->rec.flag = cmd->flag;
+			}
+
+			elt->rec.flags &= ~SEGMENT_REC_DELETED;
+			elt->rec.ts = ts;
+
+			if (io_cmd->is_shingle && cmd->shingles_count > 0) {
+				elt->has_shingles = TRUE;
+				memcpy (&elt->sgl, &io_cmd->cmd.shingle.sgl,
+						sizeof (elt->sgl));
+
+				nkeys = rspamd_fuzzy_segments_shingle_keys (backend, &elt->sgl,
+						hashes, numbers);
+
+				for (j = 0; j < nkeys; j ++) {
+					shkey = g_malloc (sizeof (*shkey));
+					shkey->hash = hashes[j];
+					shkey->number = numbers[j];
+					g_hash_table_replace (backend->memtable_shingles, shkey,
+							elt);
+				}
+			}
+
+			nadded ++;
+			nupdates ++;
+		}
+		else if (cmd->cmd == FUZZY_DEL) {
+			elt = rspamd_fuzzy_segments_memtable_get (backend,
+					(const guchar *)cmd->digest, &found);
+
+			if (found) {
+				elt->rec.flags |= SEGMENT_REC_DELETED;
+				elt->rec.ts = ts;
+				ndeleted ++;
+				nupdates ++;
+			}
+			else {
+				g_hash_table_remove (backend->memtable, cmd->digest);
+			}
+		}
+		else if (cmd->cmd == FUZZY_REFRESH) {
+			elt = rspamd_fuzzy_segments_memtable_get (backend,
+					(const guchar *)cmd->digest, &found);
+
+			if (found && !(elt->rec.flags & SEGMENT_REC_DELETED)) {
+				elt->rec.ts = ts;
+			}
+			else if (!found) {
+				/* Nothing to refresh */
+				g_hash_table_remove (backend->memtable, cmd->digest);
+			}
+
+			nextended ++;
+		}
+		else {
+			nignored ++;
+		}
+	}
+
+	if (nupdates > 0) {
+		/* Bump version for the source */
+		for (i = 0; i < backend->manifest->nsources; i ++) {
+			if (strncmp (backend->manifest->sources[i].name, src,
+					sizeof (backend->manifest->sources[i].name)) == 0) {
+				source = &backend->manifest->sources[i];
+				break;
+			}
+		}
+
+		if (source == NULL &&
+				backend->manifest->nsources < SEGMENTS_MAX_SOURCES) {
+			source = &backend->manifest->sources[backend->manifest->nsources];
+			rspamd_strlcpy (source->name, src, sizeof (source->name));
+			source->rev = 0;
+			backend->manifest->nsources ++;
+		}
+
+		if (source) {
+			source->rev ++;
+		}
+	}
+
+	now = rspamd_get_calendar_ticks ();
+
+	if (g_hash_table_size (backend->memtable) >= backend->memtable_size ||
+			now - backend->last_flush >= backend->flush_interval) {
+		success = rspamd_fuzzy_segments_flush (backend);
+
+		if (success && (backend->segments->len > backend->max_segments ||
+				now - backend->last_compact >= backend->compact_interval)) {
+			rspamd_fuzzy_segments_compact (backend, expire);
+		}
+	}
+
+	if (cb) {
+		cb (success, nadded, ndeleted, nextended, nignored, ud);
+	}
+}
+
+void
+rspamd_fuzzy_backend_count_segments (struct rspamd_fuzzy_backend *bk,
+		rspamd_fuzzy_count_cb cb, void *ud,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_segments *backend = subr_ud;
+	struct rspamd_fuzzy_segment *seg;
+	guint64 nhashes;
+	guint i;
+
+	rspamd_fuzzy_segments_reload (backend);
+	/* Approximate as digests might be repeated in several segments */
+	nhashes = g_hash_table_size (backend->memtable);
+
+	PTR_ARRAY_FOREACH (backend->segments, i, seg) {
+		nhashes += seg->nrecs;
+	}
+
+	if (cb) {
+		cb (nhashes, ud);
+	}
+}
+
+void
+rspamd_fuzzy_backend_version_segments (struct rspamd_fuzzy_backend *bk,
+		const gchar *src,
+		rspamd_fuzzy_version_cb cb, void *ud,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_segments *backend = subr_ud;
+	guint64 rev = 0;
+	guint i;
+
+	for (i = 0; i < backend->manifest->nsources; i ++) {
+		if (strncmp (backend->manifest->sources[i].name, src,
+				sizeof (backend->manifest->sources[i].name)) == 0) {
+			rev = backend->manifest->sources[i].rev;
+			break;
+		}
+	}
+
+	if (cb) {
+		cb (rev, ud);
+	}
+}
+
+const gchar*
+rspamd_fuzzy_backend_id_segments (struct rspamd_fuzzy_backend *bk,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_segments *backend = subr_ud;
+
+	return backend->id;
+}
+
+void
+rspamd_fuzzy_backend_periodic_segments (struct rspamd_fuzzy_backend *bk,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_segments *backend = subr_ud;
+	gdouble now = rspamd_get_calendar_ticks ();
+
+	/* Called by the process that applies updates */
+	if (g_hash_table_size (backend->memtable) > 0 &&
+			!rspamd_fuzzy_segments_flush (backend)) {
+		return;
+	}
+
+	if (backend->segments->len > backend->max_segments ||
+			now - backend->last_compact >= backend->compact_interval) {
+		rspamd_fuzzy_segments_compact (backend,
+				rspamd_fuzzy_backend_get_expire (bk));
+	}
+}
+
+void
+rspamd_fuzzy_backend_close_segments (struct rspamd_fuzzy_backend *bk,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_segments *backend = subr_ud;
+
+	if (g_hash_table_size (backend->memtable) > 0) {
+		rspamd_fuzzy_segments_flush (backend);
+	}
+
+	rspamd_fuzzy_backend_segments_free (backend);
+}
@@ -24,6 +24,7 @@
 
 struct rspamd_fuzzy_backend_sqlite {
 	sqlite3 *db;
+	sqlite3_stmt **stmts; /* Prepared statements are per connection */
 	char *path;
 	gchar id[MEMPOOL_UID_LEN];
 	gsize count;
@@ -109,7 +110,6 @@ static struct rspamd_fuzzy_stmts {
 	enum rspamd_fuzzy_statement_idx idx;
 	const gchar *sql;
 	const gchar *args;
-	sqlite3_stmt *stmt;
 	gint result;
 } prepared_stmts[RSPAMD_FUZZY_BACKEND_MAX] =
 {
@@ -117,21 +117,18 @@ static struct rspamd_fuzzy_stmts {
 		.idx = RSPAMD_FUZZY_BACKEND_TRANSACTION_START,
 		.sql = "BEGIN TRANSACTION;",
 		.args = "",
-		.stmt = NULL,
 		.result = SQLITE_DONE
 	},
 	{
 		.idx = RSPAMD_FUZZY_BACKEND_TRANSACTION_COMMIT,
 		.sql = "COMMIT;",
 		.args = "",
-		.stmt = NULL,
 		.result = SQLITE_DONE
 	},
 	{
 		.idx = RSPAMD_FUZZY_BACKEND_TRANSACTION_ROLLBACK,
 		.sql = "ROLLBACK;",
 		.args = "",
-		.stmt = NULL,
 		.result = SQLITE_DONE
 	},
 	{
@@ -139,7 +136,6 @@ static struct rspamd_fuzzy_stmts {
 		.sql = "INSERT INTO digests(flag, digest, value, time) VALUES"
 				"(?1, ?2, ?3, strftime('%s','now'));",
 		.args = "SDI",
-		.stmt = NULL,
 		.result = SQLITE_DONE
 	},
 	{
@@ -147,7 +143,6 @@ static struct rspamd_fuzzy_stmts {
 		.sql = "UPDATE digests SET value = value + ?1, time = strftime('%s','now') WHERE "
 				"digest==?2;",
 		.args = "ID",
-		.stmt = NULL,
 		.result = SQLITE_DONE
 	},
 	{
@@ -155,7 +150,6 @@ static struct rspamd_fuzzy_stmts {
 		.sql = "UPDATE digests SET value = ?1, flag = ?2, time = strftime('%s','now') WHERE "
 				"digest==?3;",
 		.args = "IID",
-		.stmt = NULL,
 		.result = SQLITE_DONE
 	},
 	{
@@ -163,84 +157,72 @@ static struct rspamd_fuzzy_stmts {
 		.sql = "INSERT OR REPLACE INTO shingles(value, number, digest_id) "
 				"VALUES (?1, ?2, ?3);",
 		.args = "III",
-		.stmt = NULL,
 		.result = SQLITE_DONE
 	},
 	{
 		.idx = RSPAMD_FUZZY_BACKEND_CHECK,
 		.sql = "SELECT value, time, flag FROM digests WHERE digest==?1;",
 		.args = "D",
-		.stmt = NULL,
 		.result = SQLITE_ROW
 	},
 	{
 		.idx = RSPAMD_FUZZY_BACKEND_CHECK_SHINGLE,
 		.sql = "SELECT digest_id FROM shingles WHERE value=?1 AND number=?2",
 		.args = "IS",
-		.stmt = NULL,
 		.result = SQLITE_ROW
 	},
 	{
 		.idx = RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID,
 		.sql = "SELECT digest, value, time, flag FROM digests WHERE id=?1",
 		.args = "I",
-		.stmt = NULL,
 		.result = SQLITE_ROW
 	},
 	{
 		.idx = RSPAMD_FUZZY_BACKEND_DELETE,
 		.sql = "DELETE FROM digests WHERE digest==?1;",
 		.args = "D",
-		.stmt = NULL,
 		.result = SQLITE_DONE
 	},
 	{
 		.idx = RSPAMD_FUZZY_BACKEND_COUNT,
 		.sql = "SELECT COUNT(*) FROM digests;",
 		.args = "",
-		.stmt = NULL,
 		.result = SQLITE_ROW
 	},
 	{
 		.idx = RSPAMD_FUZZY_BACKEND_EXPIRE,
 		.sql = "DELETE FROM digests WHERE id IN (SELECT id FROM digests WHERE time < ?1 LIMIT ?2);",
 		.args = "II",
-		.stmt = NULL,
 		.result = SQLITE_DONE
 	},
 	{
 		.idx = RSPAMD_FUZZY_BACKEND_VACUUM,
 		.sql = "VACUUM;",
 		.args = "",
-		.stmt = NULL,
 		.result = SQLITE_DONE
 	},
 	{
 		.idx = RSPAMD_FUZZY_BACKEND_DELETE_ORPHANED,
 		.sql = "DELETE FROM shingles WHERE value=?1 AND number=?2;",
 		.args = "II",
-		.stmt = NULL,
 		.result = SQLITE_DONE
 	},
 	{
 		.idx = RSPAMD_FUZZY_BACKEND_ADD_SOURCE,
 		.sql = "INSERT OR IGNORE INTO sources(name, version, last) VALUES (?1, ?2, ?3);",
 		.args = "TII",
-		.stmt = NULL,
 		.result = SQLITE_DONE
 	},
 	{
 		.idx = RSPAMD_FUZZY_BACKEND_VERSION,
 		.sql = "SELECT version FROM sources WHERE name=?1;",
 		.args = "T",
-		.stmt = NULL,
 		.result = SQLITE_ROW
 	},
 	{
 		.idx = RSPAMD_FUZZY_BACKEND_SET_VERSION,
 		.sql = "INSERT OR REPLACE INTO sources (name, version, last) VALUES (?3, ?1, ?2);",
 		.args = "IIT",
-		.stmt = NULL,
 		.result = SQLITE_DONE
 	},
 };
@@ -257,12 +239,12 @@ rspamd_fuzzy_backend_sqlite_prepare_stmts (struct rspamd_fuzzy_backend_sqlite *b
 	int i;
 
 	for (i = 0; i < RSPAMD_FUZZY_BACKEND_MAX; i ++) {
-		if (prepared_stmts[i].stmt != NULL) {
+		if (bk->stmts[i] != NULL) {
 			/* Skip already prepared statements */
 			continue;
 		}
 		if (sqlite3_prepare_v2 (bk->db, prepared_stmts[i].sql, -1,
-				&prepared_stmts[i].stmt, NULL) != SQLITE_OK) {
+				&bk->stmts[i], NULL) != SQLITE_OK) {
 			g_set_error (err, rspamd_fuzzy_backend_sqlite_quark (),
 				-1, "Cannot initialize prepared sql `%s`: %s",
 				prepared_stmts[i].sql, sqlite3_errmsg (bk->db));
@@ -286,7 +268,7 @@ rspamd_fuzzy_backend_sqlite_cleanup_stmt (struct rspamd_fuzzy_backend_sqlite *ba
 	}
 
 	msg_debug_fuzzy_backend ("resetting `%s`", prepared_stmts[idx].sql);
-	stmt = prepared_stmts[idx].stmt;
+	stmt = backend->stmts[idx];
 	sqlite3_clear_bindings (stmt);
 	sqlite3_reset (stmt);
 
@@ -311,18 +293,18 @@ rspamd_fuzzy_backend_sqlite_run_stmt (struct rspamd_fuzzy_backend_sqlite *backen
 		return -1;
 	}
 
-	stmt = prepared_stmts[idx].stmt;
+	stmt = backend->stmts[idx];
 	g_assert ((int)prepared_stmts[idx].idx == idx);
 
 	if (stmt == NULL) {
 		if ((retcode = sqlite3_prepare_v2 (backend->db, prepared_stmts[idx].sql, -1,
-				&prepared_stmts[idx].stmt, NULL)) != SQLITE_OK) {
+				&backend->stmts[idx], NULL)) != SQLITE_OK) {
 			msg_err_fuzzy_backend ("Cannot initialize prepared sql `%s`: %s",
 					prepared_stmts[idx].sql, sqlite3_errmsg (backend->db));
 
 			return retcode;
 		}
-		stmt = prepared_stmts[idx].stmt;
+		stmt = backend->stmts[idx];
 	}
 
 	msg_debug_fuzzy_backend ("executing `%s` %s auto cleanup",
@@ -386,9 +368,9 @@ rspamd_fuzzy_backend_sqlite_close_stmts (struct rspamd_fuzzy_backend_sqlite *bk)
 	int i;
 
 	for (i = 0; i < RSPAMD_FUZZY_BACKEND_MAX; i++) {
-		if (prepared_stmts[i].stmt != NULL) {
-			sqlite3_finalize (prepared_stmts[i].stmt);
-			prepared_stmts[i].stmt = NULL;
+		if (bk->stmts[i] != NULL) {
+			sqlite3_finalize (bk->stmts[i]);
+			bk->stmts[i] = NULL;
 		}
 	}
 
@@ -431,6 +413,7 @@ rspamd_fuzzy_backend_sqlite_open_db (const gchar *path, GError **err)
 	bk = g_malloc0 (sizeof (*bk));
 	bk->path = g_strdup (path);
 	bk->expired = 0;
+	bk->stmts = g_malloc0 (sizeof (sqlite3_stmt *) * RSPAMD_FUZZY_BACKEND_MAX);
 	bk->pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "fuzzy_backend");
 	bk->db = rspamd_sqlite3_open_or_create (bk->pool, bk->path,
 			create_tables_sql, 1, err);
@@ -478,7 +461,7 @@ rspamd_fuzzy_backend_sqlite_open (const gchar *path,
 	if (rspamd_fuzzy_backend_sqlite_run_stmt (backend, FALSE, RSPAMD_FUZZY_BACKEND_COUNT)
 			== SQLITE_OK) {
 		backend->count = sqlite3_column_int64 (
-				prepared_stmts[RSPAMD_FUZZY_BACKEND_COUNT].stmt, 0);
+				backend->stmts[RSPAMD_FUZZY_BACKEND_COUNT], 0);
 	}
 
 	rspamd_fuzzy_backend_sqlite_cleanup_stmt (backend, RSPAMD_FUZZY_BACKEND_COUNT);
@@ -494,8 +477,9 @@ rspamd_fuzzy_backend_sqlite_int64_cmp (const void *a, const void *b)
 	return (ia - ib);
 }
 
-struct rspamd_fuzzy_reply
-rspamd_fuzzy_backend_sqlite_check (struct rspamd_fuzzy_backend_sqlite *backend,
+static struct rspamd_fuzzy_reply
+rspamd_fuzzy_backend_sqlite_check_single (
+		struct rspamd_fuzzy_backend_sqlite *backend,
 		const struct rspamd_fuzzy_cmd *cmd, gint64 expire)
 {
 	struct rspamd_fuzzy_reply rep;
@@ -513,25 +497,23 @@ rspamd_fuzzy_backend_sqlite_check (struct rspamd_fuzzy_backend_sqlite *backend,
 	}
 
 	/* Try direct match first of all */
-	rspamd_fuzzy_backend_sqlite_run_stmt (backend, TRUE,
-			RSPAMD_FUZZY_BACKEND_TRANSACTION_START);
 	rc = rspamd_fuzzy_backend_sqlite_run_stmt (backend, FALSE,
 			RSPAMD_FUZZY_BACKEND_CHECK,
 			cmd->digest);
 
 	if (rc == SQLITE_OK) {
 		timestamp = sqlite3_column_int64 (
-				prepared_stmts[RSPAMD_FUZZY_BACKEND_CHECK].stmt, 1);
+				backend->stmts[RSPAMD_FUZZY_BACKEND_CHECK], 1);
 		if (time (NULL) - timestamp > expire) {
 			/* Expire element */
 			msg_debug_fuzzy_backend ("requested hash has been expired");
 		}
 		else {
 			rep.v1.value = sqlite3_column_int64 (
-				prepared_stmts[RSPAMD_FUZZY_BACKEND_CHECK].stmt, 0);
+				backend->stmts[RSPAMD_FUZZY_BACKEND_CHECK], 0);
 			rep.v1.prob = 1.0;
 			rep.v1.flag = sqlite3_column_int (
-					prepared_stmts[RSPAMD_FUZZY_BACKEND_CHECK].stmt, 2);
+					backend->stmts[RSPAMD_FUZZY_BACKEND_CHECK], 2);
 		}
 	}
 	else if (cmd->shingles_count > 0) {
@@ -546,7 +528,7 @@ rspamd_fuzzy_backend_sqlite_check (struct rspamd_fuzzy_backend_sqlite *backend,
 					shcmd->sgl.hashes[i], i);
 			if (rc == SQLITE_OK) {
 				shingle_values[i] = sqlite3_column_int64 (
-						prepared_stmts[RSPAMD_FUZZY_BACKEND_CHECK_SHINGLE].stmt,
+						backend->stmts[RSPAMD_FUZZY_BACKEND_CHECK_SHINGLE],
 						0);
 			}
 			else {
@@ -601,7 +583,7 @@ rspamd_fuzzy_backend_sqlite_check (struct rspamd_fuzzy_backend_sqlite *backend,
 						RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID, sel_id);
 				if (rc == SQLITE_OK) {
 					timestamp = sqlite3_column_int64 (
-							prepared_stmts[RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID].stmt,
+							backend->stmts[RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID],
 							2);
 					if (time (NULL) - timestamp > expire) {
 						/* Expire element */
@@ -612,13 +594,13 @@ rspamd_fuzzy_backend_sqlite_check (struct rspamd_fuzzy_backend_sqlite *backend,
 					else {
 						rep.ts = timestamp;
 						memcpy (rep.digest, sqlite3_column_blob (
-								prepared_stmts[RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID].stmt,
+								backend->stmts[RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID],
 								0), sizeof (rep.digest));
 						rep.v1.value = sqlite3_column_int64 (
-								prepared_stmts[RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID].stmt,
+								backend->stmts[RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID],
 								1);
 						rep.v1.flag = sqlite3_column_int (
-								prepared_stmts[RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID].stmt,
+								backend->stmts[RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID],
 								3);
 					}
 				}
@@ -634,12 +616,63 @@ rspamd_fuzzy_backend_sqlite_check (struct rspamd_fuzzy_backend_sqlite *backend,
 	}
 
 	rspamd_fuzzy_backend_sqlite_cleanup_stmt (backend, RSPAMD_FUZZY_BACKEND_CHECK);
+
+	return rep;
+}
+
+struct rspamd_fuzzy_reply
+rspamd_fuzzy_backend_sqlite_check (struct rspamd_fuzzy_backend_sqlite *backend,
+		const struct rspamd_fuzzy_cmd *cmd, gint64 expire)
+{
+	struct rspamd_fuzzy_reply rep;
+
+	if (backend == NULL) {
+		memset (&rep, 0, sizeof (rep));
+		memcpy (rep.digest, cmd->digest, sizeof (rep.digest));
+
+		return rep;
+	}
+
+	rspamd_fuzzy_backend_sqlite_run_stmt (backend, TRUE,
+			RSPAMD_FUZZY_BACKEND_TRANSACTION_START);
+	rep = rspamd_fuzzy_backend_sqlite_check_single (backend, cmd, expire);
 	rspamd_fuzzy_backend_sqlite_run_stmt (backend, TRUE,
 			RSPAMD_FUZZY_BACKEND_TRANSACTION_COMMIT);
 
 	return rep;
 }
 
+void
+rspamd_fuzzy_backend_sqlite_check_multi (
+		struct rspamd_fuzzy_backend_sqlite *backend,
+		const struct rspamd_fuzzy_cmd **cmds, guint ncmds,
+		gint64 expire,
+		struct rspamd_fuzzy_reply *reps)
+{
+	guint i;
+
+	if (backend == NULL) {
+		for (i = 0; i < ncmds; i ++) {
+			memset (&reps[i], 0, sizeof (reps[i]));
+			memcpy (reps[i].digest, cmds[i]->digest, sizeof (reps[i].digest));
+		}
+
+		return;
+	}
+
+	/* All lookups share a single read transaction */
+	rspamd_fuzzy_backend_sqlite_run_stmt (backend, TRUE,
+			RSPAMD_FUZZY_BACKEND_TRANSACTION_START);
+
+	for (i = 0; i < ncmds; i ++) {
+		reps[i] = rspamd_fuzzy_backend_sqlite_check_single (backend, cmds[i],
+				expire);
+	}
+
+	rspamd_fuzzy_backend_sqlite_run_stmt (backend, TRUE,
+			RSPAMD_FUZZY_BACKEND_TRANSACTION_COMMIT);
+}
+
 gboolean
 rspamd_fuzzy_backend_sqlite_prepare_update (struct rspamd_fuzzy_backend_sqlite *backend,
 		const gchar *source)
@@ -681,7 +714,7 @@ rspamd_fuzzy_backend_sqlite_add (struct rspamd_fuzzy_backend_sqlite *backend,
 	if (rc == SQLITE_OK) {
 		/* Check flag */
 		flag = sqlite3_column_int64 (
-				prepared_stmts[RSPAMD_FUZZY_BACKEND_CHECK].stmt,
+				backend->stmts[RSPAMD_FUZZY_BACKEND_CHECK],
 				2);
 		rspamd_fuzzy_backend_sqlite_cleanup_stmt (backend, RSPAMD_FUZZY_BACKEND_CHECK);
 
@@ -1005,6 +1038,8 @@ rspamd_fuzzy_backend_sqlite_close (struct rspamd_fuzzy_backend_sqlite *backend)
 			g_free (backend->path);
 		}
 
+		g_free (backend->stmts);
+
 		if (backend->pool) {
 			rspamd_mempool_delete (backend->pool);
 		}
@@ -1021,7 +1056,7 @@ rspamd_fuzzy_backend_sqlite_count (struct rspamd_fuzzy_backend_sqlite *backend)
 		if (rspamd_fuzzy_backend_sqlite_run_stmt (backend, FALSE,
 				RSPAMD_FUZZY_BACKEND_COUNT) == SQLITE_OK) {
 			backend->count = sqlite3_column_int64 (
-					prepared_stmts[RSPAMD_FUZZY_BACKEND_COUNT].stmt, 0);
+					backend->stmts[RSPAMD_FUZZY_BACKEND_COUNT], 0);
 		}
 
 		rspamd_fuzzy_backend_sqlite_cleanup_stmt (backend, RSPAMD_FUZZY_BACKEND_COUNT);
@@ -1042,7 +1077,7 @@ rspamd_fuzzy_backend_sqlite_version (struct rspamd_fuzzy_backend_sqlite *backend
 		if (rspamd_fuzzy_backend_sqlite_run_stmt (backend, FALSE,
 				RSPAMD_FUZZY_BACKEND_VERSION, source) == SQLITE_OK) {
 			ret = sqlite3_column_int64 (
-					prepared_stmts[RSPAMD_FUZZY_BACKEND_VERSION].stmt, 0);
+					backend->stmts[RSPAMD_FUZZY_BACKEND_VERSION], 0);
 		}
 
 		rspamd_fuzzy_backend_sqlite_cleanup_stmt (backend, RSPAMD_FUZZY_BACKEND_VERSION);
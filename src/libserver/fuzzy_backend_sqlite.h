@@ -43,6 +43,19 @@ struct rspamd_fuzzy_reply rspamd_fuzzy_backend_sqlite_check (
 		const struct rspamd_fuzzy_cmd *cmd,
 		gint64 expire);
 
+/**
+ * Check several fuzzy hashes within a single transaction
+ * @param backend
+ * @param cmds array of commands
+ * @param ncmds number of commands
+ * @param reps output array of `ncmds` replies
+ */
+void rspamd_fuzzy_backend_sqlite_check_multi (
+		struct rspamd_fuzzy_backend_sqlite *backend,
+		const struct rspamd_fuzzy_cmd **cmds, guint ncmds,
+		gint64 expire,
+		struct rspamd_fuzzy_reply *reps);
+
 /**
  * Prepare storage for updates (by starting transaction)
  */
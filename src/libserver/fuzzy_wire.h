@@ -90,6 +90,32 @@ RSPAMD_PACKED(rspamd_fuzzy_encrypted_reply) {
 
 static const guchar fuzzy_encrypted_magic[4] = {'r', 's', 'f', 'e'};
 
+/*
+ * Multi-command frame: several commands are packed into a single encrypted
+ * datagram and the server replies with a single encrypted datagram.
+ *
+ * Request: rspamd_fuzzy_encrypted_req_hdr with `fuzzy_multi_magic` followed
+ * by encrypted rspamd_fuzzy_multi_hdr and `ncmds` commands, each command is
+ * rspamd_fuzzy_cmd followed by rspamd_shingle if shingles_count is not zero.
+ *
+ * Reply: rspamd_fuzzy_encrypted_rep_hdr followed by encrypted
+ * rspamd_fuzzy_multi_hdr and `ncmds` rspamd_fuzzy_reply in the same order
+ * as commands.
+ */
+#define RSPAMD_FUZZY_MULTI_VERSION 1
+#define RSPAMD_FUZZY_MULTI_MAX_CMDS 16
+#define RSPAMD_FUZZY_MULTI_MAX_LEN (sizeof (struct rspamd_fuzzy_encrypted_req_hdr) + \
+		sizeof (struct rspamd_fuzzy_multi_hdr) + \
+		RSPAMD_FUZZY_MULTI_MAX_CMDS * sizeof (struct rspamd_fuzzy_shingle_cmd))
+
+static const guchar fuzzy_multi_magic[4] = {'r', 's', 'f', 'm'};
+
+RSPAMD_PACKED(rspamd_fuzzy_multi_hdr) {
+	guint8 version;
+	guint8 ncmds;
+	guchar reserved[2];
+};
+
 struct rspamd_fuzzy_stat_entry {
 	const gchar *name;
 	guint32 fuzzy_cnt;
@@ -176,14 +176,16 @@ static struct html_tag_def tag_defs[] = {
 KHASH_MAP_INIT_INT (entity_by_number, const char *);
 KHASH_MAP_INIT_STR (entity_by_name, const char *);
 KHASH_MAP_INIT_STR (tag_by_name, struct html_tag_def);
-KHASH_MAP_INIT_INT (tag_by_id, struct html_tag_def);
 KHASH_INIT (color_by_name, const rspamd_ftok_t *, struct html_color, true,
 		rspamd_ftok_icase_hash, rspamd_ftok_icase_equal);
 
 khash_t(entity_by_number) *html_entity_by_number;
 khash_t(entity_by_name) *html_entity_by_name;
+/* Most of numeric entities in real messages are latin1 ones */
+static const entity *html_entity_by_small_number[256];
 khash_t(tag_by_name) *html_tag_by_name;
-khash_t(tag_by_id) *html_tag_by_id;
+/* Tag ids are dense, so they are resolved by a plain array */
+static const struct html_tag_def *html_tag_by_id[N_TAGS];
 khash_t(color_by_name) *html_color_by_name;
 
 static void
@@ -194,14 +196,12 @@ rspamd_html_library_init (void)
 	gint rc;
 
 	if (!tags_sorted) {
-		html_tag_by_id = kh_init (tag_by_id);
 		html_tag_by_name = kh_init (tag_by_name);
-		kh_resize (tag_by_id, html_tag_by_id, G_N_ELEMENTS (tag_defs));
 		kh_resize (tag_by_name, html_tag_by_name, G_N_ELEMENTS (tag_defs));
 
 		for (i = 0; i < G_N_ELEMENTS (tag_defs); i++) {
-			k = kh_put (tag_by_id, html_tag_by_id, tag_defs[i].id, &rc);
-			kh_val (html_tag_by_id, k) = tag_defs[i];
+			g_assert (tag_defs[i].id >= 0 && tag_defs[i].id < N_TAGS);
+			html_tag_by_id[tag_defs[i].id] = &tag_defs[i];
 
 			k = kh_put (tag_by_name, html_tag_by_name, tag_defs[i].name, &rc);
 			kh_val (html_tag_by_name, k) = tag_defs[i];
@@ -223,6 +223,11 @@ rspamd_html_library_init (void)
 					entities_defs[i].code, &rc);
 			kh_val (html_entity_by_number, k) = entities_defs[i].replacement;
 
+			if (entities_defs[i].code < G_N_ELEMENTS (html_entity_by_small_number)) {
+				html_entity_by_small_number[entities_defs[i].code] =
+						&entities_defs[i];
+			}
+
 			k = kh_put (entity_by_name, html_entity_by_name,
 					entities_defs[i].name, &rc);
 			kh_val (html_entity_by_name, k) = entities_defs[i].replacement;
@@ -320,16 +325,38 @@ rspamd_html_tag_seen (struct html_content *hc, const gchar *tagname)
 
 const gchar *
 rspamd_html_tag_by_id (gint id)
+{
+	if (id >= 0 && id < N_TAGS && html_tag_by_id[id] != NULL) {
+		return html_tag_by_id[id]->name;
+	}
+
+	return NULL;
+}
+
+static gboolean
+rspamd_html_entity_by_number (gint val, const gchar **replacement)
 {
 	khiter_t k;
 
-	k = kh_get (tag_by_id, html_tag_by_id, id);
+	if (val >= 0 && val < (gint)G_N_ELEMENTS (html_entity_by_small_number)) {
+		if (html_entity_by_small_number[val] != NULL) {
+			*replacement = html_entity_by_small_number[val]->replacement;
+
+			return TRUE;
+		}
 
-	if (k != kh_end (html_tag_by_id)) {
-		return kh_val (html_tag_by_id, k).name;
+		return FALSE;
 	}
 
-	return NULL;
+	k = kh_get (entity_by_number, html_entity_by_number, val);
+
+	if (k != kh_end (html_entity_by_number)) {
+		*replacement = kh_val (html_entity_by_number, k);
+
+		return TRUE;
+	}
+
+	return FALSE;
 }
 
 /* Decode HTML entitles in text */
@@ -337,9 +364,10 @@ guint
 rspamd_html_decode_entitles_inplace (gchar *s, guint len)
 {
 	guint l, rep_len;
-	gchar *t = s, *h = s, *e = s, *end_ptr;
+	gchar *t = s, *h = s, *e = s, *end_ptr, *amp, *semi;
 	const gchar *end;
-	const gchar *entity;
+	const gchar *entity, *replacement;
+	gsize seg;
 	gint state = 0, val, base;
 	khiter_t k;
 
@@ -356,19 +384,37 @@ rspamd_html_decode_entitles_inplace (gchar *s, guint len)
 		switch (state) {
 		/* Out of entity */
 		case 0:
-			if (*h == '&') {
-				state = 1;
-				e = h;
-				h++;
+			/* Copy everything up to the next entity at once */
+			amp = memchr (h, '&', end - h);
+			seg = (amp == NULL) ? (gsize)(end - h) : (gsize)(amp - h);
+
+			if (seg > 0) {
+				if (t != h) {
+					memmove (t, h, seg);
+				}
+
+				h += seg;
+				t += seg;
 				continue;
 			}
-			else {
-				*t = *h;
-				h++;
-				t++;
-			}
-			break;
+
+			state = 1;
+			e = h;
+			h++;
+			continue;
 		case 1:
+			if (*h != ';') {
+				/* Skip to the end of entity at once */
+				semi = memchr (h, ';', end - h);
+
+				if (semi == NULL) {
+					h = (gchar *)end;
+					break;
+				}
+
+				h = semi;
+			}
+
 			if (*h == ';' && h > e) {
 				/* Determine base */
 				/* First find in entities table */
@@ -421,15 +467,12 @@ rspamd_html_decode_entitles_inplace (gchar *s, guint len)
 					}
 					else {
 						/* Search for a replacement */
-						k = kh_get (entity_by_number, html_entity_by_number, val);
-
-						if (k != kh_end (html_entity_by_number)) {
-							if (kh_val (html_entity_by_number, k)) {
-								rep_len = strlen (kh_val (html_entity_by_number, k));
+						if (rspamd_html_entity_by_number (val, &replacement)) {
+							if (replacement) {
+								rep_len = strlen (replacement);
 
 								if (end - t >= rep_len) {
-									memcpy (t, kh_val (html_entity_by_number, k),
-											rep_len);
+									memcpy (t, replacement, rep_len);
 									t += rep_len;
 								}
 							} else {
@@ -1417,7 +1460,7 @@ rspamd_process_html_url (rspamd_mempool_t *pool, struct rspamd_url *url,
 		GHashTable *tbl_urls, GHashTable *tbl_emails)
 {
 	GHashTable *target_tbl;
-	struct rspamd_url *query_url, *existing;
+	struct rspamd_url *query_url;
 	gchar *url_str;
 	gint rc;
 	gboolean prefix_added;
@@ -1466,15 +1509,7 @@ rspamd_process_html_url (rspamd_mempool_t *pool, struct rspamd_url *url,
 					query_url->flags |= RSPAMD_URL_FLAG_OBSCURED;
 				}
 
-				if ((existing = g_hash_table_lookup (target_tbl,
-						query_url)) == NULL) {
-					g_hash_table_insert (target_tbl,
-							query_url,
-							query_url);
-				}
-				else {
-					existing->count ++;
-				}
+				rspamd_url_set_add_or_increase (target_tbl, query_url);
 			}
 		}
 	}
@@ -2712,21 +2747,17 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
 							}
 
 							if (target_tbl != NULL) {
-								turl = g_hash_table_lookup (target_tbl, url);
+								turl = rspamd_url_set_add_or_increase (
+										target_tbl, url);
 
 								if (turl == NULL) {
-									g_hash_table_insert (target_tbl, url, url);
-								}
-								else {
-									turl->count ++;
-									url = NULL;
-								}
-
-								if (turl == NULL && url != NULL) {
 									rspamd_process_html_url (pool,
 											url,
 											urls, emails);
 								}
+								else {
+									url = NULL;
+								}
 							}
 
 							href_offset = dest->len;
@@ -153,6 +153,7 @@ rspamd_milter_session_reset (struct rspamd_milter_session *session,
 		}
 
 		priv->cur_hdr = 0;
+		priv->size_hint = 0;
 	}
 
 	if (how & RSPAMD_MILTER_RESET_ADDR) {
@@ -287,6 +288,65 @@ rspamd_milter_plan_io (struct rspamd_milter_session *session,
 	(var) = ntohs (var); \
 } while (0)
 
+/*
+ * ESMTP arguments of MAIL command are NUL terminated strings, we are
+ * interested in SIZE= merely to preallocate the message
+ */
+static void
+rspamd_milter_parse_esmtp_args (struct rspamd_milter_session *session,
+		struct rspamd_milter_private *priv,
+		const guchar *pos, const guchar *end)
+{
+	const guchar *zero;
+	gulong size;
+
+	while (pos < end) {
+		zero = memchr (pos, '\0', end - pos);
+
+		if (zero == NULL) {
+			zero = end;
+		}
+
+		if ((gsize)(zero - pos) > sizeof ("SIZE=") - 1 &&
+				g_ascii_strncasecmp ((const gchar *)pos, "SIZE=",
+						sizeof ("SIZE=") - 1) == 0) {
+			if (rspamd_strtoul ((const gchar *)pos + sizeof ("SIZE=") - 1,
+					zero - pos - (sizeof ("SIZE=") - 1), &size)) {
+				priv->size_hint = MIN (size, RSPAMD_MILTER_MAX_PREALLOC);
+				msg_debug_milter ("got message size hint: %ul", size);
+			}
+		}
+
+		pos = zero + 1;
+	}
+}
+
+/*
+ * Ensures that `len` more bytes fit the message buffer, if the MTA has declared
+ * the message size, then the whole message is reserved at once to avoid
+ * reallocations when body chunks are appended
+ */
+static void
+rspamd_milter_message_reserve (struct rspamd_milter_session *session,
+		struct rspamd_milter_private *priv, gsize len)
+{
+	gsize need = len, cur_len;
+
+	cur_len = session->message ? session->message->len : 0;
+
+	if (priv->size_hint > 0 && cur_len < priv->size_hint) {
+		need = MAX (len, priv->size_hint + RSPAMD_MILTER_SIZE_SLACK - cur_len);
+	}
+
+	if (session->message == NULL) {
+		session->message = rspamd_fstring_sized_new (
+				MAX (need, RSPAMD_MILTER_MESSAGE_CHUNK));
+	}
+	else if (session->message->allocated - session->message->len < len) {
+		session->message = rspamd_fstring_grow (session->message, need);
+	}
+}
+
 static gboolean
 rspamd_milter_process_command (struct rspamd_milter_session *session,
 		struct rspamd_milter_private *priv)
@@ -308,12 +368,8 @@ rspamd_milter_process_command (struct rspamd_milter_session *session,
 		rspamd_milter_session_reset (session, RSPAMD_MILTER_RESET_ABORT);
 		break;
 	case RSPAMD_MILTER_CMD_BODY:
-		if (!session->message) {
-			session->message = rspamd_fstring_sized_new (
-					RSPAMD_MILTER_MESSAGE_CHUNK);
-		}
-
 		msg_debug_milter ("got body chunk: %d bytes", (int)cmdlen);
+		rspamd_milter_message_reserve (session, priv, cmdlen);
 		session->message = rspamd_fstring_append (session->message,
 				pos, cmdlen);
 		break;
@@ -555,10 +611,6 @@ rspamd_milter_process_command (struct rspamd_milter_session *session,
 		break;
 	case RSPAMD_MILTER_CMD_HEADER:
 		msg_debug_milter ("got header command");
-		if (!session->message) {
-			session->message = rspamd_fstring_sized_new (
-					RSPAMD_MILTER_MESSAGE_CHUNK);
-		}
 		zero = memchr (pos, '\0', cmdlen);
 
 		if (zero == NULL) {
@@ -589,9 +641,17 @@ rspamd_milter_process_command (struct rspamd_milter_session *session,
 							priv->cur_hdr);
 				}
 
-				rspamd_printf_fstring (&session->message, "%*s: %*s\r\n",
-						(int)(zero - pos), pos,
-						(int)(end - zero - 2), zero + 1);
+				/* name: value\r\n */
+				rspamd_milter_message_reserve (session, priv,
+						(zero - pos) + (end - zero - 2) + 4);
+				session->message = rspamd_fstring_append (session->message,
+						pos, zero - pos);
+				session->message = rspamd_fstring_append (session->message,
+						": ", 2);
+				session->message = rspamd_fstring_append (session->message,
+						zero + 1, end - zero - 2);
+				session->message = rspamd_fstring_append (session->message,
+						"\r\n", 2);
 				priv->cur_hdr ++;
 			}
 			else {
@@ -622,7 +682,7 @@ rspamd_milter_process_command (struct rspamd_milter_session *session,
 					session->from = addr;
 				}
 
-				/* TODO: parse esmtp arguments */
+				rspamd_milter_parse_esmtp_args (session, priv, zero + 1, end);
 				break;
 			}
 			else {
@@ -643,12 +703,7 @@ rspamd_milter_process_command (struct rspamd_milter_session *session,
 		break;
 	case RSPAMD_MILTER_CMD_EOH:
 		msg_debug_milter ("got eoh command");
-
-		if (!session->message) {
-			session->message = rspamd_fstring_sized_new (
-					RSPAMD_MILTER_MESSAGE_CHUNK);
-		}
-
+		rspamd_milter_message_reserve (session, priv, 2);
 		session->message = rspamd_fstring_append (session->message,
 				"\r\n", 2);
 		break;
@@ -754,10 +809,7 @@ rspamd_milter_process_command (struct rspamd_milter_session *session,
 		}
 		break;
 	case RSPAMD_MILTER_CMD_DATA:
-		if (!session->message) {
-			session->message = rspamd_fstring_sized_new (
-					RSPAMD_MILTER_MESSAGE_CHUNK);
-		}
+		rspamd_milter_message_reserve (session, priv, 0);
 		msg_debug_milter ("got data command");
 		/* We do not need reply as specified */
 		break;
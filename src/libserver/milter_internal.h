@@ -67,6 +67,7 @@ struct rspamd_milter_private {
 	rspamd_mempool_t *pool;
 	khash_t(milter_headers_hash_t) *headers;
 	gint cur_hdr;
+	gsize size_hint; /* SIZE= argument of MAIL command */
 	rspamd_milter_finish fin_cb;
 	rspamd_milter_error err_cb;
 	void *ud;
@@ -152,6 +153,10 @@ enum rspamd_milter_connect_proto {
 #define RSPAMD_MILTER_PROTO_VER 6
 
 #define RSPAMD_MILTER_MESSAGE_CHUNK 65536
+/* Limit for preallocation based on SIZE= declared by the MTA */
+#define RSPAMD_MILTER_MAX_PREALLOC (32 * 1024 * 1024)
+/* Headers added by MTA are not included in SIZE= */
+#define RSPAMD_MILTER_SIZE_SLACK 4096
 
 #define RSPAMD_MILTER_RCODE_REJECT "554"
 #define RSPAMD_MILTER_RCODE_TEMPFAIL "451"
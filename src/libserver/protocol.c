@@ -24,6 +24,7 @@
 #include "unix-std.h"
 #include "protocol_internal.h"
 #include "libserver/mempool_vars_internal.h"
+#include "libstat/stat_api.h"
 #include "task.h"
 #include <math.h>
 
@@ -227,281 +228,304 @@ err:
 	srch.len = sizeof (name) - 1; \
 	if (rspamd_ftok_casecmp (hn_tok, &srch) == 0)
 
-gboolean
-rspamd_protocol_handle_headers (struct rspamd_task *task,
-	struct rspamd_http_message *msg)
+/*
+ * Process a single request header (or an envelope field of the same name)
+ * taking ownership of both strings
+ */
+static void
+rspamd_protocol_handle_header (struct rspamd_task *task,
+	rspamd_fstring_t *hn, rspamd_fstring_t *hv, gboolean *has_ip)
 {
-	rspamd_fstring_t *hn, *hv;
 	rspamd_ftok_t *hn_tok, *hv_tok, srch;
-	gboolean fl, has_ip = FALSE;
-	struct rspamd_http_header *header, *h, *htmp;
+	gboolean fl;
 	struct rspamd_email_address *addr;
 
-	HASH_ITER (hh, msg->headers, header, htmp) {
-		DL_FOREACH (header, h) {
-			hn = rspamd_fstring_new_init (h->name.begin, h->name.len);
-			hv = rspamd_fstring_new_init (h->value.begin, h->value.len);
-			hn_tok = rspamd_ftok_map (hn);
-			hv_tok = rspamd_ftok_map (hv);
-
-			switch (*hn_tok->begin) {
-			case 'd':
-			case 'D':
-				IF_HEADER (DELIVER_TO_HEADER) {
-					task->deliver_to = rspamd_protocol_escape_braces (task, hv);
-					msg_debug_protocol ("read deliver-to header, value: %s",
-							task->deliver_to);
-				}
-				else {
-					msg_debug_protocol ("wrong header: %V", hn);
-				}
-				break;
-			case 'h':
-			case 'H':
-				IF_HEADER (HELO_HEADER) {
-					task->helo = rspamd_mempool_ftokdup (task->task_pool, hv_tok);
-					msg_debug_protocol ("read helo header, value: %s", task->helo);
-				}
-				IF_HEADER (HOSTNAME_HEADER) {
-					task->hostname = rspamd_mempool_ftokdup (task->task_pool,
-							hv_tok);
-					msg_debug_protocol ("read hostname header, value: %s", task->hostname);
-				}
-				break;
-			case 'f':
-			case 'F':
-				IF_HEADER (FROM_HEADER) {
-					task->from_envelope = rspamd_email_address_from_smtp (hv->str,
-							hv->len);
-					msg_debug_protocol ("read from header, value: %V", hv);
-
-					if (!task->from_envelope) {
-						msg_err_protocol ("bad from header: '%V'", hv);
-						task->flags |= RSPAMD_TASK_FLAG_BROKEN_HEADERS;
-					}
-				}
-				IF_HEADER (FILENAME_HEADER) {
-					task->msg.fpath = rspamd_mempool_ftokdup (task->task_pool,
-							hv_tok);
-					msg_debug_protocol ("read filename header, value: %s", task->msg.fpath);
-				}
-				break;
-			case 'j':
-			case 'J':
-				IF_HEADER (JSON_HEADER) {
-					msg_debug_protocol ("read json header, value: %V", hv);
-					fl = rspamd_config_parse_flag (hv->str, hv->len);
-					if (fl) {
-						task->flags |= RSPAMD_TASK_FLAG_JSON;
-					}
-					else {
-						task->flags &= ~RSPAMD_TASK_FLAG_JSON;
-					}
-				}
-				else {
-					msg_debug_protocol ("wrong header: %V", hn);
-				}
-				break;
-			case 'q':
-			case 'Q':
-				IF_HEADER (QUEUE_ID_HEADER) {
-					task->queue_id = rspamd_mempool_ftokdup (task->task_pool,
-							hv_tok);
-					msg_debug_protocol ("read queue_id header, value: %s", task->queue_id);
-				}
-				else {
-					msg_debug_protocol ("wrong header: %V", hn);
-				}
-				break;
-			case 'r':
-			case 'R':
-				IF_HEADER (RCPT_HEADER) {
-					const gchar *p, *end;
-					gsize cur_len;
-
-					p = hv->str;
-					end = p + hv->len;
+	hn_tok = rspamd_ftok_map (hn);
+	hv_tok = rspamd_ftok_map (hv);
 
-					while (p < end) {
-						cur_len = rspamd_memcspn (p, ",", end - p);
+	switch (*hn_tok->begin) {
+	case 'd':
+	case 'D':
+		IF_HEADER (DELIVER_TO_HEADER) {
+			task->deliver_to = rspamd_protocol_escape_braces (task, hv);
+			msg_debug_protocol ("read deliver-to header, value: %s",
+					task->deliver_to);
+		}
+		else {
+			msg_debug_protocol ("wrong header: %V", hn);
+		}
+		break;
+	case 'h':
+	case 'H':
+		IF_HEADER (HELO_HEADER) {
+			task->helo = rspamd_mempool_ftokdup (task->task_pool, hv_tok);
+			msg_debug_protocol ("read helo header, value: %s", task->helo);
+		}
+		IF_HEADER (HOSTNAME_HEADER) {
+			task->hostname = rspamd_mempool_ftokdup (task->task_pool,
+					hv_tok);
+			msg_debug_protocol ("read hostname header, value: %s", task->hostname);
+		}
+		break;
+	case 'f':
+	case 'F':
+		IF_HEADER (FROM_HEADER) {
+			task->from_envelope = rspamd_email_address_from_smtp (hv->str,
+					hv->len);
+			msg_debug_protocol ("read from header, value: %V", hv);
+
+			if (!task->from_envelope) {
+				msg_err_protocol ("bad from header: '%V'", hv);
+				task->flags |= RSPAMD_TASK_FLAG_BROKEN_HEADERS;
+			}
+		}
+		IF_HEADER (FILENAME_HEADER) {
+			task->msg.fpath = rspamd_mempool_ftokdup (task->task_pool,
+					hv_tok);
+			msg_debug_protocol ("read filename header, value: %s", task->msg.fpath);
+		}
+		break;
+	case 'j':
+	case 'J':
+		IF_HEADER (JSON_HEADER) {
+			msg_debug_protocol ("read json header, value: %V", hv);
+			fl = rspamd_config_parse_flag (hv->str, hv->len);
+			if (fl) {
+				task->flags |= RSPAMD_TASK_FLAG_JSON;
+			}
+			else {
+				task->flags &= ~RSPAMD_TASK_FLAG_JSON;
+			}
+		}
+		else {
+			msg_debug_protocol ("wrong header: %V", hn);
+		}
+		break;
+	case 'q':
+	case 'Q':
+		IF_HEADER (QUEUE_ID_HEADER) {
+			task->queue_id = rspamd_mempool_ftokdup (task->task_pool,
+					hv_tok);
+			msg_debug_protocol ("read queue_id header, value: %s", task->queue_id);
+		}
+		else {
+			msg_debug_protocol ("wrong header: %V", hn);
+		}
+		break;
+	case 'r':
+	case 'R':
+		IF_HEADER (RCPT_HEADER) {
+			const gchar *p, *end;
+			gsize cur_len;
 
-						if (cur_len > 0) {
-							addr = rspamd_email_address_from_smtp (p, cur_len);
+			p = hv->str;
+			end = p + hv->len;
 
-							if (addr) {
-								if (task->rcpt_envelope == NULL) {
-									task->rcpt_envelope = g_ptr_array_sized_new (
-											2);
-								}
+			while (p < end) {
+				cur_len = rspamd_memcspn (p, ",", end - p);
 
-								g_ptr_array_add (task->rcpt_envelope, addr);
-							} else {
-								msg_err_protocol ("bad rcpt header: '%T'",
-										&h->value);
-								task->flags |= RSPAMD_TASK_FLAG_BROKEN_HEADERS;
-							}
+				if (cur_len > 0) {
+					addr = rspamd_email_address_from_smtp (p, cur_len);
 
-							p += cur_len;
+					if (addr) {
+						if (task->rcpt_envelope == NULL) {
+							task->rcpt_envelope = g_ptr_array_sized_new (
+									2);
 						}
 
-						while (p < end && *p == ',') {
-							p ++;
-						}
+						g_ptr_array_add (task->rcpt_envelope, addr);
+					} else {
+						msg_err_protocol ("bad rcpt header: '%T'",
+								hv_tok);
+						task->flags |= RSPAMD_TASK_FLAG_BROKEN_HEADERS;
 					}
 
-					msg_debug_protocol ("read rcpt header, value: %V", hv);
-				}
-				else {
-					msg_debug_protocol ("wrong header: %V", hn);
-				}
-				break;
-			case 'i':
-			case 'I':
-				IF_HEADER (IP_ADDR_HEADER) {
-					if (!rspamd_parse_inet_address (&task->from_addr, hv->str, hv->len)) {
-						msg_err_protocol ("bad ip header: '%V'", hv);
-					}
-					else {
-						msg_debug_protocol ("read IP header, value: %V", hv);
-						has_ip = TRUE;
-					}
+					p += cur_len;
 				}
-				else {
-					msg_debug_protocol ("wrong header: %V", hn);
+
+				while (p < end && *p == ',') {
+					p ++;
 				}
-				break;
-			case 'p':
-			case 'P':
-				IF_HEADER (PASS_HEADER) {
-					srch.begin = "all";
-					srch.len = 3;
+			}
 
-					msg_debug_protocol ("read pass header, value: %V", hv);
+			msg_debug_protocol ("read rcpt header, value: %V", hv);
+		}
+		else {
+			msg_debug_protocol ("wrong header: %V", hn);
+		}
+		break;
+	case 'i':
+	case 'I':
+		IF_HEADER (IP_ADDR_HEADER) {
+			if (!rspamd_parse_inet_address (&task->from_addr, hv->str, hv->len)) {
+				msg_err_protocol ("bad ip header: '%V'", hv);
+			}
+			else {
+				msg_debug_protocol ("read IP header, value: %V", hv);
+				*has_ip = TRUE;
+			}
+		}
+		else {
+			msg_debug_protocol ("wrong header: %V", hn);
+		}
+		break;
+	case 'p':
+	case 'P':
+		IF_HEADER (PASS_HEADER) {
+			srch.begin = "all";
+			srch.len = 3;
 
-					if (rspamd_ftok_casecmp (hv_tok, &srch) == 0) {
-						task->flags |= RSPAMD_TASK_FLAG_PASS_ALL;
-						msg_debug_protocol ("pass all filters");
-					}
-				}
-				IF_HEADER (PROFILE_HEADER) {
-					msg_debug_protocol ("read profile header, value: %V", hv);
-					task->flags |= RSPAMD_TASK_FLAG_PROFILE;
-				}
-				break;
-			case 's':
-			case 'S':
-				IF_HEADER (SUBJECT_HEADER) {
-					msg_debug_protocol ("read subject header, value: %V", hv);
-					task->subject = rspamd_mempool_ftokdup (task->task_pool, hv_tok);
-				}
-				IF_HEADER (SETTINGS_ID_HEADER) {
-					guint64 h;
-					guint32 *hp;
-
-					msg_debug_protocol ("read settings-id header, value: %V", hv);
-					h = rspamd_cryptobox_fast_hash_specific (RSPAMD_CRYPTOBOX_XXHASH64,
-							hv_tok->begin, hv_tok->len, 0xdeadbabe);
-					hp = rspamd_mempool_alloc (task->task_pool, sizeof (*hp));
-					memcpy (hp, &h, sizeof (*hp));
-					rspamd_mempool_set_variable (task->task_pool,
-							RSPAMD_MEMPOOL_SETTINGS_HASH,
-							hp, NULL);
-				}
-				break;
-			case 'u':
-			case 'U':
-				IF_HEADER (USER_HEADER) {
-					/*
-					 * We must ignore User header in case of spamc, as SA has
-					 * different meaning of this header
-					 */
-					msg_debug_protocol ("read user header, value: %V", hv);
-					if (!RSPAMD_TASK_IS_SPAMC (task)) {
-						task->user = rspamd_mempool_ftokdup (task->task_pool,
-								hv_tok);
-					}
-					else {
-						msg_info_protocol ("ignore user header: legacy SA protocol");
-					}
-				}
-				IF_HEADER (URLS_HEADER) {
-					srch.begin = "extended";
-					srch.len = 8;
-
-					msg_debug_protocol ("read urls header, value: %V", hv);
-					if (rspamd_ftok_casecmp (hv_tok, &srch) == 0) {
-						task->flags |= RSPAMD_TASK_FLAG_EXT_URLS;
-						msg_debug_protocol ("extended urls information");
-					}
-				}
-				IF_HEADER (USER_AGENT_HEADER) {
-					msg_debug_protocol ("read user-agent header, value: %V", hv);
+			msg_debug_protocol ("read pass header, value: %V", hv);
 
-					if (hv_tok->len == 6 &&
-							rspamd_lc_cmp (hv_tok->begin, "rspamc", 6) == 0) {
-						task->flags |= RSPAMD_TASK_FLAG_LOCAL_CLIENT;
-					}
-				}
-				break;
-			case 'l':
-			case 'L':
-				IF_HEADER (NO_LOG_HEADER) {
-					msg_debug_protocol ("read log header, value: %V", hv);
-					srch.begin = "no";
-					srch.len = 2;
-
-					if (rspamd_ftok_casecmp (hv_tok, &srch) == 0) {
-						task->flags |= RSPAMD_TASK_FLAG_NO_LOG;
-					}
-				}
-				break;
-			case 'm':
-			case 'M':
-				IF_HEADER (MLEN_HEADER) {
-					msg_debug_protocol ("read message length header, value: %V", hv);
-					if (!rspamd_strtoul (hv_tok->begin,
-							hv_tok->len,
-							&task->message_len)) {
-						msg_err_protocol ("Invalid message length header: %V", hv);
-					}
-					else {
-						task->flags |= RSPAMD_TASK_FLAG_HAS_CONTROL;
-					}
-				}
-				IF_HEADER (MTA_TAG_HEADER) {
-					gchar *mta_tag;
-					mta_tag = rspamd_mempool_ftokdup (task->task_pool, hv_tok);
-					rspamd_mempool_set_variable (task->task_pool,
-							RSPAMD_MEMPOOL_MTA_TAG,
-							mta_tag, NULL);
-					msg_debug_protocol ("read MTA-Tag header, value: %s", mta_tag);
-				}
-				IF_HEADER (MTA_NAME_HEADER) {
-					gchar *mta_name;
-					mta_name = rspamd_mempool_ftokdup (task->task_pool, hv_tok);
-					rspamd_mempool_set_variable (task->task_pool,
-							RSPAMD_MEMPOOL_MTA_NAME,
-							mta_name, NULL);
-					msg_debug_protocol ("read MTA-Name header, value: %s", mta_name);
-				}
-				IF_HEADER (MILTER_HEADER) {
-					task->flags |= RSPAMD_TASK_FLAG_MILTER;
-					msg_debug_protocol ("read Milter header, value: %V", hv);
-				}
-				break;
-			case 't':
-			case 'T':
-				IF_HEADER (TLS_CIPHER_HEADER) {
-					task->flags |= RSPAMD_TASK_FLAG_SSL;
-					msg_debug_protocol ("read TLS cipher header, value: %V", hv);
-				}
-				break;
-			default:
-				msg_debug_protocol ("generic header: %V", hn);
-				break;
+			if (rspamd_ftok_casecmp (hv_tok, &srch) == 0) {
+				task->flags |= RSPAMD_TASK_FLAG_PASS_ALL;
+				msg_debug_protocol ("pass all filters");
+			}
+		}
+		IF_HEADER (PROFILE_HEADER) {
+			msg_debug_protocol ("read profile header, value: %V", hv);
+			task->flags |= RSPAMD_TASK_FLAG_PROFILE;
+		}
+		IF_HEADER (PER_RCPT_HEADER) {
+			/* Results of per user classifiers for each recipient */
+			msg_debug_protocol ("read per-rcpt header, value: %V", hv);
+
+			if (task->rcpt_results == NULL) {
+				task->rcpt_results = g_ptr_array_new ();
+				rspamd_mempool_add_destructor (task->task_pool,
+						rspamd_ptr_array_free_hard, task->rcpt_results);
 			}
+		}
+		break;
+	case 's':
+	case 'S':
+		IF_HEADER (SUBJECT_HEADER) {
+			msg_debug_protocol ("read subject header, value: %V", hv);
+			task->subject = rspamd_mempool_ftokdup (task->task_pool, hv_tok);
+		}
+		IF_HEADER (SETTINGS_ID_HEADER) {
+			guint64 h;
+			guint32 *hp;
+
+			msg_debug_protocol ("read settings-id header, value: %V", hv);
+			h = rspamd_cryptobox_fast_hash_specific (RSPAMD_CRYPTOBOX_XXHASH64,
+					hv_tok->begin, hv_tok->len, 0xdeadbabe);
+			hp = rspamd_mempool_alloc (task->task_pool, sizeof (*hp));
+			memcpy (hp, &h, sizeof (*hp));
+			rspamd_mempool_set_variable (task->task_pool,
+					RSPAMD_MEMPOOL_SETTINGS_HASH,
+					hp, NULL);
+		}
+		break;
+	case 'u':
+	case 'U':
+		IF_HEADER (USER_HEADER) {
+			/*
+			 * We must ignore User header in case of spamc, as SA has
+			 * different meaning of this header
+			 */
+			msg_debug_protocol ("read user header, value: %V", hv);
+			if (!RSPAMD_TASK_IS_SPAMC (task)) {
+				task->user = rspamd_mempool_ftokdup (task->task_pool,
+						hv_tok);
+			}
+			else {
+				msg_info_protocol ("ignore user header: legacy SA protocol");
+			}
+		}
+		IF_HEADER (URLS_HEADER) {
+			srch.begin = "extended";
+			srch.len = 8;
+
+			msg_debug_protocol ("read urls header, value: %V", hv);
+			if (rspamd_ftok_casecmp (hv_tok, &srch) == 0) {
+				task->flags |= RSPAMD_TASK_FLAG_EXT_URLS;
+				msg_debug_protocol ("extended urls information");
+			}
+		}
+		IF_HEADER (USER_AGENT_HEADER) {
+			msg_debug_protocol ("read user-agent header, value: %V", hv);
+
+			if (hv_tok->len == 6 &&
+					rspamd_lc_cmp (hv_tok->begin, "rspamc", 6) == 0) {
+				task->flags |= RSPAMD_TASK_FLAG_LOCAL_CLIENT;
+			}
+		}
+		break;
+	case 'l':
+	case 'L':
+		IF_HEADER (NO_LOG_HEADER) {
+			msg_debug_protocol ("read log header, value: %V", hv);
+			srch.begin = "no";
+			srch.len = 2;
+
+			if (rspamd_ftok_casecmp (hv_tok, &srch) == 0) {
+				task->flags |= RSPAMD_TASK_FLAG_NO_LOG;
+			}
+		}
+		break;
+	case 'm':
+	case 'M':
+		IF_HEADER (MLEN_HEADER) {
+			msg_debug_protocol ("read message length header, value: %V", hv);
+			if (!rspamd_strtoul (hv_tok->begin,
+					hv_tok->len,
+					&task->message_len)) {
+				msg_err_protocol ("Invalid message length header: %V", hv);
+			}
+			else {
+				task->flags |= RSPAMD_TASK_FLAG_HAS_CONTROL;
+			}
+		}
+		IF_HEADER (MTA_TAG_HEADER) {
+			gchar *mta_tag;
+			mta_tag = rspamd_mempool_ftokdup (task->task_pool, hv_tok);
+			rspamd_mempool_set_variable (task->task_pool,
+					RSPAMD_MEMPOOL_MTA_TAG,
+					mta_tag, NULL);
+			msg_debug_protocol ("read MTA-Tag header, value: %s", mta_tag);
+		}
+		IF_HEADER (MTA_NAME_HEADER) {
+			gchar *mta_name;
+			mta_name = rspamd_mempool_ftokdup (task->task_pool, hv_tok);
+			rspamd_mempool_set_variable (task->task_pool,
+					RSPAMD_MEMPOOL_MTA_NAME,
+					mta_name, NULL);
+			msg_debug_protocol ("read MTA-Name header, value: %s", mta_name);
+		}
+		IF_HEADER (MILTER_HEADER) {
+			task->flags |= RSPAMD_TASK_FLAG_MILTER;
+			msg_debug_protocol ("read Milter header, value: %V", hv);
+		}
+		break;
+	case 't':
+	case 'T':
+		IF_HEADER (TLS_CIPHER_HEADER) {
+			task->flags |= RSPAMD_TASK_FLAG_SSL;
+			msg_debug_protocol ("read TLS cipher header, value: %V", hv);
+		}
+		break;
+	default:
+		msg_debug_protocol ("generic header: %V", hn);
+		break;
+	}
+
+	rspamd_task_add_request_header (task, hn_tok, hv_tok);
+}
+
+gboolean
+rspamd_protocol_handle_headers (struct rspamd_task *task,
+	struct rspamd_http_message *msg)
+{
+	rspamd_fstring_t *hn, *hv;
+	gboolean has_ip = FALSE;
+	struct rspamd_http_header *header, *h, *htmp;
 
-			rspamd_task_add_request_header (task, hn_tok, hv_tok);
+	HASH_ITER (hh, msg->headers, header, htmp) {
+		DL_FOREACH (header, h) {
+			hn = rspamd_fstring_new_init (h->name.begin, h->name.len);
+			hv = rspamd_fstring_new_init (h->value.begin, h->value.len);
+			rspamd_protocol_handle_header (task, hn, hv, &has_ip);
 		}
 	}
 
@@ -648,10 +672,107 @@ rspamd_protocol_handle_request (struct rspamd_task *task,
 		task->flags &= ~RSPAMD_TASK_FLAG_JSON;
 		task->flags |= RSPAMD_TASK_FLAG_SPAMC;
 	}
+	else if (task->cmd == CMD_CHECK_V2) {
+		const rspamd_ftok_t *ctype;
+		rspamd_ftok_t srch;
+
+		ctype = rspamd_http_message_find_header (msg, "Content-Type");
+		RSPAMD_FTOK_ASSIGN (&srch, MSGPACK_CONTENT_TYPE);
+
+		if (ctype && rspamd_ftok_casecmp (ctype, &srch) == 0) {
+			msg_debug_protocol ("use msgpack for request and reply");
+			task->flags |= RSPAMD_TASK_FLAG_MSGPACK;
+		}
+	}
 
 	return ret;
 }
 
+gboolean
+rspamd_protocol_handle_msgpack (struct rspamd_task *task)
+{
+	struct ucl_parser *parser;
+	ucl_object_t *top;
+	const ucl_object_t *envelope, *message, *cur, *elt;
+	ucl_object_iter_t it = NULL, ait;
+	rspamd_fstring_t *hn, *hv;
+	const gchar *key, *val;
+	gsize vlen;
+	gboolean has_ip = FALSE;
+
+	/*
+	 * Message body is owned by the task, so all strings, including the
+	 * message itself, can point directly to the input
+	 */
+	parser = ucl_parser_new (UCL_PARSER_ZEROCOPY|UCL_PARSER_NO_TIME);
+
+	if (!ucl_parser_add_chunk_full (parser, task->msg.begin, task->msg.len,
+			0, UCL_DUPLICATE_APPEND, UCL_PARSE_MSGPACK)) {
+		g_set_error (&task->err, rspamd_protocol_quark (), RSPAMD_PROTOCOL_ERROR,
+				"cannot parse msgpack request: %s",
+				ucl_parser_get_error (parser));
+		ucl_parser_free (parser);
+
+		return FALSE;
+	}
+
+	top = ucl_parser_get_object (parser);
+	ucl_parser_free (parser);
+	message = ucl_object_lookup (top, "message");
+
+	if (message == NULL || ucl_object_type (message) != UCL_STRING) {
+		g_set_error (&task->err, rspamd_protocol_quark (), RSPAMD_PROTOCOL_ERROR,
+				"msgpack request has no message");
+		ucl_object_unref (top);
+
+		return FALSE;
+	}
+
+	envelope = ucl_object_lookup (top, "envelope");
+
+	if (envelope && ucl_object_type (envelope) == UCL_OBJECT) {
+		/* Envelope fields have the same meaning as HTTP headers */
+		while ((cur = ucl_object_iterate (envelope, &it, true)) != NULL) {
+			key = ucl_object_key (cur);
+			ait = NULL;
+
+			if (key == NULL || cur->keylen == 0) {
+				continue;
+			}
+
+			while ((elt = ucl_object_iterate (cur, &ait, true)) != NULL) {
+				if (ucl_object_type (elt) == UCL_STRING) {
+					ucl_object_tolstring_safe (elt, &val, &vlen);
+				}
+				else {
+					val = ucl_object_tostring_forced (elt);
+					vlen = val ? strlen (val) : 0;
+				}
+
+				if (val == NULL) {
+					continue;
+				}
+
+				hn = rspamd_fstring_new_init (key, cur->keylen);
+				hv = rspamd_fstring_new_init (val, vlen);
+				rspamd_protocol_handle_header (task, hn, hv, &has_ip);
+			}
+		}
+	}
+
+	if (has_ip) {
+		task->flags &= ~RSPAMD_TASK_FLAG_NO_IP;
+	}
+
+	task->msg.begin = message->value.sv;
+	task->msg.len = message->len;
+	msg_debug_protocol ("loaded msgpack request: %z bytes of message",
+			task->msg.len);
+	ucl_object_unref (top);
+
+	return TRUE;
+}
+
 /* Structure for writing tree data */
 struct tree_cb_data {
 	ucl_object_t *top;
@@ -695,6 +816,32 @@ rspamd_protocol_extended_url (struct rspamd_task *task,
 	return obj;
 }
 
+static void
+rspamd_protocol_log_url (struct rspamd_task *task,
+		const gchar *encoded, gsize enclen)
+{
+	const gchar *user_field = "unknown";
+	gboolean has_user = FALSE;
+	guint len = 0;
+
+	if (task->user) {
+		user_field = task->user;
+		len = strlen (task->user);
+		has_user = TRUE;
+	}
+	else if (task->from_envelope) {
+		user_field = task->from_envelope->addr;
+		len = task->from_envelope->addr_len;
+	}
+
+	msg_notice_task_encrypted ("<%s> %s: %*s; ip: %s; URL: %*s",
+		task->message_id,
+		has_user ? "user" : "from",
+		len, user_field,
+		rspamd_inet_address_to_string (task->from_addr),
+		(gint)enclen, encoded);
+}
+
 /*
  * Callback for writing urls
  */
@@ -705,9 +852,7 @@ urls_protocol_cb (gpointer key, gpointer value, gpointer ud)
 	struct rspamd_url *url = value;
 	ucl_object_t *obj;
 	struct rspamd_task *task = cb->task;
-	const gchar *user_field = "unknown", *encoded;
-	gboolean has_user = FALSE;
-	guint len = 0;
+	const gchar *encoded;
 	gsize enclen;
 
 	encoded = rspamd_url_encode (url, &enclen, task->task_pool);
@@ -722,22 +867,7 @@ urls_protocol_cb (gpointer key, gpointer value, gpointer ud)
 	ucl_array_append (cb->top, obj);
 
 	if (cb->task->cfg->log_urls) {
-		if (task->user) {
-			user_field = task->user;
-			len = strlen (task->user);
-			has_user = TRUE;
-		}
-		else if (task->from_envelope) {
-			user_field = task->from_envelope->addr;
-			len = task->from_envelope->addr_len;
-		}
-
-		msg_notice_task_encrypted ("<%s> %s: %*s; ip: %s; URL: %*s",
-			task->message_id,
-			has_user ? "user" : "from",
-			len, user_field,
-			rspamd_inet_address_to_string (task->from_addr),
-			(gint)enclen, encoded);
+		rspamd_protocol_log_url (task, encoded, enclen);
 	}
 }
 
@@ -981,6 +1111,59 @@ rspamd_metric_result_ucl (struct rspamd_task *task,
 	return obj;
 }
 
+/*
+ * Recipients results: task score where per user classifiers symbols are
+ * replaced with the recipient ones, action for that score and these symbols
+ */
+static ucl_object_t *
+rspamd_protocol_rcpt_results_ucl (struct rspamd_task *task)
+{
+	struct rspamd_task_rcpt_result *rr;
+	struct rspamd_metric_result mres;
+	struct rspamd_symbol_result *sym;
+	enum rspamd_action_type action;
+	ucl_object_t *top, *obj, *sobj;
+	guint i;
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+
+	PTR_ARRAY_FOREACH (task->rcpt_results, i, rr) {
+		obj = ucl_object_typed_new (UCL_OBJECT);
+		memcpy (&mres, task->result, sizeof (mres));
+		mres.score = rspamd_stat_rcpt_score (task, rr);
+		action = rspamd_check_action_metric (task, &mres);
+
+		ucl_object_insert_key (obj,
+				ucl_object_frombool (action < METRIC_ACTION_GREYLIST),
+				"is_spam", 0, false);
+		ucl_object_insert_key (obj,
+				ucl_object_fromdouble (isnan (mres.score) ? 0.0 : mres.score),
+				"score", 0, false);
+		ucl_object_insert_key (obj,
+				ucl_object_fromdouble (rspamd_task_get_required_score (task,
+						&mres)),
+				"required_score", 0, false);
+		ucl_object_insert_key (obj,
+				ucl_object_fromstring (rspamd_action_to_str (action)),
+				"action", 0, false);
+
+		if (rr->result) {
+			sobj = ucl_object_typed_new (UCL_OBJECT);
+
+			kh_foreach_value_ptr (rr->result->symbols, sym, {
+				ucl_object_insert_key (sobj, rspamd_metric_symbol_ucl (task, sym),
+						sym->name, 0, false);
+			});
+
+			ucl_object_insert_key (obj, sobj, "symbols", 0, false);
+		}
+
+		ucl_object_insert_key (top, obj, rr->rcpt, 0, false);
+	}
+
+	return top;
+}
+
 void
 rspamd_ucl_torspamc_output (const ucl_object_t *top,
 	rspamd_fstring_t **out)
@@ -1121,7 +1304,12 @@ rspamd_protocol_write_ucl (struct rspamd_task *task,
 
 	if (flags & RSPAMD_PROTOCOL_METRICS) {
 		rspamd_metric_result_ucl (task, task->result, top);
-	}
+
+		if (task->rcpt_results && task->rcpt_results->len > 0) {
+			ucl_object_insert_key (top, rspamd_protocol_rcpt_results_ucl (task),
+					"recipients", 0, false);
+		}
+	}
 
 	if (flags & RSPAMD_PROTOCOL_MESSAGES) {
 		if (G_UNLIKELY (task->cfg->compat_messages)) {
@@ -1232,6 +1420,501 @@ rspamd_protocol_write_ucl (struct rspamd_task *task,
 	return top;
 }
 
+/*
+ * Direct JSON writer: produces the same output as emitting the tree from
+ * rspamd_protocol_write_ucl with UCL_EMIT_JSON_COMPACT, but serialises task
+ * results straight into the reply buffer without creating ucl objects
+ */
+static void
+rspamd_protocol_json_string (rspamd_fstring_t **out,
+		const gchar *str, gsize len)
+{
+	const gchar *p = str, *c = str, *end = str + len;
+	const gchar *esc;
+	gsize esclen;
+
+	*out = rspamd_fstring_append (*out, "\"", 1);
+
+	while (p < end) {
+		switch (*p) {
+		case '\n':
+			esc = "\\n";
+			break;
+		case '\r':
+			esc = "\\r";
+			break;
+		case '\b':
+			esc = "\\b";
+			break;
+		case '\t':
+			esc = "\\t";
+			break;
+		case '\f':
+			esc = "\\f";
+			break;
+		case '\v':
+			esc = "\\u000B";
+			break;
+		case '\\':
+			esc = "\\\\";
+			break;
+		case '"':
+			esc = "\\\"";
+			break;
+		default:
+			if ((guchar)*p < 0x20 || *p == 0x7f) {
+				/* Same as ucl: emit unicode unknown character */
+				esc = "\\uFFFD";
+			}
+			else {
+				esc = NULL;
+			}
+			break;
+		}
+
+		if (esc) {
+			esclen = strlen (esc);
+
+			if (p > c) {
+				*out = rspamd_fstring_append (*out, c, p - c);
+			}
+
+			*out = rspamd_fstring_append (*out, esc, esclen);
+			c = p + 1;
+		}
+
+		p ++;
+	}
+
+	if (p > c) {
+		*out = rspamd_fstring_append (*out, c, p - c);
+	}
+
+	*out = rspamd_fstring_append (*out, "\"", 1);
+}
+
+static inline void
+rspamd_protocol_json_cstring (rspamd_fstring_t **out, const gchar *str)
+{
+	rspamd_protocol_json_string (out, str, strlen (str));
+}
+
+static void
+rspamd_protocol_json_key (rspamd_fstring_t **out, const gchar *key,
+		gboolean *first)
+{
+	if (!*first) {
+		*out = rspamd_fstring_append (*out, ",", 1);
+	}
+
+	*first = FALSE;
+	rspamd_protocol_json_cstring (out, key);
+	*out = rspamd_fstring_append (*out, ":", 1);
+}
+
+static void
+rspamd_protocol_json_double (rspamd_fstring_t **out, gdouble val)
+{
+	/* Must match rspamd_fstring_emit_append_double */
+	if (isfinite (val)) {
+		if (val == (gdouble) ((gint) val)) {
+			rspamd_printf_fstring (out, "%.1f", val);
+		}
+		else {
+			rspamd_printf_fstring (out, "%.6f", val);
+		}
+	}
+	else {
+		*out = rspamd_fstring_append (*out, "null", 4);
+	}
+}
+
+static inline void
+rspamd_protocol_json_bool (rspamd_fstring_t **out, gboolean val)
+{
+	if (val) {
+		*out = rspamd_fstring_append (*out, "true", 4);
+	}
+	else {
+		*out = rspamd_fstring_append (*out, "false", 5);
+	}
+}
+
+static void
+rspamd_protocol_json_extended_url (struct rspamd_task *task,
+		struct rspamd_url *url,
+		const gchar *encoded, gsize enclen,
+		rspamd_fstring_t **out)
+{
+	gboolean first = TRUE;
+
+	*out = rspamd_fstring_append (*out, "{", 1);
+	rspamd_protocol_json_key (out, "url", &first);
+	rspamd_protocol_json_string (out, encoded, enclen);
+
+	if (url->surbllen > 0) {
+		rspamd_protocol_json_key (out, "surbl", &first);
+		rspamd_protocol_json_string (out, url->surbl, url->surbllen);
+	}
+	if (url->hostlen > 0) {
+		rspamd_protocol_json_key (out, "host", &first);
+		rspamd_protocol_json_string (out, url->host, url->hostlen);
+	}
+
+	rspamd_protocol_json_key (out, "phished", &first);
+	rspamd_protocol_json_bool (out, url->flags & RSPAMD_URL_FLAG_PHISHED);
+	rspamd_protocol_json_key (out, "redirected", &first);
+	rspamd_protocol_json_bool (out, url->flags & RSPAMD_URL_FLAG_REDIRECTED);
+
+	if (url->phished_url) {
+		encoded = rspamd_url_encode (url->phished_url, &enclen, task->task_pool);
+		rspamd_protocol_json_key (out, "orig_url", &first);
+		rspamd_protocol_json_extended_url (task, url->phished_url, encoded,
+				enclen, out);
+	}
+
+	*out = rspamd_fstring_append (*out, "}", 1);
+}
+
+static void
+rspamd_protocol_json_urls (struct rspamd_task *task, rspamd_fstring_t **out)
+{
+	GHashTableIter it;
+	gpointer k, v;
+	struct rspamd_url *url;
+	const gchar *encoded;
+	gsize enclen;
+	gboolean first = TRUE;
+
+	*out = rspamd_fstring_append (*out, "[", 1);
+	g_hash_table_iter_init (&it, task->urls);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		url = v;
+		encoded = rspamd_url_encode (url, &enclen, task->task_pool);
+
+		if (!first) {
+			*out = rspamd_fstring_append (*out, ",", 1);
+		}
+
+		first = FALSE;
+
+		if (!(task->flags & RSPAMD_TASK_FLAG_EXT_URLS)) {
+			rspamd_protocol_json_string (out, encoded, enclen);
+		}
+		else {
+			rspamd_protocol_json_extended_url (task, url, encoded, enclen, out);
+		}
+
+		if (task->cfg->log_urls) {
+			rspamd_protocol_log_url (task, encoded, enclen);
+		}
+	}
+
+	*out = rspamd_fstring_append (*out, "]", 1);
+}
+
+static void
+rspamd_protocol_json_emails (struct rspamd_task *task, rspamd_fstring_t **out)
+{
+	GHashTableIter it;
+	gpointer k, v;
+	struct rspamd_url *url;
+	gboolean first = TRUE;
+
+	*out = rspamd_fstring_append (*out, "[", 1);
+	g_hash_table_iter_init (&it, task->emails);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		url = v;
+
+		if (url->userlen > 0 && url->hostlen > 0 &&
+				url->host == url->user + url->userlen + 1) {
+			if (!first) {
+				*out = rspamd_fstring_append (*out, ",", 1);
+			}
+
+			first = FALSE;
+			rspamd_protocol_json_string (out, url->user,
+					url->userlen + url->hostlen + 1);
+		}
+	}
+
+	*out = rspamd_fstring_append (*out, "]", 1);
+}
+
+static void
+rspamd_protocol_json_symbol (struct rspamd_task *task,
+		struct rspamd_symbol_result *sym, rspamd_fstring_t **out)
+{
+	struct rspamd_symbol_option *opt;
+	gboolean first = TRUE;
+
+	*out = rspamd_fstring_append (*out, "{", 1);
+	rspamd_protocol_json_key (out, "name", &first);
+	rspamd_protocol_json_cstring (out, sym->name);
+	rspamd_protocol_json_key (out, "score", &first);
+	rspamd_protocol_json_double (out, sym->score);
+
+	if (task->cmd == CMD_CHECK_V2) {
+		rspamd_protocol_json_key (out, "metric_score", &first);
+		rspamd_protocol_json_double (out, sym->sym ? sym->sym->score : 0.0);
+	}
+
+	if (sym->sym != NULL && sym->sym->description) {
+		rspamd_protocol_json_key (out, "description", &first);
+		rspamd_protocol_json_cstring (out, sym->sym->description);
+	}
+
+	if (sym->options != NULL) {
+		gboolean first_opt = TRUE;
+
+		rspamd_protocol_json_key (out, "options", &first);
+		*out = rspamd_fstring_append (*out, "[", 1);
+
+		DL_FOREACH (sym->opts_head, opt) {
+			if (!first_opt) {
+				*out = rspamd_fstring_append (*out, ",", 1);
+			}
+
+			first_opt = FALSE;
+			rspamd_protocol_json_cstring (out, opt->option);
+		}
+
+		*out = rspamd_fstring_append (*out, "]", 1);
+	}
+
+	*out = rspamd_fstring_append (*out, "}", 1);
+}
+
+static void
+rspamd_protocol_json_metric_result (struct rspamd_task *task,
+		struct rspamd_metric_result *mres, rspamd_fstring_t **out,
+		gboolean *first)
+{
+	struct rspamd_symbol_result *sym;
+	enum rspamd_action_type action;
+	const gchar *subject;
+	gboolean mfirst = TRUE, *pfirst;
+
+	action = rspamd_check_action_metric (task, mres);
+
+	if (task->cmd != CMD_CHECK_V2) {
+		rspamd_protocol_json_key (out, DEFAULT_METRIC, first);
+		*out = rspamd_fstring_append (*out, "{", 1);
+		pfirst = &mfirst;
+		rspamd_protocol_json_key (out, "is_spam", pfirst);
+		rspamd_protocol_json_bool (out, action < METRIC_ACTION_GREYLIST);
+	}
+	else {
+		pfirst = first;
+	}
+
+	rspamd_protocol_json_key (out, "is_skipped", pfirst);
+	rspamd_protocol_json_bool (out, RSPAMD_TASK_IS_SKIPPED (task));
+	rspamd_protocol_json_key (out, "score", pfirst);
+	rspamd_protocol_json_double (out, !isnan (mres->score) ? mres->score : 0.0);
+	rspamd_protocol_json_key (out, "required_score", pfirst);
+	rspamd_protocol_json_double (out,
+			rspamd_task_get_required_score (task, mres));
+	rspamd_protocol_json_key (out, "action", pfirst);
+	rspamd_protocol_json_cstring (out, rspamd_action_to_str (action));
+
+	if (action == METRIC_ACTION_REWRITE_SUBJECT) {
+		subject = rspamd_protocol_rewrite_subject (task);
+
+		if (subject) {
+			rspamd_protocol_json_key (out, "subject", pfirst);
+			rspamd_protocol_json_cstring (out, subject);
+		}
+	}
+
+	/* Now handle symbols */
+	if (task->cmd == CMD_CHECK_V2) {
+		rspamd_protocol_json_key (out, "symbols", first);
+		*out = rspamd_fstring_append (*out, "{", 1);
+		pfirst = &mfirst;
+	}
+
+	kh_foreach_value_ptr (mres->symbols, sym, {
+		if (!(sym->flags & RSPAMD_SYMBOL_RESULT_IGNORED)) {
+			rspamd_protocol_json_key (out, sym->name, pfirst);
+			rspamd_protocol_json_symbol (task, sym, out);
+		}
+	});
+
+	*out = rspamd_fstring_append (*out, "}", 1);
+}
+
+static void
+rspamd_protocol_json_profiling (struct rspamd_task *task,
+		rspamd_fstring_t **out, gboolean *first)
+{
+	GHashTable *tbl;
+	GHashTableIter it;
+	gpointer k, v;
+	gboolean pfirst = TRUE;
+
+	rspamd_protocol_json_key (out, "profile", first);
+	*out = rspamd_fstring_append (*out, "{", 1);
+	tbl = rspamd_mempool_get_variable (task->task_pool, "profile");
+
+	if (tbl) {
+		g_hash_table_iter_init (&it, tbl);
+
+		while (g_hash_table_iter_next (&it, &k, &v)) {
+			rspamd_protocol_json_key (out, (const gchar *)k, &pfirst);
+			rspamd_protocol_json_double (out, *(gdouble *)v);
+		}
+	}
+
+	*out = rspamd_fstring_append (*out, "}", 1);
+}
+
+void
+rspamd_protocol_write_json (struct rspamd_task *task,
+		enum rspamd_protocol_flags flags, rspamd_fstring_t **out)
+{
+	GString *dkim_sig;
+	const ucl_object_t *milter_reply;
+	gboolean first = TRUE;
+
+	rspamd_task_set_finish_time (task);
+	*out = rspamd_fstring_append (*out, "{", 1);
+
+	if (flags & RSPAMD_PROTOCOL_METRICS) {
+		rspamd_protocol_json_metric_result (task, task->result, out, &first);
+
+		if (task->rcpt_results && task->rcpt_results->len > 0) {
+			ucl_object_t *rcpts = rspamd_protocol_rcpt_results_ucl (task);
+
+			rspamd_protocol_json_key (out, "recipients", &first);
+			rspamd_ucl_emit_fstring (rcpts, UCL_EMIT_JSON_COMPACT, out);
+			ucl_object_unref (rcpts);
+		}
+	}
+
+	if (flags & RSPAMD_PROTOCOL_MESSAGES) {
+		rspamd_protocol_json_key (out, "messages", &first);
+
+		if (G_UNLIKELY (task->cfg->compat_messages)) {
+			const ucl_object_t *cur;
+			ucl_object_iter_t iter = NULL;
+			gboolean mfirst = TRUE;
+
+			*out = rspamd_fstring_append (*out, "[", 1);
+
+			while ((cur = ucl_object_iterate (task->messages, &iter, true)) != NULL) {
+				if (cur->type == UCL_STRING) {
+					const gchar *str;
+					gsize slen;
+
+					if (!mfirst) {
+						*out = rspamd_fstring_append (*out, ",", 1);
+					}
+
+					mfirst = FALSE;
+					str = ucl_object_tolstring (cur, &slen);
+					rspamd_protocol_json_string (out, str, slen);
+				}
+			}
+
+			*out = rspamd_fstring_append (*out, "]", 1);
+		}
+		else {
+			rspamd_ucl_emit_fstring (task->messages, UCL_EMIT_JSON_COMPACT, out);
+		}
+	}
+
+	if (flags & RSPAMD_PROTOCOL_URLS) {
+		if (task->cfg->log_urls || (task->flags & RSPAMD_TASK_FLAG_EXT_URLS)) {
+			if (g_hash_table_size (task->urls) > 0) {
+				rspamd_protocol_json_key (out, "urls", &first);
+				rspamd_protocol_json_urls (task, out);
+			}
+			if (g_hash_table_size (task->emails) > 0) {
+				rspamd_protocol_json_key (out, "emails", &first);
+				rspamd_protocol_json_emails (task, out);
+			}
+		}
+	}
+
+	if (flags & RSPAMD_PROTOCOL_EXTRA) {
+		if (G_UNLIKELY (RSPAMD_TASK_IS_PROFILING (task))) {
+			rspamd_protocol_json_profiling (task, out, &first);
+		}
+	}
+
+	if (flags & RSPAMD_PROTOCOL_BASIC) {
+		rspamd_protocol_json_key (out, "message-id", &first);
+		rspamd_protocol_json_cstring (out, task->message_id);
+		rspamd_protocol_json_key (out, "time_real", &first);
+		rspamd_protocol_json_double (out,
+				task->time_real_finish - task->time_real);
+		rspamd_protocol_json_key (out, "time_virtual", &first);
+		rspamd_protocol_json_double (out,
+				task->time_virtual_finish - task->time_virtual);
+	}
+
+	if (flags & RSPAMD_PROTOCOL_DKIM) {
+		dkim_sig = rspamd_mempool_get_variable (task->task_pool,
+				RSPAMD_MEMPOOL_DKIM_SIGNATURE);
+
+		if (dkim_sig) {
+			GString *folded_header;
+
+			/* See rspamd_protocol_write_ucl for folding rules */
+			if (task->flags & RSPAMD_TASK_FLAG_MILTER) {
+				folded_header = rspamd_header_value_fold ("DKIM-Signature",
+						dkim_sig->str, 80, RSPAMD_TASK_NEWLINES_LF, NULL);
+			}
+			else {
+				folded_header = rspamd_header_value_fold ("DKIM-Signature",
+						dkim_sig->str, 80, task->nlines_type, NULL);
+			}
+
+			rspamd_protocol_json_key (out, "dkim-signature", &first);
+			rspamd_protocol_json_string (out, folded_header->str,
+					folded_header->len);
+			g_string_free (folded_header, TRUE);
+		}
+	}
+
+	if (flags & RSPAMD_PROTOCOL_RMILTER) {
+		milter_reply = rspamd_mempool_get_variable (task->task_pool,
+				RSPAMD_MEMPOOL_MILTER_REPLY);
+
+		if (milter_reply) {
+			rspamd_protocol_json_key (out,
+					task->cmd == CMD_CHECK_V2 ? "milter" : "rmilter", &first);
+			rspamd_ucl_emit_fstring (milter_reply, UCL_EMIT_JSON_COMPACT, out);
+		}
+	}
+
+	*out = rspamd_fstring_append (*out, "}", 1);
+}
+
+/*
+ * Estimate reply length to avoid reallocations while writing it
+ */
+static gsize
+rspamd_protocol_reply_size_hint (struct rspamd_task *task,
+		enum rspamd_protocol_flags flags)
+{
+	gsize hint = 1000;
+
+	if (task->result) {
+		hint += kh_size (task->result->symbols) * 96;
+	}
+
+	if (flags & RSPAMD_PROTOCOL_URLS) {
+		hint += g_hash_table_size (task->urls) * 128 +
+				g_hash_table_size (task->emails) * 48;
+	}
+
+	return hint;
+}
+
 void
 rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 		struct rspamd_task *task, ucl_object_t **pobj)
@@ -1241,7 +1924,7 @@ rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 	const struct rspamd_re_cache_stat *restat;
 	gpointer h, v;
 	ucl_object_t *top = NULL;
-	rspamd_fstring_t *reply;
+	rspamd_fstring_t *reply = NULL;
 	gint action, flags = RSPAMD_PROTOCOL_DEFAULT;
 
 	/* Write custom headers */
@@ -1256,10 +1939,19 @@ rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 		flags |= RSPAMD_PROTOCOL_URLS;
 	}
 
-	top = rspamd_protocol_write_ucl (task, flags);
+	if (msg->method < HTTP_SYMBOLS && !RSPAMD_TASK_IS_SPAMC (task) &&
+			!RSPAMD_TASK_IS_MSGPACK (task) && pobj == NULL) {
+		/* Nobody needs the tree, so serialise results directly */
+		reply = rspamd_fstring_sized_new (
+				rspamd_protocol_reply_size_hint (task, flags));
+		rspamd_protocol_write_json (task, flags, &reply);
+	}
+	else {
+		top = rspamd_protocol_write_ucl (task, flags);
 
-	if (pobj) {
-		*pobj = top;
+		if (pobj) {
+			*pobj = top;
+		}
 	}
 
 	if (!(task->flags & RSPAMD_TASK_FLAG_NO_LOG)) {
@@ -1273,27 +1965,36 @@ rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 		g_assert (restat != NULL);
 		msg_notice_task (
 				"regexp statistics: %ud pcre regexps scanned, %ud regexps matched,"
-				" %ud regexps total, %ud regexps cached,"
+				" %ud regexps total, %ud regexps cached, %ud inputs reused,"
+				" %ud regexps deferred,"
 				" %HL bytes scanned using pcre, %HL bytes scanned total",
 				restat->regexp_checked,
 				restat->regexp_matched,
 				restat->regexp_total,
 				restat->regexp_fast_cached,
+				restat->inputs_reused,
+				restat->regexp_deferred,
 				restat->bytes_scanned_pcre,
 				restat->bytes_scanned);
 	}
 
-	reply = rspamd_fstring_sized_new (1000);
+	if (top != NULL) {
+		reply = rspamd_fstring_sized_new (
+				rspamd_protocol_reply_size_hint (task, flags));
 
-	if (msg->method < HTTP_SYMBOLS && !RSPAMD_TASK_IS_SPAMC (task)) {
-		rspamd_ucl_emit_fstring (top, UCL_EMIT_JSON_COMPACT, &reply);
-	}
-	else {
-		if (RSPAMD_TASK_IS_SPAMC (task)) {
-			rspamd_ucl_tospamc_output (top, &reply);
+		if (RSPAMD_TASK_IS_MSGPACK (task)) {
+			rspamd_ucl_emit_fstring (top, UCL_EMIT_MSGPACK, &reply);
+		}
+		else if (msg->method < HTTP_SYMBOLS && !RSPAMD_TASK_IS_SPAMC (task)) {
+			rspamd_ucl_emit_fstring (top, UCL_EMIT_JSON_COMPACT, &reply);
 		}
 		else {
-			rspamd_ucl_torspamc_output (top, &reply);
+			if (RSPAMD_TASK_IS_SPAMC (task)) {
+				rspamd_ucl_tospamc_output (top, &reply);
+			}
+			else {
+				rspamd_ucl_torspamc_output (top, &reply);
+			}
 		}
 	}
 
@@ -1374,11 +2075,23 @@ end:
 			}
 
 			if (action < METRIC_ACTION_MAX) {
+				guint64 scan_time = 0;
+
+				rspamd_task_set_finish_time (task);
+
+				if (isfinite (task->time_real_finish) &&
+						task->time_real_finish > task->time_real) {
+					scan_time = (task->time_real_finish - task->time_real) * 1e6;
+				}
+
 #ifndef HAVE_ATOMIC_BUILTINS
 				task->worker->srv->stat->actions_stat[action]++;
+				task->worker->srv->stat->actions_time[action] += scan_time;
 #else
 				__atomic_add_fetch (&task->worker->srv->stat->actions_stat[action],
 						1, __ATOMIC_RELEASE);
+				__atomic_add_fetch (&task->worker->srv->stat->actions_time[action],
+						scan_time, __ATOMIC_RELEASE);
 #endif
 			}
 		}
@@ -1665,6 +2378,10 @@ rspamd_protocol_write_reply (struct rspamd_task *task)
 		case CMD_CHECK_V2:
 			rspamd_protocol_http_reply (msg, task, NULL);
 			rspamd_protocol_write_log_pipe (task);
+
+			if (RSPAMD_TASK_IS_MSGPACK (task)) {
+				ctype = MSGPACK_CONTENT_TYPE;
+			}
 			break;
 		case CMD_PING:
 			rspamd_http_message_set_body (msg, "pong" CRLF, 6);
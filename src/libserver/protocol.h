@@ -51,6 +51,14 @@ gboolean rspamd_protocol_handle_headers (struct rspamd_task *task,
 gboolean rspamd_protocol_handle_control (struct rspamd_task *task,
 		const ucl_object_t *control);
 
+/**
+ * Decode msgpack request body: process envelope fields as request headers
+ * and point task message to the embedded message
+ * @param task
+ * @return FALSE and sets task->err if request is malformed
+ */
+gboolean rspamd_protocol_handle_msgpack (struct rspamd_task *task);
+
 /**
  * Process HTTP request to the task structure
  * @param task
@@ -98,6 +106,17 @@ enum rspamd_protocol_flags {
 ucl_object_t * rspamd_protocol_write_ucl (struct rspamd_task *task,
 		enum rspamd_protocol_flags flags);
 
+/**
+ * Serialise reply as compact JSON directly to the output buffer, without
+ * building an intermediate ucl object (output is the same as emitting
+ * the result of `rspamd_protocol_write_ucl`)
+ * @param task
+ * @param flags
+ * @param out output buffer, reply is appended to it
+ */
+void rspamd_protocol_write_json (struct rspamd_task *task,
+		enum rspamd_protocol_flags flags, rspamd_fstring_t **out);
+
 /**
  * Write reply for specified task command
  * @param task task object
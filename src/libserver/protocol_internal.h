@@ -76,6 +76,7 @@
 #define USER_AGENT_HEADER "User-Agent"
 #define MTA_TAG_HEADER "MTA-Tag"
 #define PROFILE_HEADER "Profile"
+#define PER_RCPT_HEADER "Per-Rcpt"
 #define TLS_CIPHER_HEADER "TLS-Cipher"
 #define TLS_VERSION_HEADER "TLS-Version"
 #define MTA_NAME_HEADER "MTA-Name"
@@ -83,5 +84,10 @@
 #define FILENAME_HEADER "Filename"
 #define CERT_ISSUER_HEADER "TLS-Cert-Issuer"
 #define MAILER_HEADER "Mailer"
+/*
+ * Binary request/reply format for checkv2: msgpack map with `envelope` and
+ * `message` keys in request and the same reply object as JSON
+ */
+#define MSGPACK_CONTENT_TYPE "application/msgpack"
 
 #endif //RSPAMD_PROTOCOL_INTERNAL_H
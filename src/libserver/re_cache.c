@@ -70,7 +70,19 @@ INIT_LOG_MODULE(re_cache)
 #ifdef WITH_HYPERSCAN
 #define RSPAMD_HS_MAGIC_LEN (sizeof (rspamd_hs_magic))
 static const guchar rspamd_hs_magic[] = {'r', 's', 'h', 's', 'r', 'e', '1', '1'},
-		rspamd_hs_magic_vector[] = {'r', 's', 'h', 's', 'r', 'v', '1', '1'};
+		rspamd_hs_magic_vector[] = {'r', 's', 'h', 's', 'r', 'v', '1', '1'},
+		rspamd_hs_map_magic[] = {'r', 's', 'h', 's', 'm', 'a', 'p', '1'};
+
+/*
+ * Header of the deserialized database images that are mapped by all workers,
+ * database itself starts at the offset of the header's size
+ */
+struct rspamd_hs_map_header {
+	guchar magic[8];
+	guint64 crc;
+	guint64 db_len;
+	guchar unused[40];
+};
 #endif
 
 
@@ -79,6 +91,7 @@ struct rspamd_re_class {
 	enum rspamd_re_type type;
 	gpointer type_data;
 	gsize type_len;
+	guint64 header_hash; /* Hash of header's name for header classes */
 	GHashTable *re;
 	gchar hash[rspamd_cryptobox_HASHBYTES + 1];
 	rspamd_cryptobox_hash_state_t *st;
@@ -87,6 +100,9 @@ struct rspamd_re_class {
 	hs_scratch_t *hs_scratch;
 	gint *hs_ids;
 	guint nhs;
+	/* Set if hs_db points to a shared database image */
+	gpointer hs_map;
+	gsize hs_map_len;
 #endif
 };
 
@@ -96,9 +112,21 @@ enum rspamd_re_cache_elt_match_type {
 	RSPAMD_RE_CACHE_HYPERSCAN_PRE
 };
 
+/* Pcre execution cost of a regexp, shared between all workers */
+struct rspamd_re_cache_elt_stat {
+	guint calls;
+	guint samples;
+	gint deferred;
+	gdouble total_ticks;
+	gdouble max_ticks;
+};
+
 struct rspamd_re_cache_elt {
 	rspamd_regexp_t *re;
 	enum rspamd_re_cache_elt_match_type match_type;
+	struct rspamd_re_cache_elt_stat *st;
+	/* The same pattern is registered for several classes */
+	gboolean multiclass;
 };
 
 KHASH_INIT (lua_selectors_hash, gchar *, int, 1, kh_str_hash_func, kh_str_hash_equal);
@@ -111,12 +139,15 @@ struct rspamd_re_cache {
 	ref_entry_t ref;
 	guint nre;
 	guint max_re_data;
+	gdouble max_pcre_ticks;
+	struct rspamd_re_cache_elt_stat *stats;
 	gchar hash[rspamd_cryptobox_HASHBYTES + 1];
 	lua_State *L;
 #ifdef WITH_HYPERSCAN
 	gboolean hyperscan_loaded;
 	gboolean disable_hyperscan;
 	gboolean vectorized_hyperscan;
+	gboolean shared_hyperscan;
 	hs_platform_info_t plt;
 #endif
 };
@@ -130,10 +161,37 @@ struct rspamd_re_selector_result {
 KHASH_INIT (selectors_results_hash, int, struct rspamd_re_selector_result, 1,
 		kh_int_hash_func, kh_int_hash_equal);
 
+/* Input vectors of a single class extracted from a task */
+struct rspamd_re_class_input {
+	const guchar **scvec;
+	guint *lenvec;
+	guint cnt;
+	gboolean raw;
+	gboolean owned;
+};
+
+KHASH_INIT (re_class_inputs_hash, guint64, struct rspamd_re_class_input, 1,
+		kh_int64_hash_func, kh_int64_hash_equal);
+
+/* Inputs starting from the last bit are tracked all together */
+#define PREFILTER_INPUT_BIT(idx) (1ULL << MIN ((idx), 63))
+
+#ifdef WITH_HYPERSCAN
+KHASH_INIT (re_prefilter_inputs_hash, gint, guint64, 1,
+		kh_int_hash_func, kh_int_hash_equal);
+#endif
+
 struct rspamd_re_runtime {
 	guchar *checked;
 	guchar *results;
+	/* Regexps matched by hyperscan prefilter but not yet confirmed by pcre */
+	guchar *prefiltered;
 	khash_t (selectors_results_hash) *sel_cache;
+	khash_t (re_class_inputs_hash) *inputs_cache;
+#ifdef WITH_HYPERSCAN
+	/* Masks of inputs where prefiltered regexps have been found */
+	khash_t (re_prefilter_inputs_hash) *prefilter_inputs;
+#endif
 	struct rspamd_re_cache *cache;
 	struct rspamd_re_cache_stat stat;
 	gboolean has_hs;
@@ -184,7 +242,10 @@ rspamd_re_cache_destroy (struct rspamd_re_cache *cache)
 		}
 
 #ifdef WITH_HYPERSCAN
-		if (re_class->hs_db) {
+		if (re_class->hs_map) {
+			munmap (re_class->hs_map, re_class->hs_map_len);
+		}
+		else if (re_class->hs_db) {
 			hs_free_database (re_class->hs_db);
 		}
 		if (re_class->hs_scratch) {
@@ -255,9 +316,10 @@ rspamd_re_cache_add (struct rspamd_re_cache *cache, rspamd_regexp_t *re,
 		enum rspamd_re_type type, gconstpointer type_data, gsize datalen)
 {
 	guint64 class_id;
-	struct rspamd_re_class *re_class;
+	struct rspamd_re_class *re_class, *old_class;
 	rspamd_regexp_t *nre;
-	struct rspamd_re_cache_elt *elt;
+	struct rspamd_re_cache_elt *elt, *old_elt;
+	gboolean cloned = FALSE;
 
 	g_assert (cache != NULL);
 	g_assert (re != NULL);
@@ -276,6 +338,12 @@ rspamd_re_cache_add (struct rspamd_re_cache *cache, rspamd_regexp_t *re,
 		if (datalen > 0) {
 			re_class->type_data = g_malloc0 (datalen);
 			memcpy (re_class->type_data, type_data, datalen);
+
+			if (type == RSPAMD_RE_HEADER || type == RSPAMD_RE_RAWHEADER) {
+				/* Header name is hashed once instead of each lookup */
+				re_class->header_hash = rspamd_mime_header_hash (
+						re_class->type_data, strlen (re_class->type_data));
+			}
 		}
 
 		g_hash_table_insert (cache->re_classes, &re_class->id, re_class);
@@ -283,10 +351,26 @@ rspamd_re_cache_add (struct rspamd_re_cache *cache, rspamd_regexp_t *re,
 
 	if ((nre = g_hash_table_lookup (re_class->re, rspamd_regexp_get_id (re)))
 			== NULL) {
+		old_class = rspamd_regexp_get_class (re);
+
+		if (old_class != NULL && old_class != re_class) {
+			/*
+			 * Regexp object stores its class and cache id, so if the same
+			 * regexp is used for another class (e.g. the same pattern for
+			 * different headers), then it needs a separate object
+			 */
+			old_elt = g_ptr_array_index (cache->re,
+					rspamd_regexp_get_cache_id (re));
+			old_elt->multiclass = TRUE;
+			re = rspamd_regexp_clone (re);
+			cloned = TRUE;
+		}
+
 		/*
 		 * We set re id based on the global position in the cache
 		 */
 		elt = g_malloc0 (sizeof (*elt));
+		elt->multiclass = cloned;
 		/* One ref for re_class */
 		nre = rspamd_regexp_ref (re);
 		rspamd_regexp_set_cache_id (re, cache->nre++);
@@ -295,6 +379,11 @@ rspamd_re_cache_add (struct rspamd_re_cache *cache, rspamd_regexp_t *re,
 		g_ptr_array_add (cache->re, elt);
 		rspamd_regexp_set_class (re, re_class);
 		g_hash_table_insert (re_class->re, rspamd_regexp_get_id (nre), nre);
+
+		if (cloned) {
+			/* Owned by the class and the cache now */
+			rspamd_regexp_unref (re);
+		}
 	}
 
 	return nre;
@@ -368,9 +457,14 @@ rspamd_re_cache_init (struct rspamd_re_cache *cache, struct rspamd_config *cfg)
 	rspamd_cryptobox_hash_init (&st_global, NULL, 0);
 	/* Resort all regexps */
 	g_ptr_array_sort (cache->re, rspamd_re_cache_sort_func);
+	/* Allocated before fork, so the controller can see workers statistics */
+	cache->stats = rspamd_mempool_alloc0_shared (cfg->cfg_pool,
+			sizeof (*cache->stats) * MAX (cache->re->len, 1));
+	cache->max_pcre_ticks = cfg->regexp_max_ticks;
 
 	for (i = 0; i < cache->re->len; i ++) {
 		elt = g_ptr_array_index (cache->re, i);
+		elt->st = &cache->stats[i];
 		re = elt->re;
 		re_class = rspamd_regexp_get_class (re);
 		g_assert (re_class != NULL);
@@ -452,6 +546,7 @@ rspamd_re_cache_init (struct rspamd_re_cache *cache, struct rspamd_config *cfg)
 
 	cache->disable_hyperscan = cfg->disable_hyperscan;
 	cache->vectorized_hyperscan = cfg->vectorized_hyperscan;
+	cache->shared_hyperscan = cfg->shared_hyperscan;
 
 	g_assert (hs_populate_platform (&cache->plt) == HS_SUCCESS);
 
@@ -492,11 +587,12 @@ rspamd_re_cache_runtime_new (struct rspamd_re_cache *cache)
 	struct rspamd_re_runtime *rt;
 	g_assert (cache != NULL);
 
-	rt = g_malloc0 (sizeof (*rt) + NBYTES (cache->nre) + cache->nre);
+	rt = g_malloc0 (sizeof (*rt) + NBYTES (cache->nre) * 2 + cache->nre);
 	rt->cache = cache;
 	REF_RETAIN (cache);
 	rt->checked = ((guchar *)rt) + sizeof (*rt);
 	rt->results = rt->checked + NBYTES (cache->nre);
+	rt->prefiltered = rt->results + cache->nre;
 	rt->stat.regexp_total = cache->nre;
 #ifdef WITH_HYPERSCAN
 	rt->has_hs = cache->hyperscan_loaded;
@@ -513,6 +609,166 @@ rspamd_re_cache_get_stat (struct rspamd_re_runtime *rt)
 	return &rt->stat;
 }
 
+static gint
+rspamd_re_cache_cost_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct rspamd_re_cache_elt *e1 = *(const struct rspamd_re_cache_elt **)a,
+		*e2 = *(const struct rspamd_re_cache_elt **)b;
+	gdouble c1 = 0, c2 = 0;
+
+	if (e1->st && e1->st->samples > 0) {
+		c1 = e1->st->total_ticks / e1->st->samples * e1->st->calls;
+	}
+	if (e2->st && e2->st->samples > 0) {
+		c2 = e2->st->total_ticks / e2->st->samples * e2->st->calls;
+	}
+
+	if (c1 > c2) {
+		return -1;
+	}
+	else if (c1 < c2) {
+		return 1;
+	}
+
+	return 0;
+}
+
+ucl_object_t *
+rspamd_re_cache_costs (struct rspamd_re_cache *cache, guint limit)
+{
+	ucl_object_t *top, *obj;
+	GPtrArray *sorted;
+	struct rspamd_re_cache_elt *elt;
+	struct rspamd_re_cache_elt_stat *st;
+	struct rspamd_re_class *re_class;
+	gdouble avg;
+	guint i;
+
+	g_assert (cache != NULL);
+
+	top = ucl_object_typed_new (UCL_ARRAY);
+	sorted = g_ptr_array_sized_new (cache->re->len);
+
+	PTR_ARRAY_FOREACH (cache->re, i, elt) {
+		if (elt->st && elt->st->calls > 0) {
+			g_ptr_array_add (sorted, elt);
+		}
+	}
+
+	g_ptr_array_sort (sorted, rspamd_re_cache_cost_cmp);
+
+	PTR_ARRAY_FOREACH (sorted, i, elt) {
+		if (limit > 0 && i >= limit) {
+			break;
+		}
+
+		st = elt->st;
+		re_class = rspamd_regexp_get_class (elt->re);
+		avg = st->samples > 0 ? st->total_ticks / st->samples : 0;
+		obj = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (obj,
+				ucl_object_fromstring (rspamd_regexp_get_pattern (elt->re)),
+				"re", 0, false);
+
+		if (re_class) {
+			ucl_object_insert_key (obj,
+					ucl_object_fromstring (
+							rspamd_re_cache_type_to_string (re_class->type)),
+					"type", 0, false);
+		}
+
+		ucl_object_insert_key (obj, ucl_object_fromint (st->calls),
+				"calls", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (st->samples),
+				"samples", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromdouble (avg),
+				"avg_ticks", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromdouble (st->max_ticks),
+				"max_ticks", 0, false);
+		ucl_object_insert_key (obj, ucl_object_frombool (st->deferred),
+				"deferred", 0, false);
+		ucl_array_append (top, obj);
+	}
+
+	g_ptr_array_free (sorted, TRUE);
+
+	return top;
+}
+
+void
+rspamd_re_cache_foreach (struct rspamd_re_cache *cache,
+		rspamd_re_cache_elt_cb cb, gpointer ud)
+{
+	struct rspamd_re_cache_elt *elt;
+	struct rspamd_re_class *re_class;
+	struct rspamd_re_cache_elt_info info;
+	guint i;
+
+	g_assert (cache != NULL);
+	g_assert (cb != NULL);
+
+	PTR_ARRAY_FOREACH (cache->re, i, elt) {
+		re_class = rspamd_regexp_get_class (elt->re);
+
+		if (re_class == NULL) {
+			continue;
+		}
+
+		memset (&info, 0, sizeof (info));
+		info.re = elt->re;
+		info.type = re_class->type;
+		info.type_data = re_class->type_data;
+		/* Type data is registered with the trailing zero */
+		info.type_len = re_class->type_len > 0 ? re_class->type_len - 1 : 0;
+		info.class_hash = re_class->hash;
+#ifdef WITH_HYPERSCAN
+		if (!cache->disable_hyperscan && cache->hyperscan_loaded &&
+				elt->match_type != RSPAMD_RE_CACHE_PCRE) {
+			info.hyperscan = TRUE;
+			info.prefilter = elt->match_type == RSPAMD_RE_CACHE_HYPERSCAN_PRE;
+		}
+
+		if (re_class->hs_scratch) {
+			hs_scratch_size (re_class->hs_scratch, &info.scratch_size);
+		}
+#endif
+
+		cb (&info, ud);
+	}
+}
+
+/*
+ * Statistics are updated without locking, as they are approximate anyway
+ */
+static void
+rspamd_re_cache_account_cost (struct rspamd_re_cache *cache,
+		struct rspamd_re_cache_elt_stat *st,
+		rspamd_regexp_t *re,
+		struct rspamd_task *task,
+		gdouble ticks)
+{
+	const guint min_samples = 10;
+	guint samples;
+
+	samples = g_atomic_int_add (&st->samples, 1) + 1;
+	st->total_ticks += ticks;
+
+	if (ticks > st->max_ticks) {
+		st->max_ticks = ticks;
+	}
+
+	if (cache->max_pcre_ticks > 0 && samples >= min_samples &&
+			st->total_ticks / samples > cache->max_pcre_ticks) {
+		if (g_atomic_int_compare_and_exchange (&st->deferred, 0, 1)) {
+			msg_warn_task ("regexp '%s' is deferred: it takes %.0f ticks on "
+					"average, budget is %.0f ticks",
+					rspamd_regexp_get_pattern (re),
+					st->total_ticks / samples,
+					cache->max_pcre_ticks);
+		}
+	}
+}
+
 static guint
 rspamd_re_cache_process_pcre (struct rspamd_re_runtime *rt,
 		rspamd_regexp_t *re, struct rspamd_task *task,
@@ -525,11 +781,23 @@ rspamd_re_cache_process_pcre (struct rspamd_re_runtime *rt,
 	guint64 id = rspamd_regexp_get_cache_id (re);
 	gdouble t1, t2, pr;
 	const gdouble slow_time = 1e8;
+	struct rspamd_re_cache_elt *elt;
+	struct rspamd_re_cache_elt_stat *st;
 
 	if (in == NULL) {
 		return rt->results[id];
 	}
 
+	elt = g_ptr_array_index (rt->cache->re, id);
+	st = elt->st;
+
+	if (st && g_atomic_int_get (&st->deferred)) {
+		/* Pathological regexp that has exceed its budget */
+		rt->stat.regexp_deferred ++;
+
+		return rt->results[id];
+	}
+
 	if (len == 0) {
 		return rt->results[id];
 	}
@@ -572,6 +840,10 @@ rspamd_re_cache_process_pcre (struct rspamd_re_runtime *rt,
 			rt->stat.regexp_matched += r;
 		}
 
+		if (st) {
+			g_atomic_int_inc (&st->calls);
+		}
+
 		if (pr > 0.9) {
 			t2 = rspamd_get_ticks (TRUE);
 
@@ -579,6 +851,10 @@ rspamd_re_cache_process_pcre (struct rspamd_re_runtime *rt,
 				msg_info_task ("regexp '%16s' took %.0f ticks to execute",
 						rspamd_regexp_get_pattern (re), t2 - t1);
 			}
+
+			if (st) {
+				rspamd_re_cache_account_cost (rt->cache, st, re, task, t2 - t1);
+			}
 		}
 	}
 
@@ -591,6 +867,8 @@ struct rspamd_re_hyperscan_cbdata {
 	const guchar **ins;
 	const guint *lens;
 	guint count;
+	/* Index of ins[0] in the whole inputs vector */
+	guint first_idx;
 	rspamd_regexp_t *re;
 	struct rspamd_task *task;
 };
@@ -605,7 +883,7 @@ rspamd_re_cache_hyperscan_cb (unsigned int id,
 	struct rspamd_re_hyperscan_cbdata *cbdata = ud;
 	struct rspamd_re_runtime *rt;
 	struct rspamd_re_cache_elt *pcre_elt;
-	guint ret, maxhits, i, processed;
+	guint ret, maxhits;
 	struct rspamd_task *task;
 
 	rt = cbdata->rt;
@@ -624,26 +902,44 @@ rspamd_re_cache_hyperscan_cb (unsigned int id,
 		msg_debug_re_task ("found regexp /%s/ using hyperscan only, total hits: %d",
 				rspamd_regexp_get_pattern (pcre_elt->re), rt->results[id]);
 	}
-	else {
-		if (!isset (rt->checked, id)) {
+	else if (!isset (rt->checked, id)) {
+		guint idx = cbdata->first_idx, i;
+		unsigned long long processed = 0;
+		khiter_t k;
+		gint r;
 
-			processed = 0;
+		/* Find the input that contains the match */
+		for (i = 0; i < cbdata->count; i ++) {
+			processed += cbdata->lens[i];
 
-			for (i = 0; i < cbdata->count; i ++) {
-				rspamd_re_cache_process_pcre (rt,
-						pcre_elt->re,
-						cbdata->task,
-						cbdata->ins[i],
-						cbdata->lens[i],
-						FALSE);
-				setbit (rt->checked, id);
+			if (processed >= to) {
+				break;
+			}
+		}
 
-				processed += cbdata->lens[i];
+		idx += MIN (i, cbdata->count - 1);
 
-				if (processed >= to) {
-					break;
-				}
-			}
+		/*
+		 * Pcre is executed on demand only, so the regexps that are not
+		 * requested by any enabled rule cost nothing; and it is executed
+		 * merely for the inputs where the prefilter has matched
+		 */
+		if (rt->prefilter_inputs == NULL) {
+			rt->prefilter_inputs = kh_init (re_prefilter_inputs_hash);
+		}
+
+		k = kh_put (re_prefilter_inputs_hash, rt->prefilter_inputs, id, &r);
+
+		if (r != 0) {
+			kh_value (rt->prefilter_inputs, k) = 0;
+		}
+
+		kh_value (rt->prefilter_inputs, k) |= PREFILTER_INPUT_BIT (idx);
+
+		if (!isset (rt->prefiltered, id)) {
+			setbit (rt->prefiltered, id);
+			msg_debug_re_task ("regexp /%s/ has been prefiltered by hyperscan",
+					rspamd_regexp_get_pattern (pcre_elt->re));
 		}
 	}
 
@@ -725,6 +1021,7 @@ rspamd_re_cache_process_regexp_data (struct rspamd_re_runtime *rt,
 				cbdata.rt = rt;
 				cbdata.lens = &lens[i];
 				cbdata.count = 1;
+				cbdata.first_idx = i;
 				cbdata.task = task;
 
 				if ((hs_scan (re_class->hs_db, in[i], lens[i], 0,
@@ -742,7 +1039,8 @@ rspamd_re_cache_process_regexp_data (struct rspamd_re_runtime *rt,
 			cbdata.re = re;
 			cbdata.rt = rt;
 			cbdata.lens = lens;
-			cbdata.count = 1;
+			cbdata.count = count;
+			cbdata.first_idx = 0;
 			cbdata.task = task;
 
 			if ((hs_scan_vector (re_class->hs_db, (const char **)in, lens, count, 0,
@@ -772,7 +1070,8 @@ rspamd_re_cache_finish_class (struct rspamd_re_runtime *rt,
 	for (i = 0; i < re_class->nhs; i++) {
 		re_id = re_class->hs_ids[i];
 
-		if (!isset (rt->checked, re_id)) {
+		/* Prefiltered regexps are checked when they are requested */
+		if (!isset (rt->checked, re_id) && !isset (rt->prefiltered, re_id)) {
 			g_assert (rt->results[re_id] == 0);
 			rt->results[re_id] = 0;
 			setbit (rt->checked, re_id);
@@ -891,16 +1190,17 @@ rspamd_re_cache_process_selector (struct rspamd_task *task,
 }
 
 /*
- * Calculates the specified regexp for the specified class if it's not calculated
+ * Extracts the input vectors for the specified class, returns FALSE if
+ * there is no data to match for that class
  */
-static guint
-rspamd_re_cache_exec_re (struct rspamd_task *task,
+static gboolean
+rspamd_re_cache_collect_inputs (struct rspamd_task *task,
 		struct rspamd_re_runtime *rt,
-		rspamd_regexp_t *re,
 		struct rspamd_re_class *re_class,
-		gboolean is_strong)
+		gboolean is_strong,
+		struct rspamd_re_class_input *inp)
 {
-	guint ret = 0, i, re_id;
+	guint i;
 	GPtrArray *headerlist;
 	GHashTableIter it;
 	struct rspamd_mime_header *rh;
@@ -913,207 +1213,145 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 	gpointer k, v;
 	guint len, cnt;
 
-	msg_debug_re_task ("check re type: %s: /%s/",
-			rspamd_re_cache_type_to_string (re_class->type),
-			rspamd_regexp_get_pattern (re));
-	re_id = rspamd_regexp_get_cache_id (re);
-
 	switch (re_class->type) {
 	case RSPAMD_RE_HEADER:
 	case RSPAMD_RE_RAWHEADER:
+	case RSPAMD_RE_MIMEHEADER:
 		/* Get list of specified headers */
-		headerlist = rspamd_message_get_header_array (task,
-				re_class->type_data,
-				is_strong);
+		if (re_class->type == RSPAMD_RE_MIMEHEADER) {
+			headerlist = rspamd_message_get_mime_header_array (task,
+					re_class->type_data,
+					is_strong);
+		}
+		else {
+			headerlist = rspamd_message_get_header_array_by_hash (task,
+					re_class->header_hash,
+					re_class->type_data,
+					is_strong);
+		}
 
-		if (headerlist && headerlist->len > 0) {
-			scvec = g_malloc (sizeof (*scvec) * headerlist->len);
-			lenvec = g_malloc (sizeof (*lenvec) * headerlist->len);
+		if (headerlist == NULL || headerlist->len == 0) {
+			return FALSE;
+		}
 
-			for (i = 0; i < headerlist->len; i ++) {
-				rh = g_ptr_array_index (headerlist, i);
+		scvec = g_malloc (sizeof (*scvec) * headerlist->len);
+		lenvec = g_malloc (sizeof (*lenvec) * headerlist->len);
 
-				if (re_class->type == RSPAMD_RE_RAWHEADER) {
-					in = rh->value;
-					raw = TRUE;
-					lenvec[i] = strlen (rh->value);
-				}
-				else {
-					in = rh->decoded;
-					/* Validate input */
-					if (!in || !g_utf8_validate (in, -1, &end)) {
-						lenvec[i] = 0;
-						scvec[i] = (guchar *)"";
-						continue;
-					}
-					lenvec[i] = end - in;
-				}
+		for (i = 0; i < headerlist->len; i ++) {
+			rh = g_ptr_array_index (headerlist, i);
 
-				scvec[i] = (guchar *)in;
+			if (re_class->type == RSPAMD_RE_RAWHEADER) {
+				in = rh->value;
+				raw = TRUE;
+				lenvec[i] = strlen (rh->value);
+			}
+			else {
+				in = rspamd_mime_header_get_decoded (task->task_pool, rh);
+				/* Validate input */
+				if (!in || !g_utf8_validate (in, -1, &end)) {
+					lenvec[i] = 0;
+					scvec[i] = (guchar *)"";
+					continue;
+				}
+				lenvec[i] = end - in;
 			}
 
-			ret = rspamd_re_cache_process_regexp_data (rt, re,
-					task, scvec, lenvec, headerlist->len, raw);
-			msg_debug_re_task ("checking header %s regexp: %s=%*s -> %d",
-					re_class->type_data,
-					rspamd_regexp_get_pattern (re),
-					(int)lenvec[0], scvec[0], ret);
-			g_free (scvec);
-			g_free (lenvec);
+			scvec[i] = (guchar *)in;
 		}
+
+		cnt = headerlist->len;
 		break;
 	case RSPAMD_RE_ALLHEADER:
+		scvec = g_malloc (sizeof (*scvec));
+		lenvec = g_malloc (sizeof (*lenvec));
 		raw = TRUE;
-		in = task->raw_headers_content.begin;
-		len = task->raw_headers_content.len;
-		ret = rspamd_re_cache_process_regexp_data (rt, re,
-				task, (const guchar **)&in, &len, 1, raw);
-		msg_debug_re_task ("checking allheader regexp: %s -> %d",
-				rspamd_regexp_get_pattern (re), ret);
+		scvec[0] = (guchar *)task->raw_headers_content.begin;
+		lenvec[0] = task->raw_headers_content.len;
+		cnt = 1;
 		break;
-	case RSPAMD_RE_MIMEHEADER:
-		headerlist = rspamd_message_get_mime_header_array (task,
-				re_class->type_data,
-				is_strong);
+	case RSPAMD_RE_MIME:
+	case RSPAMD_RE_RAWMIME:
+		/* Iterate through text parts */
+		if (task->text_parts->len == 0) {
+			return FALSE;
+		}
 
-		if (headerlist && headerlist->len > 0) {
-			scvec = g_malloc (sizeof (*scvec) * headerlist->len);
-			lenvec = g_malloc (sizeof (*lenvec) * headerlist->len);
+		cnt = task->text_parts->len;
+		scvec = g_malloc (sizeof (*scvec) * cnt);
+		lenvec = g_malloc (sizeof (*lenvec) * cnt);
 
-			for (i = 0; i < headerlist->len; i ++) {
-				rh = g_ptr_array_index (headerlist, i);
+		for (i = 0; i < task->text_parts->len; i++) {
+			part = g_ptr_array_index (task->text_parts, i);
 
-				if (re_class->type == RSPAMD_RE_RAWHEADER) {
-					in = rh->value;
-					raw = TRUE;
-					lenvec[i] = strlen (rh->value);
+			/* Select data for regexp */
+			if (re_class->type == RSPAMD_RE_RAWMIME) {
+				if (part->raw.len == 0) {
+					len = 0;
+					in = "";
 				}
 				else {
-					in = rh->decoded;
-					/* Validate input */
-					if (!in || !g_utf8_validate (in, -1, &end)) {
-						lenvec[i] = 0;
-						scvec[i] = (guchar *)"";
-						continue;
-					}
-					lenvec[i] = end - in;
+					in = part->raw.begin;
+					len = part->raw.len;
 				}
 
-				scvec[i] = (guchar *)in;
+				raw = TRUE;
 			}
-
-			ret = rspamd_re_cache_process_regexp_data (rt, re,
-					task, scvec, lenvec, headerlist->len, raw);
-			msg_debug_re_task ("checking mime header %s regexp: %s -> %d",
-					re_class->type_data,
-					rspamd_regexp_get_pattern (re), ret);
-			g_free (scvec);
-			g_free (lenvec);
-		}
-		break;
-	case RSPAMD_RE_MIME:
-	case RSPAMD_RE_RAWMIME:
-		/* Iterate through text parts */
-		if (task->text_parts->len > 0) {
-			cnt = task->text_parts->len;
-			scvec = g_malloc (sizeof (*scvec) * cnt);
-			lenvec = g_malloc (sizeof (*lenvec) * cnt);
-
-			for (i = 0; i < task->text_parts->len; i++) {
-				part = g_ptr_array_index (task->text_parts, i);
-
-				/* Select data for regexp */
-				if (re_class->type == RSPAMD_RE_RAWMIME) {
-					if (part->raw.len == 0) {
-						len = 0;
-						in = "";
-					}
-					else {
-						in = part->raw.begin;
-						len = part->raw.len;
-					}
-
-					raw = TRUE;
+			else {
+				/* Skip empty parts */
+				if (IS_PART_EMPTY (part)) {
+					len = 0;
+					in = "";
 				}
 				else {
-					/* Skip empty parts */
-					if (IS_PART_EMPTY (part)) {
-						len = 0;
-						in = "";
+					/* Check raw flags */
+					if (!IS_PART_UTF (part)) {
+						raw = TRUE;
 					}
-					else {
-						/* Check raw flags */
-						if (!IS_PART_UTF (part)) {
-							raw = TRUE;
-						}
-
-						in = part->utf_content->data;
-						len = part->utf_content->len;
-					}
-				}
 
-				scvec[i] = (guchar *) in;
-				lenvec[i] = len;
+					in = part->utf_content->data;
+					len = part->utf_content->len;
+				}
 			}
 
-			ret = rspamd_re_cache_process_regexp_data (rt, re,
-					task, scvec, lenvec, cnt, raw);
-			msg_debug_re_task ("checking mime regexp: %s -> %d",
-					rspamd_regexp_get_pattern (re), ret);
-			g_free (scvec);
-			g_free (lenvec);
+			scvec[i] = (guchar *) in;
+			lenvec[i] = len;
 		}
 		break;
 	case RSPAMD_RE_URL:
 		cnt = g_hash_table_size (task->urls) + g_hash_table_size (task->emails);
 
-		if (cnt > 0) {
-			scvec = g_malloc (sizeof (*scvec) * cnt);
-			lenvec = g_malloc (sizeof (*lenvec) * cnt);
-			g_hash_table_iter_init (&it, task->urls);
-			i = 0;
-
-			while (g_hash_table_iter_next (&it, &k, &v)) {
-				url = v;
-				in = url->string;
-				len = url->urllen;
-				raw = FALSE;
-
-				scvec[i] = (guchar *)in;
-				lenvec[i++] = len;
-			}
-
-			g_hash_table_iter_init (&it, task->emails);
+		if (cnt == 0) {
+			return FALSE;
+		}
 
-			while (g_hash_table_iter_next (&it, &k, &v)) {
-				url = v;
-				in = url->string;
-				len = url->urllen;
-				raw = FALSE;
+		scvec = g_malloc (sizeof (*scvec) * cnt);
+		lenvec = g_malloc (sizeof (*lenvec) * cnt);
+		g_hash_table_iter_init (&it, task->urls);
+		i = 0;
 
-				scvec[i] = (guchar *) in;
-				lenvec[i++] = len;
-			}
+		while (g_hash_table_iter_next (&it, &k, &v)) {
+			url = v;
+			scvec[i] = (guchar *)url->string;
+			lenvec[i++] = url->urllen;
+		}
 
-			g_assert (i == cnt);
+		g_hash_table_iter_init (&it, task->emails);
 
-			ret = rspamd_re_cache_process_regexp_data (rt, re,
-					task, scvec, lenvec, i, raw);
-			msg_debug_re_task ("checking url regexp: %s -> %d",
-					rspamd_regexp_get_pattern (re), ret);
-			g_free (scvec);
-			g_free (lenvec);
+		while (g_hash_table_iter_next (&it, &k, &v)) {
+			url = v;
+			scvec[i] = (guchar *)url->string;
+			lenvec[i++] = url->urllen;
 		}
+
+		g_assert (i == cnt);
 		break;
 	case RSPAMD_RE_BODY:
+		scvec = g_malloc (sizeof (*scvec));
+		lenvec = g_malloc (sizeof (*lenvec));
 		raw = TRUE;
-		in = task->msg.begin;
-		len = task->msg.len;
-
-		ret = rspamd_re_cache_process_regexp_data (rt, re, task,
-				(const guchar **)&in, &len, 1, raw);
-		msg_debug_re_task ("checking rawbody regexp: %s -> %d",
-				rspamd_regexp_get_pattern (re), ret);
+		scvec[0] = (guchar *)task->msg.begin;
+		lenvec[0] = task->msg.len;
+		cnt = 1;
 		break;
 	case RSPAMD_RE_SABODY:
 		/* According to SA docs:
@@ -1127,6 +1365,7 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 		cnt = task->text_parts->len + 1;
 		scvec = g_malloc (sizeof (*scvec) * cnt);
 		lenvec = g_malloc (sizeof (*lenvec) * cnt);
+		raw = TRUE;
 
 		/*
 		 * Body rules also include the Subject as the first line
@@ -1138,8 +1377,9 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 		if (headerlist && headerlist->len > 0) {
 			rh = g_ptr_array_index (headerlist, 0);
 
-			scvec[0] = (guchar *)rh->decoded;
-			lenvec[0] = strlen (rh->decoded);
+			scvec[0] = (guchar *)rspamd_mime_header_get_decoded (
+					task->task_pool, rh);
+			lenvec[0] = strlen (scvec[0]);
 		}
 		else {
 			scvec[0] = (guchar *)"";
@@ -1157,13 +1397,6 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 				lenvec[i + 1] = 0;
 			}
 		}
-
-		ret = rspamd_re_cache_process_regexp_data (rt, re,
-				task, scvec, lenvec, cnt, TRUE);
-		msg_debug_re_task ("checking sa body regexp: %s -> %d",
-				rspamd_regexp_get_pattern (re), ret);
-		g_free (scvec);
-		g_free (lenvec);
 		break;
 	case RSPAMD_RE_SARAWBODY:
 		/* According to SA docs:
@@ -1173,69 +1406,211 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 		 * Multiline expressions will need to be used to match strings that are
 		 * broken by line breaks.
 		 */
-		if (task->text_parts->len > 0) {
-			cnt = task->text_parts->len;
-			scvec = g_malloc (sizeof (*scvec) * cnt);
-			lenvec = g_malloc (sizeof (*lenvec) * cnt);
+		if (task->text_parts->len == 0) {
+			return FALSE;
+		}
 
-			for (i = 0; i < task->text_parts->len; i++) {
-				part = g_ptr_array_index (task->text_parts, i);
+		cnt = task->text_parts->len;
+		scvec = g_malloc (sizeof (*scvec) * cnt);
+		lenvec = g_malloc (sizeof (*lenvec) * cnt);
+		raw = TRUE;
 
-				if (part->parsed.len > 0) {
-					scvec[i] = (guchar *)part->parsed.begin;
-					lenvec[i] = part->parsed.len;
-				}
-				else {
-					scvec[i] = (guchar *)"";
-					lenvec[i] = 0;
-				}
-			}
+		for (i = 0; i < task->text_parts->len; i++) {
+			part = g_ptr_array_index (task->text_parts, i);
 
-			ret = rspamd_re_cache_process_regexp_data (rt, re,
-					task, scvec, lenvec, cnt, TRUE);
-			msg_debug_re_task ("checking sa rawbody regexp: %s -> %d",
-					rspamd_regexp_get_pattern (re), ret);
-			g_free (scvec);
-			g_free (lenvec);
+			if (part->parsed.len > 0) {
+				scvec[i] = (guchar *)part->parsed.begin;
+				lenvec[i] = part->parsed.len;
+			}
+			else {
+				scvec[i] = (guchar *)"";
+				lenvec[i] = 0;
+			}
 		}
 		break;
 	case RSPAMD_RE_SELECTOR:
-		if (rspamd_re_cache_process_selector (task, rt,
+		/* Selectors are cached in rt->sel_cache */
+		if (!rspamd_re_cache_process_selector (task, rt,
 				re_class->type_data,
 				(guchar ***)&scvec,
 				&lenvec, &cnt)) {
-
-			ret = rspamd_re_cache_process_regexp_data (rt, re,
-					task, scvec, lenvec, cnt, TRUE);
-			msg_debug_re_task ("checking selector (%s) regexp: %s -> %d",
-					re_class->type_data,
-					rspamd_regexp_get_pattern (re), ret);
-
-			/* Do not free vectors as they are managed by rt->sel_cache */
+			return FALSE;
 		}
-		break;
-	case RSPAMD_RE_MAX:
-		msg_err_task ("regexp of class invalid has been called: %s",
-				rspamd_regexp_get_pattern (re));
-		break;
-	}
 
-#if WITH_HYPERSCAN
-	if (!rt->cache->disable_hyperscan && rt->has_hs) {
-		rspamd_re_cache_finish_class (rt, re_class);
+		raw = TRUE;
+		break;
+	default:
+		return FALSE;
 	}
-#endif
 
-	setbit (rt->checked, re_id);
+	inp->scvec = scvec;
+	inp->lenvec = lenvec;
+	inp->cnt = cnt;
+	inp->raw = raw;
 
-	return rt->results[re_id];
+	return TRUE;
 }
 
-gint
-rspamd_re_cache_process (struct rspamd_task *task,
-		rspamd_regexp_t *re,
-		enum rspamd_re_type type,
-		gconstpointer type_data,
+/*
+ * Returns input vectors for the specified class, they are extracted once per
+ * task and then reused by all regexps of the same class
+ */
+static struct rspamd_re_class_input *
+rspamd_re_cache_get_inputs (struct rspamd_task *task,
+		struct rspamd_re_runtime *rt,
+		struct rspamd_re_class *re_class,
+		gboolean is_strong)
+{
+	struct rspamd_re_class_input inp, *pinp;
+	guint64 key;
+	khiter_t k;
+	gint r;
+
+	/* Strong headers lookup can return different set of headers */
+	key = is_strong ? ~re_class->id : re_class->id;
+
+	if (rt->inputs_cache == NULL) {
+		rt->inputs_cache = kh_init (re_class_inputs_hash);
+	}
+
+	k = kh_get (re_class_inputs_hash, rt->inputs_cache, key);
+
+	if (k != kh_end (rt->inputs_cache)) {
+		rt->stat.inputs_reused ++;
+
+		return &kh_value (rt->inputs_cache, k);
+	}
+
+	memset (&inp, 0, sizeof (inp));
+
+	if (!rspamd_re_cache_collect_inputs (task, rt, re_class, is_strong, &inp)) {
+		/* Remember absence of data as well */
+		inp.cnt = 0;
+	}
+
+	inp.owned = (re_class->type != RSPAMD_RE_SELECTOR);
+	k = kh_put (re_class_inputs_hash, rt->inputs_cache, key, &r);
+	pinp = &kh_value (rt->inputs_cache, k);
+	memcpy (pinp, &inp, sizeof (inp));
+
+	return pinp;
+}
+
+/*
+ * Calculates the specified regexp for the specified class if it's not calculated
+ */
+static guint
+rspamd_re_cache_exec_re (struct rspamd_task *task,
+		struct rspamd_re_runtime *rt,
+		rspamd_regexp_t *re,
+		struct rspamd_re_class *re_class,
+		gboolean is_strong)
+{
+	guint ret = 0, re_id, i;
+	struct rspamd_re_class_input *inp;
+
+	msg_debug_re_task ("check re type: %s: /%s/",
+			rspamd_re_cache_type_to_string (re_class->type),
+			rspamd_regexp_get_pattern (re));
+	re_id = rspamd_regexp_get_cache_id (re);
+
+	if (re_class->type == RSPAMD_RE_MAX) {
+		msg_err_task ("regexp of class invalid has been called: %s",
+				rspamd_regexp_get_pattern (re));
+	}
+	else {
+		inp = rspamd_re_cache_get_inputs (task, rt, re_class, is_strong);
+
+		if (inp->cnt > 0 && !isset (rt->prefiltered, re_id)) {
+			ret = rspamd_re_cache_process_regexp_data (rt, re,
+					task, inp->scvec, inp->lenvec, inp->cnt, inp->raw);
+			msg_debug_re_task ("checking %s(%s) regexp: %s -> %d",
+					rspamd_re_cache_type_to_string (re_class->type),
+					re_class->type_data ? (const gchar *)re_class->type_data : "",
+					rspamd_regexp_get_pattern (re), ret);
+		}
+
+#if WITH_HYPERSCAN
+		if (!rt->cache->disable_hyperscan && rt->has_hs) {
+			rspamd_re_cache_finish_class (rt, re_class);
+		}
+#endif
+
+		if (isset (rt->prefiltered, re_id) && !isset (rt->checked, re_id)) {
+			guint64 inputs_mask = G_MAXUINT64;
+#ifdef WITH_HYPERSCAN
+			khiter_t k;
+
+			if (rt->prefilter_inputs) {
+				k = kh_get (re_prefilter_inputs_hash, rt->prefilter_inputs,
+						re_id);
+
+				if (k != kh_end (rt->prefilter_inputs)) {
+					inputs_mask = kh_value (rt->prefilter_inputs, k);
+				}
+			}
+#endif
+
+			/* Hyperscan has found a candidate, confirm it with pcre */
+			for (i = 0; i < inp->cnt; i ++) {
+				if (!(inputs_mask & PREFILTER_INPUT_BIT (i))) {
+					rt->stat.inputs_prefiltered ++;
+					continue;
+				}
+
+				rspamd_re_cache_process_pcre (rt, re, task,
+						inp->scvec[i], inp->lenvec[i], inp->raw);
+			}
+
+			ret = rt->results[re_id];
+			msg_debug_re_task ("confirmed prefiltered %s(%s) regexp: %s -> %d",
+					rspamd_re_cache_type_to_string (re_class->type),
+					re_class->type_data ? (const gchar *)re_class->type_data : "",
+					rspamd_regexp_get_pattern (re), ret);
+		}
+	}
+
+	setbit (rt->checked, re_id);
+
+	return rt->results[re_id];
+}
+
+/*
+ * Finds the regexp object that is registered for the specified class
+ */
+static rspamd_regexp_t *
+rspamd_re_cache_resolve_class (struct rspamd_re_cache *cache,
+		rspamd_regexp_t *re,
+		enum rspamd_re_type type,
+		gconstpointer type_data,
+		gsize datalen)
+{
+	guint64 class_id;
+	struct rspamd_re_class *re_class;
+
+	/* Type data is registered with the trailing zero */
+	class_id = rspamd_re_cache_class_id (type, type_data,
+			(type_data && datalen > 0) ? datalen + 1 : 0);
+	re_class = rspamd_regexp_get_class (re);
+
+	if (re_class != NULL && re_class->id == class_id) {
+		return re;
+	}
+
+	re_class = g_hash_table_lookup (cache->re_classes, &class_id);
+
+	if (re_class == NULL) {
+		return NULL;
+	}
+
+	return g_hash_table_lookup (re_class->re, rspamd_regexp_get_id (re));
+}
+
+gint
+rspamd_re_cache_process (struct rspamd_task *task,
+		rspamd_regexp_t *re,
+		enum rspamd_re_type type,
+		gconstpointer type_data,
 		gsize datalen,
 		gboolean is_strong)
 {
@@ -1243,6 +1618,7 @@ rspamd_re_cache_process (struct rspamd_task *task,
 	struct rspamd_re_class *re_class;
 	struct rspamd_re_cache *cache;
 	struct rspamd_re_runtime *rt;
+	struct rspamd_re_cache_elt *elt;
 
 	g_assert (task != NULL);
 	rt = task->re_rt;
@@ -1252,12 +1628,31 @@ rspamd_re_cache_process (struct rspamd_task *task,
 	cache = rt->cache;
 	re_id = rspamd_regexp_get_cache_id (re);
 
-	if (re_id == RSPAMD_INVALID_ID || re_id > cache->nre) {
+	if (re_id == RSPAMD_INVALID_ID || re_id >= cache->nre) {
 		msg_err_task ("re '%s' has no valid id for the cache",
 				rspamd_regexp_get_pattern (re));
 		return 0;
 	}
 
+	elt = g_ptr_array_index (cache->re, re_id);
+
+	if (elt->multiclass) {
+		rspamd_regexp_t *class_re;
+
+		class_re = rspamd_re_cache_resolve_class (cache, re, type,
+				type_data, datalen);
+
+		if (class_re == NULL) {
+			msg_err_task ("re '%s' is not registered for class %s",
+					rspamd_regexp_get_pattern (re),
+					rspamd_re_cache_type_to_string (type));
+			return 0;
+		}
+
+		re = class_re;
+		re_id = rspamd_regexp_get_cache_id (re);
+	}
+
 	if (isset (rt->checked, re_id)) {
 		/* Fast path */
 		rt->stat.regexp_fast_cached ++;
@@ -1318,6 +1713,25 @@ rspamd_re_cache_runtime_destroy (struct rspamd_re_runtime *rt)
 		kh_destroy (selectors_results_hash, rt->sel_cache);
 	}
 
+	if (rt->inputs_cache) {
+		struct rspamd_re_class_input inp;
+
+		kh_foreach_value (rt->inputs_cache, inp, {
+			/* Selectors vectors are owned by the selectors cache */
+			if (inp.owned) {
+				g_free (inp.scvec);
+				g_free (inp.lenvec);
+			}
+		});
+		kh_destroy (re_class_inputs_hash, rt->inputs_cache);
+	}
+
+#ifdef WITH_HYPERSCAN
+	if (rt->prefilter_inputs) {
+		kh_destroy (re_prefilter_inputs_hash, rt->prefilter_inputs);
+	}
+#endif
+
 	REF_RELEASE (rt->cache);
 	g_free (rt);
 }
@@ -1531,21 +1945,19 @@ rspamd_re_cache_is_finite (struct rspamd_re_cache *cache,
 }
 #endif
 
-gint
-rspamd_re_cache_compile_hyperscan (struct rspamd_re_cache *cache,
-		const char *cache_dir, gdouble max_time, gboolean silent,
+#ifdef WITH_HYPERSCAN
+/*
+ * Compiles a single class and atomically stores it in the cache dir,
+ * returns number of compiled regexps or -1 on error
+ */
+static gint
+rspamd_re_cache_compile_class (struct rspamd_re_cache *cache,
+		struct rspamd_re_class *re_class,
+		const char *cache_dir, gdouble max_time,
 		GError **err)
 {
-	g_assert (cache != NULL);
-	g_assert (cache_dir != NULL);
-
-#ifndef WITH_HYPERSCAN
-	g_set_error (err, rspamd_re_cache_quark (), EINVAL, "hyperscan is disabled");
-	return -1;
-#else
-	GHashTableIter it, cit;
+	GHashTableIter cit;
 	gpointer k, v;
-	struct rspamd_re_class *re_class;
 	gchar path[PATH_MAX], npath[PATH_MAX];
 	hs_database_t *test_db;
 	gint fd, i, n, *hs_ids = NULL, pcre_flags, re_flags;
@@ -1557,9 +1969,294 @@ rspamd_re_cache_compile_hyperscan (struct rspamd_re_cache *cache,
 	const hs_expr_ext_t **hs_exts = NULL;
 	const gchar **hs_pats = NULL;
 	gchar *hs_serialized;
-	gsize serialized_len, total = 0;
+	gsize serialized_len;
 	struct iovec iov[7];
 
+	rspamd_snprintf (path, sizeof (path), "%s%c%s.hs.new", cache_dir,
+					G_DIR_SEPARATOR, re_class->hash);
+	fd = open (path, O_CREAT|O_TRUNC|O_EXCL|O_WRONLY, 00600);
+
+	if (fd == -1) {
+		g_set_error (err, rspamd_re_cache_quark (), errno, "cannot open file "
+				"%s: %s", path, strerror (errno));
+		return -1;
+	}
+
+	g_hash_table_iter_init (&cit, re_class->re);
+	n = g_hash_table_size (re_class->re);
+	hs_flags = g_malloc0 (sizeof (*hs_flags) * n);
+	hs_ids = g_malloc (sizeof (*hs_ids) * n);
+	hs_pats = g_malloc (sizeof (*hs_pats) * n);
+	hs_exts = g_malloc0 (sizeof (*hs_exts) * n);
+	i = 0;
+
+	while (g_hash_table_iter_next (&cit, &k, &v)) {
+		re = v;
+
+		pcre_flags = rspamd_regexp_get_pcre_flags (re);
+		re_flags = rspamd_regexp_get_flags (re);
+
+		if (re_flags & RSPAMD_REGEXP_FLAG_PCRE_ONLY) {
+			/* Do not try to compile bad regexp */
+			msg_info_re_cache (
+					"do not try compile %s to hyperscan as it is PCRE only",
+					rspamd_regexp_get_pattern (re));
+			continue;
+		}
+
+		hs_flags[i] = 0;
+		hs_exts[i] = NULL;
+#ifndef WITH_PCRE2
+		if (pcre_flags & PCRE_FLAG(UTF8)) {
+			hs_flags[i] |= HS_FLAG_UTF8;
+		}
+#else
+		if (pcre_flags & PCRE_FLAG(UTF)) {
+			hs_flags[i] |= HS_FLAG_UTF8;
+		}
+#endif
+		if (pcre_flags & PCRE_FLAG(CASELESS)) {
+			hs_flags[i] |= HS_FLAG_CASELESS;
+		}
+		if (pcre_flags & PCRE_FLAG(MULTILINE)) {
+			hs_flags[i] |= HS_FLAG_MULTILINE;
+		}
+		if (pcre_flags & PCRE_FLAG(DOTALL)) {
+			hs_flags[i] |= HS_FLAG_DOTALL;
+		}
+		if (rspamd_regexp_get_maxhits (re) == 1) {
+			hs_flags[i] |= HS_FLAG_SINGLEMATCH;
+		}
+
+		if (hs_compile (rspamd_regexp_get_pattern (re),
+				hs_flags[i],
+				cache->vectorized_hyperscan ? HS_MODE_VECTORED : HS_MODE_BLOCK,
+				&cache->plt,
+				&test_db,
+				&hs_errors) != HS_SUCCESS) {
+			msg_info_re_cache ("cannot compile %s to hyperscan, try prefilter match",
+					rspamd_regexp_get_pattern (re));
+			hs_free_compile_error (hs_errors);
+
+			/* The approximation operation might take a significant
+			 * amount of time, so we need to check if it's finite
+			 */
+			if (rspamd_re_cache_is_finite (cache, re, hs_flags[i], max_time)) {
+				hs_flags[i] |= HS_FLAG_PREFILTER;
+				hs_ids[i] = rspamd_regexp_get_cache_id (re);
+				hs_pats[i] = rspamd_regexp_get_pattern (re);
+				i++;
+			}
+		}
+		else {
+			hs_ids[i] = rspamd_regexp_get_cache_id (re);
+			hs_pats[i] = rspamd_regexp_get_pattern (re);
+			i ++;
+			hs_free_database (test_db);
+		}
+	}
+	/* Adjust real re number */
+	n = i;
+
+	if (n > 0) {
+		/* Create the hs tree */
+		if (hs_compile_ext_multi (hs_pats,
+				hs_flags,
+				hs_ids,
+				hs_exts,
+				n,
+				cache->vectorized_hyperscan ? HS_MODE_VECTORED : HS_MODE_BLOCK,
+				&cache->plt,
+				&test_db,
+				&hs_errors) != HS_SUCCESS) {
+
+			g_set_error (err, rspamd_re_cache_quark (), EINVAL,
+					"cannot create tree of regexp when processing '%s': %s",
+					hs_pats[hs_errors->expression], hs_errors->message);
+			g_free (hs_flags);
+			g_free (hs_ids);
+			g_free (hs_pats);
+			g_free (hs_exts);
+			close (fd);
+			unlink (path);
+			hs_free_compile_error (hs_errors);
+
+			return -1;
+		}
+
+		g_free (hs_pats);
+		g_free (hs_exts);
+
+		if (hs_serialize_database (test_db, &hs_serialized,
+				&serialized_len) != HS_SUCCESS) {
+			g_set_error (err,
+					rspamd_re_cache_quark (),
+					errno,
+					"cannot serialize tree of regexp for %s",
+					re_class->hash);
+
+			close (fd);
+			unlink (path);
+			g_free (hs_ids);
+			g_free (hs_flags);
+			hs_free_database (test_db);
+
+			return -1;
+		}
+
+		hs_free_database (test_db);
+
+		/*
+		 * Magic - 8 bytes
+		 * Platform - sizeof (platform)
+		 * n - number of regexps
+		 * n * <regexp ids>
+		 * n * <regexp flags>
+		 * crc - 8 bytes checksum
+		 * <hyperscan blob>
+		 */
+		rspamd_cryptobox_fast_hash_init (&crc_st, 0xdeadbabe);
+		/* IDs -> Flags -> Hs blob */
+		rspamd_cryptobox_fast_hash_update (&crc_st,
+				hs_ids, sizeof (*hs_ids) * n);
+		rspamd_cryptobox_fast_hash_update (&crc_st,
+				hs_flags, sizeof (*hs_flags) * n);
+		rspamd_cryptobox_fast_hash_update (&crc_st,
+				hs_serialized, serialized_len);
+		crc = rspamd_cryptobox_fast_hash_final (&crc_st);
+
+		if (cache->vectorized_hyperscan) {
+			iov[0].iov_base = (void *) rspamd_hs_magic_vector;
+		}
+		else {
+			iov[0].iov_base = (void *) rspamd_hs_magic;
+		}
+
+		iov[0].iov_len = RSPAMD_HS_MAGIC_LEN;
+		iov[1].iov_base = &cache->plt;
+		iov[1].iov_len = sizeof (cache->plt);
+		iov[2].iov_base = &n;
+		iov[2].iov_len = sizeof (n);
+		iov[3].iov_base = hs_ids;
+		iov[3].iov_len = sizeof (*hs_ids) * n;
+		iov[4].iov_base = hs_flags;
+		iov[4].iov_len = sizeof (*hs_flags) * n;
+		iov[5].iov_base = &crc;
+		iov[5].iov_len = sizeof (crc);
+		iov[6].iov_base = hs_serialized;
+		iov[6].iov_len = serialized_len;
+
+		if (writev (fd, iov, G_N_ELEMENTS (iov)) == -1) {
+			g_set_error (err,
+					rspamd_re_cache_quark (),
+					errno,
+					"cannot serialize tree of regexp to %s: %s",
+					path, strerror (errno));
+			close (fd);
+			unlink (path);
+			g_free (hs_ids);
+			g_free (hs_flags);
+			g_free (hs_serialized);
+
+			return -1;
+		}
+
+		if (re_class->type_len > 0) {
+			msg_info_re_cache (
+					"compiled class %s(%*s) to cache %6s, %d regexps",
+					rspamd_re_cache_type_to_string (re_class->type),
+					(gint) re_class->type_len - 1,
+					re_class->type_data,
+					re_class->hash,
+					n);
+		}
+		else {
+			msg_info_re_cache (
+					"compiled class %s to cache %6s, %d regexps",
+					rspamd_re_cache_type_to_string (re_class->type),
+					re_class->hash,
+					n);
+		}
+
+		g_free (hs_serialized);
+		g_free (hs_ids);
+		g_free (hs_flags);
+	}
+
+	fsync (fd);
+
+	/* Now rename temporary file to the new .hs file */
+	rspamd_snprintf (npath, sizeof (path), "%s%c%s.hs", cache_dir,
+			G_DIR_SEPARATOR, re_class->hash);
+
+	if (rename (path, npath) == -1) {
+		g_set_error (err,
+				rspamd_re_cache_quark (),
+				errno,
+				"cannot rename %s to %s: %s",
+				path, npath, strerror (errno));
+		unlink (path);
+		close (fd);
+
+		return -1;
+	}
+
+	close (fd);
+
+	return n;
+}
+
+/*
+ * Returns number of regexps stored in a valid hyperscan file
+ */
+static gint
+rspamd_re_cache_hyperscan_file_nre (struct rspamd_re_cache *cache,
+		const gchar *path)
+{
+	gint fd, n = 0;
+
+	fd = open (path, O_RDONLY, 00600);
+
+	if (fd == -1) {
+		return 0;
+	}
+
+	if (lseek (fd, RSPAMD_HS_MAGIC_LEN + sizeof (cache->plt), SEEK_SET) == -1 ||
+			read (fd, &n, sizeof (n)) != sizeof (n)) {
+		n = 0;
+	}
+
+	close (fd);
+
+	return n;
+}
+#endif
+
+gint
+rspamd_re_cache_compile_hyperscan (struct rspamd_re_cache *cache,
+		const char *cache_dir, gdouble max_time, gboolean silent,
+		guint max_jobs,
+		GError **err)
+{
+	g_assert (cache != NULL);
+	g_assert (cache_dir != NULL);
+
+#ifndef WITH_HYPERSCAN
+	g_set_error (err, rspamd_re_cache_quark (), EINVAL, "hyperscan is disabled");
+	return -1;
+#else
+	GHashTableIter it;
+	gpointer k, v;
+	struct rspamd_re_class *re_class;
+	gchar path[PATH_MAX];
+	gint n, status;
+	gsize total = 0;
+	guint njobs = 0, i;
+	pid_t cld;
+	GPtrArray *pending;
+	gboolean failed = FALSE;
+
+	pending = g_ptr_array_new ();
 	g_hash_table_iter_init (&it, cache->re_classes);
 
 	while (g_hash_table_iter_next (&it, &k, &v)) {
@@ -1568,14 +2265,8 @@ rspamd_re_cache_compile_hyperscan (struct rspamd_re_cache *cache,
 				G_DIR_SEPARATOR, re_class->hash);
 
 		if (rspamd_re_cache_is_valid_hyperscan_file (cache, path, TRUE, TRUE)) {
-
-			fd = open (path, O_RDONLY, 00600);
-
-			/* Read number of regexps */
-			g_assert (fd != -1);
-			lseek (fd, RSPAMD_HS_MAGIC_LEN + sizeof (cache->plt), SEEK_SET);
-			g_assert (read (fd, &n, sizeof (n)) == sizeof (n));
-			close (fd);
+			/* Classes are addressed by hash, so it has not been changed */
+			n = rspamd_re_cache_hyperscan_file_nre (cache, path);
 
 			if (re_class->type_len > 0) {
 				if (!silent) {
@@ -1601,240 +2292,93 @@ rspamd_re_cache_compile_hyperscan (struct rspamd_re_cache *cache,
 			continue;
 		}
 
-		rspamd_snprintf (path, sizeof (path), "%s%c%s.hs.new", cache_dir,
-						G_DIR_SEPARATOR, re_class->hash);
-		fd = open (path, O_CREAT|O_TRUNC|O_EXCL|O_WRONLY, 00600);
-
-		if (fd == -1) {
-			g_set_error (err, rspamd_re_cache_quark (), errno, "cannot open file "
-					"%s: %s", path, strerror (errno));
-			return -1;
-		}
-
-		g_hash_table_iter_init (&cit, re_class->re);
-		n = g_hash_table_size (re_class->re);
-		hs_flags = g_malloc0 (sizeof (*hs_flags) * n);
-		hs_ids = g_malloc (sizeof (*hs_ids) * n);
-		hs_pats = g_malloc (sizeof (*hs_pats) * n);
-		hs_exts = g_malloc0 (sizeof (*hs_exts) * n);
-		i = 0;
-
-		while (g_hash_table_iter_next (&cit, &k, &v)) {
-			re = v;
-
-			pcre_flags = rspamd_regexp_get_pcre_flags (re);
-			re_flags = rspamd_regexp_get_flags (re);
+		g_ptr_array_add (pending, re_class);
+	}
 
-			if (re_flags & RSPAMD_REGEXP_FLAG_PCRE_ONLY) {
-				/* Do not try to compile bad regexp */
-				msg_info_re_cache (
-						"do not try compile %s to hyperscan as it is PCRE only",
-						rspamd_regexp_get_pattern (re));
-				continue;
-			}
+	if (max_jobs <= 1 || pending->len <= 1) {
+		PTR_ARRAY_FOREACH (pending, i, re_class) {
+			if ((n = rspamd_re_cache_compile_class (cache, re_class, cache_dir,
+					max_time, err)) == -1) {
+				g_ptr_array_free (pending, TRUE);
 
-			hs_flags[i] = 0;
-			hs_exts[i] = NULL;
-#ifndef WITH_PCRE2
-			if (pcre_flags & PCRE_FLAG(UTF8)) {
-				hs_flags[i] |= HS_FLAG_UTF8;
-			}
-#else
-			if (pcre_flags & PCRE_FLAG(UTF)) {
-				hs_flags[i] |= HS_FLAG_UTF8;
-			}
-#endif
-			if (pcre_flags & PCRE_FLAG(CASELESS)) {
-				hs_flags[i] |= HS_FLAG_CASELESS;
-			}
-			if (pcre_flags & PCRE_FLAG(MULTILINE)) {
-				hs_flags[i] |= HS_FLAG_MULTILINE;
-			}
-			if (pcre_flags & PCRE_FLAG(DOTALL)) {
-				hs_flags[i] |= HS_FLAG_DOTALL;
-			}
-			if (rspamd_regexp_get_maxhits (re) == 1) {
-				hs_flags[i] |= HS_FLAG_SINGLEMATCH;
+				return -1;
 			}
 
-			if (hs_compile (rspamd_regexp_get_pattern (re),
-					hs_flags[i],
-					cache->vectorized_hyperscan ? HS_MODE_VECTORED : HS_MODE_BLOCK,
-					&cache->plt,
-					&test_db,
-					&hs_errors) != HS_SUCCESS) {
-				msg_info_re_cache ("cannot compile %s to hyperscan, try prefilter match",
-						rspamd_regexp_get_pattern (re));
-				hs_free_compile_error (hs_errors);
-
-				/* The approximation operation might take a significant
-				 * amount of time, so we need to check if it's finite
-				 */
-				if (rspamd_re_cache_is_finite (cache, re, hs_flags[i], max_time)) {
-					hs_flags[i] |= HS_FLAG_PREFILTER;
-					hs_ids[i] = rspamd_regexp_get_cache_id (re);
-					hs_pats[i] = rspamd_regexp_get_pattern (re);
-					i++;
-				}
-			}
-			else {
-				hs_ids[i] = rspamd_regexp_get_cache_id (re);
-				hs_pats[i] = rspamd_regexp_get_pattern (re);
-				i ++;
-				hs_free_database (test_db);
-			}
+			total += n;
 		}
-		/* Adjust real re number */
-		n = i;
-
-		if (n > 0) {
-			/* Create the hs tree */
-			if (hs_compile_ext_multi (hs_pats,
-					hs_flags,
-					hs_ids,
-					hs_exts,
-					n,
-					cache->vectorized_hyperscan ? HS_MODE_VECTORED : HS_MODE_BLOCK,
-					&cache->plt,
-					&test_db,
-					&hs_errors) != HS_SUCCESS) {
-
-				g_set_error (err, rspamd_re_cache_quark (), EINVAL,
-						"cannot create tree of regexp when processing '%s': %s",
-						hs_pats[hs_errors->expression], hs_errors->message);
-				g_free (hs_flags);
-				g_free (hs_ids);
-				g_free (hs_pats);
-				g_free (hs_exts);
-				close (fd);
-				unlink (path);
-				hs_free_compile_error (hs_errors);
 
-				return -1;
-			}
+		g_ptr_array_free (pending, TRUE);
 
-			g_free (hs_pats);
-			g_free (hs_exts);
+		return total;
+	}
 
-			if (hs_serialize_database (test_db, &hs_serialized,
-					&serialized_len) != HS_SUCCESS) {
-				g_set_error (err,
-						rspamd_re_cache_quark (),
-						errno,
-						"cannot serialize tree of regexp for %s",
-						re_class->hash);
+	/*
+	 * Compile classes in separate processes, each of them writes its own
+	 * file, so we just need to wait for them and read the results
+	 */
+	signal (SIGCHLD, SIG_DFL);
 
-				close (fd);
-				unlink (path);
-				g_free (hs_ids);
-				g_free (hs_flags);
-				hs_free_database (test_db);
+	PTR_ARRAY_FOREACH (pending, i, re_class) {
+		if (njobs >= max_jobs) {
+			if (waitpid (-1, &status, 0) > 0) {
+				njobs --;
 
-				return -1;
+				if (!(WIFEXITED (status) && WEXITSTATUS (status) == EXIT_SUCCESS)) {
+					failed = TRUE;
+				}
 			}
+		}
 
-			hs_free_database (test_db);
-
-			/*
-			 * Magic - 8 bytes
-			 * Platform - sizeof (platform)
-			 * n - number of regexps
-			 * n * <regexp ids>
-			 * n * <regexp flags>
-			 * crc - 8 bytes checksum
-			 * <hyperscan blob>
-			 */
-			rspamd_cryptobox_fast_hash_init (&crc_st, 0xdeadbabe);
-			/* IDs -> Flags -> Hs blob */
-			rspamd_cryptobox_fast_hash_update (&crc_st,
-					hs_ids, sizeof (*hs_ids) * n);
-			rspamd_cryptobox_fast_hash_update (&crc_st,
-					hs_flags, sizeof (*hs_flags) * n);
-			rspamd_cryptobox_fast_hash_update (&crc_st,
-					hs_serialized, serialized_len);
-			crc = rspamd_cryptobox_fast_hash_final (&crc_st);
+		cld = fork ();
 
-			if (cache->vectorized_hyperscan) {
-				iov[0].iov_base = (void *) rspamd_hs_magic_vector;
-			}
-			else {
-				iov[0].iov_base = (void *) rspamd_hs_magic;
+		if (cld == -1) {
+			msg_err_re_cache ("cannot fork compiler process: %s",
+					strerror (errno));
+			failed = TRUE;
+			break;
+		}
+		else if (cld == 0) {
+			GError *cld_err = NULL;
+
+			if (rspamd_re_cache_compile_class (cache, re_class, cache_dir,
+					max_time, &cld_err) == -1) {
+				msg_err_re_cache ("cannot compile class %s: %e",
+						re_class->hash, cld_err);
+				_exit (EXIT_FAILURE);
 			}
 
-			iov[0].iov_len = RSPAMD_HS_MAGIC_LEN;
-			iov[1].iov_base = &cache->plt;
-			iov[1].iov_len = sizeof (cache->plt);
-			iov[2].iov_base = &n;
-			iov[2].iov_len = sizeof (n);
-			iov[3].iov_base = hs_ids;
-			iov[3].iov_len = sizeof (*hs_ids) * n;
-			iov[4].iov_base = hs_flags;
-			iov[4].iov_len = sizeof (*hs_flags) * n;
-			iov[5].iov_base = &crc;
-			iov[5].iov_len = sizeof (crc);
-			iov[6].iov_base = hs_serialized;
-			iov[6].iov_len = serialized_len;
-
-			if (writev (fd, iov, G_N_ELEMENTS (iov)) == -1) {
-				g_set_error (err,
-						rspamd_re_cache_quark (),
-						errno,
-						"cannot serialize tree of regexp to %s: %s",
-						path, strerror (errno));
-				close (fd);
-				unlink (path);
-				g_free (hs_ids);
-				g_free (hs_flags);
-				g_free (hs_serialized);
-
-				return -1;
-			}
+			_exit (EXIT_SUCCESS);
+		}
 
-			if (re_class->type_len > 0) {
-				msg_info_re_cache (
-						"compiled class %s(%*s) to cache %6s, %d regexps",
-						rspamd_re_cache_type_to_string (re_class->type),
-						(gint) re_class->type_len - 1,
-						re_class->type_data,
-						re_class->hash,
-						n);
-			}
-			else {
-				msg_info_re_cache (
-						"compiled class %s to cache %6s, %d regexps",
-						rspamd_re_cache_type_to_string (re_class->type),
-						re_class->hash,
-						n);
-			}
+		njobs ++;
+	}
 
-			total += n;
+	while (njobs > 0 && waitpid (-1, &status, 0) > 0) {
+		njobs --;
 
-			g_free (hs_serialized);
-			g_free (hs_ids);
-			g_free (hs_flags);
+		if (!(WIFEXITED (status) && WEXITSTATUS (status) == EXIT_SUCCESS)) {
+			failed = TRUE;
 		}
+	}
 
-		fsync (fd);
-
-		/* Now rename temporary file to the new .hs file */
-		rspamd_snprintf (npath, sizeof (path), "%s%c%s.hs", cache_dir,
-				G_DIR_SEPARATOR, re_class->hash);
+	signal (SIGCHLD, SIG_IGN);
 
-		if (rename (path, npath) == -1) {
-			g_set_error (err,
-					rspamd_re_cache_quark (),
-					errno,
-					"cannot rename %s to %s: %s",
-					path, npath, strerror (errno));
-			unlink (path);
-			close (fd);
+	if (failed) {
+		g_set_error (err, rspamd_re_cache_quark (), EINVAL,
+				"cannot compile some of hyperscan classes, see log for details");
+		g_ptr_array_free (pending, TRUE);
 
-			return -1;
-		}
+		return -1;
+	}
 
-		close (fd);
+	PTR_ARRAY_FOREACH (pending, i, re_class) {
+		rspamd_snprintf (path, sizeof (path), "%s%c%s.hs", cache_dir,
+				G_DIR_SEPARATOR, re_class->hash);
+		total += rspamd_re_cache_hyperscan_file_nre (cache, path);
 	}
 
+	g_ptr_array_free (pending, TRUE);
+
 	return total;
 #endif
 }
@@ -2014,6 +2558,143 @@ rspamd_re_cache_is_valid_hyperscan_file (struct rspamd_re_cache *cache,
 #endif
 }
 
+#ifdef WITH_HYPERSCAN
+static gboolean
+rspamd_re_cache_open_shared_db (struct rspamd_re_cache *cache,
+		struct rspamd_re_class *re_class,
+		const gchar *path,
+		guint64 crc,
+		gsize db_len)
+{
+	struct rspamd_hs_map_header hdr;
+	struct stat st;
+	gpointer map;
+	gint fd;
+
+	fd = open (path, O_RDONLY);
+
+	if (fd == -1) {
+		return FALSE;
+	}
+
+	if (fstat (fd, &st) == -1 ||
+			st.st_size != (goffset)(sizeof (hdr) + db_len) ||
+			read (fd, &hdr, sizeof (hdr)) != sizeof (hdr) ||
+			memcmp (hdr.magic, rspamd_hs_map_magic, sizeof (hdr.magic)) != 0 ||
+			hdr.crc != crc || hdr.db_len != db_len) {
+		close (fd);
+
+		return FALSE;
+	}
+
+	map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+
+	if (map == MAP_FAILED) {
+		msg_err_re_cache ("cannot mmap %s: %s", path, strerror (errno));
+
+		return FALSE;
+	}
+
+	re_class->hs_map = map;
+	re_class->hs_map_len = st.st_size;
+	re_class->hs_db = (hs_database_t *)(((guchar *)map) + sizeof (hdr));
+
+	return TRUE;
+}
+
+/*
+ * Deserializes database to a file in the cache dir (once for all workers) and
+ * maps it read only, so all workers share the same pages of the page cache
+ */
+static gboolean
+rspamd_re_cache_map_shared_db (struct rspamd_re_cache *cache,
+		struct rspamd_re_class *re_class,
+		const gchar *hs_path,
+		const guchar *serialized,
+		gsize serialized_len,
+		guint64 crc)
+{
+	gchar path[PATH_MAX], tmppath[PATH_MAX];
+	struct rspamd_hs_map_header *hdr;
+	gsize db_len;
+	gpointer map;
+	gint fd, ret;
+
+	if ((ret = hs_serialized_database_size (serialized, serialized_len,
+			&db_len)) != HS_SUCCESS) {
+		msg_err_re_cache ("bad hs database in %s: %d", hs_path, ret);
+
+		return FALSE;
+	}
+
+	rspamd_snprintf (path, sizeof (path), "%smap", hs_path);
+
+	if (rspamd_re_cache_open_shared_db (cache, re_class, path, crc, db_len)) {
+		msg_debug_re_cache ("use shared hyperscan image '%s'", path);
+
+		return TRUE;
+	}
+
+	/* Create a new image and atomically replace the old one */
+	rspamd_snprintf (tmppath, sizeof (tmppath), "%s.%P.tmp", path, getpid ());
+	fd = rspamd_file_xopen (tmppath, O_CREAT|O_TRUNC|O_EXCL|O_RDWR, 00644, 0);
+
+	if (fd == -1) {
+		msg_err_re_cache ("cannot create file %s: %s", tmppath, strerror (errno));
+
+		return FALSE;
+	}
+
+	if (ftruncate (fd, sizeof (*hdr) + db_len) == -1) {
+		msg_err_re_cache ("cannot truncate file %s: %s", tmppath,
+				strerror (errno));
+		close (fd);
+		unlink (tmppath);
+
+		return FALSE;
+	}
+
+	map = mmap (NULL, sizeof (*hdr) + db_len, PROT_READ|PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	close (fd);
+
+	if (map == MAP_FAILED) {
+		msg_err_re_cache ("cannot mmap %s: %s", tmppath, strerror (errno));
+		unlink (tmppath);
+
+		return FALSE;
+	}
+
+	hdr = map;
+	memcpy (hdr->magic, rspamd_hs_map_magic, sizeof (hdr->magic));
+	hdr->crc = crc;
+	hdr->db_len = db_len;
+
+	if ((ret = hs_deserialize_database_at (serialized, serialized_len,
+			(hs_database_t *)(((guchar *)map) + sizeof (*hdr)))) != HS_SUCCESS) {
+		msg_err_re_cache ("bad hs database in %s: %d", hs_path, ret);
+		munmap (map, sizeof (*hdr) + db_len);
+		unlink (tmppath);
+
+		return FALSE;
+	}
+
+	munmap (map, sizeof (*hdr) + db_len);
+
+	if (rename (tmppath, path) == -1) {
+		msg_err_re_cache ("cannot rename %s -> %s: %s", tmppath, path,
+				strerror (errno));
+		unlink (tmppath);
+
+		return FALSE;
+	}
+
+	msg_debug_re_cache ("created shared hyperscan image '%s'", path);
+
+	return rspamd_re_cache_open_shared_db (cache, re_class, path, crc, db_len);
+}
+#endif
 
 gboolean
 rspamd_re_cache_load_hyperscan (struct rspamd_re_cache *cache,
@@ -2029,6 +2710,7 @@ rspamd_re_cache_load_hyperscan (struct rspamd_re_cache *cache,
 	gint fd, i, n, *hs_ids = NULL, *hs_flags = NULL, total = 0, ret;
 	GHashTableIter it;
 	gpointer k, v;
+	guint64 crc;
 	guint8 *map, *p, *end;
 	struct rspamd_re_class *re_class;
 	struct rspamd_re_cache_elt *elt;
@@ -2091,7 +2773,10 @@ rspamd_re_cache_load_hyperscan (struct rspamd_re_cache *cache,
 				hs_free_scratch (re_class->hs_scratch);
 			}
 
-			if (re_class->hs_db != NULL) {
+			if (re_class->hs_map != NULL) {
+				munmap (re_class->hs_map, re_class->hs_map_len);
+			}
+			else if (re_class->hs_db != NULL) {
 				hs_free_database (re_class->hs_db);
 			}
 
@@ -2102,8 +2787,21 @@ rspamd_re_cache_load_hyperscan (struct rspamd_re_cache *cache,
 			re_class->hs_ids = NULL;
 			re_class->hs_scratch = NULL;
 			re_class->hs_db = NULL;
+			re_class->hs_map = NULL;
+			re_class->hs_map_len = 0;
+
+			if (cache->shared_hyperscan) {
+				memcpy (&crc, p - sizeof (guint64), sizeof (crc));
+
+				if (!rspamd_re_cache_map_shared_db (cache, re_class, path,
+						p, end - p, crc)) {
+					msg_info_re_cache ("cannot use shared database image for "
+							"'%s', load it to the private memory", path);
+				}
+			}
 
-			if ((ret = hs_deserialize_database (p, end - p, &re_class->hs_db))
+			if (re_class->hs_db == NULL &&
+					(ret = hs_deserialize_database (p, end - p, &re_class->hs_db))
 					!= HS_SUCCESS) {
 				msg_err_re_cache ("bad hs database in %s: %d", path, ret);
 				munmap (map, st.st_size);
@@ -18,6 +18,7 @@
 
 #include "config.h"
 #include "libutil/regexp.h"
+#include "ucl.h"
 
 struct rspamd_re_cache;
 struct rspamd_re_runtime;
@@ -46,6 +47,9 @@ struct rspamd_re_cache_stat {
 	guint regexp_matched;
 	guint regexp_total;
 	guint regexp_fast_cached;
+	guint inputs_reused;
+	guint regexp_deferred;
+	guint inputs_prefiltered;
 };
 
 /**
@@ -100,6 +104,42 @@ struct rspamd_re_runtime* rspamd_re_cache_runtime_new (struct rspamd_re_cache *c
 const struct rspamd_re_cache_stat *
 		rspamd_re_cache_get_stat (struct rspamd_re_runtime *rt);
 
+/**
+ * Returns an array of regexps sorted by the total pcre execution cost
+ * accumulated by all workers
+ * @param cache
+ * @param limit maximum number of elements (0 means no limit)
+ */
+ucl_object_t *rspamd_re_cache_costs (struct rspamd_re_cache *cache,
+		guint limit);
+
+/**
+ * Describes a regexp registered in the cache
+ */
+struct rspamd_re_cache_elt_info {
+	rspamd_regexp_t *re;
+	enum rspamd_re_type type;
+	gconstpointer type_data;
+	gsize type_len;
+	const gchar *class_hash;
+	gboolean hyperscan;
+	gboolean prefilter;
+	gsize scratch_size;
+};
+
+typedef void (*rspamd_re_cache_elt_cb) (
+		const struct rspamd_re_cache_elt_info *info, gpointer ud);
+
+/**
+ * Calls `cb` for each regexp in the cache in order of their cache ids,
+ * `scratch_size` is the size of hyperscan scratch of the regexp's class
+ * @param cache
+ * @param cb
+ * @param ud
+ */
+void rspamd_re_cache_foreach (struct rspamd_re_cache *cache,
+		rspamd_re_cache_elt_cb cb, gpointer ud);
+
 /**
  * Process regexp runtime and return the result for a specific regexp
  * @param task task object
@@ -153,10 +193,13 @@ const gchar * rspamd_re_cache_type_to_string (enum rspamd_re_type type);
 enum rspamd_re_type rspamd_re_cache_type_from_string (const char *str);
 
 /**
- * Compile expressions to the hyperscan tree and store in the `cache_dir`
+ * Compile expressions to the hyperscan tree and store in the `cache_dir`.
+ * Classes that have not been changed are not recompiled, others are compiled
+ * by up to `max_jobs` processes in parallel
  */
 gint rspamd_re_cache_compile_hyperscan (struct rspamd_re_cache *cache,
 		const char *cache_dir, gdouble max_time, gboolean silent,
+		guint max_jobs,
 		GError **err);
 
 
@@ -23,6 +23,7 @@
 #include "contrib/hiredis/adapters/libevent.h"
 #include "cryptobox.h"
 #include "logger.h"
+#include "timer_wheel.h"
 
 struct rspamd_redis_pool_elt;
 
@@ -30,8 +31,13 @@ struct rspamd_redis_pool_connection {
 	struct redisAsyncContext *ctx;
 	struct rspamd_redis_pool_elt *elt;
 	GList *entry;
-	struct event timeout;
+	struct rspamd_wheel_timer timeout;
 	gboolean active;
+	/* Shared connections are multiplexed between many requests */
+	gboolean shared;
+	gboolean draining;
+	guint pending;
+	guint abandoned;
 	gchar tag[MEMPOOL_UID_LEN];
 	ref_entry_t ref;
 };
@@ -41,6 +47,14 @@ struct rspamd_redis_pool_elt {
 	guint64 key;
 	GQueue *active;
 	GQueue *inactive;
+	GQueue *shared;
+};
+
+struct rspamd_redis_pool_request {
+	struct rspamd_redis_pool_connection *conn;
+	rspamd_redis_pool_cb cb;
+	gpointer ud;
+	gboolean abandoned;
 };
 
 struct rspamd_redis_pool {
@@ -50,10 +64,14 @@ struct rspamd_redis_pool {
 	GHashTable *elts_by_ctx;
 	gdouble timeout;
 	guint max_conns;
+	guint max_shared_conns;
+	guint max_shared_pending;
 };
 
 static const gdouble default_timeout = 10.0;
 static const guint default_max_conns = 100;
+static const guint default_max_shared_conns = 4;
+static const guint default_max_shared_pending = 64;
 
 #define msg_err_rpool(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
 		"redis_pool", conn->tag, \
@@ -99,7 +117,15 @@ rspamd_redis_pool_get_key (const gchar *db, const gchar *password,
 static void
 rspamd_redis_pool_conn_dtor (struct rspamd_redis_pool_connection *conn)
 {
-	if (conn->active) {
+	if (conn->shared) {
+		msg_debug_rpool ("shared connection removed");
+
+		rspamd_wheel_timer_del (&conn->timeout);
+
+		/* Context is always detached before the last reference is released */
+		g_assert (conn->ctx == NULL);
+	}
+	else if (conn->active) {
 		msg_debug_rpool ("active connection removed");
 
 		if (conn->ctx) {
@@ -120,9 +146,7 @@ rspamd_redis_pool_conn_dtor (struct rspamd_redis_pool_connection *conn)
 	else {
 		msg_debug_rpool ("inactive connection removed");
 
-		if (rspamd_event_pending (&conn->timeout, EV_TIMEOUT)) {
-			event_del (&conn->timeout);
-		}
+		rspamd_wheel_timer_del (&conn->timeout);
 
 		if (conn->ctx && !(conn->ctx->c.flags & REDIS_FREEING)) {
 			redisAsyncContext *ac = conn->ctx;
@@ -148,6 +172,9 @@ rspamd_redis_pool_conn_dtor (struct rspamd_redis_pool_connection *conn)
 	g_free (conn);
 }
 
+static void rspamd_redis_pool_shared_close (
+		struct rspamd_redis_pool_connection *conn);
+
 static void
 rspamd_redis_pool_elt_dtor (gpointer p)
 {
@@ -155,6 +182,11 @@ rspamd_redis_pool_elt_dtor (gpointer p)
 	struct rspamd_redis_pool_elt *elt = p;
 	struct rspamd_redis_pool_connection *c;
 
+	while (elt->shared->head != NULL) {
+		/* Unlinks connection from the queue */
+		rspamd_redis_pool_shared_close (elt->shared->head->data);
+	}
+
 	for (cur = elt->active->head; cur != NULL; cur = g_list_next (cur)) {
 		c = cur->data;
 		c->entry = NULL;
@@ -169,11 +201,12 @@ rspamd_redis_pool_elt_dtor (gpointer p)
 
 	g_queue_free (elt->active);
 	g_queue_free (elt->inactive);
+	g_queue_free (elt->shared);
 	g_free (elt);
 }
 
 static void
-rspamd_redis_conn_timeout (gint fd, short what, gpointer p)
+rspamd_redis_conn_timeout (gpointer p)
 {
 	struct rspamd_redis_pool_connection *conn = p;
 
@@ -186,7 +219,6 @@ rspamd_redis_conn_timeout (gint fd, short what, gpointer p)
 static void
 rspamd_redis_pool_schedule_timeout (struct rspamd_redis_pool_connection *conn)
 {
-	struct timeval tv;
 	gdouble real_timeout;
 	guint active_elts;
 
@@ -203,10 +235,10 @@ rspamd_redis_pool_schedule_timeout (struct rspamd_redis_pool_connection *conn)
 
 	msg_debug_rpool ("scheduled connection %p cleanup in %.1f seconds",
 			conn->ctx, real_timeout);
-	double_to_tv (real_timeout, &tv);
-	event_set (&conn->timeout, -1, EV_TIMEOUT, rspamd_redis_conn_timeout, conn);
-	event_base_set (conn->elt->pool->ev_base, &conn->timeout);
-	event_add (&conn->timeout, &tv);
+	rspamd_wheel_timer_del (&conn->timeout);
+	rspamd_wheel_timer_init (&conn->timeout, rspamd_redis_conn_timeout, conn);
+	rspamd_wheel_timer_add (rspamd_timer_wheel_get (conn->elt->pool->ev_base),
+			&conn->timeout, real_timeout);
 }
 
 static void
@@ -220,6 +252,22 @@ rspamd_redis_pool_on_disconnect (const struct redisAsyncContext *ac, int status,
 	 * so, we need to do something very clever about it
 	 */
 
+	if (conn->shared) {
+		/* All pending requests have been already called with no reply */
+		if (conn->ctx) {
+			msg_debug_rpool ("shared connection terminated: %s",
+					conn->ctx->errstr);
+			g_hash_table_remove (conn->elt->pool->elts_by_ctx, conn->ctx);
+			conn->ctx = NULL;
+			g_queue_unlink (conn->elt->shared, conn->entry);
+			g_list_free (conn->entry);
+			conn->entry = NULL;
+			REF_RELEASE (conn);
+		}
+
+		return;
+	}
+
 	if (!conn->active) {
 		/* Do nothing for active connections as it is already handled somewhere */
 		if (conn->ctx) {
@@ -296,6 +344,7 @@ rspamd_redis_pool_new_elt (struct rspamd_redis_pool *pool)
 	elt = g_malloc0 (sizeof (*elt));
 	elt->active = g_queue_new ();
 	elt->inactive = g_queue_new ();
+	elt->shared = g_queue_new ();
 	elt->pool = pool;
 
 	return elt;
@@ -325,6 +374,8 @@ rspamd_redis_pool_config (struct rspamd_redis_pool *pool,
 	pool->cfg = cfg;
 	pool->timeout = default_timeout;
 	pool->max_conns = default_max_conns;
+	pool->max_shared_conns = default_max_shared_conns;
+	pool->max_shared_pending = default_max_shared_pending;
 }
 
 
@@ -352,7 +403,7 @@ rspamd_redis_pool_connect (struct rspamd_redis_pool *pool,
 			g_assert (!conn->active);
 
 			if (conn->ctx->err == REDIS_OK) {
-				event_del (&conn->timeout);
+				rspamd_wheel_timer_del (&conn->timeout);
 				conn->active = TRUE;
 				g_queue_push_tail_link (elt->active, conn_entry);
 				msg_debug_rpool ("reused existing connection to %s:%d: %p",
@@ -393,6 +444,197 @@ rspamd_redis_pool_connect (struct rspamd_redis_pool *pool,
 }
 
 
+/* Closes shared connection, requests pending are called with no reply */
+static void
+rspamd_redis_pool_shared_close (struct rspamd_redis_pool_connection *conn)
+{
+	redisAsyncContext *ac = conn->ctx;
+
+	if (conn->entry) {
+		g_queue_unlink (conn->elt->shared, conn->entry);
+		g_list_free (conn->entry);
+		conn->entry = NULL;
+	}
+
+	if (ac) {
+		msg_debug_rpool ("close shared connection %p", ac);
+		conn->ctx = NULL;
+		g_hash_table_remove (conn->elt->pool->elts_by_ctx, ac);
+		ac->onDisconnect = NULL;
+
+		/* Requests hold their own references, so conn is alive here */
+		if (!(ac->c.flags & REDIS_FREEING)) {
+			redisAsyncFree (ac);
+		}
+	}
+
+	REF_RELEASE (conn);
+}
+
+static void
+rspamd_redis_shared_conn_timeout (gpointer p)
+{
+	struct rspamd_redis_pool_connection *conn = p;
+
+	if (conn->pending == 0) {
+		msg_debug_rpool ("scheduled removal of idle shared connection %p",
+				conn->ctx);
+		rspamd_redis_pool_shared_close (conn);
+	}
+}
+
+static void
+rspamd_redis_pool_shared_cb (redisAsyncContext *ac, gpointer r, gpointer priv)
+{
+	struct rspamd_redis_pool_request *req = priv;
+	struct rspamd_redis_pool_connection *conn = req->conn;
+
+	conn->pending --;
+
+	if (req->abandoned) {
+		conn->abandoned --;
+	}
+	else {
+		req->cb (ac, r, req->ud);
+	}
+
+	g_free (req);
+
+	if (conn->ctx && conn->pending == 0 && conn->ctx->err == REDIS_OK) {
+		if (conn->draining) {
+			rspamd_redis_pool_shared_close (conn);
+		}
+		else if (!rspamd_wheel_timer_pending (&conn->timeout)) {
+			rspamd_wheel_timer_init (&conn->timeout,
+					rspamd_redis_shared_conn_timeout, conn);
+			rspamd_wheel_timer_add (
+					rspamd_timer_wheel_get (conn->elt->pool->ev_base),
+					&conn->timeout,
+					rspamd_time_jitter (conn->elt->pool->timeout,
+							conn->elt->pool->timeout / 2.0));
+		}
+	}
+
+	REF_RELEASE (conn);
+}
+
+struct redisAsyncContext*
+rspamd_redis_pool_connect_shared (struct rspamd_redis_pool *pool,
+		const gchar *db, const gchar *password,
+		const char *ip, int port)
+{
+	guint64 key;
+	struct rspamd_redis_pool_elt *elt;
+	struct rspamd_redis_pool_connection *conn, *best = NULL;
+	GList *cur;
+	guint nusable = 0;
+
+	g_assert (pool != NULL);
+	g_assert (pool->ev_base != NULL);
+	g_assert (ip != NULL);
+
+	key = rspamd_redis_pool_get_key (db, password, ip, port);
+	elt = g_hash_table_lookup (pool->elts_by_key, &key);
+
+	if (elt == NULL) {
+		elt = rspamd_redis_pool_new_elt (pool);
+		elt->key = key;
+		g_hash_table_insert (pool->elts_by_key, &elt->key, elt);
+	}
+
+	for (cur = elt->shared->head; cur != NULL; cur = g_list_next (cur)) {
+		conn = cur->data;
+
+		if (conn->draining || conn->ctx->err != REDIS_OK) {
+			continue;
+		}
+
+		nusable ++;
+
+		if (conn->pending < pool->max_shared_pending &&
+				(best == NULL || conn->pending < best->pending)) {
+			best = conn;
+		}
+	}
+
+	/* Requests are spread over up to `max_shared_conns` connections */
+	if ((best == NULL || best->pending > 0) &&
+			nusable < pool->max_shared_conns) {
+		conn = rspamd_redis_pool_new_connection (pool, elt,
+				db, password, ip, port);
+
+		if (conn) {
+			g_queue_unlink (elt->active, conn->entry);
+			g_queue_push_tail_link (elt->shared, conn->entry);
+			conn->shared = TRUE;
+			best = conn;
+		}
+	}
+
+	if (best == NULL) {
+		/* All shared connections are busy */
+		return NULL;
+	}
+
+	rspamd_wheel_timer_del (&best->timeout);
+
+	REF_RETAIN (best);
+
+	return best->ctx;
+}
+
+struct rspamd_redis_pool_request *
+rspamd_redis_pool_shared_command (struct rspamd_redis_pool *pool,
+		struct redisAsyncContext *ctx,
+		rspamd_redis_pool_cb cb, gpointer ud,
+		gint argc, const gchar **argv, const gsize *argvlen)
+{
+	struct rspamd_redis_pool_connection *conn;
+	struct rspamd_redis_pool_request *req;
+
+	conn = g_hash_table_lookup (pool->elts_by_ctx, ctx);
+	g_assert (conn != NULL && conn->shared);
+
+	req = g_malloc0 (sizeof (*req));
+	req->conn = conn;
+	req->cb = cb;
+	req->ud = ud;
+
+	if (redisAsyncCommandArgv (ctx, rspamd_redis_pool_shared_cb, req,
+			argc, argv, argvlen) != REDIS_OK) {
+		g_free (req);
+
+		return NULL;
+	}
+
+	conn->pending ++;
+	REF_RETAIN (conn);
+
+	return req;
+}
+
+void
+rspamd_redis_pool_abandon_request (struct rspamd_redis_pool_request *req)
+{
+	struct rspamd_redis_pool_connection *conn = req->conn;
+
+	if (req->abandoned) {
+		return;
+	}
+
+	req->abandoned = TRUE;
+	conn->abandoned ++;
+	/* Server is slow or broken, so new requests should use another connection */
+	conn->draining = TRUE;
+
+	if (conn->ctx && conn->abandoned == conn->pending) {
+		/* Nobody waits for replies on this connection */
+		REF_RETAIN (conn);
+		rspamd_redis_pool_shared_close (conn);
+		REF_RELEASE (conn);
+	}
+}
+
 void
 rspamd_redis_pool_release_connection (struct rspamd_redis_pool *pool,
 		struct redisAsyncContext *ctx, gboolean is_fatal)
@@ -403,7 +645,15 @@ rspamd_redis_pool_release_connection (struct rspamd_redis_pool *pool,
 	g_assert (ctx != NULL);
 
 	conn = g_hash_table_lookup (pool->elts_by_ctx, ctx);
-	if (conn != NULL) {
+	if (conn != NULL && conn->shared) {
+		if (is_fatal) {
+			conn->draining = TRUE;
+		}
+
+		/* Drop the user reference only, requests hold their own ones */
+		REF_RELEASE (conn);
+	}
+	else if (conn != NULL) {
 		g_assert (conn->active);
 
 		if (is_fatal || ctx->err != REDIS_OK) {
@@ -53,6 +53,48 @@ struct redisAsyncContext* rspamd_redis_pool_connect (
 		const gchar *db, const gchar *password,
 		const char *ip, int port);
 
+/**
+ * Returns a connection shared by many concurrent requests, commands sent
+ * over it are pipelined. Returns NULL if all shared connections have too
+ * many requests pending, so a dedicated connection should be used instead.
+ * Connection must be released by `rspamd_redis_pool_release_connection`
+ * @param pool
+ * @param db
+ * @param password
+ * @param ip
+ * @param port
+ * @return
+ */
+struct redisAsyncContext* rspamd_redis_pool_connect_shared (
+		struct rspamd_redis_pool *pool,
+		const gchar *db, const gchar *password,
+		const char *ip, int port);
+
+struct rspamd_redis_pool_request;
+typedef void (*rspamd_redis_pool_cb) (struct redisAsyncContext *ac,
+		gpointer reply, gpointer ud);
+
+/**
+ * Sends command over a shared connection
+ * @param pool
+ * @param ctx shared connection
+ * @param cb callback for reply, it is not called for abandoned requests
+ * @param ud
+ * @return request or NULL if command cannot be sent
+ */
+struct rspamd_redis_pool_request* rspamd_redis_pool_shared_command (
+		struct rspamd_redis_pool *pool,
+		struct redisAsyncContext *ctx,
+		rspamd_redis_pool_cb cb, gpointer ud,
+		gint argc, const gchar **argv, const gsize *argvlen);
+
+/**
+ * Abandons request (e.g. on timeout), so its reply is silently dropped.
+ * Request must not be used after this call
+ * @param req
+ */
+void rspamd_redis_pool_abandon_request (struct rspamd_redis_pool_request *req);
+
 /**
  * Release a connection to the pool
  * @param pool
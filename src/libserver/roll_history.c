@@ -17,9 +17,48 @@
 #include "rspamd.h"
 #include "lua/lua_common.h"
 #include "unix-std.h"
+#include <math.h>
 
 static const gchar rspamd_history_magic_old[] = {'r', 's', 'h', '1'};
 
+#define HISTORY_REC_PAD (1u << 0)
+/* Symbol is stored by name in the strings area, the rest is an offset */
+#define HISTORY_SYM_INLINE (1u << 31)
+#define HISTORY_ALIGN(x) (((x) + 7) & ~((gsize)7))
+
+struct roll_history_ring {
+	gint owner;   /* pid of the single writer */
+	guint head;   /* end of the written data, grows monotonically */
+	guint tail;   /* start of the oldest record, grows monotonically */
+	guchar *data;
+};
+
+/*
+ * Records are aligned to 8 bytes and consist of this header followed by
+ * `nsymbols` elements of `roll_history_rec_sym` and `strings_len` bytes of
+ * zero terminated strings: message id, user, from address and names of
+ * symbols that are not known by the symbols cache
+ */
+struct roll_history_rec {
+	guint32 len;
+	guint32 flags;
+	guint64 cksum;
+	gdouble time;
+	gdouble scan_time;
+	gdouble score;
+	gdouble required_score;
+	guint64 size;
+	gint32 action;
+	guint32 nsymbols;
+	guint32 strings_len;
+	guint32 unused;
+};
+
+struct roll_history_rec_sym {
+	guint32 id;
+	gfloat score;
+};
+
 /**
  * Returns new roll history
  * @param pool pool for shared memory
@@ -30,7 +69,11 @@ rspamd_roll_history_new (rspamd_mempool_t *pool, guint max_rows,
 		struct rspamd_config *cfg)
 {
 	struct roll_history *history;
+	struct rspamd_worker_conf *wcf;
 	lua_State *L = cfg->lua_state;
+	guint nworkers = 0, i;
+	guint64 ring_size, pow2;
+	GList *cur;
 
 	if (pool == NULL || max_rows == 0) {
 		return NULL;
@@ -57,35 +100,245 @@ rspamd_roll_history_new (rspamd_mempool_t *pool, guint max_rows,
 	lua_pop (L, 1);
 
 	if (!history->disabled) {
-		history->rows = rspamd_mempool_alloc0_shared (pool,
-				sizeof (struct roll_history_row) * max_rows);
-		history->nrows = max_rows;
+		for (cur = cfg->workers; cur != NULL; cur = g_list_next (cur)) {
+			wcf = cur->data;
+
+			if (wcf->enabled) {
+				nworkers += MAX (wcf->count, 1);
+			}
+		}
+
+		nworkers = MAX (nworkers, 1);
+		/* Split rows between workers, size must be a power of two */
+		ring_size = (guint64)max_rows * HISTORY_ROW_AVG_SIZE / nworkers;
+		pow2 = HISTORY_MIN_RING_SIZE;
+
+		while (pow2 < ring_size && pow2 < G_MAXINT32) {
+			pow2 <<= 1;
+		}
+
+		/* Prefer smaller ring if it is closer to the requested size */
+		if (pow2 > HISTORY_MIN_RING_SIZE && pow2 - ring_size > ring_size - pow2 / 2) {
+			pow2 >>= 1;
+		}
+
+		/*
+		 * The first ring is used by the main process to load saved history,
+		 * we also reserve a couple of rings for workers being respawned
+		 */
+		history->nrings = nworkers + 3;
+		history->ring_size = pow2;
+		history->rings = rspamd_mempool_alloc0_shared (pool,
+				sizeof (struct roll_history_ring) * history->nrings);
+
+		for (i = 0; i < history->nrings; i ++) {
+			history->rings[i].data = rspamd_mempool_alloc_shared (pool,
+					history->ring_size);
+		}
+
+		history->rings[0].owner = getpid ();
 	}
 
 	return history;
 }
 
-struct history_metric_callback_data {
-	gchar *pos;
-	gint remain;
-};
+/*
+ * Returns a ring owned by the current process, claiming a free ring or a ring
+ * of a dead worker if needed
+ */
+static struct roll_history_ring *
+rspamd_roll_history_get_ring (struct roll_history *history)
+{
+	static struct roll_history_ring *cur_ring = NULL;
+	static pid_t cur_pid = 0;
+	struct roll_history_ring *ring;
+	pid_t pid = getpid ();
+	gint owner;
+	guint i;
+
+	if (cur_ring != NULL && cur_pid == pid &&
+			g_atomic_int_get (&cur_ring->owner) == pid) {
+		return cur_ring;
+	}
+
+	cur_ring = NULL;
+	cur_pid = pid;
+
+	for (i = 1; i < history->nrings; i ++) {
+		ring = &history->rings[i];
+		owner = g_atomic_int_get (&ring->owner);
+
+		if (owner == pid) {
+			cur_ring = ring;
+			break;
+		}
+
+		if (owner == 0 || (kill (owner, 0) == -1 && errno == ESRCH)) {
+			if (g_atomic_int_compare_and_exchange (&ring->owner, owner, pid)) {
+				cur_ring = ring;
+				break;
+			}
+		}
+	}
+
+	if (cur_ring == NULL) {
+		msg_debug ("no free history rings for process %P", pid);
+	}
+
+	return cur_ring;
+}
+
+/*
+ * Appends record to the ring, must be called by the ring owner only
+ */
+static void
+rspamd_roll_history_ring_push (struct roll_history *history,
+		struct roll_history_ring *ring, const guchar *rec, guint32 len)
+{
+	struct roll_history_rec pad_hdr;
+	guint head, tail, pos, pad = 0, new_head;
+	guint32 cur_len;
+
+	head = g_atomic_int_get (&ring->head);
+	tail = g_atomic_int_get (&ring->tail);
+	pos = head & (history->ring_size - 1);
+
+	if (pos + len > history->ring_size) {
+		/* Record cannot be split, so we fill the rest of the ring */
+		pad = history->ring_size - pos;
+	}
+
+	new_head = head + pad + len;
+
+	/* Drop the oldest records to free enough space */
+	while (new_head - tail > history->ring_size) {
+		memcpy (&cur_len, ring->data + (tail & (history->ring_size - 1)),
+				sizeof (cur_len));
+
+		if (cur_len < sizeof (guint32) * 2) {
+			/* Should not happen, but we cannot continue with broken ring */
+			tail = head;
+			break;
+		}
+
+		tail += cur_len;
+	}
+
+	/* Readers must see the new tail before we overwrite anything */
+	g_atomic_int_set (&ring->tail, tail);
+
+	if (pad > 0) {
+		memset (&pad_hdr, 0, sizeof (pad_hdr));
+		pad_hdr.len = pad;
+		pad_hdr.flags = HISTORY_REC_PAD;
+		memcpy (ring->data + pos, &pad_hdr, MIN (pad, sizeof (pad_hdr)));
+	}
+
+	memcpy (ring->data + ((head + pad) & (history->ring_size - 1)), rec, len);
+	g_atomic_int_set (&ring->head, new_head);
+}
+
+static inline gsize
+rspamd_roll_history_add_string (gchar *dst, const gchar *src)
+{
+	gsize len = strlen (src) + 1;
+
+	memcpy (dst, src, len);
+
+	return len;
+}
+
+static void
+rspamd_roll_history_write (struct roll_history *history,
+		struct roll_history_ring *ring,
+		struct rspamd_symcache *cache,
+		const struct roll_history_row *row)
+{
+	struct roll_history_rec rec;
+	struct roll_history_rec_sym sym;
+	guchar *buf, *syms_pos;
+	gchar *strings;
+	gsize buflen, max_len, slen;
+	guint i, nsyms;
+	gint id;
+
+	memset (&rec, 0, sizeof (rec));
+	nsyms = row->nsymbols;
+	/* Records cannot be larger than half of a ring, it is very unlikely */
+	max_len = history->ring_size / 2;
+	buflen = sizeof (rec) + nsyms * sizeof (sym) +
+			strlen (row->message_id) + strlen (row->user) +
+			strlen (row->from_addr) + 3;
+
+	for (i = 0; i < nsyms; i ++) {
+		buflen += strlen (row->symbols[i].name) + 1;
+	}
+
+	buf = g_malloc (buflen + sizeof (guint64));
+	syms_pos = buf + sizeof (rec);
+	strings = (gchar *)(syms_pos + nsyms * sizeof (sym));
+	slen = rspamd_roll_history_add_string (strings, row->message_id);
+	slen += rspamd_roll_history_add_string (strings + slen, row->user);
+	slen += rspamd_roll_history_add_string (strings + slen, row->from_addr);
+
+	for (i = 0; i < nsyms; i ++) {
+		id = cache ? rspamd_symcache_find_symbol (cache, row->symbols[i].name) : -1;
+
+		if (id >= 0) {
+			sym.id = id;
+		}
+		else {
+			sym.id = HISTORY_SYM_INLINE | slen;
+			slen += rspamd_roll_history_add_string (strings + slen,
+					row->symbols[i].name);
+		}
+
+		sym.score = row->symbols[i].score;
+		memcpy (syms_pos + i * sizeof (sym), &sym, sizeof (sym));
+	}
+
+	rec.len = HISTORY_ALIGN (sizeof (rec) + nsyms * sizeof (sym) + slen);
+
+	if (rec.len > max_len) {
+		msg_info ("history row for %s is too large: %ud bytes, skip it",
+				row->message_id, rec.len);
+		g_free (buf);
+
+		return;
+	}
+
+	rec.cksum = cache ? rspamd_symcache_get_cksum (cache) : 0;
+	rec.time = tv_to_double (&row->tv);
+	rec.scan_time = row->scan_time;
+	rec.score = row->score;
+	rec.required_score = row->required_score;
+	rec.size = row->len;
+	rec.action = row->action;
+	rec.nsymbols = nsyms;
+	rec.strings_len = slen;
+	memcpy (buf, &rec, sizeof (rec));
+	/* Zero alignment padding */
+	memset (buf + sizeof (rec) + nsyms * sizeof (sym) + slen, 0,
+			rec.len - (sizeof (rec) + nsyms * sizeof (sym) + slen));
+
+	rspamd_roll_history_ring_push (history, ring, buf, rec.len);
+	g_free (buf);
+}
 
 static void
 roll_history_symbols_callback (gpointer key, gpointer value, void *user_data)
 {
-	struct history_metric_callback_data *cb = user_data;
+	GArray *syms = user_data;
 	struct rspamd_symbol_result *s = value;
-	guint wr;
+	struct roll_history_symbol sym;
 
 	if (s->flags & RSPAMD_SYMBOL_RESULT_IGNORED) {
 		return;
 	}
 
-	if (cb->remain > 0) {
-		wr = rspamd_snprintf (cb->pos, cb->remain, "%s, ", s->name);
-		cb->pos += wr;
-		cb->remain -= wr;
-	}
+	sym.name = s->name;
+	sym.score = s->score;
+	g_array_append_val (syms, sym);
 }
 
 /**
@@ -97,82 +350,364 @@ void
 rspamd_roll_history_update (struct roll_history *history,
 	struct rspamd_task *task)
 {
-	guint row_num;
-	struct roll_history_row *row;
+	struct roll_history_ring *ring;
+	struct roll_history_row row;
 	struct rspamd_metric_result *metric_res;
-	struct history_metric_callback_data cbdata;
+	GArray *syms;
 
 	if (history->disabled) {
 		return;
 	}
 
-	/* First of all obtain check and obtain row number */
-	g_atomic_int_compare_and_exchange (&history->cur_row, history->nrows, 0);
-#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION > 30))
-	row_num = g_atomic_int_add (&history->cur_row, 1);
-#else
-	row_num = g_atomic_int_exchange_and_add (&history->cur_row, 1);
-#endif
+	ring = rspamd_roll_history_get_ring (history);
 
-	if (row_num < history->nrows) {
-		row = &history->rows[row_num];
-		g_atomic_int_set (&row->completed, FALSE);
-	}
-	else {
-		/* Race condition */
-		history->cur_row = 0;
+	if (ring == NULL) {
 		return;
 	}
 
+	memset (&row, 0, sizeof (row));
+
 	/* Add information from task to roll history */
 	if (task->from_addr) {
-		rspamd_strlcpy (row->from_addr,
-				rspamd_inet_address_to_string (task->from_addr),
-				sizeof (row->from_addr));
+		row.from_addr = rspamd_inet_address_to_string (task->from_addr);
 	}
 	else {
-		rspamd_strlcpy (row->from_addr, "unknown", sizeof (row->from_addr));
+		row.from_addr = "unknown";
 	}
 
-	memcpy (&row->tv, &task->tv, sizeof (row->tv));
-
-	/* Strings */
-	rspamd_strlcpy (row->message_id, task->message_id,
-		sizeof (row->message_id));
-	if (task->user) {
-		rspamd_strlcpy (row->user, task->user, sizeof (row->user));
-	}
-	else {
-		row->user[0] = '\0';
-	}
+	memcpy (&row.tv, &task->tv, sizeof (row.tv));
+	row.message_id = task->message_id ? task->message_id : "";
+	row.user = task->user ? task->user : "";
 
 	/* Get default metric */
 	metric_res = task->result;
+	syms = g_array_new (FALSE, FALSE, sizeof (struct roll_history_symbol));
 
 	if (metric_res == NULL) {
-		row->symbols[0] = '\0';
-		row->action = METRIC_ACTION_NOACTION;
+		row.action = METRIC_ACTION_NOACTION;
 	}
 	else {
-		row->score = metric_res->score;
-		row->action = rspamd_check_action_metric (task, metric_res);
-		row->required_score = rspamd_task_get_required_score (task, metric_res);
-		cbdata.pos = row->symbols;
-		cbdata.remain = sizeof (row->symbols);
+		row.score = metric_res->score;
+		row.action = rspamd_check_action_metric (task, metric_res);
+		row.required_score = rspamd_task_get_required_score (task, metric_res);
 		rspamd_task_symbol_result_foreach (task,
 				roll_history_symbols_callback,
-				&cbdata);
-		if (cbdata.remain > 0) {
-			/* Remove last whitespace and comma */
-			*cbdata.pos-- = '\0';
-			*cbdata.pos-- = '\0';
-			*cbdata.pos = '\0';
+				syms);
+	}
+
+	row.nsymbols = syms->len;
+	row.symbols = (struct roll_history_symbol *)syms->data;
+	row.scan_time = task->time_real_finish - task->time_real;
+	row.len = task->msg.len;
+
+	rspamd_roll_history_write (history, ring, task->cfg->cache, &row);
+	g_array_free (syms, TRUE);
+}
+
+static const gchar *
+rspamd_roll_history_next_string (const gchar **pos, const gchar *end)
+{
+	const gchar *ret = *pos, *nul;
+
+	if (ret >= end) {
+		return NULL;
+	}
+
+	nul = memchr (ret, '\0', end - ret);
+
+	if (nul == NULL) {
+		return NULL;
+	}
+
+	*pos = nul + 1;
+
+	return ret;
+}
+
+static gboolean
+rspamd_roll_history_decode (const guchar *p, guint32 len,
+		struct rspamd_symcache *cache, guint64 cksum,
+		struct roll_history_row *row)
+{
+	struct roll_history_rec rec;
+	struct roll_history_rec_sym sym;
+	const gchar *strings, *end, *pos;
+	guint i;
+
+	memset (row, 0, sizeof (*row));
+	memcpy (&rec, p, sizeof (rec));
+
+	if ((guint64)sizeof (rec) + (guint64)rec.nsymbols * sizeof (sym) +
+			rec.strings_len > len) {
+		return FALSE;
+	}
+
+	strings = (const gchar *)p + sizeof (rec) + rec.nsymbols * sizeof (sym);
+	end = strings + rec.strings_len;
+	pos = strings;
+
+	row->message_id = rspamd_roll_history_next_string (&pos, end);
+	row->user = rspamd_roll_history_next_string (&pos, end);
+	row->from_addr = rspamd_roll_history_next_string (&pos, end);
+
+	if (row->message_id == NULL || row->user == NULL || row->from_addr == NULL) {
+		return FALSE;
+	}
+
+	double_to_tv (rec.time, &row->tv);
+	row->scan_time = rec.scan_time;
+	row->score = rec.score;
+	row->required_score = rec.required_score;
+	row->len = rec.size;
+	row->action = rec.action;
+	row->symbols = g_malloc (sizeof (*row->symbols) * (rec.nsymbols + 1));
+
+	for (i = 0; i < rec.nsymbols; i ++) {
+		memcpy (&sym, p + sizeof (rec) + i * sizeof (sym), sizeof (sym));
+
+		if (sym.id & HISTORY_SYM_INLINE) {
+			pos = strings + (sym.id & ~HISTORY_SYM_INLINE);
+			row->symbols[row->nsymbols].name =
+					rspamd_roll_history_next_string (&pos, end);
+		}
+		else if (cache != NULL && rec.cksum == cksum) {
+			row->symbols[row->nsymbols].name =
+					rspamd_symcache_symbol_by_id (cache, sym.id);
+		}
+		else {
+			/* Symbols cache has been changed, so ids are meaningless */
+			continue;
+		}
+
+		if (row->symbols[row->nsymbols].name != NULL) {
+			row->symbols[row->nsymbols].score = sym.score;
+			row->nsymbols ++;
+		}
+	}
+
+	return TRUE;
+}
+
+struct roll_history_ref {
+	const guchar *p;
+	guint32 len;
+	gdouble time;
+};
+
+/*
+ * Checks filter using the raw record, so rows that are filtered out are never
+ * decoded
+ */
+static gboolean
+rspamd_roll_history_rec_matches (const struct roll_history *history,
+		const guchar *p, const struct roll_history_rec *rec,
+		const struct roll_history_filter *filter,
+		gint sym_id, guint64 cksum)
+{
+	struct roll_history_rec_sym sym;
+	const gchar *strings, *name;
+	guint i, off;
+
+	if (rec->time <= history->reset_time) {
+		return FALSE;
+	}
+
+	if (filter == NULL) {
+		return TRUE;
+	}
+
+	if ((filter->since > 0 && rec->time < filter->since) ||
+			(filter->until > 0 && rec->time >= filter->until)) {
+		return FALSE;
+	}
+
+	if (filter->action >= 0 && rec->action != filter->action) {
+		return FALSE;
+	}
+
+	if ((!isnan (filter->min_score) && !(rec->score >= filter->min_score)) ||
+			(!isnan (filter->max_score) && !(rec->score <= filter->max_score))) {
+		return FALSE;
+	}
+
+	if (filter->symbol != NULL) {
+		if ((guint64)sizeof (*rec) + (guint64)rec->nsymbols * sizeof (sym) +
+				rec->strings_len > rec->len) {
+			return FALSE;
+		}
+
+		strings = (const gchar *)p + sizeof (*rec) + rec->nsymbols * sizeof (sym);
+
+		for (i = 0; i < rec->nsymbols; i ++) {
+			memcpy (&sym, p + sizeof (*rec) + i * sizeof (sym), sizeof (sym));
+
+			if (sym.id & HISTORY_SYM_INLINE) {
+				off = sym.id & ~HISTORY_SYM_INLINE;
+				name = strings + off;
+
+				if (off < rec->strings_len &&
+						memchr (name, '\0', rec->strings_len - off) != NULL &&
+						strcmp (name, filter->symbol) == 0) {
+					return TRUE;
+				}
+			}
+			else if (sym_id >= 0 && rec->cksum == cksum && (gint)sym.id == sym_id) {
+				return TRUE;
+			}
+		}
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Copies consistent part of a ring and collects matching records from it,
+ * writer is not blocked: records that could be overwritten while copying are
+ * ignored
+ */
+static void
+rspamd_roll_history_ring_read (struct roll_history *history,
+		struct roll_history_ring *ring,
+		const struct roll_history_filter *filter,
+		gint sym_id, guint64 cksum,
+		GPtrArray *bufs, GArray *refs)
+{
+	struct roll_history_rec rec;
+	struct roll_history_ref ref;
+	guint head, tail, new_tail, n, pos, first, off;
+	guchar *buf;
+
+	head = g_atomic_int_get (&ring->head);
+	tail = g_atomic_int_get (&ring->tail);
+	n = head - tail;
+
+	if (n == 0 || n > history->ring_size) {
+		return;
+	}
+
+	buf = g_malloc (n);
+	pos = tail & (history->ring_size - 1);
+	first = MIN (n, history->ring_size - pos);
+	memcpy (buf, ring->data + pos, first);
+
+	if (first < n) {
+		memcpy (buf + first, ring->data, n - first);
+	}
+
+	new_tail = g_atomic_int_get (&ring->tail);
+
+	if (new_tail - tail > n) {
+		/* Writer has overwritten everything we have copied */
+		g_free (buf);
+
+		return;
+	}
+
+	g_ptr_array_add (bufs, buf);
+
+	for (off = new_tail - tail; off + sizeof (guint32) * 2 <= n; off += rec.len) {
+		memcpy (&rec, buf + off, MIN (sizeof (rec), n - off));
+
+		if (rec.len < sizeof (guint32) * 2 || rec.len > n - off) {
+			break;
+		}
+
+		if (rec.flags & HISTORY_REC_PAD || rec.len < sizeof (rec)) {
+			continue;
+		}
+
+		if (rspamd_roll_history_rec_matches (history, buf + off, &rec, filter,
+				sym_id, cksum)) {
+			ref.p = buf + off;
+			ref.len = rec.len;
+			ref.time = rec.time;
+			g_array_append_val (refs, ref);
+		}
+	}
+}
+
+static gint
+rspamd_roll_history_ref_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct roll_history_ref *r1 = a, *r2 = b;
+
+	if (r1->time < r2->time) {
+		return -1;
+	}
+	else if (r1->time > r2->time) {
+		return 1;
+	}
+
+	return 0;
+}
+
+static gint
+rspamd_roll_history_ref_cmp_rev (gconstpointer a, gconstpointer b)
+{
+	return rspamd_roll_history_ref_cmp (b, a);
+}
+
+guint
+rspamd_roll_history_foreach (struct roll_history *history,
+	struct rspamd_config *cfg, const struct roll_history_filter *filter,
+	rspamd_roll_history_cb cb, gpointer ud)
+{
+	GPtrArray *bufs;
+	GArray *refs;
+	struct roll_history_ref *ref;
+	struct roll_history_row row;
+	struct rspamd_symcache *cache = cfg ? cfg->cache : NULL;
+	guint64 cksum = cache ? rspamd_symcache_get_cksum (cache) : 0;
+	gint sym_id = -1;
+	guint i, ret = 0;
+
+	if (history->disabled) {
+		return 0;
+	}
+
+	if (filter && filter->symbol && cache) {
+		sym_id = rspamd_symcache_find_symbol (cache, filter->symbol);
+	}
+
+	bufs = g_ptr_array_new_with_free_func (g_free);
+	refs = g_array_new (FALSE, FALSE, sizeof (struct roll_history_ref));
+
+	for (i = 0; i < history->nrings; i ++) {
+		rspamd_roll_history_ring_read (history, &history->rings[i], filter,
+				sym_id, cksum, bufs, refs);
+	}
+
+	g_array_sort (refs, (filter && filter->newest_first) ?
+			rspamd_roll_history_ref_cmp_rev : rspamd_roll_history_ref_cmp);
+
+	/* Merely rows that are passed to the callback are decoded */
+	for (i = 0; i < refs->len; i ++) {
+		if (filter && filter->limit > 0 && ret >= filter->limit) {
+			break;
 		}
+
+		ref = &g_array_index (refs, struct roll_history_ref, i);
+
+		if (rspamd_roll_history_decode (ref->p, ref->len, cache, cksum, &row)) {
+			cb (&row, ud);
+			ret ++;
+		}
+
+		g_free (row.symbols);
 	}
 
-	row->scan_time = task->time_real_finish - task->time_real;
-	row->len = task->msg.len;
-	g_atomic_int_set (&row->completed, TRUE);
+	g_array_free (refs, TRUE);
+	g_ptr_array_free (bufs, TRUE);
+
+	return ret;
+}
+
+void
+rspamd_roll_history_reset (struct roll_history *history)
+{
+	history->reset_time = rspamd_get_calendar_ticks ();
 }
 
 /**
@@ -182,16 +717,20 @@ rspamd_roll_history_update (struct roll_history *history,
  * @return TRUE if history has been loaded
  */
 gboolean
-rspamd_roll_history_load (struct roll_history *history, const gchar *filename)
+rspamd_roll_history_load (struct roll_history *history, const gchar *filename,
+		struct rspamd_config *cfg)
 {
 	gint fd;
 	struct stat st;
-	gchar magic[sizeof(rspamd_history_magic_old)];
+	gchar magic[sizeof(rspamd_history_magic_old)], **syms;
 	ucl_object_t *top;
-	const ucl_object_t *cur, *elt;
+	const ucl_object_t *cur, *elt, *sym_elt;
+	ucl_object_iter_t it;
 	struct ucl_parser *parser;
-	struct roll_history_row *row;
-	guint n, i;
+	struct roll_history_row row;
+	struct roll_history_symbol sym;
+	GArray *symbols;
+	guint i, j;
 
 	g_assert (history != NULL);
 	if (history->disabled) {
@@ -253,104 +792,155 @@ rspamd_roll_history_load (struct roll_history *history, const gchar *filename)
 		return FALSE;
 	}
 
-	if (top->len > history->nrows) {
-		msg_warn ("stored history is larger than the current one: %ud (file) vs "
-				"%ud (history)", top->len, history->nrows);
-		n = history->nrows;
-	}
-	else if (top->len < history->nrows) {
-		msg_warn (
-				"stored history is smaller than the current one: %ud (file) vs "
-						"%ud (history)",
-				top->len, history->nrows);
-		n = top->len;
-	}
-	else {
-		n = top->len;
-	}
+	symbols = g_array_new (FALSE, FALSE, sizeof (struct roll_history_symbol));
 
-	for (i = 0; i < n; i ++) {
+	for (i = 0; i < top->len; i ++) {
 		cur = ucl_array_find_index (top, i);
 
 		if (cur != NULL && ucl_object_type (cur) == UCL_OBJECT) {
-			row = &history->rows[i];
-			memset (row, 0, sizeof (*row));
+			memset (&row, 0, sizeof (row));
+			row.message_id = "";
+			row.user = "";
+			row.from_addr = "";
+			syms = NULL;
+			g_array_set_size (symbols, 0);
 
 			elt = ucl_object_lookup (cur, "time");
 
 			if (elt && ucl_object_type (elt) == UCL_FLOAT) {
-				double_to_tv (ucl_object_todouble (elt), &row->tv);
+				double_to_tv (ucl_object_todouble (elt), &row.tv);
 			}
 
 			elt = ucl_object_lookup (cur, "id");
 
 			if (elt && ucl_object_type (elt) == UCL_STRING) {
-				rspamd_strlcpy (row->message_id, ucl_object_tostring (elt),
-						sizeof (row->message_id));
+				row.message_id = ucl_object_tostring (elt);
 			}
 
 			elt = ucl_object_lookup (cur, "symbols");
 
-			if (elt && ucl_object_type (elt) == UCL_STRING) {
-				rspamd_strlcpy (row->symbols, ucl_object_tostring (elt),
-						sizeof (row->symbols));
+			if (elt && ucl_object_type (elt) == UCL_OBJECT) {
+				it = NULL;
+
+				while ((sym_elt = ucl_object_iterate (elt, &it, true)) != NULL) {
+					sym.name = ucl_object_key (sym_elt);
+					sym.score = ucl_object_todouble (sym_elt);
+					g_array_append_val (symbols, sym);
+				}
+			}
+			else if (elt && ucl_object_type (elt) == UCL_STRING) {
+				/* Previous format: symbols names without scores */
+				syms = g_strsplit_set (ucl_object_tostring (elt), ", ", -1);
+
+				for (j = 0; syms[j] != NULL; j ++) {
+					if (syms[j][0] != '\0') {
+						sym.name = syms[j];
+						sym.score = 0.0;
+						g_array_append_val (symbols, sym);
+					}
+				}
 			}
 
 			elt = ucl_object_lookup (cur, "user");
 
 			if (elt && ucl_object_type (elt) == UCL_STRING) {
-				rspamd_strlcpy (row->user, ucl_object_tostring (elt),
-						sizeof (row->user));
+				row.user = ucl_object_tostring (elt);
 			}
 
 			elt = ucl_object_lookup (cur, "from");
 
 			if (elt && ucl_object_type (elt) == UCL_STRING) {
-				rspamd_strlcpy (row->from_addr, ucl_object_tostring (elt),
-						sizeof (row->from_addr));
+				row.from_addr = ucl_object_tostring (elt);
 			}
 
 			elt = ucl_object_lookup (cur, "len");
 
 			if (elt && ucl_object_type (elt) == UCL_INT) {
-				row->len = ucl_object_toint (elt);
+				row.len = ucl_object_toint (elt);
 			}
 
 			elt = ucl_object_lookup (cur, "scan_time");
 
 			if (elt && ucl_object_type (elt) == UCL_FLOAT) {
-				row->scan_time = ucl_object_todouble (elt);
+				row.scan_time = ucl_object_todouble (elt);
 			}
 
 			elt = ucl_object_lookup (cur, "score");
 
 			if (elt && ucl_object_type (elt) == UCL_FLOAT) {
-				row->score = ucl_object_todouble (elt);
+				row.score = ucl_object_todouble (elt);
 			}
 
 			elt = ucl_object_lookup (cur, "required_score");
 
 			if (elt && ucl_object_type (elt) == UCL_FLOAT) {
-				row->required_score = ucl_object_todouble (elt);
+				row.required_score = ucl_object_todouble (elt);
 			}
 
 			elt = ucl_object_lookup (cur, "action");
 
 			if (elt && ucl_object_type (elt) == UCL_INT) {
-				row->action = ucl_object_toint (elt);
+				row.action = ucl_object_toint (elt);
 			}
 
-			row->completed = TRUE;
+			row.nsymbols = symbols->len;
+			row.symbols = (struct roll_history_symbol *)symbols->data;
+			/* Saved history is stored in the ring of the main process */
+			rspamd_roll_history_write (history, &history->rings[0],
+					cfg ? cfg->cache : NULL, &row);
+
+			if (syms) {
+				g_strfreev (syms);
+			}
 		}
 	}
 
+	g_array_free (symbols, TRUE);
 	ucl_object_unref (top);
 
-	history->cur_row = n;
-
 	return TRUE;
 }
 
+static void
+rspamd_roll_history_save_cb (const struct roll_history_row *row, gpointer ud)
+{
+	ucl_object_t *obj = ud, *elt, *syms;
+	guint i;
+
+	elt = ucl_object_typed_new (UCL_OBJECT);
+
+	ucl_object_insert_key (elt, ucl_object_fromdouble (
+			tv_to_double (&row->tv)), "time", 0, false);
+	ucl_object_insert_key (elt, ucl_object_fromstring (row->message_id),
+			"id", 0, false);
+
+	syms = ucl_object_typed_new (UCL_OBJECT);
+
+	for (i = 0; i < row->nsymbols; i ++) {
+		ucl_object_insert_key (syms,
+				ucl_object_fromdouble (row->symbols[i].score),
+				row->symbols[i].name, 0, true);
+	}
+
+	ucl_object_insert_key (elt, syms, "symbols", 0, false);
+	ucl_object_insert_key (elt, ucl_object_fromstring (row->user),
+			"user", 0, false);
+	ucl_object_insert_key (elt, ucl_object_fromstring (row->from_addr),
+			"from", 0, false);
+	ucl_object_insert_key (elt, ucl_object_fromint (row->len),
+			"len", 0, false);
+	ucl_object_insert_key (elt, ucl_object_fromdouble (row->scan_time),
+			"scan_time", 0, false);
+	ucl_object_insert_key (elt, ucl_object_fromdouble (row->score),
+			"score", 0, false);
+	ucl_object_insert_key (elt, ucl_object_fromdouble (row->required_score),
+			"required_score", 0, false);
+	ucl_object_insert_key (elt, ucl_object_fromint (row->action),
+			"action", 0, false);
+
+	ucl_array_append (obj, elt);
+}
+
 /**
  * Save history to file
  * @param history roll history object
@@ -358,12 +948,11 @@ rspamd_roll_history_load (struct roll_history *history, const gchar *filename)
  * @return TRUE if history has been saved
  */
 gboolean
-rspamd_roll_history_save (struct roll_history *history, const gchar *filename)
+rspamd_roll_history_save (struct roll_history *history, const gchar *filename,
+		struct rspamd_config *cfg)
 {
 	gint fd;
-	ucl_object_t *obj, *elt;
-	guint i;
-	struct roll_history_row *row;
+	ucl_object_t *obj;
 	struct ucl_emitter_functions *emitter_func;
 
 	g_assert (history != NULL);
@@ -378,39 +967,8 @@ rspamd_roll_history_save (struct roll_history *history, const gchar *filename)
 	}
 
 	obj = ucl_object_typed_new (UCL_ARRAY);
-
-	for (i = 0; i < history->nrows; i ++) {
-		row = &history->rows[i];
-
-		if (!row->completed) {
-			continue;
-		}
-
-		elt = ucl_object_typed_new (UCL_OBJECT);
-
-		ucl_object_insert_key (elt, ucl_object_fromdouble (
-				tv_to_double (&row->tv)), "time", 0, false);
-		ucl_object_insert_key (elt, ucl_object_fromstring (row->message_id),
-				"id", 0, false);
-		ucl_object_insert_key (elt, ucl_object_fromstring (row->symbols),
-				"symbols", 0, false);
-		ucl_object_insert_key (elt, ucl_object_fromstring (row->user),
-				"user", 0, false);
-		ucl_object_insert_key (elt, ucl_object_fromstring (row->from_addr),
-				"from", 0, false);
-		ucl_object_insert_key (elt, ucl_object_fromint (row->len),
-				"len", 0, false);
-		ucl_object_insert_key (elt, ucl_object_fromdouble (row->scan_time),
-				"scan_time", 0, false);
-		ucl_object_insert_key (elt, ucl_object_fromdouble (row->score),
-				"score", 0, false);
-		ucl_object_insert_key (elt, ucl_object_fromdouble (row->required_score),
-				"required_score", 0, false);
-		ucl_object_insert_key (elt, ucl_object_fromint (row->action),
-				"action", 0, false);
-
-		ucl_array_append (obj, elt);
-	}
+	rspamd_roll_history_foreach (history, cfg, NULL,
+			rspamd_roll_history_save_cb, obj);
 
 	emitter_func = ucl_object_emit_fd_funcs (fd);
 	ucl_object_emit_full (obj, UCL_EMIT_JSON_COMPACT, emitter_func, NULL);
@@ -22,37 +22,71 @@
 /*
  * Roll history is a special cycled buffer for checked messages, it is designed for writing history messages
  * and displaying them in webui
+ *
+ * Each worker process owns a separate ring buffer in shared memory, so there
+ * is a single writer for each ring and no locking is required. Rows are
+ * stored in a compact binary form with symbols stored as their cache ids,
+ * rings are merged on reading.
  */
 
-#define HISTORY_MAX_ID 256
-#define HISTORY_MAX_SYMBOLS 256
-#define HISTORY_MAX_USER 32
-#define HISTORY_MAX_ADDR 32
+/* Average size of a row, used to compute size of ring buffers */
+#define HISTORY_ROW_AVG_SIZE 256
+/* Minimum size of a ring buffer */
+#define HISTORY_MIN_RING_SIZE (64 * 1024)
 
 struct rspamd_task;
 struct rspamd_config;
+struct roll_history_ring;
 
+struct roll_history_symbol {
+	const gchar *name;
+	gdouble score;
+};
+
+/*
+ * Decoded history row, strings and symbols are valid merely during
+ * a callback call
+ */
 struct roll_history_row {
 	struct timeval tv;
-	gchar message_id[HISTORY_MAX_ID];
-	gchar symbols[HISTORY_MAX_SYMBOLS];
-	gchar user[HISTORY_MAX_USER];
-	gchar from_addr[HISTORY_MAX_ADDR];
+	const gchar *message_id;
+	const gchar *user;
+	const gchar *from_addr;
 	gsize len;
 	gdouble scan_time;
 	gdouble score;
 	gdouble required_score;
 	gint action;
-	guint completed;
+	guint nsymbols;
+	struct roll_history_symbol *symbols;
 };
 
 struct roll_history {
-	struct roll_history_row *rows;
+	struct roll_history_ring *rings;
 	gboolean disabled;
-	guint nrows;
-	guint cur_row;
+	guint nrings;
+	guint ring_size;
+	/* Rows older than this time are ignored */
+	gdouble reset_time;
+};
+
+/*
+ * Filter for history rows, rows are ordered by time
+ */
+struct roll_history_filter {
+	gdouble since;       /* inclusive, 0 means no limit */
+	gdouble until;       /* exclusive, 0 means no limit */
+	gdouble min_score;   /* NAN means no limit */
+	gdouble max_score;   /* NAN means no limit */
+	gint action;         /* -1 means any action */
+	const gchar *symbol; /* NULL means any symbols */
+	guint limit;         /* 0 means no limit */
+	gboolean newest_first;
 };
 
+typedef void (*rspamd_roll_history_cb) (const struct roll_history_row *row,
+		gpointer ud);
+
 /**
  * Returns new roll history
  * @param pool pool for shared memory
@@ -69,22 +103,43 @@ struct roll_history * rspamd_roll_history_new (rspamd_mempool_t *pool,
 void rspamd_roll_history_update (struct roll_history *history,
 	struct rspamd_task *task);
 
+/**
+ * Calls `cb` for history rows from all workers ordered by time
+ * @param history roll history object
+ * @param cfg config used to resolve symbols names
+ * @param filter optional filter for rows
+ * @param cb callback
+ * @param ud opaque data for callback
+ * @return number of rows processed
+ */
+guint rspamd_roll_history_foreach (struct roll_history *history,
+	struct rspamd_config *cfg, const struct roll_history_filter *filter,
+	rspamd_roll_history_cb cb, gpointer ud);
+
+/**
+ * Hides all rows that are currently in history
+ * @param history roll history object
+ */
+void rspamd_roll_history_reset (struct roll_history *history);
+
 /**
  * Load previously saved history from file
  * @param history roll history object
  * @param filename filename to load from
+ * @param cfg config used to resolve symbols names
  * @return TRUE if history has been loaded
  */
 gboolean rspamd_roll_history_load (struct roll_history *history,
-	const gchar *filename);
+	const gchar *filename, struct rspamd_config *cfg);
 
 /**
  * Save history to file
  * @param history roll history object
  * @param filename filename to load from
+ * @param cfg config used to resolve symbols names
  * @return TRUE if history has been saved
  */
 gboolean rspamd_roll_history_save (struct roll_history *history,
-	const gchar *filename);
+	const gchar *filename, struct rspamd_config *cfg);
 
 #endif /* ROLL_HISTORY_H_ */
@@ -16,10 +16,12 @@
 #include "config.h"
 #include "rspamd.h"
 #include "rspamd_control.h"
+#include "worker_util.h"
 #include "libutil/http.h"
 #include "libutil/http_private.h"
 #include "unix-std.h"
 #include "utlist.h"
+#include "lua/lua_common.h"
 
 #ifdef HAVE_SYS_RESOURCE_H
 #include <sys/resource.h>
@@ -101,6 +103,20 @@ static const struct rspamd_control_cmd_match {
 				},
 				.type = RSPAMD_CONTROL_FUZZY_SYNC
 		},
+		{
+				.name = {
+						.begin = "/mempoolstat",
+						.len = sizeof ("/mempoolstat") - 1
+				},
+				.type = RSPAMD_CONTROL_MEMPOOL_STAT
+		},
+		{
+				.name = {
+						.begin = "/luaprofile",
+						.len = sizeof ("/luaprofile") - 1
+				},
+				.type = RSPAMD_CONTROL_LUA_PROFILE
+		},
 };
 
 void
@@ -174,19 +190,206 @@ rspamd_control_connection_close (struct rspamd_control_session *session)
 	g_free (session);
 }
 
+/*
+ * Sum allocations of all workers per call site
+ */
+static void
+rspamd_control_mempool_stat_merge (GHashTable *total, const ucl_object_t *data)
+{
+	const ucl_object_t *allocs, *cur, *elt;
+	ucl_object_iter_t it = NULL;
+	struct rspamd_mempool_profile_elt *prof;
+	const gchar *loc;
+
+	allocs = ucl_object_lookup (data, "allocations");
+
+	if (allocs == NULL || ucl_object_type (allocs) != UCL_ARRAY) {
+		return;
+	}
+
+	while ((cur = ucl_object_iterate (allocs, &it, true)) != NULL) {
+		elt = ucl_object_lookup (cur, "loc");
+
+		if (elt == NULL || (loc = ucl_object_tostring (elt)) == NULL) {
+			continue;
+		}
+
+		prof = g_hash_table_lookup (total, loc);
+
+		if (prof == NULL) {
+			prof = g_malloc0 (sizeof (*prof));
+			prof->loc = g_strdup (loc);
+			g_hash_table_insert (total, (gpointer)prof->loc, prof);
+		}
+
+		prof->bytes += ucl_object_toint (ucl_object_lookup (cur, "bytes"));
+		prof->count += ucl_object_toint (ucl_object_lookup (cur, "count"));
+	}
+}
+
+static gint
+rspamd_control_mempool_stat_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct rspamd_mempool_profile_elt *e1 = *(gpointer *)a,
+			*e2 = *(gpointer *)b;
+
+	if (e1->bytes > e2->bytes) {
+		return -1;
+	}
+	else if (e1->bytes < e2->bytes) {
+		return 1;
+	}
+
+	return 0;
+}
+
+static void
+rspamd_control_mempool_stat_free (gpointer p)
+{
+	struct rspamd_mempool_profile_elt *prof = p;
+
+	g_free ((gpointer)prof->loc);
+	g_free (prof);
+}
+
+/*
+ * Sum Lua profiles of all workers per symbol
+ */
+static void
+rspamd_control_lua_profile_merge (GHashTable *total, const ucl_object_t *data)
+{
+	const ucl_object_t *syms, *cur, *elt;
+	ucl_object_iter_t it = NULL;
+	struct rspamd_lua_profile_elt *prof;
+	const gchar *sym;
+
+	syms = ucl_object_lookup (data, "symbols");
+
+	if (syms == NULL || ucl_object_type (syms) != UCL_ARRAY) {
+		return;
+	}
+
+	while ((cur = ucl_object_iterate (syms, &it, true)) != NULL) {
+		elt = ucl_object_lookup (cur, "symbol");
+
+		if (elt == NULL || (sym = ucl_object_tostring (elt)) == NULL) {
+			continue;
+		}
+
+		prof = g_hash_table_lookup (total, sym);
+
+		if (prof == NULL) {
+			prof = g_malloc0 (sizeof (*prof));
+			prof->symbol = g_strdup (sym);
+			prof->source = g_strdup (ucl_object_tostring (
+					ucl_object_lookup (cur, "source")));
+			g_hash_table_insert (total, (gpointer)prof->symbol, prof);
+		}
+
+		prof->calls += ucl_object_toint (ucl_object_lookup (cur, "calls"));
+		prof->cpu_time += ucl_object_todouble (ucl_object_lookup (cur, "cpu_time"));
+		prof->mem_bytes += ucl_object_toint (ucl_object_lookup (cur, "mem_bytes"));
+	}
+}
+
+static void
+rspamd_control_lua_profile_free (gpointer p)
+{
+	struct rspamd_lua_profile_elt *prof = p;
+
+	g_free ((gpointer)prof->symbol);
+	g_free ((gpointer)prof->source);
+	g_free (prof);
+}
+
+static void
+rspamd_control_fill_stat_reply (struct rspamd_control_reply *rep,
+		const struct rspamd_worker_usage *usage)
+{
+	rep->reply.stat.conns = usage->conns;
+	rep->reply.stat.utime = usage->utime;
+	rep->reply.stat.systime = usage->systime;
+	rep->reply.stat.maxrss = usage->maxrss;
+	rep->reply.stat.lua_mem = usage->lua_mem;
+	rep->reply.stat.lua_gc_steps = usage->lua_gc_steps;
+	rep->reply.stat.lua_gc_time = usage->lua_gc_time;
+	rep->reply.stat.lua_gc_max_pause = usage->lua_gc_max_pause;
+
+	if (usage->start_time > 0) {
+		rep->reply.stat.uptime = rspamd_get_calendar_ticks () -
+				usage->start_time;
+	}
+}
+
+/*
+ * Workers publish their usage in the shared stat slots, so the stat command
+ * is served from there without a round trip to each worker
+ */
+static struct rspamd_control_reply_elt *
+rspamd_control_collect_stat (struct rspamd_main *rspamd_main,
+		gpointer ud)
+{
+	GHashTableIter it;
+	struct rspamd_worker *wrk;
+	struct rspamd_control_reply_elt *rep_elt, *res = NULL;
+	struct rspamd_worker_usage usage;
+	gpointer k, v;
+
+	g_hash_table_iter_init (&it, rspamd_main->workers);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		wrk = v;
+
+		if (wrk->stat_slot < 0) {
+			continue;
+		}
+
+		if (!rspamd_worker_stat_read_usage (
+				&rspamd_main->stat->workers[wrk->stat_slot], &usage)) {
+			msg_warn ("cannot read usage of the worker %P (%s)",
+					wrk->pid, g_quark_to_string (wrk->type));
+		}
+
+		rep_elt = g_malloc0 (sizeof (*rep_elt));
+		rep_elt->wrk = wrk;
+		rep_elt->ud = ud;
+		rep_elt->attached_fd = -1;
+		rep_elt->reply.type = RSPAMD_CONTROL_STAT;
+		rspamd_control_fill_stat_reply (&rep_elt->reply, &usage);
+
+		DL_APPEND (res, rep_elt);
+	}
+
+	return res;
+}
+
 static void
 rspamd_control_write_reply (struct rspamd_control_session *session)
 {
-	ucl_object_t *rep, *cur, *workers;
+	ucl_object_t *rep, *cur, *workers, *obj;
 	struct rspamd_control_reply_elt *elt;
 	gchar tmpbuf[64];
 	gdouble total_utime = 0, total_systime = 0;
 	struct ucl_parser *parser;
-	guint total_conns = 0;
+	guint total_conns = 0, i;
+	GHashTable *total_allocs = NULL, *total_lua = NULL;
+	GPtrArray *sorted;
+	GHashTableIter hit;
+	gpointer k, v;
+	struct rspamd_mempool_profile_elt *prof;
 
 	rep = ucl_object_typed_new (UCL_OBJECT);
 	workers = ucl_object_typed_new (UCL_OBJECT);
 
+	if (session->cmd.type == RSPAMD_CONTROL_MEMPOOL_STAT) {
+		total_allocs = g_hash_table_new_full (rspamd_str_hash, rspamd_str_equal,
+				NULL, rspamd_control_mempool_stat_free);
+	}
+	else if (session->cmd.type == RSPAMD_CONTROL_LUA_PROFILE) {
+		total_lua = g_hash_table_new_full (rspamd_str_hash, rspamd_str_equal,
+				NULL, rspamd_control_lua_profile_free);
+	}
+
 	DL_FOREACH (session->replies, elt) {
 		/* Skip incompatible worker for fuzzy_stat */
 		if ((session->cmd.type == RSPAMD_CONTROL_FUZZY_STAT ||
@@ -213,6 +416,15 @@ rspamd_control_write_reply (struct rspamd_control_session *session)
 					elt->reply.reply.stat.uptime), "uptime", 0, false);
 			ucl_object_insert_key (cur, ucl_object_fromint (
 					elt->reply.reply.stat.maxrss), "maxrss", 0, false);
+			ucl_object_insert_key (cur, ucl_object_fromint (
+					elt->reply.reply.stat.lua_mem), "lua_mem", 0, false);
+			ucl_object_insert_key (cur, ucl_object_fromint (
+					elt->reply.reply.stat.lua_gc_steps), "lua_gc_steps", 0, false);
+			ucl_object_insert_key (cur, ucl_object_fromdouble (
+					elt->reply.reply.stat.lua_gc_time), "lua_gc_time", 0, false);
+			ucl_object_insert_key (cur, ucl_object_fromdouble (
+					elt->reply.reply.stat.lua_gc_max_pause), "lua_gc_max_pause",
+					0, false);
 
 			total_utime += elt->reply.reply.stat.utime;
 			total_systime += elt->reply.reply.stat.systime;
@@ -282,6 +494,47 @@ rspamd_control_write_reply (struct rspamd_control_session *session)
 			ucl_object_insert_key (cur, ucl_object_fromint (
 					elt->reply.reply.fuzzy_sync.status), "status", 0, false);
 			break;
+		case RSPAMD_CONTROL_MEMPOOL_STAT:
+		case RSPAMD_CONTROL_LUA_PROFILE:
+			ucl_object_insert_key (cur,
+					ucl_object_fromint (
+							session->cmd.type == RSPAMD_CONTROL_MEMPOOL_STAT ?
+							elt->reply.reply.mempool_stat.status :
+							elt->reply.reply.lua_profile.status),
+					"status",
+					0,
+					false);
+
+			if (elt->attached_fd != -1) {
+				parser = ucl_parser_new (0);
+
+				if (ucl_parser_add_fd (parser, elt->attached_fd)) {
+					obj = ucl_parser_get_object (parser);
+
+					if (total_allocs) {
+						rspamd_control_mempool_stat_merge (total_allocs, obj);
+					}
+					else {
+						rspamd_control_lua_profile_merge (total_lua, obj);
+					}
+
+					ucl_object_insert_key (cur, obj, "data", 0, false);
+				}
+				else {
+					ucl_object_insert_key (cur, ucl_object_fromstring (
+							ucl_parser_get_error (parser)), "error", 0, false);
+				}
+
+				ucl_parser_free (parser);
+			}
+			else {
+				ucl_object_insert_key (cur,
+						ucl_object_fromstring ("missing file"),
+						"error",
+						0,
+						false);
+			}
+			break;
 		default:
 			break;
 		}
@@ -308,6 +561,47 @@ rspamd_control_write_reply (struct rspamd_control_session *session)
 
 		ucl_object_insert_key (rep, cur, "total", 0, false);
 	}
+	else if (total_allocs != NULL) {
+		/* Allocations of all workers sorted by size */
+		sorted = g_ptr_array_sized_new (g_hash_table_size (total_allocs));
+		g_hash_table_iter_init (&hit, total_allocs);
+
+		while (g_hash_table_iter_next (&hit, &k, &v)) {
+			g_ptr_array_add (sorted, v);
+		}
+
+		g_ptr_array_sort (sorted, rspamd_control_mempool_stat_cmp);
+		cur = ucl_object_typed_new (UCL_ARRAY);
+
+		PTR_ARRAY_FOREACH (sorted, i, prof) {
+			obj = ucl_object_typed_new (UCL_OBJECT);
+			ucl_object_insert_key (obj, ucl_object_fromstring (prof->loc),
+					"loc", 0, false);
+			ucl_object_insert_key (obj, ucl_object_fromint (prof->bytes),
+					"bytes", 0, false);
+			ucl_object_insert_key (obj, ucl_object_fromint (prof->count),
+					"count", 0, false);
+			ucl_array_append (cur, obj);
+		}
+
+		ucl_object_insert_key (rep, cur, "total", 0, false);
+		g_ptr_array_free (sorted, TRUE);
+		g_hash_table_unref (total_allocs);
+	}
+	else if (total_lua != NULL) {
+		/* Lua symbols of all workers sorted by CPU time */
+		sorted = g_ptr_array_sized_new (g_hash_table_size (total_lua));
+		g_hash_table_iter_init (&hit, total_lua);
+
+		while (g_hash_table_iter_next (&hit, &k, &v)) {
+			g_ptr_array_add (sorted, v);
+		}
+
+		ucl_object_insert_key (rep, rspamd_lua_profile_ucl (sorted),
+				"total", 0, false);
+		g_ptr_array_free (sorted, TRUE);
+		g_hash_table_unref (total_lua);
+	}
 
 	rspamd_control_send_ucl (session, rep);
 	ucl_object_unref (rep);
@@ -483,6 +777,11 @@ rspamd_control_finish_handler (struct rspamd_http_connection *conn,
 		if (!found) {
 			rspamd_control_send_error (session, 404, "Command not defined");
 		}
+		else if (session->cmd.type == RSPAMD_CONTROL_STAT) {
+			session->replies = rspamd_control_collect_stat (
+					session->rspamd_main, session);
+			rspamd_control_write_reply (session);
+		}
 		else {
 			/* Send command to all workers */
 			session->replies = rspamd_control_broadcast_cmd (
@@ -533,6 +832,97 @@ struct rspamd_worker_control_data {
 	} handlers[RSPAMD_CONTROL_MAX];
 };
 
+/*
+ * Write object to a temporary file and return a descriptor to read it from,
+ * object is unrefed afterwards
+ */
+static gint
+rspamd_control_emit_tmp_fd (struct rspamd_config *cfg, ucl_object_t *top,
+		const gchar *name, guint *status)
+{
+	struct ucl_emitter_functions *emit_subr;
+	gchar tmppath[PATH_MAX];
+	gint outfd;
+
+	rspamd_snprintf (tmppath, sizeof (tmppath), "%s%c%s-XXXXXXXXXX",
+			cfg->temp_dir, G_DIR_SEPARATOR, name);
+
+	if ((outfd = mkstemp (tmppath)) == -1) {
+		*status = errno;
+		msg_info ("cannot make temporary stat file for %s: %s",
+				name, strerror (errno));
+		ucl_object_unref (top);
+
+		return -1;
+	}
+
+	emit_subr = ucl_object_emit_fd_funcs (outfd);
+	ucl_object_emit_full (top, UCL_EMIT_JSON_COMPACT, emit_subr, NULL);
+	ucl_object_emit_funcs_free (emit_subr);
+	ucl_object_unref (top);
+	/* Rewind output file */
+	close (outfd);
+	outfd = open (tmppath, O_RDONLY);
+	unlink (tmppath);
+	*status = 0;
+
+	return outfd;
+}
+
+/*
+ * Dump pool allocations profile of this worker
+ */
+static gint
+rspamd_control_mempool_stat_fd (struct rspamd_config *cfg, guint *status)
+{
+	ucl_object_t *top, *allocs, *obj;
+	struct rspamd_mempool_profile_elt *prof;
+	GArray *profile;
+	guint i;
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+	allocs = ucl_object_typed_new (UCL_ARRAY);
+	profile = rspamd_mempool_profile_get ();
+
+	for (i = 0; i < profile->len; i ++) {
+		prof = &g_array_index (profile, struct rspamd_mempool_profile_elt, i);
+		obj = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (obj, ucl_object_fromstring (prof->loc),
+				"loc", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (prof->bytes),
+				"bytes", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (prof->count),
+				"count", 0, false);
+		ucl_array_append (allocs, obj);
+	}
+
+	g_array_free (profile, TRUE);
+	ucl_object_insert_key (top,
+			ucl_object_frombool (rspamd_mempool_profile_enabled ()),
+			"enabled", 0, false);
+	ucl_object_insert_key (top, allocs, "allocations", 0, false);
+
+	return rspamd_control_emit_tmp_fd (cfg, top, "mempool-stat", status);
+}
+
+/*
+ * Dump Lua symbols profile of this worker
+ */
+static gint
+rspamd_control_lua_profile_fd (struct rspamd_config *cfg, guint *status)
+{
+	ucl_object_t *top;
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (top,
+			ucl_object_frombool (cfg->enable_lua_profile),
+			"enabled", 0, false);
+	ucl_object_insert_key (top, rspamd_lua_profile_ucl (cfg->lua_profile),
+			"symbols", 0, false);
+
+	return rspamd_control_emit_tmp_fd (cfg, top, "lua-profile", status);
+}
+
 static void
 rspamd_control_default_cmd_handler (gint fd,
 		gint attached_fd,
@@ -541,26 +931,21 @@ rspamd_control_default_cmd_handler (gint fd,
 {
 	struct rspamd_control_reply rep;
 	gssize r;
-	struct rusage rusg;
+	struct rspamd_worker_usage usage;
 	struct rspamd_config *cfg;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	guchar fdspace[CMSG_SPACE(sizeof (int))];
+	gint outfd = -1;
 
 	memset (&rep, 0, sizeof (rep));
 	rep.type = cmd->type;
 
 	switch (cmd->type) {
 	case RSPAMD_CONTROL_STAT:
-		if (getrusage (RUSAGE_SELF, &rusg) == -1) {
-			msg_err ("cannot get rusage stats: %s",
-					strerror (errno));
-		}
-		else {
-			rep.reply.stat.utime = tv_to_double (&rusg.ru_utime);
-			rep.reply.stat.systime = tv_to_double (&rusg.ru_stime);
-			rep.reply.stat.maxrss = rusg.ru_maxrss;
-		}
-
-		rep.reply.stat.conns = cd->worker->nconns;
-		rep.reply.stat.uptime = rspamd_get_calendar_ticks () - cd->worker->start_time;
+		rspamd_worker_get_usage (cd->worker, &usage);
+		rspamd_control_fill_stat_reply (&rep, &usage);
 		break;
 	case RSPAMD_CONTROL_RELOAD:
 	case RSPAMD_CONTROL_RECOMPILE:
@@ -587,17 +972,48 @@ rspamd_control_default_cmd_handler (gint fd,
 			rep.reply.reresolve.status = EINVAL;
 		}
 		break;
+	case RSPAMD_CONTROL_MEMPOOL_STAT:
+		outfd = rspamd_control_mempool_stat_fd (cd->worker->srv->cfg,
+				&rep.reply.mempool_stat.status);
+		break;
+	case RSPAMD_CONTROL_LUA_PROFILE:
+		outfd = rspamd_control_lua_profile_fd (cd->worker->srv->cfg,
+				&rep.reply.lua_profile.status);
+		break;
 	default:
 		break;
 	}
 
-	r = write (fd, &rep, sizeof (rep));
+	memset (&msg, 0, sizeof (msg));
+
+	/* Attach fd to the message */
+	if (outfd != -1) {
+		memset (fdspace, 0, sizeof (fdspace));
+		msg.msg_control = fdspace;
+		msg.msg_controllen = sizeof (fdspace);
+		cmsg = CMSG_FIRSTHDR (&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN (sizeof (int));
+		memcpy (CMSG_DATA (cmsg), &outfd, sizeof (int));
+	}
+
+	iov.iov_base = &rep;
+	iov.iov_len = sizeof (rep);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	r = sendmsg (fd, &msg, 0);
 
 	if (r != sizeof (rep)) {
 		msg_err ("cannot write reply to the control socket: %s",
 				strerror (errno));
 	}
 
+	if (outfd != -1) {
+		close (outfd);
+	}
+
 	if (attached_fd != -1) {
 		close (attached_fd);
 	}
@@ -776,6 +1192,7 @@ rspamd_control_handle_on_fork (struct rspamd_srv_command *cmd,
 		child->srv_pipe[1] = -1;
 		child->control_pipe[0] = -1;
 		child->control_pipe[1] = -1;
+		child->stat_slot = -1;
 		child->cf = parent->cf;
 		child->ppid = parent->pid;
 		REF_RETAIN (child->cf);
@@ -875,6 +1292,10 @@ rspamd_srv_handler (gint fd, short what, gpointer ud)
 				wcmd.cmd.hs_loaded.forced = cmd.cmd.hs_loaded.forced;
 				rspamd_control_broadcast_cmd (srv, &wcmd, rfd,
 						rspamd_control_hs_io_handler, NULL);
+				/* Templates have no control pipe but fork new workers */
+				rspamd_worker_template_hs_loaded (srv,
+						cmd.cmd.hs_loaded.cache_dir,
+						cmd.cmd.hs_loaded.forced);
 				break;
 			case RSPAMD_SRV_MONITORED_CHANGE:
 				/* Broadcast command to all workers */
@@ -33,6 +33,8 @@ enum rspamd_control_type {
 	RSPAMD_CONTROL_FUZZY_STAT,
 	RSPAMD_CONTROL_FUZZY_SYNC,
 	RSPAMD_CONTROL_MONITORED_CHANGE,
+	RSPAMD_CONTROL_MEMPOOL_STAT,
+	RSPAMD_CONTROL_LUA_PROFILE,
 	RSPAMD_CONTROL_MAX
 };
 
@@ -81,6 +83,12 @@ struct rspamd_control_command {
 		struct {
 			guint unused;
 		} fuzzy_sync;
+		struct {
+			guint unused;
+		} mempool_stat;
+		struct {
+			guint unused;
+		} lua_profile;
 	} cmd;
 };
 
@@ -93,6 +101,10 @@ struct rspamd_control_reply {
 			gdouble utime;
 			gdouble systime;
 			gulong maxrss;
+			gulong lua_mem;
+			guint64 lua_gc_steps;
+			gdouble lua_gc_time;
+			gdouble lua_gc_max_pause;
 		} stat;
 		struct {
 			guint status;
@@ -119,6 +131,12 @@ struct rspamd_control_reply {
 		struct {
 			guint status;
 		} fuzzy_sync;
+		struct {
+			guint status;
+		} mempool_stat;
+		struct {
+			guint status;
+		} lua_profile;
 	} reply;
 };
 
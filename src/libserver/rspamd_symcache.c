@@ -23,6 +23,7 @@
 #include "unix-std.h"
 #include "contrib/t1ha/t1ha.h"
 #include "libserver/worker_util.h"
+#include "libserver/tracing.h"
 #include <math.h>
 
 #if defined(__STDC_VERSION__) &&  __STDC_VERSION__ >= 201112L
@@ -52,15 +53,23 @@
 
 INIT_LOG_MODULE(symcache)
 
-#define CHECK_START_BIT(checkpoint, dyn_item) \
-	((dyn_item)->started)
-#define SET_START_BIT(checkpoint, dyn_item) \
-	(dyn_item)->started = 1
+#define SAVEPOINT_BIT_WORD(id) ((id) >> 6)
+#define SAVEPOINT_BIT_MASK(id) (1ULL << ((id) & 63))
+#define SAVEPOINT_BITS_LEN(n) (((n) + 63) >> 6)
 
-#define CHECK_FINISH_BIT(checkpoint, dyn_item) \
-	((dyn_item)->finished)
-#define SET_FINISH_BIT(checkpoint, dyn_item) \
-	(dyn_item)->finished = 1
+#define CHECK_START_BIT(checkpoint, id) \
+	(((checkpoint)->started[SAVEPOINT_BIT_WORD (id)] & SAVEPOINT_BIT_MASK (id)) != 0)
+#define SET_START_BIT(checkpoint, id) \
+	(checkpoint)->started[SAVEPOINT_BIT_WORD (id)] |= SAVEPOINT_BIT_MASK (id)
+#define CLEAR_START_BIT(checkpoint, id) \
+	(checkpoint)->started[SAVEPOINT_BIT_WORD (id)] &= ~SAVEPOINT_BIT_MASK (id)
+
+#define CHECK_FINISH_BIT(checkpoint, id) \
+	(((checkpoint)->finished[SAVEPOINT_BIT_WORD (id)] & SAVEPOINT_BIT_MASK (id)) != 0)
+#define SET_FINISH_BIT(checkpoint, id) \
+	(checkpoint)->finished[SAVEPOINT_BIT_WORD (id)] |= SAVEPOINT_BIT_MASK (id)
+#define CLEAR_FINISH_BIT(checkpoint, id) \
+	(checkpoint)->finished[SAVEPOINT_BIT_WORD (id)] &= ~SAVEPOINT_BIT_MASK (id)
 
 static const guchar rspamd_symcache_magic[8] = {'r', 's', 'c', 2, 0, 0, 0, 0 };
 
@@ -73,6 +82,21 @@ struct rspamd_symcache_header {
 
 struct symcache_order {
 	GPtrArray *d;
+	/*
+	 * Flat view of the execution order used by the per-task walk:
+	 * ids/types/priorities are indexed by position in `d`, whilst
+	 * deps_off is indexed by item id and points to the ranges in deps_ids.
+	 * All arrays live in a single block starting at `ids`, which could be
+	 * moved to a shared read-only mapping by `rspamd_symcache_freeze`
+	 */
+	guint *ids;
+	guint *types;
+	gint *priorities;
+	guint *deps_off;
+	guint *deps_ids;
+	gsize compiled_len;
+	gboolean frozen;
+	guint nitems;
 	guint id;
 	ref_entry_t ref;
 };
@@ -91,6 +115,8 @@ struct rspamd_symcache {
 	GPtrArray *squeezed;
 	GList *delayed_deps;
 	GList *delayed_conditions;
+	/* Settings plans indexed by hash of settings symbols and groups */
+	GHashTable *settings_plans;
 	rspamd_mempool_t *static_pool;
 	guint64 cksum;
 	gdouble total_weight;
@@ -112,14 +138,25 @@ struct item_stat {
 	struct rspamd_counter_data frequency_counter;
 	gdouble avg_frequency;
 	gdouble stddev_frequency;
+	/* Cost model */
+	guint runs;
+	guint64 total_runs;
+	gdouble hit_probability;
+	gdouble expected_score;
+	/* Number of times an item has not been started due to the early exit */
+	guint early_skips;
+	/* Log2 buckets of execution time in microseconds, updated atomically */
+	guint time_hist[RSPAMD_SYMCACHE_HIST_BUCKETS];
 };
 
+/*
+ * Runtime state of an item that has been started, it is written when an item
+ * starts, so the array of these structures does not need to be zeroed per task
+ */
 struct rspamd_symcache_dynamic_item {
-	guint16 start_msec; /* Relative to task time */
-	unsigned started:1;
-	unsigned finished:1;
-	/* unsigned pad:14; */
+	guint32 start_msec; /* Relative to task time */
 	guint32 async_events;
+	guint32 span; /* Trace span if a task is traced */
 };
 
 struct rspamd_symcache_item {
@@ -195,12 +232,44 @@ struct cache_savepoint {
 
 	struct rspamd_metric_result *rs;
 	gdouble lim;
+	/* Absolute time after which non-critical filters are skipped, 0 if unset */
+	gdouble deadline;
 
 	struct rspamd_symcache_item *cur_item;
 	struct symcache_order *order;
-	struct rspamd_symcache_dynamic_item dynamic_items[];
+	/* Started and finished bits indexed by item id */
+	guint nwords;
+	guint64 *started;
+	guint64 *finished;
+	struct rspamd_symcache_dynamic_item *dynamic_items;
+	guint64 bits[];
 };
 
+/*
+ * Effect of symbols and groups enabled/disabled by settings: items with mask
+ * bit set get both started and finished bits equal to the value bit
+ */
+struct symcache_settings_plan {
+	guint64 key;
+	guint id;
+	guint nwords;
+	guint64 *mask;
+	guint64 *value;
+};
+
+#define SET_PLAN_BIT(plan, id, disable) do { \
+	(plan)->mask[SAVEPOINT_BIT_WORD (id)] |= SAVEPOINT_BIT_MASK (id); \
+	if (disable) { \
+		(plan)->value[SAVEPOINT_BIT_WORD (id)] |= SAVEPOINT_BIT_MASK (id); \
+	} \
+	else { \
+		(plan)->value[SAVEPOINT_BIT_WORD (id)] &= ~SAVEPOINT_BIT_MASK (id); \
+	} \
+} while (0)
+
+/* Do not cache plans for settings beyond this number */
+#define SETTINGS_PLANS_MAX 1024
+
 struct rspamd_cache_refresh_cbdata {
 	gdouble last_resort;
 	struct event resort_ev;
@@ -216,6 +285,33 @@ struct rspamd_cache_refresh_cbdata {
 #define SCORE_FUN(w, f, t) (((w) > 0 ? (w) : WEIGHT_ALPHA) \
 		* ((f) > 0 ? (f) : FREQ_ALPHA) \
 		/ (t > TIME_ALPHA ? t : TIME_ALPHA))
+/* Expected score contribution per millisecond of execution */
+#define COST_FUN(s, t) (((s) > 0 ? (s) : WEIGHT_ALPHA * FREQ_ALPHA) \
+		/ (t > TIME_ALPHA ? t : TIME_ALPHA))
+/* Minimum number of runs to trust the cost model */
+#define COST_MIN_RUNS 100
+
+/* Histogram bucket `i` holds execution times below 2^i microseconds */
+static inline guint
+rspamd_symcache_hist_bucket (gdouble msec)
+{
+	guint64 usec = msec > 0 ? (guint64)(msec * 1000.0) : 0;
+	guint bucket = 0;
+
+	while (usec > 0 && bucket < RSPAMD_SYMCACHE_HIST_BUCKETS - 1) {
+		usec >>= 1;
+		bucket ++;
+	}
+
+	return bucket;
+}
+
+/* Upper bound of a histogram bucket in milliseconds */
+static inline gdouble
+rspamd_symcache_hist_bound (guint bucket)
+{
+	return (gdouble)(1ULL << bucket) / 1000.0;
+}
 
 static gboolean rspamd_symcache_check_symbol (struct rspamd_task *task,
 		struct rspamd_symcache *cache,
@@ -227,12 +323,17 @@ static gboolean rspamd_symcache_check_deps (struct rspamd_task *task,
 		struct cache_savepoint *checkpoint,
 		guint recursion,
 		gboolean check_only);
-static void rspamd_symcache_disable_symbol_checkpoint (struct rspamd_task *task,
-		struct rspamd_symcache *cache, const gchar *symbol);
-static void rspamd_symcache_enable_symbol_checkpoint (struct rspamd_task *task,
-		struct rspamd_symcache *cache, const gchar *symbol);
+static void rspamd_symcache_disable_symbol_plan (struct rspamd_task *task,
+		struct rspamd_symcache *cache,
+		struct symcache_settings_plan *plan,
+		const gchar *symbol);
+static void rspamd_symcache_enable_symbol_plan (struct rspamd_task *task,
+		struct rspamd_symcache *cache,
+		struct symcache_settings_plan *plan,
+		const gchar *symbol);
 static void rspamd_symcache_disable_all_symbols (struct rspamd_task *task,
-		struct rspamd_symcache *cache);
+		struct rspamd_symcache *cache,
+		struct symcache_settings_plan *plan);
 
 static void
 rspamd_symcache_order_dtor (gpointer p)
@@ -240,6 +341,16 @@ rspamd_symcache_order_dtor (gpointer p)
 	struct symcache_order *ord = p;
 
 	g_ptr_array_free (ord->d, TRUE);
+
+	if (ord->frozen) {
+#if defined(HAVE_MMAP_ANON)
+		munmap (ord->ids, ord->compiled_len);
+#endif
+	}
+	else {
+		g_free (ord->ids);
+	}
+
 	g_free (ord);
 }
 
@@ -251,6 +362,16 @@ rspamd_symcache_order_unref (gpointer p)
 	REF_RELEASE (ord);
 }
 
+static void
+rspamd_symcache_settings_plan_dtor (gpointer p)
+{
+	struct symcache_settings_plan *plan = p;
+
+	g_free (plan->mask);
+	g_free (plan->value);
+	g_free (plan);
+}
+
 static struct symcache_order *
 rspamd_symcache_order_new (struct rspamd_symcache *cache,
 		gsize nelts)
@@ -272,6 +393,91 @@ rspamd_symcache_get_dynamic (struct cache_savepoint *checkpoint,
 	return &checkpoint->dynamic_items[item->id];
 }
 
+static inline gdouble
+rspamd_symcache_task_now (struct rspamd_task *task)
+{
+#ifdef HAVE_EVENT_NO_CACHE_TIME_FUNC
+	struct timeval tv;
+
+	event_base_update_cache_time (task->ev_base);
+	event_base_gettimeofday_cached (task->ev_base, &tv);
+
+	return tv_to_double (&tv);
+#else
+	return rspamd_get_ticks (FALSE);
+#endif
+}
+
+static inline gboolean
+rspamd_symcache_item_is_independent (struct symcache_order *ord, gint id)
+{
+	if (id >= (gint)ord->nitems) {
+		return TRUE;
+	}
+
+	return ord->deps_off[id] == ord->deps_off[id + 1];
+}
+
+/*
+ * Builds contiguous arrays from the sorted pointers array, so the filters pass
+ * and dependencies checks do not need to chase items and deps pointers
+ */
+static void
+rspamd_symcache_order_compile (struct rspamd_symcache *cache,
+		struct symcache_order *ord)
+{
+	struct rspamd_symcache_item *it;
+	struct cache_dependency *dep;
+	guint i, j, ndeps = 0, cur_dep = 0, nindependent = 0;
+	guint *block;
+
+	ord->nitems = cache->items_by_id->len;
+
+	PTR_ARRAY_FOREACH (cache->items_by_id, i, it) {
+		if (it->deps) {
+			ndeps += it->deps->len;
+		}
+	}
+
+	/* All elements are 32 bits wide so there is no padding between arrays */
+	ord->compiled_len = sizeof (guint) * ((ord->d->len + 1) * 3 +
+			(ord->nitems + 1) + (ndeps + 1));
+	block = g_malloc (ord->compiled_len);
+	ord->ids = block;
+	ord->types = ord->ids + ord->d->len + 1;
+	ord->priorities = (gint *)(ord->types + ord->d->len + 1);
+	ord->deps_off = (guint *)(ord->priorities + ord->d->len + 1);
+	ord->deps_ids = ord->deps_off + ord->nitems + 1;
+
+	PTR_ARRAY_FOREACH (ord->d, i, it) {
+		ord->ids[i] = it->id;
+		ord->types[i] = it->type;
+		ord->priorities[i] = it->priority;
+	}
+
+	PTR_ARRAY_FOREACH (cache->items_by_id, i, it) {
+		ord->deps_off[i] = cur_dep;
+
+		PTR_ARRAY_FOREACH (it->deps, j, dep) {
+			if (dep->item != NULL) {
+				ord->deps_ids[cur_dep++] = dep->item->id;
+			}
+		}
+	}
+
+	ord->deps_off[ord->nitems] = cur_dep;
+
+	PTR_ARRAY_FOREACH (ord->d, i, it) {
+		if (rspamd_symcache_item_is_independent (ord, it->id)) {
+			nindependent ++;
+		}
+	}
+
+	msg_debug_cache ("compiled order of %ud filters, %ud of them have no "
+			"dependencies, %ud dependencies total",
+			ord->d->len, nindependent, cur_dep);
+}
+
 static inline struct rspamd_symcache_item *
 rspamd_symcache_find_filter (struct rspamd_symcache *cache,
 							 const gchar *name)
@@ -360,16 +566,25 @@ cache_logic_cmp (const void *p1, const void *p2, gpointer ud)
 	if (o1 == o2) {
 		/* Heurstic */
 		if (i1->priority == i2->priority) {
-			avg_freq = ((gdouble) cache->total_hits / cache->used_items);
-			avg_weight = (cache->total_weight / cache->used_items);
-			f1 = (double) i1->st->total_hits / avg_freq;
-			f2 = (double) i2->st->total_hits / avg_freq;
-			weight1 = fabs (i1->st->weight) / avg_weight;
-			weight2 = fabs (i2->st->weight) / avg_weight;
 			t1 = i1->st->avg_time;
 			t2 = i2->st->avg_time;
-			w1 = SCORE_FUN (weight1, f1, t1);
-			w2 = SCORE_FUN (weight2, f2, t2);
+
+			if (i1->st->total_runs > COST_MIN_RUNS &&
+					i2->st->total_runs > COST_MIN_RUNS) {
+				/* Cheap items that are likely to add score go first */
+				w1 = COST_FUN (i1->st->expected_score, t1);
+				w2 = COST_FUN (i2->st->expected_score, t2);
+			}
+			else {
+				avg_freq = ((gdouble) cache->total_hits / cache->used_items);
+				avg_weight = (cache->total_weight / cache->used_items);
+				f1 = (double) i1->st->total_hits / avg_freq;
+				f2 = (double) i2->st->total_hits / avg_freq;
+				weight1 = fabs (i1->st->weight) / avg_weight;
+				weight2 = fabs (i2->st->weight) / avg_weight;
+				w1 = SCORE_FUN (weight1, f1, t1);
+				w2 = SCORE_FUN (weight2, f2, t2);
+			}
 		} else {
 			/* Strict sorting */
 			w1 = abs (i1->priority);
@@ -428,6 +643,42 @@ rspamd_symcache_tsort_visit (struct rspamd_symcache *cache,
 	TSORT_MARK_PERM (it);
 }
 
+/*
+ * Updates hit probability and expected score of filters, virtual symbols
+ * contribute their scores to the parent item
+ */
+static void
+rspamd_symcache_update_cost (struct rspamd_symcache *cache)
+{
+	struct rspamd_symcache_item *it, *parent;
+	guint i;
+
+	PTR_ARRAY_FOREACH (cache->filters, i, it) {
+		if (it->st->total_runs > 0) {
+			it->st->hit_probability = MIN (1.0,
+					(gdouble)it->st->total_hits / it->st->total_runs);
+		}
+
+		it->st->expected_score = fabs (it->st->weight) *
+				it->st->hit_probability;
+	}
+
+	PTR_ARRAY_FOREACH (cache->virtual, i, it) {
+		if (it->specific.virtual.parent < (gint)cache->items_by_id->len) {
+			parent = g_ptr_array_index (cache->items_by_id,
+					it->specific.virtual.parent);
+
+			if (parent->st->total_runs > 0) {
+				it->st->hit_probability = MIN (1.0,
+						(gdouble)it->st->total_hits / parent->st->total_runs);
+				it->st->expected_score = fabs (it->st->weight) *
+						it->st->hit_probability;
+				parent->st->expected_score += it->st->expected_score;
+			}
+		}
+	}
+}
+
 static void
 rspamd_symcache_resort (struct rspamd_symcache *cache)
 {
@@ -445,6 +696,8 @@ rspamd_symcache_resort (struct rspamd_symcache *cache)
 		g_ptr_array_add (ord->d, it);
 	}
 
+	rspamd_symcache_update_cost (cache);
+
 	/* Topological sort, intended to be O(N) but my implementation
 	 * is not linear (semi-linear usually) as I want to make it as
 	 * simple as possible.
@@ -464,8 +717,24 @@ rspamd_symcache_resort (struct rspamd_symcache *cache)
 	 */
 	g_ptr_array_sort_with_data (ord->d, cache_logic_cmp, cache);
 	cache->total_hits = total_hits;
+	rspamd_symcache_order_compile (cache, ord);
 
 	if (cache->items_by_order) {
+		struct symcache_order *old_ord = cache->items_by_order;
+
+		if (old_ord->frozen && old_ord->compiled_len == ord->compiled_len &&
+				old_ord->d->len == ord->d->len &&
+				memcmp (old_ord->ids, ord->ids, ord->compiled_len) == 0) {
+			/*
+			 * Order has not been changed, so we keep the shared pages
+			 * instead of making a private copy of the same data
+			 */
+			old_ord->id = ord->id;
+			REF_RELEASE (ord);
+
+			return;
+		}
+
 		REF_RELEASE (cache->items_by_order);
 	}
 
@@ -693,6 +962,11 @@ rspamd_symcache_load_items (struct rspamd_symcache *cache, const gchar *name)
 				item->last_count = item->st->total_hits;
 			}
 
+			elt = ucl_object_lookup (cur, "runs");
+			if (elt) {
+				item->st->total_runs = ucl_object_toint (elt);
+			}
+
 			elt = ucl_object_lookup (cur, "frequency");
 			if (elt && ucl_object_type (elt) == UCL_OBJECT) {
 				const ucl_object_t *cur;
@@ -799,6 +1073,8 @@ rspamd_symcache_save_items (struct rspamd_symcache *cache, const gchar *name)
 				"time", 0, false);
 		ucl_object_insert_key (elt, ucl_object_fromint (item->st->total_hits),
 				"count", 0, false);
+		ucl_object_insert_key (elt, ucl_object_fromint (item->st->total_runs),
+				"runs", 0, false);
 
 		freq = ucl_object_typed_new (UCL_OBJECT);
 		ucl_object_insert_key (freq,
@@ -1082,6 +1358,7 @@ rspamd_symcache_destroy (struct rspamd_symcache *cache)
 		}
 
 		g_hash_table_destroy (cache->items_by_symbol);
+		g_hash_table_destroy (cache->settings_plans);
 		g_ptr_array_free (cache->items_by_id, TRUE);
 		rspamd_mempool_delete (cache->static_pool);
 		g_ptr_array_free (cache->filters, TRUE);
@@ -1111,6 +1388,8 @@ rspamd_symcache_new (struct rspamd_config *cfg)
 	cache->items_by_symbol = g_hash_table_new (rspamd_str_hash,
 			rspamd_str_equal);
 	cache->items_by_id = g_ptr_array_new ();
+	cache->settings_plans = g_hash_table_new_full (g_int64_hash,
+			g_int64_equal, NULL, rspamd_symcache_settings_plan_dtor);
 	cache->filters = g_ptr_array_new ();
 	cache->prefilters = g_ptr_array_new ();
 	cache->postfilters = g_ptr_array_new ();
@@ -1151,6 +1430,53 @@ rspamd_symcache_init (struct rspamd_symcache *cache)
 	return res;
 }
 
+void
+rspamd_symcache_freeze (struct rspamd_symcache *cache)
+{
+#if defined(HAVE_MMAP_ANON)
+	struct symcache_order *ord;
+	gpointer map;
+
+	g_assert (cache != NULL);
+	ord = cache->items_by_order;
+
+	if (ord == NULL || ord->frozen || ord->compiled_len == 0) {
+		return;
+	}
+
+	map = mmap (NULL, ord->compiled_len, PROT_READ | PROT_WRITE,
+			MAP_ANON | MAP_SHARED, -1, 0);
+
+	if (map == MAP_FAILED) {
+		msg_warn_cache ("cannot map %z bytes for the frozen symbols order: %s",
+				ord->compiled_len, strerror (errno));
+
+		return;
+	}
+
+	memcpy (map, ord->ids, ord->compiled_len);
+
+	if (mprotect (map, ord->compiled_len, PROT_READ) == -1) {
+		msg_warn_cache ("cannot protect the frozen symbols order: %s",
+				strerror (errno));
+		munmap (map, ord->compiled_len);
+
+		return;
+	}
+
+	g_free (ord->ids);
+	ord->ids = map;
+	ord->types = ord->ids + ord->d->len + 1;
+	ord->priorities = (gint *)(ord->types + ord->d->len + 1);
+	ord->deps_off = (guint *)(ord->priorities + ord->d->len + 1);
+	ord->deps_ids = ord->deps_off + ord->nitems + 1;
+	ord->frozen = TRUE;
+
+	msg_info_cache ("frozen symbols order: %z bytes are shared between workers",
+			ord->compiled_len);
+#endif
+}
+
 
 static void
 rspamd_symcache_validate_cb (gpointer k, gpointer v, gpointer ud)
@@ -1300,6 +1626,53 @@ rspamd_symcache_validate (struct rspamd_symcache *cache,
 	return ret;
 }
 
+guint
+rspamd_symcache_update_weights (struct rspamd_symcache *cache)
+{
+	struct rspamd_symcache_item *item, *parent;
+	struct rspamd_symbol *sym_def;
+	GHashTableIter it;
+	gpointer k, v;
+	gdouble weight;
+	guint nchanged = 0;
+
+	g_assert (cache != NULL);
+
+	g_hash_table_iter_init (&it, cache->cfg->symbols);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		sym_def = v;
+		weight = *sym_def->weight_ptr;
+		item = g_hash_table_lookup (cache->items_by_symbol, k);
+
+		if (item == NULL || item->st->weight == weight) {
+			continue;
+		}
+
+		msg_debug_cache ("update weight of %s: %.2f -> %.2f", item->symbol,
+				item->st->weight, weight);
+		cache->total_weight += fabs (weight) - fabs (item->st->weight);
+		item->st->weight = weight;
+		nchanged ++;
+
+		if (item->is_virtual) {
+			parent = g_ptr_array_index (cache->items_by_id,
+					item->specific.virtual.parent);
+
+			if (fabs (parent->st->weight) < fabs (weight)) {
+				parent->st->weight = weight;
+			}
+		}
+	}
+
+	if (nchanged > 0) {
+		msg_info_cache ("updated weights of %ud symbols, resort cache", nchanged);
+		rspamd_symcache_resort (cache);
+	}
+
+	return nchanged;
+}
+
 /* Return true if metric has score that is more than spam score for it */
 static gboolean
 rspamd_symcache_metric_limit (struct rspamd_task *task,
@@ -1345,10 +1718,11 @@ rspamd_symcache_check_symbol (struct rspamd_task *task,
 		struct rspamd_symcache_item *item,
 		struct cache_savepoint *checkpoint)
 {
-	double t1 = 0;
+	double t1 = 0, cpu1 = 0;
 	struct rspamd_task **ptask;
 	lua_State *L;
 	gboolean check = TRUE;
+	guint prev_span = RSPAMD_TRACE_NO_SPAN;
 	struct rspamd_symcache_dynamic_item *dyn_item =
 			rspamd_symcache_get_dynamic (checkpoint, item);
 
@@ -1359,15 +1733,15 @@ rspamd_symcache_check_symbol (struct rspamd_task *task,
 
 	g_assert (!item->is_virtual);
 	g_assert (item->specific.normal.func != NULL);
-	if (CHECK_START_BIT (checkpoint, dyn_item)) {
+	if (CHECK_START_BIT (checkpoint, item->id)) {
 		/*
 		 * This can actually happen when deps span over different layers
 		 */
-		return CHECK_FINISH_BIT (checkpoint, dyn_item);
+		return CHECK_FINISH_BIT (checkpoint, item->id);
 	}
 
 	/* Check has been started */
-	SET_START_BIT (checkpoint, dyn_item);
+	SET_START_BIT (checkpoint, item->id);
 
 	if (!item->enabled ||
 		(RSPAMD_TASK_IS_EMPTY (task) && !(item->type & SYMBOL_TYPE_EMPTY))) {
@@ -1394,30 +1768,38 @@ rspamd_symcache_check_symbol (struct rspamd_task *task,
 
 	if (check) {
 		msg_debug_cache_task ("execute %s, %d", item->symbol, item->id);
-#ifdef HAVE_EVENT_NO_CACHE_TIME_FUNC
-		struct timeval tv;
-
-		event_base_update_cache_time (task->ev_base);
-		event_base_gettimeofday_cached (task->ev_base, &tv);
-		t1 = tv_to_double (&tv);
-#else
-		t1 = rspamd_get_ticks (FALSE);
-#endif
+		t1 = rspamd_symcache_task_now (task);
 		dyn_item->start_msec = (t1 - task->time_real) * 1e3;
 		dyn_item->async_events = 0;
 		g_assert (checkpoint->cur_item == NULL);
 		checkpoint->cur_item = item;
 		checkpoint->items_inflight ++;
+
+		if (G_UNLIKELY (task->trace)) {
+			/* Async events started by this item are its children */
+			dyn_item->span = rspamd_trace_span_start (task->trace, item->symbol,
+					RSPAMD_TRACE_ROOT_SPAN);
+			prev_span = rspamd_trace_set_current (task->trace, dyn_item->span);
+			cpu1 = rspamd_get_virtual_ticks ();
+		}
+
 		/* Callback now must finalize itself */
 		item->specific.normal.func (task, item, item->specific.normal.user_data);
 		checkpoint->cur_item = NULL;
 
+		if (G_UNLIKELY (task->trace)) {
+			/* The item may be finalized already, but its span is still valid */
+			rspamd_trace_span_add_cpu (task->trace, dyn_item->span,
+					rspamd_get_virtual_ticks () - cpu1);
+			rspamd_trace_set_current (task->trace, prev_span);
+		}
+
 		if (checkpoint->items_inflight == 0) {
 
 			return TRUE;
 		}
 
-		if (dyn_item->async_events == 0 && !CHECK_FINISH_BIT (checkpoint, dyn_item)) {
+		if (dyn_item->async_events == 0 && !CHECK_FINISH_BIT (checkpoint, item->id)) {
 			msg_err_cache ("critical error: item %s has no async events pending, "
 						   "but it is not finalised", item->symbol);
 			g_assert_not_reached ();
@@ -1428,7 +1810,7 @@ rspamd_symcache_check_symbol (struct rspamd_task *task,
 	else {
 		msg_debug_cache_task ("skipping check of %s as its start condition is false",
 				item->symbol);
-		SET_FINISH_BIT (checkpoint, dyn_item);
+		SET_FINISH_BIT (checkpoint, item->id);
 	}
 
 	return TRUE;
@@ -1442,11 +1824,11 @@ rspamd_symcache_check_deps (struct rspamd_task *task,
 		guint recursion,
 		gboolean check_only)
 {
-	struct cache_dependency *dep;
-	guint i;
+	struct rspamd_symcache_item *dep_item;
+	struct symcache_order *ord = checkpoint->order;
+	guint i, dep_id;
 	gboolean ret = TRUE;
 	static const guint max_recursion = 20;
-	struct rspamd_symcache_dynamic_item *dyn_item;
 
 	if (recursion > max_recursion) {
 		msg_err_task ("cyclic dependencies: maximum check level %ud exceed when "
@@ -1455,74 +1837,73 @@ rspamd_symcache_check_deps (struct rspamd_task *task,
 		return TRUE;
 	}
 
-	if (item->deps != NULL && item->deps->len > 0) {
-		for (i = 0; i < item->deps->len; i ++) {
-			dep = g_ptr_array_index (item->deps, i);
+	if (item->id >= (gint)ord->nitems) {
+		/* Item has been added after the order was compiled, no resolved deps */
+		return TRUE;
+	}
 
-			if (dep->item == NULL) {
-				/* Assume invalid deps as done */
-				msg_debug_cache_task ("symbol %d(%s) has invalid dependencies on %d(%s)",
-						item->id, item->symbol, dep->id, dep->sym);
-				continue;
-			}
+	for (i = ord->deps_off[item->id]; i < ord->deps_off[item->id + 1]; i ++) {
+		dep_id = ord->deps_ids[i];
+
+		if (!CHECK_FINISH_BIT (checkpoint, dep_id)) {
+			dep_item = g_ptr_array_index (cache->items_by_id, dep_id);
 
-			dyn_item = rspamd_symcache_get_dynamic (checkpoint, dep->item);
-
-			if (!CHECK_FINISH_BIT (checkpoint, dyn_item)) {
-				if (!CHECK_START_BIT (checkpoint, dyn_item)) {
-					/* Not started */
-					if (!check_only) {
-						if (!rspamd_symcache_check_deps (task, cache,
-								dep->item,
-								checkpoint,
-								recursion + 1,
-								check_only)) {
-
-							ret = FALSE;
-							msg_debug_cache_task ("delayed dependency %d(%s) for "
-											"symbol %d(%s)",
-									dep->id, dep->sym, item->id, item->symbol);
-						}
-						else if (!rspamd_symcache_check_symbol (task, cache,
-								dep->item,
-								checkpoint)) {
-							/* Now started, but has events pending */
-							ret = FALSE;
-							msg_debug_cache_task ("started check of %d(%s) symbol "
-											"as dep for "
-											"%d(%s)",
-									dep->id, dep->sym, item->id, item->symbol);
-						}
-						else {
-							msg_debug_cache_task ("dependency %d(%s) for symbol %d(%s) is "
-									"already processed",
-									dep->id, dep->sym, item->id, item->symbol);
-						}
+			if (!CHECK_START_BIT (checkpoint, dep_id)) {
+				/* Not started */
+				if (!check_only) {
+					if (!rspamd_symcache_check_deps (task, cache,
+							dep_item,
+							checkpoint,
+							recursion + 1,
+							check_only)) {
+
+						ret = FALSE;
+						msg_debug_cache_task ("delayed dependency %d(%s) for "
+										"symbol %d(%s)",
+								dep_item->id, dep_item->symbol,
+								item->id, item->symbol);
+					}
+					else if (!rspamd_symcache_check_symbol (task, cache,
+							dep_item,
+							checkpoint)) {
+						/* Now started, but has events pending */
+						ret = FALSE;
+						msg_debug_cache_task ("started check of %d(%s) symbol "
+										"as dep for "
+										"%d(%s)",
+								dep_item->id, dep_item->symbol,
+								item->id, item->symbol);
 					}
 					else {
-						msg_debug_cache_task ("dependency %d(%s) for symbol %d(%s) "
-										"cannot be started now",
-								dep->id, dep->sym,
+						msg_debug_cache_task ("dependency %d(%s) for symbol %d(%s) is "
+								"already processed",
+								dep_item->id, dep_item->symbol,
 								item->id, item->symbol);
-						ret = FALSE;
 					}
 				}
 				else {
-					/* Started but not finished */
-					msg_debug_cache_task ("dependency %d(%s) for symbol %d(%s) is "
-									"still executing",
-							dep->id, dep->sym,
+					msg_debug_cache_task ("dependency %d(%s) for symbol %d(%s) "
+									"cannot be started now",
+							dep_item->id, dep_item->symbol,
 							item->id, item->symbol);
 					ret = FALSE;
 				}
 			}
 			else {
-				msg_debug_cache_task ("dependency %d(%s) for symbol %d(%s) is already "
-						"checked",
-						dep->id, dep->sym,
+				/* Started but not finished */
+				msg_debug_cache_task ("dependency %d(%s) for symbol %d(%s) is "
+								"still executing",
+						dep_item->id, dep_item->symbol,
 						item->id, item->symbol);
+				ret = FALSE;
 			}
 		}
+		else {
+			msg_debug_cache_task ("dependency %d for symbol %d(%s) is already "
+					"checked",
+					dep_id,
+					item->id, item->symbol);
+		}
 	}
 
 	return ret;
@@ -1533,6 +1914,7 @@ rspamd_symcache_make_checkpoint (struct rspamd_task *task,
 		struct rspamd_symcache *cache)
 {
 	struct cache_savepoint *checkpoint;
+	guint nwords;
 
 	if (cache->items_by_order->id != cache->id) {
 		/*
@@ -1544,9 +1926,16 @@ rspamd_symcache_make_checkpoint (struct rspamd_task *task,
 		rspamd_symcache_resort (cache);
 	}
 
+	nwords = SAVEPOINT_BITS_LEN (cache->items_by_id->len);
 	checkpoint = rspamd_mempool_alloc0 (task->task_pool,
-			sizeof (*checkpoint) +
-			sizeof (struct rspamd_symcache_dynamic_item) * cache->items_by_id->len);
+			sizeof (*checkpoint) + sizeof (guint64) * nwords * 2);
+	checkpoint->nwords = nwords;
+	checkpoint->started = checkpoint->bits;
+	checkpoint->finished = checkpoint->bits + nwords;
+	/* Filled when an item is started, so no need to zero it */
+	checkpoint->dynamic_items = rspamd_mempool_alloc (task->task_pool,
+			sizeof (struct rspamd_symcache_dynamic_item) *
+			MAX (cache->items_by_id->len, 1));
 
 	g_assert (cache->items_by_order != NULL);
 	checkpoint->version = cache->items_by_order->d->len;
@@ -1563,35 +1952,83 @@ rspamd_symcache_make_checkpoint (struct rspamd_task *task,
 	return checkpoint;
 }
 
-gboolean
-rspamd_symcache_process_settings (struct rspamd_task *task,
-								  struct rspamd_symcache *cache)
+static const gchar *rspamd_symcache_settings_keys[] = {
+	"symbols_enabled",
+	"groups_enabled",
+	"symbols_disabled",
+	"groups_disabled",
+};
+
+/* Hashes symbols and groups affected by settings, returns 0 if there are none */
+static guint64
+rspamd_symcache_settings_hash (const ucl_object_t *settings)
 {
-	const ucl_object_t *wl, *cur, *disabled, *enabled;
+	const ucl_object_t *elt, *cur;
+	ucl_object_iter_t it;
+	const gchar *str;
+	gsize slen;
+	guint64 h = 0xdeadbabe;
+	gboolean found = FALSE;
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (rspamd_symcache_settings_keys); i ++) {
+		elt = ucl_object_lookup (settings, rspamd_symcache_settings_keys[i]);
+
+		if (elt == NULL) {
+			continue;
+		}
+
+		found = TRUE;
+		h = t1ha (&i, sizeof (i), h);
+		it = NULL;
+
+		while ((cur = ucl_iterate_object (elt, &it, true)) != NULL) {
+			str = ucl_object_tolstring (cur, &slen);
+
+			if (str) {
+				h = t1ha (str, slen + 1, h);
+			}
+		}
+	}
+
+	if (!found) {
+		return 0;
+	}
+
+	return h != 0 ? h : 1;
+}
+
+static struct symcache_settings_plan *
+rspamd_symcache_build_settings_plan (struct rspamd_task *task,
+		struct rspamd_symcache *cache, guint64 key)
+{
+	const ucl_object_t *cur, *disabled, *enabled;
 	struct rspamd_symbols_group *gr;
+	struct symcache_settings_plan *plan;
 	GHashTableIter gr_it;
 	ucl_object_iter_t it = NULL;
 	gboolean already_disabled = FALSE;
 	gpointer k, v;
 
-	wl = ucl_object_lookup (task->settings, "whitelist");
+	plan = g_malloc0 (sizeof (*plan));
+	plan->key = key;
+	plan->id = cache->id;
+	plan->nwords = SAVEPOINT_BITS_LEN (cache->items_by_id->len);
+	plan->mask = g_malloc0 (sizeof (guint64) * MAX (plan->nwords, 1));
+	plan->value = g_malloc0 (sizeof (guint64) * MAX (plan->nwords, 1));
 
-	if (wl != NULL) {
-		msg_info_task ("<%s> is whitelisted", task->message_id);
-		task->flags |= RSPAMD_TASK_FLAG_SKIP;
-		return TRUE;
-	}
+	msg_debug_cache_task ("build settings plan %uL", key);
 
 	enabled = ucl_object_lookup (task->settings, "symbols_enabled");
 
 	if (enabled) {
 		/* Disable all symbols but selected */
-		rspamd_symcache_disable_all_symbols (task, cache);
+		rspamd_symcache_disable_all_symbols (task, cache, plan);
 		already_disabled = TRUE;
 		it = NULL;
 
 		while ((cur = ucl_iterate_object (enabled, &it, true)) != NULL) {
-			rspamd_symcache_enable_symbol_checkpoint (task, cache,
+			rspamd_symcache_enable_symbol_plan (task, cache, plan,
 					ucl_object_tostring (cur));
 		}
 	}
@@ -1603,7 +2040,7 @@ rspamd_symcache_process_settings (struct rspamd_task *task,
 		it = NULL;
 
 		if (!already_disabled) {
-			rspamd_symcache_disable_all_symbols (task, cache);
+			rspamd_symcache_disable_all_symbols (task, cache, plan);
 		}
 
 		while ((cur = ucl_iterate_object (enabled, &it, true)) != NULL) {
@@ -1615,7 +2052,7 @@ rspamd_symcache_process_settings (struct rspamd_task *task,
 					g_hash_table_iter_init (&gr_it, gr->symbols);
 
 					while (g_hash_table_iter_next (&gr_it, &k, &v)) {
-						rspamd_symcache_enable_symbol_checkpoint (task, cache, k);
+						rspamd_symcache_enable_symbol_plan (task, cache, plan, k);
 					}
 				}
 			}
@@ -1628,7 +2065,7 @@ rspamd_symcache_process_settings (struct rspamd_task *task,
 		it = NULL;
 
 		while ((cur = ucl_iterate_object (disabled, &it, true)) != NULL) {
-			rspamd_symcache_disable_symbol_checkpoint (task, cache,
+			rspamd_symcache_disable_symbol_plan (task, cache, plan,
 					ucl_object_tostring (cur));
 		}
 	}
@@ -1648,22 +2085,172 @@ rspamd_symcache_process_settings (struct rspamd_task *task,
 					g_hash_table_iter_init (&gr_it, gr->symbols);
 
 					while (g_hash_table_iter_next (&gr_it, &k, &v)) {
-						rspamd_symcache_disable_symbol_checkpoint (task, cache, k);
+						rspamd_symcache_disable_symbol_plan (task, cache, plan, k);
 					}
 				}
 			}
 		}
 	}
 
+	return plan;
+}
+
+gboolean
+rspamd_symcache_process_settings (struct rspamd_task *task,
+								  struct rspamd_symcache *cache)
+{
+	const ucl_object_t *wl, *budget;
+	struct cache_savepoint *checkpoint;
+	struct symcache_settings_plan *plan;
+	gdouble budget_time;
+	guint64 key;
+	guint i, nwords;
+
+	wl = ucl_object_lookup (task->settings, "whitelist");
+
+	if (wl != NULL) {
+		msg_info_task ("<%s> is whitelisted", task->message_id);
+		task->flags |= RSPAMD_TASK_FLAG_SKIP;
+		return TRUE;
+	}
+
+	budget = ucl_object_lookup (task->settings, "time_budget");
+
+	if (budget != NULL && ucl_object_todouble_safe (budget, &budget_time) &&
+			budget_time > 0) {
+		if (task->checkpoint == NULL) {
+			checkpoint = rspamd_symcache_make_checkpoint (task, cache);
+			task->checkpoint = checkpoint;
+		}
+		else {
+			checkpoint = task->checkpoint;
+		}
+
+		checkpoint->deadline = task->time_real + budget_time;
+		msg_debug_cache_task ("set time budget to %.3f seconds", budget_time);
+	}
+
+	key = rspamd_symcache_settings_hash (task->settings);
+
+	if (key == 0) {
+		/* No symbols or groups are touched by these settings */
+		return FALSE;
+	}
+
+	plan = g_hash_table_lookup (cache->settings_plans, &key);
+
+	if (plan == NULL || plan->id != cache->id) {
+		plan = rspamd_symcache_build_settings_plan (task, cache, key);
+
+		if (g_hash_table_size (cache->settings_plans) < SETTINGS_PLANS_MAX ||
+				g_hash_table_lookup (cache->settings_plans, &key) != NULL) {
+			g_hash_table_replace (cache->settings_plans, &plan->key, plan);
+		}
+		else {
+			rspamd_mempool_add_destructor (task->task_pool,
+					rspamd_symcache_settings_plan_dtor, plan);
+		}
+	}
+	else {
+		msg_debug_cache_task ("reuse settings plan %uL", key);
+	}
+
+	if (task->checkpoint == NULL) {
+		checkpoint = rspamd_symcache_make_checkpoint (task, cache);
+		task->checkpoint = checkpoint;
+	}
+	else {
+		checkpoint = task->checkpoint;
+	}
+
+	nwords = MIN (plan->nwords, checkpoint->nwords);
+
+	for (i = 0; i < nwords; i ++) {
+		checkpoint->started[i] = (checkpoint->started[i] & ~plan->mask[i]) |
+				(plan->value[i] & plan->mask[i]);
+		checkpoint->finished[i] = (checkpoint->finished[i] & ~plan->mask[i]) |
+				(plan->value[i] & plan->mask[i]);
+	}
+
 	return FALSE;
 }
 
+/*
+ * Checks whether a filter should be skipped as the task time budget would be
+ * exceeded, items with explicit priority are never skipped
+ */
+static gboolean
+rspamd_symcache_check_budget (struct rspamd_task *task,
+		struct rspamd_symcache_item *item,
+		struct cache_savepoint *checkpoint)
+{
+	gdouble remain;
+	const gchar *reason = NULL;
+	ucl_object_t *skipped;
+
+	if (checkpoint->deadline == 0 || item->priority > 0) {
+		return FALSE;
+	}
+
+	remain = checkpoint->deadline - rspamd_symcache_task_now (task);
+
+	if (remain <= 0) {
+		reason = "time budget exhausted";
+	}
+	else if (item->st->total_runs > COST_MIN_RUNS &&
+			item->st->avg_time > remain * 1e3) {
+		reason = "expected time exceeds time budget";
+	}
+
+	if (reason == NULL) {
+		return FALSE;
+	}
+
+	msg_debug_cache_task ("skip %s(%d): %s", item->symbol, item->id, reason);
+	SET_START_BIT (checkpoint, item->id);
+	SET_FINISH_BIT (checkpoint, item->id);
+
+	if (item->symbol) {
+		skipped = (ucl_object_t *)ucl_object_lookup (task->messages, "skipped");
+
+		if (skipped == NULL) {
+			skipped = ucl_object_typed_new (UCL_OBJECT);
+			ucl_object_insert_key (task->messages, skipped, "skipped", 0, false);
+		}
+
+		ucl_object_insert_key (skipped, ucl_object_fromstring (reason),
+				item->symbol, 0, false);
+	}
+
+	return TRUE;
+}
+
+/* Counts items that will not be started as the metric limit has been reached */
+static void
+rspamd_symcache_account_early_skips (struct cache_savepoint *checkpoint,
+		guint start)
+{
+	struct rspamd_symcache_item *item;
+	guint i;
+
+	for (i = start; i < checkpoint->version; i ++) {
+		if (checkpoint->order->types[i] &
+				(SYMBOL_TYPE_CLASSIFIER|SYMBOL_TYPE_FINE)) {
+			continue;
+		}
+
+		if (!CHECK_START_BIT (checkpoint, checkpoint->order->ids[i])) {
+			item = g_ptr_array_index (checkpoint->order->d, i);
+			g_atomic_int_inc (&item->st->early_skips);
+		}
+	}
+}
+
 gboolean
 rspamd_symcache_process_symbols (struct rspamd_task *task,
 								 struct rspamd_symcache *cache, gint stage)
 {
 	struct rspamd_symcache_item *item = NULL;
-	struct rspamd_symcache_dynamic_item *dyn_item;
 	struct cache_savepoint *checkpoint;
 	gint i;
 	gboolean all_done;
@@ -1702,14 +2289,12 @@ rspamd_symcache_process_symbols (struct rspamd_task *task,
 
 		for (i = 0; i < (gint)cache->prefilters->len; i ++) {
 			item = g_ptr_array_index (cache->prefilters, i);
-			dyn_item = rspamd_symcache_get_dynamic (checkpoint, item);
-
 			if (RSPAMD_TASK_IS_SKIPPED (task)) {
 				return TRUE;
 			}
 
-			if (!CHECK_START_BIT (checkpoint, dyn_item) &&
-					!CHECK_FINISH_BIT (checkpoint, dyn_item)) {
+			if (!CHECK_START_BIT (checkpoint, item->id) &&
+					!CHECK_FINISH_BIT (checkpoint, item->id)) {
 				/* Check priorities */
 				if (saved_priority == G_MININT) {
 					saved_priority = item->priority;
@@ -1756,17 +2341,22 @@ rspamd_symcache_process_symbols (struct rspamd_task *task,
 				return TRUE;
 			}
 
-			item = g_ptr_array_index (checkpoint->order->d, i);
-			dyn_item = rspamd_symcache_get_dynamic (checkpoint, item);
-
-			if (item->type & SYMBOL_TYPE_CLASSIFIER) {
+			if (checkpoint->order->types[i] & SYMBOL_TYPE_CLASSIFIER) {
 				continue;
 			}
 
-			if (!CHECK_START_BIT (checkpoint, dyn_item)) {
+			if (!CHECK_START_BIT (checkpoint, checkpoint->order->ids[i])) {
 				all_done = FALSE;
+				item = g_ptr_array_index (checkpoint->order->d, i);
+
+				if (rspamd_symcache_check_budget (task, item, checkpoint)) {
+					continue;
+				}
 
-				if (!rspamd_symcache_check_deps (task, cache, item,
+				/* Independent items can be started without checking deps */
+				if (!rspamd_symcache_item_is_independent (checkpoint->order,
+						item->id) &&
+						!rspamd_symcache_check_deps (task, cache, item,
 						checkpoint, 0, FALSE)) {
 
 					msg_debug_cache_task ("blocked execution of %d(%s) unless deps are "
@@ -1780,12 +2370,13 @@ rspamd_symcache_process_symbols (struct rspamd_task *task,
 						checkpoint);
 			}
 
-			if (!(item->type & SYMBOL_TYPE_FINE)) {
+			if (!(checkpoint->order->types[i] & SYMBOL_TYPE_FINE)) {
 				if (rspamd_symcache_metric_limit (task, checkpoint)) {
 					msg_info_task ("<%s> has already scored more than %.2f, so do "
 								   "not "
 								   "plan more checks", task->message_id,
 							checkpoint->rs->score);
+					rspamd_symcache_account_early_skips (checkpoint, i + 1);
 					all_done = TRUE;
 					break;
 				}
@@ -1814,10 +2405,8 @@ rspamd_symcache_process_symbols (struct rspamd_task *task,
 			}
 
 			item = g_ptr_array_index (cache->postfilters, i);
-			dyn_item = rspamd_symcache_get_dynamic (checkpoint, item);
-
-			if (!CHECK_START_BIT (checkpoint, dyn_item) &&
-					!CHECK_FINISH_BIT (checkpoint, dyn_item)) {
+			if (!CHECK_START_BIT (checkpoint, item->id) &&
+					!CHECK_FINISH_BIT (checkpoint, item->id)) {
 				/* Check priorities */
 				all_done = FALSE;
 
@@ -1863,10 +2452,8 @@ rspamd_symcache_process_symbols (struct rspamd_task *task,
 
 		for (i = 0; i < (gint)cache->idempotent->len; i ++) {
 			item = g_ptr_array_index (cache->idempotent, i);
-			dyn_item = rspamd_symcache_get_dynamic (checkpoint, item);
-
-			if (!CHECK_START_BIT (checkpoint, dyn_item) &&
-					!CHECK_FINISH_BIT (checkpoint, dyn_item)) {
+			if (!CHECK_START_BIT (checkpoint, item->id) &&
+					!CHECK_FINISH_BIT (checkpoint, item->id)) {
 				/* Check priorities */
 				if (saved_priority == G_MININT) {
 					saved_priority = item->priority;
@@ -1895,9 +2482,7 @@ rspamd_symcache_process_symbols (struct rspamd_task *task,
 
 		for (i = 0; i < (gint)cache->idempotent->len; i ++) {
 			item = g_ptr_array_index (cache->idempotent, i);
-			dyn_item = rspamd_symcache_get_dynamic (checkpoint, item);
-
-			if (!CHECK_FINISH_BIT (checkpoint, dyn_item)) {
+			if (!CHECK_FINISH_BIT (checkpoint, item->id)) {
 				all_done = FALSE;
 				break;
 			}
@@ -1921,8 +2506,42 @@ rspamd_symcache_process_symbols (struct rspamd_task *task,
 struct counters_cbdata {
 	ucl_object_t *top;
 	struct rspamd_symcache *cache;
+	gboolean histograms;
 };
 
+static ucl_object_t *
+rspamd_symcache_hist_to_ucl (struct item_stat *st)
+{
+	ucl_object_t *hist, *bucket;
+	guint i, cnt;
+
+	hist = ucl_object_typed_new (UCL_ARRAY);
+
+	for (i = 0; i < RSPAMD_SYMCACHE_HIST_BUCKETS; i ++) {
+		cnt = g_atomic_int_get (&st->time_hist[i]);
+
+		if (cnt > 0) {
+			bucket = ucl_object_typed_new (UCL_OBJECT);
+
+			if (i == RSPAMD_SYMCACHE_HIST_BUCKETS - 1) {
+				ucl_object_insert_key (bucket, ucl_object_fromstring ("inf"),
+						"le", 0, false);
+			}
+			else {
+				ucl_object_insert_key (bucket,
+						ucl_object_fromdouble (rspamd_symcache_hist_bound (i)),
+						"le", 0, false);
+			}
+
+			ucl_object_insert_key (bucket, ucl_object_fromint (cnt),
+					"count", 0, false);
+			ucl_array_append (hist, bucket);
+		}
+	}
+
+	return hist;
+}
+
 #define ROUND_DOUBLE(x) (floor((x) * 100.0) / 100.0)
 
 static void
@@ -1954,6 +2573,18 @@ rspamd_symcache_counters_cb (gpointer k, gpointer v, gpointer ud)
 		ucl_object_insert_key (obj,
 				ucl_object_fromdouble (ROUND_DOUBLE (parent->st->avg_time)),
 				"time", 0, false);
+		ucl_object_insert_key (obj,
+				ucl_object_fromdouble (item->st->hit_probability),
+				"probability", 0, false);
+		ucl_object_insert_key (obj,
+				ucl_object_fromint (parent->st->early_skips),
+				"skipped", 0, false);
+
+		if (cbd->histograms) {
+			ucl_object_insert_key (obj,
+					rspamd_symcache_hist_to_ucl (parent->st),
+					"histogram", 0, false);
+		}
 	}
 	else {
 		ucl_object_insert_key (obj,
@@ -1968,6 +2599,18 @@ rspamd_symcache_counters_cb (gpointer k, gpointer v, gpointer ud)
 		ucl_object_insert_key (obj,
 				ucl_object_fromdouble (ROUND_DOUBLE (item->st->avg_time)),
 				"time", 0, false);
+		ucl_object_insert_key (obj,
+				ucl_object_fromdouble (item->st->hit_probability),
+				"probability", 0, false);
+		ucl_object_insert_key (obj,
+				ucl_object_fromint (item->st->early_skips),
+				"skipped", 0, false);
+
+		if (cbd->histograms) {
+			ucl_object_insert_key (obj,
+					rspamd_symcache_hist_to_ucl (item->st),
+					"histogram", 0, false);
+		}
 	}
 
 	ucl_array_append (top, obj);
@@ -1976,7 +2619,8 @@ rspamd_symcache_counters_cb (gpointer k, gpointer v, gpointer ud)
 #undef ROUND_DOUBLE
 
 ucl_object_t *
-rspamd_symcache_counters (struct rspamd_symcache *cache)
+rspamd_symcache_counters_full (struct rspamd_symcache *cache,
+		gboolean histograms)
 {
 	ucl_object_t *top;
 	struct counters_cbdata cbd;
@@ -1985,12 +2629,142 @@ rspamd_symcache_counters (struct rspamd_symcache *cache)
 	top = ucl_object_typed_new (UCL_ARRAY);
 	cbd.top = top;
 	cbd.cache = cache;
+	cbd.histograms = histograms;
 	g_hash_table_foreach (cache->items_by_symbol,
 			rspamd_symcache_counters_cb, &cbd);
 
 	return top;
 }
 
+void
+rspamd_symcache_histograms_text (struct rspamd_symcache *cache,
+		rspamd_fstring_t **out)
+{
+	struct rspamd_symcache_item *item;
+	guint i, j;
+	guint64 cumulative;
+
+	g_assert (cache != NULL);
+
+	rspamd_printf_fstring (out, "# HELP rspamd_symbol_duration_seconds "
+			"Execution time of symbols\n"
+			"# TYPE rspamd_symbol_duration_seconds histogram\n");
+
+	PTR_ARRAY_FOREACH (cache->items_by_id, i, item) {
+		if (item->symbol == NULL ||
+				!(item->type & (SYMBOL_TYPE_CALLBACK|SYMBOL_TYPE_NORMAL))) {
+			continue;
+		}
+
+		cumulative = 0;
+
+		for (j = 0; j < RSPAMD_SYMCACHE_HIST_BUCKETS; j ++) {
+			cumulative += g_atomic_int_get (&item->st->time_hist[j]);
+
+			if (j == RSPAMD_SYMCACHE_HIST_BUCKETS - 1) {
+				rspamd_printf_fstring (out, "rspamd_symbol_duration_seconds_bucket"
+						"{symbol=\"%s\",le=\"+Inf\"} %uL\n",
+						item->symbol, cumulative);
+			}
+			else {
+				rspamd_printf_fstring (out, "rspamd_symbol_duration_seconds_bucket"
+						"{symbol=\"%s\",le=\"%.6f\"} %uL\n",
+						item->symbol, rspamd_symcache_hist_bound (j) / 1000.0,
+						cumulative);
+			}
+		}
+
+		rspamd_printf_fstring (out, "rspamd_symbol_duration_seconds_count"
+				"{symbol=\"%s\"} %uL\n",
+				item->symbol, cumulative);
+	}
+}
+
+static inline const struct item_stat *
+rspamd_symcache_item_text_stat (struct rspamd_symcache *cache,
+		struct rspamd_symcache_item *item)
+{
+	struct rspamd_symcache_item *parent;
+
+	if (item->is_virtual) {
+		parent = g_ptr_array_index (cache->items_by_id,
+				item->specific.virtual.parent);
+
+		return parent->st;
+	}
+
+	return item->st;
+}
+
+void
+rspamd_symcache_counters_text (struct rspamd_symcache *cache,
+		rspamd_fstring_t **out)
+{
+	struct rspamd_symcache_item *item;
+	const struct item_stat *st;
+	guint i;
+
+	g_assert (cache != NULL);
+
+	rspamd_printf_fstring (out, "# HELP rspamd_symbol_hits_total "
+			"Number of symbol checks\n"
+			"# TYPE rspamd_symbol_hits_total counter\n");
+
+	PTR_ARRAY_FOREACH (cache->items_by_id, i, item) {
+		if (item->symbol == NULL) {
+			continue;
+		}
+
+		st = rspamd_symcache_item_text_stat (cache, item);
+		rspamd_printf_fstring (out, "rspamd_symbol_hits_total"
+				"{symbol=\"%s\"} %uL\n", item->symbol, st->total_hits);
+	}
+
+	rspamd_printf_fstring (out, "# HELP rspamd_symbol_skipped_total "
+			"Number of symbol checks skipped by early termination\n"
+			"# TYPE rspamd_symbol_skipped_total counter\n");
+
+	PTR_ARRAY_FOREACH (cache->items_by_id, i, item) {
+		if (item->symbol == NULL) {
+			continue;
+		}
+
+		st = rspamd_symcache_item_text_stat (cache, item);
+		rspamd_printf_fstring (out, "rspamd_symbol_skipped_total"
+				"{symbol=\"%s\"} %uL\n", item->symbol,
+				(guint64)st->early_skips);
+	}
+
+	rspamd_printf_fstring (out, "# HELP rspamd_symbol_frequency "
+			"Average number of symbol hits per second\n"
+			"# TYPE rspamd_symbol_frequency gauge\n");
+
+	PTR_ARRAY_FOREACH (cache->items_by_id, i, item) {
+		if (item->symbol == NULL) {
+			continue;
+		}
+
+		st = rspamd_symcache_item_text_stat (cache, item);
+		rspamd_printf_fstring (out, "rspamd_symbol_frequency"
+				"{symbol=\"%s\"} %.6f\n", item->symbol, st->avg_frequency);
+	}
+
+	rspamd_printf_fstring (out, "# HELP rspamd_symbol_avg_time_seconds "
+			"Average execution time of symbols\n"
+			"# TYPE rspamd_symbol_avg_time_seconds gauge\n");
+
+	PTR_ARRAY_FOREACH (cache->items_by_id, i, item) {
+		if (item->symbol == NULL) {
+			continue;
+		}
+
+		st = rspamd_symcache_item_text_stat (cache, item);
+		rspamd_printf_fstring (out, "rspamd_symbol_avg_time_seconds"
+				"{symbol=\"%s\"} %.6f\n", item->symbol,
+				st->avg_time / 1000.0);
+	}
+}
+
 static void
 rspamd_symcache_call_peak_cb (struct event_base *ev_base,
 		struct rspamd_symcache *cache,
@@ -2047,6 +2821,8 @@ rspamd_symcache_resort_cb (gint fd, short what, gpointer ud)
 			item = g_ptr_array_index (cache->filters, i);
 			item->st->total_hits += item->st->hits;
 			g_atomic_int_set (&item->st->hits, 0);
+			item->st->total_runs += item->st->runs;
+			g_atomic_int_set (&item->st->runs, 0);
 
 			if (item->last_count > 0 && cbdata->w->index == 0) {
 				/* Calculate frequency */
@@ -2103,9 +2879,24 @@ rspamd_symcache_resort_cb (gint fd, short what, gpointer ud)
 		}
 
 
+		/* Virtual symbols hits are used by the cost model of their parents */
+		for (i = 0; i < cache->virtual->len; i ++) {
+			item = g_ptr_array_index (cache->virtual, i);
+			item->st->total_hits += item->st->hits;
+			g_atomic_int_set (&item->st->hits, 0);
+		}
+
 		cbdata->last_resort = cur_ticks;
 		/* We don't do actual sorting due to topological guarantees */
 	}
+	else if (rspamd_worker_is_scanner (cbdata->w)) {
+		/*
+		 * Shared stats are updated by the primary controller, so we can
+		 * reorder filters according to the cost model, topological order
+		 * is still preserved by resort
+		 */
+		rspamd_symcache_resort (cache);
+	}
 }
 
 void
@@ -2236,6 +3027,31 @@ rspamd_symcache_stat_symbol (struct rspamd_symcache *cache,
 	return FALSE;
 }
 
+gboolean
+rspamd_symcache_symbol_hits (struct rspamd_symcache *cache,
+							 const gchar *name,
+							 guint64 *hits)
+{
+	struct rspamd_symcache_item *item;
+
+	g_assert (cache != NULL);
+
+	if (name == NULL) {
+		return FALSE;
+	}
+
+	item = g_hash_table_lookup (cache->items_by_symbol, name);
+
+	if (item != NULL) {
+		/* Recent hits are moved to the total count on each resort */
+		*hits = item->st->total_hits + g_atomic_int_get (&item->st->hits);
+
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
 const gchar *
 rspamd_symcache_symbol_by_id (struct rspamd_symcache *cache,
 							  gint id)
@@ -2264,55 +3080,33 @@ rspamd_symcache_stats_symbols_count (struct rspamd_symcache *cache)
 
 static void
 rspamd_symcache_disable_all_symbols (struct rspamd_task *task,
-		struct rspamd_symcache *cache)
+		struct rspamd_symcache *cache,
+		struct symcache_settings_plan *plan)
 {
-	struct cache_savepoint *checkpoint;
 	guint i;
 	struct rspamd_symcache_item *item;
-	struct rspamd_symcache_dynamic_item *dyn_item;
-
-	if (task->checkpoint == NULL) {
-		checkpoint = rspamd_symcache_make_checkpoint (task, cache);
-		task->checkpoint = checkpoint;
-	}
-	else {
-		checkpoint = task->checkpoint;
-	}
 
 	/* Enable for squeezed symbols */
 	PTR_ARRAY_FOREACH (cache->items_by_id, i, item) {
-		dyn_item = rspamd_symcache_get_dynamic (checkpoint, item);
-
 		if (!(item->type & SYMBOL_TYPE_SQUEEZED)) {
-			SET_FINISH_BIT (checkpoint, dyn_item);
-			SET_START_BIT (checkpoint, dyn_item);
+			SET_PLAN_BIT (plan, item->id, TRUE);
 		}
 	}
 }
 
 static void
-rspamd_symcache_disable_symbol_checkpoint (struct rspamd_task *task,
-		struct rspamd_symcache *cache, const gchar *symbol)
+rspamd_symcache_disable_symbol_plan (struct rspamd_task *task,
+		struct rspamd_symcache *cache,
+		struct symcache_settings_plan *plan,
+		const gchar *symbol)
 {
-	struct cache_savepoint *checkpoint;
 	struct rspamd_symcache_item *item;
-	struct rspamd_symcache_dynamic_item *dyn_item;
-
-	if (task->checkpoint == NULL) {
-		checkpoint = rspamd_symcache_make_checkpoint (task, cache);
-		task->checkpoint = checkpoint;
-	}
-	else {
-		checkpoint = task->checkpoint;
-	}
 
 	item = rspamd_symcache_find_filter (cache, symbol);
 
 	if (item) {
 		if (!(item->type & SYMBOL_TYPE_SQUEEZED)) {
-			dyn_item = rspamd_symcache_get_dynamic (checkpoint, item);
-			SET_FINISH_BIT (checkpoint, dyn_item);
-			SET_START_BIT (checkpoint, dyn_item);
+			SET_PLAN_BIT (plan, item->id, TRUE);
 			msg_debug_cache_task ("disable execution of %s", symbol);
 		}
 		else {
@@ -2325,28 +3119,18 @@ rspamd_symcache_disable_symbol_checkpoint (struct rspamd_task *task,
 }
 
 static void
-rspamd_symcache_enable_symbol_checkpoint (struct rspamd_task *task,
-		struct rspamd_symcache *cache, const gchar *symbol)
+rspamd_symcache_enable_symbol_plan (struct rspamd_task *task,
+		struct rspamd_symcache *cache,
+		struct symcache_settings_plan *plan,
+		const gchar *symbol)
 {
-	struct cache_savepoint *checkpoint;
 	struct rspamd_symcache_item *item;
-	struct rspamd_symcache_dynamic_item *dyn_item;
-
-	if (task->checkpoint == NULL) {
-		checkpoint = rspamd_symcache_make_checkpoint (task, cache);
-		task->checkpoint = checkpoint;
-	}
-	else {
-		checkpoint = task->checkpoint;
-	}
 
 	item = rspamd_symcache_find_filter (cache, symbol);
 
 	if (item) {
 		if (!(item->type & SYMBOL_TYPE_SQUEEZED)) {
-			dyn_item = rspamd_symcache_get_dynamic (checkpoint, item);
-			dyn_item->finished = 0;
-			dyn_item->started = 0;
+			SET_PLAN_BIT (plan, item->id, FALSE);
 			msg_debug_cache_task ("enable execution of %s", symbol);
 		}
 		else {
@@ -2382,7 +3166,6 @@ rspamd_symcache_is_checked (struct rspamd_task *task,
 {
 	struct cache_savepoint *checkpoint;
 	struct rspamd_symcache_item *item;
-	struct rspamd_symcache_dynamic_item *dyn_item;
 
 	g_assert (cache != NULL);
 	g_assert (symbol != NULL);
@@ -2398,8 +3181,7 @@ rspamd_symcache_is_checked (struct rspamd_task *task,
 	item = rspamd_symcache_find_filter (cache, symbol);
 
 	if (item) {
-		dyn_item = rspamd_symcache_get_dynamic (checkpoint, item);
-		return dyn_item->started;
+		return CHECK_START_BIT (checkpoint, item->id);
 	}
 
 	return FALSE;
@@ -2453,7 +3235,6 @@ rspamd_symcache_is_symbol_enabled (struct rspamd_task *task,
 {
 	struct cache_savepoint *checkpoint;
 	struct rspamd_symcache_item *item;
-	struct rspamd_symcache_dynamic_item *dyn_item;
 	lua_State *L;
 	struct rspamd_task **ptask;
 	gboolean ret = TRUE;
@@ -2468,8 +3249,7 @@ rspamd_symcache_is_symbol_enabled (struct rspamd_task *task,
 		item = rspamd_symcache_find_filter (cache, symbol);
 
 		if (item) {
-			dyn_item = rspamd_symcache_get_dynamic (checkpoint, item);
-			if (CHECK_START_BIT (checkpoint, dyn_item)) {
+			if (CHECK_START_BIT (checkpoint, item->id)) {
 				ret = FALSE;
 			}
 			else {
@@ -2561,7 +3341,6 @@ rspamd_symcache_finalize_item (struct rspamd_task *task,
 	struct rspamd_symcache_dynamic_item *dyn_item;
 	gdouble t2, diff;
 	guint i;
-	struct timeval tv;
 	const gdouble slow_diff_limit = 300;
 
 	/* Sanity checks */
@@ -2585,17 +3364,14 @@ rspamd_symcache_finalize_item (struct rspamd_task *task,
 	}
 
 	msg_debug_cache_task ("process finalize for item %s(%d)", item->symbol, item->id);
-	SET_FINISH_BIT (checkpoint, dyn_item);
+	SET_FINISH_BIT (checkpoint, item->id);
 	checkpoint->items_inflight --;
 	checkpoint->cur_item = NULL;
+	t2 = rspamd_symcache_task_now (task);
 
-#ifdef HAVE_EVENT_NO_CACHE_TIME_FUNC
-	event_base_update_cache_time (task->ev_base);
-	event_base_gettimeofday_cached (task->ev_base, &tv);
-	t2 = tv_to_double (&tv);
-#else
-	t2 = rspamd_get_ticks (FALSE);
-#endif
+	if (G_UNLIKELY (task->trace)) {
+		rspamd_trace_span_finish (task->trace, dyn_item->span);
+	}
 
 	diff = ((t2 - task->time_real) * 1e3 - dyn_item->start_msec);
 
@@ -2611,14 +3387,16 @@ rspamd_symcache_finalize_item (struct rspamd_task *task,
 
 		if (rspamd_worker_is_scanner (task->worker)) {
 			rspamd_set_counter (item->cd, diff);
+			g_atomic_int_inc (&item->st->runs);
+			g_atomic_int_inc (
+					&item->st->time_hist[rspamd_symcache_hist_bucket (diff)]);
 		}
 	}
 
 	/* Process all reverse dependencies */
 	PTR_ARRAY_FOREACH (item->rdeps, i, rdep) {
 		if (rdep->item) {
-			dyn_item = rspamd_symcache_get_dynamic (checkpoint, rdep->item);
-			if (!CHECK_START_BIT (checkpoint, dyn_item)) {
+			if (!CHECK_START_BIT (checkpoint, rdep->item->id)) {
 				msg_debug_cache_task ("check item %d(%s) rdep of %s ",
 						rdep->item->id, rdep->item->symbol, item->symbol);
 
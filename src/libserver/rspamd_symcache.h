@@ -18,6 +18,7 @@
 
 #include "config.h"
 #include "ucl.h"
+#include "fstring.h"
 #include <lua.h>
 #include <event.h>
 
@@ -80,6 +81,13 @@ void rspamd_symcache_save (struct rspamd_symcache *cache);
  */
 gboolean rspamd_symcache_init (struct rspamd_symcache *cache);
 
+/**
+ * Moves the compiled execution order to a shared read-only mapping, so
+ * forked workers do not get private copies of it. Should be called in the
+ * main process after `rspamd_symcache_init`
+ */
+void rspamd_symcache_freeze (struct rspamd_symcache *cache);
+
 /**
  * Generic function to register a symbol
  * @param cache
@@ -143,6 +151,17 @@ gboolean rspamd_symcache_stat_symbol (struct rspamd_symcache *cache,
 									  gdouble *freq_stddev,
 									  gdouble *tm,
 									  guint *nhits);
+
+/**
+ * Returns the total number of hits of a symbol since start
+ * @param cache
+ * @param name
+ * @param hits
+ * @return TRUE if a symbol has been found
+ */
+gboolean rspamd_symcache_symbol_hits (struct rspamd_symcache *cache,
+									  const gchar *name,
+									  guint64 *hits);
 /**
  * Find symbol in cache by its id
  * @param cache
@@ -179,12 +198,44 @@ gboolean rspamd_symcache_validate (struct rspamd_symcache *cache,
 								   struct rspamd_config *cfg,
 								   gboolean strict);
 
+/* Number of log2 buckets in per symbol execution time histograms */
+#define RSPAMD_SYMCACHE_HIST_BUCKETS 24
+
+/**
+ * Updates weights of cache items from the configuration symbols, e.g. after
+ * dynamic scores have been changed, and reorders items if needed
+ * @param cache
+ * @return number of items with changed weights
+ */
+guint rspamd_symcache_update_weights (struct rspamd_symcache *cache);
+
 /**
  * Return statistics about the cache as ucl object (array of objects one per item)
  * @param cache
+ * @param histograms add execution time histograms for each item
  * @return
  */
-ucl_object_t *rspamd_symcache_counters (struct rspamd_symcache *cache);
+ucl_object_t *rspamd_symcache_counters_full (struct rspamd_symcache *cache,
+		gboolean histograms);
+#define rspamd_symcache_counters(cache) \
+	rspamd_symcache_counters_full(cache, FALSE)
+
+/**
+ * Appends execution time histograms of all symbols in Prometheus text format
+ * @param cache
+ * @param out output string
+ */
+void rspamd_symcache_histograms_text (struct rspamd_symcache *cache,
+		rspamd_fstring_t **out);
+
+/**
+ * Appends hits, skips, frequency and average time of all symbols
+ * in Prometheus text format
+ * @param cache
+ * @param out output string
+ */
+void rspamd_symcache_counters_text (struct rspamd_symcache *cache,
+		rspamd_fstring_t **out);
 
 /**
  * Start cache reloading
@@ -0,0 +1,519 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "rspamd.h"
+#include "sa_rules.h"
+#include "task.h"
+#include "libmime/filter.h"
+#include "libutil/expression.h"
+
+enum rspamd_sa_rule_type {
+	RSPAMD_SA_RULE_REGEXP = 0,
+	RSPAMD_SA_RULE_CALLBACK,
+	RSPAMD_SA_RULE_META,
+	RSPAMD_SA_RULE_EXTERNAL,
+};
+
+enum rspamd_sa_meta_state {
+	RSPAMD_SA_META_NEW = 0,
+	RSPAMD_SA_META_VISITING,
+	RSPAMD_SA_META_SORTED,
+	RSPAMD_SA_META_CYCLIC,
+};
+
+struct rspamd_sa_rule {
+	gchar *name;
+	enum rspamd_sa_rule_type type;
+
+	union {
+		struct {
+			rspamd_regexp_t *re;
+			enum rspamd_re_type type;
+			gchar *header;
+			gboolean strong;
+			gboolean negate;
+		} re;
+		struct {
+			rspamd_sa_rule_cb cb;
+			gpointer ud;
+			GDestroyNotify dtor;
+		} cb;
+		struct {
+			struct rspamd_expression *expr;
+			GPtrArray *atoms; /* rspamd_sa_atom */
+			guint idx; /* in results */
+			enum rspamd_sa_meta_state state;
+		} meta;
+		struct {
+			gchar *symbol;
+		} ext;
+	} d;
+};
+
+/* Atom of meta expression, rule is resolved on compilation */
+struct rspamd_sa_atom {
+	struct rspamd_sa_rules *rules;
+	struct rspamd_sa_rule *rule;
+	gchar *name;
+};
+
+struct rspamd_sa_rules {
+	GHashTable *rules; /* name -> rspamd_sa_rule, metas excluded */
+	GHashTable *meta_rules; /* name -> meta rspamd_sa_rule */
+	GPtrArray *metas; /* meta rules in evaluation order after compilation */
+	GPtrArray *externals; /* names of external symbols */
+	gdouble *results; /* value of each meta rule for the current task */
+	guint nresults;
+	rspamd_mempool_t *pool;
+	gboolean compiled;
+};
+
+struct rspamd_sa_rules_parse_data {
+	struct rspamd_sa_rules *rules;
+	GPtrArray *atoms;
+};
+
+static rspamd_expression_atom_t * rspamd_sa_atom_parse (const gchar *line,
+		gsize len, rspamd_mempool_t *pool, gpointer ud, GError **err);
+static gdouble rspamd_sa_atom_process (struct rspamd_expr_process_data *pd,
+		rspamd_expression_atom_t *atom);
+static gint rspamd_sa_atom_priority (rspamd_expression_atom_t *atom);
+
+static const struct rspamd_atom_subr sa_atom_subr = {
+	.parse = rspamd_sa_atom_parse,
+	.process = rspamd_sa_atom_process,
+	.priority = rspamd_sa_atom_priority,
+	.destroy = NULL,
+	.share_atoms = TRUE,
+};
+
+static GQuark
+rspamd_sa_rules_quark (void)
+{
+	return g_quark_from_static_string ("sa-rules");
+}
+
+static void
+rspamd_sa_rule_dtor (gpointer p)
+{
+	struct rspamd_sa_rule *rule = p;
+
+	switch (rule->type) {
+	case RSPAMD_SA_RULE_REGEXP:
+		rspamd_regexp_unref (rule->d.re.re);
+		g_free (rule->d.re.header);
+		break;
+	case RSPAMD_SA_RULE_CALLBACK:
+		if (rule->d.cb.dtor) {
+			rule->d.cb.dtor (rule->d.cb.ud);
+		}
+		break;
+	case RSPAMD_SA_RULE_META:
+		/* Expression itself is owned by the pool */
+		g_ptr_array_free (rule->d.meta.atoms, TRUE);
+		break;
+	case RSPAMD_SA_RULE_EXTERNAL:
+		g_free (rule->d.ext.symbol);
+		break;
+	}
+
+	g_free (rule->name);
+	g_free (rule);
+}
+
+static struct rspamd_sa_rule *
+rspamd_sa_rule_new (struct rspamd_sa_rules *rules, const gchar *name,
+		enum rspamd_sa_rule_type type)
+{
+	struct rspamd_sa_rule *rule;
+
+	g_assert (!rules->compiled);
+
+	rule = g_malloc0 (sizeof (*rule));
+	rule->name = g_strdup (name);
+	rule->type = type;
+	/*
+	 * The last definition wins like in SpamAssassin. Metas have their own
+	 * namespace, so a meta can have the same name as its only atom
+	 */
+	g_hash_table_replace (type == RSPAMD_SA_RULE_META ?
+			rules->meta_rules : rules->rules, rule->name, rule);
+
+	return rule;
+}
+
+struct rspamd_sa_rules *
+rspamd_sa_rules_new (void)
+{
+	struct rspamd_sa_rules *rules;
+
+	rules = g_malloc0 (sizeof (*rules));
+	rules->rules = g_hash_table_new_full (rspamd_str_hash, rspamd_str_equal,
+			NULL, rspamd_sa_rule_dtor);
+	rules->meta_rules = g_hash_table_new_full (rspamd_str_hash,
+			rspamd_str_equal, NULL, rspamd_sa_rule_dtor);
+	rules->metas = g_ptr_array_new ();
+	rules->externals = g_ptr_array_new ();
+	rules->pool = rspamd_mempool_new (rspamd_mempool_suggest_size (),
+			"sa_rules");
+
+	return rules;
+}
+
+void
+rspamd_sa_rules_add_regexp (struct rspamd_sa_rules *rules,
+		const gchar *name,
+		rspamd_regexp_t *re,
+		enum rspamd_re_type type,
+		const gchar *header,
+		gboolean strong,
+		gboolean negate)
+{
+	struct rspamd_sa_rule *rule;
+
+	g_assert (re != NULL);
+
+	rule = rspamd_sa_rule_new (rules, name, RSPAMD_SA_RULE_REGEXP);
+	rule->d.re.re = rspamd_regexp_ref (re);
+	rule->d.re.type = type;
+	rule->d.re.header = g_strdup (header);
+	rule->d.re.strong = strong;
+	rule->d.re.negate = negate;
+}
+
+void
+rspamd_sa_rules_add_callback (struct rspamd_sa_rules *rules,
+		const gchar *name,
+		rspamd_sa_rule_cb cb,
+		gpointer ud,
+		GDestroyNotify dtor)
+{
+	struct rspamd_sa_rule *rule;
+
+	g_assert (cb != NULL);
+
+	rule = rspamd_sa_rule_new (rules, name, RSPAMD_SA_RULE_CALLBACK);
+	rule->d.cb.cb = cb;
+	rule->d.cb.ud = ud;
+	rule->d.cb.dtor = dtor;
+}
+
+gboolean
+rspamd_sa_rules_add_meta (struct rspamd_sa_rules *rules,
+		const gchar *name,
+		const gchar *expr,
+		GError **err)
+{
+	struct rspamd_sa_rule *rule;
+	struct rspamd_sa_rules_parse_data pd;
+	struct rspamd_expression *parsed = NULL;
+	GPtrArray *atoms;
+
+	atoms = g_ptr_array_new_full (4, g_free);
+	pd.rules = rules;
+	pd.atoms = atoms;
+	/* Atoms point to the expression string */
+	expr = rspamd_mempool_strdup (rules->pool, expr);
+
+	if (!rspamd_parse_expression (expr, 0, &sa_atom_subr, &pd, rules->pool,
+			err, &parsed)) {
+		g_ptr_array_free (atoms, TRUE);
+
+		return FALSE;
+	}
+
+	rule = rspamd_sa_rule_new (rules, name, RSPAMD_SA_RULE_META);
+	rule->d.meta.expr = parsed;
+	rule->d.meta.atoms = atoms;
+
+	return TRUE;
+}
+
+static rspamd_expression_atom_t *
+rspamd_sa_atom_parse (const gchar *line, gsize len, rspamd_mempool_t *pool,
+		gpointer ud, GError **err)
+{
+	struct rspamd_sa_rules_parse_data *pd = ud;
+	rspamd_expression_atom_t *a;
+	struct rspamd_sa_atom *sa;
+	const gchar *p = line, *end = line + len;
+
+	while (p < end && strchr (", \t()><+!|&\n", *p) == NULL) {
+		p ++;
+	}
+
+	if (p == line) {
+		g_set_error (err, rspamd_sa_rules_quark (), 100,
+				"empty atom: %*s", (gint)len, line);
+
+		return NULL;
+	}
+
+	sa = g_malloc0 (sizeof (*sa) + (p - line) + 1);
+	sa->name = ((gchar *)sa) + sizeof (*sa);
+	rspamd_strlcpy (sa->name, line, (p - line) + 1);
+	sa->rules = pd->rules;
+	g_ptr_array_add (pd->atoms, sa);
+
+	a = rspamd_mempool_alloc0 (pool, sizeof (*a));
+	a->str = line;
+	a->len = p - line;
+	a->data = sa;
+
+	return a;
+}
+
+static gint
+rspamd_sa_atom_priority (rspamd_expression_atom_t *atom)
+{
+	struct rspamd_sa_atom *sa = atom->data;
+
+	/*
+	 * Cheap atoms are checked first to short-circuit regexps, rules are
+	 * resolved after parsing so it works from the first resort
+	 */
+	if (sa->rule) {
+		switch (sa->rule->type) {
+		case RSPAMD_SA_RULE_META:
+		case RSPAMD_SA_RULE_EXTERNAL:
+			return 2;
+		case RSPAMD_SA_RULE_CALLBACK:
+			return 1;
+		default:
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static gdouble
+rspamd_sa_atom_process (struct rspamd_expr_process_data *pd,
+		rspamd_expression_atom_t *atom)
+{
+	struct rspamd_sa_atom *sa = atom->data;
+	struct rspamd_sa_rule *rule = sa->rule;
+	struct rspamd_task *task = pd->task;
+	gdouble ret = 0;
+	gint res;
+
+	if (rule == NULL) {
+		return 0;
+	}
+
+	switch (rule->type) {
+	case RSPAMD_SA_RULE_REGEXP:
+		res = rspamd_re_cache_process (task, rule->d.re.re, rule->d.re.type,
+				rule->d.re.header,
+				rule->d.re.header ? strlen (rule->d.re.header) : 0,
+				rule->d.re.strong);
+
+		if (rule->d.re.negate) {
+			ret = res > 0 ? 0 : 1;
+		}
+		else {
+			ret = res;
+		}
+		break;
+	case RSPAMD_SA_RULE_CALLBACK:
+		ret = rule->d.cb.cb (task, rule->d.cb.ud);
+		break;
+	case RSPAMD_SA_RULE_META:
+		/* Dependencies are evaluated first, see rspamd_sa_rules_compile */
+		ret = sa->rules->results[rule->d.meta.idx];
+		break;
+	case RSPAMD_SA_RULE_EXTERNAL:
+		ret = rspamd_task_find_symbol_result (task, rule->d.ext.symbol) ? 1 : 0;
+		break;
+	}
+
+	return ret;
+}
+
+/*
+ * Depth first search over meta dependencies, returns FALSE if the rule
+ * depends on itself (maybe indirectly)
+ */
+static gboolean
+rspamd_sa_rules_sort_meta (struct rspamd_sa_rules *rules,
+		struct rspamd_sa_rule *rule)
+{
+	struct rspamd_sa_atom *sa;
+	gboolean cyclic = FALSE;
+	guint i;
+
+	switch (rule->d.meta.state) {
+	case RSPAMD_SA_META_SORTED:
+		return TRUE;
+	case RSPAMD_SA_META_VISITING:
+	case RSPAMD_SA_META_CYCLIC:
+		return FALSE;
+	default:
+		break;
+	}
+
+	rule->d.meta.state = RSPAMD_SA_META_VISITING;
+
+	PTR_ARRAY_FOREACH (rule->d.meta.atoms, i, sa) {
+		if (sa->rule->type == RSPAMD_SA_RULE_META &&
+				!rspamd_sa_rules_sort_meta (rules, sa->rule)) {
+			cyclic = TRUE;
+		}
+	}
+
+	if (cyclic) {
+		msg_err ("meta rule %s has cyclic dependencies and is ignored",
+				rule->name);
+		rule->d.meta.state = RSPAMD_SA_META_CYCLIC;
+
+		return FALSE;
+	}
+
+	rule->d.meta.state = RSPAMD_SA_META_SORTED;
+	g_ptr_array_add (rules->metas, rule);
+
+	return TRUE;
+}
+
+GPtrArray *
+rspamd_sa_rules_compile (struct rspamd_sa_rules *rules,
+		GHashTable *replacements)
+{
+	GHashTableIter it;
+	GPtrArray *metas;
+	struct rspamd_sa_rule *rule, *ext;
+	struct rspamd_sa_atom *sa;
+	const gchar *sym;
+	gpointer k, v;
+	guint i, j, nmetas;
+
+	if (rules->compiled) {
+		return rules->externals;
+	}
+
+	metas = g_ptr_array_sized_new (g_hash_table_size (rules->meta_rules));
+	g_hash_table_iter_init (&it, rules->meta_rules);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		g_ptr_array_add (metas, v);
+	}
+
+	/* Atoms that are not our rules are symbols inserted by other modules */
+	PTR_ARRAY_FOREACH (metas, i, rule) {
+		PTR_ARRAY_FOREACH (rule->d.meta.atoms, j, sa) {
+			sa->rule = g_hash_table_lookup (rules->rules, sa->name);
+
+			if (sa->rule == NULL) {
+				sa->rule = g_hash_table_lookup (rules->meta_rules, sa->name);
+			}
+
+			if (sa->rule == NULL) {
+				sym = replacements ?
+						g_hash_table_lookup (replacements, sa->name) : NULL;
+				ext = rspamd_sa_rule_new (rules, sa->name,
+						RSPAMD_SA_RULE_EXTERNAL);
+				ext->d.ext.symbol = g_strdup (sym ? sym : sa->name);
+				g_ptr_array_add (rules->externals, ext->d.ext.symbol);
+				sa->rule = ext;
+			}
+		}
+	}
+
+	PTR_ARRAY_FOREACH (metas, i, rule) {
+		rspamd_sa_rules_sort_meta (rules, rule);
+	}
+
+	/* Cyclic rules have slots at the end that are never set */
+	nmetas = 0;
+
+	PTR_ARRAY_FOREACH (rules->metas, i, rule) {
+		rule->d.meta.idx = nmetas ++;
+	}
+
+	PTR_ARRAY_FOREACH (metas, i, rule) {
+		if (rule->d.meta.state == RSPAMD_SA_META_CYCLIC) {
+			rule->d.meta.idx = nmetas ++;
+		}
+	}
+
+	rules->nresults = MAX (nmetas, 1);
+	rules->results = g_malloc0 (sizeof (gdouble) * rules->nresults);
+	rules->compiled = TRUE;
+	g_ptr_array_free (metas, TRUE);
+
+	msg_info ("compiled %d meta rules, %d external symbols",
+			(gint)rules->metas->len, (gint)rules->externals->len);
+
+	return rules->externals;
+}
+
+guint
+rspamd_sa_rules_process (struct rspamd_sa_rules *rules,
+		struct rspamd_task *task)
+{
+	struct rspamd_expr_process_data pd;
+	struct rspamd_symbol_result *s;
+	struct rspamd_sa_rule *rule;
+	rspamd_expression_atom_t *atom;
+	gdouble res;
+	guint i, j, nmatched = 0;
+
+	g_assert (rules->compiled);
+
+	if (rules->metas->len == 0) {
+		return 0;
+	}
+
+	memset (rules->results, 0, sizeof (gdouble) * rules->nresults);
+	memset (&pd, 0, sizeof (pd));
+	pd.task = task;
+	pd.trace = g_ptr_array_sized_new (16);
+
+	PTR_ARRAY_FOREACH (rules->metas, i, rule) {
+		g_ptr_array_set_size (pd.trace, 0);
+		res = rspamd_process_expression_track (rule->d.meta.expr, &pd);
+		rules->results[rule->d.meta.idx] = res;
+
+		if (res > 0) {
+			s = rspamd_task_insert_result (task, rule->name, res, NULL);
+			nmatched ++;
+
+			if (s) {
+				PTR_ARRAY_FOREACH (pd.trace, j, atom) {
+					rspamd_task_add_result_option (task, s,
+							((struct rspamd_sa_atom *)atom->data)->name);
+				}
+			}
+		}
+	}
+
+	g_ptr_array_free (pd.trace, TRUE);
+
+	return nmatched;
+}
+
+void
+rspamd_sa_rules_destroy (struct rspamd_sa_rules *rules)
+{
+	if (rules) {
+		g_hash_table_unref (rules->rules);
+		g_hash_table_unref (rules->meta_rules);
+		g_ptr_array_free (rules->metas, TRUE);
+		g_ptr_array_free (rules->externals, TRUE);
+		g_free (rules->results);
+		/* Expressions */
+		rspamd_mempool_delete (rules->pool);
+		g_free (rules);
+	}
+}
@@ -0,0 +1,91 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef RSPAMD_SA_RULES_H
+#define RSPAMD_SA_RULES_H
+
+#include "config.h"
+#include "libutil/regexp.h"
+#include "re_cache.h"
+
+struct rspamd_task;
+struct rspamd_sa_rules;
+
+/*
+ * Evaluates a rule that is not a plain regexp check (e.g. header rules with
+ * functions applied to a header value)
+ */
+typedef gdouble (*rspamd_sa_rule_cb) (struct rspamd_task *task, gpointer ud);
+
+/**
+ * Creates an empty set of SpamAssassin rules
+ */
+struct rspamd_sa_rules *rspamd_sa_rules_new (void);
+
+/**
+ * Adds a rule that is checked by a regexp from the regexps cache
+ * @param name name of the rule
+ * @param re regexp, it should be registered in the regexps cache
+ * @param type type of the regexp
+ * @param header header name for header regexps, NULL otherwise
+ * @param strong case sensitive header name
+ * @param negate rule matches if the regexp does not match
+ */
+void rspamd_sa_rules_add_regexp (struct rspamd_sa_rules *rules,
+		const gchar *name,
+		rspamd_regexp_t *re,
+		enum rspamd_re_type type,
+		const gchar *header,
+		gboolean strong,
+		gboolean negate);
+
+/**
+ * Adds a rule evaluated by the callback
+ * @param dtor destructor for `ud`, called when rules are destroyed
+ */
+void rspamd_sa_rules_add_callback (struct rspamd_sa_rules *rules,
+		const gchar *name,
+		rspamd_sa_rule_cb cb,
+		gpointer ud,
+		GDestroyNotify dtor);
+
+/**
+ * Parses and adds meta rule, atoms are resolved by `rspamd_sa_rules_compile`
+ * @return FALSE if the expression cannot be parsed
+ */
+gboolean rspamd_sa_rules_add_meta (struct rspamd_sa_rules *rules,
+		const gchar *name,
+		const gchar *expr,
+		GError **err);
+
+/**
+ * Resolves atoms of meta rules and sorts meta rules in dependency order.
+ * Atoms that are not rules are treated as external symbols, their names are
+ * replaced using `replacements` (may be NULL). Meta rules with cyclic
+ * dependencies are never matched.
+ * @return array of external symbols names owned by rules
+ */
+GPtrArray *rspamd_sa_rules_compile (struct rspamd_sa_rules *rules,
+		GHashTable *replacements);
+
+/**
+ * Evaluates all meta rules once and inserts results for matched ones, atoms
+ * of matched rules are added as symbol options
+ * @return number of matched meta rules
+ */
+guint rspamd_sa_rules_process (struct rspamd_sa_rules *rules,
+		struct rspamd_task *task);
+
+void rspamd_sa_rules_destroy (struct rspamd_sa_rules *rules);
+
+#endif
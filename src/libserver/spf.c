@@ -40,6 +40,9 @@
 #define SPF_MAX_NESTING 10
 #define SPF_MAX_DNS_REQUESTS 30
 
+/* Records with less elements are checked linearly */
+#define SPF_INDEX_MIN_ELTS 16
+
 struct spf_resolved_element {
 	GPtrArray *elts;
 	gchar *cur_domain;
@@ -272,6 +275,10 @@ rspamd_flatten_record_dtor (struct spf_resolved *r)
 		g_free (addr->spf_string);
 	}
 
+	if (r->addrs) {
+		radix_destroy_compressed (r->addrs);
+	}
+
 	g_free (r->domain);
 	g_array_free (r->elts, TRUE);
 	g_free (r);
@@ -2229,3 +2236,271 @@ spf_record_unref (struct spf_resolved *rec)
 {
 	REF_RELEASE (rec);
 }
+
+static gboolean
+spf_prefix_contains (const guchar *net, guint mask, const guchar *key)
+{
+	guint bmask = mask / CHAR_BIT;
+	guchar m;
+
+	if (memcmp (net, key, bmask) != 0) {
+		return FALSE;
+	}
+
+	if (bmask * CHAR_BIT < mask) {
+		m = (0xff << (CHAR_BIT - (mask - bmask * CHAR_BIT))) & 0xff;
+
+		return (net[bmask] & m) == (key[bmask] & m);
+	}
+
+	return TRUE;
+}
+
+/*
+ * Inserts prefixes of one family to the tree. As the tree returns the most
+ * specific prefix, each prefix is stored with the lowest index among itself
+ * and all prefixes enclosing it, so the order of elements is preserved
+ */
+static void
+spf_record_index_family (struct spf_resolved *rec, gboolean v6)
+{
+	struct spf_addr *addr, *other;
+	guint i, j, mask, omask, flag, keylen;
+	uintptr_t value;
+	gboolean dup;
+
+	flag = v6 ? RSPAMD_SPF_FLAG_IPV6 : RSPAMD_SPF_FLAG_IPV4;
+	keylen = v6 ? sizeof (addr->addr6) : sizeof (addr->addr4);
+
+	for (i = 0; i < rec->elts->len; i ++) {
+		addr = &g_array_index (rec->elts, struct spf_addr, i);
+
+		if (addr->flags & RSPAMD_SPF_FLAG_TEMPFAIL) {
+			continue;
+		}
+
+		if (!(addr->flags & flag)) {
+			if ((addr->flags & RSPAMD_SPF_FLAG_ANY) &&
+					rec->first_any[v6] == rec->elts->len) {
+				rec->first_any[v6] = i;
+			}
+
+			continue;
+		}
+
+		mask = v6 ? addr->m.dual.mask_v6 : addr->m.dual.mask_v4;
+
+		if (mask > keylen * CHAR_BIT) {
+			/* Never matches */
+			continue;
+		}
+
+		value = i;
+		dup = FALSE;
+
+		for (j = 0; j < rec->elts->len; j ++) {
+			other = &g_array_index (rec->elts, struct spf_addr, j);
+
+			if (j == i || !(other->flags & flag) ||
+					(other->flags & RSPAMD_SPF_FLAG_TEMPFAIL)) {
+				continue;
+			}
+
+			omask = v6 ? other->m.dual.mask_v6 : other->m.dual.mask_v4;
+
+			if (omask > mask || !spf_prefix_contains (
+					v6 ? other->addr6 : other->addr4, omask,
+					v6 ? addr->addr6 : addr->addr4)) {
+				continue;
+			}
+
+			if (omask == mask && j < i) {
+				/* The same prefix has been already inserted */
+				dup = TRUE;
+				break;
+			}
+
+			if (j < value) {
+				value = j;
+			}
+		}
+
+		if (!dup) {
+			radix_insert_compressed (rec->addrs,
+					v6 ? addr->addr6 : addr->addr4, keylen,
+					keylen * CHAR_BIT - mask, value);
+		}
+	}
+}
+
+static void
+spf_record_build_index (struct spf_resolved *rec)
+{
+	rec->indexed = TRUE;
+	rec->first_any[0] = rec->elts->len;
+	rec->first_any[1] = rec->elts->len;
+
+	if (rec->elts->len < SPF_INDEX_MIN_ELTS) {
+		/* Linear scan is faster for small records */
+		return;
+	}
+
+	rec->addrs = radix_create_compressed ();
+	spf_record_index_family (rec, FALSE);
+	spf_record_index_family (rec, TRUE);
+	radix_compile_compressed (rec->addrs);
+}
+
+guint
+spf_record_first_match (struct spf_resolved *rec,
+		const rspamd_inet_addr_t *addr)
+{
+	uintptr_t found;
+	guint any;
+
+	if (!rec->indexed) {
+		spf_record_build_index (rec);
+	}
+
+	if (rec->addrs == NULL || addr == NULL) {
+		return 0;
+	}
+
+	any = rec->first_any[rspamd_inet_address_get_af (addr) == AF_INET6];
+	found = radix_find_compressed_addr (rec->addrs, addr);
+
+	if (found != RADIX_NO_VALUE && found < any) {
+		return found;
+	}
+
+	return any;
+}
+
+/* Serialized record: header followed by elements and their spf strings */
+struct spf_serialized_hdr {
+	guint32 ttl;
+	guint32 nelts;
+	guint8 temp_failed;
+	guint8 na;
+	guint8 perm_failed;
+};
+
+struct spf_serialized_addr {
+	guchar addr6[sizeof (struct in6_addr)];
+	guchar addr4[sizeof (struct in_addr)];
+	guint32 m;
+	guint32 flags;
+	guint32 mech;
+	guint32 slen;
+};
+
+gsize
+spf_record_serialize (struct spf_resolved *rec, guchar *out, gsize outlen)
+{
+	struct spf_serialized_hdr hdr;
+	struct spf_serialized_addr saddr;
+	struct spf_addr *addr;
+	gsize pos = 0;
+	guint i;
+
+	if (outlen < sizeof (hdr)) {
+		return 0;
+	}
+
+	memset (&hdr, 0, sizeof (hdr));
+	hdr.ttl = rec->ttl;
+	hdr.nelts = rec->elts->len;
+	hdr.temp_failed = rec->temp_failed;
+	hdr.na = rec->na;
+	hdr.perm_failed = rec->perm_failed;
+	memcpy (out, &hdr, sizeof (hdr));
+	pos += sizeof (hdr);
+
+	for (i = 0; i < rec->elts->len; i ++) {
+		addr = &g_array_index (rec->elts, struct spf_addr, i);
+		memset (&saddr, 0, sizeof (saddr));
+		memcpy (saddr.addr6, addr->addr6, sizeof (saddr.addr6));
+		memcpy (saddr.addr4, addr->addr4, sizeof (saddr.addr4));
+		saddr.m = addr->m.idx;
+		saddr.flags = addr->flags;
+		saddr.mech = addr->mech;
+		saddr.slen = addr->spf_string ? strlen (addr->spf_string) : 0;
+
+		if (pos + sizeof (saddr) + saddr.slen > outlen) {
+			return 0;
+		}
+
+		memcpy (out + pos, &saddr, sizeof (saddr));
+		pos += sizeof (saddr);
+
+		if (saddr.slen > 0) {
+			memcpy (out + pos, addr->spf_string, saddr.slen);
+			pos += saddr.slen;
+		}
+	}
+
+	return pos;
+}
+
+struct spf_resolved *
+spf_record_deserialize (const gchar *domain, const guchar *in, gsize inlen)
+{
+	struct spf_serialized_hdr hdr;
+	struct spf_serialized_addr saddr;
+	struct spf_resolved *res;
+	struct spf_addr addr;
+	gsize pos = 0;
+	guint i;
+
+	if (inlen < sizeof (hdr)) {
+		return NULL;
+	}
+
+	memcpy (&hdr, in, sizeof (hdr));
+	pos += sizeof (hdr);
+
+	res = g_malloc0 (sizeof (*res));
+	res->elts = g_array_sized_new (FALSE, FALSE, sizeof (struct spf_addr),
+			MIN (hdr.nelts, inlen / sizeof (saddr)));
+	res->domain = g_strdup (domain);
+	res->ttl = hdr.ttl;
+	res->temp_failed = hdr.temp_failed;
+	res->na = hdr.na;
+	res->perm_failed = hdr.perm_failed;
+	REF_INIT_RETAIN (res, rspamd_flatten_record_dtor);
+
+	for (i = 0; i < hdr.nelts; i ++) {
+		if (pos + sizeof (saddr) > inlen) {
+			REF_RELEASE (res);
+
+			return NULL;
+		}
+
+		memcpy (&saddr, in + pos, sizeof (saddr));
+		pos += sizeof (saddr);
+
+		if (pos + saddr.slen > inlen) {
+			REF_RELEASE (res);
+
+			return NULL;
+		}
+
+		memset (&addr, 0, sizeof (addr));
+		memcpy (addr.addr6, saddr.addr6, sizeof (addr.addr6));
+		memcpy (addr.addr4, saddr.addr4, sizeof (addr.addr4));
+		addr.m.idx = saddr.m;
+		addr.flags = saddr.flags;
+		addr.mech = saddr.mech;
+
+		if (saddr.slen > 0) {
+			addr.spf_string = g_malloc (saddr.slen + 1);
+			memcpy (addr.spf_string, in + pos, saddr.slen);
+			addr.spf_string[saddr.slen] = '\0';
+			pos += saddr.slen;
+		}
+
+		g_array_append_val (res->elts, addr);
+	}
+
+	return res;
+}
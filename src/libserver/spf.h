@@ -4,6 +4,7 @@
 #include "config.h"
 #include "ref.h"
 #include "addr.h"
+#include "radix.h"
 
 struct rspamd_task;
 struct spf_resolved;
@@ -65,6 +66,9 @@ struct spf_resolved {
 	gboolean na;
 	gboolean perm_failed;
 	GArray *elts; /* Flat list of struct spf_addr */
+	radix_compressed_t *addrs; /* Index of the first matching element */
+	guint first_any[2]; /* First `all` element for IPv4 and IPv6 */
+	gboolean indexed;
 	ref_entry_t ref; /* Refcounting */
 };
 
@@ -91,4 +95,34 @@ struct spf_resolved * spf_record_ref (struct spf_resolved *rec);
  */
 void spf_record_unref (struct spf_resolved *rec);
 
+/**
+ * Returns index of the first element of the record that could match the
+ * specified address, all elements before it are guaranteed not to match.
+ * Large records are indexed by a radix tree on the first call
+ * @param rec record
+ * @param addr address to check
+ * @return index of element or the number of elements if nothing matches
+ */
+guint spf_record_first_match (struct spf_resolved *rec,
+		const rspamd_inet_addr_t *addr);
+
+/**
+ * Write resolved record to a buffer in a compact binary form suitable for caches
+ * @param rec record
+ * @param out output buffer
+ * @param outlen size of buffer
+ * @return length of data written or 0 if buffer is too short
+ */
+gsize spf_record_serialize (struct spf_resolved *rec, guchar *out, gsize outlen);
+
+/**
+ * Create resolved record from data written by spf_record_serialize
+ * @param domain domain of record
+ * @param in
+ * @param inlen
+ * @return new record with refcount 1 or NULL if data is invalid
+ */
+struct spf_resolved * spf_record_deserialize (const gchar *domain,
+		const guchar *in, gsize inlen);
+
 #endif
@@ -25,7 +25,10 @@
 #include "unix-std.h"
 #include "utlist.h"
 #include "contrib/zstd/zstd.h"
+#include "libutil/http_private.h"
 #include "libserver/mempool_vars_internal.h"
+#include "libserver/worker_util.h"
+#include "libserver/tracing.h"
 #include "libmime/lang_detection.h"
 #include <math.h>
 
@@ -120,44 +123,26 @@ rspamd_task_new (struct rspamd_worker *worker, struct rspamd_config *cfg,
 		new_task->task_pool = pool;
 	}
 
+	new_task->trace = rspamd_trace_maybe_start (cfg, new_task->task_pool);
+
+	/*
+	 * Task containers are released directly in rspamd_task_free, so they
+	 * do not need pool destructors
+	 */
 	new_task->raw_headers = g_hash_table_new_full (rspamd_strcase_hash,
 			rspamd_strcase_equal, NULL, rspamd_ptr_array_free_hard);
 	new_task->headers_order = g_queue_new ();
 	new_task->request_headers = g_hash_table_new_full (rspamd_ftok_icase_hash,
 			rspamd_ftok_icase_equal, rspamd_fstring_mapped_ftok_free,
 			rspamd_request_header_dtor);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-		(rspamd_mempool_destruct_t) g_hash_table_unref,
-		new_task->request_headers);
 	new_task->reply_headers = g_hash_table_new_full (rspamd_ftok_icase_hash,
 			rspamd_ftok_icase_equal, rspamd_fstring_mapped_ftok_free,
 			rspamd_fstring_mapped_ftok_free);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-			(rspamd_mempool_destruct_t) g_hash_table_unref,
-			new_task->reply_headers);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-			(rspamd_mempool_destruct_t) g_hash_table_unref,
-			new_task->raw_headers);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-			(rspamd_mempool_destruct_t) g_queue_free,
-			new_task->headers_order);
 	new_task->emails = g_hash_table_new (rspamd_email_hash, rspamd_emails_cmp);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-			(rspamd_mempool_destruct_t) g_hash_table_unref,
-			new_task->emails);
 	new_task->urls = g_hash_table_new (rspamd_url_hash, rspamd_urls_cmp);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-			(rspamd_mempool_destruct_t) g_hash_table_unref,
-			new_task->urls);
 	new_task->parts = g_ptr_array_sized_new (4);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-			rspamd_ptr_array_free_hard, new_task->parts);
 	new_task->text_parts = g_ptr_array_sized_new (2);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-			rspamd_ptr_array_free_hard, new_task->text_parts);
 	new_task->received = g_ptr_array_sized_new (8);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-			rspamd_ptr_array_free_hard, new_task->received);
 
 	new_task->sock = -1;
 	new_task->flags |= (RSPAMD_TASK_FLAG_MIME|RSPAMD_TASK_FLAG_JSON);
@@ -171,9 +156,87 @@ rspamd_task_new (struct rspamd_worker *worker, struct rspamd_config *cfg,
 }
 
 
+static inline guint
+rspamd_task_stage_idx (guint stage)
+{
+	guint idx = 0;
+
+	while (stage > 1) {
+		stage >>= 1;
+		idx ++;
+	}
+
+	return idx;
+}
+
+/* Histogram bucket `i` holds durations below 2^i microseconds */
+static inline guint
+rspamd_task_stage_hist_bucket (gdouble sec)
+{
+	guint64 usec = sec > 0 ? (guint64)(sec * 1e6) : 0;
+	guint bucket = 0;
+
+	while (usec > 0 && bucket < RSPAMD_TASK_STAGE_HIST_BUCKETS - 1) {
+		usec >>= 1;
+		bucket ++;
+	}
+
+	return bucket;
+}
+
+/*
+ * Adds durations of task stages to the worker histograms and logs
+ * the stages breakdown of slow tasks
+ */
+static void
+rspamd_task_account_stages (struct rspamd_task *task)
+{
+	struct rspamd_worker_stages_stat *ws = NULL;
+	gchar buf[1024];
+	gdouble elapsed;
+	guint i;
+	gint r = 0;
+
+	if (task->worker && rspamd_worker_is_scanner (task->worker)) {
+		ws = rspamd_worker_get_stages_stat (task->worker);
+	}
+
+	if (ws) {
+		for (i = 0; i < RSPAMD_TASK_STAGES_COUNT; i ++) {
+			if (task->stage_time[i] > 0) {
+				g_atomic_int_inc (&ws->hist[i][
+						rspamd_task_stage_hist_bucket (task->stage_time[i])]);
+				__atomic_fetch_add (&ws->sum_usec[i],
+						(guint64)(task->stage_time[i] * 1e6), __ATOMIC_RELAXED);
+			}
+		}
+	}
+
+	if (task->cfg && task->cfg->slow_task_time > 0) {
+		rspamd_task_set_finish_time (task);
+		elapsed = task->time_real_finish - task->time_real;
+
+		if (elapsed > task->cfg->slow_task_time) {
+			for (i = 0; i < RSPAMD_TASK_STAGES_COUNT; i ++) {
+				if (task->stage_time[i] > 0) {
+					r += rspamd_snprintf (buf + r, sizeof (buf) - r, "%s%s: %.3f",
+							r > 0 ? ", " : "",
+							rspamd_task_stage_name (1 << i),
+							task->stage_time[i]);
+				}
+			}
+
+			msg_info_task ("slow task: %.3f sec; stages: %s", elapsed,
+					r > 0 ? buf : "none");
+		}
+	}
+}
+
 static void
 rspamd_task_reply (struct rspamd_task *task)
 {
+	rspamd_task_account_stages (task);
+
 	if (task->fin_callback) {
 		task->fin_callback (task, task->fin_arg);
 	}
@@ -272,6 +335,16 @@ rspamd_task_free (struct rspamd_task *task)
 			}
 		}
 
+		g_ptr_array_free (task->parts, TRUE);
+		g_ptr_array_free (task->text_parts, TRUE);
+		g_ptr_array_free (task->received, TRUE);
+		g_hash_table_unref (task->raw_headers);
+		g_queue_free (task->headers_order);
+		g_hash_table_unref (task->request_headers);
+		g_hash_table_unref (task->reply_headers);
+		g_hash_table_unref (task->emails);
+		g_hash_table_unref (task->urls);
+
 		if (task->rcpt_envelope) {
 			for (i = 0; i < task->rcpt_envelope->len; i ++) {
 				addr = g_ptr_array_index (task->rcpt_envelope, i);
@@ -324,6 +397,15 @@ rspamd_task_free (struct rspamd_task *task)
 			close (task->sock);
 		}
 
+		if (task->trace) {
+			if (task->s) {
+				rspamd_session_set_trace (task->s, NULL);
+			}
+
+			rspamd_trace_finish (task->trace, task->cfg, task->ev_base,
+					task->message_id);
+		}
+
 		if (task->cfg) {
 			if (task->lua_cache) {
 				g_hash_table_iter_init (&it, task->lua_cache);
@@ -337,6 +419,8 @@ rspamd_task_free (struct rspamd_task *task)
 				g_hash_table_unref (task->lua_cache);
 			}
 
+			/* Collect task garbage between tasks and not inside of them */
+			rspamd_lua_gc_step (task->cfg);
 			REF_RELEASE (task->cfg);
 		}
 
@@ -663,11 +747,35 @@ rspamd_task_load_message (struct rspamd_task *task,
 		task->msg.len = len;
 	}
 
+	if (msg) {
+		/*
+		 * Adopt HTTP message, so its body is not freed when connection is
+		 * reset and we do not need to copy it
+		 */
+		task->msg.copied = msg->body_copied;
+		rspamd_mempool_add_destructor (task->task_pool,
+				(rspamd_mempool_destruct_t)rspamd_http_message_unref,
+				rspamd_http_message_ref (msg));
+	}
+
 	if (task->msg.len == 0) {
 		task->flags |= RSPAMD_TASK_FLAG_EMPTY;
 	}
 
-	if (task->flags & RSPAMD_TASK_FLAG_HAS_CONTROL) {
+	if (RSPAMD_TASK_IS_MSGPACK (task)) {
+		/* Envelope and message are both encoded in the body */
+		if (!rspamd_protocol_handle_msgpack (task)) {
+			return FALSE;
+		}
+
+		if (task->msg.len == 0) {
+			task->flags |= RSPAMD_TASK_FLAG_EMPTY;
+		}
+		else {
+			task->flags &= ~RSPAMD_TASK_FLAG_EMPTY;
+		}
+	}
+	else if (task->flags & RSPAMD_TASK_FLAG_HAS_CONTROL) {
 		/* We have control chunk, so we need to process it separately */
 		if (task->msg.len < task->message_len) {
 			msg_warn_task ("message has invalid message length: %ul and total len: %ul",
@@ -732,6 +840,17 @@ rspamd_task_select_processing_stage (struct rspamd_task *task, guint stages)
 	return RSPAMD_TASK_STAGE_DONE;
 }
 
+static void
+rspamd_task_stage_finish (struct rspamd_task *task)
+{
+	if (task->cur_stage != 0) {
+		task->stage_time[rspamd_task_stage_idx (task->cur_stage)] +=
+				rspamd_ticks_to_seconds (rspamd_get_ticks (TRUE) -
+						task->stage_start);
+		task->cur_stage = 0;
+	}
+}
+
 gboolean
 rspamd_task_process (struct rspamd_task *task, guint stages)
 {
@@ -750,8 +869,18 @@ rspamd_task_process (struct rspamd_task *task, guint stages)
 
 	task->flags |= RSPAMD_TASK_FLAG_PROCESSING;
 
+	if (task->trace && task->s) {
+		/* Sessions are created after tasks, so attach trace here */
+		rspamd_session_set_trace (task->s, task->trace);
+	}
+
 	st = rspamd_task_select_processing_stage (task, stages);
 
+	if (st != task->cur_stage && st != RSPAMD_TASK_STAGE_DONE) {
+		task->cur_stage = st;
+		task->stage_start = rspamd_get_ticks (TRUE);
+	}
+
 	switch (st) {
 	case RSPAMD_TASK_STAGE_READ_MESSAGE:
 		if (!rspamd_message_parse (task)) {
@@ -864,6 +993,8 @@ rspamd_task_process (struct rspamd_task *task, guint stages)
 	task->flags &= ~RSPAMD_TASK_FLAG_PROCESSING;
 
 	if (!ret || RSPAMD_TASK_IS_PROCESSED (task)) {
+		rspamd_task_stage_finish (task);
+
 		if (!ret) {
 			/* Set processed flags */
 			task->processed_stages |= RSPAMD_TASK_STAGE_DONE;
@@ -882,6 +1013,7 @@ rspamd_task_process (struct rspamd_task *task, guint stages)
 		/* Mark the current stage as done and go to the next stage */
 		msg_debug_task ("completed stage %d", st);
 		task->processed_stages |= st;
+		rspamd_task_stage_finish (task);
 
 		/* Tail recursion */
 		return rspamd_task_process (task, stages);
@@ -1369,6 +1501,11 @@ rspamd_task_log_variable (struct rspamd_task *task,
 				task->dns_requests);
 		var.begin = numbuf;
 		break;
+	case RSPAMD_LOG_COPIED:
+		var.len = rspamd_snprintf (numbuf, sizeof (numbuf), "%uz",
+				task->msg.copied);
+		var.begin = numbuf;
+		break;
 	case RSPAMD_LOG_TIME_REAL:
 		var.begin = rspamd_log_check_time (task->time_real,
 				task->time_real_finish,
@@ -1685,4 +1822,42 @@ rspamd_task_set_finish_time (struct rspamd_task *task)
 	}
 
 	return FALSE;
-}
\ No newline at end of file
+}
+
+const gchar *
+rspamd_task_stage_name (guint stage)
+{
+	static const gchar *names[RSPAMD_TASK_STAGES_COUNT] = {
+		"connect",
+		"envelope",
+		"read_message",
+		"pre_filters",
+		"process_message",
+		"filters",
+		"classifiers_pre",
+		"classifiers",
+		"classifiers_post",
+		"composites",
+		"post_filters",
+		"learn_pre",
+		"learn",
+		"learn_post",
+		"composites_post",
+		"idempotent",
+		"done",
+		"replied",
+	};
+	guint idx = rspamd_task_stage_idx (stage);
+
+	if (stage == 0 || idx >= RSPAMD_TASK_STAGES_COUNT) {
+		return "unknown";
+	}
+
+	return names[idx];
+}
+
+gdouble
+rspamd_task_stage_hist_bound (guint bucket)
+{
+	return (gdouble)(1ULL << bucket) / 1e6;
+}
@@ -57,6 +57,11 @@ enum rspamd_task_stage {
 	RSPAMD_TASK_STAGE_REPLIED = (1 << 17)
 };
 
+/* Number of bits in the stages mask */
+#define RSPAMD_TASK_STAGES_COUNT 18
+/* Log2 buckets of stages duration histograms, the first one is below 1us */
+#define RSPAMD_TASK_STAGE_HIST_BUCKETS 24
+
 #define RSPAMD_TASK_PROCESS_ALL (RSPAMD_TASK_STAGE_CONNECT | \
 		RSPAMD_TASK_STAGE_ENVELOPE | \
 		RSPAMD_TASK_STAGE_READ_MESSAGE | \
@@ -85,6 +90,14 @@ enum rspamd_task_stage {
 		RSPAMD_TASK_STAGE_LEARN | \
 		RSPAMD_TASK_STAGE_LEARN_POST | \
 		RSPAMD_TASK_STAGE_DONE)
+#define RSPAMD_TASK_PROCESS_CLASSIFY (RSPAMD_TASK_STAGE_CONNECT | \
+		RSPAMD_TASK_STAGE_ENVELOPE | \
+		RSPAMD_TASK_STAGE_READ_MESSAGE | \
+		RSPAMD_TASK_STAGE_PROCESS_MESSAGE | \
+		RSPAMD_TASK_STAGE_CLASSIFIERS_PRE | \
+		RSPAMD_TASK_STAGE_CLASSIFIERS | \
+		RSPAMD_TASK_STAGE_CLASSIFIERS_POST | \
+		RSPAMD_TASK_STAGE_DONE)
 
 #define RSPAMD_TASK_FLAG_MIME (1 << 0)
 #define RSPAMD_TASK_FLAG_JSON (1 << 1)
@@ -116,6 +129,10 @@ enum rspamd_task_stage {
 #define RSPAMD_TASK_FLAG_OWN_POOL (1 << 27)
 #define RSPAMD_TASK_FLAG_MILTER (1 << 28)
 #define RSPAMD_TASK_FLAG_SSL (1 << 29)
+/* Process message only as much as required to get statistical tokens */
+#define RSPAMD_TASK_FLAG_TOKENIZE_ONLY (1U << 30)
+/* Request and reply use msgpack encoding */
+#define RSPAMD_TASK_FLAG_MSGPACK (1U << 31)
 
 #define RSPAMD_TASK_IS_SKIPPED(task) (((task)->flags & RSPAMD_TASK_FLAG_SKIP))
 #define RSPAMD_TASK_IS_JSON(task) (((task)->flags & RSPAMD_TASK_FLAG_JSON))
@@ -124,10 +141,26 @@ enum rspamd_task_stage {
 #define RSPAMD_TASK_IS_CLASSIFIED(task) (((task)->processed_stages & RSPAMD_TASK_STAGE_CLASSIFIERS))
 #define RSPAMD_TASK_IS_EMPTY(task) (((task)->flags & RSPAMD_TASK_FLAG_EMPTY))
 #define RSPAMD_TASK_IS_PROFILING(task) (((task)->flags & RSPAMD_TASK_FLAG_PROFILE))
+#define RSPAMD_TASK_IS_TOKENIZE_ONLY(task) (((task)->flags & RSPAMD_TASK_FLAG_TOKENIZE_ONLY))
+#define RSPAMD_TASK_IS_MSGPACK(task) (((task)->flags & RSPAMD_TASK_FLAG_MSGPACK))
 
 struct rspamd_email_address;
 struct rspamd_lang_detector;
 enum rspamd_newlines_type;
+struct rspamd_metric_result;
+struct rspamd_stat_tokens;
+struct rspamd_task_snapshot;
+
+/**
+ * Result of per user classifiers for a single recipient when a message is
+ * scanned once for all its recipients
+ */
+struct rspamd_task_rcpt_result {
+	const gchar *rcpt;								/**< lowercased recipient address					*/
+	struct rspamd_metric_result *result;			/**< NULL for the principal recipient				*/
+	GPtrArray *stat_runtimes;						/**< backends runtimes for this recipient			*/
+	struct rspamd_stat_tokens *stat_tokens;			/**< tokens with values for this recipient			*/
+};
 
 /**
  * Worker task structure
@@ -154,6 +187,7 @@ struct rspamd_task {
 	struct {
 		const gchar *begin;
 		gsize len;
+		gsize copied;								/**< bytes copied while receiving it				*/
 		gchar *fpath;
 	} msg;											/**< message buffer									*/
 	struct rspamd_http_connection *http_conn;		/**< HTTP server connection							*/
@@ -170,12 +204,15 @@ struct rspamd_task {
 	GHashTable *emails;								/**< list of parsed emails							*/
 	GHashTable *raw_headers;						/**< list of raw headers							*/
 	GQueue *headers_order;							/**< order of raw headers							*/
+	struct rspamd_mime_headers_index *headers_index; /**< raw headers indexed by hash of name			*/
 	struct rspamd_metric_result *result;			/**< Metric result									*/
 	GHashTable *lua_cache;							/**< cache of lua objects							*/
 	GPtrArray *tokens;								/**< statistics tokens */
+	struct rspamd_stat_tokens *stat_tokens;			/**< contiguous view of statistics tokens */
 
 	GPtrArray *rcpt_mime;
 	GPtrArray *rcpt_envelope;						/**< array of rspamd_email_address					*/
+	GPtrArray *rcpt_results;						/**< rspamd_task_rcpt_result if requested			*/
 	GPtrArray *from_mime;
 	struct rspamd_email_address *from_envelope;
 	enum rspamd_newlines_type nlines_type;			/**< type of newlines (detected on most of headers 	*/
@@ -190,6 +227,10 @@ struct rspamd_task {
 	double time_virtual;
 	double time_real_finish;
 	double time_virtual_finish;
+	gdouble stage_start;							/**< ticks when the current stage has started		*/
+	guint cur_stage;								/**< stage that is being timed now					*/
+	gdouble stage_time[RSPAMD_TASK_STAGES_COUNT];	/**< wall time spent in each stage (seconds)		*/
+	struct rspamd_trace *trace;						/**< trace of a sampled task or NULL				*/
 	struct timeval tv;
 	gboolean (*fin_callback)(struct rspamd_task *task, void *arg);
 													/**< callback for filters finalizing					*/
@@ -201,6 +242,7 @@ struct rspamd_task {
 	struct event *guard_ev;							/**< Event for input sanity guard 					*/
 
 	gpointer checkpoint;							/**< Opaque checkpoint data							*/
+	struct rspamd_task_snapshot *snapshot;			/**< processing results loaded from snapshot		*/
 	ucl_object_t *settings;							/**< Settings applied to task						*/
 
 	const gchar *classifier;						/**< Classifier to learn (if needed)				*/
@@ -353,4 +395,18 @@ gdouble* rspamd_task_profile_get (struct rspamd_task *task, const gchar *key);
  */
 gboolean rspamd_task_set_finish_time (struct rspamd_task *task);
 
+/**
+ * Returns a short name of a task stage
+ * @param stage stage bit
+ * @return
+ */
+const gchar *rspamd_task_stage_name (guint stage);
+
+/**
+ * Returns the upper bound of a stages histogram bucket in seconds
+ * @param bucket
+ * @return
+ */
+gdouble rspamd_task_stage_hist_bound (guint bucket);
+
 #endif /* TASK_H_ */
@@ -0,0 +1,541 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "task_snapshot.h"
+#include "task.h"
+#include "url.h"
+#include "protocol.h"
+#include "rspamd.h"
+#include "libmime/message.h"
+#include "libmime/lang_detection.h"
+#include "libstat/stat_api.h"
+
+/*
+ * File layout, all numbers are in the native byte order:
+ *
+ * header | message padded to 8 bytes | text parts | urls
+ *
+ * text part: mime part id, non ascii words, language,
+ *   languages (prob, name), words (flags, string), hashes, exceptions
+ * url: flags, count, email flag, string
+ *
+ * Strings are stored as u32 length followed by data and zero byte
+ */
+
+#define SNAPSHOT_MAGIC "rsnpsht1"
+#define SNAPSHOT_BOM 0x01020304U
+
+struct rspamd_snapshot_hdr {
+	gchar magic[8];
+	guint32 bom;
+	guint32 nparts;
+	guint32 nurls;
+	guint32 unused;
+	guint64 msg_len;
+};
+
+struct rspamd_snapshot_part {
+	guint32 id;
+	guint32 nwords;
+	guint32 nhashes;
+	guint32 nexceptions;
+	guint32 non_ascii_words;
+	const gchar *language;
+	GPtrArray *languages;
+	rspamd_stat_token_t *words;
+	const guchar *hashes;
+	struct rspamd_process_exception *exceptions;
+};
+
+struct rspamd_snapshot_url {
+	guint32 flags;
+	guint32 count;
+	gboolean is_email;
+	const gchar *str;
+	guint32 len;
+};
+
+struct rspamd_task_snapshot {
+	struct rspamd_snapshot_part *parts;
+	guint nparts;
+	struct rspamd_snapshot_url *urls;
+	guint nurls;
+};
+
+struct rspamd_snapshot_reader {
+	const guchar *p;
+	const guchar *end;
+};
+
+static gboolean
+rspamd_snapshot_read (struct rspamd_snapshot_reader *rd, gpointer out,
+		gsize len)
+{
+	if (rd->end - rd->p < (goffset)len) {
+		return FALSE;
+	}
+
+	memcpy (out, rd->p, len);
+	rd->p += len;
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_snapshot_read_string (struct rspamd_snapshot_reader *rd,
+		const gchar **pstr, guint32 *plen)
+{
+	guint32 len;
+
+	if (!rspamd_snapshot_read (rd, &len, sizeof (len)) ||
+			rd->end - rd->p < (goffset)len + 1 || rd->p[len] != '\0') {
+		return FALSE;
+	}
+
+	*pstr = (const gchar *)rd->p;
+
+	if (plen) {
+		*plen = len;
+	}
+
+	rd->p += len + 1;
+
+	return TRUE;
+}
+
+static void
+rspamd_snapshot_write (GByteArray *out, gconstpointer data, gsize len)
+{
+	g_byte_array_append (out, data, len);
+}
+
+static void
+rspamd_snapshot_write_u32 (GByteArray *out, guint32 v)
+{
+	g_byte_array_append (out, (const guint8 *)&v, sizeof (v));
+}
+
+static void
+rspamd_snapshot_write_string (GByteArray *out, const gchar *s, gsize len)
+{
+	static const guint8 zero = 0;
+
+	rspamd_snapshot_write_u32 (out, len);
+	g_byte_array_append (out, (const guint8 *)s, len);
+	g_byte_array_append (out, &zero, 1);
+}
+
+gboolean
+rspamd_task_is_snapshot (const guchar *data, gsize len)
+{
+	return len >= sizeof (struct rspamd_snapshot_hdr) &&
+			memcmp (data, SNAPSHOT_MAGIC, sizeof (SNAPSHOT_MAGIC) - 1) == 0;
+}
+
+static void
+rspamd_snapshot_write_text_part (GByteArray *out,
+		struct rspamd_mime_text_part *part)
+{
+	struct rspamd_lang_detector_res *lang;
+	struct rspamd_process_exception *ex;
+	rspamd_stat_token_t *w;
+	GList *cur;
+	guint i;
+	guint32 nwords = 0, nhashes = 0;
+	guint64 pos;
+
+	rspamd_snapshot_write_u32 (out, part->mime_part->id);
+	rspamd_snapshot_write_u32 (out, part->non_ascii_words);
+
+	if (part->language) {
+		rspamd_snapshot_write_string (out, part->language,
+				strlen (part->language));
+	}
+	else {
+		rspamd_snapshot_write_string (out, "", 0);
+	}
+
+	rspamd_snapshot_write_u32 (out,
+			part->languages ? part->languages->len : 0);
+
+	if (part->languages) {
+		PTR_ARRAY_FOREACH (part->languages, i, lang) {
+			rspamd_snapshot_write (out, &lang->prob, sizeof (lang->prob));
+			rspamd_snapshot_write_string (out, lang->lang, strlen (lang->lang));
+		}
+	}
+
+	if (part->utf_words) {
+		nwords = part->utf_words->len;
+	}
+
+	rspamd_snapshot_write_u32 (out, nwords);
+
+	for (i = 0; i < nwords; i ++) {
+		w = &g_array_index (part->utf_words, rspamd_stat_token_t, i);
+		rspamd_snapshot_write_u32 (out, w->flags);
+		rspamd_snapshot_write_string (out, w->begin, w->len);
+	}
+
+	if (part->normalized_hashes) {
+		nhashes = part->normalized_hashes->len;
+	}
+
+	rspamd_snapshot_write_u32 (out, nhashes);
+
+	if (nhashes > 0) {
+		rspamd_snapshot_write (out, part->normalized_hashes->data,
+				nhashes * sizeof (guint64));
+	}
+
+	rspamd_snapshot_write_u32 (out, g_list_length (part->exceptions));
+
+	for (cur = part->exceptions; cur != NULL; cur = g_list_next (cur)) {
+		ex = cur->data;
+		pos = ex->pos;
+		rspamd_snapshot_write (out, &pos, sizeof (pos));
+		rspamd_snapshot_write_u32 (out, ex->len);
+		rspamd_snapshot_write_u32 (out, ex->type);
+	}
+}
+
+static void
+rspamd_snapshot_write_urls (GByteArray *out, GHashTable *urls,
+		gboolean is_email)
+{
+	GHashTableIter it;
+	struct rspamd_url *u;
+	gpointer k, v;
+
+	g_hash_table_iter_init (&it, urls);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		u = k;
+		rspamd_snapshot_write_u32 (out, u->flags);
+		rspamd_snapshot_write_u32 (out, u->count);
+		rspamd_snapshot_write_u32 (out, is_email);
+		rspamd_snapshot_write_string (out, u->string, u->urllen);
+	}
+}
+
+gboolean
+rspamd_task_save_snapshot (struct rspamd_task *task, const gchar *fname,
+		GError **err)
+{
+	struct rspamd_snapshot_hdr hdr;
+	struct rspamd_mime_text_part *part;
+	static const guint8 pad[8] = {0};
+	GByteArray *out;
+	gboolean ret;
+	guint i;
+
+	memset (&hdr, 0, sizeof (hdr));
+	memcpy (hdr.magic, SNAPSHOT_MAGIC, sizeof (hdr.magic));
+	hdr.bom = SNAPSHOT_BOM;
+	hdr.nparts = task->text_parts->len;
+	hdr.nurls = g_hash_table_size (task->urls) +
+			g_hash_table_size (task->emails);
+	hdr.msg_len = task->msg.len;
+
+	out = g_byte_array_sized_new (sizeof (hdr) + task->msg.len * 2);
+	rspamd_snapshot_write (out, &hdr, sizeof (hdr));
+	rspamd_snapshot_write (out, task->msg.begin, task->msg.len);
+
+	if (task->msg.len % sizeof (pad) != 0) {
+		rspamd_snapshot_write (out, pad,
+				sizeof (pad) - task->msg.len % sizeof (pad));
+	}
+
+	PTR_ARRAY_FOREACH (task->text_parts, i, part) {
+		rspamd_snapshot_write_text_part (out, part);
+	}
+
+	rspamd_snapshot_write_urls (out, task->urls, FALSE);
+	rspamd_snapshot_write_urls (out, task->emails, TRUE);
+
+	ret = g_file_set_contents (fname, (const gchar *)out->data, out->len, err);
+	g_byte_array_free (out, TRUE);
+
+	return ret;
+}
+
+static gboolean
+rspamd_snapshot_read_text_part (struct rspamd_task *task,
+		struct rspamd_snapshot_reader *rd, struct rspamd_snapshot_part *sp)
+{
+	struct rspamd_lang_detector_res *lang;
+	struct rspamd_process_exception *ex;
+	guint32 nlangs, len, type, i;
+	guint64 pos;
+	const gchar *s;
+
+	if (!rspamd_snapshot_read (rd, &sp->id, sizeof (sp->id)) ||
+			!rspamd_snapshot_read (rd, &sp->non_ascii_words,
+					sizeof (sp->non_ascii_words)) ||
+			!rspamd_snapshot_read_string (rd, &sp->language, NULL) ||
+			!rspamd_snapshot_read (rd, &nlangs, sizeof (nlangs))) {
+		return FALSE;
+	}
+
+	if (sp->language[0] == '\0') {
+		sp->language = NULL;
+	}
+
+	if (nlangs > 0) {
+		sp->languages = g_ptr_array_sized_new (nlangs);
+		rspamd_mempool_add_destructor (task->task_pool,
+				(rspamd_mempool_destruct_t)g_ptr_array_unref, sp->languages);
+
+		for (i = 0; i < nlangs; i ++) {
+			lang = rspamd_mempool_alloc0 (task->task_pool, sizeof (*lang));
+
+			if (!rspamd_snapshot_read (rd, &lang->prob, sizeof (lang->prob)) ||
+					!rspamd_snapshot_read_string (rd, &lang->lang, NULL)) {
+				return FALSE;
+			}
+
+			g_ptr_array_add (sp->languages, lang);
+		}
+	}
+
+	if (!rspamd_snapshot_read (rd, &sp->nwords, sizeof (sp->nwords)) ||
+			sp->nwords > (guint32)(rd->end - rd->p)) {
+		return FALSE;
+	}
+
+	sp->words = rspamd_mempool_alloc (task->task_pool,
+			sizeof (*sp->words) * (sp->nwords + 1));
+
+	for (i = 0; i < sp->nwords; i ++) {
+		if (!rspamd_snapshot_read (rd, &sp->words[i].flags,
+				sizeof (guint32)) ||
+				!rspamd_snapshot_read_string (rd, &s, &len)) {
+			return FALSE;
+		}
+
+		sp->words[i].begin = s;
+		sp->words[i].len = len;
+	}
+
+	if (!rspamd_snapshot_read (rd, &sp->nhashes, sizeof (sp->nhashes)) ||
+			(gsize)(rd->end - rd->p) < sp->nhashes * sizeof (guint64)) {
+		return FALSE;
+	}
+
+	sp->hashes = rd->p;
+	rd->p += sp->nhashes * sizeof (guint64);
+
+	if (!rspamd_snapshot_read (rd, &sp->nexceptions, sizeof (sp->nexceptions)) ||
+			sp->nexceptions > (guint32)(rd->end - rd->p)) {
+		return FALSE;
+	}
+
+	sp->exceptions = rspamd_mempool_alloc (task->task_pool,
+			sizeof (*sp->exceptions) * (sp->nexceptions + 1));
+
+	for (i = 0; i < sp->nexceptions; i ++) {
+		ex = &sp->exceptions[i];
+
+		if (!rspamd_snapshot_read (rd, &pos, sizeof (pos)) ||
+				!rspamd_snapshot_read (rd, &len, sizeof (len)) ||
+				!rspamd_snapshot_read (rd, &type, sizeof (type))) {
+			return FALSE;
+		}
+
+		ex->pos = pos;
+		ex->len = len;
+		ex->type = type;
+	}
+
+	return TRUE;
+}
+
+gboolean
+rspamd_task_load_snapshot (struct rspamd_task *task, const guchar *data,
+		gsize len)
+{
+	struct rspamd_snapshot_hdr hdr;
+	struct rspamd_snapshot_reader rd;
+	struct rspamd_task_snapshot *snap;
+	struct rspamd_snapshot_url *su;
+	const guchar *msg;
+	gsize padded_len;
+	guint i;
+
+	if (!rspamd_task_is_snapshot (data, len)) {
+		g_set_error (&task->err, rspamd_task_quark (), RSPAMD_PROTOCOL_ERROR,
+				"not a task snapshot");
+		return FALSE;
+	}
+
+	memcpy (&hdr, data, sizeof (hdr));
+
+	if (hdr.bom != SNAPSHOT_BOM) {
+		g_set_error (&task->err, rspamd_task_quark (), RSPAMD_PROTOCOL_ERROR,
+				"task snapshot is written on a host with different byte order");
+		return FALSE;
+	}
+
+	padded_len = hdr.msg_len + (8 - hdr.msg_len % 8) % 8;
+
+	if (padded_len > len - sizeof (hdr)) {
+		goto err;
+	}
+
+	msg = data + sizeof (hdr);
+	rd.p = msg + padded_len;
+	rd.end = data + len;
+
+	snap = rspamd_mempool_alloc0 (task->task_pool, sizeof (*snap));
+
+	if (hdr.nparts > (guint32)(rd.end - rd.p) ||
+			hdr.nurls > (guint32)(rd.end - rd.p)) {
+		goto err;
+	}
+
+	snap->nparts = hdr.nparts;
+	snap->parts = rspamd_mempool_alloc0 (task->task_pool,
+			sizeof (*snap->parts) * (snap->nparts + 1));
+
+	for (i = 0; i < snap->nparts; i ++) {
+		if (!rspamd_snapshot_read_text_part (task, &rd, &snap->parts[i])) {
+			goto err;
+		}
+	}
+
+	snap->nurls = hdr.nurls;
+	snap->urls = rspamd_mempool_alloc0 (task->task_pool,
+			sizeof (*snap->urls) * (snap->nurls + 1));
+
+	for (i = 0; i < snap->nurls; i ++) {
+		su = &snap->urls[i];
+
+		if (!rspamd_snapshot_read (&rd, &su->flags, sizeof (su->flags)) ||
+				!rspamd_snapshot_read (&rd, &su->count, sizeof (su->count)) ||
+				!rspamd_snapshot_read (&rd, &su->is_email,
+						sizeof (guint32)) ||
+				!rspamd_snapshot_read_string (&rd, &su->str, &su->len)) {
+			goto err;
+		}
+	}
+
+	if (!rspamd_task_load_message (task, NULL, (const gchar *)msg,
+			hdr.msg_len)) {
+		return FALSE;
+	}
+
+	task->snapshot = snap;
+	msg_debug_task ("loaded task snapshot: %ud text parts, %ud urls",
+			snap->nparts, snap->nurls);
+
+	return TRUE;
+
+err:
+	g_set_error (&task->err, rspamd_task_quark (), RSPAMD_PROTOCOL_ERROR,
+			"task snapshot is truncated or corrupted");
+
+	return FALSE;
+}
+
+gboolean
+rspamd_task_snapshot_restore_text_part (struct rspamd_task *task,
+		struct rspamd_mime_text_part *part)
+{
+	struct rspamd_snapshot_part *sp;
+	guint idx, i;
+
+	if (task->snapshot == NULL) {
+		return FALSE;
+	}
+
+	/* Text parts are saved in the order they are found */
+	idx = task->text_parts->len - 1;
+
+	if (idx >= task->snapshot->nparts) {
+		return FALSE;
+	}
+
+	sp = &task->snapshot->parts[idx];
+
+	if (sp->id != part->mime_part->id) {
+		msg_info_task ("text part %ud does not match the snapshot, process it",
+				idx);
+		return FALSE;
+	}
+
+	part->language = sp->language;
+	part->non_ascii_words = sp->non_ascii_words;
+
+	if (sp->languages) {
+		part->languages = g_ptr_array_ref (sp->languages);
+	}
+
+	part->utf_words = g_array_sized_new (FALSE, FALSE,
+			sizeof (rspamd_stat_token_t), sp->nwords);
+	g_array_append_vals (part->utf_words, sp->words, sp->nwords);
+	part->normalized_hashes = g_array_sized_new (FALSE, FALSE,
+			sizeof (guint64), sp->nhashes);
+	g_array_append_vals (part->normalized_hashes, sp->hashes, sp->nhashes);
+
+	for (i = 0; i < sp->nexceptions; i ++) {
+		part->exceptions = g_list_prepend (part->exceptions,
+				&sp->exceptions[i]);
+	}
+
+	part->exceptions = g_list_reverse (part->exceptions);
+	part->flags |= RSPAMD_MIME_TEXT_PART_FLAG_SNAPSHOT;
+
+	return TRUE;
+}
+
+void
+rspamd_task_snapshot_restore_urls (struct rspamd_task *task)
+{
+	struct rspamd_snapshot_url *su;
+	struct rspamd_url *u, *existing;
+	GHashTable *target;
+	gchar *str;
+	guint i;
+
+	if (task->snapshot == NULL) {
+		return;
+	}
+
+	for (i = 0; i < task->snapshot->nurls; i ++) {
+		su = &task->snapshot->urls[i];
+		target = su->is_email ? task->emails : task->urls;
+		u = rspamd_mempool_alloc0 (task->task_pool, sizeof (*u));
+		/* Parser modifies string */
+		str = rspamd_mempool_alloc (task->task_pool, su->len + 1);
+		memcpy (str, su->str, su->len + 1);
+
+		if (rspamd_url_parse (u, str, su->len, task->task_pool) !=
+				URI_ERRNO_OK) {
+			continue;
+		}
+
+		/* Urls from html and subject are found again */
+		existing = g_hash_table_lookup (target, u);
+
+		if (existing) {
+			existing->flags |= su->flags;
+			existing->count = MAX (existing->count, su->count);
+		}
+		else {
+			u->flags = su->flags;
+			u->count = su->count;
+			g_hash_table_insert (target, u, u);
+		}
+	}
+}
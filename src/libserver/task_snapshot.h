@@ -0,0 +1,70 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef RSPAMD_TASK_SNAPSHOT_H
+#define RSPAMD_TASK_SNAPSHOT_H
+
+#include "config.h"
+
+/*
+ * Snapshot of a processed task: the message itself and results of the
+ * expensive processing steps, namely normalized words, languages and urls of
+ * text parts. When a snapshot is loaded, the message is parsed as usual but
+ * these results are taken from the snapshot. Snapshot is a flat file in
+ * the native byte order, strings are used directly from its memory, so it
+ * should be mapped for the lifetime of a task
+ */
+
+struct rspamd_task;
+struct rspamd_mime_text_part;
+struct rspamd_task_snapshot;
+
+/**
+ * Checks if data starts with the snapshot signature
+ */
+gboolean rspamd_task_is_snapshot (const guchar *data, gsize len);
+
+/**
+ * Writes snapshot of a processed task to a file
+ * @param task task after the message processing stage
+ * @param fname file to write, it is replaced atomically
+ * @param err
+ * @return TRUE if snapshot has been written
+ */
+gboolean rspamd_task_save_snapshot (struct rspamd_task *task,
+		const gchar *fname, GError **err);
+
+/**
+ * Loads message and its processing results from a snapshot
+ * @param task new task
+ * @param data snapshot data, must be alive until task is destroyed
+ * @param len length of data
+ * @return TRUE if snapshot is valid, task->err is set otherwise
+ */
+gboolean rspamd_task_load_snapshot (struct rspamd_task *task,
+		const guchar *data, gsize len);
+
+/**
+ * Restores words and languages of a text part from the snapshot of task
+ * @return TRUE if part has been restored and must not be processed further
+ */
+gboolean rspamd_task_snapshot_restore_text_part (struct rspamd_task *task,
+		struct rspamd_mime_text_part *part);
+
+/**
+ * Adds urls and emails from the snapshot of task that have not been found
+ * while processing
+ */
+void rspamd_task_snapshot_restore_urls (struct rspamd_task *task);
+
+#endif
@@ -0,0 +1,514 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "tracing.h"
+#include "cfg_file.h"
+#include "rspamd.h"
+#include "http.h"
+#include "upstream.h"
+#include "ottery.h"
+#include "unix-std.h"
+
+/* Batches are sent at least once per this interval */
+#define TRACE_FLUSH_INTERVAL 5.0
+/* Spans are dropped if the collector is not fast enough */
+#define TRACE_MAX_PENDING_BATCHES 8
+#define TRACE_SEND_TIMEOUT 5.0
+#define TRACE_COLLECTOR_PATH "/v1/traces"
+
+struct rspamd_trace_span {
+	const gchar *name;
+	const gchar *loc;
+	const gchar *peer;
+	guint parent;
+	guint64 id;
+	gdouble start;
+	gdouble end;
+	gdouble cpu;
+};
+
+struct rspamd_trace {
+	guchar trace_id[16];
+	GArray *spans;
+	rspamd_mempool_t *pool;
+	guint cur_span;
+};
+
+/* Per process exporter of finished spans */
+struct rspamd_trace_exporter {
+	struct rspamd_config *cfg;
+	struct upstream_list *collectors;
+	struct event_base *ev_base;
+	struct event flush_ev;
+	ucl_object_t *spans;
+	guint nspans;
+	guint inflight;
+	gboolean flush_planned;
+};
+
+struct rspamd_trace_request {
+	struct rspamd_http_connection *conn;
+	struct upstream *up;
+	gint fd;
+};
+
+static struct rspamd_trace_exporter *exporter = NULL;
+
+static void
+rspamd_trace_dtor (gpointer p)
+{
+	struct rspamd_trace *trace = p;
+
+	g_array_free (trace->spans, TRUE);
+}
+
+static inline struct rspamd_trace_span *
+rspamd_trace_get_span (struct rspamd_trace *trace, guint span)
+{
+	if (trace == NULL || span >= trace->spans->len) {
+		return NULL;
+	}
+
+	return &g_array_index (trace->spans, struct rspamd_trace_span, span);
+}
+
+struct rspamd_trace *
+rspamd_trace_maybe_start (struct rspamd_config *cfg, rspamd_mempool_t *pool)
+{
+	struct rspamd_trace *trace;
+
+	if (cfg == NULL || cfg->trace_sample_rate <= 0 ||
+			cfg->trace_collector == NULL) {
+		return NULL;
+	}
+
+	if (cfg->trace_sample_rate < 1.0 &&
+			rspamd_random_double_fast () >= cfg->trace_sample_rate) {
+		return NULL;
+	}
+
+	trace = rspamd_mempool_alloc0 (pool, sizeof (*trace));
+	trace->pool = pool;
+	trace->spans = g_array_sized_new (FALSE, FALSE,
+			sizeof (struct rspamd_trace_span), 32);
+	ottery_rand_bytes (trace->trace_id, sizeof (trace->trace_id));
+	rspamd_mempool_add_destructor (pool, rspamd_trace_dtor, trace);
+
+	/* Root span has no parent */
+	trace->cur_span = RSPAMD_TRACE_NO_SPAN;
+	trace->cur_span = rspamd_trace_span_start (trace, "rspamd task",
+			RSPAMD_TRACE_NO_SPAN);
+
+	return trace;
+}
+
+guint
+rspamd_trace_span_start (struct rspamd_trace *trace, const gchar *name,
+		guint parent)
+{
+	struct rspamd_trace_span span;
+
+	if (trace == NULL) {
+		return RSPAMD_TRACE_NO_SPAN;
+	}
+
+	memset (&span, 0, sizeof (span));
+	span.name = name ? name : "unknown";
+	span.parent = parent == RSPAMD_TRACE_NO_SPAN ? trace->cur_span : parent;
+	span.id = ottery_rand_uint64 ();
+	span.start = rspamd_get_calendar_ticks ();
+	span.end = NAN;
+	g_array_append_val (trace->spans, span);
+
+	return trace->spans->len - 1;
+}
+
+void
+rspamd_trace_span_finish (struct rspamd_trace *trace, guint span)
+{
+	struct rspamd_trace_span *sp = rspamd_trace_get_span (trace, span);
+
+	if (sp && isnan (sp->end)) {
+		sp->end = rspamd_get_calendar_ticks ();
+	}
+}
+
+void
+rspamd_trace_span_set_loc (struct rspamd_trace *trace, guint span,
+		const gchar *loc)
+{
+	struct rspamd_trace_span *sp = rspamd_trace_get_span (trace, span);
+
+	if (sp) {
+		sp->loc = loc;
+	}
+}
+
+void
+rspamd_trace_span_set_peer (struct rspamd_trace *trace, guint span,
+		const gchar *peer)
+{
+	struct rspamd_trace_span *sp = rspamd_trace_get_span (trace, span);
+
+	if (sp && peer) {
+		sp->peer = rspamd_mempool_strdup (trace->pool, peer);
+	}
+}
+
+void
+rspamd_trace_span_add_cpu (struct rspamd_trace *trace, guint span, gdouble cpu)
+{
+	struct rspamd_trace_span *sp = rspamd_trace_get_span (trace, span);
+
+	if (sp && cpu > 0) {
+		sp->cpu += cpu;
+	}
+}
+
+guint
+rspamd_trace_set_current (struct rspamd_trace *trace, guint span)
+{
+	guint old;
+
+	if (trace == NULL) {
+		return RSPAMD_TRACE_NO_SPAN;
+	}
+
+	old = trace->cur_span;
+	trace->cur_span = span;
+
+	return old;
+}
+
+static void
+rspamd_trace_add_attr (ucl_object_t *attrs, const gchar *key,
+		ucl_object_t *val, const gchar *type)
+{
+	ucl_object_t *attr, *value;
+
+	attr = ucl_object_typed_new (UCL_OBJECT);
+	value = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (value, val, type, 0, false);
+	ucl_object_insert_key (attr, ucl_object_fromstring (key), "key", 0, false);
+	ucl_object_insert_key (attr, value, "value", 0, false);
+	ucl_array_append (attrs, attr);
+}
+
+static ucl_object_t *
+rspamd_trace_span_to_ucl (struct rspamd_trace *trace,
+		struct rspamd_trace_span *sp,
+		const gchar *message_id)
+{
+	ucl_object_t *obj, *attrs;
+	gchar hexbuf[33], numbuf[32];
+	guint64 id;
+	gdouble wall;
+	gint r;
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	attrs = ucl_object_typed_new (UCL_ARRAY);
+
+	r = rspamd_encode_hex_buf (trace->trace_id, sizeof (trace->trace_id),
+			hexbuf, sizeof (hexbuf));
+	ucl_object_insert_key (obj, ucl_object_fromlstring (hexbuf, r),
+			"traceId", 0, false);
+	r = rspamd_encode_hex_buf ((const guchar *)&sp->id, sizeof (sp->id),
+			hexbuf, sizeof (hexbuf));
+	ucl_object_insert_key (obj, ucl_object_fromlstring (hexbuf, r),
+			"spanId", 0, false);
+
+	if (sp->parent < trace->spans->len) {
+		id = g_array_index (trace->spans, struct rspamd_trace_span,
+				sp->parent).id;
+		r = rspamd_encode_hex_buf ((const guchar *)&id, sizeof (id),
+				hexbuf, sizeof (hexbuf));
+		ucl_object_insert_key (obj, ucl_object_fromlstring (hexbuf, r),
+				"parentSpanId", 0, false);
+	}
+
+	ucl_object_insert_key (obj, ucl_object_fromstring (sp->name),
+			"name", 0, false);
+	/* SPAN_KIND_INTERNAL for the task and symbols, SPAN_KIND_CLIENT for I/O */
+	ucl_object_insert_key (obj, ucl_object_fromint (sp->peer ? 3 : 1),
+			"kind", 0, false);
+	/* Nanoseconds do not fit to a double, so they are sent as strings */
+	rspamd_snprintf (numbuf, sizeof (numbuf), "%uL",
+			(guint64)(sp->start * 1e9));
+	ucl_object_insert_key (obj, ucl_object_fromstring (numbuf),
+			"startTimeUnixNano", 0, false);
+	rspamd_snprintf (numbuf, sizeof (numbuf), "%uL",
+			(guint64)(sp->end * 1e9));
+	ucl_object_insert_key (obj, ucl_object_fromstring (numbuf),
+			"endTimeUnixNano", 0, false);
+
+	wall = sp->end - sp->start;
+
+	if (sp->cpu > 0) {
+		rspamd_trace_add_attr (attrs, "rspamd.cpu_time",
+				ucl_object_fromdouble (sp->cpu), "doubleValue");
+		rspamd_trace_add_attr (attrs, "rspamd.wait_time",
+				ucl_object_fromdouble (MAX (wall - sp->cpu, 0.0)), "doubleValue");
+	}
+
+	if (sp->peer) {
+		rspamd_trace_add_attr (attrs, "net.peer.name",
+				ucl_object_fromstring (sp->peer), "stringValue");
+	}
+
+	if (sp->loc) {
+		rspamd_trace_add_attr (attrs, "code.location",
+				ucl_object_fromstring (sp->loc), "stringValue");
+	}
+
+	if (message_id) {
+		rspamd_trace_add_attr (attrs, "rspamd.message_id",
+				ucl_object_fromstring (message_id), "stringValue");
+	}
+
+	ucl_object_insert_key (obj, attrs, "attributes", 0, false);
+
+	return obj;
+}
+
+static void
+rspamd_trace_request_free (struct rspamd_trace_request *req)
+{
+	rspamd_http_connection_unref (req->conn);
+	close (req->fd);
+	g_free (req);
+
+	if (exporter && exporter->inflight > 0) {
+		exporter->inflight --;
+	}
+}
+
+static void
+rspamd_trace_error_handler (struct rspamd_http_connection *conn, GError *err)
+{
+	struct rspamd_trace_request *req = conn->ud;
+
+	msg_info ("cannot send traces to %s: %e", rspamd_upstream_name (req->up),
+			err);
+	rspamd_upstream_fail (req->up, FALSE);
+	rspamd_trace_request_free (req);
+}
+
+static int
+rspamd_trace_finish_handler (struct rspamd_http_connection *conn,
+		struct rspamd_http_message *msg)
+{
+	struct rspamd_trace_request *req = conn->ud;
+
+	if (msg->code / 100 != 2) {
+		msg_info ("traces collector %s replied with code %d",
+				rspamd_upstream_name (req->up), msg->code);
+		rspamd_upstream_fail (req->up, FALSE);
+	}
+	else {
+		rspamd_upstream_ok (req->up);
+	}
+
+	rspamd_trace_request_free (req);
+
+	return 0;
+}
+
+static void
+rspamd_trace_send_batch (void)
+{
+	struct rspamd_trace_request *req;
+	struct rspamd_http_message *msg;
+	struct upstream *up;
+	ucl_object_t *top, *rs, *ss, *resource, *scope, *ar, *scope_spans;
+	rspamd_fstring_t *body;
+	struct timeval tv;
+	gint fd;
+
+	if (exporter->nspans == 0) {
+		return;
+	}
+
+	up = rspamd_upstream_get (exporter->collectors,
+			RSPAMD_UPSTREAM_ROUND_ROBIN, NULL, 0);
+
+	if (up == NULL) {
+		msg_info ("no traces collectors alive, drop %ud spans", exporter->nspans);
+		goto drop;
+	}
+
+	fd = rspamd_inet_address_connect (rspamd_upstream_addr (up),
+			SOCK_STREAM, TRUE);
+
+	if (fd == -1) {
+		msg_info ("cannot connect to traces collector %s: %s",
+				rspamd_upstream_name (up), strerror (errno));
+		rspamd_upstream_fail (up, TRUE);
+		goto drop;
+	}
+
+	/* OTLP/HTTP JSON: resourceSpans -> scopeSpans -> spans */
+	top = ucl_object_typed_new (UCL_OBJECT);
+	rs = ucl_object_typed_new (UCL_OBJECT);
+	resource = ucl_object_typed_new (UCL_OBJECT);
+	ar = ucl_object_typed_new (UCL_ARRAY);
+	rspamd_trace_add_attr (ar, "service.name", ucl_object_fromstring ("rspamd"),
+			"stringValue");
+	ucl_object_insert_key (resource, ar, "attributes", 0, false);
+	ucl_object_insert_key (rs, resource, "resource", 0, false);
+	ss = ucl_object_typed_new (UCL_OBJECT);
+	scope = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (scope, ucl_object_fromstring ("rspamd"),
+			"name", 0, false);
+	ucl_object_insert_key (scope, ucl_object_fromstring (RVERSION),
+			"version", 0, false);
+	ucl_object_insert_key (ss, scope, "scope", 0, false);
+	ucl_object_insert_key (ss, exporter->spans, "spans", 0, false);
+	scope_spans = ucl_object_typed_new (UCL_ARRAY);
+	ucl_array_append (scope_spans, ss);
+	ucl_object_insert_key (rs, scope_spans, "scopeSpans", 0, false);
+	ar = ucl_object_typed_new (UCL_ARRAY);
+	ucl_array_append (ar, rs);
+	ucl_object_insert_key (top, ar, "resourceSpans", 0, false);
+
+	body = rspamd_fstring_sized_new (exporter->nspans * 512);
+	rspamd_ucl_emit_fstring (top, UCL_EMIT_JSON_COMPACT, &body);
+	ucl_object_unref (top);
+
+	req = g_malloc0 (sizeof (*req));
+	req->up = up;
+	req->fd = fd;
+	req->conn = rspamd_http_connection_new (NULL,
+			rspamd_trace_error_handler,
+			rspamd_trace_finish_handler,
+			RSPAMD_HTTP_CLIENT_SIMPLE,
+			RSPAMD_HTTP_CLIENT,
+			NULL,
+			NULL);
+	msg = rspamd_http_new_message (HTTP_REQUEST);
+	msg->url = rspamd_fstring_assign (msg->url, TRACE_COLLECTOR_PATH,
+			sizeof (TRACE_COLLECTOR_PATH) - 1);
+	rspamd_http_message_set_body_from_fstring_steal (msg, body);
+	double_to_tv (TRACE_SEND_TIMEOUT, &tv);
+
+	exporter->inflight ++;
+	exporter->spans = ucl_object_typed_new (UCL_ARRAY);
+	exporter->nspans = 0;
+
+	rspamd_http_connection_write_message (req->conn, msg,
+			rspamd_upstream_name (up), "application/json", req, fd,
+			&tv, exporter->ev_base);
+
+	return;
+
+drop:
+	ucl_object_unref (exporter->spans);
+	exporter->spans = ucl_object_typed_new (UCL_ARRAY);
+	exporter->nspans = 0;
+}
+
+static void
+rspamd_trace_flush_cb (gint fd, short what, gpointer ud)
+{
+	exporter->flush_planned = FALSE;
+	rspamd_trace_send_batch ();
+}
+
+static gboolean
+rspamd_trace_exporter_init (struct rspamd_config *cfg,
+		struct event_base *ev_base)
+{
+	if (exporter != NULL && exporter->cfg == cfg &&
+			exporter->ev_base == ev_base) {
+		return TRUE;
+	}
+
+	if (exporter != NULL) {
+		/* Config has been reloaded */
+		rspamd_trace_send_batch ();
+
+		if (exporter->flush_planned) {
+			event_del (&exporter->flush_ev);
+		}
+
+		rspamd_upstreams_destroy (exporter->collectors);
+		ucl_object_unref (exporter->spans);
+		g_free (exporter);
+		exporter = NULL;
+	}
+
+	exporter = g_malloc0 (sizeof (*exporter));
+	exporter->cfg = cfg;
+	exporter->ev_base = ev_base;
+	exporter->spans = ucl_object_typed_new (UCL_ARRAY);
+	exporter->collectors = rspamd_upstreams_create (cfg->ups_ctx);
+
+	if (!rspamd_upstreams_parse_line (exporter->collectors,
+			cfg->trace_collector, DEFAULT_TRACE_COLLECTOR_PORT, NULL)) {
+		msg_err_config ("cannot parse traces collector: %s",
+				cfg->trace_collector);
+		rspamd_upstreams_destroy (exporter->collectors);
+		ucl_object_unref (exporter->spans);
+		g_free (exporter);
+		exporter = NULL;
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+void
+rspamd_trace_finish (struct rspamd_trace *trace,
+		struct rspamd_config *cfg,
+		struct event_base *ev_base,
+		const gchar *message_id)
+{
+	struct rspamd_trace_span *sp;
+	struct timeval tv;
+	guint i, batch;
+
+	if (trace == NULL || ev_base == NULL) {
+		return;
+	}
+
+	if (!rspamd_trace_exporter_init (cfg, ev_base)) {
+		return;
+	}
+
+	batch = MAX (cfg->trace_batch_size, 1);
+
+	if (exporter->inflight >= TRACE_MAX_PENDING_BATCHES) {
+		/* Collector is too slow, do not accumulate spans in memory */
+		return;
+	}
+
+	for (i = 0; i < trace->spans->len; i ++) {
+		sp = &g_array_index (trace->spans, struct rspamd_trace_span, i);
+		rspamd_trace_span_finish (trace, i);
+		ucl_array_append (exporter->spans, rspamd_trace_span_to_ucl (trace, sp,
+				i == RSPAMD_TRACE_ROOT_SPAN ? message_id : NULL));
+		exporter->nspans ++;
+	}
+
+	if (exporter->nspans >= batch) {
+		rspamd_trace_send_batch ();
+	}
+	else if (!exporter->flush_planned) {
+		double_to_tv (TRACE_FLUSH_INTERVAL, &tv);
+		evtimer_set (&exporter->flush_ev, rspamd_trace_flush_cb, NULL);
+		event_base_set (exporter->ev_base, &exporter->flush_ev);
+		evtimer_add (&exporter->flush_ev, &tv);
+		exporter->flush_planned = TRUE;
+	}
+}
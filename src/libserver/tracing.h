@@ -0,0 +1,98 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef RSPAMD_TRACING_H
+#define RSPAMD_TRACING_H
+
+#include "config.h"
+#include "mem_pool.h"
+
+/*
+ * Per task tracing: a sampled task records spans for symbols, async events
+ * and the task itself. When a task is finished, its spans are queued and sent
+ * in batches to the collector over HTTP as OTLP JSON (`/v1/traces`)
+ */
+
+/* Used as an invalid span index */
+#define RSPAMD_TRACE_NO_SPAN ((guint)-1)
+/* Root span, it covers the whole task */
+#define RSPAMD_TRACE_ROOT_SPAN 0
+
+#define DEFAULT_TRACE_COLLECTOR_PORT 4318
+
+struct rspamd_trace;
+struct rspamd_config;
+struct event_base;
+
+/**
+ * Starts a new trace if it is selected by the sample rate
+ * @param cfg config, if `trace_sample_rate` is zero no traces are started
+ * @param pool pool to allocate the trace from
+ * @return new trace or NULL if this task should not be traced
+ */
+struct rspamd_trace *rspamd_trace_maybe_start (struct rspamd_config *cfg,
+		rspamd_mempool_t *pool);
+
+/**
+ * Opens new span
+ * @param trace
+ * @param name name of the span (must be valid until the trace is finished)
+ * @param parent parent span, RSPAMD_TRACE_NO_SPAN to use the current one
+ * @return span index
+ */
+guint rspamd_trace_span_start (struct rspamd_trace *trace, const gchar *name,
+		guint parent);
+
+/**
+ * Closes the span specified, spans that are still opened are closed when
+ * a trace is finished
+ */
+void rspamd_trace_span_finish (struct rspamd_trace *trace, guint span);
+
+/**
+ * Sets the location (e.g. source line) where a span has been started
+ */
+void rspamd_trace_span_set_loc (struct rspamd_trace *trace, guint span,
+		const gchar *loc);
+
+/**
+ * Sets the remote peer (upstream) of a span, the string is copied
+ */
+void rspamd_trace_span_set_peer (struct rspamd_trace *trace, guint span,
+		const gchar *peer);
+
+/**
+ * Accounts CPU time spent by a span (in seconds), the rest of its duration is
+ * treated as wait time
+ */
+void rspamd_trace_span_add_cpu (struct rspamd_trace *trace, guint span,
+		gdouble cpu);
+
+/**
+ * Sets the span that is used as a parent for new spans, returns the previous one
+ */
+guint rspamd_trace_set_current (struct rspamd_trace *trace, guint span);
+
+/**
+ * Finishes trace and queues its spans for export
+ * @param trace
+ * @param cfg
+ * @param ev_base event base used to send batches
+ * @param message_id message id attribute of the root span
+ */
+void rspamd_trace_finish (struct rspamd_trace *trace,
+		struct rspamd_config *cfg,
+		struct event_base *ev_base,
+		const gchar *message_id);
+
+#endif /* RSPAMD_TRACING_H */
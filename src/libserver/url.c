@@ -207,11 +207,19 @@ struct url_callback_data {
 	const gchar *last_at;
 	url_insert_function func;
 	void *funcd;
+	GHashTable *seen; /* url string -> parsed url or NULL if it is invalid */
 };
 
+/* Inputs shorter than this are matched as a whole */
+#define URL_SCAN_WINDOWS_MIN_LEN 1024
+/* Windows closer than this are matched at once */
+#define URL_SCAN_WINDOWS_GAP 128
+
 struct url_match_scanner {
 	GArray *matchers;
 	struct rspamd_multipattern *search_trie;
+	/* Public suffixes from tld file: rspamd_ftok_t -> matcher flags */
+	GHashTable *tld_suffixes;
 };
 
 struct url_match_scanner *url_scanner = NULL;
@@ -391,6 +399,9 @@ rspamd_url_parse_tld_file (const gchar *fname,
 	gsize buflen = 0;
 	gssize r;
 	gint flags;
+	rspamd_ftok_t *suffix;
+	const gchar *sp;
+	gsize slen;
 
 	f = fopen (fname, "r");
 
@@ -419,6 +430,32 @@ rspamd_url_parse_tld_file (const gchar *fname,
 
 		flags = URL_FLAG_NOHTML | URL_FLAG_TLD_MATCH;
 
+		/*
+		 * Suffixes table is used for hosts lookups and it always stores
+		 * star patterns without `*.` prefix, regardless of multipattern
+		 */
+		sp = linebuf;
+		slen = strlen (linebuf);
+
+		if (linebuf[0] == '*') {
+			sp = memchr (linebuf, '.', slen);
+
+			if (sp != NULL) {
+				sp++;
+				slen -= sp - linebuf;
+			}
+		}
+
+		if (sp != NULL && slen > 0) {
+			suffix = g_malloc (sizeof (*suffix) + slen + 1);
+			memcpy ((gchar *)(suffix + 1), sp, slen + 1);
+			suffix->begin = (const gchar *)(suffix + 1);
+			suffix->len = slen;
+			g_hash_table_replace (scanner->tld_suffixes, suffix,
+					GINT_TO_POINTER (linebuf[0] == '*' ?
+							flags | URL_FLAG_STAR_MATCH : flags));
+		}
+
 #ifndef WITH_HYPERSCAN
 		if (linebuf[0] == '*') {
 			flags |= URL_FLAG_STAR_MATCH;
@@ -480,6 +517,11 @@ rspamd_url_deinit (void)
 	if (url_scanner != NULL) {
 		rspamd_multipattern_destroy (url_scanner->search_trie);
 		g_array_free (url_scanner->matchers, TRUE);
+
+		if (url_scanner->tld_suffixes) {
+			g_hash_table_unref (url_scanner->tld_suffixes);
+		}
+
 		g_free (url_scanner);
 
 		url_scanner = NULL;
@@ -496,6 +538,7 @@ rspamd_url_init (const gchar *tld_file)
 	}
 
 	url_scanner = g_malloc (sizeof (struct url_match_scanner));
+	url_scanner->tld_suffixes = NULL;
 
 	if (tld_file) {
 		/* Reserve larger multipattern */
@@ -514,7 +557,15 @@ rspamd_url_init (const gchar *tld_file)
 	rspamd_url_add_static_matchers (url_scanner);
 
 	if (tld_file != NULL) {
+		url_scanner->tld_suffixes = g_hash_table_new_full (
+				rspamd_ftok_icase_hash, rspamd_ftok_icase_equal,
+				g_free, NULL);
 		rspamd_url_parse_tld_file (tld_file, url_scanner);
+
+		if (g_hash_table_size (url_scanner->tld_suffixes) == 0) {
+			g_hash_table_unref (url_scanner->tld_suffixes);
+			url_scanner->tld_suffixes = NULL;
+		}
 	}
 
 	if (!rspamd_multipattern_compile (url_scanner->search_trie, &err)) {
@@ -1272,6 +1323,59 @@ rspamd_web_parse (struct http_parser_url *u, const gchar *str, gsize len,
 
 #undef SET_U
 
+/*
+ * Returns the beginning of the longest registered domain (public suffix plus
+ * one more label) that ends at `in + len` or NULL if no known suffix is found.
+ * Each label boundary costs a single hash lookup, so it is much cheaper than
+ * running the whole url multipattern over a host.
+ */
+static const gchar *
+rspamd_url_tld_suffix_lookup (const gchar *in, gsize len)
+{
+	const gchar *dot, *p, *pos, *best = NULL;
+	rspamd_ftok_t srch;
+	gpointer flags;
+	gint ndots;
+
+	dot = in;
+
+	while (dot < in + len && (dot = memchr (dot, '.', in + len - dot)) != NULL) {
+		srch.begin = dot + 1;
+		srch.len = in + len - srch.begin;
+
+		if (srch.len > 0 &&
+				(flags = g_hash_table_lookup (url_scanner->tld_suffixes,
+						&srch)) != NULL) {
+			ndots = 1;
+
+			if (GPOINTER_TO_INT (flags) & URL_FLAG_STAR_MATCH) {
+				/* Skip one more tld component */
+				ndots = 2;
+			}
+
+			p = dot - 1;
+			pos = in;
+
+			while (p >= in && ndots > 0) {
+				if (*p == '.') {
+					ndots--;
+					pos = p + 1;
+				}
+
+				p--;
+			}
+
+			if ((ndots == 0 || p == in - 1) && (best == NULL || pos < best)) {
+				best = pos;
+			}
+		}
+
+		dot++;
+	}
+
+	return best;
+}
+
 static gint
 rspamd_tld_trie_callback (struct rspamd_multipattern *mp,
 		guint strnum,
@@ -1765,9 +1869,28 @@ rspamd_url_parse (struct rspamd_url *uri, gchar *uristring, gsize len,
 	}
 
 	/* Find TLD part */
-	rspamd_multipattern_lookup (url_scanner->search_trie,
+	if (url_scanner->tld_suffixes != NULL) {
+		const gchar *tld;
+		gsize hostlen = uri->hostlen;
+
+		if (hostlen > 0 && uri->host[hostlen - 1] == '.') {
+			/* This is dot at the end of domain */
+			hostlen--;
+		}
+
+		tld = rspamd_url_tld_suffix_lookup (uri->host, hostlen);
+
+		if (tld != NULL) {
+			uri->hostlen = hostlen;
+			uri->tld = (gchar *)tld;
+			uri->tldlen = uri->host + hostlen - tld;
+		}
+	}
+	else {
+		rspamd_multipattern_lookup (url_scanner->search_trie,
 				uri->host, uri->hostlen,
 				rspamd_tld_trie_callback, uri, NULL);
+	}
 
 	if (uri->tldlen == 0) {
 		/* Ignore URL's without TLD if it is not a numeric URL */
@@ -1859,8 +1982,27 @@ rspamd_url_find_tld (const gchar *in, gsize inlen, rspamd_ftok_t *out)
 	cbdata.out = out;
 	out->len = 0;
 
-	rspamd_multipattern_lookup (url_scanner->search_trie, in, inlen,
-			rspamd_tld_trie_find_callback, &cbdata, NULL);
+	if (url_scanner->tld_suffixes != NULL) {
+		const gchar *pos, *best;
+
+		/* Suffix can also end one character before the end of input */
+		best = rspamd_url_tld_suffix_lookup (in, inlen);
+
+		if (inlen > 1 &&
+				(pos = rspamd_url_tld_suffix_lookup (in, inlen - 1)) != NULL &&
+				(best == NULL || pos < best)) {
+			best = pos;
+		}
+
+		if (best != NULL) {
+			out->begin = best;
+			out->len = in + inlen - best;
+		}
+	}
+	else {
+		rspamd_multipattern_lookup (url_scanner->search_trie, in, inlen,
+				rspamd_tld_trie_find_callback, &cbdata, NULL);
+	}
 
 	if (out->len > 0) {
 		return TRUE;
@@ -2436,11 +2578,12 @@ rspamd_url_trie_generic_callback_common (struct rspamd_multipattern *mp,
 		}
 	}
 
-	if (!rspamd_url_trie_is_match (matcher, pos, text + len, newline_pos)) {
+	/* Text might be a window of the input, see rspamd_url_find_multiple */
+	if (!rspamd_url_trie_is_match (matcher, pos, cb->end, newline_pos)) {
 		return 0;
 	}
 
-	pos = cb->begin + match_start;
+	pos = text + match_start;
 	m.pattern = matcher->pattern;
 	m.prefix = matcher->prefix;
 	m.add_prefix = FALSE;
@@ -2468,8 +2611,22 @@ rspamd_url_trie_generic_callback_common (struct rspamd_multipattern *mp,
 
 		cb->start = m.m_begin;
 		cb->fin = m.m_begin + m.m_len;
-		url = rspamd_mempool_alloc0 (pool, sizeof (struct rspamd_url));
 		g_strstrip (cb->url_str);
+
+		if (cb->seen && g_hash_table_lookup_extended (cb->seen, cb->url_str,
+				NULL, (gpointer *)&url)) {
+			/* Repeated url is not parsed again */
+			cb->prefix_added = FALSE;
+
+			if (url && cb->func) {
+				cb->func (url, cb->start - cb->begin, cb->fin - cb->begin,
+						cb->funcd);
+			}
+
+			return !multiple;
+		}
+
+		url = rspamd_mempool_alloc0 (pool, sizeof (struct rspamd_url));
 		rc = rspamd_url_parse (url, cb->url_str, strlen (cb->url_str), pool);
 
 		if (rc == URI_ERRNO_OK && url->hostlen > 0) {
@@ -2478,14 +2635,27 @@ rspamd_url_trie_generic_callback_common (struct rspamd_multipattern *mp,
 				cb->prefix_added = FALSE;
 			}
 
+			if (cb->seen) {
+				g_hash_table_insert (cb->seen, cb->url_str, url);
+			}
+
 			if (cb->func) {
-				cb->func (url, cb->start - text, cb->fin - text, cb->funcd);
+				cb->func (url, cb->start - cb->begin, cb->fin - cb->begin,
+						cb->funcd);
 			}
 		}
-		else if (rc != URI_ERRNO_OK) {
-			msg_debug_pool_check ("extract of url '%s' failed: %s",
-					cb->url_str,
-					rspamd_url_strerror (rc));
+		else {
+			if (rc != URI_ERRNO_OK) {
+				msg_debug_pool_check ("extract of url '%s' failed: %s",
+						cb->url_str,
+						rspamd_url_strerror (rc));
+			}
+
+			cb->prefix_added = FALSE;
+
+			if (cb->seen) {
+				g_hash_table_insert (cb->seen, cb->url_str, NULL);
+			}
 		}
 	}
 	else {
@@ -2535,10 +2705,10 @@ rspamd_url_text_part_callback (struct rspamd_url *url, gsize start_offset,
 	struct rspamd_process_exception *ex;
 	struct rspamd_task *task;
 	gchar *url_str = NULL;
-	struct rspamd_url *query_url, *existing;
+	struct rspamd_url *query_url;
 	GHashTable *target_tbl = NULL;
 	gint rc;
-	gboolean prefix_added;
+	gboolean prefix_added, duplicate = FALSE;
 
 	task = cbd->task;
 	ex = rspamd_mempool_alloc0 (task->task_pool, sizeof (struct rspamd_process_exception));
@@ -2547,7 +2717,11 @@ rspamd_url_text_part_callback (struct rspamd_url *url, gsize start_offset,
 	ex->len = end_offset - start_offset;
 	ex->type = RSPAMD_EXCEPTION_URL;
 
-	if (url->protocol == PROTOCOL_MAILTO) {
+	if (RSPAMD_TASK_IS_TOKENIZE_ONLY (task)) {
+		/* Merely an exception for the tokenizer is required */
+		target_tbl = NULL;
+	}
+	else if (url->protocol == PROTOCOL_MAILTO) {
 		if (url->userlen > 0) {
 			target_tbl = task->emails;
 		}
@@ -2557,12 +2731,11 @@ rspamd_url_text_part_callback (struct rspamd_url *url, gsize start_offset,
 	}
 
 	if (target_tbl) {
-		if ((existing = g_hash_table_lookup (target_tbl, url)) == NULL) {
-			url->flags |= RSPAMD_URL_FLAG_FROM_TEXT;
-			g_hash_table_insert (target_tbl, url, url);
-		}
-		else {
-			existing->count++;
+		url->flags |= RSPAMD_URL_FLAG_FROM_TEXT;
+
+		if (rspamd_url_set_add_or_increase (target_tbl, url) != NULL) {
+			/* The same url has been already found, so is its query */
+			duplicate = TRUE;
 		}
 	}
 
@@ -2573,7 +2746,7 @@ rspamd_url_text_part_callback (struct rspamd_url *url, gsize start_offset,
 			ex);
 
 	/* We also search the query for additional url inside */
-	if (url->querylen > 0) {
+	if (url->querylen > 0 && !duplicate && !RSPAMD_TASK_IS_TOKENIZE_ONLY (task)) {
 		if (rspamd_url_find (task->task_pool, url->query, url->querylen,
 				&url_str, IS_PART_HTML (cbd->part), NULL, &prefix_added)) {
 
@@ -2603,12 +2776,9 @@ rspamd_url_text_part_callback (struct rspamd_url *url, gsize start_offset,
 				}
 
 				if (target_tbl) {
-					if ((existing = g_hash_table_lookup (target_tbl, query_url)) == NULL) {
+					if (rspamd_url_set_add_or_increase (target_tbl,
+							query_url) == NULL) {
 						url->flags |= RSPAMD_URL_FLAG_FROM_TEXT;
-						g_hash_table_insert (target_tbl, query_url, query_url);
-					}
-					else {
-						existing->count++;
 					}
 				}
 			}
@@ -2637,6 +2807,62 @@ rspamd_url_text_extract (rspamd_mempool_t *pool,
 			rspamd_url_text_part_callback, &mcbd);
 }
 
+/*
+ * Every url pattern contains one of these characters, so the matcher is run
+ * only on the windows of words containing them. Patterns have no spaces, so
+ * matches are the same as for the whole text, except for the star TLD
+ * patterns with hyperscan that could span several words
+ */
+static void
+rspamd_url_find_windows (struct url_callback_data *cb)
+{
+	const gchar *p = cb->begin, *end = cb->end, *ws = NULL, *we = NULL,
+			*ts, *te;
+
+	while (p < end) {
+		/* Anchors are located by the vectorized implementation if possible */
+		p += rspamd_memcspn (p, ":@.", end - p);
+
+		if (p >= end) {
+			break;
+		}
+
+		/* Lone anchors cannot be a part of any url */
+		if ((p == cb->begin || g_ascii_isspace (p[-1])) &&
+				(p + 1 == end || g_ascii_isspace (p[1]))) {
+			p ++;
+			continue;
+		}
+
+		ts = p;
+
+		while (ts > cb->begin && !g_ascii_isspace (ts[-1])) {
+			ts --;
+		}
+
+		te = p + 1;
+		te += rspamd_memcspn (te, " \t\r\n\f\v", end - te);
+
+		if (ws != NULL && ts - we > URL_SCAN_WINDOWS_GAP) {
+			rspamd_multipattern_lookup (url_scanner->search_trie, ws, we - ws,
+					rspamd_url_trie_generic_callback_multiple, cb, NULL);
+			ws = NULL;
+		}
+
+		if (ws == NULL) {
+			ws = ts;
+		}
+
+		we = te;
+		p = te;
+	}
+
+	if (ws != NULL) {
+		rspamd_multipattern_lookup (url_scanner->search_trie, ws, we - ws,
+				rspamd_url_trie_generic_callback_multiple, cb, NULL);
+	}
+}
+
 void
 rspamd_url_find_multiple (rspamd_mempool_t *pool, const gchar *in,
 		gsize inlen, gboolean is_html, GPtrArray *nlines,
@@ -2660,9 +2886,17 @@ rspamd_url_find_multiple (rspamd_mempool_t *pool, const gchar *in,
 	cb.func = func;
 	cb.newlines = nlines;
 
-	rspamd_multipattern_lookup (url_scanner->search_trie, in,
-			inlen,
-			rspamd_url_trie_generic_callback_multiple, &cb, NULL);
+	if (inlen < URL_SCAN_WINDOWS_MIN_LEN) {
+		rspamd_multipattern_lookup (url_scanner->search_trie, in,
+				inlen,
+				rspamd_url_trie_generic_callback_multiple, &cb, NULL);
+
+		return;
+	}
+
+	cb.seen = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
+	rspamd_url_find_windows (&cb);
+	g_hash_table_unref (cb.seen);
 }
 
 void
@@ -2699,35 +2933,28 @@ rspamd_url_task_subject_callback (struct rspamd_url *url, gsize start_offset,
 {
 	struct rspamd_task *task = ud;
 	gchar *url_str = NULL;
-	struct rspamd_url *query_url, *existing;
+	struct rspamd_url *query_url;
 	gint rc;
-	gboolean prefix_added;
+	gboolean prefix_added, duplicate = FALSE;
 
 	/* It is just a displayed URL, we should not check it for certain things */
 	url->flags |= RSPAMD_URL_FLAG_HTML_DISPLAYED|RSPAMD_URL_FLAG_SUBJECT;
 
 	if (url->protocol == PROTOCOL_MAILTO) {
 		if (url->userlen > 0) {
-			if ((existing = g_hash_table_lookup (task->emails, url)) == NULL) {
-				g_hash_table_insert (task->emails, url,
-						url);
-			}
-			else {
-				existing->count ++;
+			if (rspamd_url_set_add_or_increase (task->emails, url) != NULL) {
+				duplicate = TRUE;
 			}
 		}
 	}
 	else {
-		if ((existing = g_hash_table_lookup (task->urls, url)) == NULL) {
-			g_hash_table_insert (task->urls, url, url);
-		}
-		else {
-			existing->count ++;
+		if (rspamd_url_set_add_or_increase (task->urls, url) != NULL) {
+			duplicate = TRUE;
 		}
 	}
 
 	/* We also search the query for additional url inside */
-	if (url->querylen > 0) {
+	if (url->querylen > 0 && !duplicate) {
 		if (rspamd_url_find (task->task_pool, url->query, url->querylen,
 				&url_str, FALSE, NULL, &prefix_added)) {
 
@@ -2747,15 +2974,7 @@ rspamd_url_task_subject_callback (struct rspamd_url *url, gsize start_offset,
 					query_url->flags |= RSPAMD_URL_FLAG_SCHEMALESS;
 				}
 
-				if ((existing = g_hash_table_lookup (task->urls,
-						query_url)) == NULL) {
-					g_hash_table_insert (task->urls,
-							query_url,
-							query_url);
-				}
-				else {
-					existing->count ++;
-				}
+				rspamd_url_set_add_or_increase (task->urls, query_url);
 			}
 		}
 	}
@@ -2867,6 +3086,22 @@ rspamd_urls_cmp (gconstpointer a, gconstpointer b)
 	return r == 0;
 }
 
+struct rspamd_url *
+rspamd_url_set_add_or_increase (GHashTable *set, struct rspamd_url *u)
+{
+	struct rspamd_url *existing;
+
+	if ((existing = g_hash_table_lookup (set, u)) == NULL) {
+		g_hash_table_insert (set, u, u);
+
+		return NULL;
+	}
+
+	existing->count ++;
+
+	return existing;
+}
+
 gsize
 rspamd_url_decode (gchar *dst, const gchar *src, gsize size)
 {
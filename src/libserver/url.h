@@ -147,7 +147,8 @@ typedef void (*url_insert_function) (struct rspamd_url *url,
 		gsize start_offset, gsize end_offset, void *ud);
 
 /**
- * Search for multiple urls in text and call `func` for each url found
+ * Search for multiple urls in text and call `func` for each url found,
+ * repeated urls are passed as the same object
  * @param pool
  * @param in
  * @param inlen
@@ -201,6 +202,16 @@ gboolean rspamd_emails_cmp (gconstpointer a, gconstpointer b);
 /* Compare two urls for building emails hash */
 gboolean rspamd_urls_cmp (gconstpointer a, gconstpointer b);
 
+/**
+ * Inserts url to a set of urls or emails (hash table keyed by urls) or
+ * increases counter of the equal url that is already there
+ * @param set
+ * @param u
+ * @return existing url or NULL if `u` has been inserted
+ */
+struct rspamd_url *rspamd_url_set_add_or_increase (GHashTable *set,
+		struct rspamd_url *u);
+
 /**
  * Decode URL encoded string in-place and return new length of a string, src and dst are NULL terminated
  * @param dst
@@ -42,6 +42,15 @@
 #ifdef HAVE_LIBUTIL_H
 #include <libutil.h>
 #endif
+#ifdef HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
 #include "zlib.h"
 
 #ifdef WITH_LIBUNWIND
@@ -56,6 +65,10 @@
 #include <sys/ucontext.h>
 #endif
 
+/* How often workers publish their resources usage, in seconds */
+#define RSPAMD_WORKER_USAGE_INTERVAL 1.0
+#define RSPAMD_WORKER_USAGE_READ_ATTEMPTS 64
+
 static void rspamd_worker_ignore_signal (int signo);
 /**
  * Return worker's control structure by its type
@@ -296,6 +309,28 @@ rspamd_worker_init_signals (struct rspamd_worker *worker, struct event_base *bas
 	sigprocmask (SIG_UNBLOCK, &signals.sa_mask, NULL);
 }
 
+/*
+ * Returns own SO_REUSEPORT socket for a shared listener if it has been
+ * created for this worker
+ */
+static gint
+rspamd_worker_listen_fd (struct rspamd_worker *worker,
+		struct rspamd_worker_listen_socket *ls)
+{
+	GList *cur;
+	struct rspamd_worker_listen_socket *own;
+
+	for (cur = worker->reuseport_socks; cur != NULL; cur = g_list_next (cur)) {
+		own = cur->data;
+
+		if (own->addr == ls->addr && own->type == ls->type) {
+			return own->fd;
+		}
+	}
+
+	return ls->fd;
+}
+
 struct event_base *
 rspamd_prepare_worker (struct rspamd_worker *worker, const char *name,
 	void (*accept_handler)(int, short, void *))
@@ -304,6 +339,8 @@ rspamd_prepare_worker (struct rspamd_worker *worker, const char *name,
 	struct event *accept_events;
 	GList *cur;
 	struct rspamd_worker_listen_socket *ls;
+	static struct event usage_ev;
+	struct timeval usage_tv;
 
 #ifdef WITH_PROFILER
 	extern void _start (void), etext (void);
@@ -319,6 +356,14 @@ rspamd_prepare_worker (struct rspamd_worker *worker, const char *name,
 
 	rspamd_worker_init_signals (worker, ev_base);
 	rspamd_control_worker_add_default_handler (worker, ev_base);
+
+	/* Resources usage is read by the main process without asking workers */
+	rspamd_worker_publish_usage (worker);
+	double_to_tv (RSPAMD_WORKER_USAGE_INTERVAL, &usage_tv);
+	event_set (&usage_ev, -1, EV_TIMEOUT|EV_PERSIST,
+			rspamd_worker_usage_timer, worker);
+	event_base_set (ev_base, &usage_ev);
+	event_add (&usage_ev, &usage_tv);
 #ifdef WITH_HIREDIS
 	rspamd_redis_pool_config (worker->srv->cfg->redis_pool,
 			worker->srv->cfg, ev_base);
@@ -333,7 +378,8 @@ rspamd_prepare_worker (struct rspamd_worker *worker, const char *name,
 
 			if (ls->fd != -1) {
 				accept_events = g_malloc0 (sizeof (struct event) * 2);
-				event_set (&accept_events[0], ls->fd, EV_READ | EV_PERSIST,
+				event_set (&accept_events[0], rspamd_worker_listen_fd (worker, ls),
+						EV_READ | EV_PERSIST,
 						accept_handler, worker);
 				event_base_set (ev_base, &accept_events[0]);
 				event_add (&accept_events[0], NULL);
@@ -353,6 +399,7 @@ rspamd_worker_stop_accept (struct rspamd_worker *worker)
 {
 	GList *cur;
 	struct event *events;
+	struct rspamd_worker_listen_socket *ls;
 
 	/* Remove all events */
 	cur = worker->accept_events;
@@ -374,6 +421,22 @@ rspamd_worker_stop_accept (struct rspamd_worker *worker)
 	if (worker->accept_events != NULL) {
 		g_list_free (worker->accept_events);
 	}
+
+	/*
+	 * Own sockets are in the kernel reuseport group, so we need to close them
+	 * to stop receiving new connections while terminating
+	 */
+	cur = worker->reuseport_socks;
+	while (cur) {
+		ls = cur->data;
+
+		if (ls->fd != -1) {
+			close (ls->fd);
+			ls->fd = -1;
+		}
+
+		cur = g_list_next (cur);
+	}
 	/* XXX: we need to do it much later */
 #if 0
 	g_hash_table_iter_init (&it, worker->signal_events);
@@ -474,12 +537,39 @@ rspamd_controller_send_string (struct rspamd_http_connection_entry *entry,
 	entry->is_reply = TRUE;
 }
 
+static void
+rspamd_controller_write_json (struct rspamd_http_connection_entry *entry,
+	struct rspamd_http_message *msg)
+{
+	rspamd_http_connection_reset (entry->conn);
+	rspamd_http_router_insert_headers (entry->rt, msg);
+	rspamd_http_connection_write_message (entry->conn,
+		msg,
+		NULL,
+		"application/json",
+		entry,
+		entry->conn->fd,
+		entry->rt->ptv,
+		entry->rt->ev_base);
+	entry->is_reply = TRUE;
+}
+
 void
 rspamd_controller_send_ucl (struct rspamd_http_connection_entry *entry,
 	ucl_object_t *obj)
 {
 	struct rspamd_http_message *msg;
 	rspamd_fstring_t *reply;
+	rspamd_fstring_rope_t *rope;
+
+	if (!entry->support_gzip) {
+		/* Large replies are written from chunks with no reallocations */
+		rope = rspamd_fstring_rope_new (BUFSIZ);
+		rspamd_ucl_emit_rope (obj, UCL_EMIT_JSON_COMPACT, rope);
+		rspamd_controller_send_rope (entry, rope);
+
+		return;
+	}
 
 	msg = rspamd_http_new_message (HTTP_RESPONSE);
 	msg->date = time (NULL);
@@ -487,6 +577,46 @@ rspamd_controller_send_ucl (struct rspamd_http_connection_entry *entry,
 	msg->status = rspamd_fstring_new_init ("OK", 2);
 	reply = rspamd_fstring_sized_new (BUFSIZ);
 	rspamd_ucl_emit_fstring (obj, UCL_EMIT_JSON_COMPACT, &reply);
+	rspamd_http_message_set_body_from_fstring_steal (msg,
+			rspamd_controller_maybe_compress (entry, reply, msg));
+	rspamd_controller_write_json (entry, msg);
+}
+
+void
+rspamd_controller_send_rope (struct rspamd_http_connection_entry *entry,
+	rspamd_fstring_rope_t *rope)
+{
+	struct rspamd_http_message *msg;
+	rspamd_fstring_t *reply;
+
+	msg = rspamd_http_new_message (HTTP_RESPONSE);
+	msg->date = time (NULL);
+	msg->code = 200;
+	msg->status = rspamd_fstring_new_init ("OK", 2);
+
+	if (entry->support_gzip) {
+		reply = rspamd_fstring_rope_flatten (rope);
+		rspamd_fstring_rope_free (rope);
+		rspamd_http_message_set_body_from_fstring_steal (msg,
+				rspamd_controller_maybe_compress (entry, reply, msg));
+	}
+	else {
+		rspamd_http_message_set_body_from_rope_steal (msg, rope);
+	}
+
+	rspamd_controller_write_json (entry, msg);
+}
+
+void
+rspamd_controller_send_text (struct rspamd_http_connection_entry *entry,
+	rspamd_fstring_t *reply, const gchar *content_type)
+{
+	struct rspamd_http_message *msg;
+
+	msg = rspamd_http_new_message (HTTP_RESPONSE);
+	msg->date = time (NULL);
+	msg->code = 200;
+	msg->status = rspamd_fstring_new_init ("OK", 2);
 	rspamd_http_message_set_body_from_fstring_steal (msg,
 			rspamd_controller_maybe_compress (entry, reply, msg));
 	rspamd_http_connection_reset (entry->conn);
@@ -494,7 +624,7 @@ rspamd_controller_send_ucl (struct rspamd_http_connection_entry *entry,
 	rspamd_http_connection_write_message (entry->conn,
 		msg,
 		NULL,
-		"application/json",
+		content_type,
 		entry,
 		entry->conn->fd,
 		entry->rt->ptv,
@@ -568,136 +698,1255 @@ rspamd_worker_set_limits (struct rspamd_main *rspamd_main,
 	}
 }
 
-struct rspamd_worker *
-rspamd_fork_worker (struct rspamd_main *rspamd_main,
-		struct rspamd_worker_conf *cf,
-		guint index,
-		struct event_base *ev_base)
+/*
+ * Creates own listening sockets for TCP listeners, must be called before
+ * dropping privileges
+ */
+static void
+rspamd_worker_create_reuseport_socks (struct rspamd_main *rspamd_main,
+		struct rspamd_worker *wrk)
 {
-	struct rspamd_worker *wrk;
-	gint rc;
-	struct rlimit rlim;
-
-	/* Starting worker process */
-	wrk = (struct rspamd_worker *) g_malloc0 (sizeof (struct rspamd_worker));
+	GList *cur;
+	struct rspamd_worker_listen_socket *ls, *nls;
+	gint fd;
 
-	if (!rspamd_socketpair (wrk->control_pipe, 0)) {
-		msg_err ("socketpair failure: %s", strerror (errno));
-		rspamd_hard_terminate (rspamd_main);
+	if (wrk->index == 0) {
+		/* The first worker still listens on the shared socket */
+		return;
 	}
 
-	if (!rspamd_socketpair (wrk->srv_pipe, 0)) {
-		msg_err ("socketpair failure: %s", strerror (errno));
-		rspamd_hard_terminate (rspamd_main);
+	for (cur = wrk->cf->listen_socks; cur != NULL; cur = g_list_next (cur)) {
+		ls = cur->data;
+
+		if (ls->fd == -1 || ls->type != RSPAMD_WORKER_SOCKET_TCP ||
+				rspamd_inet_address_get_af (ls->addr) == AF_UNIX) {
+			continue;
+		}
+
+		fd = rspamd_inet_address_listen_reuseport (ls->addr, SOCK_STREAM, TRUE);
+
+		if (fd == -1) {
+			msg_warn_main ("cannot create own socket for %s, "
+					"use the shared one",
+					rspamd_inet_address_to_string_pretty (ls->addr));
+			continue;
+		}
+
+		nls = g_malloc0 (sizeof (*nls));
+		nls->addr = ls->addr;
+		nls->fd = fd;
+		nls->type = ls->type;
+		wrk->reuseport_socks = g_list_prepend (wrk->reuseport_socks, nls);
 	}
+}
 
-	wrk->srv = rspamd_main;
-	wrk->type = cf->type;
-	wrk->cf = cf;
-	wrk->flags = cf->worker->flags;
-	REF_RETAIN (cf);
-	wrk->index = index;
-	wrk->ctx = cf->ctx;
-	wrk->finish_actions = g_ptr_array_new ();
-	wrk->ppid = getpid ();
-	wrk->pid = fork ();
-	wrk->cores_throttled = rspamd_main->cores_throttling;
+#if defined(HAVE_SCHED_SETAFFINITY) && defined(HAVE_SC_NPROCESSORS_ONLN)
+/*
+ * Parses cpu list in the kernel format, e.g. "0-7,16,18-19", into the set
+ */
+static guint
+rspamd_worker_parse_cpus (const gchar *str, cpu_set_t *set, glong ncpus)
+{
+	gchar **elts, *dash;
+	gulong from, to, i;
+	guint n = 0, j;
 
-	switch (wrk->pid) {
-	case 0:
-		/* Update pid for logging */
-		rspamd_log_update_pid (cf->type, rspamd_main->logger);
-		wrk->pid = getpid ();
+	CPU_ZERO (set);
+	elts = g_strsplit_set (str, ", \n", -1);
 
-		/* Init PRNG after fork */
-		rc = ottery_init (rspamd_main->cfg->libs_ctx->ottery_cfg);
-		if (rc != OTTERY_ERR_NONE) {
-			msg_err_main ("cannot initialize PRNG: %d", rc);
-			abort ();
+	for (j = 0; elts[j] != NULL; j ++) {
+		g_strstrip (elts[j]);
+
+		if (elts[j][0] == '\0') {
+			continue;
 		}
 
-		rspamd_random_seed_fast ();
-#ifdef HAVE_EVUTIL_RNG_INIT
-		evutil_secure_rng_init ();
+		dash = strchr (elts[j], '-');
+
+		if (dash) {
+			*dash = '\0';
+
+			if (!rspamd_strtoul (elts[j], strlen (elts[j]), &from) ||
+					!rspamd_strtoul (dash + 1, strlen (dash + 1), &to)) {
+				continue;
+			}
+		}
+		else {
+			if (!rspamd_strtoul (elts[j], strlen (elts[j]), &from)) {
+				continue;
+			}
+
+			to = from;
+		}
+
+		for (i = from; i <= to && i < (gulong)ncpus && i < CPU_SETSIZE; i ++) {
+			if (!CPU_ISSET (i, set)) {
+				CPU_SET (i, set);
+				n ++;
+			}
+		}
+	}
+
+	g_strfreev (elts);
+
+	return n;
+}
 #endif
 
-		/* Remove the inherited event base */
-		event_reinit (rspamd_main->ev_base);
-		event_base_free (rspamd_main->ev_base);
+/*
+ * Restricts worker to the configured cpus and numa node, with cpu_affinity
+ * each worker is pinned to a single cpu selected by its index
+ */
+static void
+rspamd_worker_set_affinity (struct rspamd_main *rspamd_main,
+		struct rspamd_worker *wrk)
+{
+	struct rspamd_worker_conf *cf = wrk->cf;
+	struct rspamd_worker_stat *ws = NULL;
+#if defined(HAVE_SCHED_SETAFFINITY) && defined(HAVE_SC_NPROCESSORS_ONLN)
+	cpu_set_t avail, set;
+	glong ncpus;
+	guint navail = 0, cpu = 0, i, sel;
+	gchar *node_cpus = NULL, path[PATH_MAX];
+#endif
 
-		/* Drop privileges */
-		rspamd_worker_drop_priv (rspamd_main);
-		/* Set limits */
-		rspamd_worker_set_limits (rspamd_main, cf);
-		/* Re-set stack limit */
-		getrlimit (RLIMIT_STACK, &rlim);
-		rlim.rlim_cur = 100 * 1024 * 1024;
-		rlim.rlim_max = rlim.rlim_cur;
-		setrlimit (RLIMIT_STACK, &rlim);
+	if (wrk->stat_slot >= 0) {
+		ws = &rspamd_main->stat->workers[wrk->stat_slot];
+	}
 
-		if (cf->bind_conf) {
-			setproctitle ("%s process (%s)", cf->worker->name,
-					cf->bind_conf->bind_line);
+#if defined(HAVE_SCHED_SETAFFINITY) && defined(HAVE_SC_NPROCESSORS_ONLN)
+	ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+
+	if (ncpus <= 0) {
+		return;
+	}
+
+	if (cf->cpus) {
+		navail = rspamd_worker_parse_cpus (cf->cpus, &avail, ncpus);
+
+		if (navail == 0) {
+			msg_warn_main ("no usable cpus in the list \"%s\"", cf->cpus);
+		}
+	}
+	else if (cf->numa_node >= 0) {
+		rspamd_snprintf (path, sizeof (path),
+				"/sys/devices/system/node/node%d/cpulist", cf->numa_node);
+
+		if (g_file_get_contents (path, &node_cpus, NULL, NULL)) {
+			navail = rspamd_worker_parse_cpus (node_cpus, &avail, ncpus);
+			g_free (node_cpus);
 		}
 		else {
-			setproctitle ("%s process", cf->worker->name);
+			msg_warn_main ("cannot get cpus of numa node %d", cf->numa_node);
 		}
+	}
 
-		if (rspamd_main->pfh) {
-			rspamd_pidfile_close (rspamd_main->pfh);
+	if (navail == 0) {
+		if (!cf->cpu_affinity) {
+			goto mempolicy;
 		}
 
-		/* Do silent log reopen to avoid collisions */
-		rspamd_log_close (rspamd_main->logger, FALSE);
+		CPU_ZERO (&avail);
+
+		for (i = 0; i < ncpus && i < CPU_SETSIZE; i ++) {
+			CPU_SET (i, &avail);
+		}
 
+		navail = i;
+	}
 
-		if (rspamd_main->cfg->log_silent_workers) {
-			rspamd_main->cfg->log_level = G_LOG_LEVEL_MESSAGE;
-			rspamd_set_logger (rspamd_main->cfg, cf->type,
-					&rspamd_main->logger, rspamd_main->server_pool);
+	if (cf->cpu_affinity) {
+		/* Select index % navail cpu of the available ones */
+		sel = wrk->index % navail;
+		CPU_ZERO (&set);
+
+		for (cpu = 0; cpu < CPU_SETSIZE; cpu ++) {
+			if (CPU_ISSET (cpu, &avail)) {
+				if (sel == 0) {
+					break;
+				}
+
+				sel --;
+			}
 		}
 
-		rspamd_log_open (rspamd_main->logger);
-		wrk->start_time = rspamd_get_calendar_ticks ();
+		CPU_SET (cpu, &set);
+	}
+	else {
+		memcpy (&set, &avail, sizeof (set));
+	}
 
-#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION <= 30))
-		# if (GLIB_MINOR_VERSION > 20)
-		/* Ugly hack for old glib */
-		if (!g_thread_get_initialized ()) {
-			g_thread_init (NULL);
+	if (sched_setaffinity (0, sizeof (set), &set) == -1) {
+		msg_warn_main ("cannot set cpu affinity: %s", strerror (errno));
+	}
+	else {
+		if (cf->cpu_affinity) {
+			msg_info_main ("pinned %s process to cpu %ud",
+					g_quark_to_string (wrk->type), cpu);
+
+			if (ws) {
+				rspamd_snprintf (ws->cpus, sizeof (ws->cpus), "%ud", cpu);
+			}
 		}
-# else
-		g_thread_init (NULL);
-# endif
+		else {
+			msg_info_main ("restricted %s process to %ud cpus",
+					g_quark_to_string (wrk->type), navail);
+
+			if (ws) {
+				rspamd_strlcpy (ws->cpus, cf->cpus ? cf->cpus : "", sizeof (ws->cpus));
+			}
+		}
+	}
+
+mempolicy:
+#else
+	if (cf->cpu_affinity || cf->cpus) {
+		msg_warn_main ("cpu affinity is not supported on this platform");
+	}
 #endif
-		if (cf->bind_conf) {
-			msg_info_main ("starting %s process %P (%d); listen on: %s",
-					cf->worker->name,
-					getpid (), index, cf->bind_conf->bind_line);
+
+	if (cf->numa_node >= 0) {
+#if defined(__linux__) && defined(SYS_set_mempolicy)
+		/* MPOL_PREFERRED: fall back to other nodes if the node is exhausted */
+		gulong nodemask[4];
+		const gint mpol_preferred = 1;
+
+		if (cf->numa_node >= (gint)(sizeof (nodemask) * CHAR_BIT)) {
+			msg_warn_main ("numa node %d is out of range", cf->numa_node);
+			return;
+		}
+
+		memset (nodemask, 0, sizeof (nodemask));
+		nodemask[cf->numa_node / (sizeof (gulong) * CHAR_BIT)] |=
+				1UL << (cf->numa_node % (sizeof (gulong) * CHAR_BIT));
+
+		if (syscall (SYS_set_mempolicy, mpol_preferred, nodemask,
+				(gulong)(sizeof (nodemask) * CHAR_BIT)) == -1) {
+			msg_warn_main ("cannot set memory policy to numa node %d: %s",
+					cf->numa_node, strerror (errno));
 		}
 		else {
-			msg_info_main ("starting %s process %P (%d)", cf->worker->name,
-					getpid (), index);
+			msg_info_main ("allocating memory of %s process on numa node %d",
+					g_quark_to_string (wrk->type), cf->numa_node);
+
+			if (ws) {
+				ws->numa_node = cf->numa_node;
+			}
 		}
-		/* Close parent part of socketpair */
-		close (wrk->control_pipe[0]);
-		close (wrk->srv_pipe[0]);
-		rspamd_socket_nonblocking (wrk->control_pipe[1]);
-		rspamd_socket_nonblocking (wrk->srv_pipe[1]);
-		/* Execute worker */
-		cf->worker->worker_start_func (wrk);
-		exit (EXIT_FAILURE);
-		break;
-	case -1:
-		msg_err_main ("cannot fork main process. %s", strerror (errno));
+#else
+		msg_warn_main ("numa memory policy is not supported on this platform");
+#endif
+	}
+}
 
-		if (rspamd_main->pfh) {
-			rspamd_pidfile_remove (rspamd_main->pfh);
+/*
+ * Finds a free slot in the shared workers stat, slots of dead workers are
+ * released by the main process
+ */
+static gint
+rspamd_worker_claim_stat_slot (struct rspamd_main *rspamd_main,
+		struct rspamd_worker_conf *cf, guint index)
+{
+	struct rspamd_worker_stat *ws;
+	guint i;
+
+	for (i = 0; i < RSPAMD_MAX_WORKERS_STAT; i ++) {
+		ws = &rspamd_main->stat->workers[i];
+
+		if (ws->pid == 0) {
+			ws->pid = -1;
+			ws->type = cf->type;
+			ws->index = index;
+			ws->connections_count = 0;
+			ws->numa_node = -1;
+			ws->cpus[0] = '\0';
+
+			return i;
 		}
+	}
 
-		rspamd_hard_terminate (rspamd_main);
+	return -1;
+}
+
+void
+rspamd_worker_release_stat_slot (struct rspamd_main *rspamd_main,
+		struct rspamd_worker *wrk)
+{
+	if (wrk->stat_slot >= 0) {
+		memset (&rspamd_main->stat->workers[wrk->stat_slot], 0,
+				sizeof (struct rspamd_worker_stat));
+		memset (&rspamd_main->stat->stages[wrk->stat_slot], 0,
+				sizeof (struct rspamd_worker_stages_stat));
+		wrk->stat_slot = -1;
+	}
+}
+
+void
+rspamd_worker_count_connection (struct rspamd_worker *wrk)
+{
+	if (wrk->stat_slot >= 0) {
+#ifndef HAVE_ATOMIC_BUILTINS
+		wrk->srv->stat->workers[wrk->stat_slot].connections_count ++;
+#else
+		__atomic_add_fetch (
+				&wrk->srv->stat->workers[wrk->stat_slot].connections_count,
+				1, __ATOMIC_RELEASE);
+#endif
+	}
+}
+
+struct rspamd_worker_stat *
+rspamd_worker_get_stat (struct rspamd_worker *wrk)
+{
+	if (wrk->stat_slot >= 0) {
+		return &wrk->srv->stat->workers[wrk->stat_slot];
+	}
+
+	return NULL;
+}
+
+void
+rspamd_worker_get_usage (struct rspamd_worker *wrk,
+		struct rspamd_worker_usage *usage)
+{
+	struct rusage rusg;
+	const struct rspamd_lua_gc_stat *gc_stat;
+
+	memset (usage, 0, sizeof (*usage));
+
+	if (getrusage (RUSAGE_SELF, &rusg) == -1) {
+		msg_err ("cannot get rusage stats: %s",
+				strerror (errno));
+	}
+	else {
+		usage->utime = tv_to_double (&rusg.ru_utime);
+		usage->systime = tv_to_double (&rusg.ru_stime);
+		usage->maxrss = rusg.ru_maxrss;
+	}
+
+	usage->conns = wrk->nconns;
+	usage->start_time = wrk->start_time;
+	gc_stat = rspamd_lua_gc_get_stat ();
+	usage->lua_gc_steps = gc_stat->steps;
+	usage->lua_gc_time = gc_stat->total_time;
+	usage->lua_gc_max_pause = gc_stat->max_pause;
+
+	if (wrk->srv->cfg && wrk->srv->cfg->lua_state) {
+		/* In kilobytes as maxrss */
+		usage->lua_mem = lua_gc (wrk->srv->cfg->lua_state, LUA_GCCOUNT, 0);
+	}
+}
+
+void
+rspamd_worker_publish_usage (struct rspamd_worker *wrk)
+{
+	struct rspamd_worker_stat *ws;
+	struct rspamd_worker_usage usage;
+
+	ws = rspamd_worker_get_stat (wrk);
+
+	if (ws == NULL) {
+		return;
+	}
+
+	rspamd_worker_get_usage (wrk, &usage);
+	/* There is a single writer, readers retry while the sequence is odd */
+#ifndef HAVE_ATOMIC_BUILTINS
+	ws->usage_seq ++;
+	memcpy (&ws->usage, &usage, sizeof (usage));
+	ws->usage_seq ++;
+#else
+	__atomic_store_n (&ws->usage_seq, ws->usage_seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+	memcpy (&ws->usage, &usage, sizeof (usage));
+	__atomic_store_n (&ws->usage_seq, ws->usage_seq + 1, __ATOMIC_RELEASE);
+#endif
+}
+
+gboolean
+rspamd_worker_stat_read_usage (const struct rspamd_worker_stat *ws,
+		struct rspamd_worker_usage *usage)
+{
+#ifndef HAVE_ATOMIC_BUILTINS
+	memcpy (usage, &ws->usage, sizeof (*usage));
+
+	return TRUE;
+#else
+	guint seq, i;
+
+	for (i = 0; i < RSPAMD_WORKER_USAGE_READ_ATTEMPTS; i ++) {
+		seq = __atomic_load_n (&ws->usage_seq, __ATOMIC_ACQUIRE);
+
+		if (seq & 1) {
+			continue;
+		}
+
+		memcpy (usage, &ws->usage, sizeof (*usage));
+		__atomic_thread_fence (__ATOMIC_ACQUIRE);
+
+		if (__atomic_load_n (&ws->usage_seq, __ATOMIC_RELAXED) == seq) {
+			return TRUE;
+		}
+	}
+
+	memset (usage, 0, sizeof (*usage));
+
+	return FALSE;
+#endif
+}
+
+static void
+rspamd_worker_usage_timer (gint fd, short what, gpointer ud)
+{
+	struct rspamd_worker *wrk = ud;
+
+	rspamd_worker_publish_usage (wrk);
+}
+
+struct rspamd_worker_stages_stat *
+rspamd_worker_get_stages_stat (struct rspamd_worker *wrk)
+{
+	if (wrk->stat_slot >= 0 && wrk->srv->stat->stages) {
+		return &wrk->srv->stat->stages[wrk->stat_slot];
+	}
+
+	return NULL;
+}
+
+/*
+ * Prefork templates: a template process is forked by the main process,
+ * warms up expensive state once and then forks workers of its type on
+ * request, so respawned workers start without repeating this work
+ */
+#define RSPAMD_TEMPLATE_REPLY_TIMEOUT 1000 /* milliseconds */
+
+enum rspamd_worker_template_cmd {
+	RSPAMD_TEMPLATE_SPAWN = 0,
+	RSPAMD_TEMPLATE_SPAWNED,
+	RSPAMD_TEMPLATE_CHILD_DEAD,
+	RSPAMD_TEMPLATE_HS_LOADED,
+};
+
+struct rspamd_worker_template_msg {
+	enum rspamd_worker_template_cmd type;
+	guint index;
+	gint stat_slot;
+	pid_t pid;
+	gint status;
+	gboolean forced;
+	gchar cache_dir[CONTROL_PATHLEN];
+};
+
+struct rspamd_worker_template {
+	struct rspamd_main *srv;
+	struct rspamd_worker_conf *cf;
+	pid_t pid;
+	gint fd;                    /* main's end of the template channel */
+	struct event ev;
+	rspamd_worker_template_dead_cb dead_cb;
+	GArray *pending_dead;       /* reports read while waiting for a spawn reply */
+};
+
+static volatile sig_atomic_t template_got_sigchld = 0;
+static volatile sig_atomic_t template_reopen_log = 0;
+static volatile sig_atomic_t template_terminating = 0;
+
+static gboolean
+rspamd_worker_template_send (gint fd, struct rspamd_worker_template_msg *msg,
+		gint *fds, guint nfds)
+{
+	struct msghdr mh;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	guchar fdspace[CMSG_SPACE (sizeof (int) * 2)];
+	gssize r;
+
+	g_assert (nfds <= 2);
+	memset (&mh, 0, sizeof (mh));
+
+	if (nfds > 0) {
+		memset (fdspace, 0, sizeof (fdspace));
+		mh.msg_control = fdspace;
+		mh.msg_controllen = CMSG_SPACE (sizeof (int) * nfds);
+		cmsg = CMSG_FIRSTHDR (&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN (sizeof (int) * nfds);
+		memcpy (CMSG_DATA (cmsg), fds, sizeof (int) * nfds);
+	}
+
+	iov.iov_base = msg;
+	iov.iov_len = sizeof (*msg);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+
+	while ((r = sendmsg (fd, &mh, 0)) == -1 && errno == EINTR);
+
+	return r == sizeof (*msg);
+}
+
+static gssize
+rspamd_worker_template_recv (gint fd, struct rspamd_worker_template_msg *msg,
+		gint *fds, guint nfds)
+{
+	struct msghdr mh;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	guchar fdspace[CMSG_SPACE (sizeof (int) * 2)];
+	gint recvd[2];
+	guint i, nrecvd;
+	gssize r;
+
+	for (i = 0; i < nfds; i ++) {
+		fds[i] = -1;
+	}
+
+	memset (&mh, 0, sizeof (mh));
+	mh.msg_control = fdspace;
+	mh.msg_controllen = sizeof (fdspace);
+	iov.iov_base = msg;
+	iov.iov_len = sizeof (*msg);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+
+	while ((r = recvmsg (fd, &mh, 0)) == -1 && errno == EINTR);
+
+	if (r <= 0) {
+		return r;
+	}
+
+	for (cmsg = CMSG_FIRSTHDR (&mh); cmsg != NULL;
+			cmsg = CMSG_NXTHDR (&mh, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+			continue;
+		}
+
+		nrecvd = MIN ((cmsg->cmsg_len - CMSG_LEN (0)) / sizeof (int),
+				G_N_ELEMENTS (recvd));
+		memcpy (recvd, CMSG_DATA (cmsg), sizeof (int) * nrecvd);
+
+		for (i = 0; i < nrecvd; i ++) {
+			if (i < nfds) {
+				fds[i] = recvd[i];
+			}
+			else {
+				/* Unexpected descriptor */
+				close (recvd[i]);
+			}
+		}
+	}
+
+	return r;
+}
+
+static void
+rspamd_worker_template_sig_handler (int signo)
+{
+	switch (signo) {
+	case SIGCHLD:
+		template_got_sigchld = 1;
+		break;
+	case SIGUSR1:
+		template_reopen_log = 1;
 		break;
 	default:
+		template_terminating = 1;
+		break;
+	}
+}
+
+static void
+rspamd_worker_template_warmup (struct rspamd_config *cfg)
+{
+#ifdef WITH_HYPERSCAN
+	if (!cfg->disable_hyperscan && cfg->hs_cache_dir &&
+			!rspamd_re_cache_is_hs_loaded (cfg->re_cache)) {
+		if (rspamd_re_cache_load_hyperscan (cfg->re_cache, cfg->hs_cache_dir)) {
+			msg_info_config ("loaded hyperscan expressions in template process");
+		}
+	}
+#endif
+
+	/* Let children inherit a collected heap instead of collecting it each */
+	lua_gc (cfg->lua_state, LUA_GCCOLLECT, 0);
+}
+
+/*
+ * Called in the template process, returns pid of a new worker or -1
+ */
+static pid_t
+rspamd_worker_template_fork (struct rspamd_main *rspamd_main,
+		struct rspamd_worker_conf *cf, gint tpl_fd,
+		struct rspamd_worker_template_msg *msg, gint *fds)
+{
+	struct rspamd_worker *wrk;
+	pid_t pid;
+	gint rc;
+
+	pid = fork ();
+
+	if (pid != 0) {
+		if (pid == -1) {
+			msg_err_main ("cannot fork %s worker from template: %s",
+					cf->worker->name, strerror (errno));
+		}
+
+		return pid;
+	}
+
+	close (tpl_fd);
+	signal (SIGCHLD, SIG_DFL);
+	signal (SIGTERM, SIG_DFL);
+	signal (SIGINT, SIG_DFL);
+	signal (SIGHUP, SIG_DFL);
+	signal (SIGUSR1, SIG_DFL);
+	signal (SIGUSR2, SIG_DFL);
+
+	rspamd_log_update_pid (cf->type, rspamd_main->logger);
+
+	wrk = g_malloc0 (sizeof (*wrk));
+	wrk->srv = rspamd_main;
+	wrk->type = cf->type;
+	wrk->cf = cf;
+	wrk->flags = cf->worker->flags;
+	REF_RETAIN (cf);
+	wrk->index = msg->index;
+	wrk->ctx = cf->ctx;
+	wrk->finish_actions = g_ptr_array_new ();
+	wrk->pid = getpid ();
+	wrk->ppid = getppid ();
+	wrk->stat_slot = msg->stat_slot;
+	wrk->control_pipe[0] = -1;
+	wrk->control_pipe[1] = fds[0];
+	wrk->srv_pipe[0] = -1;
+	wrk->srv_pipe[1] = fds[1];
+	wrk->cores_throttled = rspamd_main->cores_throttling;
+
+	/* Per process state must not be shared with siblings */
+	rc = ottery_init (rspamd_main->cfg->libs_ctx->ottery_cfg);
+	if (rc != OTTERY_ERR_NONE) {
+		msg_err_main ("cannot initialize PRNG: %d", rc);
+		abort ();
+	}
+
+	rspamd_random_seed_fast ();
+	rspamd_mempool_profile_reset ();
+
+	if (rspamd_main->cfg->enable_mempool_profile) {
+		rspamd_mempool_profile_enable (TRUE);
+	}
+
+	rspamd_mempool_huge_pages_enable (rspamd_main->cfg->mempool_huge_pages);
+#ifdef HAVE_EVUTIL_RNG_INIT
+	evutil_secure_rng_init ();
+#endif
+
+	if (cf->cpu_affinity || cf->cpus || cf->numa_node >= 0) {
+		rspamd_worker_set_affinity (rspamd_main, wrk);
+	}
+
+	if (cf->bind_conf) {
+		setproctitle ("%s process (%s)", cf->worker->name,
+				cf->bind_conf->bind_line);
+	}
+	else {
+		setproctitle ("%s process", cf->worker->name);
+	}
+
+	rspamd_log_close (rspamd_main->logger, FALSE);
+
+	if (rspamd_main->cfg->log_silent_workers) {
+		rspamd_main->cfg->log_level = G_LOG_LEVEL_MESSAGE;
+		rspamd_set_logger (rspamd_main->cfg, cf->type,
+				&rspamd_main->logger, rspamd_main->server_pool);
+	}
+
+	rspamd_log_open (rspamd_main->logger);
+	wrk->start_time = rspamd_get_calendar_ticks ();
+	msg_info_main ("starting %s process %P (%d) from template",
+			cf->worker->name, wrk->pid, wrk->index);
+
+	rspamd_socket_nonblocking (wrk->control_pipe[1]);
+	rspamd_socket_nonblocking (wrk->srv_pipe[1]);
+	cf->worker->worker_start_func (wrk);
+	exit (EXIT_FAILURE);
+
+	return -1;
+}
+
+static void
+rspamd_worker_template_loop (struct rspamd_main *rspamd_main,
+		struct rspamd_worker_conf *cf, gint fd)
+{
+	struct rspamd_worker_template_msg msg, rep;
+	struct sigaction sa;
+	struct pollfd pfd;
+	guint nchildren = 0;
+	gint fds[2], status;
+	pid_t pid;
+	gssize r;
+
+	memset (&sa, 0, sizeof (sa));
+	sigemptyset (&sa.sa_mask);
+	/* No SA_RESTART: poll must be interrupted to reap children */
+	sa.sa_handler = rspamd_worker_template_sig_handler;
+	sigaction (SIGCHLD, &sa, NULL);
+	sigaction (SIGTERM, &sa, NULL);
+	sigaction (SIGINT, &sa, NULL);
+	sigaction (SIGUSR1, &sa, NULL);
+	sigaction (SIGUSR2, &sa, NULL);
+	signal (SIGHUP, SIG_IGN);
+	rspamd_worker_unblock_signals ();
+
+	for (;;) {
+		if (template_got_sigchld) {
+			template_got_sigchld = 0;
+
+			while ((pid = waitpid (-1, &status, WNOHANG)) > 0) {
+				if (nchildren > 0) {
+					nchildren --;
+				}
+
+				memset (&rep, 0, sizeof (rep));
+				rep.type = RSPAMD_TEMPLATE_CHILD_DEAD;
+				rep.pid = pid;
+				rep.status = status;
+
+				if (!rspamd_worker_template_send (fd, &rep, NULL, 0)) {
+					msg_err_main ("cannot report termination of %P: %s",
+							pid, strerror (errno));
+				}
+			}
+		}
+
+		if (template_reopen_log) {
+			template_reopen_log = 0;
+			rspamd_log_reopen (rspamd_main->logger);
+		}
+
+		if (template_terminating && nchildren == 0) {
+			/* Children are reported before the template exits */
+			break;
+		}
+
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+
+		/* Timeout covers SIGCHLD delivered right before poll */
+		if (poll (&pfd, 1, 1000) <= 0) {
+			continue;
+		}
+
+		r = rspamd_worker_template_recv (fd, &msg, fds, G_N_ELEMENTS (fds));
+
+		if (r == 0 || (r == -1 && errno != EAGAIN)) {
+			msg_info_main ("main process has gone, terminating template");
+			break;
+		}
+
+		if (r != sizeof (msg)) {
+			continue;
+		}
+
+		switch (msg.type) {
+		case RSPAMD_TEMPLATE_SPAWN:
+			memset (&rep, 0, sizeof (rep));
+			rep.type = RSPAMD_TEMPLATE_SPAWNED;
+			rep.index = msg.index;
+			rep.pid = -1;
+
+			if (!template_terminating && fds[0] != -1 && fds[1] != -1) {
+				rep.pid = rspamd_worker_template_fork (rspamd_main, cf, fd,
+						&msg, fds);
+
+				if (rep.pid > 0) {
+					nchildren ++;
+				}
+			}
+
+			if (!rspamd_worker_template_send (fd, &rep, NULL, 0)) {
+				msg_err_main ("cannot send spawn reply: %s", strerror (errno));
+			}
+			break;
+		case RSPAMD_TEMPLATE_HS_LOADED:
+#ifdef WITH_HYPERSCAN
+			if (!rspamd_re_cache_is_hs_loaded (rspamd_main->cfg->re_cache) ||
+					msg.forced) {
+				msg_info_main ("loading hyperscan expressions in template "
+						"after receiving compilation notice");
+				rspamd_re_cache_load_hyperscan (rspamd_main->cfg->re_cache,
+						msg.cache_dir);
+			}
+#endif
+			break;
+		default:
+			break;
+		}
+
+		if (fds[0] != -1) {
+			close (fds[0]);
+		}
+		if (fds[1] != -1) {
+			close (fds[1]);
+		}
+	}
+}
+
+static void
+rspamd_worker_template_io (gint fd, short what, gpointer ud)
+{
+	struct rspamd_worker_template *tpl = ud;
+	struct rspamd_main *rspamd_main = tpl->srv;
+	struct rspamd_worker_template_msg msg;
+	gssize r;
+
+	while ((r = rspamd_worker_template_recv (fd, &msg, NULL, 0)) ==
+			sizeof (msg)) {
+		if (msg.type == RSPAMD_TEMPLATE_CHILD_DEAD) {
+			tpl->dead_cb (rspamd_main, msg.pid, msg.status);
+		}
+		else if (msg.type == RSPAMD_TEMPLATE_SPAWNED && msg.pid > 0) {
+			/* Late reply after a timed out spawn, the worker is not tracked */
+			msg_warn_main ("terminate untracked %s process %P",
+					tpl->cf->worker->name, msg.pid);
+			kill (msg.pid, SIGTERM);
+		}
+	}
+
+	if (r == 0) {
+		/* Template has gone, it is reaped by the SIGCHLD handler */
+		event_del (&tpl->ev);
+	}
+}
+
+struct rspamd_worker *
+rspamd_worker_template_start (struct rspamd_main *rspamd_main,
+		struct rspamd_worker_conf *cf,
+		struct event_base *ev_base,
+		rspamd_worker_template_dead_cb dead_cb)
+{
+	struct rspamd_worker_template *tpl;
+	struct rspamd_worker *wrk;
+	struct rlimit rlim;
+	gint pair[2];
+
+	if (!rspamd_socketpair (pair, 0)) {
+		msg_err_main ("cannot create template socketpair: %s", strerror (errno));
+
+		return NULL;
+	}
+
+	wrk = (struct rspamd_worker *) g_malloc0 (sizeof (struct rspamd_worker));
+	wrk->srv = rspamd_main;
+	wrk->type = cf->type;
+	wrk->cf = cf;
+	wrk->flags = cf->worker->flags | RSPAMD_WORKER_TEMPLATE;
+	REF_RETAIN (cf);
+	wrk->ctx = cf->ctx;
+	wrk->finish_actions = g_ptr_array_new ();
+	wrk->ppid = getpid ();
+	wrk->stat_slot = -1;
+	wrk->control_pipe[0] = -1;
+	wrk->control_pipe[1] = -1;
+	wrk->srv_pipe[0] = -1;
+	wrk->srv_pipe[1] = -1;
+	wrk->pid = fork ();
+
+	switch (wrk->pid) {
+	case 0:
+		rspamd_log_update_pid (cf->type, rspamd_main->logger);
+		wrk->pid = getpid ();
+
+		/* Remove the inherited event base */
+		event_reinit (rspamd_main->ev_base);
+		event_base_free (rspamd_main->ev_base);
+		rspamd_main->ev_base = NULL;
+
+		/* Workers inherit privileges and limits of the template */
+		rspamd_worker_drop_priv (rspamd_main);
+		rspamd_worker_set_limits (rspamd_main, cf);
+		getrlimit (RLIMIT_STACK, &rlim);
+		rlim.rlim_cur = 100 * 1024 * 1024;
+		rlim.rlim_max = rlim.rlim_cur;
+		setrlimit (RLIMIT_STACK, &rlim);
+
+		setproctitle ("%s template process", cf->worker->name);
+
+		if (rspamd_main->pfh) {
+			rspamd_pidfile_close (rspamd_main->pfh);
+		}
+
+		rspamd_log_close (rspamd_main->logger, FALSE);
+		rspamd_log_open (rspamd_main->logger);
+		close (pair[0]);
+
+		msg_info_main ("starting %s template process %P", cf->worker->name,
+				wrk->pid);
+		rspamd_worker_template_warmup (rspamd_main->cfg);
+		rspamd_worker_template_loop (rspamd_main, cf, pair[1]);
+
+		rspamd_log_close (rspamd_main->logger, TRUE);
+		exit (EXIT_SUCCESS);
+		break;
+	case -1:
+		msg_err_main ("cannot fork %s template process: %s", cf->worker->name,
+				strerror (errno));
+		close (pair[0]);
+		close (pair[1]);
+		REF_RELEASE (cf);
+		g_ptr_array_free (wrk->finish_actions, TRUE);
+		g_free (wrk);
+
+		return NULL;
+	default:
+		close (pair[1]);
+		rspamd_socket_nonblocking (pair[0]);
+
+		tpl = g_malloc0 (sizeof (*tpl));
+		tpl->srv = rspamd_main;
+		tpl->cf = cf;
+		tpl->pid = wrk->pid;
+		tpl->fd = pair[0];
+		tpl->dead_cb = dead_cb;
+		tpl->pending_dead = g_array_new (FALSE, FALSE,
+				sizeof (struct rspamd_worker_template_msg));
+		event_set (&tpl->ev, tpl->fd, EV_READ | EV_PERSIST,
+				rspamd_worker_template_io, tpl);
+		event_base_set (ev_base, &tpl->ev);
+		event_add (&tpl->ev, NULL);
+		cf->tpl = tpl;
+
+		g_hash_table_insert (rspamd_main->workers, GSIZE_TO_POINTER (
+				wrk->pid), wrk);
+		break;
+	}
+
+	return wrk;
+}
+
+void
+rspamd_worker_template_terminated (struct rspamd_main *rspamd_main,
+		struct rspamd_worker *wrk)
+{
+	struct rspamd_worker_template *tpl = wrk->cf->tpl;
+
+	if (tpl == NULL || tpl->pid != wrk->pid) {
+		return;
+	}
+
+	event_del (&tpl->ev);
+	/* Process the last reports sent by the template */
+	rspamd_worker_template_io (tpl->fd, EV_READ, tpl);
+	close (tpl->fd);
+	g_array_free (tpl->pending_dead, TRUE);
+	wrk->cf->tpl = NULL;
+	g_free (tpl);
+}
+
+void
+rspamd_worker_template_hs_loaded (struct rspamd_main *rspamd_main,
+		const gchar *cache_dir, gboolean forced)
+{
+	struct rspamd_worker_template_msg msg;
+	struct rspamd_worker *w;
+	GHashTableIter it;
+	gpointer k, v;
+
+	memset (&msg, 0, sizeof (msg));
+	msg.type = RSPAMD_TEMPLATE_HS_LOADED;
+	msg.forced = forced;
+	rspamd_strlcpy (msg.cache_dir, cache_dir, sizeof (msg.cache_dir));
+	g_hash_table_iter_init (&it, rspamd_main->workers);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		w = v;
+
+		if ((w->flags & RSPAMD_WORKER_TEMPLATE) && w->cf->tpl &&
+				w->cf->tpl->pid == w->pid) {
+			if (!rspamd_worker_template_send (w->cf->tpl->fd, &msg, NULL, 0)) {
+				msg_err_main ("cannot send hyperscan notice to template %P: %s",
+						w->pid, strerror (errno));
+			}
+		}
+	}
+}
+
+/*
+ * Asks a template to fork a worker, returns NULL if the worker should be
+ * forked directly
+ */
+static struct rspamd_worker *
+rspamd_worker_template_spawn (struct rspamd_main *rspamd_main,
+		struct rspamd_worker_conf *cf,
+		guint index,
+		struct event_base *ev_base)
+{
+	struct rspamd_worker_template *tpl = cf->tpl;
+	struct rspamd_worker_template_msg msg;
+	struct rspamd_worker *wrk;
+	gint fds[2];
+	gssize r;
+	guint i;
+
+	wrk = (struct rspamd_worker *) g_malloc0 (sizeof (struct rspamd_worker));
+
+	if (!rspamd_socketpair (wrk->control_pipe, 0)) {
+		g_free (wrk);
+
+		return NULL;
+	}
+
+	if (!rspamd_socketpair (wrk->srv_pipe, 0)) {
+		close (wrk->control_pipe[0]);
+		close (wrk->control_pipe[1]);
+		g_free (wrk);
+
+		return NULL;
+	}
+
+	wrk->srv = rspamd_main;
+	wrk->type = cf->type;
+	wrk->cf = cf;
+	wrk->flags = cf->worker->flags;
+	REF_RETAIN (cf);
+	wrk->index = index;
+	wrk->ctx = cf->ctx;
+	wrk->finish_actions = g_ptr_array_new ();
+	/* Workers are children of the template, so main cannot wait for them */
+	wrk->ppid = tpl->pid;
+	wrk->stat_slot = rspamd_worker_claim_stat_slot (rspamd_main, cf, index);
+	wrk->cores_throttled = rspamd_main->cores_throttling;
+
+	memset (&msg, 0, sizeof (msg));
+	msg.type = RSPAMD_TEMPLATE_SPAWN;
+	msg.index = index;
+	msg.stat_slot = wrk->stat_slot;
+	fds[0] = wrk->control_pipe[1];
+	fds[1] = wrk->srv_pipe[1];
+
+	if (rspamd_worker_template_send (tpl->fd, &msg, fds, G_N_ELEMENTS (fds))) {
+		while (rspamd_socket_poll (tpl->fd, RSPAMD_TEMPLATE_REPLY_TIMEOUT,
+				POLLIN) > 0) {
+			r = rspamd_worker_template_recv (tpl->fd, &msg, NULL, 0);
+
+			if (r != sizeof (msg)) {
+				if (r == -1 && errno == EAGAIN) {
+					continue;
+				}
+
+				break;
+			}
+
+			if (msg.type == RSPAMD_TEMPLATE_CHILD_DEAD) {
+				g_array_append_val (tpl->pending_dead, msg);
+			}
+			else if (msg.type == RSPAMD_TEMPLATE_SPAWNED) {
+				wrk->pid = msg.pid;
+				break;
+			}
+		}
+	}
+
+	close (wrk->control_pipe[1]);
+	close (wrk->srv_pipe[1]);
+
+	if (wrk->pid <= 0) {
+		msg_warn_main ("%s template process %P has not spawned a worker, "
+				"fork it directly", cf->worker->name, tpl->pid);
+		close (wrk->control_pipe[0]);
+		close (wrk->srv_pipe[0]);
+		rspamd_worker_release_stat_slot (rspamd_main, wrk);
+		REF_RELEASE (cf);
+		g_ptr_array_free (wrk->finish_actions, TRUE);
+		g_free (wrk);
+		wrk = NULL;
+	}
+	else {
+		if (wrk->stat_slot >= 0) {
+			rspamd_main->stat->workers[wrk->stat_slot].pid = wrk->pid;
+		}
+
+		rspamd_socket_nonblocking (wrk->control_pipe[0]);
+		rspamd_socket_nonblocking (wrk->srv_pipe[0]);
+		rspamd_srv_start_watching (rspamd_main, wrk, ev_base);
+		g_hash_table_insert (rspamd_main->workers, GSIZE_TO_POINTER (
+				wrk->pid), wrk);
+	}
+
+	/* Terminations reported while we were waiting for the reply */
+	for (i = 0; i < tpl->pending_dead->len; i ++) {
+		msg = g_array_index (tpl->pending_dead, struct rspamd_worker_template_msg,
+				i);
+		tpl->dead_cb (rspamd_main, msg.pid, msg.status);
+	}
+
+	g_array_set_size (tpl->pending_dead, 0);
+
+	return wrk;
+}
+
+struct rspamd_worker *
+rspamd_fork_worker (struct rspamd_main *rspamd_main,
+		struct rspamd_worker_conf *cf,
+		guint index,
+		struct event_base *ev_base)
+{
+	struct rspamd_worker *wrk;
+	gint rc;
+	struct rlimit rlim;
+
+	if (cf->tpl != NULL &&
+			(wrk = rspamd_worker_template_spawn (rspamd_main, cf, index,
+					ev_base)) != NULL) {
+		return wrk;
+	}
+
+	/* Starting worker process */
+	wrk = (struct rspamd_worker *) g_malloc0 (sizeof (struct rspamd_worker));
+
+	if (!rspamd_socketpair (wrk->control_pipe, 0)) {
+		msg_err ("socketpair failure: %s", strerror (errno));
+		rspamd_hard_terminate (rspamd_main);
+	}
+
+	if (!rspamd_socketpair (wrk->srv_pipe, 0)) {
+		msg_err ("socketpair failure: %s", strerror (errno));
+		rspamd_hard_terminate (rspamd_main);
+	}
+
+	wrk->srv = rspamd_main;
+	wrk->type = cf->type;
+	wrk->cf = cf;
+	wrk->flags = cf->worker->flags;
+	REF_RETAIN (cf);
+	wrk->index = index;
+	wrk->ctx = cf->ctx;
+	wrk->finish_actions = g_ptr_array_new ();
+	wrk->ppid = getpid ();
+	wrk->stat_slot = rspamd_worker_claim_stat_slot (rspamd_main, cf, index);
+	wrk->log_ring = rspamd_log_ring_new (rspamd_main->logger);
+	wrk->pid = fork ();
+	wrk->cores_throttled = rspamd_main->cores_throttling;
+
+	switch (wrk->pid) {
+	case 0:
+		/* Update pid for logging */
+		rspamd_log_update_pid (cf->type, rspamd_main->logger);
+		wrk->pid = getpid ();
+
+		/* Init PRNG after fork */
+		rc = ottery_init (rspamd_main->cfg->libs_ctx->ottery_cfg);
+		if (rc != OTTERY_ERR_NONE) {
+			msg_err_main ("cannot initialize PRNG: %d", rc);
+			abort ();
+		}
+
+		rspamd_random_seed_fast ();
+
+		/* Do not attribute allocations of the main process to the worker */
+		rspamd_mempool_profile_reset ();
+
+		if (rspamd_main->cfg->enable_mempool_profile) {
+			rspamd_mempool_profile_enable (TRUE);
+		}
+
+		rspamd_mempool_huge_pages_enable (rspamd_main->cfg->mempool_huge_pages);
+#ifdef HAVE_EVUTIL_RNG_INIT
+		evutil_secure_rng_init ();
+#endif
+
+		/* Remove the inherited event base */
+		event_reinit (rspamd_main->ev_base);
+		event_base_free (rspamd_main->ev_base);
+
+		/* Own sockets are created before dropping privileges */
+		if (cf->reuseport) {
+			rspamd_worker_create_reuseport_socks (rspamd_main, wrk);
+		}
+
+		if (cf->cpu_affinity || cf->cpus || cf->numa_node >= 0) {
+			rspamd_worker_set_affinity (rspamd_main, wrk);
+		}
+
+		/* Drop privileges */
+		rspamd_worker_drop_priv (rspamd_main);
+		/* Set limits */
+		rspamd_worker_set_limits (rspamd_main, cf);
+		/* Re-set stack limit */
+		getrlimit (RLIMIT_STACK, &rlim);
+		rlim.rlim_cur = 100 * 1024 * 1024;
+		rlim.rlim_max = rlim.rlim_cur;
+		setrlimit (RLIMIT_STACK, &rlim);
+
+		if (cf->bind_conf) {
+			setproctitle ("%s process (%s)", cf->worker->name,
+					cf->bind_conf->bind_line);
+		}
+		else {
+			setproctitle ("%s process", cf->worker->name);
+		}
+
+		if (rspamd_main->pfh) {
+			rspamd_pidfile_close (rspamd_main->pfh);
+		}
+
+		/* Do silent log reopen to avoid collisions */
+		rspamd_log_close (rspamd_main->logger, FALSE);
+
+
+		if (rspamd_main->cfg->log_silent_workers) {
+			rspamd_main->cfg->log_level = G_LOG_LEVEL_MESSAGE;
+			rspamd_set_logger (rspamd_main->cfg, cf->type,
+					&rspamd_main->logger, rspamd_main->server_pool);
+		}
+
+		rspamd_log_open (rspamd_main->logger);
+		rspamd_log_ring_attach (rspamd_main->logger, wrk->log_ring);
+		wrk->start_time = rspamd_get_calendar_ticks ();
+
+#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION <= 30))
+		# if (GLIB_MINOR_VERSION > 20)
+		/* Ugly hack for old glib */
+		if (!g_thread_get_initialized ()) {
+			g_thread_init (NULL);
+		}
+# else
+		g_thread_init (NULL);
+# endif
+#endif
+		if (cf->bind_conf) {
+			msg_info_main ("starting %s process %P (%d); listen on: %s",
+					cf->worker->name,
+					getpid (), index, cf->bind_conf->bind_line);
+		}
+		else {
+			msg_info_main ("starting %s process %P (%d)", cf->worker->name,
+					getpid (), index);
+		}
+		/* Close parent part of socketpair */
+		close (wrk->control_pipe[0]);
+		close (wrk->srv_pipe[0]);
+		rspamd_socket_nonblocking (wrk->control_pipe[1]);
+		rspamd_socket_nonblocking (wrk->srv_pipe[1]);
+		/* Execute worker */
+		cf->worker->worker_start_func (wrk);
+		exit (EXIT_FAILURE);
+		break;
+	case -1:
+		msg_err_main ("cannot fork main process. %s", strerror (errno));
+
+		if (rspamd_main->pfh) {
+			rspamd_pidfile_remove (rspamd_main->pfh);
+		}
+
+		rspamd_hard_terminate (rspamd_main);
+		break;
+	default:
+		if (wrk->stat_slot >= 0) {
+			rspamd_main->stat->workers[wrk->stat_slot].pid = wrk->pid;
+		}
+
 		/* Close worker part of socketpair */
 		close (wrk->control_pipe[1]);
 		close (wrk->srv_pipe[1]);
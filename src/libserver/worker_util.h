@@ -79,11 +79,16 @@ struct rspamd_custom_controller_command {
 struct rspamd_controller_worker_ctx;
 struct rspamd_lang_detector;
 
+struct rspamd_controller_bulk_learn;
+struct rspamd_controller_forward;
+
 struct rspamd_controller_session {
 	struct rspamd_controller_worker_ctx *ctx;
 	struct rspamd_worker *wrk;
 	rspamd_mempool_t *pool;
 	struct rspamd_task *task;
+	struct rspamd_controller_bulk_learn *bulk;
+	struct rspamd_controller_forward *forward;
 	gchar *classifier;
 	rspamd_inet_addr_t *from_addr;
 	struct rspamd_config *cfg;
@@ -117,6 +122,24 @@ void rspamd_controller_send_string (struct rspamd_http_connection_entry *entry,
 void rspamd_controller_send_ucl (struct rspamd_http_connection_entry *entry,
 	ucl_object_t *obj);
 
+/**
+ * Send JSON reply built incrementally in a rope, rope is owned by the message
+ * afterwards
+ * @param entry router entry
+ * @param rope JSON data
+ */
+void rspamd_controller_send_rope (struct rspamd_http_connection_entry *entry,
+	rspamd_fstring_rope_t *rope);
+
+/**
+ * Send a plain text reply using HTTP, reply is owned by the message afterwards
+ * @param entry router entry
+ * @param reply text to send
+ * @param content_type content type of the reply
+ */
+void rspamd_controller_send_text (struct rspamd_http_connection_entry *entry,
+	rspamd_fstring_t *reply, const gchar *content_type);
+
 /**
  * Return worker's control structure by its type
  * @param type
@@ -187,6 +210,78 @@ void rspamd_worker_session_cache_remove (void *cache, void *ptr);
 struct rspamd_worker *rspamd_fork_worker (struct rspamd_main *,
 		struct rspamd_worker_conf *, guint idx, struct event_base *ev_base);
 
+/**
+ * Called by the main process when a worker forked by a template terminates
+ */
+typedef void (*rspamd_worker_template_dead_cb) (struct rspamd_main *rspamd_main,
+		pid_t pid, gint status);
+
+/**
+ * Fork a prefork template process for the specified configuration, workers
+ * forked by `rspamd_fork_worker` are spawned by the template while it is alive
+ * @return template entry inserted into the workers table or NULL
+ */
+struct rspamd_worker *rspamd_worker_template_start (struct rspamd_main *,
+		struct rspamd_worker_conf *cf, struct event_base *ev_base,
+		rspamd_worker_template_dead_cb dead_cb);
+
+/**
+ * Detach a terminated template process from its configuration
+ */
+void rspamd_worker_template_terminated (struct rspamd_main *rspamd_main,
+		struct rspamd_worker *wrk);
+
+/**
+ * Notify all templates about new hyperscan databases
+ */
+void rspamd_worker_template_hs_loaded (struct rspamd_main *rspamd_main,
+		const gchar *cache_dir, gboolean forced);
+
+/**
+ * Release per worker stat slot of a terminated worker (main process only)
+ */
+void rspamd_worker_release_stat_slot (struct rspamd_main *rspamd_main,
+		struct rspamd_worker *wrk);
+
+/**
+ * Increase connections counter of the specified worker
+ */
+void rspamd_worker_count_connection (struct rspamd_worker *wrk);
+
+/**
+ * Returns shared statistics slot of the specified worker
+ * @return slot or NULL if worker has no slot
+ */
+struct rspamd_worker_stat *rspamd_worker_get_stat (struct rspamd_worker *wrk);
+
+/**
+ * Collects resources usage of the current process
+ */
+void rspamd_worker_get_usage (struct rspamd_worker *wrk,
+		struct rspamd_worker_usage *usage);
+
+/**
+ * Writes resources usage of the current process to its shared stat slot, it
+ * is done periodically by all workers that use `rspamd_prepare_worker`
+ */
+void rspamd_worker_publish_usage (struct rspamd_worker *wrk);
+
+/**
+ * Reads a consistent snapshot of resources usage published by a worker
+ * @param ws shared stat slot of the worker
+ * @param usage output
+ * @return FALSE if a snapshot cannot be read (e.g. the writer has died)
+ */
+gboolean rspamd_worker_stat_read_usage (const struct rspamd_worker_stat *ws,
+		struct rspamd_worker_usage *usage);
+
+/**
+ * Returns shared stages histograms of the specified worker
+ * @return histograms or NULL if worker has no slot
+ */
+struct rspamd_worker_stages_stat *rspamd_worker_get_stages_stat (
+		struct rspamd_worker *wrk);
+
 /**
  * Sets crash signals handlers if compiled with libunwind
  */
@@ -28,6 +28,7 @@ struct rspamd_config;
 struct rspamd_stat_ctx;
 struct rspamd_token_result;
 struct rspamd_statfile;
+struct rspamd_stat_tokens;
 struct rspamd_task;
 
 struct rspamd_stat_backend {
@@ -36,12 +37,14 @@ struct rspamd_stat_backend {
 			struct rspamd_statfile *st);
 	gpointer (*runtime)(struct rspamd_task *task,
 			struct rspamd_statfile_config *stcf, gboolean learn, gpointer ctx);
-	gboolean (*process_tokens)(struct rspamd_task *task, GPtrArray *tokens,
+	gboolean (*process_tokens)(struct rspamd_task *task,
+			struct rspamd_stat_tokens *tokens,
 			gint id,
 			gpointer ctx);
 	gboolean (*finalize_process)(struct rspamd_task *task,
 			gpointer runtime, gpointer ctx);
-	gboolean (*learn_tokens)(struct rspamd_task *task, GPtrArray *tokens,
+	gboolean (*learn_tokens)(struct rspamd_task *task,
+			struct rspamd_stat_tokens *tokens,
 			gint id,
 			gpointer ctx);
 	gulong (*total_learns)(struct rspamd_task *task,
@@ -66,13 +69,13 @@ struct rspamd_stat_backend {
 				struct rspamd_statfile_config *stcf, \
 				gboolean learn, gpointer ctx); \
 		gboolean rspamd_##name##_process_tokens (struct rspamd_task *task, \
-                GPtrArray *tokens, gint id, \
+				struct rspamd_stat_tokens *tokens, gint id, \
 				gpointer ctx); \
 		gboolean rspamd_##name##_finalize_process (struct rspamd_task *task, \
 				gpointer runtime, \
 				gpointer ctx); \
 		gboolean rspamd_##name##_learn_tokens (struct rspamd_task *task, \
-                GPtrArray *tokens, gint id, \
+				struct rspamd_stat_tokens *tokens, gint id, \
 				gpointer ctx); \
 		gboolean rspamd_##name##_finalize_learn (struct rspamd_task *task, \
 				gpointer runtime, \
@@ -99,6 +102,54 @@ RSPAMD_STAT_BACKEND_DEF(mmaped_file);
 RSPAMD_STAT_BACKEND_DEF(sqlite3);
 #ifdef WITH_HIREDIS
 RSPAMD_STAT_BACKEND_DEF(redis);
+
+struct event_base;
+/**
+ * Starts periodic native expiry of tokens stored in redis using the new schema.
+ * Expiry is started for spam statfiles only as both classes share the same keys
+ * @param ctx backend context
+ * @param cfg config (`bayes_expiry` section is used for options)
+ * @param ev_base event base
+ * @return TRUE if expiry has been started
+ */
+gboolean rspamd_redis_start_expiry (gpointer ctx, struct rspamd_config *cfg,
+		struct event_base *ev_base);
 #endif
 
+struct memory_pool_s;
+/**
+ * Converts mmaped statfile to the cuckoo hashed format (version 2), the old
+ * file is kept with `.old` suffix
+ * @param pool pool for logging
+ * @param filename statfile to convert
+ * @param err error pointer
+ * @return TRUE if file has been converted or it has been already in version 2
+ */
+gboolean rspamd_mmaped_file_convert (struct memory_pool_s *pool,
+		const gchar *filename, GError **err);
+
+struct rspamd_mmaped_file_compact_stat {
+	guint64 blocks_before;
+	guint64 blocks_after;
+	guint64 merged;
+	guint64 dropped;
+	gsize bytes_before;
+	gsize bytes_after;
+};
+
+/**
+ * Compacts mmaped statfile: merges duplicate tokens and drops tokens with
+ * value less than `min_value`. Version 2 files are rewritten to a smaller
+ * file and replaced atomically, version 1 files are rebuilt in place
+ * @param pool pool for logging
+ * @param filename statfile to compact
+ * @param min_value minimum value of a token to keep
+ * @param st statistics of compaction
+ * @param err error pointer
+ * @return TRUE if file has been compacted
+ */
+gboolean rspamd_mmaped_file_compact (struct memory_pool_s *pool,
+		const gchar *filename, double min_value,
+		struct rspamd_mmaped_file_compact_stat *st, GError **err);
+
 #endif /* BACKENDS_H_ */
@@ -16,11 +16,21 @@
 #include "config.h"
 #include "stat_internal.h"
 #include "unix-std.h"
+#include "ottery.h"
+#include "khash.h"
 
 #define CHAIN_LENGTH 128
 
 /* Section types */
 #define STATFILE_SECTION_COMMON 1
+#define STATFILE_SECTION_CUCKOO 2
+
+/* Cuckoo hashing parameters for version 2 statfiles */
+#define CUCKOO_BUCKET_SLOTS 4
+#define CUCKOO_MAX_KICKS 500
+#define CUCKOO_READ_RETRIES 64
+#define CUCKOO_MIN_BUCKETS 2
+#define CUCKOO_ALIGN 64
 
 /**
  * Common statfile header
@@ -64,6 +74,23 @@ struct stat_file {
 	struct stat_file_block blocks[1];       /**< first block of data				*/
 };
 
+/**
+ * Bucket of a cuckoo section, fits exactly one cache line
+ */
+struct stat_file_bucket {
+	struct stat_file_block slots[CUCKOO_BUCKET_SLOTS];
+};
+
+/**
+ * Cuckoo extension that follows the section header in version 2 statfiles
+ */
+struct stat_file_cuckoo {
+	gint seq;                               /**< odd while keys are being moved	*/
+	gint moved;                             /**< file has been replaced by a bigger one */
+	guint64 generation;                     /**< number of times file has grown	*/
+	u_char unused[48];                      /**< pad to cache line				*/
+};
+
 /**
  * Common view of statfile object
  */
@@ -80,11 +107,17 @@ typedef struct {
 	struct stat_file_section cur_section;   /**< current section					*/
 	size_t len;                             /**< length of file(in bytes)			*/
 	struct rspamd_statfile_config *cf;
+	gint version;                           /**< format of file (1 or 2)			*/
+	struct stat_file_cuckoo *cuckoo;        /**< cuckoo extension for version 2	*/
+	guint64 max_blocks;                     /**< growth limit for version 2 (0 - none) */
+	gboolean hugepages;                     /**< try to map file with huge pages	*/
 } rspamd_mmaped_file_t;
 
 
 #define RSPAMD_STATFILE_VERSION {'1', '2'}
+#define RSPAMD_STATFILE_VERSION_CUCKOO {'2', '0'}
 #define BACKUP_SUFFIX ".old"
+#define NEW_SUFFIX ".new"
 
 static void rspamd_mmaped_file_set_block_common (rspamd_mempool_t *pool,
 	   rspamd_mmaped_file_t *file,
@@ -98,6 +131,237 @@ gint rspamd_mmaped_file_create (const gchar *filename, size_t size,
 		rspamd_mempool_t *pool);
 gint rspamd_mmaped_file_close_file (rspamd_mempool_t *pool,
 		rspamd_mmaped_file_t * file);
+static void rspamd_mmaped_file_set_block_v2 (rspamd_mempool_t *pool,
+		rspamd_mmaped_file_t *file,
+		guint32 h1, guint32 h2, double value);
+
+static GQuark
+rspamd_mmaped_file_quark (void)
+{
+	return g_quark_from_static_string ("mmaped-file-stat-backend");
+}
+
+/*
+ * Version 2 statfiles store blocks in 64 bytes buckets of 4 slots each. Every
+ * key can live in one of two buckets (selected by h1 and h2 respectively), so
+ * lookup touches at most two cache lines. Writers are serialised by the file
+ * lock and move keys between buckets (cuckoo kicks) when both buckets are
+ * full. Readers do not lock anything: they check `seq` counter, which is odd
+ * while keys are moving, and retry if it has changed during lookup.
+ */
+static inline gsize
+rspamd_mmaped_file_cuckoo_offset (void)
+{
+	gsize off = sizeof (struct stat_file_header) +
+			sizeof (struct stat_file_section) +
+			sizeof (struct stat_file_cuckoo);
+
+	return (off + CUCKOO_ALIGN - 1) & ~((gsize)CUCKOO_ALIGN - 1);
+}
+
+static inline struct stat_file_bucket *
+rspamd_mmaped_file_bucket (rspamd_mmaped_file_t *file, guint64 idx)
+{
+	return (struct stat_file_bucket *)((u_char *)file->map + file->seek_pos +
+			idx * sizeof (struct stat_file_bucket));
+}
+
+static inline void
+rspamd_mmaped_file_cuckoo_buckets (rspamd_mmaped_file_t *file,
+		guint32 h1, guint32 h2, guint64 *b1, guint64 *b2)
+{
+	guint64 n = file->cur_section.length;
+
+	*b1 = h1 % n;
+	*b2 = h2 % n;
+
+	if (*b2 == *b1) {
+		*b2 = (*b1 + 1) % n;
+	}
+}
+
+static inline struct stat_file_block *
+rspamd_mmaped_file_cuckoo_find (struct stat_file_bucket *bk,
+		guint32 h1, guint32 h2)
+{
+	guint i;
+
+	for (i = 0; i < CUCKOO_BUCKET_SLOTS; i ++) {
+		if (bk->slots[i].hash1 == h1 && bk->slots[i].hash2 == h2) {
+			return &bk->slots[i];
+		}
+	}
+
+	return NULL;
+}
+
+static double
+rspamd_mmaped_file_get_block_cuckoo (rspamd_mmaped_file_t *file,
+		guint32 h1, guint32 h2)
+{
+	struct stat_file_bucket *bk1, *bk2;
+	struct stat_file_block *block;
+	guint64 b1, b2;
+	double value = 0;
+	gint seq, i;
+
+	rspamd_mmaped_file_cuckoo_buckets (file, h1, h2, &b1, &b2);
+	bk1 = rspamd_mmaped_file_bucket (file, b1);
+	bk2 = rspamd_mmaped_file_bucket (file, b2);
+
+	for (i = 0; i < CUCKOO_READ_RETRIES; i ++) {
+		seq = g_atomic_int_get (&file->cuckoo->seq);
+
+		if (seq & 1) {
+			/* Writer is moving keys now */
+			continue;
+		}
+
+		block = rspamd_mmaped_file_cuckoo_find (bk1, h1, h2);
+
+		if (block == NULL) {
+			block = rspamd_mmaped_file_cuckoo_find (bk2, h1, h2);
+		}
+
+		value = block ? block->value : 0;
+
+		if (g_atomic_int_get (&file->cuckoo->seq) == seq) {
+			return value;
+		}
+	}
+
+	/* Writer is too busy, treat token as missing */
+	return 0;
+}
+
+static inline struct stat_file_block *
+rspamd_mmaped_file_cuckoo_free_slot (struct stat_file_bucket *bk)
+{
+	return rspamd_mmaped_file_cuckoo_find (bk, 0, 0);
+}
+
+/*
+ * Inserts or updates key, must be called with file lock held. If the table is
+ * too full, returns FALSE and replaces h1, h2 and value with the key that
+ * could not be placed (it is not necessarily the key being inserted)
+ */
+static gboolean
+rspamd_mmaped_file_set_block_cuckoo (rspamd_mmaped_file_t *file,
+		guint32 *h1, guint32 *h2, double *value)
+{
+	struct stat_file_header *header = (struct stat_file_header *)file->map;
+	struct stat_file_bucket *bk1, *bk2;
+	struct stat_file_block *block, cur, tmp;
+	guint64 b1, b2, pos;
+	guint kicks;
+	gboolean ret = FALSE;
+
+	rspamd_mmaped_file_cuckoo_buckets (file, *h1, *h2, &b1, &b2);
+	bk1 = rspamd_mmaped_file_bucket (file, b1);
+	bk2 = rspamd_mmaped_file_bucket (file, b2);
+
+	/* Existing keys are updated in place, values are stored atomically */
+	block = rspamd_mmaped_file_cuckoo_find (bk1, *h1, *h2);
+
+	if (block == NULL) {
+		block = rspamd_mmaped_file_cuckoo_find (bk2, *h1, *h2);
+	}
+
+	if (block != NULL) {
+		block->value = *value;
+
+		return TRUE;
+	}
+
+	g_atomic_int_inc (&file->cuckoo->seq);
+
+	block = rspamd_mmaped_file_cuckoo_free_slot (bk1);
+
+	if (block == NULL) {
+		block = rspamd_mmaped_file_cuckoo_free_slot (bk2);
+	}
+
+	cur.hash1 = *h1;
+	cur.hash2 = *h2;
+	cur.value = *value;
+
+	if (block != NULL) {
+		*block = cur;
+		header->used_blocks ++;
+		ret = TRUE;
+		goto end;
+	}
+
+	pos = ottery_rand_range (1) ? b2 : b1;
+
+	for (kicks = 0; kicks < CUCKOO_MAX_KICKS; kicks ++) {
+		/* Evict random victim and move it to its alternative bucket */
+		block = &rspamd_mmaped_file_bucket (file, pos)->slots[
+				ottery_rand_range (CUCKOO_BUCKET_SLOTS - 1)];
+		tmp = *block;
+		*block = cur;
+		cur = tmp;
+
+		rspamd_mmaped_file_cuckoo_buckets (file, cur.hash1, cur.hash2, &b1, &b2);
+		pos = (pos == b1) ? b2 : b1;
+		block = rspamd_mmaped_file_cuckoo_free_slot (
+				rspamd_mmaped_file_bucket (file, pos));
+
+		if (block != NULL) {
+			*block = cur;
+			header->used_blocks ++;
+			ret = TRUE;
+			goto end;
+		}
+	}
+
+	*h1 = cur.hash1;
+	*h2 = cur.hash2;
+	*value = cur.value;
+
+end:
+	g_atomic_int_inc (&file->cuckoo->seq);
+
+	return ret;
+}
+
+/*
+ * Replaces key with the minimum value in the key's buckets if it is less
+ * than the value of the key
+ */
+static void
+rspamd_mmaped_file_expire_cuckoo (rspamd_mmaped_file_t *file,
+		guint32 h1, guint32 h2, double value)
+{
+	struct stat_file_bucket *bk[2];
+	struct stat_file_block *block, *to_expire = NULL;
+	guint64 b1, b2;
+	double min = value;
+	guint i, j;
+
+	rspamd_mmaped_file_cuckoo_buckets (file, h1, h2, &b1, &b2);
+	bk[0] = rspamd_mmaped_file_bucket (file, b1);
+	bk[1] = rspamd_mmaped_file_bucket (file, b2);
+
+	for (i = 0; i < G_N_ELEMENTS (bk); i ++) {
+		for (j = 0; j < CUCKOO_BUCKET_SLOTS; j ++) {
+			block = &bk[i]->slots[j];
+
+			if (block->value < min) {
+				to_expire = block;
+				min = block->value;
+			}
+		}
+	}
+
+	if (to_expire) {
+		g_atomic_int_inc (&file->cuckoo->seq);
+		to_expire->hash1 = h1;
+		to_expire->hash2 = h2;
+		to_expire->value = value;
+		g_atomic_int_inc (&file->cuckoo->seq);
+	}
+}
 
 double
 rspamd_mmaped_file_get_block (rspamd_mmaped_file_t * file,
@@ -112,6 +376,10 @@ rspamd_mmaped_file_get_block (rspamd_mmaped_file_t * file,
 		return 0;
 	}
 
+	if (file->version == 2) {
+		return rspamd_mmaped_file_get_block_cuckoo (file, h1, h2);
+	}
+
 	blocknum = h1 % file->cur_section.length;
 	c = (u_char *) file->map + file->seek_pos + blocknum *
 		sizeof (struct stat_file_block);
@@ -220,7 +488,12 @@ rspamd_mmaped_file_set_block (rspamd_mempool_t *pool,
 		guint32 h2,
 		double value)
 {
-	rspamd_mmaped_file_set_block_common (pool, file, h1, h2, value);
+	if (file->version == 2) {
+		rspamd_mmaped_file_set_block_v2 (pool, file, h1, h2, value);
+	}
+	else {
+		rspamd_mmaped_file_set_block_common (pool, file, h1, h2, value);
+	}
 }
 
 gboolean
@@ -334,6 +607,7 @@ rspamd_mmaped_file_check (rspamd_mempool_t *pool, rspamd_mmaped_file_t * file)
 	struct stat_file *f;
 	gchar *c;
 	static gchar valid_version[] = RSPAMD_STATFILE_VERSION;
+	static gchar cuckoo_version[] = RSPAMD_STATFILE_VERSION_CUCKOO;
 
 
 	if (!file || !file->map) {
@@ -360,6 +634,35 @@ rspamd_mmaped_file_check (rspamd_mempool_t *pool, rspamd_mmaped_file_t * file)
 	if (*c == 1 && *(c + 1) == 0) {
 		return -1;
 	}
+	else if (memcmp (c, cuckoo_version, sizeof (cuckoo_version)) == 0) {
+		file->cur_section.code = f->section.code;
+		file->cur_section.length = f->section.length;
+
+		if (f->section.code != STATFILE_SECTION_CUCKOO ||
+				f->section.length < CUCKOO_MIN_BUCKETS) {
+			msg_info_pool ("file %s has invalid cuckoo section", file->filename);
+			return -1;
+		}
+
+		if (rspamd_mmaped_file_cuckoo_offset () +
+				file->cur_section.length * sizeof (struct stat_file_bucket) >
+				file->len) {
+			msg_info_pool ("file %s is truncated: %z, must be %z",
+					file->filename,
+					file->len,
+					rspamd_mmaped_file_cuckoo_offset () +
+					file->cur_section.length * sizeof (struct stat_file_bucket));
+			return -1;
+		}
+
+		file->version = 2;
+		file->cuckoo = (struct stat_file_cuckoo *)((u_char *)file->map +
+				sizeof (struct stat_file_header) +
+				sizeof (struct stat_file_section));
+		file->seek_pos = rspamd_mmaped_file_cuckoo_offset ();
+
+		return 0;
+	}
 	else if (memcmp (c, valid_version, sizeof (valid_version)) != 0) {
 		/* Unknown version */
 		msg_info_pool ("file %s has invalid version %c.%c",
@@ -382,8 +685,329 @@ rspamd_mmaped_file_check (rspamd_mempool_t *pool, rspamd_mmaped_file_t * file)
 	}
 	file->seek_pos = sizeof (struct stat_file) -
 		sizeof (struct stat_file_block);
+	file->version = 1;
+	file->cuckoo = NULL;
+
+	return 0;
+}
+
+/*
+ * Maps statfile without any size checks
+ */
+static rspamd_mmaped_file_t *
+rspamd_mmaped_file_map (rspamd_mempool_t *pool, const gchar *filename,
+		gboolean hugepages)
+{
+	struct stat st;
+	rspamd_mmaped_file_t *new_file;
+
+	new_file = g_malloc0 (sizeof (rspamd_mmaped_file_t));
+
+	if ((new_file->fd = open (filename, O_RDWR)) == -1) {
+		msg_info_pool ("cannot open file %s, error %d, %s",
+			filename,
+			errno,
+			strerror (errno));
+		g_free (new_file);
+		return NULL;
+	}
+
+	if (fstat (new_file->fd, &st) == -1) {
+		msg_info_pool ("cannot stat file %s, error %s, %d", filename, strerror (
+				errno), errno);
+		close (new_file->fd);
+		g_free (new_file);
+		return NULL;
+	}
+
+	new_file->map = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+	if (hugepages) {
+		/* Works merely for files on hugetlbfs, fallback to normal pages */
+		new_file->map = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_HUGETLB, new_file->fd, 0);
+	}
+#endif
+
+	if (new_file->map == MAP_FAILED &&
+			(new_file->map = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED, new_file->fd, 0)) == MAP_FAILED) {
+		close (new_file->fd);
+		msg_info_pool ("cannot mmap file %s, error %d, %s",
+			filename,
+			errno,
+			strerror (errno));
+		g_free (new_file);
+		return NULL;
+	}
+
+	rspamd_strlcpy (new_file->filename, filename, sizeof (new_file->filename));
+	new_file->len = st.st_size;
+	new_file->hugepages = hugepages;
+	new_file->pool = pool;
+
+	/* Acquire lock for this operation */
+	if (!rspamd_file_lock (new_file->fd, FALSE)) {
+		close (new_file->fd);
+		munmap (new_file->map, st.st_size);
+		msg_info_pool ("cannot lock file %s, error %d, %s",
+				filename,
+				errno,
+				strerror (errno));
+		g_free (new_file);
+		return NULL;
+	}
+
+	if (rspamd_mmaped_file_check (pool, new_file) == -1) {
+		rspamd_file_unlock (new_file->fd, FALSE);
+		close (new_file->fd);
+		munmap (new_file->map, st.st_size);
+		g_free (new_file);
+		return NULL;
+	}
+
+	rspamd_file_unlock (new_file->fd, FALSE);
+
+	return new_file;
+}
+
+/*
+ * Creates version 2 statfile with `nbuckets` buckets, header fields including
+ * revision and tokenizer config are copied from `tpl`
+ */
+static gint
+rspamd_mmaped_file_create_cuckoo (rspamd_mempool_t *pool,
+		const gchar *filename,
+		guint64 nbuckets,
+		const struct stat_file_header *tpl,
+		guint64 generation)
+{
+	struct stat_file_header header;
+	struct stat_file_section section = {
+		.code = STATFILE_SECTION_CUCKOO,
+	};
+	struct stat_file_cuckoo ext;
+	static const u_char cuckoo_version[] = RSPAMD_STATFILE_VERSION_CUCKOO;
+	gsize total;
+	gint fd;
+
+	nbuckets = MAX (nbuckets, CUCKOO_MIN_BUCKETS);
+	memcpy (&header, tpl, sizeof (header));
+	memcpy (header.version, cuckoo_version, sizeof (header.version));
+	header.used_blocks = 0;
+	header.total_blocks = nbuckets * CUCKOO_BUCKET_SLOTS;
+	section.length = nbuckets;
+	memset (&ext, 0, sizeof (ext));
+	ext.generation = generation;
+	total = rspamd_mmaped_file_cuckoo_offset () +
+			nbuckets * sizeof (struct stat_file_bucket);
+
+	msg_debug_pool ("create cuckoo statfile %s with %L buckets", filename,
+			(gint64)nbuckets);
+
+	if ((fd =
+		open (filename, O_RDWR | O_TRUNC | O_CREAT, S_IWUSR | S_IRUSR)) == -1) {
+		msg_info_pool ("cannot create file %s, error %d, %s",
+			filename,
+			errno,
+			strerror (errno));
+
+		return -1;
+	}
+
+	/* Buckets are zeroed by ftruncate */
+	if (ftruncate (fd, total) == -1 ||
+			pwrite (fd, &header, sizeof (header), 0) == -1 ||
+			pwrite (fd, &section, sizeof (section), sizeof (header)) == -1 ||
+			pwrite (fd, &ext, sizeof (ext),
+					sizeof (header) + sizeof (section)) == -1) {
+		msg_info_pool ("cannot write header to file %s, error %d, %s",
+			filename,
+			errno,
+			strerror (errno));
+		close (fd);
+		unlink (filename);
+
+		return -1;
+	}
+
+	rspamd_fallocate (fd, 0, total);
+	close (fd);
+
+	return 0;
+}
+
+/*
+ * Replaces mapping of `file` with mapping of `nfile` and frees `nfile`
+ */
+static void
+rspamd_mmaped_file_swap (rspamd_mmaped_file_t *file,
+		rspamd_mmaped_file_t *nfile)
+{
+	munmap (file->map, file->len);
+	close (file->fd);
+
+	file->fd = nfile->fd;
+	file->map = nfile->map;
+	file->len = nfile->len;
+	file->seek_pos = nfile->seek_pos;
+	file->cur_section = nfile->cur_section;
+	file->version = nfile->version;
+	file->cuckoo = nfile->cuckoo;
+
+	g_free (nfile);
+}
+
+/*
+ * Copies all keys to a new file with `nbuckets` buckets and atomically
+ * replaces the original file with it. Other processes notice `moved` flag in
+ * the old mapping and remap the file. Must be called with file lock held, the
+ * lock is transferred to the new file.
+ */
+static gboolean
+rspamd_mmaped_file_grow (rspamd_mempool_t *pool,
+		rspamd_mmaped_file_t *file,
+		guint64 nbuckets)
+{
+	rspamd_mmaped_file_t *nfile;
+	struct stat_file_bucket *bk;
+	struct stat_file_block *block;
+	gchar *tmpname;
+	guint64 i;
+	guint j;
+	guint32 h1, h2;
+	double value;
+
+	tmpname = g_strconcat (file->filename, NEW_SUFFIX, NULL);
+
+	msg_info_pool ("cuckoo statfile %s is full, grow it from %L to %L buckets",
+			file->filename, (gint64)file->cur_section.length, (gint64)nbuckets);
+
+	if (rspamd_mmaped_file_create_cuckoo (pool, tmpname, nbuckets,
+			(struct stat_file_header *)file->map,
+			file->cuckoo->generation + 1) != 0) {
+		g_free (tmpname);
+
+		return FALSE;
+	}
+
+	nfile = rspamd_mmaped_file_map (pool, tmpname, file->hugepages);
+
+	if (nfile == NULL) {
+		unlink (tmpname);
+		g_free (tmpname);
+
+		return FALSE;
+	}
+
+	for (i = 0; i < file->cur_section.length; i ++) {
+		bk = rspamd_mmaped_file_bucket (file, i);
+
+		for (j = 0; j < CUCKOO_BUCKET_SLOTS; j ++) {
+			block = &bk->slots[j];
+
+			if (block->hash1 == 0 && block->hash2 == 0) {
+				continue;
+			}
+
+			h1 = block->hash1;
+			h2 = block->hash2;
+			value = block->value;
+
+			if (!rspamd_mmaped_file_set_block_cuckoo (nfile, &h1, &h2, &value)) {
+				msg_err_pool ("cannot move keys to a new statfile %s", tmpname);
+				rspamd_mmaped_file_close_file (pool, nfile);
+				unlink (tmpname);
+				g_free (tmpname);
+
+				return FALSE;
+			}
+		}
+	}
+
+	if (!rspamd_file_lock (nfile->fd, FALSE) ||
+			rename (tmpname, file->filename) == -1) {
+		msg_err_pool ("cannot rename %s to %s: %s", tmpname, file->filename,
+				strerror (errno));
+		rspamd_mmaped_file_close_file (pool, nfile);
+		unlink (tmpname);
+		g_free (tmpname);
+
+		return FALSE;
+	}
+
+	g_free (tmpname);
+	g_atomic_int_set (&file->cuckoo->moved, 1);
+	rspamd_file_unlock (file->fd, FALSE);
+	rspamd_mmaped_file_swap (file, nfile);
+
+	return TRUE;
+}
+
+/*
+ * Maps a file that has replaced the current one
+ */
+static gboolean
+rspamd_mmaped_file_remap (rspamd_mempool_t *pool, rspamd_mmaped_file_t *file)
+{
+	rspamd_mmaped_file_t *nfile;
+
+	nfile = rspamd_mmaped_file_map (pool, file->filename, file->hugepages);
+
+	if (nfile == NULL) {
+		return FALSE;
+	}
+
+	msg_debug_pool ("remap grown statfile %s", file->filename);
+	rspamd_mmaped_file_swap (file, nfile);
+
+	return TRUE;
+}
+
+/*
+ * Locks version 2 file for writing, remapping it if it has been replaced
+ */
+static gboolean
+rspamd_mmaped_file_lock_cuckoo (rspamd_mempool_t *pool,
+		rspamd_mmaped_file_t *file)
+{
+	for (;;) {
+		if (!rspamd_file_lock (file->fd, FALSE)) {
+			return FALSE;
+		}
+
+		if (!g_atomic_int_get (&file->cuckoo->moved)) {
+			return TRUE;
+		}
+
+		rspamd_file_unlock (file->fd, FALSE);
+
+		if (!rspamd_mmaped_file_remap (pool, file)) {
+			return FALSE;
+		}
+	}
+}
+
+static void
+rspamd_mmaped_file_set_block_v2 (rspamd_mempool_t *pool,
+		rspamd_mmaped_file_t *file,
+		guint32 h1, guint32 h2, double value)
+{
+	guint64 nbuckets;
 
-	return 0;
+	while (!rspamd_mmaped_file_set_block_cuckoo (file, &h1, &h2, &value)) {
+		nbuckets = file->cur_section.length * 2;
+
+		if ((file->max_blocks != 0 &&
+				nbuckets * CUCKOO_BUCKET_SLOTS > file->max_blocks) ||
+				!rspamd_mmaped_file_grow (pool, file, nbuckets)) {
+			/* Cannot grow, so expire some key */
+			rspamd_mmaped_file_expire_cuckoo (file, h1, h2, value);
+
+			return;
+		}
+	}
 }
 
 
@@ -526,6 +1150,71 @@ rspamd_mmaped_file_reindex (rspamd_mempool_t *pool,
 
 }
 
+/*
+ * Returns format version of statfile without mapping it (0 if unknown)
+ */
+static gint
+rspamd_mmaped_file_peek_version (const gchar *filename)
+{
+	struct stat_file_header header;
+	static const u_char cuckoo_version[] = RSPAMD_STATFILE_VERSION_CUCKOO;
+	gint fd, ret = 0;
+
+	if ((fd = open (filename, O_RDONLY)) == -1) {
+		return 0;
+	}
+
+	if (pread (fd, &header, sizeof (header), 0) == sizeof (header) &&
+			memcmp (header.magic, "rsd", sizeof (header.magic)) == 0) {
+		ret = memcmp (header.version, cuckoo_version,
+				sizeof (header.version)) == 0 ? 2 : 1;
+	}
+
+	close (fd);
+
+	return ret;
+}
+
+static gint
+rspamd_mmaped_file_format (struct rspamd_statfile_config *stcf)
+{
+	const ucl_object_t *obj;
+
+	if (stcf->opts == NULL) {
+		return 1;
+	}
+
+	obj = ucl_object_lookup (stcf->opts, "format");
+
+	if (obj == NULL) {
+		return 1;
+	}
+
+	if (ucl_object_type (obj) == UCL_STRING) {
+		return strcmp (ucl_object_tostring (obj), "cuckoo") == 0 ? 2 : 1;
+	}
+
+	return ucl_object_toint (obj) == 2 ? 2 : 1;
+}
+
+static guint64
+rspamd_mmaped_file_max_blocks (struct rspamd_statfile_config *stcf)
+{
+	const ucl_object_t *obj;
+
+	if (stcf->opts == NULL) {
+		return 0;
+	}
+
+	obj = ucl_object_lookup (stcf->opts, "max_size");
+
+	if (obj == NULL || ucl_object_type (obj) != UCL_INT) {
+		return 0;
+	}
+
+	return ucl_object_toint (obj) / sizeof (struct stat_file_block);
+}
+
 /*
  * Pre-load mmaped file into memory
  */
@@ -535,11 +1224,23 @@ rspamd_mmaped_file_preload (rspamd_mmaped_file_t *file)
 	guint8 *pos, *end;
 	volatile guint8 t;
 	gsize size;
+	gint advice = MADV_SEQUENTIAL;
 
 	pos = (guint8 *)file->map;
 	end = (guint8 *)file->map + file->len;
 
-	if (madvise (pos, end - pos, MADV_SEQUENTIAL) == -1) {
+#ifdef MADV_HUGEPAGE
+	if (file->hugepages && madvise (pos, end - pos, MADV_HUGEPAGE) == -1) {
+		msg_info ("madvise (MADV_HUGEPAGE) failed: %s", strerror (errno));
+	}
+#endif
+
+	if (file->version == 2) {
+		/* Buckets are accessed randomly */
+		advice = MADV_WILLNEED;
+	}
+
+	if (madvise (pos, end - pos, advice) == -1) {
 		msg_info ("madvise failed: %s", strerror (errno));
 	}
 	else {
@@ -566,6 +1267,7 @@ rspamd_mmaped_file_open (rspamd_mempool_t *pool,
 	rspamd_mmaped_file_t *new_file;
 	gchar *lock;
 	gint lock_fd;
+	gboolean hugepages = FALSE;
 
 	lock = g_strconcat (filename, ".lock", NULL);
 	lock_fd = open (lock, O_WRONLY|O_CREAT|O_EXCL, 00600);
@@ -586,7 +1288,14 @@ rspamd_mmaped_file_open (rspamd_mempool_t *pool,
 		return NULL;
 	}
 
-	if (labs ((glong)size - st.st_size) > (long)sizeof (struct stat_file) * 2
+	if (stcf->opts) {
+		hugepages = ucl_object_toboolean (ucl_object_lookup (stcf->opts,
+				"hugepages"));
+	}
+
+	/* Cuckoo statfiles grow online, so their size is not checked */
+	if (rspamd_mmaped_file_peek_version (filename) != 2 &&
+		labs ((glong)size - st.st_size) > (long)sizeof (struct stat_file) * 2
 		&& size > sizeof (struct stat_file)) {
 		msg_warn_pool ("need to reindex statfile old size: %Hz, new size: %Hz",
 			(size_t)st.st_size, size);
@@ -597,54 +1306,16 @@ rspamd_mmaped_file_open (rspamd_mempool_t *pool,
 			size);
 	}
 
-	new_file = g_malloc0 (sizeof (rspamd_mmaped_file_t));
-	if ((new_file->fd = open (filename, O_RDWR)) == -1) {
-		msg_info_pool ("cannot open file %s, error %d, %s",
-			filename,
-			errno,
-			strerror (errno));
-		g_free (new_file);
-		return NULL;
-	}
-
-	if ((new_file->map =
-		mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
-		new_file->fd, 0)) == MAP_FAILED) {
-		close (new_file->fd);
-		msg_info_pool ("cannot mmap file %s, error %d, %s",
-			filename,
-			errno,
-			strerror (errno));
-		g_free (new_file);
-		return NULL;
-
-	}
-
-	rspamd_strlcpy (new_file->filename, filename, sizeof (new_file->filename));
-	new_file->len = st.st_size;
-	/* Try to lock pages in RAM */
+	new_file = rspamd_mmaped_file_map (pool, filename, hugepages);
 
-	/* Acquire lock for this operation */
-	if (!rspamd_file_lock (new_file->fd, FALSE)) {
-		close (new_file->fd);
-		munmap (new_file->map, st.st_size);
-		msg_info_pool ("cannot lock file %s, error %d, %s",
-				filename,
-				errno,
-				strerror (errno));
-		g_free (new_file);
+	if (new_file == NULL) {
 		return NULL;
 	}
 
-	if (rspamd_mmaped_file_check (pool, new_file) == -1) {
-		close (new_file->fd);
-		rspamd_file_unlock (new_file->fd, FALSE);
-		munmap (new_file->map, st.st_size);
-		g_free (new_file);
-		return NULL;
+	if (new_file->version == 2) {
+		new_file->max_blocks = rspamd_mmaped_file_max_blocks (stcf);
 	}
 
-	rspamd_file_unlock (new_file->fd, FALSE);
 	new_file->cf = stcf;
 	new_file->pool = pool;
 	rspamd_mmaped_file_preload (new_file);
@@ -693,7 +1364,7 @@ rspamd_mmaped_file_create (const gchar *filename,
 	};
 	struct stat_file_block block = { 0, 0, 0 };
 	struct rspamd_stat_tokenizer *tokenizer;
-	gint fd, lock_fd;
+	gint fd, lock_fd, ret;
 	guint buflen = 0, nblocks;
 	gchar *buf = NULL, *lock;
 	struct stat sb;
@@ -740,6 +1411,29 @@ rspamd_mmaped_file_create (const gchar *filename,
 create:
 
 	msg_debug_pool ("create statfile %s of size %l", filename, (long)size);
+	header.create_time = (guint64) time (NULL);
+	g_assert (stcf->clcf != NULL);
+	g_assert (stcf->clcf->tokenizer != NULL);
+	tokenizer = rspamd_stat_get_tokenizer (stcf->clcf->tokenizer->name);
+	g_assert (tokenizer != NULL);
+	tok_conf = tokenizer->get_config (pool, stcf->clcf->tokenizer, &tok_conf_len);
+	header.tokenizer_conf_len = tok_conf_len;
+	g_assert (tok_conf_len < sizeof (header.unused) - sizeof (guint64));
+	memcpy (header.unused, tok_conf, tok_conf_len);
+
+	if (rspamd_mmaped_file_format (stcf) == 2) {
+		ret = rspamd_mmaped_file_create_cuckoo (pool, filename,
+				(size > rspamd_mmaped_file_cuckoo_offset () ?
+				size - rspamd_mmaped_file_cuckoo_offset () : 0) /
+				sizeof (struct stat_file_bucket),
+				&header, 0);
+		unlink (lock);
+		close (lock_fd);
+		g_free (lock);
+
+		return ret;
+	}
+
 	nblocks =
 		(size - sizeof (struct stat_file_header) -
 		sizeof (struct stat_file_section)) / sizeof (struct stat_file_block);
@@ -762,16 +1456,6 @@ create:
 		0,
 		sizeof (header) + sizeof (section) + sizeof (block) * nblocks);
 
-	header.create_time = (guint64) time (NULL);
-	g_assert (stcf->clcf != NULL);
-	g_assert (stcf->clcf->tokenizer != NULL);
-	tokenizer = rspamd_stat_get_tokenizer (stcf->clcf->tokenizer->name);
-	g_assert (tokenizer != NULL);
-	tok_conf = tokenizer->get_config (pool, stcf->clcf->tokenizer, &tok_conf_len);
-	header.tokenizer_conf_len = tok_conf_len;
-	g_assert (tok_conf_len < sizeof (header.unused) - sizeof (guint64));
-	memcpy (header.unused, tok_conf, tok_conf_len);
-
 	if (write (fd, &header, sizeof (header)) == -1) {
 		msg_info_pool ("cannot write header to file %s, error %d, %s",
 			filename,
@@ -858,6 +1542,302 @@ create:
 	return 0;
 }
 
+gboolean
+rspamd_mmaped_file_convert (rspamd_mempool_t *pool,
+		const gchar *filename,
+		GError **err)
+{
+	rspamd_mmaped_file_t *old, *nfile = NULL;
+	struct stat_file_block *block;
+	gchar *lock, *tmpname, *backup;
+	gint lock_fd;
+	guint64 i, used = 0, nbuckets;
+	guint32 h1, h2;
+	double value;
+	struct timespec sleep_ts = {
+			.tv_sec = 0,
+			.tv_nsec = 1000000
+	};
+
+	lock = g_strconcat (filename, ".lock", NULL);
+	lock_fd = open (lock, O_WRONLY|O_CREAT|O_EXCL, 00600);
+
+	while (lock_fd == -1) {
+		/* Wait for lock, file could be converted by another process */
+		nanosleep (&sleep_ts, NULL);
+		lock_fd = open (lock, O_WRONLY|O_CREAT|O_EXCL, 00600);
+	}
+
+	old = rspamd_mmaped_file_map (pool, filename, FALSE);
+
+	if (old == NULL) {
+		g_set_error (err, rspamd_mmaped_file_quark (), EINVAL,
+				"cannot open statfile %s", filename);
+		goto err;
+	}
+
+	if (old->version == 2) {
+		/* Already converted */
+		rspamd_mmaped_file_close_file (pool, old);
+		unlink (lock);
+		close (lock_fd);
+		g_free (lock);
+
+		return TRUE;
+	}
+
+	for (i = 0; i < old->cur_section.length; i ++) {
+		block = (struct stat_file_block *)((u_char *)old->map + old->seek_pos +
+				i * sizeof (struct stat_file_block));
+
+		if (block->hash1 != 0 && block->value != 0) {
+			used ++;
+		}
+	}
+
+	/* Keep the same size, but no more than half full */
+	nbuckets = MAX (old->cur_section.length, used * 2) / CUCKOO_BUCKET_SLOTS;
+	tmpname = g_strconcat (filename, NEW_SUFFIX, NULL);
+
+	if (rspamd_mmaped_file_create_cuckoo (pool, tmpname, nbuckets,
+			(struct stat_file_header *)old->map, 0) != 0 ||
+			(nfile = rspamd_mmaped_file_map (pool, tmpname, FALSE)) == NULL) {
+		g_set_error (err, rspamd_mmaped_file_quark (), errno,
+				"cannot create statfile %s: %s", tmpname, strerror (errno));
+		rspamd_mmaped_file_close_file (pool, old);
+		unlink (tmpname);
+		g_free (tmpname);
+		goto err;
+	}
+
+	for (i = 0; i < old->cur_section.length; i ++) {
+		block = (struct stat_file_block *)((u_char *)old->map + old->seek_pos +
+				i * sizeof (struct stat_file_block));
+
+		if (block->hash1 != 0 && block->value != 0) {
+			h1 = block->hash1;
+			h2 = block->hash2;
+			value = block->value;
+			rspamd_mmaped_file_set_block_v2 (pool, nfile, h1, h2, value);
+		}
+	}
+
+	msync (nfile->map, nfile->len, MS_SYNC);
+	rspamd_mmaped_file_close_file (pool, nfile);
+	rspamd_mmaped_file_close_file (pool, old);
+	backup = g_strconcat (filename, BACKUP_SUFFIX, NULL);
+
+	if (rename (filename, backup) == -1 || rename (tmpname, filename) == -1) {
+		g_set_error (err, rspamd_mmaped_file_quark (), errno,
+				"cannot replace statfile %s: %s", filename, strerror (errno));
+		g_free (backup);
+		g_free (tmpname);
+		goto err;
+	}
+
+	msg_info_pool ("converted statfile %s to cuckoo format, %L keys, "
+			"old file is saved as %s", filename, (gint64)used, backup);
+	g_free (backup);
+	g_free (tmpname);
+	unlink (lock);
+	close (lock_fd);
+	g_free (lock);
+
+	return TRUE;
+
+err:
+	unlink (lock);
+	close (lock_fd);
+	g_free (lock);
+
+	return FALSE;
+}
+
+KHASH_INIT (rspamd_stat_compact, guint64, double, 1, kh_int64_hash_func,
+		kh_int64_hash_equal);
+
+static void
+rspamd_mmaped_file_compact_add (khash_t(rspamd_stat_compact) *h,
+		struct stat_file_block *block,
+		struct rspamd_mmaped_file_compact_stat *st)
+{
+	khiter_t k;
+	gint r;
+
+	if (block->hash1 == 0 && block->hash2 == 0) {
+		return;
+	}
+
+	st->blocks_before ++;
+	k = kh_put (rspamd_stat_compact, h,
+			((guint64)block->hash1) << 32 | block->hash2, &r);
+
+	if (r == 0) {
+		/* Duplicate of the same token, possible in version 1 chains */
+		kh_value (h, k) += block->value;
+		st->merged ++;
+	}
+	else {
+		kh_value (h, k) = block->value;
+	}
+}
+
+gboolean
+rspamd_mmaped_file_compact (rspamd_mempool_t *pool,
+		const gchar *filename,
+		double min_value,
+		struct rspamd_mmaped_file_compact_stat *st,
+		GError **err)
+{
+	rspamd_mmaped_file_t *file, *nfile = NULL;
+	khash_t(rspamd_stat_compact) *h;
+	struct stat_file_block *block;
+	struct stat_file_header *header;
+	gchar *tmpname = NULL;
+	guint64 i, key, nbuckets;
+	guint32 h1, h2;
+	guint j;
+	double value;
+
+	memset (st, 0, sizeof (*st));
+	file = rspamd_mmaped_file_map (pool, filename, FALSE);
+
+	if (file == NULL) {
+		g_set_error (err, rspamd_mmaped_file_quark (), EINVAL,
+				"cannot open statfile %s", filename);
+
+		return FALSE;
+	}
+
+	if ((file->version == 2 && !rspamd_mmaped_file_lock_cuckoo (pool, file)) ||
+			(file->version != 2 && !rspamd_file_lock (file->fd, FALSE))) {
+		g_set_error (err, rspamd_mmaped_file_quark (), errno,
+				"cannot lock statfile %s: %s", filename, strerror (errno));
+		rspamd_mmaped_file_close_file (pool, file);
+
+		return FALSE;
+	}
+
+	st->bytes_before = file->len;
+	h = kh_init (rspamd_stat_compact);
+
+	if (file->version == 2) {
+		for (i = 0; i < file->cur_section.length; i ++) {
+			for (j = 0; j < CUCKOO_BUCKET_SLOTS; j ++) {
+				rspamd_mmaped_file_compact_add (h,
+						&rspamd_mmaped_file_bucket (file, i)->slots[j], st);
+			}
+		}
+	}
+	else {
+		for (i = 0; i < file->cur_section.length; i ++) {
+			block = (struct stat_file_block *)((u_char *)file->map +
+					file->seek_pos + i * sizeof (struct stat_file_block));
+			rspamd_mmaped_file_compact_add (h, block, st);
+		}
+	}
+
+	kh_foreach (h, key, value, {
+		if (value < min_value) {
+			st->dropped ++;
+		}
+	});
+
+	st->blocks_after = kh_size (h) - st->dropped;
+
+	if (file->version == 2) {
+		/* Shrink to a half full file, but never grow it */
+		nbuckets = MIN (st->blocks_after * 2 / CUCKOO_BUCKET_SLOTS,
+				file->cur_section.length);
+		tmpname = g_strconcat (filename, NEW_SUFFIX, NULL);
+
+		if (rspamd_mmaped_file_create_cuckoo (pool, tmpname, nbuckets,
+				(struct stat_file_header *)file->map,
+				file->cuckoo->generation + 1) != 0 ||
+				(nfile = rspamd_mmaped_file_map (pool, tmpname, FALSE)) == NULL) {
+			g_set_error (err, rspamd_mmaped_file_quark (), errno,
+					"cannot create statfile %s: %s", tmpname, strerror (errno));
+			goto err;
+		}
+
+		kh_foreach (h, key, value, {
+			if (value >= min_value) {
+				h1 = key >> 32;
+				h2 = key & 0xFFFFFFFFULL;
+
+				if (!rspamd_mmaped_file_set_block_cuckoo (nfile, &h1, &h2,
+						&value)) {
+					g_set_error (err, rspamd_mmaped_file_quark (), ENOSPC,
+							"cannot move keys to a new statfile %s", tmpname);
+					goto err;
+				}
+			}
+		});
+
+		msync (nfile->map, nfile->len, MS_SYNC);
+
+		if (!rspamd_file_lock (nfile->fd, FALSE) ||
+				rename (tmpname, filename) == -1) {
+			g_set_error (err, rspamd_mmaped_file_quark (), errno,
+					"cannot replace statfile %s: %s", filename, strerror (errno));
+			goto err;
+		}
+
+		/* Writers holding the old mapping remap the file */
+		g_atomic_int_set (&file->cuckoo->moved, 1);
+		st->bytes_after = nfile->len;
+		rspamd_file_unlock (nfile->fd, FALSE);
+		rspamd_mmaped_file_close_file (pool, nfile);
+		g_free (tmpname);
+	}
+	else {
+		/*
+		 * Version 1 files have fixed layout, so blocks are reinserted in
+		 * place: chains become shorter but the file keeps its size
+		 */
+		header = (struct stat_file_header *)file->map;
+		memset ((u_char *)file->map + file->seek_pos, 0,
+				file->cur_section.length * sizeof (struct stat_file_block));
+		header->used_blocks = 0;
+
+		kh_foreach (h, key, value, {
+			if (value >= min_value) {
+				rspamd_mmaped_file_set_block_common (pool, file,
+						key >> 32, key & 0xFFFFFFFFULL, value);
+			}
+		});
+
+		msync (file->map, file->len, MS_SYNC);
+		st->bytes_after = file->len;
+	}
+
+	kh_destroy (rspamd_stat_compact, h);
+	rspamd_file_unlock (file->fd, FALSE);
+	rspamd_mmaped_file_close_file (pool, file);
+
+	msg_info_pool ("compacted statfile %s: %L keys, %L merged, %L dropped",
+			filename, (gint64)st->blocks_after, (gint64)st->merged,
+			(gint64)st->dropped);
+
+	return TRUE;
+
+err:
+	if (nfile) {
+		rspamd_mmaped_file_close_file (pool, nfile);
+	}
+
+	if (tmpname) {
+		unlink (tmpname);
+		g_free (tmpname);
+	}
+
+	kh_destroy (rspamd_stat_compact, h);
+	rspamd_file_unlock (file->fd, FALSE);
+	rspamd_mmaped_file_close_file (pool, file);
+
+	return FALSE;
+}
+
 gpointer
 rspamd_mmaped_file_init (struct rspamd_stat_ctx *ctx,
 		struct rspamd_config *cfg, struct rspamd_statfile *st)
@@ -891,6 +1871,19 @@ rspamd_mmaped_file_init (struct rspamd_stat_ctx *ctx,
 	size = ucl_object_toint (sizeo);
 	mf = rspamd_mmaped_file_open (cfg->cfg_pool, filename, size, stf);
 
+	if (mf != NULL && mf->version == 1 && rspamd_mmaped_file_format (stf) == 2) {
+		GError *err = NULL;
+
+		rspamd_mmaped_file_close_file (cfg->cfg_pool, mf);
+
+		if (!rspamd_mmaped_file_convert (cfg->cfg_pool, filename, &err)) {
+			msg_err_config ("cannot convert statfile %s: %e", filename, err);
+			g_error_free (err);
+		}
+
+		mf = rspamd_mmaped_file_open (cfg->cfg_pool, filename, size, stf);
+	}
+
 	if (mf != NULL) {
 		mf->pool = cfg->cfg_pool;
 	} else {
@@ -945,27 +1938,37 @@ rspamd_mmaped_file_runtime (struct rspamd_task *task,
 {
 	rspamd_mmaped_file_t *mf = p;
 
+	if (mf != NULL && mf->version == 2 &&
+			g_atomic_int_get (&mf->cuckoo->moved)) {
+		/* Statfile has grown in another process */
+		if (!rspamd_mmaped_file_remap (mf->pool, mf)) {
+			msg_err_task ("cannot remap grown statfile %s", mf->filename);
+		}
+	}
+
 	return (gpointer)mf;
 }
 
 gboolean
-rspamd_mmaped_file_process_tokens (struct rspamd_task *task, GPtrArray *tokens,
+rspamd_mmaped_file_process_tokens (struct rspamd_task *task,
+		struct rspamd_stat_tokens *tokens,
 		gint id,
 		gpointer p)
 {
 	rspamd_mmaped_file_t *mf = p;
 	guint32 h1, h2;
-	rspamd_token_t *tok;
+	gdouble *values;
 	guint i;
 
 	g_assert (tokens != NULL);
 	g_assert (p != NULL);
 
-	for (i = 0; i < tokens->len; i++) {
-		tok = g_ptr_array_index (tokens, i);
-		memcpy (&h1, (guchar *)&tok->data, sizeof (h1));
-		memcpy (&h2, ((guchar *)&tok->data) + sizeof (h1), sizeof (h2));
-		tok->values[id] = rspamd_mmaped_file_get_block (mf, h1, h2);
+	values = RSPAMD_STAT_TOKENS_VALUES (tokens, id);
+
+	for (i = 0; i < tokens->ntokens; i++) {
+		memcpy (&h1, (guchar *)&tokens->hashes[i], sizeof (h1));
+		memcpy (&h2, ((guchar *)&tokens->hashes[i]) + sizeof (h1), sizeof (h2));
+		values[i] = rspamd_mmaped_file_get_block (mf, h1, h2);
 	}
 
 	if (mf->cf->is_spam) {
@@ -979,24 +1982,38 @@ rspamd_mmaped_file_process_tokens (struct rspamd_task *task, GPtrArray *tokens,
 }
 
 gboolean
-rspamd_mmaped_file_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
+rspamd_mmaped_file_learn_tokens (struct rspamd_task *task,
+		struct rspamd_stat_tokens *tokens,
 		gint id,
 		gpointer p)
 {
 	rspamd_mmaped_file_t *mf = p;
 	guint32 h1, h2;
-	rspamd_token_t *tok;
+	gdouble *values;
 	guint i;
 
 	g_assert (tokens != NULL);
 	g_assert (p != NULL);
 
-	for (i = 0; i < tokens->len; i++) {
-		tok = g_ptr_array_index (tokens, i);
-		memcpy (&h1, (guchar *)&tok->data, sizeof (h1));
-		memcpy (&h2, ((guchar *)&tok->data) + sizeof (h1), sizeof (h2));
+	values = RSPAMD_STAT_TOKENS_VALUES (tokens, id);
+
+	if (mf->version == 2 &&
+			!rspamd_mmaped_file_lock_cuckoo (task->task_pool, mf)) {
+		msg_err_task ("cannot lock statfile %s: %s", mf->filename,
+				strerror (errno));
+
+		return FALSE;
+	}
+
+	for (i = 0; i < tokens->ntokens; i++) {
+		memcpy (&h1, (guchar *)&tokens->hashes[i], sizeof (h1));
+		memcpy (&h2, ((guchar *)&tokens->hashes[i]) + sizeof (h1), sizeof (h2));
 		rspamd_mmaped_file_set_block (task->task_pool, mf, h1, h2,
-				tok->values[id]);
+				values[i]);
+	}
+
+	if (mf->version == 2) {
+		rspamd_file_unlock (mf->fd, FALSE);
 	}
 
 	return TRUE;
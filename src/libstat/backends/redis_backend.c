@@ -19,6 +19,10 @@
 #include "upstream.h"
 #include "lua/lua_common.h"
 #include "libserver/mempool_vars_internal.h"
+#include "libutil/hash.h"
+#include "cryptobox.h"
+#include "unix-std.h"
+#include <openssl/evp.h>
 
 #ifdef WITH_HIREDIS
 #include "hiredis.h"
@@ -40,11 +44,25 @@ INIT_LOG_MODULE(stat_redis)
 #define REDIS_DEFAULT_USERS_OBJECT "%s%l%r"
 #define REDIS_DEFAULT_TIMEOUT 0.5
 #define REDIS_STAT_TIMEOUT 30
+#define REDIS_DEFAULT_CACHE_TTL 60
+#define REDIS_EXPIRY_DEFAULT_INTERVAL 60.0
+#define REDIS_EXPIRY_DEFAULT_BATCH 10000
+#define REDIS_EXPIRY_DEFAULT_SCAN_COUNT 1000
+#define REDIS_EXPIRY_DEFAULT_RATE 5000.0
+#define REDIS_EXPIRY_DEFAULT_TIMEOUT 10.0
+
+/* Servers that store a part of tokens */
+struct rspamd_redis_stat_shard {
+	struct upstream_list *read_servers;
+	struct upstream_list *write_servers;
+};
 
 struct redis_stat_ctx {
 	struct rspamd_statfile_config *stcf;
 	struct upstream_list *read_servers;
 	struct upstream_list *write_servers;
+	/* Tokens are distributed over shards by consistent hashing if not NULL */
+	GPtrArray *shards;
 	struct rspamd_stat_async_elt *stat_elt;
 	const gchar *redis_object;
 	const gchar *password;
@@ -54,8 +72,28 @@ struct redis_stat_ctx {
 	gboolean store_tokens;
 	gboolean new_schema;
 	gboolean enable_signatures;
+	gboolean fetch_script;
+	gboolean script_loaded;
+	gchar script_sha[EVP_MAX_MD_SIZE * 2 + 1];
 	guint expiry;
 	gint cbref_user;
+	/* Local cache of hot tokens */
+	rspamd_lru_hash_t *tokens_cache;
+	GHashTable *cache_revs;
+	guint cache_size;
+	guint cache_ttl;
+	/* Native expiry driver, started explicitly */
+	struct rspamd_redis_expiry *expiry_drv;
+};
+
+struct rspamd_redis_cache_key {
+	guint64 token;
+	guint64 prefix_hash;
+};
+
+struct rspamd_redis_cache_value {
+	gdouble value;
+	guint64 rev;
 };
 
 enum rspamd_redis_connection_state {
@@ -78,7 +116,20 @@ struct redis_stat_runtime {
 	redisAsyncContext *redis;
 	guint64 learned;
 	gint id;
+	/* Tokens being processed, may differ from task tokens for recipients */
+	struct rspamd_stat_tokens *tokens;
 	gboolean has_event;
+	gboolean script_retried;
+	gint script_argc;
+	const gchar **script_argv;
+	gsize *script_argvlen;
+	/* Indices of tokens that are not found in the local cache */
+	guint *fetch_idx;
+	guint nfetch;
+	guint64 prefix_hash;
+	/* Runtimes of shards used for the current request */
+	GPtrArray *shards;
+	struct redis_stat_runtime *parent;
 	GError *err;
 };
 
@@ -107,12 +158,150 @@ struct rspamd_redis_stat_cbdata {
 
 static const gchar *M = "redis statistics";
 
+/*
+ * Fetches learns counter and values of all tokens in a single call
+ * ARGV: prefix, field ('S'/'H' for the new schema or '' for the old one),
+ * learned key, tokens...
+ * Returns packed little endian doubles: learns followed by tokens values
+ */
+static const gchar *rspamd_redis_fetch_script =
+		"local prefix = ARGV[1]\n"
+		"local field = ARGV[2]\n"
+		"local res = {}\n"
+		"local v = redis.call('HGET', prefix, ARGV[3])\n"
+		"res[1] = struct.pack('<d', tonumber(v) or 0)\n"
+		"for i = 4, #ARGV do\n"
+		"  if field ~= '' then\n"
+		"    v = redis.call('HGET', prefix .. '_' .. ARGV[i], field)\n"
+		"  else\n"
+		"    v = redis.call('HGET', prefix, ARGV[i])\n"
+		"  end\n"
+		"  res[#res + 1] = struct.pack('<d', tonumber(v) or 0)\n"
+		"end\n"
+		"return table.concat(res)\n";
+
+static void rspamd_redis_expiry_free (struct rspamd_redis_expiry *exp);
+
 static GQuark
 rspamd_redis_stat_quark (void)
 {
 	return g_quark_from_static_string (M);
 }
 
+static guint
+rspamd_redis_cache_key_hash (gconstpointer p)
+{
+	const struct rspamd_redis_cache_key *k = p;
+
+	return (guint)(k->token ^ (k->prefix_hash * 0x9E3779B97F4A7C15ULL));
+}
+
+static gboolean
+rspamd_redis_cache_key_equal (gconstpointer a, gconstpointer b)
+{
+	const struct rspamd_redis_cache_key *k1 = a, *k2 = b;
+
+	return k1->token == k2->token && k1->prefix_hash == k2->prefix_hash;
+}
+
+/*
+ * Fill values of tokens that are in the local cache and collect indices
+ * of the rest. Cached values are valid if they have been fetched for the
+ * last known learns revision of the prefix and their ttl is not expired
+ */
+static void
+rspamd_redis_cache_lookup (struct rspamd_task *task,
+		struct redis_stat_runtime *rt,
+		struct rspamd_stat_tokens *tokens)
+{
+	struct redis_stat_ctx *ctx = rt->ctx;
+	struct rspamd_redis_cache_key k;
+	struct rspamd_redis_cache_value *v;
+	guint64 *prev;
+	gdouble *values;
+	guint i;
+
+	rt->prefix_hash = rspamd_cryptobox_fast_hash (rt->redis_object_expanded,
+			strlen (rt->redis_object_expanded), 0);
+	rt->fetch_idx = rspamd_mempool_alloc (task->task_pool,
+			sizeof (guint) * tokens->ntokens);
+	rt->nfetch = 0;
+	prev = g_hash_table_lookup (ctx->cache_revs, rt->redis_object_expanded);
+	values = RSPAMD_STAT_TOKENS_VALUES (tokens, rt->id);
+	k.prefix_hash = rt->prefix_hash;
+
+	for (i = 0; i < tokens->ntokens; i ++) {
+		k.token = tokens->hashes[i];
+		v = NULL;
+
+		if (prev) {
+			v = rspamd_lru_hash_lookup (ctx->tokens_cache, &k,
+					task->tv.tv_sec);
+		}
+
+		if (v && v->rev == *prev) {
+			values[i] = v->value;
+		}
+		else {
+			rt->fetch_idx[rt->nfetch ++] = i;
+		}
+	}
+
+	if (prev) {
+		rt->learned = *prev;
+	}
+
+	msg_debug_stat_redis ("%ud of %ud tokens for %s are found in cache",
+			tokens->ntokens - rt->nfetch, tokens->ntokens,
+			rt->redis_object_expanded);
+}
+
+/*
+ * Store fetched values in the local cache
+ */
+static void
+rspamd_redis_cache_store (struct rspamd_task *task,
+		struct redis_stat_runtime *rt,
+		struct rspamd_stat_tokens *tokens)
+{
+	struct redis_stat_ctx *ctx = rt->ctx;
+	struct rspamd_redis_cache_key *k;
+	struct rspamd_redis_cache_value *v;
+	guint64 *prev;
+	gdouble *values;
+	guint i, j;
+
+	prev = g_hash_table_lookup (ctx->cache_revs, rt->redis_object_expanded);
+
+	if (prev == NULL) {
+		prev = g_malloc (sizeof (*prev));
+		g_hash_table_insert (ctx->cache_revs,
+				g_strdup (rt->redis_object_expanded), prev);
+	}
+
+	/* Entries with other revisions become invalid */
+	*prev = rt->learned;
+	values = RSPAMD_STAT_TOKENS_VALUES (tokens, rt->id);
+
+	for (j = 0; j < rt->nfetch; j ++) {
+		i = rt->fetch_idx[j];
+
+		/* Do not waste cache on rare tokens */
+		if (values[i] == 0) {
+			continue;
+		}
+
+		k = g_malloc (sizeof (*k));
+		k->token = tokens->hashes[i];
+		k->prefix_hash = rt->prefix_hash;
+		v = g_malloc (sizeof (*v));
+		v->value = values[i];
+		v->rev = rt->learned;
+		rspamd_lru_hash_insert (ctx->tokens_cache, k, v,
+				task->tv.tv_sec, ctx->cache_ttl);
+	}
+}
+
 /*
  * Non-static for lua unit testing
  */
@@ -359,7 +548,7 @@ rspamd_redis_maybe_auth (struct redis_stat_ctx *ctx, redisAsyncContext *redis)
 static rspamd_fstring_t *
 rspamd_redis_tokens_to_query (struct rspamd_task *task,
 		struct redis_stat_runtime *rt,
-		GPtrArray *tokens,
+		struct rspamd_stat_tokens *tokens,
 		const gchar *command,
 		const gchar *prefix,
 		gboolean learn,
@@ -368,12 +557,26 @@ rspamd_redis_tokens_to_query (struct rspamd_task *task,
 {
 	rspamd_fstring_t *out;
 	rspamd_token_t *tok;
+	gdouble *values = NULL;
+	const guint *indices = NULL;
 	gchar n0[512], n1[64];
-	guint i, l0, l1, cmd_len, prefix_len;
+	guint i, j, n, l0, l1, cmd_len, prefix_len;
 	gint ret;
 
 	g_assert (tokens != NULL);
 
+	n = tokens->ntokens;
+
+	if (learn) {
+		values = RSPAMD_STAT_TOKENS_VALUES (tokens, idx);
+	}
+
+	if (rt->fetch_idx && (!learn || rt->parent)) {
+		/* Query only tokens that are not cached or belong to this shard */
+		indices = rt->fetch_idx;
+		n = rt->nfetch;
+	}
+
 	cmd_len = strlen (command);
 	prefix_len = strlen (prefix);
 	out = rspamd_fstring_sized_new (1024);
@@ -417,22 +620,23 @@ rspamd_redis_tokens_to_query (struct rspamd_task *task,
 							"%s\r\n"
 							"$%d\r\n"
 							"%s\r\n",
-					(tokens->len + 2),
+					(n + 2),
 					cmd_len, command,
 					prefix_len, prefix);
 		}
 	}
 
-	for (i = 0; i < tokens->len; i ++) {
-		tok = g_ptr_array_index (tokens, i);
+	for (j = 0; j < n; j ++) {
+		i = indices ? indices[j] : j;
+		tok = tokens->meta[i];
 
 		if (learn) {
 			if (intvals) {
 				l1 = rspamd_snprintf (n1, sizeof (n1), "%L",
-						(gint64) tok->values[idx]);
+						(gint64) values[i]);
 			} else {
 				l1 = rspamd_snprintf (n1, sizeof (n1), "%f",
-						tok->values[idx]);
+						values[i]);
 			}
 
 			if (rt->ctx->new_schema) {
@@ -612,11 +816,10 @@ rspamd_redis_tokens_to_query (struct rspamd_task *task,
 static void
 rspamd_redis_store_stat_signature (struct rspamd_task *task,
 		struct redis_stat_runtime *rt,
-		GPtrArray *tokens,
+		struct rspamd_stat_tokens *tokens,
 		const gchar *prefix)
 {
 	gchar *sig, keybuf[512], nbuf[64];
-	rspamd_token_t *tok;
 	guint i, blen, klen;
 	rspamd_fstring_t *out;
 
@@ -652,11 +855,11 @@ rspamd_redis_store_stat_signature (struct rspamd_task *task,
 					"LPUSH\r\n"
 					"$%d\r\n"
 					"%s\r\n",
-			tokens->len + 2,
+			tokens->ntokens + 2,
 			klen, keybuf);
 
-	PTR_ARRAY_FOREACH (tokens, i, tok) {
-		blen = rspamd_snprintf (nbuf, sizeof (nbuf), "%uL", tok->data);
+	for (i = 0; i < tokens->ntokens; i ++) {
+		blen = rspamd_snprintf (nbuf, sizeof (nbuf), "%uL", tokens->hashes[i]);
 		rspamd_printf_fstring (&out, ""
 				"$%d\r\n"
 				"%s\r\n", blen, nbuf);
@@ -1092,6 +1295,12 @@ rspamd_redis_connected (redisAsyncContext *c, gpointer r, gpointer priv)
 			}
 
 			rt->learned = val;
+
+			/* Learns are replicated to all shards */
+			if (rt->parent && rt->learned > rt->parent->learned) {
+				rt->parent->learned = rt->learned;
+			}
+
 			msg_debug_stat_redis ("connected to redis server, tokens learned for %s: %uL",
 					rt->redis_object_expanded, rt->learned);
 			rspamd_upstream_ok (rt->selected);
@@ -1118,41 +1327,44 @@ rspamd_redis_processed (redisAsyncContext *c, gpointer r, gpointer priv)
 	struct redis_stat_runtime *rt = REDIS_RUNTIME (priv);
 	redisReply *reply = r, *elt;
 	struct rspamd_task *task;
-	rspamd_token_t *tok;
-	guint i, processed = 0, found = 0;
+	gdouble *values;
+	guint i, j, n, processed = 0, found = 0;
 	gulong val;
 	gdouble float_val;
 
 	task = rt->task;
+	n = rt->fetch_idx ? rt->nfetch : rt->tokens->ntokens;
 
 	if (c->err == 0) {
 		if (r != NULL) {
 			if (reply->type == REDIS_REPLY_ARRAY) {
 
-				if (reply->elements == task->tokens->len) {
-					for (i = 0; i < reply->elements; i ++) {
-						tok = g_ptr_array_index (task->tokens, i);
-						elt = reply->element[i];
+				if (reply->elements == n) {
+					values = RSPAMD_STAT_TOKENS_VALUES (rt->tokens, rt->id);
+
+					for (j = 0; j < reply->elements; j ++) {
+						i = rt->fetch_idx ? rt->fetch_idx[j] : j;
+						elt = reply->element[j];
 
 						if (G_UNLIKELY (elt->type == REDIS_REPLY_INTEGER)) {
-							tok->values[rt->id] = elt->integer;
+							values[i] = elt->integer;
 							found ++;
 						}
 						else if (elt->type == REDIS_REPLY_STRING) {
 							if (rt->stcf->clcf->flags &
 									RSPAMD_FLAG_CLASSIFIER_INTEGER) {
 								rspamd_strtoul (elt->str, elt->len, &val);
-								tok->values[rt->id] = val;
+								values[i] = val;
 							}
 							else {
 								float_val = strtod (elt->str, NULL);
-								tok->values[rt->id] = float_val;
+								values[i] = float_val;
 							}
 
 							found ++;
 						}
 						else {
-							tok->values[rt->id] = 0;
+							values[i] = 0;
 						}
 
 						processed ++;
@@ -1164,12 +1376,16 @@ rspamd_redis_processed (redisAsyncContext *c, gpointer r, gpointer priv)
 					else {
 						task->flags |= RSPAMD_TASK_FLAG_HAS_HAM_TOKENS;
 					}
+
+					if (rt->fetch_idx && rt->ctx->tokens_cache) {
+						rspamd_redis_cache_store (task, rt, rt->tokens);
+					}
 				}
 				else {
 					msg_err_task_check ("got invalid length of reply vector from redis: "
 							"%d, expected: %d",
 							(gint)reply->elements,
-							(gint)task->tokens->len);
+							(gint)n);
 				}
 			}
 			else {
@@ -1206,6 +1422,149 @@ rspamd_redis_processed (redisAsyncContext *c, gpointer r, gpointer priv)
 	}
 }
 
+static void rspamd_redis_script_processed (redisAsyncContext *c, gpointer r,
+		gpointer priv);
+
+static gboolean
+rspamd_redis_send_fetch_script (struct redis_stat_runtime *rt)
+{
+	struct rspamd_task *task = rt->task;
+
+	if (!rt->ctx->script_loaded) {
+		if (redisAsyncCommand (rt->redis, NULL, NULL, "SCRIPT LOAD %s",
+				rspamd_redis_fetch_script) != REDIS_OK) {
+			msg_err_task ("call to redis failed: %s", rt->redis->errstr);
+
+			return FALSE;
+		}
+	}
+
+	if (redisAsyncCommandArgv (rt->redis, rspamd_redis_script_processed, rt,
+			rt->script_argc, rt->script_argv, rt->script_argvlen) != REDIS_OK) {
+		msg_err_task ("call to redis failed: %s", rt->redis->errstr);
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Called when we have received reply from the fetch script */
+static void
+rspamd_redis_script_processed (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct redis_stat_runtime *rt = REDIS_RUNTIME (priv);
+	redisReply *reply = r;
+	struct rspamd_task *task;
+	struct rspamd_stat_tokens *tokens;
+	gdouble *values, val;
+	guint64 packed;
+	guint i, j, n, found = 0;
+
+	task = rt->task;
+	tokens = rt->tokens;
+	n = rt->fetch_idx ? rt->nfetch : tokens->ntokens;
+
+	if (c->err == 0) {
+		if (r != NULL) {
+			if (reply->type == REDIS_REPLY_ERROR &&
+					strncmp (reply->str, "NOSCRIPT", sizeof ("NOSCRIPT") - 1) == 0 &&
+					!rt->script_retried) {
+				/* Script cache has been flushed, load it again */
+				msg_debug_stat_redis ("fetch script is not loaded, reload it");
+				rt->ctx->script_loaded = FALSE;
+				rt->script_retried = TRUE;
+
+				if (rspamd_redis_send_fetch_script (rt)) {
+					/* Wait for the next reply */
+					return;
+				}
+			}
+			else if (reply->type == REDIS_REPLY_STRING &&
+					reply->len == (n + 1) * sizeof (packed)) {
+				rt->ctx->script_loaded = TRUE;
+				values = RSPAMD_STAT_TOKENS_VALUES (tokens, rt->id);
+
+				memcpy (&packed, reply->str, sizeof (packed));
+				packed = GUINT64_FROM_LE (packed);
+				memcpy (&val, &packed, sizeof (val));
+				rt->learned = val > 0 ? val : 0;
+
+				if (rt->parent && rt->learned > rt->parent->learned) {
+					rt->parent->learned = rt->learned;
+				}
+
+				for (j = 0; j < n; j ++) {
+					i = rt->fetch_idx ? rt->fetch_idx[j] : j;
+					memcpy (&packed, reply->str + (j + 1) * sizeof (packed),
+							sizeof (packed));
+					packed = GUINT64_FROM_LE (packed);
+					memcpy (&values[i], &packed, sizeof (values[i]));
+
+					if (values[i] != 0) {
+						found ++;
+					}
+				}
+
+				if (rt->stcf->is_spam) {
+					task->flags |= RSPAMD_TASK_FLAG_HAS_SPAM_TOKENS;
+				}
+				else {
+					task->flags |= RSPAMD_TASK_FLAG_HAS_HAM_TOKENS;
+				}
+
+				if (rt->fetch_idx && rt->ctx->tokens_cache) {
+					rspamd_redis_cache_store (task, rt, tokens);
+				}
+
+				msg_debug_stat_redis ("received tokens for %s: %ud processed, "
+						"%ud found, %uL learned",
+						rt->redis_object_expanded, n, found,
+						rt->learned);
+				rspamd_upstream_ok (rt->selected);
+			}
+			else if (reply->type == REDIS_REPLY_ERROR) {
+				msg_err_task_check ("fetch script failed for %s: %s",
+						rt->redis_object_expanded, reply->str);
+
+				if (!rt->err) {
+					g_set_error (&rt->err, rspamd_redis_stat_quark (), EINVAL,
+							"fetch script failed: %s", reply->str);
+				}
+			}
+			else {
+				msg_err_task_check ("got invalid reply from redis fetch script: "
+						"%s of %d bytes, %d expected",
+						rspamd_redis_type_to_string (reply->type),
+						(gint)reply->len,
+						(gint)((n + 1) * sizeof (packed)));
+			}
+		}
+	}
+	else {
+		msg_err_task ("error getting reply from redis server %s: %s",
+				rspamd_upstream_name (rt->selected), c->errstr);
+
+		if (rt->redis) {
+			rspamd_upstream_fail (rt->selected, FALSE);
+		}
+
+		if (!rt->err) {
+			g_set_error (&rt->err, rspamd_redis_stat_quark (), c->err,
+					"cannot get values: error getting reply from redis server %s: %s",
+					rspamd_upstream_name (rt->selected), c->errstr);
+		}
+	}
+
+	if (rt->has_event) {
+		if (rt->item) {
+			rspamd_symcache_item_async_dec_check (task, rt->item, M);
+		}
+
+		rspamd_session_remove_event (task->s, rspamd_redis_fin, rt);
+	}
+}
+
 /* Called when we have set tokens during learning */
 static void
 rspamd_redis_learned (redisAsyncContext *c, gpointer r, gpointer priv)
@@ -1242,6 +1601,115 @@ rspamd_redis_learned (redisAsyncContext *c, gpointer r, gpointer priv)
 	}
 }
 
+static void
+rspamd_redis_parse_auth (struct redis_stat_ctx *backend,
+		const ucl_object_t *obj)
+{
+	const ucl_object_t *elt;
+
+	elt = ucl_object_lookup_any (obj, "db", "database", "dbname", NULL);
+	if (elt) {
+		if (ucl_object_type (elt) == UCL_STRING) {
+			backend->dbname = ucl_object_tostring (elt);
+		}
+		else if (ucl_object_type (elt) == UCL_INT) {
+			backend->dbname = ucl_object_tostring_forced (elt);
+		}
+	}
+	else {
+		backend->dbname = NULL;
+	}
+
+	elt = ucl_object_lookup (obj, "password");
+	if (elt) {
+		backend->password = ucl_object_tostring (elt);
+	}
+	else {
+		backend->password = NULL;
+	}
+}
+
+static void
+rspamd_redis_free_shards (struct redis_stat_ctx *backend)
+{
+	struct rspamd_redis_stat_shard *shard;
+	guint i;
+
+	PTR_ARRAY_FOREACH (backend->shards, i, shard) {
+		rspamd_upstreams_destroy (shard->read_servers);
+		rspamd_upstreams_destroy (shard->write_servers);
+		g_free (shard);
+	}
+
+	g_ptr_array_free (backend->shards, TRUE);
+	backend->shards = NULL;
+	backend->read_servers = NULL;
+	backend->write_servers = NULL;
+}
+
+/*
+ * Each shard is either a list of servers or an object with
+ * `read_servers` and `write_servers`
+ */
+static gboolean
+rspamd_redis_parse_shards (struct redis_stat_ctx *backend,
+		const ucl_object_t *obj,
+		struct rspamd_config *cfg,
+		const gchar *symbol)
+{
+	const ucl_object_t *cur, *relt, *welt;
+	struct rspamd_redis_stat_shard *shard;
+	ucl_object_iter_t it = NULL;
+
+	backend->shards = g_ptr_array_new ();
+
+	while ((cur = ucl_object_iterate (obj, &it, true)) != NULL) {
+		if (ucl_object_type (cur) == UCL_OBJECT) {
+			relt = ucl_object_lookup_any (cur, "read_servers", "servers", NULL);
+			welt = ucl_object_lookup (cur, "write_servers");
+
+			if (welt == NULL) {
+				welt = relt;
+			}
+		}
+		else {
+			relt = cur;
+			welt = cur;
+		}
+
+		shard = g_malloc0 (sizeof (*shard));
+		g_ptr_array_add (backend->shards, shard);
+		shard->read_servers = rspamd_upstreams_create (cfg->ups_ctx);
+		shard->write_servers = rspamd_upstreams_create (cfg->ups_ctx);
+
+		if (relt == NULL ||
+				!rspamd_upstreams_from_ucl (shard->read_servers, relt,
+						REDIS_DEFAULT_PORT, NULL) ||
+				!rspamd_upstreams_from_ucl (shard->write_servers, welt,
+						REDIS_DEFAULT_PORT, NULL)) {
+			msg_err ("statfile %s cannot get servers configuration for "
+					"shard %ud", symbol, backend->shards->len - 1);
+			rspamd_redis_free_shards (backend);
+
+			return FALSE;
+		}
+	}
+
+	if (backend->shards->len == 0) {
+		msg_err ("statfile %s has no shards defined", symbol);
+		rspamd_redis_free_shards (backend);
+
+		return FALSE;
+	}
+
+	/* The first shard is used for everything that is not sharded */
+	shard = g_ptr_array_index (backend->shards, 0);
+	backend->read_servers = shard->read_servers;
+	backend->write_servers = shard->write_servers;
+
+	return TRUE;
+}
+
 static gboolean
 rspamd_redis_try_ucl (struct redis_stat_ctx *backend,
 		const ucl_object_t *obj,
@@ -1250,6 +1718,18 @@ rspamd_redis_try_ucl (struct redis_stat_ctx *backend,
 {
 	const ucl_object_t *elt, *relt;
 
+	elt = ucl_object_lookup (obj, "shards");
+
+	if (elt != NULL) {
+		if (!rspamd_redis_parse_shards (backend, elt, cfg, symbol)) {
+			return FALSE;
+		}
+
+		rspamd_redis_parse_auth (backend, obj);
+
+		return TRUE;
+	}
+
 	elt = ucl_object_lookup_any (obj, "read_servers", "servers", NULL);
 
 	if (elt == NULL) {
@@ -1289,26 +1769,7 @@ rspamd_redis_try_ucl (struct redis_stat_ctx *backend,
 		}
 	}
 
-	elt = ucl_object_lookup_any (obj, "db", "database", "dbname", NULL);
-	if (elt) {
-		if (ucl_object_type (elt) == UCL_STRING) {
-			backend->dbname = ucl_object_tostring (elt);
-		}
-		else if (ucl_object_type (elt) == UCL_INT) {
-			backend->dbname = ucl_object_tostring_forced (elt);
-		}
-	}
-	else {
-		backend->dbname = NULL;
-	}
-
-	elt = ucl_object_lookup (obj, "password");
-	if (elt) {
-		backend->password = ucl_object_tostring (elt);
-	}
-	else {
-		backend->password = NULL;
-	}
+	rspamd_redis_parse_auth (backend, obj);
 
 	return TRUE;
 }
@@ -1406,6 +1867,50 @@ rspamd_redis_parse_classifier_opts (struct redis_stat_ctx *backend,
 		backend->enable_signatures = FALSE;
 	}
 
+	elt = ucl_object_lookup (obj, "fetch_script");
+	if (elt) {
+		backend->fetch_script = ucl_object_toboolean (elt);
+	}
+	else {
+		backend->fetch_script = FALSE;
+	}
+
+	if (backend->fetch_script) {
+		guchar sha[EVP_MAX_MD_SIZE];
+		guint shalen = 0;
+
+		EVP_Digest (rspamd_redis_fetch_script,
+				strlen (rspamd_redis_fetch_script),
+				sha, &shalen, EVP_sha1 (), NULL);
+		rspamd_encode_hex_buf (sha, shalen, backend->script_sha,
+				sizeof (backend->script_sha) - 1);
+		backend->script_sha[shalen * 2] = '\0';
+	}
+
+	elt = ucl_object_lookup (obj, "cache_size");
+	if (elt) {
+		backend->cache_size = ucl_object_toint (elt);
+	}
+	else {
+		backend->cache_size = 0;
+	}
+
+	elt = ucl_object_lookup (obj, "cache_ttl");
+	if (elt) {
+		backend->cache_ttl = ucl_object_toint (elt);
+	}
+	else {
+		backend->cache_ttl = REDIS_DEFAULT_CACHE_TTL;
+	}
+
+	if (backend->cache_size > 0) {
+		backend->tokens_cache = rspamd_lru_hash_new_full (backend->cache_size,
+				g_free, g_free,
+				rspamd_redis_cache_key_hash, rspamd_redis_cache_key_equal);
+		backend->cache_revs = g_hash_table_new_full (rspamd_str_hash,
+				rspamd_str_equal, g_free, g_free);
+	}
+
 	elt = ucl_object_lookup_any (obj, "expiry", "expire", NULL);
 	if (elt) {
 		backend->expiry = ucl_object_toint (elt);
@@ -1505,6 +2010,20 @@ rspamd_redis_runtime (struct rspamd_task *task,
 		return NULL;
 	}
 
+	if (ctx->shards) {
+		/* Shards are connected when we know tokens to query */
+		rt = rspamd_mempool_alloc0 (task->task_pool, sizeof (*rt));
+		rspamd_mempool_add_destructor (task->task_pool,
+				rspamd_gerror_free_maybe, &rt->err);
+		rspamd_redis_expand_object (ctx->redis_object, ctx, task,
+				&rt->redis_object_expanded);
+		rt->task = task;
+		rt->ctx = ctx;
+		rt->stcf = stcf;
+
+		return rt;
+	}
+
 	if (learn) {
 		up = rspamd_upstream_get (ctx->write_servers,
 				RSPAMD_UPSTREAM_MASTER_SLAVE,
@@ -1560,7 +2079,12 @@ rspamd_redis_close (gpointer p)
 {
 	struct redis_stat_ctx *ctx = REDIS_CTX (p);
 
-	if (ctx->read_servers) {
+	if (ctx->shards) {
+		/* Read and write servers belong to the first shard */
+		rspamd_redis_free_shards (ctx);
+	}
+
+	if (ctx->read_servers) {
 		rspamd_upstreams_destroy (ctx->read_servers);
 	}
 
@@ -1568,37 +2092,155 @@ rspamd_redis_close (gpointer p)
 		rspamd_upstreams_destroy (ctx->write_servers);
 	}
 
+	if (ctx->tokens_cache) {
+		rspamd_lru_hash_destroy (ctx->tokens_cache);
+		g_hash_table_unref (ctx->cache_revs);
+	}
+
+	if (ctx->expiry_drv) {
+		rspamd_redis_expiry_free (ctx->expiry_drv);
+	}
+
 	g_free (ctx);
 }
 
-gboolean
-rspamd_redis_process_tokens (struct rspamd_task *task,
-		GPtrArray *tokens,
-		gint id, gpointer p)
+/*
+ * Fetch learns and tokens values in a single round trip using EVALSHA
+ */
+static gboolean
+rspamd_redis_process_tokens_script (struct rspamd_task *task,
+		struct redis_stat_runtime *rt,
+		struct rspamd_stat_tokens *tokens,
+		const gchar *learned_key)
 {
-	struct redis_stat_runtime *rt = REDIS_RUNTIME (p);
-	rspamd_fstring_t *query;
 	struct timeval tv;
-	gint ret;
-	const gchar *learned_key = "learns";
+	gchar numbuf[64];
+	guint i, j, n;
+	gint argc;
+
+	/* EVALSHA sha 0 prefix field learned_key tokens... */
+	n = rt->fetch_idx ? rt->nfetch : tokens->ntokens;
+	argc = n + 6;
+	rt->script_argc = argc;
+	rt->script_argv = rspamd_mempool_alloc (task->task_pool,
+			sizeof (gchar *) * argc);
+	rt->script_argvlen = rspamd_mempool_alloc (task->task_pool,
+			sizeof (gsize) * argc);
+
+	rt->script_argv[0] = "EVALSHA";
+	rt->script_argv[1] = rt->ctx->script_sha;
+	rt->script_argv[2] = "0";
+	rt->script_argv[3] = rt->redis_object_expanded;
 
-	if (rspamd_session_blocked (task->s)) {
-		return FALSE;
+	if (rt->ctx->new_schema) {
+		rt->script_argv[4] = rt->stcf->is_spam ? "S" : "H";
+	}
+	else {
+		/* Tokens are stored as fields of the prefix */
+		rt->script_argv[4] = "";
 	}
 
-	if (tokens == NULL || tokens->len == 0 || rt->redis == NULL) {
+	rt->script_argv[5] = learned_key;
+
+	for (i = 0, j = 6; i < n; i ++, j ++) {
+		rspamd_snprintf (numbuf, sizeof (numbuf), "%uL",
+				tokens->hashes[rt->fetch_idx ? rt->fetch_idx[i] : i]);
+		rt->script_argv[j] = rspamd_mempool_strdup (task->task_pool, numbuf);
+	}
+
+	for (i = 0; i < (guint)argc; i ++) {
+		rt->script_argvlen[i] = strlen (rt->script_argv[i]);
+	}
+
+	if (!rspamd_redis_send_fetch_script (rt)) {
 		return FALSE;
 	}
 
-	rt->id = id;
+	rspamd_session_add_event (task->s, rspamd_redis_fin, rt, M);
+	rt->item = rspamd_symcache_get_cur_item (task);
+	rt->has_event = TRUE;
 
-	if (rt->ctx->new_schema) {
-		if (rt->ctx->stcf->is_spam) {
-			learned_key = "learns_spam";
-		}
-		else {
-			learned_key = "learns_ham";
-		}
+	if (rspamd_event_pending (&rt->timeout_event, EV_TIMEOUT)) {
+		event_del (&rt->timeout_event);
+	}
+	event_set (&rt->timeout_event, -1, EV_TIMEOUT, rspamd_redis_timeout, rt);
+	event_base_set (task->ev_base, &rt->timeout_event);
+	double_to_tv (rt->ctx->timeout, &tv);
+	event_add (&rt->timeout_event, &tv);
+
+	return TRUE;
+}
+
+/*
+ * Creates runtime for a shard of the parent runtime connected to one of `ups`
+ */
+static struct redis_stat_runtime *
+rspamd_redis_shard_runtime (struct rspamd_task *task,
+		struct redis_stat_runtime *parent,
+		struct upstream_list *ups,
+		enum rspamd_upstream_rotation rot)
+{
+	struct redis_stat_runtime *rt;
+	struct upstream *up;
+	rspamd_inet_addr_t *addr;
+
+	up = rspamd_upstream_get (ups, rot, NULL, 0);
+
+	if (up == NULL) {
+		msg_err_task ("no upstreams reachable");
+		return NULL;
+	}
+
+	rt = rspamd_mempool_alloc0 (task->task_pool, sizeof (*rt));
+	rspamd_mempool_add_destructor (task->task_pool,
+			rspamd_gerror_free_maybe, &rt->err);
+	rt->selected = up;
+	rt->task = task;
+	rt->ctx = parent->ctx;
+	rt->stcf = parent->stcf;
+	rt->id = parent->id;
+	rt->tokens = parent->tokens;
+	rt->redis_object_expanded = parent->redis_object_expanded;
+	rt->prefix_hash = parent->prefix_hash;
+	rt->parent = parent;
+	rt->fetch_idx = rspamd_mempool_alloc (task->task_pool,
+			sizeof (guint) * parent->tokens->ntokens);
+
+	addr = rspamd_upstream_addr (up);
+	g_assert (addr != NULL);
+
+	if (rspamd_inet_address_get_af (addr) == AF_UNIX) {
+		rt->redis = redisAsyncConnectUnix (rspamd_inet_address_to_string (addr));
+	}
+	else {
+		rt->redis = redisAsyncConnect (rspamd_inet_address_to_string (addr),
+				rspamd_inet_address_get_port (addr));
+	}
+
+	if (rt->redis == NULL) {
+		msg_err_task ("cannot connect redis");
+		return NULL;
+	}
+
+	redisLibeventAttach (rt->redis, task->ev_base);
+	rspamd_redis_maybe_auth (rt->ctx, rt->redis);
+
+	return rt;
+}
+
+static gboolean
+rspamd_redis_fetch_tokens (struct rspamd_task *task,
+		struct redis_stat_runtime *rt,
+		struct rspamd_stat_tokens *tokens,
+		const gchar *learned_key)
+{
+	rspamd_fstring_t *query;
+	struct timeval tv;
+	gint ret;
+
+	if (rt->ctx->fetch_script) {
+		return rspamd_redis_process_tokens_script (task, rt, tokens,
+				learned_key);
 	}
 
 	if (redisAsyncCommand (rt->redis, rspamd_redis_connected, rt, "HGET %s %s",
@@ -1638,12 +2280,143 @@ rspamd_redis_process_tokens (struct rspamd_task *task,
 	return FALSE;
 }
 
+/*
+ * Splits tokens that are not cached among shards and queries all shards
+ * that have some tokens in parallel
+ */
+static gboolean
+rspamd_redis_process_tokens_sharded (struct rspamd_task *task,
+		struct redis_stat_runtime *rt,
+		struct rspamd_stat_tokens *tokens,
+		const gchar *learned_key)
+{
+	struct rspamd_redis_stat_shard *shard;
+	struct redis_stat_runtime *srt;
+	guint i, j, n, nshards = rt->ctx->shards->len;
+	guint *counts;
+	gboolean ret = TRUE;
+
+	n = rt->fetch_idx ? rt->nfetch : tokens->ntokens;
+	counts = rspamd_mempool_alloc0 (task->task_pool, sizeof (guint) * nshards);
+	rt->shards = g_ptr_array_sized_new (nshards);
+	rspamd_mempool_add_destructor (task->task_pool,
+			rspamd_ptr_array_free_hard, rt->shards);
+
+	for (j = 0; j < n; j ++) {
+		i = rt->fetch_idx ? rt->fetch_idx[j] : j;
+		counts[rspamd_consistent_hash (tokens->hashes[i], nshards)] ++;
+	}
+
+	for (i = 0; i < nshards; i ++) {
+		srt = NULL;
+
+		if (counts[i] > 0) {
+			shard = g_ptr_array_index (rt->ctx->shards, i);
+			srt = rspamd_redis_shard_runtime (task, rt, shard->read_servers,
+					RSPAMD_UPSTREAM_ROUND_ROBIN);
+
+			if (srt == NULL) {
+				return FALSE;
+			}
+		}
+
+		g_ptr_array_add (rt->shards, srt);
+	}
+
+	for (j = 0; j < n; j ++) {
+		i = rt->fetch_idx ? rt->fetch_idx[j] : j;
+		srt = g_ptr_array_index (rt->shards,
+				rspamd_consistent_hash (tokens->hashes[i], nshards));
+		srt->fetch_idx[srt->nfetch ++] = i;
+	}
+
+	PTR_ARRAY_FOREACH (rt->shards, i, srt) {
+		if (srt != NULL) {
+			msg_debug_stat_redis ("query %ud tokens from shard %ud for %s",
+					srt->nfetch, i, rt->redis_object_expanded);
+
+			if (!rspamd_redis_fetch_tokens (task, srt, tokens, learned_key)) {
+				ret = FALSE;
+			}
+		}
+	}
+
+	return ret;
+}
+
+gboolean
+rspamd_redis_process_tokens (struct rspamd_task *task,
+		struct rspamd_stat_tokens *tokens,
+		gint id, gpointer p)
+{
+	struct redis_stat_runtime *rt = REDIS_RUNTIME (p);
+	const gchar *learned_key = "learns";
+
+	if (rspamd_session_blocked (task->s)) {
+		return FALSE;
+	}
+
+	if (tokens == NULL || tokens->ntokens == 0 ||
+			(rt->redis == NULL && rt->ctx->shards == NULL)) {
+		return FALSE;
+	}
+
+	rt->id = id;
+	rt->tokens = tokens;
+
+	if (rt->ctx->new_schema) {
+		if (rt->ctx->stcf->is_spam) {
+			learned_key = "learns_spam";
+		}
+		else {
+			learned_key = "learns_ham";
+		}
+	}
+
+	if (rt->ctx->tokens_cache) {
+		rspamd_redis_cache_lookup (task, rt, tokens);
+
+		if (rt->nfetch == 0) {
+			/* All tokens are cached, learns are known from the cache */
+			if (rt->stcf->is_spam) {
+				task->flags |= RSPAMD_TASK_FLAG_HAS_SPAM_TOKENS;
+			}
+			else {
+				task->flags |= RSPAMD_TASK_FLAG_HAS_HAM_TOKENS;
+			}
+
+			return TRUE;
+		}
+	}
+
+	if (rt->ctx->shards) {
+		return rspamd_redis_process_tokens_sharded (task, rt, tokens,
+				learned_key);
+	}
+
+	return rspamd_redis_fetch_tokens (task, rt, tokens, learned_key);
+}
+
 gboolean
 rspamd_redis_finalize_process (struct rspamd_task *task, gpointer runtime,
 		gpointer ctx)
 {
-	struct redis_stat_runtime *rt = REDIS_RUNTIME (runtime);
+	struct redis_stat_runtime *rt = REDIS_RUNTIME (runtime), *srt;
 	redisAsyncContext *redis;
+	gboolean ret = TRUE;
+	guint i;
+
+	if (rt->shards) {
+		PTR_ARRAY_FOREACH (rt->shards, i, srt) {
+			if (srt && !rspamd_redis_finalize_process (task, srt, ctx)) {
+				ret = FALSE;
+			}
+		}
+
+		g_ptr_array_set_size (rt->shards, 0);
+
+		return ret && rt->err == NULL;
+	}
 
 	if (rspamd_event_pending (&rt->timeout_event, EV_TIMEOUT)) {
 		event_del (&rt->timeout_event);
@@ -1662,37 +2435,24 @@ rspamd_redis_finalize_process (struct rspamd_task *task, gpointer runtime,
 	return TRUE;
 }
 
-gboolean
-rspamd_redis_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
-		gint id, gpointer p)
+/*
+ * Sends tokens of the runtime to the connected server along with the learns
+ * counter update
+ */
+static gboolean
+rspamd_redis_send_learn (struct rspamd_task *task,
+		struct redis_stat_runtime *rt,
+		struct rspamd_stat_tokens *tokens,
+		gint id,
+		gboolean store_signature)
 {
-	struct redis_stat_runtime *rt = REDIS_RUNTIME (p);
-	struct upstream *up;
-	rspamd_inet_addr_t *addr;
 	struct timeval tv;
 	rspamd_fstring_t *query;
 	const gchar *redis_cmd;
-	rspamd_token_t *tok;
 	gint ret;
 	goffset off;
 	const gchar *learned_key = "learns";
 
-	if (rspamd_session_blocked (task->s)) {
-		return FALSE;
-	}
-
-	up = rspamd_upstream_get (rt->ctx->write_servers,
-			RSPAMD_UPSTREAM_MASTER_SLAVE,
-			NULL,
-			0);
-
-	if (up == NULL) {
-		msg_err_task ("no upstreams reachable");
-		return FALSE;
-	}
-
-	rt->selected = up;
-
 	if (rt->ctx->new_schema) {
 		if (rt->ctx->stcf->is_spam) {
 			learned_key = "learns_spam";
@@ -1702,22 +2462,6 @@ rspamd_redis_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 		}
 	}
 
-	addr = rspamd_upstream_addr (up);
-	g_assert (addr != NULL);
-
-	if (rspamd_inet_address_get_af (addr) == AF_UNIX) {
-		rt->redis = redisAsyncConnectUnix (rspamd_inet_address_to_string (addr));
-	}
-	else {
-		rt->redis = redisAsyncConnect (rspamd_inet_address_to_string (addr),
-				rspamd_inet_address_get_port (addr));
-	}
-
-	g_assert (rt->redis != NULL);
-
-	redisLibeventAttach (rt->redis, task->ev_base);
-	rspamd_redis_maybe_auth (rt->ctx, rt->redis);
-
 	/*
 	 * Add the current key to the set of learned keys
 	 */
@@ -1737,6 +2481,7 @@ rspamd_redis_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 	}
 
 	rt->id = id;
+	rt->tokens = tokens;
 	query = rspamd_redis_tokens_to_query (task, rt, tokens,
 			redis_cmd, rt->redis_object_expanded, TRUE, id,
 			rt->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER);
@@ -1749,9 +2494,7 @@ rspamd_redis_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 	 * we could understand that we are learning or unlearning
 	 */
 
-	tok = g_ptr_array_index (task->tokens, 0);
-
-	if (tok->values[id] > 0) {
+	if (RSPAMD_STAT_TOKENS_VALUES (tokens, id)[0] > 0) {
 		rspamd_printf_fstring (&query, ""
 				"*4\r\n"
 				"$7\r\n"
@@ -1804,7 +2547,7 @@ rspamd_redis_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 	if (ret == REDIS_OK) {
 
 		/* Add signature if needed */
-		if (rt->ctx->enable_signatures) {
+		if (store_signature) {
 			rspamd_redis_store_stat_signature (task, rt, tokens,
 					"RSIG");
 		}
@@ -1832,12 +2575,132 @@ rspamd_redis_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 }
 
 
+/*
+ * Splits tokens among shards, the learns counter is updated on all shards
+ */
+static gboolean
+rspamd_redis_learn_tokens_sharded (struct rspamd_task *task,
+		struct redis_stat_runtime *rt,
+		struct rspamd_stat_tokens *tokens,
+		gint id)
+{
+	struct rspamd_redis_stat_shard *shard;
+	struct redis_stat_runtime *srt;
+	guint i, nshards = rt->ctx->shards->len;
+
+	rt->id = id;
+	rt->tokens = tokens;
+
+	if (rt->shards == NULL) {
+		rt->shards = g_ptr_array_sized_new (nshards);
+		rspamd_mempool_add_destructor (task->task_pool,
+				rspamd_ptr_array_free_hard, rt->shards);
+	}
+	else {
+		g_ptr_array_set_size (rt->shards, 0);
+	}
+
+	PTR_ARRAY_FOREACH (rt->ctx->shards, i, shard) {
+		srt = rspamd_redis_shard_runtime (task, rt, shard->write_servers,
+				RSPAMD_UPSTREAM_MASTER_SLAVE);
+
+		if (srt == NULL) {
+			return FALSE;
+		}
+
+		g_ptr_array_add (rt->shards, srt);
+	}
+
+	for (i = 0; i < tokens->ntokens; i ++) {
+		srt = g_ptr_array_index (rt->shards,
+				rspamd_consistent_hash (tokens->hashes[i], nshards));
+		srt->fetch_idx[srt->nfetch ++] = i;
+	}
+
+	PTR_ARRAY_FOREACH (rt->shards, i, srt) {
+		msg_debug_stat_redis ("learn %ud tokens to shard %ud for %s",
+				srt->nfetch, i, rt->redis_object_expanded);
+
+		/* Signatures are stored in the first shard only */
+		if (!rspamd_redis_send_learn (task, srt, tokens, id,
+				i == 0 && rt->ctx->enable_signatures)) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+gboolean
+rspamd_redis_learn_tokens (struct rspamd_task *task,
+		struct rspamd_stat_tokens *tokens,
+		gint id, gpointer p)
+{
+	struct redis_stat_runtime *rt = REDIS_RUNTIME (p);
+	struct upstream *up;
+	rspamd_inet_addr_t *addr;
+
+	if (rspamd_session_blocked (task->s)) {
+		return FALSE;
+	}
+
+	if (rt->ctx->shards) {
+		return rspamd_redis_learn_tokens_sharded (task, rt, tokens, id);
+	}
+
+	up = rspamd_upstream_get (rt->ctx->write_servers,
+			RSPAMD_UPSTREAM_MASTER_SLAVE,
+			NULL,
+			0);
+
+	if (up == NULL) {
+		msg_err_task ("no upstreams reachable");
+		return FALSE;
+	}
+
+	rt->selected = up;
+
+	addr = rspamd_upstream_addr (up);
+	g_assert (addr != NULL);
+
+	if (rspamd_inet_address_get_af (addr) == AF_UNIX) {
+		rt->redis = redisAsyncConnectUnix (rspamd_inet_address_to_string (addr));
+	}
+	else {
+		rt->redis = redisAsyncConnect (rspamd_inet_address_to_string (addr),
+				rspamd_inet_address_get_port (addr));
+	}
+
+	g_assert (rt->redis != NULL);
+
+	redisLibeventAttach (rt->redis, task->ev_base);
+	rspamd_redis_maybe_auth (rt->ctx, rt->redis);
+
+	return rspamd_redis_send_learn (task, rt, tokens, id,
+			rt->ctx->enable_signatures);
+}
+
 gboolean
 rspamd_redis_finalize_learn (struct rspamd_task *task, gpointer runtime,
 		gpointer ctx, GError **err)
 {
-	struct redis_stat_runtime *rt = REDIS_RUNTIME (runtime);
+	struct redis_stat_runtime *rt = REDIS_RUNTIME (runtime), *srt;
 	redisAsyncContext *redis;
+	gboolean ret = TRUE;
+	guint i;
+
+	if (rt->shards) {
+		PTR_ARRAY_FOREACH (rt->shards, i, srt) {
+			if (srt && !rspamd_redis_finalize_learn (task, srt, ctx,
+					(err && *err == NULL) ? err : NULL)) {
+				ret = FALSE;
+			}
+		}
+
+		g_ptr_array_set_size (rt->shards, 0);
+
+		return ret;
+	}
 
 	if (rspamd_event_pending (&rt->timeout_event, EV_TIMEOUT)) {
 		event_del (&rt->timeout_event);
@@ -1929,4 +2792,547 @@ rspamd_redis_load_tokenizer_config (gpointer runtime,
 	return NULL;
 }
 
+/*
+ * Native expiry of the new schema tokens. Unlike the bayes_expiry plugin,
+ * keys are scanned and checked inside redis, so each step processes a large
+ * batch of tokens in a single round trip. The progress of a cycle is stored
+ * in a hash named `<symbol>_expiry`.
+ * KEYS: progress key
+ * ARGV: pattern, expire, batch, scan count, epsilon_common, common_ttl,
+ * significant_factor, lazy ('1' or '0'), hostname, lock ttl
+ * Returns either 'locked by <host>' or
+ * {next cursor, mean, step counters, cycle counters (if a cycle is finished)}
+ */
+static const gchar *rspamd_redis_expiry_script =
+		"local state = KEYS[1]\n"
+		"local pattern = ARGV[1]\n"
+		"local expire = tonumber(ARGV[2])\n"
+		"local batch = tonumber(ARGV[3])\n"
+		"local epsilon_common = tonumber(ARGV[5])\n"
+		"local common_ttl = tonumber(ARGV[6])\n"
+		"local significant_factor = tonumber(ARGV[7])\n"
+		"local lazy = ARGV[8] == '1'\n"
+		"local names = {'nelts', 'significant', 'extended', 'insignificant',\n"
+		"  'insignificant_ttls', 'common', 'discriminated', 'infrequent',\n"
+		"  'infrequent_ttls'}\n"
+		"local lock_key = state .. '_lock'\n"
+		"local lock = redis.call('GET', lock_key)\n"
+		"if lock and lock ~= ARGV[9] then\n"
+		"  return 'locked by ' .. lock\n"
+		"end\n"
+		"redis.replicate_commands()\n"
+		"redis.call('SETEX', lock_key, ARGV[10], ARGV[9])\n"
+		"local cursor = redis.call('HGET', state, 'cursor') or '0'\n"
+		"local tokens, nelts, sum = {}, 0, 0\n"
+		"repeat\n"
+		"  local ret = redis.call('SCAN', cursor, 'MATCH', pattern, 'COUNT', ARGV[4])\n"
+		"  cursor = ret[1]\n"
+		"  for _,key in ipairs(ret[2]) do\n"
+		"    local values = redis.call('HMGET', key, 'H', 'S')\n"
+		"    local ham = tonumber(values[1]) or 0\n"
+		"    local spam = tonumber(values[2]) or 0\n"
+		"    nelts = nelts + 1\n"
+		"    tokens[nelts] = {key, ham, spam, redis.call('TTL', key)}\n"
+		"    sum = sum + ham + spam\n"
+		"  end\n"
+		"until cursor == '0' or nelts >= batch\n"
+		"local mean = nelts > 0 and sum / nelts or 0\n"
+		"local c = {nelts, 0, 0, 0, 0, 0, 0, 0, 0}\n"
+		"local function set_ttl(key, ttl)\n"
+		"  if ttl == -1 or ttl > expire then\n"
+		"    redis.call('EXPIRE', key, expire)\n"
+		"    return 1\n"
+		"  end\n"
+		"  return 0\n"
+		"end\n"
+		"for _,token in ipairs(tokens) do\n"
+		"  local key, ham, spam, ttl = token[1], token[2], token[3], token[4]\n"
+		"  local total = ham + spam\n"
+		"  if total == 0 or math.abs(ham - spam) <= total * epsilon_common then\n"
+		"    c[6] = c[6] + 1\n"
+		"    if ttl > common_ttl then\n"
+		"      c[7] = c[7] + 1\n"
+		"      redis.call('EXPIRE', key, common_ttl)\n"
+		"    end\n"
+		"  elseif total >= mean then\n"
+		"    if ham / total > significant_factor or spam / total > significant_factor then\n"
+		"      c[2] = c[2] + 1\n"
+		"      if lazy then\n"
+		"        if ttl ~= -1 then\n"
+		"          redis.call('PERSIST', key)\n"
+		"          c[3] = c[3] + 1\n"
+		"        end\n"
+		"      else\n"
+		"        redis.call('EXPIRE', key, expire)\n"
+		"        c[3] = c[3] + 1\n"
+		"      end\n"
+		"    else\n"
+		"      c[4] = c[4] + 1\n"
+		"      c[5] = c[5] + set_ttl(key, ttl)\n"
+		"    end\n"
+		"  else\n"
+		"    c[8] = c[8] + 1\n"
+		"    c[9] = c[9] + set_ttl(key, ttl)\n"
+		"  end\n"
+		"end\n"
+		"redis.call('HINCRBY', state, 'steps', 1)\n"
+		"for i,name in ipairs(names) do\n"
+		"  if c[i] ~= 0 then redis.call('HINCRBY', state, name, c[i]) end\n"
+		"end\n"
+		"local cycle = {}\n"
+		"if cursor == '0' then\n"
+		"  local res = redis.call('HMGET', state, 'steps', unpack(names))\n"
+		"  for i,v in ipairs(res) do cycle[i] = tonumber(v) or 0 end\n"
+		"  redis.call('DEL', state)\n"
+		"else\n"
+		"  redis.call('HSET', state, 'cursor', cursor)\n"
+		"end\n"
+		"redis.call('DEL', lock_key)\n"
+		"return {cursor, math.floor(mean + 0.5), c, cycle}\n";
+
+enum rspamd_redis_expiry_counter {
+	RSPAMD_EXPIRY_CHECKED = 0,
+	RSPAMD_EXPIRY_SIGNIFICANT,
+	RSPAMD_EXPIRY_EXTENDED,
+	RSPAMD_EXPIRY_INSIGNIFICANT,
+	RSPAMD_EXPIRY_INSIGNIFICANT_TTLS,
+	RSPAMD_EXPIRY_COMMON,
+	RSPAMD_EXPIRY_DISCRIMINATED,
+	RSPAMD_EXPIRY_INFREQUENT,
+	RSPAMD_EXPIRY_INFREQUENT_TTLS,
+	RSPAMD_EXPIRY_MAX,
+};
+
+enum {
+	RSPAMD_EXPIRY_ARG_SHA = 1,
+	RSPAMD_EXPIRY_ARG_STATE = 3,
+	RSPAMD_EXPIRY_ARG_EXPIRE = 5,
+	RSPAMD_EXPIRY_ARGC = 14,
+};
+
+struct rspamd_redis_expiry {
+	struct redis_stat_ctx *ctx;
+	struct event_base *ev_base;
+	redisAsyncContext *redis;
+	struct upstream *selected;
+	struct event timer_ev;
+	struct event timeout_ev;
+	gchar *argv[RSPAMD_EXPIRY_ARGC];
+	gsize argvlen[RSPAMD_EXPIRY_ARGC];
+	gdouble interval;
+	gdouble rate;
+	gdouble timeout;
+	gdouble step_start;
+	gboolean lazy;
+	gboolean script_loaded;
+	gboolean script_retried;
+};
+
+static void rspamd_redis_expiry_processed (redisAsyncContext *c, gpointer r,
+		gpointer priv);
+
+static void
+rspamd_redis_expiry_disconnect (struct rspamd_redis_expiry *exp)
+{
+	redisAsyncContext *redis;
+
+	if (rspamd_event_pending (&exp->timeout_ev, EV_TIMEOUT)) {
+		event_del (&exp->timeout_ev);
+	}
+
+	if (exp->redis) {
+		redis = exp->redis;
+		exp->redis = NULL;
+		/* This calls for all callbacks pending */
+		redisAsyncFree (redis);
+	}
+}
+
+static void
+rspamd_redis_expiry_schedule (struct rspamd_redis_expiry *exp, gdouble after)
+{
+	struct timeval tv;
+
+	double_to_tv (after, &tv);
+	event_add (&exp->timer_ev, &tv);
+}
+
+static void
+rspamd_redis_expiry_fail (struct rspamd_redis_expiry *exp, const gchar *err)
+{
+	msg_err ("cannot perform expiry step for %s: %s",
+			exp->ctx->stcf->symbol, err);
+
+	if (exp->selected) {
+		rspamd_upstream_fail (exp->selected, FALSE);
+	}
+
+	rspamd_redis_expiry_disconnect (exp);
+	rspamd_redis_expiry_schedule (exp, exp->interval);
+}
+
+static void
+rspamd_redis_expiry_timeout (gint fd, short what, gpointer d)
+{
+	struct rspamd_redis_expiry *exp = d;
+
+	rspamd_redis_expiry_fail (exp, "timeout");
+}
+
+static gboolean
+rspamd_redis_expiry_send (struct rspamd_redis_expiry *exp)
+{
+	if (!exp->script_loaded) {
+		if (redisAsyncCommand (exp->redis, NULL, NULL, "SCRIPT LOAD %s",
+				rspamd_redis_expiry_script) != REDIS_OK) {
+			return FALSE;
+		}
+	}
+
+	return redisAsyncCommandArgv (exp->redis, rspamd_redis_expiry_processed,
+			exp, RSPAMD_EXPIRY_ARGC, (const gchar **)exp->argv,
+			exp->argvlen) == REDIS_OK;
+}
+
+static void
+rspamd_redis_expiry_step (gint fd, short what, gpointer d)
+{
+	struct rspamd_redis_expiry *exp = d;
+	rspamd_inet_addr_t *addr;
+	struct timeval tv;
+
+	if (exp->redis == NULL) {
+		exp->selected = rspamd_upstream_get (exp->ctx->write_servers,
+				RSPAMD_UPSTREAM_MASTER_SLAVE,
+				NULL,
+				0);
+
+		if (exp->selected == NULL) {
+			msg_err ("cannot perform expiry step for %s: no upstreams reachable",
+					exp->ctx->stcf->symbol);
+			rspamd_redis_expiry_schedule (exp, exp->interval);
+
+			return;
+		}
+
+		addr = rspamd_upstream_addr (exp->selected);
+		g_assert (addr != NULL);
+
+		if (rspamd_inet_address_get_af (addr) == AF_UNIX) {
+			exp->redis = redisAsyncConnectUnix (
+					rspamd_inet_address_to_string (addr));
+		}
+		else {
+			exp->redis = redisAsyncConnect (rspamd_inet_address_to_string (addr),
+					rspamd_inet_address_get_port (addr));
+		}
+
+		if (exp->redis == NULL || exp->redis->err != 0) {
+			rspamd_redis_expiry_fail (exp, exp->redis ?
+					exp->redis->errstr : "cannot connect");
+
+			return;
+		}
+
+		redisLibeventAttach (exp->redis, exp->ev_base);
+		rspamd_redis_maybe_auth (exp->ctx, exp->redis);
+		/* A new connection might be another server */
+		exp->script_loaded = FALSE;
+	}
+
+	exp->script_retried = FALSE;
+	exp->step_start = rspamd_get_ticks (FALSE);
+
+	if (!rspamd_redis_expiry_send (exp)) {
+		rspamd_redis_expiry_fail (exp, exp->redis->errstr);
+
+		return;
+	}
+
+	double_to_tv (exp->timeout, &tv);
+	event_add (&exp->timeout_ev, &tv);
+}
+
+static void
+rspamd_redis_expiry_log (struct rspamd_redis_expiry *exp,
+		const gchar *what, guint64 steps, redisReply *counters, gint64 mean)
+{
+	guint64 c[RSPAMD_EXPIRY_MAX];
+	guint i, off = steps > 0 ? 1 : 0;
+	const gchar *significant_action;
+
+	memset (c, 0, sizeof (c));
+
+	for (i = 0; i < RSPAMD_EXPIRY_MAX && i + off < counters->elements; i ++) {
+		if (counters->element[i + off]->type == REDIS_REPLY_INTEGER) {
+			c[i] = counters->element[i + off]->integer;
+		}
+	}
+
+	significant_action = exp->lazy ? "made persistent" : "extended";
+
+	if (steps > 0) {
+		msg_info ("finished expiry cycle for %s in %uL steps%s: "
+				"%uL items checked, "
+				"%uL significant (%uL %s), %uL insignificant (%uL ttls set), "
+				"%uL common (%uL discriminated), %uL infrequent (%uL ttls set)",
+				exp->ctx->stcf->symbol, steps, exp->lazy ? " (lazy)" : "",
+				c[RSPAMD_EXPIRY_CHECKED],
+				c[RSPAMD_EXPIRY_SIGNIFICANT], c[RSPAMD_EXPIRY_EXTENDED],
+				significant_action,
+				c[RSPAMD_EXPIRY_INSIGNIFICANT],
+				c[RSPAMD_EXPIRY_INSIGNIFICANT_TTLS],
+				c[RSPAMD_EXPIRY_COMMON], c[RSPAMD_EXPIRY_DISCRIMINATED],
+				c[RSPAMD_EXPIRY_INFREQUENT], c[RSPAMD_EXPIRY_INFREQUENT_TTLS]);
+	}
+	else {
+		msg_debug ("finished expiry %s for %s: %uL items checked, "
+				"%uL significant (%uL %s), %uL insignificant (%uL ttls set), "
+				"%uL common (%uL discriminated), %uL infrequent (%uL ttls set), "
+				"%L mean",
+				what, exp->ctx->stcf->symbol,
+				c[RSPAMD_EXPIRY_CHECKED],
+				c[RSPAMD_EXPIRY_SIGNIFICANT], c[RSPAMD_EXPIRY_EXTENDED],
+				significant_action,
+				c[RSPAMD_EXPIRY_INSIGNIFICANT],
+				c[RSPAMD_EXPIRY_INSIGNIFICANT_TTLS],
+				c[RSPAMD_EXPIRY_COMMON], c[RSPAMD_EXPIRY_DISCRIMINATED],
+				c[RSPAMD_EXPIRY_INFREQUENT], c[RSPAMD_EXPIRY_INFREQUENT_TTLS],
+				mean);
+	}
+}
+
+static void
+rspamd_redis_expiry_processed (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct rspamd_redis_expiry *exp = priv;
+	redisReply *reply = r, *elt;
+	gdouble delay, elapsed;
+	guint64 checked = 0, steps = 0;
+	gboolean finished;
+
+	if (exp->redis == NULL) {
+		/* Connection has been already terminated */
+		return;
+	}
+
+	if (c->err != 0 || reply == NULL) {
+		rspamd_redis_expiry_fail (exp, c->err ? c->errstr : "no reply");
+
+		return;
+	}
+
+	if (reply->type == REDIS_REPLY_ERROR &&
+			strncmp (reply->str, "NOSCRIPT", sizeof ("NOSCRIPT") - 1) == 0 &&
+			!exp->script_retried) {
+		/* Script cache has been flushed, load it again */
+		exp->script_loaded = FALSE;
+		exp->script_retried = TRUE;
+
+		if (rspamd_redis_expiry_send (exp)) {
+			return;
+		}
+
+		rspamd_redis_expiry_fail (exp, c->errstr);
+
+		return;
+	}
+
+	if (rspamd_event_pending (&exp->timeout_ev, EV_TIMEOUT)) {
+		event_del (&exp->timeout_ev);
+	}
+
+	if (reply->type == REDIS_REPLY_STRING) {
+		/* Another node performs expiry at the moment */
+		msg_info ("skip expiry step for %s: %*s", exp->ctx->stcf->symbol,
+				(gint)reply->len, reply->str);
+		rspamd_upstream_ok (exp->selected);
+		rspamd_redis_expiry_schedule (exp, exp->interval);
+
+		return;
+	}
+
+	if (reply->type != REDIS_REPLY_ARRAY || reply->elements != 4 ||
+			reply->element[0]->type != REDIS_REPLY_STRING ||
+			reply->element[2]->type != REDIS_REPLY_ARRAY ||
+			reply->element[3]->type != REDIS_REPLY_ARRAY) {
+		rspamd_redis_expiry_fail (exp, reply->type == REDIS_REPLY_ERROR ?
+				reply->str : "bad reply");
+
+		return;
+	}
+
+	exp->script_loaded = TRUE;
+	rspamd_upstream_ok (exp->selected);
+	finished = (reply->element[0]->len == 1 && reply->element[0]->str[0] == '0');
+	elt = reply->element[2];
+
+	if (elt->elements > 0 && elt->element[0]->type == REDIS_REPLY_INTEGER) {
+		checked = elt->element[0]->integer;
+	}
+
+	rspamd_redis_expiry_log (exp, "step", 0, elt,
+			reply->element[1]->type == REDIS_REPLY_INTEGER ?
+					reply->element[1]->integer : 0);
+
+	if (finished) {
+		elt = reply->element[3];
+
+		if (elt->elements > 0 && elt->element[0]->type == REDIS_REPLY_INTEGER) {
+			steps = elt->element[0]->integer;
+		}
+
+		rspamd_redis_expiry_log (exp, "cycle", MAX (steps, 1), elt, 0);
+	}
+
+	/* Keep the average load of redis below the configured rate */
+	delay = exp->rate > 0 ? checked / exp->rate : 0;
+	elapsed = rspamd_get_ticks (FALSE) - exp->step_start;
+	delay = delay > elapsed ? delay - elapsed : 0;
+
+	if (finished) {
+		delay = MAX (delay, exp->interval);
+	}
+
+	rspamd_redis_expiry_schedule (exp, delay);
+}
+
+static void
+rspamd_redis_expiry_free (struct rspamd_redis_expiry *exp)
+{
+	guint i;
+
+	if (rspamd_event_pending (&exp->timer_ev, EV_TIMEOUT)) {
+		event_del (&exp->timer_ev);
+	}
+
+	rspamd_redis_expiry_disconnect (exp);
+
+	for (i = 0; i < RSPAMD_EXPIRY_ARGC; i ++) {
+		g_free (exp->argv[i]);
+	}
+
+	g_free (exp);
+}
+
+static gdouble
+rspamd_redis_expiry_opt_double (const ucl_object_t *opts, const gchar *name,
+		gdouble def)
+{
+	const ucl_object_t *elt;
+	gdouble val;
+
+	elt = ucl_object_lookup (opts, name);
+
+	if (elt && ucl_object_todouble_safe (elt, &val)) {
+		return val;
+	}
+
+	return def;
+}
+
+gboolean
+rspamd_redis_start_expiry (gpointer p, struct rspamd_config *cfg,
+		struct event_base *ev_base)
+{
+	struct redis_stat_ctx *ctx = REDIS_CTX (p);
+	struct rspamd_redis_expiry *exp;
+	const ucl_object_t *opts, *elt;
+	gchar hostname[256];
+	guchar sha[EVP_MAX_MD_SIZE];
+	guint shalen = 0;
+	gdouble val;
+	guint i;
+
+	if (ctx->expiry_drv != NULL) {
+		return TRUE;
+	}
+
+	if (!ctx->new_schema || ctx->expiry == 0 || !ctx->stcf->is_spam ||
+			ctx->write_servers == NULL) {
+		/* Tokens of both classes are stored in the same keys */
+		return FALSE;
+	}
+
+	opts = ucl_object_lookup (cfg->rcl_obj, "bayes_expiry");
+	elt = ucl_object_lookup (opts, "native");
+
+	if (elt && !ucl_object_toboolean (elt)) {
+		return FALSE;
+	}
+
+	exp = g_malloc0 (sizeof (*exp));
+	exp->ctx = ctx;
+	exp->ev_base = ev_base;
+	exp->interval = rspamd_redis_expiry_opt_double (opts, "interval",
+			REDIS_EXPIRY_DEFAULT_INTERVAL);
+	exp->rate = rspamd_redis_expiry_opt_double (opts, "rate",
+			REDIS_EXPIRY_DEFAULT_RATE);
+	exp->timeout = rspamd_redis_expiry_opt_double (opts, "timeout",
+			REDIS_EXPIRY_DEFAULT_TIMEOUT);
+	elt = ucl_object_lookup (ctx->stcf->clcf->opts, "lazy");
+
+	if (elt == NULL) {
+		elt = ucl_object_lookup (opts, "lazy");
+	}
+
+	exp->lazy = elt ? ucl_object_toboolean (elt) : FALSE;
+
+	memset (hostname, 0, sizeof (hostname));
+	gethostname (hostname, sizeof (hostname) - 1);
+
+	EVP_Digest (rspamd_redis_expiry_script,
+			strlen (rspamd_redis_expiry_script),
+			sha, &shalen, EVP_sha1 (), NULL);
+	exp->argv[0] = g_strdup ("EVALSHA");
+	exp->argv[RSPAMD_EXPIRY_ARG_SHA] = g_malloc (shalen * 2 + 1);
+	rspamd_encode_hex_buf (sha, shalen, exp->argv[RSPAMD_EXPIRY_ARG_SHA],
+			shalen * 2);
+	exp->argv[RSPAMD_EXPIRY_ARG_SHA][shalen * 2] = '\0';
+	exp->argv[2] = g_strdup ("1");
+	exp->argv[RSPAMD_EXPIRY_ARG_STATE] = g_strdup_printf ("%s_expiry",
+			ctx->stcf->symbol);
+	exp->argv[4] = g_strdup ("RS*_*");
+	exp->argv[RSPAMD_EXPIRY_ARG_EXPIRE] = g_strdup_printf ("%u",
+			ctx->expiry);
+	val = rspamd_redis_expiry_opt_double (opts, "batch",
+			REDIS_EXPIRY_DEFAULT_BATCH);
+	exp->argv[6] = g_strdup_printf ("%u", (guint)MAX (val, 1));
+	val = rspamd_redis_expiry_opt_double (opts, "count",
+			REDIS_EXPIRY_DEFAULT_SCAN_COUNT);
+	exp->argv[7] = g_strdup_printf ("%u", (guint)MAX (val, 1));
+	exp->argv[8] = g_strdup_printf ("%f",
+			rspamd_redis_expiry_opt_double (opts, "epsilon_common", 0.01));
+	exp->argv[9] = g_strdup_printf ("%u",
+			(guint)rspamd_redis_expiry_opt_double (opts, "common_ttl",
+					10 * 86400));
+	exp->argv[10] = g_strdup_printf ("%f",
+			rspamd_redis_expiry_opt_double (opts, "significant_factor",
+					3.0 / 4.0));
+	exp->argv[11] = g_strdup (exp->lazy ? "1" : "0");
+	exp->argv[12] = g_strdup (hostname);
+	/* Lock is released by the script, ttl protects from crashes */
+	exp->argv[13] = g_strdup_printf ("%u",
+			(guint)MAX (exp->timeout * 2, exp->interval));
+
+	for (i = 0; i < RSPAMD_EXPIRY_ARGC; i ++) {
+		exp->argvlen[i] = strlen (exp->argv[i]);
+	}
+
+	evtimer_set (&exp->timer_ev, rspamd_redis_expiry_step, exp);
+	event_base_set (ev_base, &exp->timer_ev);
+	evtimer_set (&exp->timeout_ev, rspamd_redis_expiry_timeout, exp);
+	event_base_set (ev_base, &exp->timeout_ev);
+	ctx->expiry_drv = exp;
+
+	msg_info_config ("start native expiry for %s: expire %s, batch %s, "
+			"rate %.1f tokens per second",
+			ctx->stcf->symbol, exp->argv[RSPAMD_EXPIRY_ARG_EXPIRE],
+			exp->argv[6], exp->rate);
+	rspamd_redis_expiry_schedule (exp,
+			rspamd_time_jitter (exp->interval / 10.0, 0));
+
+	return TRUE;
+}
+
 #endif
@@ -667,26 +667,25 @@ rspamd_sqlite3_runtime (struct rspamd_task *task,
 
 gboolean
 rspamd_sqlite3_process_tokens (struct rspamd_task *task,
-		GPtrArray *tokens,
+		struct rspamd_stat_tokens *tokens,
 		gint id, gpointer p)
 {
 	struct rspamd_stat_sqlite3_db *bk;
 	struct rspamd_stat_sqlite3_rt *rt = p;
 	gint64 iv = 0;
 	guint i;
-	rspamd_token_t *tok;
+	gdouble *values;
 
 	g_assert (p != NULL);
 	g_assert (tokens != NULL);
 
 	bk = rt->db;
+	values = RSPAMD_STAT_TOKENS_VALUES (tokens, id);
 
-	for (i = 0; i < tokens->len; i ++) {
-		tok = g_ptr_array_index (tokens, i);
-
+	for (i = 0; i < tokens->ntokens; i ++) {
 		if (bk == NULL) {
 			/* Statfile is does not exist, so all values are zero */
-			tok->values[id] = 0.0;
+			values[i] = 0.0;
 			continue;
 		}
 
@@ -716,11 +715,11 @@ rspamd_sqlite3_process_tokens (struct rspamd_task *task,
 
 		if (rspamd_sqlite3_run_prstmt (task->task_pool, bk->sqlite, bk->prstmt,
 				RSPAMD_STAT_BACKEND_GET_TOKEN,
-				tok->data, rt->user_id, rt->lang_id, &iv) == SQLITE_OK) {
-			tok->values[id] = iv;
+				tokens->hashes[i], rt->user_id, rt->lang_id, &iv) == SQLITE_OK) {
+			values[i] = iv;
 		}
 		else {
-			tok->values[id] = 0.0;
+			values[i] = 0.0;
 		}
 
 		if (rt->cf->is_spam) {
@@ -758,22 +757,23 @@ rspamd_sqlite3_finalize_process (struct rspamd_task *task, gpointer runtime,
 }
 
 gboolean
-rspamd_sqlite3_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
+rspamd_sqlite3_learn_tokens (struct rspamd_task *task,
+		struct rspamd_stat_tokens *tokens,
 		gint id, gpointer p)
 {
 	struct rspamd_stat_sqlite3_db *bk;
 	struct rspamd_stat_sqlite3_rt *rt = p;
 	gint64 iv = 0;
 	guint i;
-	rspamd_token_t *tok;
+	gdouble *values;
 
 	g_assert (tokens != NULL);
 	g_assert (p != NULL);
 
 	bk = rt->db;
+	values = RSPAMD_STAT_TOKENS_VALUES (tokens, id);
 
-	for (i = 0; i < tokens->len; i++) {
-		tok = g_ptr_array_index (tokens, i);
+	for (i = 0; i < tokens->ntokens; i++) {
 		if (bk == NULL) {
 			/* Statfile is does not exist, so all values are zero */
 			return FALSE;
@@ -803,11 +803,11 @@ rspamd_sqlite3_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 			}
 		}
 
-		iv = tok->values[id];
+		iv = values[i];
 
 		if (rspamd_sqlite3_run_prstmt (task->task_pool, bk->sqlite, bk->prstmt,
 				RSPAMD_STAT_BACKEND_SET_TOKEN,
-				tok->data, rt->user_id, rt->lang_id, iv) != SQLITE_OK) {
+				tokens->hashes[i], rt->user_id, rt->lang_id, iv) != SQLITE_OK) {
 			rspamd_sqlite3_run_prstmt (task->task_pool, bk->sqlite, bk->prstmt,
 					RSPAMD_STAT_BACKEND_TRANSACTION_ROLLBACK);
 			bk->in_transaction = FALSE;
@@ -102,6 +102,10 @@ struct bayes_task_closure {
 	guint64 processed_tokens;
 	guint64 total_hits;
 	guint64 text_tokens;
+	/* Counts and weights of tokens that are passed to the kernel */
+	gdouble *spam_counts;
+	gdouble *ham_counts;
+	gdouble *weights;
 	struct rspamd_task *task;
 };
 
@@ -112,12 +116,144 @@ struct bayes_task_closure {
 static const double feature_weight[] = { 0, 1, 4, 27, 256, 3125, 46656, 823543 };
 
 #define PROB_COMBINE(prob, cnt, weight, assumed) (((weight) * (assumed) + (cnt) * (prob)) / ((weight) + (cnt)))
+
+/* Number of independent accumulators in the batched kernel */
+#define BAYES_KERNEL_LANES 4
+/* Renormalise products each BAYES_KERNEL_RENORM tokens per lane */
+#define BAYES_KERNEL_RENORM 8
+
+/*
+ * Calculate spam and ham probabilities for a single token
+ */
+static inline void
+bayes_token_probs (gdouble spam_count, gdouble ham_count, gdouble fw,
+		gdouble spam_learns, gdouble ham_learns,
+		gdouble *pspam, gdouble *pham)
+{
+	gdouble spam_freq, ham_freq, spam_prob, ham_prob, total_count,
+			norm_sum, norm_sub, w;
+
+	total_count = spam_count + ham_count;
+	spam_freq = spam_count / spam_learns;
+	ham_freq = ham_count / ham_learns;
+	spam_prob = spam_freq / (spam_freq + ham_freq);
+	ham_prob = ham_freq / (spam_freq + ham_freq);
+
+	norm_sum = (spam_freq + ham_freq) * (spam_freq + ham_freq);
+	norm_sub = (spam_freq - ham_freq) * (spam_freq - ham_freq);
+	/* (spam - ham)^2 == (ham - spam)^2, so both classes use the same weight */
+	w = (norm_sub) / (norm_sum) *
+			(fw * total_count) / (4.0 * (1.0 + fw * total_count));
+
+	*pspam = PROB_COMBINE (spam_prob, total_count, w, 0.5);
+	*pham = PROB_COMBINE (ham_prob, total_count, w, 0.5);
+}
+
+/*
+ * Reference implementation: accumulates log2 of probabilities token by token
+ */
+void
+bayes_accumulate_probs_ref (const gdouble *spam_counts,
+		const gdouble *ham_counts, const gdouble *weights, gsize n,
+		gdouble spam_learns, gdouble ham_learns,
+		gdouble *spam_log, gdouble *ham_log)
+{
+	gdouble ps, ph, sl = 0, hl = 0;
+	gsize i;
+
+	spam_learns = MAX (1., spam_learns);
+	ham_learns = MAX (1., ham_learns);
+
+	for (i = 0; i < n; i ++) {
+		bayes_token_probs (spam_counts[i], ham_counts[i], weights[i],
+				spam_learns, ham_learns, &ps, &ph);
+		sl += log2 (ps);
+		hl += log2 (ph);
+	}
+
+	*spam_log = sl;
+	*ham_log = hl;
+}
+
+/*
+ * Batched implementation: tokens are processed in independent lanes, so the
+ * inner loop could be vectorised by compiler; instead of calculating log2 for
+ * each token we multiply probabilities and move exponents of the products to
+ * integer accumulators, calling log2 only once per lane
+ */
+void
+bayes_accumulate_probs (const gdouble *spam_counts,
+		const gdouble *ham_counts, const gdouble *weights, gsize n,
+		gdouble spam_learns, gdouble ham_learns,
+		gdouble *spam_log, gdouble *ham_log)
+{
+	gdouble sp[BAYES_KERNEL_LANES], hp[BAYES_KERNEL_LANES],
+			ps[BAYES_KERNEL_LANES], ph[BAYES_KERNEL_LANES];
+	gint64 se = 0, he = 0;
+	gdouble sl = 0, hl = 0;
+	gint e;
+	gsize i, nbatches, batch;
+	guint l;
+
+	spam_learns = MAX (1., spam_learns);
+	ham_learns = MAX (1., ham_learns);
+
+	for (l = 0; l < BAYES_KERNEL_LANES; l ++) {
+		sp[l] = 1.0;
+		hp[l] = 1.0;
+	}
+
+	nbatches = n / BAYES_KERNEL_LANES;
+
+	for (batch = 0; batch < nbatches; batch ++) {
+		i = batch * BAYES_KERNEL_LANES;
+
+		for (l = 0; l < BAYES_KERNEL_LANES; l ++) {
+			bayes_token_probs (spam_counts[i + l], ham_counts[i + l],
+					weights[i + l],
+					spam_learns, ham_learns, &ps[l], &ph[l]);
+		}
+
+		for (l = 0; l < BAYES_KERNEL_LANES; l ++) {
+			sp[l] *= ps[l];
+			hp[l] *= ph[l];
+		}
+
+		if ((batch + 1) % BAYES_KERNEL_RENORM == 0) {
+			for (l = 0; l < BAYES_KERNEL_LANES; l ++) {
+				sp[l] = frexp (sp[l], &e);
+				se += e;
+				hp[l] = frexp (hp[l], &e);
+				he += e;
+			}
+		}
+	}
+
+	for (l = 0; l < BAYES_KERNEL_LANES; l ++) {
+		sl += log2 (sp[l]);
+		hl += log2 (hp[l]);
+	}
+
+	/* Tail */
+	for (i = nbatches * BAYES_KERNEL_LANES; i < n; i ++) {
+		bayes_token_probs (spam_counts[i], ham_counts[i], weights[i],
+				spam_learns, ham_learns, &ps[0], &ph[0]);
+		sl += log2 (ps[0]);
+		hl += log2 (ph[0]);
+	}
+
+	*spam_log = sl + se;
+	*ham_log = hl + he;
+}
+
 /*
- * In this callback we calculate local probabilities for tokens
+ * In this callback we collect counts for tokens and select tokens that
+ * should be passed to the kernel
  */
 static void
 bayes_classify_token (struct rspamd_classifier *ctx,
-		rspamd_token_t *tok, struct bayes_task_closure *cl)
+		struct rspamd_stat_tokens *tokens, guint idx,
+		struct bayes_task_closure *cl)
 {
 	guint i;
 	gint id;
@@ -125,26 +261,20 @@ bayes_classify_token (struct rspamd_classifier *ctx,
 	struct rspamd_statfile *st;
 	struct rspamd_task *task;
 	const gchar *token_type = "txt";
-	double spam_prob, spam_freq, ham_freq, bayes_spam_prob, bayes_ham_prob,
-		ham_prob, fw, w, norm_sum, norm_sub, val;
+	double fw, val;
+	rspamd_token_t *tok = tokens->meta[idx];
+	guint flags = tokens->flags[idx];
 
 	task = cl->task;
 
-#if 0
-	if (tok->flags & RSPAMD_STAT_TOKEN_FLAG_LUA_META) {
-		/* Ignore lua metatokens for now */
-		return;
-	}
-#endif
-
-	if (tok->flags & RSPAMD_STAT_TOKEN_FLAG_META && cl->meta_skip_prob > 0) {
+	if (flags & RSPAMD_STAT_TOKEN_FLAG_META && cl->meta_skip_prob > 0) {
 		val = rspamd_random_double_fast ();
 
 		if (val <= cl->meta_skip_prob) {
 			if (tok->t1 && tok->t2) {
 				msg_debug_bayes (
 						"token(meta) %uL <%*s:%*s> probabilistically skipped",
-						tok->data,
+						tokens->hashes[idx],
 						(int) tok->t1->len, tok->t1->begin,
 						(int) tok->t2->len, tok->t2->begin);
 			}
@@ -157,7 +287,7 @@ bayes_classify_token (struct rspamd_classifier *ctx,
 		id = g_array_index (ctx->statfiles_ids, gint, i);
 		st = g_ptr_array_index (ctx->ctx->statfiles, id);
 		g_assert (st != NULL);
-		val = tok->values[id];
+		val = RSPAMD_STAT_TOKENS_VALUES (tokens, id)[idx];
 
 		if (val > 0) {
 			if (st->stcf->is_spam) {
@@ -172,37 +302,21 @@ bayes_classify_token (struct rspamd_classifier *ctx,
 		}
 	}
 
-	/* Probability for this token */
 	if (total_count > 0) {
-		spam_freq = ((double)spam_count / MAX (1., (double) ctx->spam_learns));
-		ham_freq = ((double)ham_count / MAX (1., (double)ctx->ham_learns));
-		spam_prob = spam_freq / (spam_freq + ham_freq);
-		ham_prob = ham_freq / (spam_freq + ham_freq);
-
-		if (tok->flags & RSPAMD_STAT_TOKEN_FLAG_UNIGRAM) {
+		if (flags & RSPAMD_STAT_TOKEN_FLAG_UNIGRAM) {
 			fw = 1.0;
 		}
 		else {
-			fw = feature_weight[tok->window_idx %
+			fw = feature_weight[tokens->window_idx[idx] %
 					G_N_ELEMENTS (feature_weight)];
 		}
 
-		norm_sum = (spam_freq + ham_freq) * (spam_freq + ham_freq);
-		norm_sub = (spam_freq - ham_freq) * (spam_freq - ham_freq);
-
-		w = (norm_sub) / (norm_sum) *
-				(fw * total_count) / (4.0 * (1.0 + fw * total_count));
-		bayes_spam_prob = PROB_COMBINE (spam_prob, total_count, w, 0.5);
-		norm_sub = (ham_freq - spam_freq) * (ham_freq - spam_freq);
-		w = (norm_sub) / (norm_sum) *
-				(fw * total_count) / (4.0 * (1.0 + fw * total_count));
-		bayes_ham_prob = PROB_COMBINE (ham_prob, total_count, w, 0.5);
-
-		cl->spam_prob += log2 (bayes_spam_prob);
-		cl->ham_prob += log2 (bayes_ham_prob);
+		cl->spam_counts[cl->processed_tokens] = spam_count;
+		cl->ham_counts[cl->processed_tokens] = ham_count;
+		cl->weights[cl->processed_tokens] = fw;
 		cl->processed_tokens ++;
 
-		if (!(tok->flags & RSPAMD_STAT_TOKEN_FLAG_META)) {
+		if (!(flags & RSPAMD_STAT_TOKEN_FLAG_META)) {
 			cl->text_tokens ++;
 		}
 		else {
@@ -211,31 +325,19 @@ bayes_classify_token (struct rspamd_classifier *ctx,
 
 		if (tok->t1 && tok->t2) {
 			msg_debug_bayes ("token(%s) %uL <%*s:%*s>: weight: %f, total_count: %L, "
-					"spam_count: %L, ham_count: %L,"
-					"spam_prob: %.3f, ham_prob: %.3f, "
-					"bayes_spam_prob: %.3f, bayes_ham_prob: %.3f, "
-					"current spam prob: %.3f, current ham prob: %.3f",
+					"spam_count: %L, ham_count: %L",
 					token_type,
-					tok->data,
+					tokens->hashes[idx],
 					(int) tok->t1->len, tok->t1->begin,
 					(int) tok->t2->len, tok->t2->begin,
-					fw, total_count, spam_count, ham_count,
-					spam_prob, ham_prob,
-					bayes_spam_prob, bayes_ham_prob,
-					cl->spam_prob, cl->ham_prob);
+					fw, total_count, spam_count, ham_count);
 		}
 		else {
 			msg_debug_bayes ("token(%s) %uL <?:?>: weight: %f, total_count: %L, "
-					"spam_count: %L, ham_count: %L,"
-					"spam_prob: %.3f, ham_prob: %.3f, "
-					"bayes_spam_prob: %.3f, bayes_ham_prob: %.3f, "
-					"current spam prob: %.3f, current ham prob: %.3f",
+					"spam_count: %L, ham_count: %L",
 					token_type,
-					tok->data,
-					fw, total_count, spam_count, ham_count,
-					spam_prob, ham_prob,
-					bayes_spam_prob, bayes_ham_prob,
-					cl->spam_prob, cl->ham_prob);
+					tokens->hashes[idx],
+					fw, total_count, spam_count, ham_count);
 		}
 	}
 }
@@ -252,14 +354,13 @@ bayes_init (rspamd_mempool_t *pool, struct rspamd_classifier *cl)
 
 gboolean
 bayes_classify (struct rspamd_classifier * ctx,
-		GPtrArray *tokens,
+		struct rspamd_stat_tokens *tokens,
 		struct rspamd_task *task)
 {
 	double final_prob, h, s, *pprob;
 	gchar sumbuf[32];
 	struct rspamd_statfile *st = NULL;
 	struct bayes_task_closure cl;
-	rspamd_token_t *tok;
 	guint i, text_tokens = 0;
 	gint id;
 
@@ -287,9 +388,8 @@ bayes_classify (struct rspamd_classifier * ctx,
 		}
 	}
 
-	for (i = 0; i < tokens->len; i ++) {
-		tok = g_ptr_array_index (tokens, i);
-		if (!(tok->flags & RSPAMD_STAT_TOKEN_FLAG_META)) {
+	for (i = 0; i < tokens->ntokens; i ++) {
+		if (!(tokens->flags[i] & RSPAMD_STAT_TOKEN_FLAG_META)) {
 			text_tokens ++;
 		}
 	}
@@ -297,7 +397,7 @@ bayes_classify (struct rspamd_classifier * ctx,
 	if (text_tokens == 0) {
 		msg_info_task ("skip classification as there are no text tokens, "
 				"%ud total tokens",
-				tokens->len);
+				tokens->ntokens);
 
 		return TRUE;
 	}
@@ -305,19 +405,28 @@ bayes_classify (struct rspamd_classifier * ctx,
 	/*
 	 * Skip some metatokens if we don't have enough text tokens
 	 */
-	if (text_tokens > tokens->len - text_tokens) {
+	if (text_tokens > tokens->ntokens - text_tokens) {
 		cl.meta_skip_prob = 0.0;
 	}
 	else {
-		cl.meta_skip_prob = 1.0 - text_tokens / tokens->len;
+		cl.meta_skip_prob = 1.0 - text_tokens / tokens->ntokens;
 	}
 
-	for (i = 0; i < tokens->len; i ++) {
-		tok = g_ptr_array_index (tokens, i);
+	cl.spam_counts = rspamd_mempool_alloc (task->task_pool,
+			sizeof (gdouble) * tokens->ntokens);
+	cl.ham_counts = rspamd_mempool_alloc (task->task_pool,
+			sizeof (gdouble) * tokens->ntokens);
+	cl.weights = rspamd_mempool_alloc (task->task_pool,
+			sizeof (gdouble) * tokens->ntokens);
 
-		bayes_classify_token (ctx, tok, &cl);
+	for (i = 0; i < tokens->ntokens; i ++) {
+		bayes_classify_token (ctx, tokens, i, &cl);
 	}
 
+	bayes_accumulate_probs (cl.spam_counts, cl.ham_counts, cl.weights,
+			cl.processed_tokens, ctx->spam_learns, ctx->ham_learns,
+			&cl.spam_prob, &cl.ham_prob);
+
 	h = 1 - inv_chi_square (task, cl.spam_prob, cl.processed_tokens);
 	s = 1 - inv_chi_square (task, cl.ham_prob, cl.processed_tokens);
 
@@ -332,7 +441,7 @@ bayes_classify (struct rspamd_classifier * ctx,
 				cl.spam_prob,
 				s,
 				cl.processed_tokens,
-				tokens->len,
+				tokens->ntokens,
 				cl.text_tokens);
 	}
 	else {
@@ -410,7 +519,7 @@ bayes_classify (struct rspamd_classifier * ctx,
 
 gboolean
 bayes_learn_spam (struct rspamd_classifier * ctx,
-		GPtrArray *tokens,
+		struct rspamd_stat_tokens *tokens,
 		struct rspamd_task *task,
 		gboolean is_spam,
 		gboolean unlearn,
@@ -420,6 +529,7 @@ bayes_learn_spam (struct rspamd_classifier * ctx,
 	gint id;
 	struct rspamd_statfile *st;
 	rspamd_token_t *tok;
+	gdouble *values;
 	gboolean incrementing;
 
 	g_assert (ctx != NULL);
@@ -427,54 +537,55 @@ bayes_learn_spam (struct rspamd_classifier * ctx,
 
 	incrementing = ctx->cfg->flags & RSPAMD_FLAG_CLASSIFIER_INCREMENTING_BACKEND;
 
-	for (i = 0; i < tokens->len; i++) {
+	for (i = 0; i < tokens->ntokens; i++) {
 		total_cnt = 0;
 		spam_cnt = 0;
 		ham_cnt = 0;
-		tok = g_ptr_array_index (tokens, i);
+		tok = tokens->meta[i];
 
 		for (j = 0; j < ctx->statfiles_ids->len; j++) {
 			id = g_array_index (ctx->statfiles_ids, gint, j);
 			st = g_ptr_array_index (ctx->ctx->statfiles, id);
 			g_assert (st != NULL);
+			values = RSPAMD_STAT_TOKENS_VALUES (tokens, id);
 
 			if (!!st->stcf->is_spam == !!is_spam) {
 				if (incrementing) {
-					tok->values[id] = 1;
+					values[i] = 1;
 				}
 				else {
-					tok->values[id]++;
+					values[i]++;
 				}
 
-				total_cnt += tok->values[id];
+				total_cnt += values[i];
 
 				if (st->stcf->is_spam) {
-					spam_cnt += tok->values[id];
+					spam_cnt += values[i];
 				}
 				else {
-					ham_cnt += tok->values[id];
+					ham_cnt += values[i];
 				}
 			}
 			else {
-				if (tok->values[id] > 0 && unlearn) {
+				if (values[i] > 0 && unlearn) {
 					/* Unlearning */
 					if (incrementing) {
-						tok->values[id] = -1;
+						values[i] = -1;
 					}
 					else {
-						tok->values[id]--;
+						values[i]--;
 					}
 
 					if (st->stcf->is_spam) {
-						spam_cnt += tok->values[id];
+						spam_cnt += values[i];
 					}
 					else {
-						ham_cnt += tok->values[id];
+						ham_cnt += values[i];
 					}
-					total_cnt += tok->values[id];
+					total_cnt += values[i];
 				}
 				else if (incrementing) {
-					tok->values[id] = 0;
+					values[i] = 0;
 				}
 			}
 		}
@@ -13,16 +13,17 @@ struct rspamd_task;
 struct rspamd_classifier;
 
 struct token_node_s;
+struct rspamd_stat_tokens;
 
 struct rspamd_stat_classifier {
 	char *name;
 	gboolean (*init_func)(rspamd_mempool_t *pool,
 			struct rspamd_classifier *cl);
 	gboolean (*classify_func)(struct rspamd_classifier * ctx,
-			GPtrArray *tokens,
+			struct rspamd_stat_tokens *tokens,
 			struct rspamd_task *task);
 	gboolean (*learn_spam_func)(struct rspamd_classifier * ctx,
-			GPtrArray *input,
+			struct rspamd_stat_tokens *input,
 			struct rspamd_task *task,
 			gboolean is_spam,
 			gboolean unlearn,
@@ -33,23 +34,36 @@ struct rspamd_stat_classifier {
 gboolean bayes_init (rspamd_mempool_t *pool,
 		struct rspamd_classifier *);
 gboolean bayes_classify (struct rspamd_classifier *ctx,
-		GPtrArray *tokens,
+		struct rspamd_stat_tokens *tokens,
 		struct rspamd_task *task);
 gboolean bayes_learn_spam (struct rspamd_classifier *ctx,
-		GPtrArray *tokens,
+		struct rspamd_stat_tokens *tokens,
 		struct rspamd_task *task,
 		gboolean is_spam,
 		gboolean unlearn,
 		GError **err);
 
+/*
+ * Accumulate log2 of spam and ham probabilities for tokens with the
+ * specified counts and weights, _ref version is a scalar reference
+ */
+void bayes_accumulate_probs (const gdouble *spam_counts,
+		const gdouble *ham_counts, const gdouble *weights, gsize n,
+		gdouble spam_learns, gdouble ham_learns,
+		gdouble *spam_log, gdouble *ham_log);
+void bayes_accumulate_probs_ref (const gdouble *spam_counts,
+		const gdouble *ham_counts, const gdouble *weights, gsize n,
+		gdouble spam_learns, gdouble ham_learns,
+		gdouble *spam_log, gdouble *ham_log);
+
 /* Generic lua classifier */
 gboolean lua_classifier_init (rspamd_mempool_t *pool,
 		struct rspamd_classifier *);
 gboolean lua_classifier_classify (struct rspamd_classifier *ctx,
-		GPtrArray *tokens,
+		struct rspamd_stat_tokens *tokens,
 		struct rspamd_task *task);
 gboolean lua_classifier_learn_spam (struct rspamd_classifier *ctx,
-		GPtrArray *tokens,
+		struct rspamd_stat_tokens *tokens,
 		struct rspamd_task *task,
 		gboolean is_spam,
 		gboolean unlearn,
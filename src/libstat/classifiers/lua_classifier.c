@@ -126,14 +126,13 @@ lua_classifier_init (rspamd_mempool_t *pool,
 }
 gboolean
 lua_classifier_classify (struct rspamd_classifier *cl,
-		GPtrArray *tokens,
+		struct rspamd_stat_tokens *tokens,
 		struct rspamd_task *task)
 {
 	struct rspamd_lua_classifier_ctx *ctx;
 	struct rspamd_task **ptask;
 	struct rspamd_classifier_config **pcfg;
 	lua_State *L;
-	rspamd_token_t *tok;
 	guint i;
 	guint64 v;
 
@@ -149,18 +148,17 @@ lua_classifier_classify (struct rspamd_classifier *cl,
 	*pcfg = cl->cfg;
 	rspamd_lua_setclass (L, "rspamd{classifier}", -1);
 
-	lua_createtable (L, tokens->len, 0);
+	lua_createtable (L, tokens->ntokens, 0);
 
-	for (i = 0; i < tokens->len; i ++) {
-		tok = g_ptr_array_index (tokens, i);
-		v = tok->data;
+	for (i = 0; i < tokens->ntokens; i ++) {
+		v = tokens->hashes[i];
 		lua_createtable (L, 3, 0);
 		/* High word, low word, order */
 		lua_pushinteger (L, (guint32)(v >> 32));
 		lua_rawseti (L, -2, 1);
 		lua_pushinteger (L, (guint32)(v));
 		lua_rawseti (L, -2, 2);
-		lua_pushinteger (L, tok->window_idx);
+		lua_pushinteger (L, tokens->window_idx[i]);
 		lua_rawseti (L, -2, 3);
 		lua_rawseti (L, -2, i + 1);
 	}
@@ -178,7 +176,7 @@ lua_classifier_classify (struct rspamd_classifier *cl,
 
 gboolean
 lua_classifier_learn_spam (struct rspamd_classifier *cl,
-		GPtrArray *tokens,
+		struct rspamd_stat_tokens *tokens,
 		struct rspamd_task *task,
 		gboolean is_spam,
 		gboolean unlearn,
@@ -188,7 +186,6 @@ lua_classifier_learn_spam (struct rspamd_classifier *cl,
 	struct rspamd_task **ptask;
 	struct rspamd_classifier_config **pcfg;
 	lua_State *L;
-	rspamd_token_t *tok;
 	guint i;
 	guint64 v;
 
@@ -204,19 +201,17 @@ lua_classifier_learn_spam (struct rspamd_classifier *cl,
 	*pcfg = cl->cfg;
 	rspamd_lua_setclass (L, "rspamd{classifier}", -1);
 
-	lua_createtable (L, tokens->len, 0);
+	lua_createtable (L, tokens->ntokens, 0);
 
-	for (i = 0; i < tokens->len; i ++) {
-		tok = g_ptr_array_index (tokens, i);
-		v = 0;
-		v = tok->data;
+	for (i = 0; i < tokens->ntokens; i ++) {
+		v = tokens->hashes[i];
 		lua_createtable (L, 3, 0);
 		/* High word, low word, order */
 		lua_pushinteger (L, (guint32)(v >> 32));
 		lua_rawseti (L, -2, 1);
 		lua_pushinteger (L, (guint32)(v));
 		lua_rawseti (L, -2, 2);
-		lua_pushinteger (L, tok->window_idx);
+		lua_pushinteger (L, tokens->window_idx[i]);
 		lua_rawseti (L, -2, 3);
 		lua_rawseti (L, -2, i + 1);
 	}
@@ -22,11 +22,17 @@
 #include "ucl.h"
 #include "hiredis.h"
 #include "adapters/libevent.h"
+#include "bloom.h"
 
 #define REDIS_DEFAULT_TIMEOUT 0.5
 #define REDIS_STAT_TIMEOUT 30
 #define REDIS_DEFAULT_PORT 6379
 #define DEFAULT_REDIS_KEY "learned_ids"
+/* About 12 counters per element for ~0.1% of false positives */
+#define DEFAULT_BLOOM_ELEMENTS 1000000
+#define BLOOM_COUNTERS_PER_ELEMENT 12
+#define BLOOM_WARM_TIMEOUT 600
+#define BLOOM_WARM_BATCH 1000
 
 static const gchar *M = "redis learn cache";
 
@@ -37,6 +43,11 @@ struct rspamd_redis_cache_ctx {
 	const gchar *password;
 	const gchar *dbname;
 	const gchar *redis_object;
+	const gchar *bloom_path;
+	guint64 bloom_elts;
+	rspamd_bloom_filter_t *prefilter;
+	redisAsyncContext *warm_conn;
+	guint64 warm_elts;
 	gdouble timeout;
 };
 
@@ -68,6 +79,28 @@ rspamd_redis_cache_maybe_auth (struct rspamd_redis_cache_ctx *ctx,
 	}
 }
 
+static redisAsyncContext *
+rspamd_redis_cache_connect (struct upstream *up)
+{
+	rspamd_inet_addr_t *addr;
+	redisAsyncContext *redis;
+
+	addr = rspamd_upstream_addr (up);
+	g_assert (addr != NULL);
+
+	if (rspamd_inet_address_get_af (addr) == AF_UNIX) {
+		redis = redisAsyncConnectUnix (rspamd_inet_address_to_string (addr));
+	}
+	else {
+		redis = redisAsyncConnect (rspamd_inet_address_to_string (addr),
+				rspamd_inet_address_get_port (addr));
+	}
+
+	g_assert (redis != NULL);
+
+	return redis;
+}
+
 /* Called on connection termination */
 static void
 rspamd_redis_cache_fin (gpointer data)
@@ -217,6 +250,122 @@ rspamd_stat_cache_redis_generate_id (struct rspamd_task *task)
 	rspamd_mempool_set_variable (task->task_pool, "words_hash", b32out, g_free);
 }
 
+/* Called for each batch of learned ids when the prefilter is being filled */
+static void
+rspamd_redis_cache_warm_cb (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct rspamd_redis_cache_ctx *ctx = priv;
+	redisReply *reply = r, *cursor, *elts;
+	guint i;
+
+	if (ctx->warm_conn != c) {
+		/* Connection has been closed */
+		return;
+	}
+
+	if (c->err != 0 || reply == NULL || reply->type != REDIS_REPLY_ARRAY ||
+			reply->elements != 2 ||
+			reply->element[0]->type != REDIS_REPLY_STRING ||
+			reply->element[1]->type != REDIS_REPLY_ARRAY) {
+		msg_err ("cannot load learned ids from %s to prefilter: %s",
+				ctx->redis_object, c->err ? c->errstr : "bad reply");
+		rspamd_bloom_file_set_state (ctx->prefilter, RSPAMD_BLOOM_FILE_WARMING,
+				RSPAMD_BLOOM_FILE_EMPTY);
+		ctx->warm_conn = NULL;
+
+		if (c->err == 0) {
+			redisAsyncFree (c);
+		}
+
+		return;
+	}
+
+	cursor = reply->element[0];
+	elts = reply->element[1];
+
+	/* Reply contains pairs of id and flag */
+	for (i = 0; i + 1 < elts->elements; i += 2) {
+		if (elts->element[i]->type == REDIS_REPLY_STRING) {
+			rspamd_bloom_add_buf (ctx->prefilter, elts->element[i]->str,
+					elts->element[i]->len);
+			ctx->warm_elts ++;
+		}
+	}
+
+	if (cursor->len == 1 && cursor->str[0] == '0') {
+		rspamd_bloom_file_set_state (ctx->prefilter, RSPAMD_BLOOM_FILE_WARMING,
+				RSPAMD_BLOOM_FILE_COMPLETE);
+		msg_info ("loaded %uL learned ids from %s to prefilter",
+				ctx->warm_elts, ctx->redis_object);
+		ctx->warm_conn = NULL;
+		redisAsyncFree (c);
+	}
+	else if (redisAsyncCommand (c, rspamd_redis_cache_warm_cb, ctx,
+			"HSCAN %s %b COUNT %d", ctx->redis_object,
+			cursor->str, (size_t)cursor->len, BLOOM_WARM_BATCH) != REDIS_OK) {
+		rspamd_bloom_file_set_state (ctx->prefilter, RSPAMD_BLOOM_FILE_WARMING,
+				RSPAMD_BLOOM_FILE_EMPTY);
+		ctx->warm_conn = NULL;
+		redisAsyncFree (c);
+	}
+}
+
+/*
+ * Starts filling of the prefilter with the ids stored in redis, only one
+ * process performs this for a shared prefilter file
+ */
+static void
+rspamd_redis_cache_maybe_warm (struct rspamd_redis_cache_ctx *ctx,
+		struct event_base *ev_base)
+{
+	struct upstream *up;
+	time_t changed;
+
+	if (ctx->warm_conn != NULL) {
+		return;
+	}
+
+	switch (rspamd_bloom_file_get_state (ctx->prefilter, &changed)) {
+	case RSPAMD_BLOOM_FILE_COMPLETE:
+		return;
+	case RSPAMD_BLOOM_FILE_WARMING:
+		if (changed + BLOOM_WARM_TIMEOUT >= time (NULL)) {
+			/* Another process is filling prefilter */
+			return;
+		}
+		/* Owner has likely died, restart */
+		if (!rspamd_bloom_file_set_state (ctx->prefilter,
+				RSPAMD_BLOOM_FILE_WARMING, RSPAMD_BLOOM_FILE_EMPTY)) {
+			return;
+		}
+		break;
+	default:
+		break;
+	}
+
+	up = rspamd_upstream_get (ctx->read_servers, RSPAMD_UPSTREAM_ROUND_ROBIN,
+			NULL, 0);
+
+	if (up == NULL || !rspamd_bloom_file_set_state (ctx->prefilter,
+			RSPAMD_BLOOM_FILE_EMPTY, RSPAMD_BLOOM_FILE_WARMING)) {
+		return;
+	}
+
+	ctx->warm_conn = rspamd_redis_cache_connect (up);
+	ctx->warm_elts = 0;
+	redisLibeventAttach (ctx->warm_conn, ev_base);
+	rspamd_redis_cache_maybe_auth (ctx, ctx->warm_conn);
+
+	if (redisAsyncCommand (ctx->warm_conn, rspamd_redis_cache_warm_cb, ctx,
+			"HSCAN %s 0 COUNT %d", ctx->redis_object,
+			BLOOM_WARM_BATCH) != REDIS_OK) {
+		rspamd_bloom_file_set_state (ctx->prefilter, RSPAMD_BLOOM_FILE_WARMING,
+				RSPAMD_BLOOM_FILE_EMPTY);
+		redisAsyncFree (ctx->warm_conn);
+		ctx->warm_conn = NULL;
+	}
+}
+
 static gboolean
 rspamd_redis_cache_try_ucl (struct rspamd_redis_cache_ctx *cache_ctx,
 		const ucl_object_t *obj,
@@ -302,6 +451,22 @@ rspamd_redis_cache_try_ucl (struct rspamd_redis_cache_ctx *cache_ctx,
 		cache_ctx->redis_object = ucl_object_tostring (elt);
 	}
 
+	elt = ucl_object_lookup (obj, "bloom_file");
+	if (elt) {
+		cache_ctx->bloom_path = ucl_object_tostring (elt);
+	}
+	else {
+		cache_ctx->bloom_path = NULL;
+	}
+
+	elt = ucl_object_lookup (obj, "bloom_elements");
+	if (elt && ucl_object_toint (elt) > 0) {
+		cache_ctx->bloom_elts = ucl_object_toint (elt);
+	}
+	else {
+		cache_ctx->bloom_elts = DEFAULT_BLOOM_ELEMENTS;
+	}
+
 	return TRUE;
 }
 
@@ -364,6 +529,19 @@ rspamd_stat_cache_redis_init (struct rspamd_stat_ctx *ctx,
 
 	cache_ctx->stcf = stf;
 
+	if (cache_ctx->bloom_path) {
+		GError *err = NULL;
+
+		cache_ctx->prefilter = rspamd_bloom_open_file (cache_ctx->bloom_path,
+				cache_ctx->bloom_elts * BLOOM_COUNTERS_PER_ELEMENT, &err);
+
+		if (cache_ctx->prefilter == NULL) {
+			msg_err_config ("cannot open learn cache prefilter for %s, "
+					"all lookups go to redis: %e", stf->symbol, err);
+			g_error_free (err);
+		}
+	}
+
 	return (gpointer)cache_ctx;
 }
 
@@ -374,7 +552,6 @@ rspamd_stat_cache_redis_runtime (struct rspamd_task *task,
 	struct rspamd_redis_cache_ctx *ctx = c;
 	struct rspamd_redis_cache_runtime *rt;
 	struct upstream *up;
-	rspamd_inet_addr_t *addr;
 
 	g_assert (ctx != NULL);
 
@@ -388,6 +565,27 @@ rspamd_stat_cache_redis_runtime (struct rspamd_task *task,
 		return NULL;
 	}
 
+	if (!learn) {
+		rspamd_stat_cache_redis_generate_id (task);
+
+		if (ctx->prefilter) {
+			rspamd_redis_cache_maybe_warm (ctx, task->ev_base);
+
+			if (rspamd_bloom_file_get_state (ctx->prefilter, NULL) ==
+					RSPAMD_BLOOM_FILE_COMPLETE &&
+					!rspamd_bloom_check (ctx->prefilter,
+						rspamd_mempool_get_variable (task->task_pool,
+								"words_hash"))) {
+				/* Definitely not learned, no need to ask redis */
+				rt = rspamd_mempool_alloc0 (task->task_pool, sizeof (*rt));
+				rt->task = task;
+				rt->ctx = ctx;
+
+				return rt;
+			}
+		}
+	}
+
 	if (learn) {
 		up = rspamd_upstream_get (ctx->write_servers,
 				RSPAMD_UPSTREAM_MASTER_SLAVE,
@@ -411,19 +609,7 @@ rspamd_stat_cache_redis_runtime (struct rspamd_task *task,
 	rt->task = task;
 	rt->ctx = ctx;
 
-	addr = rspamd_upstream_addr (up);
-	g_assert (addr != NULL);
-
-	if (rspamd_inet_address_get_af (addr) == AF_UNIX) {
-		rt->redis = redisAsyncConnectUnix (rspamd_inet_address_to_string (addr));
-	}
-	else {
-		rt->redis = redisAsyncConnect (rspamd_inet_address_to_string (addr),
-				rspamd_inet_address_get_port (addr));
-	}
-
-	g_assert (rt->redis != NULL);
-
+	rt->redis = rspamd_redis_cache_connect (up);
 	redisLibeventAttach (rt->redis, task->ev_base);
 
 	/* Now check stats */
@@ -431,10 +617,6 @@ rspamd_stat_cache_redis_runtime (struct rspamd_task *task,
 	event_base_set (task->ev_base, &rt->timeout_event);
 	rspamd_redis_cache_maybe_auth (ctx, rt->redis);
 
-	if (!learn) {
-		rspamd_stat_cache_redis_generate_id (task);
-	}
-
 	return rt;
 }
 
@@ -457,6 +639,11 @@ rspamd_stat_cache_redis_check (struct rspamd_task *task,
 		return RSPAMD_LEARN_INGORE;
 	}
 
+	if (rt == NULL || rt->redis == NULL) {
+		/* Prefilter has told that this message has not been learned */
+		return RSPAMD_LEARN_OK;
+	}
+
 	double_to_tv (rt->ctx->timeout, &tv);
 
 	if (redisAsyncCommand (rt->redis, rspamd_stat_cache_redis_get, rt,
@@ -492,6 +679,10 @@ rspamd_stat_cache_redis_learn (struct rspamd_task *task,
 	h = rspamd_mempool_get_variable (task->task_pool, "words_hash");
 	g_assert (h != NULL);
 
+	if (rt->ctx->prefilter && !(task->flags & RSPAMD_TASK_FLAG_UNLEARN)) {
+		rspamd_bloom_add (rt->ctx->prefilter, h);
+	}
+
 	double_to_tv (rt->ctx->timeout, &tv);
 	flag = (task->flags & RSPAMD_TASK_FLAG_LEARN_SPAM) ? 1 : -1;
 
@@ -512,5 +703,24 @@ rspamd_stat_cache_redis_learn (struct rspamd_task *task,
 void
 rspamd_stat_cache_redis_close (gpointer c)
 {
+	struct rspamd_redis_cache_ctx *ctx = c;
+	redisAsyncContext *redis;
 
+	if (ctx == NULL) {
+		return;
+	}
+
+	if (ctx->warm_conn) {
+		redis = ctx->warm_conn;
+		ctx->warm_conn = NULL;
+		/* Not finished warm up is restarted by another process */
+		rspamd_bloom_file_set_state (ctx->prefilter, RSPAMD_BLOOM_FILE_WARMING,
+				RSPAMD_BLOOM_FILE_EMPTY);
+		redisAsyncFree (redis);
+	}
+
+	if (ctx->prefilter) {
+		rspamd_bloom_destroy (ctx->prefilter);
+		ctx->prefilter = NULL;
+	}
 }
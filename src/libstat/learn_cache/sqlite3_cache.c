@@ -23,6 +23,7 @@
 #include "fstring.h"
 #include "message.h"
 #include "libutil/sqlite_utils.h"
+#include "bloom.h"
 
 static const char *create_tables_sql =
 		""
@@ -34,6 +35,11 @@ static const char *create_tables_sql =
 		"";
 
 #define SQLITE_CACHE_PATH RSPAMD_DBDIR "/learn_cache.sqlite"
+/* About 12 counters per element for ~0.1% of false positives */
+#define SQLITE_CACHE_BLOOM_ELEMENTS 1000000
+#define SQLITE_CACHE_BLOOM_COUNTERS 12
+/* Warm up is restarted if the process that has started it has not finished */
+#define SQLITE_CACHE_BLOOM_WARM_TIMEOUT 600
 
 enum rspamd_stat_sqlite3_stmt_idx {
 	RSPAMD_STAT_CACHE_TRANSACTION_START_IM = 0,
@@ -109,8 +115,55 @@ static struct rspamd_sqlite3_prstmt prepared_stmts[RSPAMD_STAT_CACHE_MAX] =
 struct rspamd_stat_sqlite3_ctx {
 	sqlite3 *db;
 	GArray *prstmt;
+	rspamd_bloom_filter_t *prefilter;
 };
 
+/*
+ * Fills prefilter with all digests stored in the cache, it is done once for
+ * a newly created prefilter file
+ */
+static void
+rspamd_stat_cache_sqlite3_warm (struct rspamd_stat_sqlite3_ctx *ctx,
+		const gchar *path)
+{
+	sqlite3_stmt *stmt;
+	guint64 nelts = 0;
+	time_t changed;
+
+	if (rspamd_bloom_file_get_state (ctx->prefilter, &changed) ==
+			RSPAMD_BLOOM_FILE_WARMING &&
+			changed + SQLITE_CACHE_BLOOM_WARM_TIMEOUT < time (NULL)) {
+		rspamd_bloom_file_set_state (ctx->prefilter, RSPAMD_BLOOM_FILE_WARMING,
+				RSPAMD_BLOOM_FILE_EMPTY);
+	}
+
+	if (!rspamd_bloom_file_set_state (ctx->prefilter, RSPAMD_BLOOM_FILE_EMPTY,
+			RSPAMD_BLOOM_FILE_WARMING)) {
+		return;
+	}
+
+	if (sqlite3_prepare_v2 (ctx->db, "SELECT digest FROM learns;", -1,
+			&stmt, NULL) != SQLITE_OK) {
+		msg_err ("cannot load learned digests from %s: %s",
+				path, sqlite3_errmsg (ctx->db));
+		rspamd_bloom_file_set_state (ctx->prefilter, RSPAMD_BLOOM_FILE_WARMING,
+				RSPAMD_BLOOM_FILE_EMPTY);
+
+		return;
+	}
+
+	while (sqlite3_step (stmt) == SQLITE_ROW) {
+		rspamd_bloom_add_buf (ctx->prefilter, sqlite3_column_blob (stmt, 0),
+				sqlite3_column_bytes (stmt, 0));
+		nelts ++;
+	}
+
+	sqlite3_finalize (stmt);
+	rspamd_bloom_file_set_state (ctx->prefilter, RSPAMD_BLOOM_FILE_WARMING,
+			RSPAMD_BLOOM_FILE_COMPLETE);
+	msg_info ("loaded %uL learned digests from %s to prefilter", nelts, path);
+}
+
 gpointer
 rspamd_stat_cache_sqlite3_init (struct rspamd_stat_ctx *ctx,
 		struct rspamd_config *cfg,
@@ -120,7 +173,8 @@ rspamd_stat_cache_sqlite3_init (struct rspamd_stat_ctx *ctx,
 	struct rspamd_stat_sqlite3_ctx *new = NULL;
 	const ucl_object_t *elt;
 	gchar dbpath[PATH_MAX];
-	const gchar *path = SQLITE_CACHE_PATH;
+	const gchar *path = SQLITE_CACHE_PATH, *bloom_path = NULL;
+	guint64 bloom_elts = SQLITE_CACHE_BLOOM_ELEMENTS;
 	sqlite3 *sqlite;
 	GError *err = NULL;
 
@@ -130,6 +184,18 @@ rspamd_stat_cache_sqlite3_init (struct rspamd_stat_ctx *ctx,
 		if (elt != NULL) {
 			path = ucl_object_tostring (elt);
 		}
+
+		elt = ucl_object_lookup (cf, "bloom_file");
+
+		if (elt != NULL) {
+			bloom_path = ucl_object_tostring (elt);
+		}
+
+		elt = ucl_object_lookup (cf, "bloom_elements");
+
+		if (elt != NULL && ucl_object_toint (elt) > 0) {
+			bloom_elts = ucl_object_toint (elt);
+		}
 	}
 
 	rspamd_snprintf (dbpath, sizeof (dbpath), "%s", path);
@@ -156,6 +222,20 @@ rspamd_stat_cache_sqlite3_init (struct rspamd_stat_ctx *ctx,
 			g_free (new);
 			new = NULL;
 		}
+		else if (bloom_path != NULL) {
+			new->prefilter = rspamd_bloom_open_file (bloom_path,
+					bloom_elts * SQLITE_CACHE_BLOOM_COUNTERS, &err);
+
+			if (new->prefilter == NULL) {
+				msg_err ("cannot open learn cache prefilter, "
+						"all lookups go to sqlite: %e", err);
+				g_error_free (err);
+				err = NULL;
+			}
+			else {
+				rspamd_stat_cache_sqlite3_warm (new, dbpath);
+			}
+		}
 	}
 
 	return new;
@@ -206,6 +286,18 @@ rspamd_stat_cache_sqlite3_check (struct rspamd_task *task,
 
 		rspamd_cryptobox_hash_final (&st, out);
 
+		/* Save hash into variables */
+		rspamd_mempool_set_variable (task->task_pool, "words_hash", out, NULL);
+
+		if (ctx->prefilter &&
+				rspamd_bloom_file_get_state (ctx->prefilter, NULL) ==
+						RSPAMD_BLOOM_FILE_COMPLETE &&
+				!rspamd_bloom_check_buf (ctx->prefilter, out,
+						rspamd_cryptobox_HASHBYTES)) {
+			/* Definitely not learned */
+			return RSPAMD_LEARN_OK;
+		}
+
 		rspamd_sqlite3_run_prstmt (task->task_pool, ctx->db, ctx->prstmt,
 				RSPAMD_STAT_CACHE_TRANSACTION_START_DEF);
 		rc = rspamd_sqlite3_run_prstmt (task->task_pool, ctx->db, ctx->prstmt,
@@ -214,9 +306,6 @@ rspamd_stat_cache_sqlite3_check (struct rspamd_task *task,
 		rspamd_sqlite3_run_prstmt (task->task_pool, ctx->db, ctx->prstmt,
 				RSPAMD_STAT_CACHE_TRANSACTION_COMMIT);
 
-		/* Save hash into variables */
-		rspamd_mempool_set_variable (task->task_pool, "words_hash", out, NULL);
-
 		if (rc == SQLITE_OK) {
 			/* We have some existing record in the table */
 			if (!!flag == !!is_spam) {
@@ -260,6 +349,11 @@ rspamd_stat_cache_sqlite3_learn (struct rspamd_task *task,
 				(gint64)rspamd_cryptobox_HASHBYTES, h, flag);
 		rspamd_sqlite3_run_prstmt (task->task_pool, ctx->db, ctx->prstmt,
 				RSPAMD_STAT_CACHE_TRANSACTION_COMMIT);
+
+		if (ctx->prefilter) {
+			rspamd_bloom_add_buf (ctx->prefilter, h,
+					rspamd_cryptobox_HASHBYTES);
+		}
 	}
 	else {
 		rspamd_sqlite3_run_prstmt (task->task_pool, ctx->db, ctx->prstmt,
@@ -285,6 +379,11 @@ rspamd_stat_cache_sqlite3_close (gpointer c)
 	if (ctx != NULL) {
 		rspamd_sqlite3_close_prstmt (ctx->db, ctx->prstmt);
 		sqlite3_close (ctx->db);
+
+		if (ctx->prefilter) {
+			rspamd_bloom_destroy (ctx->prefilter);
+		}
+
 		g_free (ctx);
 	}
 
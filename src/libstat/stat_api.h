@@ -32,6 +32,8 @@
 #define RSPAMD_STAT_TOKEN_FLAG_EXCEPTION (1 << 3)
 #define RSPAMD_STAT_TOKEN_FLAG_SUBJECT (1 << 4)
 #define RSPAMD_STAT_TOKEN_FLAG_UNIGRAM (1 << 5)
+/* Word has non ASCII characters, set for text parts words only */
+#define RSPAMD_STAT_TOKEN_FLAG_NON_ASCII (1 << 6)
 
 typedef struct rspamd_stat_token_s {
 	const gchar *begin;
@@ -45,9 +47,26 @@ typedef struct token_node_s {
 	guint flags;
 	rspamd_stat_token_t *t1;
 	rspamd_stat_token_t *t2;
-	gdouble values[];
 } rspamd_token_t;
 
+/*
+ * Contiguous (structure of arrays) representation of task tokens: hashes,
+ * flags and window indexes are stored in plain arrays, whilst values are
+ * stored in a matrix with one row of `ntokens` elements per statfile
+ */
+struct rspamd_stat_tokens {
+	guint64 *hashes;
+	guint *flags;
+	guint *window_idx;
+	gdouble *values;
+	rspamd_token_t **meta; /* original tokens, used for t1/t2 only */
+	guint ntokens;
+	guint nstatfiles;
+};
+
+#define RSPAMD_STAT_TOKENS_VALUES(toks, id) \
+	((toks)->values + (gsize)(id) * (toks)->ntokens)
+
 struct rspamd_stat_ctx;
 
 /**
@@ -73,6 +92,15 @@ void rspamd_stat_init (struct rspamd_config *cfg, struct event_base *ev_base);
  */
 void rspamd_stat_close (void);
 
+/**
+ * Start native expiry of tokens for all backends that support it
+ * @param cfg configuration
+ * @param ev_base event base used for expiry steps
+ * @return number of statfiles whose expiry has been started
+ */
+guint rspamd_stat_start_expiry (struct rspamd_config *cfg,
+		struct event_base *ev_base);
+
 /**
  * Tokenize task
  * @param st_ctx
@@ -91,6 +119,16 @@ void rspamd_stat_process_tokenize (struct rspamd_stat_ctx *st_ctx,
 rspamd_stat_result_t rspamd_stat_classify (struct rspamd_task *task,
 		lua_State *L, guint stage, GError **err);
 
+/**
+ * Returns score of the task for a recipient: symbols of per user
+ * classifiers are replaced with the recipient ones
+ * @param task
+ * @param rr recipient result
+ * @return score for the recipient
+ */
+gdouble rspamd_stat_rcpt_score (struct rspamd_task *task,
+		struct rspamd_task_rcpt_result *rr);
+
 
 /**
  * Check if a task should be learned and set the appropriate flags for it
@@ -189,6 +189,19 @@ rspamd_stat_init (struct rspamd_config *cfg, struct event_base *ev_base)
 			continue;
 		}
 
+		if (clf->opts) {
+			const ucl_object_t *users_enabled;
+
+			users_enabled = ucl_object_lookup_any (clf->opts, "per_user",
+					"users_enabled", NULL);
+
+			if (users_enabled != NULL &&
+					(ucl_object_type (users_enabled) != UCL_BOOLEAN ||
+					ucl_object_toboolean (users_enabled))) {
+				clf->flags |= RSPAMD_FLAG_CLASSIFIER_PER_USER;
+			}
+		}
+
 		if (!(clf->flags & RSPAMD_FLAG_CLASSIFIER_NO_BACKEND)) {
 			bk = rspamd_stat_get_backend (clf->backend);
 
@@ -348,6 +361,35 @@ rspamd_stat_close (void)
 	stat_ctx = NULL;
 }
 
+guint
+rspamd_stat_start_expiry (struct rspamd_config *cfg,
+		struct event_base *ev_base)
+{
+	struct rspamd_stat_ctx *st_ctx;
+	struct rspamd_statfile *st;
+	guint i, nstarted = 0;
+
+	st_ctx = rspamd_stat_get_ctx ();
+	g_assert (st_ctx != NULL);
+
+	for (i = 0; i < st_ctx->statfiles->len; i ++) {
+		st = g_ptr_array_index (st_ctx->statfiles, i);
+
+		if (st->bkcf == NULL ||
+				(st->classifier->cfg->flags & RSPAMD_FLAG_CLASSIFIER_NO_BACKEND)) {
+			continue;
+		}
+#ifdef WITH_HIREDIS
+		if (strcmp (st->backend->name, "redis") == 0 &&
+				rspamd_redis_start_expiry (st->bkcf, cfg, ev_base)) {
+			nstarted ++;
+		}
+#endif
+	}
+
+	return nstarted;
+}
+
 struct rspamd_stat_ctx *
 rspamd_stat_get_ctx (void)
 {
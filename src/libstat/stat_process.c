@@ -19,6 +19,7 @@
 #include "stat_internal.h"
 #include "libmime/message.h"
 #include "libmime/images.h"
+#include "libmime/filter.h"
 #include "libserver/html.h"
 #include "lua/lua_common.h"
 #include "libserver/mempool_vars_internal.h"
@@ -40,7 +41,7 @@ rspamd_stat_tokenize_header (struct rspamd_task *task,
 	guint i;
 	rspamd_stat_token_t str;
 
-	hdrs = g_hash_table_lookup (task->raw_headers, name);
+	hdrs = rspamd_message_get_header_array (task, name, FALSE);
 	str.flags = RSPAMD_STAT_TOKEN_FLAG_META;
 
 	if (hdrs != NULL) {
@@ -51,14 +52,9 @@ rspamd_stat_tokenize_header (struct rspamd_task *task,
 				str.len = strlen (cur->name);
 				g_array_append_val (ar, str);
 			}
-			if (cur->decoded != NULL) {
-				str.begin = cur->decoded;
-				str.len = strlen (cur->decoded);
-				g_array_append_val (ar, str);
-			}
-			else if (cur->value != NULL) {
-				str.begin = cur->value;
-				str.len = strlen (cur->value);
+			if (cur->value != NULL) {
+				str.begin = rspamd_mime_header_get_decoded (task->task_pool, cur);
+				str.len = strlen (str.begin);
 				g_array_append_val (ar, str);
 			}
 		}
@@ -304,6 +300,39 @@ rspamd_stat_tokenize_parts_metadata (struct rspamd_stat_ctx *st_ctx,
 			rspamd_array_free_hard, ar);
 }
 
+/*
+ * Convert tokens produced by tokenizer to the contiguous representation
+ */
+static struct rspamd_stat_tokens *
+rspamd_stat_tokens_build (struct rspamd_stat_ctx *st_ctx,
+		struct rspamd_task *task)
+{
+	struct rspamd_stat_tokens *toks;
+	rspamd_token_t *st_tok;
+	guint i;
+
+	toks = rspamd_mempool_alloc (task->task_pool, sizeof (*toks));
+	toks->ntokens = task->tokens->len;
+	toks->nstatfiles = st_ctx->statfiles->len;
+	toks->meta = (rspamd_token_t **)task->tokens->pdata;
+	toks->hashes = rspamd_mempool_alloc (task->task_pool,
+			sizeof (*toks->hashes) * toks->ntokens);
+	toks->flags = rspamd_mempool_alloc (task->task_pool,
+			sizeof (*toks->flags) * toks->ntokens);
+	toks->window_idx = rspamd_mempool_alloc (task->task_pool,
+			sizeof (*toks->window_idx) * toks->ntokens);
+	toks->values = rspamd_mempool_alloc0 (task->task_pool,
+			sizeof (*toks->values) * toks->ntokens * toks->nstatfiles);
+
+	PTR_ARRAY_FOREACH (task->tokens, i, st_tok) {
+		toks->hashes[i] = st_tok->data;
+		toks->flags[i] = st_tok->flags;
+		toks->window_idx[i] = st_tok->window_idx;
+	}
+
+	return toks;
+}
+
 /*
  * Tokenize task using the tokenizer specified
  */
@@ -314,7 +343,6 @@ rspamd_stat_process_tokenize (struct rspamd_stat_ctx *st_ctx,
 	struct rspamd_mime_text_part *part;
 	rspamd_cryptobox_hash_state_t hst;
 	rspamd_stat_token_t *tok;
-	rspamd_token_t *st_tok;
 	GArray *words;
 	gchar *sub = NULL;
 	guint i, reserved_len = 0;
@@ -399,14 +427,12 @@ rspamd_stat_process_tokenize (struct rspamd_stat_ctx *st_ctx,
 	}
 
 	rspamd_stat_tokenize_parts_metadata (st_ctx, task);
+	task->stat_tokens = rspamd_stat_tokens_build (st_ctx, task);
 
 	/* Produce signature */
 	rspamd_cryptobox_hash_init (&hst, NULL, 0);
-
-	PTR_ARRAY_FOREACH (task->tokens, i, st_tok) {
-		rspamd_cryptobox_hash_update (&hst, (guchar *)&st_tok->data,
-				sizeof (st_tok->data));
-	}
+	rspamd_cryptobox_hash_update (&hst, (guchar *)task->stat_tokens->hashes,
+			sizeof (*task->stat_tokens->hashes) * task->stat_tokens->ntokens);
 
 	rspamd_cryptobox_hash_final (&hst, hout);
 	b32_hout = rspamd_encode_base32 (hout, sizeof (hout));
@@ -486,7 +512,7 @@ rspamd_stat_backends_process (struct rspamd_stat_ctx *st_ctx,
 		bk_run = g_ptr_array_index (task->stat_runtimes, i);
 
 		if (bk_run != NULL) {
-			st->backend->process_tokens (task, task->tokens, i, bk_run);
+			st->backend->process_tokens (task, task->stat_tokens, i, bk_run);
 		}
 	}
 }
@@ -620,9 +646,309 @@ rspamd_stat_classifiers_process (struct rspamd_stat_ctx *st_ctx,
 				continue;
 			}
 
-			cl->subrs->classify_func (cl, task->tokens, task);
+			cl->subrs->classify_func (cl, task->stat_tokens, task);
+		}
+	}
+}
+
+/*
+ * Per recipient classification: tokens are shared with the task whilst
+ * values and backends runtimes are separate for each recipient, so backends
+ * requests for all recipients are performed in parallel. Backends get user
+ * from the principal recipient, so it is overridden for each recipient
+ */
+static void
+rspamd_stat_set_principal (struct rspamd_task *task, const gchar *rcpt)
+{
+	rspamd_mempool_set_variable (task->task_pool,
+			RSPAMD_MEMPOOL_PRINCIPAL_RECIPIENT, (gpointer)rcpt, NULL);
+}
+
+static gboolean
+rspamd_stat_has_per_user (struct rspamd_stat_ctx *st_ctx,
+		struct rspamd_task *task)
+{
+	guint i;
+	struct rspamd_statfile *st;
+
+	for (i = 0; i < st_ctx->statfiles->len; i++) {
+		st = g_ptr_array_index (st_ctx->statfiles, i);
+
+		if ((st->classifier->cfg->flags & RSPAMD_FLAG_CLASSIFIER_PER_USER) &&
+				g_ptr_array_index (task->stat_runtimes, i) != NULL) {
+			return TRUE;
 		}
 	}
+
+	return FALSE;
+}
+
+static void
+rspamd_stat_rcpt_preprocess (struct rspamd_stat_ctx *st_ctx,
+		struct rspamd_task *task)
+{
+	guint i, j;
+	struct rspamd_statfile *st;
+	struct rspamd_email_address *addr;
+	struct rspamd_task_rcpt_result *rr, *cur;
+	const gchar *principal;
+	gpointer stat_user, bk_run;
+	gchar *rcpt;
+	gboolean dup;
+	gsize values_len;
+
+	if (task->rcpt_envelope == NULL || task->stat_tokens == NULL ||
+			!rspamd_stat_has_per_user (st_ctx, task)) {
+		return;
+	}
+
+	principal = rspamd_task_get_principal_recipient (task);
+	stat_user = rspamd_mempool_get_variable (task->task_pool, "stat_user");
+	values_len = sizeof (gdouble) * task->stat_tokens->ntokens *
+			task->stat_tokens->nstatfiles;
+
+	PTR_ARRAY_FOREACH (task->rcpt_envelope, i, addr) {
+		if (addr->addr == NULL || addr->addr_len == 0) {
+			continue;
+		}
+
+		rcpt = rspamd_mempool_alloc (task->task_pool, addr->addr_len + 1);
+		rspamd_strlcpy (rcpt, addr->addr, addr->addr_len + 1);
+		rspamd_str_lc (rcpt, addr->addr_len);
+		dup = FALSE;
+
+		PTR_ARRAY_FOREACH (task->rcpt_results, j, cur) {
+			if (strcmp (cur->rcpt, rcpt) == 0) {
+				dup = TRUE;
+				break;
+			}
+		}
+
+		if (dup) {
+			continue;
+		}
+
+		rr = rspamd_mempool_alloc0 (task->task_pool, sizeof (*rr));
+		rr->rcpt = rcpt;
+		g_ptr_array_add (task->rcpt_results, rr);
+
+		if (principal && strcmp (principal, rcpt) == 0) {
+			/* Task classification is used for this recipient */
+			continue;
+		}
+
+		rr->stat_tokens = rspamd_mempool_alloc (task->task_pool,
+				sizeof (*rr->stat_tokens));
+		memcpy (rr->stat_tokens, task->stat_tokens, sizeof (*rr->stat_tokens));
+		rr->stat_tokens->values = rspamd_mempool_alloc0 (task->task_pool,
+				values_len);
+		rr->stat_runtimes = g_ptr_array_sized_new (st_ctx->statfiles->len);
+		g_ptr_array_set_size (rr->stat_runtimes, st_ctx->statfiles->len);
+		rspamd_mempool_add_destructor (task->task_pool,
+				rspamd_ptr_array_free_hard, rr->stat_runtimes);
+		rspamd_stat_set_principal (task, rcpt);
+
+		for (j = 0; j < st_ctx->statfiles->len; j ++) {
+			st = g_ptr_array_index (st_ctx->statfiles, j);
+			bk_run = NULL;
+
+			if ((st->classifier->cfg->flags & RSPAMD_FLAG_CLASSIFIER_PER_USER) &&
+					g_ptr_array_index (task->stat_runtimes, j) != NULL) {
+				bk_run = st->backend->runtime (task, st->stcf, FALSE, st->bkcf);
+
+				if (bk_run == NULL) {
+					msg_err_task ("cannot init backend %s for statfile %s "
+							"and recipient %s",
+							st->backend->name, st->stcf->symbol, rcpt);
+				}
+			}
+
+			g_ptr_array_index (rr->stat_runtimes, j) = bk_run;
+		}
+	}
+
+	rspamd_stat_set_principal (task, principal);
+	rspamd_mempool_set_variable (task->task_pool, "stat_user", stat_user, NULL);
+}
+
+static void
+rspamd_stat_rcpt_backends_process (struct rspamd_stat_ctx *st_ctx,
+		struct rspamd_task *task)
+{
+	guint i, j;
+	struct rspamd_statfile *st;
+	struct rspamd_task_rcpt_result *rr;
+	const gchar *principal;
+	gpointer bk_run;
+
+	principal = rspamd_task_get_principal_recipient (task);
+
+	PTR_ARRAY_FOREACH (task->rcpt_results, i, rr) {
+		if (rr->stat_runtimes == NULL) {
+			continue;
+		}
+
+		rspamd_stat_set_principal (task, rr->rcpt);
+
+		for (j = 0; j < st_ctx->statfiles->len; j ++) {
+			st = g_ptr_array_index (st_ctx->statfiles, j);
+			bk_run = g_ptr_array_index (rr->stat_runtimes, j);
+
+			if (bk_run != NULL) {
+				st->backend->process_tokens (task, rr->stat_tokens, j, bk_run);
+			}
+		}
+	}
+
+	rspamd_stat_set_principal (task, principal);
+}
+
+static void
+rspamd_stat_rcpt_classifiers_process (struct rspamd_stat_ctx *st_ctx,
+		struct rspamd_task *task)
+{
+	guint i, j, k, id;
+	struct rspamd_classifier *cl;
+	struct rspamd_statfile *st;
+	struct rspamd_task_rcpt_result *rr;
+	struct rspamd_metric_result *task_result;
+	gpointer bk_run, prob;
+	gulong spam_learns, ham_learns, saved_spam, saved_ham;
+	gboolean skip;
+
+	task_result = task->result;
+	/* Classifiers export the last probability */
+	prob = rspamd_mempool_get_variable (task->task_pool, "bayes_prob");
+
+	PTR_ARRAY_FOREACH (task->rcpt_results, i, rr) {
+		if (rr->stat_runtimes == NULL) {
+			continue;
+		}
+
+		skip = FALSE;
+
+		for (j = 0; j < st_ctx->statfiles->len; j ++) {
+			st = g_ptr_array_index (st_ctx->statfiles, j);
+			bk_run = g_ptr_array_index (rr->stat_runtimes, j);
+
+			if (bk_run != NULL &&
+					!st->backend->finalize_process (task, bk_run, st_ctx)) {
+				skip = TRUE;
+			}
+		}
+
+		if (skip) {
+			msg_info_task ("skip statistics for recipient %s: backend failure",
+					rr->rcpt);
+			continue;
+		}
+
+		/* Symbols of classifiers are inserted to the recipient result */
+		task->result = NULL;
+		rr->result = rspamd_create_metric_result (task);
+		task->result = rr->result;
+
+		for (j = 0; j < st_ctx->classifiers->len; j ++) {
+			cl = g_ptr_array_index (st_ctx->classifiers, j);
+
+			if (!(cl->cfg->flags & RSPAMD_FLAG_CLASSIFIER_PER_USER)) {
+				continue;
+			}
+
+			if ((cl->cfg->min_tokens > 0 &&
+					task->tokens->len < cl->cfg->min_tokens) ||
+					(cl->cfg->max_tokens > 0 &&
+					task->tokens->len > cl->cfg->max_tokens)) {
+				continue;
+			}
+
+			skip = FALSE;
+			spam_learns = 0;
+			ham_learns = 0;
+
+			for (k = 0; k < cl->statfiles_ids->len; k ++) {
+				id = g_array_index (cl->statfiles_ids, gint, k);
+				bk_run = g_ptr_array_index (rr->stat_runtimes, id);
+				st = g_ptr_array_index (st_ctx->statfiles, id);
+
+				if (bk_run == NULL) {
+					skip = TRUE;
+					break;
+				}
+
+				if (st->stcf->is_spam) {
+					spam_learns += st->backend->total_learns (task, bk_run,
+							st_ctx);
+				}
+				else {
+					ham_learns += st->backend->total_learns (task, bk_run,
+							st_ctx);
+				}
+			}
+
+			if (skip) {
+				continue;
+			}
+
+			saved_spam = cl->spam_learns;
+			saved_ham = cl->ham_learns;
+			cl->spam_learns = spam_learns;
+			cl->ham_learns = ham_learns;
+			cl->subrs->classify_func (cl, rr->stat_tokens, task);
+			cl->spam_learns = saved_spam;
+			cl->ham_learns = saved_ham;
+		}
+
+		task->result = task_result;
+	}
+
+	rspamd_mempool_set_variable (task->task_pool, "bayes_prob", prob, NULL);
+}
+
+gdouble
+rspamd_stat_rcpt_score (struct rspamd_task *task,
+		struct rspamd_task_rcpt_result *rr)
+{
+	struct rspamd_stat_ctx *st_ctx;
+	struct rspamd_statfile *st;
+	struct rspamd_symbol_result *res;
+	gdouble score;
+	khiter_t k;
+	guint i;
+
+	score = task->result->score;
+
+	if (rr->result == NULL) {
+		return score;
+	}
+
+	st_ctx = rspamd_stat_get_ctx ();
+
+	for (i = 0; i < st_ctx->statfiles->len; i ++) {
+		st = g_ptr_array_index (st_ctx->statfiles, i);
+
+		if (!(st->classifier->cfg->flags & RSPAMD_FLAG_CLASSIFIER_PER_USER)) {
+			continue;
+		}
+
+		k = kh_get (rspamd_symbols_hash, task->result->symbols,
+				st->stcf->symbol);
+
+		if (k != kh_end (task->result->symbols)) {
+			res = &kh_value (task->result->symbols, k);
+			score -= res->score;
+		}
+
+		k = kh_get (rspamd_symbols_hash, rr->result->symbols,
+				st->stcf->symbol);
+
+		if (k != kh_end (rr->result->symbols)) {
+			res = &kh_value (rr->result->symbols, k);
+			score += res->score;
+		}
+	}
+
+	return score;
 }
 
 rspamd_stat_result_t
@@ -643,10 +969,18 @@ rspamd_stat_classify (struct rspamd_task *task, lua_State *L, guint stage,
 	if (stage == RSPAMD_TASK_STAGE_CLASSIFIERS_PRE) {
 		/* Preprocess tokens */
 		rspamd_stat_preprocess (st_ctx, task, FALSE);
+
+		if (task->rcpt_results) {
+			rspamd_stat_rcpt_preprocess (st_ctx, task);
+		}
 	}
 	else if (stage == RSPAMD_TASK_STAGE_CLASSIFIERS) {
 		/* Process backends */
 		rspamd_stat_backends_process (st_ctx, task);
+
+		if (task->rcpt_results) {
+			rspamd_stat_rcpt_backends_process (st_ctx, task);
+		}
 	}
 	else if (stage == RSPAMD_TASK_STAGE_CLASSIFIERS_POST) {
 		/* Process classifiers */
@@ -654,6 +988,10 @@ rspamd_stat_classify (struct rspamd_task *task, lua_State *L, guint stage,
 			rspamd_stat_classifiers_process (st_ctx, task);
 		}
 		/* Do not process classifiers on backend failures */
+
+		if (task->rcpt_results) {
+			rspamd_stat_rcpt_classifiers_process (st_ctx, task);
+		}
 	}
 
 	task->processed_stages |= stage;
@@ -829,7 +1167,7 @@ rspamd_stat_classifiers_learn (struct rspamd_stat_ctx *st_ctx,
 			break;
 		}
 
-		if (cl->subrs->learn_spam_func (cl, task->tokens, task, spam,
+		if (cl->subrs->learn_spam_func (cl, task->stat_tokens, task, spam,
 				task->flags & RSPAMD_TASK_FLAG_UNLEARN, err)) {
 			learned = TRUE;
 		}
@@ -928,7 +1266,7 @@ rspamd_stat_backends_learn (struct rspamd_stat_ctx *st_ctx,
 				}
 			}
 
-			if (!st->backend->learn_tokens (task, task->tokens, id, bk_run)) {
+			if (!st->backend->learn_tokens (task, task->stat_tokens, id, bk_run)) {
 				if (err && *err == NULL) {
 					g_set_error (err, rspamd_stat_quark (), 500, "Cannot push "
 							"learned results to the backend");
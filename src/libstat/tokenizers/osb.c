@@ -252,10 +252,94 @@ rspamd_tokenizer_osb_is_compat (struct rspamd_tokenizer_runtime *rt)
 }
 #endif
 
-struct token_pipe_entry {
-	guint64 h;
-	rspamd_stat_token_t *t;
-};
+/*
+ * Hash all words at once, so the hash type is checked once per part and not
+ * once per word
+ */
+static void
+rspamd_tokenizer_osb_hash_words (struct rspamd_osb_tokenizer_config *osb_cf,
+		GArray *words,
+		gboolean is_utf,
+		const gchar *prefix,
+		guint64 seed,
+		guint64 *hashes)
+{
+	rspamd_stat_token_t *token;
+	rspamd_ftok_t ftok;
+	guint w;
+
+	switch (osb_cf->ht) {
+	case RSPAMD_OSB_HASH_COMPAT:
+		for (w = 0; w < words->len; w ++) {
+			token = &g_array_index (words, rspamd_stat_token_t, w);
+			ftok.begin = token->begin;
+			ftok.len = token->len;
+			hashes[w] = rspamd_fstrhash_lc (&ftok, is_utf);
+		}
+		break;
+	case RSPAMD_OSB_HASH_XXHASH:
+		/* We know that the words are normalized */
+		for (w = 0; w < words->len; w ++) {
+			token = &g_array_index (words, rspamd_stat_token_t, w);
+			hashes[w] = rspamd_cryptobox_fast_hash_specific (
+					RSPAMD_CRYPTOBOX_XXHASH64,
+					token->begin, token->len, osb_cf->seed);
+		}
+		break;
+	default:
+		for (w = 0; w < words->len; w ++) {
+			token = &g_array_index (words, rspamd_stat_token_t, w);
+			rspamd_cryptobox_siphash ((guchar *)&hashes[w], token->begin,
+					token->len, osb_cf->sk);
+
+			if (prefix) {
+				hashes[w] ^= seed;
+			}
+		}
+		break;
+	}
+}
+
+/*
+ * Generates tokens for word `cur` paired with `npairs` preceding words of
+ * the window, `pipe` points to the hashes of the window words, so pipe[-i]
+ * is the i-th preceding word
+ */
+static inline void
+rspamd_tokenizer_osb_pairs (struct rspamd_osb_tokenizer_config *osb_cf,
+		rspamd_token_t *out,
+		const guint64 *pipe,
+		rspamd_stat_token_t **pipe_words,
+		guint npairs,
+		guint flags)
+{
+	guint i;
+	guint32 h1, h2;
+
+	if (osb_cf->ht == RSPAMD_OSB_HASH_COMPAT) {
+		for (i = 1; i <= npairs; i ++) {
+			h1 = ((guint32)pipe[0]) * primes[0] +
+					((guint32)pipe[-(gint)i]) * primes[i << 1];
+			h2 = ((guint32)pipe[0]) * primes[1] +
+					((guint32)pipe[-(gint)i]) * primes[(i << 1) - 1];
+			memcpy ((guchar *)&out[i - 1].data, &h1, sizeof (h1));
+			memcpy (((guchar *)&out[i - 1].data) + sizeof (h1), &h2, sizeof (h2));
+		}
+	}
+	else {
+		for (i = 1; i <= npairs; i ++) {
+			out[i - 1].data = pipe[0] * primes[0] +
+					pipe[-(gint)i] * primes[i << 1];
+		}
+	}
+
+	for (i = 1; i <= npairs; i ++) {
+		out[i - 1].flags = flags;
+		out[i - 1].t1 = pipe_words[0];
+		out[i - 1].t2 = pipe_words[-(gint)i];
+		out[i - 1].window_idx = i + 1;
+	}
+}
 
 gint
 rspamd_tokenizer_osb (struct rspamd_stat_ctx *ctx,
@@ -265,14 +349,12 @@ rspamd_tokenizer_osb (struct rspamd_stat_ctx *ctx,
 		const gchar *prefix,
 		GPtrArray *result)
 {
-	rspamd_token_t *new_tok = NULL;
-	rspamd_stat_token_t *token;
+	rspamd_token_t *tokens_block, *new_tok;
+	rspamd_stat_token_t *token, **pipe_words;
 	struct rspamd_osb_tokenizer_config *osb_cf;
-	guint64 cur, seed;
-	struct token_pipe_entry *hashpipe;
-	guint32 h1, h2;
-	gsize token_size;
-	guint processed = 0, i, w, window_size, token_flags = 0;
+	guint64 seed, *hashes, *pipe;
+	gsize ntokens = 0, max_tokens, start;
+	guint i, w, window_size, npipe = 0, nunigrams = 0;
 
 	if (words == NULL) {
 		return FALSE;
@@ -289,108 +371,97 @@ rspamd_tokenizer_osb (struct rspamd_stat_ctx *ctx,
 		seed = osb_cf->seed;
 	}
 
-	hashpipe = g_alloca (window_size * sizeof (hashpipe[0]));
-	for (i = 0; i < window_size; i++) {
-		hashpipe[i].h = 0xfe;
-		hashpipe[i].t = NULL;
+	if (words->len == 0) {
+		return TRUE;
 	}
 
-	token_size = sizeof (rspamd_token_t) +
-			sizeof (gdouble) * ctx->statfiles->len;
-	g_assert (token_size > 0);
+	/*
+	 * Words are hashed in bulk, then non unigram words are packed to the
+	 * `pipe` array, so the window of the word k is just pipe[k - i] and
+	 * there is no need to shift a hashpipe for each word
+	 */
+	hashes = g_malloc (words->len * sizeof (*hashes) * 2);
+	pipe = hashes + words->len;
+	pipe_words = g_malloc (words->len * sizeof (*pipe_words));
+	rspamd_tokenizer_osb_hash_words (osb_cf, words, is_utf, prefix, seed,
+			hashes);
 
 	for (w = 0; w < words->len; w ++) {
 		token = &g_array_index (words, rspamd_stat_token_t, w);
-		token_flags = token->flags;
-
-		if (osb_cf->ht == RSPAMD_OSB_HASH_COMPAT) {
-			rspamd_ftok_t ftok;
 
-			ftok.begin = token->begin;
-			ftok.len = token->len;
-			cur = rspamd_fstrhash_lc (&ftok, is_utf);
+		if (token->flags & RSPAMD_STAT_TOKEN_FLAG_UNIGRAM) {
+			nunigrams ++;
 		}
 		else {
-			/* We know that the words are normalized */
-			if (osb_cf->ht == RSPAMD_OSB_HASH_XXHASH) {
-				cur = rspamd_cryptobox_fast_hash_specific (RSPAMD_CRYPTOBOX_XXHASH64,
-						token->begin, token->len, osb_cf->seed);
-			}
-			else {
-				rspamd_cryptobox_siphash ((guchar *)&cur, token->begin,
-						token->len, osb_cf->sk);
-
-				if (prefix) {
-					cur ^= seed;
-				}
-			}
+			pipe[npipe] = hashes[w];
+			pipe_words[npipe] = token;
+			npipe ++;
 		}
+	}
 
-		if (token_flags & RSPAMD_STAT_TOKEN_FLAG_UNIGRAM) {
-			new_tok = rspamd_mempool_alloc0 (pool, token_size);
-			new_tok->flags = token_flags;
+	/*
+	 * The first window_size words just fill the window, each following word
+	 * produces window_size - 1 tokens. Short texts produce tokens for the
+	 * filled part of the window only (excluding the last word)
+	 */
+	max_tokens = nunigrams;
+
+	if (npipe > window_size) {
+		max_tokens += (gsize)(npipe - window_size) * (window_size - 1);
+	}
+	else if (npipe > 2) {
+		max_tokens += npipe - 2;
+	}
+
+	tokens_block = rspamd_mempool_alloc (pool,
+			sizeof (rspamd_token_t) * MAX (max_tokens, 1));
+	start = result->len;
+	g_ptr_array_set_size (result, start + max_tokens);
+	npipe = 0;
+
+	for (w = 0; w < words->len; w ++) {
+		token = &g_array_index (words, rspamd_stat_token_t, w);
+
+		if (token->flags & RSPAMD_STAT_TOKEN_FLAG_UNIGRAM) {
+			new_tok = &tokens_block[ntokens ++];
+			new_tok->flags = token->flags;
 			new_tok->t1 = token;
 			new_tok->t2 = token;
-			new_tok->data = cur;
+			new_tok->data = hashes[w];
 			new_tok->window_idx = 0;
-			g_ptr_array_add (result, new_tok);
 
 			continue;
 		}
 
-#define ADD_TOKEN do {\
-    new_tok = rspamd_mempool_alloc0 (pool, token_size); \
-    new_tok->flags = token_flags; \
-    new_tok->t1 = hashpipe[0].t; \
-    new_tok->t2 = hashpipe[i].t; \
-    if (osb_cf->ht == RSPAMD_OSB_HASH_COMPAT) { \
-        h1 = ((guint32)hashpipe[0].h) * primes[0] + \
-            ((guint32)hashpipe[i].h) * primes[i << 1]; \
-        h2 = ((guint32)hashpipe[0].h) * primes[1] + \
-            ((guint32)hashpipe[i].h) * primes[(i << 1) - 1]; \
-        memcpy((guchar *)&new_tok->data, &h1, sizeof (h1)); \
-        memcpy(((guchar *)&new_tok->data) + sizeof (h1), &h2, sizeof (h2)); \
-    } \
-    else { \
-        new_tok->data = hashpipe[0].h * primes[0] + hashpipe[i].h * primes[i << 1]; \
-    } \
-    new_tok->window_idx = i + 1; \
-    g_ptr_array_add (result, new_tok); \
-  } while(0)
-
-		if (processed < window_size) {
-			/* Just fill a hashpipe */
-			++processed;
-			hashpipe[window_size - processed].h = cur;
-			hashpipe[window_size - processed].t = token;
+		if (npipe >= window_size) {
+			g_assert (ntokens + window_size - 1 <= max_tokens);
+			rspamd_tokenizer_osb_pairs (osb_cf, &tokens_block[ntokens],
+					&pipe[npipe], &pipe_words[npipe], window_size - 1,
+					token->flags);
+			ntokens += window_size - 1;
 		}
-		else {
-			/* Shift hashpipe */
-			for (i = window_size - 1; i > 0; i--) {
-				hashpipe[i] = hashpipe[i - 1];
-			}
-			hashpipe[0].h = cur;
-			hashpipe[0].t = token;
 
-			processed++;
+		npipe ++;
+	}
 
-			for (i = 1; i < window_size; i++) {
-				ADD_TOKEN;
-			}
-		}
+	if (npipe > 2 && npipe <= window_size) {
+		/* Flags of the last word are used for the tail, like for the window */
+		token = &g_array_index (words, rspamd_stat_token_t, words->len - 1);
+		g_assert (ntokens + npipe - 2 <= max_tokens);
+		rspamd_tokenizer_osb_pairs (osb_cf, &tokens_block[ntokens],
+				&pipe[npipe - 2], &pipe_words[npipe - 2], npipe - 2,
+				token->flags);
+		ntokens += npipe - 2;
 	}
 
-	if (processed > 1 && processed <= window_size) {
-		processed --;
-		memmove (hashpipe, &hashpipe[window_size - processed],
-				processed * sizeof (hashpipe[0]));
+	g_assert (ntokens == max_tokens);
 
-		for (i = 1; i < processed; i++) {
-			ADD_TOKEN;
-		}
+	for (i = 0; i < ntokens; i ++) {
+		g_ptr_array_index (result, start + i) = &tokens_block[i];
 	}
 
-#undef ADD_TOKEN
+	g_free (hashes);
+	g_free (pipe_words);
 
 	return TRUE;
 }
@@ -999,9 +999,9 @@ rspamd_inet_address_connect (const rspamd_inet_addr_t *addr, gint type,
 	return fd;
 }
 
-int
-rspamd_inet_address_listen (const rspamd_inet_addr_t *addr, gint type,
-		gboolean async)
+static int
+rspamd_inet_address_listen_common (const rspamd_inet_addr_t *addr, gint type,
+		gboolean async, gboolean reuseport)
 {
 	gint fd, r;
 	gint on = 1;
@@ -1031,6 +1031,14 @@ rspamd_inet_address_listen (const rspamd_inet_addr_t *addr, gint type,
 
 	(void)setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, (const void *)&on, sizeof (gint));
 
+#ifdef SO_REUSEPORT
+	if (reuseport && addr->af != AF_UNIX) {
+		/* Allow workers to bind their own sockets to distribute load */
+		(void)setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, (const void *)&on,
+				sizeof (gint));
+	}
+#endif
+
 #ifdef HAVE_IPV6_V6ONLY
 	if (addr->af == AF_INET6) {
 		/* We need to set this flag to avoid errors */
@@ -1088,6 +1096,22 @@ rspamd_inet_address_listen (const rspamd_inet_addr_t *addr, gint type,
 	return fd;
 }
 
+int
+rspamd_inet_address_listen (const rspamd_inet_addr_t *addr, gint type,
+		gboolean async)
+{
+	/* Datagram sockets are always shareable, see fuzzy storage */
+	return rspamd_inet_address_listen_common (addr, type, async,
+			type == (int)SOCK_DGRAM);
+}
+
+int
+rspamd_inet_address_listen_reuseport (const rspamd_inet_addr_t *addr,
+		gint type, gboolean async)
+{
+	return rspamd_inet_address_listen_common (addr, type, async, TRUE);
+}
+
 gssize
 rspamd_inet_address_recvfrom (gint fd, void *buf, gsize len, gint fl,
 		rspamd_inet_addr_t **target)
@@ -1146,6 +1170,124 @@ rspamd_inet_address_sendto (gint fd, const void *buf, gsize len, gint fl,
 	return r;
 }
 
+gint
+rspamd_inet_address_recvmmsg (gint fd, guchar **bufs, gsize buflen,
+		gsize *lens, rspamd_inet_addr_t **targets, guint count)
+{
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr *msgs;
+	struct iovec *iovs;
+	union sa_union *sus;
+	rspamd_inet_addr_t *addr;
+	gint ret, i;
+
+	msgs = g_alloca (sizeof (*msgs) * count);
+	iovs = g_alloca (sizeof (*iovs) * count);
+	sus = g_alloca (sizeof (*sus) * count);
+	memset (msgs, 0, sizeof (*msgs) * count);
+
+	for (i = 0; i < (gint)count; i ++) {
+		iovs[i].iov_base = bufs[i];
+		iovs[i].iov_len = buflen;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &sus[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof (sus[i]);
+	}
+
+	if ((ret = recvmmsg (fd, msgs, count, 0, NULL)) == -1) {
+		return -1;
+	}
+
+	for (i = 0; i < ret; i ++) {
+		lens[i] = msgs[i].msg_len;
+		addr = rspamd_inet_addr_create (sus[i].sa.sa_family);
+		addr->slen = msgs[i].msg_hdr.msg_namelen;
+
+		if (addr->af == AF_UNIX) {
+			addr->u.un = g_malloc (sizeof (*addr->u.un));
+			memcpy (&addr->u.un->addr, &sus[i].su,
+					sizeof (struct sockaddr_un));
+		}
+		else {
+			memcpy (&addr->u.in.addr, &sus[i].sa,
+					MIN (addr->slen, sizeof (addr->u.in.addr)));
+		}
+
+		targets[i] = addr;
+	}
+
+	return ret;
+#else
+	gssize r;
+	guint i;
+
+	for (i = 0; i < count; i ++) {
+		r = rspamd_inet_address_recvfrom (fd, bufs[i], buflen, 0, &targets[i]);
+
+		if (r == -1) {
+			if (i == 0) {
+				return -1;
+			}
+
+			break;
+		}
+
+		lens[i] = r;
+	}
+
+	return i;
+#endif
+}
+
+gint
+rspamd_inet_address_sendmmsg (gint fd, const void **bufs, const gsize *lens,
+		rspamd_inet_addr_t **addrs, guint count)
+{
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr *msgs;
+	struct iovec *iovs;
+	guint i;
+
+	msgs = g_alloca (sizeof (*msgs) * count);
+	iovs = g_alloca (sizeof (*iovs) * count);
+	memset (msgs, 0, sizeof (*msgs) * count);
+
+	for (i = 0; i < count; i ++) {
+		iovs[i].iov_base = (void *)bufs[i];
+		iovs[i].iov_len = lens[i];
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+
+		if (addrs[i]->af == AF_UNIX) {
+			msgs[i].msg_hdr.msg_name = &addrs[i]->u.un->addr;
+		}
+		else {
+			msgs[i].msg_hdr.msg_name = &addrs[i]->u.in.addr.sa;
+		}
+
+		msgs[i].msg_hdr.msg_namelen = addrs[i]->slen;
+	}
+
+	return sendmmsg (fd, msgs, count, 0);
+#else
+	guint i;
+
+	for (i = 0; i < count; i ++) {
+		if (rspamd_inet_address_sendto (fd, bufs[i], lens[i], 0,
+				addrs[i]) == -1) {
+			if (i == 0) {
+				return -1;
+			}
+
+			break;
+		}
+	}
+
+	return i;
+#endif
+}
+
 static gboolean
 rspamd_check_port_priority (const char *line, guint default_port,
 		guint *priority, gchar *out,
@@ -171,6 +171,25 @@ gssize rspamd_inet_address_recvfrom (gint fd, void *buf, gsize len, gint fl,
 gssize rspamd_inet_address_sendto (gint fd, const void *buf, gsize len, gint fl,
 		const rspamd_inet_addr_t *addr);
 
+/**
+ * Receive up to `count` datagrams at once (using recvmmsg(2) if available)
+ * @param fd
+ * @param bufs array of `count` buffers of `buflen` size each
+ * @param lens output lengths of the datagrams received
+ * @param targets output addresses of the senders
+ * @param count
+ * @return number of datagrams received or -1 if nothing has been received
+ */
+gint rspamd_inet_address_recvmmsg (gint fd, guchar **bufs, gsize buflen,
+		gsize *lens, rspamd_inet_addr_t **targets, guint count);
+
+/**
+ * Send `count` datagrams at once (using sendmmsg(2) if available)
+ * @return number of datagrams sent or -1 if nothing has been sent
+ */
+gint rspamd_inet_address_sendmmsg (gint fd, const void **bufs,
+		const gsize *lens, rspamd_inet_addr_t **addrs, guint count);
+
 /**
  * Set port for inet address
  */
@@ -194,6 +213,17 @@ int rspamd_inet_address_connect (const rspamd_inet_addr_t *addr, gint type,
  */
 int rspamd_inet_address_listen (const rspamd_inet_addr_t *addr, gint type,
 	gboolean async);
+
+/**
+ * Listen on a specified inet address with SO_REUSEPORT set, so other
+ * sockets could be bound to the same address and share incoming load
+ * @param addr
+ * @param type
+ * @param async
+ * @return
+ */
+int rspamd_inet_address_listen_reuseport (const rspamd_inet_addr_t *addr,
+	gint type, gboolean async);
 /**
  * Check whether specified ip is valid (not INADDR_ANY or INADDR_NONE) for ipv4 or ipv6
  * @param ptr pointer to struct in_addr or struct in6_addr
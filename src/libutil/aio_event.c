@@ -27,6 +27,27 @@
 #include <aio.h>
 #endif
 
+#include <sys/uio.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* Syscall numbers are the same for all architectures */
+#ifndef __NR_io_uring_setup
+# define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+# define __NR_io_uring_enter 426
+#endif
+#ifndef __NR_io_uring_register
+# define __NR_io_uring_register 427
+#endif
+
+#define MAX_URING_EV 256
+#endif
+
 /* Linux syscall numbers */
 #if defined(__i386__)
 # define SYS_io_setup      245
@@ -60,6 +81,9 @@ struct io_cbdata {
 	gpointer buf;
 	gpointer io_buf;
 	gpointer ud;
+	struct iovec *iov; /* iovecs must live until request is completed */
+	gint iovcnt;
+	struct iovec single_iov;
 };
 
 #ifdef LINUX
@@ -173,6 +197,28 @@ eventfd (guint initval, guint flags)
 
 #endif
 
+#ifdef HAVE_LINUX_IO_URING_H
+/* io_uring specific calls, liburing is not required */
+static int
+io_uring_setup (guint entries, struct io_uring_params *p)
+{
+	return syscall (__NR_io_uring_setup, entries, p);
+}
+
+static int
+io_uring_enter (gint fd, guint to_submit, guint min_complete, guint flags)
+{
+	return syscall (__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+			NULL, 0);
+}
+
+static int
+io_uring_register (gint fd, guint opcode, gpointer arg, guint nr_args)
+{
+	return syscall (__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+#endif
+
 /**
  * AIO context
  */
@@ -184,12 +230,49 @@ struct aio_context {
 	gint event_fd;
 	struct event eventfd_ev;
 	aio_context_t io_ctx;
+#ifdef HAVE_LINUX_IO_URING_H
+	/* io_uring is preferred as it does not require O_DIRECT */
+	gboolean has_uring;
+	gint ring_fd;
+	guint sq_entries;
+	guint *sq_head;
+	guint *sq_tail;
+	guint *sq_mask;
+	guint *sq_array;
+	guint *cq_head;
+	guint *cq_tail;
+	guint *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+#endif
 #elif defined(HAVE_AIO_H)
 	/* POSIX aio */
 	struct event rtsigs[128];
 #endif
 };
 
+/* Calls callback for the finished operation and frees its data */
+static void
+rspamd_aio_notify (struct io_cbdata *ev_data, gint64 res)
+{
+	if (res < 0) {
+		ev_data->cb (ev_data->fd, res, 0, ev_data->buf, ev_data->ud);
+	}
+	else {
+		ev_data->cb (ev_data->fd, 0, res, ev_data->buf, ev_data->ud);
+	}
+
+	if (ev_data->io_buf) {
+		free (ev_data->io_buf);
+	}
+
+	if (ev_data->iov && ev_data->iov != &ev_data->single_iov) {
+		g_free (ev_data->iov);
+	}
+
+	g_free (ev_data);
+}
+
 #ifdef LINUX
 /* Eventfd read callback */
 static void
@@ -223,15 +306,7 @@ rspamd_eventfdcb (gint fd, gshort what, gpointer ud)
 			for (i = 0; i < done; i++) {
 				ev_data = (struct io_cbdata *) (uintptr_t) event[i].data;
 				/* Call this callback */
-				ev_data->cb (ev_data->fd,
-					event[i].res,
-					ev_data->len,
-					ev_data->buf,
-					ev_data->ud);
-				if (ev_data->io_buf) {
-					free (ev_data->io_buf);
-				}
-				g_free (ev_data);
+				rspamd_aio_notify (ev_data, event[i].res);
 			}
 		}
 		else if (done == 0) {
@@ -245,6 +320,141 @@ rspamd_eventfdcb (gint fd, gshort what, gpointer ud)
 	}
 }
 
+#ifdef HAVE_LINUX_IO_URING_H
+/* Eventfd callback for io_uring completions */
+static void
+rspamd_uring_eventfdcb (gint fd, gshort what, gpointer ud)
+{
+	struct aio_context *ctx = ud;
+	struct io_uring_cqe *cqe;
+	struct io_cbdata *ev_data;
+	guint64 ready;
+	guint head;
+	gint res;
+
+	if (read (fd, &ready, 8) != 8 && errno != EAGAIN) {
+		msg_err ("eventfd read returned error: %s", strerror (errno));
+	}
+
+	for (;;) {
+		head = *ctx->cq_head;
+
+		if (head == __atomic_load_n (ctx->cq_tail, __ATOMIC_ACQUIRE)) {
+			break;
+		}
+
+		cqe = &ctx->cqes[head & *ctx->cq_mask];
+		ev_data = (struct io_cbdata *) (uintptr_t) cqe->user_data;
+		res = cqe->res;
+		/* Release entry before callback as it can submit new requests */
+		__atomic_store_n (ctx->cq_head, head + 1, __ATOMIC_RELEASE);
+		rspamd_aio_notify (ev_data, res);
+	}
+}
+
+static gboolean
+rspamd_uring_init (struct aio_context *ctx)
+{
+	struct io_uring_params p;
+	guchar *sq_ptr, *cq_ptr;
+	gsize sq_sz, cq_sz;
+
+	memset (&p, 0, sizeof (p));
+	ctx->ring_fd = io_uring_setup (MAX_URING_EV, &p);
+
+	if (ctx->ring_fd == -1) {
+		msg_info ("io_uring_setup failed, use aio: %s", strerror (errno));
+		return FALSE;
+	}
+
+	sq_sz = p.sq_off.array + p.sq_entries * sizeof (guint);
+	cq_sz = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+	sq_ptr = mmap (NULL, sq_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ctx->ring_fd, IORING_OFF_SQ_RING);
+	cq_ptr = mmap (NULL, cq_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ctx->ring_fd, IORING_OFF_CQ_RING);
+	ctx->sqes = mmap (NULL, p.sq_entries * sizeof (struct io_uring_sqe),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ctx->ring_fd,
+			IORING_OFF_SQES);
+
+	if (sq_ptr == MAP_FAILED || cq_ptr == MAP_FAILED ||
+			ctx->sqes == MAP_FAILED) {
+		msg_err ("cannot map io_uring: %s", strerror (errno));
+		/* Mappings are released when ring is closed */
+		close (ctx->ring_fd);
+
+		return FALSE;
+	}
+
+	ctx->sq_entries = p.sq_entries;
+	ctx->sq_head = (guint *)(sq_ptr + p.sq_off.head);
+	ctx->sq_tail = (guint *)(sq_ptr + p.sq_off.tail);
+	ctx->sq_mask = (guint *)(sq_ptr + p.sq_off.ring_mask);
+	ctx->sq_array = (guint *)(sq_ptr + p.sq_off.array);
+	ctx->cq_head = (guint *)(cq_ptr + p.cq_off.head);
+	ctx->cq_tail = (guint *)(cq_ptr + p.cq_off.tail);
+	ctx->cq_mask = (guint *)(cq_ptr + p.cq_off.ring_mask);
+	ctx->cqes = (struct io_uring_cqe *)(cq_ptr + p.cq_off.cqes);
+
+	if (io_uring_register (ctx->ring_fd, IORING_REGISTER_EVENTFD,
+			&ctx->event_fd, 1) == -1) {
+		msg_err ("cannot register eventfd for io_uring: %s", strerror (errno));
+		munmap (sq_ptr, sq_sz);
+		munmap (cq_ptr, cq_sz);
+		munmap (ctx->sqes, p.sq_entries * sizeof (struct io_uring_sqe));
+		close (ctx->ring_fd);
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Queues and submits a single request, returns FALSE if request cannot be
+ * submitted, so the caller should use blocking IO
+ */
+static gboolean
+rspamd_uring_submit (struct aio_context *ctx, guint8 opcode,
+	struct io_cbdata *cbdata, guint64 offset)
+{
+	struct io_uring_sqe *sqe;
+	guint head, tail, idx;
+
+	head = __atomic_load_n (ctx->sq_head, __ATOMIC_ACQUIRE);
+	tail = *ctx->sq_tail;
+
+	if (tail - head >= ctx->sq_entries) {
+		return FALSE;
+	}
+
+	idx = tail & *ctx->sq_mask;
+	sqe = &ctx->sqes[idx];
+	memset (sqe, 0, sizeof (*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = cbdata->fd;
+	sqe->off = offset;
+
+	if (cbdata->iov) {
+		sqe->addr = (guint64)((uintptr_t)cbdata->iov);
+		sqe->len = cbdata->iovcnt;
+	}
+
+	sqe->user_data = (guint64)((uintptr_t)cbdata);
+	ctx->sq_array[idx] = idx;
+	__atomic_store_n (ctx->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	if (io_uring_enter (ctx->ring_fd, 1, 0, 0) != 1) {
+		/* Kernel consumes entries on enter only, so we can revert the tail */
+		__atomic_store_n (ctx->sq_tail, tail, __ATOMIC_RELEASE);
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+#endif
+
 #endif
 
 /**
@@ -271,6 +481,19 @@ rspamd_aio_init (struct event_base *base)
 			msg_err ("non blocking for eventfd failed: %s", strerror (errno));
 			close (new->event_fd);
 		}
+#ifdef HAVE_LINUX_IO_URING_H
+		else if (rspamd_uring_init (new)) {
+			event_set (&new->eventfd_ev,
+				new->event_fd,
+				EV_READ | EV_PERSIST,
+				rspamd_uring_eventfdcb,
+				new);
+			event_base_set (new->base, &new->eventfd_ev);
+			event_add (&new->eventfd_ev, NULL);
+			new->has_aio = TRUE;
+			new->has_uring = TRUE;
+		}
+#endif
 		else {
 			event_set (&new->eventfd_ev,
 				new->event_fd,
@@ -281,6 +504,7 @@ rspamd_aio_init (struct event_base *base)
 			event_add (&new->eventfd_ev, NULL);
 			if (io_setup (MAX_AIO_EV, &new->io_ctx) == -1) {
 				msg_err ("io_setup failed: %s", strerror (errno));
+				event_del (&new->eventfd_ev);
 				close (new->event_fd);
 			}
 			else {
@@ -307,6 +531,11 @@ rspamd_aio_open (struct aio_context *ctx, const gchar *path, int flags)
 		return open (path, flags);
 	}
 #ifdef LINUX
+#ifdef HAVE_LINUX_IO_URING_H
+	if (ctx->has_uring) {
+		return open (path, flags);
+	}
+#endif
 
 	fd = open (path, flags | O_DIRECT);
 
@@ -318,6 +547,40 @@ rspamd_aio_open (struct aio_context *ctx, const gchar *path, int flags)
 	return fd;
 }
 
+static struct io_cbdata *
+rspamd_aio_cbdata_new (gint fd, gpointer buf, guint64 len,
+	rspamd_aio_cb cb, gpointer ud)
+{
+	struct io_cbdata *cbdata;
+
+	cbdata = g_malloc0 (sizeof (struct io_cbdata));
+	cbdata->cb = cb;
+	cbdata->buf = buf;
+	cbdata->len = len;
+	cbdata->ud = ud;
+	cbdata->fd = fd;
+
+	return cbdata;
+}
+
+/*
+ * Blocking variant of operations, callback is called synchronously and
+ * gets the result, so the operation is treated as started
+ */
+static gint
+rspamd_aio_blocking_finish (gint fd, gssize r, gpointer buf,
+	rspamd_aio_cb cb, gpointer ud)
+{
+	if (r >= 0) {
+		cb (fd, 0, r, buf, ud);
+	}
+	else {
+		cb (fd, -errno, 0, buf, ud);
+	}
+
+	return 0;
+}
+
 /**
  * Asynchronous read of file
  */
@@ -330,20 +593,28 @@ rspamd_aio_read (gint fd,
 	rspamd_aio_cb cb,
 	gpointer ud)
 {
-	gint r = -1;
-
 	if (ctx->has_aio) {
 #ifdef LINUX
 		struct iocb *iocb[1];
 		struct io_cbdata *cbdata;
 
-		cbdata = g_malloc0 (sizeof (struct io_cbdata));
-		cbdata->cb = cb;
-		cbdata->buf = buf;
-		cbdata->len = len;
-		cbdata->ud = ud;
-		cbdata->fd = fd;
-		cbdata->io_buf = NULL;
+		cbdata = rspamd_aio_cbdata_new (fd, buf, len, cb, ud);
+
+#ifdef HAVE_LINUX_IO_URING_H
+		if (ctx->has_uring) {
+			cbdata->single_iov.iov_base = buf;
+			cbdata->single_iov.iov_len = len;
+			cbdata->iov = &cbdata->single_iov;
+			cbdata->iovcnt = 1;
+
+			if (rspamd_uring_submit (ctx, IORING_OP_READV, cbdata, offset)) {
+				return len;
+			}
+
+			g_free (cbdata);
+			goto blocking;
+		}
+#endif
 
 		iocb[0] = alloca (sizeof (struct iocb));
 		memset (iocb[0], 0, sizeof (struct iocb));
@@ -362,6 +633,8 @@ rspamd_aio_read (gint fd,
 			return len;
 		}
 		else {
+			g_free (cbdata);
+
 			if (errno == EAGAIN || errno == ENOSYS) {
 				/* Fall back to sync read */
 				goto blocking;
@@ -372,27 +645,10 @@ rspamd_aio_read (gint fd,
 #elif defined(HAVE_AIO_H)
 #endif
 	}
-	else {
-		/* Blocking variant */
-		goto blocking;
-blocking:
-#ifdef _LARGEFILE64_SOURCE
-		r = lseek64 (fd, offset, SEEK_SET);
-#else
-		r = lseek (fd, offset, SEEK_SET);
-#endif
-		if (r > 0) {
-			r = read (fd, buf, len);
-			if (r >= 0) {
-				cb (fd, 0, r, buf, ud);
-			}
-			else {
-				cb (fd, r, -1, buf, ud);
-			}
-		}
-	}
 
-	return r;
+blocking:
+	return rspamd_aio_blocking_finish (fd, pread (fd, buf, len, offset),
+			buf, cb, ud);
 }
 
 /**
@@ -407,21 +663,32 @@ rspamd_aio_write (gint fd,
 	rspamd_aio_cb cb,
 	gpointer ud)
 {
-	gint r = -1;
-
 	if (ctx->has_aio) {
 #ifdef LINUX
 		struct iocb *iocb[1];
 		struct io_cbdata *cbdata;
 
-		cbdata = g_malloc0 (sizeof (struct io_cbdata));
-		cbdata->cb = cb;
-		cbdata->buf = buf;
-		cbdata->len = len;
-		cbdata->ud = ud;
-		cbdata->fd = fd;
+		cbdata = rspamd_aio_cbdata_new (fd, buf, len, cb, ud);
+
+#ifdef HAVE_LINUX_IO_URING_H
+		if (ctx->has_uring) {
+			cbdata->single_iov.iov_base = buf;
+			cbdata->single_iov.iov_len = len;
+			cbdata->iov = &cbdata->single_iov;
+			cbdata->iovcnt = 1;
+
+			if (rspamd_uring_submit (ctx, IORING_OP_WRITEV, cbdata, offset)) {
+				return len;
+			}
+
+			g_free (cbdata);
+			goto blocking;
+		}
+#endif
+
 		/* We need to align pointer on boundary of 512 bytes here */
 		if (posix_memalign (&cbdata->io_buf, 512, len) != 0) {
+			g_free (cbdata);
 			return -1;
 		}
 		memcpy (cbdata->io_buf, buf, len);
@@ -443,8 +710,11 @@ rspamd_aio_write (gint fd,
 			return len;
 		}
 		else {
+			free (cbdata->io_buf);
+			g_free (cbdata);
+
 			if (errno == EAGAIN || errno == ENOSYS) {
-				/* Fall back to sync read */
+				/* Fall back to sync write */
 				goto blocking;
 			}
 			return -1;
@@ -453,27 +723,90 @@ rspamd_aio_write (gint fd,
 #elif defined(HAVE_AIO_H)
 #endif
 	}
-	else {
-		/* Blocking variant */
-		goto blocking;
+
 blocking:
-#ifdef _LARGEFILE64_SOURCE
-		r = lseek64 (fd, offset, SEEK_SET);
-#else
-		r = lseek (fd, offset, SEEK_SET);
+	return rspamd_aio_blocking_finish (fd, pwrite (fd, buf, len, offset),
+			buf, cb, ud);
+}
+
+/**
+ * Asynchronous scattered read of file
+ */
+gint
+rspamd_aio_readv (gint fd,
+	const struct iovec *iov,
+	gint iovcnt,
+	guint64 offset,
+	struct aio_context *ctx,
+	rspamd_aio_cb cb,
+	gpointer ud)
+{
+	guint64 len = 0;
+	gint i;
+
+	g_assert (iovcnt > 0);
+
+	for (i = 0; i < iovcnt; i ++) {
+		len += iov[i].iov_len;
+	}
+
+#ifdef HAVE_LINUX_IO_URING_H
+	/* Linux aio is limited to a single O_DIRECT buffer, so it is not used */
+	if (ctx->has_uring) {
+		struct io_cbdata *cbdata;
+
+		cbdata = rspamd_aio_cbdata_new (fd, iov[0].iov_base, len, cb, ud);
+		cbdata->iov = g_malloc (sizeof (*iov) * iovcnt);
+		memcpy (cbdata->iov, iov, sizeof (*iov) * iovcnt);
+		cbdata->iovcnt = iovcnt;
+
+		if (rspamd_uring_submit (ctx, IORING_OP_READV, cbdata, offset)) {
+			return len;
+		}
+
+		g_free (cbdata->iov);
+		g_free (cbdata);
+	}
 #endif
-		if (r > 0) {
-			r = write (fd, buf, len);
-			if (r >= 0) {
-				cb (fd, 0, r, buf, ud);
-			}
-			else {
-				cb (fd, r, -1, buf, ud);
-			}
+
+	return rspamd_aio_blocking_finish (fd, preadv (fd, iov, iovcnt, offset),
+			iov[0].iov_base, cb, ud);
+}
+
+/**
+ * Asynchronous fsync of file
+ */
+gint
+rspamd_aio_fsync (gint fd,
+	struct aio_context *ctx,
+	rspamd_aio_cb cb,
+	gpointer ud)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+	if (ctx->has_uring) {
+		struct io_cbdata *cbdata;
+
+		cbdata = rspamd_aio_cbdata_new (fd, NULL, 0, cb, ud);
+
+		if (rspamd_uring_submit (ctx, IORING_OP_FSYNC, cbdata, 0)) {
+			return 0;
 		}
+
+		g_free (cbdata);
 	}
+#endif
 
-	return r;
+	return rspamd_aio_blocking_finish (fd, fsync (fd), NULL, cb, ud);
+}
+
+gboolean
+rspamd_aio_is_async (struct aio_context *ctx)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+	return ctx->has_uring;
+#else
+	return FALSE;
+#endif
 }
 
 /**
@@ -489,6 +822,13 @@ rspamd_aio_close (gint fd, struct aio_context *ctx)
 		struct iocb iocb;
 		struct io_event ev;
 
+#ifdef HAVE_LINUX_IO_URING_H
+		if (ctx->has_uring) {
+			/* Pending requests keep their own reference to the file */
+			return close (fd);
+		}
+#endif
+
 		memset (&iocb, 0, sizeof (struct iocb));
 		iocb.aio_fildes = fd;
 		iocb.aio_lio_opcode = IO_CMD_NOOP;
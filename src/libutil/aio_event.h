@@ -23,8 +23,13 @@
  */
 struct aio_context;
 
+struct iovec;
+
 /**
- * Callback for notifying
+ * Callback for notifying: `res` is 0 on success or negative errno on error,
+ * `len` is the number of bytes processed. Callback is called synchronously
+ * if operation falls back to blocking IO. Operations return -1 and do not
+ * call callback if they cannot be started at all
  */
 typedef void (*rspamd_aio_cb) (gint fd, gint res, guint64 len, gpointer data,
 	gpointer ud);
@@ -51,6 +56,27 @@ gint rspamd_aio_read (gint fd, gpointer buf, guint64 len, guint64 offset,
 gint rspamd_aio_write (gint fd, gpointer buf, guint64 len, guint64 offset,
 	struct aio_context *ctx, rspamd_aio_cb cb, gpointer ud);
 
+/**
+ * Asynchronous scattered read of file, `iov` array is copied, however
+ * buffers must be valid until callback is called (`data` argument of the
+ * callback is the first buffer)
+ */
+gint rspamd_aio_readv (gint fd, const struct iovec *iov, gint iovcnt,
+	guint64 offset, struct aio_context *ctx, rspamd_aio_cb cb, gpointer ud);
+
+/**
+ * Asynchronous fsync of file
+ */
+gint rspamd_aio_fsync (gint fd, struct aio_context *ctx, rspamd_aio_cb cb,
+	gpointer ud);
+
+/**
+ * Returns TRUE if operations with arbitrary buffers and offsets are performed
+ * without blocking (linux aio requires aligned O_DIRECT IO, so it does not
+ * count)
+ */
+gboolean rspamd_aio_is_async (struct aio_context *ctx);
+
 /**
  * Close of aio operations
  */
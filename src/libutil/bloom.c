@@ -17,42 +17,78 @@
 #include "bloom.h"
 #include "cryptobox.h"
 
-/* 4 bits are used for counting (implementing delete operation) */
+#include "unix-std.h"
+#include "util.h"
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * 4 bits are used for counting (implementing delete operation), 8 counters
+ * are packed in a 32 bit word and updated atomically, as filters could be
+ * shared between processes
+ */
 #define SIZE_BIT 4
+#define COUNTERS_PER_WORD (32 / SIZE_BIT)
+#define COUNTER_MAX 0xFU
+
+#define RSPAMD_BLOOM_FILE_MAGIC "rsbloom1"
+#define RSPAMD_BLOOM_MAX_FUNCS 16
+
+struct rspamd_bloom_file_header {
+	gchar magic[8];
+	guint64 asize;
+	guint64 nfuncs;
+	guint32 seeds[RSPAMD_BLOOM_MAX_FUNCS];
+	gint state;
+	gint unused_int;
+	guint64 state_time;
+	guchar unused[24];
+};
 
-/* These macroes are for 4 bits for counting element */
-#define INCBIT(a, n, acc) do {                                                              \
-		acc = \
-			a[n * SIZE_BIT / CHAR_BIT] & (0xF << \
-			(n % (CHAR_BIT / SIZE_BIT) * SIZE_BIT));     \
-		acc ++;                                                                                 \
-		acc &= 0xF;                                                                             \
-                                                                                            \
-		a[n * SIZE_BIT / \
-		CHAR_BIT] &= (0xF << (4 - (n % (CHAR_BIT / SIZE_BIT) * SIZE_BIT)));      \
-		a[n * SIZE_BIT / \
-		CHAR_BIT] |= (acc << (n % (CHAR_BIT / SIZE_BIT) * SIZE_BIT));            \
-} while (0);
-
-#define DECBIT(a, n, acc) do {                                                              \
-		acc = \
-			a[n * SIZE_BIT / CHAR_BIT] & (0xF << \
-			(n % (CHAR_BIT / SIZE_BIT) * SIZE_BIT));     \
-		acc --;                                                                                 \
-		acc &= 0xF;                                                                             \
-                                                                                            \
-		a[n * SIZE_BIT / \
-		CHAR_BIT] &= (0xF << (4 - (n % (CHAR_BIT / SIZE_BIT) * SIZE_BIT)));      \
-		a[n * SIZE_BIT / \
-		CHAR_BIT] |= (acc << (n % (CHAR_BIT / SIZE_BIT) * SIZE_BIT));            \
-} while (0);
-
-#define GETBIT(a, \
-		n) (a[n * SIZE_BIT / CHAR_BIT] & (0xF << \
-	(n % (CHAR_BIT / SIZE_BIT) * SIZE_BIT)))
-
-/* Common hash functions */
+static inline volatile gint *
+rspamd_bloom_word (rspamd_bloom_filter_t *bloom, guint n)
+{
+	return ((volatile gint *)bloom->a) + n / COUNTERS_PER_WORD;
+}
+
+static inline guint
+rspamd_bloom_get_counter (rspamd_bloom_filter_t *bloom, guint n)
+{
+	guint32 w = g_atomic_int_get (rspamd_bloom_word (bloom, n));
+
+	return (w >> ((n % COUNTERS_PER_WORD) * SIZE_BIT)) & COUNTER_MAX;
+}
+
+static inline void
+rspamd_bloom_update_counter (rspamd_bloom_filter_t *bloom, guint n,
+		gboolean inc)
+{
+	volatile gint *w = rspamd_bloom_word (bloom, n);
+	guint shift = (n % COUNTERS_PER_WORD) * SIZE_BIT;
+	guint32 old, cnt;
+
+	do {
+		old = g_atomic_int_get (w);
+		cnt = (old >> shift) & COUNTER_MAX;
+
+		/* Saturated counters are never changed to avoid false negatives */
+		if (cnt == COUNTER_MAX || (!inc && cnt == 0)) {
+			return;
+		}
+	} while (!g_atomic_int_compare_and_exchange (w, (gint)old,
+			(gint)(inc ? old + (1U << shift) : old - (1U << shift))));
+}
 
+static inline guint
+rspamd_bloom_idx (rspamd_bloom_filter_t *bloom, const void *data, gsize len,
+		guint n)
+{
+	return rspamd_cryptobox_fast_hash_specific (RSPAMD_CRYPTOBOX_XXHASH64,
+			data, len, bloom->seeds[n]) % bloom->asize;
+}
 
 rspamd_bloom_filter_t *
 rspamd_bloom_create (size_t size, size_t nfuncs, ...)
@@ -61,7 +97,7 @@ rspamd_bloom_create (size_t size, size_t nfuncs, ...)
 	va_list l;
 	gsize n;
 
-	if (!(bloom = g_malloc (sizeof (rspamd_bloom_filter_t)))) {
+	if (!(bloom = g_malloc0 (sizeof (rspamd_bloom_filter_t)))) {
 		return NULL;
 	}
 	if (!(bloom->a =
@@ -87,72 +123,609 @@ rspamd_bloom_create (size_t size, size_t nfuncs, ...)
 	return bloom;
 }
 
+static GQuark
+rspamd_bloom_quark (void)
+{
+	return g_quark_from_static_string ("bloom");
+}
+
+rspamd_bloom_filter_t *
+rspamd_bloom_open_file (const gchar *path, size_t size, GError **err)
+{
+	rspamd_bloom_filter_t *bloom;
+	struct rspamd_bloom_file_header hdr, *map;
+	static const guint32 default_seeds[] = {RSPAMD_DEFAULT_BLOOM_HASHES};
+	struct stat st;
+	gsize maplen;
+	gint fd;
+
+	if ((fd = open (path, O_RDWR | O_CREAT, 00600)) == -1) {
+		g_set_error (err, rspamd_bloom_quark (), errno,
+				"cannot open %s: %s", path, strerror (errno));
+
+		return NULL;
+	}
+
+	/* Serialise initialisation of a new file */
+	if (!rspamd_file_lock (fd, FALSE) || fstat (fd, &st) == -1) {
+		g_set_error (err, rspamd_bloom_quark (), errno,
+				"cannot lock %s: %s", path, strerror (errno));
+		close (fd);
+
+		return NULL;
+	}
+
+	if (st.st_size == 0) {
+		memset (&hdr, 0, sizeof (hdr));
+		memcpy (hdr.magic, RSPAMD_BLOOM_FILE_MAGIC, sizeof (hdr.magic));
+		hdr.asize = MAX (size, COUNTERS_PER_WORD);
+		/* The first element of default list is the number of functions */
+		hdr.nfuncs = default_seeds[0];
+		memcpy (hdr.seeds, &default_seeds[1], hdr.nfuncs * sizeof (guint32));
+		hdr.state = RSPAMD_BLOOM_FILE_EMPTY;
+		hdr.state_time = time (NULL);
+		maplen = sizeof (hdr) +
+				(hdr.asize + CHAR_BIT - 1) / CHAR_BIT * SIZE_BIT;
+
+		if (ftruncate (fd, maplen) == -1 ||
+				pwrite (fd, &hdr, sizeof (hdr), 0) != sizeof (hdr)) {
+			g_set_error (err, rspamd_bloom_quark (), errno,
+					"cannot create %s: %s", path, strerror (errno));
+			rspamd_file_unlock (fd, FALSE);
+			close (fd);
+			unlink (path);
+
+			return NULL;
+		}
+	}
+	else {
+		if (st.st_size < (gssize)sizeof (hdr) ||
+				pread (fd, &hdr, sizeof (hdr), 0) != sizeof (hdr) ||
+				memcmp (hdr.magic, RSPAMD_BLOOM_FILE_MAGIC,
+						sizeof (hdr.magic)) != 0 ||
+				hdr.nfuncs == 0 || hdr.nfuncs > RSPAMD_BLOOM_MAX_FUNCS ||
+				hdr.asize == 0) {
+			g_set_error (err, rspamd_bloom_quark (), EINVAL,
+					"%s is not a bloom filter file", path);
+			rspamd_file_unlock (fd, FALSE);
+			close (fd);
+
+			return NULL;
+		}
+
+		maplen = sizeof (hdr) +
+				(hdr.asize + CHAR_BIT - 1) / CHAR_BIT * SIZE_BIT;
+
+		if ((gsize)st.st_size < maplen) {
+			g_set_error (err, rspamd_bloom_quark (), EINVAL,
+					"%s is truncated", path);
+			rspamd_file_unlock (fd, FALSE);
+			close (fd);
+
+			return NULL;
+		}
+	}
+
+	map = mmap (NULL, maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	rspamd_file_unlock (fd, FALSE);
+	close (fd);
+
+	if (map == MAP_FAILED) {
+		g_set_error (err, rspamd_bloom_quark (), errno,
+				"cannot mmap %s: %s", path, strerror (errno));
+
+		return NULL;
+	}
+
+	bloom = g_malloc0 (sizeof (*bloom));
+	bloom->hdr = map;
+	bloom->maplen = maplen;
+	bloom->a = (gchar *)(map + 1);
+	bloom->asize = map->asize;
+	bloom->nfuncs = map->nfuncs;
+	bloom->seeds = map->seeds;
+
+	return bloom;
+}
+
+enum rspamd_bloom_file_state
+rspamd_bloom_file_get_state (rspamd_bloom_filter_t *bloom, time_t *changed)
+{
+	if (bloom->hdr == NULL) {
+		return RSPAMD_BLOOM_FILE_COMPLETE;
+	}
+
+	if (changed) {
+		*changed = bloom->hdr->state_time;
+	}
+
+	return g_atomic_int_get (&bloom->hdr->state);
+}
+
+gboolean
+rspamd_bloom_file_set_state (rspamd_bloom_filter_t *bloom,
+		enum rspamd_bloom_file_state old_state,
+		enum rspamd_bloom_file_state new_state)
+{
+	if (bloom->hdr == NULL) {
+		return FALSE;
+	}
+
+	if (g_atomic_int_compare_and_exchange (&bloom->hdr->state, old_state,
+			new_state)) {
+		bloom->hdr->state_time = time (NULL);
+
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
 void
 rspamd_bloom_destroy (rspamd_bloom_filter_t * bloom)
 {
-	g_free (bloom->a);
-	g_free (bloom->seeds);
+	if (bloom->hdr) {
+		munmap (bloom->hdr, bloom->maplen);
+	}
+	else {
+		g_free (bloom->a);
+		g_free (bloom->seeds);
+	}
+
 	g_free (bloom);
 }
 
 gboolean
-rspamd_bloom_add (rspamd_bloom_filter_t * bloom, const gchar *s)
+rspamd_bloom_add_buf (rspamd_bloom_filter_t *bloom, const void *data, gsize len)
 {
-	size_t n, len;
-	u_char t;
-	guint v;
+	size_t n;
 
-	if (s == NULL) {
+	if (data == NULL) {
 		return FALSE;
 	}
-	len = strlen (s);
+
 	for (n = 0; n < bloom->nfuncs; ++n) {
-		v = rspamd_cryptobox_fast_hash_specific (RSPAMD_CRYPTOBOX_XXHASH64,
-				s, len, bloom->seeds[n]) % bloom->asize;
-		INCBIT (bloom->a, v, t);
+		rspamd_bloom_update_counter (bloom,
+				rspamd_bloom_idx (bloom, data, len, n), TRUE);
 	}
 
 	return TRUE;
 }
 
 gboolean
-rspamd_bloom_del (rspamd_bloom_filter_t * bloom, const gchar *s)
+rspamd_bloom_del_buf (rspamd_bloom_filter_t *bloom, const void *data, gsize len)
 {
-	size_t n, len;
-	u_char t;
-	guint v;
+	size_t n;
 
-	if (s == NULL) {
+	if (data == NULL) {
 		return FALSE;
 	}
-	len = strlen (s);
+
 	for (n = 0; n < bloom->nfuncs; ++n) {
-		v = rspamd_cryptobox_fast_hash_specific (RSPAMD_CRYPTOBOX_XXHASH64,
-				s, len, bloom->seeds[n]) % bloom->asize;
-		DECBIT (bloom->a, v, t);
+		rspamd_bloom_update_counter (bloom,
+				rspamd_bloom_idx (bloom, data, len, n), FALSE);
 	}
 
 	return TRUE;
+}
+
+gboolean
+rspamd_bloom_check_buf (rspamd_bloom_filter_t *bloom, const void *data,
+		gsize len)
+{
+	size_t n;
+
+	if (data == NULL) {
+		return FALSE;
+	}
+
+	for (n = 0; n < bloom->nfuncs; ++n) {
+		if (rspamd_bloom_get_counter (bloom,
+				rspamd_bloom_idx (bloom, data, len, n)) == 0) {
+			return FALSE;
+		}
+	}
 
+	return TRUE;
 }
 
 gboolean
-rspamd_bloom_check (rspamd_bloom_filter_t * bloom, const gchar *s)
+rspamd_bloom_add (rspamd_bloom_filter_t * bloom, const gchar *s)
 {
-	size_t n, len;
-	guint v;
+	if (s == NULL) {
+		return FALSE;
+	}
+
+	return rspamd_bloom_add_buf (bloom, s, strlen (s));
+}
 
+gboolean
+rspamd_bloom_del (rspamd_bloom_filter_t * bloom, const gchar *s)
+{
 	if (s == NULL) {
 		return FALSE;
 	}
-	len = strlen (s);
-	for (n = 0; n < bloom->nfuncs; ++n) {
-		v = rspamd_cryptobox_fast_hash_specific (RSPAMD_CRYPTOBOX_XXHASH64,
-				s, len, bloom->seeds[n]) % bloom->asize;
-		if (!(GETBIT (bloom->a, v))) {
+
+	return rspamd_bloom_del_buf (bloom, s, strlen (s));
+}
+
+gboolean
+rspamd_bloom_check (rspamd_bloom_filter_t * bloom, const gchar *s)
+{
+	if (s == NULL) {
+		return FALSE;
+	}
+
+	return rspamd_bloom_check_buf (bloom, s, strlen (s));
+}
+
+/*
+ * Blocked bloom filter, each block is 8 words of 32 bits and each key sets
+ * one bit in every word of its block, bit numbers are derived from the low
+ * part of hash using multiplicative hashing with odd salts
+ */
+#define BLOCK_WORDS 8
+#define BLOCK_BITS (BLOCK_WORDS * 32)
+
+static const guint32 rspamd_bloom_blocked_salts[BLOCK_WORDS] = {
+	0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+	0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
+static inline guint32 *
+rspamd_bloom_blocked_block (rspamd_bloom_blocked_t *bloom, guint64 h,
+		guint32 *masks)
+{
+	guint32 key = (guint32)h;
+	guint i;
+
+	for (i = 0; i < BLOCK_WORDS; i ++) {
+		masks[i] = 1U << ((key * rspamd_bloom_blocked_salts[i]) >> 27);
+	}
+
+	/* Map the high part of hash to [0, nblocks) without division */
+	return bloom->blocks + ((h >> 32) * bloom->nblocks >> 32) * BLOCK_WORDS;
+}
+
+rspamd_bloom_blocked_t *
+rspamd_bloom_blocked_create (gsize nelts, gdouble fp_rate)
+{
+	rspamd_bloom_blocked_t *bloom;
+	gdouble nbits;
+
+	if (fp_rate <= 0 || fp_rate >= 1) {
+		fp_rate = 0.01;
+	}
+
+	/* Blocks are loaded unevenly, so they need ~10% more bits than optimal */
+	nbits = -(gdouble)MAX (nelts, 1) * log (fp_rate) / (M_LN2 * M_LN2) * 1.1;
+	bloom = g_malloc0 (sizeof (*bloom));
+	bloom->nblocks = MAX (1, ((guint64)nbits + BLOCK_BITS - 1) / BLOCK_BITS);
+	/* Block index is calculated from 32 bits of hash */
+	bloom->nblocks = MIN (bloom->nblocks, G_MAXUINT32);
+	bloom->seed = rspamd_random_uint64_fast ();
+
+	/* Blocks are aligned to cache lines */
+	if (posix_memalign ((void **)&bloom->blocks, 64,
+			bloom->nblocks * BLOCK_WORDS * sizeof (guint32)) != 0) {
+		g_free (bloom);
+
+		return NULL;
+	}
+
+	rspamd_bloom_blocked_clear (bloom);
+
+	return bloom;
+}
+
+void
+rspamd_bloom_blocked_destroy (rspamd_bloom_blocked_t *bloom)
+{
+	if (bloom) {
+		/* Not g_free as blocks are allocated using posix_memalign */
+		free (bloom->blocks);
+		g_free (bloom);
+	}
+}
+
+void
+rspamd_bloom_blocked_clear (rspamd_bloom_blocked_t *bloom)
+{
+	memset (bloom->blocks, 0,
+			bloom->nblocks * BLOCK_WORDS * sizeof (guint32));
+}
+
+void
+rspamd_bloom_blocked_add_hash (rspamd_bloom_blocked_t *bloom, guint64 h)
+{
+	guint32 masks[BLOCK_WORDS], *blk;
+	guint i;
+
+	blk = rspamd_bloom_blocked_block (bloom, h, masks);
+
+	for (i = 0; i < BLOCK_WORDS; i ++) {
+		blk[i] |= masks[i];
+	}
+}
+
+gboolean
+rspamd_bloom_blocked_check_hash (rspamd_bloom_blocked_t *bloom, guint64 h)
+{
+	guint32 masks[BLOCK_WORDS], *blk;
+#ifdef __SSE2__
+	__m128i zero = _mm_setzero_si128 (), t;
+#else
+	guint i;
+#endif
+
+	blk = rspamd_bloom_blocked_block (bloom, h, masks);
+
+#ifdef __SSE2__
+	t = _mm_or_si128 (
+			_mm_cmpeq_epi32 (_mm_and_si128 (
+					_mm_load_si128 ((const __m128i *)blk),
+					_mm_loadu_si128 ((const __m128i *)masks)), zero),
+			_mm_cmpeq_epi32 (_mm_and_si128 (
+					_mm_load_si128 ((const __m128i *)(blk + 4)),
+					_mm_loadu_si128 ((const __m128i *)(masks + 4))), zero));
+
+	return _mm_movemask_epi8 (t) == 0;
+#else
+	for (i = 0; i < BLOCK_WORDS; i ++) {
+		if ((blk[i] & masks[i]) == 0) {
 			return FALSE;
 		}
 	}
 
 	return TRUE;
+#endif
+}
+
+void
+rspamd_bloom_blocked_add_buf (rspamd_bloom_blocked_t *bloom,
+		const void *data, gsize len)
+{
+	rspamd_bloom_blocked_add_hash (bloom,
+			rspamd_cryptobox_fast_hash_specific (RSPAMD_CRYPTOBOX_XXHASH64,
+					data, len, bloom->seed));
+}
+
+gboolean
+rspamd_bloom_blocked_check_buf (rspamd_bloom_blocked_t *bloom,
+		const void *data, gsize len)
+{
+	return rspamd_bloom_blocked_check_hash (bloom,
+			rspamd_cryptobox_fast_hash_specific (RSPAMD_CRYPTOBOX_XXHASH64,
+					data, len, bloom->seed));
+}
+
+/*
+ * Cuckoo filter: a bucket is a 64 bit word of 4 fingerprints, so a bucket
+ * is checked for a fingerprint using a few arithmetic operations. Alternate
+ * bucket is calculated from the current one and fingerprint only
+ */
+#define CUCKOO_SLOTS 4
+#define CUCKOO_MAX_KICKS 500
+#define CUCKOO_LOAD 0.95
+#define CUCKOO_ONES 0x0001000100010001ULL
+#define CUCKOO_HIGHS 0x8000800080008000ULL
+
+static inline guint16
+rspamd_cuckoo_fp (guint64 h)
+{
+	guint16 fp = h >> 48;
+
+	/* Zero means empty slot */
+	return fp ? fp : 1;
+}
+
+static inline guint64
+rspamd_cuckoo_alt (rspamd_cuckoo_filter_t *filter, guint64 idx, guint16 fp)
+{
+	return (idx ^ (fp * 0x5bd1e995ULL)) & filter->mask;
+}
+
+static inline gboolean
+rspamd_cuckoo_bucket_has (guint64 bucket, guint16 fp)
+{
+	guint64 x = bucket ^ (fp * CUCKOO_ONES);
+
+	/* Whether any 16 bit lane of x is zero */
+	return ((x - CUCKOO_ONES) & ~x & CUCKOO_HIGHS) != 0;
+}
+
+static inline gboolean
+rspamd_cuckoo_bucket_insert (guint64 *bucket, guint16 fp)
+{
+	guint i;
+
+	for (i = 0; i < CUCKOO_SLOTS; i ++) {
+		if (((*bucket >> (i * 16)) & 0xffff) == 0) {
+			*bucket |= (guint64)fp << (i * 16);
+
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static inline gboolean
+rspamd_cuckoo_bucket_remove (guint64 *bucket, guint16 fp)
+{
+	guint i;
+
+	for (i = 0; i < CUCKOO_SLOTS; i ++) {
+		if (((*bucket >> (i * 16)) & 0xffff) == fp) {
+			*bucket &= ~(0xffffULL << (i * 16));
+
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static inline guint64
+rspamd_cuckoo_random (rspamd_cuckoo_filter_t *filter)
+{
+	/* xorshift64 is enough to select victims */
+	filter->rnd ^= filter->rnd << 13;
+	filter->rnd ^= filter->rnd >> 7;
+	filter->rnd ^= filter->rnd << 17;
+
+	return filter->rnd;
+}
+
+rspamd_cuckoo_filter_t *
+rspamd_cuckoo_filter_create (gsize nelts)
+{
+	rspamd_cuckoo_filter_t *filter;
+	guint64 nbuckets = 1;
+
+	while (nbuckets * CUCKOO_SLOTS * CUCKOO_LOAD < nelts) {
+		nbuckets <<= 1;
+	}
+
+	filter = g_malloc0 (sizeof (*filter));
+	filter->buckets = g_malloc0 (nbuckets * sizeof (guint64));
+	filter->mask = nbuckets - 1;
+	filter->seed = rspamd_random_uint64_fast ();
+	filter->rnd = filter->seed | 1;
+
+	return filter;
+}
+
+void
+rspamd_cuckoo_filter_destroy (rspamd_cuckoo_filter_t *filter)
+{
+	if (filter) {
+		g_free (filter->buckets);
+		g_free (filter);
+	}
+}
+
+gboolean
+rspamd_cuckoo_filter_add_hash (rspamd_cuckoo_filter_t *filter, guint64 h)
+{
+	guint16 fp = rspamd_cuckoo_fp (h), old;
+	guint64 idx = h & filter->mask, alt;
+	guint n, slot;
+
+	if (filter->victim_fp) {
+		/* Filter is full */
+		return FALSE;
+	}
+
+	alt = rspamd_cuckoo_alt (filter, idx, fp);
+
+	if (rspamd_cuckoo_bucket_insert (&filter->buckets[idx], fp) ||
+			rspamd_cuckoo_bucket_insert (&filter->buckets[alt], fp)) {
+		filter->nitems ++;
+
+		return TRUE;
+	}
+
+	idx = (rspamd_cuckoo_random (filter) & 1) ? alt : idx;
+
+	for (n = 0; n < CUCKOO_MAX_KICKS; n ++) {
+		slot = (rspamd_cuckoo_random (filter) % CUCKOO_SLOTS) * 16;
+		old = (filter->buckets[idx] >> slot) & 0xffff;
+		filter->buckets[idx] &= ~(0xffffULL << slot);
+		filter->buckets[idx] |= (guint64)fp << slot;
+		fp = old;
+		idx = rspamd_cuckoo_alt (filter, idx, fp);
+
+		if (rspamd_cuckoo_bucket_insert (&filter->buckets[idx], fp)) {
+			filter->nitems ++;
+
+			return TRUE;
+		}
+	}
+
+	/* The last kicked fingerprint is kept aside, so nothing is lost */
+	filter->victim_fp = fp;
+	filter->victim_idx = idx;
+	filter->nitems ++;
+
+	return TRUE;
+}
+
+gboolean
+rspamd_cuckoo_filter_check_hash (rspamd_cuckoo_filter_t *filter, guint64 h)
+{
+	guint16 fp = rspamd_cuckoo_fp (h);
+	guint64 idx = h & filter->mask, alt;
+
+	alt = rspamd_cuckoo_alt (filter, idx, fp);
+
+	if (filter->victim_fp == fp &&
+			(filter->victim_idx == idx || filter->victim_idx == alt)) {
+		return TRUE;
+	}
+
+	return rspamd_cuckoo_bucket_has (filter->buckets[idx], fp) ||
+			rspamd_cuckoo_bucket_has (filter->buckets[alt], fp);
+}
+
+gboolean
+rspamd_cuckoo_filter_del_hash (rspamd_cuckoo_filter_t *filter, guint64 h)
+{
+	guint16 fp = rspamd_cuckoo_fp (h), vfp;
+	guint64 idx = h & filter->mask, alt;
+
+	alt = rspamd_cuckoo_alt (filter, idx, fp);
+
+	if (rspamd_cuckoo_bucket_remove (&filter->buckets[idx], fp) ||
+			rspamd_cuckoo_bucket_remove (&filter->buckets[alt], fp)) {
+		filter->nitems --;
+
+		if (filter->victim_fp) {
+			/* Try to place victim as we have a free slot now */
+			vfp = filter->victim_fp;
+			filter->victim_fp = 0;
+			filter->nitems --;
+			rspamd_cuckoo_filter_add_hash (filter,
+					((guint64)vfp << 48) | filter->victim_idx);
+		}
+
+		return TRUE;
+	}
+
+	if (filter->victim_fp == fp &&
+			(filter->victim_idx == idx || filter->victim_idx == alt)) {
+		filter->victim_fp = 0;
+		filter->nitems --;
+
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+gboolean
+rspamd_cuckoo_filter_add_buf (rspamd_cuckoo_filter_t *filter,
+		const void *data, gsize len)
+{
+	return rspamd_cuckoo_filter_add_hash (filter,
+			rspamd_cryptobox_fast_hash_specific (RSPAMD_CRYPTOBOX_XXHASH64,
+					data, len, filter->seed));
+}
+
+gboolean
+rspamd_cuckoo_filter_check_buf (rspamd_cuckoo_filter_t *filter,
+		const void *data, gsize len)
+{
+	return rspamd_cuckoo_filter_check_hash (filter,
+			rspamd_cryptobox_fast_hash_specific (RSPAMD_CRYPTOBOX_XXHASH64,
+					data, len, filter->seed));
+}
+
+gboolean
+rspamd_cuckoo_filter_del_buf (rspamd_cuckoo_filter_t *filter,
+		const void *data, gsize len)
+{
+	return rspamd_cuckoo_filter_del_hash (filter,
+			rspamd_cryptobox_fast_hash_specific (RSPAMD_CRYPTOBOX_XXHASH64,
+					data, len, filter->seed));
 }
@@ -3,13 +3,27 @@
 
 #include "config.h"
 
+struct rspamd_bloom_file_header;
+
 typedef struct rspamd_bloom_filter_s {
 	size_t asize;
 	gchar *a;
 	size_t nfuncs;
 	guint32 *seeds;
+	struct rspamd_bloom_file_header *hdr; /* NULL if not backed by a file */
+	gsize maplen;
 } rspamd_bloom_filter_t;
 
+/*
+ * States of file backed filters, the state is shared between all processes
+ * that have opened the same file
+ */
+enum rspamd_bloom_file_state {
+	RSPAMD_BLOOM_FILE_EMPTY = 0,
+	RSPAMD_BLOOM_FILE_WARMING,
+	RSPAMD_BLOOM_FILE_COMPLETE,
+};
+
 
 /*
  * Some random uint32 seeds for hashing
@@ -25,6 +39,32 @@ typedef struct rspamd_bloom_filter_s {
  */
 rspamd_bloom_filter_t * rspamd_bloom_create (size_t size, size_t nfuncs, ...);
 
+/*
+ * Open or create bloom filter stored in a shared mapping of the specified
+ * file with the default hash functions. All processes that open the same
+ * file see insertions of each other and the filter persists between
+ * restarts. If file exists, its size and hash functions are used.
+ * @param path path to file
+ * @param size number of counters for a new file
+ * @param err error pointer
+ */
+rspamd_bloom_filter_t * rspamd_bloom_open_file (const gchar *path,
+		size_t size, GError **err);
+
+/*
+ * Returns state of file backed filter and time of the last state change
+ */
+enum rspamd_bloom_file_state rspamd_bloom_file_get_state (
+		rspamd_bloom_filter_t *bloom, time_t *changed);
+
+/*
+ * Atomically changes state of file backed filter from `old_state` to
+ * `new_state`, returns FALSE if the state is not `old_state`
+ */
+gboolean rspamd_bloom_file_set_state (rspamd_bloom_filter_t *bloom,
+		enum rspamd_bloom_file_state old_state,
+		enum rspamd_bloom_file_state new_state);
+
 /*
  * Destroy bloom filter
  */
@@ -45,4 +85,87 @@ gboolean rspamd_bloom_del (rspamd_bloom_filter_t * bloom, const gchar *s);
  */
 gboolean rspamd_bloom_check (rspamd_bloom_filter_t * bloom, const gchar *s);
 
+/*
+ * The same functions for binary data
+ */
+gboolean rspamd_bloom_add_buf (rspamd_bloom_filter_t *bloom,
+		const void *data, gsize len);
+gboolean rspamd_bloom_del_buf (rspamd_bloom_filter_t *bloom,
+		const void *data, gsize len);
+gboolean rspamd_bloom_check_buf (rspamd_bloom_filter_t *bloom,
+		const void *data, gsize len);
+
+/*
+ * Blocked bloom filter: all bits of a key are set in a single 256 bit block,
+ * so lookup costs one cache miss, one bit is set in each 32 bit word of a
+ * block. Filter is not thread safe and cannot be shared between processes.
+ * Hash functions take a precomputed 64 bit hash, e.g. a digest, whilst
+ * buffer functions hash data using the filter's seed
+ */
+typedef struct rspamd_bloom_blocked_s {
+	guint32 *blocks;
+	guint64 nblocks;
+	guint64 seed;
+} rspamd_bloom_blocked_t;
+
+/*
+ * Create new blocked bloom filter
+ * @param nelts expected number of elements
+ * @param fp_rate desired false positives rate
+ */
+rspamd_bloom_blocked_t * rspamd_bloom_blocked_create (gsize nelts,
+		gdouble fp_rate);
+void rspamd_bloom_blocked_destroy (rspamd_bloom_blocked_t *bloom);
+void rspamd_bloom_blocked_clear (rspamd_bloom_blocked_t *bloom);
+
+void rspamd_bloom_blocked_add_hash (rspamd_bloom_blocked_t *bloom, guint64 h);
+gboolean rspamd_bloom_blocked_check_hash (rspamd_bloom_blocked_t *bloom,
+		guint64 h);
+void rspamd_bloom_blocked_add_buf (rspamd_bloom_blocked_t *bloom,
+		const void *data, gsize len);
+gboolean rspamd_bloom_blocked_check_buf (rspamd_bloom_blocked_t *bloom,
+		const void *data, gsize len);
+
+/*
+ * Cuckoo filter with 16 bit fingerprints and buckets of 4 entries. Unlike
+ * counting bloom filter it supports deletion without saturation, however,
+ * only elements that have been added before should be deleted. Insertion
+ * fails when filter is full. Filter is not thread safe
+ */
+typedef struct rspamd_cuckoo_filter_s {
+	guint64 *buckets;
+	guint64 mask;
+	guint64 nitems;
+	guint64 seed;
+	guint64 rnd;
+	guint64 victim_idx;
+	guint16 victim_fp; /* 0 if there is no victim */
+} rspamd_cuckoo_filter_t;
+
+/*
+ * Create new cuckoo filter
+ * @param nelts maximum number of elements
+ */
+rspamd_cuckoo_filter_t * rspamd_cuckoo_filter_create (gsize nelts);
+void rspamd_cuckoo_filter_destroy (rspamd_cuckoo_filter_t *filter);
+
+/*
+ * Returns FALSE if filter is full
+ */
+gboolean rspamd_cuckoo_filter_add_hash (rspamd_cuckoo_filter_t *filter,
+		guint64 h);
+gboolean rspamd_cuckoo_filter_check_hash (rspamd_cuckoo_filter_t *filter,
+		guint64 h);
+/*
+ * Returns FALSE if element has not been found
+ */
+gboolean rspamd_cuckoo_filter_del_hash (rspamd_cuckoo_filter_t *filter,
+		guint64 h);
+gboolean rspamd_cuckoo_filter_add_buf (rspamd_cuckoo_filter_t *filter,
+		const void *data, gsize len);
+gboolean rspamd_cuckoo_filter_check_buf (rspamd_cuckoo_filter_t *filter,
+		const void *data, gsize len);
+gboolean rspamd_cuckoo_filter_del_buf (rspamd_cuckoo_filter_t *filter,
+		const void *data, gsize len);
+
 #endif
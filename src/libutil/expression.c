@@ -23,7 +23,6 @@
 #include <math.h>
 
 #define RSPAMD_EXPR_FLAG_NEGATE (1 << 0)
-#define RSPAMD_EXPR_FLAG_PROCESSED (1 << 1)
 
 #define MIN_RESORT_EVALS 50
 #define MAX_RESORT_EVALS 150
@@ -45,7 +44,34 @@ struct rspamd_expression_elt {
 
 	gint flags;
 	gint priority;
+};
+
+enum rspamd_expression_insn_type {
+	INSN_ATOM = 0,
+	INSN_OP,
+	INSN_NAN
+};
+
+/*
+ * Flat representation of the AST: atoms push their values to the stack,
+ * operations fold the top value into the accumulator below it and jump to
+ * the end of their subtree when the result cannot change anymore
+ */
+struct rspamd_expression_insn {
+	enum rspamd_expression_insn_type type;
+	gboolean first;
+	guint slot;
+	guint jump;
+	gdouble lim;
+	struct rspamd_expression_elt *elt;
+	struct rspamd_expression_elt *parelt;
+};
+
+/* Atoms with the same string may share a slot and are evaluated once */
+struct rspamd_expression_slot {
+	rspamd_expression_atom_t *atom;
 	gdouble value;
+	gboolean processed;
 };
 
 struct rspamd_expression {
@@ -53,6 +79,9 @@ struct rspamd_expression {
 	GArray *expressions;
 	GPtrArray *expression_stack;
 	GNode *ast;
+	GArray *code;
+	GArray *slots;
+	gdouble *stack;
 	guint next_resort;
 	guint evals;
 };
@@ -363,7 +392,14 @@ rspamd_expression_destroy (struct rspamd_expression *expr)
 		if (expr->ast) {
 			g_node_destroy (expr->ast);
 		}
+		if (expr->code) {
+			g_array_free (expr->code, TRUE);
+		}
+		if (expr->slots) {
+			g_array_free (expr->slots, TRUE);
+		}
 
+		g_free (expr->stack);
 		g_free (expr);
 	}
 }
@@ -561,6 +597,120 @@ rspamd_expr_dup_elt (rspamd_mempool_t *pool, struct rspamd_expression_elt *elt)
 	return n;
 }
 
+static guint
+rspamd_expr_atom_slot (struct rspamd_expression *expr,
+		rspamd_expression_atom_t *atom)
+{
+	struct rspamd_expression_slot *slot, nslot;
+	guint i;
+
+	for (i = 0; expr->subr->share_atoms && i < expr->slots->len; i ++) {
+		slot = &g_array_index (expr->slots, struct rspamd_expression_slot, i);
+
+		if (slot->atom->len == atom->len &&
+				memcmp (slot->atom->str, atom->str, atom->len) == 0) {
+			return i;
+		}
+	}
+
+	memset (&nslot, 0, sizeof (nslot));
+	nslot.atom = atom;
+	g_array_append_val (expr->slots, nslot);
+
+	return expr->slots->len - 1;
+}
+
+static void
+rspamd_expr_compile_node (struct rspamd_expression *expr, GNode *node)
+{
+	struct rspamd_expression_elt *elt, *celt, *parelt = NULL;
+	struct rspamd_expression_insn insn, *cur;
+	GNode *cld;
+	gdouble lim = 0;
+	guint i, start;
+	gboolean first = TRUE;
+
+	elt = node->data;
+	memset (&insn, 0, sizeof (insn));
+
+	switch (elt->type) {
+	case ELT_ATOM:
+		insn.type = INSN_ATOM;
+		insn.elt = elt;
+		insn.slot = rspamd_expr_atom_slot (expr, elt->p.atom);
+		g_array_append_val (expr->code, insn);
+		break;
+	case ELT_LIMIT:
+		/* Limits are folded into operations */
+		break;
+	case ELT_OP:
+		g_assert (node->children != NULL);
+
+		/* Try to find limit at the parent node */
+		if (node->parent) {
+			parelt = node->parent->data;
+			celt = node->parent->children->data;
+
+			if (celt->type == ELT_LIMIT) {
+				lim = celt->p.lim;
+			}
+		}
+
+		start = expr->code->len;
+
+		DL_FOREACH (node->children, cld) {
+			celt = cld->data;
+
+			/* Limits are sorted first, so they apply to all operands */
+			if (celt->type == ELT_LIMIT) {
+				lim = celt->p.lim;
+				continue;
+			}
+
+			rspamd_expr_compile_node (expr, cld);
+
+			insn.type = INSN_OP;
+			insn.elt = elt;
+			insn.parelt = parelt;
+			insn.lim = lim;
+			insn.first = first;
+			g_array_append_val (expr->code, insn);
+			first = FALSE;
+		}
+
+		if (first) {
+			/* No operands, the result is undefined */
+			insn.type = INSN_NAN;
+			g_array_append_val (expr->code, insn);
+		}
+
+		/* Early exits from this subtree jump to its end */
+		for (i = start; i < expr->code->len; i ++) {
+			cur = &g_array_index (expr->code, struct rspamd_expression_insn, i);
+
+			if (cur->type == INSN_OP && cur->elt == elt) {
+				cur->jump = expr->code->len;
+			}
+		}
+		break;
+	}
+}
+
+/*
+ * Translates AST to the flat code, must be called each time AST is resorted
+ */
+static void
+rspamd_expr_compile (struct rspamd_expression *expr)
+{
+	g_array_set_size (expr->code, 0);
+	g_array_set_size (expr->slots, 0);
+	rspamd_expr_compile_node (expr, expr->ast);
+
+	/* Stack depth cannot exceed the code length */
+	expr->stack = g_realloc (expr->stack,
+			MAX (expr->code->len, 1) * sizeof (gdouble));
+}
+
 gboolean
 rspamd_parse_expression (const gchar *line, gsize len,
 		const struct rspamd_atom_subr *subr, gpointer subr_data,
@@ -604,6 +754,8 @@ rspamd_parse_expression (const gchar *line, gsize len,
 	e->ast = NULL;
 	e->expression_stack = g_ptr_array_sized_new (32);
 	e->subr = subr;
+	e->code = g_array_new (FALSE, FALSE, sizeof (struct rspamd_expression_insn));
+	e->slots = g_array_new (FALSE, FALSE, sizeof (struct rspamd_expression_slot));
 	e->evals = 0;
 	e->next_resort = ottery_rand_range (MAX_RESORT_EVALS) + MIN_RESORT_EVALS;
 
@@ -867,6 +1019,7 @@ rspamd_parse_expression (const gchar *line, gsize len,
 	/* Now set less expensive branches to be evaluated first */
 	g_node_traverse (e->ast, G_POST_ORDER, G_TRAVERSE_NON_LEAVES, -1,
 			rspamd_ast_resort_traverse, NULL);
+	rspamd_expr_compile (e);
 
 	if (target) {
 		*target = e;
@@ -995,109 +1148,120 @@ rspamd_ast_do_op (struct rspamd_expression_elt *elt, gdouble val,
 }
 
 static gdouble
-rspamd_ast_process_node (struct rspamd_expression *expr, GNode *node,
-						 struct rspamd_expr_process_data *process_data)
+rspamd_expr_atom_value (struct rspamd_expression *expr,
+		struct rspamd_expression_insn *insn,
+		struct rspamd_expr_process_data *process_data)
 {
-	struct rspamd_expression_elt *elt, *celt, *parelt = NULL;
-	GNode *cld;
-	gdouble acc = NAN, lim = 0;
-	gdouble t1, t2, val;
+	struct rspamd_expression_slot *slot;
+	rspamd_expression_atom_t *atom = insn->elt->p.atom;
+	gdouble t1 = 0, t2;
 	gboolean calc_ticks = FALSE;
 
-	elt = node->data;
+	slot = &g_array_index (expr->slots, struct rspamd_expression_slot,
+			insn->slot);
 
-	switch (elt->type) {
-	case ELT_ATOM:
-		if (!(elt->flags & RSPAMD_EXPR_FLAG_PROCESSED)) {
+	if (slot->processed) {
+		return slot->value;
+	}
 
-			/*
-			 * Sometimes get ticks for this expression. 'Sometimes' here means
-			 * that we get lowest 5 bits of the counter `evals` and 5 bits
-			 * of some shifted address to provide some sort of jittering for
-			 * ticks evaluation
-			 */
-			if ((expr->evals & 0x1F) == (GPOINTER_TO_UINT (node) >> 4 & 0x1F)) {
-				calc_ticks = TRUE;
-				t1 = rspamd_get_ticks (TRUE);
-			}
+	/*
+	 * Sometimes get ticks for this expression. 'Sometimes' here means
+	 * that we get lowest 5 bits of the counter `evals` and 5 bits
+	 * of some shifted address to provide some sort of jittering for
+	 * ticks evaluation
+	 */
+	if ((expr->evals & 0x1F) == (GPOINTER_TO_UINT (insn->elt) >> 4 & 0x1F)) {
+		calc_ticks = TRUE;
+		t1 = rspamd_get_ticks (TRUE);
+	}
 
-			elt->value = expr->subr->process (process_data, elt->p.atom);
+	slot->value = expr->subr->process (process_data, atom);
 
-			if (fabs (elt->value) > 1e-9) {
-				elt->p.atom->hits ++;
+	if (fabs (slot->value) > 1e-9) {
+		atom->hits ++;
 
-				if (process_data->trace) {
-					g_ptr_array_add (process_data->trace, elt->p.atom);
-				}
-			}
+		if (process_data->trace) {
+			g_ptr_array_add (process_data->trace, atom);
+		}
+	}
 
-			if (calc_ticks) {
-				t2 = rspamd_get_ticks (TRUE);
-				elt->p.atom->avg_ticks += ((t2 - t1) - elt->p.atom->avg_ticks) /
-						(expr->evals);
-			}
+	if (calc_ticks) {
+		t2 = rspamd_get_ticks (TRUE);
+		atom->avg_ticks += ((t2 - t1) - atom->avg_ticks) / (expr->evals);
+	}
 
-			elt->flags |= RSPAMD_EXPR_FLAG_PROCESSED;
-		}
+	slot->processed = TRUE;
 
-		acc = elt->value;
-		break;
-	case ELT_LIMIT:
+	return slot->value;
+}
 
-		acc = elt->p.lim;
-		break;
-	case ELT_OP:
-		g_assert (node->children != NULL);
+/*
+ * If process_data is NULL then atoms are not processed and all of them are
+ * assumed to have `const_value`
+ */
+static gdouble
+rspamd_expr_execute (struct rspamd_expression *expr,
+		struct rspamd_expr_process_data *process_data,
+		gdouble const_value)
+{
+	struct rspamd_expression_insn *insn;
+	gdouble *stack = expr->stack, acc, val;
+	guint pc = 0, sp = 0, i;
+	gboolean noopt = FALSE;
 
-		/* Try to find limit at the parent node */
-		if (node->parent) {
-			parelt = node->parent->data;
-			celt = node->parent->children->data;
+	if (process_data) {
+		noopt = process_data->flags & RSPAMD_EXPRESSION_FLAG_NOOPT;
+	}
 
-			if (celt->type == ELT_LIMIT) {
-				lim = celt->p.lim;
-			}
-		}
+	for (i = 0; i < expr->slots->len; i ++) {
+		g_array_index (expr->slots, struct rspamd_expression_slot,
+				i).processed = FALSE;
+	}
 
-		DL_FOREACH (node->children, cld) {
-			celt = cld->data;
+	while (pc < expr->code->len) {
+		insn = &g_array_index (expr->code, struct rspamd_expression_insn, pc);
 
-			/* Save limit if we've found it */
-			if (celt->type == ELT_LIMIT) {
-				lim = celt->p.lim;
-				continue;
+		switch (insn->type) {
+		case INSN_ATOM:
+			if (process_data) {
+				stack[sp++] = rspamd_expr_atom_value (expr, insn, process_data);
 			}
+			else {
+				stack[sp++] = const_value;
+			}
+			pc ++;
+			break;
+		case INSN_NAN:
+			stack[sp++] = NAN;
+			pc ++;
+			break;
+		case INSN_OP:
+			val = stack[--sp];
 
-			val = rspamd_ast_process_node (expr, cld, process_data);
-
-			if (isnan (acc)) {
-				acc = rspamd_ast_do_op (elt, val, 0, lim, TRUE);
+			if (insn->first) {
+				acc = rspamd_ast_do_op (insn->elt, val, 0, insn->lim, TRUE);
 			}
 			else {
-				acc = rspamd_ast_do_op (elt, val, acc, lim, FALSE);
+				acc = rspamd_ast_do_op (insn->elt, val, stack[--sp], insn->lim,
+						FALSE);
 			}
 
-			if (!(process_data->flags & RSPAMD_EXPRESSION_FLAG_NOOPT)) {
-				if (rspamd_ast_node_done (elt, parelt, acc, lim)) {
-					return acc;
-				}
+			stack[sp++] = acc;
+
+			if (!noopt && rspamd_ast_node_done (insn->elt, insn->parelt,
+					acc, insn->lim)) {
+				pc = insn->jump;
 			}
+			else {
+				pc ++;
+			}
+			break;
 		}
-		break;
 	}
 
-	return acc;
-}
-
-static gboolean
-rspamd_ast_cleanup_traverse (GNode *n, gpointer d)
-{
-	struct rspamd_expression_elt *elt = n->data;
-
-	elt->value = 0;
-	elt->flags = 0;
+	g_assert (sp == 1);
 
-	return FALSE;
+	return stack[0];
 }
 
 gdouble
@@ -1110,11 +1274,7 @@ rspamd_process_expression_track (struct rspamd_expression *expr, struct rspamd_e
 	g_assert (expr->expression_stack->len == 0);
 
 	expr->evals ++;
-	ret = rspamd_ast_process_node (expr, expr->ast, process_data);
-
-	/* Cleanup */
-	g_node_traverse (expr->ast, G_IN_ORDER, G_TRAVERSE_ALL, -1,
-			rspamd_ast_cleanup_traverse, NULL);
+	ret = rspamd_expr_execute (expr, process_data, 0.0);
 
 	/* Check if we need to resort */
 	if (expr->evals % expr->next_resort == 0) {
@@ -1127,6 +1287,7 @@ rspamd_process_expression_track (struct rspamd_expression *expr, struct rspamd_e
 		/* Now set less expensive branches to be evaluated first */
 		g_node_traverse (expr->ast, G_POST_ORDER, G_TRAVERSE_NON_LEAVES, -1,
 				rspamd_ast_resort_traverse, NULL);
+		rspamd_expr_compile (expr);
 	}
 
 	return ret;
@@ -1138,6 +1299,15 @@ rspamd_process_expression (struct rspamd_expression *expr, struct rspamd_expr_pr
 	return rspamd_process_expression_track (expr, process_data);
 }
 
+gdouble
+rspamd_expression_constant_value (struct rspamd_expression *expr,
+		gdouble atoms_value)
+{
+	g_assert (expr != NULL);
+
+	return rspamd_expr_execute (expr, NULL, atoms_value);
+}
+
 static gboolean
 rspamd_ast_string_traverse (GNode *n, gpointer d)
 {
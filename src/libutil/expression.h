@@ -77,6 +77,8 @@ struct rspamd_atom_subr {
 	/* Calculates the relative priority of the expression */
 	gint (*priority) (rspamd_expression_atom_t *atom);
 	void (*destroy) (rspamd_expression_atom_t *atom);
+	/* Atoms with the same string have no side effects and can be evaluated once */
+	gboolean share_atoms;
 };
 
 /* Opaque structure */
@@ -118,6 +120,16 @@ gdouble rspamd_process_expression (struct rspamd_expression *expr,
 gdouble rspamd_process_expression_track (struct rspamd_expression *expr,
 		struct rspamd_expr_process_data *process_data);
 
+/**
+ * Returns the value of expression assuming that all atoms have the same value,
+ * atoms themselves are not processed
+ * @param expr expression to evaluate
+ * @param atoms_value value of all atoms
+ * @return the value of expression
+ */
+gdouble rspamd_expression_constant_value (struct rspamd_expression *expr,
+		gdouble atoms_value);
+
 /**
  * Shows string representation of an expression
  * @param expr expression to show
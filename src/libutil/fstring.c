@@ -470,3 +470,112 @@ rspamd_fstringdup (const rspamd_fstring_t *src)
 
 	return newstr;
 }
+
+/* Chunks of rope grow twice up to this limit */
+#define ROPE_DEFAULT_CHUNK_SIZE 4096
+#define ROPE_MAX_CHUNK_SIZE (4 * 1024 * 1024)
+
+rspamd_fstring_rope_t *
+rspamd_fstring_rope_new (gsize initial_size)
+{
+	rspamd_fstring_rope_t *rope;
+
+	rope = g_malloc0 (sizeof (*rope));
+	rope->chunks = g_ptr_array_new ();
+	rope->next_chunk_size = initial_size > 0 ?
+			initial_size : ROPE_DEFAULT_CHUNK_SIZE;
+
+	return rope;
+}
+
+void
+rspamd_fstring_rope_append (rspamd_fstring_rope_t *rope,
+		const gchar *in, gsize len)
+{
+	rspamd_fstring_t *last = NULL;
+	gsize avail;
+
+	if (rope->chunks->len > 0) {
+		last = g_ptr_array_index (rope->chunks, rope->chunks->len - 1);
+		avail = MIN (fstravail (last), len);
+
+		if (avail > 0) {
+			memcpy (last->str + last->len, in, avail);
+			last->len += avail;
+			rope->len += avail;
+			in += avail;
+			len -= avail;
+		}
+	}
+
+	if (len > 0) {
+		/* Never move the written data, start a new chunk instead */
+		last = rspamd_fstring_sized_new (MAX (len, rope->next_chunk_size));
+		memcpy (last->str, in, len);
+		last->len = len;
+		rope->len += len;
+		g_ptr_array_add (rope->chunks, last);
+
+		if (rope->next_chunk_size < ROPE_MAX_CHUNK_SIZE) {
+			rope->next_chunk_size *= 2;
+		}
+	}
+}
+
+void
+rspamd_fstring_rope_append_fstring_steal (rspamd_fstring_rope_t *rope,
+		rspamd_fstring_t *str)
+{
+	rspamd_fstring_t *last;
+
+	if (rope->chunks->len > 0) {
+		last = g_ptr_array_index (rope->chunks, rope->chunks->len - 1);
+
+		if (fstravail (last) >= str->len) {
+			/* Small strings are cheaper to copy than to write separately */
+			memcpy (last->str + last->len, str->str, str->len);
+			last->len += str->len;
+			rope->len += str->len;
+			rspamd_fstring_free (str);
+
+			return;
+		}
+	}
+
+	rope->len += str->len;
+	g_ptr_array_add (rope->chunks, str);
+}
+
+rspamd_fstring_t *
+rspamd_fstring_rope_flatten (const rspamd_fstring_rope_t *rope)
+{
+	rspamd_fstring_t *res, *chunk;
+	guint i;
+
+	res = rspamd_fstring_sized_new (rope->len);
+
+	for (i = 0; i < rope->chunks->len; i ++) {
+		chunk = g_ptr_array_index (rope->chunks, i);
+		memcpy (res->str + res->len, chunk->str, chunk->len);
+		res->len += chunk->len;
+	}
+
+	return res;
+}
+
+void
+rspamd_fstring_rope_free (rspamd_fstring_rope_t *rope)
+{
+	rspamd_fstring_t *chunk;
+	guint i;
+
+	if (rope) {
+		for (i = 0; i < rope->chunks->len; i ++) {
+			chunk = g_ptr_array_index (rope->chunks, i);
+			rspamd_fstring_free (chunk);
+		}
+
+		g_ptr_array_free (rope->chunks, TRUE);
+		g_free (rope);
+	}
+}
@@ -181,6 +181,55 @@ gchar *rspamd_ftokdup (const rspamd_ftok_t *src) G_GNUC_WARN_UNUSED_RESULT;
  */
 gchar *rspamd_fstringdup (const rspamd_fstring_t *src) G_GNUC_WARN_UNUSED_RESULT;
 
+/**
+ * Rope of fixed strings, data is appended without moving the already
+ * written chunks, so it suits large incrementally built outputs that are
+ * written using scattered IO
+ */
+typedef struct rspamd_fstring_rope_s {
+	GPtrArray *chunks; /* rspamd_fstring_t */
+	gsize len;
+	gsize next_chunk_size;
+} rspamd_fstring_rope_t;
+
+/**
+ * Create new rope
+ * @param initial_size size of the first chunk (0 for default)
+ * @return
+ */
+rspamd_fstring_rope_t *rspamd_fstring_rope_new (gsize initial_size)
+		G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Append data to the rope
+ * @param rope
+ * @param in
+ * @param len
+ */
+void rspamd_fstring_rope_append (rspamd_fstring_rope_t *rope,
+		const gchar *in, gsize len);
+
+/**
+ * Append the existing fixed string as a new chunk without copying it
+ * @param rope
+ * @param str string that is owned by rope afterwards
+ */
+void rspamd_fstring_rope_append_fstring_steal (rspamd_fstring_rope_t *rope,
+		rspamd_fstring_t *str);
+
+/**
+ * Copy the content of rope to a single fixed string
+ * @param rope
+ * @return new string
+ */
+rspamd_fstring_t *rspamd_fstring_rope_flatten (const rspamd_fstring_rope_t *rope)
+		G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Free rope and all its chunks
+ */
+void rspamd_fstring_rope_free (rspamd_fstring_rope_t *rope);
+
 #define RSPAMD_FTOK_ASSIGN(t, lit) do { (t)->begin = (lit); (t)->len = sizeof(lit) - 1; } while (0)
 #define RSPAMD_FTOK_FROM_STR(t, str) do { \
 	if (G_LIKELY(str)) { \
@@ -27,6 +27,7 @@
 #include "unix-std.h"
 #include "libutil/ssl_util.h"
 #include "libutil/regexp.h"
+#include "libutil/timer_wheel.h"
 #include "libserver/url.h"
 
 #include <openssl/err.h>
@@ -45,6 +46,8 @@ enum rspamd_http_priv_flags {
 	RSPAMD_HTTP_CONN_FLAG_NEW_HEADER = 1 << 1,
 	RSPAMD_HTTP_CONN_FLAG_RESETED = 1 << 2,
 	RSPAMD_HTTP_CONN_FLAG_TOO_LARGE = 1 << 3,
+	RSPAMD_HTTP_CONN_FLAG_KEEP_ALIVE = 1 << 4,
+	RSPAMD_HTTP_CONN_FLAG_COMPLETE = 1 << 5,
 };
 
 #define IS_CONN_ENCRYPTED(c) ((c)->flags & RSPAMD_HTTP_CONN_FLAG_ENCRYPTED)
@@ -54,12 +57,15 @@ struct rspamd_http_connection_private {
 	gpointer ssl_ctx;
 	struct rspamd_ssl_connection *ssl;
 	struct _rspamd_http_privbuf *buf;
+	/* Data read after the end of the previous message */
+	rspamd_fstring_t *pipelined;
 	struct rspamd_cryptobox_pubkey *peer_key;
 	struct rspamd_cryptobox_keypair *local_key;
 	struct rspamd_http_header *header;
 	struct http_parser parser;
 	struct http_parser_settings parser_cb;
 	struct event ev;
+	struct rspamd_wheel_timer timer; /* timeout of ev for plain connections */
 	struct timeval tv;
 	struct timeval *ptv;
 	struct rspamd_http_message *msg;
@@ -70,6 +76,63 @@ struct rspamd_http_connection_private {
 	gsize wr_total;
 };
 
+static void rspamd_http_event_handler (int fd, short what, gpointer ud);
+
+static void
+rspamd_http_timeout_handler (gpointer ud)
+{
+	struct rspamd_http_connection *conn = ud;
+	struct rspamd_http_connection_private *priv = conn->priv;
+
+	if (priv->ev.ev_events & EV_PERSIST) {
+		rspamd_wheel_timer_add (priv->timer.wheel, &priv->timer,
+				tv_to_double (priv->ptv));
+	}
+	else {
+		event_del (&priv->ev);
+	}
+
+	rspamd_http_event_handler (conn->fd, EV_TIMEOUT, conn);
+}
+
+/*
+ * Timeouts of plain connections are tracked by the timer wheel as they are
+ * restarted on each read and write, SSL connections manage their event
+ * themselves so they use libevent timeouts
+ */
+static void
+rspamd_http_event_add (struct rspamd_http_connection *conn)
+{
+	struct rspamd_http_connection_private *priv = conn->priv;
+
+	if (priv->ssl != NULL || priv->ptv == NULL) {
+		rspamd_wheel_timer_del (&priv->timer);
+		event_add (&priv->ev, priv->ptv);
+
+		return;
+	}
+
+	event_add (&priv->ev, NULL);
+
+	if (!rspamd_wheel_timer_pending (&priv->timer)) {
+		rspamd_wheel_timer_init (&priv->timer, rspamd_http_timeout_handler,
+				conn);
+	}
+
+	rspamd_wheel_timer_add (rspamd_timer_wheel_get (priv->ev.ev_base),
+			&priv->timer, tv_to_double (priv->ptv));
+}
+
+static void
+rspamd_http_event_del (struct rspamd_http_connection_private *priv)
+{
+	if (rspamd_event_pending (&priv->ev, EV_READ|EV_WRITE|EV_TIMEOUT)) {
+		event_del (&priv->ev);
+	}
+
+	rspamd_wheel_timer_del (&priv->timer);
+}
+
 enum http_magic_type {
 	HTTP_MAGIC_PLAIN = 0,
 	HTTP_MAGIC_HTML,
@@ -91,6 +154,19 @@ static const struct _rspamd_http_magic {
 	[HTTP_MAGIC_JPG] = { "jpg", "image/jpeg" },
 };
 
+/*
+ * Client connections with no local key share the session keypair, so servers
+ * can resume the shared key found in their caches. Like keys of the proxy it
+ * is rotated within [lifetime, 2 * lifetime] seconds
+ */
+#define RSPAMD_HTTP_SESSION_KEY_LIFETIME 60
+#define RSPAMD_HTTP_SESSION_CACHE_SIZE 64
+
+static struct rspamd_cryptobox_keypair *http_session_kp = NULL;
+static struct rspamd_keypair_cache *http_session_cache = NULL;
+static time_t http_session_expire = 0;
+static pid_t http_session_pid = 0;
+
 static const gchar *http_week[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
 static const gchar *http_month[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
 							   "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
@@ -108,6 +184,7 @@ static const rspamd_ftok_t last_modified_header = {
 };
 
 static void rspamd_http_message_storage_cleanup (struct rspamd_http_message *msg);
+static void rspamd_http_flatten_rope (struct rspamd_http_message *msg);
 static gboolean rspamd_http_message_grow_body (struct rspamd_http_message *msg,
 		gsize len);
 
@@ -118,13 +195,114 @@ http_error_quark (void)
 	return g_quark_from_static_string ("http-error-quark");
 }
 
+/*
+ * Per process free lists for the objects allocated on each request. HTTP
+ * objects are never shared between threads, so no locking is required
+ */
+#define HTTP_FREELIST_HEADERS 1024
+#define HTTP_FREELIST_MESSAGES 64
+#define HTTP_FREELIST_CONNECTIONS 64
+#define HTTP_FREELIST_BUFS 32
+/* Larger buffers are returned to the allocator */
+#define HTTP_FREELIST_MAX_HEADER_LEN 512
+#define HTTP_FREELIST_MAX_BUF_LEN (64 * 1024)
+
+static struct {
+	struct rspamd_http_header *headers[HTTP_FREELIST_HEADERS];
+	struct rspamd_http_message *messages[HTTP_FREELIST_MESSAGES];
+	struct rspamd_http_connection *connections[HTTP_FREELIST_CONNECTIONS];
+	rspamd_fstring_t *bufs[HTTP_FREELIST_BUFS];
+	guint nheaders;
+	guint nmessages;
+	guint nconnections;
+	guint nbufs;
+} http_freelist;
+
+/* Returns an empty header, its combined string is reused if possible */
+static struct rspamd_http_header *
+rspamd_http_header_alloc (gsize len)
+{
+	struct rspamd_http_header *hdr;
+	rspamd_fstring_t *combined;
+
+	if (http_freelist.nheaders > 0) {
+		hdr = http_freelist.headers[--http_freelist.nheaders];
+		combined = hdr->combined;
+		memset (hdr, 0, sizeof (*hdr));
+
+		if (combined->allocated >= len) {
+			combined->len = 0;
+			hdr->combined = combined;
+
+			return hdr;
+		}
+
+		rspamd_fstring_free (combined);
+	}
+	else {
+		hdr = g_malloc0 (sizeof (*hdr));
+	}
+
+	hdr->combined = rspamd_fstring_sized_new (len);
+
+	return hdr;
+}
+
+static void
+rspamd_http_header_free (struct rspamd_http_header *hdr)
+{
+	if (http_freelist.nheaders < HTTP_FREELIST_HEADERS &&
+			hdr->combined != NULL &&
+			hdr->combined->allocated <= HTTP_FREELIST_MAX_HEADER_LEN) {
+		http_freelist.headers[http_freelist.nheaders++] = hdr;
+	}
+	else {
+		if (hdr->combined) {
+			rspamd_fstring_free (hdr->combined);
+		}
+
+		g_free (hdr);
+	}
+}
+
+static rspamd_fstring_t *
+rspamd_http_buf_alloc (gsize len)
+{
+	rspamd_fstring_t *buf;
+
+	if (http_freelist.nbufs > 0) {
+		buf = http_freelist.bufs[--http_freelist.nbufs];
+		buf->len = 0;
+
+		if (buf->allocated >= len) {
+			return buf;
+		}
+
+		rspamd_fstring_free (buf);
+	}
+
+	return rspamd_fstring_sized_new (len);
+}
+
+static void
+rspamd_http_buf_free (rspamd_fstring_t *buf)
+{
+	if (http_freelist.nbufs < HTTP_FREELIST_BUFS &&
+			buf->allocated <= HTTP_FREELIST_MAX_BUF_LEN) {
+		http_freelist.bufs[http_freelist.nbufs++] = buf;
+	}
+	else {
+		rspamd_fstring_free (buf);
+	}
+}
+
 static void
 rspamd_http_privbuf_dtor (gpointer ud)
 {
 	struct _rspamd_http_privbuf *p = (struct _rspamd_http_privbuf *)ud;
 
 	if (p->data) {
-		rspamd_fstring_free (p->data);
+		rspamd_http_buf_free (p->data);
 	}
 
 	g_free (p);
@@ -421,6 +599,41 @@ rspamd_http_parse_date (const gchar *header, gsize len)
 	return (time_t) time;
 }
 
+struct rspamd_cryptobox_keypair *
+rspamd_http_session_keypair (void)
+{
+	time_t now = time (NULL);
+	pid_t pid = getpid ();
+
+	/* Forked processes must not share the secret key of their parent */
+	if (http_session_kp == NULL || now >= http_session_expire ||
+			pid != http_session_pid) {
+		if (http_session_kp) {
+			rspamd_keypair_unref (http_session_kp);
+		}
+
+		http_session_kp = rspamd_keypair_new (RSPAMD_KEYPAIR_KEX,
+				RSPAMD_CRYPTOBOX_MODE_25519);
+		http_session_expire = now + RSPAMD_HTTP_SESSION_KEY_LIFETIME +
+				ottery_rand_range (RSPAMD_HTTP_SESSION_KEY_LIFETIME);
+		http_session_pid = pid;
+	}
+
+	return rspamd_keypair_ref (http_session_kp);
+}
+
+/* Shared keys for connections with no keypairs cache of their own */
+static struct rspamd_keypair_cache *
+rspamd_http_session_cache (void)
+{
+	if (http_session_cache == NULL) {
+		http_session_cache = rspamd_keypair_cache_new (
+				RSPAMD_HTTP_SESSION_CACHE_SIZE);
+	}
+
+	return http_session_cache;
+}
+
 static void
 rspamd_http_parse_key (rspamd_ftok_t *data, struct rspamd_http_connection *conn,
 		struct rspamd_http_connection_private *priv)
@@ -551,8 +764,7 @@ rspamd_http_finish_header (struct rspamd_http_connection *conn,
 static void
 rspamd_http_init_header (struct rspamd_http_connection_private *priv)
 {
-	priv->header = g_malloc0 (sizeof (struct rspamd_http_header));
-	priv->header->combined = rspamd_fstring_new ();
+	priv->header = rspamd_http_header_alloc (64);
 }
 
 static gint
@@ -629,11 +841,16 @@ rspamd_http_on_headers_complete (http_parser * parser)
 		priv->flags &= ~RSPAMD_HTTP_CONN_FLAG_NEW_HEADER;
 	}
 
+	if ((conn->opts & RSPAMD_HTTP_KEEP_ALIVE) && http_should_keep_alive (parser)) {
+		priv->flags |= RSPAMD_HTTP_CONN_FLAG_KEEP_ALIVE;
+	}
+	else {
+		priv->flags &= ~RSPAMD_HTTP_CONN_FLAG_KEEP_ALIVE;
+	}
+
 	if (msg->method == HTTP_HEAD) {
 		/* We don't care about the rest */
-		if (rspamd_event_pending (&priv->ev, EV_READ)) {
-			event_del (&priv->ev);
-		}
+		rspamd_http_event_del (priv);
 
 		msg->code = parser->status_code;
 		rspamd_http_connection_ref (conn);
@@ -719,8 +936,11 @@ rspamd_http_on_body (http_parser * parser, const gchar *at, size_t length)
 			return -1;
 		}
 
-		/* We might have some leftover in our private buffer */
-		if (pbuf->data->len == length) {
+		/*
+		 * If this chunk ends our private buffer, then we can read the rest of
+		 * the body directly to the message, otherwise we have some leftover
+		 */
+		if (at + length == pbuf->data->str + pbuf->data->len) {
 			/* Switch to zero-copy mode */
 			rspamd_http_switch_zc (pbuf, msg);
 		}
@@ -730,6 +950,7 @@ rspamd_http_on_body (http_parser * parser, const gchar *at, size_t length)
 			/* Likely chunked encoding */
 			memmove ((gchar *)msg->body_buf.begin + msg->body_buf.len, at, length);
 			p = msg->body_buf.begin + msg->body_buf.len;
+			msg->body_copied += length;
 		}
 
 		/* Adjust zero-copy buf */
@@ -806,9 +1027,7 @@ rspamd_http_on_headers_complete_decrypted (http_parser *parser)
 
 	if (msg->method == HTTP_HEAD) {
 		/* We don't care about the rest */
-		if (rspamd_event_pending (&priv->ev, EV_READ)) {
-			event_del (&priv->ev);
-		}
+		rspamd_http_event_del (priv);
 
 		msg->code = parser->status_code;
 		rspamd_http_connection_ref (conn);
@@ -862,8 +1081,7 @@ rspamd_http_decrypt_message (struct rspamd_http_connection *conn,
 		HASH_DELETE (hh, msg->headers, hdr);
 
 		DL_FOREACH_SAFE (hdr, hcur, hcurtmp) {
-			rspamd_fstring_free (hcur->combined);
-			g_free (hcur);
+			rspamd_http_header_free (hcur);
 		}
 	}
 
@@ -899,6 +1117,22 @@ rspamd_http_decrypt_message (struct rspamd_http_connection *conn,
 	return 0;
 }
 
+static int
+rspamd_http_connection_finish_read (struct rspamd_http_connection *conn)
+{
+	struct rspamd_http_connection_private *priv = conn->priv;
+	int ret;
+
+	rspamd_http_event_del (priv);
+
+	rspamd_http_connection_ref (conn);
+	ret = conn->finish_handler (conn, priv->msg);
+	conn->finished = TRUE;
+	rspamd_http_connection_unref (conn);
+
+	return ret;
+}
+
 static int
 rspamd_http_on_message_complete (http_parser * parser)
 {
@@ -951,19 +1185,48 @@ rspamd_http_on_message_complete (http_parser * parser)
 	}
 
 	if (ret == 0) {
-		if (rspamd_event_pending (&priv->ev, EV_READ)) {
-			event_del (&priv->ev);
+		if (priv->flags & RSPAMD_HTTP_CONN_FLAG_KEEP_ALIVE) {
+			/*
+			 * The rest of the input can belong to the next pipelined message,
+			 * so we stop parsing here and let the event handler save it
+			 * before calling the finish handler
+			 */
+			priv->flags |= RSPAMD_HTTP_CONN_FLAG_COMPLETE;
+			http_parser_pause (parser, 1);
+		}
+		else {
+			ret = rspamd_http_connection_finish_read (conn);
 		}
-
-		rspamd_http_connection_ref (conn);
-		ret = conn->finish_handler (conn, priv->msg);
-		conn->finished = TRUE;
-		rspamd_http_connection_unref (conn);
 	}
 
 	return ret;
 }
 
+static void
+rspamd_http_connection_save_pipelined (struct rspamd_http_connection *conn,
+		const gchar *data, gsize len)
+{
+	struct rspamd_http_connection_private *priv = conn->priv;
+	rspamd_fstring_t *npipelined;
+
+	priv->flags &= ~RSPAMD_HTTP_CONN_FLAG_COMPLETE;
+
+	if (len > 0) {
+		/* These data precede anything that we have saved before */
+		npipelined = rspamd_fstring_new_init (data, len);
+
+		if (priv->pipelined != NULL) {
+			npipelined = rspamd_fstring_append (npipelined,
+					priv->pipelined->str, priv->pipelined->len);
+			rspamd_fstring_free (priv->pipelined);
+		}
+
+		priv->pipelined = npipelined;
+	}
+
+	rspamd_http_connection_finish_read (conn);
+}
+
 static void
 rspamd_http_simple_client_helper (struct rspamd_http_connection *conn)
 {
@@ -1069,7 +1332,7 @@ rspamd_http_write_helper (struct rspamd_http_connection *conn)
 	else {
 		/* Want to write more */
 		priv->flags &= ~RSPAMD_HTTP_CONN_FLAG_RESETED;
-		event_add (&priv->ev, priv->ptv);
+		rspamd_http_event_add (conn);
 	}
 
 	return;
@@ -1117,7 +1380,15 @@ rspamd_http_try_read (gint fd,
 		}
 	}
 
-	if (priv->ssl) {
+	if (priv->pipelined != NULL && priv->pipelined->len > 0) {
+		/* Consume the pending data of the pipelined message first */
+		r = MIN (priv->pipelined->len, len);
+		memcpy (data, priv->pipelined->str, r);
+		memmove (priv->pipelined->str, priv->pipelined->str + r,
+				priv->pipelined->len - r);
+		priv->pipelined->len -= r;
+	}
+	else if (priv->ssl) {
 		r = rspamd_ssl_read (priv->ssl, data, len);
 	}
 	else {
@@ -1162,6 +1433,7 @@ rspamd_http_event_handler (int fd, short what, gpointer ud)
 	struct _rspamd_http_privbuf *pbuf;
 	const gchar *d;
 	gssize r;
+	gsize nparsed;
 	GError *err;
 
 	priv = conn->priv;
@@ -1169,12 +1441,29 @@ rspamd_http_event_handler (int fd, short what, gpointer ud)
 	REF_RETAIN (pbuf);
 	rspamd_http_connection_ref (conn);
 
+	if (what != EV_TIMEOUT && rspamd_wheel_timer_pending (&priv->timer)) {
+		if (priv->ev.ev_events & EV_PERSIST) {
+			/* Libevent restarts timeout of a persistent event on activity */
+			rspamd_wheel_timer_add (priv->timer.wheel, &priv->timer,
+					tv_to_double (priv->ptv));
+		}
+		else {
+			rspamd_wheel_timer_del (&priv->timer);
+		}
+	}
+
 	if (what == EV_READ) {
 		r = rspamd_http_try_read (fd, conn, priv, pbuf, &d);
 
 		if (r > 0) {
-			if (http_parser_execute (&priv->parser, &priv->parser_cb,
-					d, r) != (size_t)r || priv->parser.http_errno != 0) {
+			nparsed = http_parser_execute (&priv->parser, &priv->parser_cb,
+					d, r);
+
+			if (priv->flags & RSPAMD_HTTP_CONN_FLAG_COMPLETE) {
+				rspamd_http_connection_save_pipelined (conn, d + nparsed,
+						r - nparsed);
+			}
+			else if (nparsed != (size_t)r || priv->parser.http_errno != 0) {
 				if (priv->flags & RSPAMD_HTTP_CONN_FLAG_TOO_LARGE) {
 					err = g_error_new (HTTP_ERROR, 413,
 							"Request entity too large: %zu",
@@ -1238,8 +1527,14 @@ rspamd_http_event_handler (int fd, short what, gpointer ud)
 		r = rspamd_http_try_read (fd, conn, priv, pbuf, &d);
 
 		if (r > 0) {
-			if (http_parser_execute (&priv->parser, &priv->parser_cb,
-					d, r) != (size_t)r || priv->parser.http_errno != 0) {
+			nparsed = http_parser_execute (&priv->parser, &priv->parser_cb,
+					d, r);
+
+			if (priv->flags & RSPAMD_HTTP_CONN_FLAG_COMPLETE) {
+				rspamd_http_connection_save_pipelined (conn, d + nparsed,
+						r - nparsed);
+			}
+			else if (nparsed != (size_t)r || priv->parser.http_errno != 0) {
 				err = g_error_new (HTTP_ERROR, priv->parser.http_errno,
 						"HTTP parser error: %s",
 						http_errno_description (priv->parser.http_errno));
@@ -1326,7 +1621,17 @@ rspamd_http_connection_new (
 		return NULL;
 	}
 
-	conn = g_malloc0 (sizeof (struct rspamd_http_connection));
+	if (http_freelist.nconnections > 0) {
+		conn = http_freelist.connections[--http_freelist.nconnections];
+		priv = conn->priv;
+		memset (conn, 0, sizeof (*conn));
+		memset (priv, 0, sizeof (*priv));
+	}
+	else {
+		conn = g_malloc0 (sizeof (struct rspamd_http_connection));
+		priv = g_malloc0 (sizeof (struct rspamd_http_connection_private));
+	}
+
 	conn->opts = opts;
 	conn->type = type;
 	conn->body_handler = body_handler;
@@ -1338,7 +1643,6 @@ rspamd_http_connection_new (
 	conn->cache = cache;
 
 	/* Init priv */
-	priv = g_malloc0 (sizeof (struct rspamd_http_connection_private));
 	conn->priv = priv;
 	priv->ssl_ctx = ssl_ctx;
 
@@ -1372,12 +1676,12 @@ rspamd_http_connection_reset (struct rspamd_http_connection *conn)
 
 	if (!(priv->flags & RSPAMD_HTTP_CONN_FLAG_RESETED)) {
 
-		if (rspamd_event_pending (&priv->ev, EV_READ|EV_WRITE|EV_TIMEOUT)) {
-			event_del (&priv->ev);
-		}
-
+		rspamd_http_event_del (priv);
 		rspamd_http_parser_reset (conn);
 	}
+	else {
+		rspamd_wheel_timer_del (&priv->timer);
+	}
 
 	if (priv->buf != NULL) {
 		REF_RELEASE (priv->buf);
@@ -1423,6 +1727,10 @@ rspamd_http_connection_copy_msg (struct rspamd_http_message *msg, GError **err)
 	struct stat st;
 	union _rspamd_storage_u *storage;
 
+	if (msg->body_rope) {
+		rspamd_http_flatten_rope (msg);
+	}
+
 	new_msg = rspamd_http_new_message (msg->type);
 	new_msg->flags = msg->flags;
 
@@ -1517,10 +1825,9 @@ rspamd_http_connection_copy_msg (struct rspamd_http_message *msg, GError **err)
 		nhdrs = NULL;
 
 		DL_FOREACH (hdr, hcur) {
-			nhdr = g_malloc (sizeof (struct rspamd_http_header));
-
-			nhdr->combined = rspamd_fstring_new_init (hcur->combined->str,
-					hcur->combined->len);
+			nhdr = rspamd_http_header_alloc (hcur->combined->len);
+			nhdr->combined = rspamd_fstring_append (nhdr->combined,
+					hcur->combined->str, hcur->combined->len);
 			nhdr->name.begin = nhdr->combined->str +
 					(hcur->name.begin - hcur->combined->str);
 			nhdr->name.len = hcur->name.len;
@@ -1552,6 +1859,10 @@ rspamd_http_connection_free (struct rspamd_http_connection *conn)
 			priv->ssl = NULL;
 		}
 
+		if (priv->pipelined) {
+			rspamd_fstring_free (priv->pipelined);
+		}
+
 		if (priv->local_key) {
 			rspamd_keypair_unref (priv->local_key);
 		}
@@ -1559,6 +1870,12 @@ rspamd_http_connection_free (struct rspamd_http_connection *conn)
 			rspamd_pubkey_unref (priv->peer_key);
 		}
 
+		if (http_freelist.nconnections < HTTP_FREELIST_CONNECTIONS) {
+			http_freelist.connections[http_freelist.nconnections++] = conn;
+
+			return;
+		}
+
 		g_free (priv);
 	}
 
@@ -1601,7 +1918,7 @@ rspamd_http_connection_read_message_common (struct rspamd_http_connection *conn,
 	priv->header = NULL;
 	priv->buf = g_malloc0 (sizeof (*priv->buf));
 	REF_INIT_RETAIN (priv->buf, rspamd_http_privbuf_dtor);
-	priv->buf->data = rspamd_fstring_sized_new (8192);
+	priv->buf->data = rspamd_http_buf_alloc (8192);
 	priv->flags |= RSPAMD_HTTP_CONN_FLAG_NEW_HEADER;
 
 	event_set (&priv->ev,
@@ -1614,7 +1931,12 @@ rspamd_http_connection_read_message_common (struct rspamd_http_connection *conn,
 	}
 
 	priv->flags &= ~RSPAMD_HTTP_CONN_FLAG_RESETED;
-	event_add (&priv->ev, priv->ptv);
+	rspamd_http_event_add (conn);
+
+	if (priv->pipelined != NULL && priv->pipelined->len > 0) {
+		/* We have already received (a part of) this message */
+		event_active (&priv->ev, EV_READ, 0);
+	}
 }
 
 void
@@ -1756,9 +2078,14 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 {
 	gchar datebuf[64];
 	gint meth_len = 0;
+	const gchar *conn_type = "close";
 	struct tm t;
 
 	if (conn->type == RSPAMD_HTTP_SERVER) {
+		if (rspamd_http_connection_is_keepalive (conn)) {
+			conn_type = "keep-alive";
+		}
+
 		/* Format reply */
 		if (msg->method < HTTP_SYMBOLS) {
 			rspamd_ftok_t status;
@@ -1801,12 +2128,13 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 					meth_len =
 							rspamd_snprintf (repbuf, replen,
 									"HTTP/1.1 %d %T\r\n"
-											"Connection: close\r\n"
+											"Connection: %s\r\n"
 											"Server: %s\r\n"
 											"Date: %s\r\n"
 											"Content-Length: %z\r\n"
 											"Content-Type: %s", /* NO \r\n at the end ! */
-									msg->code, &status, "rspamd/" RVERSION,
+									msg->code, &status, conn_type,
+									"rspamd/" RVERSION,
 									datebuf,
 									bodylen, mime_type);
 				}
@@ -1814,11 +2142,12 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 					meth_len =
 							rspamd_snprintf (repbuf, replen,
 									"HTTP/1.1 %d %T\r\n"
-											"Connection: close\r\n"
+											"Connection: %s\r\n"
 											"Server: %s\r\n"
 											"Date: %s\r\n"
 											"Content-Length: %z", /* NO \r\n at the end ! */
-									msg->code, &status, "rspamd/" RVERSION,
+									msg->code, &status, conn_type,
+									"rspamd/" RVERSION,
 									datebuf,
 									bodylen);
 				}
@@ -1826,24 +2155,25 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 				/* External reply */
 				rspamd_printf_fstring (buf,
 						"HTTP/1.1 200 OK\r\n"
-						"Connection: close\r\n"
+						"Connection: %s\r\n"
 						"Server: rspamd\r\n"
 						"Date: %s\r\n"
 						"Content-Length: %z\r\n"
 						"Content-Type: application/octet-stream\r\n",
-						datebuf, enclen);
+						conn_type, datebuf, enclen);
 			}
 			else {
 				if (mime_type) {
 					meth_len =
 							rspamd_printf_fstring (buf,
 									"HTTP/1.1 %d %T\r\n"
-											"Connection: close\r\n"
+											"Connection: %s\r\n"
 											"Server: %s\r\n"
 											"Date: %s\r\n"
 											"Content-Length: %z\r\n"
 											"Content-Type: %s\r\n",
-									msg->code, &status, "rspamd/" RVERSION,
+									msg->code, &status, conn_type,
+									"rspamd/" RVERSION,
 									datebuf,
 									bodylen, mime_type);
 				}
@@ -1851,11 +2181,12 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 					meth_len =
 							rspamd_printf_fstring (buf,
 									"HTTP/1.1 %d %T\r\n"
-											"Connection: close\r\n"
+											"Connection: %s\r\n"
 											"Server: %s\r\n"
 											"Date: %s\r\n"
 											"Content-Length: %z\r\n",
-									msg->code, &status, "rspamd/" RVERSION,
+									msg->code, &status, conn_type,
+									"rspamd/" RVERSION,
 									datebuf,
 									bodylen);
 				}
@@ -1893,6 +2224,10 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 		/* Format request */
 		enclen += msg->url->len + strlen (http_method_str (msg->method)) + 1;
 
+		if (conn->opts & RSPAMD_HTTP_KEEP_ALIVE) {
+			conn_type = "keep-alive";
+		}
+
 		if (host == NULL && msg->host == NULL) {
 			/* Fallback to HTTP/1.0 */
 			if (encrypted) {
@@ -1918,45 +2253,50 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 							mime_type);
 				}
 			}
+
+			if (conn->opts & RSPAMD_HTTP_KEEP_ALIVE) {
+				/* HTTP/1.0 connections are closed unless asked explicitly */
+				rspamd_printf_fstring (buf, "Connection: keep-alive\r\n");
+			}
 		}
 		else {
 			if (encrypted) {
 				if (host != NULL) {
 					rspamd_printf_fstring (buf,
 							"%s %s HTTP/1.1\r\n"
-							"Connection: close\r\n"
+							"Connection: %s\r\n"
 							"Host: %s\r\n"
 							"Content-Length: %z\r\n"
 							"Content-Type: application/octet-stream\r\n",
-							"POST", "/post", host, enclen);
+							"POST", "/post", conn_type, host, enclen);
 				}
 				else {
 					rspamd_printf_fstring (buf,
 							"%s %s HTTP/1.1\r\n"
-							"Connection: close\r\n"
+							"Connection: %s\r\n"
 							"Host: %V\r\n"
 							"Content-Length: %z\r\n"
 							"Content-Type: application/octet-stream\r\n",
-							"POST", "/post", msg->host, enclen);
+							"POST", "/post", conn_type, msg->host, enclen);
 				}
 			}
 			else {
 				if (host != NULL) {
 					rspamd_printf_fstring (buf,
-							"%s %V HTTP/1.1\r\nConnection: close\r\n"
+							"%s %V HTTP/1.1\r\nConnection: %s\r\n"
 							"Host: %s\r\n"
 							"Content-Length: %z\r\n",
-							http_method_str (msg->method), msg->url, host,
-							bodylen);
+							http_method_str (msg->method), msg->url, conn_type,
+							host, bodylen);
 				}
 				else {
 					rspamd_printf_fstring (buf,
 							"%s %V HTTP/1.1\r\n"
-							"Connection: close\r\n"
+							"Connection: %s\r\n"
 							"Host: %V\r\n"
 							"Content-Length: %z\r\n",
-							http_method_str (msg->method), msg->url, msg->host,
-							bodylen);
+							http_method_str (msg->method), msg->url, conn_type,
+							msg->host, bodylen);
 				}
 
 				if (bodylen > 0) {
@@ -1996,6 +2336,8 @@ rspamd_http_connection_write_message_common (struct rspamd_http_connection *conn
 	struct rspamd_http_header *hdr, *htmp, *hcur;
 	gchar repbuf[512], *pbody;
 	gint i, hdrcount, meth_len = 0, preludelen = 0;
+	guint j;
+	rspamd_fstring_t *chunk;
 	gsize bodylen, enclen = 0;
 	rspamd_fstring_t *buf;
 	gboolean encrypted = FALSE;
@@ -2024,24 +2366,29 @@ rspamd_http_connection_write_message_common (struct rspamd_http_connection *conn
 	buf = priv->buf->data;
 
 	if (priv->peer_key && priv->local_key) {
-		priv->msg->peer_key = priv->peer_key;
+		if (priv->msg->peer_key == NULL) {
+			priv->msg->peer_key = priv->peer_key;
+		}
+		else {
+			/* Message has its own key, e.g. on a kept alive connection */
+			rspamd_pubkey_unref (priv->peer_key);
+		}
+
 		priv->peer_key = NULL;
 		priv->flags |= RSPAMD_HTTP_CONN_FLAG_ENCRYPTED;
 	}
 
 	if (msg->peer_key != NULL) {
 		if (priv->local_key == NULL) {
-			/* Automatically generate a temporary keypair */
-			priv->local_key = rspamd_keypair_new (RSPAMD_KEYPAIR_KEX,
-					RSPAMD_CRYPTOBOX_MODE_25519);
+			/* Resume session of this process instead of a new keypair */
+			priv->local_key = rspamd_http_session_keypair ();
 		}
 
 		encrypted = TRUE;
 
-		if (conn->cache) {
-			rspamd_keypair_cache_process (conn->cache,
-					priv->local_key, priv->msg->peer_key);
-		}
+		rspamd_keypair_cache_process (
+				conn->cache ? conn->cache : rspamd_http_session_cache (),
+				priv->local_key, priv->msg->peer_key);
 	}
 
 	if (encrypted && (msg->flags &
@@ -2051,6 +2398,11 @@ rspamd_http_connection_write_message_common (struct rspamd_http_connection *conn
 		rspamd_http_detach_shared (msg);
 	}
 
+	if (msg->body_rope && (encrypted || msg->method >= HTTP_SYMBOLS)) {
+		/* Encryption and legacy replies need a contiguous body */
+		rspamd_http_flatten_rope (msg);
+	}
+
 	if (allow_shared) {
 		gchar tmpbuf[64];
 
@@ -2159,7 +2511,9 @@ rspamd_http_connection_write_message_common (struct rspamd_http_connection *conn
 	}
 	else {
 		if (msg->method < HTTP_SYMBOLS) {
-			if (msg->body_buf.len == 0 || allow_shared) {
+			if ((msg->body_buf.len == 0 &&
+					(msg->body_rope == NULL || msg->body_rope->len == 0)) ||
+					allow_shared) {
 				pbody = NULL;
 				bodylen = 0;
 				priv->outlen = 2;
@@ -2168,6 +2522,16 @@ rspamd_http_connection_write_message_common (struct rspamd_http_connection *conn
 					msg->method = HTTP_GET;
 				}
 			}
+			else if (msg->body_rope) {
+				/* Each chunk of rope is written as is */
+				pbody = NULL;
+				bodylen = msg->body_rope->len;
+				priv->outlen = 2 + msg->body_rope->chunks->len;
+
+				if (msg->method == HTTP_INVALID) {
+					msg->method = HTTP_POST;
+				}
+			}
 			else {
 				pbody = (gchar *)msg->body_buf.begin;
 				bodylen = msg->body_buf.len;
@@ -2294,13 +2658,17 @@ rspamd_http_connection_write_message_common (struct rspamd_http_connection *conn
 			priv->out[i].iov_base = pbody;
 			priv->out[i++].iov_len = bodylen;
 		}
+		else if (bodylen > 0 && msg->body_rope != NULL) {
+			PTR_ARRAY_FOREACH (msg->body_rope->chunks, j, chunk) {
+				priv->out[i].iov_base = chunk->str;
+				priv->out[i++].iov_len = chunk->len;
+			}
+		}
 	}
 
 	priv->flags &= ~RSPAMD_HTTP_CONN_FLAG_RESETED;
 
-	if (rspamd_event_pending (&priv->ev, EV_TIMEOUT|EV_WRITE|EV_READ)) {
-		event_del (&priv->ev);
-	}
+	rspamd_http_event_del (priv);
 
 	if (msg->flags & RSPAMD_HTTP_FLAG_SSL) {
 		if (base != NULL) {
@@ -2315,6 +2683,16 @@ rspamd_http_connection_write_message_common (struct rspamd_http_connection *conn
 			g_error_free (err);
 			return;
 		}
+		else if (priv->ssl && (priv->flags & RSPAMD_HTTP_CONN_FLAG_KEEP_ALIVE)) {
+			/* Kept alive connection, reuse the established TLS session */
+			event_set (&priv->ev, fd, EV_WRITE, rspamd_http_event_handler, conn);
+
+			if (base != NULL) {
+				event_base_set (base, &priv->ev);
+			}
+
+			rspamd_http_event_add (conn);
+		}
 		else {
 			if (priv->ssl) {
 				/* Cleanup the existing connection */
@@ -2348,7 +2726,7 @@ rspamd_http_connection_write_message_common (struct rspamd_http_connection *conn
 			event_base_set (base, &priv->ev);
 		}
 
-		event_add (&priv->ev, priv->ptv);
+		rspamd_http_event_add (conn);
 	}
 }
 
@@ -2375,7 +2753,13 @@ rspamd_http_new_message (enum http_parser_type type)
 {
 	struct rspamd_http_message *new;
 
-	new = g_malloc0 (sizeof (struct rspamd_http_message));
+	if (http_freelist.nmessages > 0) {
+		new = http_freelist.messages[--http_freelist.nmessages];
+		memset (new, 0, sizeof (*new));
+	}
+	else {
+		new = g_malloc0 (sizeof (struct rspamd_http_message));
+	}
 
 	if (type == HTTP_REQUEST) {
 		new->url = rspamd_fstring_new ();
@@ -2461,12 +2845,28 @@ rspamd_http_message_from_url (const gchar *url)
 	return msg;
 }
 
+static void
+rspamd_http_flatten_rope (struct rspamd_http_message *msg)
+{
+	rspamd_fstring_rope_t *rope = msg->body_rope;
+
+	/* Detach rope, so it is not freed by storage cleanup */
+	msg->body_rope = NULL;
+	rspamd_http_message_set_body_from_fstring_steal (msg,
+			rspamd_fstring_rope_flatten (rope));
+	rspamd_fstring_rope_free (rope);
+}
+
 const gchar *
 rspamd_http_message_get_body (struct rspamd_http_message *msg,
 		gsize *blen)
 {
 	const gchar *ret = NULL;
 
+	if (msg->body_rope) {
+		rspamd_http_flatten_rope (msg);
+	}
+
 	if (msg->body_buf.len > 0) {
 		ret = msg->body_buf.begin;
 	}
@@ -2671,6 +3071,18 @@ rspamd_http_message_set_body_from_fstring_steal (struct rspamd_http_message *msg
 	return TRUE;
 }
 
+gboolean
+rspamd_http_message_set_body_from_rope_steal (struct rspamd_http_message *msg,
+		rspamd_fstring_rope_t *rope)
+{
+	rspamd_http_message_storage_cleanup (msg);
+
+	msg->flags &= ~(RSPAMD_HTTP_FLAG_SHMEM|RSPAMD_HTTP_FLAG_SHMEM_IMMUTABLE);
+	msg->body_rope = rope;
+
+	return TRUE;
+}
+
 gboolean
 rspamd_http_message_set_body_from_fstring_copy (struct rspamd_http_message *msg,
 		const rspamd_fstring_t *fstr)
@@ -2736,6 +3148,8 @@ rspamd_http_message_grow_body (struct rspamd_http_message *msg, gsize len)
 		}
 	}
 	else {
+		/* Realloc is likely to move the existing data */
+		msg->body_copied += storage->normal->len;
 		storage->normal = rspamd_fstring_grow (storage->normal, len);
 
 		/* Append might cause realloc */
@@ -2755,6 +3169,7 @@ rspamd_http_message_append_body (struct rspamd_http_message *msg,
 	union _rspamd_storage_u *storage;
 
 	storage = &msg->body_buf.c;
+	msg->body_copied += len;
 
 	if (msg->flags & RSPAMD_HTTP_FLAG_SHMEM) {
 		if (!rspamd_http_message_grow_body (msg, len)) {
@@ -2765,6 +3180,11 @@ rspamd_http_message_append_body (struct rspamd_http_message *msg,
 		msg->body_buf.len += len;
 	}
 	else {
+		if (storage->normal->len + len > storage->normal->allocated) {
+			/* Realloc is likely to move the existing data */
+			msg->body_copied += storage->normal->len;
+		}
+
 		storage->normal = rspamd_fstring_append (storage->normal, data, len);
 
 		/* Append might cause realloc */
@@ -2811,6 +3231,11 @@ rspamd_http_message_storage_cleanup (struct rspamd_http_message *msg)
 		msg->body_buf.c.normal = NULL;
 	}
 
+	if (msg->body_rope) {
+		rspamd_fstring_rope_free (msg->body_rope);
+		msg->body_rope = NULL;
+	}
+
 	msg->body_buf.len = 0;
 }
 
@@ -2831,8 +3256,7 @@ rspamd_http_message_free (struct rspamd_http_message *msg)
 		HASH_DEL (msg->headers, hdr);
 
 		DL_FOREACH_SAFE (hdr, hcur, hcurtmp) {
-			rspamd_fstring_free (hcur->combined);
-			g_free (hcur);
+			rspamd_http_header_free (hcur);
 		}
 	}
 
@@ -2852,7 +3276,12 @@ rspamd_http_message_free (struct rspamd_http_message *msg)
 		rspamd_pubkey_unref (msg->peer_key);
 	}
 
-	g_free (msg);
+	if (http_freelist.nmessages < HTTP_FREELIST_MESSAGES) {
+		http_freelist.messages[http_freelist.nmessages++] = msg;
+	}
+	else {
+		g_free (msg);
+	}
 }
 
 void
@@ -2881,10 +3310,9 @@ rspamd_http_message_add_header_len (struct rspamd_http_message *msg,
 	guint nlen, vlen;
 
 	if (msg != NULL && name != NULL && value != NULL) {
-		hdr = g_malloc0 (sizeof (struct rspamd_http_header));
 		nlen = strlen (name);
 		vlen = len;
-		hdr->combined = rspamd_fstring_sized_new (nlen + vlen + 4);
+		hdr = rspamd_http_header_alloc (nlen + vlen + 4);
 		rspamd_printf_fstring (&hdr->combined, "%s: %*s\r\n", name, (gint)vlen,
 				value);
 		hdr->name.begin = hdr->combined->str;
@@ -2923,10 +3351,9 @@ rspamd_http_message_add_header_fstr (struct rspamd_http_message *msg,
 	guint nlen, vlen;
 
 	if (msg != NULL && name != NULL && value != NULL) {
-		hdr = g_malloc0 (sizeof (struct rspamd_http_header));
 		nlen = strlen (name);
 		vlen = value->len;
-		hdr->combined = rspamd_fstring_sized_new (nlen + vlen + 4);
+		hdr = rspamd_http_header_alloc (nlen + vlen + 4);
 		rspamd_printf_fstring (&hdr->combined, "%s: %V\r\n", name, value);
 		hdr->name.begin = hdr->combined->str;
 		hdr->name.len = nlen;
@@ -3007,8 +3434,7 @@ rspamd_http_message_remove_header (struct rspamd_http_message *msg,
 			res = TRUE;
 
 			DL_FOREACH_SAFE (hdr, hcur, hcurtmp) {
-				rspamd_fstring_free (hcur->combined);
-				g_free (hcur);
+				rspamd_http_header_free (hcur);
 			}
 		}
 	}
@@ -3560,6 +3986,15 @@ rspamd_http_connection_get_peer_key (struct rspamd_http_connection *conn)
 	return NULL;
 }
 
+gboolean
+rspamd_http_connection_is_keepalive (struct rspamd_http_connection *conn)
+{
+	struct rspamd_http_connection_private *priv = conn->priv;
+
+	return (conn->opts & RSPAMD_HTTP_KEEP_ALIVE) &&
+			(priv->flags & RSPAMD_HTTP_CONN_FLAG_KEEP_ALIVE);
+}
+
 gboolean
 rspamd_http_connection_is_encrypted (struct rspamd_http_connection *conn)
 {
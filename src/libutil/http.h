@@ -79,6 +79,7 @@ enum rspamd_http_options {
 	RSPAMD_HTTP_CLIENT_SIMPLE = 0x2, /**< Read HTTP client reply automatically */      //!< RSPAMD_HTTP_CLIENT_SIMPLE
 	RSPAMD_HTTP_CLIENT_ENCRYPTED = 0x4, /**< Encrypt data for client */                //!< RSPAMD_HTTP_CLIENT_ENCRYPTED
 	RSPAMD_HTTP_CLIENT_SHARED = 0x8, /**< Store reply in shared memory */              //!< RSPAMD_HTTP_CLIENT_SHARED
+	RSPAMD_HTTP_KEEP_ALIVE = 0x10, /**< Do not close connection if peer asks for keep-alive */
 };
 
 typedef int (*rspamd_http_body_handler_t) (struct rspamd_http_connection *conn,
@@ -168,6 +169,15 @@ struct rspamd_http_connection *rspamd_http_connection_new (
 void rspamd_http_connection_set_key (struct rspamd_http_connection *conn,
 		struct rspamd_cryptobox_keypair *key);
 
+/**
+ * Returns ephemeral keypair shared by encrypted client connections of the
+ * current process. It is rotated periodically, and servers reuse the shared
+ * secret for it from their keypairs caches instead of computing it for each
+ * connection
+ * @return new reference to the keypair
+ */
+struct rspamd_cryptobox_keypair* rspamd_http_session_keypair (void);
+
 /**
  * Get peer's public key
  * @param conn connection structure
@@ -183,6 +193,14 @@ const struct rspamd_cryptobox_pubkey* rspamd_http_connection_get_peer_key (
  */
 gboolean rspamd_http_connection_is_encrypted (struct rspamd_http_connection *conn);
 
+/**
+ * Returns TRUE if a connection can be reused after the current message, that
+ * is only possible if both this side and the peer allow keep-alive
+ * @param conn
+ * @return
+ */
+gboolean rspamd_http_connection_is_keepalive (struct rspamd_http_connection *conn);
+
 /**
  * Handle a request using socket fd and user data ud
  * @param conn connection structure
@@ -359,6 +377,16 @@ gboolean rspamd_http_message_set_body_from_fd (struct rspamd_http_message *msg,
 gboolean rspamd_http_message_set_body_from_fstring_steal (struct rspamd_http_message *msg,
 		rspamd_fstring_t *fstr);
 
+/**
+ * Uses rope as message's body, rope is consumed by this operation. Plain
+ * HTTP messages are written from the chunks of rope without copying them
+ * @param msg
+ * @param rope
+ * @return TRUE if a message's body has been set
+ */
+gboolean rspamd_http_message_set_body_from_rope_steal (struct rspamd_http_message *msg,
+		rspamd_fstring_rope_t *rope);
+
 /**
  * Uses rspamd_fstring_t as message's body, string is copied by this operation
  * @param msg
@@ -62,7 +62,11 @@ struct rspamd_http_message {
 		} c;
 	} body_buf;
 
+	/* Body that is written by chunks, body_buf is empty if it is set */
+	rspamd_fstring_rope_t *body_rope;
 	struct rspamd_cryptobox_pubkey *peer_key;
+	/* Number of body bytes copied in memory while receiving it */
+	gsize body_copied;
 	time_t date;
 	time_t last_modified;
 	unsigned port;
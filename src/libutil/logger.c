@@ -30,6 +30,9 @@
 #define REPEATS_MAX 300
 #define LOG_ID 6
 #define LOGBUF_LEN 8192
+/* Minimum and default sizes of rings used for asynchronous logging */
+#define LOG_RING_MIN_SIZE (64 * 1024)
+#define LOG_RING_DEFAULT_SIZE (1024 * 1024)
 
 struct rspamd_log_module {
 	gchar *mname;
@@ -53,6 +56,44 @@ struct rspamd_logger_error_elt {
 	gchar message[];
 };
 
+/*
+ * Ring of binary log records shared between a worker, that is the only writer,
+ * and the main process, that is the only reader. Positions are never wrapped
+ * and are masked by size, which is a power of two.
+ */
+struct rspamd_log_ring {
+	guint head;
+	guint dropped;
+	pid_t pid;
+	/* Avoid false cache sharing */
+	guchar __padding1[64 - sizeof (guint) * 2 - sizeof (pid_t)];
+	guint tail;
+	guint reported;
+	guint size;
+	guchar __padding2[64 - sizeof (guint) * 3];
+	guchar data[];
+};
+
+enum rspamd_log_ring_record_flags {
+	RSPAMD_LOG_RING_PAD = (1u << 0),
+};
+
+/* Followed by id, module, function and message, all zero terminated */
+struct rspamd_log_ring_record {
+	guint32 len;
+	guint32 flags;
+	gint level_flags;
+	pid_t pid;
+	gdouble ts;
+	GQuark ptype;
+	guint32 id_len;
+	guint32 module_len;
+	guint32 function_len;
+	guint32 msg_len;
+};
+
+#define LOG_RING_ALIGN(x) (((x) + 7) & ~7)
+
 struct rspamd_logger_error_log {
 	struct rspamd_logger_error_elt *elts;
 	rspamd_mempool_t *pool;
@@ -76,6 +117,8 @@ struct rspamd_logger_s {
 	gboolean log_buffered;
 	gboolean log_silent_workers;
 	guint32 log_buf_size;
+	gboolean log_async;
+	guint32 log_async_ring_size;
 
 	struct rspamd_logger_error_log *errlog;
 	struct rspamd_cryptobox_pubkey *pk;
@@ -107,6 +150,8 @@ struct rspamd_logger_s {
 	rspamd_mempool_mutex_t *mtx;
 	guint saved_loglevel;
 	guint64 log_cnt[4];
+	struct rspamd_log_ring *ring;
+	gdouble ring_ts;
 };
 
 static const gchar lf_chr = '\n';
@@ -463,6 +508,8 @@ rspamd_set_logger (struct rspamd_config *cfg,
 	logger->log_buffered = cfg->log_buffered;
 	logger->log_silent_workers = cfg->log_silent_workers;
 	logger->log_buf_size = cfg->log_buf_size;
+	logger->log_async = cfg->log_async;
+	logger->log_async_ring_size = cfg->log_async_ring_size;
 
 	if (logger->log_file) {
 		g_free (logger->log_file);
@@ -474,8 +521,8 @@ rspamd_set_logger (struct rspamd_config *cfg,
 
 	logger->flags = cfg->log_flags;
 
-	/* Set up buffer */
-	if (cfg->log_buffered) {
+	/* Set up buffer, records from rings are written in batches */
+	if (cfg->log_buffered || cfg->log_async) {
 		if (cfg->log_buf_size != 0) {
 			logger->io_buf.size = cfg->log_buf_size;
 		}
@@ -531,6 +578,8 @@ rspamd_log_update_pid (GQuark ptype, rspamd_logger_t *rspamd_log)
 {
 	rspamd_log->pid = getpid ();
 	rspamd_log->process_type = ptype;
+	/* Ring is written by a single process only */
+	rspamd_log->ring = NULL;
 
 	/* We also need to clear all messages pending */
 	if (rspamd_log->repeats > 0) {
@@ -582,6 +631,106 @@ rspamd_logger_need_log (rspamd_logger_t *rspamd_log, GLogLevelFlags log_level,
 	return FALSE;
 }
 
+/*
+ * Copies log record to the ring, record is dropped if there is not enough
+ * space, as a worker should never wait for the main process
+ */
+static void
+rspamd_log_ring_write (struct rspamd_log_ring *ring,
+		rspamd_logger_t *rspamd_log,
+		const gchar *module, const gchar *id,
+		const gchar *function,
+		gint level_flags,
+		const gchar *message)
+{
+	struct rspamd_log_ring_record *rec;
+	guint head, tail, pos, avail, reclen;
+	gsize id_len, module_len, function_len, msg_len;
+	guchar *p;
+
+	id_len = id ? strlen (id) : 0;
+	module_len = module ? strlen (module) : 0;
+	function_len = function ? strlen (function) : 0;
+	msg_len = strlen (message);
+	reclen = LOG_RING_ALIGN (sizeof (*rec) + id_len + module_len +
+			function_len + msg_len + 4);
+
+	if (reclen > ring->size / 2) {
+		g_atomic_int_inc (&ring->dropped);
+
+		return;
+	}
+
+	head = ring->head;
+	tail = g_atomic_int_get (&ring->tail);
+	avail = ring->size - (head - tail);
+	pos = head & (ring->size - 1);
+
+	if (ring->size - pos < reclen) {
+		/* Records are never split, so the rest of ring is skipped */
+		if (avail < ring->size - pos + reclen) {
+			g_atomic_int_inc (&ring->dropped);
+
+			return;
+		}
+
+		rec = (struct rspamd_log_ring_record *)(ring->data + pos);
+		rec->len = ring->size - pos;
+		rec->flags = RSPAMD_LOG_RING_PAD;
+		head += rec->len;
+		pos = 0;
+	}
+	else if (avail < reclen) {
+		g_atomic_int_inc (&ring->dropped);
+
+		return;
+	}
+
+	rec = (struct rspamd_log_ring_record *)(ring->data + pos);
+	rec->len = reclen;
+	rec->flags = 0;
+	rec->level_flags = level_flags;
+	rec->pid = rspamd_log->pid;
+	rec->ptype = rspamd_log->process_type;
+	rec->ts = rspamd_get_calendar_ticks ();
+	rec->id_len = id_len;
+	rec->module_len = module_len;
+	rec->function_len = function_len;
+	rec->msg_len = msg_len;
+
+	p = (guchar *)(rec + 1);
+	memcpy (p, id ? id : "", id_len + 1);
+	p += id_len + 1;
+	memcpy (p, module ? module : "", module_len + 1);
+	p += module_len + 1;
+	memcpy (p, function ? function : "", function_len + 1);
+	p += function_len + 1;
+	memcpy (p, message, msg_len + 1);
+
+	/* Publish record for the main process */
+	g_atomic_int_set (&ring->head, head + reclen);
+}
+
+static inline void
+rspamd_log_dispatch (rspamd_logger_t *rspamd_log,
+		const gchar *module, const gchar *id,
+		const gchar *function,
+		gint level_flags,
+		const gchar *message)
+{
+	if (rspamd_log->ring) {
+		rspamd_log_ring_write (rspamd_log->ring, rspamd_log, module, id,
+				function, level_flags, message);
+	}
+	else {
+		rspamd_log->log_func (module, id,
+				function,
+				level_flags,
+				message,
+				rspamd_log);
+	}
+}
+
 static gchar *
 rspamd_log_encrypt_message (const gchar *begin, const gchar *end,
 		rspamd_logger_t *rspamd_log)
@@ -709,19 +858,17 @@ rspamd_common_logv (rspamd_logger_t *rspamd_log, gint level_flags,
 				gchar *encrypted;
 
 				encrypted = rspamd_log_encrypt_message (logbuf, end, rspamd_log);
-				rspamd_log->log_func (module, id,
+				rspamd_log_dispatch (rspamd_log, module, id,
 						function,
 						level_flags,
-						encrypted,
-						rspamd_log);
+						encrypted);
 				g_free (encrypted);
 			}
 			else {
-				rspamd_log->log_func (module, id,
+				rspamd_log_dispatch (rspamd_log, module, id,
 						function,
 						level_flags,
-						logbuf,
-						rspamd_log);
+						logbuf);
 			}
 
 			switch (level) {
@@ -1060,7 +1207,11 @@ file_log_function (const gchar *module, const gchar *id,
 				rspamd_log->repeats = 0;
 			}
 		}
-		if (!got_time) {
+		if (rspamd_log->ring_ts > 0) {
+			/* Record from a worker's ring is written with its own time */
+			now = rspamd_log->ring_ts;
+		}
+		else if (!got_time) {
 			now = rspamd_get_calendar_ticks ();
 		}
 
@@ -1239,11 +1390,10 @@ rspamd_conditional_debug (rspamd_logger_t *rspamd_log,
 		end = rspamd_vsnprintf (logbuf, sizeof (logbuf), fmt, vp);
 		*end = '\0';
 		va_end (vp);
-		rspamd_log->log_func (module, id,
+		rspamd_log_dispatch (rspamd_log, module, id,
 				function,
 				G_LOG_LEVEL_DEBUG | RSPAMD_LOG_FORCED,
-				logbuf,
-				rspamd_log);
+				logbuf);
 	}
 }
 
@@ -1274,11 +1424,10 @@ rspamd_conditional_debug_fast (rspamd_logger_t *rspamd_log,
 		end = rspamd_vsnprintf (logbuf, sizeof (logbuf), fmt, vp);
 		*end = '\0';
 		va_end (vp);
-		rspamd_log->log_func (module, id,
+		rspamd_log_dispatch (rspamd_log, module, id,
 				function,
 				G_LOG_LEVEL_DEBUG | RSPAMD_LOG_FORCED,
-				logbuf,
-				rspamd_log);
+				logbuf);
 	}
 }
 
@@ -1295,11 +1444,10 @@ rspamd_glib_log_function (const gchar *log_domain,
 
 	if (rspamd_log->enabled &&
 			rspamd_logger_need_log (rspamd_log, log_level, -1)) {
-		rspamd_log->log_func ("glib", NULL,
+		rspamd_log_dispatch (rspamd_log, "glib", NULL,
 				NULL,
 				log_level,
-				message,
-				rspamd_log);
+				message);
 	}
 }
 
@@ -1500,4 +1648,117 @@ rspamd_logger_t*
 rspamd_logger_get_singleton (void)
 {
 	return default_logger;
-}
\ No newline at end of file
+}
+struct rspamd_log_ring *
+rspamd_log_ring_new (rspamd_logger_t *logger)
+{
+	struct rspamd_log_ring *ring;
+	guint size = LOG_RING_MIN_SIZE, target;
+	gpointer map;
+
+	if (logger == NULL || !logger->log_async) {
+		return NULL;
+	}
+
+	target = logger->log_async_ring_size > 0 ?
+			logger->log_async_ring_size : LOG_RING_DEFAULT_SIZE;
+
+	while (size < target && size < G_MAXINT / 2) {
+		size <<= 1;
+	}
+
+	map = mmap (NULL, sizeof (*ring) + size, PROT_READ | PROT_WRITE,
+			MAP_ANON | MAP_SHARED, -1, 0);
+
+	if (map == MAP_FAILED) {
+		msg_err ("cannot allocate log ring of size %ud: %s", size,
+				strerror (errno));
+
+		return NULL;
+	}
+
+	ring = map;
+	ring->size = size;
+
+	return ring;
+}
+
+void
+rspamd_log_ring_attach (rspamd_logger_t *logger, struct rspamd_log_ring *ring)
+{
+	if (logger && ring) {
+		ring->pid = logger->pid;
+		logger->ring = ring;
+	}
+}
+
+guint
+rspamd_log_ring_drain (rspamd_logger_t *logger, struct rspamd_log_ring *ring)
+{
+	struct rspamd_log_ring_record *rec;
+	const gchar *id, *module, *function, *message;
+	guint head, tail, dropped, nrecords = 0;
+	pid_t saved_pid;
+	GQuark saved_ptype;
+
+	if (logger == NULL || ring == NULL) {
+		return 0;
+	}
+
+	saved_pid = logger->pid;
+	saved_ptype = logger->process_type;
+	tail = ring->tail;
+	head = g_atomic_int_get (&ring->head);
+
+	while (tail != head) {
+		rec = (struct rspamd_log_ring_record *)(ring->data +
+				(tail & (ring->size - 1)));
+
+		if (!(rec->flags & RSPAMD_LOG_RING_PAD)) {
+			id = (const gchar *)(rec + 1);
+			module = id + rec->id_len + 1;
+			function = module + rec->module_len + 1;
+			message = function + rec->function_len + 1;
+
+			/* Write as if it has been logged by the worker itself */
+			logger->pid = rec->pid;
+			logger->process_type = rec->ptype;
+			logger->ring_ts = rec->ts;
+			logger->log_func (rec->module_len ? module : NULL,
+					rec->id_len ? id : NULL,
+					rec->function_len ? function : NULL,
+					rec->level_flags,
+					message,
+					logger);
+			nrecords ++;
+		}
+
+		tail += rec->len;
+	}
+
+	g_atomic_int_set (&ring->tail, tail);
+	logger->pid = saved_pid;
+	logger->process_type = saved_ptype;
+	logger->ring_ts = 0;
+
+	dropped = g_atomic_int_get (&ring->dropped);
+
+	if (dropped != ring->reported) {
+		msg_warn ("%ud log records of process %P have been dropped "
+				"as its log ring was full", dropped - ring->reported,
+				ring->pid);
+		ring->reported = dropped;
+	}
+
+	rspamd_log_flush (logger);
+
+	return nrecords;
+}
+
+void
+rspamd_log_ring_free (struct rspamd_log_ring *ring)
+{
+	if (ring) {
+		munmap (ring, sizeof (*ring) + ring->size);
+	}
+}
@@ -189,6 +189,35 @@ ucl_object_t * rspamd_log_errorbuf_export (const rspamd_logger_t *logger);
  */
 rspamd_logger_t* rspamd_logger_get_singleton (void);
 
+struct rspamd_log_ring;
+
+/**
+ * Allocates shared ring for asynchronous logging of a worker, must be
+ * called by the main process before fork
+ * @param logger
+ * @return new ring or NULL if asynchronous logging is disabled
+ */
+struct rspamd_log_ring* rspamd_log_ring_new (rspamd_logger_t *logger);
+
+/**
+ * Makes the current process to write binary log records to the ring instead
+ * of formatting and writing them
+ */
+void rspamd_log_ring_attach (rspamd_logger_t *logger,
+		struct rspamd_log_ring *ring);
+
+/**
+ * Writes all pending records from the ring using logger
+ * @return number of records written
+ */
+guint rspamd_log_ring_drain (rspamd_logger_t *logger,
+		struct rspamd_log_ring *ring);
+
+/**
+ * Releases ring
+ */
+void rspamd_log_ring_free (struct rspamd_log_ring *ring);
+
 /* Typical functions */
 
 extern guint rspamd_task_log_id;
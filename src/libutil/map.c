@@ -19,10 +19,12 @@
 #include "config.h"
 #include "map.h"
 #include "map_private.h"
+#include "map_helpers.h"
 #include "http.h"
 #include "http_private.h"
 #include "rspamd.h"
 #include "contrib/zstd/zstd.h"
+#include "aio_event.h"
 
 #undef MAP_DEBUG_REFS
 #ifdef MAP_DEBUG_REFS
@@ -57,6 +59,13 @@ static gboolean rspamd_map_save_http_cached_file (struct rspamd_map *map,
 												  struct http_map_data *htdata,
 												  const guchar *data,
 												  gsize len);
+static gint rspamd_map_open_http_cached_file (struct rspamd_map *map,
+											  struct rspamd_map_backend *bk,
+											  struct http_map_data *htdata);
+static void rspamd_map_close_http_cached_file (struct rspamd_map *map,
+											   struct rspamd_map_backend *bk,
+											   gint fd,
+											   gboolean success);
 
 guint rspamd_map_log_id = (guint)-1;
 RSPAMD_CONSTRUCTOR(rspamd_map_log_init)
@@ -447,6 +456,88 @@ rspamd_http_check_signature (struct rspamd_map *map,
 	return FALSE;
 }
 
+/*
+ * Decompresses zstd data by bounded chunks passing them to the read callback,
+ * the same way as `read_map_file_chunks` does for files. If `save_fd` is not
+ * -1 then uncompressed data is also written to that descriptor
+ */
+static gboolean
+read_map_zstd_chunks (struct rspamd_map *map, struct map_cb_data *cbdata,
+		const guchar *in, gsize inlen, const gchar *src, gint save_fd,
+		gsize *outlen)
+{
+	ZSTD_DStream *zstream;
+	ZSTD_inBuffer zin;
+	ZSTD_outBuffer zout;
+	gsize buflen = 1024 * 1024, remain = 0, total = 0, r;
+	gchar *bytes, *pos, *end;
+	gboolean final = FALSE;
+
+	zstream = ZSTD_createDStream ();
+	ZSTD_initDStream (zstream);
+	bytes = g_malloc (buflen);
+
+	zin.pos = 0;
+	zin.src = in;
+	zin.size = inlen;
+
+	while (!final) {
+		zout.dst = bytes + remain;
+		zout.pos = 0;
+		zout.size = buflen - remain;
+
+		r = ZSTD_decompressStream (zstream, &zout, &zin);
+
+		if (ZSTD_isError (r)) {
+			msg_err_map ("%s: cannot decompress data: %s", src,
+					ZSTD_getErrorName (r));
+			ZSTD_freeDStream (zstream);
+			g_free (bytes);
+
+			return FALSE;
+		}
+
+		if (save_fd != -1 && zout.pos > 0 &&
+				write (save_fd, zout.dst, zout.pos) != (gssize)zout.pos) {
+			msg_err_map ("%s: cannot save uncompressed data: %s", src,
+					strerror (errno));
+			ZSTD_freeDStream (zstream);
+			g_free (bytes);
+
+			return FALSE;
+		}
+
+		total += zout.pos;
+		/* Decompressor could hold more output if the buffer is full */
+		final = zin.pos == zin.size && zout.pos < zout.size;
+		end = bytes + remain + zout.pos;
+		pos = map->read_callback (bytes, end - bytes, cbdata, final);
+
+		if (pos && pos > bytes && pos < end) {
+			remain = end - pos;
+			memmove (bytes, pos, remain);
+
+			if (remain == buflen) {
+				/* Too large element */
+				buflen *= 2;
+				bytes = g_realloc (bytes, buflen);
+			}
+		}
+		else {
+			remain = 0;
+		}
+	}
+
+	ZSTD_freeDStream (zstream);
+	g_free (bytes);
+
+	if (outlen) {
+		*outlen = total;
+	}
+
+	return TRUE;
+}
+
 static int
 http_map_finish (struct rspamd_http_connection *conn,
 		struct rspamd_http_message *msg)
@@ -664,9 +755,10 @@ read_data:
 			if (cbd->data->etag) {
 				/* Remove old etag */
 				rspamd_fstring_free (cbd->data->etag);
-				cbd->data->etag = rspamd_fstring_new_init (etag_hdr->begin,
-						etag_hdr->len);
 			}
+
+			cbd->data->etag = rspamd_fstring_new_init (etag_hdr->begin,
+					etag_hdr->len);
 		}
 		else {
 			if (cbd->data->etag) {
@@ -712,60 +804,29 @@ read_data:
 
 
 		if (cbd->bk->is_compressed) {
-			ZSTD_DStream *zstream;
-			ZSTD_inBuffer zin;
-			ZSTD_outBuffer zout;
-			guchar *out;
-			gsize outlen, r;
-
-			zstream = ZSTD_createDStream ();
-			ZSTD_initDStream (zstream);
+			gint save_fd;
+			gsize outlen = 0;
+			gboolean res;
 
-			zin.pos = 0;
-			zin.src = in;
-			zin.size = dlen;
+			save_fd = rspamd_map_open_http_cached_file (map, bk, cbd->data);
+			res = read_map_zstd_chunks (map, &cbd->periodic->cbdata, in,
+					cbd->data_len, cbd->bk->uri, save_fd, &outlen);
 
-			if ((outlen = ZSTD_getDecompressedSize (zin.src, zin.size)) == 0) {
-				outlen = ZSTD_DStreamOutSize ();
+			if (save_fd != -1) {
+				rspamd_map_close_http_cached_file (map, bk, save_fd, res);
 			}
 
-			out = g_malloc (outlen);
-
-			zout.dst = out;
-			zout.pos = 0;
-			zout.size = outlen;
-
-			while (zin.pos < zin.size) {
-				r = ZSTD_decompressStream (zstream, &zout, &zin);
-
-				if (ZSTD_isError (r)) {
-					msg_err_map ("%s(%s): cannot decompress data: %s",
-							cbd->bk->uri,
-							rspamd_inet_address_to_string_pretty (cbd->addr),
-							ZSTD_getErrorName (r));
-					ZSTD_freeDStream (zstream);
-					g_free (out);
-					MAP_RELEASE (cbd->shmem_data, "shmem_data");
-					goto err;
-				}
-
-				if (zout.pos == zout.size) {
-					/* We need to extend output buffer */
-					zout.size = zout.size * 1.5 + 1.0;
-					out = g_realloc (zout.dst, zout.size);
-					zout.dst = out;
-				}
+			if (!res) {
+				MAP_RELEASE (cbd->shmem_data, "shmem_data");
+				munmap (in, dlen);
+				goto err;
 			}
 
-			ZSTD_freeDStream (zstream);
 			msg_info_map ("%s(%s): read map data %z bytes compressed, "
 					"%z uncompressed, next check at %s",
 					cbd->bk->uri,
 					rspamd_inet_address_to_string_pretty (cbd->addr),
-					dlen, zout.pos, next_check_date);
-			map->read_callback (out, zout.pos, &cbd->periodic->cbdata, TRUE);
-			rspamd_map_save_http_cached_file (map, bk, cbd->data, out, zout.pos);
-			g_free (out);
+					cbd->data_len, outlen, next_check_date);
 		}
 		else {
 			msg_info_map ("%s(%s): read map data %z bytes, next check at %s",
@@ -815,9 +876,10 @@ read_data:
 			if (cbd->data->etag) {
 				/* Remove old etag */
 				rspamd_fstring_free (cbd->data->etag);
-				cbd->data->etag = rspamd_fstring_new_init (etag_hdr->begin,
-						etag_hdr->len);
 			}
+
+			cbd->data->etag = rspamd_fstring_new_init (etag_hdr->begin,
+					etag_hdr->len);
 		}
 
 		if (map->next_check) {
@@ -977,8 +1039,24 @@ read_map_file (struct rspamd_map *map, struct file_map_data *data,
 		munmap (bytes, len);
 	}
 
+	if (len > 0 && !bk->is_compressed &&
+			map->read_callback == rspamd_kv_list_read) {
+		/* Compiled hash maps are used as is */
+		switch (rspamd_kv_list_load_image (&periodic->cbdata, data->filename)) {
+		case 1:
+			memcpy (&data->st, &st, sizeof (struct stat));
+			return TRUE;
+		case -1:
+			return FALSE;
+		default:
+			break;
+		}
+	}
+
 	if (len > 0) {
 		if (bk->is_compressed) {
+			gsize outlen = 0;
+
 			bytes = rspamd_file_xmap (data->filename, PROT_READ, &len, TRUE);
 
 			if (bytes == NULL) {
@@ -986,57 +1064,15 @@ read_map_file (struct rspamd_map *map, struct file_map_data *data,
 				return FALSE;
 			}
 
-			ZSTD_DStream *zstream;
-			ZSTD_inBuffer zin;
-			ZSTD_outBuffer zout;
-			guchar *out;
-			gsize outlen, r;
-
-			zstream = ZSTD_createDStream ();
-			ZSTD_initDStream (zstream);
-
-			zin.pos = 0;
-			zin.src = bytes;
-			zin.size = len;
-
-			if ((outlen = ZSTD_getDecompressedSize (zin.src, zin.size)) == 0) {
-				outlen = ZSTD_DStreamOutSize ();
-			}
-
-			out = g_malloc (outlen);
-
-			zout.dst = out;
-			zout.pos = 0;
-			zout.size = outlen;
-
-			while (zin.pos < zin.size) {
-				r = ZSTD_decompressStream (zstream, &zout, &zin);
-
-				if (ZSTD_isError (r)) {
-					msg_err_map ("%s: cannot decompress data: %s",
-							data->filename,
-							ZSTD_getErrorName (r));
-					ZSTD_freeDStream (zstream);
-					g_free (out);
-					munmap (bytes, len);
-					return FALSE;
-				}
-
-				if (zout.pos == zout.size) {
-					/* We need to extend output buffer */
-					zout.size = zout.size * 1.5 + 1.0;
-					out = g_realloc (zout.dst, zout.size);
-					zout.dst = out;
-				}
+			if (!read_map_zstd_chunks (map, &periodic->cbdata, bytes, len,
+					data->filename, -1, &outlen)) {
+				munmap (bytes, len);
+				return FALSE;
 			}
 
-			ZSTD_freeDStream (zstream);
 			msg_info_map ("%s: read map data, %z bytes compressed, "
 					"%z uncompressed)", data->filename,
-					len, zout.pos);
-			map->read_callback (out, zout.pos, &periodic->cbdata, TRUE);
-			g_free (out);
-
+					len, outlen);
 			munmap (bytes, len);
 		}
 		else {
@@ -1058,6 +1094,180 @@ read_map_file (struct rspamd_map *map, struct file_map_data *data,
 	return TRUE;
 }
 
+struct map_file_aio_cbdata {
+	struct rspamd_map *map;
+	struct map_periodic_cbdata *periodic;
+	struct rspamd_map_backend *bk;
+	struct file_map_data *data;
+	struct aio_context *aio;
+	struct stat st;
+	gint fd;
+	gchar *bytes;
+	gsize buflen;
+	gsize remain; /* Incomplete element at the beginning of the buffer */
+	gsize len; /* Bytes left to read */
+	goffset off;
+};
+
+static struct aio_context *map_aio_ctx = NULL;
+static struct event_base *map_aio_base = NULL;
+
+static void rspamd_map_file_aio_read_cb (gint fd, gint res, guint64 len,
+		gpointer data, gpointer ud);
+
+static void
+rspamd_map_file_aio_finish (struct map_file_aio_cbdata *cbd, gboolean success)
+{
+	struct map_periodic_cbdata *periodic = cbd->periodic;
+
+	if (success) {
+		/* Also update at the read time */
+		memcpy (&cbd->data->st, &cbd->st, sizeof (struct stat));
+	}
+	else {
+		periodic->errored = TRUE;
+	}
+
+	rspamd_aio_close (cbd->fd, cbd->aio);
+	MAP_RELEASE (cbd->bk, "rspamd_map_backend");
+	g_free (cbd->bytes);
+	g_free (cbd);
+
+	/* Switch to the next backend */
+	periodic->cur_backend ++;
+	rspamd_map_periodic_callback (-1, EV_TIMEOUT, periodic);
+}
+
+static void
+rspamd_map_file_aio_read_next (struct map_file_aio_cbdata *cbd)
+{
+	gsize avail = cbd->buflen - cbd->remain;
+
+	/* Callback is not called if read cannot be started */
+	if (rspamd_aio_read (cbd->fd, cbd->bytes + cbd->remain,
+			MIN (avail, cbd->len), cbd->off, cbd->aio,
+			rspamd_map_file_aio_read_cb, cbd) == -1) {
+		struct rspamd_map *map = cbd->map;
+
+		msg_err_map ("can't read from map %s: %s", cbd->data->filename,
+				strerror (errno));
+		rspamd_map_file_aio_finish (cbd, FALSE);
+	}
+}
+
+/* Does the same as `read_map_file_chunks` */
+static void
+rspamd_map_file_aio_read_cb (gint fd, gint res, guint64 len,
+		gpointer data, gpointer ud)
+{
+	struct map_file_aio_cbdata *cbd = ud;
+	struct rspamd_map *map = cbd->map;
+	gchar *pos, *end;
+
+	if (res < 0) {
+		msg_err_map ("can't read from map %s: %s", cbd->data->filename,
+				strerror (-res));
+		rspamd_map_file_aio_finish (cbd, FALSE);
+
+		return;
+	}
+
+	if (len == 0) {
+		/* File has been truncated while reading */
+		rspamd_map_file_aio_finish (cbd, TRUE);
+
+		return;
+	}
+
+	msg_info_map ("%s: read map chunk, %z bytes", cbd->data->filename,
+			(gsize)len);
+	len = MIN (len, cbd->len);
+	cbd->len -= len;
+	cbd->off += len;
+	end = cbd->bytes + cbd->remain + len;
+	pos = map->read_callback (cbd->bytes, end - cbd->bytes,
+			&cbd->periodic->cbdata, cbd->len == 0);
+
+	if (pos && pos > cbd->bytes && pos < end) {
+		cbd->remain = end - pos;
+		memmove (cbd->bytes, pos, cbd->remain);
+
+		if (cbd->remain >= cbd->buflen) {
+			/* Try realloc, too large element */
+			cbd->bytes = g_realloc (cbd->bytes, cbd->buflen * 2);
+			cbd->buflen *= 2;
+		}
+	}
+	else {
+		cbd->remain = 0;
+	}
+
+	if (cbd->len == 0) {
+		rspamd_map_file_aio_finish (cbd, TRUE);
+	}
+	else {
+		rspamd_map_file_aio_read_next (cbd);
+	}
+}
+
+/*
+ * Starts reading of a plain file map without blocking, returns FALSE if map
+ * should be read synchronously (signed, compressed or precompiled maps, no
+ * asynchronous IO support). If TRUE is returned, periodic callback is called
+ * for the next backend once the file is read
+ */
+static gboolean
+read_map_file_async (struct rspamd_map *map, struct file_map_data *data,
+		struct rspamd_map_backend *bk, struct map_periodic_cbdata *periodic)
+{
+	struct map_file_aio_cbdata *cbd;
+	struct stat st;
+	gint fd;
+
+	if (map->ev_base == NULL || bk->is_signed || bk->is_compressed ||
+			map->read_callback == NULL || map->fin_callback == NULL ||
+			map->read_callback == rspamd_kv_list_read) {
+		return FALSE;
+	}
+
+	if (map_aio_base != map->ev_base) {
+		map_aio_ctx = rspamd_aio_init (map->ev_base);
+		map_aio_base = map->ev_base;
+	}
+
+	if (!rspamd_aio_is_async (map_aio_ctx)) {
+		return FALSE;
+	}
+
+	if (stat (data->filename, &st) == -1 || st.st_size == 0) {
+		/* Let synchronous code deal with missing and empty files */
+		return FALSE;
+	}
+
+	fd = rspamd_aio_open (map_aio_ctx, data->filename, O_RDONLY);
+
+	if (fd == -1) {
+		return FALSE;
+	}
+
+	cbd = g_malloc0 (sizeof (*cbd));
+	cbd->map = map;
+	cbd->periodic = periodic;
+	cbd->bk = bk;
+	MAP_RETAIN (bk, "rspamd_map_backend");
+	cbd->data = data;
+	cbd->aio = map_aio_ctx;
+	cbd->fd = fd;
+	cbd->len = st.st_size;
+	cbd->buflen = MIN (cbd->len, 1024 * 1024);
+	cbd->bytes = g_malloc (cbd->buflen);
+	memcpy (&cbd->st, &st, sizeof (st));
+
+	rspamd_map_file_aio_read_next (cbd);
+
+	return TRUE;
+}
+
 static gboolean
 read_map_static (struct rspamd_map *map, struct static_map_data *data,
 		struct rspamd_map_backend *bk, struct map_periodic_cbdata *periodic)
@@ -1076,57 +1286,18 @@ read_map_static (struct rspamd_map *map, struct static_map_data *data,
 
 	if (len > 0) {
 		if (bk->is_compressed) {
-			ZSTD_DStream *zstream;
-			ZSTD_inBuffer zin;
-			ZSTD_outBuffer zout;
-			guchar *out;
-			gsize outlen, r;
-
-			zstream = ZSTD_createDStream ();
-			ZSTD_initDStream (zstream);
-
-			zin.pos = 0;
-			zin.src = bytes;
-			zin.size = len;
-
-			if ((outlen = ZSTD_getDecompressedSize (zin.src, zin.size)) == 0) {
-				outlen = ZSTD_DStreamOutSize ();
-			}
-
-			out = g_malloc (outlen);
-
-			zout.dst = out;
-			zout.pos = 0;
-			zout.size = outlen;
+			gsize outlen = 0;
 
-			while (zin.pos < zin.size) {
-				r = ZSTD_decompressStream (zstream, &zout, &zin);
-
-				if (ZSTD_isError (r)) {
-					msg_err_map ("%s: cannot decompress data: %s",
-							map->name,
-							ZSTD_getErrorName (r));
-					ZSTD_freeDStream (zstream);
-					g_free (out);
-
-					return FALSE;
-				}
-
-				if (zout.pos == zout.size) {
-					/* We need to extend output buffer */
-					zout.size = zout.size * 1.5 + 1.0;
-					out = g_realloc (zout.dst, zout.size);
-					zout.dst = out;
-				}
+			if (!read_map_zstd_chunks (map, &periodic->cbdata, bytes, len,
+					map->name, -1, &outlen)) {
+				data->processed = TRUE;
+				return FALSE;
 			}
 
-			ZSTD_freeDStream (zstream);
 			msg_info_map ("%s: read map data, %z bytes compressed, "
 					"%z uncompressed)",
 					map->name,
-					len, zout.pos);
-			map->read_callback (out, zout.pos, &periodic->cbdata, TRUE);
-			g_free (out);
+					len, outlen);
 		}
 		else {
 			msg_info_map ("%s: read map data, %z bytes",
@@ -1337,56 +1508,17 @@ rspamd_map_read_cached (struct rspamd_map *map, struct rspamd_map_backend *bk,
 	}
 
 	if (bk->is_compressed) {
-		ZSTD_DStream *zstream;
-		ZSTD_inBuffer zin;
-		ZSTD_outBuffer zout;
-		guchar *out;
-		gsize outlen, r;
-
-		zstream = ZSTD_createDStream ();
-		ZSTD_initDStream (zstream);
-
-		zin.pos = 0;
-		zin.src = in;
-		zin.size = len;
-
-		if ((outlen = ZSTD_getDecompressedSize (zin.src, zin.size)) == 0) {
-			outlen = ZSTD_DStreamOutSize ();
-		}
-
-		out = g_malloc (outlen);
-
-		zout.dst = out;
-		zout.pos = 0;
-		zout.size = outlen;
-
-		while (zin.pos < zin.size) {
-			r = ZSTD_decompressStream (zstream, &zout, &zin);
-
-			if (ZSTD_isError (r)) {
-				msg_err_map ("%s: cannot decompress data: %s",
-						bk->uri,
-						ZSTD_getErrorName (r));
-				ZSTD_freeDStream (zstream);
-				g_free (out);
-				munmap (in, len);
-				return FALSE;
-			}
+		gsize outlen = 0;
 
-			if (zout.pos == zout.size) {
-				/* We need to extend output buffer */
-				zout.size = zout.size * 1.5 + 1.0;
-				out = g_realloc (zout.dst, zout.size);
-				zout.dst = out;
-			}
+		if (!read_map_zstd_chunks (map, &periodic->cbdata, in, len,
+				bk->uri, -1, &outlen)) {
+			munmap (in, len);
+			return FALSE;
 		}
 
-		ZSTD_freeDStream (zstream);
 		msg_info_map ("%s: read map data cached %z bytes compressed, "
 				"%z uncompressed", bk->uri,
-				len, zout.pos);
-		map->read_callback (out, zout.pos, &periodic->cbdata, TRUE);
-		g_free (out);
+				len, outlen);
 	}
 	else {
 		msg_info_map ("%s: read map data cached %z bytes", bk->uri,
@@ -1424,39 +1556,51 @@ rspamd_map_has_http_cached_file (struct rspamd_map *map,
 	return FALSE;
 }
 
-static gboolean
-rspamd_map_save_http_cached_file (struct rspamd_map *map,
+static void
+rspamd_map_http_cached_file_path (struct rspamd_map_backend *bk,
+								  const gchar *dir,
+								  gchar *path, gsize pathlen)
+{
+	guchar digest[rspamd_cryptobox_HASHBYTES];
+
+	rspamd_cryptobox_hash (digest, bk->uri, strlen (bk->uri), NULL, 0);
+	rspamd_snprintf (path, pathlen, "%s%c%*xs.map", dir,
+			G_DIR_SEPARATOR, 20, digest);
+}
+
+/*
+ * Opens and locks cache file writing its header, data is written by a caller
+ * to allow saving of the data that is produced by chunks
+ */
+static gint
+rspamd_map_open_http_cached_file (struct rspamd_map *map,
 								  struct rspamd_map_backend *bk,
-								  struct http_map_data *htdata,
-								  const guchar *data,
-								  gsize len)
+								  struct http_map_data *htdata)
 {
 	gchar path[PATH_MAX];
-	guchar digest[rspamd_cryptobox_HASHBYTES];
 	struct rspamd_config *cfg = map->cfg;
 	gint fd;
 	struct rspamd_http_file_data header;
 
 	if (cfg->maps_cache_dir == NULL || cfg->maps_cache_dir[0] == '\0') {
-		return FALSE;
+		return -1;
 	}
 
-	rspamd_cryptobox_hash (digest, bk->uri, strlen (bk->uri), NULL, 0);
-	rspamd_snprintf (path, sizeof (path), "%s%c%*xs.map", cfg->maps_cache_dir,
-			G_DIR_SEPARATOR, 20, digest);
+	rspamd_map_http_cached_file_path (bk, cfg->maps_cache_dir,
+			path, sizeof (path));
 
 	fd = rspamd_file_xopen (path, O_WRONLY | O_TRUNC | O_CREAT,
 			00600, FALSE);
 
 	if (fd == -1) {
-		return FALSE;
+		return -1;
 	}
 
 	if (!rspamd_file_lock (fd, FALSE)) {
 		msg_err_map ("cannot lock file %s: %s", path, strerror (errno));
 		close (fd);
 
-		return FALSE;
+		return -1;
 	}
 
 	memcpy (header.magic, rspamd_http_file_magic, sizeof (rspamd_http_file_magic));
@@ -1468,23 +1612,60 @@ rspamd_map_save_http_cached_file (struct rspamd_map *map,
 		msg_err_map ("cannot write file %s: %s", path, strerror (errno));
 		rspamd_file_unlock (fd, FALSE);
 		close (fd);
+		unlink (path);
+
+		return -1;
+	}
+
+	return fd;
+}
+
+static void
+rspamd_map_close_http_cached_file (struct rspamd_map *map,
+								   struct rspamd_map_backend *bk,
+								   gint fd,
+								   gboolean success)
+{
+	gchar path[PATH_MAX];
+
+	if (!success) {
+		/* Do not leave partial data */
+		rspamd_map_http_cached_file_path (bk, map->cfg->maps_cache_dir,
+				path, sizeof (path));
+		unlink (path);
+	}
+
+	rspamd_file_unlock (fd, FALSE);
+	close (fd);
+}
 
+static gboolean
+rspamd_map_save_http_cached_file (struct rspamd_map *map,
+								  struct rspamd_map_backend *bk,
+								  struct http_map_data *htdata,
+								  const guchar *data,
+								  gsize len)
+{
+	gint fd;
+
+	fd = rspamd_map_open_http_cached_file (map, bk, htdata);
+
+	if (fd == -1) {
 		return FALSE;
 	}
 
 	/* Now write the rest */
 	if (write (fd, data, len) != len) {
-		msg_err_map ("cannot write file %s: %s", path, strerror (errno));
-		rspamd_file_unlock (fd, FALSE);
-		close (fd);
+		msg_err_map ("cannot write cached file for %s: %s", bk->uri,
+				strerror (errno));
+		rspamd_map_close_http_cached_file (map, bk, fd, FALSE);
 
 		return FALSE;
 	}
 
-	rspamd_file_unlock (fd, FALSE);
-	close (fd);
+	rspamd_map_close_http_cached_file (map, bk, fd, TRUE);
 
-	msg_info_map ("saved data from %s in %s, %uz bytes", bk->uri, path, len);
+	msg_info_map ("saved data from %s, %uz bytes", bk->uri, len);
 
 	return TRUE;
 }
@@ -1791,6 +1972,11 @@ rspamd_map_file_read_callback (gint fd, short what, void *ud)
 
 	msg_info_map ("rereading map file %s", data->filename);
 
+	if (read_map_file_async (map, data, bk, periodic)) {
+		/* Periodic callback is called when the file is read */
+		return;
+	}
+
 	if (!read_map_file (map, data, bk, periodic)) {
 		periodic->errored = TRUE;
 	}
@@ -1954,13 +2140,17 @@ rspamd_map_preload (struct rspamd_config *cfg)
 	GList *cur = cfg->maps;
 	struct rspamd_map *map;
 	struct rspamd_map_backend *bk;
-	guint i;
+	guint i, npreloaded = 0;
 	gboolean map_ok;
+	gdouble start, map_start;
+
+	start = rspamd_get_ticks (FALSE);
 
 	/* First of all do synced read of data */
 	while (cur) {
 		map = cur->data;
 		map_ok = TRUE;
+		map_start = rspamd_get_ticks (FALSE);
 
 		PTR_ARRAY_FOREACH (map->backends, i, bk) {
 			if (!(bk->protocol == MAP_PROTO_FILE ||
@@ -2048,10 +2238,18 @@ rspamd_map_preload (struct rspamd_config *cfg)
 				msg_info_map ("preload of %s failed", map->name);
 			}
 
+			rspamd_config_profile_phase (cfg, RSPAMD_CONFIG_PHASE_MAP,
+					map->name, map_start);
+			npreloaded ++;
 		}
 
 		cur = g_list_next (cur);
 	}
+
+	rspamd_config_profile_phase (cfg, RSPAMD_CONFIG_PHASE_CORE,
+			"maps_preload", start);
+	msg_info_config ("preloaded %ud maps in %.3f seconds", npreloaded,
+			rspamd_get_ticks (FALSE) - start);
 }
 
 void
@@ -20,6 +20,7 @@
 #include "radix.h"
 #include "rspamd.h"
 #include "cryptobox.h"
+#include "acism.h"
 
 #ifdef WITH_HYPERSCAN
 #include "hs.h"
@@ -32,11 +33,18 @@
 
 
 static const guint64 map_hash_seed = 0xdeadbabeULL;
+/* Time to wait for another process that saves the same shared map */
+#define MAP_SHARED_WAIT_TRIES 100
+#define MAP_SHARED_WAIT_INTERVAL 0.02
+/* Literal prefilter is used for regexp maps with no hyperscan database */
+#define RE_MAP_PREFILTER_MIN_REGEXPS 16
+#define RE_MAP_PREFILTER_MIN_LITERAL 3
 static const gchar *hash_fill = "1";
 
 struct rspamd_map_helper_value {
 	gsize hits;
 	gconstpointer key;
+	guint gen; /* Generation of the map where the value was seen */
 	gchar value[]; /* Null terminated */
 };
 
@@ -55,6 +63,35 @@ struct rspamd_hash_map_helper {
 	rspamd_mempool_t *pool;
 	khash_t(rspamd_map_hash) *htb;
 	rspamd_cryptobox_fast_hash_state_t hst;
+	/* Current generation, entries not seen in it are removed on update */
+	guint gen;
+	/* Bytes allocated in pool and bytes of values that are no longer used */
+	gsize allocated;
+	gsize garbage;
+	/* Read only image shared between processes, replaces htb if not NULL */
+	const guchar *shared;
+	gsize shared_len;
+	gchar *shared_path;
+};
+
+/*
+ * Shared image of a hash map: header, elements sorted by caseless hash and
+ * null terminated keys and values addressed by offsets from the image start
+ */
+static const guchar rspamd_map_shared_magic[] =
+		{'r', 'm', 's', 'h', '0', '0', '0', '1'};
+
+struct rspamd_map_shared_hdr {
+	guchar magic[sizeof (rspamd_map_shared_magic)];
+	guint64 len;
+	guint32 nelts;
+	guint32 unused;
+};
+
+struct rspamd_map_shared_elt {
+	guint64 hash;
+	guint32 key;
+	guint32 value;
 };
 
 struct rspamd_regexp_map_helper {
@@ -65,6 +102,9 @@ struct rspamd_regexp_map_helper {
 	khash_t(rspamd_map_hash) *htb;
 	rspamd_cryptobox_fast_hash_state_t hst;
 	enum rspamd_regexp_map_flags map_flags;
+	ac_trie_t *prefilter;
+	gint *literal_ids; /* literal index for each regexp or -1 */
+	guint nliterals;
 #ifdef WITH_HYPERSCAN
 	hs_database_t *hs_db;
 	hs_scratch_t *hs_scratch;
@@ -503,15 +543,33 @@ rspamd_map_helper_insert_hash (gpointer st, gconstpointer key, gconstpointer val
 	gint r;
 
 	vlen = strlen (value);
+	k = kh_get (rspamd_map_hash, ht->htb, key);
+
+	if (k != kh_end (ht->htb)) {
+		val = kh_value (ht->htb, k);
+
+		if (val->gen != ht->gen && strcmp (val->value, value) == 0) {
+			/* The same entry in the updated map, keep it as is */
+			val->gen = ht->gen;
+			rspamd_cryptobox_fast_hash_update (&ht->hst, val->key,
+					strlen (val->key));
+
+			return;
+		}
+
+		ht->garbage += sizeof (*val) + strlen (val->value) + 1;
+	}
+
 	val = rspamd_mempool_alloc0 (ht->pool, sizeof (*val) +
 			vlen + 1);
 	memcpy (val->value, value, vlen);
-
-	k = kh_get (rspamd_map_hash, ht->htb, key);
+	val->gen = ht->gen;
+	ht->allocated += sizeof (*val) + vlen + 1;
 
 	if (k == kh_end (ht->htb)) {
 		nk = rspamd_mempool_strdup (ht->pool, key);
 		k = kh_put (rspamd_map_hash, ht->htb, nk, &r);
+		ht->allocated += strlen (nk) + 1;
 	}
 
 	nk = kh_key (ht->htb, k);
@@ -630,6 +688,7 @@ rspamd_map_helper_new_hash (struct rspamd_map *map)
 	htb = rspamd_mempool_alloc0 (pool, sizeof (*htb));
 	htb->htb = kh_init (rspamd_map_hash);
 	htb->pool = pool;
+	htb->gen = 1;
 	rspamd_cryptobox_fast_hash_init (&htb->hst, map_hash_seed);
 
 	return htb;
@@ -642,6 +701,10 @@ rspamd_map_helper_destroy_hash (struct rspamd_hash_map_helper *r)
 		return;
 	}
 
+	if (r->shared) {
+		munmap ((gpointer)r->shared, r->shared_len);
+	}
+
 	kh_destroy (rspamd_map_hash, r->htb);
 	rspamd_mempool_delete (r->pool);
 }
@@ -656,6 +719,25 @@ rspamd_map_helper_traverse_hash (void *data,
 	struct rspamd_map_helper_value *val;
 	struct rspamd_hash_map_helper *ht = data;
 
+	const struct rspamd_map_shared_hdr *hdr;
+	const struct rspamd_map_shared_elt *elts;
+	guint i;
+
+	if (ht->shared) {
+		/* Hits are not tracked for shared images */
+		hdr = (const struct rspamd_map_shared_hdr *)ht->shared;
+		elts = (const struct rspamd_map_shared_elt *)(hdr + 1);
+
+		for (i = 0; i < hdr->nelts; i ++) {
+			if (!cb (ht->shared + elts[i].key, ht->shared + elts[i].value,
+					0, cbdata)) {
+				break;
+			}
+		}
+
+		return;
+	}
+
 	kh_foreach (ht->htb, k, val, {
 		if (!cb (k, val->value, val->hits, cbdata)) {
 			break;
@@ -765,6 +847,13 @@ rspamd_map_helper_destroy_regexp (struct rspamd_regexp_map_helper *re_map)
 	g_ptr_array_free (re_map->values, TRUE);
 	kh_destroy (rspamd_map_hash, re_map->htb);
 
+	if (re_map->prefilter) {
+		acism_destroy (re_map->prefilter);
+	}
+	if (re_map->literal_ids) {
+		g_free (re_map->literal_ids);
+	}
+
 #ifdef WITH_HYPERSCAN
 	if (re_map->hs_scratch) {
 		hs_free_scratch (re_map->hs_scratch);
@@ -793,8 +882,23 @@ rspamd_kv_list_read (
 		struct map_cb_data *data,
 		gboolean final)
 {
+	struct rspamd_hash_map_helper *prev;
+
 	if (data->cur_data == NULL) {
-		data->cur_data = rspamd_map_helper_new_hash (data->map);
+		prev = data->prev_data;
+
+		if (prev && !prev->shared) {
+			/*
+			 * Apply changes to the previous generation: unchanged entries
+			 * are just marked and the rest are removed in the fin callback
+			 */
+			prev->gen ++;
+			rspamd_cryptobox_fast_hash_init (&prev->hst, map_hash_seed);
+			data->cur_data = prev;
+		}
+		else {
+			data->cur_data = rspamd_map_helper_new_hash (data->map);
+		}
 	}
 
 	return rspamd_parse_kv_list (
@@ -806,23 +910,355 @@ rspamd_kv_list_read (
 			final);
 }
 
+struct rspamd_map_shared_sort_elt {
+	guint64 hash;
+	const gchar *key;
+	const gchar *value;
+};
+
+static gint
+rspamd_map_shared_sort_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct rspamd_map_shared_sort_elt *e1 = a, *e2 = b;
+
+	if (e1->hash != e2->hash) {
+		return e1->hash < e2->hash ? -1 : 1;
+	}
+
+	/* Keys are unique caseless, so the order does not depend on khash */
+	return g_ascii_strcasecmp (e1->key, e2->key);
+}
+
+GByteArray *
+rspamd_map_helper_serialize_hash (struct rspamd_hash_map_helper *ht)
+{
+	struct rspamd_map_shared_sort_elt *sorted;
+	struct rspamd_map_shared_hdr hdr;
+	struct rspamd_map_shared_elt elt;
+	struct rspamd_map_helper_value *val;
+	GByteArray *res, *strings;
+	gconstpointer k;
+	gsize base;
+	guint i = 0, n;
+
+	n = kh_size (ht->htb);
+	sorted = g_new (struct rspamd_map_shared_sort_elt, n);
+
+	kh_foreach (ht->htb, k, val, {
+		sorted[i].hash = rspamd_icase_hash (k, strlen (k), map_hash_seed);
+		sorted[i].key = k;
+		sorted[i].value = val->value;
+		i ++;
+	});
+
+	qsort (sorted, n, sizeof (*sorted), rspamd_map_shared_sort_cmp);
+
+	base = sizeof (hdr) + sizeof (elt) * n;
+	res = g_byte_array_sized_new (base);
+	strings = g_byte_array_new ();
+	memset (&hdr, 0, sizeof (hdr));
+	g_byte_array_append (res, (const guint8 *)&hdr, sizeof (hdr));
+
+	for (i = 0; i < n; i ++) {
+		elt.hash = sorted[i].hash;
+		elt.key = base + strings->len;
+		g_byte_array_append (strings, sorted[i].key,
+				strlen (sorted[i].key) + 1);
+		elt.value = base + strings->len;
+		g_byte_array_append (strings, sorted[i].value,
+				strlen (sorted[i].value) + 1);
+		g_byte_array_append (res, (const guint8 *)&elt, sizeof (elt));
+	}
+
+	g_byte_array_append (res, strings->data, strings->len);
+	g_byte_array_free (strings, TRUE);
+	g_free (sorted);
+
+	memcpy (hdr.magic, rspamd_map_shared_magic, sizeof (hdr.magic));
+	hdr.len = res->len;
+	hdr.nelts = n;
+	memcpy (res->data, &hdr, sizeof (hdr));
+
+	return res;
+}
+
+static gboolean
+rspamd_map_shared_check (const guchar *image, gsize len)
+{
+	const struct rspamd_map_shared_hdr *hdr;
+
+	if (len < sizeof (*hdr)) {
+		return FALSE;
+	}
+
+	hdr = (const struct rspamd_map_shared_hdr *)image;
+
+	return memcmp (hdr->magic, rspamd_map_shared_magic,
+			sizeof (hdr->magic)) == 0 &&
+			hdr->len == len &&
+			sizeof (*hdr) + sizeof (struct rspamd_map_shared_elt) *
+					(gsize)hdr->nelts <= len &&
+			image[len - 1] == '\0';
+}
+
+static gboolean
+rspamd_map_shared_save (struct rspamd_map *map, GByteArray *image,
+		const gchar *path)
+{
+	gchar tmppath[PATH_MAX];
+	gint fd;
+
+	rspamd_snprintf (tmppath, sizeof (tmppath), "%s.tmp", path);
+
+	if ((fd = rspamd_file_xopen (tmppath, O_WRONLY | O_CREAT | O_EXCL,
+			00644, 0)) == -1) {
+		/* Another process is saving the same image */
+		return FALSE;
+	}
+
+	if (write (fd, image->data, image->len) != (gssize)image->len) {
+		msg_warn_map ("cannot write shared map to %s: %s",
+				tmppath, strerror (errno));
+		unlink (tmppath);
+		close (fd);
+
+		return FALSE;
+	}
+
+	fsync (fd);
+	close (fd);
+
+	if (rename (tmppath, path) == -1) {
+		msg_warn_map ("cannot rename shared map from %s to %s: %s",
+				tmppath, path, strerror (errno));
+		unlink (tmppath);
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Replaces the parsed hash map with its image mapped read only from
+ * maps_cache_dir. Images are addressed by their content, so all processes
+ * that have loaded the same map generation use the same pages and the
+ * private copy is freed. Returns the original helper on any error.
+ */
+static struct rspamd_hash_map_helper *
+rspamd_map_helper_share_hash (struct rspamd_map *map,
+		struct rspamd_hash_map_helper *ht)
+{
+	struct rspamd_config *cfg = map->cfg;
+	struct rspamd_hash_map_helper *nht;
+	guchar hash[rspamd_cryptobox_HASHBYTES];
+	gchar path[PATH_MAX], tmppath[PATH_MAX];
+	struct timespec ts;
+	GByteArray *image;
+	gpointer mapped;
+	gsize len;
+	guint tries = 0;
+
+	if (ht->shared || !cfg->shared_maps || cfg->maps_cache_dir == NULL ||
+			cfg->maps_cache_dir[0] == '\0') {
+		return ht;
+	}
+
+	image = rspamd_map_helper_serialize_hash (ht);
+
+	if (image->len > G_MAXUINT32) {
+		msg_info_map ("map is too large to be shared: %z bytes", image->len);
+		g_byte_array_free (image, TRUE);
+
+		return ht;
+	}
+
+	rspamd_cryptobox_hash (hash, image->data, image->len, NULL, 0);
+	rspamd_snprintf (path, sizeof (path), "%s%c%*xs.rmsh", cfg->maps_cache_dir,
+			G_DIR_SEPARATOR, (gint)rspamd_cryptobox_HASHBYTES / 2, hash);
+
+	if (access (path, F_OK) == -1) {
+		/* Wait for another process that saves the same image */
+		rspamd_snprintf (tmppath, sizeof (tmppath), "%s.tmp", path);
+		double_to_ts (MAP_SHARED_WAIT_INTERVAL, &ts);
+
+		while (access (tmppath, F_OK) != -1 && tries ++ < MAP_SHARED_WAIT_TRIES) {
+			(void)nanosleep (&ts, NULL);
+		}
+
+		if (access (path, F_OK) == -1 && !rspamd_map_shared_save (map,
+				image, path)) {
+			g_byte_array_free (image, TRUE);
+
+			return ht;
+		}
+	}
+
+	g_byte_array_free (image, TRUE);
+
+	if ((mapped = rspamd_file_xmap (path, PROT_READ, &len, TRUE)) == NULL) {
+		msg_warn_map ("cannot map shared map %s: %s", path, strerror (errno));
+
+		return ht;
+	}
+
+	if (!rspamd_map_shared_check (mapped, len)) {
+		msg_warn_map ("invalid shared map %s, removing it", path);
+		munmap (mapped, len);
+		(void)unlink (path);
+
+		return ht;
+	}
+
+	nht = rspamd_map_helper_new_hash (map);
+	nht->hst = ht->hst;
+	nht->shared = mapped;
+	nht->shared_len = len;
+	nht->shared_path = rspamd_mempool_strdup (nht->pool, path);
+	rspamd_map_helper_destroy_hash (ht);
+
+	msg_info_map ("use shared map image %s", path);
+
+	return nht;
+}
+
+gint
+rspamd_kv_list_load_image (struct map_cb_data *data, const gchar *path)
+{
+	struct rspamd_map *map = data->map;
+	struct rspamd_hash_map_helper *ht;
+	gpointer mapped;
+	gsize len;
+
+	if ((mapped = rspamd_file_xmap (path, PROT_READ, &len, TRUE)) == NULL) {
+		return 0;
+	}
+
+	if (len < sizeof (rspamd_map_shared_magic) ||
+			memcmp (mapped, rspamd_map_shared_magic,
+					sizeof (rspamd_map_shared_magic)) != 0) {
+		/* Text map */
+		munmap (mapped, len);
+
+		return 0;
+	}
+
+	if (!rspamd_map_shared_check (mapped, len)) {
+		msg_err_map ("%s: invalid compiled map", path);
+		munmap (mapped, len);
+
+		return -1;
+	}
+
+	if (data->cur_data) {
+		msg_err_map ("%s: compiled map cannot be combined with other backends",
+				path);
+		munmap (mapped, len);
+
+		return -1;
+	}
+
+	ht = rspamd_map_helper_new_hash (map);
+	ht->shared = mapped;
+	ht->shared_len = len;
+	rspamd_cryptobox_fast_hash_update (&ht->hst, mapped, len);
+	data->cur_data = ht;
+
+	return 1;
+}
+
+/*
+ * Removes entries that are not found in the updated map. If too many values
+ * have been replaced, then the live entries are copied to a new helper to
+ * release the memory of the old ones
+ */
+static struct rspamd_hash_map_helper *
+rspamd_map_helper_sweep_hash (struct rspamd_map *map,
+		struct rspamd_hash_map_helper *ht)
+{
+	struct rspamd_hash_map_helper *nht;
+	struct rspamd_map_helper_value *val;
+	gconstpointer key;
+	guint removed = 0;
+	khiter_t k;
+
+	for (k = kh_begin (ht->htb); k != kh_end (ht->htb); k ++) {
+		if (!kh_exist (ht->htb, k)) {
+			continue;
+		}
+
+		val = kh_value (ht->htb, k);
+
+		if (val->gen != ht->gen) {
+			ht->garbage += sizeof (*val) + strlen (val->value) + 1 +
+					strlen (val->key) + 1;
+			kh_del (rspamd_map_hash, ht->htb, k);
+			removed ++;
+		}
+	}
+
+	msg_info_map ("updated hash in place, %ud elements removed", removed);
+
+	if (ht->garbage > ht->allocated / 2) {
+		nht = rspamd_map_helper_new_hash (map);
+
+		kh_foreach (ht->htb, key, val, {
+			rspamd_map_helper_insert_hash (nht, key, val->value);
+		});
+
+		rspamd_map_helper_destroy_hash (ht);
+
+		return nht;
+	}
+
+	return ht;
+}
+
 void
 rspamd_kv_list_fin (struct map_cb_data *data)
 {
 	struct rspamd_map *map = data->map;
-	struct rspamd_hash_map_helper *htb;
+	struct rspamd_hash_map_helper *htb, *prev = NULL;
+	guint nelts;
 
 	if (data->prev_data) {
-		htb = (struct rspamd_hash_map_helper *)data->prev_data;
-		rspamd_map_helper_destroy_hash (htb);
+		prev = (struct rspamd_hash_map_helper *)data->prev_data;
 	}
 
 	if (data->cur_data) {
 		htb = (struct rspamd_hash_map_helper *)data->cur_data;
-		msg_info_map ("read hash of %d elements", kh_size (htb->htb));
+
+		if (htb == prev) {
+			/* Previous generation has been updated in place */
+			prev = NULL;
+			htb = rspamd_map_helper_sweep_hash (map, htb);
+			data->cur_data = htb;
+		}
+
+		if (htb->shared) {
+			nelts = ((const struct rspamd_map_shared_hdr *)htb->shared)->nelts;
+			msg_info_map ("loaded compiled hash of %d elements", nelts);
+		}
+		else {
+			nelts = kh_size (htb->htb);
+			msg_info_map ("read hash of %d elements", nelts);
+		}
+
 		data->map->traverse_function = rspamd_map_helper_traverse_hash;
-		data->map->nelts = kh_size (htb->htb);
+		data->map->nelts = nelts;
 		data->map->digest = rspamd_cryptobox_fast_hash_final (&htb->hst);
+		htb = rspamd_map_helper_share_hash (map, htb);
+		data->cur_data = htb;
+
+		if (prev && prev->shared_path && (htb->shared_path == NULL ||
+				strcmp (prev->shared_path, htb->shared_path) != 0)) {
+			/* Previous generation is not needed for new processes */
+			(void)unlink (prev->shared_path);
+		}
+	}
+
+	if (prev) {
+		rspamd_map_helper_destroy_hash (prev);
 	}
 }
 
@@ -874,6 +1310,7 @@ rspamd_radix_fin (struct map_cb_data *data)
 
 	if (data->cur_data) {
 		r = (struct rspamd_radix_map_helper *)data->cur_data;
+		radix_compile_compressed (r->trie);
 		msg_info_map ("read radix trie of %z elements: %s",
 				radix_get_size (r->trie), radix_get_info (r->trie));
 		data->map->traverse_function = rspamd_map_helper_traverse_radix;
@@ -893,6 +1330,146 @@ rspamd_radix_dtor (struct map_cb_data *data)
 	}
 }
 
+#ifdef WITH_HYPERSCAN
+/* Time to wait for another worker that compiles the same database */
+#define RE_MAP_HS_WAIT_TRIES 100
+#define RE_MAP_HS_WAIT_INTERVAL 0.02
+
+/*
+ * Compiled databases are stored in the hyperscan cache dir, addressed by
+ * hash of the patterns, flags and platform
+ */
+static gboolean
+rspamd_re_map_hs_cache_path (struct rspamd_regexp_map_helper *re_map,
+		hs_platform_info_t *plt,
+		gchar *path, gsize pathlen)
+{
+	rspamd_cryptobox_hash_state_t st;
+	guchar hash[rspamd_cryptobox_HASHBYTES];
+	const gchar *cache_dir;
+	guint i;
+
+	cache_dir = re_map->map->cfg->hs_cache_dir;
+
+	if (cache_dir == NULL) {
+		return FALSE;
+	}
+
+	rspamd_cryptobox_hash_init (&st, NULL, 0);
+
+	for (i = 0; i < re_map->regexps->len; i ++) {
+		/* Include the trailing zero to separate patterns */
+		rspamd_cryptobox_hash_update (&st, re_map->patterns[i],
+				strlen (re_map->patterns[i]) + 1);
+	}
+
+	rspamd_cryptobox_hash_update (&st, (const guchar *)re_map->flags,
+			sizeof (*re_map->flags) * re_map->regexps->len);
+	rspamd_cryptobox_hash_update (&st, (const guchar *)plt, sizeof (*plt));
+	rspamd_cryptobox_hash_final (&st, hash);
+
+	rspamd_snprintf (path, pathlen, "%s%c%*xs.hsmc", cache_dir,
+			G_DIR_SEPARATOR,
+			(gint)rspamd_cryptobox_HASHBYTES / 2, hash);
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_re_map_try_load_hs (struct rspamd_regexp_map_helper *re_map,
+		const gchar *path)
+{
+	gpointer map;
+	gsize len;
+
+	if ((map = rspamd_file_xmap (path, PROT_READ, &len, TRUE)) != NULL) {
+		if (hs_deserialize_database (map, len, &re_map->hs_db) == HS_SUCCESS) {
+			munmap (map, len);
+
+			return TRUE;
+		}
+
+		munmap (map, len);
+		/* Remove stale file */
+		(void)unlink (path);
+	}
+
+	re_map->hs_db = NULL;
+
+	return FALSE;
+}
+
+/*
+ * If another process is compiling the same database, then we wait a bit for
+ * it instead of compiling the same data in all workers simultaneously
+ */
+static gboolean
+rspamd_re_map_wait_hs (struct rspamd_regexp_map_helper *re_map,
+		const gchar *path)
+{
+	gchar tmppath[PATH_MAX];
+	struct timespec ts;
+	guint tries = 0;
+
+	rspamd_snprintf (tmppath, sizeof (tmppath), "%s.tmp", path);
+	double_to_ts (RE_MAP_HS_WAIT_INTERVAL, &ts);
+
+	while (access (tmppath, F_OK) != -1 && tries ++ < RE_MAP_HS_WAIT_TRIES) {
+		(void)nanosleep (&ts, NULL);
+	}
+
+	if (tries > 0) {
+		return rspamd_re_map_try_load_hs (re_map, path);
+	}
+
+	return FALSE;
+}
+
+static void
+rspamd_re_map_try_save_hs (struct rspamd_regexp_map_helper *re_map,
+		const gchar *path)
+{
+	struct rspamd_map *map = re_map->map;
+	gchar tmppath[PATH_MAX];
+	char *bytes = NULL;
+	gsize len;
+	gint fd;
+
+	rspamd_snprintf (tmppath, sizeof (tmppath), "%s.tmp", path);
+
+	if ((fd = rspamd_file_xopen (tmppath, O_WRONLY | O_CREAT | O_EXCL,
+			00644, 0)) == -1) {
+		/* Another process is saving the same database */
+		return;
+	}
+
+	if (hs_serialize_database (re_map->hs_db, &bytes, &len) == HS_SUCCESS) {
+		if (write (fd, bytes, len) == -1) {
+			msg_warn_map ("cannot write hyperscan cache to %s: %s",
+					tmppath, strerror (errno));
+			unlink (tmppath);
+		}
+		else {
+			fsync (fd);
+
+			if (rename (tmppath, path) == -1) {
+				msg_warn_map ("cannot rename hyperscan cache from %s to %s: %s",
+						tmppath, path, strerror (errno));
+				unlink (tmppath);
+			}
+		}
+
+		free (bytes);
+	}
+	else {
+		msg_warn_map ("cannot serialize hyperscan cache to %s", tmppath);
+		unlink (tmppath);
+	}
+
+	close (fd);
+}
+#endif
+
 static void
 rspamd_re_map_finalize (struct rspamd_regexp_map_helper *re_map)
 {
@@ -903,6 +1480,8 @@ rspamd_re_map_finalize (struct rspamd_regexp_map_helper *re_map)
 	struct rspamd_map *map;
 	rspamd_regexp_t *re;
 	gint pcre_flags;
+	gchar cache_path[PATH_MAX];
+	gboolean has_cache_path;
 
 	map = re_map->map;
 
@@ -953,7 +1532,15 @@ rspamd_re_map_finalize (struct rspamd_regexp_map_helper *re_map)
 	}
 
 	if (re_map->regexps->len > 0 && re_map->patterns) {
-		if (hs_compile_multi (re_map->patterns,
+		has_cache_path = rspamd_re_map_hs_cache_path (re_map, &plt,
+				cache_path, sizeof (cache_path));
+
+		if (has_cache_path && (rspamd_re_map_try_load_hs (re_map, cache_path) ||
+				rspamd_re_map_wait_hs (re_map, cache_path))) {
+			msg_info_map ("loaded compiled regexp map %s from %s",
+					map->name, cache_path);
+		}
+		else if (hs_compile_multi (re_map->patterns,
 				re_map->flags,
 				re_map->ids,
 				re_map->regexps->len,
@@ -971,6 +1558,9 @@ rspamd_re_map_finalize (struct rspamd_regexp_map_helper *re_map)
 
 			return;
 		}
+		else if (has_cache_path) {
+			rspamd_re_map_try_save_hs (re_map, cache_path);
+		}
 
 		if (hs_alloc_scratch (re_map->hs_db, &re_map->hs_scratch) != HS_SUCCESS) {
 			msg_err_map ("cannot allocate scratch space for hyperscan");
@@ -984,6 +1574,326 @@ rspamd_re_map_finalize (struct rspamd_regexp_map_helper *re_map)
 #endif
 }
 
+#define RE_MAP_LITERAL_FLUSH() do { \
+	if (curlen > bestlen) { \
+		memcpy (best, cur, curlen); \
+		bestlen = curlen; \
+	} \
+	curlen = 0; \
+} while (0)
+
+/*
+ * Returns the longest sequence of characters that must be present in any
+ * string matched by the regexp (lowercased) or NULL if it cannot be found.
+ * Only top level literals are considered, so the result is conservative.
+ */
+static gchar *
+rspamd_re_map_required_literal (rspamd_regexp_t *re, gsize *outlen)
+{
+	const gchar *p, *end, *pattern;
+	gchar *cur, *best, c, term;
+	gsize curlen = 0, bestlen = 0, len;
+	gint depth = 0, pcre_flags;
+	gboolean unicode_caseless;
+
+	pattern = rspamd_regexp_get_pattern (re);
+	pcre_flags = rspamd_regexp_get_pcre_flags (re);
+
+	if (pcre_flags & PCRE_FLAG(EXTENDED)) {
+		/* Whitespaces and comments are not literals */
+		return NULL;
+	}
+
+	/* 'k' and 's' have non ASCII case variants in unicode */
+#ifndef WITH_PCRE2
+	unicode_caseless = (pcre_flags & PCRE_FLAG(CASELESS)) &&
+			(pcre_flags & PCRE_FLAG(UTF8));
+#else
+	unicode_caseless = (pcre_flags & PCRE_FLAG(CASELESS)) &&
+			(pcre_flags & PCRE_FLAG(UTF));
+#endif
+
+	len = strlen (pattern);
+	p = pattern;
+	end = pattern + len;
+	cur = g_malloc (len + 1);
+	best = g_malloc (len + 1);
+
+	while (p < end) {
+		c = *p;
+
+		if (c == '\\') {
+			if (p + 1 >= end) {
+				goto fail;
+			}
+
+			if (!g_ascii_isalnum (p[1])) {
+				/* Escaped punctuation is a literal */
+				c = p[1];
+				p += 2;
+
+				if (depth > 0) {
+					continue;
+				}
+
+				goto literal;
+			}
+
+			/* Classes, backreferences and escaped codes */
+			if (depth == 0) {
+				RE_MAP_LITERAL_FLUSH ();
+			}
+
+			if (p[1] == 'c') {
+				p += 3;
+				continue;
+			}
+
+			p += 2;
+
+			while (p < end && (g_ascii_isalnum (*p) || *p == '_')) {
+				p ++;
+			}
+
+			if (p < end && (*p == '{' || *p == '<' || *p == '\'')) {
+				term = *p == '{' ? '}' : (*p == '<' ? '>' : '\'');
+				p = memchr (p, term, end - p);
+
+				if (p == NULL) {
+					goto fail;
+				}
+
+				p ++;
+			}
+
+			continue;
+		}
+
+		switch (c) {
+		case '[':
+			if (depth == 0) {
+				RE_MAP_LITERAL_FLUSH ();
+			}
+
+			p ++;
+
+			if (p < end && *p == '^') {
+				p ++;
+			}
+			if (p < end && *p == ']') {
+				p ++;
+			}
+
+			while (p < end && *p != ']') {
+				if (*p == '\\' && p + 1 < end) {
+					p ++;
+				}
+
+				p ++;
+			}
+
+			p ++;
+			continue;
+		case '(':
+			if (p + 1 < end && p[1] == '?' && p + 2 < end &&
+					strchr (":=!<>|", p[2]) == NULL) {
+				/* Inline options could change meaning of the rest */
+				goto fail;
+			}
+
+			if (depth == 0) {
+				RE_MAP_LITERAL_FLUSH ();
+			}
+
+			depth ++;
+			p ++;
+			continue;
+		case ')':
+			if (--depth < 0) {
+				goto fail;
+			}
+
+			p ++;
+			continue;
+		case '|':
+			if (depth == 0) {
+				/* Top level alternation has no required literals */
+				goto fail;
+			}
+
+			p ++;
+			continue;
+		default:
+			p ++;
+
+			if (depth > 0) {
+				continue;
+			}
+
+			if (strchr ("^$.?*+{}]", c) != NULL || !g_ascii_isprint (c) ||
+					(unicode_caseless && strchr ("kKsS", c) != NULL)) {
+				RE_MAP_LITERAL_FLUSH ();
+				continue;
+			}
+
+			break;
+		}
+
+literal:
+		cur[curlen ++] = g_ascii_tolower (c);
+
+		if (p < end) {
+			if (*p == '?' || *p == '*' || *p == '{') {
+				/* The last character is optional */
+				curlen --;
+				RE_MAP_LITERAL_FLUSH ();
+			}
+			else if (*p == '+') {
+				RE_MAP_LITERAL_FLUSH ();
+			}
+		}
+	}
+
+	RE_MAP_LITERAL_FLUSH ();
+	g_free (cur);
+
+	if (bestlen < RE_MAP_PREFILTER_MIN_LITERAL) {
+		g_free (best);
+
+		return NULL;
+	}
+
+	best[bestlen] = '\0';
+	*outlen = bestlen;
+
+	return best;
+
+fail:
+	g_free (cur);
+	g_free (best);
+
+	return NULL;
+}
+
+#undef RE_MAP_LITERAL_FLUSH
+
+/*
+ * Builds multipattern prefilter of required literals, so regexps are
+ * checked only for the inputs that contain their literals
+ */
+static void
+rspamd_re_map_build_prefilter (struct rspamd_regexp_map_helper *re_map)
+{
+	struct rspamd_map *map = re_map->map;
+	GArray *pats;
+	GHashTable *literals;
+	ac_trie_pat_t pat;
+	rspamd_regexp_t *re;
+	gpointer found;
+	gchar *lit;
+	gsize len;
+	guint i, nfiltered = 0;
+
+#ifdef WITH_HYPERSCAN
+	if (re_map->hs_db) {
+		return;
+	}
+#endif
+
+	if (re_map->regexps->len < RE_MAP_PREFILTER_MIN_REGEXPS) {
+		return;
+	}
+
+	pats = g_array_new (FALSE, FALSE, sizeof (ac_trie_pat_t));
+	literals = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+	re_map->literal_ids = g_new (gint, re_map->regexps->len);
+
+	for (i = 0; i < re_map->regexps->len; i ++) {
+		re = g_ptr_array_index (re_map->regexps, i);
+		lit = rspamd_re_map_required_literal (re, &len);
+
+		if (lit == NULL) {
+			re_map->literal_ids[i] = -1;
+			continue;
+		}
+
+		nfiltered ++;
+		found = g_hash_table_lookup (literals, lit);
+
+		if (found) {
+			/* Duplicate literals must share the same pattern id */
+			re_map->literal_ids[i] = GPOINTER_TO_INT (found) - 1;
+			g_free (lit);
+		}
+		else {
+			pat.ptr = lit;
+			pat.len = len;
+			g_array_append_val (pats, pat);
+			re_map->literal_ids[i] = pats->len - 1;
+			g_hash_table_insert (literals, lit, GINT_TO_POINTER (pats->len));
+		}
+	}
+
+	if (pats->len > 0) {
+		re_map->prefilter = acism_create ((const ac_trie_pat_t *)pats->data,
+				pats->len);
+		re_map->nliterals = pats->len;
+		msg_info_map ("use literal prefilter for %ud of %ud regexps in map %s",
+				nfiltered, re_map->regexps->len, map->name);
+	}
+	else {
+		g_free (re_map->literal_ids);
+		re_map->literal_ids = NULL;
+	}
+
+	g_array_free (pats, TRUE);
+	g_hash_table_unref (literals);
+}
+
+static int
+rspamd_re_map_prefilter_cb (int strnum, int textpos, void *context)
+{
+	guint8 *candidates = context;
+
+	candidates[strnum / 8] |= 1u << (strnum % 8);
+
+	/* Always return zero as we need all literals here */
+	return 0;
+}
+
+static guint8 *
+rspamd_re_map_prefilter_candidates (struct rspamd_regexp_map_helper *map,
+		const gchar *in, gsize len)
+{
+	guint8 *candidates;
+	gint state = 0;
+
+	if (map->prefilter == NULL) {
+		return NULL;
+	}
+
+	candidates = g_malloc0 ((map->nliterals + 7) / 8);
+	acism_lookup (map->prefilter, in, len, rspamd_re_map_prefilter_cb,
+			candidates, &state, TRUE);
+
+	return candidates;
+}
+
+static inline gboolean
+rspamd_re_map_is_candidate (struct rspamd_regexp_map_helper *map,
+		const guint8 *candidates, guint i)
+{
+	gint id;
+
+	if (candidates == NULL) {
+		return TRUE;
+	}
+
+	id = map->literal_ids[i];
+
+	return id < 0 || (candidates[id / 8] & (1u << (id % 8)));
+}
+
 gchar *
 rspamd_regexp_list_read_single (
 		gchar *chunk,
@@ -1091,6 +2001,7 @@ rspamd_regexp_list_fin (struct map_cb_data *data)
 	if (data->cur_data) {
 		re_map = data->cur_data;
 		rspamd_re_map_finalize (re_map);
+		rspamd_re_map_build_prefilter (re_map);
 		msg_info_map ("read regexp list of %ud elements",
 				re_map->regexps->len);
 		data->map->traverse_function = rspamd_map_helper_traverse_regexp;
@@ -1131,6 +2042,7 @@ rspamd_match_regexp_map_single (struct rspamd_regexp_map_helper *map,
 	gpointer ret = NULL;
 	struct rspamd_map_helper_value *val;
 	gboolean validated = FALSE;
+	guint8 *candidates;
 
 	g_assert (in != NULL);
 
@@ -1170,7 +2082,13 @@ rspamd_match_regexp_map_single (struct rspamd_regexp_map_helper *map,
 
 	if (!res) {
 		/* PCRE version */
+		candidates = rspamd_re_map_prefilter_candidates (map, in, len);
+
 		for (i = 0; i < map->regexps->len; i ++) {
+			if (!rspamd_re_map_is_candidate (map, candidates, i)) {
+				continue;
+			}
+
 			re = g_ptr_array_index (map->regexps, i);
 
 			if (rspamd_regexp_search (re, in, len, NULL, NULL, !validated, NULL)) {
@@ -1181,6 +2099,8 @@ rspamd_match_regexp_map_single (struct rspamd_regexp_map_helper *map,
 				break;
 			}
 		}
+
+		g_free (candidates);
 	}
 
 	return ret;
@@ -1222,6 +2142,7 @@ rspamd_match_regexp_map_all (struct rspamd_regexp_map_helper *map,
 	gint res = 0;
 	gboolean validated = FALSE;
 	struct rspamd_map_helper_value *val;
+	guint8 *candidates;
 
 	g_assert (in != NULL);
 
@@ -1259,7 +2180,13 @@ rspamd_match_regexp_map_all (struct rspamd_regexp_map_helper *map,
 
 	if (!res) {
 		/* PCRE version */
+		candidates = rspamd_re_map_prefilter_candidates (map, in, len);
+
 		for (i = 0; i < map->regexps->len; i ++) {
+			if (!rspamd_re_map_is_candidate (map, candidates, i)) {
+				continue;
+			}
+
 			re = g_ptr_array_index (map->regexps, i);
 
 			if (rspamd_regexp_search (re, in, len, NULL, NULL,
@@ -1269,6 +2196,8 @@ rspamd_match_regexp_map_all (struct rspamd_regexp_map_helper *map,
 				g_ptr_array_add (ret, val->value);
 			}
 		}
+
+		g_free (candidates);
 	}
 
 	if (ret->len > 0) {
@@ -1280,6 +2209,42 @@ rspamd_match_regexp_map_all (struct rspamd_regexp_map_helper *map,
 	return NULL;
 }
 
+static gconstpointer
+rspamd_match_shared_hash_map (struct rspamd_hash_map_helper *map,
+		const gchar *in)
+{
+	const struct rspamd_map_shared_hdr *hdr;
+	const struct rspamd_map_shared_elt *elts;
+	guint64 h;
+	guint lo, hi, mid;
+
+	hdr = (const struct rspamd_map_shared_hdr *)map->shared;
+	elts = (const struct rspamd_map_shared_elt *)(hdr + 1);
+	h = rspamd_icase_hash (in, strlen (in), map_hash_seed);
+	lo = 0;
+	hi = hdr->nelts;
+
+	/* Lower bound of the hash */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+
+		if (elts[mid].hash < h) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+
+	for (; lo < hdr->nelts && elts[lo].hash == h; lo ++) {
+		if (g_ascii_strcasecmp (map->shared + elts[lo].key, in) == 0) {
+			return map->shared + elts[lo].value;
+		}
+	}
+
+	return NULL;
+}
+
 gconstpointer
 rspamd_match_hash_map (struct rspamd_hash_map_helper *map, const gchar *in)
 {
@@ -1290,6 +2255,10 @@ rspamd_match_hash_map (struct rspamd_hash_map_helper *map, const gchar *in)
 		return NULL;
 	}
 
+	if (map->shared) {
+		return rspamd_match_shared_hash_map (map, in);
+	}
+
 	k = kh_get (rspamd_map_hash, map->htb, in);
 
 	if (k != kh_end (map->htb)) {
@@ -1343,4 +2312,32 @@ rspamd_match_radix_map_addr (struct rspamd_radix_map_helper *map,
 	}
 
 	return NULL;
-}
\ No newline at end of file
+}
+
+guint
+rspamd_match_radix_map_addrs (struct rspamd_radix_map_helper *map,
+		const rspamd_inet_addr_t **addrs, guint naddrs,
+		gconstpointer *results)
+{
+	struct rspamd_map_helper_value *val;
+	guint i, nmatched = 0;
+
+	for (i = 0; i < naddrs; i ++) {
+		results[i] = NULL;
+
+		if (map == NULL || addrs[i] == NULL) {
+			continue;
+		}
+
+		val = (struct rspamd_map_helper_value *)radix_find_compressed_addr (
+				map->trie, addrs[i]);
+
+		if (val != (gconstpointer)RADIX_NO_VALUE) {
+			val->hits ++;
+			results[i] = val->value;
+			nmatched ++;
+		}
+	}
+
+	return nmatched;
+}
@@ -65,6 +65,13 @@ gchar * rspamd_kv_list_read (
 		gboolean final);
 void rspamd_kv_list_fin (struct map_cb_data *data);
 void rspamd_kv_list_dtor (struct map_cb_data *data);
+/**
+ * Loads hash map compiled by `rspamadm map_compile` with no parsing
+ * @param data
+ * @param path
+ * @return 1 if map has been loaded, 0 if it is not compiled and -1 on error
+ */
+gint rspamd_kv_list_load_image (struct map_cb_data *data, const gchar *path);
 
 /**
  * Regexp list is a list of regular expressions
@@ -151,6 +158,19 @@ gconstpointer rspamd_match_radix_map (struct rspamd_radix_map_helper *map,
 gconstpointer rspamd_match_radix_map_addr (struct rspamd_radix_map_helper *map,
 		const rspamd_inet_addr_t *addr);
 
+/**
+ * Find values for multiple addresses (e.g. all addresses from the received
+ * chain) in a single call
+ * @param map
+ * @param addrs array of addresses, NULL elements are skipped
+ * @param naddrs number of addresses
+ * @param results output array of `naddrs` values, NULL if not found
+ * @return number of addresses matched
+ */
+guint rspamd_match_radix_map_addrs (struct rspamd_radix_map_helper *map,
+		const rspamd_inet_addr_t **addrs, guint naddrs,
+		gconstpointer *results);
+
 /**
  * Creates radix map helper
  * @param map
@@ -197,6 +217,13 @@ void rspamd_map_helper_insert_hash (gpointer st, gconstpointer key, gconstpointe
  * @param r
  */
 void rspamd_map_helper_destroy_hash (struct rspamd_hash_map_helper *r);
+/**
+ * Serializes hash map to the flat image that could be used with no parsing.
+ * The same content always produces the same image
+ * @param ht
+ * @return image that must be freed by a caller
+ */
+GByteArray *rspamd_map_helper_serialize_hash (struct rspamd_hash_map_helper *ht);
 
 /**
  * Create new regexp map
@@ -90,6 +90,29 @@ KHASH_INIT(mempool_entry, const gchar *, struct rspamd_mempool_entry_point *,
 
 static khash_t(mempool_entry) *mempool_entries = NULL;
 
+/*
+ * Allocations profile, locations are produced by G_STRLOC so their
+ * pointers are unique per call site and could be used as keys directly
+ */
+static inline khint_t
+rspamd_profile_hash (const gchar *loc)
+{
+	return kh_int64_hash_func ((guint64)(uintptr_t)loc);
+}
+
+static inline int
+rspamd_profile_equal (const gchar *k1, const gchar *k2)
+{
+	return k1 == k2;
+}
+
+KHASH_INIT(mempool_profile, const gchar *, struct rspamd_mempool_profile_elt,
+		1, rspamd_profile_hash, rspamd_profile_equal)
+
+static khash_t(mempool_profile) *mempool_profile = NULL;
+static gboolean profile_enabled = FALSE;
+static gboolean huge_pages_enabled = FALSE;
+
 
 /* Internal statistic */
 static rspamd_mempool_stat_t *mem_pool_stat = NULL;
@@ -97,6 +120,19 @@ static rspamd_mempool_stat_t *mem_pool_stat = NULL;
 static gboolean env_checked = FALSE;
 static gboolean always_malloc = FALSE;
 
+/* Maximum number of cached chunks */
+#define CHUNKS_CACHE_MAX 256
+
+/*
+ * Freed chunks of this process, the most recently freed (and so the warmest)
+ * chunks are at the end
+ */
+static struct {
+	GPtrArray *chunks;
+	gsize bytes;
+	gsize max_bytes;
+} chunks_cache = {NULL, 0, 0};
+
 /**
  * Function that return free space in pool page
  * @param x pool page struct
@@ -113,6 +149,59 @@ pool_chain_free (struct _pool_chain *chain)
 /* By default allocate 8Kb chunks of memory */
 #define FIXED_POOL_SIZE 4096
 
+/*
+ * Find a cached chunk with at least `len` bytes of space that is not much
+ * larger than requested
+ */
+static struct _pool_chain *
+rspamd_mempool_chunks_cache_get (gsize len)
+{
+	struct _pool_chain *chain;
+	guint i;
+
+	if (chunks_cache.chunks == NULL) {
+		return NULL;
+	}
+
+	for (i = chunks_cache.chunks->len; i > 0; i --) {
+		chain = g_ptr_array_index (chunks_cache.chunks, i - 1);
+
+		if (chain->len >= len && chain->len <= len * 2) {
+			g_ptr_array_remove_index (chunks_cache.chunks, i - 1);
+			chunks_cache.bytes -= chain->len + sizeof (struct _pool_chain);
+
+			return chain;
+		}
+	}
+
+	return NULL;
+}
+
+static gboolean
+rspamd_mempool_chunks_cache_put (struct _pool_chain *chain)
+{
+	gsize len = chain->len + sizeof (struct _pool_chain);
+
+	/* Do not let a single huge chunk occupy the whole cache */
+	if (len > chunks_cache.max_bytes / 4 ||
+			chunks_cache.bytes + len > chunks_cache.max_bytes) {
+		return FALSE;
+	}
+
+	if (chunks_cache.chunks == NULL) {
+		chunks_cache.chunks = g_ptr_array_sized_new (CHUNKS_CACHE_MAX);
+	}
+
+	if (chunks_cache.chunks->len >= CHUNKS_CACHE_MAX) {
+		return FALSE;
+	}
+
+	g_ptr_array_add (chunks_cache.chunks, chain);
+	chunks_cache.bytes += len;
+
+	return TRUE;
+}
+
 static inline struct rspamd_mempool_entry_point *
 rspamd_mempool_entry_new (const gchar *loc)
 {
@@ -163,6 +252,30 @@ rspamd_mempool_get_entry (const gchar *loc)
 	return rspamd_mempool_entry_new (loc);
 }
 
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/*
+ * Advises transparent huge pages for the aligned part of a large chunk,
+ * so big pools of tasks need less TLB entries
+ */
+static void
+rspamd_mempool_advise_huge_pages (gpointer map, gsize len)
+{
+#ifdef MADV_HUGEPAGE
+	guintptr start, end;
+
+	if (!huge_pages_enabled || len < HUGE_PAGE_SIZE) {
+		return;
+	}
+
+	start = ((guintptr)map + HUGE_PAGE_SIZE - 1) & ~((guintptr)HUGE_PAGE_SIZE - 1);
+	end = ((guintptr)map + len) & ~((guintptr)HUGE_PAGE_SIZE - 1);
+
+	if (end > start) {
+		(void)madvise ((gpointer)start, end - start, MADV_HUGEPAGE);
+	}
+#endif
+}
 
 static struct _pool_chain *
 rspamd_mempool_chain_new (gsize size, enum rspamd_mempool_chain_type pool_type)
@@ -212,9 +325,20 @@ rspamd_mempool_chain_new (gsize size, enum rspamd_mempool_chain_type pool_type)
 #else
 #error No mmap methods are defined
 #endif
+		rspamd_mempool_advise_huge_pages (map, total_size);
 		g_atomic_int_inc (&mem_pool_stat->shared_chunks_allocated);
 		g_atomic_int_add (&mem_pool_stat->bytes_allocated, total_size);
 	}
+	else if ((chain = rspamd_mempool_chunks_cache_get (
+			total_size - sizeof (struct _pool_chain))) != NULL) {
+		/* Reuse already faulted memory, chain->begin and len are kept */
+		g_atomic_int_add (&mem_pool_stat->bytes_allocated, chain->len);
+		g_atomic_int_inc (&mem_pool_stat->chunks_allocated);
+		chain->pos = align_ptr (chain->begin, MEM_ALIGNMENT);
+		chain->lock = NULL;
+
+		return chain;
+	}
 	else {
 #ifdef HAVE_MALLOC_SIZE
 		optimal_size = sys_alloc_size (total_size);
@@ -228,6 +352,7 @@ rspamd_mempool_chain_new (gsize size, enum rspamd_mempool_chain_type pool_type)
 			abort ();
 		}
 
+		rspamd_mempool_advise_huge_pages (map, total_size);
 		chain = map;
 		chain->begin = ((guint8 *) chain) + sizeof (struct _pool_chain);
 		g_atomic_int_add (&mem_pool_stat->bytes_allocated, total_size);
@@ -363,6 +488,11 @@ rspamd_mempool_new_ (gsize size, const gchar *tag, const gchar *loc)
 		if (g_slice != NULL) {
 			always_malloc = TRUE;
 		}
+
+		if (getenv ("RSPAMD_MEMPOOL_PROFILE") != NULL) {
+			profile_enabled = TRUE;
+		}
+
 		env_checked = TRUE;
 	}
 
@@ -400,14 +530,40 @@ rspamd_mempool_new_ (gsize size, const gchar *tag, const gchar *loc)
 	return new;
 }
 
+static void
+rspamd_mempool_profile_add (const gchar *loc, gsize size)
+{
+	struct rspamd_mempool_profile_elt *elt;
+	khiter_t k;
+	gint r;
+
+	if (mempool_profile == NULL) {
+		mempool_profile = kh_init (mempool_profile);
+	}
+
+	k = kh_put (mempool_profile, mempool_profile, loc, &r);
+	elt = &kh_value (mempool_profile, k);
+
+	if (r != 0) {
+		elt->loc = loc;
+		elt->bytes = 0;
+		elt->count = 0;
+	}
+
+	elt->bytes += size;
+	elt->count ++;
+}
+
 static void *
 memory_pool_alloc_common (rspamd_mempool_t * pool, gsize size,
-						  enum rspamd_mempool_chain_type pool_type)
+						  enum rspamd_mempool_chain_type pool_type,
+						  const gchar *loc)
 RSPAMD_ATTR_ALLOC_SIZE(2) RSPAMD_ATTR_ALLOC_ALIGN(MEM_ALIGNMENT) RSPAMD_ATTR_RETURNS_NONNUL;
 
 static void *
 memory_pool_alloc_common (rspamd_mempool_t * pool, gsize size,
-		enum rspamd_mempool_chain_type pool_type)
+		enum rspamd_mempool_chain_type pool_type,
+		const gchar *loc)
 {
 	guint8 *tmp;
 	struct _pool_chain *new, *cur;
@@ -415,6 +571,11 @@ memory_pool_alloc_common (rspamd_mempool_t * pool, gsize size,
 
 	if (pool) {
 		POOL_MTX_LOCK ();
+
+		if (G_UNLIKELY (profile_enabled)) {
+			rspamd_mempool_profile_add (loc, size);
+		}
+
 		if (always_malloc && pool_type != RSPAMD_MEMPOOL_SHARED) {
 			void *ptr;
 
@@ -475,21 +636,21 @@ memory_pool_alloc_common (rspamd_mempool_t * pool, gsize size,
 
 
 void *
-rspamd_mempool_alloc (rspamd_mempool_t * pool, gsize size)
+rspamd_mempool_alloc_ (rspamd_mempool_t * pool, gsize size, const gchar *loc)
 {
-	return memory_pool_alloc_common (pool, size, RSPAMD_MEMPOOL_NORMAL);
+	return memory_pool_alloc_common (pool, size, RSPAMD_MEMPOOL_NORMAL, loc);
 }
 
 void *
-rspamd_mempool_alloc_tmp (rspamd_mempool_t * pool, gsize size)
+rspamd_mempool_alloc_tmp_ (rspamd_mempool_t * pool, gsize size, const gchar *loc)
 {
-	return memory_pool_alloc_common (pool, size, RSPAMD_MEMPOOL_TMP);
+	return memory_pool_alloc_common (pool, size, RSPAMD_MEMPOOL_TMP, loc);
 }
 
 void *
-rspamd_mempool_alloc0 (rspamd_mempool_t * pool, gsize size)
+rspamd_mempool_alloc0_ (rspamd_mempool_t * pool, gsize size, const gchar *loc)
 {
-	void *pointer = rspamd_mempool_alloc (pool, size);
+	void *pointer = rspamd_mempool_alloc_ (pool, size, loc);
 	if (pointer) {
 		memset (pointer, 0, size);
 	}
@@ -497,9 +658,9 @@ rspamd_mempool_alloc0 (rspamd_mempool_t * pool, gsize size)
 }
 
 void *
-rspamd_mempool_alloc0_tmp (rspamd_mempool_t * pool, gsize size)
+rspamd_mempool_alloc0_tmp_ (rspamd_mempool_t * pool, gsize size, const gchar *loc)
 {
-	void *pointer = rspamd_mempool_alloc_tmp (pool, size);
+	void *pointer = rspamd_mempool_alloc_tmp_ (pool, size, loc);
 	if (pointer) {
 		memset (pointer, 0, size);
 	}
@@ -507,9 +668,10 @@ rspamd_mempool_alloc0_tmp (rspamd_mempool_t * pool, gsize size)
 }
 
 void *
-rspamd_mempool_alloc0_shared (rspamd_mempool_t * pool, gsize size)
+rspamd_mempool_alloc0_shared_ (rspamd_mempool_t * pool, gsize size,
+		const gchar *loc)
 {
-	void *pointer = rspamd_mempool_alloc_shared (pool, size);
+	void *pointer = rspamd_mempool_alloc_shared_ (pool, size, loc);
 	if (pointer) {
 		memset (pointer, 0, size);
 	}
@@ -517,14 +679,16 @@ rspamd_mempool_alloc0_shared (rspamd_mempool_t * pool, gsize size)
 }
 
 void *
-rspamd_mempool_alloc_shared (rspamd_mempool_t * pool, gsize size)
+rspamd_mempool_alloc_shared_ (rspamd_mempool_t * pool, gsize size,
+		const gchar *loc)
 {
-	return memory_pool_alloc_common (pool, size, RSPAMD_MEMPOOL_SHARED);
+	return memory_pool_alloc_common (pool, size, RSPAMD_MEMPOOL_SHARED, loc);
 }
 
 
 gchar *
-rspamd_mempool_strdup (rspamd_mempool_t * pool, const gchar *src)
+rspamd_mempool_strdup_ (rspamd_mempool_t * pool, const gchar *src,
+		const gchar *loc)
 {
 	gsize len;
 	gchar *newstr;
@@ -534,7 +698,7 @@ rspamd_mempool_strdup (rspamd_mempool_t * pool, const gchar *src)
 	}
 
 	len = strlen (src);
-	newstr = rspamd_mempool_alloc (pool, len + 1);
+	newstr = rspamd_mempool_alloc_ (pool, len + 1, loc);
 	memcpy (newstr, src, len);
 	newstr[len] = '\0';
 
@@ -542,7 +706,8 @@ rspamd_mempool_strdup (rspamd_mempool_t * pool, const gchar *src)
 }
 
 gchar *
-rspamd_mempool_fstrdup (rspamd_mempool_t * pool, const struct f_str_s *src)
+rspamd_mempool_fstrdup_ (rspamd_mempool_t * pool, const struct f_str_s *src,
+		const gchar *loc)
 {
 	gchar *newstr;
 
@@ -550,7 +715,7 @@ rspamd_mempool_fstrdup (rspamd_mempool_t * pool, const struct f_str_s *src)
 		return NULL;
 	}
 
-	newstr = rspamd_mempool_alloc (pool, src->len + 1);
+	newstr = rspamd_mempool_alloc_ (pool, src->len + 1, loc);
 	memcpy (newstr, src->str, src->len);
 	newstr[src->len] = '\0';
 
@@ -558,7 +723,8 @@ rspamd_mempool_fstrdup (rspamd_mempool_t * pool, const struct f_str_s *src)
 }
 
 gchar *
-rspamd_mempool_ftokdup (rspamd_mempool_t *pool, const rspamd_ftok_t *src)
+rspamd_mempool_ftokdup_ (rspamd_mempool_t *pool, const rspamd_ftok_t *src,
+		const gchar *loc)
 {
 	gchar *newstr;
 
@@ -566,7 +732,7 @@ rspamd_mempool_ftokdup (rspamd_mempool_t *pool, const rspamd_ftok_t *src)
 		return NULL;
 	}
 
-	newstr = rspamd_mempool_alloc (pool, src->len + 1);
+	newstr = rspamd_mempool_alloc_ (pool, src->len + 1, loc);
 	memcpy (newstr, src->begin, src->len);
 	newstr[src->len] = '\0';
 
@@ -738,7 +904,7 @@ rspamd_mempool_delete (rspamd_mempool_t * pool)
 				if (i == RSPAMD_MEMPOOL_SHARED) {
 					munmap ((void *)cur, len);
 				}
-				else {
+				else if (!rspamd_mempool_chunks_cache_put (cur)) {
 					free (cur); /* Not g_free as we use system allocator */
 				}
 			}
@@ -780,7 +946,9 @@ rspamd_mempool_cleanup_tmp (rspamd_mempool_t * pool)
 					-((gint)cur->len));
 			g_atomic_int_add (&mem_pool_stat->chunks_allocated, -1);
 
-			free (cur);
+			if (!rspamd_mempool_chunks_cache_put (cur)) {
+				free (cur);
+			}
 		}
 
 		g_ptr_array_free (pool->pools[RSPAMD_MEMPOOL_TMP], TRUE);
@@ -814,6 +982,107 @@ rspamd_mempool_stat_reset (void)
 	}
 }
 
+void
+rspamd_mempool_profile_enable (gboolean enable)
+{
+	profile_enabled = enable;
+}
+
+void
+rspamd_mempool_huge_pages_enable (gboolean enable)
+{
+	huge_pages_enabled = enable;
+}
+
+gboolean
+rspamd_mempool_profile_enabled (void)
+{
+	return profile_enabled;
+}
+
+static gint
+rspamd_mempool_profile_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct rspamd_mempool_profile_elt *e1 = a, *e2 = b;
+
+	if (e1->bytes > e2->bytes) {
+		return -1;
+	}
+	else if (e1->bytes < e2->bytes) {
+		return 1;
+	}
+
+	return 0;
+}
+
+GArray *
+rspamd_mempool_profile_get (void)
+{
+	GArray *res;
+	struct rspamd_mempool_profile_elt elt;
+
+	if (mempool_profile == NULL) {
+		return g_array_new (FALSE, FALSE,
+				sizeof (struct rspamd_mempool_profile_elt));
+	}
+
+	res = g_array_sized_new (FALSE, FALSE,
+			sizeof (struct rspamd_mempool_profile_elt),
+			kh_size (mempool_profile));
+
+	kh_foreach_value (mempool_profile, elt, {
+		g_array_append_val (res, elt);
+	});
+
+	g_array_sort (res, rspamd_mempool_profile_cmp);
+
+	return res;
+}
+
+void
+rspamd_mempool_profile_reset (void)
+{
+	if (mempool_profile != NULL) {
+		kh_clear (mempool_profile, mempool_profile);
+	}
+}
+
+void
+rspamd_mempool_chunks_cache_limit (gsize max_bytes)
+{
+	chunks_cache.max_bytes = max_bytes;
+	rspamd_mempool_chunks_cache_trim (max_bytes);
+}
+
+void
+rspamd_mempool_chunks_cache_trim (gsize keep_bytes)
+{
+	struct _pool_chain *chain;
+	guint i;
+
+	if (chunks_cache.chunks == NULL) {
+		return;
+	}
+
+	/* Free the oldest chunks first */
+	for (i = 0; i < chunks_cache.chunks->len &&
+			chunks_cache.bytes > keep_bytes; i ++) {
+		chain = g_ptr_array_index (chunks_cache.chunks, i);
+		chunks_cache.bytes -= chain->len + sizeof (struct _pool_chain);
+		free (chain);
+	}
+
+	if (i > 0) {
+		g_ptr_array_remove_range (chunks_cache.chunks, 0, i);
+	}
+}
+
+gsize
+rspamd_mempool_chunks_cache_size (void)
+{
+	return chunks_cache.bytes;
+}
+
 gsize
 rspamd_mempool_suggest_size_ (const char *loc)
 {
@@ -1111,3 +1380,16 @@ rspamd_mempool_glist_append (rspamd_mempool_t *pool, GList *l, gpointer p)
 
 	return l;
 }
+
+GPtrArray *
+rspamd_mempool_ptr_array_new (rspamd_mempool_t *pool, guint nelts)
+{
+	GPtrArray *ar;
+
+	ar = rspamd_mempool_alloc (pool, sizeof (*ar));
+	ar->pdata = nelts > 0 ?
+			rspamd_mempool_alloc (pool, sizeof (gpointer) * nelts) : NULL;
+	ar->len = 0;
+
+	return ar;
+}
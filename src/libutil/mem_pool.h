@@ -156,8 +156,10 @@ rspamd_mempool_t * rspamd_mempool_new_ (gsize size, const gchar *tag, const gcha
  * @param size bytes to allocate
  * @return pointer to allocated object
  */
-void * rspamd_mempool_alloc (rspamd_mempool_t * pool, gsize size)
+void * rspamd_mempool_alloc_ (rspamd_mempool_t * pool, gsize size, const gchar *loc)
 		RSPAMD_ATTR_ALLOC_SIZE(2) RSPAMD_ATTR_ALLOC_ALIGN(MEM_ALIGNMENT) RSPAMD_ATTR_RETURNS_NONNUL;
+#define rspamd_mempool_alloc(pool, size) \
+	rspamd_mempool_alloc_((pool), (size), G_STRLOC)
 
 /**
  * Get memory from temporary pool
@@ -165,7 +167,10 @@ void * rspamd_mempool_alloc (rspamd_mempool_t * pool, gsize size)
  * @param size bytes to allocate
  * @return pointer to allocated object
  */
-void * rspamd_mempool_alloc_tmp (rspamd_mempool_t * pool, gsize size) RSPAMD_ATTR_RETURNS_NONNUL;
+void * rspamd_mempool_alloc_tmp_ (rspamd_mempool_t * pool, gsize size,
+		const gchar *loc) RSPAMD_ATTR_RETURNS_NONNUL;
+#define rspamd_mempool_alloc_tmp(pool, size) \
+	rspamd_mempool_alloc_tmp_((pool), (size), G_STRLOC)
 
 /**
  * Get memory and set it to zero
@@ -173,8 +178,10 @@ void * rspamd_mempool_alloc_tmp (rspamd_mempool_t * pool, gsize size) RSPAMD_ATT
  * @param size bytes to allocate
  * @return pointer to allocated object
  */
-void * rspamd_mempool_alloc0 (rspamd_mempool_t * pool, gsize size)
+void * rspamd_mempool_alloc0_ (rspamd_mempool_t * pool, gsize size, const gchar *loc)
 	RSPAMD_ATTR_ALLOC_SIZE(2) RSPAMD_ATTR_ALLOC_ALIGN(MEM_ALIGNMENT) RSPAMD_ATTR_RETURNS_NONNUL;
+#define rspamd_mempool_alloc0(pool, size) \
+	rspamd_mempool_alloc0_((pool), (size), G_STRLOC)
 
 /**
  * Get memory and set it to zero
@@ -182,7 +189,10 @@ void * rspamd_mempool_alloc0 (rspamd_mempool_t * pool, gsize size)
  * @param size bytes to allocate
  * @return pointer to allocated object
  */
-void * rspamd_mempool_alloc0_tmp (rspamd_mempool_t * pool, gsize size) RSPAMD_ATTR_RETURNS_NONNUL;
+void * rspamd_mempool_alloc0_tmp_ (rspamd_mempool_t * pool, gsize size,
+		const gchar *loc) RSPAMD_ATTR_RETURNS_NONNUL;
+#define rspamd_mempool_alloc0_tmp(pool, size) \
+	rspamd_mempool_alloc0_tmp_((pool), (size), G_STRLOC)
 
 /**
  * Cleanup temporary data in pool
@@ -195,8 +205,10 @@ void rspamd_mempool_cleanup_tmp (rspamd_mempool_t * pool);
  * @param src source string
  * @return pointer to newly created string that is copy of src
  */
-gchar * rspamd_mempool_strdup (rspamd_mempool_t * pool, const gchar *src)
-	RSPAMD_ATTR_ALLOC_ALIGN(MEM_ALIGNMENT);
+gchar * rspamd_mempool_strdup_ (rspamd_mempool_t * pool, const gchar *src,
+		const gchar *loc) RSPAMD_ATTR_ALLOC_ALIGN(MEM_ALIGNMENT);
+#define rspamd_mempool_strdup(pool, src) \
+	rspamd_mempool_strdup_((pool), (src), G_STRLOC)
 
 /**
  * Make a copy of fixed string in pool as null terminated string
@@ -204,8 +216,10 @@ gchar * rspamd_mempool_strdup (rspamd_mempool_t * pool, const gchar *src)
  * @param src source string
  * @return pointer to newly created string that is copy of src
  */
-gchar * rspamd_mempool_fstrdup (rspamd_mempool_t * pool,
-	const struct f_str_s *src) RSPAMD_ATTR_ALLOC_ALIGN(MEM_ALIGNMENT);
+gchar * rspamd_mempool_fstrdup_ (rspamd_mempool_t * pool,
+	const struct f_str_s *src, const gchar *loc) RSPAMD_ATTR_ALLOC_ALIGN(MEM_ALIGNMENT);
+#define rspamd_mempool_fstrdup(pool, src) \
+	rspamd_mempool_fstrdup_((pool), (src), G_STRLOC)
 
 struct f_str_tok;
 
@@ -215,18 +229,26 @@ struct f_str_tok;
  * @param src source string
  * @return pointer to newly created string that is copy of src
  */
-gchar * rspamd_mempool_ftokdup (rspamd_mempool_t *pool,
-		const struct f_str_tok *src) RSPAMD_ATTR_ALLOC_ALIGN(MEM_ALIGNMENT);
+gchar * rspamd_mempool_ftokdup_ (rspamd_mempool_t *pool,
+		const struct f_str_tok *src, const gchar *loc) RSPAMD_ATTR_ALLOC_ALIGN(MEM_ALIGNMENT);
+#define rspamd_mempool_ftokdup(pool, src) \
+	rspamd_mempool_ftokdup_((pool), (src), G_STRLOC)
 
 /**
  * Allocate piece of shared memory
  * @param pool memory pool object
  * @param size bytes to allocate
  */
-void * rspamd_mempool_alloc_shared (rspamd_mempool_t * pool, gsize size)
+void * rspamd_mempool_alloc_shared_ (rspamd_mempool_t * pool, gsize size,
+		const gchar *loc)
 	RSPAMD_ATTR_ALLOC_SIZE(2) RSPAMD_ATTR_ALLOC_ALIGN(MEM_ALIGNMENT) RSPAMD_ATTR_RETURNS_NONNUL;
-void * rspamd_mempool_alloc0_shared (rspamd_mempool_t *pool, gsize size)
+#define rspamd_mempool_alloc_shared(pool, size) \
+	rspamd_mempool_alloc_shared_((pool), (size), G_STRLOC)
+void * rspamd_mempool_alloc0_shared_ (rspamd_mempool_t *pool, gsize size,
+		const gchar *loc)
 	RSPAMD_ATTR_ALLOC_SIZE(2) RSPAMD_ATTR_ALLOC_ALIGN(MEM_ALIGNMENT) RSPAMD_ATTR_RETURNS_NONNUL;
+#define rspamd_mempool_alloc0_shared(pool, size) \
+	rspamd_mempool_alloc0_shared_((pool), (size), G_STRLOC)
 /**
  * Add destructor callback to pool
  * @param pool memory pool object
@@ -327,6 +349,62 @@ void rspamd_mempool_stat (rspamd_mempool_stat_t *st);
  */
 void rspamd_mempool_stat_reset (void);
 
+/**
+ * Keep freed chunks of normal and temporary pools in this process to reuse
+ * them for new pools instead of returning them to malloc
+ * @param max_bytes maximum size of cached chunks, 0 disables the cache
+ */
+void rspamd_mempool_chunks_cache_limit (gsize max_bytes);
+
+/**
+ * Free cached chunks until their total size is not more than keep_bytes
+ * @param keep_bytes size of chunks to keep in cache
+ */
+void rspamd_mempool_chunks_cache_trim (gsize keep_bytes);
+
+/**
+ * Get total size of the cached chunks
+ * @return size in bytes
+ */
+gsize rspamd_mempool_chunks_cache_size (void);
+
+/**
+ * Allocations of a single call site recorded by the pool profiler
+ */
+struct rspamd_mempool_profile_elt {
+	const gchar *loc;                   /**< file:line of the allocation		*/
+	guint64 bytes;                      /**< bytes allocated from this place	*/
+	guint64 count;                      /**< number of allocations				*/
+};
+
+/**
+ * Enable or disable recording of pool allocations per call site in this process
+ * @param enable TRUE to enable profiling
+ */
+void rspamd_mempool_profile_enable (gboolean enable);
+
+/**
+ * Advise transparent huge pages for large pool chunks allocated in this process
+ * @param enable TRUE to use huge pages
+ */
+void rspamd_mempool_huge_pages_enable (gboolean enable);
+
+/**
+ * Check if pool allocations are profiled in this process
+ */
+gboolean rspamd_mempool_profile_enabled (void);
+
+/**
+ * Get allocations recorded by the pool profiler sorted by bytes in descending order
+ * @return array of `struct rspamd_mempool_profile_elt`, must be freed by caller
+ */
+GArray * rspamd_mempool_profile_get (void);
+
+/**
+ * Forget all allocations recorded by the pool profiler
+ */
+void rspamd_mempool_profile_reset (void);
+
 /**
  * Get optimal pool size based on page size for this system
  * @return size of memory page in system
@@ -377,4 +455,15 @@ GList *rspamd_mempool_glist_prepend (rspamd_mempool_t *pool,
 GList *rspamd_mempool_glist_append (rspamd_mempool_t *pool,
 		GList *l, gpointer p) G_GNUC_WARN_UNUSED_RESULT;
 
+/**
+ * Create pointer array with storage for `nelts` elements in the memory pool,
+ * such an array needs no destructor. It must be filled by writing to `pdata`
+ * and incrementing `len` and must never be passed to g_ptr_array_* functions
+ * that grow or free arrays
+ * @param pool
+ * @param nelts
+ * @return
+ */
+GPtrArray *rspamd_mempool_ptr_array_new (rspamd_mempool_t *pool, guint nelts);
+
 #endif
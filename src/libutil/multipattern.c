@@ -27,6 +27,8 @@
 #include "acism.h"
 
 #define MAX_SCRATCH 4
+/* Do not use bytes skipping if patterns can start with too many bytes */
+#define MAX_SKIP_FIRST_BYTES 16
 
 enum rspamd_hs_check_state {
 	RSPAMD_HS_UNCHECKED = 0,
@@ -50,6 +52,12 @@ struct rspamd_multipattern {
 #endif
 	ac_trie_t *t;
 	GArray *pats;
+	/* Bitmap of bytes that can start a pattern, used to skip input quickly */
+	guint8 first_bytes[256 / NBBY];
+	guint nfirst;
+	guchar single_first;
+	gsize max_len;
+	gboolean use_skip;
 
 	gboolean compiled;
 	guint cnt;
@@ -423,6 +431,58 @@ rspamd_multipattern_try_save_hs (struct rspamd_multipattern *mp,
 }
 #endif
 
+static inline void
+rspamd_multipattern_set_first (struct rspamd_multipattern *mp, guchar c)
+{
+	if (!(mp->first_bytes[c / NBBY] & (1 << (c % NBBY)))) {
+		mp->first_bytes[c / NBBY] |= 1 << (c % NBBY);
+		mp->single_first = c;
+		mp->nfirst ++;
+	}
+}
+
+/*
+ * Collects bytes that can start patterns, if there are a few of them, then
+ * lookup can skip input up to the next such byte using memchr or a bitmap
+ * instead of passing every byte through the automaton
+ */
+static void
+rspamd_multipattern_init_skip (struct rspamd_multipattern *mp)
+{
+	ac_trie_pat_t *pat;
+	guchar c;
+	guint i;
+
+	memset (mp->first_bytes, 0, sizeof (mp->first_bytes));
+	mp->nfirst = 0;
+	mp->max_len = 0;
+
+	for (i = 0; i < mp->cnt; i ++) {
+		pat = &g_array_index (mp->pats, ac_trie_pat_t, i);
+
+		if (pat->len == 0) {
+			/* Empty pattern matches everywhere */
+			mp->use_skip = FALSE;
+
+			return;
+		}
+
+		c = pat->ptr[0];
+
+		if (mp->flags & RSPAMD_MULTIPATTERN_ICASE) {
+			rspamd_multipattern_set_first (mp, g_ascii_tolower (c));
+			rspamd_multipattern_set_first (mp, g_ascii_toupper (c));
+		}
+		else {
+			rspamd_multipattern_set_first (mp, c);
+		}
+
+		mp->max_len = MAX (mp->max_len, pat->len);
+	}
+
+	mp->use_skip = mp->nfirst <= MAX_SKIP_FIRST_BYTES;
+}
+
 gboolean
 rspamd_multipattern_compile (struct rspamd_multipattern *mp, GError **err)
 {
@@ -476,6 +536,7 @@ rspamd_multipattern_compile (struct rspamd_multipattern *mp, GError **err)
 
 	if (mp->cnt > 0) {
 		mp->t = acism_create ((const ac_trie_pat_t *)mp->pats->data, mp->cnt);
+		rspamd_multipattern_init_skip (mp);
 	}
 
 	mp->compiled = TRUE;
@@ -491,6 +552,8 @@ struct rspamd_multipattern_cbdata {
 	gpointer ud;
 	guint nfound;
 	gint ret;
+	/* Offset of the chunk passed to acism from the beginning of input */
+	gsize offset;
 };
 
 #ifdef WITH_HYPERSCAN
@@ -528,6 +591,7 @@ rspamd_multipattern_acism_cb (int strnum, int textpos, void *context)
 	ac_trie_pat_t pat;
 
 	pat = g_array_index (cbd->mp->pats, ac_trie_pat_t, strnum);
+	textpos += cbd->offset;
 	ret = cbd->cb (cbd->mp, strnum, textpos - pat.len,
 			textpos, cbd->in, cbd->len, cbd->ud);
 
@@ -537,6 +601,57 @@ rspamd_multipattern_acism_cb (int strnum, int textpos, void *context)
 	return ret;
 }
 
+/*
+ * The automaton is fed by chunks of the longest pattern length starting from
+ * a byte that can start a pattern. Once it returns to the root state, there
+ * are no partial matches, so we can skip input up to the next such byte
+ */
+static gint
+rspamd_multipattern_acism_lookup_skip (struct rspamd_multipattern *mp,
+		const gchar *in, gsize len,
+		struct rspamd_multipattern_cbdata *cbd)
+{
+	const guchar *p = (const guchar *)in, *end = p + len;
+	gsize chunk;
+	gint state = 0, ret = 0;
+
+	while (p < end) {
+		if (state == 0) {
+			if (mp->nfirst == 1) {
+				p = memchr (p, mp->single_first, end - p);
+
+				if (p == NULL) {
+					break;
+				}
+			}
+			else {
+				while (p < end &&
+						!(mp->first_bytes[*p / NBBY] & (1 << (*p % NBBY)))) {
+					p ++;
+				}
+
+				if (p == end) {
+					break;
+				}
+			}
+		}
+
+		chunk = MIN (mp->max_len, (gsize)(end - p));
+		cbd->offset = p - (const guchar *)in;
+		ret = acism_lookup (mp->t, (const gchar *)p, chunk,
+				rspamd_multipattern_acism_cb, cbd,
+				&state, mp->flags & RSPAMD_MULTIPATTERN_ICASE);
+
+		if (ret != 0) {
+			return ret;
+		}
+
+		p += chunk;
+	}
+
+	return ret;
+}
+
 gint
 rspamd_multipattern_lookup (struct rspamd_multipattern *mp,
 		const gchar *in, gsize len, rspamd_multipattern_cb_t cb,
@@ -558,6 +673,7 @@ rspamd_multipattern_lookup (struct rspamd_multipattern *mp,
 	cbd.ud = ud;
 	cbd.nfound = 0;
 	cbd.ret = 0;
+	cbd.offset = 0;
 
 #ifdef WITH_HYPERSCAN
 	if (rspamd_hs_check ()) {
@@ -596,8 +712,13 @@ rspamd_multipattern_lookup (struct rspamd_multipattern *mp,
 
 	gint state = 0;
 
-	ret = acism_lookup (mp->t, in, len, rspamd_multipattern_acism_cb, &cbd,
-			&state, mp->flags & RSPAMD_MULTIPATTERN_ICASE);
+	if (mp->use_skip) {
+		ret = rspamd_multipattern_acism_lookup_skip (mp, in, len, &cbd);
+	}
+	else {
+		ret = acism_lookup (mp->t, in, len, rspamd_multipattern_acism_cb, &cbd,
+				&state, mp->flags & RSPAMD_MULTIPATTERN_ICASE);
+	}
 
 	if (pnfound) {
 		*pnfound = cbd.nfound;
@@ -38,21 +38,115 @@
 
 INIT_LOG_MODULE(radix)
 
+/* Prefix as inserted to the trie, used to build flat tables */
+struct radix_prefix {
+	guint64 hi;
+	guint64 lo;
+	guint bits;
+	guint seq;
+	uintptr_t value;
+};
+
+/*
+ * Flat table is a sorted array of range starts: the value of a key is the
+ * value of the last start that is less or equal to the key. Starts are
+ * stored separately from values to keep the binary search in a contiguous
+ * memory. Large tables also have an index by the first 16 bits of a key
+ */
+struct radix_flat_table {
+	guint64 *starts; /* Pairs of hi and lo for IPv6, just hi for IPv4 */
+	uintptr_t *values;
+	guint32 *idx;
+	guint n;
+};
+
+#define RADIX_FLAT_INDEX_BITS 16
+#define RADIX_FLAT_INDEX_MIN 1024
+
 struct radix_tree_compressed {
 	rspamd_mempool_t *pool;
 	struct btrie *tree;
 	size_t size;
 	guint duplicates;
 	gboolean own_pool;
+	GArray *prefixes;
+	struct radix_flat_table *flat4;
+	struct radix_flat_table *flat6;
 };
 
+static guint
+radix_flat_lookup_pos (struct radix_flat_table *t, guint64 hi, guint64 lo,
+		gboolean v6)
+{
+	guint l = 0, r = t->n, mid, h;
+	guint64 shi, slo;
+
+	if (t->idx) {
+		h = hi >> (64 - RADIX_FLAT_INDEX_BITS);
+		l = t->idx[h] > 0 ? t->idx[h] - 1 : 0;
+		r = t->idx[h + 1];
+	}
+
+	/* Find the first start that is greater than the key */
+	while (l < r) {
+		mid = l + (r - l) / 2;
+
+		if (v6) {
+			shi = t->starts[mid * 2];
+			slo = t->starts[mid * 2 + 1];
+		}
+		else {
+			shi = t->starts[mid];
+			slo = 0;
+		}
+
+		if (shi < hi || (shi == hi && slo <= lo)) {
+			l = mid + 1;
+		}
+		else {
+			r = mid;
+		}
+	}
+
+	/* The first start is always zero, so l is positive here */
+	return l - 1;
+}
+
+static inline void
+radix_key_to_u128 (const guint8 *key, gsize keylen, guint64 *hi, guint64 *lo)
+{
+	guint8 buf[16];
+
+	memset (buf, 0, sizeof (buf));
+	memcpy (buf, key, MIN (keylen, sizeof (buf)));
+	memcpy (hi, buf, sizeof (*hi));
+	memcpy (lo, buf + 8, sizeof (*lo));
+	*hi = GUINT64_FROM_BE (*hi);
+	*lo = GUINT64_FROM_BE (*lo);
+}
+
 uintptr_t
 radix_find_compressed (radix_compressed_t * tree, const guint8 *key, gsize keylen)
 {
 	gconstpointer ret;
+	struct radix_flat_table *t = NULL;
+	guint64 hi, lo;
 
 	g_assert (tree != NULL);
 
+	if (keylen == sizeof (struct in_addr)) {
+		t = tree->flat4;
+	}
+	else if (keylen == sizeof (struct in6_addr)) {
+		t = tree->flat6;
+	}
+
+	if (t) {
+		radix_key_to_u128 (key, keylen, &hi, &lo);
+
+		return t->values[radix_flat_lookup_pos (t, hi, lo, t == tree->flat6)];
+	}
+
 	ret = btrie_lookup (tree->tree, key, keylen * NBBY);
 
 	if (ret == NULL) {
@@ -114,11 +208,245 @@ radix_insert_compressed (radix_compressed_t * tree,
 	}
 	else {
 		tree->size ++;
+
+		if (tree->prefixes == NULL) {
+			/* Flat tables cannot be updated, use the trie from now */
+			tree->flat4 = NULL;
+			tree->flat6 = NULL;
+		}
+		else {
+			struct radix_prefix pfx;
+
+			radix_key_to_u128 (key, keylen, &pfx.hi, &pfx.lo);
+			pfx.bits = keybits - masklen;
+			pfx.seq = tree->prefixes->len;
+			pfx.value = value;
+			g_array_append_val (tree->prefixes, pfx);
+		}
 	}
 
 	return old;
 }
 
+static gint
+radix_prefix_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct radix_prefix *p1 = a, *p2 = b;
+
+	if (p1->hi != p2->hi) {
+		return p1->hi < p2->hi ? -1 : 1;
+	}
+	if (p1->lo != p2->lo) {
+		return p1->lo < p2->lo ? -1 : 1;
+	}
+	/* Wider prefixes go first */
+	if (p1->bits != p2->bits) {
+		return p1->bits < p2->bits ? -1 : 1;
+	}
+
+	return p1->seq < p2->seq ? -1 : (p1->seq > p2->seq ? 1 : 0);
+}
+
+static void
+radix_flat_emit (GArray *starts, GArray *values, guint64 hi, guint64 lo,
+		uintptr_t value)
+{
+	struct radix_prefix *last;
+	struct radix_prefix st;
+
+	if (starts->len > 0) {
+		last = &g_array_index (starts, struct radix_prefix, starts->len - 1);
+
+		if (last->hi == hi && last->lo == lo) {
+			/* More specific range starts at the same point */
+			g_array_index (values, uintptr_t, values->len - 1) = value;
+
+			if (values->len > 1 && g_array_index (values, uintptr_t,
+					values->len - 2) == value) {
+				g_array_set_size (starts, starts->len - 1);
+				g_array_set_size (values, values->len - 1);
+			}
+
+			return;
+		}
+
+		if (g_array_index (values, uintptr_t, values->len - 1) == value) {
+			return;
+		}
+	}
+
+	st.hi = hi;
+	st.lo = lo;
+	g_array_append_val (starts, st);
+	g_array_append_val (values, value);
+}
+
+static inline void
+radix_prefix_end (const struct radix_prefix *p, guint64 *hi, guint64 *lo)
+{
+	if (p->bits < 64) {
+		*hi = p->hi | (G_MAXUINT64 >> p->bits);
+		*lo = G_MAXUINT64;
+	}
+	else if (p->bits < 128) {
+		*hi = p->hi;
+		*lo = p->lo | (G_MAXUINT64 >> (p->bits - 64));
+	}
+	else {
+		*hi = p->hi;
+		*lo = p->lo;
+	}
+}
+
+/*
+ * Converts nested prefixes to the sorted list of disjoint ranges, prefixes
+ * are either nested or disjoint, so a stack of the covering prefixes is
+ * enough. `bits` limits the key space: 32 for IPv4 and 128 for IPv6
+ */
+static struct radix_flat_table *
+radix_flat_build (radix_compressed_t *tree, guint bits)
+{
+	struct radix_flat_table *t;
+	struct radix_prefix *p, *stack[129], cur;
+	GArray *sorted, *starts, *values;
+	guint64 hmask, lmask, ehi, elo;
+	guint i, sp = 0, h, j;
+
+	sorted = g_array_sized_new (FALSE, FALSE, sizeof (cur), tree->prefixes->len);
+
+	for (i = 0; i < tree->prefixes->len; i ++) {
+		p = &g_array_index (tree->prefixes, struct radix_prefix, i);
+
+		if (p->bits <= bits) {
+			cur = *p;
+			hmask = cur.bits >= 64 ? G_MAXUINT64 :
+					(cur.bits == 0 ? 0 : G_MAXUINT64 << (64 - cur.bits));
+			lmask = cur.bits <= 64 ? 0 :
+					(cur.bits == 128 ? G_MAXUINT64 : G_MAXUINT64 << (128 - cur.bits));
+			cur.hi &= hmask;
+			cur.lo &= lmask;
+			g_array_append_val (sorted, cur);
+		}
+	}
+
+	g_array_sort (sorted, radix_prefix_cmp);
+	starts = g_array_new (FALSE, FALSE, sizeof (cur));
+	values = g_array_new (FALSE, FALSE, sizeof (uintptr_t));
+	radix_flat_emit (starts, values, 0, 0, RADIX_NO_VALUE);
+
+#define PFX_POP() do { \
+	struct radix_prefix *top = stack[--sp]; \
+	radix_prefix_end (top, &ehi, &elo); \
+	if (!(ehi == G_MAXUINT64 && elo == G_MAXUINT64)) { \
+		if (++elo == 0) { ehi ++; } \
+		radix_flat_emit (starts, values, ehi, elo, \
+				sp > 0 ? stack[sp - 1]->value : RADIX_NO_VALUE); \
+	} \
+} while (0)
+
+	for (i = 0; i < sorted->len; i ++) {
+		p = &g_array_index (sorted, struct radix_prefix, i);
+
+		if (i > 0 && p->hi == (p - 1)->hi && p->lo == (p - 1)->lo &&
+				p->bits == (p - 1)->bits) {
+			/* Duplicate prefix, the first one is used as in the trie */
+			continue;
+		}
+
+		while (sp > 0) {
+			radix_prefix_end (stack[sp - 1], &ehi, &elo);
+
+			if (ehi < p->hi || (ehi == p->hi && elo < p->lo)) {
+				PFX_POP ();
+			}
+			else {
+				break;
+			}
+		}
+
+		radix_flat_emit (starts, values, p->hi, p->lo, p->value);
+		stack[sp ++] = p;
+	}
+
+	while (sp > 0) {
+		PFX_POP ();
+	}
+
+#undef PFX_POP
+
+	t = g_malloc0 (sizeof (*t));
+	t->n = starts->len;
+	t->values = (uintptr_t *)g_array_free (values, FALSE);
+	rspamd_mempool_add_destructor (tree->pool, g_free, t->values);
+
+	if (bits == 128) {
+		t->starts = g_malloc (sizeof (guint64) * 2 * t->n);
+
+		for (i = 0; i < t->n; i ++) {
+			cur = g_array_index (starts, struct radix_prefix, i);
+			t->starts[i * 2] = cur.hi;
+			t->starts[i * 2 + 1] = cur.lo;
+		}
+	}
+	else {
+		t->starts = g_malloc (sizeof (guint64) * t->n);
+
+		for (i = 0; i < t->n; i ++) {
+			t->starts[i] = g_array_index (starts, struct radix_prefix, i).hi;
+		}
+	}
+
+	rspamd_mempool_add_destructor (tree->pool, g_free, t->starts);
+
+	if (t->n >= RADIX_FLAT_INDEX_MIN) {
+		t->idx = g_malloc (sizeof (guint32) * ((1u << RADIX_FLAT_INDEX_BITS) + 1));
+
+		for (h = 0, j = 0; h <= (1u << RADIX_FLAT_INDEX_BITS); h ++) {
+			while (j < t->n && (g_array_index (starts, struct radix_prefix,
+					j).hi >> (64 - RADIX_FLAT_INDEX_BITS)) < h) {
+				j ++;
+			}
+
+			t->idx[h] = j;
+		}
+
+		rspamd_mempool_add_destructor (tree->pool, g_free, t->idx);
+	}
+
+	rspamd_mempool_add_destructor (tree->pool, g_free, t);
+	g_array_free (starts, TRUE);
+	g_array_free (sorted, TRUE);
+
+	return t;
+}
+
+void
+radix_compile_compressed (radix_compressed_t *tree)
+{
+	if (tree == NULL || tree->prefixes == NULL) {
+		return;
+	}
+
+	tree->flat4 = radix_flat_build (tree, 32);
+	tree->flat6 = radix_flat_build (tree, 128);
+	msg_debug_radix ("compiled %ud prefixes to %ud IPv4 and %ud IPv6 ranges",
+			tree->prefixes->len, tree->flat4->n, tree->flat6->n);
+	/* Prefixes are not needed anymore */
+	g_array_free (tree->prefixes, TRUE);
+	tree->prefixes = NULL;
+}
+
+static void
+radix_prefixes_dtor (gpointer p)
+{
+	radix_compressed_t *tree = p;
+
+	if (tree->prefixes) {
+		g_array_free (tree->prefixes, TRUE);
+		tree->prefixes = NULL;
+	}
+}
+
 
 radix_compressed_t *
 radix_create_compressed (void)
@@ -135,6 +463,10 @@ radix_create_compressed (void)
 	tree->duplicates = 0;
 	tree->tree = btrie_init (tree->pool);
 	tree->own_pool = TRUE;
+	tree->prefixes = g_array_new (FALSE, FALSE, sizeof (struct radix_prefix));
+	tree->flat4 = NULL;
+	tree->flat6 = NULL;
+	rspamd_mempool_add_destructor (tree->pool, radix_prefixes_dtor, tree);
 
 	return tree;
 }
@@ -150,6 +482,10 @@ radix_create_compressed_with_pool (rspamd_mempool_t *pool)
 	tree->duplicates = 0;
 	tree->tree = btrie_init (tree->pool);
 	tree->own_pool = FALSE;
+	tree->prefixes = g_array_new (FALSE, FALSE, sizeof (struct radix_prefix));
+	tree->flat4 = NULL;
+	tree->flat6 = NULL;
+	rspamd_mempool_add_destructor (tree->pool, radix_prefixes_dtor, tree);
 
 	return tree;
 }
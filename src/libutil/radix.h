@@ -97,6 +97,15 @@ gboolean radix_add_generic_iplist (const gchar *ip_list,
  */
 gsize radix_get_size (radix_compressed_t *tree);
 
+/**
+ * Builds flat lookup tables for IPv4 and IPv6 keys from the prefixes
+ * inserted so far. Tables are contiguous sorted arrays of ranges, so lookups
+ * do not follow pointers between trie nodes. Inserting after this call
+ * drops the tables and lookups use the trie again
+ * @param tree
+ */
+void radix_compile_compressed (radix_compressed_t *tree);
+
 /**
  * Return string that describes this radix tree (memory, nodes, compression etc)
  * @param tree
@@ -508,6 +508,66 @@ fin:
 	return res;
 }
 
+static PCRE_T *
+rspamd_regexp_compile_pattern (const gchar *pattern, gint pcre_flags)
+{
+	PCRE_T *r;
+#ifndef WITH_PCRE2
+	const gchar *err_str;
+	gint err_off;
+
+	r = pcre_compile (pattern, pcre_flags, &err_str, &err_off, NULL);
+#else
+	gint err_code;
+	gsize err_off;
+
+	r = pcre2_compile (pattern, PCRE2_ZERO_TERMINATED,
+			pcre_flags, &err_code, &err_off, pcre2_ctx);
+#endif
+
+	return r;
+}
+
+rspamd_regexp_t *
+rspamd_regexp_clone (rspamd_regexp_t *re)
+{
+	rspamd_regexp_t *res;
+
+	g_assert (re != NULL);
+
+	res = g_malloc0 (sizeof (*res));
+	REF_INIT_RETAIN (res, rspamd_regexp_dtor);
+	res->flags = re->flags;
+	res->pattern = g_strdup (re->pattern);
+	res->cache_id = RSPAMD_INVALID_ID;
+	res->pcre_flags = re->pcre_flags;
+	res->max_hits = re->max_hits;
+	res->ncaptures = re->ncaptures;
+	res->nbackref = re->nbackref;
+	res->ud = re->ud;
+	memcpy (res->id, re->id, sizeof (res->id));
+	/* The original pattern has been already compiled, so it is valid */
+	res->re = rspamd_regexp_compile_pattern (res->pattern, res->pcre_flags);
+	g_assert (res->re != NULL);
+
+	if (re->raw_re == re->re) {
+		res->raw_re = res->re;
+	}
+	else if (re->raw_re != NULL) {
+#ifndef WITH_PCRE2
+		res->raw_re = rspamd_regexp_compile_pattern (res->pattern,
+				res->pcre_flags & ~PCRE_FLAG(UTF8));
+#else
+		res->raw_re = rspamd_regexp_compile_pattern (res->pattern,
+				res->pcre_flags & ~PCRE_FLAG(UTF));
+#endif
+	}
+
+	rspamd_regexp_post_process (res);
+
+	return res;
+}
+
 #ifndef WITH_PCRE2
 gboolean
 rspamd_regexp_search (rspamd_regexp_t *re, const gchar *text, gsize len,
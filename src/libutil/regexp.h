@@ -53,6 +53,14 @@ struct rspamd_re_capture {
 rspamd_regexp_t* rspamd_regexp_new (const gchar *pattern, const gchar *flags,
 		GError **err);
 
+/**
+ * Creates an independent copy of the regexp with the same id, pattern and
+ * flags but with no cache id and class set
+ * @param re regexp to copy
+ * @return new regexp object
+ */
+rspamd_regexp_t* rspamd_regexp_clone (rspamd_regexp_t *re);
+
 /**
  * Search the specified regexp in the text
  * @param re
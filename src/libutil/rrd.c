@@ -23,7 +23,7 @@
 
 #define RSPAMD_RRD_DS_COUNT METRIC_ACTION_MAX
 #define RSPAMD_RRD_OLD_DS_COUNT 4
-#define RSPAMD_RRD_RRA_COUNT 4
+#define RSPAMD_RRD_RRA_COUNT 5
 
 #define msg_err_rrd(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
         "rrd", file->id, \
@@ -779,7 +779,7 @@ rspamd_rrd_finalize (struct rspamd_rrd_file *file, GError **err)
  */
 static gboolean
 rspamd_rrd_update_pdp_prep (struct rspamd_rrd_file *file,
-	gdouble *vals,
+	const gdouble *vals,
 	gdouble *pdp_new,
 	gdouble interval)
 {
@@ -1108,16 +1108,13 @@ rspamd_rrd_write_rra (struct rspamd_rrd_file *file, gulong *rra_steps)
 	}
 }
 
-/**
- * Add record to rrd file
- * @param file rrd file object
- * @param points points (must be row suitable for this RRA, depending on ds count)
- * @param err error pointer
- * @return TRUE if a row has been added
+/*
+ * Updates PDP, CDP and RRA areas with a row of values, the caller is
+ * responsible to check the row length and to sync the map
  */
-gboolean
-rspamd_rrd_add_record (struct rspamd_rrd_file *file,
-		GArray *points,
+static gboolean
+rspamd_rrd_update_record (struct rspamd_rrd_file *file,
+		const gdouble *points,
 		gdouble ticks,
 		GError **err)
 {
@@ -1127,14 +1124,6 @@ rspamd_rrd_add_record (struct rspamd_rrd_file *file,
 	gulong pdp_steps, cur_pdp_count, prev_pdp_step, cur_pdp_step,
 		prev_pdp_age, cur_pdp_age, *rra_steps, pdp_offset;
 
-	if (file == NULL || file->stat_head->ds_cnt * sizeof (gdouble) !=
-		points->len) {
-		g_set_error (err,
-			rrd_error_quark (), EINVAL,
-			"rrd add points failed: wrong arguments");
-		return FALSE;
-	}
-
 	/* Get interval */
 	seconds = (glong)ticks;
 	microseconds = (glong)((ticks - seconds) * 1000000.);
@@ -1149,7 +1138,7 @@ rspamd_rrd_add_record (struct rspamd_rrd_file *file,
 	/* How much steps need to be updated in each RRA */
 	rra_steps = g_malloc0 (sizeof (gulong) * file->stat_head->rra_cnt);
 
-	if (!rspamd_rrd_update_pdp_prep (file, (gdouble *)points->data, pdp_new,
+	if (!rspamd_rrd_update_pdp_prep (file, points, pdp_new,
 		interval)) {
 		g_set_error (err,
 			rrd_error_quark (), EINVAL,
@@ -1238,9 +1227,6 @@ rspamd_rrd_add_record (struct rspamd_rrd_file *file,
 	file->live_head->last_up = seconds;
 	file->live_head->last_up_usec = microseconds;
 
-	/* Sync and invalidate */
-	msync (file->map, file->size, MS_ASYNC | MS_INVALIDATE);
-
 	g_free (pdp_new);
 	g_free (pdp_temp);
 	g_free (rra_steps);
@@ -1248,6 +1234,98 @@ rspamd_rrd_add_record (struct rspamd_rrd_file *file,
 	return TRUE;
 }
 
+gboolean
+rspamd_rrd_add_record (struct rspamd_rrd_file *file,
+		GArray *points,
+		gdouble ticks,
+		GError **err)
+{
+	if (file == NULL || file->stat_head->ds_cnt * sizeof (gdouble) !=
+		points->len) {
+		g_set_error (err,
+			rrd_error_quark (), EINVAL,
+			"rrd add points failed: wrong arguments");
+		return FALSE;
+	}
+
+	if (!rspamd_rrd_update_record (file, (const gdouble *)points->data,
+			ticks, err)) {
+		return FALSE;
+	}
+
+	/* Sync and invalidate */
+	msync (file->map, file->size, MS_ASYNC | MS_INVALIDATE);
+
+	return TRUE;
+}
+
+gboolean
+rspamd_rrd_queue_record (struct rspamd_rrd_file *file,
+		GArray *points,
+		gdouble ticks,
+		GError **err)
+{
+	gulong ds_cnt;
+
+	if (file == NULL || file->stat_head->ds_cnt * sizeof (gdouble) !=
+		points->len) {
+		g_set_error (err,
+			rrd_error_quark (), EINVAL,
+			"rrd queue points failed: wrong arguments");
+		return FALSE;
+	}
+
+	ds_cnt = file->stat_head->ds_cnt;
+
+	if (file->pending == NULL) {
+		file->pending = g_array_sized_new (FALSE, FALSE, sizeof (gdouble),
+				(ds_cnt + 1) * 16);
+	}
+
+	/* Each queued row is the timestamp followed by the values */
+	g_array_append_val (file->pending, ticks);
+	g_array_append_vals (file->pending, points->data, ds_cnt);
+
+	return TRUE;
+}
+
+gboolean
+rspamd_rrd_flush (struct rspamd_rrd_file *file, GError **err)
+{
+	const gdouble *row;
+	gulong row_len;
+	guint i;
+	gboolean ret = TRUE;
+
+	if (file == NULL) {
+		g_set_error (err,
+			rrd_error_quark (), EINVAL,
+			"rrd flush failed: wrong arguments");
+		return FALSE;
+	}
+
+	if (file->pending == NULL || file->pending->len == 0) {
+		return TRUE;
+	}
+
+	row_len = file->stat_head->ds_cnt + 1;
+
+	for (i = 0; i < file->pending->len; i += row_len) {
+		row = &g_array_index (file->pending, gdouble, i);
+
+		if (!rspamd_rrd_update_record (file, row + 1, row[0], err)) {
+			ret = FALSE;
+			break;
+		}
+	}
+
+	g_array_set_size (file->pending, 0);
+	/* A single sync for all queued rows */
+	msync (file->map, file->size, MS_ASYNC | MS_INVALIDATE);
+
+	return ret;
+}
+
 /**
  * Close rrd file
  * @param file
@@ -1261,6 +1339,14 @@ rspamd_rrd_close (struct rspamd_rrd_file * file)
 		return -1;
 	}
 
+	if (file->pending) {
+		if (file->pending->len > 0 && file->finalized) {
+			rspamd_rrd_flush (file, NULL);
+		}
+
+		g_array_free (file->pending, TRUE);
+	}
+
 	munmap (file->map, file->size);
 	close (file->fd);
 	g_free (file->filename);
@@ -1271,18 +1357,64 @@ rspamd_rrd_close (struct rspamd_rrd_file * file)
 	return 0;
 }
 
+static void
+rspamd_rrd_default_rra (struct rrd_rra_def *rra)
+{
+	/* Once per minute for 1 day */
+	rrd_make_default_rra (rrd_cf_to_string (RRD_CF_AVERAGE),
+			60, 24 * 60, &rra[0]);
+	/* Once per 5 minutes for 1 week */
+	rrd_make_default_rra (rrd_cf_to_string (RRD_CF_AVERAGE),
+			5 * 60, 7 * 24 * 60 / 5, &rra[1]);
+	/* Once per 10 mins for 1 month */
+	rrd_make_default_rra (rrd_cf_to_string (RRD_CF_AVERAGE),
+			60 * 10, 30 * 24 * 6, &rra[2]);
+	/* Once per hour for 1 year */
+	rrd_make_default_rra (rrd_cf_to_string (RRD_CF_AVERAGE),
+			60 * 60, 365 * 24, &rra[3]);
+	/* Once per 10 seconds for 6 hours */
+	rrd_make_default_rra (rrd_cf_to_string (RRD_CF_AVERAGE),
+			10, 6 * 60 * 6, &rra[4]);
+}
+
+/*
+ * Fills data sources of the default rrd: actions counters followed by
+ * the extra data sources
+ */
+static GArray *
+rspamd_rrd_default_ds (GArray *extra_ds)
+{
+	GArray *ds;
+	struct rrd_ds_def def;
+	gint i;
+
+	ds = g_array_sized_new (FALSE, FALSE, sizeof (def),
+			RSPAMD_RRD_DS_COUNT + (extra_ds ? extra_ds->len : 0));
+
+	for (i = METRIC_ACTION_REJECT; i < METRIC_ACTION_MAX; i ++) {
+		rrd_make_default_ds (rspamd_action_to_str (i),
+				rrd_dst_to_string (RRD_DST_COUNTER), 1, &def);
+		g_array_append_val (ds, def);
+	}
+
+	if (extra_ds) {
+		g_array_append_vals (ds, extra_ds->data, extra_ds->len);
+	}
+
+	return ds;
+}
+
 static struct rspamd_rrd_file *
-rspamd_rrd_create_file (const gchar *path, gboolean finalize, GError **err)
+rspamd_rrd_create_file (const gchar *path, GArray *ds, gboolean finalize,
+		GError **err)
 {
 	struct rspamd_rrd_file *file;
-	struct rrd_ds_def ds[RSPAMD_RRD_DS_COUNT];
 	struct rrd_rra_def rra[RSPAMD_RRD_RRA_COUNT];
-	gint i;
 	GArray ar;
 
 	/* Try to create new rrd file */
 
-	file = rspamd_rrd_create (path, RSPAMD_RRD_DS_COUNT, RSPAMD_RRD_RRA_COUNT,
+	file = rspamd_rrd_create (path, ds->len, RSPAMD_RRD_RRA_COUNT,
 			1, rspamd_get_calendar_ticks (), err);
 
 	if (file == NULL) {
@@ -1290,32 +1422,15 @@ rspamd_rrd_create_file (const gchar *path, gboolean finalize, GError **err)
 	}
 
 	/* Create DS and RRA */
-
-	for (i = METRIC_ACTION_REJECT; i < METRIC_ACTION_MAX; i ++) {
-		rrd_make_default_ds (rspamd_action_to_str (i),
-				rrd_dst_to_string (RRD_DST_COUNTER), 1, &ds[i]);
-	}
-
-	ar.data = (gchar *)ds;
-	ar.len = sizeof (ds);
+	ar.data = ds->data;
+	ar.len = ds->len * sizeof (struct rrd_ds_def);
 
 	if (!rspamd_rrd_add_ds (file, &ar, err)) {
 		rspamd_rrd_close (file);
 		return NULL;
 	}
 
-	/* Once per minute for 1 day */
-	rrd_make_default_rra (rrd_cf_to_string (RRD_CF_AVERAGE),
-			60, 24 * 60, &rra[0]);
-	/* Once per 5 minutes for 1 week */
-	rrd_make_default_rra (rrd_cf_to_string (RRD_CF_AVERAGE),
-			5 * 60, 7 * 24 * 60 / 5, &rra[1]);
-	/* Once per 10 mins for 1 month */
-	rrd_make_default_rra (rrd_cf_to_string (RRD_CF_AVERAGE),
-			60 * 10, 30 * 24 * 6, &rra[2]);
-	/* Once per hour for 1 year */
-	rrd_make_default_rra (rrd_cf_to_string (RRD_CF_AVERAGE),
-			60 * 60, 365 * 24, &rra[3]);
+	rspamd_rrd_default_rra (rra);
 	ar.data = (gchar *)rra;
 	ar.len = sizeof (rra);
 
@@ -1332,42 +1447,163 @@ rspamd_rrd_create_file (const gchar *path, gboolean finalize, GError **err)
 	return file;
 }
 
+/*
+ * Returns index of the data source in the old file or -1 if it is absent
+ */
+static gint
+rspamd_rrd_find_ds (struct rspamd_rrd_file *old, GArray *ds, guint idx)
+{
+	struct rrd_ds_def *def = &g_array_index (ds, struct rrd_ds_def, idx);
+	guint i;
+
+	if (old->stat_head->ds_cnt == RSPAMD_RRD_OLD_DS_COUNT) {
+		/*
+		 * Old DSes:
+		 * 0 - spam -> reject
+		 * 1 - probable spam -> add header
+		 * 2 - greylist -> greylist
+		 * 3 - ham -> ham
+		 */
+		switch (idx) {
+		case METRIC_ACTION_REJECT:
+			return 0;
+		case METRIC_ACTION_ADD_HEADER:
+			return 1;
+		case METRIC_ACTION_GREYLIST:
+			return 2;
+		case METRIC_ACTION_NOACTION:
+			return 3;
+		default:
+			return -1;
+		}
+	}
+
+	for (i = 0; i < old->stat_head->ds_cnt; i ++) {
+		if (strcmp (old->ds_def[i].ds_nam, def->ds_nam) == 0 &&
+				strcmp (old->ds_def[i].dst, def->dst) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * Returns index of the same archive in the old file or -1 if it is absent
+ */
+static gint
+rspamd_rrd_find_rra (struct rspamd_rrd_file *old, struct rrd_rra_def *rra)
+{
+	guint i;
+
+	for (i = 0; i < old->stat_head->rra_cnt; i ++) {
+		if (old->rra_def[i].pdp_cnt == rra->pdp_cnt &&
+				old->rra_def[i].row_cnt == rra->row_cnt &&
+				strcmp (old->rra_def[i].cf_nam, rra->cf_nam) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+static gboolean
+rspamd_rrd_layout_matches (struct rspamd_rrd_file *file, GArray *ds)
+{
+	struct rrd_rra_def rra[RSPAMD_RRD_RRA_COUNT];
+	guint i;
+
+	if (file->stat_head->ds_cnt != ds->len ||
+			file->stat_head->rra_cnt != RSPAMD_RRD_RRA_COUNT) {
+		return FALSE;
+	}
+
+	for (i = 0; i < ds->len; i ++) {
+		if (rspamd_rrd_find_ds (file, ds, i) != (gint)i) {
+			return FALSE;
+		}
+	}
+
+	rspamd_rrd_default_rra (rra);
+
+	for (i = 0; i < RSPAMD_RRD_RRA_COUNT; i ++) {
+		if (rspamd_rrd_find_rra (file, &rra[i]) != (gint)i) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/*
+ * Copies data of all data sources and archives that exist in both files,
+ * new data sources and archives start empty
+ */
 static void
-rspamd_rrd_convert_ds (struct rspamd_rrd_file *old,
-		 struct rspamd_rrd_file *cur, gint idx_old, gint idx_new)
+rspamd_rrd_convert_data (struct rspamd_rrd_file *old,
+		struct rspamd_rrd_file *cur, GArray *ds)
 {
-	struct rrd_pdp_prep *pdp_prep_old, *pdp_prep_new;
-	struct rrd_cdp_prep *cdp_prep_old, *cdp_prep_new;
 	gdouble *val_old, *val_new;
-	gulong rra_cnt, i, j, points_cnt, old_ds, new_ds;
+	gulong j, points_cnt, old_ds, new_ds, *old_offsets;
+	gint *ds_map, old_rra;
+	guint i, k;
 
-	rra_cnt = old->stat_head->rra_cnt;
-	pdp_prep_old = &old->pdp_prep[idx_old];
-	pdp_prep_new = &cur->pdp_prep[idx_new];
-	memcpy (pdp_prep_new, pdp_prep_old, sizeof (*pdp_prep_new));
-	val_old = old->rrd_value;
-	val_new = cur->rrd_value;
 	old_ds = old->stat_head->ds_cnt;
 	new_ds = cur->stat_head->ds_cnt;
+	ds_map = g_malloc (sizeof (*ds_map) * new_ds);
+
+	for (k = 0; k < new_ds; k ++) {
+		ds_map[k] = rspamd_rrd_find_ds (old, ds, k);
+
+		if (ds_map[k] >= 0) {
+			memcpy (&cur->pdp_prep[k], &old->pdp_prep[ds_map[k]],
+					sizeof (cur->pdp_prep[k]));
+		}
+	}
+
+	/* Offsets of archives values in the old file */
+	old_offsets = g_malloc (sizeof (*old_offsets) * old->stat_head->rra_cnt);
+
+	for (i = 0, j = 0; i < old->stat_head->rra_cnt; i ++) {
+		old_offsets[i] = j;
+		j += old->rra_def[i].row_cnt * old_ds;
+	}
+
+	val_new = cur->rrd_value;
 
-	for (i = 0; i < rra_cnt; i++) {
-		cdp_prep_old = &old->cdp_prep[i * old_ds] + idx_old;
-		cdp_prep_new = &cur->cdp_prep[i * new_ds] + idx_new;
-		memcpy (cdp_prep_new, cdp_prep_old, sizeof (*cdp_prep_new));
-		points_cnt = old->rra_def[i].row_cnt;
+	for (i = 0; i < cur->stat_head->rra_cnt; i++) {
+		points_cnt = cur->rra_def[i].row_cnt;
+		old_rra = rspamd_rrd_find_rra (old, &cur->rra_def[i]);
 
-		for (j = 0; j < points_cnt; j ++) {
-			val_new[j * new_ds + idx_new] = val_old[j * old_ds + idx_old];
+		if (old_rra >= 0) {
+			cur->rra_ptr[i].cur_row = old->rra_ptr[old_rra].cur_row;
+			val_old = old->rrd_value + old_offsets[old_rra];
+
+			for (k = 0; k < new_ds; k ++) {
+				if (ds_map[k] < 0) {
+					continue;
+				}
+
+				memcpy (&cur->cdp_prep[i * new_ds + k],
+						&old->cdp_prep[old_rra * old_ds + ds_map[k]],
+						sizeof (struct rrd_cdp_prep));
+
+				for (j = 0; j < points_cnt; j ++) {
+					val_new[j * new_ds + k] = val_old[j * old_ds + ds_map[k]];
+				}
+			}
 		}
 
 		val_new += points_cnt * new_ds;
-		val_old += points_cnt * old_ds;
 	}
+
+	g_free (old_offsets);
+	g_free (ds_map);
 }
 
 static struct rspamd_rrd_file *
 rspamd_rrd_convert (const gchar *path, struct rspamd_rrd_file *old,
-		GError **err)
+		GArray *ds, GError **err)
 {
 	struct rspamd_rrd_file *rrd;
 	gchar tpath[PATH_MAX];
@@ -1375,25 +1611,12 @@ rspamd_rrd_convert (const gchar *path, struct rspamd_rrd_file *old,
 	g_assert (old != NULL);
 
 	rspamd_snprintf (tpath, sizeof (tpath), "%s.new", path);
-	rrd = rspamd_rrd_create_file (tpath, TRUE, err);
+	rrd = rspamd_rrd_create_file (tpath, ds, TRUE, err);
 
 	if (rrd) {
 		/* Copy old data */
 		memcpy (rrd->live_head, old->live_head, sizeof (*rrd->live_head));
-		memcpy (rrd->rra_ptr, old->rra_ptr,
-				sizeof (*old->rra_ptr) * rrd->stat_head->rra_cnt);
-
-		/*
-		 * Old DSes:
-		 * 0 - spam -> reject
-		 * 1 - probable spam -> add header
-		 * 2 - greylist -> greylist
-		 * 3 - ham -> ham
-		 */
-		rspamd_rrd_convert_ds (old, rrd, 0, METRIC_ACTION_REJECT);
-		rspamd_rrd_convert_ds (old, rrd, 1, METRIC_ACTION_ADD_HEADER);
-		rspamd_rrd_convert_ds (old, rrd, 2, METRIC_ACTION_GREYLIST);
-		rspamd_rrd_convert_ds (old, rrd, 3, METRIC_ACTION_NOACTION);
+		rspamd_rrd_convert_data (old, rrd, ds);
 
 		if (unlink (path) == -1) {
 			g_set_error (err, rrd_error_quark (), errno, "cannot unlink old rrd file %s: %s",
@@ -1420,54 +1643,53 @@ rspamd_rrd_convert (const gchar *path, struct rspamd_rrd_file *old,
 struct rspamd_rrd_file *
 rspamd_rrd_file_default (const gchar *path,
 		GError **err)
+{
+	return rspamd_rrd_file_default_ds (path, NULL, err);
+}
+
+struct rspamd_rrd_file *
+rspamd_rrd_file_default_ds (const gchar *path,
+		GArray *extra_ds,
+		GError **err)
 {
 	struct rspamd_rrd_file *file, *nf;
+	GArray *ds;
 
 	g_assert (path != NULL);
 
+	ds = rspamd_rrd_default_ds (extra_ds);
+
 	if (access (path, R_OK) != -1) {
 		/* We can open rrd file */
 		file = rspamd_rrd_open (path, err);
 
 		if (file == NULL) {
-			return NULL;
-		}
-
-
-		if (file->stat_head->rra_cnt != RSPAMD_RRD_RRA_COUNT) {
-			msg_err_rrd ("rrd file is not suitable for rspamd: it has "
-					"%ul ds and %ul rra", file->stat_head->ds_cnt,
-					file->stat_head->rra_cnt);
-			g_set_error (err, rrd_error_quark (), EINVAL, "bad rrd file");
-			rspamd_rrd_close (file);
+			g_array_free (ds, TRUE);
 
 			return NULL;
 		}
-		else if (file->stat_head->ds_cnt == RSPAMD_RRD_OLD_DS_COUNT) {
-			/* Old rrd, need to convert */
-			msg_info_rrd ("rrd file %s is not suitable for rspamd, convert it",
-					path);
 
-			nf = rspamd_rrd_convert (path, file, err);
-			rspamd_rrd_close (file);
+		if (rspamd_rrd_layout_matches (file, ds)) {
+			g_array_free (ds, TRUE);
 
-			return nf;
-		}
-		else if (file->stat_head->ds_cnt == RSPAMD_RRD_DS_COUNT) {
 			return file;
 		}
-		else {
-			msg_err_rrd ("rrd file is not suitable for rspamd: it has "
-					"%ul ds and %ul rra", file->stat_head->ds_cnt,
-					file->stat_head->rra_cnt);
-			g_set_error (err, rrd_error_quark (), EINVAL, "bad rrd file");
-			rspamd_rrd_close (file);
 
-			return NULL;
-		}
+		/* Archives or data sources have been changed, need to convert */
+		msg_info_rrd ("rrd file %s has %ul ds and %ul rra, convert it to "
+				"%ud ds and %d rra",
+				path, file->stat_head->ds_cnt, file->stat_head->rra_cnt,
+				ds->len, RSPAMD_RRD_RRA_COUNT);
+
+		nf = rspamd_rrd_convert (path, file, ds, err);
+		rspamd_rrd_close (file);
+		g_array_free (ds, TRUE);
+
+		return nf;
 	}
 
-	file = rspamd_rrd_create_file (path, TRUE, err);
+	file = rspamd_rrd_create_file (path, ds, TRUE, err);
+	g_array_free (ds, TRUE);
 
 	return file;
 }
@@ -1475,16 +1697,26 @@ rspamd_rrd_file_default (const gchar *path,
 struct rspamd_rrd_query_result *
 rspamd_rrd_query (struct rspamd_rrd_file *file,
 		gulong rra_num)
+{
+	return rspamd_rrd_query_window (file, rra_num, 0, 0);
+}
+
+struct rspamd_rrd_query_result *
+rspamd_rrd_query_window (struct rspamd_rrd_file *file,
+		gulong rra_num,
+		gdouble from,
+		gdouble to)
 {
 	struct rspamd_rrd_query_result *res;
 	struct rrd_rra_def *rra;
 	const gdouble *rra_offset = NULL;
+	gulong skip, last_cdp;
 	guint i;
 
 	g_assert (file != NULL);
 
 
-	if (rra_num > file->stat_head->rra_cnt) {
+	if (rra_num >= file->stat_head->rra_cnt) {
 		msg_err_rrd ("requested unexisting rra: %l", rra_num);
 
 		return NULL;
@@ -1511,5 +1743,30 @@ rspamd_rrd_query (struct rspamd_rrd_file *file,
 
 	res->data = rra_offset;
 
+	/* The oldest row follows the current one */
+	res->first_row = (res->cur_row + 1) % res->rra_rows;
+	res->rows = res->rra_rows;
+	res->first_cdp = (gulong)(res->last_update / res->pdp_per_cdp) -
+			res->rra_rows;
+
+	if (from > 0 && (gulong)(from / res->pdp_per_cdp) > res->first_cdp) {
+		skip = MIN ((gulong)(from / res->pdp_per_cdp) - res->first_cdp,
+				res->rows);
+		res->first_row = (res->first_row + skip) % res->rra_rows;
+		res->first_cdp += skip;
+		res->rows -= skip;
+	}
+
+	if (to > 0 && res->rows > 0) {
+		last_cdp = to / res->pdp_per_cdp;
+
+		if (last_cdp < res->first_cdp) {
+			res->rows = 0;
+		}
+		else if (last_cdp - res->first_cdp + 1 < res->rows) {
+			res->rows = last_cdp - res->first_cdp + 1;
+		}
+	}
+
 	return res;
 }
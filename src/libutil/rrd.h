@@ -205,6 +205,7 @@ struct rspamd_rrd_file {
 	gboolean finalized;
 	gchar *id;
 	gint fd;
+	GArray *pending; /* rows queued by rspamd_rrd_queue_record */
 };
 
 
@@ -276,6 +277,27 @@ gboolean rspamd_rrd_add_record (struct rspamd_rrd_file *file,
 		gdouble ticks,
 		GError **err);
 
+/**
+ * Queue record to be written to rrd file by the next `rspamd_rrd_flush`
+ * @param file rrd file object
+ * @param points points (must be row suitable for this RRA, depending on ds count)
+ * @param ticks time of the record
+ * @param err error pointer
+ * @return TRUE if a row has been queued
+ */
+gboolean rspamd_rrd_queue_record (struct rspamd_rrd_file *file,
+		GArray *points,
+		gdouble ticks,
+		GError **err);
+
+/**
+ * Write all queued records to rrd file and sync it once
+ * @param file rrd file object
+ * @param err error pointer
+ * @return TRUE if all rows have been written
+ */
+gboolean rspamd_rrd_flush (struct rspamd_rrd_file *file, GError **err);
+
 /**
  * Close rrd file
  * @param file
@@ -328,6 +350,18 @@ void rrd_make_default_ds (const gchar *name,
 struct rspamd_rrd_file *rspamd_rrd_file_default (const gchar *path,
 		GError **err);
 
+/**
+ * Open or create the default rspamd rrd file with extra data sources after
+ * the actions counters, an existing file is converted if its data sources
+ * or archives differ
+ * @param path
+ * @param extra_ds array of struct rrd_ds_def, can be NULL
+ * @param err
+ */
+struct rspamd_rrd_file *rspamd_rrd_file_default_ds (const gchar *path,
+		GArray *extra_ds,
+		GError **err);
+
 /**
  * Returned by querying rrd database
  */
@@ -338,6 +372,9 @@ struct rspamd_rrd_query_result {
 	gdouble last_update;
 	gulong cur_row;
 	const gdouble *data;
+	gulong first_row; /* the oldest row of the requested window */
+	gulong rows; /* number of rows in the requested window */
+	gulong first_cdp; /* time of the first row divided by pdp_per_cdp */
 };
 
 /**
@@ -348,4 +385,18 @@ struct rspamd_rrd_query_result {
  */
 struct rspamd_rrd_query_result * rspamd_rrd_query (struct rspamd_rrd_file *file,
 	gulong rra_num);
+
+/**
+ * Return RRA data limited to the specified time window
+ * @param file rrd file
+ * @param rra_num number of rra to return data for
+ * @param from start of the window, 0 for the oldest row
+ * @param to end of the window, 0 for the latest row
+ * @return query result structure, that should be freed (using g_free) after usage
+ */
+struct rspamd_rrd_query_result * rspamd_rrd_query_window (
+	struct rspamd_rrd_file *file,
+	gulong rra_num,
+	gdouble from,
+	gdouble to);
 #endif /* RRD_H_ */
@@ -0,0 +1,617 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "shared_cache.h"
+#include "cryptobox.h"
+#include "util.h"
+#include "unix-std.h"
+
+/* Number of elements in a set */
+#define RSPAMD_SHARED_CACHE_WAYS 8
+/* Number of independently locked shards */
+#define RSPAMD_SHARED_CACHE_SHARDS 16
+/* Hash seed must be the same in all processes */
+#define RSPAMD_SHARED_CACHE_SEED 0xb1a5c0debeefULL
+
+struct rspamd_shared_cache_slot {
+	guint64 hash;
+	guint64 atime;                  /* logical time of the last access in shard */
+	gint64 expire;                  /* 0 means no expiration */
+	guint32 value_len;
+	guint16 keylen;                 /* 0 means empty slot */
+	gchar key[RSPAMD_SHARED_CACHE_KEY_LEN + 1];
+	/* Value follows */
+};
+
+struct rspamd_shared_cache_shard {
+	rspamd_mempool_mutex_t *lock;
+	guint64 clock;
+	struct rspamd_shared_cache_stat stat;
+};
+
+struct rspamd_shared_cache_s {
+	const gchar *name;
+	guchar *slots;
+	struct rspamd_shared_cache_shard *shards;
+	guint64 *local_hits;
+	gsize slot_len;
+	gsize value_len;
+	guint nsets;
+};
+
+/* Caches of this process for statistics */
+static GPtrArray *shared_caches = NULL;
+
+/*
+ * Snapshot consists of the header followed by sections of caches: a name
+ * prefixed by its guint16 length and records terminated by a record with
+ * zero key length. Snapshots are host specific, so native byte order is used.
+ */
+static const guchar rspamd_shared_cache_magic[8] = {
+		'r', 's', 'c', 'a', 'c', 'h', 'e', '1'
+};
+
+RSPAMD_PACKED(rspamd_shared_cache_rec) {
+	gint64 expire;
+	guint32 value_len;
+	guint16 keylen;
+	/* Key and value follow */
+};
+
+/* Data is written when buffer is larger than this */
+#define RSPAMD_SHARED_CACHE_SNAPSHOT_BUF (64 * 1024)
+
+static GQuark
+rspamd_shared_cache_quark (void)
+{
+	return g_quark_from_static_string ("shared-cache");
+}
+
+static void
+rspamd_shared_cache_dtor (gpointer p)
+{
+	rspamd_shared_cache_t *cache = p;
+
+	if (shared_caches) {
+		g_ptr_array_remove_fast (shared_caches, cache);
+	}
+}
+
+rspamd_shared_cache_t *
+rspamd_shared_cache_new (rspamd_mempool_t *pool,
+		const gchar *name,
+		guint nelts,
+		gsize value_len)
+{
+	rspamd_shared_cache_t *cache;
+	guint i;
+
+	g_assert (pool != NULL);
+	g_assert (value_len > 0 && value_len <= G_MAXUINT32);
+
+	cache = rspamd_mempool_alloc0 (pool, sizeof (*cache));
+	cache->name = rspamd_mempool_strdup (pool, name);
+	cache->value_len = value_len;
+	cache->slot_len = sizeof (struct rspamd_shared_cache_slot) + value_len;
+	cache->slot_len += (MEM_ALIGNMENT - cache->slot_len % MEM_ALIGNMENT) %
+			MEM_ALIGNMENT;
+	cache->nsets = MAX (nelts / RSPAMD_SHARED_CACHE_WAYS, 1);
+	/* Allocated in shared memory, so workers forked later share data */
+	cache->slots = rspamd_mempool_alloc0_shared (pool,
+			cache->slot_len * cache->nsets * RSPAMD_SHARED_CACHE_WAYS);
+	cache->shards = rspamd_mempool_alloc0_shared (pool,
+			sizeof (*cache->shards) * RSPAMD_SHARED_CACHE_SHARDS);
+	cache->local_hits = rspamd_mempool_alloc0_shared (pool,
+			sizeof (*cache->local_hits));
+
+	for (i = 0; i < RSPAMD_SHARED_CACHE_SHARDS; i ++) {
+		cache->shards[i].lock = rspamd_mempool_get_mutex (pool);
+	}
+
+	if (shared_caches == NULL) {
+		shared_caches = g_ptr_array_new ();
+	}
+
+	g_ptr_array_add (shared_caches, cache);
+	rspamd_mempool_add_destructor (pool, rspamd_shared_cache_dtor, cache);
+
+	return cache;
+}
+
+static inline struct rspamd_shared_cache_slot *
+rspamd_shared_cache_get_slot (rspamd_shared_cache_t *cache, guint set, guint i)
+{
+	return (struct rspamd_shared_cache_slot *)(cache->slots +
+			(set * RSPAMD_SHARED_CACHE_WAYS + i) * cache->slot_len);
+}
+
+gboolean
+rspamd_shared_cache_lookup (rspamd_shared_cache_t *cache,
+		const gchar *key, gsize keylen,
+		time_t now,
+		gpointer value, gsize *value_len,
+		guint *ttl)
+{
+	struct rspamd_shared_cache_slot *slot;
+	struct rspamd_shared_cache_shard *shard;
+	guint64 h;
+	guint set, i;
+	gboolean ret = FALSE;
+
+	if (keylen == 0 || keylen > RSPAMD_SHARED_CACHE_KEY_LEN) {
+		return FALSE;
+	}
+
+	h = rspamd_cryptobox_fast_hash (key, keylen, RSPAMD_SHARED_CACHE_SEED);
+	set = h % cache->nsets;
+	shard = &cache->shards[set % RSPAMD_SHARED_CACHE_SHARDS];
+
+	rspamd_mempool_lock_mutex (shard->lock);
+
+	for (i = 0; i < RSPAMD_SHARED_CACHE_WAYS; i ++) {
+		slot = rspamd_shared_cache_get_slot (cache, set, i);
+
+		if (slot->keylen != keylen || slot->hash != h ||
+				memcmp (slot->key, key, keylen) != 0) {
+			continue;
+		}
+
+		if (slot->expire != 0 && slot->expire <= now) {
+			/* Free expired slot */
+			slot->keylen = 0;
+		}
+		else if (slot->value_len <= *value_len) {
+			memcpy (value, ((guchar *)slot) + sizeof (*slot), slot->value_len);
+			*value_len = slot->value_len;
+
+			if (ttl) {
+				*ttl = slot->expire != 0 ? slot->expire - now : 0;
+			}
+
+			slot->atime = ++shard->clock;
+			ret = TRUE;
+		}
+
+		break;
+	}
+
+	if (ret) {
+		shard->stat.hits ++;
+	}
+	else {
+		shard->stat.misses ++;
+	}
+
+	rspamd_mempool_unlock_mutex (shard->lock);
+
+	return ret;
+}
+
+gboolean
+rspamd_shared_cache_insert (rspamd_shared_cache_t *cache,
+		const gchar *key, gsize keylen,
+		gconstpointer value, gsize value_len,
+		time_t now, guint ttl)
+{
+	struct rspamd_shared_cache_slot *slot, *victim = NULL, *unused = NULL,
+			*lru = NULL;
+	struct rspamd_shared_cache_shard *shard;
+	guint64 h;
+	guint set, i;
+
+	if (keylen == 0 || keylen > RSPAMD_SHARED_CACHE_KEY_LEN ||
+			value_len > cache->value_len) {
+		return FALSE;
+	}
+
+	h = rspamd_cryptobox_fast_hash (key, keylen, RSPAMD_SHARED_CACHE_SEED);
+	set = h % cache->nsets;
+	shard = &cache->shards[set % RSPAMD_SHARED_CACHE_SHARDS];
+
+	rspamd_mempool_lock_mutex (shard->lock);
+
+	for (i = 0; i < RSPAMD_SHARED_CACHE_WAYS; i ++) {
+		slot = rspamd_shared_cache_get_slot (cache, set, i);
+
+		if (slot->keylen == keylen && slot->hash == h &&
+				memcmp (slot->key, key, keylen) == 0) {
+			/* Replace value of the same key */
+			victim = slot;
+			break;
+		}
+
+		if (slot->keylen == 0 ||
+				(slot->expire != 0 && slot->expire <= now)) {
+			/* Continue to search for the same key */
+			if (unused == NULL) {
+				unused = slot;
+			}
+		}
+		else if (lru == NULL || slot->atime < lru->atime) {
+			lru = slot;
+		}
+	}
+
+	if (victim == NULL) {
+		if (unused != NULL) {
+			victim = unused;
+		}
+		else {
+			victim = lru;
+			shard->stat.evictions ++;
+		}
+	}
+
+	victim->hash = h;
+	victim->atime = ++shard->clock;
+	victim->expire = ttl != 0 ? now + ttl : 0;
+	victim->value_len = value_len;
+	victim->keylen = keylen;
+	memcpy (victim->key, key, keylen);
+	victim->key[keylen] = '\0';
+	memcpy (((guchar *)victim) + sizeof (*victim), value, value_len);
+	shard->stat.stores ++;
+
+	rspamd_mempool_unlock_mutex (shard->lock);
+
+	return TRUE;
+}
+
+void
+rspamd_shared_cache_local_hit (rspamd_shared_cache_t *cache)
+{
+#ifndef HAVE_ATOMIC_BUILTINS
+	(*cache->local_hits) ++;
+#else
+	__atomic_add_fetch (cache->local_hits, 1, __ATOMIC_RELEASE);
+#endif
+}
+
+void
+rspamd_shared_cache_get_stat (rspamd_shared_cache_t *cache,
+		struct rspamd_shared_cache_stat *st, gboolean reset)
+{
+	struct rspamd_shared_cache_shard *shard;
+	guint i;
+
+	memset (st, 0, sizeof (*st));
+
+	for (i = 0; i < RSPAMD_SHARED_CACHE_SHARDS; i ++) {
+		shard = &cache->shards[i];
+		rspamd_mempool_lock_mutex (shard->lock);
+		st->hits += shard->stat.hits;
+		st->misses += shard->stat.misses;
+		st->stores += shard->stat.stores;
+		st->evictions += shard->stat.evictions;
+
+		if (reset) {
+			memset (&shard->stat, 0, sizeof (shard->stat));
+		}
+
+		rspamd_mempool_unlock_mutex (shard->lock);
+	}
+
+#ifndef HAVE_ATOMIC_BUILTINS
+	st->local_hits = *cache->local_hits;
+
+	if (reset) {
+		*cache->local_hits = 0;
+	}
+#else
+	if (reset) {
+		st->local_hits = __atomic_exchange_n (cache->local_hits, 0,
+				__ATOMIC_ACQ_REL);
+	}
+	else {
+		st->local_hits = __atomic_load_n (cache->local_hits, __ATOMIC_ACQUIRE);
+	}
+#endif
+}
+
+gsize
+rspamd_shared_cache_value_len (rspamd_shared_cache_t *cache)
+{
+	return cache->value_len;
+}
+
+ucl_object_t *
+rspamd_shared_caches_stat (gboolean reset)
+{
+	ucl_object_t *top, *obj;
+	rspamd_shared_cache_t *cache;
+	struct rspamd_shared_cache_stat st;
+	guint i;
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+
+	if (shared_caches == NULL) {
+		return top;
+	}
+
+	PTR_ARRAY_FOREACH (shared_caches, i, cache) {
+		rspamd_shared_cache_get_stat (cache, &st, reset);
+		obj = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (obj,
+				ucl_object_fromint (cache->nsets * RSPAMD_SHARED_CACHE_WAYS),
+				"size", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (st.hits),
+				"hits", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (st.misses),
+				"misses", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (st.stores),
+				"stores", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (st.evictions),
+				"evictions", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (st.local_hits),
+				"local_hits", 0, false);
+		ucl_object_insert_key (top, obj, cache->name, 0, true);
+	}
+
+	return top;
+}
+
+static gboolean
+rspamd_shared_cache_flush_buf (gint fd, GByteArray *buf)
+{
+	if (buf->len > 0) {
+		if (write (fd, buf->data, buf->len) != (gssize)buf->len) {
+			return FALSE;
+		}
+
+		g_byte_array_set_size (buf, 0);
+	}
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_shared_cache_save_one (rspamd_shared_cache_t *cache, gint fd,
+		GByteArray *buf, time_t now)
+{
+	struct rspamd_shared_cache_slot *slot;
+	struct rspamd_shared_cache_shard *shard;
+	struct rspamd_shared_cache_rec rec;
+	guint16 namelen;
+	guint set, i;
+
+	namelen = strlen (cache->name);
+	g_byte_array_append (buf, (const guint8 *)&namelen, sizeof (namelen));
+	g_byte_array_append (buf, (const guint8 *)cache->name, namelen);
+
+	for (set = 0; set < cache->nsets; set ++) {
+		shard = &cache->shards[set % RSPAMD_SHARED_CACHE_SHARDS];
+		rspamd_mempool_lock_mutex (shard->lock);
+
+		for (i = 0; i < RSPAMD_SHARED_CACHE_WAYS; i ++) {
+			slot = rspamd_shared_cache_get_slot (cache, set, i);
+
+			if (slot->keylen == 0 ||
+					(slot->expire != 0 && slot->expire <= now)) {
+				continue;
+			}
+
+			rec.expire = slot->expire;
+			rec.value_len = slot->value_len;
+			rec.keylen = slot->keylen;
+			g_byte_array_append (buf, (const guint8 *)&rec, sizeof (rec));
+			g_byte_array_append (buf, (const guint8 *)slot->key, slot->keylen);
+			g_byte_array_append (buf, ((const guint8 *)slot) + sizeof (*slot),
+					slot->value_len);
+		}
+
+		rspamd_mempool_unlock_mutex (shard->lock);
+
+		if (buf->len >= RSPAMD_SHARED_CACHE_SNAPSHOT_BUF &&
+				!rspamd_shared_cache_flush_buf (fd, buf)) {
+			return FALSE;
+		}
+	}
+
+	memset (&rec, 0, sizeof (rec));
+	g_byte_array_append (buf, (const guint8 *)&rec, sizeof (rec));
+
+	return TRUE;
+}
+
+gboolean
+rspamd_shared_caches_save (const gchar *path, time_t now, GError **err)
+{
+	rspamd_shared_cache_t *cache;
+	GByteArray *buf;
+	gchar tmp_path[PATH_MAX];
+	gboolean ret = TRUE;
+	guint i;
+	gint fd;
+
+	rspamd_snprintf (tmp_path, sizeof (tmp_path), "%s.new", path);
+	fd = open (tmp_path, O_CREAT | O_WRONLY | O_TRUNC, 00644);
+
+	if (fd == -1) {
+		g_set_error (err, rspamd_shared_cache_quark (), errno,
+				"cannot open %s: %s", tmp_path, strerror (errno));
+
+		return FALSE;
+	}
+
+	buf = g_byte_array_sized_new (RSPAMD_SHARED_CACHE_SNAPSHOT_BUF);
+	g_byte_array_append (buf, rspamd_shared_cache_magic,
+			sizeof (rspamd_shared_cache_magic));
+
+	if (shared_caches != NULL) {
+		PTR_ARRAY_FOREACH (shared_caches, i, cache) {
+			if (!rspamd_shared_cache_save_one (cache, fd, buf, now)) {
+				ret = FALSE;
+				break;
+			}
+		}
+	}
+
+	if (ret) {
+		ret = rspamd_shared_cache_flush_buf (fd, buf);
+	}
+
+	g_byte_array_free (buf, TRUE);
+
+	if (!ret) {
+		g_set_error (err, rspamd_shared_cache_quark (), errno,
+				"cannot write %s: %s", tmp_path, strerror (errno));
+		close (fd);
+		(void)unlink (tmp_path);
+
+		return FALSE;
+	}
+
+	close (fd);
+
+	if (rename (tmp_path, path) == -1) {
+		g_set_error (err, rspamd_shared_cache_quark (), errno,
+				"cannot rename %s -> %s: %s", tmp_path, path, strerror (errno));
+		(void)unlink (tmp_path);
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static rspamd_shared_cache_t *
+rspamd_shared_cache_find (const gchar *name, gsize namelen)
+{
+	rspamd_shared_cache_t *cache;
+	guint i;
+
+	if (shared_caches == NULL) {
+		return NULL;
+	}
+
+	PTR_ARRAY_FOREACH (shared_caches, i, cache) {
+		if (strlen (cache->name) == namelen &&
+				memcmp (cache->name, name, namelen) == 0) {
+			return cache;
+		}
+	}
+
+	return NULL;
+}
+
+gint
+rspamd_shared_caches_load (const gchar *path, time_t now, GError **err)
+{
+	rspamd_shared_cache_t *cache;
+	struct rspamd_shared_cache_rec rec;
+	struct stat st;
+	const guchar *p, *end;
+	guint16 namelen;
+	gpointer map;
+	gint fd, nloaded = 0;
+
+	fd = open (path, O_RDONLY);
+
+	if (fd == -1) {
+		g_set_error (err, rspamd_shared_cache_quark (), errno,
+				"cannot open %s: %s", path, strerror (errno));
+
+		return -1;
+	}
+
+	if (fstat (fd, &st) == -1 ||
+			st.st_size < (goffset)sizeof (rspamd_shared_cache_magic)) {
+		g_set_error (err, rspamd_shared_cache_quark (), EINVAL,
+				"cannot use %s: truncated file", path);
+		close (fd);
+
+		return -1;
+	}
+
+	map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+
+	if (map == MAP_FAILED) {
+		g_set_error (err, rspamd_shared_cache_quark (), errno,
+				"cannot mmap %s: %s", path, strerror (errno));
+
+		return -1;
+	}
+
+	p = map;
+	end = p + st.st_size;
+
+	if (memcmp (p, rspamd_shared_cache_magic,
+			sizeof (rspamd_shared_cache_magic)) != 0) {
+		g_set_error (err, rspamd_shared_cache_quark (), EINVAL,
+				"cannot use %s: bad magic", path);
+		munmap (map, st.st_size);
+
+		return -1;
+	}
+
+	p += sizeof (rspamd_shared_cache_magic);
+
+	while (p < end) {
+		if (end - p < (gssize)sizeof (namelen)) {
+			goto err;
+		}
+
+		memcpy (&namelen, p, sizeof (namelen));
+		p += sizeof (namelen);
+
+		if (end - p < namelen) {
+			goto err;
+		}
+
+		/* Sections of caches that are not configured now are skipped */
+		cache = rspamd_shared_cache_find ((const gchar *)p, namelen);
+		p += namelen;
+
+		for (;;) {
+			if (end - p < (gssize)sizeof (rec)) {
+				goto err;
+			}
+
+			memcpy (&rec, p, sizeof (rec));
+			p += sizeof (rec);
+
+			if (rec.keylen == 0) {
+				break;
+			}
+
+			if ((gsize)(end - p) < (gsize)rec.keylen + rec.value_len) {
+				goto err;
+			}
+
+			if (cache != NULL && (rec.expire == 0 || rec.expire > now)) {
+				if (rspamd_shared_cache_insert (cache, (const gchar *)p,
+						rec.keylen, p + rec.keylen, rec.value_len, now,
+						rec.expire != 0 ? rec.expire - now : 0)) {
+					nloaded ++;
+				}
+			}
+
+			p += rec.keylen + rec.value_len;
+		}
+	}
+
+	munmap (map, st.st_size);
+
+	return nloaded;
+
+err:
+	g_set_error (err, rspamd_shared_cache_quark (), EINVAL,
+			"cannot use %s: truncated file", path);
+	munmap (map, st.st_size);
+
+	return -1;
+}
@@ -0,0 +1,142 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef RSPAMD_SHARED_CACHE_H
+#define RSPAMD_SHARED_CACHE_H
+
+#include "config.h"
+#include "mem_pool.h"
+#include "ucl.h"
+
+/*
+ * Cache of short binary values with fixed size slots placed in shared memory.
+ * When created before workers are forked, it is common for all of them.
+ * Slots are grouped in sets of a few elements with LRU replacement, sets are
+ * spread over several shards each protected by its own lock.
+ */
+
+/* Maximum length of a key */
+#define RSPAMD_SHARED_CACHE_KEY_LEN 255
+
+struct rspamd_shared_cache_s;
+typedef struct rspamd_shared_cache_s rspamd_shared_cache_t;
+
+struct rspamd_shared_cache_stat {
+	guint64 hits;
+	guint64 misses;
+	guint64 stores;
+	guint64 evictions;
+	guint64 local_hits; /* Lookups served by per worker caches in front */
+};
+
+/**
+ * Create new shared cache, all memory is allocated from the shared memory
+ * of pool and the cache is released with the pool
+ * @param pool memory pool that outlives the cache (e.g. cfg pool)
+ * @param name name of cache for statistics
+ * @param nelts number of elements
+ * @param value_len maximum length of a value
+ * @return new cache
+ */
+rspamd_shared_cache_t * rspamd_shared_cache_new (rspamd_mempool_t *pool,
+		const gchar *name,
+		guint nelts,
+		gsize value_len);
+
+/**
+ * Find value in cache and copy it to the buffer
+ * @param cache cache object
+ * @param key key
+ * @param keylen length of key
+ * @param now current time
+ * @param value output buffer
+ * @param value_len length of buffer, set to length of value if found
+ * @param ttl if not NULL set to the remaining time to live of value
+ * @return TRUE if value has been found and copied
+ */
+gboolean rspamd_shared_cache_lookup (rspamd_shared_cache_t *cache,
+		const gchar *key, gsize keylen,
+		time_t now,
+		gpointer value, gsize *value_len,
+		guint *ttl);
+
+/**
+ * Insert or replace value in cache
+ * @param cache cache object
+ * @param key key
+ * @param keylen length of key
+ * @param value value to store
+ * @param value_len length of value
+ * @param now current time
+ * @param ttl time to live of value (0 means no expiration)
+ * @return TRUE if value has been stored (too large values are not)
+ */
+gboolean rspamd_shared_cache_insert (rspamd_shared_cache_t *cache,
+		const gchar *key, gsize keylen,
+		gconstpointer value, gsize value_len,
+		time_t now, guint ttl);
+
+/**
+ * Account a lookup served by a per worker cache placed in front of this one,
+ * so statistics show the total hit rate of both levels
+ * @param cache cache object
+ */
+void rspamd_shared_cache_local_hit (rspamd_shared_cache_t *cache);
+
+/**
+ * Get statistics of cache summed over all shards
+ * @param cache cache object
+ * @param st output statistics
+ * @param reset reset counters after reading
+ */
+void rspamd_shared_cache_get_stat (rspamd_shared_cache_t *cache,
+		struct rspamd_shared_cache_stat *st, gboolean reset);
+
+/**
+ * Get maximum length of values in cache
+ */
+gsize rspamd_shared_cache_value_len (rspamd_shared_cache_t *cache);
+
+/**
+ * Get statistics of all shared caches of this process as ucl object
+ * @param reset reset counters after reading
+ * @return object indexed by names of caches
+ */
+ucl_object_t * rspamd_shared_caches_stat (gboolean reset);
+
+/**
+ * Dump live elements of all shared caches of this process to a file, so
+ * they can be preloaded after restart. The file is written atomically.
+ * @param path path of snapshot
+ * @param now current time
+ * @param err error
+ * @return TRUE if snapshot has been written
+ */
+gboolean rspamd_shared_caches_save (const gchar *path, time_t now,
+		GError **err);
+
+/**
+ * Load elements from a snapshot into the shared caches with the same names,
+ * elements keep their absolute expiration time so the time elapsed since
+ * the snapshot has been written is accounted
+ * @param path path of snapshot
+ * @param now current time
+ * @param err error
+ * @return number of loaded elements or -1 on error
+ */
+gint rspamd_shared_caches_load (const gchar *path, time_t now,
+		GError **err);
+
+#endif
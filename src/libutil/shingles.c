@@ -111,6 +111,36 @@ rspamd_shingles_get_keys_cached (const guchar key[SHINGLES_KEY_SIZE])
 	return keys;
 }
 
+/*
+ * Lane-wise minimum of two vectors of shingle hashes, written without
+ * branches so that compiler can vectorise it
+ */
+static inline void
+rspamd_shingles_min_lanes (guint64 *minimals, const guint64 *vals)
+{
+	guint i;
+
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+		minimals[i] = vals[i] < minimals[i] ? vals[i] : minimals[i];
+	}
+}
+
+static inline void
+rspamd_shingles_store_lanes (guint64 **hashes, guint64 *minimals,
+		const guint64 *vals, gsize pos, gboolean fused)
+{
+	guint i;
+
+	if (fused) {
+		rspamd_shingles_min_lanes (minimals, vals);
+	}
+	else {
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			hashes[i][pos] = vals[i];
+		}
+	}
+}
+
 struct rspamd_shingle* RSPAMD_OPTIMIZE("unroll-loops")
 rspamd_shingles_from_text (GArray *input,
 		const guchar key[16],
@@ -120,14 +150,19 @@ rspamd_shingles_from_text (GArray *input,
 		enum rspamd_shingle_alg alg)
 {
 	struct rspamd_shingle *res;
-	guint64 **hashes;
+	guint64 **hashes = NULL;
 	guchar **keys;
 	rspamd_fstring_t *row;
 	rspamd_stat_token_t *word;
-	guint64 val;
+	guint64 val, vals[RSPAMD_SHINGLE_SIZE], minimals[RSPAMD_SHINGLE_SIZE];
 	gint i, j, k;
 	gsize hlen, beg = 0;
 	enum rspamd_cryptobox_fast_hash_type ht;
+	/*
+	 * Default filter takes minimal hash, so we can keep running minimums
+	 * instead of storing all hashes for each shingle
+	 */
+	gboolean fused = (filter == rspamd_shingles_default_filter);
 
 	if (pool != NULL) {
 		res = rspamd_mempool_alloc (pool, sizeof (*res));
@@ -139,13 +174,21 @@ rspamd_shingles_from_text (GArray *input,
 	row = rspamd_fstring_sized_new (256);
 
 	/* Init hashes pipes and keys */
-	hashes = g_malloc (sizeof (*hashes) * RSPAMD_SHINGLE_SIZE);
 	hlen = input->len > SHINGLES_WINDOW ?
 			(input->len - SHINGLES_WINDOW + 1) : 1;
 	keys = rspamd_shingles_get_keys_cached (key);
 
-	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
-		hashes[i] = g_malloc (hlen * sizeof (guint64));
+	if (fused) {
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			minimals[i] = G_MAXUINT64;
+		}
+	}
+	else {
+		hashes = g_malloc (sizeof (*hashes) * RSPAMD_SHINGLE_SIZE);
+
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			hashes[i] = g_malloc (hlen * sizeof (guint64));
+		}
 	}
 
 	/* Now parse input words into a vector of hashes using rolling window */
@@ -161,10 +204,11 @@ rspamd_shingles_from_text (GArray *input,
 				for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
 					rspamd_cryptobox_siphash ((guchar *)&val, row->str, row->len,
 							keys[j]);
-					g_assert (hlen > beg);
-					hashes[j][beg] = val;
+					vals[j] = val;
 				}
 
+				g_assert (hlen > beg);
+				rspamd_shingles_store_lanes (hashes, minimals, vals, beg, fused);
 				beg++;
 
 				row = rspamd_fstring_assign (row, "", 0);
@@ -172,7 +216,10 @@ rspamd_shingles_from_text (GArray *input,
 		}
 	}
 	else {
-		guint64 res[SHINGLES_WINDOW * RSPAMD_SHINGLE_SIZE], seed;
+		guint64 res[SHINGLES_WINDOW * RSPAMD_SHINGLE_SIZE],
+				seeds[RSPAMD_SHINGLE_SIZE], whashes[RSPAMD_SHINGLE_SIZE];
+		const void *wdata[RSPAMD_SHINGLE_SIZE];
+		gsize wlens[RSPAMD_SHINGLE_SIZE];
 
 		switch (alg) {
 		case RSPAMD_SHINGLES_XXHASH:
@@ -186,9 +233,23 @@ rspamd_shingles_from_text (GArray *input,
 			break;
 		}
 
+		for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
+			memcpy (&seeds[j], keys[j], sizeof (seeds[j]));
+		}
+
 		memset (res, 0, sizeof (res));
 		for (i = 0; i <= (gint)input->len; i ++) {
 			if (i - beg >= SHINGLES_WINDOW || i == (gint)input->len) {
+				word = &g_array_index (input, rspamd_stat_token_t, beg);
+
+				/* The same word is hashed with all seeds at once */
+				for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
+					wdata[j] = word->begin;
+					wlens[j] = word->len;
+				}
+
+				rspamd_cryptobox_fast_hash_multi (ht, wdata, wlens, seeds,
+						RSPAMD_SHINGLE_SIZE, whashes);
 
 				for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
 					/* Shift hashes window to right */
@@ -197,35 +258,37 @@ rspamd_shingles_from_text (GArray *input,
 								res[j * SHINGLES_WINDOW + k + 1];
 					}
 
-					word = &g_array_index (input, rspamd_stat_token_t, beg);
 					/* Insert the last element to the pipe */
-					memcpy (&seed, keys[j], sizeof (seed));
-					res[j * SHINGLES_WINDOW + SHINGLES_WINDOW - 1] =
-							rspamd_cryptobox_fast_hash_specific (ht,
-									word->begin, word->len,
-									seed);
+					res[j * SHINGLES_WINDOW + SHINGLES_WINDOW - 1] = whashes[j];
 					val = 0;
 					for (k = 0; k < SHINGLES_WINDOW; k ++) {
 						val ^= res[j * SHINGLES_WINDOW + k] >>
 								(8 * (SHINGLES_WINDOW - k - 1));
 					}
 
-					g_assert (hlen > beg);
-					hashes[j][beg] = val;
+					vals[j] = val;
 				}
+
+				g_assert (hlen > beg);
+				rspamd_shingles_store_lanes (hashes, minimals, vals, beg, fused);
 				beg++;
 			}
 		}
 	}
 
 	/* Now we need to filter all hashes and make a shingles result */
-	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
-		res->hashes[i] = filter (hashes[i], hlen,
-				i, key, filterd);
-		g_free (hashes[i]);
+	if (fused) {
+		memcpy (res->hashes, minimals, sizeof (res->hashes));
 	}
+	else {
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			res->hashes[i] = filter (hashes[i], hlen,
+					i, key, filterd);
+			g_free (hashes[i]);
+		}
 
-	g_free (hashes);
+		g_free (hashes);
+	}
 
 	rspamd_fstring_free (row);
 
@@ -16,7 +16,9 @@
 #include "config.h"
 #include "libutil/logger.h"
 #include "libutil/sqlite_utils.h"
+#include "libutil/util.h"
 #include "unix-std.h"
+#include <event.h>
 
 
 static GQuark
@@ -617,3 +619,147 @@ rspamd_sqlite3_sync (sqlite3 *db, gint *wal_frames, gint *wal_checkpoints)
 
 	return TRUE;
 }
+
+struct rspamd_sqlite3_writer_task {
+	rspamd_sqlite3_writer_job job; /* NULL means stop */
+	rspamd_sqlite3_writer_fin fin;
+	gpointer ud;
+};
+
+struct rspamd_sqlite3_writer {
+	GThread *thread;
+	GAsyncQueue *jobs;
+	GAsyncQueue *done;
+	gint notify_pipe[2];
+	struct event notify_ev;
+};
+
+static gpointer
+rspamd_sqlite3_writer_thread (gpointer d)
+{
+	struct rspamd_sqlite3_writer *writer = d;
+	struct rspamd_sqlite3_writer_task *task;
+
+	for (;;) {
+		task = g_async_queue_pop (writer->jobs);
+
+		if (task->job == NULL) {
+			g_free (task);
+			break;
+		}
+
+		task->job (task->ud);
+		g_async_queue_push (writer->done, task);
+
+		if (write (writer->notify_pipe[1], "", 1) == -1) {
+			/* Pipe is full, so event loop is already notified */
+		}
+	}
+
+	return NULL;
+}
+
+static void
+rspamd_sqlite3_writer_process_done (struct rspamd_sqlite3_writer *writer)
+{
+	struct rspamd_sqlite3_writer_task *task;
+
+	while ((task = g_async_queue_try_pop (writer->done)) != NULL) {
+		if (task->fin) {
+			task->fin (task->ud);
+		}
+
+		g_free (task);
+	}
+}
+
+static void
+rspamd_sqlite3_writer_notify (gint fd, short what, gpointer d)
+{
+	struct rspamd_sqlite3_writer *writer = d;
+	gchar buf[64];
+
+	while (read (fd, buf, sizeof (buf)) > 0);
+
+	rspamd_sqlite3_writer_process_done (writer);
+}
+
+struct rspamd_sqlite3_writer *
+rspamd_sqlite3_writer_new (struct event_base *ev_base, GError **err)
+{
+	struct rspamd_sqlite3_writer *writer;
+
+	writer = g_malloc0 (sizeof (*writer));
+
+	if (pipe (writer->notify_pipe) == -1) {
+		g_set_error (err, rspamd_sqlite3_quark (), errno,
+				"cannot create pipe: %s", strerror (errno));
+		g_free (writer);
+
+		return NULL;
+	}
+
+	rspamd_socket_nonblocking (writer->notify_pipe[0]);
+	rspamd_socket_nonblocking (writer->notify_pipe[1]);
+	writer->jobs = g_async_queue_new ();
+	writer->done = g_async_queue_new ();
+
+#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION < 32))
+	writer->thread = g_thread_create (rspamd_sqlite3_writer_thread, writer,
+			TRUE, err);
+#else
+	writer->thread = g_thread_try_new ("sqlite3 writer",
+			rspamd_sqlite3_writer_thread, writer, err);
+#endif
+
+	if (writer->thread == NULL) {
+		close (writer->notify_pipe[0]);
+		close (writer->notify_pipe[1]);
+		g_async_queue_unref (writer->jobs);
+		g_async_queue_unref (writer->done);
+		g_free (writer);
+
+		return NULL;
+	}
+
+	event_set (&writer->notify_ev, writer->notify_pipe[0], EV_READ | EV_PERSIST,
+			rspamd_sqlite3_writer_notify, writer);
+	event_base_set (ev_base, &writer->notify_ev);
+	event_add (&writer->notify_ev, NULL);
+
+	return writer;
+}
+
+void
+rspamd_sqlite3_writer_push (struct rspamd_sqlite3_writer *writer,
+		rspamd_sqlite3_writer_job job, rspamd_sqlite3_writer_fin fin,
+		gpointer ud)
+{
+	struct rspamd_sqlite3_writer_task *task;
+
+	g_assert (job != NULL);
+
+	task = g_malloc (sizeof (*task));
+	task->job = job;
+	task->fin = fin;
+	task->ud = ud;
+	g_async_queue_push (writer->jobs, task);
+}
+
+void
+rspamd_sqlite3_writer_destroy (struct rspamd_sqlite3_writer *writer)
+{
+	if (writer) {
+		/* Stop marker is processed after all queued jobs */
+		g_async_queue_push (writer->jobs,
+				g_malloc0 (sizeof (struct rspamd_sqlite3_writer_task)));
+		g_thread_join (writer->thread);
+		event_del (&writer->notify_ev);
+		rspamd_sqlite3_writer_process_done (writer);
+		close (writer->notify_pipe[0]);
+		close (writer->notify_pipe[1]);
+		g_async_queue_unref (writer->jobs);
+		g_async_queue_unref (writer->done);
+		g_free (writer);
+	}
+}
@@ -78,4 +78,35 @@ sqlite3 * rspamd_sqlite3_open_or_create (rspamd_mempool_t *pool, const gchar *pa
  */
 gboolean rspamd_sqlite3_sync (sqlite3 *db, gint *wal_frames, gint *wal_checkpoints);
 
+struct rspamd_sqlite3_writer;
+struct event_base;
+
+/* Called in the writer thread */
+typedef void (*rspamd_sqlite3_writer_job) (gpointer ud);
+/* Called from the event loop when job is done */
+typedef void (*rspamd_sqlite3_writer_fin) (gpointer ud);
+
+/**
+ * Starts a thread that executes write jobs one by one, so commits and wal
+ * checkpoints do not block the event loop. Jobs must use a database
+ * connection that is not used by the event loop
+ * @param ev_base event base used to notify about finished jobs
+ * @return new writer or NULL if thread cannot be started
+ */
+struct rspamd_sqlite3_writer * rspamd_sqlite3_writer_new (
+		struct event_base *ev_base, GError **err);
+
+/**
+ * Queues job to the writer thread, `fin` is called from the event loop
+ * after `job` is finished
+ */
+void rspamd_sqlite3_writer_push (struct rspamd_sqlite3_writer *writer,
+		rspamd_sqlite3_writer_job job, rspamd_sqlite3_writer_fin fin,
+		gpointer ud);
+
+/**
+ * Waits for all queued jobs, calls their finalizers and stops writer thread
+ */
+void rspamd_sqlite3_writer_destroy (struct rspamd_sqlite3_writer *writer);
+
 #endif /* SRC_LIBUTIL_SQLITE_UTILS_H_ */
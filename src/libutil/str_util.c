@@ -18,7 +18,10 @@
 #include "cryptobox.h"
 #include "url.h"
 #include "str_util.h"
+#include "str_util_impl.h"
+#include "platform_config.h"
 #include "logger.h"
+#include "ottery.h"
 #include "contrib/t1ha/t1ha.h"
 #include <unicode/uversion.h>
 #include <unicode/ucnv.h>
@@ -63,7 +66,7 @@ const guchar lc_map[256] = {
 };
 
 void
-rspamd_str_lc (gchar *str, guint size)
+rspamd_str_lc_ref (gchar *str, guint size)
 {
 	guint leftover = size % 4;
 	guint fp, i;
@@ -96,7 +99,7 @@ rspamd_str_lc (gchar *str, guint size)
 }
 
 gint
-rspamd_lc_cmp (const gchar *s, const gchar *d, gsize l)
+rspamd_lc_cmp_ref (const gchar *s, const gchar *d, gsize l)
 {
 	guint fp, i;
 	guchar c1, c2, c3, c4;
@@ -247,6 +250,26 @@ rspamd_icase_hash (const gchar *in, gsize len, guint64 seed)
 	return h;
 }
 
+guint64
+rspamd_icase_hash_fast (const gchar *in, gsize len, guint64 seed)
+{
+	gchar buf[256];
+	gsize blen;
+	guint64 h = seed;
+
+	/* Lowercase is exact for all implementations, so the hash is portable */
+	do {
+		blen = MIN (len, sizeof (buf));
+		memcpy (buf, in, blen);
+		rspamd_str_lc (buf, blen);
+		h = t1ha (buf, blen, h);
+		in += blen;
+		len -= blen;
+	} while (len > 0);
+
+	return h;
+}
+
 guint
 rspamd_strcase_hash (gconstpointer key)
 {
@@ -255,7 +278,7 @@ rspamd_strcase_hash (gconstpointer key)
 
 	len = strlen (p);
 
-	return rspamd_icase_hash (p, len, rspamd_hash_seed ());
+	return rspamd_icase_hash_fast (p, len, rspamd_hash_seed ());
 }
 
 guint
@@ -293,7 +316,7 @@ rspamd_ftok_icase_hash (gconstpointer key)
 {
 	const rspamd_ftok_t *f = key;
 
-	return rspamd_icase_hash (f->begin, f->len, rspamd_hash_seed ());
+	return rspamd_icase_hash_fast (f->begin, f->len, rspamd_hash_seed ());
 }
 
 gboolean
@@ -314,7 +337,7 @@ rspamd_gstring_icase_hash (gconstpointer key)
 {
 	const GString *f = key;
 
-	return rspamd_icase_hash (f->str, f->len, rspamd_hash_seed ());
+	return rspamd_icase_hash_fast (f->str, f->len, rspamd_hash_seed ());
 }
 
 /* https://graphics.stanford.edu/~seander/bithacks.html#ZeroInWord */
@@ -885,6 +908,89 @@ rspamd_encode_base64_fold (const guchar *in, gsize inlen, gint str_len,
 
 #define MIN3(a, b, c) ((a) < (b) ? ((a) < (c) ? (a) : (c)) : ((b) < (c) ? (b) : (c)))
 
+/*
+ * Optimal string alignment distance (Levenshtein with adjacent
+ * transpositions) using Hyyro bit-parallel algorithm, s1len must be in
+ * range [1, 64]
+ */
+static gint
+rspamd_strings_osa_distance_bitpar (const guchar *s1, gsize s1len,
+		const guchar *s2, gsize s2len)
+{
+	guint64 peq[256], vp = ~0ULL, vn = 0, d0 = 0, pm, pm_old = 0, tr, hp, hn,
+			mask = 1ULL << (s1len - 1);
+	gint dist = s1len;
+	gsize i;
+
+	memset (peq, 0, sizeof (peq));
+
+	for (i = 0; i < s1len; i++) {
+		peq[s1[i]] |= 1ULL << i;
+	}
+
+	for (i = 0; i < s2len; i++) {
+		pm = peq[s2[i]];
+		tr = (((~d0) & pm) << 1) & pm_old;
+		d0 = (((pm & vp) + vp) ^ vp) | pm | vn | tr;
+		hp = vn | ~(d0 | vp);
+		hn = d0 & vp;
+
+		if (hp & mask) {
+			dist ++;
+		}
+		else if (hn & mask) {
+			dist --;
+		}
+
+		hp = (hp << 1) | 1;
+		hn = hn << 1;
+		vp = hn | ~(d0 | hp);
+		vn = hp & d0;
+		pm_old = pm;
+	}
+
+	return dist;
+}
+
+/*
+ * When replacement costs at least 2, it is never better than deletion plus
+ * insertion (the same applies to transpositions), so the distance is
+ * `s1len + s2len - 2 * LCS`. LCS is calculated using bit-parallel algorithm,
+ * s1len must be in range [1, 64]
+ */
+static gint
+rspamd_strings_indel_distance_bitpar (const guchar *s1, gsize s1len,
+		const guchar *s2, gsize s2len)
+{
+	guint64 peq[256], v = ~0ULL, u;
+	gint lcs = 0;
+	gsize i;
+
+	memset (peq, 0, sizeof (peq));
+
+	for (i = 0; i < s1len; i++) {
+		peq[s1[i]] |= 1ULL << i;
+	}
+
+	for (i = 0; i < s2len; i++) {
+		u = v & peq[s2[i]];
+		v = (v + u) | (v - u);
+	}
+
+	v = ~v;
+
+	if (s1len < 64) {
+		v &= (1ULL << s1len) - 1;
+	}
+
+	while (v) {
+		v &= v - 1;
+		lcs ++;
+	}
+
+	return s1len + s2len - lcs * 2;
+}
+
 gint
 rspamd_strings_levenshtein_distance (const gchar *s1, gsize s1len,
 		const gchar *s2, gsize s2len,
@@ -925,6 +1031,22 @@ rspamd_strings_levenshtein_distance (const gchar *s1, gsize s1len,
 		s1len = tmplen;
 	}
 
+	if (s1len == 0) {
+		return s2len;
+	}
+
+	/* Short strings fit in a machine word, so avoid quadratic DP */
+	if (s1len <= 64) {
+		if (replace_cost == 1) {
+			return rspamd_strings_osa_distance_bitpar ((const guchar *)s1, s1len,
+					(const guchar *)s2, s2len);
+		}
+		else if (replace_cost >= 2) {
+			return rspamd_strings_indel_distance_bitpar ((const guchar *)s1,
+					s1len, (const guchar *)s2, s2len);
+		}
+	}
+
 	/* Adjust static space */
 	if (current_row == NULL) {
 		current_row = g_array_sized_new (FALSE, FALSE, sizeof (gint), s1len + 1);
@@ -1391,13 +1513,13 @@ rspamd_substring_search (const gchar *in, gsize inlen,
 }
 
 goffset
-rspamd_substring_search_caseless (const gchar *in, gsize inlen,
+rspamd_substring_search_caseless_ref (const gchar *in, gsize inlen,
 		const gchar *srch, gsize srchlen)
 {
 	if (inlen > srchlen) {
 		if (G_UNLIKELY (srchlen == 1)) {
 			goffset i;
-			gchar s = lc_map[(guchar)srch[0]];
+			guchar s = lc_map[(guchar)srch[0]];
 
 			for (i = 0; i < inlen; i++) {
 				if (lc_map[(guchar)in[i]] == s) {
@@ -1685,6 +1807,26 @@ rspamd_decode_hex (const gchar *in, gsize inlen)
 	return NULL;
 }
 
+/* Values of hex digits, other characters are decoded as zero */
+static const guchar qp_hex_table[256] = {
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  1,  2,  3,  4,  5,  6,  7,  8,  9,  0,  0,  0,  0,  0,  0,
+	 0, 10, 11, 12, 13, 14, 15,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0, 10, 11, 12, 13, 14, 15,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+};
+
 gssize
 rspamd_decode_qp_buf (const gchar *in, gsize inlen,
 		gchar *out, gsize outlen)
@@ -1716,10 +1858,7 @@ decode:
 			remain --;
 			ret = 0;
 
-			if      (c >= '0' && c <= '9') { ret = c - '0'; }
-			else if (c >= 'A' && c <= 'F') { ret = c - 'A' + 10; }
-			else if (c >= 'a' && c <= 'f') { ret = c - 'a' + 10; }
-			else if (c == '\r' || c == '\n') {
+			if (c == '\r' || c == '\n') {
 				/* Soft line break */
 				while (remain > 0 && (*p == '\r' || *p == '\n')) {
 					remain --;
@@ -1729,13 +1868,11 @@ decode:
 				continue;
 			}
 
+			ret = qp_hex_table[(guchar)c];
+
 			if (remain > 0) {
 				c = *p++;
-				ret *= 16;
-
-				if      (c >= '0' && c <= '9') { ret += c - '0'; }
-				else if (c >= 'A' && c <= 'F') { ret += c - 'A' + 10; }
-				else if (c >= 'a' && c <= 'f') { ret += c - 'a' + 10; }
+				ret = ret * 16 + qp_hex_table[(guchar)c];
 
 				if (end - o > 0) {
 					*o++ = (gchar)ret;
@@ -1778,7 +1915,7 @@ decode:
 
 
 gsize
-rspamd_memcspn (const gchar *s, const gchar *e, gsize len)
+rspamd_memcspn_ref (const gchar *s, const gchar *e, gsize len)
 {
 	gsize byteset[32 / sizeof(gsize)];
 	const gchar *p = s, *end = s + len;
@@ -1797,7 +1934,7 @@ rspamd_memcspn (const gchar *s, const gchar *e, gsize len)
 }
 
 gsize
-rspamd_memspn (const gchar *s, const gchar *e, gsize len)
+rspamd_memspn_ref (const gchar *s, const gchar *e, gsize len)
 {
 	gsize byteset[32 / sizeof(gsize)];
 	const gchar *p = s, *end = s + len;
@@ -1815,6 +1952,117 @@ rspamd_memspn (const gchar *s, const gchar *e, gsize len)
 	return p - s;
 }
 
+gboolean
+rspamd_str_has_8bit_ref (const guchar *beg, gsize len)
+{
+	unsigned long *w;
+	gsize i, leftover = len % sizeof (*w);
+
+	w = (unsigned long *)beg;
+
+	for (i = 0; i < len / sizeof (*w); i ++) {
+		if (rspamd_str_hasmore (*w, 127)) {
+			return TRUE;
+		}
+
+		w ++;
+	}
+
+	beg = (const guchar *)w;
+
+	for (i = 0; i < leftover; i ++) {
+		if (beg[i] > 127) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+#define RSPAMD_UTF8_IS_CONT(pos) ((pos) < len && (data[(pos)] & 0xC0) == 0x80)
+
+/*
+ * Well-formed sequences are checked according to Table 3-7 of the Unicode
+ * standard, so overlongs, surrogates and values above U+10FFFF are rejected
+ */
+gsize
+rspamd_fast_utf8_validate_ref (const guchar *data, gsize len)
+{
+	gsize i = 0;
+	guint64 w;
+	guchar c, c1;
+
+	while (i < len) {
+		/* Skip words of ASCII characters without NUL bytes */
+		if (i + sizeof (w) <= len) {
+			memcpy (&w, data + i, sizeof (w));
+
+			if ((w & 0x8080808080808080ULL) == 0 &&
+					((w - 0x0101010101010101ULL) & 0x8080808080808080ULL) == 0) {
+				i += sizeof (w);
+				continue;
+			}
+		}
+
+		c = data[i];
+
+		if (c < 0x80) {
+			if (c == 0) {
+				return i;
+			}
+
+			i ++;
+		}
+		else if (c >= 0xC2 && c <= 0xDF) {
+			if (!RSPAMD_UTF8_IS_CONT (i + 1)) {
+				return i;
+			}
+
+			i += 2;
+		}
+		else if (c >= 0xE0 && c <= 0xEF) {
+			if (i + 2 >= len) {
+				return i;
+			}
+
+			c1 = data[i + 1];
+
+			if ((c == 0xE0 && (c1 < 0xA0 || c1 > 0xBF)) ||
+					(c == 0xED && (c1 < 0x80 || c1 > 0x9F)) ||
+					(c1 & 0xC0) != 0x80 ||
+					!RSPAMD_UTF8_IS_CONT (i + 2)) {
+				return i;
+			}
+
+			i += 3;
+		}
+		else if (c >= 0xF0 && c <= 0xF4) {
+			if (i + 3 >= len) {
+				return i;
+			}
+
+			c1 = data[i + 1];
+
+			if ((c == 0xF0 && (c1 < 0x90 || c1 > 0xBF)) ||
+					(c == 0xF4 && (c1 < 0x80 || c1 > 0x8F)) ||
+					(c1 & 0xC0) != 0x80 ||
+					!RSPAMD_UTF8_IS_CONT (i + 2) ||
+					!RSPAMD_UTF8_IS_CONT (i + 3)) {
+				return i;
+			}
+
+			i += 4;
+		}
+		else {
+			return i;
+		}
+	}
+
+	return len;
+}
+
+#undef RSPAMD_UTF8_IS_CONT
+
 gssize
 rspamd_decode_qp2047_buf (const gchar *in, gsize inlen,
 		gchar *out, gsize outlen)
@@ -1846,10 +2094,7 @@ decode:
 			remain --;
 			ret = 0;
 
-			if      (c >= '0' && c <= '9') { ret = c - '0'; }
-			else if (c >= 'A' && c <= 'F') { ret = c - 'A' + 10; }
-			else if (c >= 'a' && c <= 'f') { ret = c - 'a' + 10; }
-			else if (c == '\r' || c == '\n') {
+			if (c == '\r' || c == '\n') {
 				/* Soft line break */
 				while (remain > 0 && (*p == '\r' || *p == '\n')) {
 					remain --;
@@ -1859,13 +2104,11 @@ decode:
 				continue;
 			}
 
+			ret = qp_hex_table[(guchar)c];
+
 			if (remain > 0) {
 				c = *p++;
-				ret *= 16;
-
-				if      (c >= '0' && c <= '9') { ret += c - '0'; }
-				else if (c >= 'A' && c <= 'F') { ret += c - 'A' + 10; }
-				else if (c >= 'a' && c <= 'f') { ret += c - 'a' + 10; }
+				ret = ret * 16 + qp_hex_table[(guchar)c];
 
 				if (end - o > 0) {
 					*o++ = (gchar)ret;
@@ -2105,6 +2348,90 @@ rspamd_ucl_emit_fstring_comments (const ucl_object_t *obj,
 	ucl_object_emit_full (obj, emit_type, &func, comments);
 }
 
+/*
+ * Rope ucl emitting functions
+ */
+static int
+rspamd_rope_emit_append_character (unsigned char c, size_t len, void *ud)
+{
+	rspamd_fstring_rope_t *rope = ud;
+	gchar buf[64];
+	gsize r;
+
+	memset (buf, c, MIN (len, sizeof (buf)));
+
+	while (len > 0) {
+		r = MIN (len, sizeof (buf));
+		rspamd_fstring_rope_append (rope, buf, r);
+		len -= r;
+	}
+
+	return 0;
+}
+
+static int
+rspamd_rope_emit_append_len (const unsigned char *str, size_t len, void *ud)
+{
+	rspamd_fstring_rope_t *rope = ud;
+
+	rspamd_fstring_rope_append (rope, (const gchar *)str, len);
+
+	return 0;
+}
+
+static int
+rspamd_rope_emit_append_int (int64_t val, void *ud)
+{
+	rspamd_fstring_rope_t *rope = ud;
+	gchar buf[32];
+	glong r;
+
+	r = rspamd_snprintf (buf, sizeof (buf), "%L", (intmax_t) val);
+	rspamd_fstring_rope_append (rope, buf, r);
+
+	return 0;
+}
+
+static int
+rspamd_rope_emit_append_double (double val, void *ud)
+{
+	rspamd_fstring_rope_t *rope = ud;
+	gchar buf[64];
+	glong r;
+
+	if (isfinite (val)) {
+		if (val == (double) ((gint) val)) {
+			r = rspamd_snprintf (buf, sizeof (buf), "%.1f", val);
+		} else {
+			r = rspamd_snprintf (buf, sizeof (buf),
+					"%." G_STRINGIFY (MAX_PRECISION) "f", val);
+		}
+	}
+	else {
+		r = rspamd_snprintf (buf, sizeof (buf), "null");
+	}
+
+	rspamd_fstring_rope_append (rope, buf, r);
+
+	return 0;
+}
+
+void
+rspamd_ucl_emit_rope (const ucl_object_t *obj,
+		enum ucl_emitter emit_type,
+		rspamd_fstring_rope_t *target)
+{
+	struct ucl_emitter_functions func = {
+			.ucl_emitter_append_character = rspamd_rope_emit_append_character,
+			.ucl_emitter_append_len = rspamd_rope_emit_append_len,
+			.ucl_emitter_append_int = rspamd_rope_emit_append_int,
+			.ucl_emitter_append_double = rspamd_rope_emit_append_double
+	};
+
+	func.ud = target;
+	ucl_object_emit_full (obj, emit_type, &func, NULL);
+}
+
 const void *
 rspamd_memrchr (const void *m, gint c, gsize len)
 {
@@ -2324,3 +2651,260 @@ rspamd_str_regexp_escape (const gchar *pattern, gsize slen,
 
 	return res;
 }
+
+extern unsigned long cpu_config;
+
+typedef struct rspamd_str_util_impl_s {
+	unsigned long cpu_flags;
+	const char *desc;
+	void (*lc) (gchar *str, guint size);
+	gint (*lc_cmp) (const gchar *s, const gchar *d, gsize l);
+	gsize (*memcspn) (const gchar *s, const gchar *e, gsize len);
+	gsize (*memspn) (const gchar *s, const gchar *e, gsize len);
+	gboolean (*has_8bit) (const guchar *beg, gsize len);
+	goffset (*substring_search_caseless) (const gchar *in, gsize inlen,
+			const gchar *srch, gsize srchlen);
+	gsize (*utf8_validate) (const guchar *data, gsize len);
+} rspamd_str_util_impl_t;
+
+#define RSPAMD_STR_UTIL_IMPL(cpuflags, desc, ext, spn_ext) \
+	{(cpuflags), desc, rspamd_str_lc_##ext, rspamd_lc_cmp_##ext, \
+	rspamd_memcspn_##spn_ext, rspamd_memspn_##spn_ext, \
+	rspamd_str_has_8bit_##ext, rspamd_substring_search_caseless_##ext, \
+	rspamd_fast_utf8_validate_##spn_ext}
+
+#define RSPAMD_STR_UTIL_REF RSPAMD_STR_UTIL_IMPL(0, "ref", ref, ref)
+
+#ifdef RSPAMD_HAS_TARGET_ATTR
+# if defined(HAVE_AVX2) && defined(HAVE_SSE42)
+/* AVX2 has nothing better than SSE4.2 string instructions for char sets */
+#  define RSPAMD_STR_UTIL_AVX2 RSPAMD_STR_UTIL_IMPL(CPUID_AVX2|CPUID_SSE42, \
+		"avx2", avx2, sse42)
+# endif
+# if defined(HAVE_SSE42)
+#  define RSPAMD_STR_UTIL_SSE42 RSPAMD_STR_UTIL_IMPL(CPUID_SSE42, \
+		"sse42", sse42, sse42)
+# endif
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+# define RSPAMD_STR_UTIL_NEON RSPAMD_STR_UTIL_IMPL(CPUID_NEON, "neon", neon, ref)
+#endif
+
+static const rspamd_str_util_impl_t str_util_list[] = {
+		RSPAMD_STR_UTIL_REF,
+#ifdef RSPAMD_STR_UTIL_AVX2
+		RSPAMD_STR_UTIL_AVX2,
+#endif
+#ifdef RSPAMD_STR_UTIL_SSE42
+		RSPAMD_STR_UTIL_SSE42,
+#endif
+#ifdef RSPAMD_STR_UTIL_NEON
+		RSPAMD_STR_UTIL_NEON,
+#endif
+};
+
+static const rspamd_str_util_impl_t *str_util_opt = &str_util_list[0];
+
+const char *
+rspamd_str_util_load (void)
+{
+	guint i;
+
+	if (cpu_config != 0) {
+		for (i = 1; i < G_N_ELEMENTS (str_util_list); i++) {
+			if ((str_util_list[i].cpu_flags & cpu_config) ==
+					str_util_list[i].cpu_flags) {
+				str_util_opt = &str_util_list[i];
+				break;
+			}
+		}
+	}
+
+	return str_util_opt->desc;
+}
+
+void
+rspamd_str_lc (gchar *str, guint size)
+{
+	str_util_opt->lc (str, size);
+}
+
+gint
+rspamd_lc_cmp (const gchar *s, const gchar *d, gsize l)
+{
+	return str_util_opt->lc_cmp (s, d, l);
+}
+
+gsize
+rspamd_memcspn (const gchar *s, const gchar *e, gsize len)
+{
+	return str_util_opt->memcspn (s, e, len);
+}
+
+gsize
+rspamd_memspn (const gchar *s, const gchar *e, gsize len)
+{
+	return str_util_opt->memspn (s, e, len);
+}
+
+gboolean
+rspamd_str_has_8bit (const guchar *beg, gsize len)
+{
+	return str_util_opt->has_8bit (beg, len);
+}
+
+goffset
+rspamd_substring_search_caseless (const gchar *in, gsize inlen,
+		const gchar *srch, gsize srchlen)
+{
+	return str_util_opt->substring_search_caseless (in, inlen, srch, srchlen);
+}
+
+gsize
+rspamd_fast_utf8_validate (const guchar *data, gsize len)
+{
+	return str_util_opt->utf8_validate (data, len);
+}
+
+size_t
+rspamd_str_util_test (const char *func, bool generic, size_t niters,
+		size_t len)
+{
+	size_t cycles;
+	gchar *in, *tmp;
+	const rspamd_str_util_impl_t *impl;
+	/* Characters absent from the random data, so the whole input is scanned */
+	const gchar *cspn_set = "\r\n\t <>@", *spn_set = "0123456789abcdef";
+	const gsize srchlen = 8;
+	gsize i;
+
+	g_assert (len > srchlen);
+	in = g_malloc (len);
+	tmp = g_malloc (len);
+	ottery_rand_bytes (in, len);
+	impl = generic ? &str_util_list[0] : str_util_opt;
+
+	if (strcmp (func, "memspn") == 0) {
+		for (i = 0; i < len; i ++) {
+			in[i] = spn_set[(guchar)in[i] % 16];
+		}
+	}
+	else {
+		/* Mixed case ASCII letters and some punctuation */
+		for (i = 0; i < len; i ++) {
+			in[i] = 'A' + (guchar)in[i] % ('z' - 'A' + 1);
+		}
+	}
+
+	memcpy (tmp, in, len);
+	rspamd_str_lc_ref (tmp, len);
+
+	/* Check optimized implementation against the reference one */
+	if (strcmp (func, "lc") == 0) {
+		memcpy (tmp, in, len);
+		str_util_opt->lc (tmp, len);
+		rspamd_str_lc_ref (in, len);
+		g_assert (memcmp (in, tmp, len) == 0);
+
+		for (cycles = 0; cycles < niters; cycles ++) {
+			memcpy (tmp, in, len);
+			impl->lc (tmp, len);
+		}
+	}
+	else if (strcmp (func, "lc_cmp") == 0) {
+		g_assert (str_util_opt->lc_cmp (in, tmp, len) == 0);
+		tmp[len - 1] = '#';
+		g_assert (str_util_opt->lc_cmp (in, tmp, len) ==
+				rspamd_lc_cmp_ref (in, tmp, len));
+		tmp[len - 1] = lc_map[(guchar)in[len - 1]];
+
+		for (cycles = 0; cycles < niters; cycles ++) {
+			impl->lc_cmp (in, tmp, len);
+		}
+	}
+	else if (strcmp (func, "memcspn") == 0) {
+		g_assert (str_util_opt->memcspn (in, cspn_set, len) == len);
+		in[len / 2] = '@';
+		g_assert (str_util_opt->memcspn (in, cspn_set, len) == len / 2);
+		in[len / 2] = 'a';
+
+		for (cycles = 0; cycles < niters; cycles ++) {
+			impl->memcspn (in, cspn_set, len);
+		}
+	}
+	else if (strcmp (func, "memspn") == 0) {
+		g_assert (str_util_opt->memspn (in, spn_set, len) == len);
+		in[len / 2] = 'z';
+		g_assert (str_util_opt->memspn (in, spn_set, len) == len / 2);
+		in[len / 2] = 'a';
+
+		for (cycles = 0; cycles < niters; cycles ++) {
+			impl->memspn (in, spn_set, len);
+		}
+	}
+	else if (strcmp (func, "has_8bit") == 0) {
+		g_assert (!str_util_opt->has_8bit ((const guchar *)in, len));
+		in[len - 1] = '\xff';
+		g_assert (str_util_opt->has_8bit ((const guchar *)in, len));
+		in[len - 1] = 'a';
+
+		for (cycles = 0; cycles < niters; cycles ++) {
+			impl->has_8bit ((const guchar *)in, len);
+		}
+	}
+	else if (strcmp (func, "utf8_validate") == 0) {
+		/* Mix of ASCII, 2, 3 and 4 bytes characters */
+		static const gchar *chars[] = {"a", "\xd0\xb6", "\xe2\x82\xac",
+				"\xf0\x9f\x98\x80"};
+		gsize clen, vlen = 0;
+
+		for (i = 0; i < len; i += clen) {
+			const gchar *ch = chars[(guchar)in[i] % G_N_ELEMENTS (chars)];
+
+			clen = strlen (ch);
+
+			if (i + clen > len) {
+				break;
+			}
+
+			memcpy (tmp + i, ch, clen);
+			vlen = i + clen;
+		}
+
+		memcpy (in, tmp, vlen);
+		g_assert (str_util_opt->utf8_validate ((const guchar *)in, vlen) == vlen);
+		g_assert (str_util_opt->utf8_validate ((const guchar *)in, vlen) ==
+				rspamd_fast_utf8_validate_ref ((const guchar *)in, vlen));
+		/* Byte that can never appear in UTF8 */
+		in[len / 2] = '\xff';
+		g_assert (str_util_opt->utf8_validate ((const guchar *)in, vlen) ==
+				rspamd_fast_utf8_validate_ref ((const guchar *)in, vlen));
+		g_assert (rspamd_fast_utf8_validate_ref ((const guchar *)in, vlen) <= len / 2);
+		memcpy (in, tmp, vlen);
+
+		for (cycles = 0; cycles < niters; cycles ++) {
+			impl->utf8_validate ((const guchar *)in, vlen);
+		}
+	}
+	else if (strcmp (func, "substring_caseless") == 0) {
+		/* Search for the lowercased tail of input */
+		g_assert (str_util_opt->substring_search_caseless (in, len,
+				tmp + len - srchlen, srchlen) ==
+				rspamd_substring_search_caseless_ref (in, len,
+						tmp + len - srchlen, srchlen));
+
+		for (cycles = 0; cycles < niters; cycles ++) {
+			impl->substring_search_caseless (in, len,
+					tmp + len - srchlen, srchlen);
+		}
+	}
+	else {
+		g_assert_not_reached ();
+	}
+
+	g_free (in);
+	g_free (tmp);
+
+	return cycles;
+}
@@ -46,6 +46,11 @@ void rspamd_str_lc_utf8 (gchar *str, guint size);
  * Hash table utility functions for case insensitive hashing
  */
 guint64 rspamd_icase_hash (const gchar *in, gsize len, guint64 seed);
+/*
+ * Faster case insensitive hash that lowercases and hashes input in blocks,
+ * its values differ from rspamd_icase_hash but are the same on all CPUs
+ */
+guint64 rspamd_icase_hash_fast (const gchar *in, gsize len, guint64 seed);
 guint rspamd_strcase_hash (gconstpointer key);
 gboolean rspamd_strcase_equal (gconstpointer v, gconstpointer v2);
 
@@ -325,6 +330,16 @@ void rspamd_ucl_emit_fstring_comments (const ucl_object_t *obj,
 		rspamd_fstring_t **target,
 		const ucl_object_t *comments);
 
+/**
+ * Emit UCL object to rope, suitable for large outputs
+ * @param obj object to emit
+ * @param emit_type emitter type
+ * @param target target rope
+ */
+void rspamd_ucl_emit_rope (const ucl_object_t *obj,
+		enum ucl_emitter emit_type,
+		rspamd_fstring_rope_t *target);
+
 extern const guchar lc_map[256];
 
 /**
@@ -357,32 +372,29 @@ gsize rspamd_memspn (const gchar *s, const gchar *e, gsize len);
 /* https://graphics.stanford.edu/~seander/bithacks.html#HasMoreInWord */
 #define rspamd_str_hasmore(x,n) ((((x)+~0UL/255*(127-(n)))|(x))&~0UL/255*128)
 
-static inline gboolean
-rspamd_str_has_8bit (const guchar *beg, gsize len)
-{
-	unsigned long *w;
-	gsize i, leftover = len % sizeof (*w);
-
-	w = (unsigned long *)beg;
-
-	for (i = 0; i < len / sizeof (*w); i ++) {
-		if (rspamd_str_hasmore (*w, 127)) {
-			return TRUE;
-		}
-
-		w ++;
-	}
-
-	beg = (const guchar *)w;
+/**
+ * Check if memory segment contains any characters with the high bit set
+ * @param beg any input
+ * @param len length of `beg`
+ * @return TRUE if there are 8 bit characters
+ */
+gboolean rspamd_str_has_8bit (const guchar *beg, gsize len);
 
-	for (i = 0; i < leftover; i ++) {
-		if (beg[i] > 127) {
-			return TRUE;
-		}
-	}
+/**
+ * Validates UTF8 input, NUL characters are treated as invalid like in
+ * g_utf8_validate
+ * @param data any input
+ * @param len length of `data`
+ * @return length of the valid prefix, equal to `len` if the whole input is valid
+ */
+gsize rspamd_fast_utf8_validate (const guchar *data, gsize len);
 
-	return FALSE;
-}
+/**
+ * Select the fastest implementations of string primitives for this CPU,
+ * should be called after cpu features are detected by cryptobox
+ * @return description of the selected implementation
+ */
+const char * rspamd_str_util_load (void);
 
 /**
  * Gets a string in UTF8 and normalises it to NFKC_Casefold form
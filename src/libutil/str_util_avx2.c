@@ -0,0 +1,205 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "cryptobox.h"
+#include "str_util.h"
+#include "str_util_impl.h"
+
+#ifdef RSPAMD_HAS_TARGET_ATTR
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#ifndef __SSE2__
+#define __SSE2__
+#endif
+#ifndef __SSE__
+#define __SSE__
+#endif
+#ifndef __SSE4_2__
+#define __SSE4_2__
+#endif
+#ifndef __SSE4_1__
+#define __SSE4_1__
+#endif
+#ifndef __SSEE3__
+#define __SSEE3__
+#endif
+#ifndef __AVX__
+#define __AVX__
+#endif
+#ifndef __AVX2__
+#define __AVX2__
+#endif
+
+#include <immintrin.h>
+
+static inline __m256i
+rspamd_lc_avx2 (__m256i v) __attribute__((__target__("avx2")));
+
+static inline __m256i
+rspamd_lc_avx2 (__m256i v)
+{
+	/* Signed comparison leaves all non ASCII characters untouched */
+	const __m256i before_a = _mm256_set1_epi8 ('A' - 1),
+			after_z = _mm256_set1_epi8 ('Z' + 1),
+			diff = _mm256_set1_epi8 ('a' - 'A');
+	__m256i upper;
+
+	upper = _mm256_and_si256 (_mm256_cmpgt_epi8 (v, before_a),
+			_mm256_cmpgt_epi8 (after_z, v));
+
+	return _mm256_add_epi8 (v, _mm256_and_si256 (upper, diff));
+}
+
+void
+rspamd_str_lc_avx2 (gchar *str, guint size) __attribute__((__target__("avx2")));
+
+void
+rspamd_str_lc_avx2 (gchar *str, guint size)
+{
+	guint i;
+	__m256i v;
+
+	for (i = 0; i + 32 <= size; i += 32) {
+		v = _mm256_loadu_si256 ((const __m256i *)(str + i));
+		_mm256_storeu_si256 ((__m256i *)(str + i), rspamd_lc_avx2 (v));
+	}
+
+	rspamd_str_lc_ref (str + i, size - i);
+}
+
+gint
+rspamd_lc_cmp_avx2 (const gchar *s, const gchar *d, gsize l) __attribute__((__target__("avx2")));
+
+gint
+rspamd_lc_cmp_avx2 (const gchar *s, const gchar *d, gsize l)
+{
+	gsize i;
+	__m256i v1, v2;
+
+	for (i = 0; i + 32 <= l; i += 32) {
+		v1 = rspamd_lc_avx2 (_mm256_loadu_si256 ((const __m256i *)(s + i)));
+		v2 = rspamd_lc_avx2 (_mm256_loadu_si256 ((const __m256i *)(d + i)));
+
+		if ((guint)_mm256_movemask_epi8 (_mm256_cmpeq_epi8 (v1, v2)) !=
+				0xffffffffU) {
+			/* Let the generic code define the result for the difference */
+			break;
+		}
+	}
+
+	return rspamd_lc_cmp_ref (s + i, d + i, l - i);
+}
+
+gboolean
+rspamd_str_has_8bit_avx2 (const guchar *beg, gsize len) __attribute__((__target__("avx2")));
+
+gboolean
+rspamd_str_has_8bit_avx2 (const guchar *beg, gsize len)
+{
+	gsize i;
+	__m256i acc;
+
+	for (i = 0; i + 128 <= len; i += 128) {
+		acc = _mm256_or_si256 (
+				_mm256_or_si256 (
+						_mm256_loadu_si256 ((const __m256i *)(beg + i)),
+						_mm256_loadu_si256 ((const __m256i *)(beg + i + 32))),
+				_mm256_or_si256 (
+						_mm256_loadu_si256 ((const __m256i *)(beg + i + 64)),
+						_mm256_loadu_si256 ((const __m256i *)(beg + i + 96))));
+
+		if (_mm256_movemask_epi8 (acc) != 0) {
+			return TRUE;
+		}
+	}
+
+	for (; i + 32 <= len; i += 32) {
+		acc = _mm256_loadu_si256 ((const __m256i *)(beg + i));
+
+		if (_mm256_movemask_epi8 (acc) != 0) {
+			return TRUE;
+		}
+	}
+
+	return rspamd_str_has_8bit_ref (beg + i, len - i);
+}
+
+goffset
+rspamd_substring_search_caseless_avx2 (const gchar *in, gsize inlen,
+		const gchar *srch, gsize srchlen) __attribute__((__target__("avx2")));
+
+/*
+ * Candidates are the positions where both the first and the last characters
+ * of the pattern match, only these are compared with the whole pattern
+ */
+goffset
+rspamd_substring_search_caseless_avx2 (const gchar *in, gsize inlen,
+		const gchar *srch, gsize srchlen)
+{
+	gsize i, last, ncandidates = 0;
+	guchar first_lc, last_lc;
+	guint mask, bit;
+	goffset ret;
+	__m256i first_l, first_u, last_l, last_u, v1, v2, eq;
+
+	if (srchlen == 0 || inlen <= srchlen) {
+		return rspamd_substring_search_caseless_ref (in, inlen, srch, srchlen);
+	}
+
+	last = srchlen - 1;
+	first_lc = lc_map[(guchar)srch[0]];
+	last_lc = lc_map[(guchar)srch[last]];
+	first_l = _mm256_set1_epi8 (first_lc);
+	first_u = _mm256_set1_epi8 (g_ascii_toupper (first_lc));
+	last_l = _mm256_set1_epi8 (last_lc);
+	last_u = _mm256_set1_epi8 (g_ascii_toupper (last_lc));
+
+	for (i = 0; i + last + 32 <= inlen; i += 32) {
+		v1 = _mm256_loadu_si256 ((const __m256i *)(in + i));
+		v2 = _mm256_loadu_si256 ((const __m256i *)(in + i + last));
+		eq = _mm256_and_si256 (
+				_mm256_or_si256 (_mm256_cmpeq_epi8 (v1, first_l),
+						_mm256_cmpeq_epi8 (v1, first_u)),
+				_mm256_or_si256 (_mm256_cmpeq_epi8 (v2, last_l),
+						_mm256_cmpeq_epi8 (v2, last_u)));
+		mask = _mm256_movemask_epi8 (eq);
+
+		while (mask != 0) {
+			bit = __builtin_ctz (mask);
+
+			if (srchlen <= 2 || rspamd_lc_cmp_avx2 (in + i + bit + 1,
+					srch + 1, srchlen - 2) == 0) {
+				return i + bit;
+			}
+
+			mask &= mask - 1;
+			ncandidates ++;
+		}
+
+		if (ncandidates > RSPAMD_STR_UTIL_MAX_CANDIDATES) {
+			break;
+		}
+	}
+
+	ret = rspamd_substring_search_caseless_ref (in + i, inlen - i,
+			srch, srchlen);
+
+	return ret == -1 ? -1 : ret + (goffset)i;
+}
+
+#pragma GCC pop_options
+#endif
@@ -0,0 +1,59 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SRC_LIBUTIL_STR_UTIL_IMPL_H_
+#define SRC_LIBUTIL_STR_UTIL_IMPL_H_
+
+#include "config.h"
+
+/*
+ * Internal implementations of string primitives, the public functions from
+ * str_util.h dispatch to the best one available on the current CPU
+ */
+
+/* Generic implementations, also used by optimized ones for tails */
+void rspamd_str_lc_ref (gchar *str, guint size);
+gint rspamd_lc_cmp_ref (const gchar *s, const gchar *d, gsize l);
+gsize rspamd_memcspn_ref (const gchar *s, const gchar *e, gsize len);
+gsize rspamd_memspn_ref (const gchar *s, const gchar *e, gsize len);
+gboolean rspamd_str_has_8bit_ref (const guchar *beg, gsize len);
+gsize rspamd_fast_utf8_validate_ref (const guchar *data, gsize len);
+goffset rspamd_substring_search_caseless_ref (const gchar *in, gsize inlen,
+		const gchar *srch, gsize srchlen);
+
+#define RSPAMD_STR_UTIL_DECLARE(ext) \
+	void rspamd_str_lc_##ext (gchar *str, guint size); \
+	gint rspamd_lc_cmp_##ext (const gchar *s, const gchar *d, gsize l); \
+	gboolean rspamd_str_has_8bit_##ext (const guchar *beg, gsize len); \
+	goffset rspamd_substring_search_caseless_##ext (const gchar *in, \
+			gsize inlen, const gchar *srch, gsize srchlen);
+/* Only SSE4.2 has instructions to match a set of characters */
+#define RSPAMD_STR_UTIL_DECLARE_SPN(ext) \
+	gsize rspamd_memcspn_##ext (const gchar *s, const gchar *e, gsize len); \
+	gsize rspamd_memspn_##ext (const gchar *s, const gchar *e, gsize len); \
+	gsize rspamd_fast_utf8_validate_##ext (const guchar *data, gsize len);
+
+RSPAMD_STR_UTIL_DECLARE(sse42)
+RSPAMD_STR_UTIL_DECLARE_SPN(sse42)
+RSPAMD_STR_UTIL_DECLARE(avx2)
+RSPAMD_STR_UTIL_DECLARE(neon)
+
+/*
+ * Number of false candidates after which optimized substring search falls
+ * back to the generic linear time algorithm
+ */
+#define RSPAMD_STR_UTIL_MAX_CANDIDATES 256
+
+#endif /* SRC_LIBUTIL_STR_UTIL_IMPL_H_ */
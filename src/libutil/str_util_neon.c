@@ -0,0 +1,159 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "str_util.h"
+#include "str_util_impl.h"
+
+/* Advanced SIMD is a mandatory part of ARMv8-A, so it is always available */
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+
+static inline uint8x16_t
+rspamd_lc_neon (uint8x16_t v)
+{
+	uint8x16_t upper;
+
+	upper = vandq_u8 (vcgeq_u8 (v, vdupq_n_u8 ('A')),
+			vcleq_u8 (v, vdupq_n_u8 ('Z')));
+
+	return vaddq_u8 (v, vandq_u8 (upper, vdupq_n_u8 ('a' - 'A')));
+}
+
+void
+rspamd_str_lc_neon (gchar *str, guint size)
+{
+	guint i;
+	uint8x16_t v;
+
+	for (i = 0; i + 16 <= size; i += 16) {
+		v = vld1q_u8 ((const guint8 *)(str + i));
+		vst1q_u8 ((guint8 *)(str + i), rspamd_lc_neon (v));
+	}
+
+	rspamd_str_lc_ref (str + i, size - i);
+}
+
+gint
+rspamd_lc_cmp_neon (const gchar *s, const gchar *d, gsize l)
+{
+	gsize i;
+	uint8x16_t v1, v2;
+
+	for (i = 0; i + 16 <= l; i += 16) {
+		v1 = rspamd_lc_neon (vld1q_u8 ((const guint8 *)(s + i)));
+		v2 = rspamd_lc_neon (vld1q_u8 ((const guint8 *)(d + i)));
+
+		if (vminvq_u8 (vceqq_u8 (v1, v2)) != 0xff) {
+			/* Let the generic code define the result for the difference */
+			break;
+		}
+	}
+
+	return rspamd_lc_cmp_ref (s + i, d + i, l - i);
+}
+
+gboolean
+rspamd_str_has_8bit_neon (const guchar *beg, gsize len)
+{
+	gsize i;
+	uint8x16_t acc;
+
+	for (i = 0; i + 64 <= len; i += 64) {
+		acc = vorrq_u8 (
+				vorrq_u8 (vld1q_u8 (beg + i), vld1q_u8 (beg + i + 16)),
+				vorrq_u8 (vld1q_u8 (beg + i + 32), vld1q_u8 (beg + i + 48)));
+
+		if (vmaxvq_u8 (acc) > 0x7f) {
+			return TRUE;
+		}
+	}
+
+	for (; i + 16 <= len; i += 16) {
+		if (vmaxvq_u8 (vld1q_u8 (beg + i)) > 0x7f) {
+			return TRUE;
+		}
+	}
+
+	return rspamd_str_has_8bit_ref (beg + i, len - i);
+}
+
+/*
+ * Candidates are the positions where both the first and the last characters
+ * of the pattern match, only these are compared with the whole pattern
+ */
+goffset
+rspamd_substring_search_caseless_neon (const gchar *in, gsize inlen,
+		const gchar *srch, gsize srchlen)
+{
+	gsize i, last, ncandidates = 0;
+	guchar first_lc, last_lc;
+	guint8 cand[16];
+	guint bit;
+	goffset ret;
+	uint8x16_t first_l, first_u, last_l, last_u, v1, v2, eq;
+
+	if (srchlen == 0 || inlen <= srchlen) {
+		return rspamd_substring_search_caseless_ref (in, inlen, srch, srchlen);
+	}
+
+	last = srchlen - 1;
+	first_lc = lc_map[(guchar)srch[0]];
+	last_lc = lc_map[(guchar)srch[last]];
+	first_l = vdupq_n_u8 (first_lc);
+	first_u = vdupq_n_u8 (g_ascii_toupper (first_lc));
+	last_l = vdupq_n_u8 (last_lc);
+	last_u = vdupq_n_u8 (g_ascii_toupper (last_lc));
+
+	for (i = 0; i + last + 16 <= inlen; i += 16) {
+		v1 = vld1q_u8 ((const guint8 *)(in + i));
+		v2 = vld1q_u8 ((const guint8 *)(in + i + last));
+		eq = vandq_u8 (
+				vorrq_u8 (vceqq_u8 (v1, first_l), vceqq_u8 (v1, first_u)),
+				vorrq_u8 (vceqq_u8 (v2, last_l), vceqq_u8 (v2, last_u)));
+
+		if (vmaxvq_u8 (eq) == 0) {
+			continue;
+		}
+
+		/* There is no movemask in NEON, so candidates are checked bytewise */
+		vst1q_u8 (cand, eq);
+
+		for (bit = 0; bit < 16; bit ++) {
+			if (cand[bit] == 0) {
+				continue;
+			}
+
+			if (srchlen <= 2 || rspamd_lc_cmp_neon (in + i + bit + 1,
+					srch + 1, srchlen - 2) == 0) {
+				return i + bit;
+			}
+
+			ncandidates ++;
+		}
+
+		if (ncandidates > RSPAMD_STR_UTIL_MAX_CANDIDATES) {
+			break;
+		}
+	}
+
+	ret = rspamd_substring_search_caseless_ref (in + i, inlen - i,
+			srch, srchlen);
+
+	return ret == -1 ? -1 : ret + (goffset)i;
+}
+
+#endif
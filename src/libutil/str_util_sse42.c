@@ -0,0 +1,412 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "cryptobox.h"
+#include "str_util.h"
+#include "str_util_impl.h"
+
+#ifdef RSPAMD_HAS_TARGET_ATTR
+#pragma GCC push_options
+#pragma GCC target("sse4.2")
+#ifndef __SSE2__
+#define __SSE2__
+#endif
+#ifndef __SSE__
+#define __SSE__
+#endif
+#ifndef __SSE4_2__
+#define __SSE4_2__
+#endif
+#ifndef __SSE4_1__
+#define __SSE4_1__
+#endif
+#ifndef __SSEE3__
+#define __SSEE3__
+#endif
+#include <xmmintrin.h>
+#include <nmmintrin.h>
+
+static inline __m128i
+rspamd_lc_sse42 (__m128i v) __attribute__((__target__("sse4.2")));
+
+static inline __m128i
+rspamd_lc_sse42 (__m128i v)
+{
+	/* Signed comparison leaves all non ASCII characters untouched */
+	const __m128i before_a = _mm_set1_epi8 ('A' - 1),
+			after_z = _mm_set1_epi8 ('Z' + 1),
+			diff = _mm_set1_epi8 ('a' - 'A');
+	__m128i upper;
+
+	upper = _mm_and_si128 (_mm_cmpgt_epi8 (v, before_a),
+			_mm_cmplt_epi8 (v, after_z));
+
+	return _mm_add_epi8 (v, _mm_and_si128 (upper, diff));
+}
+
+void
+rspamd_str_lc_sse42 (gchar *str, guint size) __attribute__((__target__("sse4.2")));
+
+void
+rspamd_str_lc_sse42 (gchar *str, guint size)
+{
+	guint i;
+	__m128i v;
+
+	for (i = 0; i + 16 <= size; i += 16) {
+		v = _mm_loadu_si128 ((const __m128i *)(str + i));
+		_mm_storeu_si128 ((__m128i *)(str + i), rspamd_lc_sse42 (v));
+	}
+
+	rspamd_str_lc_ref (str + i, size - i);
+}
+
+gint
+rspamd_lc_cmp_sse42 (const gchar *s, const gchar *d, gsize l) __attribute__((__target__("sse4.2")));
+
+gint
+rspamd_lc_cmp_sse42 (const gchar *s, const gchar *d, gsize l)
+{
+	gsize i;
+	__m128i v1, v2;
+
+	for (i = 0; i + 16 <= l; i += 16) {
+		v1 = rspamd_lc_sse42 (_mm_loadu_si128 ((const __m128i *)(s + i)));
+		v2 = rspamd_lc_sse42 (_mm_loadu_si128 ((const __m128i *)(d + i)));
+
+		if (_mm_movemask_epi8 (_mm_cmpeq_epi8 (v1, v2)) != 0xffff) {
+			/* Let the generic code define the result for the difference */
+			break;
+		}
+	}
+
+	return rspamd_lc_cmp_ref (s + i, d + i, l - i);
+}
+
+gboolean
+rspamd_str_has_8bit_sse42 (const guchar *beg, gsize len) __attribute__((__target__("sse4.2")));
+
+gboolean
+rspamd_str_has_8bit_sse42 (const guchar *beg, gsize len)
+{
+	gsize i;
+	__m128i acc;
+
+	for (i = 0; i + 64 <= len; i += 64) {
+		acc = _mm_or_si128 (
+				_mm_or_si128 (_mm_loadu_si128 ((const __m128i *)(beg + i)),
+						_mm_loadu_si128 ((const __m128i *)(beg + i + 16))),
+				_mm_or_si128 (_mm_loadu_si128 ((const __m128i *)(beg + i + 32)),
+						_mm_loadu_si128 ((const __m128i *)(beg + i + 48))));
+
+		if (_mm_movemask_epi8 (acc) != 0) {
+			return TRUE;
+		}
+	}
+
+	for (; i + 16 <= len; i += 16) {
+		acc = _mm_loadu_si128 ((const __m128i *)(beg + i));
+
+		if (_mm_movemask_epi8 (acc) != 0) {
+			return TRUE;
+		}
+	}
+
+	return rspamd_str_has_8bit_ref (beg + i, len - i);
+}
+
+#define RSPAMD_SSE42_CSPN_MODE (_SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | \
+		_SIDD_LEAST_SIGNIFICANT)
+#define RSPAMD_SSE42_SPN_MODE (RSPAMD_SSE42_CSPN_MODE | _SIDD_NEGATIVE_POLARITY)
+
+gsize
+rspamd_memcspn_sse42 (const gchar *s, const gchar *e, gsize len) __attribute__((__target__("sse4.2")));
+
+gsize
+rspamd_memcspn_sse42 (const gchar *s, const gchar *e, gsize len)
+{
+	gchar setbuf[16];
+	gsize i, nset;
+	gint idx;
+	__m128i set, v;
+
+	nset = strlen (e);
+
+	if (nset < 2 || nset > sizeof (setbuf) || len < 16) {
+		return rspamd_memcspn_ref (s, e, len);
+	}
+
+	memset (setbuf, 0, sizeof (setbuf));
+	memcpy (setbuf, e, nset);
+	set = _mm_loadu_si128 ((const __m128i *)setbuf);
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128 ((const __m128i *)(s + i));
+		idx = _mm_cmpestri (set, nset, v, 16, RSPAMD_SSE42_CSPN_MODE);
+
+		if (idx != 16) {
+			return i + idx;
+		}
+	}
+
+	return i + rspamd_memcspn_ref (s + i, e, len - i);
+}
+
+gsize
+rspamd_memspn_sse42 (const gchar *s, const gchar *e, gsize len) __attribute__((__target__("sse4.2")));
+
+gsize
+rspamd_memspn_sse42 (const gchar *s, const gchar *e, gsize len)
+{
+	gchar setbuf[16];
+	gsize i, nset;
+	gint idx;
+	__m128i set, v;
+
+	nset = strlen (e);
+
+	if (nset < 2 || nset > sizeof (setbuf) || len < 16) {
+		return rspamd_memspn_ref (s, e, len);
+	}
+
+	memset (setbuf, 0, sizeof (setbuf));
+	memcpy (setbuf, e, nset);
+	set = _mm_loadu_si128 ((const __m128i *)setbuf);
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128 ((const __m128i *)(s + i));
+		idx = _mm_cmpestri (set, nset, v, 16, RSPAMD_SSE42_SPN_MODE);
+
+		if (idx != 16) {
+			return i + idx;
+		}
+	}
+
+	return i + rspamd_memspn_ref (s + i, e, len - i);
+}
+
+goffset
+rspamd_substring_search_caseless_sse42 (const gchar *in, gsize inlen,
+		const gchar *srch, gsize srchlen) __attribute__((__target__("sse4.2")));
+
+/*
+ * Candidates are the positions where both the first and the last characters
+ * of the pattern match, only these are compared with the whole pattern
+ */
+goffset
+rspamd_substring_search_caseless_sse42 (const gchar *in, gsize inlen,
+		const gchar *srch, gsize srchlen)
+{
+	gsize i, last, ncandidates = 0;
+	guchar first_lc, last_lc;
+	guint mask, bit;
+	goffset ret;
+	__m128i first_l, first_u, last_l, last_u, v1, v2, eq;
+
+	if (srchlen == 0 || inlen <= srchlen) {
+		return rspamd_substring_search_caseless_ref (in, inlen, srch, srchlen);
+	}
+
+	last = srchlen - 1;
+	first_lc = lc_map[(guchar)srch[0]];
+	last_lc = lc_map[(guchar)srch[last]];
+	first_l = _mm_set1_epi8 (first_lc);
+	first_u = _mm_set1_epi8 (g_ascii_toupper (first_lc));
+	last_l = _mm_set1_epi8 (last_lc);
+	last_u = _mm_set1_epi8 (g_ascii_toupper (last_lc));
+
+	for (i = 0; i + last + 16 <= inlen; i += 16) {
+		v1 = _mm_loadu_si128 ((const __m128i *)(in + i));
+		v2 = _mm_loadu_si128 ((const __m128i *)(in + i + last));
+		eq = _mm_and_si128 (
+				_mm_or_si128 (_mm_cmpeq_epi8 (v1, first_l),
+						_mm_cmpeq_epi8 (v1, first_u)),
+				_mm_or_si128 (_mm_cmpeq_epi8 (v2, last_l),
+						_mm_cmpeq_epi8 (v2, last_u)));
+		mask = _mm_movemask_epi8 (eq);
+
+		while (mask != 0) {
+			bit = __builtin_ctz (mask);
+
+			if (srchlen <= 2 || rspamd_lc_cmp_sse42 (in + i + bit + 1,
+					srch + 1, srchlen - 2) == 0) {
+				return i + bit;
+			}
+
+			mask &= mask - 1;
+			ncandidates ++;
+		}
+
+		if (ncandidates > RSPAMD_STR_UTIL_MAX_CANDIDATES) {
+			break;
+		}
+	}
+
+	ret = rspamd_substring_search_caseless_ref (in + i, inlen - i,
+			srch, srchlen);
+
+	return ret == -1 ? -1 : ret + (goffset)i;
+}
+
+/*
+ * UTF8 validation using lookup tables by the high and low nibbles of
+ * adjacent bytes (Keiser, Lemire: "Validating UTF-8 In Less Than One
+ * Instruction Per Byte")
+ */
+#define UTF8_TOO_SHORT (1 << 0)
+#define UTF8_TOO_LONG (1 << 1)
+#define UTF8_OVERLONG_3 (1 << 2)
+#define UTF8_TOO_LARGE (1 << 3)
+#define UTF8_SURROGATE (1 << 4)
+#define UTF8_OVERLONG_2 (1 << 5)
+#define UTF8_TOO_LARGE_1000 (1 << 6)
+#define UTF8_OVERLONG_4 (1 << 6)
+#define UTF8_TWO_CONTS (1 << 7)
+#define UTF8_CARRY (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+static inline __m128i
+rspamd_utf8_shr4_sse42 (__m128i v) __attribute__((__target__("sse4.2")));
+
+static inline __m128i
+rspamd_utf8_shr4_sse42 (__m128i v)
+{
+	return _mm_and_si128 (_mm_srli_epi16 (v, 4), _mm_set1_epi8 (0x0F));
+}
+
+static inline __m128i
+rspamd_utf8_check_block_sse42 (__m128i input, __m128i prev_input) __attribute__((__target__("sse4.2")));
+
+static inline __m128i
+rspamd_utf8_check_block_sse42 (__m128i input, __m128i prev_input)
+{
+	const __m128i byte_1_high_tbl = _mm_setr_epi8 (
+			UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+			UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+			UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+			UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+			UTF8_TOO_SHORT,
+			UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+			(gchar)(UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 |
+					UTF8_OVERLONG_4));
+	const __m128i byte_1_low_tbl = _mm_setr_epi8 (
+			(gchar)(UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 |
+					UTF8_OVERLONG_4),
+			(gchar)(UTF8_CARRY | UTF8_OVERLONG_2),
+			(gchar)UTF8_CARRY,
+			(gchar)UTF8_CARRY,
+			(gchar)(UTF8_CARRY | UTF8_TOO_LARGE),
+			(gchar)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+			(gchar)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+			(gchar)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+			(gchar)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+			(gchar)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+			(gchar)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+			(gchar)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+			(gchar)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+			(gchar)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 |
+					UTF8_SURROGATE),
+			(gchar)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+			(gchar)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000));
+	const __m128i byte_2_high_tbl = _mm_setr_epi8 (
+			UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+			UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+			(gchar)(UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS |
+					UTF8_OVERLONG_3 | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4),
+			(gchar)(UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS |
+					UTF8_OVERLONG_3 | UTF8_TOO_LARGE),
+			(gchar)(UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS |
+					UTF8_SURROGATE | UTF8_TOO_LARGE),
+			(gchar)(UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS |
+					UTF8_SURROGATE | UTF8_TOO_LARGE),
+			UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT);
+	__m128i prev1, prev2, prev3, sc, must23;
+
+	prev1 = _mm_alignr_epi8 (input, prev_input, 15);
+	sc = _mm_and_si128 (
+			_mm_and_si128 (
+					_mm_shuffle_epi8 (byte_1_high_tbl,
+							rspamd_utf8_shr4_sse42 (prev1)),
+					_mm_shuffle_epi8 (byte_1_low_tbl,
+							_mm_and_si128 (prev1, _mm_set1_epi8 (0x0F)))),
+			_mm_shuffle_epi8 (byte_2_high_tbl, rspamd_utf8_shr4_sse42 (input)));
+
+	/* Third and fourth bytes of sequences must be continuations */
+	prev2 = _mm_alignr_epi8 (input, prev_input, 14);
+	prev3 = _mm_alignr_epi8 (input, prev_input, 13);
+	must23 = _mm_or_si128 (
+			_mm_subs_epu8 (prev2, _mm_set1_epi8 ((gchar)(0xE0 - 0x80))),
+			_mm_subs_epu8 (prev3, _mm_set1_epi8 ((gchar)(0xF0 - 0x80))));
+	must23 = _mm_and_si128 (must23, _mm_set1_epi8 ((gchar)0x80));
+
+	return _mm_xor_si128 (must23, sc);
+}
+
+gsize
+rspamd_fast_utf8_validate_sse42 (const guchar *data, gsize len) __attribute__((__target__("sse4.2")));
+
+gsize
+rspamd_fast_utf8_validate_sse42 (const guchar *data, gsize len)
+{
+	gsize i, j, k;
+	const __m128i zero = _mm_setzero_si128 ();
+	/* Sequences started in the last 3 bytes that need more bytes */
+	const __m128i max_value = _mm_setr_epi8 (-1, -1, -1, -1, -1, -1, -1, -1,
+			-1, -1, -1, -1, -1, (gchar)(0xF0 - 1), (gchar)(0xE0 - 1),
+			(gchar)(0xC0 - 1));
+	__m128i input, err, prev_input = zero, prev_incomplete = zero;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		input = _mm_loadu_si128 ((const __m128i *)(data + i));
+		err = _mm_cmpeq_epi8 (input, zero);
+
+		if (_mm_movemask_epi8 (input) == 0) {
+			/* ASCII block is valid unless previous one is incomplete */
+			err = _mm_or_si128 (err, prev_incomplete);
+			prev_incomplete = zero;
+		}
+		else {
+			err = _mm_or_si128 (err,
+					rspamd_utf8_check_block_sse42 (input, prev_input));
+			prev_incomplete = _mm_subs_epu8 (input, max_value);
+		}
+
+		if (!_mm_testz_si128 (err, err)) {
+			break;
+		}
+
+		prev_input = input;
+	}
+
+	/*
+	 * Input before `i` is valid except for a sequence that might continue
+	 * past it, so let the generic code find the exact position starting from
+	 * the last character boundary
+	 */
+	j = i;
+
+	for (k = 1; k <= 3 && k <= i; k ++) {
+		if ((data[i - k] & 0xC0) != 0x80) {
+			j = i - k;
+			break;
+		}
+	}
+
+	return j + rspamd_fast_utf8_validate_ref (data + j, len - j);
+}
+
+#pragma GCC pop_options
+#endif
@@ -0,0 +1,217 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "timer_wheel.h"
+#include "util.h"
+#include "utlist.h"
+#include <math.h>
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1u << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 3
+/* Timers that are further than this are parked in the last slot */
+#define WHEEL_MAX_DELTA ((G_GUINT64_CONSTANT (1) << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+struct rspamd_timer_wheel {
+	struct rspamd_wheel_timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+	struct event_base *base;
+	struct event tick_ev;
+	guint64 cur; /* the last processed tick */
+	guint count;
+	gboolean ticking;
+};
+
+static inline guint64
+rspamd_timer_wheel_now (void)
+{
+	return rspamd_get_ticks (FALSE) / RSPAMD_TIMER_WHEEL_TICK;
+}
+
+static void
+rspamd_timer_wheel_insert (struct rspamd_timer_wheel *wheel,
+		struct rspamd_wheel_timer *t)
+{
+	guint64 delta, expire = t->expire;
+	guint level, slot;
+
+	delta = expire > wheel->cur ? expire - wheel->cur : 0;
+
+	if (delta > WHEEL_MAX_DELTA) {
+		/* Will be moved to a proper slot on cascading */
+		delta = WHEEL_MAX_DELTA;
+		expire = wheel->cur + delta;
+	}
+
+	if (delta < WHEEL_SLOTS) {
+		/* Expired timers are cascaded to the slot being processed */
+		level = 0;
+		slot = (delta == 0 ? wheel->cur : expire) & WHEEL_MASK;
+	}
+	else if (delta < (1u << (WHEEL_BITS * 2))) {
+		level = 1;
+		slot = (expire >> WHEEL_BITS) & WHEEL_MASK;
+	}
+	else {
+		level = 2;
+		slot = (expire >> (WHEEL_BITS * 2)) & WHEEL_MASK;
+	}
+
+	t->wheel = wheel;
+	t->slot = &wheel->slots[level][slot];
+	DL_APPEND (*t->slot, t);
+}
+
+static void
+rspamd_timer_wheel_cascade (struct rspamd_timer_wheel *wheel, guint level,
+		guint slot)
+{
+	struct rspamd_wheel_timer *head, *t, *tmp;
+
+	head = wheel->slots[level][slot];
+	wheel->slots[level][slot] = NULL;
+
+	DL_FOREACH_SAFE (head, t, tmp) {
+		t->prev = NULL;
+		t->next = NULL;
+		rspamd_timer_wheel_insert (wheel, t);
+	}
+}
+
+static void
+rspamd_timer_wheel_tick (gint fd, short what, gpointer ud)
+{
+	struct rspamd_timer_wheel *wheel = ud;
+	struct rspamd_wheel_timer *t, **slot;
+	guint64 now = rspamd_timer_wheel_now ();
+
+	while (wheel->cur < now && wheel->count > 0) {
+		wheel->cur ++;
+
+		if ((wheel->cur & WHEEL_MASK) == 0) {
+			if (((wheel->cur >> WHEEL_BITS) & WHEEL_MASK) == 0) {
+				rspamd_timer_wheel_cascade (wheel, 2,
+						(wheel->cur >> (WHEEL_BITS * 2)) & WHEEL_MASK);
+			}
+
+			rspamd_timer_wheel_cascade (wheel, 1,
+					(wheel->cur >> WHEEL_BITS) & WHEEL_MASK);
+		}
+
+		slot = &wheel->slots[0][wheel->cur & WHEEL_MASK];
+
+		/* Callbacks can add or remove any timers including ones in this slot */
+		while ((t = *slot) != NULL) {
+			DL_DELETE (*slot, t);
+			t->wheel = NULL;
+			t->slot = NULL;
+			wheel->count --;
+
+			if (t->cb) {
+				t->cb (t->ud);
+			}
+		}
+	}
+
+	if (wheel->count == 0 && wheel->ticking) {
+		event_del (&wheel->tick_ev);
+		wheel->ticking = FALSE;
+	}
+}
+
+struct rspamd_timer_wheel *
+rspamd_timer_wheel_get (struct event_base *base)
+{
+	static GHashTable *wheels = NULL;
+	static struct rspamd_timer_wheel *last = NULL;
+	struct rspamd_timer_wheel *wheel;
+
+	if (last != NULL && last->base == base) {
+		return last;
+	}
+
+	if (wheels == NULL) {
+		wheels = g_hash_table_new (g_direct_hash, g_direct_equal);
+	}
+
+	wheel = g_hash_table_lookup (wheels, base);
+
+	if (wheel == NULL) {
+		wheel = g_malloc0 (sizeof (*wheel));
+		wheel->base = base;
+		event_set (&wheel->tick_ev, -1, EV_TIMEOUT|EV_PERSIST,
+				rspamd_timer_wheel_tick, wheel);
+
+		if (base != NULL) {
+			event_base_set (base, &wheel->tick_ev);
+		}
+
+		g_hash_table_insert (wheels, base, wheel);
+	}
+
+	last = wheel;
+
+	return wheel;
+}
+
+void
+rspamd_wheel_timer_init (struct rspamd_wheel_timer *t,
+		rspamd_wheel_timer_cb cb, gpointer ud)
+{
+	memset (t, 0, sizeof (*t));
+	t->cb = cb;
+	t->ud = ud;
+}
+
+void
+rspamd_wheel_timer_add (struct rspamd_timer_wheel *wheel,
+		struct rspamd_wheel_timer *t, gdouble after)
+{
+	struct timeval tv;
+	guint64 now, ticks;
+
+	g_assert (wheel != NULL);
+	rspamd_wheel_timer_del (t);
+	now = rspamd_timer_wheel_now ();
+
+	if (!wheel->ticking) {
+		/* Nothing is pending, so idle ticks are skipped */
+		wheel->cur = now;
+		double_to_tv (RSPAMD_TIMER_WHEEL_TICK, &tv);
+		event_add (&wheel->tick_ev, &tv);
+		wheel->ticking = TRUE;
+	}
+
+	ticks = after > 0 ? ceil (after / RSPAMD_TIMER_WHEEL_TICK) : 0;
+	t->expire = now + MAX (ticks, 1);
+	t->prev = NULL;
+	t->next = NULL;
+	rspamd_timer_wheel_insert (wheel, t);
+	wheel->count ++;
+}
+
+void
+rspamd_wheel_timer_del (struct rspamd_wheel_timer *t)
+{
+	struct rspamd_timer_wheel *wheel = t->wheel;
+
+	if (wheel == NULL) {
+		return;
+	}
+
+	DL_DELETE (*t->slot, t);
+	t->wheel = NULL;
+	t->slot = NULL;
+	wheel->count --;
+}
@@ -0,0 +1,87 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SRC_LIBUTIL_TIMER_WHEEL_H_
+#define SRC_LIBUTIL_TIMER_WHEEL_H_
+
+#include "config.h"
+#include <event.h>
+
+/**
+ * Hierarchical timer wheel for coarse timeouts, such as network timeouts,
+ * that are mostly rescheduled or removed before they fire. Adding, moving
+ * and removing of a timer are O(1) and there is a single libevent timer per
+ * event base, that ticks merely when some timers are pending.
+ *
+ * Timers never fire earlier than requested but they can fire up to
+ * RSPAMD_TIMER_WHEEL_TICK later.
+ */
+
+/* Granularity of the wheel in seconds */
+#define RSPAMD_TIMER_WHEEL_TICK 0.1
+
+struct rspamd_timer_wheel;
+
+typedef void (*rspamd_wheel_timer_cb) (gpointer ud);
+
+/* Timer is supposed to be embedded into a structure of its user */
+struct rspamd_wheel_timer {
+	struct rspamd_wheel_timer *prev, *next;
+	struct rspamd_wheel_timer **slot; /* list head where the timer is linked */
+	struct rspamd_timer_wheel *wheel;
+	guint64 expire;
+	rspamd_wheel_timer_cb cb;
+	gpointer ud;
+};
+
+/**
+ * Returns timer wheel for the event base specified, the wheel is created
+ * on the first call and is never destroyed
+ * @param base event base (NULL for the default one)
+ * @return
+ */
+struct rspamd_timer_wheel *rspamd_timer_wheel_get (struct event_base *base);
+
+/**
+ * Initialises timer, zeroed timer structure is also valid but it has no
+ * callback set
+ */
+void rspamd_wheel_timer_init (struct rspamd_wheel_timer *t,
+		rspamd_wheel_timer_cb cb, gpointer ud);
+
+/**
+ * Schedules timer to fire after `after` seconds, if a timer is pending it is
+ * rescheduled
+ * @param wheel
+ * @param t
+ * @param after
+ */
+void rspamd_wheel_timer_add (struct rspamd_timer_wheel *wheel,
+		struct rspamd_wheel_timer *t, gdouble after);
+
+/**
+ * Removes timer if it is pending
+ * @param t
+ */
+void rspamd_wheel_timer_del (struct rspamd_wheel_timer *t);
+
+/**
+ * Returns TRUE if a timer is scheduled
+ */
+static inline gboolean
+rspamd_wheel_timer_pending (struct rspamd_wheel_timer *t)
+{
+	return t->wheel != NULL;
+}
+
+#endif /* SRC_LIBUTIL_TIMER_WHEEL_H_ */
@@ -34,16 +34,24 @@ struct upstream_addr_elt {
 	guint errors;
 };
 
+/* Number of recent latency samples used to estimate percentiles */
+#define UPSTREAM_LATENCY_SAMPLES 64
+
 struct upstream {
 	guint weight;
 	guint cur_weight;
 	guint errors;
 	guint checked;
 	guint dns_requests;
+	guint inflight;
 	gint active_idx;
 	gchar *name;
 	struct event ev;
 	gdouble last_fail;
+	gdouble latency;
+	gdouble latency_samples[UPSTREAM_LATENCY_SAMPLES];
+	guint nlatency;
+	guint64 name_hash;
 	gpointer ud;
 	struct upstream_list *ls;
 	GList *ctx_pos;
@@ -106,6 +114,16 @@ static gdouble default_revive_jitter = 0.4;
 static gdouble default_error_time = 10;
 static gdouble default_dns_timeout = 1.0;
 static guint default_dns_retransmits = 2;
+/* Weight of the new sample for latency moving average */
+static gdouble latency_ewma_alpha = 0.3;
+/*
+ * Upstream is ejected as an outlier when its average latency is this many
+ * times more than the median latency of its alive peers
+ */
+static gdouble outlier_latency_factor = 3.0;
+static guint outlier_min_samples = 16;
+/* Upstream could have up to this times more requests than the average */
+static gdouble rendezvous_load_factor = 1.25;
 
 void
 rspamd_upstreams_library_config (struct rspamd_config *cfg,
@@ -514,6 +532,145 @@ rspamd_upstream_ok (struct upstream *up)
 	RSPAMD_UPSTREAM_UNLOCK (up->lock);
 }
 
+void
+rspamd_upstream_request_start (struct upstream *up)
+{
+	RSPAMD_UPSTREAM_LOCK (up->lock);
+	up->inflight ++;
+	RSPAMD_UPSTREAM_UNLOCK (up->lock);
+}
+
+static gint
+rspamd_upstream_latency_cmp (const void *a, const void *b)
+{
+	gdouble d1 = *(const gdouble *)a, d2 = *(const gdouble *)b;
+
+	return d1 < d2 ? -1 : (d1 > d2 ? 1 : 0);
+}
+
+/*
+ * Passive outlier detection: an upstream that is much slower than the median
+ * of its peers is removed from the alive list for the usual revive time,
+ * however, the majority of upstreams is always left alive
+ */
+static void
+rspamd_upstream_check_outlier (struct upstream *up)
+{
+	struct upstream_list *ls = up->ls;
+	struct upstream *cur;
+	gdouble *peers, median;
+	guint i, npeers = 0;
+
+	if (ls == NULL || up->ctx == NULL || up->active_idx == -1 ||
+			up->nlatency < outlier_min_samples ||
+			ls->alive->len < 3 || ls->alive->len * 2 <= ls->ups->len) {
+		return;
+	}
+
+	peers = g_alloca (sizeof (*peers) * ls->alive->len);
+
+	for (i = 0; i < ls->alive->len; i ++) {
+		cur = g_ptr_array_index (ls->alive, i);
+
+		if (cur != up && cur->nlatency >= outlier_min_samples) {
+			peers[npeers ++] = cur->latency;
+		}
+	}
+
+	if (npeers < 2) {
+		return;
+	}
+
+	qsort (peers, npeers, sizeof (*peers), rspamd_upstream_latency_cmp);
+	median = peers[npeers / 2];
+
+	if (median > 0 && up->latency > median * outlier_latency_factor) {
+		/* Latency is measured from scratch after revival */
+		up->latency = 0;
+		up->nlatency = 0;
+		up->errors = 0;
+		rspamd_upstream_set_inactive (ls, up);
+	}
+}
+
+void
+rspamd_upstream_latency (struct upstream *up, gdouble elapsed)
+{
+	if (elapsed < 0) {
+		return;
+	}
+
+	RSPAMD_UPSTREAM_LOCK (up->lock);
+
+	if (up->latency == 0) {
+		up->latency = elapsed;
+	}
+	else {
+		up->latency += latency_ewma_alpha * (elapsed - up->latency);
+	}
+
+	up->latency_samples[up->nlatency % UPSTREAM_LATENCY_SAMPLES] = elapsed;
+	up->nlatency ++;
+
+	if (up->nlatency == G_MAXUINT) {
+		/* Keep position in the ring buffer */
+		up->nlatency = UPSTREAM_LATENCY_SAMPLES;
+	}
+
+	rspamd_upstream_check_outlier (up);
+	RSPAMD_UPSTREAM_UNLOCK (up->lock);
+}
+
+void
+rspamd_upstream_request_finish (struct upstream *up, gdouble elapsed)
+{
+	RSPAMD_UPSTREAM_LOCK (up->lock);
+
+	if (up->inflight > 0) {
+		up->inflight --;
+	}
+
+	RSPAMD_UPSTREAM_UNLOCK (up->lock);
+
+	rspamd_upstream_latency (up, elapsed);
+}
+
+gdouble
+rspamd_upstream_get_latency (struct upstream *up)
+{
+	return up->latency;
+}
+
+gdouble
+rspamd_upstream_get_latency_p95 (struct upstream *up)
+{
+	gdouble samples[UPSTREAM_LATENCY_SAMPLES];
+	guint n;
+
+	n = MIN (up->nlatency, UPSTREAM_LATENCY_SAMPLES);
+
+	if (n == 0) {
+		return 0;
+	}
+
+	memcpy (samples, up->latency_samples, n * sizeof (samples[0]));
+	qsort (samples, n, sizeof (samples[0]), rspamd_upstream_latency_cmp);
+
+	return samples[(n * 95 - 1) / 100];
+}
+
+gboolean
+rspamd_upstream_is_alive (struct upstream *up)
+{
+	return up->active_idx != -1;
+}
+
+guint
+rspamd_upstream_get_errors (struct upstream *up)
+{
+	return up->errors;
+}
+
 void
 rspamd_upstream_set_weight (struct upstream *up, guint weight)
 {
@@ -690,6 +847,9 @@ rspamd_upstreams_add_upstream (struct upstream_list *ups, const gchar *str,
 	g_ptr_array_add (ups->ups, up);
 	up->ud = data;
 	up->cur_weight = up->weight;
+	up->name_hash = rspamd_cryptobox_fast_hash_specific (
+			RSPAMD_CRYPTOBOX_XXHASH64, up->name, strlen (up->name),
+			ups->hash_seed);
 	up->ls = ups;
 	REF_INIT_RETAIN (up, rspamd_upstream_dtor);
 	up->lock = rspamd_mutex_new ();
@@ -722,6 +882,38 @@ rspamd_upstreams_set_rotation (struct upstream_list *ups,
 	ups->rot_alg = rot;
 }
 
+gboolean
+rspamd_upstreams_parse_rotation (const gchar *str,
+		enum rspamd_upstream_rotation *rot)
+{
+	if (g_ascii_strcasecmp (str, "random") == 0) {
+		*rot = RSPAMD_UPSTREAM_RANDOM;
+	}
+	else if (g_ascii_strcasecmp (str, "hash") == 0) {
+		*rot = RSPAMD_UPSTREAM_HASHED;
+	}
+	else if (g_ascii_strcasecmp (str, "round-robin") == 0) {
+		*rot = RSPAMD_UPSTREAM_ROUND_ROBIN;
+	}
+	else if (g_ascii_strcasecmp (str, "master-slave") == 0) {
+		*rot = RSPAMD_UPSTREAM_MASTER_SLAVE;
+	}
+	else if (g_ascii_strcasecmp (str, "sequential") == 0) {
+		*rot = RSPAMD_UPSTREAM_SEQUENTIAL;
+	}
+	else if (g_ascii_strcasecmp (str, "least-loaded") == 0) {
+		*rot = RSPAMD_UPSTREAM_LEAST_LOADED;
+	}
+	else if (g_ascii_strcasecmp (str, "rendezvous") == 0) {
+		*rot = RSPAMD_UPSTREAM_RENDEZVOUS;
+	}
+	else {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 gboolean
 rspamd_upstream_add_addr (struct upstream *up, rspamd_inet_addr_t *addr)
 {
@@ -779,6 +971,18 @@ rspamd_upstreams_parse_line (struct upstream_list *ups,
 		ups->rot_alg = RSPAMD_UPSTREAM_SEQUENTIAL;
 		p += sizeof ("sequential:") - 1;
 	}
+	else if (g_ascii_strncasecmp (p,
+			"least-loaded:",
+			sizeof ("least-loaded:") - 1) == 0) {
+		ups->rot_alg = RSPAMD_UPSTREAM_LEAST_LOADED;
+		p += sizeof ("least-loaded:") - 1;
+	}
+	else if (g_ascii_strncasecmp (p,
+			"rendezvous:",
+			sizeof ("rendezvous:") - 1) == 0) {
+		ups->rot_alg = RSPAMD_UPSTREAM_RENDEZVOUS;
+		p += sizeof ("rendezvous:") - 1;
+	}
 
 	while (p < end) {
 		len = strcspn (p, separators);
@@ -938,7 +1142,7 @@ rspamd_upstream_get_round_robin (struct upstream_list *ups, gboolean use_cur)
  *
  * http://arxiv.org/abs/1406.2294
  */
-static guint32
+guint32
 rspamd_consistent_hash (guint64 key, guint32 nbuckets)
 {
 	gint64 b = -1, j = 0;
@@ -969,6 +1173,107 @@ rspamd_upstream_get_hashed (struct upstream_list *ups, const guint8 *key, guint
 	return g_ptr_array_index (ups->alive, idx);
 }
 
+/* Expected wait for a new request sent to this upstream */
+static inline gdouble
+rspamd_upstream_load_cost (struct upstream *up)
+{
+	return up->latency * (up->inflight + 1);
+}
+
+/*
+ * Power of two choices: select two random alive upstreams and take the one
+ * with the lower cost, which avoids herding on a single fast upstream
+ */
+static struct upstream*
+rspamd_upstream_get_least_loaded (struct upstream_list *ups)
+{
+	struct upstream *first, *second;
+	guint i, j;
+	gdouble c1, c2;
+
+	RSPAMD_UPSTREAM_LOCK (ups->lock);
+
+	if (ups->alive->len == 1) {
+		first = g_ptr_array_index (ups->alive, 0);
+		RSPAMD_UPSTREAM_UNLOCK (ups->lock);
+
+		return first;
+	}
+
+	i = ottery_rand_range (ups->alive->len - 1);
+	j = ottery_rand_range (ups->alive->len - 2);
+
+	if (j >= i) {
+		j ++;
+	}
+
+	first = g_ptr_array_index (ups->alive, i);
+	second = g_ptr_array_index (ups->alive, j);
+	RSPAMD_UPSTREAM_UNLOCK (ups->lock);
+
+	if (first->latency == 0 || second->latency == 0) {
+		/* No latency measured yet, prefer less outstanding requests */
+		return second->inflight < first->inflight ? second : first;
+	}
+
+	c1 = rspamd_upstream_load_cost (first);
+	c2 = rspamd_upstream_load_cost (second);
+
+	return c2 < c1 ? second : first;
+}
+
+/*
+ * Weighted rendezvous hashing with bounded loads: every upstream gets a score
+ * for a key and the best scored upstream is selected unless it has more
+ * requests in flight than `rendezvous_load_factor` times the average one.
+ * When an upstream dies, only its own keys are moved to other upstreams.
+ */
+static struct upstream*
+rspamd_upstream_get_rendezvous (struct upstream_list *ups, const guint8 *key,
+		guint keylen)
+{
+	struct upstream *up, *best = NULL, *best_bounded = NULL;
+	guint64 k, h;
+	guint i, total_inflight = 0;
+	gdouble score, best_score = -1, best_bounded_score = -1, bound, u;
+
+	k = rspamd_cryptobox_fast_hash_specific (RSPAMD_CRYPTOBOX_XXHASH64,
+			key, keylen, ups->hash_seed);
+
+	RSPAMD_UPSTREAM_LOCK (ups->lock);
+
+	for (i = 0; i < ups->alive->len; i ++) {
+		up = g_ptr_array_index (ups->alive, i);
+		total_inflight += up->inflight;
+	}
+
+	bound = ceil (rendezvous_load_factor * (total_inflight + 1) /
+			(gdouble)ups->alive->len);
+
+	for (i = 0; i < ups->alive->len; i ++) {
+		up = g_ptr_array_index (ups->alive, i);
+		h = rspamd_cryptobox_fast_hash_specific (RSPAMD_CRYPTOBOX_XXHASH64,
+				&k, sizeof (k), up->name_hash);
+		/* Uniform value in (0, 1) */
+		u = ((h >> 11) + 0.5) / (gdouble)(1ULL << 53);
+		score = -(gdouble)MAX (up->weight, 1) / log (u);
+
+		if (score > best_score) {
+			best_score = score;
+			best = up;
+		}
+
+		if (up->inflight < bound && score > best_bounded_score) {
+			best_bounded_score = score;
+			best_bounded = up;
+		}
+	}
+
+	RSPAMD_UPSTREAM_UNLOCK (ups->lock);
+
+	return best_bounded ? best_bounded : best;
+}
+
 static struct upstream*
 rspamd_upstream_get_common (struct upstream_list *ups,
 		enum rspamd_upstream_rotation default_type,
@@ -991,7 +1296,8 @@ rspamd_upstream_get_common (struct upstream_list *ups,
 		type = default_type != RSPAMD_UPSTREAM_UNDEF ? default_type : ups->rot_alg;
 	}
 
-	if (type == RSPAMD_UPSTREAM_HASHED && (keylen == 0 || key == NULL)) {
+	if ((type == RSPAMD_UPSTREAM_HASHED || type == RSPAMD_UPSTREAM_RENDEZVOUS) &&
+			(keylen == 0 || key == NULL)) {
 		/* Cannot use hashed rotation when no key is specified, switch to random */
 		type = RSPAMD_UPSTREAM_RANDOM;
 	}
@@ -1010,6 +1316,12 @@ rspamd_upstream_get_common (struct upstream_list *ups,
 	case RSPAMD_UPSTREAM_MASTER_SLAVE:
 		up = rspamd_upstream_get_round_robin (ups, FALSE);
 		break;
+	case RSPAMD_UPSTREAM_LEAST_LOADED:
+		up = rspamd_upstream_get_least_loaded (ups);
+		break;
+	case RSPAMD_UPSTREAM_RENDEZVOUS:
+		up = rspamd_upstream_get_rendezvous (ups, key, keylen);
+		break;
 	case RSPAMD_UPSTREAM_SEQUENTIAL:
 		if (ups->cur_elt >= ups->alive->len) {
 			ups->cur_elt = 0;
@@ -1090,6 +1402,18 @@ rspamd_upstreams_foreach (struct upstream_list *ups,
 	}
 }
 
+void
+rspamd_upstream_ctx_foreach (struct upstream_ctx *ctx,
+		rspamd_upstream_traverse_func cb, void *ud)
+{
+	GList *cur;
+	guint i = 0;
+
+	for (cur = ctx->upstreams->head; cur != NULL; cur = g_list_next (cur)) {
+		cb (cur->data, i ++, ud);
+	}
+}
+
 void
 rspamd_upstreams_set_limits (struct upstream_list *ups,
 								  gdouble revive_time,
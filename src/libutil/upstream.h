@@ -12,6 +12,8 @@ enum rspamd_upstream_rotation {
 	RSPAMD_UPSTREAM_ROUND_ROBIN,
 	RSPAMD_UPSTREAM_MASTER_SLAVE,
 	RSPAMD_UPSTREAM_SEQUENTIAL,
+	RSPAMD_UPSTREAM_LEAST_LOADED,
+	RSPAMD_UPSTREAM_RENDEZVOUS,
 	RSPAMD_UPSTREAM_UNDEF
 };
 
@@ -62,6 +64,59 @@ void rspamd_upstream_fail (struct upstream *up, gboolean addr_failure);
  */
 void rspamd_upstream_ok (struct upstream *up);
 
+/**
+ * Marks that a request has been sent to an upstream, used by
+ * `RSPAMD_UPSTREAM_LEAST_LOADED` rotation
+ * @param up
+ */
+void rspamd_upstream_request_start (struct upstream *up);
+
+/**
+ * Marks that a request to an upstream has been finished
+ * @param up
+ * @param elapsed time of request in seconds, negative value means that
+ * no latency should be accounted (e.g. request has been aborted)
+ */
+void rspamd_upstream_request_finish (struct upstream *up, gdouble elapsed);
+
+/**
+ * Accounts latency of a request to an upstream that is used for
+ * `RSPAMD_UPSTREAM_LEAST_LOADED` rotation and for ejection of upstreams that
+ * are much slower than their peers
+ * @param up
+ * @param elapsed time of request in seconds, negative values are ignored
+ */
+void rspamd_upstream_latency (struct upstream *up, gdouble elapsed);
+
+/**
+ * Returns moving average of the upstream latency in seconds (0 if unknown)
+ * @param up
+ * @return
+ */
+gdouble rspamd_upstream_get_latency (struct upstream *up);
+
+/**
+ * Returns 95th percentile of the recent upstream latencies in seconds
+ * (0 if unknown)
+ * @param up
+ * @return
+ */
+gdouble rspamd_upstream_get_latency_p95 (struct upstream *up);
+
+/**
+ * Returns TRUE if an upstream is in the alive list
+ * @param up
+ * @return
+ */
+gboolean rspamd_upstream_is_alive (struct upstream *up);
+
+/**
+ * Returns number of errors counted for an upstream during error time
+ * @param up
+ * @return
+ */
+guint rspamd_upstream_get_errors (struct upstream *up);
+
 /**
  * Set weight for an upstream
  * @param up
@@ -108,6 +163,15 @@ void rspamd_upstreams_set_limits (struct upstream_list *ups,
 void rspamd_upstreams_set_rotation (struct upstream_list *ups,
 		enum rspamd_upstream_rotation rot);
 
+/**
+ * Parses rotation name, e.g. "round-robin" or "least-loaded"
+ * @param str
+ * @param rot
+ * @return TRUE if rotation name is known
+ */
+gboolean rspamd_upstreams_parse_rotation (const gchar *str,
+		enum rspamd_upstream_rotation *rot);
+
 /**
  * Destroy list of upstreams
  * @param ups
@@ -181,6 +245,15 @@ typedef void (*rspamd_upstream_traverse_func) (struct upstream *up, guint idx,
 void rspamd_upstreams_foreach (struct upstream_list *ups,
 		rspamd_upstream_traverse_func cb, void *ud);
 
+/**
+ * Traverse all upstreams created within the upstreams library context
+ * @param ctx
+ * @param cb
+ * @param ud
+ */
+void rspamd_upstream_ctx_foreach (struct upstream_ctx *ctx,
+		rspamd_upstream_traverse_func cb, void *ud);
+
 /**
  * Returns the current IP address of the upstream
  * @param up
@@ -238,6 +311,15 @@ struct upstream* rspamd_upstream_get_forced (struct upstream_list *ups,
 		enum rspamd_upstream_rotation forced_type,
 		const guchar *key, gsize keylen);
 
+/**
+ * Maps key to one of `nbuckets` buckets, so that only 1/n of keys are moved
+ * when a bucket is appended
+ * @param key hashed key
+ * @param nbuckets number of buckets
+ * @return bucket index
+ */
+guint32 rspamd_consistent_hash (guint64 key, guint32 nbuckets);
+
 /**
  * Re-resolve addresses for all upstreams registered
  */
@@ -1856,6 +1856,47 @@ rspamd_get_ticks (gboolean rdtsc_ok)
 	return res;
 }
 
+/* Number of `rspamd_get_ticks (TRUE)` units per second */
+static gdouble
+rspamd_ticks_calibrate (void)
+{
+#if defined(HAVE_RDTSC) && defined(__x86_64__) && defined(HAVE_CLOCK_GETTIME)
+	struct timespec ts1, ts2;
+	gdouble t1, t2, elapsed;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts1);
+	t1 = rspamd_get_ticks (TRUE);
+
+	/* Spin for a few milliseconds to measure tsc frequency */
+	do {
+		clock_gettime (CLOCK_MONOTONIC, &ts2);
+		elapsed = (ts2.tv_sec - ts1.tv_sec) +
+				(ts2.tv_nsec - ts1.tv_nsec) / 1000000000.;
+	} while (elapsed < 0.005);
+
+	t2 = rspamd_get_ticks (TRUE);
+
+	if (t2 > t1) {
+		return (t2 - t1) / elapsed;
+	}
+#endif
+
+	/* Nanoseconds are used when rdtsc is not available */
+	return 1e9;
+}
+
+gdouble
+rspamd_ticks_to_seconds (gdouble ticks)
+{
+	static gdouble ticks_per_second = 0;
+
+	if (G_UNLIKELY (ticks_per_second == 0)) {
+		ticks_per_second = rspamd_ticks_calibrate ();
+	}
+
+	return ticks / ticks_per_second;
+}
+
 gdouble
 rspamd_get_virtual_ticks (void)
 {
@@ -302,6 +302,14 @@ gint rspamd_read_passphrase (gchar *buf, gint size, gint rwflag, gpointer key);
  */
 gdouble rspamd_get_ticks (gboolean rdtsc_ok);
 
+/**
+ * Converts a difference of `rspamd_get_ticks (TRUE)` values to seconds,
+ * rdtsc frequency is calibrated on the first call
+ * @param ticks
+ * @return
+ */
+gdouble rspamd_ticks_to_seconds (gdouble ticks);
+
 /**
  * Portably return the current virtual clock ticks as seconds
  * @return
@@ -0,0 +1,226 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "lua_common.h"
+#include "lua_thread_pool.h"
+
+/***
+ * @module rspamd_async
+ * This module allows to run several functions that use coroutines based
+ * requests (e.g. `rspamd_http.request` or `rspamd_dns.request` with no callback)
+ * in parallel and to wait for all of them. Each function is executed in its own
+ * coroutine from the shared threads pool.
+ * @example
+local rspamd_async = require "rspamd_async"
+local rspamd_dns = require "rspamd_dns"
+
+local function cb(task)
+  local res, errors = rspamd_async.all(task, {
+    function(t) return rspamd_dns.request({task = t, type = 'a', name = 'example.com'}) end,
+    function(t) return rspamd_dns.request({task = t, type = 'mx', name = 'example.com'}) end,
+  })
+  -- res[1] = {is_ok, results} for the first request and so on
+end
+ */
+
+/***
+ * @function rspamd_async.all(task, functions)
+ * Starts each function from the list in a separate coroutine passing task as
+ * the only argument and yields until all of them are finished. This function
+ * must be called from a coroutine (e.g. from a symbol callback).
+ * @param {rspamd_task} task task object
+ * @param {table} functions list of functions to execute
+ * @return {table,table} values returned by each function packed in tables and errors indexed the same way
+ */
+LUA_FUNCTION_DEF (async, all);
+
+static const struct luaL_reg asynclib_f[] = {
+	LUA_INTERFACE_DEF (async, all),
+	{NULL, NULL}
+};
+
+struct lua_async_all_cbdata {
+	struct rspamd_task *task;
+	struct thread_entry *parent;
+	gint results_ref;
+	gint errors_ref;
+	guint pending;
+	gboolean waiting;
+};
+
+struct lua_async_child {
+	struct lua_async_all_cbdata *cbd;
+	guint idx;
+	gint stack_level;
+};
+
+static gint
+lua_async_all_push_results (lua_State *L, struct lua_async_all_cbdata *cbd)
+{
+	lua_rawgeti (L, LUA_REGISTRYINDEX, cbd->results_ref);
+	luaL_unref (L, LUA_REGISTRYINDEX, cbd->results_ref);
+	lua_rawgeti (L, LUA_REGISTRYINDEX, cbd->errors_ref);
+	luaL_unref (L, LUA_REGISTRYINDEX, cbd->errors_ref);
+
+	return 2;
+}
+
+static void
+lua_async_child_done (struct lua_async_all_cbdata *cbd)
+{
+	g_assert (cbd->pending > 0);
+	cbd->pending --;
+
+	if (cbd->pending == 0 && cbd->waiting) {
+		/* All children are finished, so parent can continue */
+		cbd->waiting = FALSE;
+		lua_thread_resume (cbd->parent,
+				lua_async_all_push_results (cbd->parent->lua_state, cbd));
+	}
+}
+
+static void
+lua_async_child_finish (struct thread_entry *thread, int ret)
+{
+	struct lua_async_child *child = thread->cd;
+	struct lua_async_all_cbdata *cbd = child->cbd;
+	lua_State *L = thread->lua_state;
+	gint nresults, i;
+
+	(void)ret;
+
+	nresults = lua_gettop (L) - child->stack_level;
+	lua_rawgeti (L, LUA_REGISTRYINDEX, cbd->results_ref);
+	lua_createtable (L, nresults, 0);
+
+	for (i = 1; i <= nresults; i ++) {
+		lua_pushvalue (L, child->stack_level + i);
+		lua_rawseti (L, -2, i);
+	}
+
+	lua_rawseti (L, -2, child->idx);
+	lua_settop (L, child->stack_level);
+
+	lua_async_child_done (cbd);
+}
+
+static void
+lua_async_child_error (struct thread_entry *thread, int ret, const char *msg)
+{
+	struct lua_async_child *child = thread->cd;
+	struct lua_async_all_cbdata *cbd = child->cbd;
+	struct rspamd_task *task = cbd->task;
+	/* Failed thread is going to be terminated, so use the main state */
+	lua_State *L = task->cfg->lua_state;
+
+	msg_err_task ("call to async function %d failed (%d): %s",
+			child->idx, ret, msg);
+
+	lua_rawgeti (L, LUA_REGISTRYINDEX, cbd->errors_ref);
+	lua_pushstring (L, msg);
+	lua_rawseti (L, -2, child->idx);
+	lua_pop (L, 1);
+
+	lua_async_child_done (cbd);
+}
+
+static gint
+lua_async_all (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_task *task = lua_check_task (L, 1), **ptask;
+	struct lua_thread_pool *pool;
+	struct thread_entry *parent, *thread;
+	struct lua_async_all_cbdata *cbd;
+	struct lua_async_child *child;
+	guint i, nfuncs;
+
+	if (task == NULL || lua_type (L, 2) != LUA_TTABLE) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	pool = task->cfg->lua_thread_pool;
+	parent = lua_thread_pool_get_running_entry (pool);
+
+	if (parent == NULL || parent->lua_state != L) {
+		return luaL_error (L, "rspamd_async.all must be called from a coroutine");
+	}
+
+	nfuncs = rspamd_lua_table_size (L, 2);
+	cbd = rspamd_mempool_alloc0 (task->task_pool, sizeof (*cbd));
+	cbd->task = task;
+	cbd->parent = parent;
+	lua_createtable (L, nfuncs, 0);
+	cbd->results_ref = luaL_ref (L, LUA_REGISTRYINDEX);
+	lua_createtable (L, 0, 0);
+	cbd->errors_ref = luaL_ref (L, LUA_REGISTRYINDEX);
+	cbd->pending = nfuncs;
+
+	for (i = 1; i <= nfuncs; i ++) {
+		lua_rawgeti (L, 2, i);
+
+		if (lua_type (L, -1) != LUA_TFUNCTION) {
+			lua_pop (L, 1);
+			lua_rawgeti (L, LUA_REGISTRYINDEX, cbd->errors_ref);
+			lua_pushstring (L, "function expected");
+			lua_rawseti (L, -2, i);
+			lua_pop (L, 1);
+			cbd->pending --;
+
+			continue;
+		}
+
+		thread = lua_thread_pool_get_for_task (task);
+		child = rspamd_mempool_alloc (task->task_pool, sizeof (*child));
+		child->cbd = cbd;
+		child->idx = i;
+		child->stack_level = lua_gettop (thread->lua_state);
+		thread->cd = child;
+		thread->finish_callback = lua_async_child_finish;
+		thread->error_callback = lua_async_child_error;
+
+		lua_xmove (L, thread->lua_state, 1);
+		ptask = lua_newuserdata (thread->lua_state, sizeof (*ptask));
+		rspamd_lua_setclass (thread->lua_state, "rspamd{task}", -1);
+		*ptask = task;
+
+		lua_thread_call (thread, 1);
+		/* Child has either finished or yielded, so we are running again */
+		lua_thread_pool_set_running_entry (pool, parent);
+	}
+
+	if (cbd->pending == 0) {
+		/* Nothing has yielded, so results are ready */
+		return lua_async_all_push_results (L, cbd);
+	}
+
+	msg_debug_task ("wait for %ud async functions of %ud", cbd->pending, nfuncs);
+	cbd->waiting = TRUE;
+
+	return lua_thread_yield (parent, 0);
+}
+
+static gint
+lua_load_async (lua_State *L)
+{
+	lua_newtable (L);
+	luaL_register (L, NULL, asynclib_f);
+
+	return 1;
+}
+
+void
+luaopen_async (lua_State *L)
+{
+	rspamd_lua_add_preload (L, "rspamd_async", lua_load_async);
+}
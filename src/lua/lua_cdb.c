@@ -15,23 +15,58 @@
  */
 #include "lua_common.h"
 #include "cdb.h"
+#include "unix-std.h"
+#include "contrib/libucl/lua_ucl.h"
 
 #define CDB_REFRESH_TIME 60
 
+/*
+ * Typed values stored by cdb builder: the first byte is a tag followed by
+ * the payload
+ */
+enum lua_cdb_value_type {
+	LUA_CDB_VALUE_STRING = 's',
+	LUA_CDB_VALUE_NUMBER = 'n',
+	LUA_CDB_VALUE_BOOLEAN = 'b',
+	LUA_CDB_VALUE_TABLE = 't',
+};
+
+struct lua_cdb_builder {
+	struct cdb_make cdbm;
+	gchar *name;
+	gint fd;
+	gboolean finished;
+};
+
 LUA_FUNCTION_DEF (cdb, create);
+LUA_FUNCTION_DEF (cdb, build);
 LUA_FUNCTION_DEF (cdb, lookup);
+LUA_FUNCTION_DEF (cdb, get);
 LUA_FUNCTION_DEF (cdb, get_name);
 LUA_FUNCTION_DEF (cdb, destroy);
 
+LUA_FUNCTION_DEF (cdb_builder, add);
+LUA_FUNCTION_DEF (cdb_builder, finalize);
+LUA_FUNCTION_DEF (cdb_builder, destroy);
+
 static const struct luaL_reg cdblib_m[] = {
 	LUA_INTERFACE_DEF (cdb, lookup),
+	LUA_INTERFACE_DEF (cdb, get),
 	LUA_INTERFACE_DEF (cdb, get_name),
 	{"__tostring", rspamd_lua_class_tostring},
 	{"__gc", lua_cdb_destroy},
 	{NULL, NULL}
 };
+static const struct luaL_reg cdbbuilderlib_m[] = {
+	LUA_INTERFACE_DEF (cdb_builder, add),
+	LUA_INTERFACE_DEF (cdb_builder, finalize),
+	{"__tostring", rspamd_lua_class_tostring},
+	{"__gc", lua_cdb_builder_destroy},
+	{NULL, NULL}
+};
 static const struct luaL_reg cdblib_f[] = {
 	LUA_INTERFACE_DEF (cdb, create),
+	LUA_INTERFACE_DEF (cdb, build),
 	{NULL, NULL}
 };
 
@@ -44,6 +79,15 @@ lua_check_cdb (lua_State * L)
 	return ud ? *((struct cdb **)ud) : NULL;
 }
 
+static struct lua_cdb_builder *
+lua_check_cdb_builder (lua_State * L)
+{
+	void *ud = rspamd_lua_check_udata (L, 1, "rspamd{cdb_builder}");
+
+	luaL_argcheck (L, ud != NULL, 1, "'cdb_builder' expected");
+	return ud ? *((struct lua_cdb_builder **)ud) : NULL;
+}
+
 static gint
 lua_cdb_create (lua_State *L)
 {
@@ -89,7 +133,7 @@ lua_cdb_get_name (lua_State *L)
 		lua_error (L);
 		return 1;
 	}
-	lua_pushstring (L, cdb->filename);
+	lua_pushstring (L, cdb->filename ? cdb->filename : "anonymous");
 	return 1;
 }
 
@@ -110,7 +154,7 @@ lua_cdb_lookup (lua_State *L)
 	 * XXX: this code is placed here because event_loop is called inside workers, so start
 	 * monitoring on first check, not on creation
 	 */
-	if (cdb->check_timer_ev == NULL) {
+	if (cdb->check_timer_ev == NULL && cdb->filename != NULL) {
 		cdb_add_timer (cdb, CDB_REFRESH_TIME);
 	}
 
@@ -131,6 +175,281 @@ lua_cdb_lookup (lua_State *L)
 	return 1;
 }
 
+/***
+ * @method cdb:get(key)
+ * Returns a typed value stored by `rspamd_cdb.build`: string, number,
+ * boolean or table
+ * @param {string} key key to find
+ * @return {any} value or nil if key is not found
+ */
+static gint
+lua_cdb_get (lua_State *L)
+{
+	struct cdb *cdb = lua_check_cdb (L);
+	const gchar *what;
+	const guchar *value;
+	struct ucl_parser *parser;
+	ucl_object_t *obj;
+	gsize klen, vlen;
+	gdouble num;
+
+	if (!cdb) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	what = luaL_checklstring (L, 2, &klen);
+
+	if (cdb_find (cdb, what, klen) <= 0) {
+		lua_pushnil (L);
+
+		return 1;
+	}
+
+	vlen = cdb_datalen (cdb);
+	/* Data is mmapped, so we can avoid copying */
+	value = cdb->cdb_mem + cdb_datapos (cdb);
+
+	if (vlen < 1) {
+		lua_pushnil (L);
+
+		return 1;
+	}
+
+	switch (value[0]) {
+	case LUA_CDB_VALUE_STRING:
+		lua_pushlstring (L, (const gchar *)value + 1, vlen - 1);
+		break;
+	case LUA_CDB_VALUE_NUMBER:
+		if (vlen != sizeof (num) + 1) {
+			return luaL_error (L, "invalid number value for key %s", what);
+		}
+
+		memcpy (&num, value + 1, sizeof (num));
+		lua_pushnumber (L, num);
+		break;
+	case LUA_CDB_VALUE_BOOLEAN:
+		lua_pushboolean (L, vlen > 1 && value[1] != 0);
+		break;
+	case LUA_CDB_VALUE_TABLE:
+		parser = ucl_parser_new (0);
+
+		if (!ucl_parser_add_chunk_full (parser, value + 1, vlen - 1, 0,
+				UCL_DUPLICATE_APPEND, UCL_PARSE_MSGPACK)) {
+			ucl_parser_free (parser);
+
+			return luaL_error (L, "invalid table value for key %s", what);
+		}
+
+		obj = ucl_parser_get_object (parser);
+		ucl_parser_free (parser);
+		ucl_object_push_lua (L, obj, true);
+		ucl_object_unref (obj);
+		break;
+	default:
+		return luaL_error (L, "untyped value for key %s", what);
+	}
+
+	return 1;
+}
+
+/***
+ * @function rspamd_cdb.build([name])
+ * Creates a builder for a read-only typed key/value storage. The storage is
+ * kept in an unlinked temporary file and it is memory mapped when finalized,
+ * so if it is built when configuration is loaded (e.g. in the main process),
+ * then all forked workers share the same pages instead of copying the data
+ * to their Lua states.
+ * @param {string} name optional symbolic name of the storage
+ * @return {cdb_builder} builder object or nil
+ */
+static gint
+lua_cdb_build (lua_State *L)
+{
+	struct lua_cdb_builder *builder, **pbuilder;
+	const gchar *name = luaL_optstring (L, 1, "anonymous");
+	gchar fpath[PATH_MAX];
+	gint fd;
+
+	rspamd_snprintf (fpath, sizeof (fpath), "%s%crspamd-cdb-XXXXXXXX",
+			g_get_tmp_dir (), G_DIR_SEPARATOR);
+	fd = mkstemp (fpath);
+
+	if (fd == -1) {
+		msg_err ("cannot create temporary file %s for cdb: %s", fpath,
+				strerror (errno));
+		lua_pushnil (L);
+
+		return 1;
+	}
+
+	/* We keep just an fd and so the storage is removed with the last user */
+	unlink (fpath);
+
+	builder = g_malloc0 (sizeof (*builder));
+	builder->fd = fd;
+	builder->name = g_strdup (name);
+
+	if (cdb_make_start (&builder->cdbm, fd) == -1) {
+		msg_err ("cannot start cdb %s: %s", name, strerror (errno));
+		close (fd);
+		g_free (builder->name);
+		g_free (builder);
+		lua_pushnil (L);
+
+		return 1;
+	}
+
+	pbuilder = lua_newuserdata (L, sizeof (*pbuilder));
+	rspamd_lua_setclass (L, "rspamd{cdb_builder}", -1);
+	*pbuilder = builder;
+
+	return 1;
+}
+
+/***
+ * @method cdb_builder:add(key, value)
+ * Adds typed value to the storage. Tables are serialized using msgpack.
+ * @param {string} key key
+ * @param {string|number|boolean|table} value value
+ * @return {cdb_builder} builder itself to allow chaining
+ */
+static gint
+lua_cdb_builder_add (lua_State *L)
+{
+	struct lua_cdb_builder *builder = lua_check_cdb_builder (L);
+	const gchar *key, *data = NULL;
+	gsize klen, dlen = 0;
+	guchar tag, small[sizeof (gdouble)];
+	unsigned char *emitted = NULL;
+	GByteArray *buf;
+	ucl_object_t *obj;
+	gdouble num;
+	gint ret;
+
+	if (!builder || builder->finished) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	key = luaL_checklstring (L, 2, &klen);
+
+	switch (lua_type (L, 3)) {
+	case LUA_TSTRING:
+		tag = LUA_CDB_VALUE_STRING;
+		data = lua_tolstring (L, 3, &dlen);
+		break;
+	case LUA_TNUMBER:
+		tag = LUA_CDB_VALUE_NUMBER;
+		num = lua_tonumber (L, 3);
+		memcpy (small, &num, sizeof (num));
+		data = (const gchar *)small;
+		dlen = sizeof (num);
+		break;
+	case LUA_TBOOLEAN:
+		tag = LUA_CDB_VALUE_BOOLEAN;
+		small[0] = lua_toboolean (L, 3);
+		data = (const gchar *)small;
+		dlen = 1;
+		break;
+	case LUA_TTABLE:
+		tag = LUA_CDB_VALUE_TABLE;
+		obj = ucl_object_lua_import (L, 3);
+		emitted = ucl_object_emit_len (obj, UCL_EMIT_MSGPACK, &dlen);
+		ucl_object_unref (obj);
+
+		if (emitted == NULL) {
+			return luaL_error (L, "cannot serialize table for key %s", key);
+		}
+
+		data = (const gchar *)emitted;
+		break;
+	default:
+		return luaL_error (L, "invalid value type for key %s: %s", key,
+				lua_typename (L, lua_type (L, 3)));
+	}
+
+	buf = g_byte_array_sized_new (dlen + 1);
+	g_byte_array_append (buf, &tag, 1);
+	g_byte_array_append (buf, (const guint8 *)data, dlen);
+	ret = cdb_make_add (&builder->cdbm, key, klen, buf->data, buf->len);
+	g_byte_array_free (buf, TRUE);
+
+	if (emitted) {
+		free (emitted);
+	}
+
+	if (ret == -1) {
+		return luaL_error (L, "cannot add key %s to cdb %s: %s", key,
+				builder->name, strerror (errno));
+	}
+
+	lua_pushvalue (L, 1);
+
+	return 1;
+}
+
+/***
+ * @method cdb_builder:finalize()
+ * Finishes building and maps the storage to memory. Builder cannot be used
+ * after this call.
+ * @return {cdb} read-only cdb object
+ */
+static gint
+lua_cdb_builder_finalize (lua_State *L)
+{
+	struct lua_cdb_builder *builder = lua_check_cdb_builder (L);
+	struct cdb *cdb, **pcdb;
+
+	if (!builder || builder->finished) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	builder->finished = TRUE;
+
+	if (cdb_make_finish (&builder->cdbm) == -1) {
+		return luaL_error (L, "cannot finish cdb %s: %s", builder->name,
+				strerror (errno));
+	}
+
+	cdb = g_malloc0 (sizeof (struct cdb));
+
+	if (cdb_init (cdb, builder->fd) == -1) {
+		g_free (cdb);
+
+		return luaL_error (L, "cannot map cdb %s: %s", builder->name,
+				strerror (errno));
+	}
+
+	/* Now fd is owned by cdb, filename is NULL as there is nothing to watch */
+	builder->fd = -1;
+	pcdb = lua_newuserdata (L, sizeof (struct cdb *));
+	rspamd_lua_setclass (L, "rspamd{cdb}", -1);
+	*pcdb = cdb;
+
+	return 1;
+}
+
+static gint
+lua_cdb_builder_destroy (lua_State *L)
+{
+	struct lua_cdb_builder *builder = lua_check_cdb_builder (L);
+
+	if (builder) {
+		if (!builder->finished) {
+			/* Releases internal record lists */
+			cdb_make_finish (&builder->cdbm);
+		}
+
+		if (builder->fd != -1) {
+			close (builder->fd);
+		}
+
+		g_free (builder->name);
+		g_free (builder);
+	}
+
+	return 0;
+}
+
 static gint
 lua_cdb_destroy (lua_State *L)
 {
@@ -170,5 +489,8 @@ luaopen_cdb (lua_State * L)
 	luaL_register (L, NULL,	 cdblib_m);
 	lua_pop (L, 1);                      /* remove metatable from stack */
 
+	rspamd_lua_new_class (L, "rspamd{cdb_builder}", cdbbuilderlib_m);
+	lua_pop (L, 1);
+
 	rspamd_lua_add_preload (L, "rspamd_cdb", lua_load_cdb);
 }
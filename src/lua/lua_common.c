@@ -755,9 +755,15 @@ rspamd_lua_init ()
 	luaopen_tcp (L);
 	luaopen_html (L);
 	luaopen_fann (L);
+	luaopen_mlp (L);
 	luaopen_sqlite3 (L);
 	luaopen_cryptobox (L);
 	luaopen_dns (L);
+	luaopen_rows (L);
+	luaopen_async (L);
+	luaopen_selectors (L);
+	luaopen_dmarc (L);
+	luaopen_sa_rules (L);
 
 	luaL_newmetatable (L, "rspamd{ev_base}");
 	lua_pushstring (L, "class");
@@ -877,6 +883,7 @@ rspamd_init_lua_filters (struct rspamd_config *cfg, gboolean force_load)
 	lua_State *L = cfg->lua_state;
 	GString *tb;
 	gint err_idx;
+	gdouble start;
 
 	cur = g_list_first (cfg->script_modules);
 
@@ -891,6 +898,8 @@ rspamd_init_lua_filters (struct rspamd_config *cfg, gboolean force_load)
 				}
 			}
 
+			start = rspamd_get_ticks (FALSE);
+
 			lua_pushcfunction (L, &rspamd_lua_traceback);
 			err_idx = lua_gettop (L);
 
@@ -932,6 +941,8 @@ rspamd_init_lua_filters (struct rspamd_config *cfg, gboolean force_load)
 				msg_info_config ("init lua module %s", module->name);
 			}
 
+			rspamd_config_profile_phase (cfg, RSPAMD_CONFIG_PHASE_LUA_MODULE,
+					module->name, start);
 			lua_pop (L, 1); /* Error function */
 		}
 
@@ -2343,3 +2354,108 @@ rspamd_lua_require_function (lua_State *L, const gchar *modname,
 
 	return FALSE;
 }
+
+static gint
+rspamd_lua_profile_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct rspamd_lua_profile_elt *e1 = *(gpointer *)a,
+			*e2 = *(gpointer *)b;
+
+	if (e1->cpu_time > e2->cpu_time) {
+		return -1;
+	}
+	else if (e1->cpu_time < e2->cpu_time) {
+		return 1;
+	}
+
+	return 0;
+}
+
+ucl_object_t *
+rspamd_lua_profile_ucl (GPtrArray *elts)
+{
+	ucl_object_t *top, *obj;
+	struct rspamd_lua_profile_elt *prof;
+	GPtrArray *sorted;
+	guint i;
+
+	top = ucl_object_typed_new (UCL_ARRAY);
+
+	if (elts == NULL) {
+		return top;
+	}
+
+	sorted = g_ptr_array_sized_new (elts->len);
+
+	PTR_ARRAY_FOREACH (elts, i, prof) {
+		g_ptr_array_add (sorted, prof);
+	}
+
+	g_ptr_array_sort (sorted, rspamd_lua_profile_cmp);
+
+	PTR_ARRAY_FOREACH (sorted, i, prof) {
+		obj = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (obj, ucl_object_fromstring (prof->symbol),
+				"symbol", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromstring (prof->source),
+				"source", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (prof->calls),
+				"calls", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromdouble (prof->cpu_time),
+				"cpu_time", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (prof->mem_bytes),
+				"mem_bytes", 0, false);
+		ucl_array_append (top, obj);
+	}
+
+	g_ptr_array_free (sorted, TRUE);
+
+	return top;
+}
+
+static struct rspamd_lua_gc_stat lua_gc_stat;
+
+void
+rspamd_lua_gc_setup (struct rspamd_config *cfg)
+{
+	lua_State *L = cfg->lua_state;
+
+	if (L == NULL) {
+		return;
+	}
+
+	if (cfg->lua_gc_pause > 0) {
+		lua_gc (L, LUA_GCSETPAUSE, cfg->lua_gc_pause);
+	}
+
+	if (cfg->lua_gc_stepmul > 0) {
+		lua_gc (L, LUA_GCSETSTEPMUL, cfg->lua_gc_stepmul);
+	}
+}
+
+void
+rspamd_lua_gc_step (struct rspamd_config *cfg)
+{
+	gdouble t1, pause;
+
+	if (cfg->lua_gc_step == 0 || cfg->lua_state == NULL) {
+		return;
+	}
+
+	t1 = rspamd_get_ticks (FALSE);
+
+	lua_gc (cfg->lua_state, LUA_GCSTEP, cfg->lua_gc_step);
+	pause = rspamd_get_ticks (FALSE) - t1;
+	lua_gc_stat.steps ++;
+	lua_gc_stat.total_time += pause;
+
+	if (pause > lua_gc_stat.max_pause) {
+		lua_gc_stat.max_pause = pause;
+	}
+}
+
+const struct rspamd_lua_gc_stat *
+rspamd_lua_gc_get_stat (void)
+{
+	return &lua_gc_stat;
+}
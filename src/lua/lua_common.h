@@ -201,6 +201,59 @@ void rspamd_lua_ip_push (lua_State *L, rspamd_inet_addr_t *addr);
  */
 void rspamd_lua_task_push (lua_State *L, struct rspamd_task *task);
 
+/**
+ * Push task object that is created once per task and reused by all callers,
+ * e.g. by symbols callbacks
+ */
+void rspamd_lua_task_push_cached (lua_State *L, struct rspamd_task *task);
+
+/*
+ * Lua symbol profile (options.lua_profile), only Lua execution is accounted
+ * and the time spent waiting for asynchronous events is excluded
+ */
+struct rspamd_lua_profile_elt {
+	const gchar *symbol;
+	const gchar *source;  /* file:line where callback is defined */
+	guint64 calls;
+	gdouble cpu_time;     /* virtual ticks spent in callback */
+	guint64 mem_bytes;    /* growth of Lua heap, GC steps hide some allocations */
+};
+
+/*
+ * Statistics of Lua GC steps performed between tasks in this process
+ */
+struct rspamd_lua_gc_stat {
+	guint64 steps;
+	gdouble total_time;
+	gdouble max_pause;
+};
+
+/**
+ * Applies Lua GC parameters from the configuration
+ * @param cfg
+ */
+void rspamd_lua_gc_setup (struct rspamd_config *cfg);
+
+/**
+ * Performs an incremental GC step if options.lua_gc_step is set,
+ * it is called when a task is destroyed
+ * @param cfg
+ */
+void rspamd_lua_gc_step (struct rspamd_config *cfg);
+
+/**
+ * Returns GC statistics of the current process
+ * @return
+ */
+const struct rspamd_lua_gc_stat *rspamd_lua_gc_get_stat (void);
+
+/**
+ * Emits profile elements as an array sorted by CPU time
+ * @param elts array of `struct rspamd_lua_profile_elt`, can be NULL
+ * @return
+ */
+ucl_object_t *rspamd_lua_profile_ucl (GPtrArray *elts);
+
 /**
  * Return lua ip structure at the specified address
  */
@@ -208,20 +261,37 @@ struct rspamd_lua_ip * lua_check_ip (lua_State * L, gint pos);
 
 struct rspamd_lua_text * lua_check_text (lua_State * L, gint pos);
 
+/**
+ * Push new text object. If `own` is FALSE, then no copy is performed and
+ * the memory must outlive the Lua object (e.g. be allocated in a task pool)
+ */
+struct rspamd_lua_text * lua_new_text (lua_State *L, const gchar *start,
+		gsize len, gboolean own);
+
+/**
+ * Returns data of either string or text at the specified position with no
+ * copying, or NULL if there is neither of them
+ */
+const gchar * lua_tolstring_or_text (lua_State *L, gint pos, gsize *len);
+
 enum rspamd_lua_task_header_type {
 	RSPAMD_TASK_HEADER_PUSH_SIMPLE = 0,
 	RSPAMD_TASK_HEADER_PUSH_RAW,
 	RSPAMD_TASK_HEADER_PUSH_FULL,
 	RSPAMD_TASK_HEADER_PUSH_COUNT,
+	RSPAMD_TASK_HEADER_PUSH_SIMPLE_TEXT,
+	RSPAMD_TASK_HEADER_PUSH_RAW_TEXT,
 };
 
 gint rspamd_lua_push_header (lua_State *L,
+							 rspamd_mempool_t *pool,
 							 struct rspamd_mime_header *h,
 							 enum rspamd_lua_task_header_type how);
 /**
  * Push specific header to lua
  */
 gint rspamd_lua_push_header_array (lua_State *L,
+								   rspamd_mempool_t *pool,
 								   GPtrArray *hdrs,
 								   enum rspamd_lua_task_header_type how);
 
@@ -278,9 +348,15 @@ void luaopen_util (lua_State * L);
 void luaopen_tcp (lua_State * L);
 void luaopen_html (lua_State * L);
 void luaopen_fann (lua_State *L);
+void luaopen_mlp (lua_State *L);
 void luaopen_sqlite3 (lua_State *L);
 void luaopen_cryptobox (lua_State *L);
 void luaopen_dns (lua_State *L);
+void luaopen_rows (lua_State *L);
+void luaopen_async (lua_State *L);
+void luaopen_selectors (lua_State *L);
+void luaopen_dmarc (lua_State *L);
+void luaopen_sa_rules (lua_State *L);
 
 void rspamd_lua_dostring (const gchar *line);
 
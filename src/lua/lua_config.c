@@ -1060,6 +1060,7 @@ struct lua_callback_data {
 	gint stack_level;
 	gint order;
 	struct rspamd_symcache_item *item;
+	struct rspamd_lua_profile_elt *prof;
 };
 
 /*
@@ -1076,6 +1077,45 @@ lua_destroy_cfg_symbol (gpointer ud)
 	}
 }
 
+/*
+ * Attaches profile element to the callback if options.lua_profile is set
+ */
+static void
+lua_config_maybe_profile_symbol (lua_State *L, struct rspamd_config *cfg,
+		struct lua_callback_data *cd)
+{
+	struct rspamd_lua_profile_elt *prof;
+	lua_Debug ar;
+	gchar srcbuf[PATH_MAX];
+
+	if (!cfg->enable_lua_profile) {
+		return;
+	}
+
+	prof = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*prof));
+	prof->symbol = cd->symbol ? cd->symbol : "(unnamed)";
+
+	/* Function is popped by lua_getinfo */
+	lua_rawgeti (L, LUA_REGISTRYINDEX, cd->callback.ref);
+	memset (&ar, 0, sizeof (ar));
+
+	if (lua_getinfo (L, ">S", &ar)) {
+		rspamd_snprintf (srcbuf, sizeof (srcbuf), "%s:%d",
+				ar.short_src, ar.linedefined);
+		prof->source = rspamd_mempool_strdup (cfg->cfg_pool, srcbuf);
+	}
+	else {
+		prof->source = "unknown";
+	}
+
+	if (cfg->lua_profile == NULL) {
+		cfg->lua_profile = g_ptr_array_new ();
+	}
+
+	g_ptr_array_add (cfg->lua_profile, prof);
+	cd->prof = prof;
+}
+
 static gint
 lua_config_register_module_option (lua_State *L)
 {
@@ -1104,7 +1144,6 @@ lua_metric_symbol_callback (struct rspamd_task *task,
 		gpointer ud)
 {
 	struct lua_callback_data *cd = ud;
-	struct rspamd_task **ptask;
 	struct thread_entry *thread_entry;
 
 	rspamd_symcache_item_async_inc (task, item, "lua symbol");
@@ -1113,6 +1152,11 @@ lua_metric_symbol_callback (struct rspamd_task *task,
 	g_assert(thread_entry->cd == NULL);
 	thread_entry->cd = cd;
 
+	if (cd->prof) {
+		cd->prof->calls ++;
+		thread_entry->prof = cd->prof;
+	}
+
 	lua_State *thread = thread_entry->lua_state;
 	cd->stack_level = lua_gettop (thread);
 	cd->item = item;
@@ -1124,9 +1168,8 @@ lua_metric_symbol_callback (struct rspamd_task *task,
 		lua_getglobal (thread, cd->callback.name);
 	}
 
-	ptask = lua_newuserdata (thread, sizeof (struct rspamd_task *));
-	rspamd_lua_setclass (thread, "rspamd{task}", -1);
-	*ptask = task;
+	/* The same task object is passed to all symbols of a task */
+	rspamd_lua_task_push_cached (thread, task);
 
 	thread_entry->finish_callback = lua_metric_symbol_callback_return;
 	thread_entry->error_callback = lua_metric_symbol_callback_error;
@@ -1303,6 +1346,8 @@ rspamd_register_symbol_fromlua (lua_State *L,
 					cd->symbol = rspamd_mempool_strdup (cfg->cfg_pool, name);
 				}
 
+				lua_config_maybe_profile_symbol (L, cfg, cd);
+
 				ret = rspamd_symcache_add_symbol (cfg->cache,
 						name,
 						priority,
@@ -1327,6 +1372,8 @@ rspamd_register_symbol_fromlua (lua_State *L,
 				cd->symbol = rspamd_mempool_strdup (cfg->cfg_pool, name);
 			}
 
+			lua_config_maybe_profile_symbol (L, cfg, cd);
+
 			ret = rspamd_symcache_add_symbol (cfg->cache,
 					name,
 					priority,
@@ -0,0 +1,337 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "lua_common.h"
+#include "lua_thread_pool.h"
+#include "libserver/dmarc.h"
+#include "libserver/task.h"
+
+/***
+ * @module rspamd_dmarc
+ * This module provides parsed and cached DMARC records
+ * @example
+local rspamd_dmarc = require "rspamd_dmarc"
+
+rspamd_dmarc.resolve(task, 'example.com', function(domain, records, err)
+  if not err then
+    for _,rec in ipairs(records) do
+      local ok, policy = rec:to_table(false)
+    end
+  end
+end)
+ */
+
+/***
+ * @function rspamd_dmarc.resolve(task, domain, callback)
+ * Resolves `_dmarc.<domain>` records using per process cache of parsed
+ * records. Callback is called as `callback(domain, records, err)` where
+ * records is a list of `rspamd_dmarc_record` objects (TXT records that are not
+ * DMARC records are skipped) and `err` is a DNS error string
+ * @param {rspamd_task} task task object
+ * @param {string} domain domain to check
+ * @param {function} callback callback function
+ * @return {boolean} true if request has been scheduled
+ */
+LUA_FUNCTION_DEF (dmarc, resolve);
+/***
+ * @function rspamd_dmarc.parse(record)
+ * Parses DMARC record
+ * @param {string} record record text
+ * @return {rspamd_dmarc_record} parsed record or nil if text is not a DMARC record
+ */
+LUA_FUNCTION_DEF (dmarc, parse);
+
+/***
+ * @method dmarc_record:to_table(is_tld)
+ * Checks record tags and returns policy table with fields `dmarc_policy`,
+ * `strict_dkim`, `strict_spf`, `subdomain_policy`, `pct` and `rua`.
+ * Subdomain policy is applied when `is_tld` is true
+ * @param {boolean} is_tld record is for the organisational domain
+ * @return {boolean,table|string} true and policy table or false and error message
+ */
+LUA_FUNCTION_DEF (dmarc_record, to_table);
+LUA_FUNCTION_DEF (dmarc_record, gc);
+
+static const struct luaL_reg dmarclib_f[] = {
+	LUA_INTERFACE_DEF (dmarc, resolve),
+	LUA_INTERFACE_DEF (dmarc, parse),
+	{NULL, NULL}
+};
+
+static const struct luaL_reg dmarcrecordlib_m[] = {
+	LUA_INTERFACE_DEF (dmarc_record, to_table),
+	{"__tostring", rspamd_lua_class_tostring},
+	{"__gc", lua_dmarc_record_gc},
+	{NULL, NULL}
+};
+
+struct lua_dmarc_cbdata {
+	struct rspamd_task *task;
+	struct rspamd_symcache_item *item;
+	gint cbref;
+};
+
+static struct rspamd_dmarc_record *
+lua_check_dmarc_record (lua_State *L, gint pos)
+{
+	void *ud = rspamd_lua_check_udata (L, pos, "rspamd{dmarc_record}");
+
+	luaL_argcheck (L, ud != NULL, pos, "'dmarc_record' expected");
+	return ud ? *((struct rspamd_dmarc_record **)ud) : NULL;
+}
+
+static void
+lua_dmarc_push_record (lua_State *L, struct rspamd_dmarc_record *rec)
+{
+	struct rspamd_dmarc_record **prec;
+
+	prec = lua_newuserdata (L, sizeof (*prec));
+	rspamd_lua_setclass (L, "rspamd{dmarc_record}", -1);
+	*prec = rspamd_dmarc_record_ref (rec);
+}
+
+static const gchar *
+lua_dmarc_policy_str (enum rspamd_dmarc_policy policy)
+{
+	switch (policy) {
+	case RSPAMD_DMARC_POLICY_QUARANTINE:
+		return "quarantine";
+	case RSPAMD_DMARC_POLICY_REJECT:
+		return "reject";
+	default:
+		return "none";
+	}
+}
+
+static void
+lua_dmarc_lookup_cb (struct rspamd_dmarc_lookup *res, const gchar *domain,
+		gpointer ud)
+{
+	struct lua_dmarc_cbdata *cbd = ud;
+	struct rspamd_task *task = cbd->task;
+	struct rspamd_dmarc_record *rec;
+	struct lua_callback_state cbs;
+	lua_State *L;
+	gint err_idx;
+	guint i;
+	GString *tb;
+
+	lua_thread_pool_prepare_callback (task->cfg->lua_thread_pool, &cbs);
+	L = cbs.L;
+
+	lua_pushcfunction (L, &rspamd_lua_traceback);
+	err_idx = lua_gettop (L);
+
+	lua_rawgeti (L, LUA_REGISTRYINDEX, cbd->cbref);
+	lua_pushstring (L, domain);
+
+	if (res->rcode == RDNS_RC_NOERROR) {
+		lua_createtable (L, res->records->len, 0);
+
+		PTR_ARRAY_FOREACH (res->records, i, rec) {
+			lua_dmarc_push_record (L, rec);
+			lua_rawseti (L, -2, i + 1);
+		}
+
+		lua_pushnil (L);
+	}
+	else {
+		lua_pushnil (L);
+		lua_pushstring (L, rdns_strerror (res->rcode));
+	}
+
+	if (cbd->item) {
+		rspamd_symcache_set_cur_item (task, cbd->item);
+	}
+
+	if (lua_pcall (L, 3, 0, err_idx) != 0) {
+		tb = lua_touserdata (L, -1);
+
+		if (tb) {
+			msg_err_task ("call to dmarc callback failed: %s", tb->str);
+			g_string_free (tb, TRUE);
+		}
+	}
+
+	lua_settop (L, err_idx - 1);
+	luaL_unref (L, LUA_REGISTRYINDEX, cbd->cbref);
+	lua_thread_pool_restore_callback (&cbs);
+
+	if (cbd->item) {
+		rspamd_symcache_item_async_dec_check (task, cbd->item, "rspamd dmarc");
+	}
+}
+
+static gint
+lua_dmarc_resolve (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_task *task = lua_check_task (L, 1);
+	const gchar *domain = luaL_checkstring (L, 2);
+	struct lua_dmarc_cbdata *cbd;
+
+	if (task == NULL || domain == NULL || !lua_isfunction (L, 3)) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	cbd = rspamd_mempool_alloc0 (task->task_pool, sizeof (*cbd));
+	cbd->task = task;
+	lua_pushvalue (L, 3);
+	cbd->cbref = luaL_ref (L, LUA_REGISTRYINDEX);
+	cbd->item = rspamd_symcache_get_cur_item (task);
+
+	if (cbd->item) {
+		rspamd_symcache_item_async_inc (task, cbd->item, "rspamd dmarc");
+	}
+
+	if (!rspamd_dmarc_lookup (task, domain, lua_dmarc_lookup_cb, cbd)) {
+		luaL_unref (L, LUA_REGISTRYINDEX, cbd->cbref);
+
+		if (cbd->item) {
+			rspamd_symcache_item_async_dec_check (task, cbd->item,
+					"rspamd dmarc");
+		}
+
+		lua_pushboolean (L, false);
+	}
+	else {
+		lua_pushboolean (L, true);
+	}
+
+	return 1;
+}
+
+static gint
+lua_dmarc_parse (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_dmarc_record *rec;
+	const gchar *txt;
+	gsize len;
+
+	txt = luaL_checklstring (L, 1, &len);
+	rec = rspamd_dmarc_parse_record (txt, len);
+
+	if (rec) {
+		lua_dmarc_push_record (L, rec);
+		rspamd_dmarc_record_unref (rec);
+	}
+	else {
+		lua_pushnil (L);
+	}
+
+	return 1;
+}
+
+static gint
+lua_dmarc_record_to_table (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_dmarc_record *rec = lua_check_dmarc_record (L, 1);
+	gboolean is_tld = lua_toboolean (L, 2);
+	enum rspamd_dmarc_policy policy;
+
+	if (rec == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	if (rec->error) {
+		lua_pushboolean (L, false);
+		lua_pushstring (L, rec->error);
+
+		return 2;
+	}
+
+	policy = rec->policy;
+
+	if (is_tld && rec->sp) {
+		if (rec->subdomain_policy == RSPAMD_DMARC_POLICY_INVALID) {
+			lua_pushboolean (L, false);
+			lua_pushfstring (L, "sp tag has invalid value: %s", rec->sp);
+
+			return 2;
+		}
+
+		policy = rec->subdomain_policy;
+	}
+
+	lua_pushboolean (L, true);
+	lua_createtable (L, 0, 6);
+
+	lua_pushstring (L, "dmarc_policy");
+	lua_pushstring (L, lua_dmarc_policy_str (policy));
+	lua_settable (L, -3);
+
+	if (rec->strict_dkim) {
+		lua_pushstring (L, "strict_dkim");
+		lua_pushboolean (L, true);
+		lua_settable (L, -3);
+	}
+
+	if (rec->strict_spf) {
+		lua_pushstring (L, "strict_spf");
+		lua_pushboolean (L, true);
+		lua_settable (L, -3);
+	}
+
+	if (is_tld && rec->sp) {
+		lua_pushstring (L, "subdomain_policy");
+		lua_pushstring (L, rec->sp);
+		lua_settable (L, -3);
+	}
+
+	if (rec->pct >= 0) {
+		lua_pushstring (L, "pct");
+		lua_pushinteger (L, rec->pct);
+		lua_settable (L, -3);
+	}
+
+	if (rec->rua) {
+		lua_pushstring (L, "rua");
+		lua_pushstring (L, rec->rua);
+		lua_settable (L, -3);
+	}
+
+	return 2;
+}
+
+static gint
+lua_dmarc_record_gc (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_dmarc_record *rec = lua_check_dmarc_record (L, 1);
+
+	if (rec) {
+		rspamd_dmarc_record_unref (rec);
+	}
+
+	return 0;
+}
+
+static gint
+lua_load_dmarc (lua_State *L)
+{
+	lua_newtable (L);
+	luaL_register (L, NULL, dmarclib_f);
+
+	return 1;
+}
+
+void
+luaopen_dmarc (lua_State *L)
+{
+	rspamd_lua_new_class (L, "rspamd{dmarc_record}", dmarcrecordlib_m);
+	lua_pop (L, 1);
+
+	rspamd_lua_add_preload (L, "rspamd_dmarc", lua_load_dmarc);
+}
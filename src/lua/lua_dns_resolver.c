@@ -54,6 +54,7 @@ LUA_FUNCTION_DEF (dns_resolver, resolve_txt);
 LUA_FUNCTION_DEF (dns_resolver, resolve_mx);
 LUA_FUNCTION_DEF (dns_resolver, resolve_ns);
 LUA_FUNCTION_DEF (dns_resolver, resolve);
+LUA_FUNCTION_DEF (dns_resolver, resolve_batch);
 
 void lua_push_dns_reply (lua_State *L, const struct rdns_reply *reply);
 
@@ -69,6 +70,7 @@ static const struct luaL_reg dns_resolverlib_m[] = {
 	LUA_INTERFACE_DEF (dns_resolver, resolve_mx),
 	LUA_INTERFACE_DEF (dns_resolver, resolve_ns),
 	LUA_INTERFACE_DEF (dns_resolver, resolve),
+	LUA_INTERFACE_DEF (dns_resolver, resolve_batch),
 	{"__tostring", rspamd_lua_class_tostring},
 	{NULL, NULL}
 };
@@ -92,6 +94,21 @@ struct lua_dns_cbdata {
 	struct rspamd_async_session *s;
 };
 
+/* Requests of a batch share the callback and the table of replies */
+struct lua_dns_batch_cbdata {
+	struct rspamd_task *task;
+	struct rspamd_dns_resolver *resolver;
+	struct rspamd_symcache_item *item;
+	gint cbref;
+	gint resref;
+	guint pending;
+};
+
+struct lua_dns_batch_elt {
+	struct lua_dns_batch_cbdata *batch;
+	const gchar *name;
+};
+
 static int
 lua_dns_get_type (lua_State *L, int argno)
 {
@@ -675,6 +692,261 @@ lua_dns_resolver_resolve (lua_State *L)
 	return 1;
 }
 
+static void
+lua_dns_resolver_batch_dtor (gpointer p)
+{
+	struct lua_dns_batch_cbdata *cd = p;
+	lua_State *L = cd->resolver->cfg->lua_state;
+
+	/* Task is destroyed before all replies are received */
+	if (cd->cbref != -1) {
+		luaL_unref (L, LUA_REGISTRYINDEX, cd->cbref);
+		luaL_unref (L, LUA_REGISTRYINDEX, cd->resref);
+		cd->cbref = -1;
+	}
+}
+
+static void
+lua_dns_resolver_batch_fin (struct lua_dns_batch_cbdata *cd)
+{
+	struct rspamd_dns_resolver **presolver;
+	struct rspamd_task *task = cd->task;
+	struct lua_callback_state cbs;
+	lua_State *L;
+	gint err_idx;
+	GString *tb;
+
+	lua_thread_pool_prepare_callback (cd->resolver->cfg->lua_thread_pool, &cbs);
+	L = cbs.L;
+
+	lua_pushcfunction (L, &rspamd_lua_traceback);
+	err_idx = lua_gettop (L);
+
+	lua_rawgeti (L, LUA_REGISTRYINDEX, cd->cbref);
+	presolver = lua_newuserdata (L, sizeof (gpointer));
+	rspamd_lua_setclass (L, "rspamd{resolver}", -1);
+	*presolver = cd->resolver;
+	lua_rawgeti (L, LUA_REGISTRYINDEX, cd->resref);
+
+	if (cd->item) {
+		/* We also need to restore the item in case there are some chains */
+		rspamd_symcache_set_cur_item (task, cd->item);
+	}
+
+	if (lua_pcall (L, 2, 0, err_idx) != 0) {
+		tb = lua_touserdata (L, -1);
+
+		if (tb) {
+			msg_err_task ("call to dns batch callback failed: %s", tb->str);
+			g_string_free (tb, TRUE);
+		}
+	}
+
+	lua_settop (L, err_idx - 1);
+	luaL_unref (L, LUA_REGISTRYINDEX, cd->cbref);
+	luaL_unref (L, LUA_REGISTRYINDEX, cd->resref);
+	cd->cbref = -1;
+	lua_thread_pool_restore_callback (&cbs);
+}
+
+static void
+lua_dns_resolver_batch_callback (struct rdns_reply *reply, gpointer arg)
+{
+	struct lua_dns_batch_elt *elt = arg;
+	struct lua_dns_batch_cbdata *cd = elt->batch;
+	lua_State *L = cd->resolver->cfg->lua_state;
+
+	/* Replies are collected in a table, Lua is called once for the batch */
+	lua_rawgeti (L, LUA_REGISTRYINDEX, cd->resref);
+	lua_createtable (L, 0, 2);
+
+	if (reply->code == RDNS_RC_NOERROR) {
+		lua_push_dns_reply (L, reply);
+		/* Remove error placeholder */
+		lua_pop (L, 1);
+		lua_setfield (L, -2, "results");
+	}
+	else {
+		lua_pushstring (L, rdns_strerror (reply->code));
+		lua_setfield (L, -2, "error");
+	}
+
+	lua_pushboolean (L, reply->authenticated);
+	lua_setfield (L, -2, "authenticated");
+	lua_setfield (L, -2, elt->name);
+	lua_pop (L, 1);
+
+	if (--cd->pending == 0) {
+		lua_dns_resolver_batch_fin (cd);
+	}
+}
+
+/* Names that are not scheduled have no replies */
+static void
+lua_dns_resolver_batch_unset (lua_State *L, struct lua_dns_batch_cbdata *cd,
+		const gchar *name)
+{
+	lua_rawgeti (L, LUA_REGISTRYINDEX, cd->resref);
+	lua_pushnil (L);
+	lua_setfield (L, -2, name);
+	lua_pop (L, 1);
+}
+
+/***
+ * @method resolver:resolve_batch(table)
+ * Resolve many names with records of the same type calling a single callback
+ * when all of them are resolved. Requests are sent at once, so identical
+ * requests are served by the cache or joined to the requests in flight.
+ * Table elements:
+ * * `task` - task element
+ * * `names` - array of names to resolve, duplicates are resolved once
+ * * `type` - type of records, e.g. `a` (default), `txt` or `ptr`
+ * * `callback` - callback function to be called when all names are resolved; must be of type `function (resolver, replies)`, where `replies` are indexed by names and have fields `results`, `error` and `authenticated`
+ * * `forced` - true if needed to override normal limit for DNS requests
+ * @return {number} number of requests scheduled, callback is not called if it is zero
+ */
+static int
+lua_dns_resolver_resolve_batch (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_dns_resolver *resolver = lua_check_dns_resolver (L);
+	struct rspamd_task *task = NULL;
+	struct lua_dns_batch_cbdata *cd;
+	struct lua_dns_batch_elt *elt;
+	enum rdns_request_type type = RDNS_REQUEST_A;
+	const gchar *name;
+	gchar *ptr_str;
+	gboolean forced = FALSE, ret;
+	gsize nnames, i;
+	guint scheduled = 0;
+
+	if (resolver == NULL || lua_type (L, 2) != LUA_TTABLE) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	lua_getfield (L, 2, "task");
+	task = lua_check_task_maybe (L, -1);
+	lua_pop (L, 1);
+
+	lua_getfield (L, 2, "forced");
+	forced = lua_toboolean (L, -1);
+	lua_pop (L, 1);
+
+	lua_getfield (L, 2, "type");
+
+	if (lua_type (L, -1) == LUA_TSTRING) {
+		type = lua_dns_get_type (L, lua_gettop (L));
+	}
+	else if (lua_type (L, -1) == LUA_TNUMBER) {
+		type = lua_tonumber (L, -1);
+	}
+
+	lua_pop (L, 1);
+
+	lua_getfield (L, 2, "names");
+	lua_getfield (L, 2, "callback");
+
+	if (task == NULL || lua_type (L, -2) != LUA_TTABLE ||
+			lua_type (L, -1) != LUA_TFUNCTION) {
+		lua_pop (L, 2);
+
+		return luaL_error (L, "invalid arguments: task, names and callback "
+				"are required");
+	}
+
+	cd = rspamd_mempool_alloc0 (task->task_pool, sizeof (*cd));
+	cd->task = task;
+	cd->resolver = resolver;
+	cd->item = rspamd_symcache_get_cur_item (task);
+	cd->cbref = luaL_ref (L, LUA_REGISTRYINDEX);
+	lua_newtable (L);
+	cd->resref = luaL_ref (L, LUA_REGISTRYINDEX);
+	rspamd_mempool_add_destructor (task->task_pool,
+			lua_dns_resolver_batch_dtor, cd);
+
+	/* Guard against replies delivered before all requests are scheduled */
+	cd->pending = 1;
+	nnames = rspamd_lua_table_size (L, -1);
+
+	for (i = 1; i <= nnames; i ++) {
+		lua_rawgeti (L, -1, i);
+		name = lua_tostring (L, -1);
+
+		if (name == NULL) {
+			lua_pop (L, 1);
+			continue;
+		}
+
+		/* Skip duplicates, replies table holds `false` for names in flight */
+		lua_rawgeti (L, LUA_REGISTRYINDEX, cd->resref);
+		lua_getfield (L, -1, name);
+
+		if (!lua_isnil (L, -1)) {
+			lua_pop (L, 3);
+			continue;
+		}
+
+		lua_pop (L, 1);
+		lua_pushboolean (L, FALSE);
+		lua_setfield (L, -2, name);
+		lua_pop (L, 1);
+
+		elt = rspamd_mempool_alloc (task->task_pool, sizeof (*elt));
+		elt->batch = cd;
+		elt->name = rspamd_mempool_strdup (task->task_pool, name);
+		lua_pop (L, 1);
+
+		if (type == RDNS_REQUEST_PTR) {
+			ptr_str = rdns_generate_ptr_from_str (elt->name);
+
+			if (ptr_str == NULL) {
+				msg_err_task ("wrong resolve string to PTR request: %s",
+						elt->name);
+				lua_dns_resolver_batch_unset (L, cd, elt->name);
+				continue;
+			}
+
+			name = rspamd_mempool_strdup (task->task_pool, ptr_str);
+			free (ptr_str);
+		}
+		else {
+			name = elt->name;
+		}
+
+		cd->pending ++;
+
+		if (forced) {
+			ret = make_dns_request_task_forced (task,
+					lua_dns_resolver_batch_callback, elt, type, name);
+		}
+		else {
+			ret = make_dns_request_task (task,
+					lua_dns_resolver_batch_callback, elt, type, name);
+		}
+
+		if (ret) {
+			scheduled ++;
+		}
+		else {
+			cd->pending --;
+			lua_dns_resolver_batch_unset (L, cd, elt->name);
+		}
+	}
+
+	lua_pop (L, 1); /* Names */
+
+	if (scheduled == 0) {
+		lua_dns_resolver_batch_dtor (cd);
+	}
+	else if (--cd->pending == 0) {
+		lua_dns_resolver_batch_fin (cd);
+	}
+
+	lua_pushinteger (L, scheduled);
+
+	return 1;
+}
+
 static gint
 lua_load_dns_resolver (lua_State *L)
 {
@@ -0,0 +1,175 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "lua_common.h"
+#include "lua_ffi.h"
+#include "libmime/message.h"
+#include "libmime/filter.h"
+
+/*
+ * All functions here are called with userdata pointers as they are seen by
+ * LuaJIT FFI, e.g. `struct rspamd_task **` for `rspamd{task}`
+ */
+
+static inline struct rspamd_mime_header *
+rspamd_ffi_task_first_header (struct rspamd_task *task, const char *name,
+		int is_strong)
+{
+	GPtrArray *ar;
+
+	ar = rspamd_message_get_header_array (task, name, is_strong);
+
+	if (ar == NULL || ar->len == 0) {
+		return NULL;
+	}
+
+	return g_ptr_array_index (ar, 0);
+}
+
+int
+rspamd_ffi_task_header_count (void *ptask, const char *name, int is_strong)
+{
+	struct rspamd_task *task = *(struct rspamd_task **)ptask;
+	GPtrArray *ar;
+
+	ar = rspamd_message_get_header_array (task, name, is_strong);
+
+	return ar ? ar->len : 0;
+}
+
+const char *
+rspamd_ffi_task_header (void *ptask, const char *name, int is_strong,
+		int is_raw, size_t *len)
+{
+	struct rspamd_task *task = *(struct rspamd_task **)ptask;
+	struct rspamd_mime_header *rh;
+	const gchar *val;
+
+	rh = rspamd_ffi_task_first_header (task, name, is_strong);
+
+	if (rh == NULL) {
+		return NULL;
+	}
+
+	val = is_raw ? rh->value :
+			rspamd_mime_header_get_decoded (task->task_pool, rh);
+
+	if (val != NULL && len != NULL) {
+		*len = strlen (val);
+	}
+
+	return val;
+}
+
+int
+rspamd_ffi_task_insert_result (void *ptask, const char *symbol,
+		double weight, const char *opt)
+{
+	struct rspamd_task *task = *(struct rspamd_task **)ptask;
+	struct rspamd_symbol_result *s;
+
+	s = rspamd_task_insert_result_full (task,
+			rspamd_mempool_strdup (task->task_pool, symbol),
+			weight, NULL, RSPAMD_SYMBOL_INSERT_DEFAULT);
+
+	if (s == NULL) {
+		return 0;
+	}
+
+	if (opt != NULL) {
+		rspamd_task_add_result_option (task, s, opt);
+	}
+
+	return 1;
+}
+
+int
+rspamd_ffi_task_has_symbol (void *ptask, const char *symbol)
+{
+	struct rspamd_task *task = *(struct rspamd_task **)ptask;
+
+	return rspamd_task_find_symbol_result (task, symbol) != NULL;
+}
+
+size_t
+rspamd_ffi_task_len (void *ptask)
+{
+	struct rspamd_task *task = *(struct rspamd_task **)ptask;
+
+	return task->msg.len;
+}
+
+size_t
+rspamd_ffi_mimepart_length (void *ppart)
+{
+	struct rspamd_mime_part *part = *(struct rspamd_mime_part **)ppart;
+
+	return part->parsed_data.len;
+}
+
+unsigned int
+rspamd_ffi_mimepart_flags (void *ppart)
+{
+	struct rspamd_mime_part *part = *(struct rspamd_mime_part **)ppart;
+
+	return part->flags;
+}
+
+size_t
+rspamd_ffi_textpart_length (void *ppart)
+{
+	struct rspamd_mime_text_part *part = *(struct rspamd_mime_text_part **)ppart;
+
+	if (IS_PART_EMPTY (part) || part->utf_content == NULL) {
+		return 0;
+	}
+
+	return part->utf_content->len;
+}
+
+unsigned int
+rspamd_ffi_textpart_flags (void *ppart)
+{
+	struct rspamd_mime_text_part *part = *(struct rspamd_mime_text_part **)ppart;
+
+	return part->flags;
+}
+
+const char *
+rspamd_ffi_url_host (void *purl, size_t *len)
+{
+	struct rspamd_lua_url *url = purl;
+
+	*len = url->url->hostlen;
+
+	return url->url->host;
+}
+
+const char *
+rspamd_ffi_url_tld (void *purl, size_t *len)
+{
+	struct rspamd_lua_url *url = purl;
+
+	*len = url->url->tldlen;
+
+	return url->url->tldlen > 0 ? url->url->tld : NULL;
+}
+
+unsigned int
+rspamd_ffi_url_flags (void *purl)
+{
+	struct rspamd_lua_url *url = purl;
+
+	return url->url->flags;
+}
@@ -0,0 +1,51 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef RSPAMD_LUA_FFI_H
+#define RSPAMD_LUA_FFI_H
+
+#include <stddef.h>
+
+/*
+ * Accessors callable from LuaJIT FFI (see lualib/lua_ffi_accessors.lua).
+ * Objects are passed as Lua userdata, so no type checks are performed and
+ * only plain C types are used in this ABI: it must not be changed
+ * incompatibly, as declarations are duplicated in Lua code.
+ */
+
+/* rspamd{task} */
+int rspamd_ffi_task_header_count (void *ptask, const char *name,
+		int is_strong);
+/* Returns the first header value (decoded or raw) or NULL */
+const char *rspamd_ffi_task_header (void *ptask, const char *name,
+		int is_strong, int is_raw, size_t *len);
+/* Returns non-zero if a symbol has been inserted */
+int rspamd_ffi_task_insert_result (void *ptask, const char *symbol,
+		double weight, const char *opt);
+int rspamd_ffi_task_has_symbol (void *ptask, const char *symbol);
+size_t rspamd_ffi_task_len (void *ptask);
+
+/* rspamd{mimepart} */
+size_t rspamd_ffi_mimepart_length (void *ppart);
+unsigned int rspamd_ffi_mimepart_flags (void *ppart);
+
+/* rspamd{textpart} */
+size_t rspamd_ffi_textpart_length (void *ppart);
+unsigned int rspamd_ffi_textpart_flags (void *ppart);
+
+/* rspamd{url} */
+const char *rspamd_ffi_url_host (void *purl, size_t *len);
+const char *rspamd_ffi_url_tld (void *purl, size_t *len);
+unsigned int rspamd_ffi_url_flags (void *purl);
+
+#endif
@@ -58,10 +58,12 @@ static const struct luaL_reg httplib_m[] = {
 #define RSPAMD_LUA_HTTP_FLAG_TEXT (1 << 0)
 #define RSPAMD_LUA_HTTP_FLAG_NOVERIFY (1 << 1)
 #define RSPAMD_LUA_HTTP_FLAG_RESOLVED (1 << 2)
+#define RSPAMD_LUA_HTTP_FLAG_REUSED (1 << 3)
 
 struct lua_http_cbdata {
 	struct rspamd_http_connection *conn;
 	struct rspamd_async_session *session;
+	struct rspamd_async_event *async_ev;
 	struct rspamd_symcache_item *item;
 	struct rspamd_http_message *msg;
 	struct event_base *ev_base;
@@ -74,6 +76,7 @@ struct lua_http_cbdata {
 	gchar *mime_type;
 	gchar *host;
 	gchar *auth;
+	gchar *pool_key;
 	const gchar *url;
 	gsize max_size;
 	gint flags;
@@ -83,6 +86,23 @@ struct lua_http_cbdata {
 };
 
 static const int default_http_timeout = 5000;
+static const gdouble default_keepalive_timeout = 10.0;
+static const guint default_keepalive_max_idle = 16;
+
+/*
+ * Idle kept alive connections of a worker are pooled by host, port and TLS
+ * settings, so requests to the same server skip DNS, TCP and TLS handshakes
+ */
+struct lua_http_idle_conn {
+	struct rspamd_http_connection *conn;
+	rspamd_inet_addr_t *addr;
+	GQueue *pool;
+	GList *link;
+	struct event ev;
+	gint fd;
+};
+
+static GHashTable *lua_http_idle_pool = NULL;
 
 static struct rspamd_dns_resolver *
 lua_http_global_resolver (struct event_base *ev_base)
@@ -109,8 +129,9 @@ lua_http_fin (gpointer arg)
 		/* Here we already have a connection, so we need to unref it */
 		rspamd_http_connection_unref (cbd->conn);
 	}
-	else if (cbd->msg != NULL) {
-		/* We need to free message */
+
+	if (cbd->msg != NULL) {
+		/* Either not sent or kept to retry a request on a reused connection */
 		rspamd_http_message_unref (cbd->msg);
 	}
 
@@ -134,6 +155,10 @@ lua_http_fin (gpointer arg)
 		g_free (cbd->auth);
 	}
 
+	if (cbd->pool_key) {
+		g_free (cbd->pool_key);
+	}
+
 	if (cbd->local_kp) {
 		rspamd_keypair_unref (cbd->local_kp);
 	}
@@ -145,6 +170,140 @@ lua_http_fin (gpointer arg)
 	g_free (cbd);
 }
 
+static void
+lua_http_idle_conn_free (struct lua_http_idle_conn *ic)
+{
+	if (rspamd_event_pending (&ic->ev, EV_READ|EV_TIMEOUT)) {
+		event_del (&ic->ev);
+	}
+
+	rspamd_http_connection_unref (ic->conn);
+	rspamd_inet_address_free (ic->addr);
+	close (ic->fd);
+	g_free (ic);
+}
+
+static void
+lua_http_idle_pool_dtor (gpointer p)
+{
+	g_queue_free_full ((GQueue *)p, (GDestroyNotify)lua_http_idle_conn_free);
+}
+
+static void
+lua_http_idle_conn_handler (gint fd, short what, gpointer ud)
+{
+	struct lua_http_idle_conn *ic = ud;
+
+	/* Idle connection is timed out or closed by a peer */
+	g_queue_delete_link (ic->pool, ic->link);
+	lua_http_idle_conn_free (ic);
+}
+
+static gchar *
+lua_http_idle_pool_key (struct lua_http_cbdata *cbd)
+{
+	const gchar *tls = "plain";
+
+	if (cbd->msg->flags & RSPAMD_HTTP_FLAG_SSL) {
+		tls = (cbd->flags & RSPAMD_LUA_HTTP_FLAG_NOVERIFY) ? "tls-noverify" :
+				"tls";
+	}
+
+	/* Event base is a part of the key as idle events are bound to it */
+	return g_strdup_printf ("%s:%d:%s:%p", cbd->host, cbd->msg->port, tls,
+			cbd->ev_base);
+}
+
+/*
+ * Takes the most recently used idle connection for the request if we have any
+ */
+static gboolean
+lua_http_idle_pool_take (struct lua_http_cbdata *cbd)
+{
+	struct lua_http_idle_conn *ic;
+	GQueue *pool;
+
+	if (lua_http_idle_pool == NULL || cbd->pool_key == NULL) {
+		return FALSE;
+	}
+
+	pool = g_hash_table_lookup (lua_http_idle_pool, cbd->pool_key);
+
+	if (pool == NULL || pool->length == 0) {
+		return FALSE;
+	}
+
+	ic = g_queue_pop_head (pool);
+	event_del (&ic->ev);
+	cbd->conn = ic->conn;
+	cbd->fd = ic->fd;
+	cbd->addr = ic->addr;
+	cbd->flags |= RSPAMD_LUA_HTTP_FLAG_REUSED;
+	g_free (ic);
+
+	return TRUE;
+}
+
+/*
+ * Moves connection to the idle pool if both sides have agreed on keep-alive
+ */
+static void
+lua_http_idle_pool_release (struct lua_http_cbdata *cbd)
+{
+	struct lua_http_idle_conn *ic;
+	struct timeval tv;
+	GQueue *pool;
+	gdouble timeout = default_keepalive_timeout;
+	guint max_idle = default_keepalive_max_idle;
+
+	if (cbd->pool_key == NULL || cbd->conn == NULL ||
+			cbd->addr == NULL ||
+			!rspamd_http_connection_is_keepalive (cbd->conn)) {
+		return;
+	}
+
+	if (cbd->cfg) {
+		timeout = cbd->cfg->http_keepalive_timeout;
+		max_idle = cbd->cfg->http_keepalive_max_idle;
+	}
+
+	if (lua_http_idle_pool == NULL) {
+		lua_http_idle_pool = g_hash_table_new_full (rspamd_str_hash,
+				rspamd_str_equal, g_free, lua_http_idle_pool_dtor);
+	}
+
+	pool = g_hash_table_lookup (lua_http_idle_pool, cbd->pool_key);
+
+	if (pool == NULL) {
+		pool = g_queue_new ();
+		g_hash_table_insert (lua_http_idle_pool, g_strdup (cbd->pool_key),
+				pool);
+	}
+
+	if (pool->length >= max_idle) {
+		return;
+	}
+
+	rspamd_http_connection_reset (cbd->conn);
+	ic = g_malloc0 (sizeof (*ic));
+	ic->conn = cbd->conn;
+	ic->fd = cbd->fd;
+	ic->addr = cbd->addr;
+	ic->pool = pool;
+	/* The most recently used connections are reused first */
+	g_queue_push_head (pool, ic);
+	ic->link = pool->head;
+
+	double_to_tv (timeout, &tv);
+	event_set (&ic->ev, ic->fd, EV_READ, lua_http_idle_conn_handler, ic);
+	event_base_set (cbd->ev_base, &ic->ev);
+	event_add (&ic->ev, &tv);
+
+	cbd->conn = NULL;
+	cbd->fd = -1;
+	cbd->addr = NULL;
+}
+
 static void
 lua_http_maybe_free (struct lua_http_cbdata *cbd)
 {
@@ -156,7 +315,7 @@ lua_http_maybe_free (struct lua_http_cbdata *cbd)
 				rspamd_symcache_item_async_dec_check (cbd->task, cbd->item, M);
 			}
 
-			rspamd_session_remove_event (cbd->session, lua_http_fin, cbd);
+			rspamd_session_remove_event_handle (cbd->session, cbd->async_ev);
 		}
 	}
 	else {
@@ -192,11 +351,30 @@ lua_http_push_error (struct lua_http_cbdata *cbd, const char *err)
 
 static void lua_http_resume_handler (struct rspamd_http_connection *conn,
 						 struct rspamd_http_message *msg, const char *err);
+static gboolean lua_http_connect_and_write (struct lua_http_cbdata *cbd);
 
 static void
 lua_http_error_handler (struct rspamd_http_connection *conn, GError *err)
 {
 	struct lua_http_cbdata *cbd = (struct lua_http_cbdata *)conn->ud;
+
+	if ((cbd->flags & RSPAMD_LUA_HTTP_FLAG_REUSED) && err->code != ETIMEDOUT) {
+		/*
+		 * Peer might close an idle connection just before we have reused it,
+		 * so we retry with a new connection
+		 */
+		msg_debug ("cannot reuse connection to %s: %e", cbd->host, err);
+		cbd->flags &= ~RSPAMD_LUA_HTTP_FLAG_REUSED;
+		rspamd_http_connection_unref (cbd->conn);
+		cbd->conn = NULL;
+		close (cbd->fd);
+		cbd->fd = -1;
+
+		if (lua_http_connect_and_write (cbd)) {
+			return;
+		}
+	}
+
 	if (cbd->cbref == -1) {
 		lua_http_resume_handler (conn, NULL, err->message);
 	}
@@ -220,6 +398,7 @@ lua_http_finish_handler (struct rspamd_http_connection *conn,
 
 	if (cbd->cbref == -1) {
 		lua_http_resume_handler (conn, msg, NULL);
+		lua_http_idle_pool_release (cbd);
 		lua_http_maybe_free (cbd);
 		return 0;
 	}
@@ -275,6 +454,7 @@ lua_http_finish_handler (struct rspamd_http_connection *conn,
 		lua_pop (L, 1);
 	}
 
+	lua_http_idle_pool_release (cbd);
 	lua_http_maybe_free (cbd);
 
 	lua_thread_pool_restore_callback (&lcbd);
@@ -365,82 +545,110 @@ lua_http_resume_handler (struct rspamd_http_connection *conn,
 }
 
 static gboolean
-lua_http_make_connection (struct lua_http_cbdata *cbd)
+lua_http_connect_and_write (struct lua_http_cbdata *cbd)
 {
 	int fd;
+	unsigned opts = RSPAMD_HTTP_CLIENT_SIMPLE;
 
-	rspamd_inet_address_set_port (cbd->addr, cbd->msg->port);
-	fd = rspamd_inet_address_connect (cbd->addr, SOCK_STREAM, TRUE);
-
-	if (fd == -1) {
-		msg_info ("cannot connect to %V", cbd->msg->host);
-		return FALSE;
-	}
-	cbd->fd = fd;
-
-	if (cbd->cfg) {
-		cbd->conn = rspamd_http_connection_new (NULL,
-				lua_http_error_handler,
-				lua_http_finish_handler,
-				RSPAMD_HTTP_CLIENT_SIMPLE,
-				RSPAMD_HTTP_CLIENT,
-				NULL,
-				(cbd->flags & RSPAMD_LUA_HTTP_FLAG_NOVERIFY) ?
-				cbd->cfg->libs_ctx->ssl_ctx_noverify : cbd->cfg->libs_ctx->ssl_ctx);
-	}
-	else {
-		cbd->conn = rspamd_http_connection_new (NULL,
-				lua_http_error_handler,
-				lua_http_finish_handler,
-				RSPAMD_HTTP_CLIENT_SIMPLE,
-				RSPAMD_HTTP_CLIENT,
-				NULL,
-				NULL);
-	}
+	if (!(cbd->flags & RSPAMD_LUA_HTTP_FLAG_REUSED)) {
+		rspamd_inet_address_set_port (cbd->addr, cbd->msg->port);
+		fd = rspamd_inet_address_connect (cbd->addr, SOCK_STREAM, TRUE);
 
-	if (cbd->conn) {
-		if (cbd->local_kp) {
-			rspamd_http_connection_set_key (cbd->conn, cbd->local_kp);
+		if (fd == -1) {
+			msg_info ("cannot connect to %V", cbd->msg->host);
+			return FALSE;
 		}
+		cbd->fd = fd;
 
-		if (cbd->peer_pk) {
-			rspamd_http_message_set_peer_key (cbd->msg, cbd->peer_pk);
+		if (cbd->pool_key) {
+			opts |= RSPAMD_HTTP_KEEP_ALIVE;
 		}
 
-		if (cbd->flags & RSPAMD_LUA_HTTP_FLAG_NOVERIFY) {
-			cbd->msg->flags |= RSPAMD_HTTP_FLAG_SSL_NOVERIFY;
+		if (cbd->cfg) {
+			cbd->conn = rspamd_http_connection_new (NULL,
+					lua_http_error_handler,
+					lua_http_finish_handler,
+					opts,
+					RSPAMD_HTTP_CLIENT,
+					NULL,
+					(cbd->flags & RSPAMD_LUA_HTTP_FLAG_NOVERIFY) ?
+					cbd->cfg->libs_ctx->ssl_ctx_noverify : cbd->cfg->libs_ctx->ssl_ctx);
+		}
+		else {
+			cbd->conn = rspamd_http_connection_new (NULL,
+					lua_http_error_handler,
+					lua_http_finish_handler,
+					opts,
+					RSPAMD_HTTP_CLIENT,
+					NULL,
+					NULL);
 		}
 
-		if (cbd->max_size) {
-			rspamd_http_connection_set_max_size (cbd->conn, cbd->max_size);
+		if (cbd->conn == NULL) {
+			return FALSE;
 		}
 
-		if (cbd->auth) {
-			rspamd_http_message_add_header (cbd->msg, "Authorization",
-					cbd->auth);
+		if (cbd->local_kp) {
+			rspamd_http_connection_set_key (cbd->conn, cbd->local_kp);
 		}
+	}
 
+	if (cbd->max_size) {
+		rspamd_http_connection_set_max_size (cbd->conn, cbd->max_size);
+	}
+
+	if (cbd->flags & RSPAMD_LUA_HTTP_FLAG_REUSED) {
+		/* Keep the message to retry if the peer has closed the connection */
+		rspamd_http_connection_write_message (cbd->conn,
+				rspamd_http_message_ref (cbd->msg),
+				cbd->host, cbd->mime_type, cbd, cbd->fd,
+				&cbd->tv, cbd->ev_base);
+	}
+	else {
 		rspamd_http_connection_write_message (cbd->conn, cbd->msg,
-				cbd->host, cbd->mime_type, cbd, fd,
+				cbd->host, cbd->mime_type, cbd, cbd->fd,
 				&cbd->tv, cbd->ev_base);
 		/* Message is now owned by a connection object */
 		cbd->msg = NULL;
+	}
 
-		if (cbd->session) {
-			rspamd_session_add_event (cbd->session,
-					(event_finalizer_t) lua_http_fin, cbd,
-					M);
-			cbd->flags |= RSPAMD_LUA_HTTP_FLAG_RESOLVED;
-		}
+	return TRUE;
+}
 
-		if (cbd->item) {
-			rspamd_symcache_item_async_inc (cbd->task, cbd->item, M);
-		}
+static gboolean
+lua_http_make_connection (struct lua_http_cbdata *cbd)
+{
+	if (cbd->peer_pk) {
+		rspamd_http_message_set_peer_key (cbd->msg, cbd->peer_pk);
+	}
 
-		return TRUE;
+	if (cbd->flags & RSPAMD_LUA_HTTP_FLAG_NOVERIFY) {
+		cbd->msg->flags |= RSPAMD_HTTP_FLAG_SSL_NOVERIFY;
+	}
+
+	if (cbd->auth) {
+		rspamd_http_message_add_header (cbd->msg, "Authorization",
+				cbd->auth);
+	}
+
+	if (!lua_http_connect_and_write (cbd)) {
+		return FALSE;
+	}
+
+	if (cbd->session) {
+		cbd->async_ev = rspamd_session_add_event_handle (cbd->session,
+				(event_finalizer_t) lua_http_fin, cbd,
+				M);
+		rspamd_session_event_set_peer (cbd->session, cbd->async_ev,
+				cbd->host);
+		cbd->flags |= RSPAMD_LUA_HTTP_FLAG_RESOLVED;
+	}
+
+	if (cbd->item) {
+		rspamd_symcache_item_async_inc (cbd->task, cbd->item, M);
 	}
 
-	return FALSE;
+	return TRUE;
 }
 
 static void
@@ -531,6 +739,7 @@ lua_http_push_headers (lua_State *L, struct rspamd_http_message *msg)
  * @param {boolean} no_ssl_verify disable SSL peer checks
  * @param {string} user for HTTP authentication
  * @param {string} password for HTTP authentication, only if "user" present
+ * @param {boolean} keepalive reuse connections to the same host, port and TLS settings if the server allows keep-alive (default: true), idle connections are limited by `http_keepalive_timeout` and `http_keepalive_max_idle` options
  * @return {boolean} `true`, in **async** mode, if a request has been successfully scheduled. If this value is `false` then some error occurred, the callback thus will not be called.
  * @return In **sync** mode `string|nil, nil|table` In sync mode  error message if any and response as table: `int` _code_, `string` _content_ and `table` _headers_ (header -> value)
  */
@@ -558,7 +767,7 @@ lua_http_request (lua_State *L)
 	gchar *mime_type = NULL;
 	gchar *auth = NULL;
 	gsize max_size = 0;
-	gboolean gzip = FALSE;
+	gboolean gzip = FALSE, keepalive = TRUE;
 
 	if (lua_gettop (L) >= 2) {
 		/* url, callback and event_base format */
@@ -806,6 +1015,15 @@ lua_http_request (lua_State *L)
 
 		lua_pop (L, 1);
 
+		lua_pushstring (L, "keepalive");
+		lua_gettable (L, 1);
+
+		if (lua_type (L, -1) == LUA_TBOOLEAN) {
+			keepalive = lua_toboolean (L, -1);
+		}
+
+		lua_pop (L, 1);
+
 		lua_pushstring (L, "max_size");
 		lua_gettable (L, 1);
 
@@ -902,6 +1120,16 @@ lua_http_request (lua_State *L)
 		cbd->host = rspamd_fstring_cstr (msg->host);
 	}
 
+	if (cfg && (cfg->http_keepalive_timeout <= 0 ||
+			cfg->http_keepalive_max_idle == 0)) {
+		keepalive = FALSE;
+	}
+
+	/* Encrypted connections have per connection keys, so they are not pooled */
+	if (keepalive && cbd->host && !local_kp && !peer_key) {
+		cbd->pool_key = lua_http_idle_pool_key (cbd);
+	}
+
 	if (body) {
 		if (gzip) {
 			if (rspamd_fstring_gzip (&body)) {
@@ -916,7 +1144,17 @@ lua_http_request (lua_State *L)
 		cbd->session = session;
 	}
 
-	if (rspamd_parse_inet_address (&cbd->addr, msg->host->str, msg->host->len)) {
+	if (lua_http_idle_pool_take (cbd)) {
+		/* Idle connection to the same server, no need to resolve or connect */
+		if (!lua_http_make_connection (cbd)) {
+			lua_http_maybe_free (cbd);
+			lua_pushboolean (L, FALSE);
+
+			return 1;
+		}
+	}
+	else if (rspamd_parse_inet_address (&cbd->addr, msg->host->str,
+			msg->host->len)) {
 		/* Host is numeric IP, no need to resolve */
 		if (!lua_http_make_connection (cbd)) {
 			lua_http_maybe_free (cbd);
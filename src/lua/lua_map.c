@@ -18,6 +18,8 @@
 #include "libutil/map.h"
 #include "libutil/map_helpers.h"
 #include "libutil/map_private.h"
+#include "libmime/message.h"
+#include "libserver/task.h"
 #include "contrib/libucl/lua_ucl.h"
 
 /***
@@ -39,6 +41,15 @@
  */
 LUA_FUNCTION_DEF (map, get_key);
 
+/***
+ * @method map:get_received_keys(task)
+ * Checks addresses of all received headers of a task against radix map in
+ * a single call
+ * @param {rspamd_task} task task object
+ * @return {table} array with a value (or `false` if not found) for each received header
+ */
+LUA_FUNCTION_DEF (map, get_received_keys);
+
 
 /***
  * @method map:is_signed()
@@ -110,6 +121,7 @@ LUA_FUNCTION_DEF (map, get_nelts);
 
 static const struct luaL_reg maplib_m[] = {
 	LUA_INTERFACE_DEF (map, get_key),
+	LUA_INTERFACE_DEF (map, get_received_keys),
 	LUA_INTERFACE_DEF (map, is_signed),
 	LUA_INTERFACE_DEF (map, get_proto),
 	LUA_INTERFACE_DEF (map, get_sign_key),
@@ -123,6 +135,61 @@ static const struct luaL_reg maplib_m[] = {
 	{NULL, NULL}
 };
 
+/***
+ * @module rspamd_map_group
+ * Map group checks a single value against many maps of the same kind (e.g.
+ * all radix or all hash maps used by multimap rules) in one call
+ * @example
+local rspamd_map_group = require "rspamd_map_group"
+local group = rspamd_map_group.create()
+local idx = group:add(rspamd_config:add_map({url = 'file:///tmp/ips', type = 'radix'}))
+local res = group:get_key(task:get_from_ip())
+if res[idx] then ... end
+ */
+
+/***
+ * @function rspamd_map_group.create()
+ * Creates new empty map group
+ * @return {rspamd_map_group} new group
+ */
+LUA_FUNCTION_DEF (map_group, create);
+/***
+ * @method map_group:add(map)
+ * Adds radix, set or kv map to the group. All maps in a group must accept
+ * the same keys: either IP addresses or strings
+ * @param {rspamd_map} map map to add
+ * @return {number} index of the map in the group or nil if map cannot be added
+ */
+LUA_FUNCTION_DEF (map_group, add);
+/***
+ * @method map_group:get_key(in)
+ * Checks key against all maps in the group
+ * @param {vary} in input to check (the same as `map:get_key` accepts)
+ * @return {table} table indexed by map index with values found (`true` for set maps), missing maps are not included
+ */
+LUA_FUNCTION_DEF (map_group, get_key);
+LUA_FUNCTION_DEF (map_group, len);
+LUA_FUNCTION_DEF (map_group, gc);
+
+static const struct luaL_reg map_grouplib_m[] = {
+	LUA_INTERFACE_DEF (map_group, add),
+	LUA_INTERFACE_DEF (map_group, get_key),
+	{"__len", lua_map_group_len},
+	{"__tostring", rspamd_lua_class_tostring},
+	{"__gc", lua_map_group_gc},
+	{NULL, NULL}
+};
+static const struct luaL_reg map_grouplib_f[] = {
+	LUA_INTERFACE_DEF (map_group, create),
+	{NULL, NULL}
+};
+
+struct lua_map_group {
+	GPtrArray *maps;
+	GArray *refs;
+	gboolean radix;
+};
+
 struct lua_map_callback_data {
 	lua_State *L;
 	gint ref;
@@ -753,6 +820,47 @@ lua_map_process_string_key (lua_State *L, gint pos, gsize *len)
 	return NULL;
 }
 
+static gint
+lua_map_get_received_keys (lua_State * L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_lua_map *map = lua_check_map (L, 1);
+	struct rspamd_task *task = lua_check_task (L, 2);
+	struct received_header *rh;
+	const rspamd_inet_addr_t **addrs;
+	gconstpointer *results;
+	guint i, n;
+
+	if (map == NULL || task == NULL || map->type != RSPAMD_LUA_MAP_RADIX) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	n = task->received ? task->received->len : 0;
+	addrs = g_alloca (sizeof (*addrs) * (n + 1));
+	results = g_alloca (sizeof (*results) * (n + 1));
+
+	for (i = 0; i < n; i ++) {
+		rh = rspamd_task_get_received (task, i);
+		addrs[i] = rh->addr;
+	}
+
+	rspamd_match_radix_map_addrs (map->data.radix, addrs, n, results);
+	lua_createtable (L, n, 0);
+
+	for (i = 0; i < n; i ++) {
+		if (results[i]) {
+			lua_pushstring (L, results[i]);
+		}
+		else {
+			lua_pushboolean (L, false);
+		}
+
+		lua_rawseti (L, -2, i + 1);
+	}
+
+	return 1;
+}
+
 /* Radix and hash table functions */
 static gint
 lua_map_get_key (lua_State * L)
@@ -1162,10 +1270,210 @@ lua_map_get_uri (lua_State *L)
 	return map->map->backends->len;
 }
 
+static struct lua_map_group *
+lua_check_map_group (lua_State * L, gint pos)
+{
+	void *ud = rspamd_lua_check_udata (L, pos, "rspamd{map_group}");
+	luaL_argcheck (L, ud != NULL, pos, "'map_group' expected");
+	return ud ? *((struct lua_map_group **)ud) : NULL;
+}
+
+static gint
+lua_map_group_create (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct lua_map_group *group, **pgroup;
+
+	group = g_malloc0 (sizeof (*group));
+	group->maps = g_ptr_array_new ();
+	group->refs = g_array_new (FALSE, FALSE, sizeof (gint));
+	pgroup = lua_newuserdata (L, sizeof (*pgroup));
+	rspamd_lua_setclass (L, "rspamd{map_group}", -1);
+	*pgroup = group;
+
+	return 1;
+}
+
+static gint
+lua_map_group_add (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct lua_map_group *group = lua_check_map_group (L, 1);
+	struct rspamd_lua_map *map = lua_check_map (L, 2);
+	gboolean radix;
+	gint ref;
+
+	if (group == NULL || map == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	if (map->type == RSPAMD_LUA_MAP_RADIX) {
+		radix = TRUE;
+	}
+	else if (map->type == RSPAMD_LUA_MAP_SET ||
+			map->type == RSPAMD_LUA_MAP_HASH) {
+		radix = FALSE;
+	}
+	else {
+		lua_pushnil (L);
+		return 1;
+	}
+
+	if (group->maps->len > 0 && group->radix != radix) {
+		lua_pushnil (L);
+		return 1;
+	}
+
+	group->radix = radix;
+	/* Map must not be collected while it is used by a group */
+	lua_pushvalue (L, 2);
+	ref = luaL_ref (L, LUA_REGISTRYINDEX);
+	g_array_append_val (group->refs, ref);
+	g_ptr_array_add (group->maps, map);
+	lua_pushinteger (L, group->maps->len);
+
+	return 1;
+}
+
+static gint
+lua_map_group_get_key (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct lua_map_group *group = lua_check_map_group (L, 1);
+	struct rspamd_lua_map *map;
+	struct rspamd_lua_ip *addr = NULL;
+	const gchar *key = NULL, *addr_str;
+	gconstpointer value;
+	gpointer ud;
+	gsize len;
+	guint i;
+
+	if (group == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	/* Key is parsed once for all maps in the group */
+	if (group->radix) {
+		if (lua_type (L, 2) == LUA_TSTRING) {
+			addr_str = lua_tolstring (L, 2, &len);
+			addr = g_alloca (sizeof (*addr));
+			addr->addr = g_alloca (rspamd_inet_address_storage_size ());
+
+			if (!rspamd_parse_inet_address_ip (addr_str, len, addr->addr)) {
+				addr = NULL;
+				msg_err ("invalid ip address: %*s", (gint)len, addr_str);
+			}
+		}
+		else if (lua_type (L, 2) == LUA_TUSERDATA) {
+			ud = rspamd_lua_check_udata (L, 2, "rspamd{ip}");
+
+			if (ud != NULL) {
+				addr = *((struct rspamd_lua_ip **)ud);
+
+				if (addr->addr == NULL) {
+					addr = NULL;
+				}
+			}
+			else {
+				msg_err ("invalid userdata type provided, rspamd{ip} expected");
+			}
+		}
+	}
+	else {
+		key = lua_map_process_string_key (L, 2, &len);
+	}
+
+	lua_createtable (L, 0, 0);
+
+	if (addr == NULL && key == NULL) {
+		return 1;
+	}
+
+	PTR_ARRAY_FOREACH (group->maps, i, map) {
+		value = NULL;
+
+		if (addr != NULL) {
+			if (map->data.radix) {
+				value = rspamd_match_radix_map_addr (map->data.radix,
+						addr->addr);
+			}
+		}
+		else if (map->data.hash) {
+			value = rspamd_match_hash_map (map->data.hash, key);
+		}
+
+		if (value == NULL) {
+			continue;
+		}
+
+		if (map->type == RSPAMD_LUA_MAP_SET) {
+			lua_pushboolean (L, true);
+		}
+		else {
+			lua_pushstring (L, value);
+		}
+
+		lua_rawseti (L, -2, i + 1);
+	}
+
+	return 1;
+}
+
+static gint
+lua_map_group_len (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct lua_map_group *group = lua_check_map_group (L, 1);
+
+	if (group == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	lua_pushinteger (L, group->maps->len);
+
+	return 1;
+}
+
+static gint
+lua_map_group_gc (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct lua_map_group *group = lua_check_map_group (L, 1);
+	guint i;
+
+	if (group) {
+		for (i = 0; i < group->refs->len; i ++) {
+			luaL_unref (L, LUA_REGISTRYINDEX,
+					g_array_index (group->refs, gint, i));
+		}
+
+		g_array_free (group->refs, TRUE);
+		g_ptr_array_free (group->maps, TRUE);
+		g_free (group);
+	}
+
+	return 0;
+}
+
+static gint
+lua_load_map_group (lua_State *L)
+{
+	lua_newtable (L);
+	luaL_register (L, NULL, map_grouplib_f);
+
+	return 1;
+}
+
 void
 luaopen_map (lua_State * L)
 {
 	rspamd_lua_new_class (L, "rspamd{map}", maplib_m);
 
 	lua_pop (L, 1);
+
+	rspamd_lua_new_class (L, "rspamd{map_group}", map_grouplib_m);
+
+	lua_pop (L, 1);
+
+	rspamd_lua_add_preload (L, "rspamd_map_group", lua_load_map_group);
 }
@@ -236,20 +236,22 @@ end
  */
 
 /***
- * @method mime_part:get_header(name[, case_sensitive])
+ * @method mime_part:get_header(name[, case_sensitive[, as_text]])
  * Get decoded value of a header specified with optional case_sensitive flag.
  * By default headers are searched in caseless matter.
  * @param {string} name name of header to get
  * @param {boolean} case_sensitive case sensitiveness flag to search for a header
+ * @param {boolean} as_text return `rspamd_text` pointing to the task memory instead of a string copy
  * @return {string} decoded value of a header
  */
 LUA_FUNCTION_DEF (mimepart, get_header);
 /***
- * @method mime_part:get_header_raw(name[, case_sensitive])
+ * @method mime_part:get_header_raw(name[, case_sensitive[, as_text]])
  * Get raw value of a header specified with optional case_sensitive flag.
  * By default headers are searched in caseless matter.
  * @param {string} name name of header to get
  * @param {boolean} case_sensitive case sensitiveness flag to search for a header
+ * @param {boolean} as_text return `rspamd_text` pointing to the task memory instead of a string copy
  * @return {string} raw value of a header
  */
 LUA_FUNCTION_DEF (mimepart, get_header_raw);
@@ -1078,16 +1080,18 @@ lua_mimepart_get_content (lua_State * L)
 	LUA_TRACE_POINT;
 	struct rspamd_mime_part *part = lua_check_mimepart (L);
 	struct rspamd_lua_text *t;
+	const rspamd_ftok_t *parsed;
 
 	if (part == NULL) {
 		lua_pushnil (L);
 		return 1;
 	}
 
+	parsed = rspamd_mime_part_get_parsed (part);
 	t = lua_newuserdata (L, sizeof (*t));
 	rspamd_lua_setclass (L, "rspamd{text}", -1);
-	t->start = part->parsed_data.begin;
-	t->len = part->parsed_data.len;
+	t->start = parsed->begin;
+	t->len = parsed->len;
 	t->flags = 0;
 
 	return 1;
@@ -1241,10 +1245,19 @@ lua_mimepart_get_header_common (lua_State *L, enum rspamd_lua_task_header_type h
 
 	if (name && part) {
 
+		if (lua_toboolean (L, 4)) {
+			if (how == RSPAMD_TASK_HEADER_PUSH_SIMPLE) {
+				how = RSPAMD_TASK_HEADER_PUSH_SIMPLE_TEXT;
+			}
+			else if (how == RSPAMD_TASK_HEADER_PUSH_RAW) {
+				how = RSPAMD_TASK_HEADER_PUSH_RAW_TEXT;
+			}
+		}
+
 		ar = rspamd_message_get_header_from_hash (part->raw_headers, NULL,
 				name, FALSE);
 
-		return rspamd_lua_push_header_array (L, ar, how);
+		return rspamd_lua_push_header_array (L, part->pool, ar, how);
 	}
 
 	lua_pushnil (L);
@@ -1553,7 +1566,7 @@ lua_mimepart_headers_foreach (lua_State *L)
 				old_top = lua_gettop (L);
 				lua_pushvalue (L, 2);
 				lua_pushstring (L, hdr->name);
-				rspamd_lua_push_header (L, hdr, how);
+				rspamd_lua_push_header (L, part->pool, hdr, how);
 
 				if (lua_pcall (L, 2, LUA_MULTRET, 0) != 0) {
 					msg_err ("call to header_foreach failed: %s",
@@ -0,0 +1,1061 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "lua_common.h"
+#include "unix-std.h"
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/***
+ * @module rspamd_mlp
+ * This module provides native multilayer perceptron with float32 weights.
+ * It has the same interface as `rspamd_fann` but it does not depend on any
+ * external library. All layers use symmetric sigmoid (tanh) activation.
+ */
+
+#define RSPAMD_MLP_MAGIC "rmlp"
+#define RSPAMD_MLP_VERSION 1
+#define RSPAMD_MLP_MAX_LAYERS 16
+#define RSPAMD_MLP_MAX_THREADS 32
+
+struct rspamd_mlp {
+	guint nlayers;
+	guint layers[RSPAMD_MLP_MAX_LAYERS];
+	/* Offsets of weights matrices for each pair of layers */
+	gsize woffs[RSPAMD_MLP_MAX_LAYERS];
+	/* Offsets of neurons for each layer */
+	gsize aoffs[RSPAMD_MLP_MAX_LAYERS];
+	gsize nweights;
+	gsize nneurons;
+	gfloat mse;
+	/* Row major, each row has `layers[l] + 1` elements, bias is the last one */
+	gfloat *weights;
+};
+
+struct rspamd_mlp_hdr {
+	gchar magic[4];
+	guint32 version;
+	guint32 nlayers;
+};
+
+LUA_FUNCTION_DEF (mlp, create);
+LUA_FUNCTION_DEF (mlp, load_data);
+LUA_FUNCTION_DEF (mlp, data);
+LUA_FUNCTION_DEF (mlp, test);
+LUA_FUNCTION_DEF (mlp, train_threaded);
+LUA_FUNCTION_DEF (mlp, get_inputs);
+LUA_FUNCTION_DEF (mlp, get_outputs);
+LUA_FUNCTION_DEF (mlp, get_layers);
+LUA_FUNCTION_DEF (mlp, get_mse);
+LUA_FUNCTION_DEF (mlp, dtor);
+
+static luaL_reg rspamd_mlp_f[] = {
+		LUA_INTERFACE_DEF (mlp, create),
+		LUA_INTERFACE_DEF (mlp, load_data),
+		{NULL, NULL}
+};
+
+static luaL_reg rspamd_mlp_m[] = {
+		LUA_INTERFACE_DEF (mlp, data),
+		LUA_INTERFACE_DEF (mlp, test),
+		LUA_INTERFACE_DEF (mlp, train_threaded),
+		LUA_INTERFACE_DEF (mlp, get_inputs),
+		LUA_INTERFACE_DEF (mlp, get_outputs),
+		LUA_INTERFACE_DEF (mlp, get_layers),
+		LUA_INTERFACE_DEF (mlp, get_mse),
+		{"__gc", lua_mlp_dtor},
+		{"__tostring", rspamd_lua_class_tostring},
+		{NULL, NULL}
+};
+
+static struct rspamd_mlp *
+rspamd_lua_check_mlp (lua_State *L, gint pos)
+{
+	void *ud = rspamd_lua_check_udata (L, pos, "rspamd{mlp}");
+	luaL_argcheck (L, ud != NULL, pos, "'mlp' expected");
+	return ud ? *((struct rspamd_mlp **) ud) : NULL;
+}
+
+/*
+ * Dot product of two float vectors, the most time consuming part of both
+ * inference and training
+ */
+static inline gfloat
+rspamd_mlp_dot (const gfloat *a, const gfloat *b, gsize n)
+{
+	gsize i = 0;
+	gfloat res;
+#ifdef __SSE2__
+	__m128 acc0 = _mm_setzero_ps (), acc1 = _mm_setzero_ps ();
+	gfloat tmp[4];
+
+	for (; i + 8 <= n; i += 8) {
+		acc0 = _mm_add_ps (acc0, _mm_mul_ps (_mm_loadu_ps (a + i),
+				_mm_loadu_ps (b + i)));
+		acc1 = _mm_add_ps (acc1, _mm_mul_ps (_mm_loadu_ps (a + i + 4),
+				_mm_loadu_ps (b + i + 4)));
+	}
+
+	_mm_storeu_ps (tmp, _mm_add_ps (acc0, acc1));
+	res = tmp[0] + tmp[1] + tmp[2] + tmp[3];
+#else
+	gfloat acc[4] = {0, 0, 0, 0};
+
+	for (; i + 4 <= n; i += 4) {
+		acc[0] += a[i] * b[i];
+		acc[1] += a[i + 1] * b[i + 1];
+		acc[2] += a[i + 2] * b[i + 2];
+		acc[3] += a[i + 3] * b[i + 3];
+	}
+
+	res = acc[0] + acc[1] + acc[2] + acc[3];
+#endif
+
+	for (; i < n; i ++) {
+		res += a[i] * b[i];
+	}
+
+	return res;
+}
+
+/* y += alpha * x */
+static inline void
+rspamd_mlp_axpy (gfloat *y, const gfloat *x, gfloat alpha, gsize n)
+{
+	gsize i = 0;
+#ifdef __SSE2__
+	__m128 va = _mm_set1_ps (alpha);
+
+	for (; i + 4 <= n; i += 4) {
+		_mm_storeu_ps (y + i, _mm_add_ps (_mm_loadu_ps (y + i),
+				_mm_mul_ps (va, _mm_loadu_ps (x + i))));
+	}
+#endif
+
+	for (; i < n; i ++) {
+		y[i] += alpha * x[i];
+	}
+}
+
+static struct rspamd_mlp *
+rspamd_mlp_new (guint nlayers, const guint *layers)
+{
+	struct rspamd_mlp *mlp;
+	guint i;
+
+	if (nlayers < 2 || nlayers > RSPAMD_MLP_MAX_LAYERS) {
+		return NULL;
+	}
+
+	for (i = 0; i < nlayers; i ++) {
+		if (layers[i] == 0) {
+			return NULL;
+		}
+	}
+
+	mlp = g_malloc0 (sizeof (*mlp));
+	mlp->nlayers = nlayers;
+
+	for (i = 0; i < nlayers; i ++) {
+		mlp->layers[i] = layers[i];
+		mlp->aoffs[i] = mlp->nneurons;
+		mlp->nneurons += layers[i];
+
+		if (i > 0) {
+			mlp->woffs[i - 1] = mlp->nweights;
+			mlp->nweights += (gsize)layers[i] * (layers[i - 1] + 1);
+		}
+	}
+
+	mlp->weights = g_malloc0 (mlp->nweights * sizeof (gfloat));
+
+	return mlp;
+}
+
+static void
+rspamd_mlp_free (struct rspamd_mlp *mlp)
+{
+	if (mlp) {
+		g_free (mlp->weights);
+		g_free (mlp);
+	}
+}
+
+static struct rspamd_mlp *
+rspamd_mlp_copy (const struct rspamd_mlp *src)
+{
+	struct rspamd_mlp *mlp;
+
+	mlp = rspamd_mlp_new (src->nlayers, src->layers);
+	memcpy (mlp->weights, src->weights, src->nweights * sizeof (gfloat));
+	mlp->mse = src->mse;
+
+	return mlp;
+}
+
+static void
+rspamd_mlp_randomize (struct rspamd_mlp *mlp)
+{
+	guint l, i;
+	gsize nw;
+	gfloat *w, range;
+
+	for (l = 0; l < mlp->nlayers - 1; l ++) {
+		w = mlp->weights + mlp->woffs[l];
+		nw = (gsize)mlp->layers[l + 1] * (mlp->layers[l] + 1);
+		range = 1.0f / sqrtf (mlp->layers[l]);
+
+		for (i = 0; i < nw; i ++) {
+			w[i] = (rspamd_random_double_fast () * 2.0 - 1.0) * range;
+		}
+	}
+}
+
+/*
+ * Performs forward pass, `acts` should have `nneurons` elements and the
+ * first `layers[0]` of them must be filled with inputs
+ */
+static void
+rspamd_mlp_forward (const struct rspamd_mlp *mlp, gfloat *acts)
+{
+	guint l, i, nin;
+	const gfloat *in, *row;
+	gfloat *out;
+
+	for (l = 0; l < mlp->nlayers - 1; l ++) {
+		nin = mlp->layers[l];
+		in = acts + mlp->aoffs[l];
+		out = acts + mlp->aoffs[l + 1];
+		row = mlp->weights + mlp->woffs[l];
+
+		for (i = 0; i < mlp->layers[l + 1]; i ++, row += nin + 1) {
+			out[i] = tanhf (rspamd_mlp_dot (row, in, nin) + row[nin]);
+		}
+	}
+}
+
+/*
+ * Backward pass for a single sample after forward pass. Gradients are
+ * accumulated in `grad`, returns sum of squared errors
+ */
+static gdouble
+rspamd_mlp_backward (const struct rspamd_mlp *mlp, const gfloat *acts,
+		gfloat *deltas, const gfloat *target, gfloat *grad)
+{
+	guint l, i, j, nin, nout, last = mlp->nlayers - 1;
+	const gfloat *out, *in, *w;
+	gfloat *d, *dprev, *g, err;
+	gdouble sse = 0;
+
+	out = acts + mlp->aoffs[last];
+	d = deltas + mlp->aoffs[last];
+
+	for (i = 0; i < mlp->layers[last]; i ++) {
+		err = out[i] - target[i];
+		sse += err * err;
+		d[i] = err * (1.0f - out[i] * out[i]);
+	}
+
+	for (l = last; l > 0; l --) {
+		nin = mlp->layers[l - 1];
+		nout = mlp->layers[l];
+		in = acts + mlp->aoffs[l - 1];
+		d = deltas + mlp->aoffs[l];
+		w = mlp->weights + mlp->woffs[l - 1];
+		g = grad + mlp->woffs[l - 1];
+
+		for (i = 0; i < nout; i ++) {
+			rspamd_mlp_axpy (g + i * (nin + 1), in, d[i], nin);
+			g[i * (nin + 1) + nin] += d[i];
+		}
+
+		if (l > 1) {
+			dprev = deltas + mlp->aoffs[l - 1];
+			memset (dprev, 0, nin * sizeof (gfloat));
+
+			for (i = 0; i < nout; i ++) {
+				rspamd_mlp_axpy (dprev, w + i * (nin + 1), d[i], nin);
+			}
+
+			for (j = 0; j < nin; j ++) {
+				dprev[j] *= 1.0f - in[j] * in[j];
+			}
+		}
+	}
+
+	return sse;
+}
+
+/***
+ * @function rspamd_mlp.create(nlayers, [layer1, ... layern])
+ * Creates new neural network with `nlayers` that contains `layer1`...`layern`
+ * neurons in each layer, the first layer is the inputs layer
+ * @param {number} nlayers number of layers
+ * @param {number} layerI number of neurons in each layer
+ * @return {mlp} mlp object
+ */
+static gint
+lua_mlp_create (lua_State *L)
+{
+	struct rspamd_mlp *mlp, **pmlp;
+	guint nlayers, layers[RSPAMD_MLP_MAX_LAYERS], i;
+
+	nlayers = luaL_checknumber (L, 1);
+
+	if (nlayers < 2 || nlayers > RSPAMD_MLP_MAX_LAYERS) {
+		return luaL_error (L, "invalid number of layers: %d", nlayers);
+	}
+
+	for (i = 0; i < nlayers; i ++) {
+		if (lua_type (L, 2) == LUA_TTABLE) {
+			lua_rawgeti (L, 2, i + 1);
+			layers[i] = luaL_checknumber (L, -1);
+			lua_pop (L, 1);
+		}
+		else {
+			layers[i] = luaL_checknumber (L, i + 2);
+		}
+	}
+
+	mlp = rspamd_mlp_new (nlayers, layers);
+
+	if (mlp != NULL) {
+		rspamd_mlp_randomize (mlp);
+		pmlp = lua_newuserdata (L, sizeof (gpointer));
+		*pmlp = mlp;
+		rspamd_lua_setclass (L, "rspamd{mlp}", -1);
+	}
+	else {
+		lua_pushnil (L);
+	}
+
+	return 1;
+}
+
+/***
+ * @function rspamd_mlp.load_data(data)
+ * Loads neural network from the data produced by `mlp:data()`
+ * @param {string|text} data serialized network
+ * @return {mlp} mlp object or nil
+ */
+static gint
+lua_mlp_load_data (lua_State *L)
+{
+	struct rspamd_mlp *mlp, **pmlp;
+	struct rspamd_lua_text *t;
+	struct rspamd_mlp_hdr hdr;
+	guint32 layers32[RSPAMD_MLP_MAX_LAYERS];
+	guint layers[RSPAMD_MLP_MAX_LAYERS], i;
+	const guchar *p;
+	gsize remain;
+
+	if (lua_type (L, 1) == LUA_TUSERDATA) {
+		t = lua_check_text (L, 1);
+
+		if (!t) {
+			return luaL_error (L, "text required");
+		}
+	}
+	else {
+		t = g_alloca (sizeof (*t));
+		t->start = luaL_checklstring (L, 1, (gsize *)&t->len);
+		t->flags = 0;
+	}
+
+	p = (const guchar *)t->start;
+	remain = t->len;
+
+	if (remain < sizeof (hdr)) {
+		goto err;
+	}
+
+	memcpy (&hdr, p, sizeof (hdr));
+	p += sizeof (hdr);
+	remain -= sizeof (hdr);
+
+	if (memcmp (hdr.magic, RSPAMD_MLP_MAGIC, sizeof (hdr.magic)) != 0 ||
+			hdr.version != RSPAMD_MLP_VERSION ||
+			hdr.nlayers < 2 || hdr.nlayers > RSPAMD_MLP_MAX_LAYERS ||
+			remain < hdr.nlayers * sizeof (guint32)) {
+		goto err;
+	}
+
+	memcpy (layers32, p, hdr.nlayers * sizeof (guint32));
+	p += hdr.nlayers * sizeof (guint32);
+	remain -= hdr.nlayers * sizeof (guint32);
+
+	for (i = 0; i < hdr.nlayers; i ++) {
+		layers[i] = layers32[i];
+	}
+
+	mlp = rspamd_mlp_new (hdr.nlayers, layers);
+
+	if (mlp == NULL) {
+		goto err;
+	}
+
+	if (remain != mlp->nweights * sizeof (gfloat)) {
+		rspamd_mlp_free (mlp);
+		goto err;
+	}
+
+	memcpy (mlp->weights, p, remain);
+	pmlp = lua_newuserdata (L, sizeof (gpointer));
+	*pmlp = mlp;
+	rspamd_lua_setclass (L, "rspamd{mlp}", -1);
+
+	return 1;
+
+err:
+	msg_warn ("cannot load mlp: invalid data of length %z", t->len);
+	lua_pushnil (L);
+
+	return 1;
+}
+
+/***
+ * @method rspamd_mlp:data()
+ * Returns serialized neural network
+ * @return {string} mlp data
+ */
+static gint
+lua_mlp_data (lua_State *L)
+{
+	struct rspamd_mlp *mlp = rspamd_lua_check_mlp (L, 1);
+	struct rspamd_mlp_hdr hdr;
+	guint32 layers32[RSPAMD_MLP_MAX_LAYERS];
+	luaL_Buffer buf;
+	guint i;
+
+	if (mlp == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	memcpy (hdr.magic, RSPAMD_MLP_MAGIC, sizeof (hdr.magic));
+	hdr.version = RSPAMD_MLP_VERSION;
+	hdr.nlayers = mlp->nlayers;
+
+	for (i = 0; i < mlp->nlayers; i ++) {
+		layers32[i] = mlp->layers[i];
+	}
+
+	luaL_buffinit (L, &buf);
+	luaL_addlstring (&buf, (const gchar *)&hdr, sizeof (hdr));
+	luaL_addlstring (&buf, (const gchar *)layers32,
+			mlp->nlayers * sizeof (guint32));
+	luaL_addlstring (&buf, (const gchar *)mlp->weights,
+			mlp->nweights * sizeof (gfloat));
+	luaL_pushresult (&buf);
+
+	return 1;
+}
+
+/***
+ * @method rspamd_mlp:test(inputs)
+ * Runs neural network on a single sample of input data and returns table of
+ * outputs, e.g.:
+ *     {0, 1, 1} -> {0}
+ * @param {table} inputs input sample
+ * @return {table} outputs values
+ */
+static gint
+lua_mlp_test (lua_State *L)
+{
+	struct rspamd_mlp *mlp = rspamd_lua_check_mlp (L, 1);
+	gfloat *acts, *out;
+	guint i, ninputs, noutputs;
+
+	if (mlp == NULL || lua_type (L, 2) != LUA_TTABLE) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	ninputs = mlp->layers[0];
+	noutputs = mlp->layers[mlp->nlayers - 1];
+
+	if (rspamd_lua_table_size (L, 2) != ninputs) {
+		msg_err ("invalid number of inputs: %d, %d expected",
+				rspamd_lua_table_size (L, 2), ninputs);
+		lua_pushnil (L);
+
+		return 1;
+	}
+
+	acts = g_malloc (mlp->nneurons * sizeof (gfloat));
+
+	for (i = 0; i < ninputs; i ++) {
+		lua_rawgeti (L, 2, i + 1);
+		acts[i] = lua_tonumber (L, -1);
+		lua_pop (L, 1);
+	}
+
+	rspamd_mlp_forward (mlp, acts);
+	out = acts + mlp->aoffs[mlp->nlayers - 1];
+	lua_createtable (L, noutputs, 0);
+
+	for (i = 0; i < noutputs; i ++) {
+		lua_pushnumber (L, out[i]);
+		lua_rawseti (L, -2, i + 1);
+	}
+
+	g_free (acts);
+
+	return 1;
+}
+
+struct rspamd_mlp_train_job {
+	const struct rspamd_mlp *mlp;
+	const gfloat *inputs;
+	const gfloat *outputs;
+	const guint *idx;
+	guint start;
+	guint end;
+	gfloat *grad;
+	gfloat *acts;
+	gfloat *deltas;
+	gdouble sse;
+};
+
+struct lua_mlp_train_cbdata {
+	lua_State *L;
+	gint pair[2];
+	struct rspamd_mlp *mlp;
+	gfloat *inputs;
+	gfloat *outputs;
+	guint ndata;
+	gint cbref;
+	gint mlpref;
+	gdouble desired_mse;
+	gdouble learning_rate;
+	guint max_epochs;
+	guint batch_size;
+	guint nthreads;
+	guint64 seed;
+	GThread *t;
+	struct event io;
+};
+
+struct lua_mlp_train_reply {
+	gint errcode;
+	gfloat mse;
+	gchar errmsg[128];
+};
+
+static gpointer
+rspamd_mlp_train_job_func (gpointer ud)
+{
+	struct rspamd_mlp_train_job *job = ud;
+	const struct rspamd_mlp *mlp = job->mlp;
+	guint i, ninputs, noutputs, n;
+
+	ninputs = mlp->layers[0];
+	noutputs = mlp->layers[mlp->nlayers - 1];
+	job->sse = 0;
+
+	for (i = job->start; i < job->end; i ++) {
+		n = job->idx[i];
+		memcpy (job->acts, job->inputs + (gsize)n * ninputs,
+				ninputs * sizeof (gfloat));
+		rspamd_mlp_forward (mlp, job->acts);
+		job->sse += rspamd_mlp_backward (mlp, job->acts, job->deltas,
+				job->outputs + (gsize)n * noutputs, job->grad);
+	}
+
+	return NULL;
+}
+
+static inline guint64
+rspamd_mlp_xorshift (guint64 *st)
+{
+	guint64 x = *st;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*st = x;
+
+	return x;
+}
+
+/*
+ * Mini-batch gradient descent, samples of each batch are split between
+ * `nthreads` threads that compute gradients independently
+ */
+static gfloat
+rspamd_mlp_train (struct lua_mlp_train_cbdata *cbdata)
+{
+	struct rspamd_mlp *mlp = cbdata->mlp;
+	struct rspamd_mlp_train_job jobs[RSPAMD_MLP_MAX_THREADS];
+	GThread *threads[RSPAMD_MLP_MAX_THREADS];
+	guint *idx, epoch, i, j, bstart, bend, nthreads, per_thread, tmp;
+	guint64 rnd = cbdata->seed | 1;
+	gdouble sse;
+	gfloat mse = 0, scale;
+	GError *err = NULL;
+
+	nthreads = cbdata->nthreads;
+	idx = g_malloc (cbdata->ndata * sizeof (guint));
+
+	for (i = 0; i < cbdata->ndata; i ++) {
+		idx[i] = i;
+	}
+
+	for (j = 0; j < nthreads; j ++) {
+		jobs[j].mlp = mlp;
+		jobs[j].inputs = cbdata->inputs;
+		jobs[j].outputs = cbdata->outputs;
+		jobs[j].idx = idx;
+		jobs[j].grad = g_malloc0 (mlp->nweights * sizeof (gfloat));
+		jobs[j].acts = g_malloc (mlp->nneurons * sizeof (gfloat));
+		jobs[j].deltas = g_malloc (mlp->nneurons * sizeof (gfloat));
+	}
+
+	for (epoch = 0; epoch < cbdata->max_epochs; epoch ++) {
+		/* Fisher-Yates shuffle */
+		for (i = cbdata->ndata - 1; i > 0; i --) {
+			j = rspamd_mlp_xorshift (&rnd) % (i + 1);
+			tmp = idx[i];
+			idx[i] = idx[j];
+			idx[j] = tmp;
+		}
+
+		sse = 0;
+
+		for (bstart = 0; bstart < cbdata->ndata; bstart = bend) {
+			bend = MIN (bstart + cbdata->batch_size, cbdata->ndata);
+			per_thread = (bend - bstart + nthreads - 1) / nthreads;
+
+			for (j = 0; j < nthreads; j ++) {
+				jobs[j].start = MIN (bstart + j * per_thread, bend);
+				jobs[j].end = MIN (jobs[j].start + per_thread, bend);
+				threads[j] = NULL;
+
+				/* The first job is processed in the current thread */
+				if (j > 0 && jobs[j].start < jobs[j].end) {
+					threads[j] = rspamd_create_thread ("mlp train",
+							rspamd_mlp_train_job_func, &jobs[j], &err);
+
+					if (threads[j] == NULL) {
+						msg_err ("cannot create training thread: %e", err);
+						g_error_free (err);
+						err = NULL;
+						rspamd_mlp_train_job_func (&jobs[j]);
+					}
+				}
+			}
+
+			rspamd_mlp_train_job_func (&jobs[0]);
+
+			for (j = 1; j < nthreads; j ++) {
+				if (threads[j] != NULL) {
+					g_thread_join (threads[j]);
+				}
+				else if (jobs[j].start >= jobs[j].end) {
+					jobs[j].sse = 0;
+				}
+			}
+
+			/* Reduce gradients and apply them */
+			for (j = 1; j < nthreads; j ++) {
+				if (jobs[j].start < jobs[j].end) {
+					rspamd_mlp_axpy (jobs[0].grad, jobs[j].grad, 1.0f,
+							mlp->nweights);
+					memset (jobs[j].grad, 0, mlp->nweights * sizeof (gfloat));
+				}
+
+				sse += jobs[j].sse;
+			}
+
+			sse += jobs[0].sse;
+			scale = -cbdata->learning_rate / (bend - bstart);
+			rspamd_mlp_axpy (mlp->weights, jobs[0].grad, scale, mlp->nweights);
+			memset (jobs[0].grad, 0, mlp->nweights * sizeof (gfloat));
+		}
+
+		mse = sse / ((gdouble)cbdata->ndata * mlp->layers[mlp->nlayers - 1]);
+
+		if (mse <= cbdata->desired_mse) {
+			break;
+		}
+	}
+
+	msg_info ("learned ANN in %d epochs, MSE: %.4f", MIN (epoch + 1,
+			cbdata->max_epochs), mse);
+
+	for (j = 0; j < nthreads; j ++) {
+		g_free (jobs[j].grad);
+		g_free (jobs[j].acts);
+		g_free (jobs[j].deltas);
+	}
+
+	g_free (idx);
+	mlp->mse = mse;
+
+	return mse;
+}
+
+static void
+lua_mlp_train_cbdata_free (struct lua_mlp_train_cbdata *cbdata)
+{
+	if (cbdata->pair[0] != -1) {
+		close (cbdata->pair[0]);
+	}
+	if (cbdata->pair[1] != -1) {
+		close (cbdata->pair[1]);
+	}
+
+	rspamd_mlp_free (cbdata->mlp);
+	g_free (cbdata->inputs);
+	g_free (cbdata->outputs);
+	luaL_unref (cbdata->L, LUA_REGISTRYINDEX, cbdata->cbref);
+	luaL_unref (cbdata->L, LUA_REGISTRYINDEX, cbdata->mlpref);
+	g_free (cbdata);
+}
+
+static void
+lua_mlp_push_train_result (struct lua_mlp_train_cbdata *cbdata,
+		gint errcode, gfloat mse, const gchar *errmsg)
+{
+	lua_rawgeti (cbdata->L, LUA_REGISTRYINDEX, cbdata->cbref);
+	lua_pushnumber (cbdata->L, errcode);
+	lua_pushstring (cbdata->L, errmsg);
+	lua_pushnumber (cbdata->L, mse);
+
+	if (lua_pcall (cbdata->L, 3, 0, 0) != 0) {
+		msg_err ("call to train callback failed: %s", lua_tostring (cbdata->L, -1));
+		lua_pop (cbdata->L, 1);
+	}
+}
+
+static void
+lua_mlp_thread_notify (gint fd, short what, gpointer ud)
+{
+	struct lua_mlp_train_cbdata *cbdata = ud;
+	struct lua_mlp_train_reply rep;
+	struct rspamd_mlp *target;
+
+	if (read (cbdata->pair[0], &rep, sizeof (rep)) == -1) {
+		if (errno == EAGAIN || errno == EINTR) {
+			event_add (&cbdata->io, NULL);
+			return;
+		}
+
+		g_thread_join (cbdata->t);
+		lua_mlp_push_train_result (cbdata, errno, 0.0, strerror (errno));
+	}
+	else {
+		g_thread_join (cbdata->t);
+
+		if (rep.errcode == 0) {
+			/* Network has been trained on a copy, now we can update it */
+			lua_rawgeti (cbdata->L, LUA_REGISTRYINDEX, cbdata->mlpref);
+			target = rspamd_lua_check_mlp (cbdata->L, -1);
+			lua_pop (cbdata->L, 1);
+			memcpy (target->weights, cbdata->mlp->weights,
+					target->nweights * sizeof (gfloat));
+			target->mse = cbdata->mlp->mse;
+		}
+
+		lua_mlp_push_train_result (cbdata, rep.errcode, rep.mse, rep.errmsg);
+	}
+
+	lua_mlp_train_cbdata_free (cbdata);
+}
+
+static gpointer
+lua_mlp_train_thread (gpointer ud)
+{
+	struct lua_mlp_train_cbdata *cbdata = ud;
+	struct lua_mlp_train_reply rep;
+
+	msg_info ("start learning ANN on %d samples, %d epochs are possible, "
+			"%d threads", cbdata->ndata, cbdata->max_epochs, cbdata->nthreads);
+	rspamd_socket_blocking (cbdata->pair[1]);
+	rep.mse = rspamd_mlp_train (cbdata);
+	rep.errcode = 0;
+	rspamd_strlcpy (rep.errmsg, "OK", sizeof (rep.errmsg));
+
+	if (write (cbdata->pair[1], &rep, sizeof (rep)) == -1) {
+		msg_err ("cannot write to socketpair: %s", strerror (errno));
+	}
+
+	return NULL;
+}
+
+static gboolean
+lua_mlp_read_samples (lua_State *L, gint pos, guint ndata, guint nelts,
+		gfloat *dest)
+{
+	guint i, j;
+
+	for (i = 0; i < ndata; i ++) {
+		lua_rawgeti (L, pos, i + 1);
+
+		if (lua_type (L, -1) != LUA_TTABLE ||
+				rspamd_lua_table_size (L, -1) != nelts) {
+			msg_err ("invalid number of elements in sample %d: %d, %d expected",
+					i + 1, rspamd_lua_table_size (L, -1), nelts);
+			lua_pop (L, 1);
+
+			return FALSE;
+		}
+
+		for (j = 0; j < nelts; j ++) {
+			lua_rawgeti (L, -1, j + 1);
+			dest[(gsize)i * nelts + j] = lua_tonumber (L, -1);
+			lua_pop (L, 1);
+		}
+
+		lua_pop (L, 1);
+	}
+
+	return TRUE;
+}
+
+/**
+ * @method rspamd_mlp:train_threaded(inputs, outputs, callback, event_base, {params})
+ * Trains neural network with batch of samples in a separate thread. Inputs and
+ * outputs should be tables of equal size, each row in table should be N inputs
+ * and M outputs, e.g.
+ *     {{0, 1, 1}, ...} -> {{0}, {1} ...}
+ * Callback is called with `errcode, errmsg, mse` when training is finished.
+ * Params could contain `max_epochs`, `desired_mse`, `learning_rate`,
+ * `batch_size` and `threads` (number of threads used to process each batch)
+ * @param {table} inputs input samples
+ * @param {table} outputs output samples
+ * @param {callback} function that is called when train is completed
+ */
+static gint
+lua_mlp_train_threaded (lua_State *L)
+{
+	struct rspamd_mlp *mlp = rspamd_lua_check_mlp (L, 1);
+	struct lua_mlp_train_cbdata *cbdata;
+	struct event_base *ev_base = lua_check_ev_base (L, 5);
+	GError *err = NULL;
+	guint ndata, ninputs, noutputs;
+	gint64 max_epochs = 0, batch_size = 0, nthreads = 0;
+	gdouble desired_mse = 0, learning_rate = 0;
+
+	if (mlp == NULL || lua_type (L, 2) != LUA_TTABLE ||
+			lua_type (L, 3) != LUA_TTABLE || lua_type (L, 4) != LUA_TFUNCTION ||
+			ev_base == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	ndata = rspamd_lua_table_size (L, 2);
+	ninputs = mlp->layers[0];
+	noutputs = mlp->layers[mlp->nlayers - 1];
+
+	if (ndata == 0 || rspamd_lua_table_size (L, 3) != ndata) {
+		return luaL_error (L, "invalid arguments: inputs and outputs must "
+				"have the same non zero size");
+	}
+
+	cbdata = g_malloc0 (sizeof (*cbdata));
+	cbdata->L = L;
+	cbdata->pair[0] = -1;
+	cbdata->pair[1] = -1;
+	cbdata->ndata = ndata;
+	cbdata->max_epochs = 1000;
+	cbdata->desired_mse = 0.0001;
+	cbdata->learning_rate = 0.01;
+	cbdata->batch_size = 64;
+	cbdata->nthreads = 1;
+	cbdata->seed = rspamd_random_uint64_fast ();
+	cbdata->inputs = g_malloc ((gsize)ndata * ninputs * sizeof (gfloat));
+	cbdata->outputs = g_malloc ((gsize)ndata * noutputs * sizeof (gfloat));
+	lua_pushvalue (L, 4);
+	cbdata->cbref = luaL_ref (L, LUA_REGISTRYINDEX);
+	lua_pushvalue (L, 1);
+	cbdata->mlpref = luaL_ref (L, LUA_REGISTRYINDEX);
+
+	if (!lua_mlp_read_samples (L, 2, ndata, ninputs, cbdata->inputs) ||
+			!lua_mlp_read_samples (L, 3, ndata, noutputs, cbdata->outputs)) {
+		lua_mlp_train_cbdata_free (cbdata);
+
+		return luaL_error (L, "invalid arguments: bad samples");
+	}
+
+	if (lua_type (L, 6) == LUA_TTABLE) {
+		/* Missing parameters are set to zero, so we keep defaults for them */
+		rspamd_lua_parse_table_arguments (L, 6, NULL,
+				"max_epochs=I;desired_mse=N;learning_rate=N;batch_size=I;threads=I",
+				&max_epochs, &desired_mse, &learning_rate, &batch_size,
+				&nthreads);
+
+		if (max_epochs > 0) {
+			cbdata->max_epochs = max_epochs;
+		}
+		if (desired_mse > 0) {
+			cbdata->desired_mse = desired_mse;
+		}
+		if (learning_rate > 0) {
+			cbdata->learning_rate = learning_rate;
+		}
+		if (batch_size > 0) {
+			cbdata->batch_size = batch_size;
+		}
+		if (nthreads > 0) {
+			cbdata->nthreads = MIN (nthreads, RSPAMD_MLP_MAX_THREADS);
+		}
+	}
+
+	if (rspamd_socketpair (cbdata->pair, 0) == -1) {
+		msg_err ("cannot open socketpair: %s", strerror (errno));
+		lua_mlp_train_cbdata_free (cbdata);
+
+		return luaL_error (L, "cannot open socketpair");
+	}
+
+	/* Network is trained on a copy, so it could be used while training */
+	cbdata->mlp = rspamd_mlp_copy (mlp);
+	rspamd_socket_nonblocking (cbdata->pair[0]);
+	event_set (&cbdata->io, cbdata->pair[0], EV_READ, lua_mlp_thread_notify,
+			cbdata);
+	event_base_set (ev_base, &cbdata->io);
+	cbdata->t = rspamd_create_thread ("mlp train", lua_mlp_train_thread,
+			cbdata, &err);
+
+	if (cbdata->t == NULL) {
+		msg_err ("cannot create training thread: %e", err);
+
+		if (err) {
+			g_error_free (err);
+		}
+
+		lua_mlp_train_cbdata_free (cbdata);
+
+		return luaL_error (L, "cannot create training thread");
+	}
+
+	event_add (&cbdata->io, NULL);
+
+	return 0;
+}
+
+/***
+ * @method rspamd_mlp:get_inputs()
+ * Returns number of inputs for neural network
+ * @return {number} number of inputs
+ */
+static gint
+lua_mlp_get_inputs (lua_State *L)
+{
+	struct rspamd_mlp *mlp = rspamd_lua_check_mlp (L, 1);
+
+	if (mlp != NULL) {
+		lua_pushnumber (L, mlp->layers[0]);
+	}
+	else {
+		lua_pushnil (L);
+	}
+
+	return 1;
+}
+
+/***
+ * @method rspamd_mlp:get_outputs()
+ * Returns number of outputs for neural network
+ * @return {number} number of outputs
+ */
+static gint
+lua_mlp_get_outputs (lua_State *L)
+{
+	struct rspamd_mlp *mlp = rspamd_lua_check_mlp (L, 1);
+
+	if (mlp != NULL) {
+		lua_pushnumber (L, mlp->layers[mlp->nlayers - 1]);
+	}
+	else {
+		lua_pushnil (L);
+	}
+
+	return 1;
+}
+
+/***
+ * @method rspamd_mlp:get_mse()
+ * Returns mean square error for the last training
+ * @return {number} MSE value
+ */
+static gint
+lua_mlp_get_mse (lua_State *L)
+{
+	struct rspamd_mlp *mlp = rspamd_lua_check_mlp (L, 1);
+
+	if (mlp != NULL) {
+		lua_pushnumber (L, mlp->mse);
+	}
+	else {
+		lua_pushnil (L);
+	}
+
+	return 1;
+}
+
+/***
+ * @method rspamd_mlp:get_layers()
+ * Returns array of neurons count for each layer
+ * @return {table} table with number of neurons in each layer
+ */
+static gint
+lua_mlp_get_layers (lua_State *L)
+{
+	struct rspamd_mlp *mlp = rspamd_lua_check_mlp (L, 1);
+	guint i;
+
+	if (mlp != NULL) {
+		lua_createtable (L, mlp->nlayers, 0);
+
+		for (i = 0; i < mlp->nlayers; i ++) {
+			lua_pushnumber (L, mlp->layers[i]);
+			lua_rawseti (L, -2, i + 1);
+		}
+	}
+	else {
+		lua_pushnil (L);
+	}
+
+	return 1;
+}
+
+static gint
+lua_mlp_dtor (lua_State *L)
+{
+	struct rspamd_mlp *mlp = rspamd_lua_check_mlp (L, 1);
+
+	rspamd_mlp_free (mlp);
+
+	return 0;
+}
+
+static gint
+lua_load_mlp (lua_State * L)
+{
+	lua_newtable (L);
+	luaL_register (L, NULL, rspamd_mlp_f);
+
+	return 1;
+}
+
+void
+luaopen_mlp (lua_State * L)
+{
+	rspamd_lua_new_class (L, "rspamd{mlp}", rspamd_mlp_m);
+	lua_pop (L, 1);
+
+	rspamd_lua_add_preload (L, "rspamd_mlp", lua_load_mlp);
+}
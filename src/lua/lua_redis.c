@@ -114,7 +114,10 @@ struct lua_redis_userdata {
 #define LUA_REDIS_ASYNC (1 << 0)
 #define LUA_REDIS_TEXTDATA (1 << 1)
 #define LUA_REDIS_TERMINATED (1 << 2)
+/* connection is multiplexed with other requests */
+#define LUA_REDIS_SHARED (1 << 3)
 #define IS_ASYNC(ctx) ((ctx)->flags & LUA_REDIS_ASYNC)
+#define IS_SHARED(ctx) ((ctx)->flags & LUA_REDIS_SHARED)
 
 struct lua_redis_request_specific_userdata {
 	gint cbref;
@@ -124,6 +127,8 @@ struct lua_redis_request_specific_userdata {
 	struct lua_redis_userdata *c;
 	struct lua_redis_ctx *ctx;
 	struct lua_redis_request_specific_userdata *next;
+	struct rspamd_redis_pool_request *req; /* for shared connection only */
+	struct rspamd_async_event *async_ev;
 	struct event timeout;
 	guint flags;
 };
@@ -192,6 +197,12 @@ lua_redis_dtor (struct lua_redis_ctx *ctx)
 				is_successful = FALSE;
 			}
 
+			if (cur->req) {
+				/* Reply will be dropped by the pool */
+				rspamd_redis_pool_abandon_request (cur->req);
+				cur->req = NULL;
+			}
+
 			cur->flags |= LUA_REDIS_SPECIFIC_FINISHED;
 		}
 
@@ -222,6 +233,7 @@ lua_redis_dtor (struct lua_redis_ctx *ctx)
 		ctx->replies = NULL;
 	}
 
+	g_free (ud->server);
 	g_free (ctx);
 }
 
@@ -301,7 +313,7 @@ lua_redis_push_error (const gchar *err,
 				rspamd_symcache_item_async_dec_check (ud->task, ud->item, M);
 			}
 
-			rspamd_session_remove_event (ud->s, lua_redis_fin, sp_ud);
+			rspamd_session_remove_event_handle (ud->s, sp_ud->async_ev);
 		}
 		else {
 			lua_redis_fin (sp_ud);
@@ -391,7 +403,7 @@ lua_redis_push_data (const redisReply *r, struct lua_redis_ctx *ctx,
 				rspamd_symcache_item_async_dec_check (ud->task, ud->item, M);
 			}
 
-			rspamd_session_remove_event (ud->s, lua_redis_fin, sp_ud);
+			rspamd_session_remove_event_handle (ud->s, sp_ud->async_ev);
 		}
 		else {
 			lua_redis_fin (sp_ud);
@@ -417,6 +429,9 @@ lua_redis_callback (redisAsyncContext *c, gpointer r, gpointer priv)
 	ctx = sp_ud->ctx;
 	ud = sp_ud->c;
 
+	/* Request is freed by the pool after this callback */
+	sp_ud->req = NULL;
+
 	if (ud->terminated) {
 		/* We are already at the termination stage, just go out */
 		return;
@@ -511,7 +526,7 @@ lua_redis_cleanup_events (struct lua_redis_ctx *ctx)
 			rspamd_symcache_item_async_dec_check (result->task, result->item, M);
 		}
 
-		rspamd_session_remove_event (result->s, lua_redis_fin, result->sp_ud);
+		rspamd_session_remove_event_handle (result->s, result->sp_ud->async_ev);
 
 		g_free (result);
 	}
@@ -669,7 +684,20 @@ lua_redis_timeout (int fd, short what, gpointer u)
 			sp_ud->c->ctx);
 	lua_redis_push_error ("timeout while connecting the server", ctx, sp_ud, TRUE);
 
-	if (sp_ud->c->ctx) {
+	if (sp_ud->req) {
+		/* Shared connection is still used by other requests */
+		rspamd_redis_pool_abandon_request (sp_ud->req);
+		sp_ud->req = NULL;
+		ctx->cmds_pending --;
+
+		if (ctx->cmds_pending == 0 && sp_ud->c->ctx) {
+			ac = sp_ud->c->ctx;
+			sp_ud->c->ctx = NULL;
+			sp_ud->c->terminated = 1;
+			rspamd_redis_pool_release_connection (sp_ud->c->pool, ac, TRUE);
+		}
+	}
+	else if (sp_ud->c->ctx) {
 		ac = sp_ud->c->ctx;
 		/* Set to NULL to avoid double free in dtor */
 		sp_ud->c->ctx = NULL;
@@ -782,8 +810,61 @@ lua_redis_parse_args (lua_State *L, gint idx, const gchar *cmd,
 	*nargs = top;
 }
 
+/*
+ * Commands that change connection state or block it cannot be
+ * multiplexed with other requests
+ */
+static gboolean
+lua_redis_cmd_is_shareable (const gchar *cmd)
+{
+	static const gchar *exclusive_cmds[] = {
+			"AUTH", "SELECT", "MULTI", "EXEC", "DISCARD", "WATCH", "UNWATCH",
+			"SUBSCRIBE", "PSUBSCRIBE", "UNSUBSCRIBE", "PUNSUBSCRIBE",
+			"MONITOR", "BLPOP", "BRPOP", "BRPOPLPUSH", "BZPOPMIN", "BZPOPMAX",
+			"CLIENT", "QUIT", "WAIT", "SYNC", "PSYNC",
+	};
+	guint i;
+
+	if (cmd == NULL) {
+		return FALSE;
+	}
+
+	for (i = 0; i < G_N_ELEMENTS (exclusive_cmds); i ++) {
+		if (g_ascii_strcasecmp (cmd, exclusive_cmds[i]) == 0) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static gint
+lua_redis_send_async (struct lua_redis_ctx *ctx,
+		struct lua_redis_request_specific_userdata *sp_ud)
+{
+	if (IS_SHARED (ctx)) {
+		sp_ud->req = rspamd_redis_pool_shared_command (sp_ud->c->pool,
+				sp_ud->c->ctx,
+				lua_redis_callback,
+				sp_ud,
+				sp_ud->nargs,
+				(const gchar **)sp_ud->args,
+				sp_ud->arglens);
+
+		return sp_ud->req ? REDIS_OK : REDIS_ERR;
+	}
+
+	return redisAsyncCommandArgv (sp_ud->c->ctx,
+			lua_redis_callback,
+			sp_ud,
+			sp_ud->nargs,
+			(const gchar **)sp_ud->args,
+			sp_ud->arglens);
+}
+
 static struct lua_redis_ctx *
-rspamd_lua_redis_prepare_connection (lua_State *L, gint *pcbref, gboolean is_async)
+rspamd_lua_redis_prepare_connection (lua_State *L, gint *pcbref,
+		gboolean is_async, gboolean shared)
 {
 	struct lua_redis_ctx *ctx;
 	rspamd_inet_addr_t *ip = NULL;
@@ -937,6 +1018,8 @@ rspamd_lua_redis_prepare_connection (lua_State *L, gint *pcbref, gboolean is_asy
 			ud->pool = cfg->redis_pool;
 			ud->ev_base = ev_base;
 			ud->task = task;
+			ud->server = g_strdup (rspamd_inet_address_to_string_pretty (
+					addr->addr));
 
 			if (task) {
 				ud->item = rspamd_symcache_get_cur_item (task);
@@ -956,10 +1039,25 @@ rspamd_lua_redis_prepare_connection (lua_State *L, gint *pcbref, gboolean is_asy
 
 	if (ret) {
 		ud->terminated = 0;
-		ud->ctx = rspamd_redis_pool_connect (ud->pool,
-				dbname, password,
-				rspamd_inet_address_to_string (addr->addr),
-				rspamd_inet_address_get_port (addr->addr));
+
+		if (shared) {
+			/* NULL means that all shared connections are busy */
+			ud->ctx = rspamd_redis_pool_connect_shared (ud->pool,
+					dbname, password,
+					rspamd_inet_address_to_string (addr->addr),
+					rspamd_inet_address_get_port (addr->addr));
+
+			if (ud->ctx) {
+				ctx->flags |= LUA_REDIS_SHARED;
+			}
+		}
+
+		if (ud->ctx == NULL) {
+			ud->ctx = rspamd_redis_pool_connect (ud->pool,
+					dbname, password,
+					rspamd_inet_address_to_string (addr->addr),
+					rspamd_inet_address_get_port (addr->addr));
+		}
 
 		if (ip) {
 			rspamd_inet_address_free (ip);
@@ -1001,6 +1099,8 @@ rspamd_lua_redis_prepare_connection (lua_State *L, gint *pcbref, gboolean is_asy
  * @param {string} cmd command to be sent to redis
  * @param {table} args numeric array of strings used as redis arguments
  * @param {number} timeout timeout in seconds for request (1.0 by default)
+ * Commands that do not change connection state are pipelined over
+ * a few connections shared by all concurrent requests to the same server
  * @return {boolean} `true` if a request has been scheduled
  */
 static int
@@ -1014,9 +1114,16 @@ lua_redis_make_request (lua_State *L)
 	struct timeval tv;
 	gdouble timeout = REDIS_DEFAULT_TIMEOUT;
 	gint cbref = -1;
-	gboolean ret = FALSE;
+	gboolean ret = FALSE, shared = FALSE;
+
+	if (lua_istable (L, 1)) {
+		lua_pushstring (L, "cmd");
+		lua_gettable (L, 1);
+		shared = lua_redis_cmd_is_shareable (lua_tostring (L, -1));
+		lua_pop (L, 1);
+	}
 
-	ctx = rspamd_lua_redis_prepare_connection (L, &cbref, TRUE);
+	ctx = rspamd_lua_redis_prepare_connection (L, &cbref, TRUE, shared);
 
 	if (ctx) {
 		ud = &ctx->async;
@@ -1046,18 +1153,15 @@ lua_redis_make_request (lua_State *L)
 		lua_pop (L, 1);
 		LL_PREPEND (ud->specific, sp_ud);
 
-		ret = redisAsyncCommandArgv (ud->ctx,
-				lua_redis_callback,
-				sp_ud,
-				sp_ud->nargs,
-				(const gchar **)sp_ud->args,
-				sp_ud->arglens);
+		ret = lua_redis_send_async (ctx, sp_ud);
 
 		if (ret == REDIS_OK) {
 			if (ud->s) {
-				rspamd_session_add_event (ud->s,
+				sp_ud->async_ev = rspamd_session_add_event_handle (ud->s,
 						lua_redis_fin, sp_ud,
 						M);
+				rspamd_session_event_set_peer (ud->s, sp_ud->async_ev,
+						ud->server);
 
 				if (ud->item) {
 					rspamd_symcache_item_async_inc (ud->task, ud->item, M);
@@ -1261,7 +1365,7 @@ lua_redis_connect (lua_State *L)
 	struct lua_redis_ctx *ctx, **pctx;
 	gdouble timeout = REDIS_DEFAULT_TIMEOUT;
 
-	ctx = rspamd_lua_redis_prepare_connection (L, NULL, TRUE);
+	ctx = rspamd_lua_redis_prepare_connection (L, NULL, TRUE, FALSE);
 
 	if (ctx) {
 		ud = &ctx->async;
@@ -1304,7 +1408,7 @@ lua_redis_connect_sync (lua_State *L)
 	gdouble timeout = REDIS_DEFAULT_TIMEOUT;
 	struct lua_redis_ctx *ctx, **pctx;
 
-	ctx = rspamd_lua_redis_prepare_connection (L, NULL, FALSE);
+	ctx = rspamd_lua_redis_prepare_connection (L, NULL, FALSE, FALSE);
 
 	if (ctx) {
 		if (lua_istable (L, 1)) {
@@ -1405,12 +1509,7 @@ lua_redis_add_cmd (lua_State *L)
 		}
 
 		if (IS_ASYNC (ctx)) {
-			ret = redisAsyncCommandArgv (sp_ud->c->ctx,
-					lua_redis_callback,
-					sp_ud,
-					sp_ud->nargs,
-					(const gchar **)sp_ud->args,
-					sp_ud->arglens);
+			ret = lua_redis_send_async (ctx, sp_ud);
 		}
 		else {
 			ret = redisAsyncCommandArgv (sp_ud->c->ctx,
@@ -1423,10 +1522,12 @@ lua_redis_add_cmd (lua_State *L)
 
 		if (ret == REDIS_OK) {
 			if (ud->s) {
-				rspamd_session_add_event (ud->s,
+				sp_ud->async_ev = rspamd_session_add_event_handle (ud->s,
 						lua_redis_fin,
 						sp_ud,
 						M);
+				rspamd_session_event_set_peer (ud->s, sp_ud->async_ev,
+						ud->server);
 
 				if (ud->item) {
 					rspamd_symcache_item_async_inc (ud->task, ud->item, M);
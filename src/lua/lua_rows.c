@@ -0,0 +1,406 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "lua_common.h"
+#include <math.h>
+
+/***
+ * @module rspamd_rows
+ * `rspamd_rows` accumulates rows for analytics storages (e.g. ClickHouse)
+ * in a single buffer serialised in `TabSeparated` format. Rows are not kept
+ * as Lua tables between flushes and the whole batch is emitted as a single
+ * `rspamd_text` suitable for HTTP body.
+ * @example
+local rspamd_rows = require "rspamd_rows"
+local rows = rspamd_rows.create()
+
+rows:add_row({1, 'example.com', {'SYM1', 'SYM2'}, {1.5, -0.5}})
+print(#rows) -- 1
+local body = rows:flush() -- "1\texample.com\t['sym1','sym2']\t[1.5,-0.5]\n"
+ */
+
+/***
+ * @function rspamd_rows.create([size])
+ * Creates new rows batch
+ * @param {number} size initial size of buffer in bytes
+ * @return {rspamd_rows} new batch
+ */
+LUA_FUNCTION_DEF (rows, create);
+/***
+ * @method rows:add_row(row)
+ * Serialises row to the batch. Row elements could be strings, numbers,
+ * booleans, `rspamd_text` or arrays of strings and numbers.
+ * @param {table} row array of columns values
+ */
+LUA_FUNCTION_DEF (rows, add_row);
+/***
+ * @method rows:flush()
+ * Returns all rows accumulated and resets the batch
+ * @return {rspamd_text} serialised rows
+ */
+LUA_FUNCTION_DEF (rows, flush);
+/***
+ * @method rows:reset()
+ * Removes all rows from the batch
+ */
+LUA_FUNCTION_DEF (rows, reset);
+/***
+ * @method rows:bytes()
+ * Returns size of rows accumulated
+ * @return {number} size in bytes
+ */
+LUA_FUNCTION_DEF (rows, bytes);
+LUA_FUNCTION_DEF (rows, len);
+LUA_FUNCTION_DEF (rows, gc);
+
+static const struct luaL_reg rowslib_m[] = {
+	LUA_INTERFACE_DEF (rows, add_row),
+	LUA_INTERFACE_DEF (rows, flush),
+	LUA_INTERFACE_DEF (rows, reset),
+	LUA_INTERFACE_DEF (rows, bytes),
+	{"__len", lua_rows_len},
+	{"__tostring", rspamd_lua_class_tostring},
+	{"__gc", lua_rows_gc},
+	{NULL, NULL}
+};
+static const struct luaL_reg rowslib_f[] = {
+	LUA_INTERFACE_DEF (rows, create),
+	{NULL, NULL}
+};
+
+#define ROWS_DEFAULT_SIZE 8192
+
+struct rspamd_lua_rows {
+	GString *buf;
+	gsize initial_size;
+	guint nrows;
+};
+
+static struct rspamd_lua_rows *
+lua_check_rows (lua_State * L, gint pos)
+{
+	void *ud = rspamd_lua_check_udata (L, pos, "rspamd{rows}");
+
+	luaL_argcheck (L, ud != NULL, pos, "'rows' expected");
+	return ud ? *((struct rspamd_lua_rows **)ud) : NULL;
+}
+
+/* Integers are written with no fractional part as `ch_number` does */
+static void
+lua_rows_append_number (GString *buf, gdouble val)
+{
+	if (isfinite (val) && val == floor (val) && fabs (val) < 4503599627370496.0) {
+		rspamd_printf_gstring (buf, "%L", (gint64)val);
+	}
+	else {
+		rspamd_printf_gstring (buf, "%.14g", val);
+	}
+}
+
+/* Top level strings must not break TSV structure */
+static void
+lua_rows_append_tsv_string (GString *buf, const gchar *s, gsize len)
+{
+	const gchar *p = s, *end = s + len, *c;
+
+	while (p < end) {
+		c = p;
+
+		while (c < end && *c != '\t' && *c != '\n' && *c != '\\') {
+			c ++;
+		}
+
+		g_string_append_len (buf, p, c - p);
+
+		if (c == end) {
+			break;
+		}
+
+		switch (*c) {
+		case '\t':
+			g_string_append_len (buf, "\\t", 2);
+			break;
+		case '\n':
+			g_string_append_len (buf, "\\n", 2);
+			break;
+		default:
+			g_string_append_len (buf, "\\\\", 2);
+			break;
+		}
+
+		p = c + 1;
+	}
+}
+
+/* Array elements are quoted and lowercased like in `clickhouse_quote` */
+static void
+lua_rows_append_quoted_string (GString *buf, const gchar *s, gsize len)
+{
+	gsize i;
+
+	g_string_append_c (buf, '\'');
+
+	for (i = 0; i < len; i ++) {
+		switch (s[i]) {
+		case '\'':
+		case '\\':
+			g_string_append_c (buf, '\\');
+			g_string_append_c (buf, s[i]);
+			break;
+		case '\t':
+			g_string_append_len (buf, "\\t", 2);
+			break;
+		case '\n':
+			g_string_append_len (buf, "\\n", 2);
+			break;
+		default:
+			g_string_append_c (buf, g_ascii_tolower (s[i]));
+			break;
+		}
+	}
+
+	g_string_append_c (buf, '\'');
+}
+
+static void
+lua_rows_append_array (lua_State *L, GString *buf, gint pos)
+{
+	struct rspamd_lua_text *t;
+	const gchar *s;
+	gsize len, i, nelts;
+
+	nelts = rspamd_lua_table_size (L, pos);
+	g_string_append_c (buf, '[');
+
+	for (i = 1; i <= nelts; i ++) {
+		lua_rawgeti (L, pos, i);
+
+		if (i > 1) {
+			g_string_append_c (buf, ',');
+		}
+
+		switch (lua_type (L, -1)) {
+		case LUA_TNUMBER:
+			lua_rows_append_number (buf, lua_tonumber (L, -1));
+			break;
+		case LUA_TBOOLEAN:
+			g_string_append_c (buf, lua_toboolean (L, -1) ? '1' : '0');
+			break;
+		case LUA_TUSERDATA:
+			t = lua_check_text (L, -1);
+
+			if (t) {
+				lua_rows_append_quoted_string (buf, t->start, t->len);
+			}
+			else {
+				lua_rows_append_quoted_string (buf, "", 0);
+			}
+			break;
+		case LUA_TSTRING:
+			s = lua_tolstring (L, -1, &len);
+			lua_rows_append_quoted_string (buf, s, len);
+			break;
+		default:
+			lua_rows_append_quoted_string (buf, "", 0);
+			break;
+		}
+
+		lua_pop (L, 1);
+	}
+
+	g_string_append_c (buf, ']');
+}
+
+static gint
+lua_rows_create (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_lua_rows *rows, **prows;
+
+	rows = g_malloc0 (sizeof (*rows));
+
+	if (lua_type (L, 1) == LUA_TNUMBER && lua_tonumber (L, 1) > 0) {
+		rows->initial_size = lua_tonumber (L, 1);
+	}
+	else {
+		rows->initial_size = ROWS_DEFAULT_SIZE;
+	}
+
+	rows->buf = g_string_sized_new (rows->initial_size);
+	prows = lua_newuserdata (L, sizeof (*prows));
+	rspamd_lua_setclass (L, "rspamd{rows}", -1);
+	*prows = rows;
+
+	return 1;
+}
+
+static gint
+lua_rows_add_row (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_lua_rows *rows = lua_check_rows (L, 1);
+	struct rspamd_lua_text *t;
+	const gchar *s;
+	gsize len, i, ncols;
+
+	if (rows == NULL || lua_type (L, 2) != LUA_TTABLE) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	ncols = rspamd_lua_table_size (L, 2);
+
+	for (i = 1; i <= ncols; i ++) {
+		lua_rawgeti (L, 2, i);
+
+		if (i > 1) {
+			g_string_append_c (rows->buf, '\t');
+		}
+
+		switch (lua_type (L, -1)) {
+		case LUA_TNUMBER:
+			lua_rows_append_number (rows->buf, lua_tonumber (L, -1));
+			break;
+		case LUA_TBOOLEAN:
+			g_string_append_c (rows->buf, lua_toboolean (L, -1) ? '1' : '0');
+			break;
+		case LUA_TSTRING:
+			s = lua_tolstring (L, -1, &len);
+			lua_rows_append_tsv_string (rows->buf, s, len);
+			break;
+		case LUA_TTABLE:
+			lua_rows_append_array (L, rows->buf, lua_gettop (L));
+			break;
+		case LUA_TUSERDATA:
+			t = lua_check_text (L, -1);
+
+			if (t) {
+				lua_rows_append_tsv_string (rows->buf, t->start, t->len);
+			}
+			break;
+		default:
+			/* Empty value */
+			break;
+		}
+
+		lua_pop (L, 1);
+	}
+
+	g_string_append_c (rows->buf, '\n');
+	rows->nrows ++;
+
+	return 0;
+}
+
+static gint
+lua_rows_flush (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_lua_rows *rows = lua_check_rows (L, 1);
+	struct rspamd_lua_text *t;
+
+	if (rows == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	t = lua_newuserdata (L, sizeof (*t));
+	rspamd_lua_setclass (L, "rspamd{text}", -1);
+	t->len = rows->buf->len;
+	/* Buffer is passed to Lua with no copying */
+	t->start = g_string_free (rows->buf, FALSE);
+	t->flags = RSPAMD_TEXT_FLAG_OWN;
+
+	rows->buf = g_string_sized_new (rows->initial_size);
+	rows->nrows = 0;
+
+	return 1;
+}
+
+static gint
+lua_rows_reset (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_lua_rows *rows = lua_check_rows (L, 1);
+
+	if (rows == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	g_string_set_size (rows->buf, 0);
+	rows->nrows = 0;
+
+	return 0;
+}
+
+static gint
+lua_rows_bytes (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_lua_rows *rows = lua_check_rows (L, 1);
+
+	if (rows == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	lua_pushnumber (L, rows->buf->len);
+
+	return 1;
+}
+
+static gint
+lua_rows_len (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_lua_rows *rows = lua_check_rows (L, 1);
+
+	if (rows == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	lua_pushnumber (L, rows->nrows);
+
+	return 1;
+}
+
+static gint
+lua_rows_gc (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_lua_rows *rows = lua_check_rows (L, 1);
+
+	if (rows) {
+		g_string_free (rows->buf, TRUE);
+		g_free (rows);
+	}
+
+	return 0;
+}
+
+static gint
+lua_load_rows (lua_State *L)
+{
+	lua_newtable (L);
+	luaL_register (L, NULL, rowslib_f);
+
+	return 1;
+}
+
+void
+luaopen_rows (lua_State * L)
+{
+	rspamd_lua_new_class (L, "rspamd{rows}", rowslib_m);
+	lua_pop (L, 1);
+
+	rspamd_lua_add_preload (L, "rspamd_rows", lua_load_rows);
+}
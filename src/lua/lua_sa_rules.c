@@ -0,0 +1,371 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "lua_common.h"
+#include "libserver/sa_rules.h"
+#include "libserver/task.h"
+
+/***
+ * @module rspamd_sa_rules
+ * This module evaluates SpamAssassin rules and meta rules natively: all meta
+ * rules are checked once per task in dependency order
+ * @example
+local rspamd_sa_rules = require "rspamd_sa_rules"
+local rspamd_regexp = require "rspamd_regexp"
+
+local sa = rspamd_sa_rules.create()
+sa:add_regexp('__SUBJ_FREE', rspamd_regexp.create('/free/i'), 'header', 'Subject')
+sa:add_meta('FREE_AND_DKIM', '__SUBJ_FREE && R_DKIM_ALLOW')
+local externals = sa:compile()
+-- In a symbol callback
+sa:process(task)
+ */
+
+/***
+ * @function rspamd_sa_rules.create()
+ * Creates an empty set of rules
+ * @return {rspamd_sa_rules} rules object
+ */
+LUA_FUNCTION_DEF (sa_rules, create);
+
+/***
+ * @method sa_rules:add_regexp(name, re, type[, header[, strong[, negate]]])
+ * Adds an atom checked by the regexp from the regexps cache
+ * @param {string} name name of the rule
+ * @param {rspamd_regexp} re regexp registered in the regexps cache
+ * @param {string} type regexp type (`header`, `rawheader`, `mime`, `sabody` etc)
+ * @param {string} header header name for header regexps
+ * @param {boolean} strong case sensitive header name
+ * @param {boolean} negate rule matches if the regexp does not match
+ */
+LUA_FUNCTION_DEF (sa_rules, add_regexp);
+/***
+ * @method sa_rules:add_function(name, func)
+ * Adds an atom evaluated as `func(task)`, that should return a number
+ * @param {string} name name of the rule
+ * @param {function} func function to call
+ */
+LUA_FUNCTION_DEF (sa_rules, add_function);
+/***
+ * @method sa_rules:add_meta(name, expr)
+ * Adds a meta rule
+ * @param {string} name name of the rule and of the symbol inserted
+ * @param {string} expr SpamAssassin meta expression
+ * @return {boolean,string} true or false and error message
+ */
+LUA_FUNCTION_DEF (sa_rules, add_meta);
+/***
+ * @method sa_rules:compile([replacements])
+ * Resolves atoms and orders meta rules, no rules can be added after this call
+ * @param {table} replacements table of external symbols replacements
+ * @return {table} names of external symbols used by meta rules
+ */
+LUA_FUNCTION_DEF (sa_rules, compile);
+/***
+ * @method sa_rules:process(task)
+ * Evaluates meta rules and inserts symbols for matched ones
+ * @param {rspamd_task} task task object
+ * @return {number} number of matched meta rules
+ */
+LUA_FUNCTION_DEF (sa_rules, process);
+LUA_FUNCTION_DEF (sa_rules, gc);
+
+static const struct luaL_reg saruleslib_f[] = {
+	LUA_INTERFACE_DEF (sa_rules, create),
+	{NULL, NULL}
+};
+
+static const struct luaL_reg saruleslib_m[] = {
+	LUA_INTERFACE_DEF (sa_rules, add_regexp),
+	LUA_INTERFACE_DEF (sa_rules, add_function),
+	LUA_INTERFACE_DEF (sa_rules, add_meta),
+	LUA_INTERFACE_DEF (sa_rules, compile),
+	LUA_INTERFACE_DEF (sa_rules, process),
+	{"__tostring", rspamd_lua_class_tostring},
+	{"__gc", lua_sa_rules_gc},
+	{NULL, NULL}
+};
+
+struct lua_sa_rules {
+	struct rspamd_sa_rules *rules;
+	/* State used by function atoms, set for each process call */
+	lua_State *L;
+};
+
+struct lua_sa_rules_cbdata {
+	struct lua_sa_rules *lr;
+	gint cbref;
+};
+
+static struct lua_sa_rules *
+lua_check_sa_rules (lua_State *L, gint pos)
+{
+	void *ud = rspamd_lua_check_udata (L, pos, "rspamd{sa_rules}");
+
+	luaL_argcheck (L, ud != NULL, pos, "'sa_rules' expected");
+	return ud ? *((struct lua_sa_rules **)ud) : NULL;
+}
+
+static gdouble
+lua_sa_rules_function_cb (struct rspamd_task *task, gpointer ud)
+{
+	struct lua_sa_rules_cbdata *cbd = ud;
+	lua_State *L = cbd->lr->L;
+	struct rspamd_task **ptask;
+	gint err_idx;
+	gdouble ret = 0;
+	GString *tb;
+
+	lua_pushcfunction (L, &rspamd_lua_traceback);
+	err_idx = lua_gettop (L);
+
+	lua_rawgeti (L, LUA_REGISTRYINDEX, cbd->cbref);
+	ptask = lua_newuserdata (L, sizeof (*ptask));
+	rspamd_lua_setclass (L, "rspamd{task}", -1);
+	*ptask = task;
+
+	if (lua_pcall (L, 1, 1, err_idx) != 0) {
+		tb = lua_touserdata (L, -1);
+
+		if (tb) {
+			msg_err_task ("call to sa rule function failed: %s", tb->str);
+			g_string_free (tb, TRUE);
+		}
+	}
+	else if (lua_type (L, -1) == LUA_TNUMBER) {
+		ret = lua_tonumber (L, -1);
+	}
+	else if (lua_type (L, -1) == LUA_TBOOLEAN) {
+		ret = lua_toboolean (L, -1) ? 1 : 0;
+	}
+
+	lua_settop (L, err_idx - 1);
+
+	return ret > 0 ? ret : 0;
+}
+
+static void
+lua_sa_rules_cbdata_dtor (gpointer p)
+{
+	struct lua_sa_rules_cbdata *cbd = p;
+
+	luaL_unref (cbd->lr->L, LUA_REGISTRYINDEX, cbd->cbref);
+	g_free (cbd);
+}
+
+static gint
+lua_sa_rules_create (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct lua_sa_rules *lr, **plr;
+
+	lr = g_malloc0 (sizeof (*lr));
+	lr->rules = rspamd_sa_rules_new ();
+	lr->L = L;
+
+	plr = lua_newuserdata (L, sizeof (*plr));
+	rspamd_lua_setclass (L, "rspamd{sa_rules}", -1);
+	*plr = lr;
+
+	return 1;
+}
+
+static gint
+lua_sa_rules_add_regexp (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct lua_sa_rules *lr = lua_check_sa_rules (L, 1);
+	const gchar *name = luaL_checkstring (L, 2), *type_str, *header = NULL;
+	struct rspamd_lua_regexp *re = NULL;
+	enum rspamd_re_type type;
+	void *ud;
+
+	type_str = luaL_checkstring (L, 4);
+	ud = rspamd_lua_check_udata (L, 3, "rspamd{regexp}");
+
+	if (ud) {
+		re = *((struct rspamd_lua_regexp **)ud);
+	}
+
+	if (lr == NULL || name == NULL || re == NULL || type_str == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	type = rspamd_re_cache_type_from_string (type_str);
+
+	if (lua_type (L, 5) == LUA_TSTRING) {
+		header = lua_tostring (L, 5);
+	}
+
+	if ((type == RSPAMD_RE_HEADER || type == RSPAMD_RE_RAWHEADER ||
+			type == RSPAMD_RE_MIMEHEADER) && header == NULL) {
+		return luaL_error (L,
+				"header argument is mandatory for header/rawheader regexps");
+	}
+
+	rspamd_sa_rules_add_regexp (lr->rules, name, re->re, type, header,
+			lua_toboolean (L, 6), lua_toboolean (L, 7));
+
+	return 0;
+}
+
+static gint
+lua_sa_rules_add_function (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct lua_sa_rules *lr = lua_check_sa_rules (L, 1);
+	const gchar *name = luaL_checkstring (L, 2);
+	struct lua_sa_rules_cbdata *cbd;
+
+	if (lr == NULL || name == NULL || !lua_isfunction (L, 3)) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	cbd = g_malloc0 (sizeof (*cbd));
+	cbd->lr = lr;
+	lua_pushvalue (L, 3);
+	cbd->cbref = luaL_ref (L, LUA_REGISTRYINDEX);
+
+	rspamd_sa_rules_add_callback (lr->rules, name, lua_sa_rules_function_cb,
+			cbd, lua_sa_rules_cbdata_dtor);
+
+	return 0;
+}
+
+static gint
+lua_sa_rules_add_meta (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct lua_sa_rules *lr = lua_check_sa_rules (L, 1);
+	const gchar *name = luaL_checkstring (L, 2), *expr = luaL_checkstring (L, 3);
+	GError *err = NULL;
+
+	if (lr == NULL || name == NULL || expr == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	if (!rspamd_sa_rules_add_meta (lr->rules, name, expr, &err)) {
+		lua_pushboolean (L, false);
+		lua_pushstring (L, err ? err->message : "cannot parse expression");
+
+		if (err) {
+			g_error_free (err);
+		}
+
+		return 2;
+	}
+
+	lua_pushboolean (L, true);
+
+	return 1;
+}
+
+static gint
+lua_sa_rules_compile (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct lua_sa_rules *lr = lua_check_sa_rules (L, 1);
+	GHashTable *replacements = NULL;
+	GPtrArray *externals;
+	const gchar *sym;
+	guint i;
+
+	if (lr == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	if (lua_type (L, 2) == LUA_TTABLE) {
+		replacements = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
+
+		/* Strings are owned by the table that is alive during the call */
+		for (lua_pushnil (L); lua_next (L, 2); lua_pop (L, 1)) {
+			if (lua_type (L, -2) == LUA_TSTRING &&
+					lua_type (L, -1) == LUA_TSTRING) {
+				g_hash_table_insert (replacements,
+						(gpointer)lua_tostring (L, -2),
+						(gpointer)lua_tostring (L, -1));
+			}
+		}
+	}
+
+	externals = rspamd_sa_rules_compile (lr->rules, replacements);
+
+	if (replacements) {
+		g_hash_table_unref (replacements);
+	}
+
+	lua_createtable (L, externals->len, 0);
+
+	PTR_ARRAY_FOREACH (externals, i, sym) {
+		lua_pushstring (L, sym);
+		lua_rawseti (L, -2, i + 1);
+	}
+
+	return 1;
+}
+
+static gint
+lua_sa_rules_process (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct lua_sa_rules *lr = lua_check_sa_rules (L, 1);
+	struct rspamd_task *task = lua_check_task (L, 2);
+	lua_State *saved_L;
+	guint nmatched;
+
+	if (lr == NULL || task == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	/* Function atoms are called in the state of the caller */
+	saved_L = lr->L;
+	lr->L = L;
+	nmatched = rspamd_sa_rules_process (lr->rules, task);
+	lr->L = saved_L;
+
+	lua_pushinteger (L, nmatched);
+
+	return 1;
+}
+
+static gint
+lua_sa_rules_gc (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct lua_sa_rules *lr = lua_check_sa_rules (L, 1);
+
+	if (lr) {
+		rspamd_sa_rules_destroy (lr->rules);
+		g_free (lr);
+	}
+
+	return 0;
+}
+
+static gint
+lua_load_sa_rules (lua_State *L)
+{
+	lua_newtable (L);
+	luaL_register (L, NULL, saruleslib_f);
+
+	return 1;
+}
+
+void
+luaopen_sa_rules (lua_State *L)
+{
+	rspamd_lua_new_class (L, "rspamd{sa_rules}", saruleslib_m);
+	lua_pop (L, 1);
+
+	rspamd_lua_add_preload (L, "rspamd_sa_rules", lua_load_sa_rules);
+}
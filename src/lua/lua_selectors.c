@@ -0,0 +1,1230 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "lua_common.h"
+#include "libmime/message.h"
+#include "libmime/email_addr.h"
+#include "libcryptobox/cryptobox.h"
+#include <openssl/evp.h>
+
+/***
+ * @module rspamd_selectors
+ * This module compiles selectors parsed by `lua_selectors` into C closures
+ * over task accessors. Only the built-in extractors and transforms are
+ * supported, so `compile` returns nil for everything else and the selector
+ * is executed by Lua code. This module is used internally by `lua_selectors`.
+ */
+
+/***
+ * @function rspamd_selectors.compile(name, args, pipe)
+ * Compiles selector
+ * @param {string} name extractor name
+ * @param {table} args extractor arguments
+ * @param {table} pipe list of transforms as `{name = ..., args = ..., method = bool}`
+ * @return {rspamd_selector} compiled selector or nil if it cannot be compiled
+ */
+LUA_FUNCTION_DEF (selectors, compile);
+/***
+ * @method rspamd_selector:process(task)
+ * Extracts and transforms value from task
+ * @param {rspamd_task} task task object
+ * @return {string|table} string, list of strings or nil
+ */
+LUA_FUNCTION_DEF (selector, process);
+LUA_FUNCTION_DEF (selector, gc);
+
+static const struct luaL_reg selectorlib_m[] = {
+	LUA_INTERFACE_DEF (selector, process),
+	{"__tostring", rspamd_lua_class_tostring},
+	{"__gc", lua_selector_gc},
+	{NULL, NULL}
+};
+
+static const struct luaL_reg selectorslib_f[] = {
+	LUA_INTERFACE_DEF (selectors, compile),
+	{NULL, NULL}
+};
+
+enum lua_selector_value_type {
+	LUA_SELECTOR_STRING = 0,
+	LUA_SELECTOR_STRING_LIST,
+	LUA_SELECTOR_ADDR,
+	LUA_SELECTOR_ADDR_LIST,
+};
+
+/*
+ * Values live in the task pool, missing elements of lists (e.g. filtered
+ * by `in`) have NULL begin as nil values in Lua lists
+ */
+struct lua_selector_value {
+	enum lua_selector_value_type type;
+	guint nelts;
+	union {
+		rspamd_ftok_t str;
+		rspamd_ftok_t *strs;
+		struct rspamd_email_address *addr;
+		struct rspamd_email_address **addrs;
+	} v;
+};
+
+enum lua_selector_addrs_type {
+	LUA_SELECTOR_ADDRS_ANY = 0,
+	LUA_SELECTOR_ADDRS_SMTP,
+	LUA_SELECTOR_ADDRS_MIME,
+};
+
+enum lua_selector_encoding {
+	LUA_SELECTOR_ENC_HEX = 0,
+	LUA_SELECTOR_ENC_BASE32,
+	LUA_SELECTOR_ENC_BASE64,
+};
+
+struct lua_selector_args {
+	guint nargs;
+	gchar **args;
+	gint64 nums[2];
+};
+
+typedef gboolean (*lua_selector_check_t) (struct lua_selector_args *args);
+typedef gboolean (*lua_selector_extract_t) (struct rspamd_task *task,
+		const struct lua_selector_args *args,
+		struct lua_selector_value *out);
+typedef gboolean (*lua_selector_str_t) (struct rspamd_task *task,
+		const struct lua_selector_args *args,
+		const rspamd_ftok_t *in,
+		rspamd_ftok_t *out);
+typedef gboolean (*lua_selector_value_t) (struct rspamd_task *task,
+		const struct lua_selector_args *args,
+		const struct lua_selector_value *in,
+		struct lua_selector_value *out);
+
+struct lua_selector_extractor {
+	const gchar *name;
+	lua_selector_extract_t extract;
+	lua_selector_check_t check;
+	/* Extracts emails addresses, their fields could be selected by methods */
+	gboolean is_addr;
+};
+
+#define LUA_SELECTOR_TYPE_STRING (1u << 0u)
+#define LUA_SELECTOR_TYPE_LIST (1u << 1u)
+/* String transform is mapped over lists elements */
+#define LUA_SELECTOR_TYPE_MAP (1u << 2u)
+
+struct lua_selector_transform {
+	const gchar *name;
+	guint types;
+	/* Applied to the whole value */
+	lua_selector_value_t process;
+	/* Applied to a string or to each element of a list */
+	lua_selector_str_t process_str;
+	lua_selector_check_t check;
+};
+
+enum lua_selector_addr_field {
+	LUA_SELECTOR_ADDR_ADDR = 0,
+	LUA_SELECTOR_ADDR_USER,
+	LUA_SELECTOR_ADDR_DOMAIN,
+	LUA_SELECTOR_ADDR_NAME,
+	LUA_SELECTOR_ADDR_NONE,
+};
+
+struct lua_selector_pipe_elt {
+	const struct lua_selector_transform *transform;
+	struct lua_selector_args args;
+};
+
+struct lua_selector {
+	const struct lua_selector_extractor *extractor;
+	struct lua_selector_args args;
+	enum lua_selector_addr_field field;
+	GArray *pipe;
+};
+
+static inline const gchar *
+lua_selector_arg (const struct lua_selector_args *args, guint i)
+{
+	return i < args->nargs ? args->args[i] : NULL;
+}
+
+static inline void
+lua_selector_set_str (struct lua_selector_value *out, const gchar *s, gsize len)
+{
+	out->type = LUA_SELECTOR_STRING;
+	out->v.str.begin = s;
+	out->v.str.len = len;
+}
+
+static gboolean
+lua_selector_check_none (struct lua_selector_args *args)
+{
+	return TRUE;
+}
+
+static gboolean
+lua_selector_check_one (struct lua_selector_args *args)
+{
+	return args->nargs >= 1;
+}
+
+/* Extractors */
+
+static gboolean
+lua_selector_extract_id (struct rspamd_task *task,
+		const struct lua_selector_args *args,
+		struct lua_selector_value *out)
+{
+	const gchar *s = lua_selector_arg (args, 0);
+
+	if (s == NULL) {
+		s = "";
+	}
+
+	lua_selector_set_str (out, s, strlen (s));
+
+	return TRUE;
+}
+
+static gboolean
+lua_selector_extract_ip (struct rspamd_task *task,
+		const struct lua_selector_args *args,
+		struct lua_selector_value *out)
+{
+	const gchar *s;
+
+	if (task->from_addr == NULL) {
+		return FALSE;
+	}
+
+	/* Returned string is stored in a static buffer */
+	s = rspamd_mempool_strdup (task->task_pool,
+			rspamd_inet_address_to_string (task->from_addr));
+	lua_selector_set_str (out, s, strlen (s));
+
+	return TRUE;
+}
+
+static gboolean
+lua_selector_check_addr_type (struct lua_selector_args *args)
+{
+	const gchar *type = lua_selector_arg (args, 0);
+
+	if (type == NULL || strcmp (type, "any") == 0 || strcmp (type, "0") == 0) {
+		args->nums[0] = LUA_SELECTOR_ADDRS_ANY;
+	}
+	else if (strcmp (type, "smtp") == 0 || strcmp (type, "envelope") == 0) {
+		args->nums[0] = LUA_SELECTOR_ADDRS_SMTP;
+	}
+	else if (strcmp (type, "mime") == 0) {
+		args->nums[0] = LUA_SELECTOR_ADDRS_MIME;
+	}
+	else {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean
+lua_selector_extract_from (struct rspamd_task *task,
+		const struct lua_selector_args *args,
+		struct lua_selector_value *out)
+{
+	struct rspamd_email_address *addr = NULL;
+	GPtrArray *addrs = NULL;
+
+	switch (args->nums[0]) {
+	case LUA_SELECTOR_ADDRS_SMTP:
+		addr = task->from_envelope;
+		break;
+	case LUA_SELECTOR_ADDRS_MIME:
+		addrs = task->from_mime;
+		break;
+	default:
+		if (task->from_envelope) {
+			addr = task->from_envelope;
+		}
+		else {
+			addrs = task->from_mime;
+		}
+		break;
+	}
+
+	if (addrs != NULL && addrs->len > 0) {
+		addr = g_ptr_array_index (addrs, 0);
+	}
+	else if (addr != NULL && addr->addr == NULL) {
+		addr = NULL;
+	}
+
+	if (addr == NULL) {
+		return FALSE;
+	}
+
+	out->type = LUA_SELECTOR_ADDR;
+	out->v.addr = addr;
+
+	return TRUE;
+}
+
+static gboolean
+lua_selector_extract_rcpts (struct rspamd_task *task,
+		const struct lua_selector_args *args,
+		struct lua_selector_value *out)
+{
+	GPtrArray *addrs;
+
+	switch (args->nums[0]) {
+	case LUA_SELECTOR_ADDRS_SMTP:
+		addrs = task->rcpt_envelope;
+		break;
+	case LUA_SELECTOR_ADDRS_MIME:
+		addrs = task->rcpt_mime;
+		break;
+	default:
+		addrs = task->rcpt_envelope ? task->rcpt_envelope : task->rcpt_mime;
+		break;
+	}
+
+	if (addrs == NULL || addrs->len == 0) {
+		return FALSE;
+	}
+
+	out->type = LUA_SELECTOR_ADDR_LIST;
+	out->nelts = addrs->len;
+	out->v.addrs = (struct rspamd_email_address **)addrs->pdata;
+
+	return TRUE;
+}
+
+static gboolean
+lua_selector_extract_pool_var_common (struct rspamd_task *task,
+		const gchar *var, struct lua_selector_value *out)
+{
+	const gchar *s;
+
+	s = rspamd_mempool_get_variable (task->task_pool, var);
+
+	if (s == NULL) {
+		return FALSE;
+	}
+
+	lua_selector_set_str (out, s, strlen (s));
+
+	return TRUE;
+}
+
+static gboolean
+lua_selector_extract_country (struct rspamd_task *task,
+		const struct lua_selector_args *args,
+		struct lua_selector_value *out)
+{
+	return lua_selector_extract_pool_var_common (task, "country", out);
+}
+
+static gboolean
+lua_selector_extract_asn (struct rspamd_task *task,
+		const struct lua_selector_args *args,
+		struct lua_selector_value *out)
+{
+	return lua_selector_extract_pool_var_common (task, "asn", out);
+}
+
+static gboolean
+lua_selector_check_pool_var (struct lua_selector_args *args)
+{
+	const gchar *type = lua_selector_arg (args, 1);
+
+	/* Other types are converted by Lua */
+	return args->nargs >= 1 && (type == NULL || strcmp (type, "string") == 0);
+}
+
+static gboolean
+lua_selector_extract_pool_var (struct rspamd_task *task,
+		const struct lua_selector_args *args,
+		struct lua_selector_value *out)
+{
+	return lua_selector_extract_pool_var_common (task,
+			lua_selector_arg (args, 0), out);
+}
+
+static gboolean
+lua_selector_extract_user (struct rspamd_task *task,
+		const struct lua_selector_args *args,
+		struct lua_selector_value *out)
+{
+	if (task->user == NULL) {
+		return FALSE;
+	}
+
+	lua_selector_set_str (out, task->user, strlen (task->user));
+
+	return TRUE;
+}
+
+static gboolean
+lua_selector_extract_to (struct rspamd_task *task,
+		const struct lua_selector_args *args,
+		struct lua_selector_value *out)
+{
+	const gchar *s = rspamd_task_get_principal_recipient (task);
+
+	if (s == NULL) {
+		return FALSE;
+	}
+
+	lua_selector_set_str (out, s, strlen (s));
+
+	return TRUE;
+}
+
+static gboolean
+lua_selector_extract_digest (struct rspamd_task *task,
+		const struct lua_selector_args *args,
+		struct lua_selector_value *out)
+{
+	gchar *hexbuf;
+	gint r;
+
+	hexbuf = rspamd_mempool_alloc (task->task_pool, sizeof (task->digest) * 2);
+	r = rspamd_encode_hex_buf (task->digest, sizeof (task->digest),
+			hexbuf, sizeof (task->digest) * 2);
+
+	if (r <= 0) {
+		return FALSE;
+	}
+
+	lua_selector_set_str (out, hexbuf, r);
+
+	return TRUE;
+}
+
+static gboolean
+lua_selector_extract_helo (struct rspamd_task *task,
+		const struct lua_selector_args *args,
+		struct lua_selector_value *out)
+{
+	if (task->helo == NULL) {
+		return FALSE;
+	}
+
+	lua_selector_set_str (out, task->helo, strlen (task->helo));
+
+	return TRUE;
+}
+
+static gboolean
+lua_selector_check_header (struct lua_selector_args *args)
+{
+	const gchar *flags = lua_selector_arg (args, 1);
+
+	if (args->nargs < 1) {
+		return FALSE;
+	}
+
+	if (flags == NULL) {
+		args->nums[0] = FALSE;
+	}
+	else if (strcmp (flags, "strong") == 0) {
+		args->nums[0] = TRUE;
+	}
+	else {
+		/* Full headers are tables, leave them for Lua */
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean
+lua_selector_extract_header (struct rspamd_task *task,
+		const struct lua_selector_args *args,
+		struct lua_selector_value *out)
+{
+	GPtrArray *ar;
+	struct rspamd_mime_header *rh;
+	const gchar *decoded;
+
+	ar = rspamd_message_get_header_array (task, lua_selector_arg (args, 0),
+			args->nums[0]);
+
+	if (ar == NULL || ar->len == 0) {
+		return FALSE;
+	}
+
+	rh = g_ptr_array_index (ar, 0);
+	decoded = rspamd_mime_header_get_decoded (task->task_pool, rh);
+	lua_selector_set_str (out, decoded, strlen (decoded));
+
+	return TRUE;
+}
+
+static gboolean
+lua_selector_extract_request_header (struct rspamd_task *task,
+		const struct lua_selector_args *args,
+		struct lua_selector_value *out)
+{
+	rspamd_ftok_t *hdr;
+
+	hdr = rspamd_task_get_request_header (task, lua_selector_arg (args, 0));
+
+	if (hdr == NULL) {
+		return FALSE;
+	}
+
+	lua_selector_set_str (out, hdr->begin, hdr->len);
+
+	return TRUE;
+}
+
+static const struct lua_selector_extractor lua_selector_extractors[] = {
+	{"id", lua_selector_extract_id, lua_selector_check_none},
+	{"ip", lua_selector_extract_ip, lua_selector_check_none},
+	{"from", lua_selector_extract_from, lua_selector_check_addr_type, TRUE},
+	{"rcpts", lua_selector_extract_rcpts, lua_selector_check_addr_type, TRUE},
+	{"country", lua_selector_extract_country, lua_selector_check_none},
+	{"asn", lua_selector_extract_asn, lua_selector_check_none},
+	{"user", lua_selector_extract_user, lua_selector_check_none},
+	{"to", lua_selector_extract_to, lua_selector_check_none},
+	{"digest", lua_selector_extract_digest, lua_selector_check_none},
+	{"helo", lua_selector_extract_helo, lua_selector_check_none},
+	{"header", lua_selector_extract_header, lua_selector_check_header},
+	{"pool_var", lua_selector_extract_pool_var, lua_selector_check_pool_var},
+	{"request_header", lua_selector_extract_request_header,
+			lua_selector_check_one},
+};
+
+/* Transforms */
+
+static gboolean
+lua_selector_check_num (struct lua_selector_args *args, guint i, gint64 def)
+{
+	const gchar *s = lua_selector_arg (args, i);
+	gchar *err = NULL;
+
+	if (s == NULL) {
+		args->nums[i] = def;
+
+		return TRUE;
+	}
+
+	args->nums[i] = g_ascii_strtoll (s, &err, 10);
+
+	return err != s && *err == '\0';
+}
+
+static gboolean
+lua_selector_check_n (struct lua_selector_args *args)
+{
+	return lua_selector_check_num (args, 0, 1);
+}
+
+static gboolean
+lua_selector_check_substring (struct lua_selector_args *args)
+{
+	return lua_selector_check_num (args, 0, 1) &&
+		lua_selector_check_num (args, 1, -1);
+}
+
+static gboolean
+lua_selector_transform_lower (struct rspamd_task *task,
+		const struct lua_selector_args *args,
+		const rspamd_ftok_t *in,
+		rspamd_ftok_t *out)
+{
+	gchar *s;
+
+	s = rspamd_mempool_alloc (task->task_pool, in->len + 1);
+	memcpy (s, in->begin, in->len);
+	s[in->len] = '\0';
+	rspamd_str_lc (s, in->len);
+	out->begin = s;
+	out->len = in->len;
+
+	return TRUE;
+}
+
+/* The same as string.sub in Lua */
+static gboolean
+lua_selector_transform_substring (struct rspamd_task *task,
+		const struct lua_selector_args *args,
+		const rspamd_ftok_t *in,
+		rspamd_ftok_t *out)
+{
+	gint64 start = args->nums[0], end = args->nums[1], len = in->len;
+
+	if (start < 0) {
+		start += len + 1;
+	}
+	if (end < 0) {
+		end += len + 1;
+	}
+	if (start < 1) {
+		start = 1;
+	}
+	if (end > len) {
+		end = len;
+	}
+
+	out->begin = in->begin;
+	out->len = 0;
+
+	if (start <= end) {
+		out->begin = in->begin + start - 1;
+		out->len = end - start + 1;
+	}
+
+	return TRUE;
+}
+
+static gboolean
+lua_selector_check_digest (struct lua_selector_args *args)
+{
+	const gchar *enc = lua_selector_arg (args, 0),
+			*type = lua_selector_arg (args, 1);
+
+	if (enc == NULL || strcmp (enc, "hex") == 0) {
+		args->nums[0] = LUA_SELECTOR_ENC_HEX;
+	}
+	else if (strcmp (enc, "base32") == 0) {
+		args->nums[0] = LUA_SELECTOR_ENC_BASE32;
+	}
+	else if (strcmp (enc, "base64") == 0) {
+		args->nums[0] = LUA_SELECTOR_ENC_BASE64;
+	}
+	else {
+		return FALSE;
+	}
+
+	if (type == NULL || strcmp (type, "blake2") == 0) {
+		args->nums[1] = 0;
+	}
+	else if (strcmp (type, "sha256") == 0) {
+		args->nums[1] = 1;
+	}
+	else if (strcmp (type, "sha1") == 0) {
+		args->nums[1] = 2;
+	}
+	else if (strcmp (type, "sha512") == 0) {
+		args->nums[1] = 3;
+	}
+	else if (strcmp (type, "md5") == 0) {
+		args->nums[1] = 4;
+	}
+	else {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean
+lua_selector_transform_digest (struct rspamd_task *task,
+		const struct lua_selector_args *args,
+		const rspamd_ftok_t *in,
+		rspamd_ftok_t *out)
+{
+	guchar digest[rspamd_cryptobox_HASHBYTES];
+	guint dlen = sizeof (digest);
+	const EVP_MD *md = NULL;
+	gchar *enc;
+	gsize enclen;
+
+	switch (args->nums[1]) {
+	case 1:
+		md = EVP_sha256 ();
+		break;
+	case 2:
+		md = EVP_sha1 ();
+		break;
+	case 3:
+		md = EVP_sha512 ();
+		break;
+	case 4:
+		md = EVP_md5 ();
+		break;
+	default:
+		rspamd_cryptobox_hash (digest, in->begin, in->len, NULL, 0);
+		break;
+	}
+
+	if (md != NULL) {
+		EVP_Digest (in->begin, in->len, digest, &dlen, md, NULL);
+	}
+
+	switch (args->nums[0]) {
+	case LUA_SELECTOR_ENC_BASE32:
+		enc = rspamd_mempool_alloc (task->task_pool, dlen * 2);
+		enclen = rspamd_encode_base32_buf (digest, dlen, enc, dlen * 2);
+		break;
+	case LUA_SELECTOR_ENC_BASE64:
+		enc = rspamd_encode_base64 (digest, dlen, 0, &enclen);
+		rspamd_mempool_add_destructor (task->task_pool,
+				(rspamd_mempool_destruct_t)g_free, enc);
+		break;
+	default:
+		enc = rspamd_mempool_alloc (task->task_pool, dlen * 2);
+		enclen = rspamd_encode_hex_buf (digest, dlen, enc, dlen * 2);
+		break;
+	}
+
+	out->begin = enc;
+	out->len = enclen;
+
+	return TRUE;
+}
+
+static gboolean
+lua_selector_args_contain (const struct lua_selector_args *args,
+		const rspamd_ftok_t *in)
+{
+	guint i;
+
+	for (i = 0; i < args->nargs; i ++) {
+		if (rspamd_ftok_cstr_equal (in, args->args[i], FALSE)) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static gboolean
+lua_selector_transform_in (struct rspamd_task *task,
+		const struct lua_selector_args *args,
+		const rspamd_ftok_t *in,
+		rspamd_ftok_t *out)
+{
+	*out = *in;
+
+	return lua_selector_args_contain (args, in);
+}
+
+static gboolean
+lua_selector_transform_not_in (struct rspamd_task *task,
+		const struct lua_selector_args *args,
+		const rspamd_ftok_t *in,
+		rspamd_ftok_t *out)
+{
+	*out = *in;
+
+	return !lua_selector_args_contain (args, in);
+}
+
+static gboolean
+lua_selector_transform_nth_common (const struct lua_selector_value *in,
+		gint64 n, struct lua_selector_value *out)
+{
+	if (n < 1 || n > in->nelts || in->v.strs[n - 1].begin == NULL) {
+		return FALSE;
+	}
+
+	out->type = LUA_SELECTOR_STRING;
+	out->v.str = in->v.strs[n - 1];
+
+	return TRUE;
+}
+
+static gboolean
+lua_selector_transform_first (struct rspamd_task *task,
+		const struct lua_selector_args *args,
+		const struct lua_selector_value *in,
+		struct lua_selector_value *out)
+{
+	return lua_selector_transform_nth_common (in, 1, out);
+}
+
+static gboolean
+lua_selector_transform_last (struct rspamd_task *task,
+		const struct lua_selector_args *args,
+		const struct lua_selector_value *in,
+		struct lua_selector_value *out)
+{
+	return lua_selector_transform_nth_common (in, in->nelts, out);
+}
+
+static gboolean
+lua_selector_transform_nth (struct rspamd_task *task,
+		const struct lua_selector_args *args,
+		const struct lua_selector_value *in,
+		struct lua_selector_value *out)
+{
+	return lua_selector_transform_nth_common (in, args->nums[0], out);
+}
+
+static gboolean
+lua_selector_transform_take_n (struct rspamd_task *task,
+		const struct lua_selector_args *args,
+		const struct lua_selector_value *in,
+		struct lua_selector_value *out)
+{
+	*out = *in;
+	out->nelts = MAX (MIN (args->nums[0], in->nelts), 0);
+
+	return TRUE;
+}
+
+static gboolean
+lua_selector_transform_drop_n (struct rspamd_task *task,
+		const struct lua_selector_args *args,
+		const struct lua_selector_value *in,
+		struct lua_selector_value *out)
+{
+	guint n = MAX (MIN (args->nums[0], in->nelts), 0);
+
+	*out = *in;
+	out->nelts = in->nelts - n;
+	out->v.strs = in->v.strs + n;
+
+	return TRUE;
+}
+
+static gboolean
+lua_selector_transform_join (struct rspamd_task *task,
+		const struct lua_selector_args *args,
+		const struct lua_selector_value *in,
+		struct lua_selector_value *out)
+{
+	const gchar *sep = lua_selector_arg (args, 0);
+	gsize seplen = sep ? strlen (sep) : 0, len = 0;
+	guint i, nout = 0;
+	gchar *buf, *p;
+
+	for (i = 0; i < in->nelts; i ++) {
+		if (in->v.strs[i].begin) {
+			len += in->v.strs[i].len + seplen;
+		}
+	}
+
+	p = buf = rspamd_mempool_alloc (task->task_pool, len + 1);
+
+	for (i = 0; i < in->nelts; i ++) {
+		if (in->v.strs[i].begin) {
+			if (nout > 0 && seplen > 0) {
+				memcpy (p, sep, seplen);
+				p += seplen;
+			}
+
+			memcpy (p, in->v.strs[i].begin, in->v.strs[i].len);
+			p += in->v.strs[i].len;
+			nout ++;
+		}
+	}
+
+	*p = '\0';
+	lua_selector_set_str (out, buf, p - buf);
+
+	return TRUE;
+}
+
+static gboolean
+lua_selector_transform_id (struct rspamd_task *task,
+		const struct lua_selector_args *args,
+		const struct lua_selector_value *in,
+		struct lua_selector_value *out)
+{
+	guint i;
+
+	if (args->nargs > 1) {
+		out->type = LUA_SELECTOR_STRING_LIST;
+		out->nelts = args->nargs;
+		out->v.strs = rspamd_mempool_alloc (task->task_pool,
+				sizeof (rspamd_ftok_t) * args->nargs);
+
+		for (i = 0; i < args->nargs; i ++) {
+			out->v.strs[i].begin = args->args[i];
+			out->v.strs[i].len = strlen (args->args[i]);
+		}
+	}
+	else {
+		lua_selector_extract_id (task, args, out);
+	}
+
+	return TRUE;
+}
+
+static const struct lua_selector_transform lua_selector_transforms[] = {
+	{"lower", LUA_SELECTOR_TYPE_STRING|LUA_SELECTOR_TYPE_MAP,
+			NULL, lua_selector_transform_lower, lua_selector_check_none},
+	{"first", LUA_SELECTOR_TYPE_LIST,
+			lua_selector_transform_first, NULL, lua_selector_check_none},
+	{"last", LUA_SELECTOR_TYPE_LIST,
+			lua_selector_transform_last, NULL, lua_selector_check_none},
+	{"nth", LUA_SELECTOR_TYPE_LIST,
+			lua_selector_transform_nth, NULL, lua_selector_check_n},
+	{"take_n", LUA_SELECTOR_TYPE_LIST,
+			lua_selector_transform_take_n, NULL, lua_selector_check_n},
+	{"drop_n", LUA_SELECTOR_TYPE_LIST,
+			lua_selector_transform_drop_n, NULL, lua_selector_check_n},
+	{"join", LUA_SELECTOR_TYPE_LIST,
+			lua_selector_transform_join, NULL, lua_selector_check_none},
+	{"digest", LUA_SELECTOR_TYPE_STRING|LUA_SELECTOR_TYPE_MAP,
+			NULL, lua_selector_transform_digest, lua_selector_check_digest},
+	{"substring", LUA_SELECTOR_TYPE_STRING|LUA_SELECTOR_TYPE_MAP,
+			NULL, lua_selector_transform_substring, lua_selector_check_substring},
+	{"id", LUA_SELECTOR_TYPE_STRING|LUA_SELECTOR_TYPE_LIST,
+			lua_selector_transform_id, NULL, lua_selector_check_none},
+	{"in", LUA_SELECTOR_TYPE_STRING|LUA_SELECTOR_TYPE_MAP,
+			NULL, lua_selector_transform_in, lua_selector_check_none},
+	{"not_in", LUA_SELECTOR_TYPE_STRING|LUA_SELECTOR_TYPE_MAP,
+			NULL, lua_selector_transform_not_in, lua_selector_check_none},
+};
+
+static void
+lua_selector_args_free (struct lua_selector_args *args)
+{
+	g_strfreev (args->args);
+}
+
+static void
+lua_selector_free (struct lua_selector *sel)
+{
+	struct lua_selector_pipe_elt *elt;
+	guint i;
+
+	if (sel->pipe) {
+		for (i = 0; i < sel->pipe->len; i ++) {
+			elt = &g_array_index (sel->pipe, struct lua_selector_pipe_elt, i);
+			lua_selector_args_free (&elt->args);
+		}
+
+		g_array_free (sel->pipe, TRUE);
+	}
+
+	lua_selector_args_free (&sel->args);
+	g_free (sel);
+}
+
+/*
+ * Reads list of strings (numbers are converted to strings) from the table
+ * at the specified position
+ */
+static gboolean
+lua_selector_read_args (lua_State *L, gint pos, struct lua_selector_args *args)
+{
+	guint i, n;
+	const gchar *s;
+
+	memset (args, 0, sizeof (*args));
+
+	if (lua_type (L, pos) != LUA_TTABLE) {
+		args->args = g_malloc0 (sizeof (gchar *));
+
+		return lua_isnoneornil (L, pos);
+	}
+
+	n = rspamd_lua_table_size (L, pos);
+	args->args = g_malloc0 ((n + 1) * sizeof (gchar *));
+
+	for (i = 0; i < n; i ++) {
+		lua_rawgeti (L, pos, i + 1);
+
+		if (lua_type (L, -1) != LUA_TSTRING && lua_type (L, -1) != LUA_TNUMBER) {
+			lua_pop (L, 1);
+
+			return FALSE;
+		}
+
+		s = lua_tostring (L, -1);
+		args->args[i] = g_strdup (s);
+		args->nargs ++;
+		lua_pop (L, 1);
+	}
+
+	return TRUE;
+}
+
+static gint
+lua_selectors_compile (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	const gchar *name = luaL_checkstring (L, 1), *tname;
+	struct lua_selector *sel, **psel;
+	struct lua_selector_pipe_elt elt;
+	guint i, j, npipe;
+	gboolean is_method;
+
+	sel = g_malloc0 (sizeof (*sel));
+	sel->field = LUA_SELECTOR_ADDR_NONE;
+
+	for (i = 0; i < G_N_ELEMENTS (lua_selector_extractors); i ++) {
+		if (strcmp (lua_selector_extractors[i].name, name) == 0) {
+			sel->extractor = &lua_selector_extractors[i];
+			break;
+		}
+	}
+
+	if (!lua_selector_read_args (L, 2, &sel->args) || sel->extractor == NULL ||
+			!sel->extractor->check (&sel->args)) {
+		goto err;
+	}
+
+	sel->pipe = g_array_new (FALSE, FALSE, sizeof (struct lua_selector_pipe_elt));
+	npipe = lua_type (L, 3) == LUA_TTABLE ? rspamd_lua_table_size (L, 3) : 0;
+
+	for (i = 0; i < npipe; i ++) {
+		lua_rawgeti (L, 3, i + 1);
+
+		if (lua_type (L, -1) != LUA_TTABLE) {
+			lua_pop (L, 1);
+			goto err;
+		}
+
+		lua_getfield (L, -1, "method");
+		is_method = lua_toboolean (L, -1);
+		lua_pop (L, 1);
+		lua_getfield (L, -1, "name");
+		tname = lua_tostring (L, -1);
+		lua_pop (L, 1);
+
+		if (tname == NULL) {
+			lua_pop (L, 1);
+			goto err;
+		}
+
+		if (is_method) {
+			/* Only fields of addresses could be taken in C */
+			if (i != 0 || !sel->extractor->is_addr) {
+				lua_pop (L, 1);
+				goto err;
+			}
+
+			if (strcmp (tname, "addr") == 0) {
+				sel->field = LUA_SELECTOR_ADDR_ADDR;
+			}
+			else if (strcmp (tname, "user") == 0) {
+				sel->field = LUA_SELECTOR_ADDR_USER;
+			}
+			else if (strcmp (tname, "domain") == 0) {
+				sel->field = LUA_SELECTOR_ADDR_DOMAIN;
+			}
+			else if (strcmp (tname, "name") == 0) {
+				sel->field = LUA_SELECTOR_ADDR_NAME;
+			}
+			else {
+				lua_pop (L, 1);
+				goto err;
+			}
+
+			lua_pop (L, 1);
+			continue;
+		}
+
+		memset (&elt, 0, sizeof (elt));
+
+		for (j = 0; j < G_N_ELEMENTS (lua_selector_transforms); j ++) {
+			if (strcmp (lua_selector_transforms[j].name, tname) == 0) {
+				elt.transform = &lua_selector_transforms[j];
+				break;
+			}
+		}
+
+		lua_getfield (L, -1, "args");
+
+		if (!lua_selector_read_args (L, lua_gettop (L), &elt.args) ||
+				elt.transform == NULL || !elt.transform->check (&elt.args)) {
+			lua_pop (L, 2);
+			lua_selector_args_free (&elt.args);
+			goto err;
+		}
+
+		lua_pop (L, 2);
+		g_array_append_val (sel->pipe, elt);
+	}
+
+	psel = lua_newuserdata (L, sizeof (*psel));
+	rspamd_lua_setclass (L, "rspamd{selector}", -1);
+	*psel = sel;
+
+	return 1;
+
+err:
+	lua_selector_free (sel);
+	lua_pushnil (L);
+
+	return 1;
+}
+
+static struct lua_selector *
+lua_check_selector (lua_State *L, gint pos)
+{
+	void *ud = rspamd_lua_check_udata (L, pos, "rspamd{selector}");
+
+	luaL_argcheck (L, ud != NULL, pos, "'selector' expected");
+	return ud ? *((struct lua_selector **)ud) : NULL;
+}
+
+static void
+lua_selector_addr_field (struct rspamd_email_address *addr,
+		enum lua_selector_addr_field field, rspamd_ftok_t *out)
+{
+	/* The same as tables made by lua_push_email_address */
+	switch (field) {
+	case LUA_SELECTOR_ADDR_USER:
+		out->begin = addr->user_len > 0 ? addr->user : "";
+		out->len = addr->user_len;
+		break;
+	case LUA_SELECTOR_ADDR_DOMAIN:
+		out->begin = addr->domain_len > 0 ? addr->domain : "";
+		out->len = addr->domain_len;
+		break;
+	case LUA_SELECTOR_ADDR_NAME:
+		out->begin = addr->name ? addr->name : "";
+		out->len = strlen (out->begin);
+		break;
+	default:
+		out->begin = addr->addr_len > 0 ? addr->addr : "";
+		out->len = addr->addr_len;
+		break;
+	}
+}
+
+static gint
+lua_selector_process (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct lua_selector *sel = lua_check_selector (L, 1);
+	struct rspamd_task *task = lua_check_task (L, 2);
+	struct lua_selector_value val, res;
+	struct lua_selector_pipe_elt *elt;
+	const struct lua_selector_transform *tr;
+	guint i, j, nres;
+	gboolean ok;
+
+	if (sel == NULL || task == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	memset (&val, 0, sizeof (val));
+
+	if (!sel->extractor->extract (task, &sel->args, &val)) {
+		lua_pushnil (L);
+
+		return 1;
+	}
+
+	/* Addresses are converted to their fields, `addr` by default */
+	if (val.type == LUA_SELECTOR_ADDR) {
+		struct rspamd_email_address *addr = val.v.addr;
+
+		val.type = LUA_SELECTOR_STRING;
+		lua_selector_addr_field (addr, sel->field, &val.v.str);
+	}
+	else if (val.type == LUA_SELECTOR_ADDR_LIST) {
+		struct rspamd_email_address **addrs = val.v.addrs;
+
+		val.type = LUA_SELECTOR_STRING_LIST;
+		val.v.strs = rspamd_mempool_alloc (task->task_pool,
+				sizeof (rspamd_ftok_t) * val.nelts);
+
+		for (i = 0; i < val.nelts; i ++) {
+			lua_selector_addr_field (addrs[i], sel->field, &val.v.strs[i]);
+		}
+	}
+
+	for (i = 0; i < sel->pipe->len; i ++) {
+		elt = &g_array_index (sel->pipe, struct lua_selector_pipe_elt, i);
+		tr = elt->transform;
+		memset (&res, 0, sizeof (res));
+
+		if (val.type == LUA_SELECTOR_STRING && (tr->types & LUA_SELECTOR_TYPE_STRING)) {
+			if (tr->process) {
+				ok = tr->process (task, &elt->args, &val, &res);
+			}
+			else {
+				res.type = LUA_SELECTOR_STRING;
+				ok = tr->process_str (task, &elt->args, &val.v.str, &res.v.str);
+			}
+		}
+		else if (val.type == LUA_SELECTOR_STRING_LIST &&
+				(tr->types & LUA_SELECTOR_TYPE_LIST)) {
+			ok = tr->process (task, &elt->args, &val, &res);
+		}
+		else if (val.type == LUA_SELECTOR_STRING_LIST &&
+				(tr->types & LUA_SELECTOR_TYPE_MAP)) {
+			res.type = LUA_SELECTOR_STRING_LIST;
+			res.nelts = val.nelts;
+			res.v.strs = rspamd_mempool_alloc0 (task->task_pool,
+					sizeof (rspamd_ftok_t) * val.nelts);
+
+			for (j = 0; j < val.nelts; j ++) {
+				if (val.v.strs[j].begin != NULL &&
+						!tr->process_str (task, &elt->args, &val.v.strs[j],
+								&res.v.strs[j])) {
+					res.v.strs[j].begin = NULL;
+				}
+			}
+
+			ok = TRUE;
+		}
+		else {
+			msg_err_task ("cannot apply transform %s for type %s", tr->name,
+					val.type == LUA_SELECTOR_STRING ? "string" : "string_list");
+			ok = FALSE;
+		}
+
+		if (!ok) {
+			lua_pushnil (L);
+
+			return 1;
+		}
+
+		val = res;
+	}
+
+	if (val.type == LUA_SELECTOR_STRING) {
+		lua_pushlstring (L, val.v.str.begin, val.v.str.len);
+	}
+	else {
+		lua_createtable (L, val.nelts, 0);
+
+		for (i = 0, nres = 0; i < val.nelts; i ++) {
+			if (val.v.strs[i].begin != NULL) {
+				lua_pushlstring (L, val.v.strs[i].begin, val.v.strs[i].len);
+				lua_rawseti (L, -2, ++nres);
+			}
+		}
+	}
+
+	return 1;
+}
+
+static gint
+lua_selector_gc (lua_State *L)
+{
+	struct lua_selector *sel = lua_check_selector (L, 1);
+
+	if (sel) {
+		lua_selector_free (sel);
+	}
+
+	return 0;
+}
+
+static gint
+lua_load_selectors (lua_State *L)
+{
+	lua_newtable (L);
+	luaL_register (L, NULL, selectorslib_f);
+
+	return 1;
+}
+
+void
+luaopen_selectors (lua_State *L)
+{
+	rspamd_lua_new_class (L, "rspamd{selector}", selectorlib_m);
+	lua_pop (L, 1);
+	rspamd_lua_add_preload (L, "rspamd_selectors", lua_load_selectors);
+}
@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 #include "lua_common.h"
+#include "lua_thread_pool.h"
 #include "message.h"
 #include "images.h"
 #include "archives.h"
@@ -189,6 +190,22 @@ local function phishing_cb(task)
 end
  */
 LUA_FUNCTION_DEF (task, get_urls);
+/***
+ * @method task:get_phished_urls()
+ * Returns urls whose displayed text points to a different domain, redirected
+ * urls are skipped. Domains are compared once per task, each element is a
+ * table with the following fields:
+ *
+ * - `url` - url from the href
+ * - `phished` - url from the displayed text
+ * - `tld` and `phished_tld` - effective domains of these urls, the last label
+ * is removed if it is the same for both domains
+ * - `dist` - edit distance between `tld` and `phished_tld` (replacement costs 2)
+ * normalised by their average length
+ * - `ascii_mismatch` - only one of the domains is plain ASCII
+ * @return {table of tables} list of phished urls
+ */
+LUA_FUNCTION_DEF (task, get_phished_urls);
 /***
  * @method task:has_urls([need_emails])
  * Returns 'true' if a task has urls listed
@@ -257,20 +274,22 @@ LUA_FUNCTION_DEF (task, set_request_header);
  */
 LUA_FUNCTION_DEF (task, get_subject);
 /***
- * @method task:get_header(name[, case_sensitive])
+ * @method task:get_header(name[, case_sensitive[, as_text]])
  * Get decoded value of a header specified with optional case_sensitive flag.
  * By default headers are searched in caseless matter.
  * @param {string} name name of header to get
  * @param {boolean} case_sensitive case sensitiveness flag to search for a header
+ * @param {boolean} as_text return `rspamd_text` pointing to the task memory instead of a string copy
  * @return {string} decoded value of a header
  */
 LUA_FUNCTION_DEF (task, get_header);
 /***
- * @method task:get_header_raw(name[, case_sensitive])
+ * @method task:get_header_raw(name[, case_sensitive[, as_text]])
  * Get raw value of a header specified with optional case_sensitive flag.
  * By default headers are searched in caseless matter.
  * @param {string} name name of header to get
  * @param {boolean} case_sensitive case sensitiveness flag to search for a header
+ * @param {boolean} as_text return `rspamd_text` pointing to the task memory instead of a string copy
  * @return {string} raw value of a header
  */
 LUA_FUNCTION_DEF (task, get_header_raw);
@@ -332,6 +351,15 @@ LUA_FUNCTION_DEF (task, get_raw_headers);
  * @return {table of tables} list of received headers described above
  */
 LUA_FUNCTION_DEF (task, get_received_headers);
+/***
+ * @method task:get_received_header(n)
+ * Returns a single received header in the same format as
+ * `task:get_received_headers()`. Only this header is parsed, so it is cheaper
+ * than getting the whole chain when a rule needs the first hops only
+ * @param {number} n number of header, 1 is the closest hop
+ * @return {table} received header or nil if there is no such header
+ */
+LUA_FUNCTION_DEF (task, get_received_header);
 /***
  * @method task:get_queue_id()
  * Returns queue ID of the message being processed.
@@ -375,6 +403,15 @@ LUA_FUNCTION_DEF (task, inc_dns_req);
  * @return {number} number of DNS requests
  */
 LUA_FUNCTION_DEF (task, get_dns_req);
+/***
+ * @method task:add_timer(timeout, callback)
+ * Calls `callback(task)` after `timeout` seconds. The timer is registered as an
+ * asynchronous event, so the task is not finished until the timer fires.
+ * @param {number} timeout timeout in seconds
+ * @param {function} callback function to be called
+ * @return {boolean} true if a timer has been added
+ */
+LUA_FUNCTION_DEF (task, add_timer);
 
 /***
  * @method task:has_recipients([type])
@@ -393,6 +430,7 @@ LUA_FUNCTION_DEF (task, has_recipients);
  * - `user` - user part (if present) of the address, e.g. `blah`
  * - `domain` - domain part (if present), e.g. `foo.com`
  * @param {integer|string} type if specified has the following meaning: `0` or `any` means try SMTP recipients and fallback to MIME if failed, `1` or `smtp` means checking merely SMTP recipients and `2` or `mime` means MIME recipients only
+ * The resulting table is cached per task, so it must not be modified by a caller.
  * @return {list of addresses} list of recipients or `nil`
  */
 LUA_FUNCTION_DEF (task, get_recipients);
@@ -442,6 +480,7 @@ LUA_FUNCTION_DEF (task, has_from);
  * - `user` - user part (if present) of the address, e.g. `blah`
  * - `domain` - domain part (if present), e.g. `foo.com`
  * @param {integer|string} type if specified has the following meaning: `0` or `any` means try SMTP sender and fallback to MIME if failed, `1` or `smtp` means checking merely SMTP sender and `2` or `mime` means MIME `From:` only
+ * The resulting table is cached per task, so it must not be modified by a caller.
  * @return {address} sender or `nil`
  */
 LUA_FUNCTION_DEF (task, get_from);
@@ -948,6 +987,7 @@ static const struct luaL_reg tasklib_m[] = {
 	LUA_INTERFACE_DEF (task, append_message),
 	LUA_INTERFACE_DEF (task, has_urls),
 	LUA_INTERFACE_DEF (task, get_urls),
+	LUA_INTERFACE_DEF (task, get_phished_urls),
 	LUA_INTERFACE_DEF (task, get_content),
 	LUA_INTERFACE_DEF (task, get_filename),
 	LUA_INTERFACE_DEF (task, get_rawbody),
@@ -962,11 +1002,13 @@ static const struct luaL_reg tasklib_m[] = {
 	LUA_INTERFACE_DEF (task, get_header_count),
 	LUA_INTERFACE_DEF (task, get_raw_headers),
 	LUA_INTERFACE_DEF (task, get_received_headers),
+	LUA_INTERFACE_DEF (task, get_received_header),
 	LUA_INTERFACE_DEF (task, get_queue_id),
 	LUA_INTERFACE_DEF (task, get_uid),
 	LUA_INTERFACE_DEF (task, get_resolver),
 	LUA_INTERFACE_DEF (task, inc_dns_req),
 	LUA_INTERFACE_DEF (task, get_dns_req),
+	LUA_INTERFACE_DEF (task, add_timer),
 	LUA_INTERFACE_DEF (task, has_recipients),
 	LUA_INTERFACE_DEF (task, get_recipients),
 	LUA_INTERFACE_DEF (task, set_recipients),
@@ -1127,6 +1169,56 @@ lua_check_text (lua_State * L, gint pos)
 	return ud ? (struct rspamd_lua_text *)ud : NULL;
 }
 
+struct rspamd_lua_text *
+lua_new_text (lua_State *L, const gchar *start, gsize len, gboolean own)
+{
+	struct rspamd_lua_text *t;
+	gchar *storage;
+
+	t = lua_newuserdata (L, sizeof (*t));
+	rspamd_lua_setclass (L, "rspamd{text}", -1);
+	t->len = len;
+
+	if (own && len > 0) {
+		storage = g_malloc (len);
+		memcpy (storage, start, len);
+		t->start = storage;
+		t->flags = RSPAMD_TEXT_FLAG_OWN;
+	}
+	else {
+		t->start = start;
+		t->flags = 0;
+	}
+
+	return t;
+}
+
+const gchar *
+lua_tolstring_or_text (lua_State *L, gint pos, gsize *len)
+{
+	struct rspamd_lua_text *t;
+	const gchar *str;
+
+	*len = 0;
+
+	if (lua_type (L, pos) == LUA_TUSERDATA) {
+		t = rspamd_lua_check_udata_maybe (L, pos, "rspamd{text}");
+
+		if (t) {
+			*len = t->len;
+
+			return t->start;
+		}
+
+		return NULL;
+	}
+
+	/* Numbers are converted as `lua_tolstring` does */
+	str = lua_tolstring (L, pos, len);
+
+	return str;
+}
+
 static void
 lua_task_set_cached (lua_State *L, struct rspamd_task *task, const gchar *key,
 		gint pos, guint id)
@@ -1170,6 +1262,20 @@ lua_task_get_cached (lua_State *L, struct rspamd_task *task, const gchar *key,
 	return FALSE;
 }
 
+static void
+lua_task_reset_cached (lua_State *L, struct rspamd_task *task, const gchar *key)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_lua_cached_entry *entry;
+
+	entry = g_hash_table_lookup (task->lua_cache, key);
+
+	if (entry != NULL) {
+		luaL_unref (L, LUA_REGISTRYINDEX, entry->ref);
+		g_hash_table_remove (task->lua_cache, key);
+	}
+}
+
 /* Task methods */
 static int
 lua_task_process_message (lua_State *L)
@@ -1759,6 +1865,119 @@ lua_task_get_urls (lua_State * L)
 	return 1;
 }
 
+static gboolean
+lua_task_str_is_ascii (const gchar *s, gsize len)
+{
+	const guchar *p = (const guchar *)s, *end = p + len;
+
+	while (p < end) {
+		if (*p == 0 || *p >= 0x80) {
+			return FALSE;
+		}
+
+		p ++;
+	}
+
+	return TRUE;
+}
+
+static gint
+lua_task_get_phished_urls (lua_State * L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_task *task = lua_check_task (L, 1);
+	struct rspamd_url *url, *purl;
+	struct rspamd_lua_url *lua_url;
+	GHashTableIter it;
+	gpointer k, v;
+	const gchar *tld, *ptld, *dot, *pdot;
+	gsize tldlen, ptldlen;
+	gint dist, i = 1;
+	guint sz;
+
+	if (task) {
+		sz = g_hash_table_size (task->urls);
+
+		if (!lua_task_get_cached (L, task, "phished_urls", sz)) {
+			lua_newtable (L);
+			g_hash_table_iter_init (&it, task->urls);
+
+			while (g_hash_table_iter_next (&it, &k, &v)) {
+				url = v;
+				purl = url->phished_url;
+
+				if (!(url->flags & RSPAMD_URL_FLAG_PHISHED) ||
+						(url->flags & RSPAMD_URL_FLAG_REDIRECTED) ||
+						purl == NULL || url->tldlen == 0 || purl->tldlen == 0) {
+					continue;
+				}
+
+				tld = url->tld;
+				tldlen = url->tldlen;
+				ptld = purl->tld;
+				ptldlen = purl->tldlen;
+
+				/* Remove the last label if it is the same */
+				dot = rspamd_memrchr (tld, '.', tldlen);
+				pdot = rspamd_memrchr (ptld, '.', ptldlen);
+
+				if (dot && pdot && tld + tldlen - dot == ptld + ptldlen - pdot &&
+						memcmp (dot, pdot, tld + tldlen - dot) == 0) {
+					tldlen = dot - tld;
+					ptldlen = pdot - ptld;
+
+					if (tldlen == 0 || ptldlen == 0) {
+						continue;
+					}
+				}
+
+				dist = rspamd_strings_levenshtein_distance (tld, tldlen,
+						ptld, ptldlen, 2);
+
+				lua_createtable (L, 0, 6);
+
+				lua_pushstring (L, "url");
+				lua_url = lua_newuserdata (L, sizeof (*lua_url));
+				rspamd_lua_setclass (L, "rspamd{url}", -1);
+				lua_url->url = url;
+				lua_settable (L, -3);
+
+				lua_pushstring (L, "phished");
+				lua_url = lua_newuserdata (L, sizeof (*lua_url));
+				rspamd_lua_setclass (L, "rspamd{url}", -1);
+				lua_url->url = purl;
+				lua_settable (L, -3);
+
+				lua_pushstring (L, "tld");
+				lua_pushlstring (L, tld, tldlen);
+				lua_settable (L, -3);
+
+				lua_pushstring (L, "phished_tld");
+				lua_pushlstring (L, ptld, ptldlen);
+				lua_settable (L, -3);
+
+				lua_pushstring (L, "dist");
+				lua_pushnumber (L, 2.0 * dist / (gdouble)(tldlen + ptldlen));
+				lua_settable (L, -3);
+
+				lua_pushstring (L, "ascii_mismatch");
+				lua_pushboolean (L, lua_task_str_is_ascii (tld, tldlen) !=
+						lua_task_str_is_ascii (ptld, ptldlen));
+				lua_settable (L, -3);
+
+				lua_rawseti (L, -2, i ++);
+			}
+
+			lua_task_set_cached (L, task, "phished_urls", -1, sz);
+		}
+	}
+	else {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	return 1;
+}
+
 static gint
 lua_task_has_urls (lua_State * L)
 {
@@ -1866,12 +2085,19 @@ lua_task_get_emails (lua_State * L)
 	LUA_TRACE_POINT;
 	struct rspamd_task *task = lua_check_task (L, 1);
 	struct lua_tree_cb_data cb;
+	gsize sz;
 
 	if (task) {
-		lua_createtable (L, g_hash_table_size (task->emails), 0);
-		cb.i = 1;
-		cb.L = L;
-		g_hash_table_foreach (task->emails, lua_tree_url_callback, &cb);
+		sz = g_hash_table_size (task->emails);
+
+		if (!lua_task_get_cached (L, task, "emails", sz)) {
+			lua_createtable (L, sz, 0);
+			cb.i = 1;
+			cb.L = L;
+			g_hash_table_foreach (task->emails, lua_tree_url_callback, &cb);
+
+			lua_task_set_cached (L, task, "emails", -1, sz);
+		}
 	}
 	else {
 		return luaL_error (L, "invalid arguments");
@@ -2024,7 +2250,8 @@ lua_task_set_request_header (lua_State *L)
 
 
 gint
-rspamd_lua_push_header (lua_State *L, struct rspamd_mime_header *rh,
+rspamd_lua_push_header (lua_State *L, rspamd_mempool_t *pool,
+						struct rspamd_mime_header *rh,
 						enum rspamd_lua_task_header_type how)
 {
 	LUA_TRACE_POINT;
@@ -2038,8 +2265,9 @@ rspamd_lua_push_header (lua_State *L, struct rspamd_mime_header *rh,
 			rspamd_lua_table_set (L, "value", rh->value);
 		}
 
-		if (rh->decoded) {
-			rspamd_lua_table_set (L, "decoded", rh->decoded);
+		if (rh->value) {
+			rspamd_lua_table_set (L, "decoded",
+					rspamd_mime_header_get_decoded (pool, rh));
 		}
 
 		lua_pushstring (L, "tab_separated");
@@ -2062,8 +2290,26 @@ rspamd_lua_push_header (lua_State *L, struct rspamd_mime_header *rh,
 		}
 		break;
 	case RSPAMD_TASK_HEADER_PUSH_SIMPLE:
-		if (rh->decoded) {
-			lua_pushstring (L, rh->decoded);
+		if (rh->value) {
+			lua_pushstring (L, rspamd_mime_header_get_decoded (pool, rh));
+		}
+		else {
+			lua_pushnil (L);
+		}
+		break;
+	case RSPAMD_TASK_HEADER_PUSH_RAW_TEXT:
+		if (rh->value) {
+			lua_new_text (L, rh->value, strlen (rh->value), FALSE);
+		}
+		else {
+			lua_pushnil (L);
+		}
+		break;
+	case RSPAMD_TASK_HEADER_PUSH_SIMPLE_TEXT:
+		if (rh->value) {
+			const gchar *decoded = rspamd_mime_header_get_decoded (pool, rh);
+
+			lua_new_text (L, decoded, strlen (decoded), FALSE);
 		}
 		else {
 			lua_pushnil (L);
@@ -2080,6 +2326,7 @@ rspamd_lua_push_header (lua_State *L, struct rspamd_mime_header *rh,
 
 gint
 rspamd_lua_push_header_array (lua_State * L,
+							  rspamd_mempool_t *pool,
 							  GPtrArray *ar,
 							  enum rspamd_lua_task_header_type how)
 {
@@ -2101,7 +2348,7 @@ rspamd_lua_push_header_array (lua_State * L,
 	if (how == RSPAMD_TASK_HEADER_PUSH_FULL) {
 		lua_createtable (L, ar->len, 0);
 		PTR_ARRAY_FOREACH (ar, i, rh) {
-			rspamd_lua_push_header (L, rh, how);
+			rspamd_lua_push_header (L, pool, rh, how);
 			lua_rawseti (L, -2, i + 1);
 		}
 	}
@@ -2111,7 +2358,7 @@ rspamd_lua_push_header_array (lua_State * L,
 	else {
 		rh = g_ptr_array_index (ar, 0);
 
-		return rspamd_lua_push_header (L, rh, how);
+		return rspamd_lua_push_header (L, pool, rh, how);
 	}
 
 	return 1;
@@ -2129,13 +2376,23 @@ lua_task_get_header_common (lua_State *L, enum rspamd_lua_task_header_type how)
 	name = luaL_checkstring (L, 2);
 
 	if (name && task) {
-		if (lua_gettop (L) == 3) {
+		if (lua_gettop (L) >= 3) {
 			strong = lua_toboolean (L, 3);
 		}
 
+		if (lua_toboolean (L, 4)) {
+			/* Values live in the task pool, so they are not copied */
+			if (how == RSPAMD_TASK_HEADER_PUSH_SIMPLE) {
+				how = RSPAMD_TASK_HEADER_PUSH_SIMPLE_TEXT;
+			}
+			else if (how == RSPAMD_TASK_HEADER_PUSH_RAW) {
+				how = RSPAMD_TASK_HEADER_PUSH_RAW_TEXT;
+			}
+		}
+
 		ar = rspamd_message_get_header_array (task, name, strong);
 
-		return rspamd_lua_push_header_array (L, ar, how);
+		return rspamd_lua_push_header_array (L, task->task_pool, ar, how);
 	}
 	else {
 		return luaL_error (L, "invalid arguments");
@@ -2188,116 +2445,118 @@ lua_task_get_raw_headers (lua_State *L)
 	return 1;
 }
 
-static gint
-lua_task_get_received_headers (lua_State * L)
+static void
+lua_task_push_received (lua_State *L, struct received_header *rh)
 {
-	LUA_TRACE_POINT;
-	struct rspamd_task *task = lua_check_task (L, 1);
-	struct received_header *rh;
 	const gchar *proto;
-	guint i, k = 1;
 
-	if (task) {
-		if (!lua_task_get_cached (L, task, "received", task->received->len)) {
-			lua_createtable (L, task->received->len, 0);
+	lua_createtable (L, 0, 10);
 
-			for (i = 0; i < task->received->len; i ++) {
-				rh = g_ptr_array_index (task->received, i);
+	if (rh->hdr && rh->hdr->decoded) {
+		rspamd_lua_table_set (L, "raw", rh->hdr->decoded);
+	}
 
-				lua_createtable (L, 0, 10);
+	lua_pushstring (L, "flags");
+	lua_createtable (L, 0, 3);
 
-				if (rh->hdr && rh->hdr->decoded) {
-					rspamd_lua_table_set (L, "raw", rh->hdr->decoded);
-				}
+	lua_pushstring (L, "artificial");
+	if (rh->flags & RSPAMD_RECEIVED_FLAG_ARTIFICIAL) {
+		lua_pushboolean (L, true);
+	}
+	else {
+		lua_pushboolean (L, false);
+	}
+	lua_settable (L, -3);
 
-				lua_pushstring (L, "flags");
-				lua_createtable (L, 0, 3);
+	lua_pushstring (L, "authenticated");
+	if (rh->flags & RSPAMD_RECEIVED_FLAG_AUTHENTICATED) {
+		lua_pushboolean (L, true);
+	}
+	else {
+		lua_pushboolean (L, false);
+	}
+	lua_settable (L, -3);
 
-				lua_pushstring (L, "artificial");
-				if (rh->flags & RSPAMD_RECEIVED_FLAG_ARTIFICIAL) {
-					lua_pushboolean (L, true);
-				}
-				else {
-					lua_pushboolean (L, false);
-				}
-				lua_settable (L, -3);
+	lua_pushstring (L, "ssl");
+	if (rh->flags & RSPAMD_RECEIVED_FLAG_SSL) {
+		lua_pushboolean (L, true);
+	}
+	else {
+		lua_pushboolean (L, false);
+	}
+	lua_settable (L, -3);
 
-				lua_pushstring (L, "authenticated");
-				if (rh->flags & RSPAMD_RECEIVED_FLAG_AUTHENTICATED) {
-					lua_pushboolean (L, true);
-				}
-				else {
-					lua_pushboolean (L, false);
-				}
-				lua_settable (L, -3);
+	lua_settable (L, -3);
 
-				lua_pushstring (L, "ssl");
-				if (rh->flags & RSPAMD_RECEIVED_FLAG_SSL) {
-					lua_pushboolean (L, true);
-				}
-				else {
-					lua_pushboolean (L, false);
-				}
-				lua_settable (L, -3);
+	if (G_UNLIKELY (rh->from_ip == NULL &&
+			rh->real_ip == NULL &&
+			rh->real_hostname == NULL &&
+			rh->by_hostname == NULL && rh->timestamp == 0 &&
+			rh->for_mbox == NULL)) {
+		return;
+	}
 
-				lua_settable (L, -3);
+	rspamd_lua_table_set (L, "from_hostname", rh->from_hostname);
+	rspamd_lua_table_set (L, "from_ip", rh->from_ip);
+	rspamd_lua_table_set (L, "real_hostname", rh->real_hostname);
+	lua_pushstring (L, "real_ip");
+	rspamd_lua_ip_push (L, rh->addr);
+	lua_settable (L, -3);
+	lua_pushstring (L, "proto");
 
-				if (G_UNLIKELY (rh->from_ip == NULL &&
-						rh->real_ip == NULL &&
-						rh->real_hostname == NULL &&
-						rh->by_hostname == NULL && rh->timestamp == 0 &&
-						rh->for_mbox == NULL)) {
-					lua_rawseti (L, -2, k ++);
+	switch (rh->type) {
+	case RSPAMD_RECEIVED_SMTP:
+		proto = "smtp";
+		break;
+	case RSPAMD_RECEIVED_ESMTP:
+		proto = "esmtp";
+		break;
+	case RSPAMD_RECEIVED_ESMTPS:
+		proto = "esmtps";
+		break;
+	case RSPAMD_RECEIVED_ESMTPA:
+		proto = "esmtpa";
+		break;
+	case RSPAMD_RECEIVED_ESMTPSA:
+		proto = "esmtpsa";
+		break;
+	case RSPAMD_RECEIVED_LMTP:
+		proto = "lmtp";
+		break;
+	case RSPAMD_RECEIVED_IMAP:
+		proto = "imap";
+		break;
+	case RSPAMD_RECEIVED_UNKNOWN:
+	default:
+		proto = "unknown";
+		break;
+	}
 
-					continue;
-				}
+	lua_pushstring (L, proto);
+	lua_settable (L, -3);
 
-				rspamd_lua_table_set (L, "from_hostname", rh->from_hostname);
-				rspamd_lua_table_set (L, "from_ip", rh->from_ip);
-				rspamd_lua_table_set (L, "real_hostname", rh->real_hostname);
-				lua_pushstring (L, "real_ip");
-				rspamd_lua_ip_push (L, rh->addr);
-				lua_settable (L, -3);
-				lua_pushstring (L, "proto");
+	lua_pushstring (L, "timestamp");
+	lua_pushinteger (L, rh->timestamp);
+	lua_settable (L, -3);
 
-				switch (rh->type) {
-				case RSPAMD_RECEIVED_SMTP:
-					proto = "smtp";
-					break;
-				case RSPAMD_RECEIVED_ESMTP:
-					proto = "esmtp";
-					break;
-				case RSPAMD_RECEIVED_ESMTPS:
-					proto = "esmtps";
-					break;
-				case RSPAMD_RECEIVED_ESMTPA:
-					proto = "esmtpa";
-					break;
-				case RSPAMD_RECEIVED_ESMTPSA:
-					proto = "esmtpsa";
-					break;
-				case RSPAMD_RECEIVED_LMTP:
-					proto = "lmtp";
-					break;
-				case RSPAMD_RECEIVED_IMAP:
-					proto = "imap";
-					break;
-				case RSPAMD_RECEIVED_UNKNOWN:
-				default:
-					proto = "unknown";
-					break;
-				}
+	rspamd_lua_table_set (L, "by_hostname", rh->by_hostname);
+	rspamd_lua_table_set (L, "for", rh->for_mbox);
+}
 
-				lua_pushstring (L, proto);
-				lua_settable (L, -3);
+static gint
+lua_task_get_received_headers (lua_State * L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_task *task = lua_check_task (L, 1);
+	guint i;
 
-				lua_pushstring (L, "timestamp");
-				lua_pushinteger (L, rh->timestamp);
-				lua_settable (L, -3);
+	if (task) {
+		if (!lua_task_get_cached (L, task, "received", task->received->len)) {
+			lua_createtable (L, task->received->len, 0);
 
-				rspamd_lua_table_set (L, "by_hostname", rh->by_hostname);
-				rspamd_lua_table_set (L, "for", rh->for_mbox);
-				lua_rawseti (L, -2, k ++);
+			for (i = 0; i < task->received->len; i ++) {
+				lua_task_push_received (L, rspamd_task_get_received (task, i));
+				lua_rawseti (L, -2, i + 1);
 			}
 
 			lua_task_set_cached (L, task, "received", -1, task->received->len);
@@ -2310,6 +2569,31 @@ lua_task_get_received_headers (lua_State * L)
 	return 1;
 }
 
+static gint
+lua_task_get_received_header (lua_State * L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_task *task = lua_check_task (L, 1);
+	struct received_header *rh;
+	gint n = luaL_checkinteger (L, 2);
+
+	if (task) {
+		rh = n > 0 ? rspamd_task_get_received (task, n - 1) : NULL;
+
+		if (rh) {
+			lua_task_push_received (L, rh);
+		}
+		else {
+			lua_pushnil (L);
+		}
+	}
+	else {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	return 1;
+}
+
 static gint
 lua_task_get_queue_id (lua_State *L)
 {
@@ -2388,6 +2672,103 @@ lua_task_inc_dns_req (lua_State *L)
 	return 0;
 }
 
+struct lua_task_timer_cbdata {
+	struct rspamd_task *task;
+	struct rspamd_symcache_item *item;
+	struct event ev;
+	gint cbref;
+};
+
+static void
+lua_task_timer_fin (gpointer ud)
+{
+	struct lua_task_timer_cbdata *cbd = ud;
+
+	if (evtimer_pending (&cbd->ev, NULL)) {
+		evtimer_del (&cbd->ev);
+	}
+
+	if (cbd->cbref != -1) {
+		luaL_unref (cbd->task->cfg->lua_state, LUA_REGISTRYINDEX, cbd->cbref);
+		cbd->cbref = -1;
+	}
+}
+
+static void
+lua_task_timer_cb (gint fd, short what, gpointer ud)
+{
+	struct lua_task_timer_cbdata *cbd = ud;
+	struct rspamd_task *task = cbd->task;
+	struct lua_callback_state cbs;
+	lua_State *L;
+	gint top;
+
+	lua_thread_pool_prepare_callback (task->cfg->lua_thread_pool, &cbs);
+	L = cbs.L;
+	top = lua_gettop (L);
+	lua_rawgeti (L, LUA_REGISTRYINDEX, cbd->cbref);
+	rspamd_lua_task_push_cached (L, task);
+
+	if (cbd->item) {
+		rspamd_symcache_set_cur_item (task, cbd->item);
+	}
+
+	if (lua_pcall (L, 1, 0, 0) != 0) {
+		msg_info_task ("timer callback call failed: %s", lua_tostring (L, -1));
+	}
+
+	lua_settop (L, top);
+	lua_thread_pool_restore_callback (&cbs);
+
+	if (cbd->item) {
+		rspamd_symcache_item_async_dec_check (task, cbd->item, "lua timer");
+		cbd->item = NULL;
+	}
+
+	rspamd_session_remove_event (task->s, lua_task_timer_fin, cbd);
+}
+
+static gint
+lua_task_add_timer (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_task *task = lua_check_task (L, 1);
+	struct lua_task_timer_cbdata *cbd;
+	struct timeval tv;
+	gdouble timeout = luaL_checknumber (L, 2);
+
+	if (task == NULL || task->s == NULL || !lua_isfunction (L, 3)) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	if (rspamd_session_blocked (task->s)) {
+		lua_pushboolean (L, false);
+
+		return 1;
+	}
+
+	cbd = rspamd_mempool_alloc0 (task->task_pool, sizeof (*cbd));
+	cbd->task = task;
+	lua_pushvalue (L, 3);
+	cbd->cbref = luaL_ref (L, LUA_REGISTRYINDEX);
+
+	double_to_tv (timeout, &tv);
+	evtimer_set (&cbd->ev, lua_task_timer_cb, cbd);
+	event_base_set (task->ev_base, &cbd->ev);
+	evtimer_add (&cbd->ev, &tv);
+
+	rspamd_session_add_event (task->s, lua_task_timer_fin, cbd, "lua timer");
+	cbd->item = rspamd_symcache_get_cur_item (task);
+
+	if (cbd->item) {
+		rspamd_symcache_item_async_inc (task, cbd->item, "lua timer");
+	}
+
+	lua_pushboolean (L, true);
+
+	return 1;
+}
+
 static gint
 lua_task_get_dns_req (lua_State *L)
 {
@@ -2414,6 +2795,18 @@ enum rspamd_address_type {
 	RSPAMD_ADDRESS_MAX
 };
 
+/* Cache keys of addresses tables, invalidated by the corresponding setters */
+static const gchar *lua_task_from_cache_keys[] = {
+	[RSPAMD_ADDRESS_ANY] = "from_any",
+	[RSPAMD_ADDRESS_SMTP] = "from_smtp",
+	[RSPAMD_ADDRESS_MIME] = "from_mime",
+};
+static const gchar *lua_task_rcpt_cache_keys[] = {
+	[RSPAMD_ADDRESS_ANY] = "rcpt_any",
+	[RSPAMD_ADDRESS_SMTP] = "rcpt_smtp",
+	[RSPAMD_ADDRESS_MIME] = "rcpt_mime",
+};
+
 /*
  * Convert element at the specified position to the type
  * for get_from/get_recipients
@@ -2698,6 +3091,8 @@ lua_task_get_recipients (lua_State *L)
 			break;
 		case RSPAMD_ADDRESS_ANY:
 		default:
+			what = RSPAMD_ADDRESS_ANY;
+
 			if (task->rcpt_envelope) {
 				ptrs = task->rcpt_envelope;
 			}
@@ -2707,7 +3102,12 @@ lua_task_get_recipients (lua_State *L)
 			break;
 		}
 		if (ptrs) {
-			lua_push_emails_address_list (L, ptrs);
+			if (!lua_task_get_cached (L, task, lua_task_rcpt_cache_keys[what],
+					ptrs->len)) {
+				lua_push_emails_address_list (L, ptrs);
+				lua_task_set_cached (L, task, lua_task_rcpt_cache_keys[what],
+						-1, ptrs->len);
+			}
 		}
 		else {
 			lua_pushnil (L);
@@ -2768,6 +3168,10 @@ lua_task_set_recipients (lua_State *L)
 			g_ptr_array_set_size (ptrs, 0);
 			lua_pushvalue (L, pos);
 
+			for (i = 0; i < G_N_ELEMENTS (lua_task_rcpt_cache_keys); i ++) {
+				lua_task_reset_cached (L, task, lua_task_rcpt_cache_keys[i]);
+			}
+
 			for (lua_pushnil (L); lua_next (L, -2); lua_pop (L, 1)) {
 				if (lua_import_email_address (L, task, lua_gettop (L), &addr)) {
 					g_ptr_array_add (ptrs, addr);
@@ -2917,6 +3321,8 @@ lua_task_get_from (lua_State *L)
 			break;
 		case RSPAMD_ADDRESS_ANY:
 		default:
+			what = RSPAMD_ADDRESS_ANY;
+
 			if (task->from_envelope) {
 				addr = task->from_envelope;
 			}
@@ -2927,14 +3333,24 @@ lua_task_get_from (lua_State *L)
 		}
 
 		if (addrs) {
-			lua_push_emails_address_list (L, addrs);
+			if (!lua_task_get_cached (L, task, lua_task_from_cache_keys[what],
+					addrs->len)) {
+				lua_push_emails_address_list (L, addrs);
+				lua_task_set_cached (L, task, lua_task_from_cache_keys[what],
+						-1, addrs->len);
+			}
 		}
 		else if (addr) {
 			/* Create table to preserve compatibility */
 			if (addr->addr) {
-				lua_createtable (L, 1, 0);
-				lua_push_email_address (L, addr);
-				lua_rawseti (L, -2, 1);
+				if (!lua_task_get_cached (L, task,
+						lua_task_from_cache_keys[what], 1)) {
+					lua_createtable (L, 1, 0);
+					lua_push_email_address (L, addr);
+					lua_rawseti (L, -2, 1);
+					lua_task_set_cached (L, task,
+							lua_task_from_cache_keys[what], -1, 1);
+				}
 			}
 			else {
 				lua_pushnil (L);
@@ -2959,6 +3375,7 @@ lua_task_set_from (lua_State *L)
 	GPtrArray *addrs = NULL;
 	struct rspamd_email_address **paddr = NULL, *addr;
 	gint what = 0, pos = 3;
+	guint i;
 
 	if (task) {
 		if (lua_isstring (L, 2) || lua_isnumber (L, 2)) {
@@ -2989,9 +3406,12 @@ lua_task_set_from (lua_State *L)
 			break;
 		}
 
+		for (i = 0; i < G_N_ELEMENTS (lua_task_from_cache_keys); i ++) {
+			lua_task_reset_cached (L, task, lua_task_from_cache_keys[i]);
+		}
+
 		if (addrs) {
 			if (lua_import_email_address (L, task, pos, &addr)) {
-				guint i;
 				struct rspamd_email_address *tmp;
 
 				PTR_ARRAY_FOREACH (addrs, i, tmp) {
@@ -3785,9 +4205,11 @@ lua_task_get_date (lua_State *L)
 				time_t tt;
 				struct tm t;
 				struct rspamd_mime_header *h;
+				const gchar *date_str;
 
 				h = g_ptr_array_index (hdrs, 0);
-				tt = rspamd_parse_smtp_date (h->decoded, strlen (h->decoded));
+				date_str = rspamd_mime_header_get_decoded (task->task_pool, h);
+				tt = rspamd_parse_smtp_date (date_str, strlen (date_str));
 
 				if (!gmt) {
 					rspamd_localtime (tt, &t);
@@ -4975,7 +5397,7 @@ lua_task_headers_foreach (lua_State *L)
 				old_top = lua_gettop (L);
 				lua_pushvalue (L, 2);
 				lua_pushstring (L, hdr->name);
-				rspamd_lua_push_header (L, hdr, how);
+				rspamd_lua_push_header (L, task->task_pool, hdr, how);
 
 				if (lua_pcall (L, 2, LUA_MULTRET, 0) != 0) {
 					msg_err ("call to header_foreach failed: %s",
@@ -5423,3 +5845,12 @@ rspamd_lua_task_push (lua_State *L, struct rspamd_task *task)
 	rspamd_lua_setclass (L, "rspamd{task}", -1);
 	*ptask = task;
 }
+
+void
+rspamd_lua_task_push_cached (lua_State *L, struct rspamd_task *task)
+{
+	if (!lua_task_get_cached (L, task, "task", 0)) {
+		rspamd_lua_task_push (L, task);
+		lua_task_set_cached (L, task, "task", -1, 0);
+	}
+}
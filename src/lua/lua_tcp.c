@@ -17,6 +17,7 @@
 #include "lua_thread_pool.h"
 #include "utlist.h"
 #include "unix-std.h"
+#include "libutil/timer_wheel.h"
 #include <math.h>
 
 static const gchar *M = "rspamd lua tcp";
@@ -272,6 +273,7 @@ struct lua_tcp_read_handler {
 	gchar *stop_pattern;
 	guint plen;
 	gint cbref;
+	gsize scan_pos; /* data before this offset cannot start stop_pattern */
 };
 
 struct lua_tcp_write_handler {
@@ -299,6 +301,7 @@ struct lua_tcp_handler {
 struct lua_tcp_dtor {
 	rspamd_mempool_destruct_t dtor;
 	void *data;
+	gint lua_ref; /* used instead of dtor when it is NULL */
 	struct lua_tcp_dtor *next;
 };
 
@@ -309,6 +312,10 @@ struct lua_tcp_dtor {
 #define LUA_TCP_FLAG_SYNC (1 << 5)
 #define LUA_TCP_FLAG_RESOLVED (1 << 6)
 
+/* Minimum and maximum size of a single read to the connection buffer */
+#define LUA_TCP_READ_CHUNK 16384
+#define LUA_TCP_READ_CHUNK_MAX (1024 * 1024)
+
 #undef TCP_DEBUG_REFS
 #ifdef TCP_DEBUG_REFS
 #define TCP_RETAIN(x) do { \
@@ -339,6 +346,7 @@ struct lua_tcp_cbdata {
 	guint flags;
 	gchar tag[7];
 	struct event ev;
+	struct rspamd_wheel_timer timer; /* timeout of ev */
 	struct lua_tcp_dtor *dtors;
 	ref_entry_t ref;
 	struct rspamd_task *task;
@@ -367,6 +375,39 @@ lua_tcp_void_finalyser (gpointer arg) {}
 
 static const int default_tcp_timeout = 5000;
 
+static void
+lua_tcp_timeout_handler (gpointer ud)
+{
+	struct lua_tcp_cbdata *cbd = ud;
+
+	event_del (&cbd->ev);
+	lua_tcp_handler (cbd->fd, EV_TIMEOUT, cbd);
+}
+
+/*
+ * Timeouts are tracked by the timer wheel, as they are rescheduled on each
+ * read or write and rarely fire
+ */
+static void
+lua_tcp_event_add (struct lua_tcp_cbdata *cbd)
+{
+	event_add (&cbd->ev, NULL);
+
+	if (!rspamd_wheel_timer_pending (&cbd->timer)) {
+		rspamd_wheel_timer_init (&cbd->timer, lua_tcp_timeout_handler, cbd);
+	}
+
+	rspamd_wheel_timer_add (rspamd_timer_wheel_get (cbd->ev_base),
+			&cbd->timer, tv_to_double (&cbd->tv));
+}
+
+static void
+lua_tcp_event_del (struct lua_tcp_cbdata *cbd)
+{
+	event_del (&cbd->ev);
+	rspamd_wheel_timer_del (&cbd->timer);
+}
+
 static struct rspamd_dns_resolver *
 lua_tcp_global_resolver (struct event_base *ev_base,
 		struct rspamd_config *cfg)
@@ -446,11 +487,13 @@ lua_tcp_fin (gpointer arg)
 	}
 
 	if (cbd->fd != -1) {
-		event_del (&cbd->ev);
+		lua_tcp_event_del (cbd);
 		close (cbd->fd);
 		cbd->fd = -1;
 	}
 
+	rspamd_wheel_timer_del (&cbd->timer);
+
 	if (cbd->addr) {
 		rspamd_inet_address_free (cbd->addr);
 	}
@@ -459,7 +502,13 @@ lua_tcp_fin (gpointer arg)
 	g_queue_free (cbd->handlers);
 
 	LL_FOREACH_SAFE (cbd->dtors, dtor, dttmp) {
-		dtor->dtor (dtor->data);
+		if (dtor->dtor) {
+			dtor->dtor (dtor->data);
+		}
+		else {
+			luaL_unref (cbd->cfg->lua_state, LUA_REGISTRYINDEX, dtor->lua_ref);
+		}
+
 		g_free (dtor);
 	}
 
@@ -733,7 +782,7 @@ lua_tcp_resume_thread (struct lua_tcp_cbdata *cbd, const guint8 *str, gsize len)
 static void
 lua_tcp_plan_read (struct lua_tcp_cbdata *cbd)
 {
-	event_del (&cbd->ev);
+	lua_tcp_event_del (cbd);
 #ifdef EV_CLOSED
 	event_set (&cbd->ev, cbd->fd, EV_READ|EV_CLOSED,
 				lua_tcp_handler, cbd);
@@ -741,7 +790,7 @@ lua_tcp_plan_read (struct lua_tcp_cbdata *cbd)
 	event_set (&cbd->ev, cbd->fd, EV_READ, lua_tcp_handler, cbd);
 #endif
 	event_base_set (cbd->ev_base, &cbd->ev);
-	event_add (&cbd->ev, &cbd->tv);
+	lua_tcp_event_add (cbd);
 }
 
 static void
@@ -839,7 +888,7 @@ lua_tcp_write_helper (struct lua_tcp_cbdata *cbd)
 	}
 	else {
 		/* Want to write more */
-		event_add (&cbd->ev, &cbd->tv);
+		lua_tcp_event_add (cbd);
 	}
 
 	return;
@@ -867,14 +916,21 @@ lua_tcp_process_read_handler (struct lua_tcp_cbdata *cbd,
 {
 	guint slen;
 	goffset pos;
+	gsize start;
 
 	if (rh->stop_pattern) {
 		slen = rh->plen;
 
 		if (cbd->in->len >= slen) {
-			if ((pos = rspamd_substring_search (cbd->in->data, cbd->in->len,
+			/* Do not rescan the whole buffer after each read */
+			start = MIN (rh->scan_pos, cbd->in->len);
+
+			if ((pos = rspamd_substring_search (cbd->in->data + start,
+					cbd->in->len - start,
 					rh->stop_pattern, slen)) != -1) {
 				msg_debug_tcp ("found TCP stop pattern");
+				pos += start;
+				rh->scan_pos = 0;
 				lua_tcp_push_data (cbd, cbd->in->data, pos);
 
 				if (!IS_SYNC (cbd)) {
@@ -895,6 +951,7 @@ lua_tcp_process_read_handler (struct lua_tcp_cbdata *cbd,
 			else {
 				/* Plan new read */
 				msg_debug_tcp ("NOT found TCP stop pattern");
+				rh->scan_pos = cbd->in->len - slen + 1;
 				lua_tcp_plan_read (cbd);
 			}
 		}
@@ -917,25 +974,37 @@ lua_tcp_process_read_handler (struct lua_tcp_cbdata *cbd,
 }
 
 static void
-lua_tcp_process_read (struct lua_tcp_cbdata *cbd,
-		guchar *in, gssize r)
+lua_tcp_process_read (struct lua_tcp_cbdata *cbd)
 {
 	struct lua_tcp_handler *hdl;
 	struct lua_tcp_read_handler *rh;
+	gsize old_len, chunk;
+	gssize r;
 
 	hdl = g_queue_peek_head (cbd->handlers);
 
 	g_assert (hdl != NULL && hdl->type == LUA_WANT_READ);
 	rh = &hdl->h.r;
 
+	/*
+	 * Read directly to the tail of the connection buffer, its storage is
+	 * reused by all handlers. Reads grow with buffered data to handle large
+	 * replies in a reasonable number of syscalls
+	 */
+	old_len = cbd->in->len;
+	chunk = MAX (LUA_TCP_READ_CHUNK, MIN (old_len, LUA_TCP_READ_CHUNK_MAX));
+	g_byte_array_set_size (cbd->in, old_len + chunk);
+	r = read (cbd->fd, cbd->in->data + old_len, chunk);
+	cbd->in->len = old_len;
+
 	if (r > 0) {
 		if (cbd->flags & LUA_TCP_FLAG_PARTIAL) {
-			lua_tcp_push_data (cbd, in, r);
+			lua_tcp_push_data (cbd, cbd->in->data + old_len, r);
 			/* Plan next event */
 			lua_tcp_plan_read (cbd);
 		}
 		else {
-			g_byte_array_append (cbd->in, in, r);
+			cbd->in->len = old_len + r;
 
 			if (!lua_tcp_process_read_handler (cbd, rh, FALSE)) {
 				/* Plan more read */
@@ -983,8 +1052,6 @@ static void
 lua_tcp_handler (int fd, short what, gpointer ud)
 {
 	struct lua_tcp_cbdata *cbd = ud;
-	guchar inbuf[8192];
-	gssize r;
 	gint so_error = 0;
 	socklen_t so_len = sizeof (so_error);
 	struct lua_callback_state cbs;
@@ -994,12 +1061,15 @@ lua_tcp_handler (int fd, short what, gpointer ud)
 
 	msg_debug_tcp ("processed TCP event: %d", what);
 
+	if (what != EV_TIMEOUT) {
+		rspamd_wheel_timer_del (&cbd->timer);
+	}
+
 	struct lua_tcp_handler *rh = g_queue_peek_head (cbd->handlers);
 	event_type = rh->type;
 
 	if (what == EV_READ) {
-		r = read (cbd->fd, inbuf, sizeof (inbuf));
-		lua_tcp_process_read (cbd, inbuf, r);
+		lua_tcp_process_read (cbd);
 	}
 	else if (what == EV_WRITE) {
 
@@ -1109,7 +1179,7 @@ lua_tcp_plan_handler_event (struct lua_tcp_cbdata *cbd, gboolean can_read,
 					/* We need to plan a new event */
 					event_set (&cbd->ev, cbd->fd, EV_READ, lua_tcp_handler, cbd);
 					event_base_set (cbd->ev_base, &cbd->ev);
-					event_add (&cbd->ev, &cbd->tv);
+					lua_tcp_event_add (cbd);
 				}
 				else {
 					/* Cannot read more */
@@ -1132,7 +1202,7 @@ lua_tcp_plan_handler_event (struct lua_tcp_cbdata *cbd, gboolean can_read,
 				if (can_write) {
 					event_set (&cbd->ev, cbd->fd, EV_WRITE, lua_tcp_handler, cbd);
 					event_base_set (cbd->ev_base, &cbd->ev);
-					event_add (&cbd->ev, &cbd->tv);
+					lua_tcp_event_add (cbd);
 				}
 				else {
 					/* Cannot write more */
@@ -1152,7 +1222,7 @@ lua_tcp_plan_handler_event (struct lua_tcp_cbdata *cbd, gboolean can_read,
 			msg_debug_tcp ("plan new connect");
 			event_set (&cbd->ev, cbd->fd, EV_WRITE, lua_tcp_handler, cbd);
 			event_base_set (cbd->ev_base, &cbd->ev);
-			event_add (&cbd->ev, &cbd->tv);
+			lua_tcp_event_add (cbd);
 		}
 	}
 }
@@ -1276,15 +1346,21 @@ lua_tcp_arg_toiovec (lua_State *L, gint pos, struct lua_tcp_cbdata *cbd,
 		if (t) {
 			vec->iov_base = (void *)t->start;
 			vec->iov_len = t->len;
+			dtor = g_malloc0 (sizeof (*dtor));
 
 			if (t->flags & RSPAMD_TEXT_FLAG_OWN) {
 				/* Steal ownership */
 				t->flags = 0;
-				dtor = g_malloc0 (sizeof (*dtor));
 				dtor->dtor = g_free;
 				dtor->data = (void *)t->start;
-				LL_PREPEND (cbd->dtors, dtor);
 			}
+			else {
+				/* Keep the object that owns the text alive */
+				lua_pushvalue (L, pos);
+				dtor->lua_ref = luaL_ref (L, LUA_REGISTRYINDEX);
+			}
+
+			LL_PREPEND (cbd->dtors, dtor);
 		}
 		else {
 			msg_err ("bad userdata argument at position %d", pos);
@@ -1292,14 +1368,14 @@ lua_tcp_arg_toiovec (lua_State *L, gint pos, struct lua_tcp_cbdata *cbd,
 		}
 	}
 	else if (lua_type (L, pos) == LUA_TSTRING) {
+		/* Lua strings are not moved, so they are written with no copying */
 		str = luaL_checklstring (L, pos, &len);
-		vec->iov_base = g_malloc (len);
+		vec->iov_base = (void *)str;
+		vec->iov_len = len;
 		dtor = g_malloc0 (sizeof (*dtor));
-		dtor->dtor = g_free;
-		dtor->data = vec->iov_base;
+		lua_pushvalue (L, pos);
+		dtor->lua_ref = luaL_ref (L, LUA_REGISTRYINDEX);
 		LL_PREPEND (cbd->dtors, dtor);
-		memcpy (vec->iov_base, str, len);
-		vec->iov_len = len;
 	}
 	else {
 		msg_err ("bad argument at position %d", pos);
@@ -2048,7 +2124,7 @@ lua_tcp_sync_close (lua_State *L)
 	cbd->flags |= LUA_TCP_FLAG_FINISHED;
 
 	if (cbd->fd != -1) {
-		event_del (&cbd->ev);
+		lua_tcp_event_del (cbd);
 		close (cbd->fd);
 		cbd->fd = -1;
 	}
@@ -2064,7 +2140,7 @@ lua_tcp_sync_session_dtor (gpointer ud)
 
 	if (cbd->fd != -1) {
 		msg_debug ("closing sync TCP connection");
-		event_del (&cbd->ev);
+		lua_tcp_event_del (cbd);
 		close (cbd->fd);
 		cbd->fd = -1;
 	}
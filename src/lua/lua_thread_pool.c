@@ -118,6 +118,7 @@ lua_thread_pool_return (struct lua_thread_pool *pool, struct thread_entry *threa
 		thread_entry->error_callback = NULL;
 		thread_entry->task = NULL;
 		thread_entry->cfg = NULL;
+		thread_entry->prof = NULL;
 
 		g_queue_push_head (pool->available_items, thread_entry);
 	}
@@ -201,6 +202,12 @@ lua_do_resume (lua_State *L, gint narg)
 
 static void lua_resume_thread_internal (struct thread_entry *thread_entry, gint narg);
 
+static inline gint64
+lua_thread_pool_lua_mem (lua_State *L)
+{
+	return (gint64)lua_gc (L, LUA_GCCOUNT, 0) * 1024 + lua_gc (L, LUA_GCCOUNTB, 0);
+}
+
 void
 lua_thread_call (struct thread_entry *thread_entry, int narg)
 {
@@ -232,9 +239,27 @@ lua_resume_thread_internal (struct thread_entry *thread_entry, gint narg)
 	struct lua_thread_pool *pool;
 	GString *tb;
 	struct rspamd_task *task;
+	struct rspamd_lua_profile_elt *prof = thread_entry->prof;
+	gdouble t1 = 0;
+	gint64 mem1 = 0, mem2;
+
+	if (prof) {
+		t1 = rspamd_get_virtual_ticks ();
+		mem1 = lua_thread_pool_lua_mem (thread_entry->lua_state);
+	}
 
 	ret = lua_do_resume (thread_entry->lua_state, narg);
 
+	if (prof) {
+		/* Only this slice of execution, async events wait is not included */
+		prof->cpu_time += rspamd_get_virtual_ticks () - t1;
+		mem2 = lua_thread_pool_lua_mem (thread_entry->lua_state);
+
+		if (mem2 > mem1) {
+			prof->mem_bytes += mem2 - mem1;
+		}
+	}
+
 	if (ret != LUA_YIELD) {
 		/*
 		 LUA_YIELD state should not be handled here.
@@ -5,6 +5,7 @@
 
 struct thread_entry;
 struct lua_thread_pool;
+struct rspamd_lua_profile_elt;
 
 typedef void (*lua_thread_finish_t) (struct thread_entry *thread, int ret);
 typedef void (*lua_thread_error_t) (struct thread_entry *thread, int ret, const char *msg);
@@ -21,6 +22,9 @@ struct thread_entry {
 	lua_thread_error_t error_callback;
 	struct rspamd_task *task;
 	struct rspamd_config *cfg;
+
+	/* if not NULL, CPU and memory used by each resume are accounted here */
+	struct rspamd_lua_profile_elt *prof;
 };
 
 struct lua_callback_state {
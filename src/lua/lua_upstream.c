@@ -76,11 +76,13 @@ static const struct luaL_reg upstream_list_f[] = {
 LUA_FUNCTION_DEF (upstream, ok);
 LUA_FUNCTION_DEF (upstream, fail);
 LUA_FUNCTION_DEF (upstream, get_addr);
+LUA_FUNCTION_DEF (upstream, get_latency);
 
 static const struct luaL_reg upstream_m[] = {
 	LUA_INTERFACE_DEF (upstream, ok),
 	LUA_INTERFACE_DEF (upstream, fail),
 	LUA_INTERFACE_DEF (upstream, get_addr),
+	LUA_INTERFACE_DEF (upstream, get_latency),
 	{"__tostring", rspamd_lua_class_tostring},
 	{NULL, NULL}
 };
@@ -141,8 +143,9 @@ lua_upstream_fail (lua_State *L)
 }
 
 /***
- * @method upstream:ok()
+ * @method upstream:ok([latency])
  * Indicates upstream success. Resets errors count for an upstream.
+ * @param {number} latency optional time of request in seconds, slow upstreams are ejected from rotation
  */
 static gint
 lua_upstream_ok (lua_State *L)
@@ -152,11 +155,38 @@ lua_upstream_ok (lua_State *L)
 
 	if (up) {
 		rspamd_upstream_ok (up);
+
+		if (lua_type (L, 2) == LUA_TNUMBER) {
+			rspamd_upstream_latency (up, lua_tonumber (L, 2));
+		}
 	}
 
 	return 0;
 }
 
+/***
+ * @method upstream:get_latency()
+ * Returns average and 95th percentile of upstream latency in seconds
+ * (zeroes if unknown)
+ * @return {number,number} average latency and its 95th percentile
+ */
+static gint
+lua_upstream_get_latency (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct upstream *up = lua_check_upstream (L);
+
+	if (up) {
+		lua_pushnumber (L, rspamd_upstream_get_latency (up));
+		lua_pushnumber (L, rspamd_upstream_get_latency_p95 (up));
+	}
+	else {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	return 2;
+}
+
 /* Upstream list class */
 
 static struct upstream_list *
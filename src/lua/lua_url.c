@@ -110,6 +110,21 @@ lua_check_url (lua_State * L, gint pos)
 }
 
 
+/*
+ * URL fields live in a memory pool (usually a task one), so they could be
+ * passed to Lua as `rspamd_text` with no copying if requested
+ */
+static void
+lua_url_push_field (lua_State *L, const gchar *field, gsize len)
+{
+	if (lua_toboolean (L, 2)) {
+		lua_new_text (L, field, len, FALSE);
+	}
+	else {
+		lua_pushlstring (L, field, len);
+	}
+}
+
 /***
  * @method url:get_length()
  * Get length of the url
@@ -131,8 +146,9 @@ lua_url_get_length (lua_State *L)
 }
 
 /***
- * @method url:get_host()
+ * @method url:get_host([as_text])
  * Get domain part of the url
+ * @param {boolean} as_text return `rspamd_text` pointing to the url memory instead of a string copy
  * @return {string} domain part of URL
  */
 static gint
@@ -142,7 +158,7 @@ lua_url_get_host (lua_State *L)
 	struct rspamd_lua_url *url = lua_check_url (L, 1);
 
 	if (url != NULL) {
-		lua_pushlstring (L, url->url->host, url->url->hostlen);
+		lua_url_push_field (L, url->url->host, url->url->hostlen);
 	}
 	else {
 		lua_pushnil (L);
@@ -171,8 +187,9 @@ lua_url_get_port (lua_State *L)
 }
 
 /***
- * @method url:get_user()
+ * @method url:get_user([as_text])
  * Get user part of the url (e.g. username in email)
+ * @param {boolean} as_text return `rspamd_text` pointing to the url memory instead of a string copy
  * @return {string} user part of URL
  */
 static gint
@@ -182,7 +199,7 @@ lua_url_get_user (lua_State *L)
 	struct rspamd_lua_url *url = lua_check_url (L, 1);
 
 	if (url != NULL && url->url->user != NULL) {
-		lua_pushlstring (L, url->url->user, url->url->userlen);
+		lua_url_push_field (L, url->url->user, url->url->userlen);
 	}
 	else {
 		lua_pushnil (L);
@@ -192,8 +209,9 @@ lua_url_get_user (lua_State *L)
 }
 
 /***
- * @method url:get_path()
+ * @method url:get_path([as_text])
  * Get path of the url
+ * @param {boolean} as_text return `rspamd_text` pointing to the url memory instead of a string copy
  * @return {string} path part of URL
  */
 static gint
@@ -203,7 +221,7 @@ lua_url_get_path (lua_State *L)
 	struct rspamd_lua_url *url = lua_check_url (L, 1);
 
 	if (url != NULL && url->url->datalen > 0) {
-		lua_pushlstring (L, url->url->data, url->url->datalen);
+		lua_url_push_field (L, url->url->data, url->url->datalen);
 	}
 	else {
 		lua_pushnil (L);
@@ -213,8 +231,9 @@ lua_url_get_path (lua_State *L)
 }
 
 /***
- * @method url:get_query()
+ * @method url:get_query([as_text])
  * Get query of the url
+ * @param {boolean} as_text return `rspamd_text` pointing to the url memory instead of a string copy
  * @return {string} query part of URL
  */
 static gint
@@ -224,7 +243,7 @@ lua_url_get_query (lua_State *L)
 	struct rspamd_lua_url *url = lua_check_url (L, 1);
 
 	if (url != NULL && url->url->querylen > 0) {
-		lua_pushlstring (L, url->url->query, url->url->querylen);
+		lua_url_push_field (L, url->url->query, url->url->querylen);
 	}
 	else {
 		lua_pushnil (L);
@@ -234,8 +253,9 @@ lua_url_get_query (lua_State *L)
 }
 
 /***
- * @method url:get_fragment()
+ * @method url:get_fragment([as_text])
  * Get fragment of the url
+ * @param {boolean} as_text return `rspamd_text` pointing to the url memory instead of a string copy
  * @return {string} fragment part of URL
  */
 static gint
@@ -245,7 +265,7 @@ lua_url_get_fragment (lua_State *L)
 	struct rspamd_lua_url *url = lua_check_url (L, 1);
 
 	if (url != NULL && url->url->fragmentlen > 0) {
-		lua_pushlstring (L, url->url->fragment, url->url->fragmentlen);
+		lua_url_push_field (L, url->url->fragment, url->url->fragmentlen);
 	}
 	else {
 		lua_pushnil (L);
@@ -255,8 +275,9 @@ lua_url_get_fragment (lua_State *L)
 }
 
 /***
- * @method url:get_text()
+ * @method url:get_text([as_text])
  * Get full content of the url
+ * @param {boolean} as_text return `rspamd_text` pointing to the url memory instead of a string copy
  * @return {string} url string
  */
 static gint
@@ -266,7 +287,7 @@ lua_url_get_text (lua_State *L)
 	struct rspamd_lua_url *url = lua_check_url (L, 1);
 
 	if (url != NULL) {
-		lua_pushlstring (L, url->url->string, url->url->urllen);
+		lua_url_push_field (L, url->url->string, url->url->urllen);
 	}
 	else {
 		lua_pushnil (L);
@@ -308,8 +329,9 @@ lua_url_tostring (lua_State *L)
 }
 
 /***
- * @method url:get_raw()
+ * @method url:get_raw([as_text])
  * Get full content of the url as it was parsed (e.g. with urldecode)
+ * @param {boolean} as_text return `rspamd_text` pointing to the url memory instead of a string copy
  * @return {string} url string
  */
 static gint
@@ -319,7 +341,7 @@ lua_url_get_raw (lua_State *L)
 	struct rspamd_lua_url *url = lua_check_url (L, 1);
 
 	if (url != NULL) {
-		lua_pushlstring (L, url->url->raw, url->url->rawlen);
+		lua_url_push_field (L, url->url->raw, url->url->rawlen);
 	}
 	else {
 		lua_pushnil (L);
@@ -586,8 +608,9 @@ lua_url_get_phished (lua_State *L)
 }
 
 /***
- * @method url:get_tld()
+ * @method url:get_tld([as_text])
  * Get effective second level domain part (eSLD) of the url host
+ * @param {boolean} as_text return `rspamd_text` pointing to the url memory instead of a string copy
  * @return {string} effective second level domain part (eSLD) of the url host
  */
 static gint
@@ -597,7 +620,7 @@ lua_url_get_tld (lua_State *L)
 	struct rspamd_lua_url *url = lua_check_url (L, 1);
 
 	if (url != NULL && url->url->tldlen > 0) {
-		lua_pushlstring (L, url->url->tld, url->url->tldlen);
+		lua_url_push_field (L, url->url->tld, url->url->tldlen);
 	}
 	else {
 		lua_pushnil (L);
@@ -117,8 +117,8 @@ LUA_FUNCTION_DEF (util, parse_html);
 /***
  * @function util.levenshtein_distance(s1, s2)
  * Returns levenstein distance between two strings
- * @param {string} s1 the first string
- * @param {string} s2 the second string
+ * @param {string|text} s1 the first string
+ * @param {string|text} s2 the second string
  * @return {number} number of differences in two strings
  */
 LUA_FUNCTION_DEF (util, levenshtein_distance);
@@ -151,7 +151,7 @@ LUA_FUNCTION_DEF (util, fold_header);
  * @function util.is_uppercase(str)
  * Returns true if a string is all uppercase
  *
- * @param {string} str input string
+ * @param {string|text} str input string
  * @return {bool} true if a string is all uppercase
  */
 LUA_FUNCTION_DEF (util, is_uppercase);
@@ -202,7 +202,7 @@ LUA_FUNCTION_DEF (util, parse_mail_address);
  * @function util.strlen_utf8(str)
  * Returns length of string encoded in utf-8 in characters.
  * If invalid characters are found, then this function returns number of bytes.
- * @param {string} str utf8 encoded string
+ * @param {string|text} str utf8 encoded string
  * @return {number} number of characters in string
  */
 LUA_FUNCTION_DEF (util, strlen_utf8);
@@ -905,8 +905,6 @@ lua_util_decode_base64 (lua_State *L)
 	const gchar *s = NULL;
 	gsize inlen, outlen;
 	gboolean zero_copy = FALSE, grab_own = FALSE;
-	gint state = 0;
-	guint save = 0;
 
 	if (lua_type (L, 1) == LUA_TSTRING) {
 		s = luaL_checklstring (L, 1, &inlen);
@@ -923,7 +921,7 @@ lua_util_decode_base64 (lua_State *L)
 	if (s != NULL) {
 		if (zero_copy) {
 			/* Decode in place */
-			outlen = g_base64_decode_step (s, inlen, (guchar *)s, &state, &save);
+			(void)rspamd_cryptobox_base64_decode (s, inlen, (guchar *)s, &outlen);
 			t = lua_newuserdata (L, sizeof (*t));
 			rspamd_lua_setclass (L, "rspamd{text}", -1);
 			t->start = s;
@@ -941,8 +939,8 @@ lua_util_decode_base64 (lua_State *L)
 			rspamd_lua_setclass (L, "rspamd{text}", -1);
 			t->len = (inlen / 4) * 3 + 3;
 			t->start = g_malloc (t->len);
-			outlen = g_base64_decode_step (s, inlen, (guchar *)t->start,
-					&state, &save);
+			(void)rspamd_cryptobox_base64_decode (s, inlen, (guchar *)t->start,
+					&outlen);
 			t->len = outlen;
 			t->flags = RSPAMD_TEXT_FLAG_OWN;
 		}
@@ -1235,8 +1233,8 @@ lua_util_levenshtein_distance (lua_State *L)
 	gint dist = 0;
 	guint replace_cost = 1;
 
-	s1 = luaL_checklstring (L, 1, &s1len);
-	s2 = luaL_checklstring (L, 2, &s2len);
+	s1 = lua_tolstring_or_text (L, 1, &s1len);
+	s2 = lua_tolstring_or_text (L, 2, &s2len);
 
 	if (lua_isnumber (L, 3)) {
 		replace_cost = lua_tonumber (L, 3);
@@ -1246,6 +1244,9 @@ lua_util_levenshtein_distance (lua_State *L)
 		dist = rspamd_strings_levenshtein_distance (s1, s1len, s2, s2len,
 				replace_cost);
 	}
+	else {
+		return luaL_error (L, "invalid arguments");
+	}
 
 	lua_pushinteger (L, dist);
 
@@ -1356,9 +1357,13 @@ lua_util_is_uppercase (lua_State *L)
 	UChar32 uc;
 	guint nlc = 0, nuc = 0;
 
-	str = luaL_checklstring (L, 1, &sz);
+	str = lua_tolstring_or_text (L, 1, &sz);
+
+	if (str == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
 
-	if (str && sz > 0) {
+	if (sz > 0) {
 		while (i >= 0 && i < sz) {
 			U8_NEXT (str, i, sz, uc);
 
@@ -1508,7 +1513,7 @@ lua_util_strlen_utf8 (lua_State *L)
 	const gchar *str, *end;
 	gsize len;
 
-	str = lua_tolstring (L, 1, &len);
+	str = lua_tolstring_or_text (L, 1, &len);
 
 	if (str) {
 		if (g_utf8_validate (str, len, &end)) {
@@ -1536,8 +1541,8 @@ lua_util_strcasecmp_utf8 (lua_State *L)
 	gsize len1, len2;
 	gint ret = -1;
 
-	str1 = lua_tolstring (L, 1, &len1);
-	str2 = lua_tolstring (L, 2, &len2);
+	str1 = lua_tolstring_or_text (L, 1, &len1);
+	str2 = lua_tolstring_or_text (L, 2, &len2);
 
 	if (str1 && str2) {
 
@@ -1564,8 +1569,8 @@ lua_util_strcasecmp_ascii (lua_State *L)
 	gsize len1, len2;
 	gint ret = -1;
 
-	str1 = lua_tolstring (L, 1, &len1);
-	str2 = lua_tolstring (L, 2, &len2);
+	str1 = lua_tolstring_or_text (L, 1, &len1);
+	str2 = lua_tolstring_or_text (L, 2, &len2);
 
 	if (str1 && str2) {
 
@@ -1592,8 +1597,8 @@ lua_util_strequal_caseless (lua_State *L)
 	gsize len1, len2;
 	gint ret = -1;
 
-	str1 = lua_tolstring (L, 1, &len1);
-	str2 = lua_tolstring (L, 2, &len2);
+	str1 = lua_tolstring_or_text (L, 1, &len1);
+	str2 = lua_tolstring_or_text (L, 2, &len2);
 
 	if (str1 && str2) {
 
@@ -2329,8 +2334,8 @@ lua_util_is_utf_spoofed (lua_State *L)
 	LUA_TRACE_POINT;
 	gsize l1, l2;
 	gint ret, nres = 2;
-	const gchar *s1 = lua_tolstring (L, 1, &l1),
-			*s2 = lua_tolstring (L, 2, &l2);
+	const gchar *s1 = lua_tolstring_or_text (L, 1, &l1),
+			*s2 = lua_tolstring_or_text (L, 2, &l2);
 	static USpoofChecker *spc, *spc_sgl;
 	UErrorCode uc_err = U_ZERO_ERROR;
 
@@ -2437,7 +2442,7 @@ lua_util_is_valid_utf8 (lua_State *L)
 	const gchar *str;
 	gsize len;
 
-	str = lua_tolstring (L, 1, &len);
+	str = lua_tolstring_or_text (L, 1, &len);
 
 	if (str) {
 		lua_pushboolean (L, g_utf8_validate (str, len, NULL));
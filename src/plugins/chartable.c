@@ -150,6 +150,8 @@ chartable_module_config (struct rspamd_config *cfg)
 		chartable_module_ctx->threshold = DEFAULT_THRESHOLD;
 	}
 
+	rspamd_chartable_init_classes ();
+
 	rspamd_symcache_add_symbol (cfg->cache,
 			chartable_module_ctx->symbol,
 			0,
@@ -351,6 +353,76 @@ rspamd_can_alias_latin (gint ch)
 	return g_hash_table_lookup (latin_confusable_ht, &ch) != NULL;
 }
 
+/* Classes of codepoints, precomputed for the basic multilingual plane */
+#define CHARTABLE_CLASS_ALPHA (1u << 0)
+#define CHARTABLE_CLASS_DIGIT (1u << 1)
+#define CHARTABLE_CLASS_UPPER (1u << 2)
+#define CHARTABLE_CLASS_LATIN (1u << 3)
+#define CHARTABLE_CLASS_CONFUSABLE (1u << 4)
+#define CHARTABLE_BMP_SIZE 0x10000
+
+static guint8 *chartable_bmp_classes = NULL;
+
+static guint
+rspamd_chartable_classify (UChar32 uc)
+{
+	guint cls = 0;
+	UBlockCode sc;
+
+	if (u_isalpha (uc)) {
+		cls |= CHARTABLE_CLASS_ALPHA;
+		sc = ublock_getCode (uc);
+
+		if (sc <= UBLOCK_COMBINING_DIACRITICAL_MARKS ||
+				sc == UBLOCK_LATIN_EXTENDED_ADDITIONAL) {
+			/*
+			 * Assume all latin, IPA, diacritic and space modifiers
+			 * characters as basic latin
+			 */
+			cls |= CHARTABLE_CLASS_LATIN;
+		}
+
+		if (u_isupper (uc)) {
+			cls |= CHARTABLE_CLASS_UPPER;
+		}
+
+		if (rspamd_can_alias_latin (uc)) {
+			cls |= CHARTABLE_CLASS_CONFUSABLE;
+		}
+	}
+	else if (u_isdigit (uc)) {
+		cls |= CHARTABLE_CLASS_DIGIT;
+	}
+
+	return cls;
+}
+
+static void
+rspamd_chartable_init_classes (void)
+{
+	UChar32 uc;
+
+	if (chartable_bmp_classes != NULL) {
+		return;
+	}
+
+	chartable_bmp_classes = g_malloc (CHARTABLE_BMP_SIZE);
+
+	for (uc = 0; uc < CHARTABLE_BMP_SIZE; uc ++) {
+		chartable_bmp_classes[uc] = rspamd_chartable_classify (uc);
+	}
+}
+
+static inline guint
+rspamd_chartable_codepoint_class (UChar32 uc)
+{
+	if (uc < CHARTABLE_BMP_SIZE && chartable_bmp_classes != NULL) {
+		return chartable_bmp_classes[uc];
+	}
+
+	return rspamd_chartable_classify (uc);
+}
+
 static gdouble
 rspamd_chartable_process_word_utf (struct rspamd_task *task,
 								   rspamd_stat_token_t *w,
@@ -361,7 +433,8 @@ rspamd_chartable_process_word_utf (struct rspamd_task *task,
 	const gchar *p, *end;
 	gdouble badness = 0.0;
 	UChar32 uc;
-	UBlockCode sc;
+	guint cls;
+	gboolean is_latin;
 	gint last_is_latin = -1;
 	guint same_script_count = 0, nsym = 0, i = 0;
 	enum {
@@ -374,6 +447,11 @@ rspamd_chartable_process_word_utf (struct rspamd_task *task,
 	p = w->begin;
 	end = p + w->len;
 
+	if (!rspamd_str_has_8bit (w->begin, w->len)) {
+		/* All characters are basic latin, so scripts cannot be mixed */
+		return 0.0;
+	}
+
 	/* We assume that w is normalized */
 
 	while (p + i < end) {
@@ -383,18 +461,12 @@ rspamd_chartable_process_word_utf (struct rspamd_task *task,
 			break;
 		}
 
-		if (u_isalpha (uc)) {
-			sc = ublock_getCode (uc);
-			if (sc <= UBLOCK_COMBINING_DIACRITICAL_MARKS ||
-					sc == UBLOCK_LATIN_EXTENDED_ADDITIONAL) {
-				/*
-				 * Assume all latin, IPA, diacritic and space modifiers
-				 * characters as basic latin
-				 */
-				sc = UBLOCK_BASIC_LATIN;
-			}
+		cls = rspamd_chartable_codepoint_class (uc);
+
+		if (cls & CHARTABLE_CLASS_ALPHA) {
+			is_latin = (cls & CHARTABLE_CLASS_LATIN) != 0;
 
-			if (sc != UBLOCK_BASIC_LATIN && u_isupper (uc)) {
+			if (!is_latin && (cls & CHARTABLE_CLASS_UPPER)) {
 				if (ncap) {
 					(*ncap) ++;
 				}
@@ -402,7 +474,7 @@ rspamd_chartable_process_word_utf (struct rspamd_task *task,
 
 			if (state == got_digit) {
 				/* Penalize digit -> alpha translations */
-				if (!is_url && sc != UBLOCK_BASIC_LATIN &&
+				if (!is_url && !is_latin &&
 						prev_state != start_process) {
 					badness += 0.25;
 				}
@@ -410,9 +482,9 @@ rspamd_chartable_process_word_utf (struct rspamd_task *task,
 			else if (state == got_alpha) {
 				/* Check script */
 				if (same_script_count > 0) {
-					if (sc != UBLOCK_BASIC_LATIN && last_is_latin) {
+					if (!is_latin && last_is_latin) {
 
-						if (rspamd_can_alias_latin (uc)) {
+						if (cls & CHARTABLE_CLASS_CONFUSABLE) {
 							badness += 1.0 / (gdouble)same_script_count;
 						}
 
@@ -424,7 +496,7 @@ rspamd_chartable_process_word_utf (struct rspamd_task *task,
 					}
 				}
 				else {
-					last_is_latin = sc == UBLOCK_BASIC_LATIN;
+					last_is_latin = is_latin;
 					same_script_count = 1;
 				}
 			}
@@ -433,7 +505,7 @@ rspamd_chartable_process_word_utf (struct rspamd_task *task,
 			state = got_alpha;
 
 		}
-		else if (u_isdigit (uc)) {
+		else if (cls & CHARTABLE_CLASS_DIGIT) {
 			if (state != got_digit) {
 				prev_state = state;
 			}
@@ -569,14 +641,21 @@ rspamd_chartable_process_part (struct rspamd_task *task,
 		return;
 	}
 
+	if (IS_PART_UTF (part) && part->non_ascii_words == 0) {
+		/* Pure ASCII words have zero badness in utf parts */
+		return;
+	}
+
 	for (i = 0; i < part->utf_words->len; i++) {
 		w = &g_array_index (part->utf_words, rspamd_stat_token_t, i);
 
 		if (w->len > 0 && (w->flags & RSPAMD_STAT_TOKEN_FLAG_TEXT)) {
 
 			if (IS_PART_UTF (part)) {
-				cur_score += rspamd_chartable_process_word_utf (task, w, FALSE,
-						&ncap, chartable_module_ctx);
+				if (w->flags & RSPAMD_STAT_TOKEN_FLAG_NON_ASCII) {
+					cur_score += rspamd_chartable_process_word_utf (task, w,
+							FALSE, &ncap, chartable_module_ctx);
+				}
 			}
 			else {
 				cur_score += rspamd_chartable_process_word_ascii (task, w,
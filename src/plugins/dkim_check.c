@@ -34,6 +34,7 @@
 #include "libmime/message.h"
 #include "libserver/dkim.h"
 #include "libutil/hash.h"
+#include "libutil/shared_cache.h"
 #include "libutil/map.h"
 #include "libutil/map_helpers.h"
 #include "rspamd.h"
@@ -47,6 +48,8 @@
 #define DEFAULT_SYMBOL_NA "R_DKIM_NA"
 #define DEFAULT_SYMBOL_PERMFAIL "R_DKIM_PERMFAIL"
 #define DEFAULT_CACHE_SIZE 2048
+/* Enough for serialized RSA keys up to 8192 bits */
+#define SHARED_CACHE_KEY_LEN 1100
 #define DEFAULT_TIME_JITTER 60
 #define DEFAULT_MAX_SIGS 5
 
@@ -73,6 +76,7 @@ struct dkim_ctx {
 	guint time_jitter;
 	rspamd_lru_hash_t *dkim_hash;
 	rspamd_lru_hash_t *dkim_sign_hash;
+	rspamd_shared_cache_t *dkim_shared_cache;
 	const gchar *sign_headers;
 	gint sign_condition_ref;
 	guint max_sigs;
@@ -218,6 +222,15 @@ dkim_module_init (struct rspamd_config *cfg, struct module_ctx **ctx)
 			0,
 			G_STRINGIFY (DEFAULT_CACHE_SIZE),
 			0);
+	rspamd_rcl_add_doc_by_path (cfg,
+			"dkim",
+			"Size of DKIM keys cache shared between all workers (0 to disable)",
+			"dkim_shared_cache_size",
+			UCL_INT,
+			NULL,
+			0,
+			G_STRINGIFY (DEFAULT_CACHE_SIZE),
+			0);
 	rspamd_rcl_add_doc_by_path (cfg,
 			"dkim",
 			"Allow this time difference when checking DKIM signature time validity",
@@ -299,7 +312,7 @@ dkim_module_config (struct rspamd_config *cfg)
 {
 	const ucl_object_t *value;
 	gint res = TRUE, cb_id = -1;
-	guint cache_size, sign_cache_size;
+	guint cache_size, sign_cache_size, shared_cache_size;
 	gboolean got_trusted = FALSE;
 	struct dkim_ctx *dkim_module_ctx = dkim_get_context (cfg);
 
@@ -396,6 +409,15 @@ dkim_module_config (struct rspamd_config *cfg)
 		cache_size = DEFAULT_CACHE_SIZE;
 	}
 
+	if ((value =
+		rspamd_config_get_module_opt (cfg, "dkim",
+		"dkim_shared_cache_size")) != NULL) {
+		shared_cache_size = ucl_object_toint (value);
+	}
+	else {
+		shared_cache_size = DEFAULT_CACHE_SIZE;
+	}
+
 	if ((value =
 			rspamd_config_get_module_opt (cfg, "dkim",
 					"sign_cache_size")) != NULL) {
@@ -488,6 +510,13 @@ dkim_module_config (struct rspamd_config *cfg)
 			g_free,
 			(GDestroyNotify)rspamd_dkim_sign_key_unref);
 
+	if (dkim_module_ctx->dkim_shared_cache == NULL && shared_cache_size > 0) {
+		/* Workers are forked after modules are configured */
+		dkim_module_ctx->dkim_shared_cache = rspamd_shared_cache_new (
+				cfg->cfg_pool, "dkim", shared_cache_size,
+				SHARED_CACHE_KEY_LEN);
+	}
+
 	rspamd_mempool_add_destructor (cfg->cfg_pool,
 			(rspamd_mempool_destruct_t)rspamd_lru_hash_destroy,
 			dkim_module_ctx->dkim_hash);
@@ -1034,6 +1063,76 @@ dkim_module_check (struct dkim_check_result *res)
 	}
 }
 
+/*
+ * Find key in the local cache of parsed keys and then in the shared cache
+ */
+static rspamd_dkim_key_t *
+dkim_module_lookup_key (struct dkim_ctx *dkim_module_ctx,
+		struct rspamd_task *task,
+		const gchar *dns_key)
+{
+	rspamd_dkim_key_t *key;
+	guchar buf[SHARED_CACHE_KEY_LEN];
+	gsize len = sizeof (buf);
+	guint ttl;
+	GError *err = NULL;
+
+	key = rspamd_lru_hash_lookup (dkim_module_ctx->dkim_hash, dns_key,
+			task->tv.tv_sec);
+
+	if (key != NULL) {
+		if (dkim_module_ctx->dkim_shared_cache != NULL) {
+			rspamd_shared_cache_local_hit (dkim_module_ctx->dkim_shared_cache);
+		}
+	}
+	else if (dkim_module_ctx->dkim_shared_cache != NULL &&
+			rspamd_shared_cache_lookup (dkim_module_ctx->dkim_shared_cache,
+					dns_key, strlen (dns_key), task->tv.tv_sec,
+					buf, &len, &ttl)) {
+		key = rspamd_dkim_key_deserialize (buf, len, &err);
+
+		if (key != NULL) {
+			/* Local cache owns this key */
+			rspamd_lru_hash_insert (dkim_module_ctx->dkim_hash,
+					g_strdup (dns_key), key, task->tv.tv_sec, ttl);
+		}
+		else {
+			msg_info_task ("cannot load cached key for %s: %e", dns_key, err);
+			g_error_free (err);
+		}
+	}
+
+	return key;
+}
+
+static void
+dkim_module_store_key (struct dkim_ctx *dkim_module_ctx,
+		struct rspamd_task *task,
+		const gchar *dns_key,
+		rspamd_dkim_key_t *key)
+{
+	guchar buf[SHARED_CACHE_KEY_LEN];
+	gsize len;
+
+	/*
+	 * We actually receive key with refcount = 1, so we just assume that
+	 * lru hash owns this object now
+	 */
+	rspamd_lru_hash_insert (dkim_module_ctx->dkim_hash,
+			g_strdup (dns_key),
+			key, task->tv.tv_sec, rspamd_dkim_key_get_ttl (key));
+
+	if (dkim_module_ctx->dkim_shared_cache != NULL) {
+		len = rspamd_dkim_key_serialize (key, buf, sizeof (buf));
+
+		if (len > 0) {
+			rspamd_shared_cache_insert (dkim_module_ctx->dkim_shared_cache,
+					dns_key, strlen (dns_key), buf, len, task->tv.tv_sec,
+					rspamd_dkim_key_get_ttl (key));
+		}
+	}
+}
+
 static void
 dkim_module_key_handler (rspamd_dkim_key_t *key,
 	gsize keylen,
@@ -1049,13 +1148,8 @@ dkim_module_key_handler (rspamd_dkim_key_t *key,
 	dkim_module_ctx = dkim_get_context (task->cfg);
 
 	if (key != NULL) {
-		/*
-		 * We actually receive key with refcount = 1, so we just assume that
-		 * lru hash owns this object now
-		 */
-		rspamd_lru_hash_insert (dkim_module_ctx->dkim_hash,
-			g_strdup (rspamd_dkim_get_dns_key (ctx)),
-			key, res->task->tv.tv_sec, rspamd_dkim_key_get_ttl (key));
+		dkim_module_store_key (dkim_module_ctx, task,
+				rspamd_dkim_get_dns_key (ctx), key);
 		/* Another ref belongs to the check context */
 		 res->key = rspamd_dkim_key_ref (key);
 		/* Release key when task is processed */
@@ -1096,6 +1190,7 @@ dkim_symbol_callback (struct rspamd_task *task,
 	struct rspamd_mime_header *rh;
 	struct dkim_check_result *res = NULL, *cur;
 	guint checked = 0, i, *dmarc_checks;
+	const gchar *decoded;
 	struct dkim_ctx *dkim_module_ctx = dkim_get_context (task->cfg);
 
 	/* Allow dmarc */
@@ -1142,7 +1237,9 @@ dkim_symbol_callback (struct rspamd_task *task,
 		msg_debug_task ("dkim signature found");
 
 		PTR_ARRAY_FOREACH (hlist, i, rh) {
-			if (rh->decoded == NULL || rh->decoded[0] == '\0') {
+			decoded = rspamd_mime_header_get_decoded (task->task_pool, rh);
+
+			if (decoded[0] == '\0') {
 				msg_info_task ("<%s> cannot load empty DKIM context",
 						task->message_id);
 				continue;
@@ -1156,7 +1253,7 @@ dkim_symbol_callback (struct rspamd_task *task,
 			cur->mult_deny = 1.0;
 			cur->item = item;
 
-			ctx = rspamd_create_dkim_context (rh->decoded,
+			ctx = rspamd_create_dkim_context (decoded,
 					task->task_pool,
 					dkim_module_ctx->time_jitter,
 					RSPAMD_DKIM_NORMAL,
@@ -1200,9 +1297,8 @@ dkim_symbol_callback (struct rspamd_task *task,
 					continue;
 				}
 
-				key = rspamd_lru_hash_lookup (dkim_module_ctx->dkim_hash,
-						rspamd_dkim_get_dns_key (ctx),
-						task->tv.tv_sec);
+				key = dkim_module_lookup_key (dkim_module_ctx, task,
+						rspamd_dkim_get_dns_key (ctx));
 
 				if (key != NULL) {
 					cur->key = rspamd_dkim_key_ref (key);
@@ -1584,13 +1680,8 @@ dkim_module_lua_on_key (rspamd_dkim_key_t *key,
 	dkim_module_ctx = dkim_get_context (task->cfg);
 
 	if (key != NULL) {
-		/*
-		 * We actually receive key with refcount = 1, so we just assume that
-		 * lru hash owns this object now
-		 */
-		rspamd_lru_hash_insert (dkim_module_ctx->dkim_hash,
-				g_strdup (rspamd_dkim_get_dns_key (ctx)),
-				key, cbd->task->tv.tv_sec, rspamd_dkim_key_get_ttl (key));
+		dkim_module_store_key (dkim_module_ctx, task,
+				rspamd_dkim_get_dns_key (ctx), key);
 		/* Another ref belongs to the check context */
 		cbd->key = rspamd_dkim_key_ref (key);
 		/* Release key when task is processed */
@@ -1691,9 +1782,8 @@ lua_dkim_verify_handler (lua_State *L)
 		cbd->ctx = ctx;
 		cbd->key = NULL;
 
-		key = rspamd_lru_hash_lookup (dkim_module_ctx->dkim_hash,
-				rspamd_dkim_get_dns_key (ctx),
-				task->tv.tv_sec);
+		key = dkim_module_lookup_key (dkim_module_ctx, task,
+				rspamd_dkim_get_dns_key (ctx));
 
 		if (key != NULL) {
 			cbd->key = rspamd_dkim_key_ref (key);
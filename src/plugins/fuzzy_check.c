@@ -77,10 +77,14 @@ struct fuzzy_rule {
 	GString *hash_key;
 	GString *shingles_key;
 	struct rspamd_cryptobox_keypair *local_key;
+	struct rspamd_cryptobox_keypair *prev_local_key;
 	struct rspamd_cryptobox_pubkey *peer_key;
+	gdouble key_lifetime;
+	gdouble local_key_ts;
 	double max_score;
 	gboolean read_only;
 	gboolean skip_unknown;
+	gboolean multi_commands;
 	gint learn_condition_cb;
 	struct rspamd_hash_map_helper *skip_map;
 	struct fuzzy_ctx *ctx;
@@ -97,6 +101,8 @@ struct fuzzy_ctx {
 	struct rspamd_keypair_cache *keypairs_cache;
 	guint32 io_timeout;
 	guint32 retransmits;
+	guint32 hedge_delay; /* 0 means p95 latency of the first server */
+	gboolean hedge_requests;
 	gint check_mime_part_ref; /* Lua callback */
 	gint process_rule_ref; /* Lua callback */
 	gint cleanup_rules_ref;
@@ -120,6 +126,7 @@ struct fuzzy_client_result {
 struct fuzzy_client_session {
 	GPtrArray *commands;
 	GPtrArray *results;
+	GPtrArray *frames; /* Multi-command frames, if used */
 	struct rspamd_task *task;
 	struct rspamd_symcache_item *item;
 	struct upstream *server;
@@ -127,6 +134,13 @@ struct fuzzy_client_session {
 	struct event ev;
 	struct event timev;
 	struct timeval tv;
+	/* Hedged request to another server */
+	struct upstream *hedge_server;
+	struct event hedge_ev;
+	struct event hedge_timev;
+	gboolean hedge_planned;
+	gint hedge_fd;
+	gdouble start_ts;
 	gint state;
 	gint fd;
 	guint retransmits;
@@ -164,6 +178,12 @@ struct fuzzy_cmd_io {
 	struct rspamd_fuzzy_cmd cmd;
 };
 
+struct fuzzy_multi_frame {
+	struct iovec io;
+	guint first; /* Index of the first command in the session */
+	guint ncmds;
+};
+
 
 static const char *default_headers = "Subject,Content-Type,Reply-To,X-Mailer";
 
@@ -321,6 +341,10 @@ fuzzy_free_rule (gpointer r)
 		rspamd_keypair_unref (rule->local_key);
 	}
 
+	if (rule->prev_local_key) {
+		rspamd_keypair_unref (rule->prev_local_key);
+	}
+
 	if (rule->peer_key) {
 		rspamd_pubkey_unref (rule->peer_key);
 	}
@@ -417,6 +441,10 @@ fuzzy_parse_rule (struct rspamd_config *cfg, const ucl_object_t *obj,
 		rule->skip_unknown = ucl_obj_toboolean (value);
 	}
 
+	if ((value = ucl_object_lookup (obj, "multi_commands")) != NULL) {
+		rule->multi_commands = ucl_obj_toboolean (value);
+	}
+
 	if ((value = ucl_object_lookup (obj, "algorithm")) != NULL) {
 		rule->algorithm_str = ucl_object_tostring (value);
 
@@ -490,6 +518,13 @@ fuzzy_parse_rule (struct rspamd_config *cfg, const ucl_object_t *obj,
 
 		rule->local_key = rspamd_keypair_new (RSPAMD_KEYPAIR_KEX,
 				RSPAMD_CRYPTOBOX_MODE_25519);
+		rule->local_key_ts = rspamd_get_calendar_ticks ();
+	}
+
+	if ((value = ucl_object_lookup (obj, "key_lifetime")) != NULL) {
+		if (!ucl_object_todouble_safe (value, &rule->key_lifetime)) {
+			rule->key_lifetime = 0.0;
+		}
 	}
 
 	if ((value = ucl_object_lookup (obj, "learn_condition")) != NULL) {
@@ -715,6 +750,24 @@ fuzzy_check_module_init (struct rspamd_config *cfg, struct module_ctx **ctx)
 			0,
 			NULL,
 			0);
+	rspamd_rcl_add_doc_by_path (cfg,
+			"fuzzy_check",
+			"Send request to another server if the first one is slow to reply",
+			"hedge_requests",
+			UCL_BOOLEAN,
+			NULL,
+			0,
+			NULL,
+			0);
+	rspamd_rcl_add_doc_by_path (cfg,
+			"fuzzy_check",
+			"Delay before sending hedged request (p95 latency of the server by default)",
+			"hedge_delay",
+			UCL_TIME,
+			NULL,
+			0,
+			NULL,
+			0);
 	rspamd_rcl_add_doc_by_path (cfg,
 			"fuzzy_check",
 			"Whitelisted IPs map",
@@ -797,6 +850,26 @@ fuzzy_check_module_init (struct rspamd_config *cfg, struct module_ctx **ctx)
 			0,
 			NULL,
 			0);
+	rspamd_rcl_add_doc_by_path (cfg,
+			"fuzzy_check.rule",
+			"Lifetime of the local session key used for encryption, the key "
+			"is reused until it is expired (0 means infinite lifetime)",
+			"key_lifetime",
+			UCL_TIME,
+			NULL,
+			0,
+			NULL,
+			0);
+	rspamd_rcl_add_doc_by_path (cfg,
+			"fuzzy_check.rule",
+			"If true then pack all checks for a message into a single encrypted "
+			"frame (requires encryption and a recent fuzzy storage)",
+			"multi_commands",
+			UCL_BOOLEAN,
+			NULL,
+			0,
+			NULL,
+			0);
 	rspamd_rcl_add_doc_by_path (cfg,
 			"fuzzy_check.rule",
 			"Default symbol for rule (if no flags defined or matched)",
@@ -997,6 +1070,26 @@ fuzzy_check_module_config (struct rspamd_config *cfg)
 		fuzzy_module_ctx->retransmits = DEFAULT_RETRANSMITS;
 	}
 
+	if ((value =
+				 rspamd_config_get_module_opt (cfg,
+						 "fuzzy_check",
+						 "hedge_requests")) != NULL) {
+		fuzzy_module_ctx->hedge_requests = ucl_obj_toboolean (value);
+	}
+	else {
+		fuzzy_module_ctx->hedge_requests = FALSE;
+	}
+
+	if ((value =
+				 rspamd_config_get_module_opt (cfg,
+						 "fuzzy_check",
+						 "hedge_delay")) != NULL) {
+		fuzzy_module_ctx->hedge_delay = ucl_obj_todouble (value) * 1000;
+	}
+	else {
+		fuzzy_module_ctx->hedge_delay = 0;
+	}
+
 	if ((value =
 		rspamd_config_get_module_opt (cfg, "fuzzy_check",
 		"whitelist")) != NULL) {
@@ -1151,9 +1244,23 @@ fuzzy_io_fin (void *ud)
 		g_ptr_array_free (session->results, TRUE);
 	}
 
+	if (session->frames) {
+		g_ptr_array_free (session->frames, TRUE);
+	}
+
 	event_del (&session->ev);
 	event_del (&session->timev);
 	close (session->fd);
+
+	if (session->hedge_planned) {
+		event_del (&session->hedge_timev);
+	}
+
+	if (session->hedge_fd != -1) {
+		/* Cancel the request that has not replied */
+		event_del (&session->hedge_ev);
+		close (session->hedge_fd);
+	}
 }
 
 static GArray *
@@ -1163,8 +1270,9 @@ fuzzy_preprocess_words (struct rspamd_mime_text_part *part, rspamd_mempool_t *po
 }
 
 static void
-fuzzy_encrypt_cmd (struct fuzzy_rule *rule,
+fuzzy_encrypt_payload (struct fuzzy_rule *rule,
 		struct rspamd_fuzzy_encrypted_req_hdr *hdr,
+		const guchar *magic,
 		guchar *data, gsize datalen)
 {
 	const guchar *pk;
@@ -1174,9 +1282,23 @@ fuzzy_encrypt_cmd (struct fuzzy_rule *rule,
 	g_assert (data != NULL);
 	g_assert (rule != NULL);
 
+	if (rule->key_lifetime > 0 &&
+			rspamd_get_calendar_ticks () - rule->local_key_ts >
+			rule->key_lifetime) {
+		/* Rotate session key, keep the previous one for replies in flight */
+		if (rule->prev_local_key) {
+			rspamd_keypair_unref (rule->prev_local_key);
+		}
+
+		rule->prev_local_key = rule->local_key;
+		rule->local_key = rspamd_keypair_new (RSPAMD_KEYPAIR_KEX,
+				RSPAMD_CRYPTOBOX_MODE_25519);
+		rule->local_key_ts = rspamd_get_calendar_ticks ();
+	}
+
 	/* Encrypt data */
 	memcpy (hdr->magic,
-			fuzzy_encrypted_magic,
+			magic,
 			sizeof (hdr->magic));
 	ottery_rand_bytes (hdr->nonce, sizeof (hdr->nonce));
 	pk = rspamd_keypair_component (rule->local_key,
@@ -1192,6 +1314,23 @@ fuzzy_encrypt_cmd (struct fuzzy_rule *rule,
 			rspamd_pubkey_alg (rule->peer_key));
 }
 
+static void
+fuzzy_encrypt_cmd (struct fuzzy_rule *rule,
+		struct rspamd_fuzzy_encrypted_req_hdr *hdr,
+		guchar *data, gsize datalen)
+{
+	fuzzy_encrypt_payload (rule, hdr, fuzzy_encrypted_magic, data, datalen);
+}
+
+/*
+ * Check commands are encrypted all together in multi-command frames
+ */
+static inline gboolean
+fuzzy_cmd_encrypt_single (struct fuzzy_rule *rule, gint c)
+{
+	return rule->peer_key && !(rule->multi_commands && c == FUZZY_CHECK);
+}
+
 static struct fuzzy_cmd_io *
 fuzzy_cmd_stat (struct fuzzy_rule *rule,
 		int c,
@@ -1522,7 +1661,7 @@ fuzzy_cmd_from_text_part (struct rspamd_task *task,
 	io->flags = 0;
 
 
-	if (rule->peer_key) {
+	if (fuzzy_cmd_encrypt_single (rule, c)) {
 		/* Encrypt data */
 		if (!short_text) {
 			fuzzy_encrypt_cmd (rule, &encshcmd->hdr, (guchar *) shcmd,
@@ -1634,7 +1773,7 @@ fuzzy_cmd_from_image_part (struct fuzzy_rule *rule,
 	io->flags = FUZZY_CMD_FLAG_IMAGE;
 	memcpy (&io->cmd, &shcmd->basic, sizeof (io->cmd));
 
-	if (rule->peer_key) {
+	if (fuzzy_cmd_encrypt_single (rule, c)) {
 		/* Encrypt data */
 		fuzzy_encrypt_cmd (rule, &encshcmd->hdr, (guchar *) shcmd, sizeof (*shcmd));
 		io->io.iov_base = encshcmd;
@@ -1685,7 +1824,7 @@ fuzzy_cmd_from_data_part (struct fuzzy_rule *rule,
 	io->part = mp;
 	memcpy (&io->cmd, cmd, sizeof (io->cmd));
 
-	if (rule->peer_key) {
+	if (fuzzy_cmd_encrypt_single (rule, c)) {
 		g_assert (enccmd != NULL);
 		fuzzy_encrypt_cmd (rule, &enccmd->hdr, (guchar *) cmd, sizeof (*cmd));
 		io->io.iov_base = enccmd;
@@ -1762,6 +1901,187 @@ fuzzy_cmd_vector_to_wire (gint fd, GPtrArray *v)
 	return processed;
 }
 
+/*
+ * Sends all unreplied commands without changing their state
+ */
+static gboolean
+fuzzy_cmd_vector_resend_to_wire (gint fd, GPtrArray *v)
+{
+	guint i;
+	struct fuzzy_cmd_io *io;
+
+	PTR_ARRAY_FOREACH (v, i, io) {
+		if (!(io->flags & FUZZY_CMD_FLAG_REPLIED)) {
+			if (!fuzzy_cmd_to_wire (fd, &io->io)) {
+				return FALSE;
+			}
+		}
+	}
+
+	return TRUE;
+}
+
+/*
+ * Replies might be encrypted with the previous session key if it has been
+ * rotated while request has been in flight
+ */
+static gboolean
+fuzzy_decrypt_reply (struct fuzzy_rule *rule, guchar *data, gsize len,
+		struct rspamd_fuzzy_encrypted_rep_hdr *hdr)
+{
+	rspamd_keypair_cache_process (rule->ctx->keypairs_cache,
+			rule->local_key, rule->peer_key);
+
+	if (rspamd_cryptobox_decrypt_nm_inplace (data, len, hdr->nonce,
+			rspamd_pubkey_get_nm (rule->peer_key, rule->local_key),
+			hdr->mac,
+			rspamd_pubkey_alg (rule->peer_key))) {
+		return TRUE;
+	}
+
+	if (rule->prev_local_key) {
+		rspamd_keypair_cache_process (rule->ctx->keypairs_cache,
+				rule->prev_local_key, rule->peer_key);
+
+		/* MAC is verified before decryption, so data is still intact */
+		return rspamd_cryptobox_decrypt_nm_inplace (data, len, hdr->nonce,
+				rspamd_pubkey_get_nm (rule->peer_key, rule->prev_local_key),
+				hdr->mac,
+				rspamd_pubkey_alg (rule->peer_key));
+	}
+
+	return FALSE;
+}
+
+/*
+ * Packs commands into multi-command frames and encrypts each frame once
+ */
+static GPtrArray *
+fuzzy_cmd_vector_to_multi (struct fuzzy_rule *rule, GPtrArray *commands,
+		rspamd_mempool_t *pool)
+{
+	GPtrArray *frames;
+	struct fuzzy_multi_frame *frame;
+	struct fuzzy_cmd_io *io;
+	struct rspamd_fuzzy_encrypted_req_hdr *hdr;
+	struct rspamd_fuzzy_multi_hdr *mhdr;
+	guchar *buf, *p;
+	gsize len;
+	guint i, j;
+
+	frames = g_ptr_array_sized_new (
+			commands->len / RSPAMD_FUZZY_MULTI_MAX_CMDS + 1);
+
+	for (i = 0; i < commands->len; i += RSPAMD_FUZZY_MULTI_MAX_CMDS) {
+		frame = rspamd_mempool_alloc (pool, sizeof (*frame));
+		frame->first = i;
+		frame->ncmds = MIN (commands->len - i, RSPAMD_FUZZY_MULTI_MAX_CMDS);
+		len = sizeof (*hdr) + sizeof (*mhdr);
+
+		for (j = i; j < i + frame->ncmds; j ++) {
+			io = g_ptr_array_index (commands, j);
+			len += io->io.iov_len;
+		}
+
+		buf = rspamd_mempool_alloc0 (pool, len);
+		hdr = (struct rspamd_fuzzy_encrypted_req_hdr *)buf;
+		mhdr = (struct rspamd_fuzzy_multi_hdr *)(buf + sizeof (*hdr));
+		mhdr->version = RSPAMD_FUZZY_MULTI_VERSION;
+		mhdr->ncmds = frame->ncmds;
+		p = buf + sizeof (*hdr) + sizeof (*mhdr);
+
+		for (j = i; j < i + frame->ncmds; j ++) {
+			io = g_ptr_array_index (commands, j);
+			/* Commands are not encrypted in this mode */
+			memcpy (p, io->io.iov_base, io->io.iov_len);
+			p += io->io.iov_len;
+		}
+
+		fuzzy_encrypt_payload (rule, hdr, fuzzy_multi_magic,
+				(guchar *)mhdr, len - sizeof (*hdr));
+		frame->io.iov_base = buf;
+		frame->io.iov_len = len;
+		g_ptr_array_add (frames, frame);
+	}
+
+	return frames;
+}
+
+static gboolean
+fuzzy_multi_vector_to_wire (gint fd, GPtrArray *frames, GPtrArray *commands)
+{
+	struct fuzzy_multi_frame *frame;
+	struct fuzzy_cmd_io *io;
+	guint i, j;
+	gboolean processed = FALSE;
+
+	/* Resend all frames that have unreplied commands */
+	PTR_ARRAY_FOREACH (frames, i, frame) {
+		for (j = frame->first; j < frame->first + frame->ncmds; j ++) {
+			io = g_ptr_array_index (commands, j);
+
+			if (!(io->flags & FUZZY_CMD_FLAG_REPLIED)) {
+				break;
+			}
+		}
+
+		if (j == frame->first + frame->ncmds) {
+			continue;
+		}
+
+		if (!fuzzy_cmd_to_wire (fd, &frame->io)) {
+			return FALSE;
+		}
+
+		processed = TRUE;
+	}
+
+	return processed;
+}
+
+/*
+ * Marks command with the reply tag as replied
+ */
+static const struct rspamd_fuzzy_reply *
+fuzzy_match_reply (const struct rspamd_fuzzy_reply *rep, GPtrArray *req,
+		struct rspamd_fuzzy_cmd **pcmd,
+		struct fuzzy_cmd_io **pio)
+{
+	guint i;
+	struct fuzzy_cmd_io *io;
+	gboolean found = FALSE;
+
+	/*
+	 * Search for tag
+	 */
+	for (i = 0; i < req->len; i ++) {
+		io = g_ptr_array_index (req, i);
+
+		if (io->tag == rep->v1.tag) {
+			if (!(io->flags & FUZZY_CMD_FLAG_REPLIED)) {
+				io->flags |= FUZZY_CMD_FLAG_REPLIED;
+
+				if (pcmd) {
+					*pcmd = &io->cmd;
+				}
+
+				if (pio) {
+					*pio = io;
+				}
+
+				return rep;
+			}
+			found = TRUE;
+		}
+	}
+
+	if (!found) {
+		msg_info ("unexpected tag: %ud", rep->v1.tag);
+	}
+
+	return NULL;
+}
+
 /*
  * Read replies one-by-one and remove them from req array
  */
@@ -1772,11 +2092,9 @@ fuzzy_process_reply (guchar **pos, gint *r, GPtrArray *req,
 {
 	guchar *p = *pos;
 	gint remain = *r;
-	guint i, required_size;
-	struct fuzzy_cmd_io *io;
+	guint required_size;
 	const struct rspamd_fuzzy_reply *rep;
 	struct rspamd_fuzzy_encrypted_reply encrep;
-	gboolean found = FALSE;
 
 	if (rule->peer_key) {
 		required_size = sizeof (encrep);
@@ -1795,15 +2113,8 @@ fuzzy_process_reply (guchar **pos, gint *r, GPtrArray *req,
 		*r -= required_size;
 
 		/* Try to decrypt reply */
-		rspamd_keypair_cache_process (rule->ctx->keypairs_cache,
-				rule->local_key, rule->peer_key);
-
-		if (!rspamd_cryptobox_decrypt_nm_inplace ((guchar *)&encrep.rep,
-				sizeof (encrep.rep),
-				encrep.hdr.nonce,
-				rspamd_pubkey_get_nm (rule->peer_key, rule->local_key),
-				encrep.hdr.mac,
-				rspamd_pubkey_alg (rule->peer_key))) {
+		if (!fuzzy_decrypt_reply (rule, (guchar *)&encrep.rep,
+				sizeof (encrep.rep), &encrep.hdr)) {
 			msg_info ("cannot decrypt reply");
 			return NULL;
 		}
@@ -1818,35 +2129,47 @@ fuzzy_process_reply (guchar **pos, gint *r, GPtrArray *req,
 	}
 
 	rep = (const struct rspamd_fuzzy_reply *) p;
-	/*
-	 * Search for tag
-	 */
-	for (i = 0; i < req->len; i ++) {
-		io = g_ptr_array_index (req, i);
 
-		if (io->tag == rep->v1.tag) {
-			if (!(io->flags & FUZZY_CMD_FLAG_REPLIED)) {
-				io->flags |= FUZZY_CMD_FLAG_REPLIED;
+	return fuzzy_match_reply (rep, req, pcmd, pio);
+}
 
-				if (pcmd) {
-					*pcmd = &io->cmd;
-				}
+/*
+ * Decrypts multi-command reply in place and returns number of replies
+ */
+static guint
+fuzzy_process_multi_reply (guchar *p, gint r, struct fuzzy_rule *rule,
+		const struct rspamd_fuzzy_reply **preps)
+{
+	struct rspamd_fuzzy_encrypted_rep_hdr *hdr;
+	struct rspamd_fuzzy_multi_hdr mhdr;
+	guchar *payload;
+	gsize payload_len;
 
-				if (pio) {
-					*pio = io;
-				}
+	if (r <= 0 || (gsize)r < sizeof (*hdr) + sizeof (mhdr)) {
+		return 0;
+	}
 
-				return rep;
-			}
-			found = TRUE;
-		}
+	hdr = (struct rspamd_fuzzy_encrypted_rep_hdr *)p;
+	payload = p + sizeof (*hdr);
+	payload_len = r - sizeof (*hdr);
+
+	if (!fuzzy_decrypt_reply (rule, payload, payload_len, hdr)) {
+		msg_info ("cannot decrypt reply");
+		return 0;
 	}
 
-	if (!found) {
-		msg_info ("unexpected tag: %ud", rep->v1.tag);
+	memcpy (&mhdr, payload, sizeof (mhdr));
+
+	if (mhdr.version != RSPAMD_FUZZY_MULTI_VERSION ||
+			payload_len != sizeof (mhdr) +
+			mhdr.ncmds * sizeof (struct rspamd_fuzzy_reply)) {
+		msg_info ("invalid multi-command reply");
+		return 0;
 	}
 
-	return NULL;
+	*preps = (const struct rspamd_fuzzy_reply *)(payload + sizeof (mhdr));
+
+	return mhdr.ncmds;
 }
 
 static void
@@ -1990,19 +2313,69 @@ fuzzy_insert_result (struct fuzzy_client_session *session,
 	}
 }
 
+static void
+fuzzy_check_handle_reply (struct fuzzy_client_session *session,
+		const struct rspamd_fuzzy_reply *rep,
+		struct rspamd_fuzzy_cmd *cmd,
+		struct fuzzy_cmd_io *io)
+{
+	struct rspamd_task *task = session->task;
+
+	if (rep->v1.prob > 0.5) {
+		if (cmd->cmd == FUZZY_CHECK) {
+			fuzzy_insert_result (session, rep, cmd, io, rep->v1.flag);
+		}
+		else if (cmd->cmd == FUZZY_STAT) {
+			/* Just set pool variable to extract it in further */
+			struct rspamd_fuzzy_stat_entry *pval;
+			GList *res;
+
+			pval = rspamd_mempool_alloc (task->task_pool, sizeof (*pval));
+			pval->fuzzy_cnt = rep->v1.flag;
+			pval->name = session->rule->name;
+
+			res = rspamd_mempool_get_variable (task->task_pool, "fuzzy_stat");
+
+			if (res == NULL) {
+				res = g_list_append (NULL, pval);
+				rspamd_mempool_set_variable (task->task_pool, "fuzzy_stat",
+						res, (rspamd_mempool_destruct_t)g_list_free);
+			}
+			else {
+				res = g_list_append (res, pval);
+			}
+		}
+	}
+	else if (rep->v1.value == 403) {
+		rspamd_task_insert_result (task, "FUZZY_BLOCKED", 0.0,
+				session->rule->name);
+	}
+	else if (rep->v1.value == 401) {
+		if (cmd->cmd != FUZZY_CHECK) {
+			msg_info_task (
+					"fuzzy check error for %d: skipped by server",
+					rep->v1.flag);
+		}
+	}
+	else if (rep->v1.value != 0) {
+		msg_info_task (
+				"fuzzy check error for %d: unknown error (%d)",
+				rep->v1.flag,
+				rep->v1.value);
+	}
+}
+
 static gint
-fuzzy_check_try_read (struct fuzzy_client_session *session)
+fuzzy_check_try_read (struct fuzzy_client_session *session, gint fd)
 {
-	struct rspamd_task *task;
-	const struct rspamd_fuzzy_reply *rep;
+	const struct rspamd_fuzzy_reply *rep, *reps;
 	struct rspamd_fuzzy_cmd *cmd = NULL;
 	struct fuzzy_cmd_io *io = NULL;
 	gint r, ret;
+	guint i, nreps;
 	guchar buf[2048], *p;
 
-	task = session->task;
-
-	if ((r = read (session->fd, buf, sizeof (buf) - 1)) == -1) {
+	if ((r = read (fd, buf, sizeof (buf) - 1)) == -1) {
 		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
 			return 0;
 		}
@@ -2015,52 +2388,23 @@ fuzzy_check_try_read (struct fuzzy_client_session *session)
 
 		ret = 0;
 
-		while ((rep = fuzzy_process_reply (&p, &r,
-				session->commands, session->rule, &cmd, &io)) != NULL) {
-			if (rep->v1.prob > 0.5) {
-				if (cmd->cmd == FUZZY_CHECK) {
-					fuzzy_insert_result (session, rep, cmd, io, rep->v1.flag);
-				}
-				else if (cmd->cmd == FUZZY_STAT) {
-					/* Just set pool variable to extract it in further */
-					struct rspamd_fuzzy_stat_entry *pval;
-					GList *res;
-
-					pval = rspamd_mempool_alloc (task->task_pool, sizeof (*pval));
-					pval->fuzzy_cnt = rep->v1.flag;
-					pval->name = session->rule->name;
+		if (session->frames) {
+			nreps = fuzzy_process_multi_reply (p, r, session->rule, &reps);
 
-					res = rspamd_mempool_get_variable (task->task_pool, "fuzzy_stat");
-
-					if (res == NULL) {
-						res = g_list_append (NULL, pval);
-						rspamd_mempool_set_variable (task->task_pool, "fuzzy_stat",
-								res, (rspamd_mempool_destruct_t)g_list_free);
-					}
-					else {
-						res = g_list_append (res, pval);
-					}
-				}
-			}
-			else if (rep->v1.value == 403) {
-				rspamd_task_insert_result (task, "FUZZY_BLOCKED", 0.0,
-						session->rule->name);
-			}
-			else if (rep->v1.value == 401) {
-				if (cmd->cmd != FUZZY_CHECK) {
-					msg_info_task (
-							"fuzzy check error for %d: skipped by server",
-							rep->v1.flag);
+			for (i = 0; i < nreps; i ++) {
+				if ((rep = fuzzy_match_reply (&reps[i], session->commands,
+						&cmd, &io)) != NULL) {
+					fuzzy_check_handle_reply (session, rep, cmd, io);
+					ret = 1;
 				}
 			}
-			else if (rep->v1.value != 0) {
-				msg_info_task (
-						"fuzzy check error for %d: unknown error (%d)",
-						rep->v1.flag,
-						rep->v1.value);
+		}
+		else {
+			while ((rep = fuzzy_process_reply (&p, &r,
+					session->commands, session->rule, &cmd, &io)) != NULL) {
+				fuzzy_check_handle_reply (session, rep, cmd, io);
+				ret = 1;
 			}
-
-			ret = 1;
 		}
 	}
 
@@ -2110,12 +2454,13 @@ fuzzy_insert_metric_results (struct rspamd_task *task, GPtrArray *results)
 }
 
 static gboolean
-fuzzy_check_session_is_completed (struct fuzzy_client_session *session)
+fuzzy_check_session_is_completed (struct fuzzy_client_session *session,
+		struct upstream *replied)
 {
 	struct fuzzy_cmd_io *io;
 	guint nreplied = 0, i;
 
-	rspamd_upstream_ok (session->server);
+	rspamd_upstream_ok (replied);
 
 	for (i = 0; i < session->commands->len; i++) {
 		io = g_ptr_array_index (session->commands, i);
@@ -2126,6 +2471,8 @@ fuzzy_check_session_is_completed (struct fuzzy_client_session *session)
 	}
 
 	if (nreplied == session->commands->len) {
+		rspamd_upstream_latency (replied,
+				rspamd_get_ticks (FALSE) - session->start_ts);
 		fuzzy_insert_metric_results (session->task, session->results);
 		if (session->item) {
 			rspamd_symcache_item_async_dec_check (session->task, session->item, M);
@@ -2146,6 +2493,7 @@ fuzzy_check_io_callback (gint fd, short what, void *arg)
 	struct rspamd_task *task;
 	struct event_base *ev_base;
 	gint r;
+	gboolean sent;
 
 	enum {
 		return_error = 0,
@@ -2157,7 +2505,7 @@ fuzzy_check_io_callback (gint fd, short what, void *arg)
 
 	if ((what & EV_READ) || session->state == 1) {
 		/* Try to read reply */
-		r = fuzzy_check_try_read (session);
+		r = fuzzy_check_try_read (session, session->fd);
 
 		switch (r) {
 		case 0:
@@ -2172,7 +2520,15 @@ fuzzy_check_io_callback (gint fd, short what, void *arg)
 		}
 	}
 	else if (what & EV_WRITE) {
-		if (!fuzzy_cmd_vector_to_wire (fd, session->commands)) {
+		if (session->frames) {
+			sent = fuzzy_multi_vector_to_wire (fd, session->frames,
+					session->commands);
+		}
+		else {
+			sent = fuzzy_cmd_vector_to_wire (fd, session->commands);
+		}
+
+		if (!sent) {
 			ret = return_error;
 		}
 		else {
@@ -2205,6 +2561,14 @@ fuzzy_check_io_callback (gint fd, short what, void *arg)
 			strerror (errno));
 		rspamd_upstream_fail (session->server, FALSE);
 
+		if (session->hedge_fd != -1) {
+			/* Wait for the hedged request */
+			event_del (&session->ev);
+			session->state = 2;
+
+			return;
+		}
+
 		if (session->item) {
 			rspamd_symcache_item_async_dec_check (session->task, session->item, M);
 		}
@@ -2212,7 +2576,7 @@ fuzzy_check_io_callback (gint fd, short what, void *arg)
 	}
 	else {
 		/* Read something from network */
-		if (!fuzzy_check_session_is_completed (session)) {
+		if (!fuzzy_check_session_is_completed (session, session->server)) {
 			/* Need to read more */
 			ev_base = event_get_base (&session->ev);
 			event_del (&session->ev);
@@ -2235,8 +2599,15 @@ fuzzy_check_timer_callback (gint fd, short what, void *arg)
 	task = session->task;
 
 	/* We might be here because of other checks being slow */
-	if (fuzzy_check_try_read (session) > 0) {
-		if (fuzzy_check_session_is_completed (session)) {
+	if (session->state != 2 && fuzzy_check_try_read (session, session->fd) > 0) {
+		if (fuzzy_check_session_is_completed (session, session->server)) {
+			return;
+		}
+	}
+
+	if (session->hedge_fd != -1 &&
+			fuzzy_check_try_read (session, session->hedge_fd) > 0) {
+		if (fuzzy_check_session_is_completed (session, session->hedge_server)) {
 			return;
 		}
 	}
@@ -2248,19 +2619,37 @@ fuzzy_check_timer_callback (gint fd, short what, void *arg)
 						rspamd_upstream_addr (session->server)),
 				session->retransmits);
 		rspamd_upstream_fail (session->server, FALSE);
+
+		if (session->hedge_fd != -1) {
+			rspamd_upstream_fail (session->hedge_server, FALSE);
+		}
+
 		if (session->item) {
 			rspamd_symcache_item_async_dec_check (session->task, session->item, M);
 		}
 		rspamd_session_remove_event (session->task->s, fuzzy_io_fin, session);
 	}
 	else {
-		/* Plan write event */
-		ev_base = event_get_base (&session->ev);
-		event_del (&session->ev);
-		event_set (&session->ev, fd, EV_WRITE|EV_READ,
-				fuzzy_check_io_callback, session);
-		event_base_set (ev_base, &session->ev);
-		event_add (&session->ev, NULL);
+		if (session->state != 2) {
+			/* Plan write event */
+			ev_base = event_get_base (&session->ev);
+			event_del (&session->ev);
+			event_set (&session->ev, session->fd, EV_WRITE|EV_READ,
+					fuzzy_check_io_callback, session);
+			event_base_set (ev_base, &session->ev);
+			event_add (&session->ev, NULL);
+		}
+
+		if (session->hedge_fd != -1) {
+			if (session->frames) {
+				fuzzy_multi_vector_to_wire (session->hedge_fd, session->frames,
+						session->commands);
+			}
+			else {
+				fuzzy_cmd_vector_resend_to_wire (session->hedge_fd,
+						session->commands);
+			}
+		}
 
 		/* Plan new retransmit timer */
 		ev_base = event_get_base (&session->timev);
@@ -2271,6 +2660,108 @@ fuzzy_check_timer_callback (gint fd, short what, void *arg)
 	}
 }
 
+/* Replies for the hedged request */
+static void
+fuzzy_check_hedge_io_callback (gint fd, short what, void *arg)
+{
+	struct fuzzy_client_session *session = arg;
+	struct rspamd_task *task = session->task;
+	gint r;
+
+	r = fuzzy_check_try_read (session, fd);
+
+	if (r > 0) {
+		fuzzy_check_session_is_completed (session, session->hedge_server);
+	}
+	else if (r < 0) {
+		msg_info_task ("got error on hedged IO with server %s(%s), %d, %s",
+				rspamd_upstream_name (session->hedge_server),
+				rspamd_inet_address_to_string_pretty (
+						rspamd_upstream_addr (session->hedge_server)),
+				errno,
+				strerror (errno));
+		rspamd_upstream_fail (session->hedge_server, FALSE);
+		event_del (&session->hedge_ev);
+		close (session->hedge_fd);
+		session->hedge_fd = -1;
+
+		if (session->state == 2) {
+			/* Both servers have failed */
+			if (session->item) {
+				rspamd_symcache_item_async_dec_check (session->task,
+						session->item, M);
+			}
+			rspamd_session_remove_event (session->task->s, fuzzy_io_fin,
+					session);
+		}
+	}
+}
+
+/* The first server has not replied in time, ask another one */
+static void
+fuzzy_check_hedge_timer_callback (gint fd, short what, void *arg)
+{
+	struct fuzzy_client_session *session = arg;
+	struct rspamd_task *task = session->task;
+	struct upstream *selected = NULL;
+	rspamd_inet_addr_t *addr;
+	gsize i, nservers;
+	gboolean sent;
+	gint sock;
+
+	session->hedge_planned = FALSE;
+	nservers = rspamd_upstreams_count (session->rule->servers);
+
+	for (i = 0; i < nservers; i ++) {
+		selected = rspamd_upstream_get (session->rule->servers,
+				RSPAMD_UPSTREAM_ROUND_ROBIN, NULL, 0);
+
+		if (selected != session->server) {
+			break;
+		}
+
+		selected = NULL;
+	}
+
+	if (selected == NULL) {
+		return;
+	}
+
+	addr = rspamd_upstream_addr (selected);
+
+	if ((sock = rspamd_inet_address_connect (addr, SOCK_DGRAM, TRUE)) == -1) {
+		rspamd_upstream_fail (selected, FALSE);
+
+		return;
+	}
+
+	if (session->frames) {
+		sent = fuzzy_multi_vector_to_wire (sock, session->frames,
+				session->commands);
+	}
+	else {
+		sent = fuzzy_cmd_vector_resend_to_wire (sock, session->commands);
+	}
+
+	if (!sent) {
+		rspamd_upstream_fail (selected, FALSE);
+		close (sock);
+
+		return;
+	}
+
+	msg_debug_task ("send hedged request to %s(%s) after no reply from %s",
+			rspamd_upstream_name (selected),
+			rspamd_inet_address_to_string_pretty (addr),
+			rspamd_upstream_name (session->server));
+	session->hedge_server = selected;
+	session->hedge_fd = sock;
+	event_set (&session->hedge_ev, sock, EV_READ|EV_PERSIST,
+			fuzzy_check_hedge_io_callback, session);
+	event_base_set (session->task->ev_base, &session->hedge_ev);
+	event_add (&session->hedge_ev, NULL);
+}
+
 static void
 fuzzy_lua_fin (void *ud)
 {
@@ -2700,6 +3191,38 @@ end:
 }
 
 
+static gboolean
+fuzzy_cmd_vector_is_check (GPtrArray *commands)
+{
+	struct fuzzy_cmd_io *io;
+	guint i;
+
+	PTR_ARRAY_FOREACH (commands, i, io) {
+		if (io->cmd.cmd != FUZZY_CHECK) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static guint32
+fuzzy_hedge_delay (struct fuzzy_rule *rule, struct upstream *up)
+{
+	guint32 delay = rule->ctx->hedge_delay;
+
+	if (delay == 0) {
+		delay = rspamd_upstream_get_latency_p95 (up) * 1000;
+
+		if (delay == 0) {
+			/* No latency data yet */
+			delay = rule->ctx->io_timeout / 2;
+		}
+	}
+
+	return delay;
+}
+
 static inline void
 register_fuzzy_client_call (struct rspamd_task *task,
 	struct fuzzy_rule *rule,
@@ -2708,6 +3231,7 @@ register_fuzzy_client_call (struct rspamd_task *task,
 	struct fuzzy_client_session *session;
 	struct upstream *selected;
 	rspamd_inet_addr_t *addr;
+	struct timeval hedge_tv;
 	gint sock;
 
 	if (!rspamd_session_blocked (task->s)) {
@@ -2737,6 +3261,14 @@ register_fuzzy_client_call (struct rspamd_task *task,
 				session->server = selected;
 				session->rule = rule;
 				session->results = g_ptr_array_sized_new (32);
+				session->start_ts = rspamd_get_ticks (FALSE);
+				session->hedge_fd = -1;
+
+				if (rule->peer_key && rule->multi_commands &&
+						fuzzy_cmd_vector_is_check (commands)) {
+					session->frames = fuzzy_cmd_vector_to_multi (rule,
+							commands, task->task_pool);
+				}
 
 				event_set (&session->ev, sock, EV_WRITE, fuzzy_check_io_callback,
 						session);
@@ -2748,6 +3280,17 @@ register_fuzzy_client_call (struct rspamd_task *task,
 				event_base_set (session->task->ev_base, &session->timev);
 				event_add (&session->timev, &session->tv);
 
+				if (rule->ctx->hedge_requests &&
+						rspamd_upstreams_count (rule->servers) > 1) {
+					msec_to_tv (fuzzy_hedge_delay (rule, selected), &hedge_tv);
+					evtimer_set (&session->hedge_timev,
+							fuzzy_check_hedge_timer_callback, session);
+					event_base_set (session->task->ev_base,
+							&session->hedge_timev);
+					event_add (&session->hedge_timev, &hedge_tv);
+					session->hedge_planned = TRUE;
+				}
+
 				rspamd_session_add_event (task->s, fuzzy_io_fin, session, M);
 				session->item = rspamd_symcache_get_cur_item (task);
 
@@ -63,6 +63,13 @@ antivirus {
     }
     # `whitelist` points to a map of IP addresses. Mail from these addresses is not scanned.
     whitelist = "/etc/rspamd/antivirus.wl";
+    # Results are also cached in each worker, 0 disables this cache
+    #local_cache_size = 4096;
+    # Maximum number of scans being sent to the scanner concurrently by each worker (0 - unlimited)
+    # Concurrent scans of the same content always share the same request
+    #max_concurrent = 0;
+    # How often to query signatures version to invalidate cached results (clamav only)
+    #version_refresh = 600;
   }
 }
 ]])
@@ -305,31 +312,158 @@ local function need_av_check(task, content, rule)
   return message_not_too_large(task, content, rule)
 end
 
+-- Worker local LRU approximation: two generations of the same size, the
+-- current one is rotated to the previous one when full and entries found in
+-- the previous generation are promoted back
+local function local_cache_insert(cache, key, elt)
+  if not cache.cur[key] then
+    cache.nelts = cache.nelts + 1
+
+    if cache.nelts > cache.max then
+      cache.prev = cache.cur
+      cache.cur = {}
+      cache.nelts = 1
+    end
+  end
+
+  cache.cur[key] = elt
+end
+
+local function local_cache_get(rule, key, now)
+  local cache = rule.local_cache
+  if not cache then return nil end
+
+  local elt = cache.cur[key]
+
+  if not elt then
+    elt = cache.prev[key]
+
+    if elt then
+      cache.prev[key] = nil
+      local_cache_insert(cache, key, elt)
+    end
+  end
+
+  if elt and elt[2] > now then
+    return elt[1]
+  end
+
+  return nil
+end
+
+local function local_cache_set(rule, key, data)
+  local cache = rule.local_cache
+  if not cache then return end
+
+  local_cache_insert(cache, key,
+      {data, rspamd_util.get_time() + rule.local_cache_expire})
+end
+
+-- Cache key includes signature version when scanner reports it, so cached
+-- verdicts are invalidated on database updates
+local function av_cache_key(rule, digest)
+  if rule.sig_version then
+    return string.format('%s%s_%s', rule['prefix'], rule.sig_version, digest)
+  end
+
+  return rule['prefix'] .. digest
+end
+
+local function yield_cached(task, rule, key, data)
+  lua_util.debugm(N, task, 'got cached result for %s: %s', key, data)
+
+  if data ~= 'OK' then
+    yield_result(task, rule, rspamd_str_split(data, '\v'))
+  end
+end
+
+-- Checks if a new backend request could be started: in flight requests are
+-- tracked by digest with their deadlines, so lost requests free their slots
+local function av_slot_available(rule, now)
+  if rule.max_concurrent <= 0 then return true end
+
+  local nactive = 0
+
+  for digest, deadline in pairs(rule.inflight) do
+    if deadline <= now then
+      rule.inflight[digest] = nil
+    else
+      nactive = nactive + 1
+    end
+  end
+
+  return nactive < rule.max_concurrent
+end
+
+local function av_scan_release(rule, digest)
+  rule.inflight[digest] = nil
+end
+
+local function av_scan_failed(task, digest, rule, reason)
+  av_scan_release(rule, digest)
+  task:insert_result(rule['symbol_fail'], 0.0, reason)
+end
+
+-- Starts scanning unless the same content is already being scanned or the
+-- concurrency limit is reached, in that case waits for the result or a slot
+local function av_scan_start(task, digest, rule, fn, wait_until)
+  local now = rspamd_util.get_time()
+  local key = av_cache_key(rule, digest)
+  local cached = local_cache_get(rule, key, now)
+
+  if cached then
+    yield_cached(task, rule, key, cached)
+    return
+  end
+
+  local deadline = rule.inflight[digest]
+
+  if (deadline and deadline > now) or not av_slot_available(rule, now) then
+    if not wait_until then
+      wait_until = now + rule['timeout']
+    elseif now >= wait_until then
+      rspamd_logger.errx(task, '%s [%s]: failed to scan, too many concurrent requests',
+          rule['symbol'], rule['type'])
+      task:insert_result(rule['symbol_fail'], 0.0, 'too many concurrent requests')
+      return
+    end
+
+    lua_util.debugm(N, task, '%s [%s]: wait for in flight request for %s',
+        rule['symbol'], rule['type'], digest)
+    task:add_timer(rule.coalesce_poll, function()
+      av_scan_start(task, digest, rule, fn, wait_until)
+    end)
+
+    return
+  end
+
+  rule.inflight[digest] = now + rule['timeout'] * (rule['retransmits'] + 1)
+  fn()
+end
+
 local function check_av_cache(task, digest, rule, fn)
-  local key = digest
+  local key = av_cache_key(rule, digest)
+  local cached = local_cache_get(rule, key, rspamd_util.get_time())
+
+  if cached then
+    yield_cached(task, rule, key, cached)
+    return
+  end
 
   local function redis_av_cb(err, data)
     if data and type(data) == 'string' then
       -- Cached
-      if data ~= 'OK' then
-        lua_util.debugm(N, task, 'got cached result for %s: %s', key, data)
-        data = rspamd_str_split(data, '\v')
-        yield_result(task, rule, data)
-      else
-        lua_util.debugm(N, task, 'got cached result for %s: %s', key, data)
-      end
+      local_cache_set(rule, key, data)
+      yield_cached(task, rule, key, data)
     else
       if err then
         rspamd_logger.errx(task, 'Got error checking cache: %1', err)
       end
-      fn()
+      av_scan_start(task, digest, rule, fn)
     end
   end
 
   if redis_params then
-
-    key = rule['prefix'] .. key
-
     if rspamd_redis_make_request(task,
       redis_params, -- connect params
       key, -- hash key
@@ -338,15 +472,15 @@ local function check_av_cache(task, digest, rule, fn)
       'GET', -- command
       {key} -- arguments)
     ) then
-      return true
+      return
     end
   end
 
-  return false
+  av_scan_start(task, digest, rule, fn)
 end
 
 local function save_av_cache(task, digest, rule, to_save)
-  local key = digest
+  local key = av_cache_key(rule, digest)
 
   local function redis_set_cb(err)
     -- Do nothing
@@ -362,9 +496,10 @@ local function save_av_cache(task, digest, rule, to_save)
     to_save = table.concat(to_save, '\v')
   end
 
-  if redis_params then
-    key = rule['prefix'] .. key
+  av_scan_release(rule, digest)
+  local_cache_set(rule, key, to_save)
 
+  if redis_params then
     rspamd_redis_make_request(task,
       redis_params, -- connect params
       key, -- hash key
@@ -416,7 +551,7 @@ local function fprot_check(task, content, digest, rule)
           })
         else
           rspamd_logger.errx(task, '%s [%s]: failed to scan, maximum retransmits exceed', rule['symbol'], rule['type'])
-          task:insert_result(rule['symbol_fail'], 0.0, 'failed to scan and retransmits exceed')
+          av_scan_failed(task, digest, rule, 'failed to scan and retransmits exceed')
         end
       else
         upstream:ok()
@@ -457,11 +592,7 @@ local function fprot_check(task, content, digest, rule)
   end
 
   if need_av_check(task, content, rule) then
-    if check_av_cache(task, digest, rule, fprot_check_uncached) then
-      return
-    else
-      fprot_check_uncached()
-    end
+    check_av_cache(task, digest, rule, fprot_check_uncached)
   end
 end
 
@@ -502,7 +633,7 @@ local function clamav_check(task, content, digest, rule)
           })
         else
           rspamd_logger.errx(task, '%s [%s]: failed to scan, maximum retransmits exceed', rule['symbol'], rule['type'])
-          task:insert_result(rule['symbol_fail'], 0.0, 'failed to scan and retransmits exceed')
+          av_scan_failed(task, digest, rule, 'failed to scan and retransmits exceed')
         end
 
       else
@@ -524,7 +655,7 @@ local function clamav_check(task, content, digest, rule)
             cached = vname
           else
             rspamd_logger.errx(task, 'unhandled response: %s', data)
-            task:insert_result(rule['symbol_fail'], 0.0, 'unhandled response')
+            av_scan_failed(task, digest, rule, 'unhandled response')
           end
         end
         if cached then
@@ -545,11 +676,7 @@ local function clamav_check(task, content, digest, rule)
   end
 
   if need_av_check(task, content, rule) then
-    if check_av_cache(task, digest, rule, clamav_check_uncached) then
-      return
-    else
-      clamav_check_uncached()
-    end
+    check_av_cache(task, digest, rule, clamav_check_uncached)
   end
 end
 
@@ -590,7 +717,7 @@ local function sophos_check(task, content, digest, rule)
             })
           else
             rspamd_logger.errx(task, '%s [%s]: failed to scan, maximum retransmits exceed', rule['symbol'], rule['type'])
-            task:insert_result(rule['symbol_fail'], 0.0, 'failed to scan and retransmits exceed')
+            av_scan_failed(task, digest, rule, 'failed to scan and retransmits exceed')
           end
       else
         upstream:ok()
@@ -626,15 +753,15 @@ local function sophos_check(task, content, digest, rule)
               save_av_cache(task, digest, rule, "SAVDI_FILE_OVERSIZED")
             else
               rspamd_logger.errx(task, 'SAVDI: Message is OVERSIZED (SSSP reject code 4): %s', data)
-              task:insert_result(rule['symbol_fail'], 0.0, 'Message is OVERSIZED (SSSP reject code 4):' .. data)
+              av_scan_failed(task, digest, rule, 'Message is OVERSIZED (SSSP reject code 4):' .. data)
             end
             -- excplicitly set REJ1 message when SAVDIreports a protocol error
           elseif string.find(data, 'REJ 1') then
             rspamd_logger.errx(task, 'SAVDI (Protocol error (REJ 1)): %s', data)
-            task:insert_result(rule['symbol_fail'], 0.0, 'SAVDI (Protocol error (REJ 1)):' .. data)
+            av_scan_failed(task, digest, rule, 'SAVDI (Protocol error (REJ 1)):' .. data)
           else
             rspamd_logger.errx(task, 'unhandled response: %s', data)
-            task:insert_result(rule['symbol_fail'], 0.0, 'unhandled response')
+            av_scan_failed(task, digest, rule, 'unhandled response')
           end
 
         end
@@ -652,11 +779,7 @@ local function sophos_check(task, content, digest, rule)
   end
 
   if need_av_check(task, content, rule) then
-    if check_av_cache(task, digest, rule, sophos_check_uncached) then
-      return
-    else
-      sophos_check_uncached()
-    end
+    check_av_cache(task, digest, rule, sophos_check_uncached)
   end
 end
 
@@ -773,7 +896,7 @@ local function savapi_check(task, content, digest, rule)
           })
         else
           rspamd_logger.errx(task, '%s [%s]: failed to scan, maximum retransmits exceed', rule['symbol'], rule['type'])
-          task:insert_result(rule['symbol_fail'], 0.0, 'failed to scan and retransmits exceed')
+          av_scan_failed(task, digest, rule, 'failed to scan and retransmits exceed')
         end
       else
         upstream:ok()
@@ -797,18 +920,44 @@ local function savapi_check(task, content, digest, rule)
   end
 
   if need_av_check(task, content, rule) then
-    if check_av_cache(task, digest, rule, savapi_check_uncached) then
-      return
+    check_av_cache(task, digest, rule, savapi_check_uncached)
+  end
+end
+
+local function clamav_version(rule, ev_base, cb)
+  local upstream = rule.upstreams:get_upstream_round_robin()
+  local addr = upstream:get_addr()
+
+  local function clamav_version_callback(err, data)
+    if err then
+      upstream:fail()
+      rspamd_logger.infox(rspamd_config, '%s [%s]: cannot get version: %s',
+          rule['symbol'], rule['type'], err)
+      cb(nil)
     else
-      savapi_check_uncached()
+      upstream:ok()
+      -- ClamAV 0.100.1/24823/Mon Aug 13 08:25:55 2018
+      cb(string.match(tostring(data), '^ClamAV ([^/]+/%d+)'))
     end
   end
+
+  tcp.request({
+    ev_base = ev_base,
+    config = rspamd_config,
+    host = addr:to_string(),
+    port = addr:get_port(),
+    timeout = rule['timeout'],
+    callback = clamav_version_callback,
+    data = { 'zVERSION\0' },
+    stop_pattern = '\0'
+  })
 end
 
 local av_types = {
   clamav = {
     configure = clamav_config,
-    check = clamav_check
+    check = clamav_check,
+    version = clamav_version
   },
   fprot = {
     configure = fprot_config,
@@ -851,9 +1000,6 @@ local function add_antivirus_rule(sym, opts)
   end
 
   local rule = cfg.configure(opts)
-  rule.type = opts.type
-  rule.symbol_fail = opts.symbol_fail
-
 
   if not rule then
     rspamd_logger.errx(rspamd_config, 'cannot configure %s for %s',
@@ -861,6 +1007,47 @@ local function add_antivirus_rule(sym, opts)
     return nil
   end
 
+  rule.type = opts.type
+  rule.symbol_fail = opts.symbol_fail
+  rule.inflight = {}
+  rule.max_concurrent = tonumber(rule.max_concurrent) or 0
+  rule.coalesce_poll = tonumber(rule.coalesce_poll) or 0.05
+  rule.local_cache_expire = tonumber(rule.local_cache_expire) or rule.cache_expire
+  local local_cache_size = tonumber(rule.local_cache_size) or 4096
+
+  if local_cache_size > 0 then
+    rule.local_cache = {
+      cur = {},
+      prev = {},
+      nelts = 0,
+      max = math.ceil(local_cache_size / 2),
+    }
+  end
+
+  if cfg.version then
+    local version_refresh = tonumber(rule.version_refresh) or 600.0
+
+    local function update_version(ev_base)
+      cfg.version(rule, ev_base, function(ver)
+        if ver and ver ~= rule.sig_version then
+          rspamd_logger.infox(rspamd_config, '%s [%s]: signatures version: %s',
+              rule['symbol'], rule['type'], ver)
+          rule.sig_version = ver
+        end
+      end)
+    end
+
+    rspamd_config:add_on_load(function(_, ev_base, worker)
+      if not worker:is_scanner() then return end
+
+      update_version(ev_base)
+      rspamd_config:add_periodic(ev_base, version_refresh, function()
+        update_version(ev_base)
+        return true
+      end)
+    end)
+  end
+
   if type(opts['patterns']) == 'table' then
     rule['patterns'] = {}
     if opts['patterns'][1] then
@@ -33,6 +33,7 @@ local settings = {
   common_ttl = 10 * 86400, -- TTL of discriminated common elements
   significant_factor = 3.0 / 4.0, -- which tokens should we update
   lazy = false, -- enable lazy expiration mode
+  native = true, -- expire tokens by rspamd itself using batched redis scripts
   classifiers = {},
   cluster_nodes = 0,
 }
@@ -142,6 +143,18 @@ if opts then
   end
 end
 
+-- Classifiers with positive expiry are expired natively by the primary
+-- controller or by a dedicated bayes_expiry worker
+if settings.native then
+  local lua_classifiers = {}
+  for _,cls in ipairs(settings.classifiers) do
+    if (tonumber(cls.expiry) or 0) <= 0 then
+      table.insert(lua_classifiers, cls)
+    end
+  end
+  settings.classifiers = lua_classifiers
+end
+
 -- In clustered setup, we need to increase interval of expiration
 -- according to number of nodes in a cluster
 if settings.cluster_nodes == 0 then
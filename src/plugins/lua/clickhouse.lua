@@ -19,6 +19,7 @@ local rspamd_lua_utils = require "lua_util"
 local upstream_list = require "rspamd_upstream_list"
 local lua_util = require "lua_util"
 local lua_clickhouse = require "lua_clickhouse"
+local rspamd_rows = require "rspamd_rows"
 local fun = require "fun"
 
 local N = "clickhouse"
@@ -27,7 +28,7 @@ if confighelp then
   return
 end
 
-local data_rows = {}
+local data_rows = rspamd_rows.create()
 local custom_rows = {}
 local nrows = 0
 local schema_version = 2 -- Current schema version
@@ -572,13 +573,14 @@ local function clickhouse_collect(task)
   end
 
   nrows = nrows + 1
-  table.insert(data_rows, row)
+  -- Row is serialised immediately, so its table is not kept until flush
+  data_rows:add_row(row)
   lua_util.debugm(N, task, "add clickhouse row %s / %s", nrows, settings.limit)
 
   if nrows > settings['limit'] then
     clickhouse_send_data(task)
     nrows = 0
-    data_rows = {}
+    data_rows:reset()
     custom_rows = {}
   end
 end
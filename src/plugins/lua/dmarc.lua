@@ -22,6 +22,7 @@ local mempool = require "rspamd_mempool"
 local rspamd_tcp = require "rspamd_tcp"
 local rspamd_url = require "rspamd_url"
 local rspamd_util = require "rspamd_util"
+local rspamd_dmarc = require "rspamd_dmarc"
 local rspamd_redis = require "lua_redis"
 local lua_util = require "lua_util"
 local check_local = false
@@ -206,88 +207,6 @@ local function maybe_force_action(task, disposition)
   end
 end
 
---[[
--- Used to check dmarc record, check elements and produce dmarc policy processed
--- result.
--- Returns:
---     false,false - record is garbadge
---     false,error_message - record is invalid
---     true,policy_table - record is valid and parsed
-]]
-local function dmarc_check_record(task, record, is_tld)
-  local failed_policy
-  local result = {
-    dmarc_policy = 'none'
-  }
-
-  local elts = dmarc_grammar:match(record)
-  lua_util.debugm(N, task, "got DMARC record: %s, tld_flag=%s, processed=%s",
-      record, is_tld, elts)
-
-  if elts then
-    local dkim_pol = elts['adkim']
-    if dkim_pol then
-      if dkim_pol == 's' then
-        result.strict_dkim = true
-      elseif dkim_pol ~= 'r' then
-        failed_policy = 'adkim tag has invalid value: ' .. dkim_pol
-        return false,failed_policy
-      end
-    end
-
-    local spf_pol = elts['aspf']
-    if spf_pol then
-      if spf_pol == 's' then
-        result.strict_spf = true
-      elseif spf_pol ~= 'r' then
-        failed_policy = 'aspf tag has invalid value: ' .. spf_pol
-        return false,failed_policy
-      end
-    end
-
-    local policy = elts['p']
-    if policy then
-      if (policy == 'reject') then
-        result.dmarc_policy = 'reject'
-      elseif (policy == 'quarantine') then
-        result.dmarc_policy = 'quarantine'
-      elseif (policy ~= 'none') then
-        failed_policy = 'p tag has invalid value: ' .. policy
-        return false,failed_policy
-      end
-    end
-
-    -- Adjust policy if we are in tld mode
-    local subdomain_policy = elts['sp']
-    if elts['sp'] and is_tld then
-      result.subdomain_policy = elts['sp']
-
-      if (subdomain_policy == 'reject') then
-        result.dmarc_policy = 'reject'
-      elseif (subdomain_policy == 'quarantine') then
-        result.dmarc_policy = 'quarantine'
-      elseif (subdomain_policy == 'none') then
-        result.dmarc_policy = 'none'
-      elseif (subdomain_policy ~= 'none') then
-        failed_policy = 'sp tag has invalid value: ' .. subdomain_policy
-        return false,failed_policy
-      end
-    end
-    result.pct = elts['pct']
-    if result.pct then
-      result.pct = tonumber(result.pct)
-    end
-
-    if elts.rua then
-      result.rua = elts['rua']
-    end
-  else
-    return false,false -- Ignore garbadge
-  end
-
-  return true, result
-end
-
 local function dmarc_validate_policy(task, policy, hdrfromdom, dmarc_esld)
   local reason = {}
 
@@ -604,7 +523,7 @@ local function dmarc_callback(task)
       policy_target = dmarc_tld_policy
     end
 
-    return function (_, _, results, err)
+    return function (_, records, err)
       dns_checks_inflight = dns_checks_inflight - 1
 
       if not seen_invalid then
@@ -622,8 +541,10 @@ local function dmarc_callback(task)
         else
           local has_valid_policy = false
 
-          for _,rec in ipairs(results) do
-            local ret,results_or_err = dmarc_check_record(task, rec, is_tld)
+          for _,rec in ipairs(records) do
+            local ret,results_or_err = rec:to_table(is_tld)
+            lua_util.debugm(N, task, "got DMARC record for %s, tld_flag=%s, processed=%s",
+                lookup_domain, is_tld, results_or_err)
 
             if not ret then
               if results_or_err then
@@ -664,28 +585,15 @@ local function dmarc_callback(task)
     end
   end
 
-  local resolve_name = '_dmarc.' .. hfromdom
-
-  task:get_resolver():resolve_txt({
-    task=task,
-    name = resolve_name,
-    callback = gen_dmarc_cb(hfromdom, false),
-    forced = true
-  })
+  -- Parsed records are cached, so callbacks might be called immediately
   dns_checks_inflight = dns_checks_inflight + 1
 
   if dmarc_domain ~= hfromdom then
-    resolve_name = '_dmarc.' .. dmarc_domain
-
-    task:get_resolver():resolve_txt({
-      task=task,
-      name = resolve_name,
-      callback = gen_dmarc_cb(dmarc_domain, true),
-      forced = true
-    })
-
     dns_checks_inflight = dns_checks_inflight + 1
+    rspamd_dmarc.resolve(task, dmarc_domain, gen_dmarc_cb(dmarc_domain, true))
   end
+
+  rspamd_dmarc.resolve(task, hfromdom, gen_dmarc_cb(hfromdom, false))
 end
 
 
@@ -105,6 +105,8 @@ local function envelope_key(task)
   h:update(addr)
   local rcpt = task:get_recipients('smtp')
   if rcpt then
+    -- Recipients table is shared between all callers, so sort a copy
+    rcpt = fun.totable(rcpt)
     table.sort(rcpt, function(r1, r2)
       return r1['addr'] < r2['addr']
     end)
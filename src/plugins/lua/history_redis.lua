@@ -25,6 +25,8 @@ local settings = {
   key_prefix = 'rs_history', -- default key name
   nrows = 200, -- default rows limit
   compress = true, -- use zstd compression when storing data in redis
+  batch_rows = 10, -- rows to accumulate in a worker before writing them
+  batch_timeout = 2.0, -- max time to keep accumulated rows (seconds)
   subject_privacy = false, -- subject privacy is off
   subject_privacy_alg = 'blake2', -- default hash-algorithm to obfuscate subject
   subject_privacy_prefix = 'obf', -- prefix to show it's obfuscated
@@ -41,6 +43,49 @@ local E = {}
 local N = "history_redis"
 local hostname = rspamd_util.get_hostname()
 
+-- Rows are stored in redis in batches encoded as msgpack arrays
+-- KEYS[1] - list of batches
+-- KEYS[2] - list of rows count for each batch
+-- KEYS[3] - set of all history lists
+-- ARGV[1] - batch data
+-- ARGV[2] - rows in batch
+-- ARGV[3] - max rows to keep
+local history_push_script = [[
+  redis.call('LPUSH', KEYS[1], ARGV[1])
+  redis.call('LPUSH', KEYS[2], ARGV[2])
+  redis.call('SADD', KEYS[3], KEYS[1])
+
+  local counts = redis.call('LRANGE', KEYS[2], 0, -1)
+  local total, max_rows = 0, tonumber(ARGV[3])
+
+  for i,c in ipairs(counts) do
+    total = total + tonumber(c)
+    if total >= max_rows then
+      redis.call('LTRIM', KEYS[1], 0, i - 1)
+      redis.call('LTRIM', KEYS[2], 0, i - 1)
+      break
+    end
+  end
+
+  return total
+]]
+local history_push_id
+
+-- Rows accumulated in this worker
+local pending_rows = {}
+local pending_since = 0
+
+local function history_keys()
+  local prefix = settings.key_prefix .. hostname .. '_batch'
+
+  if settings.compress then
+    -- Distinguish between compressed and non-compressed options
+    prefix = prefix .. '_zst'
+  end
+
+  return prefix, prefix .. '_counts'
+end
+
 local function process_addr(addr)
   if addr then
     return addr.addr
@@ -91,21 +136,41 @@ local function normalise_results(tbl, task)
   tbl.user = task:get_user() or 'unknown'
 end
 
-local function history_save(task)
-  local function redis_llen_cb(err, _)
+local function history_flush(task, ev_base)
+  if #pending_rows == 0 then
+    return
+  end
+
+  local rows = pending_rows
+  pending_rows = {}
+  local prefix, counts_key = history_keys()
+  local data = ucl.to_format(rows, 'msgpack')
+
+  if settings.compress then
+    data = rspamd_util.zstd_compress(data)
+  end
+
+  local function history_push_cb(err, _)
     if err then
-      rspamd_logger.errx(task, 'got error %s when writing history row: %s',
-          err)
+      rspamd_logger.errx(task or rspamd_config,
+          'got error %s when writing %s history rows', err, #rows)
     end
   end
 
+  lua_redis.exec_redis_script(history_push_id,
+      {task = task, ev_base = ev_base, is_write = true},
+      history_push_cb,
+      {prefix, counts_key, settings.key_prefix},
+      {data, tostring(#rows), tostring(settings.nrows)})
+end
+
+local function history_save(task)
   -- We skip saving it to the history
   if task:has_flag('no_log') then
     return
   end
 
   local data = task:get_protocol_reply{'metrics', 'basic'}
-  local prefix = settings.key_prefix .. hostname
 
   if data then
     normalise_results(data, task)
@@ -113,39 +178,23 @@ local function history_save(task)
     rspamd_logger.errx('cannot get protocol reply, skip saving in history')
     return
   end
-  -- 1 is 'json-compact' but faster
-  local json = ucl.to_format(data, 1)
 
-  if settings.compress then
-    json = rspamd_util.zstd_compress(json)
-    -- Distinguish between compressed and non-compressed options
-    prefix = prefix .. '_zst'
+  if #pending_rows == 0 then
+    pending_since = rspamd_util.get_time()
   end
 
-  local ret, conn, _ = lua_redis.rspamd_redis_make_request(task,
-    redis_params, -- connect params
-    nil, -- hash key
-    true, -- is write
-    redis_llen_cb, --callback
-    'LPUSH', -- command
-    {prefix, json} -- arguments
-  )
-
-  if ret then
-    conn:add_cmd('LTRIM', {prefix, '0', string.format('%d', settings.nrows-1)})
-    conn:add_cmd('SADD', {settings.key_prefix, prefix})
+  table.insert(pending_rows, data)
+
+  if #pending_rows >= settings.batch_rows then
+    history_flush(task)
   end
 end
 
 local function handle_history_request(task, conn, from, to, reset)
-  local prefix = settings.key_prefix .. hostname
-  if settings.compress then
-    -- Distinguish between compressed and non-compressed options
-    prefix = prefix .. '_zst'
-  end
+  local prefix, counts_key = history_keys()
 
   if reset then
-    local function redis_ltrim_cb(err, _)
+    local function redis_del_cb(err, _)
       if err then
         rspamd_logger.errx(task, 'got error %s when resetting history: %s',
           err)
@@ -158,9 +207,9 @@ local function handle_history_request(task, conn, from, to, reset)
       redis_params, -- connect params
       nil, -- hash key
       true, -- is write
-      redis_ltrim_cb, --callback
-      'LTRIM', -- command
-      {prefix, '0', '0'} -- arguments
+      redis_del_cb, --callback
+      'DEL', -- command
+      {prefix, counts_key} -- arguments
     )
   else
     local function redis_lrange_cb(err, data)
@@ -168,44 +217,43 @@ local function handle_history_request(task, conn, from, to, reset)
         local reply = {
           version = 2,
         }
-        if settings.compress then
-          local t1 = rspamd_util:get_ticks()
-
-          data = fun.totable(fun.filter(function(e) return e ~= nil end,
-            fun.map(function(e)
-              local _,dec = rspamd_util.zstd_decompress(e)
-              if dec then
-                return dec
-              end
-              return nil
-            end, data)))
-          lua_util.debugm(N, task, 'decompress took %s ms',
-              (rspamd_util:get_ticks() - t1) * 1000.0)
-          collectgarbage()
-        end
-        -- Parse elements using ucl
+        local rows = {}
         local t1 = rspamd_util:get_ticks()
-        data = fun.totable(
-          fun.map(function (_, obj) return obj end,
-          fun.filter(function(res, obj)
-              if res then
-                return true
-              end
-              return false
-            end,
-            fun.map(function(elt)
-              local parser = ucl.parser()
-              local res,_ = parser:parse_text(elt)
-
-              if res then
-                return true, parser:get_object()
-              else
-                return false, nil
+
+        -- Batches are stored from the newest to the oldest, rows in each
+        -- batch are stored from the oldest to the newest
+        for _,elt in ipairs(data) do
+          local dec = elt
+
+          if settings.compress then
+            _,dec = rspamd_util.zstd_decompress(elt)
+          end
+
+          if dec then
+            local parser = ucl.parser()
+            local res,_ = parser:parse_text(dec, 'msgpack')
+
+            if res then
+              local batch = parser:get_object()
+
+              for i = #batch,1,-1 do
+                table.insert(rows, batch[i])
               end
-            end, data))))
-        lua_util.debugm(N, task, 'parse took %s ms',
+            end
+          end
+        end
+        lua_util.debugm(N, task, 'decompress and parse took %s ms',
             (rspamd_util:get_ticks() - t1) * 1000.0)
+
+        -- Select the requested rows
+        local last = math.min(to + 1, #rows)
+        data = {}
+        for i = from + 1,last do
+          table.insert(data, rows[i])
+        end
+        rows = nil
         collectgarbage()
+
         t1 = rspamd_util:get_ticks()
         fun.each(function(e)
           if e.subject and not rspamd_util.is_valid_utf8(e.subject) then
@@ -227,13 +275,14 @@ local function handle_history_request(task, conn, from, to, reset)
         conn:send_error(504, '{"error": "' .. err .. '"}')
       end
     end
+    -- Rows are batched, so we need all batches to select rows
     lua_redis.rspamd_redis_make_request(task,
       redis_params, -- connect params
       nil, -- hash key
       false, -- is write
       redis_lrange_cb, --callback
       'LRANGE', -- command
-      {prefix, string.format('%d', from), string.format('%d', to)}, -- arguments
+      {prefix, '0', '-1'}, -- arguments
       {opaque_data = true}
     )
   end
@@ -250,6 +299,8 @@ if opts then
     rspamd_logger.infox(rspamd_config, 'no servers are specified, disabling module')
     lua_util.disable_module(N, "redis")
   else
+    history_push_id = lua_redis.add_redis_script(history_push_script,
+        redis_params)
     rspamd_config:register_symbol({
       name = 'HISTORY_SAVE',
       type = 'idempotent',
@@ -257,6 +308,22 @@ if opts then
       flags = 'empty',
       priority = 150
     })
+    rspamd_config:register_finish_script(function(task)
+      history_flush(task)
+    end)
+    -- Write rows that have not reached batch_rows for too long
+    rspamd_config:add_on_load(function(_, ev_base, worker)
+      if worker:is_scanner() then
+        rspamd_config:add_periodic(ev_base, settings.batch_timeout, function()
+          if #pending_rows > 0 and
+              rspamd_util.get_time() - pending_since >= settings.batch_timeout then
+            history_flush(nil, ev_base)
+          end
+
+          return true
+        end)
+      end
+    end)
     rspamd_plugins['history'] = {
       handler = handle_history_request
     }
@@ -32,9 +32,15 @@ local rspamd_dns = require "rspamd_dns"
 local lua_selectors = require "lua_selectors"
 local redis_params
 local fun = require "fun"
+local rspamd_map_group = require "rspamd_map_group"
 local N = 'multimap'
 
 local urls = {}
+-- Radix and hash maps of all rules are checked by a single lookup per value
+local map_groups = {
+  radix = {group = rspamd_map_group.create(), idx = {}},
+  hash = {group = rspamd_map_group.create(), idx = {}},
+}
 
 local value_types = {
   ip = {
@@ -431,6 +437,24 @@ local function multimap_callback(task, rule)
       )
 
       return ret
+    elseif r['map_group'] then
+      -- The first rule checks value against all maps in the group and
+      -- other rules just take their results from the task cache
+      local cache_key = 'multimap_' .. r['map_group']
+      local cache = task:cache_get(cache_key)
+      if not cache then
+        cache = {}
+        task:cache_set(cache_key, cache)
+      end
+
+      local skey = tostring(value)
+      local res = cache[skey]
+      if not res then
+        res = map_groups[r['map_group']].group:get_key(value)
+        cache[skey] = res
+      end
+
+      ret = res[r['map_group_idx']] or false
     elseif r['radix'] then
       ret = r['radix']:get_key(value)
     elseif r['hash'] then
@@ -877,6 +901,30 @@ local function gen_multimap_callback(rule)
   end
 end
 
+local function add_map_group(rule)
+  local name, map
+
+  if rule['radix'] then
+    name, map = 'radix', rule['radix']
+  elseif rule['hash'] and not rule['regexp'] and not rule['glob'] then
+    name, map = 'hash', rule['hash']
+  else
+    return
+  end
+
+  local grp = map_groups[name]
+  -- Rules that share the same map share its index as well
+  local idx = grp.idx[map]
+  if not idx then
+    idx = grp.group:add(map)
+    if not idx then return end
+    grp.idx[map] = idx
+  end
+
+  rule['map_group'] = name
+  rule['map_group_idx'] = idx
+end
+
 local function add_multimap_rule(key, newrule)
   local ret = false
 
@@ -1153,6 +1201,7 @@ if opts and type(opts) == 'table' then
       else
         rspamd_logger.infox(rspamd_config, 'added multimap rule: %s (%s)',
             k, rule.type)
+        add_map_group(rule)
         table.insert(rules, rule)
       end
     end
@@ -21,12 +21,16 @@ end
 
 local rspamd_logger = require "rspamd_logger"
 local rspamd_fann = require "rspamd_fann"
+local rspamd_mlp = require "rspamd_mlp"
 local rspamd_util = require "rspamd_util"
 local lua_redis = require "lua_redis"
 local lua_util = require "lua_util"
 local fun = require "fun"
 local meta_functions = require "lua_meta"
 local use_torch = false
+local use_mlp = false
+-- Either rspamd_fann or rspamd_mlp as they share the same interface
+local ann_lib = rspamd_fann
 local torch
 local nn
 local N = "neural"
@@ -47,6 +51,7 @@ local default_options = {
     train_prob = 1.0,
     learn_threads = 1,
     learning_rate = 0.01,
+    batch_size = 64, -- Native MLP only
   },
   use_settings = false,
   per_user = false,
@@ -223,6 +228,8 @@ local function gen_ann_prefix(rule, id)
   local tprefix = ''
   if use_torch then
     tprefix = 't';
+  elseif use_mlp then
+    tprefix = 'm';
   end
   if id then
     return string.format('%s%s%s%d%s', tprefix, rule.prefix, cksum, n, id), id
@@ -327,7 +334,7 @@ local function create_ann(n, nlayers)
       div = div * 2
     end
     table.insert(layers, 1)
-    return rspamd_fann.create(nlayers, layers)
+    return ann_lib.create(nlayers, layers)
   end
 end
 
@@ -378,7 +385,7 @@ local function load_or_invalidate_ann(rule, data, id, ev_base)
     if use_torch then
       ann = torch.MemoryFile(torch.CharStorage():string(tostring(ann_data))):readObject()
     else
-      ann = rspamd_fann.load_data(ann_data)
+      ann = ann_lib.load_data(ann_data)
     end
   end
 
@@ -699,7 +706,11 @@ local function train_ann(rule, _, ev_base, elt, worker)
           rule.anns[elt].ann_train:train_threaded(inputs, outputs, ann_trained,
             ev_base, {
               max_epochs = rule.train.max_epoch,
-              desired_mse = rule.train.mse
+              desired_mse = rule.train.mse,
+              -- Used by native MLP only
+              learning_rate = rule.train.learning_rate,
+              batch_size = rule.train.batch_size,
+              threads = rule.train.learn_threads,
             })
         end
 
@@ -933,12 +944,13 @@ if not (opts and type(opts) == 'table') or not redis_params then
   return
 end
 
-if not rspamd_fann.is_enabled() and not use_torch then
-  rspamd_logger.errx(rspamd_config, 'neural networks support is not compiled in rspamd, this ' ..
-    'module is eventually disabled')
-  lua_util.disable_module(N, "fail")
-  return
-else
+if opts.use_mlp or (not rspamd_fann.is_enabled() and not use_torch) then
+  -- Native implementation is always available
+  use_mlp = true
+  ann_lib = rspamd_mlp
+end
+
+do
   local rules = opts['rules']
 
   if not rules then
@@ -947,7 +959,7 @@ else
     rules['RFANN'] = opts
   end
 
-  if opts.disable_torch then
+  if opts.disable_torch or use_mlp then
     use_torch = false
   else
     torch = require "torch"
@@ -59,43 +59,25 @@ local function phishing_cb(task)
 
     if host then
       local elt = map[host]
-      local found_path = false
-      local found_query = false
-      local data = nil
 
       if elt then
         local path = url:get_path()
-        local query = url:get_query()
-
-        if path then
-          for _,d in ipairs(elt) do
-            if d['path'] == path then
-              found_path = true
-              data = d['data']
-
-              if query and d['query'] and query == d['query'] then
-                found_query = true
-              elseif not d['query'] then
-                found_query = true
-              end
-            end
-          end
-        else
-          for _,d in ipairs(elt) do
-            if not d['path'] then
-              found_path = true
-            end
+        -- Feed entries are indexed by host and then by path
+        local pelts = elt[path or '']
 
-            if query and d['query'] and query == d['query'] then
-              found_query = true
-            elseif not d['query'] then
+        if pelts then
+          local query = url:get_query()
+          local found_query = false
+          local data = nil
+          local args
+
+          for _,d in ipairs(pelts) do
+            data = d['data']
+
+            if not d['query'] or (query and query == d['query']) then
               found_query = true
             end
           end
-        end
-
-        if found_path then
-          local args
 
           if type(data) == 'table' then
             args = {
@@ -182,7 +164,7 @@ local function phishing_cb(task)
 
   local urls = task:get_urls()
 
-  if urls then
+  if urls and (generic_service_hash or openphish_hash or phishtank_enabled) then
     for _,url in ipairs(urls) do
       if generic_service_hash then
         check_phishing_map(generic_service_data, url, generic_service_symbol)
@@ -195,89 +177,64 @@ local function phishing_cb(task)
       if phishtank_enabled then
         check_phishing_dns(phishtank_suffix, url, phishtank_symbol)
       end
+    end
+  end
 
-      if url:is_phished() and not url:is_redirected() then
-        local purl = url:get_phished()
-        local tld = url:get_tld()
-        local ptld = purl:get_tld()
-
-        if not ptld or not tld then
-          return
-        end
-
-        -- Now we can safely remove the last dot component if it is the same
-        local b,_ = string.find(tld, '%.[^%.]+$')
-        local b1,_ = string.find(ptld, '%.[^%.]+$')
-
-        if b1 and b then
-          if string.sub(tld, b) == string.sub(ptld, b1) then
-            ptld = string.gsub(ptld, '%.[^%.]+$', '')
-            tld = string.gsub(tld, '%.[^%.]+$', '')
-          end
-
-          if #ptld == 0 or #tld == 0 then
-            return false
-          end
-        end
+  -- Domains of displayed and real urls are compared in C once per task
+  for _,pu in ipairs(task:get_phished_urls()) do
+    local url, purl = pu.url, pu.phished
+    local tld, ptld = pu.tld, pu.phished_tld
+    local weight = 1.0
+    local spoofed,why = util.is_utf_spoofed(tld, ptld)
 
-        local weight = 1.0
-        local spoofed,why = util.is_utf_spoofed(tld, ptld)
-        if spoofed then
-          lua_util.debugm(N, task, "confusable: %1 -> %2: %3", tld, ptld, why)
-          weight = 1.0
+    if spoofed then
+      lua_util.debugm(N, task, "confusable: %1 -> %2: %3", tld, ptld, why)
+      weight = 1.0
+    else
+      local dist = pu.dist
+
+      if dist > 0.3 and dist <= 1.0 then
+        -- Use distance to penalize the total weight
+        weight = util.tanh(3 * (1 - dist + 0.1))
+      elseif dist > 1 then
+        -- We also check if two labels are in the same ascii/non-ascii representation
+        if pu.ascii_mismatch then
+          weight = 1
+          lua_util.debugm(N, task, "confusable: %1 -> %2: different characters",
+            tld, ptld, why)
         else
-          local dist = util.levenshtein_distance(tld, ptld, 2)
-          dist = 2 * dist / (#tld + #ptld)
-
-          if dist > 0.3 and dist <= 1.0 then
-            -- Use distance to penalize the total weight
-            weight = util.tanh(3 * (1 - dist + 0.1))
-          elseif dist > 1 then
-            -- We also check if two labels are in the same ascii/non-ascii representation
-            local a1, a2 = false,false
-
-            if string.match(tld, '^[\001-\127]*$') then a1 = true end
-            if string.match(ptld, '^[\001-\127]*$') then a2 = true end
-
-            if a1 ~= a2 then
-              weight = 1
-              lua_util.debugm(N, task, "confusable: %1 -> %2: different characters",
-                tld, ptld, why)
-            else
-              -- We have totally different strings in tld, so penalize it significantly
-              if dist > 2 then dist = 2 end
-              weight = util.tanh((2 - dist) * 0.5)
-            end
-          end
-
-          lua_util.debugm(N, task, "distance: %1 -> %2: %3", tld, ptld, dist)
+          -- We have totally different strings in tld, so penalize it significantly
+          if dist > 2 then dist = 2 end
+          weight = util.tanh((2 - dist) * 0.5)
         end
+      end
 
-        local function found_in_map(map, furl, sweight)
-          if not furl then furl = url end
-          if not sweight then sweight = weight end
-          if #map > 0 then
-            for _,rule in ipairs(map) do
-                for _,dn in ipairs({furl:get_tld(), furl:get_host()}) do
-                  if rule['map']:get_key(dn) then
-                    task:insert_result(rule['symbol'], sweight, ptld .. '->' .. dn)
-                    return true
-                  end
-                end
-            end
-          end
-        end
+      lua_util.debugm(N, task, "distance: %1 -> %2: %3", tld, ptld, dist)
+    end
 
-        if not found_in_map(redirector_domains) then
-          if not found_in_map(strict_domains, purl, 1.0) then
-            if domains then
-              if domains:get_key(ptld) then
-                task:insert_result(symbol, weight, ptld .. '->' .. tld)
+    local function found_in_map(map, furl, sweight)
+      if not furl then furl = url end
+      if not sweight then sweight = weight end
+      if #map > 0 then
+        for _,rule in ipairs(map) do
+            for _,dn in ipairs({furl:get_tld(), furl:get_host()}) do
+              if rule['map']:get_key(dn) then
+                task:insert_result(rule['symbol'], sweight, ptld .. '->' .. dn)
+                return true
               end
-            else
-              task:insert_result(symbol, weight, ptld .. '->' .. tld)
             end
+        end
+      end
+    end
+
+    if not found_in_map(redirector_domains) then
+      if not found_in_map(strict_domains, purl, 1.0) then
+        if domains then
+          if domains:get_key(ptld) then
+            task:insert_result(symbol, weight, ptld .. '->' .. tld)
           end
+        else
+          task:insert_result(symbol, weight, ptld .. '->' .. tld)
         end
       end
     end
@@ -345,16 +302,22 @@ local function insert_url_from_string(pool, tbl, str, data)
   if u then
     local host = u:get_host()
     if host then
+      local path = u:get_path() or ''
       local elt = {
         data = data,
-        path = u:get_path(),
         query = u:get_query()
       }
+      local helt = tbl[host]
+
+      if not helt then
+        helt = {}
+        tbl[host] = helt
+      end
 
-      if tbl[host] then
-        table.insert(tbl[host], elt)
+      if helt[path] then
+        table.insert(helt[path], elt)
       else
-        tbl[host] = {elt}
+        helt[path] = {elt}
       end
 
       return true
@@ -49,146 +49,154 @@ local settings = {
   expire = 60 * 60 * 24 * 2, -- 2 days by default
   limits = {},
   allow_local = false,
+  -- Skip redis checks for buckets that are far from the limit according to
+  -- the last known state in this worker
+  local_shadow = false,
+  local_shadow_ratio = 0.5, -- fraction of burst considered as safe
+  local_shadow_time = 10, -- seconds to trust the last known state
+  local_shadow_buckets = 10000, -- max buckets to remember
 }
 
--- Checks bucket, updating it if needed
--- KEYS[1] - prefix to update, e.g. RL_<triplet>_<seconds>
--- KEYS[2] - current time in milliseconds
--- KEYS[3] - bucket leak rate (messages per millisecond)
--- KEYS[4] - bucket burst
--- KEYS[5] - expire for a bucket
--- return 1 if message should be ratelimited and 0 if not
+-- Checks buckets, updating them if needed
+-- KEYS - prefixes to check, e.g. RL_<triplet>_<seconds>
+-- ARGV[1] - current time in milliseconds
+-- ARGV[2] - expire for a bucket
+-- ARGV[3 + 2 * i] - bucket leak rate (messages per millisecond)
+-- ARGV[4 + 2 * i] - bucket burst
+-- returns a table of {1 if message should be ratelimited and 0 if not,
+--   burst, dynamic rate, dynamic burst, leaked} for each bucket
 -- Redis keys used:
 --   l - last hit
 --   b - current burst
 --   dr - current dynamic rate multiplier (*10000)
 --   db - current dynamic burst multiplier (*10000)
 local bucket_check_script = [[
-  local last = redis.call('HGET', KEYS[1], 'l')
-  local now = tonumber(KEYS[2])
-  local dynr, dynb, leaked = 0, 0, 0
-  if not last then
-    -- New bucket
-    redis.call('HSET', KEYS[1], 'l', KEYS[2])
-    redis.call('HSET', KEYS[1], 'b', '0')
-    redis.call('HSET', KEYS[1], 'dr', '10000')
-    redis.call('HSET', KEYS[1], 'db', '10000')
-    redis.call('EXPIRE', KEYS[1], KEYS[5])
-    return {0, '0', '1', '1', '0'}
-  end
-
-  last = tonumber(last)
-  local burst = tonumber(redis.call('HGET', KEYS[1], 'b'))
-  -- Perform leak
-  if burst > 0 then
-   if last < tonumber(KEYS[2]) then
-    local rate = tonumber(KEYS[3])
-    dynr = tonumber(redis.call('HGET', KEYS[1], 'dr')) / 10000.0
-    if dynr == 0 then dynr = 0.0001 end
-    rate = rate * dynr
-    leaked = ((now - last) * rate)
-    burst = burst - leaked
-    redis.call('HINCRBYFLOAT', KEYS[1], 'b', -(leaked))
-    redis.call('HSET', KEYS[1], 'l', KEYS[2])
-   end
-  else
-   burst = 0
-   redis.call('HSET', KEYS[1], 'b', '0')
-  end
+  local now = tonumber(ARGV[1])
+  local res = {}
+
+  for i,key in ipairs(KEYS) do
+    local last = redis.call('HGET', key, 'l')
+    local dynr, dynb, leaked = 0, 0, 0
+    local max_rate = tonumber(ARGV[1 + 2 * i])
+    local max_burst = tonumber(ARGV[2 + 2 * i])
+
+    if not last then
+      -- New bucket
+      redis.call('HSET', key, 'l', ARGV[1])
+      redis.call('HSET', key, 'b', '0')
+      redis.call('HSET', key, 'dr', '10000')
+      redis.call('HSET', key, 'db', '10000')
+      redis.call('EXPIRE', key, ARGV[2])
+      res[i] = {0, '0', '1', '1', '0'}
+    else
+      last = tonumber(last)
+      local burst = tonumber(redis.call('HGET', key, 'b'))
+      -- Perform leak
+      if burst > 0 then
+        if last < now then
+          dynr = tonumber(redis.call('HGET', key, 'dr')) / 10000.0
+          if dynr == 0 then dynr = 0.0001 end
+          leaked = ((now - last) * max_rate * dynr)
+          burst = burst - leaked
+          redis.call('HINCRBYFLOAT', key, 'b', -(leaked))
+          redis.call('HSET', key, 'l', ARGV[1])
+        end
+      else
+        burst = 0
+        redis.call('HSET', key, 'b', '0')
+      end
+
+      dynb = tonumber(redis.call('HGET', key, 'db')) / 10000.0
+      if dynb == 0 then dynb = 0.0001 end
 
-  dynb = tonumber(redis.call('HGET', KEYS[1], 'db')) / 10000.0
-  if dynb == 0 then dynb = 0.0001 end
+      local limited = 0
+      if (burst + 1) > max_burst * dynb then
+        limited = 1
+      end
 
-  if (burst + 1) > tonumber(KEYS[4]) * dynb then
-   return {1, tostring(burst), tostring(dynr), tostring(dynb), tostring(leaked)}
+      res[i] = {limited, tostring(burst), tostring(dynr), tostring(dynb),
+                tostring(leaked)}
+    end
   end
 
-  return {0, tostring(burst), tostring(dynr), tostring(dynb), tostring(leaked)}
+  return res
 ]]
 local bucket_check_id
 
 
--- Updates a bucket
--- KEYS[1] - prefix to update, e.g. RL_<triplet>_<seconds>
--- KEYS[2] - current time in milliseconds
--- KEYS[3] - dynamic rate multiplier
--- KEYS[4] - dynamic burst multiplier
--- KEYS[5] - max dyn rate (min: 1/x)
--- KEYS[6] - max burst rate (min: 1/x)
--- KEYS[7] - expire for a bucket
+-- Updates buckets
+-- KEYS - prefixes to update, e.g. RL_<triplet>_<seconds>
+-- ARGV[1] - current time in milliseconds
+-- ARGV[2] - max dyn rate (min: 1/x)
+-- ARGV[3] - max burst rate (min: 1/x)
+-- ARGV[4] - expire for a bucket
+-- ARGV[3 + 2 * i] - dynamic rate multiplier
+-- ARGV[4 + 2 * i] - dynamic burst multiplier
+-- returns a table of {burst, dynamic rate, dynamic burst} for each bucket
 -- Redis keys used:
 --   l - last hit
 --   b - current burst
 --   dr - current dynamic rate multiplier
 --   db - current dynamic burst multiplier
 local bucket_update_script = [[
-  local last = redis.call('HGET', KEYS[1], 'l')
-  local now = tonumber(KEYS[2])
-  if not last then
-    -- New bucket
-    redis.call('HSET', KEYS[1], 'l', KEYS[2])
-    redis.call('HSET', KEYS[1], 'b', '1')
-    redis.call('HSET', KEYS[1], 'dr', '10000')
-    redis.call('HSET', KEYS[1], 'db', '10000')
-    redis.call('EXPIRE', KEYS[1], KEYS[7])
-    return {1, 1, 1}
-  end
-
-  local dr, db = 1.0, 1.0
-
-  if tonumber(KEYS[5]) > 1 then
-    local rate_mult = tonumber(KEYS[3])
-    local rate_limit = tonumber(KEYS[5])
-    dr = tonumber(redis.call('HGET', KEYS[1], 'dr')) / 10000
-
-    if rate_mult > 1.0 and dr < rate_limit then
-      dr = dr * rate_mult
-      if dr > 0.0001 then
-        redis.call('HSET', KEYS[1], 'dr', tostring(math.floor(dr * 10000)))
-      else
-        redis.call('HSET', KEYS[1], 'dr', '1')
-      end
-    elseif rate_mult < 1.0 and dr > (1.0 / rate_limit) then
-      dr = dr * rate_mult
-      if dr > 0.0001 then
-        redis.call('HSET', KEYS[1], 'dr', tostring(math.floor(dr * 10000)))
+  local max_dr = tonumber(ARGV[2])
+  local max_db = tonumber(ARGV[3])
+  local res = {}
+
+  local function update_mult(key, field, mult, limit)
+    local cur = tonumber(redis.call('HGET', key, field)) / 10000
+
+    if (mult > 1.0 and cur < limit) or (mult < 1.0 and cur > (1.0 / limit)) then
+      cur = cur * mult
+      if cur > 0.0001 then
+        redis.call('HSET', key, field, tostring(math.floor(cur * 10000)))
       else
-        redis.call('HSET', KEYS[1], 'dr', '1')
+        redis.call('HSET', key, field, '1')
       end
     end
+
+    return cur
   end
 
-  if tonumber(KEYS[6]) > 1 then
-    local rate_mult = tonumber(KEYS[4])
-    local rate_limit = tonumber(KEYS[6])
-    db = tonumber(redis.call('HGET', KEYS[1], 'db')) / 10000
+  for i,key in ipairs(KEYS) do
+    local last = redis.call('HGET', key, 'l')
 
-    if rate_mult > 1.0 and db < rate_limit then
-      db = db * rate_mult
-      if db > 0.0001 then
-        redis.call('HSET', KEYS[1], 'db', tostring(math.floor(db * 10000)))
-      else
-        redis.call('HSET', KEYS[1], 'db', '1')
+    if not last then
+      -- New bucket
+      redis.call('HSET', key, 'l', ARGV[1])
+      redis.call('HSET', key, 'b', '1')
+      redis.call('HSET', key, 'dr', '10000')
+      redis.call('HSET', key, 'db', '10000')
+      redis.call('EXPIRE', key, ARGV[4])
+      res[i] = {'1', '1', '1'}
+    else
+      local dr, db = 1.0, 1.0
+
+      if max_dr > 1 then
+        dr = update_mult(key, 'dr', tonumber(ARGV[3 + 2 * i]), max_dr)
       end
-    elseif rate_mult < 1.0 and db > (1.0 / rate_limit) then
-      db = db * rate_mult
-      if db > 0.0001 then
-        redis.call('HSET', KEYS[1], 'db', tostring(math.floor(db * 10000)))
-      else
-        redis.call('HSET', KEYS[1], 'db', '1')
+
+      if max_db > 1 then
+        db = update_mult(key, 'db', tonumber(ARGV[4 + 2 * i]), max_db)
       end
+
+      local burst = tonumber(redis.call('HGET', key, 'b'))
+      redis.call('HINCRBYFLOAT', key, 'b', 1)
+      redis.call('HSET', key, 'l', ARGV[1])
+      redis.call('EXPIRE', key, ARGV[4])
+
+      res[i] = {tostring(burst), tostring(dr), tostring(db)}
     end
   end
 
-  local burst = tonumber(redis.call('HGET', KEYS[1], 'b'))
-  redis.call('HINCRBYFLOAT', KEYS[1], 'b', 1)
-  redis.call('HSET', KEYS[1], 'l', KEYS[2])
-  redis.call('EXPIRE', KEYS[1], KEYS[7])
-
-  return {tostring(burst), tostring(dr), tostring(db)}
+  return res
 ]]
 local bucket_update_id
 
+-- Local shadow of buckets state: hash -> {burst, dynb, ts, hits}
+local shadow_buckets = {}
+local nshadow_buckets = 0
+
 -- message_func(task, limit_type, prefix, bucket)
 local message_func = function(_, limit_type, _, _)
   return string.format('Ratelimit "%s" exceeded', limit_type)
@@ -503,6 +511,71 @@ local function limit_to_prefixes(task, k, v, prefixes)
   return n
 end
 
+local function shadow_update(hash, burst, dynb, now)
+  if not settings.local_shadow or not burst then return end
+
+  local sb = shadow_buckets[hash]
+
+  if not sb then
+    if nshadow_buckets >= settings.local_shadow_buckets then
+      shadow_buckets = {}
+      nshadow_buckets = 0
+    end
+    sb = {}
+    shadow_buckets[hash] = sb
+    nshadow_buckets = nshadow_buckets + 1
+  end
+
+  sb.burst = burst
+  sb.dynb = dynb or 1.0
+  sb.ts = now
+  sb.hits = 0
+end
+
+-- Returns true if bucket is clearly under limit according to the local shadow
+local function shadow_check(hash, bucket, now)
+  local sb = shadow_buckets[hash]
+
+  if not sb or now - sb.ts > settings.local_shadow_time * 1000.0 then
+    return false
+  end
+
+  -- Leak is ignored here, so the estimation is pessimistic
+  if sb.burst + sb.hits + 1 < bucket.burst * sb.dynb * settings.local_shadow_ratio then
+    sb.hits = sb.hits + 1
+    return true
+  end
+
+  return false
+end
+
+-- Buckets are sharded over redis servers by their hash, so we can batch
+-- only buckets that belong to the same server
+local function batch_by_server(values)
+  local batches = {}
+
+  for _,v in ipairs(values) do
+    local up = redis_params.write_servers:get_upstream_by_hash(v.hash)
+    local id = ''
+
+    if up then
+      id = up:get_addr():to_string(true)
+    end
+
+    if not batches[id] then
+      batches[id] = {}
+    end
+    table.insert(batches[id], v)
+  end
+
+  return batches
+end
+
+local function batch_prefixes(batch)
+  return table.concat(fun.totable(fun.map(function(v)
+    return v.prefix end, batch)), ',')
+end
+
 local function ratelimit_cb(task)
   if not settings.allow_local and
           rspamd_lua_utils.is_rspamc_or_controller(task) then return end
@@ -560,38 +633,51 @@ local function ratelimit_cb(task)
     end
   end
 
-  local function gen_check_cb(prefix, bucket, lim_name)
+  local function process_check_result(value, data, now)
+    local bucket = value.bucket
+    local prefix, lim_name = value.prefix, value.name
+
+    lua_util.debugm(N, task,
+        "got reply for limit %s (%s / %s); %s burst, %s:%s dyn, %s leaked",
+        prefix, bucket.burst, bucket.rate,
+        data[2], data[3], data[4], data[5])
+    shadow_update(value.hash, tonumber(data[2]), tonumber(data[4]), now)
+
+    if data[1] == 1 then
+      -- set symbol only and do NOT soft reject
+      if settings.symbol then
+        task:insert_result(settings.symbol, 0.0, lim_name .. "(" .. prefix .. ")")
+        rspamd_logger.infox(task,
+            'set_symbol_only: ratelimit "%s(%s)" exceeded, (%s / %s): %s (%s:%s dyn)',
+            lim_name, prefix,
+            bucket.burst, bucket.rate,
+            data[2], data[3], data[4])
+        return
+        -- set INFO symbol and soft reject
+      elseif settings.info_symbol then
+        task:insert_result(settings.info_symbol, 1.0,
+            lim_name .. "(" .. prefix .. ")")
+      end
+      rspamd_logger.infox(task,
+          'ratelimit "%s(%s)" exceeded, (%s / %s): %s (%s:%s dyn)',
+          lim_name, prefix,
+          bucket.burst, bucket.rate,
+          data[2], data[3], data[4])
+      task:set_pre_result('soft reject',
+          message_func(task, lim_name, prefix, bucket), N)
+    end
+  end
+
+  local function gen_check_cb(batch, now)
     return function(err, data)
       if err then
-        rspamd_logger.errx('cannot check limit %s: %s %s', prefix, err, data)
-      elseif type(data) == 'table' and data[1] then
-        lua_util.debugm(N, task,
-            "got reply for limit %s (%s / %s); %s burst, %s:%s dyn, %s leaked",
-            prefix, bucket.burst, bucket.rate,
-            data[2], data[3], data[4], data[5])
-
-        if data[1] == 1 then
-          -- set symbol only and do NOT soft reject
-          if settings.symbol then
-            task:insert_result(settings.symbol, 0.0, lim_name .. "(" .. prefix .. ")")
-            rspamd_logger.infox(task,
-                'set_symbol_only: ratelimit "%s(%s)" exceeded, (%s / %s): %s (%s:%s dyn)',
-                lim_name, prefix,
-                bucket.burst, bucket.rate,
-                data[2], data[3], data[4])
-            return
-            -- set INFO symbol and soft reject
-          elseif settings.info_symbol then
-            task:insert_result(settings.info_symbol, 1.0,
-                lim_name .. "(" .. prefix .. ")")
+        rspamd_logger.errx('cannot check limits %s: %s %s',
+            batch_prefixes(batch), err, data)
+      elseif type(data) == 'table' then
+        for i,value in ipairs(batch) do
+          if type(data[i]) == 'table' and data[i][1] then
+            process_check_result(value, data[i], now)
           end
-          rspamd_logger.infox(task,
-              'ratelimit "%s(%s)" exceeded, (%s / %s): %s (%s:%s dyn)',
-              lim_name, prefix,
-              bucket.burst, bucket.rate,
-              data[2], data[3], data[4])
-          task:set_pre_result('soft reject',
-              message_func(task, lim_name, prefix, bucket), N)
         end
       end
     end
@@ -605,18 +691,40 @@ local function ratelimit_cb(task)
     task:cache_set('ratelimit_prefixes', prefixes)
     local now = rspamd_util.get_time()
     now = lua_util.round(now * 1000.0) -- Get milliseconds
-    -- Now call check script for all defined prefixes
+    local to_check = {}
 
     for pr,value in pairs(prefixes) do
       local bucket = value.bucket
-      local rate = (bucket.rate) / 1000.0 -- Leak rate in messages/ms
-      lua_util.debugm(N, task, "check limit %s:%s -> %s (%s/%s)",
-          value.name, pr, value.hash, bucket.burst, bucket.rate)
+      value.prefix = pr
+
+      if settings.local_shadow and shadow_check(value.hash, bucket, now) then
+        lua_util.debugm(N, task, "skip check for limit %s:%s -> %s (%s/%s): " ..
+            "far from limit according to the local state",
+            value.name, pr, value.hash, bucket.burst, bucket.rate)
+      else
+        lua_util.debugm(N, task, "check limit %s:%s -> %s (%s/%s)",
+            value.name, pr, value.hash, bucket.burst, bucket.rate)
+        table.insert(to_check, value)
+      end
+    end
+
+    -- Now call check script once for all buckets on each server
+    for _,batch in pairs(batch_by_server(to_check)) do
+      local keys = {}
+      local args = {tostring(now), tostring(settings.expire)}
+
+      for _,value in ipairs(batch) do
+        local bucket = value.bucket
+        local rate = (bucket.rate) / 1000.0 -- Leak rate in messages/ms
+        table.insert(keys, value.hash)
+        table.insert(args, tostring(rate))
+        table.insert(args, tostring(bucket.burst))
+      end
+
       lua_redis.exec_redis_script(bucket_check_id,
-              {key = value.hash, task = task, is_write = true},
-              gen_check_cb(pr, bucket, value.name),
-              {value.hash, tostring(now), tostring(rate), tostring(bucket.burst),
-                  tostring(settings.expire)})
+          {key = keys[1], task = task, is_write = true},
+          gen_check_cb(batch, now),
+          keys, args)
     end
   end
 end
@@ -634,41 +742,66 @@ local function ratelimit_update_cb(task)
     end
 
     local verdict = lua_util.get_task_verdict(task)
+    local now = rspamd_util.get_time()
+    now = lua_util.round(now * 1000.0) -- Get milliseconds
+    local to_update = {}
 
-    -- Update each bucket
     for k, v in pairs(prefixes) do
-      local bucket = v.bucket
-      local function update_bucket_cb(err, data)
-        if err then
-          rspamd_logger.errx(task, 'cannot update rate bucket %s: %s',
-                  k, err)
-        else
-          lua_util.debugm(N, task,
-              "updated limit %s:%s -> %s (%s/%s), burst: %s, dyn_rate: %s, dyn_burst: %s",
-              v.name, k, v.hash,
-              bucket.burst, bucket.rate,
-              data[1], data[2], data[3])
+      v.prefix = k
+      table.insert(to_update, v)
+    end
+
+    -- Update all buckets on each server at once
+    for _,batch in pairs(batch_by_server(to_update)) do
+      local keys = {}
+      local args = {tostring(now),
+                    tostring(settings.max_rate_mult),
+                    tostring(settings.max_bucket_mult),
+                    tostring(settings.expire)}
+
+      for _,v in ipairs(batch) do
+        local bucket = v.bucket
+        local mult_burst = 1.0
+        local mult_rate = 1.0
+
+        if verdict == 'spam' or verdict == 'junk' then
+          mult_burst = bucket.spam_factor_burst or 1.0
+          mult_rate = bucket.spam_factor_rate or 1.0
+        elseif verdict == 'ham' then
+          mult_burst = bucket.ham_factor_burst or 1.0
+          mult_rate = bucket.ham_factor_rate or 1.0
         end
+
+        table.insert(keys, v.hash)
+        table.insert(args, tostring(mult_rate))
+        table.insert(args, tostring(mult_burst))
       end
-      local now = rspamd_util.get_time()
-      now = lua_util.round(now * 1000.0) -- Get milliseconds
-      local mult_burst = 1.0
-      local mult_rate = 1.0
-
-      if verdict == 'spam' or verdict == 'junk' then
-        mult_burst = bucket.spam_factor_burst or 1.0
-        mult_rate = bucket.spam_factor_rate or 1.0
-      elseif verdict == 'ham' then
-        mult_burst = bucket.ham_factor_burst or 1.0
-        mult_rate = bucket.ham_factor_rate or 1.0
+
+      local function update_buckets_cb(err, data)
+        if err then
+          rspamd_logger.errx(task, 'cannot update rate buckets %s: %s',
+              batch_prefixes(batch), err)
+        elseif type(data) == 'table' then
+          for i,v in ipairs(batch) do
+            local res = data[i]
+
+            if type(res) == 'table' then
+              lua_util.debugm(N, task,
+                  "updated limit %s:%s -> %s (%s/%s), burst: %s, dyn_rate: %s, dyn_burst: %s",
+                  v.name, v.prefix, v.hash,
+                  v.bucket.burst, v.bucket.rate,
+                  res[1], res[2], res[3])
+              shadow_update(v.hash, (tonumber(res[1]) or 0) + 1,
+                  tonumber(res[3]), now)
+            end
+          end
+        end
       end
 
       lua_redis.exec_redis_script(bucket_update_id,
-              {key = v.hash, task = task, is_write = true},
-              update_bucket_cb,
-              {v.hash, tostring(now), tostring(mult_rate), tostring(mult_burst),
-               tostring(settings.max_rate_mult), tostring(settings.max_bucket_mult),
-               tostring(settings.expire)})
+          {key = keys[1], task = task, is_write = true},
+          update_buckets_cb,
+          keys, args)
     end
   end
 end
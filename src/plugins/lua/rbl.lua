@@ -486,14 +486,28 @@ local function rbl_cb (task)
     return false
   end, enabled_rbls))
 
+  -- All names are resolved in two batches with a single callback each
+  local batches = {[true] = {}, [false] = {}}
+  for to_resolve,p in pairs(params) do
+    table.insert(batches[p.forced], to_resolve)
+  end
+
+  local function batch_cb(_, replies)
+    for to_resolve,reply in pairs(replies) do
+      params[to_resolve].callback(nil, to_resolve, reply.results, reply.error)
+    end
+  end
+
   local r = task:get_resolver()
-  for _,p in pairs(params) do
-    r:resolve_a({
-      task = task,
-      name = p.to_resolve,
-      callback = p.callback,
-      forced = p.forced
-    })
+  for forced,names in pairs(batches) do
+    if #names > 0 then
+      r:resolve_batch({
+        task = task,
+        names = names,
+        callback = batch_cb,
+        forced = forced
+      })
+    end
   end
 end
 
@@ -891,6 +891,97 @@ local function reputation_dns_get_token(task, rule, token, continuation_cb)
   end
 end
 
+-- Worker local cache of token values: two generations, the current one is
+-- rotated to the previous one when full and hits in the previous one are
+-- promoted back
+local function reputation_cache_get(backend, token)
+  local cache = backend.cache
+  local elt = cache.cur[token]
+
+  if not elt then
+    elt = cache.prev[token]
+
+    if elt then
+      cache.prev[token] = nil
+      cache.cur[token] = elt
+      cache.nelts = cache.nelts + 1
+    end
+  end
+
+  return elt
+end
+
+local function reputation_cache_set(backend, token, values)
+  local cache = backend.cache
+  local now = rspamd_util.get_time()
+  local ttl = backend.config.local_cache_time
+
+  if ttl <= 0 then return end
+
+  if not cache.cur[token] then
+    cache.nelts = cache.nelts + 1
+
+    if cache.nelts > cache.max then
+      cache.prev = cache.cur
+      cache.cur = {}
+      cache.nelts = 1
+    end
+  end
+
+  cache.cur[token] = {
+    values = values,
+    expire = now + ttl,
+    refresh = now + ttl / 2.0,
+  }
+end
+
+-- Writes accumulated deltas for all pending tokens by a single script call
+local function reputation_redis_flush(rule, task, ev_base)
+  local backend = rule.backend
+
+  if backend.npending == 0 then return end
+
+  local keys = {tostring(rspamd_util.get_time()),
+                tostring(backend.config.expiry)}
+  local args = {}
+
+  for token,values in pairs(backend.pending) do
+    local nargs_pos = #args + 1
+    local nargs = 0
+
+    table.insert(keys, token)
+    table.insert(args, '')
+
+    for k,v in pairs(values) do
+      table.insert(args, k)
+      table.insert(args, tostring(v))
+      nargs = nargs + 2
+    end
+
+    args[nargs_pos] = tostring(nargs)
+  end
+
+  local ntokens = backend.npending
+  backend.pending = {}
+  backend.npending = 0
+
+  local function redis_set_cb(err)
+    if err then
+      rspamd_logger.errx(task or rspamd_config,
+          'rule %s - got error while setting reputation for %s tokens: %s',
+          rule['symbol'], ntokens, err)
+    end
+  end
+
+  local ret = lua_redis.exec_redis_script(backend.script_set,
+      {task = task, ev_base = ev_base or backend.ev_base, is_write = true},
+      redis_set_cb,
+      keys, args)
+  if not ret then
+    rspamd_logger.errx(task or rspamd_config, 'got error while connecting to redis')
+  end
+end
+
 local function reputation_redis_init(rule, cfg, ev_base, worker)
   local our_redis_params = {}
 
@@ -933,120 +1024,172 @@ end
   rule.backend.script_get = lua_redis.add_redis_script(table.concat(redis_script_tbl, '\n'),
       our_redis_params)
 
-  redis_script_tbl = {}
+  -- Set script updates a batch of tokens:
+  -- KEYS: now, expiry, token1 ... tokenN
+  -- ARGV: for each token number of arguments followed by key, value pairs
+  redis_script_tbl = {[[
+local now = tonumber(KEYS[1])
+local expiry = KEYS[2]
+local pos = 1
+for j=3,#KEYS do
+  local token = KEYS[j]
+  local nargs = tonumber(ARGV[pos])
+  local first = pos + 1
+  pos = pos + nargs + 1
+]]}
   local redis_set_script_tpl = [[
-local key = KEYS[1] .. '${name}'
-local last = tonumber(redis.call('HGET', key, 'start'))
-local now = tonumber(KEYS[2])
-if not last then
-  last = 0
-end
-local discriminate_bucket = false
-if now - last > ${time} then
-  discriminate_bucket = true
-  redis.call('HSET', key, 'start', now)
-end
-for i=1,#ARGV,2 do
-  local k = ARGV[i]
-  local v = tonumber(ARGV[i + 1])
-
-  if discriminate_bucket then
-    local last_value = redis.call('HGET', key, k)
-    if last_value then
-      redis.call('HSET', key, k, last_value / 2.0)
+  local key = token .. '${name}'
+  local last = tonumber(redis.call('HGET', key, 'start'))
+  if not last then
+    last = 0
+  end
+  local discriminate_bucket = false
+  if now - last > ${time} then
+    discriminate_bucket = true
+    redis.call('HSET', key, 'start', now)
+  end
+  for i=first,pos - 1,2 do
+    local k = ARGV[i]
+    local v = tonumber(ARGV[i + 1])
+
+    if discriminate_bucket then
+      local last_value = redis.call('HGET', key, k)
+      if last_value then
+        redis.call('HSET', key, k, last_value / 2.0)
+      end
     end
+    redis.call('HINCRBYFLOAT', key, k, v)
   end
-  redis.call('HINCRBYFLOAT', key, k, v)
-end
 
-redis.call('EXPIRE', key, KEYS[3])
-redis.call('HSET', key, 'last', now)
+  redis.call('EXPIRE', key, expiry)
+  redis.call('HSET', key, 'last', now)
 ]]
   for _,bucket in ipairs(rule.backend.config.buckets) do
     table.insert(redis_script_tbl, lua_util.template(redis_set_script_tpl,
         bucket))
   end
+  table.insert(redis_script_tbl, 'end')
 
   rule.backend.script_set = lua_redis.add_redis_script(table.concat(redis_script_tbl, '\n'),
       our_redis_params)
 
+  local backend = rule.backend
+  backend.cache = {
+    cur = {},
+    prev = {},
+    nelts = 0,
+    max = math.ceil(backend.config.local_cache_size / 2),
+  }
+  backend.pending = {}
+  backend.npending = 0
+
+  -- Accumulated updates are written by scanners only
+  if backend.config.flush_interval > 0 and worker:is_scanner() then
+    backend.ev_base = ev_base
+    rspamd_config:add_periodic(ev_base, backend.config.flush_interval, function()
+      reputation_redis_flush(rule, nil, ev_base)
+
+      return true
+    end)
+    rspamd_config:register_finish_script(function(task)
+      reputation_redis_flush(rule, task)
+    end)
+  end
+
   return true
 end
 
 local function reputation_redis_get_token(task, rule, token, continuation_cb)
   local key = gen_token_key(token, rule)
-
-  local function redis_get_cb(err, data)
-    if data then
-      if type(data) == 'table' then
-        local values = {}
-        for i=1,#data,2 do
-          local ndata = tonumber(data[i + 1])
-          if ndata then
-            values[data[i]] = ndata
+  local backend = rule.backend
+
+  local function gen_redis_get_cb(cb)
+    return function(err, data)
+      if data then
+        if type(data) == 'table' then
+          local values = {}
+          for i=1,#data,2 do
+            local ndata = tonumber(data[i + 1])
+            if ndata then
+              values[data[i]] = ndata
+            end
           end
+          lua_util.debugm(N, task, 'rule %s - got values for key %s -> %s',
+              rule['symbol'], key, values)
+          reputation_cache_set(backend, token, values)
+          cb(nil, key, values)
+        else
+          rspamd_logger.errx(task, 'rule %s - invalid type while getting reputation keys %s: %s',
+            rule['symbol'], key, type(data))
+          cb("invalid type", key, nil)
         end
-        lua_util.debugm(N, task, 'rule %s - got values for key %s -> %s',
-            rule['symbol'], key, values)
-        continuation_cb(nil, key, values)
+
+      elseif err then
+        rspamd_logger.errx(task, 'rule %s - got error while getting reputation keys %s: %s',
+          rule['symbol'], key, err)
+        cb(err, key, nil)
       else
-        rspamd_logger.errx(task, 'rule %s - invalid type while getting reputation keys %s: %s',
-          rule['symbol'], key, type(data))
-        continuation_cb("invalid type", key, nil)
+        rspamd_logger.errx(task, 'rule %s - got error while getting reputation keys %s: %s',
+          rule['symbol'], key, "unknown error")
+        cb("unknown error", key, nil)
       end
+    end
+  end
 
-    elseif err then
-      rspamd_logger.errx(task, 'rule %s - got error while getting reputation keys %s: %s',
-        rule['symbol'], key, err)
-      continuation_cb(err, key, nil)
-    else
-      rspamd_logger.errx(task, 'rule %s - got error while getting reputation keys %s: %s',
-        rule['symbol'], key, "unknown error")
-      continuation_cb("unknown error", key, nil)
+  local function redis_get(cb)
+    local ret = lua_redis.exec_redis_script(backend.script_get,
+        {task = task, is_write = false},
+        gen_redis_get_cb(cb),
+        {token})
+    if not ret then
+      rspamd_logger.errx(task, 'cannot make redis request to check results')
     end
   end
 
-  local ret = lua_redis.exec_redis_script(rule.backend.script_get,
-      {task = task, is_write = false},
-      redis_get_cb,
-      {token})
-  if not ret then
-    rspamd_logger.errx(task, 'cannot make redis request to check results')
+  local cached = reputation_cache_get(backend, token)
+  local now = rspamd_util.get_time()
+
+  if cached and cached.expire > now then
+    lua_util.debugm(N, task, 'rule %s - got cached values for key %s -> %s',
+        rule['symbol'], key, cached.values)
+
+    if not cached.refreshing and cached.refresh <= now then
+      -- Refresh hot tokens before they expire
+      cached.refreshing = true
+      redis_get(function() end)
+    end
+
+    continuation_cb(nil, key, cached.values)
+  else
+    redis_get(continuation_cb)
   end
 end
 
 local function reputation_redis_set_token(task, rule, token, values, continuation_cb)
   local key = gen_token_key(token, rule)
+  local backend = rule.backend
+  local pending = backend.pending[token]
 
-  local function redis_set_cb(err, data)
-    if err then
-      rspamd_logger.errx(task, 'rule %s - got error while setting reputation keys %s: %s',
-        rule['symbol'], key, err)
-      if continuation_cb then
-        continuation_cb(err, key)
-      end
-    else
-      if continuation_cb then
-        continuation_cb(nil, key)
-      end
-    end
+  lua_util.debugm(N, task, 'rule %s - set values for key %s -> %s',
+      rule['symbol'], key, values)
+
+  if not pending then
+    pending = {}
+    backend.pending[token] = pending
+    backend.npending = backend.npending + 1
   end
 
-  -- We start from expiry update
-  local args = {}
   for k,v in pairs(values) do
-    table.insert(args, k)
-    table.insert(args, v)
+    pending[k] = (pending[k] or 0) + v
   end
-  lua_util.debugm(N, task, 'rule %s - set values for key %s -> %s',
-      rule['symbol'], key, values)
-  local ret = lua_redis.exec_redis_script(rule.backend.script_set,
-      {task = task, is_write = true},
-      redis_set_cb,
-      {token, tostring(rspamd_util:get_time()),
-       tostring(rule.backend.config.expiry)}, args)
-  if not ret then
-    rspamd_logger.errx(task, 'got error while connecting to redis')
+
+  -- Without periodic flush (or if too many tokens are pending) write now
+  if not backend.ev_base or backend.npending >= backend.config.flush_batch then
+    reputation_redis_flush(rule, task)
+  end
+
+  if continuation_cb then
+    continuation_cb(nil, key)
   end
 end
 
@@ -1066,9 +1209,17 @@ local backends = {
         name = ts.string,
         mult = ts.number + ts.string / tonumber
       }),
+      local_cache_time = ts.number + ts.string / lua_util.parse_time_interval,
+      local_cache_size = ts.number,
+      flush_interval = ts.number + ts.string / lua_util.parse_time_interval,
+      flush_batch = ts.number,
     }, {extra_fields = lua_redis.config_schema}),
     config = {
       expiry = default_expiry,
+      local_cache_time = 10.0, -- Serve values from worker's cache for this time
+      local_cache_size = 8192,
+      flush_interval = 1.0, -- Write accumulated updates with this interval
+      flush_batch = 64, -- Or once this number of tokens are pending
       buckets = {
         {
           time = 60 * 60,
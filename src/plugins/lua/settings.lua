@@ -41,6 +41,14 @@ local settings_initialized = false
 local max_pri = 0
 
 local selectors_cache = {} -- Used to speed up selectors in settings
+-- Rules in order of checking and indexes of them by exact values of conditions
+local settings_index = {
+  rules = {},
+  unindexed = {},
+  conditions = {},
+}
+-- Conditions that can be indexed, the first such condition of a rule is used
+local indexed_conditions = {'ip', 'client_ip', 'from', 'rcpt', 'user'}
 
 local function apply_settings(task, to_apply)
   task:set_settings(to_apply)
@@ -374,31 +382,159 @@ local function check_settings(task)
       user[1]["addr"] = uname
     end
   end
+  -- Select rules that can match using indexes
+  local found = {}
+  local function mark(ids)
+    if ids then
+      for _,id in ipairs(ids) do found[id] = true end
+    end
+  end
+  local function lookup_ip(idx, addr)
+    if addr and addr:is_valid() then
+      mark(idx.plain[addr:to_string()])
+      for mask, keys in pairs(idx.masks) do
+        local nip = addr:apply_mask(mask)
+        if nip then
+          mark(keys[nip:to_string()])
+        end
+      end
+    end
+  end
+  local function lookup_addr(idx, addrs)
+    for _, e in ipairs(addrs or {}) do
+      if e['addr'] then mark(idx.addr[e['addr']:lower()]) end
+      if e['user'] then mark(idx.user[e['user']:lower()]) end
+      if e['domain'] then mark(idx.domain[e['domain']:lower()]) end
+    end
+  end
+
+  for _,id in ipairs(settings_index.unindexed) do found[id] = true end
+  local conds = settings_index.conditions
+  lookup_ip(conds.ip, ip)
+  lookup_ip(conds.client_ip, client_ip)
+  lookup_addr(conds.from, from)
+  lookup_addr(conds.rcpt, rcpt)
+  lookup_addr(conds.user, user)
+
+  local candidates = {}
+  for id in pairs(found) do candidates[#candidates + 1] = id end
+  table.sort(candidates)
+
   -- Match rules according their order
-  local applied = false
+  local applied_pri
 
+  for _,id in ipairs(candidates) do
+    local s = settings_index.rules[id]
+    if applied_pri and s.pri < applied_pri then
+      break
+    end
+    local rule = check_specific_setting(s.name, s.rule, ip, client_ip, from, rcpt, user, uname)
+    if rule then
+      rspamd_logger.infox(task, "<%1> apply settings according to rule %2",
+        task:get_message_id(), s.name)
+      if rule['apply'] then
+        apply_settings(task, rule['apply'])
+        applied_pri = s.pri
+      end
+      if rule['symbols'] then
+        -- Add symbols, specified in the settings
+        fun.each(function(val)
+          task:insert_result(val, 1.0)
+        end, rule['symbols'])
+      end
+    end
+  end
+
+end
+
+-- Index rules by exact values of conditions: each rule is checked only if
+-- the task matches one of the values of its first indexable condition
+local function build_settings_index()
+  local function index_add(idx, key, id)
+    local ids = idx[key]
+    if not ids then
+      ids = {}
+      idx[key] = ids
+    end
+    ids[#ids + 1] = id
+  end
+
+  local function is_indexable(cond, elts)
+    if cond == 'ip' or cond == 'client_ip' then
+      return true
+    end
+    -- Regexps require the full check
+    for _, e in ipairs(elts) do
+      if e['regexp'] then return false end
+    end
+    return true
+  end
+
+  local function index_ip(idx, elts, id)
+    for _, e in ipairs(elts) do
+      if e[2] == 0 then
+        index_add(idx.plain, e[1]:to_string(), id)
+      elseif e[2] then
+        if not idx.masks[e[2]] then idx.masks[e[2]] = {} end
+        index_add(idx.masks[e[2]], e[1]:to_string(), id)
+      end
+      -- Invalid addresses never match
+    end
+  end
+
+  local function index_addr(idx, elts, id)
+    for _, e in ipairs(elts) do
+      if e['name'] then index_add(idx.addr, e['name'], id) end
+      if e['user'] then index_add(idx.user, e['user'], id) end
+      if e['domain'] then index_add(idx.domain, e['domain'], id) end
+    end
+  end
+
+  local index = {
+    rules = {},
+    unindexed = {},
+    conditions = {},
+  }
+
+  for _, cond in ipairs(indexed_conditions) do
+    if cond == 'ip' or cond == 'client_ip' then
+      index.conditions[cond] = {plain = {}, masks = {}}
+    else
+      index.conditions[cond] = {addr = {}, user = {}, domain = {}}
+    end
+  end
+
+  local nindexed = 0
   for pri = max_pri,1,-1 do
-    if not applied and settings[pri] then
-      for _,s in ipairs(settings[pri]) do
-        local rule = check_specific_setting(s.name, s.rule, ip, client_ip, from, rcpt, user, uname)
-        if rule then
-          rspamd_logger.infox(task, "<%1> apply settings according to rule %2",
-            task:get_message_id(), s.name)
-          if rule['apply'] then
-            apply_settings(task, rule['apply'])
-            applied = true
-          end
-          if rule['symbols'] then
-            -- Add symbols, specified in the settings
-            fun.each(function(val)
-              task:insert_result(val, 1.0)
-            end, rule['symbols'])
+    for _, s in ipairs(settings[pri] or {}) do
+      local id = #index.rules + 1
+      local indexed = false
+      index.rules[id] = {name = s.name, rule = s.rule, pri = pri}
+
+      for _, cond in ipairs(indexed_conditions) do
+        local elts = s.rule[cond]
+        if elts and is_indexable(cond, elts) then
+          if cond == 'ip' or cond == 'client_ip' then
+            index_ip(index.conditions[cond], elts, id)
+          else
+            index_addr(index.conditions[cond], elts, id)
           end
+          indexed = true
+          break
         end
       end
+
+      if indexed then
+        nindexed = nindexed + 1
+      else
+        table.insert(index.unindexed, id)
+      end
     end
   end
 
+  settings_index = index
+  lua_util.debugm(N, rspamd_config, 'indexed %s of %s settings rules',
+      nindexed, #index.rules)
 end
 
 -- Process settings based on their priority
@@ -654,6 +790,7 @@ local function process_settings_table(tbl)
   for pri,_ in pairs(settings) do
     table.sort(settings[pri], function(a,b) return a.name < b.name end)
   end
+  build_settings_index()
 
   settings_initialized = true
   rspamd_logger.infox(rspamd_config, 'loaded %1 elements of settings', nrules)
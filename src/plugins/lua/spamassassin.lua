@@ -26,7 +26,7 @@ local N = 'spamassassin'
 
 local rspamd_logger = require "rspamd_logger"
 local rspamd_regexp = require "rspamd_regexp"
-local rspamd_expression = require "rspamd_expression"
+local rspamd_sa_rules = require "rspamd_sa_rules"
 local rspamd_trie = require "rspamd_trie"
 local util = require "rspamd_util"
 local lua_util = require "lua_util"
@@ -90,10 +90,8 @@ local symbols_replacements = {
 
 -- Internal variables
 local rules = {}
-local atoms = {}
 local scores = {}
 local scores_added = {}
-local external_deps = {}
 local freemail_domains = {}
 local pcre_only_regexps = {}
 local freemail_trie
@@ -144,14 +142,6 @@ local function split(str, delim)
   return result
 end
 
-local function replace_symbol(s)
-  local rspamd_symbol = symbols_replacements[s]
-  if not rspamd_symbol then
-    return s, false
-  end
-  return rspamd_symbol, true
-end
-
 local ffi
 if type(jit) == 'table' then
   ffi = require("ffi")
@@ -1155,44 +1145,6 @@ local function apply_replacements(str)
   return false,str
 end
 
-local function parse_atom(str)
-  local atom = table.concat(fun.totable(fun.take_while(function(c)
-    if string.find(', \t()><+!|&\n', c) then
-      return false
-    end
-    return true
-  end, fun.iter(str))), '')
-
-  return atom
-end
-
-local function process_atom(atom, task)
-  local atom_cb = atoms[atom]
-
-  if atom_cb then
-    local res = atom_cb(task)
-
-    if not res then
-      lua_util.debugm(N, task, 'atom: %1, NULL result', atom)
-    elseif res > 0 then
-      lua_util.debugm(N, task, 'atom: %1, result: %2', atom, res)
-    end
-    return res
-  else
-    -- This is likely external atom
-    local real_sym = atom
-    if symbols_replacements[atom] then
-      real_sym = symbols_replacements[atom]
-    end
-    if task:has_symbol(real_sym) then
-      lua_util.debugm(N, task, 'external atom: %1, result: 1', real_sym)
-      return 1
-    end
-    lua_util.debugm(N, task, 'external atom: %1, result: 0', real_sym)
-  end
-  return 0
-end
-
 local function post_process()
   -- Replace rule tags
   local ntags = {}
@@ -1250,106 +1202,100 @@ local function post_process()
     end
   end, scores)
 
+  -- Atoms and meta rules are evaluated by the native engine
+  local sa_rules = rspamd_sa_rules.create()
+
   -- Header rules
   fun.each(function(k, r)
-    local f = function(task)
+    -- Cached path for ordinary expressions
+    if r['ordinary'] then
+      local h = r['header'][1]
+      local t = 'header'
 
-      local raw = false
-      local check = {}
-      -- Cached path for ordinary expressions
-      if r['ordinary'] then
-        local h = r['header'][1]
-        local t = 'header'
+      if h['raw'] then
+        t = 'rawheader'
+      end
 
-        if h['raw'] then
-          t = 'rawheader'
-        end
+      if not r['re'] then
+        rspamd_logger.errx(rspamd_config, 're is missing for rule %1 (%2 header)', k,
+          h['header'])
+      else
+        sa_rules:add_regexp(k, r['re'], t, h['header'], h['strong'], r['not'])
+      end
+    else
+      -- Slow path
+      local f = function(task)
+        local raw = false
+        local check = {}
 
-        if not r['re'] then
-          rspamd_logger.errx(task, 're is missing for rule %1 (%2 header)', k,
-            h['header'])
-          return 0
-        end
+        fun.each(function(h)
+          local hname = h['header']
 
-        local ret = process_regexp_opt(r.re, task, t, h.header, h.strong)
+          local hdr
+          if h['mime'] then
+            local parts = task:get_parts()
+            for _, p in ipairs(parts) do
+              local m_hdr = p:get_header_full(hname, h['strong'])
 
-        if r['not'] then
-          if ret ~= 0 then
-            ret = 0
+              if m_hdr then
+                if not hdr then
+                  hdr = {}
+                end
+                for _, mh in ipairs(m_hdr) do
+                  table.insert(hdr, mh)
+                end
+              end
+            end
           else
-            ret = 1
+            hdr = task:get_header_full(hname, h['strong'])
           end
-        end
 
-        return ret
-      end
+          if hdr then
+            for _, rh in ipairs(hdr) do
+              -- Subject for optimization
+              local str
+              if h['raw'] then
+                str = rh['value']
+                raw = true
+              else
+                str = rh['decoded']
+              end
+              if not str then return 0 end
 
-      -- Slow path
-      fun.each(function(h)
-        local hname = h['header']
-
-        local hdr
-        if h['mime'] then
-          local parts = task:get_parts()
-          for _, p in ipairs(parts) do
-            local m_hdr = p:get_header_full(hname, h['strong'])
-
-            if m_hdr then
-              if not hdr then
-                hdr = {}
+              if h['function'] then
+                str = h['function'](str)
               end
-              for _, mh in ipairs(m_hdr) do
-                table.insert(hdr, mh)
+
+              if type(str) == 'string' then
+                table.insert(check, str)
+              else
+                for _, c in ipairs(str) do
+                  table.insert(check, c)
+                end
               end
             end
+          elseif r['unset'] then
+            table.insert(check, r['unset'])
           end
-        else
-          hdr = task:get_header_full(hname, h['strong'])
-        end
-
-        if hdr then
-          for _, rh in ipairs(hdr) do
-            -- Subject for optimization
-            local str
-            if h['raw'] then
-              str = rh['value']
-              raw = true
-            else
-              str = rh['decoded']
-            end
-            if not str then return 0 end
+        end, r['header'])
 
-            if h['function'] then
-              str = h['function'](str)
-            end
+        if #check == 0 then
+          if r['not'] then return 1 end
+          return 0
+        end
 
-            if type(str) == 'string' then
-              table.insert(check, str)
-            else
-              for _, c in ipairs(str) do
-                table.insert(check, c)
-              end
-            end
+        local ret = 0
+        for _, c in ipairs(check) do
+          local match = sa_regexp_match(c, r['re'], raw, r)
+          if (match > 0 and not r['not']) or (match == 0 and r['not']) then
+            ret = 1
           end
-        elseif r['unset'] then
-          table.insert(check, r['unset'])
         end
-      end, r['header'])
 
-      if #check == 0 then
-        if r['not'] then return 1 end
-        return 0
-      end
-
-      local ret = 0
-      for _, c in ipairs(check) do
-        local match = sa_regexp_match(c, r['re'], raw, r)
-        if (match > 0 and not r['not']) or (match == 0 and r['not']) then
-          ret = 1
-        end
+        return ret
       end
 
-      return ret
+      sa_rules:add_function(k, f)
     end
     if r['score'] then
       local real_score = r['score'] * calculate_score(k, r)
@@ -1357,7 +1303,6 @@ local function post_process()
         add_sole_meta(k, r)
       end
     end
-    atoms[k] = f
   end,
   fun.filter(function(_, r)
       return r['type'] == 'header' and r['header']
@@ -1379,50 +1324,26 @@ local function post_process()
         add_sole_meta(k, r)
       end
     end
-    atoms[k] = f
+    sa_rules:add_function(k, f)
   end,
     fun.filter(function(_, r)
       return r['type'] == 'function' and r['function']
     end,
       rules))
 
-  -- Parts rules
-  fun.each(function(k, r)
-    local f = function(task)
-      if not r['re'] then
-        rspamd_logger.errx(task, 're is missing for rule %1', k)
-        return 0
-      end
-
-      local t = 'mime'
-      if r['raw'] then t = 'rawmime' end
-
-      return process_regexp_opt(r.re, task, t)
-    end
-    if r['score'] then
-      local real_score = r['score'] * calculate_score(k, r)
-      if math.abs(real_score) > meta_score_alpha then
-        add_sole_meta(k, r)
-      end
-    end
-    atoms[k] = f
-  end,
-  fun.filter(function(_, r)
-      return r['type'] == 'part'
-  end, rules))
-
-  -- SA body rules
+  -- Regexp rules: parts, SA body and URL rules
+  local regexp_types = {
+    part = function(r) if r['raw'] then return 'rawmime' end return 'mime' end,
+    sabody = function(r) return r['type'] end,
+    sarawbody = function(r) return r['type'] end,
+    message = function(r) return r['type'] end,
+    uri = function() return 'url' end,
+  }
   fun.each(function(k, r)
-    local f = function(task)
-      if not r['re'] then
-        rspamd_logger.errx(task, 're is missing for rule %1', k)
-        return 0
-      end
-
-      local t = r['type']
-
-      local ret = process_regexp_opt(r.re, task, t)
-      return ret
+    if not r['re'] then
+      rspamd_logger.errx(rspamd_config, 're is missing for rule %1', k)
+    else
+      sa_rules:add_regexp(k, r['re'], regexp_types[r['type']](r))
     end
     if r['score'] then
       local real_score = r['score'] * calculate_score(k, r)
@@ -1430,61 +1351,25 @@ local function post_process()
         add_sole_meta(k, r)
       end
     end
-    atoms[k] = f
   end,
   fun.filter(function(_, r)
-      return r['type'] == 'sabody' or r['type'] == 'message' or r['type'] == 'sarawbody'
+      return regexp_types[r['type']]
   end, rules))
 
-  -- URL rules
-  fun.each(function(k, r)
-    local f = function(task)
-      if not r['re'] then
-        rspamd_logger.errx(task, 're is missing for rule %1', k)
-        return 0
-      end
-
-      return process_regexp_opt(r.re, task, 'url')
+  -- Meta rules are virtual symbols inserted by a single callback
+  local metas_cb_id = rspamd_config:register_symbol({
+    name = 'SPAMASSASSIN_METAS',
+    type = 'callback',
+    flags = 'empty',
+    callback = function(task)
+      sa_rules:process(task)
     end
-    if r['score'] then
-      local real_score = r['score'] * calculate_score(k, r)
-      if math.abs(real_score) > meta_score_alpha then
-        add_sole_meta(k, r)
-      end
-    end
-    atoms[k] = f
-  end,
-    fun.filter(function(_, r)
-      return r['type'] == 'uri'
-    end,
-      rules))
-  -- Meta rules
+  })
   fun.each(function(k, r)
-      local expression = nil
-      -- Meta function callback
-      local meta_cb = function(task)
-        local res = 0
-        local trace = {}
-        -- XXX: need to memoize result for better performance
-        local sym = task:has_symbol(k)
-        if not sym then
-          if expression then
-            res,trace = expression:process_traced(task)
-          end
-          if res > 0 then
-            -- Symbol should be one shot to make it working properly
-            task:insert_result(k, res, trace)
-          end
-        else
-          res = 1
-        end
-
-        return res
-      end
-      expression = rspamd_expression.create(r['meta'],
-        {parse_atom, process_atom}, rspamd_config:get_mempool())
-      if not expression then
-        rspamd_logger.errx(rspamd_config, 'Cannot parse expression ' .. r['meta'])
+      local ok, err = sa_rules:add_meta(k, r['meta'])
+      if not ok then
+        rspamd_logger.errx(rspamd_config, 'Cannot parse expression %1: %2',
+          r['meta'], err)
       else
         if r['score'] then
           rspamd_config:set_metric_symbol({
@@ -1497,12 +1382,9 @@ local function post_process()
         rspamd_config:register_symbol({
           name = k,
           weight = calculate_score(k, r),
-          callback = meta_cb
+          type = 'virtual',
+          parent = metas_cb_id,
         })
-        r['expression'] = expression
-        if not atoms[k] then
-          atoms[k] = meta_cb
-        end
       end
     end,
     fun.filter(function(_, r)
@@ -1510,75 +1392,13 @@ local function post_process()
       end,
       rules))
 
-  -- Check meta rules for foreign symbols and register dependencies
-  -- First direct dependencies:
-  fun.each(function(k, r)
-      if r['expression'] then
-        local expr_atoms = r['expression']:atoms()
-
-        for _,a in ipairs(expr_atoms) do
-          if not atoms[a] then
-            local rspamd_symbol = replace_symbol(a)
-            if not external_deps[k] then
-              external_deps[k] = {}
-            end
-
-            if not external_deps[k][rspamd_symbol] then
-              rspamd_config:register_dependency(k, rspamd_symbol)
-              external_deps[k][rspamd_symbol] = true
-              lua_util.debugm(N, rspamd_config,
-                'atom %1 is a direct foreign dependency, ' ..
-                'register dependency for %2 on %3',
-                a, k, rspamd_symbol)
-            end
-          end
-        end
-      end
-    end,
-    fun.filter(function(_, r)
-      return r['type'] == 'meta'
-    end,
-    rules))
-
-  -- ... And then indirect ones ...
-  local nchanges
-  repeat
-  nchanges = 0
-    fun.each(function(k, r)
-      if r['expression'] then
-        local expr_atoms = r['expression']:atoms()
-        for _,a in ipairs(expr_atoms) do
-          if type(external_deps[a]) == 'table' then
-            for dep in pairs(external_deps[a]) do
-              if not external_deps[k] then
-                external_deps[k] = {}
-              end
-              if not external_deps[k][dep] then
-                rspamd_config:register_dependency(k, dep)
-                external_deps[k][dep] = true
-                lua_util.debugm(N, rspamd_config,
-                  'atom %1 is an indirect foreign dependency, ' ..
-                  'register dependency for %2 on %3',
-                  a, k, dep)
-                  nchanges = nchanges + 1
-              end
-            end
-          else
-            local rspamd_symbol, replaced_symbol = replace_symbol(a)
-            if replaced_symbol then
-              external_deps[a] = {[rspamd_symbol] = true}
-            else
-              external_deps[a] = {}
-            end
-          end
-        end
-      end
-    end,
-    fun.filter(function(_, r)
-      return r['type'] == 'meta'
-    end,
-    rules))
-  until nchanges == 0
+  -- Metas are evaluated at once, so the callback depends on all foreign symbols
+  local externals = sa_rules:compile(symbols_replacements)
+  for _,dep in ipairs(externals) do
+    rspamd_config:register_dependency('SPAMASSASSIN_METAS', dep)
+    lua_util.debugm(N, rspamd_config,
+      'register dependency for meta rules on foreign symbol %1', dep)
+  end
 
   -- Set missing symbols
   fun.each(function(key, score)
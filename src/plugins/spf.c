@@ -31,6 +31,7 @@
 #include "libmime/message.h"
 #include "libserver/spf.h"
 #include "libutil/hash.h"
+#include "libutil/shared_cache.h"
 #include "libutil/map.h"
 #include "libutil/map_helpers.h"
 #include "rspamd.h"
@@ -44,6 +45,8 @@
 #define DEFAULT_SYMBOL_PERMFAIL "R_SPF_PERMFAIL"
 #define DEFAULT_SYMBOL_NA "R_SPF_NA"
 #define DEFAULT_CACHE_SIZE 2048
+/* Larger records are cached per worker only */
+#define SHARED_CACHE_RECORD_LEN 4096
 
 static const gchar *M = "rspamd spf plugin";
 
@@ -59,6 +62,7 @@ struct spf_ctx {
 
 	struct rspamd_radix_map_helper *whitelist_ip;
 	rspamd_lru_hash_t *spf_hash;
+	rspamd_shared_cache_t *spf_shared_cache;
 
 	gboolean check_local;
 	gboolean check_authed;
@@ -191,6 +195,15 @@ spf_module_init (struct rspamd_config *cfg, struct module_ctx **ctx)
 			0,
 			NULL,
 			0);
+	rspamd_rcl_add_doc_by_path (cfg,
+			"spf",
+			"Size of SPF records cache shared between all workers (0 to disable)",
+			"spf_shared_cache_size",
+			UCL_INT,
+			NULL,
+			0,
+			NULL,
+			0);
 
 	return 0;
 }
@@ -201,7 +214,7 @@ spf_module_config (struct rspamd_config *cfg)
 {
 	const ucl_object_t *value;
 	gint res = TRUE, cb_id;
-	guint cache_size;
+	guint cache_size, shared_cache_size;
 	struct spf_ctx *spf_module_ctx = spf_get_context (cfg);
 
 	if (!rspamd_config_is_module_enabled (cfg, "spf")) {
@@ -291,6 +304,13 @@ spf_module_config (struct rspamd_config *cfg)
 	else {
 		cache_size = DEFAULT_CACHE_SIZE;
 	}
+	if ((value =
+		rspamd_config_get_module_opt (cfg, "spf", "spf_shared_cache_size")) != NULL) {
+		shared_cache_size = ucl_obj_toint (value);
+	}
+	else {
+		shared_cache_size = DEFAULT_CACHE_SIZE;
+	}
 
 	if ((value =
 		rspamd_config_get_module_opt (cfg, "spf", "whitelist")) != NULL) {
@@ -341,6 +361,13 @@ spf_module_config (struct rspamd_config *cfg)
 			NULL,
 			(GDestroyNotify)spf_record_unref);
 
+	if (spf_module_ctx->spf_shared_cache == NULL && shared_cache_size > 0) {
+		/* Workers are forked after modules are configured */
+		spf_module_ctx->spf_shared_cache = rspamd_shared_cache_new (
+				cfg->cfg_pool, "spf", shared_cache_size,
+				SHARED_CACHE_RECORD_LEN);
+	}
+
 	msg_info_config ("init internal spf module");
 
 	rspamd_mempool_add_destructor (cfg->cfg_pool,
@@ -501,7 +528,10 @@ spf_check_list (struct spf_resolved *rec, struct rspamd_task *task)
 	guint i;
 	struct spf_addr *addr;
 
-	for (i = 0; i < rec->elts->len; i ++) {
+	/* Skip elements that cannot match */
+	i = spf_record_first_match (rec, task->from_addr);
+
+	for (; i < rec->elts->len; i ++) {
 		addr = &g_array_index (rec->elts, struct spf_addr, i);
 		if (spf_check_element (rec, addr, task)) {
 			break;
@@ -516,6 +546,8 @@ spf_plugin_callback (struct spf_resolved *record, struct rspamd_task *task,
 	struct spf_resolved *l;
 	struct rspamd_symcache_item *item = (struct rspamd_symcache_item *)ud;
 	struct spf_ctx *spf_module_ctx = spf_get_context (task->cfg);
+	guchar buf[SHARED_CACHE_RECORD_LEN];
+	gsize len;
 
 	if (record && record->na) {
 		rspamd_task_insert_result (task,
@@ -555,6 +587,17 @@ spf_plugin_callback (struct spf_resolved *record, struct rspamd_task *task,
 				rspamd_lru_hash_insert (spf_module_ctx->spf_hash,
 						record->domain, spf_record_ref (l),
 						task->tv.tv_sec, record->ttl);
+
+				if (spf_module_ctx->spf_shared_cache) {
+					len = spf_record_serialize (record, buf, sizeof (buf));
+
+					if (len > 0) {
+						rspamd_shared_cache_insert (
+								spf_module_ctx->spf_shared_cache,
+								record->domain, strlen (record->domain),
+								buf, len, task->tv.tv_sec, record->ttl);
+					}
+				}
 			}
 
 		}
@@ -568,6 +611,42 @@ spf_plugin_callback (struct spf_resolved *record, struct rspamd_task *task,
 }
 
 
+/*
+ * Find record in the local cache of records and then in the shared cache
+ */
+static struct spf_resolved *
+spf_lookup_record (struct spf_ctx *spf_module_ctx, struct rspamd_task *task,
+		const gchar *domain)
+{
+	struct spf_resolved *l;
+	guchar buf[SHARED_CACHE_RECORD_LEN];
+	gsize len = sizeof (buf);
+	guint ttl;
+
+	l = rspamd_lru_hash_lookup (spf_module_ctx->spf_hash, domain,
+			task->tv.tv_sec);
+
+	if (l != NULL) {
+		if (spf_module_ctx->spf_shared_cache != NULL) {
+			rspamd_shared_cache_local_hit (spf_module_ctx->spf_shared_cache);
+		}
+	}
+	else if (spf_module_ctx->spf_shared_cache != NULL &&
+			rspamd_shared_cache_lookup (spf_module_ctx->spf_shared_cache,
+					domain, strlen (domain), task->tv.tv_sec,
+					buf, &len, &ttl)) {
+		l = spf_record_deserialize (domain, buf, len);
+
+		if (l != NULL) {
+			/* Local cache owns this record */
+			rspamd_lru_hash_insert (spf_module_ctx->spf_hash,
+					l->domain, l, task->tv.tv_sec, ttl);
+		}
+	}
+
+	return l;
+}
+
 static void
 spf_symbol_callback (struct rspamd_task *task,
 					 struct rspamd_symcache_item *item,
@@ -613,9 +692,7 @@ spf_symbol_callback (struct rspamd_task *task,
 	rspamd_symcache_item_async_inc (task, item, M);
 
 	if (domain) {
-		if ((l =
-			rspamd_lru_hash_lookup (spf_module_ctx->spf_hash, domain,
-			task->tv.tv_sec)) != NULL) {
+		if ((l = spf_lookup_record (spf_module_ctx, task, domain)) != NULL) {
 			spf_record_ref (l);
 			spf_check_list (l, task);
 			spf_record_unref (l);
@@ -1133,39 +1133,25 @@ surbl_module_reconfig (struct rspamd_config *cfg)
 
 
 
-static gchar *
-format_surbl_request (rspamd_mempool_t * pool,
-					  rspamd_ftok_t * hostname,
-					  struct suffix_item *suffix,
-					  gboolean append_suffix,
-					  GError ** err,
-					  gboolean forced,
-					  GHashTable *tree,
-					  struct rspamd_url *url,
-					  lua_State *L,
-					  struct surbl_ctx *surbl_module_ctx)
+/*
+ * Writes the name that is checked in surbl lists for the hostname to `buf`
+ * (without a list suffix): the registered domain, an exception or the
+ * reversed ip address. `buf` must have at least hostname->len + 1 bytes.
+ */
+static gint
+surbl_format_domain (rspamd_ftok_t *hostname,
+		struct rspamd_url *url,
+		gboolean forced,
+		struct surbl_ctx *surbl_module_ctx,
+		gchar *buf,
+		gsize buflen)
 {
 	GHashTable *t;
-	gchar *result = NULL;
 	const gchar *p, *dots[MAX_LEVELS];
 	gint r, i, dots_num = 0, level = MAX_LEVELS;
-	gsize slen, len;
 	gboolean found_exception = FALSE;
 	rspamd_ftok_t f;
 
-
-	if (G_LIKELY (suffix != NULL)) {
-		slen = strlen (suffix->suffix);
-	}
-	else if (!append_suffix) {
-		slen = 0;
-	}
-	else {
-		g_assert_not_reached ();
-	}
-
-	len = hostname->len + slen + 2;
-
 	p = hostname->begin;
 
 	while (p - hostname->begin < (gint)hostname->len && dots_num < MAX_LEVELS) {
@@ -1179,18 +1165,9 @@ format_surbl_request (rspamd_mempool_t * pool,
 
 	/* Check for numeric expressions */
 	if (url->flags & RSPAMD_URL_FLAG_NUMERIC) {
-		/* This is ip address */
-		if (suffix != NULL && (suffix->options & SURBL_OPTION_NOIP) != 0) {
-			/* Ignore such requests */
-			msg_info_pool ("ignore request of ip url for list %s",
-					suffix->symbol);
-			return NULL;
-		}
-
 		if (dots_num == 3) {
 			/* IPv4 address */
-			result = rspamd_mempool_alloc (pool, len);
-			r = rspamd_snprintf (result, len, "%*s.%*s.%*s.%*s",
+			r = rspamd_snprintf (buf, buflen, "%*s.%*s.%*s.%*s",
 					(gint) (hostname->len - (dots[2] - hostname->begin + 1)),
 					dots[2] + 1,
 					(gint) (dots[2] - dots[1] - 1),
@@ -1202,67 +1179,97 @@ format_surbl_request (rspamd_mempool_t * pool,
 		}
 		else {
 			/* Just pring ip as is */
-			result = rspamd_mempool_alloc (pool, len);
-			r = rspamd_snprintf (result, len, "%*s",
+			r = rspamd_snprintf (buf, buflen, "%*s",
 					(gint)hostname->len, hostname->begin);
 		}
+
+		return r;
 	}
-	else {
-		/* Not a numeric url */
-		result = rspamd_mempool_alloc (pool, len);
-		/* Now we should try to check for exceptions */
-		if (!forced && surbl_module_ctx->exceptions) {
-			for (i = MAX_LEVELS - 1; i >= 0; i--) {
-				t = surbl_module_ctx->exceptions[i];
-				if (t != NULL && dots_num >= i + 1) {
-					f.begin = dots[dots_num - i - 1] + 1;
-					f.len = hostname->len -
-						(dots[dots_num - i - 1] - hostname->begin + 1);
-					if (g_hash_table_lookup (t, &f) != NULL) {
-						level = dots_num - i - 1;
-						found_exception = TRUE;
-						break;
-					}
+
+	/* Now we should try to check for exceptions */
+	if (!forced && surbl_module_ctx->exceptions) {
+		for (i = MAX_LEVELS - 1; i >= 0; i--) {
+			t = surbl_module_ctx->exceptions[i];
+			if (t != NULL && dots_num >= i + 1) {
+				f.begin = dots[dots_num - i - 1] + 1;
+				f.len = hostname->len -
+					(dots[dots_num - i - 1] - hostname->begin + 1);
+				if (g_hash_table_lookup (t, &f) != NULL) {
+					level = dots_num - i - 1;
+					found_exception = TRUE;
+					break;
 				}
 			}
 		}
+	}
 
-		if (found_exception || url->tldlen == 0) {
-			if (level != MAX_LEVELS) {
-				if (level == 0) {
-					r = rspamd_snprintf (result,
-							len,
-							"%T",
-							hostname);
-				}
-				else {
-					r = rspamd_snprintf (result, len, "%*s",
-							(gint)(hostname->len -
-									(dots[level - 1] - hostname->begin + 1)),
-									dots[level - 1] + 1);
-				}
-			}
-			else if (dots_num >= 2) {
-				r = rspamd_snprintf (result, len, "%*s",
-						(gint)(hostname->len -
-								(dots[dots_num - 2] - hostname->begin + 1)),
-								dots[dots_num - 2] + 1);
+	if (found_exception || url->tldlen == 0) {
+		if (level != MAX_LEVELS) {
+			if (level == 0) {
+				r = rspamd_snprintf (buf, buflen, "%T", hostname);
 			}
 			else {
-				r = rspamd_snprintf (result,
-						len,
-						"%T",
-						hostname);
+				r = rspamd_snprintf (buf, buflen, "%*s",
+						(gint)(hostname->len -
+								(dots[level - 1] - hostname->begin + 1)),
+								dots[level - 1] + 1);
 			}
 		}
+		else if (dots_num >= 2) {
+			r = rspamd_snprintf (buf, buflen, "%*s",
+					(gint)(hostname->len -
+							(dots[dots_num - 2] - hostname->begin + 1)),
+							dots[dots_num - 2] + 1);
+		}
 		else {
-			r = rspamd_snprintf (result,
-						len,
-						"%*s",
-						url->tldlen,
-						url->tld);
+			r = rspamd_snprintf (buf, buflen, "%T", hostname);
 		}
 	}
+	else {
+		r = rspamd_snprintf (buf, buflen, "%*s", url->tldlen, url->tld);
+	}
+
+	return r;
+}
+
+static gchar *
+format_surbl_request (rspamd_mempool_t * pool,
+					  rspamd_ftok_t * hostname,
+					  struct suffix_item *suffix,
+					  gboolean append_suffix,
+					  GError ** err,
+					  gboolean forced,
+					  GHashTable *tree,
+					  struct rspamd_url *url,
+					  lua_State *L,
+					  struct surbl_ctx *surbl_module_ctx)
+{
+	gchar *result = NULL;
+	gint r;
+	gsize slen, len;
+
+	if (G_LIKELY (suffix != NULL)) {
+		slen = strlen (suffix->suffix);
+	}
+	else if (!append_suffix) {
+		slen = 0;
+	}
+	else {
+		g_assert_not_reached ();
+	}
+
+	if ((url->flags & RSPAMD_URL_FLAG_NUMERIC) && suffix != NULL &&
+			(suffix->options & SURBL_OPTION_NOIP) != 0) {
+		/* Ignore such requests */
+		msg_info_pool ("ignore request of ip url for list %s",
+				suffix->symbol);
+		return NULL;
+	}
+
+	len = hostname->len + slen + 2;
+	result = rspamd_mempool_alloc (pool, len);
+	r = surbl_format_domain (hostname, url, forced, surbl_module_ctx,
+			result, len);
 
 	url->surbl = result;
 	url->surbllen = r;
@@ -1313,10 +1320,8 @@ format_surbl_request (rspamd_mempool_t * pool,
 		}
 	}
 
-	msg_debug_pool ("request: %s, dots: %d, level: %d, orig: %*s",
+	msg_debug_pool ("request: %s, orig: %*s",
 		result,
-		dots_num,
-		level,
 		(gint)hostname->len,
 		hostname->begin);
 
@@ -1607,7 +1612,7 @@ surbl_redirector_finish (struct rspamd_http_connection *conn,
 	struct redirector_param *param = (struct redirector_param *)conn->ud;
 	struct rspamd_task *task;
 	gint r, urllen;
-	struct rspamd_url *redirected_url, *existing;
+	struct rspamd_url *redirected_url;
 	const rspamd_ftok_t *hdr;
 	gchar *urlstr;
 
@@ -1631,15 +1636,11 @@ surbl_redirector_finish (struct rspamd_http_connection *conn,
 					task->task_pool);
 
 			if (r == URI_ERRNO_OK) {
-				if ((existing = g_hash_table_lookup (task->urls, redirected_url)) == NULL) {
-					g_hash_table_insert (task->urls, redirected_url,
-							redirected_url);
+				if (rspamd_url_set_add_or_increase (task->urls,
+						redirected_url) == NULL) {
 					redirected_url->phished_url = param->url;
 					redirected_url->flags |= RSPAMD_URL_FLAG_REDIRECTED;
 				}
-				else {
-					existing->count ++;
-				}
 
 				rspamd_url_add_tag (param->url, "redirector", urlstr,
 						task->task_pool);
@@ -1888,6 +1889,231 @@ surbl_tree_url_callback (gpointer key, gpointer value, void *data)
 			param->tree, surbl_module_ctx);
 }
 
+/*
+ * Unique domains of a task are collected once and shared by all surbl
+ * lists, so each list sends one request per domain and not per url
+ */
+#define SURBL_DOMAINS_VAR "surbl_domains"
+#define SURBL_SOURCE_URL (1u << 0)
+#define SURBL_SOURCE_IMAGE (1u << 1)
+
+struct surbl_domain_url {
+	struct rspamd_url *url;
+	struct surbl_domain_url *next;
+};
+
+struct surbl_domain {
+	gchar *name;
+	guint len;
+	guint sources;
+	gboolean numeric;
+	gboolean whitelisted;
+	struct surbl_domain_url *urls;
+};
+
+struct surbl_task_domains {
+	GHashTable *seen;
+	GPtrArray *domains;
+};
+
+static void
+surbl_task_domains_dtor (gpointer p)
+{
+	struct surbl_task_domains *td = p;
+
+	g_hash_table_unref (td->seen);
+	g_ptr_array_free (td->domains, TRUE);
+}
+
+static void
+surbl_task_domains_add (struct rspamd_task *task,
+		struct surbl_task_domains *td,
+		struct rspamd_url *url,
+		guint source,
+		struct surbl_ctx *surbl_module_ctx)
+{
+	struct surbl_domain *dom;
+	struct surbl_domain_url *du;
+	gchar buf[256];
+	rspamd_ftok_t f;
+	gint r;
+
+	if (url->hostlen <= 0 || url->hostlen >= sizeof (buf)) {
+		/* Longer names cannot be resolved anyway */
+		return;
+	}
+
+	if (url->tags && g_hash_table_lookup (url->tags, "redirector")) {
+		/* URL is redirected, skip from checks */
+		return;
+	}
+
+	f.begin = url->host;
+	f.len = url->hostlen;
+	r = surbl_format_domain (&f, url, FALSE, surbl_module_ctx, buf,
+			sizeof (buf));
+	dom = g_hash_table_lookup (td->seen, buf);
+
+	if (dom == NULL) {
+		dom = rspamd_mempool_alloc0 (task->task_pool, sizeof (*dom));
+		dom->name = rspamd_mempool_strdup (task->task_pool, buf);
+		dom->len = r;
+		dom->numeric = (url->flags & RSPAMD_URL_FLAG_NUMERIC) != 0;
+		dom->whitelisted = rspamd_match_hash_map (surbl_module_ctx->whitelist,
+				dom->name) != NULL;
+		g_hash_table_insert (td->seen, dom->name, dom);
+
+		if (dom->whitelisted) {
+			msg_debug_surbl ("url %s is whitelisted", dom->name);
+		}
+		else {
+			g_ptr_array_add (td->domains, dom);
+		}
+	}
+
+	url->surbl = dom->name;
+	url->surbllen = dom->len;
+	dom->sources |= source;
+	du = rspamd_mempool_alloc (task->task_pool, sizeof (*du));
+	du->url = url;
+	LL_PREPEND (dom->urls, du);
+}
+
+static struct surbl_task_domains *
+surbl_task_domains_get (struct rspamd_task *task,
+		struct surbl_ctx *surbl_module_ctx)
+{
+	struct surbl_task_domains *td;
+	struct rspamd_mime_text_part *part;
+	struct html_image *img;
+	GHashTableIter it;
+	gpointer k, v;
+	guint i, j;
+
+	td = rspamd_mempool_get_variable (task->task_pool, SURBL_DOMAINS_VAR);
+
+	if (td != NULL) {
+		return td;
+	}
+
+	td = rspamd_mempool_alloc (task->task_pool, sizeof (*td));
+	td->seen = g_hash_table_new (rspamd_strcase_hash, rspamd_strcase_equal);
+	td->domains = g_ptr_array_sized_new (g_hash_table_size (task->urls));
+	g_hash_table_iter_init (&it, task->urls);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		surbl_task_domains_add (task, td, v, SURBL_SOURCE_URL,
+				surbl_module_ctx);
+	}
+
+	for (i = 0; i < task->text_parts->len; i ++) {
+		part = g_ptr_array_index (task->text_parts, i);
+
+		if (part->html && part->html->images) {
+			for (j = 0; j < part->html->images->len; j ++) {
+				img = g_ptr_array_index (part->html->images, j);
+
+				if ((img->flags & RSPAMD_HTML_FLAG_IMAGE_EXTERNAL)
+						&& img->url) {
+					surbl_task_domains_add (task, td, img->url,
+							SURBL_SOURCE_IMAGE, surbl_module_ctx);
+				}
+			}
+		}
+	}
+
+	rspamd_mempool_set_variable (task->task_pool, SURBL_DOMAINS_VAR, td,
+			surbl_task_domains_dtor);
+	msg_debug_surbl ("collected %ud unique domains from %ud urls",
+			td->domains->len, g_hash_table_size (task->urls));
+
+	return td;
+}
+
+static void
+surbl_request_domain (struct rspamd_task *task,
+		struct redirector_param *param,
+		struct surbl_domain *dom)
+{
+	struct suffix_item *suffix = param->suffix;
+	struct surbl_domain_url *du;
+	struct dns_param *dns_param;
+	lua_State *L = task->cfg->lua_state;
+	gboolean untagged = FALSE;
+	gchar *req;
+	gsize len;
+
+	if (dom->numeric && (suffix->options & SURBL_OPTION_NOIP)) {
+		return;
+	}
+
+	if (param->ctx->use_tags) {
+		/* Urls with known results are not checked again */
+		LL_FOREACH (dom->urls, du) {
+			if (!surbl_test_tags (task, param, du->url)) {
+				untagged = TRUE;
+			}
+		}
+
+		if (!untagged) {
+			return;
+		}
+	}
+
+	req = NULL;
+
+	if (suffix->options & SURBL_OPTION_RESOLVEIP) {
+		/* Resolve the domain itself and check its address afterwards */
+		req = dom->name;
+	}
+	else if (suffix->url_process_cbref > 0) {
+		lua_rawgeti (L, LUA_REGISTRYINDEX, suffix->url_process_cbref);
+		lua_pushstring (L, dom->name);
+		lua_pushstring (L, suffix->suffix);
+
+		if (lua_pcall (L, 2, 1, 0) != 0) {
+			msg_err_task ("cannot call url process script: %s",
+					lua_tostring (L, -1));
+		}
+		else {
+			req = rspamd_mempool_strdup (task->task_pool, lua_tostring (L, -1));
+		}
+
+		lua_pop (L, 1);
+	}
+
+	if (req == NULL) {
+		len = dom->len + strlen (suffix->suffix) + 2;
+		req = rspamd_mempool_alloc (task->task_pool, len);
+		rspamd_snprintf (req, len, "%s.%s", dom->name, suffix->suffix);
+	}
+
+	if (g_hash_table_lookup (param->tree, req) != NULL) {
+		msg_debug_surbl ("url %s is already registered", req);
+		return;
+	}
+
+	g_hash_table_insert (param->tree, req, dom->urls->url);
+
+	dns_param = rspamd_mempool_alloc (task->task_pool, sizeof (*dns_param));
+	dns_param->url = dom->urls->url;
+	dns_param->task = task;
+	dns_param->suffix = suffix;
+	dns_param->host_resolve = dom->name;
+
+	msg_debug_surbl ("send surbl dns %s request %s to %s",
+			(suffix->options & SURBL_OPTION_RESOLVEIP) ? "ip" : "domain",
+			req, suffix->suffix);
+
+	if (make_dns_request_task (task,
+			(suffix->options & SURBL_OPTION_RESOLVEIP) ?
+					surbl_dns_ip_callback : surbl_dns_callback,
+			(void *) dns_param, RDNS_REQUEST_A, req)) {
+		dns_param->item = param->item;
+		rspamd_symcache_item_async_inc (task, param->item, M);
+	}
+}
+
 static void
 surbl_test_url (struct rspamd_task *task,
 		struct rspamd_symcache_item *item,
@@ -1895,9 +2121,9 @@ surbl_test_url (struct rspamd_task *task,
 {
 	struct redirector_param *param;
 	struct suffix_item *suffix = user_data;
-	guint i, j;
-	struct rspamd_mime_text_part *part;
-	struct html_image *img;
+	struct surbl_task_domains *td;
+	struct surbl_domain *dom;
+	guint i, sources;
 	struct rspamd_url *url;
 	struct surbl_ctx *surbl_module_ctx = surbl_get_context (task->cfg);
 
@@ -1919,27 +2145,23 @@ surbl_test_url (struct rspamd_task *task,
 	rspamd_mempool_add_destructor (task->task_pool,
 		(rspamd_mempool_destruct_t)g_hash_table_unref,
 		param->tree);
-	g_hash_table_foreach (task->urls, surbl_tree_url_callback, param);
 
 	rspamd_symcache_item_async_inc (task, item, M);
 
-	/* We also need to check and process img URLs */
+	/* Image urls are checked only if the list asks for them */
+	sources = SURBL_SOURCE_URL;
+
 	if (suffix->options & SURBL_OPTION_CHECKIMAGES) {
-		for (i = 0; i < task->text_parts->len; i ++) {
-			part = g_ptr_array_index (task->text_parts, i);
-
-			if (part->html && part->html->images) {
-				for (j = 0; j < part->html->images->len; j ++) {
-					img = g_ptr_array_index (part->html->images, j);
-
-					if ((img->flags & RSPAMD_HTML_FLAG_IMAGE_EXTERNAL)
-							&& img->url) {
-						surbl_tree_url_callback (img->url, img->url, param);
-						msg_debug_surbl ("checked image url %s over %s",
-								img->src, suffix->suffix);
-					}
-				}
-			}
+		sources |= SURBL_SOURCE_IMAGE;
+	}
+
+	td = surbl_task_domains_get (task, surbl_module_ctx);
+
+	for (i = 0; i < td->domains->len; i ++) {
+		dom = g_ptr_array_index (td->domains, i);
+
+		if (dom->sources & sources) {
+			surbl_request_domain (task, param, dom);
 		}
 	}
 
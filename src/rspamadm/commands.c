@@ -30,6 +30,11 @@ extern struct rspamadm_command fuzzyconvert_command;
 extern struct rspamadm_command signtool_command;
 extern struct rspamadm_command lua_command;
 extern struct rspamadm_command dkim_keygen_command;
+extern struct rspamadm_command map_compile_command;
+extern struct rspamadm_command cryptobox_bench_command;
+extern struct rspamadm_command corpus_scan_command;
+extern struct rspamadm_command fuzzy_export_command;
+extern struct rspamadm_command fuzzy_import_command;
 
 const struct rspamadm_command *commands[] = {
 	&help_command,
@@ -44,6 +49,11 @@ const struct rspamadm_command *commands[] = {
 	&signtool_command,
 	&lua_command,
 	&dkim_keygen_command,
+	&map_compile_command,
+	&cryptobox_bench_command,
+	&corpus_scan_command,
+	&fuzzy_export_command,
+	&fuzzy_import_command,
 	NULL
 };
 
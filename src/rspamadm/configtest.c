@@ -23,6 +23,8 @@
 static gboolean quiet = FALSE;
 static gchar *config = NULL;
 static gboolean strict = FALSE;
+static gboolean profile = FALSE;
+static gchar *cache = NULL;
 extern struct rspamd_main *rspamd_main;
 /* Defined in modules.c */
 extern module_t *modules[];
@@ -48,6 +50,10 @@ static GOptionEntry entries[] = {
 				"Config file to test",     NULL},
 		{"strict", 's', 0, G_OPTION_ARG_NONE, &strict,
 				"Stop on any error in config", NULL},
+		{"profile", 'p', 0, G_OPTION_ARG_NONE, &profile,
+				"Print time spent in config load phases, modules and maps", NULL},
+		{"cache", 0, 0, G_OPTION_ARG_FILENAME, &cache,
+				"Write compiled config cache to this file", NULL},
 		{NULL,  0,   0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
 };
 
@@ -58,10 +64,12 @@ rspamadm_configtest_help (gboolean full_help, const struct rspamadm_command *cmd
 
 	if (full_help) {
 		help_str = "Perform configuration file test\n\n"
-				"Usage: rspamadm configtest [-q -c <config_name>]\n"
+				"Usage: rspamadm configtest [-q -p -c <config_name> --cache <file>]\n"
 				"Where options are:\n\n"
 				"-q: quiet output\n"
 				"-c: config file to test\n"
+				"-p: print time spent in config load phases (maps are preloaded)\n"
+				"--cache: write compiled config cache for `rspamd --config-cache`\n"
 				"--help: shows available options and commands";
 	}
 	else {
@@ -95,6 +103,52 @@ config_logger (rspamd_mempool_t *pool, gpointer ud)
 	}
 }
 
+static gint
+rspamadm_configtest_phase_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct rspamd_config_load_phase *p1 = a, *p2 = b;
+
+	if (p1->time > p2->time) {
+		return -1;
+	}
+	else if (p1->time < p2->time) {
+		return 1;
+	}
+
+	return 0;
+}
+
+static void
+rspamadm_configtest_print_profile (struct rspamd_config *cfg)
+{
+	struct rspamd_config_load_phase *ph;
+	GArray *sorted;
+	gdouble total = 0;
+	guint i;
+
+	sorted = g_array_sized_new (FALSE, FALSE, sizeof (*ph),
+			cfg->load_profile->len);
+	g_array_append_vals (sorted, cfg->load_profile->data,
+			cfg->load_profile->len);
+	g_array_sort (sorted, rspamadm_configtest_phase_cmp);
+
+	printf ("%-8s %-40s %10s\n", "type", "name", "seconds");
+
+	for (i = 0; i < sorted->len; i ++) {
+		ph = &g_array_index (sorted, struct rspamd_config_load_phase, i);
+
+		if (ph->type == RSPAMD_CONFIG_PHASE_CORE) {
+			total += ph->time;
+		}
+
+		printf ("%-8s %-40s %10.3f\n", rspamd_config_phase_type_to_str (ph->type),
+				ph->name, ph->time);
+	}
+
+	printf ("%-8s %-40s %10.3f\n", "total", "", total);
+	g_array_free (sorted, TRUE);
+}
+
 static void
 rspamadm_configtest (gint argc, gchar **argv, const struct rspamadm_command *cmd)
 {
@@ -105,6 +159,8 @@ rspamadm_configtest (gint argc, gchar **argv, const struct rspamadm_command *cmd
 	gboolean ret = TRUE;
 	worker_t **pworker;
 	const guint64 *log_cnt;
+	enum rspamd_post_load_options opts = RSPAMD_CONFIG_INIT_SYMCACHE;
+	gdouble start;
 
 	context = g_option_context_new (
 			"configtest - perform configuration file test");
@@ -140,27 +196,45 @@ rspamadm_configtest (gint argc, gchar **argv, const struct rspamadm_command *cmd
 	cfg->compiled_modules = modules;
 	cfg->compiled_workers = workers;
 	cfg->cfg_name = config;
+	cfg->config_cache = cache;
 
 	if (!rspamd_config_read (cfg, cfg->cfg_name, config_logger, rspamd_main, ucl_vars)) {
 		ret = FALSE;
 	}
 	else {
 		/* Do post-load actions */
+		start = rspamd_get_ticks (FALSE);
 		rspamd_lua_post_load_config (cfg);
+		rspamd_config_profile_phase (cfg, RSPAMD_CONFIG_PHASE_CORE,
+				"lua_post_load", start);
 
 		if (!rspamd_init_filters (rspamd_main->cfg, FALSE)) {
 			ret = FALSE;
 		}
 
+		if (profile) {
+			/* Maps are a usual source of slow startup */
+			opts |= RSPAMD_CONFIG_INIT_PRELOAD_MAPS;
+		}
+
 		if (ret) {
-			ret = rspamd_config_post_load (cfg, RSPAMD_CONFIG_INIT_SYMCACHE);
+			ret = rspamd_config_post_load (cfg, opts);
 		}
 
+		start = rspamd_get_ticks (FALSE);
+
 		if (!rspamd_symcache_validate (rspamd_main->cfg->cache,
 				rspamd_main->cfg,
 				FALSE)) {
 			ret = FALSE;
 		}
+
+		rspamd_config_profile_phase (cfg, RSPAMD_CONFIG_PHASE_CORE,
+				"symcache_validate", start);
+	}
+
+	if (profile) {
+		rspamadm_configtest_print_profile (cfg);
 	}
 
 	if (strict && ret) {
@@ -85,7 +85,11 @@ rspamadm_control_help (gboolean full_help, const struct rspamadm_command *cmd)
 				"reresolve - resolve upstreams addresses\n"
 				"recompile - recompile hyperscan regexes\n"
 				"fuzzystat - show fuzzy statistics\n"
-				"fuzzysync - immediately sync fuzzy database to storage\n";
+				"fuzzysync - immediately sync fuzzy database to storage\n"
+				"mempoolstat - show memory pool allocations per call site "
+				"(requires options.mempool_profile)\n"
+				"luaprofile - show CPU time and memory used by Lua symbols "
+				"(requires options.lua_profile)\n";
 	}
 	else {
 		help_str = "Manage rspamd main control interface";
@@ -215,6 +219,14 @@ rspamadm_control (gint argc, gchar **argv, const struct rspamadm_command *_cmd)
 			g_ascii_strcasecmp (cmd, "fuzzy_sync") == 0) {
 		path = "/fuzzysync";
 	}
+	else if (g_ascii_strcasecmp (cmd, "mempoolstat") == 0 ||
+			g_ascii_strcasecmp (cmd, "mempool_stat") == 0) {
+		path = "/mempoolstat";
+	}
+	else if (g_ascii_strcasecmp (cmd, "luaprofile") == 0 ||
+			g_ascii_strcasecmp (cmd, "lua_profile") == 0) {
+		path = "/luaprofile";
+	}
 	else {
 		rspamd_fprintf (stderr, "unknown command: %s\n", cmd);
 		exit (1);
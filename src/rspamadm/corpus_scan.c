@@ -0,0 +1,748 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "rspamadm.h"
+#include "cfg_file.h"
+#include "cfg_rcl.h"
+#include "rspamd.h"
+#include "task.h"
+#include "task_snapshot.h"
+#include "dns.h"
+#include "ref.h"
+#include "unix-std.h"
+#include "libutil/map.h"
+#include "libutil/upstream.h"
+#include "libmime/filter.h"
+#include "libstat/stat_api.h"
+#include "lua/lua_common.h"
+#include "worker_private.h"
+
+#ifdef HAVE_SYS_WAIT_H
+#include <sys/wait.h>
+#endif
+
+/*
+ * Scans a corpus of messages in process, without a running server: messages
+ * are read from files, maildirs or mboxes and results are written to stdout
+ * as JSON lines or CSV, one line per message.
+ */
+
+static gchar *config = NULL;
+static gchar *format = "json";
+static gint jobs = 1;
+static gint concurrency = 16;
+static gdouble timeout = 8.0;
+static gboolean force_mbox = FALSE;
+static gboolean quiet = FALSE;
+static gchar *snapshots_dir = NULL;
+extern struct rspamd_main *rspamd_main;
+/* Defined in modules.c */
+extern module_t *modules[];
+extern worker_t *workers[];
+
+/* Output is written when buffer is larger than this */
+#define CORPUS_SCAN_OUTBUF 65536
+
+static void rspamadm_corpus_scan (gint argc, gchar **argv,
+		const struct rspamadm_command *cmd);
+static const char *rspamadm_corpus_scan_help (gboolean full_help,
+		const struct rspamadm_command *cmd);
+
+struct rspamadm_command corpus_scan_command = {
+		.name = "corpus_scan",
+		.flags = 0,
+		.help = rspamadm_corpus_scan_help,
+		.run = rspamadm_corpus_scan,
+		.lua_subrs = NULL,
+};
+
+static GOptionEntry entries[] = {
+		{"config", 'c', 0, G_OPTION_ARG_STRING, &config,
+				"Config file to use", NULL},
+		{"format", 'f', 0, G_OPTION_ARG_STRING, &format,
+				"Output format: json (one object per line) or csv", NULL},
+		{"jobs", 'j', 0, G_OPTION_ARG_INT, &jobs,
+				"Number of processes to scan messages", NULL},
+		{"concurrency", 'n', 0, G_OPTION_ARG_INT, &concurrency,
+				"Number of messages scanned simultaneously by each process", NULL},
+		{"timeout", 't', 0, G_OPTION_ARG_DOUBLE, &timeout,
+				"Timeout of a message scan in seconds", NULL},
+		{"mbox", 'm', 0, G_OPTION_ARG_NONE, &force_mbox,
+				"Treat all files as mboxes", NULL},
+		{"quiet", 'q', 0, G_OPTION_ARG_NONE, &quiet,
+				"Log errors only", NULL},
+		{"save-snapshots", 'S', 0, G_OPTION_ARG_STRING, &snapshots_dir,
+				"Save snapshots of processed messages to this directory", NULL},
+		{NULL,  0,   0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
+};
+
+enum rspamadm_corpus_format {
+	CORPUS_FORMAT_JSON = 0,
+	CORPUS_FORMAT_CSV,
+};
+
+/* Mapped input file, it is unmapped when all its messages are scanned */
+struct rspamadm_corpus_file {
+	gchar *path;
+	gpointer map;
+	gsize len;
+	gsize pos;
+	guint nmsgs;
+	gboolean is_mbox;
+	ref_entry_t ref;
+};
+
+struct rspamadm_corpus_ctx {
+	struct rspamd_config *cfg;
+	struct event_base *ev_base;
+	struct rspamd_dns_resolver *resolver;
+	GPtrArray *files;
+	guint next_file;
+	struct rspamadm_corpus_file *cur;
+	GPtrArray *done;
+	gboolean reap_scheduled;
+	guint inflight;
+	rspamd_fstring_t *out;
+	rspamd_mempool_mutex_t *out_lock;
+	enum rspamadm_corpus_format fmt;
+	guint64 nscanned;
+};
+
+struct rspamadm_corpus_task {
+	struct rspamadm_corpus_ctx *ctx;
+	struct rspamadm_corpus_file *file;
+	guint idx;
+};
+
+static void rspamadm_corpus_start_tasks (struct rspamadm_corpus_ctx *ctx);
+
+static const char *
+rspamadm_corpus_scan_help (gboolean full_help, const struct rspamadm_command *cmd)
+{
+	const char *help_str;
+
+	if (full_help) {
+		help_str = "Scan messages without a running server\n\n"
+				"Usage: rspamadm corpus_scan [-c <config_name>] [-j <jobs>] "
+				"[-f json|csv] <file|dir>...\n"
+				"Where options are:\n\n"
+				"-c: config file to use\n"
+				"-f: output format, json (one object per line) or csv\n"
+				"-j: number of processes\n"
+				"-n: number of messages scanned simultaneously by each process\n"
+				"-t: timeout of a message scan\n"
+				"-m: treat all files as mboxes (detected by `From ` otherwise)\n"
+				"-q: log errors only\n"
+				"-S: save snapshots of processed messages to a directory,\n"
+				"    snapshots are scanned faster than the original messages\n"
+				"--help: shows available options and commands";
+	}
+	else {
+		help_str = "Scan messages without a running server";
+	}
+
+	return help_str;
+}
+
+static void
+config_logger (rspamd_mempool_t *pool, gpointer ud)
+{
+	struct rspamd_main *rm = ud;
+
+	rm->cfg->log_type = RSPAMD_LOG_CONSOLE;
+	rm->cfg->log_level = quiet ? G_LOG_LEVEL_CRITICAL : G_LOG_LEVEL_WARNING;
+
+	rspamd_set_logger (rm->cfg, g_quark_from_static_string ("corpus_scan"),
+			&rm->logger, rm->server_pool);
+
+	if (rspamd_log_open_priv (rm->logger, rm->workers_uid, rm->workers_gid) ==
+			-1) {
+		fprintf (stderr, "Fatal error, cannot open logfile, exiting\n");
+		exit (EXIT_FAILURE);
+	}
+}
+
+static void
+rspamadm_corpus_add_path (GPtrArray *files, const gchar *path)
+{
+	struct stat st;
+	GDir *dir;
+	const gchar *name;
+	gchar *sub;
+
+	if (stat (path, &st) == -1) {
+		rspamd_fprintf (stderr, "cannot stat %s: %s\n", path, strerror (errno));
+
+		return;
+	}
+
+	if (S_ISDIR (st.st_mode)) {
+		/* Maildirs are handled as any other directories */
+		dir = g_dir_open (path, 0, NULL);
+
+		if (dir == NULL) {
+			rspamd_fprintf (stderr, "cannot open %s\n", path);
+
+			return;
+		}
+
+		while ((name = g_dir_read_name (dir)) != NULL) {
+			if (name[0] == '.') {
+				continue;
+			}
+
+			sub = g_build_filename (path, name, NULL);
+			rspamadm_corpus_add_path (files, sub);
+			g_free (sub);
+		}
+
+		g_dir_close (dir);
+	}
+	else if (S_ISREG (st.st_mode) && st.st_size > 0) {
+		g_ptr_array_add (files, g_strdup (path));
+	}
+}
+
+static void
+rspamadm_corpus_file_dtor (struct rspamadm_corpus_file *f)
+{
+	munmap (f->map, f->len);
+	g_free (f);
+}
+
+static void
+rspamadm_corpus_file_unref (gpointer p)
+{
+	struct rspamadm_corpus_file *f = p;
+
+	REF_RELEASE (f);
+}
+
+static struct rspamadm_corpus_file *
+rspamadm_corpus_open_file (const gchar *path)
+{
+	struct rspamadm_corpus_file *f;
+	struct stat st;
+	gpointer map;
+	gint fd;
+
+	fd = open (path, O_RDONLY);
+
+	if (fd == -1 || fstat (fd, &st) == -1) {
+		msg_err ("cannot open %s: %s", path, strerror (errno));
+
+		if (fd != -1) {
+			close (fd);
+		}
+
+		return NULL;
+	}
+
+	map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+
+	if (map == MAP_FAILED) {
+		msg_err ("cannot mmap %s: %s", path, strerror (errno));
+
+		return NULL;
+	}
+
+	f = g_malloc0 (sizeof (*f));
+	f->path = (gchar *)path;
+	f->map = map;
+	f->len = st.st_size;
+	f->is_mbox = force_mbox ||
+			(f->len > 5 && memcmp (f->map, "From ", 5) == 0);
+	REF_INIT_RETAIN (f, rspamadm_corpus_file_dtor);
+
+	return f;
+}
+
+/*
+ * Returns the next message of the corpus, each message holds a reference
+ * to its file
+ */
+static gboolean
+rspamadm_corpus_next_msg (struct rspamadm_corpus_ctx *ctx,
+		struct rspamadm_corpus_task *ct, const gchar **pdata, gsize *plen)
+{
+	struct rspamadm_corpus_file *f;
+	const gchar *p, *end;
+	goffset next;
+
+	for (;;) {
+		if (ctx->cur == NULL) {
+			if (ctx->next_file >= ctx->files->len) {
+				return FALSE;
+			}
+
+			ctx->cur = rspamadm_corpus_open_file (
+					g_ptr_array_index (ctx->files, ctx->next_file ++));
+
+			continue;
+		}
+
+		f = ctx->cur;
+		p = (const gchar *)f->map + f->pos;
+		end = (const gchar *)f->map + f->len;
+
+		if (p >= end) {
+			ctx->cur = NULL;
+			REF_RELEASE (f);
+			continue;
+		}
+
+		if (!f->is_mbox) {
+			*pdata = p;
+			*plen = end - p;
+			f->pos = f->len;
+		}
+		else {
+			/* Skip envelope line `From sender date` */
+			if (end - p > 5 && memcmp (p, "From ", 5) == 0) {
+				p = memchr (p, '\n', end - p);
+
+				if (p == NULL) {
+					f->pos = f->len;
+					continue;
+				}
+
+				p ++;
+			}
+
+			next = rspamd_substring_search (p, end - p, "\nFrom ", 6);
+
+			if (next == -1) {
+				*pdata = p;
+				*plen = end - p;
+				f->pos = f->len;
+			}
+			else {
+				*pdata = p;
+				*plen = next + 1;
+				f->pos = (p - (const gchar *)f->map) + next + 1;
+			}
+		}
+
+		REF_RETAIN (f);
+		ct->file = f;
+		ct->idx = f->nmsgs ++;
+
+		return TRUE;
+	}
+}
+
+static void
+rspamadm_corpus_flush (struct rspamadm_corpus_ctx *ctx)
+{
+	gsize written = 0;
+	gssize r;
+
+	if (ctx->out->len == 0) {
+		return;
+	}
+
+	/* Lines of different processes must not be mixed */
+	rspamd_mempool_lock_mutex (ctx->out_lock);
+
+	while (written < ctx->out->len) {
+		r = write (STDOUT_FILENO, ctx->out->str + written,
+				ctx->out->len - written);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			msg_err ("cannot write output: %s", strerror (errno));
+			break;
+		}
+
+		written += r;
+	}
+
+	rspamd_mempool_unlock_mutex (ctx->out_lock);
+	ctx->out->len = 0;
+}
+
+static void
+rspamadm_corpus_csv_string (rspamd_fstring_t **out, const gchar *s)
+{
+	*out = rspamd_fstring_append (*out, "\"", 1);
+
+	while (*s) {
+		if (*s == '"') {
+			*out = rspamd_fstring_append (*out, "\"\"", 2);
+		}
+		else {
+			*out = rspamd_fstring_append (*out, s, 1);
+		}
+
+		s ++;
+	}
+
+	*out = rspamd_fstring_append (*out, "\"", 1);
+}
+
+static void
+rspamadm_corpus_write_result (struct rspamadm_corpus_ctx *ctx,
+		struct rspamadm_corpus_task *ct, struct rspamd_task *task)
+{
+	struct rspamd_metric_result *mres = task->result;
+	struct rspamd_symbol_result *sym;
+	enum rspamd_action_type action = METRIC_ACTION_NOACTION;
+	gdouble score = 0, required = 0;
+	ucl_object_t *top, *syms;
+	gboolean first = TRUE;
+
+	rspamd_task_set_finish_time (task);
+
+	if (mres) {
+		action = rspamd_check_action_metric (task, mres);
+		score = mres->score;
+		required = rspamd_task_get_required_score (task, mres);
+	}
+
+	if (ctx->fmt == CORPUS_FORMAT_JSON) {
+		top = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (top, ucl_object_fromstring (ct->file->path),
+				"file", 0, false);
+		ucl_object_insert_key (top, ucl_object_fromint (ct->idx),
+				"idx", 0, false);
+		ucl_object_insert_key (top, ucl_object_fromdouble (score),
+				"score", 0, false);
+		ucl_object_insert_key (top, ucl_object_fromdouble (required),
+				"required_score", 0, false);
+		ucl_object_insert_key (top,
+				ucl_object_fromstring (rspamd_action_to_str (action)),
+				"action", 0, false);
+		ucl_object_insert_key (top,
+				ucl_object_fromdouble (task->time_real_finish - task->time_real),
+				"time", 0, false);
+		syms = ucl_object_typed_new (UCL_OBJECT);
+
+		if (mres) {
+			kh_foreach_value_ptr (mres->symbols, sym, {
+				ucl_object_insert_key (syms, ucl_object_fromdouble (sym->score),
+						sym->name, 0, false);
+			});
+		}
+
+		ucl_object_insert_key (top, syms, "symbols", 0, false);
+		rspamd_ucl_emit_fstring (top, UCL_EMIT_JSON_COMPACT, &ctx->out);
+		ucl_object_unref (top);
+	}
+	else {
+		rspamadm_corpus_csv_string (&ctx->out, ct->file->path);
+		rspamd_printf_fstring (&ctx->out, ",%ud,%.2f,%.2f,%s,%.3f,\"",
+				ct->idx, score, required, rspamd_action_to_str (action),
+				task->time_real_finish - task->time_real);
+
+		if (mres) {
+			kh_foreach_value_ptr (mres->symbols, sym, {
+				/* Symbol names have no quotes */
+				rspamd_printf_fstring (&ctx->out, "%s%s:%.2f",
+						first ? "" : ";", sym->name, sym->score);
+				first = FALSE;
+			});
+		}
+
+		ctx->out = rspamd_fstring_append (ctx->out, "\"", 1);
+	}
+
+	ctx->out = rspamd_fstring_append (ctx->out, "\n", 1);
+
+	if (ctx->out->len >= CORPUS_SCAN_OUTBUF) {
+		rspamadm_corpus_flush (ctx);
+	}
+}
+
+static void
+rspamadm_corpus_save_snapshot (struct rspamadm_corpus_task *ct,
+		struct rspamd_task *task)
+{
+	gchar *base, path[PATH_MAX];
+	GError *err = NULL;
+
+	base = g_path_get_basename (ct->file->path);
+	rspamd_snprintf (path, sizeof (path), "%s/%s-%ud.rsnp", snapshots_dir,
+			base, ct->idx);
+	g_free (base);
+
+	if (!rspamd_task_save_snapshot (task, path, &err)) {
+		msg_err ("cannot save snapshot to %s: %e", path, err);
+		g_error_free (err);
+	}
+}
+
+/* Sessions cannot be destroyed from their finalizers, so it is deferred */
+static void
+rspamadm_corpus_reap (gint fd, short what, gpointer ud)
+{
+	struct rspamadm_corpus_ctx *ctx = ud;
+	struct rspamd_task *task;
+	guint i;
+
+	ctx->reap_scheduled = FALSE;
+
+	PTR_ARRAY_FOREACH (ctx->done, i, task) {
+		rspamd_session_destroy (task->s);
+	}
+
+	g_ptr_array_set_size (ctx->done, 0);
+	rspamadm_corpus_start_tasks (ctx);
+
+	if (ctx->inflight == 0) {
+		event_base_loopexit (ctx->ev_base, NULL);
+	}
+}
+
+static gboolean
+rspamadm_corpus_task_fin (struct rspamd_task *task, void *ud)
+{
+	struct rspamadm_corpus_task *ct = ud;
+	struct rspamadm_corpus_ctx *ctx = ct->ctx;
+	struct timeval tv = {0, 0};
+
+	rspamadm_corpus_write_result (ctx, ct, task);
+
+	if (snapshots_dir &&
+			(task->processed_stages & RSPAMD_TASK_STAGE_PROCESS_MESSAGE)) {
+		rspamadm_corpus_save_snapshot (ct, task);
+	}
+
+	ctx->inflight --;
+	ctx->nscanned ++;
+	g_ptr_array_add (ctx->done, task);
+
+	if (!ctx->reap_scheduled) {
+		ctx->reap_scheduled = TRUE;
+		event_base_once (ctx->ev_base, -1, EV_TIMEOUT, rspamadm_corpus_reap,
+				ctx, &tv);
+	}
+
+	return TRUE;
+}
+
+static void
+rspamadm_corpus_start_tasks (struct rspamadm_corpus_ctx *ctx)
+{
+	struct rspamd_task *task;
+	struct rspamadm_corpus_task *ct, tmp;
+	struct timeval tv;
+	const gchar *data;
+	gsize len;
+
+	while (ctx->inflight < (guint)concurrency &&
+			rspamadm_corpus_next_msg (ctx, &tmp, &data, &len)) {
+		task = rspamd_task_new (NULL, ctx->cfg, NULL, ctx->cfg->lang_det,
+				ctx->ev_base);
+		task->resolver = ctx->resolver;
+		ct = rspamd_mempool_alloc (task->task_pool, sizeof (*ct));
+		memcpy (ct, &tmp, sizeof (*ct));
+		ct->ctx = ctx;
+		rspamd_mempool_add_destructor (task->task_pool,
+				rspamadm_corpus_file_unref, ct->file);
+		task->fin_callback = rspamadm_corpus_task_fin;
+		task->fin_arg = ct;
+		task->s = rspamd_session_create (task->task_pool, rspamd_task_fin,
+				rspamd_task_restore, (event_finalizer_t)rspamd_task_free, task);
+		ctx->inflight ++;
+
+		if (rspamd_task_is_snapshot (data, len)) {
+			/* Snapshot data is kept mapped by the file reference */
+			if (!rspamd_task_load_snapshot (task, data, len)) {
+				msg_err ("cannot load snapshot %ud from %s", ct->idx,
+						ct->file->path);
+				task->processed_stages |= RSPAMD_TASK_STAGE_DONE;
+				rspamd_session_pending (task->s);
+
+				continue;
+			}
+		}
+		else if (!rspamd_task_load_message (task, NULL, data, len)) {
+			msg_err ("cannot load message %ud from %s", ct->idx, ct->file->path);
+			task->processed_stages |= RSPAMD_TASK_STAGE_DONE;
+			rspamd_session_pending (task->s);
+
+			continue;
+		}
+
+		if (timeout > 0) {
+			event_set (&task->timeout_ev, -1, EV_TIMEOUT, rspamd_task_timeout,
+					task);
+			event_base_set (ctx->ev_base, &task->timeout_ev);
+			double_to_tv (timeout, &tv);
+			event_add (&task->timeout_ev, &tv);
+		}
+
+		rspamd_task_process (task, RSPAMD_TASK_PROCESS_ALL);
+		/* Calls finaliser if there are no async events */
+		rspamd_session_pending (task->s);
+	}
+}
+
+static void
+rspamadm_corpus_scan_files (struct rspamd_config *cfg, GPtrArray *files,
+		rspamd_mempool_mutex_t *out_lock)
+{
+	struct rspamadm_corpus_ctx ctx;
+
+	memset (&ctx, 0, sizeof (ctx));
+	ctx.cfg = cfg;
+	ctx.files = files;
+	ctx.out_lock = out_lock;
+	ctx.fmt = g_ascii_strcasecmp (format, "csv") == 0 ?
+			CORPUS_FORMAT_CSV : CORPUS_FORMAT_JSON;
+	ctx.out = rspamd_fstring_sized_new (CORPUS_SCAN_OUTBUF);
+	ctx.done = g_ptr_array_new ();
+	ctx.ev_base = event_init ();
+	ctx.resolver = dns_resolver_init (rspamd_main->logger, ctx.ev_base, cfg);
+	rspamd_map_watch (cfg, ctx.ev_base, ctx.resolver, NULL, FALSE);
+	rspamd_upstreams_library_config (cfg, cfg->ups_ctx, ctx.ev_base,
+			ctx.resolver->r);
+	rspamd_stat_init (cfg, ctx.ev_base);
+
+	rspamadm_corpus_start_tasks (&ctx);
+
+	if (ctx.inflight > 0 || ctx.reap_scheduled) {
+		event_base_loop (ctx.ev_base, 0);
+	}
+
+	rspamadm_corpus_flush (&ctx);
+	msg_info ("scanned %L messages", ctx.nscanned);
+
+	rspamd_stat_close ();
+	g_ptr_array_free (ctx.done, TRUE);
+	rspamd_fstring_free (ctx.out);
+}
+
+static void
+rspamadm_corpus_scan (gint argc, gchar **argv, const struct rspamadm_command *cmd)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	const gchar *confdir;
+	struct rspamd_config *cfg = rspamd_main->cfg;
+	rspamd_mempool_mutex_t *out_lock;
+	GPtrArray *files, *part;
+	worker_t **pworker;
+	pid_t *pids;
+	gint i, status, ret = EXIT_SUCCESS;
+	guint j;
+
+	context = g_option_context_new (
+			"corpus_scan - scan messages without a running server");
+	g_option_context_set_summary (context,
+			"Summary:\n  Rspamd administration utility version "
+					RVERSION
+					"\n  Release id: "
+					RID);
+	g_option_context_add_main_entries (context, entries, NULL);
+
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		fprintf (stderr, "option parsing failed: %s\n", error->message);
+		g_error_free (error);
+		exit (1);
+	}
+
+	if (argc < 2) {
+		fprintf (stderr, "no files to scan\n");
+		exit (1);
+	}
+
+	if (config == NULL) {
+		if ((confdir = g_hash_table_lookup (ucl_vars, "CONFDIR")) == NULL) {
+			confdir = RSPAMD_CONFDIR;
+		}
+
+		config = g_strdup_printf ("%s%c%s", confdir, G_DIR_SEPARATOR,
+				"rspamd.conf");
+	}
+
+	files = g_ptr_array_new_with_free_func (g_free);
+
+	for (i = 1; i < argc; i ++) {
+		rspamadm_corpus_add_path (files, argv[i]);
+	}
+
+	pworker = &workers[0];
+	while (*pworker) {
+		/* Init string quarks */
+		(void) g_quark_from_static_string ((*pworker)->name);
+		pworker++;
+	}
+
+	cfg->cache = rspamd_symcache_new (cfg);
+	cfg->compiled_modules = modules;
+	cfg->compiled_workers = workers;
+	cfg->cfg_name = config;
+
+	if (!rspamd_config_read (cfg, cfg->cfg_name, config_logger, rspamd_main,
+			ucl_vars)) {
+		fprintf (stderr, "cannot load config %s\n", config);
+		exit (EXIT_FAILURE);
+	}
+
+	rspamd_lua_post_load_config (cfg);
+
+	if (!rspamd_init_filters (cfg, FALSE) ||
+			!rspamd_config_post_load (cfg, RSPAMD_CONFIG_LOAD_ALL)) {
+		fprintf (stderr, "cannot init config %s\n", config);
+		exit (EXIT_FAILURE);
+	}
+
+	rspamd_map_preload (cfg);
+	out_lock = rspamd_mempool_get_mutex (rspamd_main->server_pool);
+
+	if (jobs <= 1 || files->len <= 1) {
+		rspamadm_corpus_scan_files (cfg, files, out_lock);
+	}
+	else {
+		/* Files are distributed between processes evenly */
+		pids = g_malloc0 (sizeof (*pids) * jobs);
+
+		for (i = 0; i < jobs; i ++) {
+			pids[i] = fork ();
+
+			if (pids[i] == -1) {
+				rspamd_fprintf (stderr, "cannot fork: %s\n", strerror (errno));
+				exit (EXIT_FAILURE);
+			}
+			else if (pids[i] == 0) {
+				part = g_ptr_array_new ();
+
+				for (j = i; j < files->len; j += jobs) {
+					g_ptr_array_add (part, g_ptr_array_index (files, j));
+				}
+
+				rspamadm_corpus_scan_files (cfg, part, out_lock);
+				exit (EXIT_SUCCESS);
+			}
+		}
+
+		for (i = 0; i < jobs; i ++) {
+			if (waitpid (pids[i], &status, 0) == -1 ||
+					!WIFEXITED (status) || WEXITSTATUS (status) != 0) {
+				ret = EXIT_FAILURE;
+			}
+		}
+
+		g_free (pids);
+	}
+
+	g_ptr_array_free (files, TRUE);
+
+	exit (ret);
+}
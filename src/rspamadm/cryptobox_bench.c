@@ -0,0 +1,171 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "rspamadm.h"
+#include "printf.h"
+#include "libutil/util.h"
+#include "ottery.h"
+#include "libcryptobox/cryptobox.h"
+#include "libcryptobox/chacha20/chacha.h"
+#include "libcryptobox/poly1305/poly1305.h"
+
+static gint64 size = 16384;
+static gint64 iterations = 10000;
+
+static void rspamadm_cryptobox_bench (gint argc, gchar **argv,
+		const struct rspamadm_command *cmd);
+static const char *rspamadm_cryptobox_bench_help (gboolean full_help,
+		const struct rspamadm_command *cmd);
+
+struct rspamadm_command cryptobox_bench_command = {
+		.name = "cryptobox_bench",
+		.flags = 0,
+		.help = rspamadm_cryptobox_bench_help,
+		.run = rspamadm_cryptobox_bench,
+		.lua_subrs = NULL,
+};
+
+static GOptionEntry entries[] = {
+		{"size", 's', 0, G_OPTION_ARG_INT64, &size,
+				"Size of a single message (16384 by default)", NULL},
+		{"iterations", 'n', 0, G_OPTION_ARG_INT64, &iterations,
+				"Number of messages processed by each implementation "
+				"(10000 by default)", NULL},
+		{NULL,       0,   0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
+};
+
+static const char *
+rspamadm_cryptobox_bench_help (gboolean full_help,
+		const struct rspamadm_command *cmd)
+{
+	const char *help_str;
+
+	if (full_help) {
+		help_str = "Measure throughput of all chacha20 and poly1305 "
+				"implementations compiled in\n\n"
+				"Usage: rspamadm cryptobox_bench [-s <size>] [-n <iterations>]\n"
+				"Where options are:\n\n"
+				"-s: size of a single message\n"
+				"-n: number of messages processed by each implementation\n"
+				"--help: shows available options and commands\n\n"
+				"Implementations selected for this CPU are marked with `*`";
+	}
+	else {
+		help_str = "Benchmark cryptobox implementations";
+	}
+
+	return help_str;
+}
+
+static void
+rspamadm_cryptobox_bench_print (const gchar *alg, const gchar *desc,
+		const gchar *active, gdouble elapsed)
+{
+	gdouble mbytes = (gdouble)size * iterations / (1024.0 * 1024.0);
+
+	rspamd_printf ("%s %s%s: %.2f MB/s (%.3f sec)\n", alg, desc,
+			strcmp (desc, active) == 0 ? "*" : "",
+			elapsed > 0 ? mbytes / elapsed : 0.0, elapsed);
+}
+
+static void
+rspamadm_cryptobox_bench (gint argc, gchar **argv,
+		const struct rspamadm_command *cmd)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	struct rspamd_cryptobox_library_ctx *crypto_ctx;
+	chacha_key key;
+	chacha_iv iv;
+	poly1305_key pkey;
+	guchar mac[16], *buf;
+	const gchar *desc;
+	gdouble t1, t2;
+	gint64 n;
+	guint i;
+
+	context = g_option_context_new (
+			"cryptobox_bench - benchmark cryptobox implementations");
+	g_option_context_set_summary (context,
+			"Summary:\n  Rspamd administration utility version "
+					RVERSION
+					"\n  Release id: "
+					RID);
+	g_option_context_add_main_entries (context, entries, NULL);
+
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		rspamd_fprintf (stderr, "option parsing failed: %s\n", error->message);
+		g_error_free (error);
+		exit (EXIT_FAILURE);
+	}
+
+	g_option_context_free (context);
+
+	if (size <= 0 || iterations <= 0) {
+		rspamd_fprintf (stderr, "%s\n",
+				rspamadm_cryptobox_bench_help (TRUE, cmd));
+		exit (EXIT_FAILURE);
+	}
+
+	/* Already initialised, so that just returns the context */
+	crypto_ctx = rspamd_cryptobox_init ();
+	rspamd_printf ("cpu extensions: %s\n", crypto_ctx->cpu_extensions);
+
+	buf = g_malloc (size);
+	ottery_rand_bytes (buf, size);
+	ottery_rand_bytes (key.b, sizeof (key.b));
+	ottery_rand_bytes (iv.b, sizeof (iv.b));
+	ottery_rand_bytes (pkey.b, sizeof (pkey.b));
+
+	for (i = 0; (desc = chacha_impl_desc (i)) != NULL; i ++) {
+		if (!chacha_load_impl (desc)) {
+			rspamd_printf ("chacha20 %s: not supported by cpu\n", desc);
+			continue;
+		}
+
+		t1 = rspamd_get_ticks (FALSE);
+
+		for (n = 0; n < iterations; n ++) {
+			chacha (&key, &iv, buf, buf, size, 20);
+		}
+
+		t2 = rspamd_get_ticks (FALSE);
+		rspamadm_cryptobox_bench_print ("chacha20", desc,
+				crypto_ctx->chacha20_impl, t2 - t1);
+	}
+
+	for (i = 0; (desc = poly1305_impl_desc (i)) != NULL; i ++) {
+		if (!poly1305_load_impl (desc)) {
+			rspamd_printf ("poly1305 %s: not supported by cpu\n", desc);
+			continue;
+		}
+
+		t1 = rspamd_get_ticks (FALSE);
+
+		for (n = 0; n < iterations; n ++) {
+			poly1305_auth (mac, buf, size, &pkey);
+		}
+
+		t2 = rspamd_get_ticks (FALSE);
+		rspamadm_cryptobox_bench_print ("poly1305", desc,
+				crypto_ctx->poly1305_impl, t2 - t1);
+	}
+
+	/* Restore implementations selected for this CPU */
+	chacha_load_impl (crypto_ctx->chacha20_impl);
+	poly1305_load_impl (crypto_ctx->poly1305_impl);
+	g_free (buf);
+}
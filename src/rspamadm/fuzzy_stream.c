@@ -0,0 +1,1290 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "rspamadm.h"
+#include "logger.h"
+#include "util.h"
+#include "unix-std.h"
+#include "sqlite_utils.h"
+#include "cryptobox.h"
+#include "contrib/zstd/zstd.h"
+#include "contrib/hiredis/hiredis.h"
+
+#ifdef HAVE_SYS_WAIT_H
+#include <sys/wait.h>
+#endif
+
+/*
+ * Bulk export and import of fuzzy hashes.
+ *
+ * Stream consists of a magic followed by chunks, each chunk is a header and
+ * a zstd compressed block of records. Chunks are independent, so they can be
+ * imported by several processes simultaneously and each chunk is applied
+ * atomically: in a single transaction for sqlite and in a single pipeline for
+ * redis. The index of the last applied chunk is saved in a state file, so an
+ * interrupted import can be resumed.
+ *
+ * All integers are little endian.
+ */
+
+#define FUZZY_STREAM_MAGIC "rsfz0001"
+#define FUZZY_STREAM_DEFAULT_CHUNK 65536
+#define FUZZY_STREAM_MAX_RAW (256 * 1024 * 1024)
+
+RSPAMD_PACKED(fuzzy_stream_chunk_hdr) {
+	guint32 clen; /* compressed length */
+	guint32 rlen; /* raw length */
+	guint32 nrecords;
+	guint64 hash; /* fast hash of the raw data */
+};
+
+RSPAMD_PACKED(fuzzy_stream_record) {
+	guchar digest[64];
+	guint32 flag;
+	gint64 value;
+	gint64 time;
+	guint8 nshingles;
+	/* nshingles of fuzzy_stream_shingle follow */
+};
+
+RSPAMD_PACKED(fuzzy_stream_shingle) {
+	guint32 number;
+	guint64 value;
+};
+
+static gchar *source_db = NULL;
+static gchar *output = NULL;
+static gchar *input = NULL;
+static gchar *target_db = NULL;
+static gchar *redis_host = NULL;
+static gchar *redis_db = NULL;
+static gchar *redis_password = NULL;
+static gchar *redis_prefix = "fuzzy";
+static gchar *state_file = NULL;
+static gint chunk_size = FUZZY_STREAM_DEFAULT_CHUNK;
+static gint compression_level = 3;
+static gint fuzzy_expiry = 0;
+static gint jobs = 1;
+static gboolean resume = FALSE;
+static gboolean quiet = FALSE;
+
+static void rspamadm_fuzzy_export (gint argc, gchar **argv,
+		const struct rspamadm_command *cmd);
+static const char *rspamadm_fuzzy_export_help (gboolean full_help,
+		const struct rspamadm_command *cmd);
+static void rspamadm_fuzzy_import (gint argc, gchar **argv,
+		const struct rspamadm_command *cmd);
+static const char *rspamadm_fuzzy_import_help (gboolean full_help,
+		const struct rspamadm_command *cmd);
+
+struct rspamadm_command fuzzy_export_command = {
+		.name = "fuzzy_export",
+		.flags = 0,
+		.help = rspamadm_fuzzy_export_help,
+		.run = rspamadm_fuzzy_export,
+		.lua_subrs = NULL,
+};
+
+struct rspamadm_command fuzzy_import_command = {
+		.name = "fuzzy_import",
+		.flags = 0,
+		.help = rspamadm_fuzzy_import_help,
+		.run = rspamadm_fuzzy_import,
+		.lua_subrs = NULL,
+};
+
+static GOptionEntry export_entries[] = {
+		{"database", 'd', 0, G_OPTION_ARG_FILENAME, &source_db,
+				"Sqlite3 database to export", NULL},
+		{"output", 'o', 0, G_OPTION_ARG_FILENAME, &output,
+				"Output file (stdout if `-`)", NULL},
+		{"chunk", 'n', 0, G_OPTION_ARG_INT, &chunk_size,
+				"Number of hashes per chunk", NULL},
+		{"level", 'l', 0, G_OPTION_ARG_INT, &compression_level,
+				"Compression level", NULL},
+		{"quiet", 'q', 0, G_OPTION_ARG_NONE, &quiet,
+				"Suppress progress output", NULL},
+		{NULL,     0,   0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
+};
+
+static GOptionEntry import_entries[] = {
+		{"input", 'i', 0, G_OPTION_ARG_FILENAME, &input,
+				"Input file produced by fuzzy_export", NULL},
+		{"database", 'd', 0, G_OPTION_ARG_FILENAME, &target_db,
+				"Import to sqlite3 database", NULL},
+		{"host", 0, 0, G_OPTION_ARG_STRING, &redis_host,
+				"Import to redis (ip:port or /path/to/socket)", NULL},
+		{"dbname", 'D', 0, G_OPTION_ARG_STRING, &redis_db,
+				"Database in redis (should be numeric)", NULL},
+		{"password", 'p', 0, G_OPTION_ARG_STRING, &redis_password,
+				"Password to connect to redis", NULL},
+		{"prefix", 0, 0, G_OPTION_ARG_STRING, &redis_prefix,
+				"Prefix of fuzzy keys in redis (default: fuzzy)", NULL},
+		{"expiry", 'e', 0, G_OPTION_ARG_INT, &fuzzy_expiry,
+				"Expire time of hashes in redis in seconds (0 for no expire)",
+				NULL},
+		{"jobs", 'j', 0, G_OPTION_ARG_INT, &jobs,
+				"Number of processes to import to redis", NULL},
+		{"state", 's', 0, G_OPTION_ARG_FILENAME, &state_file,
+				"State file prefix (default: <input>.state)", NULL},
+		{"resume", 'r', 0, G_OPTION_ARG_NONE, &resume,
+				"Skip chunks imported by the previous run", NULL},
+		{"quiet", 'q', 0, G_OPTION_ARG_NONE, &quiet,
+				"Suppress progress output", NULL},
+		{NULL,     0,   0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
+};
+
+static const gchar *create_tables_sql =
+				"BEGIN;"
+				"CREATE TABLE IF NOT EXISTS digests("
+				"id INTEGER PRIMARY KEY,"
+				"flag INTEGER NOT NULL,"
+				"digest TEXT NOT NULL,"
+				"value INTEGER,"
+				"time INTEGER);"
+				"CREATE TABLE IF NOT EXISTS shingles("
+				"value INTEGER NOT NULL,"
+				"number INTEGER NOT NULL,"
+				"digest_id INTEGER REFERENCES digests(id) ON DELETE CASCADE "
+				"ON UPDATE CASCADE);"
+				"CREATE UNIQUE INDEX IF NOT EXISTS d ON digests(digest);"
+				"CREATE INDEX IF NOT EXISTS t ON digests(time);"
+				"CREATE INDEX IF NOT EXISTS dgst_id ON shingles(digest_id);"
+				"CREATE UNIQUE INDEX IF NOT EXISTS s ON shingles(value, number);"
+				"COMMIT;";
+/* Both are ordered by digest id to join them without loading all shingles */
+static const gchar *select_digests_sql =
+				"SELECT id, flag, digest, value, time FROM digests ORDER BY id;";
+static const gchar *select_shingles_sql =
+				"SELECT digest_id, number, value FROM shingles ORDER BY digest_id;";
+
+enum statement_idx {
+	TRANSACTION_START = 0,
+	TRANSACTION_COMMIT,
+	TRANSACTION_ROLLBACK,
+	INSERT,
+	UPDATE,
+	INSERT_SHINGLE,
+	CHECK_DIGEST_ID,
+	STMAX
+};
+
+static struct rspamd_sqlite3_prstmt prepared_stmts[STMAX] = {
+		[TRANSACTION_START] = {
+				.idx = TRANSACTION_START,
+				.sql = "BEGIN IMMEDIATE TRANSACTION;",
+				.args = "",
+				.stmt = NULL,
+				.result = SQLITE_DONE,
+				.ret = ""
+		},
+		[TRANSACTION_COMMIT] = {
+				.idx = TRANSACTION_COMMIT,
+				.sql = "COMMIT;",
+				.args = "",
+				.stmt = NULL,
+				.result = SQLITE_DONE,
+				.ret = ""
+		},
+		[TRANSACTION_ROLLBACK] = {
+				.idx = TRANSACTION_ROLLBACK,
+				.sql = "ROLLBACK;",
+				.args = "",
+				.stmt = NULL,
+				.result = SQLITE_DONE,
+				.ret = ""
+		},
+		[INSERT] = {
+				.idx = INSERT,
+				.sql = "INSERT INTO digests(flag, digest, value, time) VALUES"
+						"(?1, ?2, ?3, ?4);",
+				.args = "SBII",
+				.stmt = NULL,
+				.result = SQLITE_DONE,
+				.ret = ""
+		},
+		[UPDATE] = {
+				.idx = UPDATE,
+				.sql = "UPDATE digests SET flag=?1, value=?2, time=?3 WHERE "
+						"digest==?4;",
+				.args = "SIIB",
+				.stmt = NULL,
+				.result = SQLITE_DONE,
+				.ret = ""
+		},
+		[INSERT_SHINGLE] = {
+				.idx = INSERT_SHINGLE,
+				.sql = "INSERT OR REPLACE INTO shingles(value, number, digest_id) "
+						"VALUES (?1, ?2, ?3);",
+				.args = "III",
+				.stmt = NULL,
+				.result = SQLITE_DONE,
+				.ret = ""
+		},
+		[CHECK_DIGEST_ID] = {
+				.idx = CHECK_DIGEST_ID,
+				.sql = "SELECT id FROM digests WHERE digest==?1",
+				.args = "B",
+				.stmt = NULL,
+				.result = SQLITE_ROW,
+				.ret = "I"
+		},
+};
+
+struct fuzzy_stream_stat {
+	guint64 chunks;
+	guint64 hashes;
+	guint64 shingles;
+	guint64 skipped;
+	gdouble start;
+};
+
+static const char *
+rspamadm_fuzzy_export_help (gboolean full_help,
+		const struct rspamadm_command *cmd)
+{
+	const char *help_str;
+
+	if (full_help) {
+		help_str = "Export fuzzy hashes from sqlite3 database to a compressed stream\n\n"
+				"Usage: rspamadm fuzzy_export -d <sqlite_db> -o <file>\n"
+				"Where options are:\n\n"
+				"-d: sqlite3 database to export\n"
+				"-o: output file (`-` for stdout)\n"
+				"-n: number of hashes per chunk (default: 65536)\n"
+				"-l: zstd compression level (default: 3)\n"
+				"-q: suppress progress output\n"
+				"--help: shows available options and commands";
+	}
+	else {
+		help_str = "Export fuzzy hashes to a stream";
+	}
+
+	return help_str;
+}
+
+static const char *
+rspamadm_fuzzy_import_help (gboolean full_help,
+		const struct rspamadm_command *cmd)
+{
+	const char *help_str;
+
+	if (full_help) {
+		help_str = "Import fuzzy hashes stream to sqlite3 database or redis\n\n"
+				"Usage: rspamadm fuzzy_import -i <file> (-d <sqlite_db> | --host <redis>)\n"
+				"Where options are:\n\n"
+				"-i: input file produced by fuzzy_export\n"
+				"-d: import to sqlite3 database\n"
+				"--host: import to redis (ip:port or /path/to/socket)\n"
+				"-D: redis database\n"
+				"-p: redis password\n"
+				"--prefix: prefix of fuzzy keys in redis (default: fuzzy)\n"
+				"-e: expire time of hashes in redis in seconds, expire time is\n"
+				"    counted from the last update of a hash, so hashes that are\n"
+				"    already expired are skipped\n"
+				"-j: number of processes to import to redis\n"
+				"-s: state file prefix (default: <input>.state)\n"
+				"-r: resume an interrupted import, the same -j must be used\n"
+				"-q: suppress progress output\n"
+				"--help: shows available options and commands";
+	}
+	else {
+		help_str = "Import fuzzy hashes from a stream";
+	}
+
+	return help_str;
+}
+
+static void
+rspamadm_fuzzy_stream_progress (const gchar *what, gint worker,
+		struct fuzzy_stream_stat *st, gboolean final)
+{
+	gdouble elapsed;
+
+	if (quiet) {
+		return;
+	}
+
+	elapsed = rspamd_get_ticks (FALSE) - st->start;
+
+	if (elapsed <= 0) {
+		elapsed = 1e-6;
+	}
+
+	if (worker >= 0) {
+		rspamd_fprintf (stderr, "worker %d: ", worker);
+	}
+
+	rspamd_fprintf (stderr, "%s%s %uL chunks, %uL hashes, %uL shingles, "
+			"%uL skipped in %.1f seconds (%.0f hashes/s)\n",
+			final ? "finished: " : "",
+			what,
+			st->chunks, st->hashes, st->shingles, st->skipped,
+			elapsed, st->hashes / elapsed);
+}
+
+/*
+ * Export
+ */
+
+static gboolean
+rspamadm_fuzzy_stream_flush (FILE *out, GByteArray *raw, guint nrecords,
+		GByteArray *cbuf)
+{
+	struct fuzzy_stream_chunk_hdr hdr;
+	gsize r, bound;
+
+	bound = ZSTD_compressBound (raw->len);
+	g_byte_array_set_size (cbuf, bound);
+	r = ZSTD_compress (cbuf->data, bound, raw->data, raw->len,
+			compression_level);
+
+	if (ZSTD_isError (r)) {
+		rspamd_fprintf (stderr, "cannot compress chunk: %s\n",
+				ZSTD_getErrorName (r));
+		return FALSE;
+	}
+
+	hdr.clen = GUINT32_TO_LE (r);
+	hdr.rlen = GUINT32_TO_LE (raw->len);
+	hdr.nrecords = GUINT32_TO_LE (nrecords);
+	hdr.hash = GUINT64_TO_LE (rspamd_cryptobox_fast_hash (raw->data,
+			raw->len, 0));
+
+	if (fwrite (&hdr, sizeof (hdr), 1, out) != 1 ||
+			fwrite (cbuf->data, r, 1, out) != 1) {
+		rspamd_fprintf (stderr, "cannot write chunk: %s\n", strerror (errno));
+		return FALSE;
+	}
+
+	g_byte_array_set_size (raw, 0);
+
+	return TRUE;
+}
+
+static void
+rspamadm_fuzzy_export (gint argc, gchar **argv,
+		const struct rspamadm_command *cmd)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	rspamd_mempool_t *pool;
+	sqlite3 *db;
+	sqlite3_stmt *stmt, *shgl_stmt;
+	GByteArray *raw, *cbuf;
+	FILE *out;
+	struct fuzzy_stream_record rec;
+	struct fuzzy_stream_shingle shgl;
+	struct fuzzy_stream_stat st;
+	struct fuzzy_stream_shingle shingles[G_MAXUINT8];
+	gint64 id, shgl_id = -1;
+	gint shgl_rc;
+	guint nrecords = 0, nshingles;
+
+	context = g_option_context_new (
+			"fuzzy_export - export fuzzy hashes to a stream");
+	g_option_context_set_summary (context,
+			"Summary:\n  Rspamd administration utility version "
+					RVERSION
+					"\n  Release id: "
+					RID);
+	g_option_context_add_main_entries (context, export_entries, NULL);
+
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		rspamd_fprintf (stderr, "option parsing failed: %s\n", error->message);
+		g_error_free (error);
+		exit (EXIT_FAILURE);
+	}
+
+	if (source_db == NULL || output == NULL) {
+		rspamd_fprintf (stderr, "no database or no output has been specified\n");
+		exit (EXIT_FAILURE);
+	}
+
+	if (chunk_size <= 0) {
+		chunk_size = FUZZY_STREAM_DEFAULT_CHUNK;
+	}
+
+	pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "fuzzy_export");
+	db = rspamd_sqlite3_open_or_create (pool, source_db, NULL, 0, &error);
+
+	if (db == NULL) {
+		rspamd_fprintf (stderr, "cannot open source %s: %s\n", source_db,
+				error->message);
+		g_error_free (error);
+		exit (EXIT_FAILURE);
+	}
+
+	if (sqlite3_prepare_v2 (db, select_digests_sql, -1, &stmt, NULL) !=
+			SQLITE_OK ||
+			sqlite3_prepare_v2 (db, select_shingles_sql, -1, &shgl_stmt, NULL)
+			!= SQLITE_OK) {
+		rspamd_fprintf (stderr, "cannot prepare statement: %s\n",
+				sqlite3_errmsg (db));
+		exit (EXIT_FAILURE);
+	}
+
+	if (strcmp (output, "-") == 0) {
+		out = stdout;
+	}
+	else {
+		out = fopen (output, "w");
+
+		if (out == NULL) {
+			rspamd_fprintf (stderr, "cannot open %s: %s\n", output,
+					strerror (errno));
+			exit (EXIT_FAILURE);
+		}
+	}
+
+	if (fwrite (FUZZY_STREAM_MAGIC, sizeof (FUZZY_STREAM_MAGIC) - 1, 1, out)
+			!= 1) {
+		rspamd_fprintf (stderr, "cannot write %s: %s\n", output,
+				strerror (errno));
+		exit (EXIT_FAILURE);
+	}
+
+	memset (&st, 0, sizeof (st));
+	st.start = rspamd_get_ticks (FALSE);
+	raw = g_byte_array_sized_new (chunk_size * (sizeof (rec) + sizeof (shgl)));
+	cbuf = g_byte_array_new ();
+	shgl_rc = sqlite3_step (shgl_stmt);
+
+	if (shgl_rc == SQLITE_ROW) {
+		shgl_id = sqlite3_column_int64 (shgl_stmt, 0);
+	}
+
+	while (sqlite3_step (stmt) == SQLITE_ROW) {
+		/* id, flag, digest, value, time */
+		id = sqlite3_column_int64 (stmt, 0);
+		nshingles = 0;
+
+		/* Shingles of digests that are not exported are skipped */
+		while (shgl_rc == SQLITE_ROW && shgl_id <= id) {
+			if (shgl_id == id && nshingles < G_N_ELEMENTS (shingles)) {
+				shingles[nshingles].number = GUINT32_TO_LE (
+						sqlite3_column_int64 (shgl_stmt, 1));
+				shingles[nshingles].value = GUINT64_TO_LE (
+						sqlite3_column_int64 (shgl_stmt, 2));
+				nshingles ++;
+			}
+
+			shgl_rc = sqlite3_step (shgl_stmt);
+
+			if (shgl_rc == SQLITE_ROW) {
+				shgl_id = sqlite3_column_int64 (shgl_stmt, 0);
+			}
+		}
+
+		if (sqlite3_column_bytes (stmt, 2) != sizeof (rec.digest)) {
+			st.skipped ++;
+			continue;
+		}
+
+		memcpy (rec.digest, sqlite3_column_blob (stmt, 2), sizeof (rec.digest));
+		rec.flag = GUINT32_TO_LE (sqlite3_column_int64 (stmt, 1));
+		rec.value = GINT64_TO_LE (sqlite3_column_int64 (stmt, 3));
+		rec.time = GINT64_TO_LE (sqlite3_column_int64 (stmt, 4));
+		rec.nshingles = nshingles;
+		g_byte_array_append (raw, (const guint8 *)&rec, sizeof (rec));
+
+		if (nshingles > 0) {
+			g_byte_array_append (raw, (const guint8 *)shingles,
+					sizeof (shingles[0]) * nshingles);
+		}
+
+		st.hashes ++;
+		st.shingles += nshingles;
+
+		/* Huge chunks are split to keep them below the import limit */
+		if (++nrecords >= (guint)chunk_size ||
+				raw->len >= FUZZY_STREAM_MAX_RAW / 2) {
+			if (!rspamadm_fuzzy_stream_flush (out, raw, nrecords, cbuf)) {
+				exit (EXIT_FAILURE);
+			}
+
+			nrecords = 0;
+			st.chunks ++;
+
+			if (st.chunks % 16 == 0) {
+				rspamadm_fuzzy_stream_progress ("exported", -1, &st, FALSE);
+			}
+		}
+	}
+
+	if (nrecords > 0) {
+		if (!rspamadm_fuzzy_stream_flush (out, raw, nrecords, cbuf)) {
+			exit (EXIT_FAILURE);
+		}
+
+		st.chunks ++;
+	}
+
+	if (fflush (out) != 0 || (out != stdout && fclose (out) != 0)) {
+		rspamd_fprintf (stderr, "cannot write %s: %s\n", output,
+				strerror (errno));
+		exit (EXIT_FAILURE);
+	}
+
+	rspamadm_fuzzy_stream_progress ("exported", -1, &st, TRUE);
+
+	sqlite3_finalize (stmt);
+	sqlite3_finalize (shgl_stmt);
+	sqlite3_close (db);
+	g_byte_array_free (raw, TRUE);
+	g_byte_array_free (cbuf, TRUE);
+	g_option_context_free (context);
+	rspamd_mempool_delete (pool);
+
+	exit (EXIT_SUCCESS);
+}
+
+/*
+ * Import
+ */
+
+struct fuzzy_stream_reader {
+	FILE *f;
+	GByteArray *cbuf;
+	GByteArray *raw;
+	guint idx; /* index of the next chunk */
+	guint nrecords;
+};
+
+/*
+ * Reads the next chunk, its payload is decompressed and verified if `load`
+ * is TRUE and skipped otherwise.
+ * Returns 1 if a chunk has been read, 0 on the end of stream and -1 on error
+ */
+static gint
+rspamadm_fuzzy_stream_next (struct fuzzy_stream_reader *rd, gboolean load)
+{
+	struct fuzzy_stream_chunk_hdr hdr;
+	gsize r;
+	guint32 clen, rlen;
+
+	r = fread (&hdr, 1, sizeof (hdr), rd->f);
+
+	if (r != sizeof (hdr)) {
+		if (r == 0 && feof (rd->f)) {
+			return 0;
+		}
+
+		rspamd_fprintf (stderr, "chunk %ud is truncated\n", rd->idx);
+		return -1;
+	}
+
+	clen = GUINT32_FROM_LE (hdr.clen);
+	rlen = GUINT32_FROM_LE (hdr.rlen);
+	rd->nrecords = GUINT32_FROM_LE (hdr.nrecords);
+
+	if (rlen > FUZZY_STREAM_MAX_RAW || clen > ZSTD_compressBound (rlen)) {
+		rspamd_fprintf (stderr, "chunk %ud is corrupted\n", rd->idx);
+		return -1;
+	}
+
+	if (!load) {
+		if (fseeko (rd->f, clen, SEEK_CUR) == -1) {
+			rspamd_fprintf (stderr, "cannot skip chunk %ud: %s\n", rd->idx,
+					strerror (errno));
+			return -1;
+		}
+
+		rd->idx ++;
+
+		return 1;
+	}
+
+	g_byte_array_set_size (rd->cbuf, clen);
+	g_byte_array_set_size (rd->raw, rlen);
+
+	if (fread (rd->cbuf->data, clen, 1, rd->f) != 1) {
+		rspamd_fprintf (stderr, "chunk %ud is truncated\n", rd->idx);
+		return -1;
+	}
+
+	r = ZSTD_decompress (rd->raw->data, rlen, rd->cbuf->data, clen);
+
+	if (ZSTD_isError (r)) {
+		rspamd_fprintf (stderr, "cannot decompress chunk %ud: %s\n", rd->idx,
+				ZSTD_getErrorName (r));
+		return -1;
+	}
+
+	if (r != rlen || rspamd_cryptobox_fast_hash (rd->raw->data, rlen, 0) !=
+			GUINT64_FROM_LE (hdr.hash)) {
+		rspamd_fprintf (stderr, "chunk %ud is corrupted\n", rd->idx);
+		return -1;
+	}
+
+	rd->idx ++;
+
+	return 1;
+}
+
+/*
+ * Returns record at the offset specified, moves offset to the next record
+ * and sets shingles pointer to the unaligned array of shingles
+ */
+static gboolean
+rspamadm_fuzzy_stream_record (GByteArray *raw, gsize *off,
+		struct fuzzy_stream_record *rec, const guchar **shingles)
+{
+	gsize remain = raw->len - *off;
+
+	if (remain < sizeof (*rec)) {
+		return FALSE;
+	}
+
+	memcpy (rec, raw->data + *off, sizeof (*rec));
+	remain -= sizeof (*rec);
+
+	if (remain < rec->nshingles * sizeof (struct fuzzy_stream_shingle)) {
+		return FALSE;
+	}
+
+	rec->flag = GUINT32_FROM_LE (rec->flag);
+	rec->value = GINT64_FROM_LE (rec->value);
+	rec->time = GINT64_FROM_LE (rec->time);
+	*shingles = raw->data + *off + sizeof (*rec);
+	*off += sizeof (*rec) + rec->nshingles * sizeof (struct fuzzy_stream_shingle);
+
+	return TRUE;
+}
+
+static inline void
+rspamadm_fuzzy_stream_shingle (const guchar *shingles, guint i,
+		guint *number, guint64 *value)
+{
+	struct fuzzy_stream_shingle shgl;
+
+	memcpy (&shgl, shingles + i * sizeof (shgl), sizeof (shgl));
+	*number = GUINT32_FROM_LE (shgl.number);
+	*value = GUINT64_FROM_LE (shgl.value);
+}
+
+struct fuzzy_stream_target {
+	/* Sqlite */
+	rspamd_mempool_t *pool;
+	sqlite3 *db;
+	GArray *prstmt;
+	/* Redis */
+	redisContext *redis;
+	GString *key;
+	gint64 now;
+};
+
+static gboolean
+rspamadm_fuzzy_import_sqlite (struct fuzzy_stream_target *tgt,
+		struct fuzzy_stream_reader *rd, struct fuzzy_stream_stat *st)
+{
+	struct fuzzy_stream_record rec;
+	const guchar *shingles;
+	gsize off = 0;
+	gint64 id;
+	guint i, number;
+	guint64 value;
+
+	if (rspamd_sqlite3_run_prstmt (tgt->pool, tgt->db, tgt->prstmt,
+			TRANSACTION_START) != SQLITE_OK) {
+		rspamd_fprintf (stderr, "cannot start transaction: %s\n",
+				sqlite3_errmsg (tgt->db));
+		return FALSE;
+	}
+
+	while (rspamadm_fuzzy_stream_record (rd->raw, &off, &rec, &shingles)) {
+		/* Existing hashes are overwritten to make import idempotent */
+		if (rspamd_sqlite3_run_prstmt (tgt->pool, tgt->db, tgt->prstmt,
+				CHECK_DIGEST_ID,
+				(gint64)sizeof (rec.digest), rec.digest,
+				&id) == SQLITE_OK) {
+			if (rspamd_sqlite3_run_prstmt (tgt->pool, tgt->db, tgt->prstmt,
+					UPDATE,
+					(gint)rec.flag, rec.value, rec.time,
+					(gint64)sizeof (rec.digest), rec.digest) != SQLITE_OK) {
+				rspamd_fprintf (stderr, "cannot update digest: %s\n",
+						sqlite3_errmsg (tgt->db));
+				goto err;
+			}
+		}
+		else {
+			if (rspamd_sqlite3_run_prstmt (tgt->pool, tgt->db, tgt->prstmt,
+					INSERT,
+					(gint)rec.flag,
+					(gint64)sizeof (rec.digest), rec.digest,
+					rec.value, rec.time) != SQLITE_OK) {
+				rspamd_fprintf (stderr, "cannot insert digest: %s\n",
+						sqlite3_errmsg (tgt->db));
+				goto err;
+			}
+
+			id = sqlite3_last_insert_rowid (tgt->db);
+		}
+
+		for (i = 0; i < rec.nshingles; i ++) {
+			rspamadm_fuzzy_stream_shingle (shingles, i, &number, &value);
+
+			if (rspamd_sqlite3_run_prstmt (tgt->pool, tgt->db, tgt->prstmt,
+					INSERT_SHINGLE,
+					(gint64)value, (gint64)number, id) != SQLITE_OK) {
+				rspamd_fprintf (stderr, "cannot insert shingle: %s\n",
+						sqlite3_errmsg (tgt->db));
+				goto err;
+			}
+		}
+
+		st->hashes ++;
+		st->shingles += rec.nshingles;
+	}
+
+	if (off != rd->raw->len) {
+		rspamd_fprintf (stderr, "chunk %ud has a truncated record\n",
+				rd->idx - 1);
+		goto err;
+	}
+
+	if (rspamd_sqlite3_run_prstmt (tgt->pool, tgt->db, tgt->prstmt,
+			TRANSACTION_COMMIT) != SQLITE_OK) {
+		rspamd_fprintf (stderr, "cannot commit transaction: %s\n",
+				sqlite3_errmsg (tgt->db));
+		goto err;
+	}
+
+	return TRUE;
+
+err:
+	rspamd_sqlite3_run_prstmt (tgt->pool, tgt->db, tgt->prstmt,
+			TRANSACTION_ROLLBACK);
+
+	return FALSE;
+}
+
+static void
+rspamadm_fuzzy_redis_key (struct fuzzy_stream_target *tgt,
+		const guchar *digest)
+{
+	g_string_assign (tgt->key, redis_prefix);
+	g_string_append_len (tgt->key, (const gchar *)digest, 64);
+}
+
+static gboolean
+rspamadm_fuzzy_import_redis (struct fuzzy_stream_target *tgt,
+		struct fuzzy_stream_reader *rd, struct fuzzy_stream_stat *st)
+{
+	struct fuzzy_stream_record rec;
+	const guchar *shingles;
+	const gchar *argv[8];
+	gsize argvlen[8];
+	gchar flagbuf[16], valbuf[32], timebuf[32], ttlbuf[32], countbuf[32];
+	gsize off = 0, flaglen, vallen, timelen, ttllen;
+	gint64 ttl;
+	guint i, number, ncommands = 0, nimported = 0;
+	guint64 value;
+	redisReply *reply;
+	gboolean ret = TRUE;
+
+	/*
+	 * Commands are the same as fuzzy storage emits:
+	 * HMSET <prefix><digest> F <flag> V <value> C <time>
+	 * EXPIRE <prefix><digest> <ttl>
+	 * SETEX <prefix>_<number>_<value> <ttl> <digest>
+	 * All of them are pipelined and replies are read once per chunk
+	 */
+	while (rspamadm_fuzzy_stream_record (rd->raw, &off, &rec, &shingles)) {
+		if (fuzzy_expiry > 0) {
+			ttl = rec.time + fuzzy_expiry - tgt->now;
+
+			if (ttl <= 0) {
+				st->skipped ++;
+				continue;
+			}
+		}
+		else {
+			ttl = 0;
+		}
+
+		rspamadm_fuzzy_redis_key (tgt, rec.digest);
+		flaglen = rspamd_snprintf (flagbuf, sizeof (flagbuf), "%ud", rec.flag);
+		vallen = rspamd_snprintf (valbuf, sizeof (valbuf), "%L", rec.value);
+		timelen = rspamd_snprintf (timebuf, sizeof (timebuf), "%L", rec.time);
+		ttllen = rspamd_snprintf (ttlbuf, sizeof (ttlbuf), "%L", ttl);
+
+		{
+			const gchar *hargv[] = {"HMSET", tgt->key->str, "F", flagbuf,
+					"V", valbuf, "C", timebuf};
+			const gsize hargvlen[] = {sizeof ("HMSET") - 1, tgt->key->len,
+					1, flaglen, 1, vallen, 1, timelen};
+
+			redisAppendCommandArgv (tgt->redis, G_N_ELEMENTS (hargv), hargv,
+					hargvlen);
+			ncommands ++;
+		}
+
+		if (ttl > 0) {
+			argv[0] = "EXPIRE";
+			argvlen[0] = sizeof ("EXPIRE") - 1;
+			argv[1] = tgt->key->str;
+			argvlen[1] = tgt->key->len;
+			argv[2] = ttlbuf;
+			argvlen[2] = ttllen;
+			redisAppendCommandArgv (tgt->redis, 3, argv, argvlen);
+			ncommands ++;
+		}
+
+		for (i = 0; i < rec.nshingles; i ++) {
+			rspamadm_fuzzy_stream_shingle (shingles, i, &number, &value);
+			g_string_set_size (tgt->key, 0);
+			rspamd_printf_gstring (tgt->key, "%s_%ud_%uL",
+					redis_prefix, number, value);
+
+			if (ttl > 0) {
+				argv[0] = "SETEX";
+				argvlen[0] = sizeof ("SETEX") - 1;
+				argv[1] = tgt->key->str;
+				argvlen[1] = tgt->key->len;
+				argv[2] = ttlbuf;
+				argvlen[2] = ttllen;
+				argv[3] = (const gchar *)rec.digest;
+				argvlen[3] = sizeof (rec.digest);
+				redisAppendCommandArgv (tgt->redis, 4, argv, argvlen);
+			}
+			else {
+				argv[0] = "SET";
+				argvlen[0] = sizeof ("SET") - 1;
+				argv[1] = tgt->key->str;
+				argvlen[1] = tgt->key->len;
+				argv[2] = (const gchar *)rec.digest;
+				argvlen[2] = sizeof (rec.digest);
+				redisAppendCommandArgv (tgt->redis, 3, argv, argvlen);
+			}
+
+			ncommands ++;
+		}
+
+		nimported ++;
+		st->shingles += rec.nshingles;
+	}
+
+	if (off != rd->raw->len) {
+		rspamd_fprintf (stderr, "chunk %ud has a truncated record\n",
+				rd->idx - 1);
+		ret = FALSE;
+	}
+
+	if (nimported > 0) {
+		/*
+		 * Counter is not idempotent: a chunk that has been interrupted is
+		 * imported again on resume and counted twice
+		 */
+		g_string_assign (tgt->key, redis_prefix);
+		g_string_append (tgt->key, "_count");
+		argv[0] = "INCRBY";
+		argvlen[0] = sizeof ("INCRBY") - 1;
+		argv[1] = tgt->key->str;
+		argvlen[1] = tgt->key->len;
+		argv[2] = countbuf;
+		argvlen[2] = rspamd_snprintf (countbuf, sizeof (countbuf), "%ud",
+				nimported);
+		redisAppendCommandArgv (tgt->redis, 3, argv, argvlen);
+		ncommands ++;
+	}
+
+	/* All replies must be read even if some command has failed */
+	for (i = 0; i < ncommands; i ++) {
+		if (redisGetReply (tgt->redis, (void **)&reply) != REDIS_OK) {
+			rspamd_fprintf (stderr, "redis error: %s\n", tgt->redis->errstr);
+			return FALSE;
+		}
+
+		if (reply->type == REDIS_REPLY_ERROR) {
+			if (ret) {
+				rspamd_fprintf (stderr, "redis error: %s\n", reply->str);
+			}
+
+			ret = FALSE;
+		}
+
+		freeReplyObject (reply);
+	}
+
+	st->hashes += nimported;
+
+	return ret;
+}
+
+static redisContext *
+rspamadm_fuzzy_redis_connect (void)
+{
+	redisContext *ctx;
+	redisReply *reply;
+	struct timeval tv;
+	gchar *host, *p;
+	gulong port = 6379;
+
+	double_to_tv (5.0, &tv);
+
+	if (redis_host[0] == '/' || redis_host[0] == '.') {
+		ctx = redisConnectUnixWithTimeout (redis_host, tv);
+	}
+	else {
+		host = g_strdup (redis_host);
+		p = strrchr (host, ':');
+
+		if (p != NULL && strchr (host, ':') == p) {
+			/* Not an IPv6 address */
+			*p++ = '\0';
+
+			if (!rspamd_strtoul (p, strlen (p), &port) || port > G_MAXUINT16) {
+				rspamd_fprintf (stderr, "invalid redis port: %s\n", p);
+				exit (EXIT_FAILURE);
+			}
+		}
+		else if (host[0] == '[' && (p = strstr (host, "]:")) != NULL) {
+			*p = '\0';
+			p += 2;
+
+			if (!rspamd_strtoul (p, strlen (p), &port) || port > G_MAXUINT16) {
+				rspamd_fprintf (stderr, "invalid redis port: %s\n", p);
+				exit (EXIT_FAILURE);
+			}
+
+			memmove (host, host + 1, strlen (host));
+		}
+
+		ctx = redisConnectWithTimeout (host, port, tv);
+		g_free (host);
+	}
+
+	if (ctx == NULL || ctx->err) {
+		rspamd_fprintf (stderr, "cannot connect to redis %s: %s\n", redis_host,
+				ctx ? ctx->errstr : "cannot allocate context");
+		exit (EXIT_FAILURE);
+	}
+
+	if (redis_password) {
+		reply = redisCommand (ctx, "AUTH %s", redis_password);
+
+		if (reply == NULL || reply->type == REDIS_REPLY_ERROR) {
+			rspamd_fprintf (stderr, "cannot authenticate to redis: %s\n",
+					reply ? reply->str : ctx->errstr);
+			exit (EXIT_FAILURE);
+		}
+
+		freeReplyObject (reply);
+	}
+
+	if (redis_db) {
+		reply = redisCommand (ctx, "SELECT %s", redis_db);
+
+		if (reply == NULL || reply->type == REDIS_REPLY_ERROR) {
+			rspamd_fprintf (stderr, "cannot select redis database: %s\n",
+					reply ? reply->str : ctx->errstr);
+			exit (EXIT_FAILURE);
+		}
+
+		freeReplyObject (reply);
+	}
+
+	/* Pipeline of a whole chunk can be large, so wait for replies longer */
+	double_to_tv (60.0, &tv);
+	redisSetTimeout (ctx, tv);
+
+	return ctx;
+}
+
+static gchar *
+rspamadm_fuzzy_state_path (gint worker)
+{
+	return g_strdup_printf ("%s.%d", state_file, worker);
+}
+
+/*
+ * State file contains the number of workers and the index of the last chunk
+ * imported by this worker, returns -1 if nothing has been imported
+ */
+static gint64
+rspamadm_fuzzy_state_load (gint worker, gint nworkers)
+{
+	gchar *path;
+	FILE *f;
+	gint njobs;
+	gint64 last = -1;
+
+	path = rspamadm_fuzzy_state_path (worker);
+	f = fopen (path, "r");
+
+	if (f == NULL) {
+		g_free (path);
+		return -1;
+	}
+
+	if (fscanf (f, "%d %" G_GINT64_FORMAT, &njobs, &last) != 2) {
+		rspamd_fprintf (stderr, "invalid state file %s\n", path);
+		exit (EXIT_FAILURE);
+	}
+
+	if (njobs != nworkers) {
+		rspamd_fprintf (stderr, "state file %s has been written by %d jobs, "
+				"%d jobs are requested\n", path, njobs, nworkers);
+		exit (EXIT_FAILURE);
+	}
+
+	fclose (f);
+	g_free (path);
+
+	return last;
+}
+
+static gboolean
+rspamadm_fuzzy_state_save (gint worker, gint nworkers, gint64 last)
+{
+	gchar *path, *tmp;
+	FILE *f;
+	gboolean ret = FALSE;
+
+	path = rspamadm_fuzzy_state_path (worker);
+	tmp = g_strdup_printf ("%s.tmp", path);
+	f = fopen (tmp, "w");
+
+	if (f != NULL) {
+		rspamd_fprintf (f, "%d %L\n", nworkers, last);
+
+		/* Rename is atomic, so a state file is either old or new */
+		if (fclose (f) == 0 && rename (tmp, path) == 0) {
+			ret = TRUE;
+		}
+	}
+
+	if (!ret) {
+		rspamd_fprintf (stderr, "cannot save state %s: %s\n", path,
+				strerror (errno));
+	}
+
+	g_free (tmp);
+	g_free (path);
+
+	return ret;
+}
+
+static gint
+rspamadm_fuzzy_import_worker (gint worker, gint nworkers)
+{
+	struct fuzzy_stream_reader rd;
+	struct fuzzy_stream_target tgt;
+	struct fuzzy_stream_stat st;
+	gchar magic[sizeof (FUZZY_STREAM_MAGIC) - 1];
+	GError *error = NULL;
+	gint64 last = -1;
+	gint r;
+	gboolean mine, ok;
+
+	memset (&rd, 0, sizeof (rd));
+	memset (&tgt, 0, sizeof (tgt));
+	memset (&st, 0, sizeof (st));
+	rd.f = fopen (input, "r");
+
+	if (rd.f == NULL) {
+		rspamd_fprintf (stderr, "cannot open %s: %s\n", input, strerror (errno));
+		return EXIT_FAILURE;
+	}
+
+	if (fread (magic, sizeof (magic), 1, rd.f) != 1 ||
+			memcmp (magic, FUZZY_STREAM_MAGIC, sizeof (magic)) != 0) {
+		rspamd_fprintf (stderr, "%s is not a fuzzy stream\n", input);
+		return EXIT_FAILURE;
+	}
+
+	if (resume) {
+		last = rspamadm_fuzzy_state_load (worker, nworkers);
+	}
+
+	if (target_db) {
+		tgt.pool = rspamd_mempool_new (rspamd_mempool_suggest_size (),
+				"fuzzy_import");
+		tgt.db = rspamd_sqlite3_open_or_create (tgt.pool, target_db,
+				create_tables_sql, 0, &error);
+
+		if (tgt.db == NULL) {
+			rspamd_fprintf (stderr, "cannot open destination: %s\n",
+					error->message);
+			g_error_free (error);
+			return EXIT_FAILURE;
+		}
+
+		tgt.prstmt = rspamd_sqlite3_init_prstmt (tgt.db, prepared_stmts,
+				STMAX, &error);
+
+		if (tgt.prstmt == NULL) {
+			rspamd_fprintf (stderr, "cannot init prepared statements: %s\n",
+					error->message);
+			g_error_free (error);
+			return EXIT_FAILURE;
+		}
+	}
+	else {
+		tgt.redis = rspamadm_fuzzy_redis_connect ();
+		tgt.key = g_string_sized_new (128);
+		tgt.now = rspamd_get_calendar_ticks ();
+	}
+
+	rd.cbuf = g_byte_array_new ();
+	rd.raw = g_byte_array_new ();
+	st.start = rspamd_get_ticks (FALSE);
+
+	for (;;) {
+		mine = (rd.idx % nworkers) == (guint)worker && (gint64)rd.idx > last;
+		r = rspamadm_fuzzy_stream_next (&rd, mine);
+
+		if (r == 0) {
+			break;
+		}
+		else if (r == -1) {
+			return EXIT_FAILURE;
+		}
+
+		if (!mine) {
+			continue;
+		}
+
+		if (tgt.db) {
+			ok = rspamadm_fuzzy_import_sqlite (&tgt, &rd, &st);
+		}
+		else {
+			ok = rspamadm_fuzzy_import_redis (&tgt, &rd, &st);
+		}
+
+		if (!ok || !rspamadm_fuzzy_state_save (worker, nworkers, rd.idx - 1)) {
+			rspamd_fprintf (stderr, "import has been interrupted at chunk %ud, "
+					"use --resume to continue\n", rd.idx - 1);
+			return EXIT_FAILURE;
+		}
+
+		st.chunks ++;
+
+		if (st.chunks % 16 == 0) {
+			rspamadm_fuzzy_stream_progress ("imported",
+					nworkers > 1 ? worker : -1, &st, FALSE);
+		}
+	}
+
+	rspamadm_fuzzy_stream_progress ("imported", nworkers > 1 ? worker : -1,
+			&st, TRUE);
+
+	if (tgt.db) {
+		rspamd_sqlite3_close_prstmt (tgt.db, tgt.prstmt);
+		sqlite3_close (tgt.db);
+		rspamd_mempool_delete (tgt.pool);
+	}
+	else {
+		redisFree (tgt.redis);
+		g_string_free (tgt.key, TRUE);
+	}
+
+	fclose (rd.f);
+	g_byte_array_free (rd.cbuf, TRUE);
+	g_byte_array_free (rd.raw, TRUE);
+
+	return EXIT_SUCCESS;
+}
+
+static void
+rspamadm_fuzzy_import (gint argc, gchar **argv,
+		const struct rspamadm_command *cmd)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	pid_t *pids;
+	gchar *path;
+	gint i, status, ret = EXIT_SUCCESS;
+
+	context = g_option_context_new (
+			"fuzzy_import - import fuzzy hashes from a stream");
+	g_option_context_set_summary (context,
+			"Summary:\n  Rspamd administration utility version "
+					RVERSION
+					"\n  Release id: "
+					RID);
+	g_option_context_add_main_entries (context, import_entries, NULL);
+
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		rspamd_fprintf (stderr, "option parsing failed: %s\n", error->message);
+		g_error_free (error);
+		exit (EXIT_FAILURE);
+	}
+
+	if (input == NULL || (target_db == NULL) == (redis_host == NULL)) {
+		rspamd_fprintf (stderr, "input and either sqlite database or "
+				"redis host must be specified\n");
+		exit (EXIT_FAILURE);
+	}
+
+	if (state_file == NULL) {
+		state_file = g_strdup_printf ("%s.state", input);
+	}
+
+	if (jobs < 1) {
+		jobs = 1;
+	}
+
+	if (target_db && jobs > 1) {
+		/* Sqlite has a single writer anyway */
+		if (!quiet) {
+			rspamd_fprintf (stderr, "sqlite import uses a single job\n");
+		}
+
+		jobs = 1;
+	}
+
+	if (jobs == 1) {
+		ret = rspamadm_fuzzy_import_worker (0, 1);
+	}
+	else {
+		/* Chunks are distributed between processes by their indexes */
+		pids = g_malloc0 (sizeof (*pids) * jobs);
+
+		for (i = 0; i < jobs; i ++) {
+			pids[i] = fork ();
+
+			if (pids[i] == -1) {
+				rspamd_fprintf (stderr, "cannot fork: %s\n", strerror (errno));
+				exit (EXIT_FAILURE);
+			}
+			else if (pids[i] == 0) {
+				exit (rspamadm_fuzzy_import_worker (i, jobs));
+			}
+		}
+
+		for (i = 0; i < jobs; i ++) {
+			if (waitpid (pids[i], &status, 0) == -1 ||
+					!WIFEXITED (status) || WEXITSTATUS (status) != 0) {
+				ret = EXIT_FAILURE;
+			}
+		}
+
+		g_free (pids);
+	}
+
+	if (ret == EXIT_SUCCESS) {
+		/* Everything is imported, so there is nothing to resume */
+		for (i = 0; i < jobs; i ++) {
+			path = rspamadm_fuzzy_state_path (i);
+			unlink (path);
+			g_free (path);
+		}
+	}
+
+	g_option_context_free (context);
+
+	exit (ret);
+}
@@ -0,0 +1,151 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "rspamadm.h"
+#include "printf.h"
+#include "libutil/map.h"
+#include "libutil/map_helpers.h"
+#include "libutil/map_private.h"
+
+static gchar *output = NULL;
+
+static void rspamadm_map_compile (gint argc, gchar **argv,
+		const struct rspamadm_command *cmd);
+static const char *rspamadm_map_compile_help (gboolean full_help,
+		const struct rspamadm_command *cmd);
+
+struct rspamadm_command map_compile_command = {
+		.name = "map_compile",
+		.flags = 0,
+		.help = rspamadm_map_compile_help,
+		.run = rspamadm_map_compile,
+		.lua_subrs = NULL,
+};
+
+static GOptionEntry entries[] = {
+		{"output", 'o', 0, G_OPTION_ARG_STRING, &output,
+				"Write compiled map to the specified file", NULL},
+		{NULL,       0,   0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
+};
+
+static const char *
+rspamadm_map_compile_help (gboolean full_help,
+		const struct rspamadm_command *cmd)
+{
+	const char *help_str;
+
+	if (full_help) {
+		help_str = "Compile hash map (e.g. list of domains) to the binary "
+				"format that is loaded with no parsing\n\n"
+				"Usage: rspamadm map_compile -o <output> <map_file>\n"
+				"Where options are:\n\n"
+				"-o: save compiled map to the specified file\n"
+				"--help: shows available options and commands\n\n"
+				"Compiled map could be signed by `rspamadm signtool` "
+				"as a usual map file";
+	}
+	else {
+		help_str = "Compile hash maps to binary format";
+	}
+
+	return help_str;
+}
+
+static void
+rspamadm_map_compile (gint argc, gchar **argv,
+		const struct rspamadm_command *cmd)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	struct rspamd_map map;
+	struct map_cb_data cbdata;
+	struct rspamd_hash_map_helper *ht;
+	GByteArray *image;
+	gchar *data;
+	gsize len;
+	FILE *out;
+
+	context = g_option_context_new (
+			"map_compile - compile hash maps to binary format");
+	g_option_context_set_summary (context,
+			"Summary:\n  Rspamd administration utility version "
+					RVERSION
+					"\n  Release id: "
+					RID);
+	g_option_context_add_main_entries (context, entries, NULL);
+
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		rspamd_fprintf (stderr, "option parsing failed: %s\n", error->message);
+		g_error_free (error);
+		exit (EXIT_FAILURE);
+	}
+
+	g_option_context_free (context);
+
+	if (argc < 2 || output == NULL) {
+		rspamd_fprintf (stderr, "%s\n",
+				rspamadm_map_compile_help (TRUE, cmd));
+		exit (EXIT_FAILURE);
+	}
+
+	if (!g_file_get_contents (argv[1], &data, &len, &error)) {
+		rspamd_fprintf (stderr, "cannot read %s: %e\n", argv[1], error);
+		g_error_free (error);
+		exit (EXIT_FAILURE);
+	}
+
+	if (len > G_MAXINT) {
+		rspamd_fprintf (stderr, "map %s is too large: %z bytes\n", argv[1],
+				len);
+		exit (EXIT_FAILURE);
+	}
+
+	memset (&map, 0, sizeof (map));
+	memset (&cbdata, 0, sizeof (cbdata));
+	map.name = argv[1];
+	cbdata.map = &map;
+
+	rspamd_kv_list_read (data, len, &cbdata, TRUE);
+	g_free (data);
+
+	ht = cbdata.cur_data;
+
+	if (ht == NULL) {
+		ht = rspamd_map_helper_new_hash (NULL);
+	}
+
+	image = rspamd_map_helper_serialize_hash (ht);
+	rspamd_map_helper_destroy_hash (ht);
+
+	out = fopen (output, "w");
+
+	if (out == NULL) {
+		rspamd_fprintf (stderr, "cannot open %s: %s\n", output,
+				strerror (errno));
+		exit (EXIT_FAILURE);
+	}
+
+	if (fwrite (image->data, 1, image->len, out) != image->len ||
+			fclose (out) != 0) {
+		rspamd_fprintf (stderr, "cannot write %s: %s\n", output,
+				strerror (errno));
+		exit (EXIT_FAILURE);
+	}
+
+	rspamd_printf ("compiled %s to %s: %z bytes\n", argv[1], output,
+			(gsize)image->len);
+	g_byte_array_free (image, TRUE);
+}
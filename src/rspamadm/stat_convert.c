@@ -16,9 +16,14 @@
 #include "config.h"
 #include "rspamadm.h"
 #include "lua/lua_common.h"
+#include "libstat/backends/backends.h"
 
 #include "contrib/uthash/utlist.h"
 
+#ifdef HAVE_SYS_WAIT_H
+#include <sys/wait.h>
+#endif
+
 /* Common */
 static gchar *config_file = NULL;
 static gchar *symbol_ham = NULL;
@@ -37,6 +42,18 @@ static gchar *redis_db = NULL;
 static gchar *redis_password = NULL;
 static gboolean reset_previous = FALSE;
 
+/* Mmaped statfiles to convert to cuckoo format */
+static gchar **mmap_files = NULL;
+
+/* Parallel conversion */
+static gint jobs = 1;
+static gint batch = 1000;
+
+/* Compaction */
+static gboolean compact = FALSE;
+static gdouble min_count = 1.0;
+static gchar *prefix = NULL;
+
 static void rspamadm_statconvert (gint argc, gchar **argv,
 								  const struct rspamadm_command *cmd);
 static const char *rspamadm_statconvert_help (gboolean full_help,
@@ -74,6 +91,18 @@ static GOptionEntry entries[] = {
 				"Password to connect to redis", NULL},
 		{"redis-db", 'd', 0, G_OPTION_ARG_STRING, &redis_db,
 				"Redis database (should be numeric)", NULL},
+		{"mmap", 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &mmap_files,
+				"Convert mmaped statfile to cuckoo format", NULL},
+		{"jobs", 'j', 0, G_OPTION_ARG_INT, &jobs,
+				"Number of processes to convert tokens", NULL},
+		{"batch", 'b', 0, G_OPTION_ARG_INT, &batch,
+				"Number of redis commands sent in a single pipeline", NULL},
+		{"compact", 0, 0, G_OPTION_ARG_NONE, &compact,
+				"Compact statistics in redis or mmaped statfiles", NULL},
+		{"min-count", 0, 0, G_OPTION_ARG_DOUBLE, &min_count,
+				"Drop tokens learned less than this number of times", NULL},
+		{"prefix", 0, 0, G_OPTION_ARG_STRING, &prefix,
+				"Prefix of tokens in redis (default: RS)", NULL},
 		{NULL,     0,   0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
 };
 
@@ -99,6 +128,18 @@ rspamadm_statconvert_help (gboolean full_help, const struct rspamadm_command *cm
 				"--ham-db: sqlite3 input file for ham data\n"
 				"--symbol-spam: symbol in redis for spam (e.g. BAYES_SPAM)\n"
 				"--symbol-ham: symbol in redis for ham (e.g. BAYES_HAM)\n"
+				"-j: number of processes to convert tokens\n"
+				"-b: number of redis commands sent in a single pipeline\n"
+				"** Or convert mmaped statfiles to cuckoo format **\n"
+				"--mmap: mmaped statfile to convert (can be repeated)\n"
+				"** Or compact statistics in redis or mmaped statfiles **\n"
+				"--compact: merge duplicate tokens and drop rare ones, redis\n"
+				"  keys are iterated by SCAN with -b keys per step, version 1\n"
+				"  statfiles are rebuilt in place and should not be used\n"
+				"  by rspamd meanwhile\n"
+				"--min-count: drop tokens learned less than this number of\n"
+				"  times (default: 1, i.e. merely unlearned tokens)\n"
+				"--prefix: prefix of tokens in redis (default: RS)\n"
 				;
 	}
 	else {
@@ -131,6 +172,54 @@ rspamadm_statconvert (gint argc, gchar **argv, const struct rspamadm_command *cm
 		exit (1);
 	}
 
+	if (mmap_files != NULL) {
+		rspamd_mempool_t *pool;
+		gchar **pfile;
+		gint ret = EXIT_SUCCESS;
+		struct rspamd_mmaped_file_compact_stat st;
+
+		/* Conversion is done in place, no need to read config */
+		pool = rspamd_mempool_new (rspamd_mempool_suggest_size (),
+				"statconvert");
+
+		for (pfile = mmap_files; *pfile != NULL; pfile ++) {
+			if (compact) {
+				if (!rspamd_mmaped_file_compact (pool, *pfile, min_count, &st,
+						&error)) {
+					rspamd_fprintf (stderr, "cannot compact %s: %s\n", *pfile,
+							error->message);
+					g_error_free (error);
+					error = NULL;
+					ret = EXIT_FAILURE;
+				}
+				else {
+					rspamd_printf ("compacted %s: %L tokens -> %L tokens "
+							"(%L duplicates merged, %L tokens dropped), "
+							"%z -> %z bytes\n",
+							*pfile,
+							(gint64)st.blocks_before, (gint64)st.blocks_after,
+							(gint64)st.merged, (gint64)st.dropped,
+							st.bytes_before, st.bytes_after);
+				}
+			}
+			else if (!rspamd_mmaped_file_convert (pool, *pfile, &error)) {
+				rspamd_fprintf (stderr, "cannot convert %s: %s\n", *pfile,
+						error->message);
+				g_error_free (error);
+				error = NULL;
+				ret = EXIT_FAILURE;
+			}
+			else {
+				rspamd_printf ("converted %s\n", *pfile);
+			}
+		}
+
+		rspamd_mempool_delete (pool);
+		g_strfreev (mmap_files);
+
+		exit (ret);
+	}
+
 	if (config_file) {
 		/* Load config file, assuming that it has all information required */
 		struct ucl_parser *parser;
@@ -152,12 +241,12 @@ rspamadm_statconvert (gint argc, gchar **argv, const struct rspamadm_command *cm
 		/* We need to get all information from the command line */
 		ucl_object_t *classifier, *statfile_ham, *statfile_spam, *tmp, *redis;
 
-		/* Check arguments sanity */
-		if (spam_db == NULL) {
+		/* Check arguments sanity, compaction needs merely redis */
+		if (spam_db == NULL && !compact) {
 			msg_err ("No spam-db specified");
 			exit (EXIT_FAILURE);
 		}
-		if (ham_db == NULL) {
+		if (ham_db == NULL && !compact) {
 			msg_err ("No ham-db specified");
 			exit (EXIT_FAILURE);
 		}
@@ -165,60 +254,61 @@ rspamadm_statconvert (gint argc, gchar **argv, const struct rspamadm_command *cm
 			msg_err ("No redis-host specified");
 			exit (EXIT_FAILURE);
 		}
-		if (symbol_ham == NULL) {
+		if (symbol_ham == NULL && !compact) {
 			msg_err ("No symbol-ham specified");
 			exit (EXIT_FAILURE);
 		}
-		if (symbol_spam == NULL) {
+		if (symbol_spam == NULL && !compact) {
 			msg_err ("No symbol-spam specified");
 			exit (EXIT_FAILURE);
 		}
 
 		obj = ucl_object_typed_new (UCL_OBJECT);
 
-		classifier = ucl_object_typed_new (UCL_OBJECT);
-		ucl_object_insert_key (obj, classifier, "classifier", 0, false);
-		/* Now we need to create "bayes" key in it */
-		tmp = ucl_object_typed_new (UCL_OBJECT);
-		ucl_object_insert_key (classifier, tmp, "bayes", 0, false);
-		classifier = tmp;
-		ucl_object_insert_key (classifier, ucl_object_fromstring ("sqlite3"),
-				"backend", 0, false);
-
-		if (cache_db != NULL) {
-			ucl_object_t *cache;
-
-			cache = ucl_object_typed_new (UCL_OBJECT);
-			ucl_object_insert_key (cache, ucl_object_fromstring ("sqlite3"),
-					"type", 0, false);
-			ucl_object_insert_key (cache, ucl_object_fromstring (cache_db),
-					"file", 0, false);
-
-			ucl_object_insert_key (classifier, cache, "cache", 0, false);
+		if (!compact) {
+			classifier = ucl_object_typed_new (UCL_OBJECT);
+			ucl_object_insert_key (obj, classifier, "classifier", 0, false);
+			/* Now we need to create "bayes" key in it */
+			tmp = ucl_object_typed_new (UCL_OBJECT);
+			ucl_object_insert_key (classifier, tmp, "bayes", 0, false);
+			classifier = tmp;
+			ucl_object_insert_key (classifier, ucl_object_fromstring ("sqlite3"),
+					"backend", 0, false);
+
+			if (cache_db != NULL) {
+				ucl_object_t *cache;
+
+				cache = ucl_object_typed_new (UCL_OBJECT);
+				ucl_object_insert_key (cache, ucl_object_fromstring ("sqlite3"),
+						"type", 0, false);
+				ucl_object_insert_key (cache, ucl_object_fromstring (cache_db),
+						"file", 0, false);
+
+				ucl_object_insert_key (classifier, cache, "cache", 0, false);
+			}
+
+			statfile_ham = ucl_object_typed_new (UCL_OBJECT);
+			ucl_object_insert_key (statfile_ham, ucl_object_fromstring (symbol_ham),
+					"symbol", 0, false);
+			ucl_object_insert_key (statfile_ham, ucl_object_frombool (false),
+					"spam", 0, false);
+			ucl_object_insert_key (statfile_ham, ucl_object_fromstring (ham_db),
+					"db", 0, false);
+
+			statfile_spam = ucl_object_typed_new (UCL_OBJECT);
+			ucl_object_insert_key (statfile_spam, ucl_object_fromstring (symbol_spam),
+					"symbol", 0, false);
+			ucl_object_insert_key (statfile_spam, ucl_object_frombool (true),
+					"spam", 0, false);
+			ucl_object_insert_key (statfile_spam, ucl_object_fromstring (spam_db),
+					"db", 0, false);
+
+			DL_APPEND (statfile_ham, statfile_spam);
+			ucl_object_insert_key (classifier, statfile_ham,
+					"statfile", 0, false);
 		}
 
-		statfile_ham = ucl_object_typed_new (UCL_OBJECT);
-		ucl_object_insert_key (statfile_ham, ucl_object_fromstring (symbol_ham),
-				"symbol", 0, false);
-		ucl_object_insert_key (statfile_ham, ucl_object_frombool (false),
-				"spam", 0, false);
-		ucl_object_insert_key (statfile_ham, ucl_object_fromstring (ham_db),
-				"db", 0, false);
-
-		statfile_spam = ucl_object_typed_new (UCL_OBJECT);
-		ucl_object_insert_key (statfile_spam, ucl_object_fromstring (symbol_spam),
-				"symbol", 0, false);
-		ucl_object_insert_key (statfile_spam, ucl_object_frombool (true),
-				"spam", 0, false);
-		ucl_object_insert_key (statfile_spam, ucl_object_fromstring (spam_db),
-				"db", 0, false);
-
-		DL_APPEND (statfile_ham, statfile_spam);
-		ucl_object_insert_key (classifier, statfile_ham,
-				"statfile", 0, false);
-
 		/* Deal with redis */
-
 		redis = ucl_object_typed_new (UCL_OBJECT);
 		ucl_object_insert_key (obj, redis, "redis", 0, false);
 
@@ -244,11 +334,84 @@ rspamadm_statconvert (gint argc, gchar **argv, const struct rspamadm_command *cm
 				"expire", 0, false);
 	}
 
-	rspamadm_execute_lua_ucl_subr (argc,
-			argv,
-			obj,
-			"stat_convert",
-			TRUE);
+	ucl_object_insert_key (obj, ucl_object_fromint (MAX (batch, 1)),
+			"batch", 0, false);
+
+	if (compact) {
+		ucl_object_insert_key (obj, ucl_object_frombool (true),
+				"compact", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromdouble (min_count),
+				"min_count", 0, false);
+
+		if (prefix) {
+			ucl_object_insert_key (obj, ucl_object_fromstring (prefix),
+					"prefix", 0, false);
+		}
+
+		/* SCAN cannot be split between processes */
+		jobs = 1;
+	}
+
+	if (jobs <= 1) {
+		rspamadm_execute_lua_ucl_subr (argc,
+				argv,
+				obj,
+				"stat_convert",
+				TRUE);
+	}
+	else {
+		pid_t *pids;
+		gint i, status, ret = EXIT_SUCCESS;
+
+		if (reset_previous) {
+			/* Old data must be removed before any worker starts */
+			ucl_object_insert_key (obj, ucl_object_frombool (true),
+					"reset_only", 0, false);
+			rspamadm_execute_lua_ucl_subr (argc, argv, obj, "stat_convert",
+					TRUE);
+			ucl_object_replace_key (obj, ucl_object_frombool (false),
+					"reset_only", 0, false);
+			ucl_object_replace_key (obj, ucl_object_frombool (false),
+					"reset_previous", 0, false);
+		}
+
+		ucl_object_insert_key (obj, ucl_object_fromint (jobs),
+				"jobs", 0, false);
+		/* Tokens are split between processes by their rowid */
+		pids = g_malloc0 (sizeof (*pids) * jobs);
+
+		for (i = 0; i < jobs; i ++) {
+			pids[i] = fork ();
+
+			if (pids[i] == -1) {
+				rspamd_fprintf (stderr, "cannot fork: %s\n", strerror (errno));
+				exit (EXIT_FAILURE);
+			}
+			else if (pids[i] == 0) {
+				ucl_object_insert_key (obj, ucl_object_fromint (i),
+						"worker", 0, false);
+
+				if (!rspamadm_execute_lua_ucl_subr (argc, argv, obj,
+						"stat_convert", TRUE)) {
+					exit (EXIT_FAILURE);
+				}
+
+				exit (EXIT_SUCCESS);
+			}
+		}
+
+		for (i = 0; i < jobs; i ++) {
+			if (waitpid (pids[i], &status, 0) == -1 ||
+					!WIFEXITED (status) || WEXITSTATUS (status) != 0) {
+				ret = EXIT_FAILURE;
+			}
+		}
+
+		g_free (pids);
+		ucl_object_unref (obj);
+
+		exit (ret);
+	}
 
 	ucl_object_unref (obj);
 }
@@ -19,6 +19,7 @@
 #include "lua/lua_common.h"
 #include "libserver/worker_util.h"
 #include "libserver/rspamd_control.h"
+#include "libutil/shared_cache.h"
 #include "ottery.h"
 #include "cryptobox.h"
 #include "utlist.h"
@@ -64,11 +65,16 @@
 #include "sqlite3.h"
 
 /* 2 seconds to fork new process in place of dead one */
-#define SOFT_FORK_TIME 2
+#define SOFT_FORK_TIME 2.0
+/* Workers forked by a template are cheap to respawn */
+#define PREFORK_SOFT_FORK_TIME 0.1
 
 /* 10 seconds after getting termination signal to terminate all workers with SIGKILL */
 #define TERMINATION_ATTEMPTS 50
 
+/* How often workers' log rings are written when asynchronous logging is on */
+#define LOG_RINGS_DRAIN_INTERVAL 0.1
+
 static gboolean load_rspamd_config (struct rspamd_main *rspamd_main,
 		struct rspamd_config *cfg,
 		gboolean init_modules,
@@ -86,6 +92,7 @@ static gchar **cfg_names = NULL;
 static gchar **lua_tests = NULL;
 static gchar **sign_configs = NULL;
 static gchar *privkey = NULL;
+static gchar *config_cache = NULL;
 static gchar *rspamd_user = NULL;
 static gchar *rspamd_group = NULL;
 static gchar *rspamd_pidfile = NULL;
@@ -97,6 +104,8 @@ static gboolean encrypt_password = FALSE;
 static GHashTable *ucl_vars = NULL;
 
 static gint term_attempts = 0;
+/* Set when main process stops watching for workers */
+static gboolean workers_terminating = FALSE;
 
 /* List of unrelated forked processes */
 static GArray *other_workers = NULL;
@@ -104,6 +113,13 @@ static GArray *other_workers = NULL;
 /* List of active listen sockets indexed by worker type */
 static GHashTable *listen_sockets = NULL;
 
+/* Timer to write records from workers' log rings */
+static struct event log_rings_ev;
+static gboolean log_rings_watched = FALSE;
+/* Periodic snapshots of shared caches */
+static struct event caches_snapshot_ev;
+static gboolean caches_snapshot_watched = FALSE;
+
 /* Defined in modules.c */
 extern module_t *modules[];
 extern worker_t *workers[];
@@ -135,6 +151,8 @@ static GOptionEntry entries[] =
 	  "Specify config file(s) to sign", NULL },
 	{ "private-key", 0, 0, G_OPTION_ARG_FILENAME, &privkey,
 	  "Specify private key to sign", NULL },
+	{ "config-cache", 0, 0, G_OPTION_ARG_FILENAME, &config_cache,
+	  "Use compiled configuration cache at this path", NULL },
 	{ "gen-keypair", 0, 0, G_OPTION_ARG_NONE, &gen_keypair, "Generate new encryption "
 	  "keypair", NULL},
 	{ "encrypt-password", 0, 0, G_OPTION_ARG_NONE, &encrypt_password, "Encrypt "
@@ -274,6 +292,79 @@ config_logger (rspamd_mempool_t *pool, gpointer ud)
 	rspamd_logger_configure_modules (rspamd_main->cfg->debug_modules);
 }
 
+static void
+rspamd_caches_snapshot_save (struct rspamd_main *rspamd_main)
+{
+	GError *err = NULL;
+
+	if (rspamd_main->cfg->caches_snapshot == NULL) {
+		return;
+	}
+
+	if (!rspamd_shared_caches_save (rspamd_main->cfg->caches_snapshot,
+			time (NULL), &err)) {
+		msg_err_main ("cannot save caches snapshot: %e", err);
+		g_error_free (err);
+	}
+}
+
+/* Called before workers are spawned, as they share caches of the main process */
+static void
+rspamd_caches_snapshot_load (struct rspamd_main *rspamd_main)
+{
+	GError *err = NULL;
+	gint nloaded;
+
+	if (rspamd_main->cfg->caches_snapshot == NULL) {
+		return;
+	}
+
+	nloaded = rspamd_shared_caches_load (rspamd_main->cfg->caches_snapshot,
+			time (NULL), &err);
+
+	if (nloaded == -1) {
+		if (err->code != ENOENT) {
+			msg_warn_main ("cannot load caches snapshot: %e", err);
+		}
+
+		g_error_free (err);
+	}
+	else {
+		msg_info_main ("loaded %d elements from caches snapshot %s",
+				nloaded, rspamd_main->cfg->caches_snapshot);
+	}
+}
+
+static void
+rspamd_caches_snapshot_handler (gint fd, short what, gpointer arg)
+{
+	struct rspamd_main *rspamd_main = arg;
+
+	rspamd_caches_snapshot_save (rspamd_main);
+}
+
+static void
+rspamd_caches_snapshot_watch (struct rspamd_main *rspamd_main,
+		struct event_base *ev_base)
+{
+	struct timeval tv;
+
+	if (caches_snapshot_watched) {
+		event_del (&caches_snapshot_ev);
+		caches_snapshot_watched = FALSE;
+	}
+
+	if (rspamd_main->cfg->caches_snapshot &&
+			rspamd_main->cfg->caches_snapshot_interval > 0) {
+		double_to_tv (rspamd_main->cfg->caches_snapshot_interval, &tv);
+		event_set (&caches_snapshot_ev, -1, EV_TIMEOUT|EV_PERSIST,
+				rspamd_caches_snapshot_handler, rspamd_main);
+		event_base_set (ev_base, &caches_snapshot_ev);
+		event_add (&caches_snapshot_ev, &tv);
+		caches_snapshot_watched = TRUE;
+	}
+}
+
 static void
 reread_config (struct rspamd_main *rspamd_main)
 {
@@ -281,6 +372,8 @@ reread_config (struct rspamd_main *rspamd_main)
 	gchar *cfg_file;
 
 	rspamd_symcache_save (rspamd_main->cfg->cache);
+	/* Caches are recreated with the new config */
+	rspamd_caches_snapshot_save (rspamd_main);
 	tmp_cfg = rspamd_config_new (RSPAMD_CONFIG_INIT_DEFAULT);
 	tmp_cfg->libs_ctx = rspamd_main->cfg->libs_ctx;
 	REF_RETAIN (tmp_cfg->libs_ctx);
@@ -313,6 +406,7 @@ reread_config (struct rspamd_main *rspamd_main)
 		REF_RELEASE (old_cfg);
 		msg_info_main ("config has been reread successfully");
 		rspamd_map_preload (rspamd_main->cfg);
+		rspamd_caches_snapshot_load (rspamd_main);
 	}
 }
 
@@ -321,16 +415,30 @@ struct waiting_worker {
 	struct event wait_ev;
 	struct rspamd_worker_conf *cf;
 	guint oldindex;
+	gboolean is_template;
 };
 
+static void rspamd_template_child_dead (struct rspamd_main *rspamd_main,
+		pid_t pid, gint status);
+
 static void
 rspamd_fork_delayed_cb (gint signo, short what, gpointer arg)
 {
 	struct waiting_worker *w = arg;
 
 	event_del (&w->wait_ev);
-	rspamd_fork_worker (w->rspamd_main, w->cf, w->oldindex,
-			w->rspamd_main->ev_base);
+
+	if (w->is_template) {
+		if (w->cf->tpl == NULL) {
+			rspamd_worker_template_start (w->rspamd_main, w->cf,
+					w->rspamd_main->ev_base, rspamd_template_child_dead);
+		}
+	}
+	else {
+		rspamd_fork_worker (w->rspamd_main, w->cf, w->oldindex,
+				w->rspamd_main->ev_base);
+	}
+
 	REF_RELEASE (w->cf);
 	g_free (w);
 }
@@ -338,7 +446,9 @@ rspamd_fork_delayed_cb (gint signo, short what, gpointer arg)
 static void
 rspamd_fork_delayed (struct rspamd_worker_conf *cf,
 		guint index,
-		struct rspamd_main *rspamd_main)
+		struct rspamd_main *rspamd_main,
+		gdouble delay,
+		gboolean is_template)
 {
 	struct waiting_worker *nw;
 	struct timeval tv;
@@ -347,8 +457,8 @@ rspamd_fork_delayed (struct rspamd_worker_conf *cf,
 	nw->cf = cf;
 	nw->oldindex = index;
 	nw->rspamd_main = rspamd_main;
-	tv.tv_sec = SOFT_FORK_TIME;
-	tv.tv_usec = 0;
+	nw->is_template = is_template;
+	double_to_tv (delay, &tv);
 	REF_RETAIN (cf);
 	event_set (&nw->wait_ev, -1, EV_TIMEOUT, rspamd_fork_delayed_cb, nw);
 	event_base_set (rspamd_main->ev_base, &nw->wait_ev);
@@ -357,7 +467,7 @@ rspamd_fork_delayed (struct rspamd_worker_conf *cf,
 
 static GList *
 create_listen_socket (GPtrArray *addrs, guint cnt,
-		enum rspamd_worker_socket_type listen_type)
+		enum rspamd_worker_socket_type listen_type, gboolean reuseport)
 {
 	GList *result = NULL;
 	gint fd;
@@ -371,8 +481,15 @@ create_listen_socket (GPtrArray *addrs, guint cnt,
 		 * Copy address to avoid reload issues
 		 */
 		if (listen_type & RSPAMD_WORKER_SOCKET_TCP) {
-			fd = rspamd_inet_address_listen (g_ptr_array_index (addrs, i),
-					SOCK_STREAM, TRUE);
+			if (reuseport) {
+				/* Workers bind their own sockets to the same address */
+				fd = rspamd_inet_address_listen_reuseport (
+						g_ptr_array_index (addrs, i), SOCK_STREAM, TRUE);
+			}
+			else {
+				fd = rspamd_inet_address_listen (g_ptr_array_index (addrs, i),
+						SOCK_STREAM, TRUE);
+			}
 			if (fd != -1) {
 				ls = g_malloc0 (sizeof (*ls));
 				ls->addr = rspamd_inet_address_copy (g_ptr_array_index (addrs, i));
@@ -523,6 +640,22 @@ spawn_worker_type (struct rspamd_main *rspamd_main, struct event_base *ev_base,
 
 		return;
 	}
+
+	if (cf->prefork) {
+		if (cf->worker->flags & (RSPAMD_WORKER_UNIQUE|RSPAMD_WORKER_THREADED)) {
+			msg_warn_main ("prefork is not supported for %s worker, ignore it",
+					cf->worker->name);
+		}
+		else if (cf->reuseport) {
+			/* Own sockets are created by each worker before dropping privileges */
+			msg_warn_main ("prefork cannot be used with reuseport for %s "
+					"worker, ignore it", cf->worker->name);
+		}
+		else if (cf->tpl == NULL) {
+			rspamd_worker_template_start (rspamd_main, cf, ev_base,
+					rspamd_template_child_dead);
+		}
+	}
 	if (cf->worker->flags & RSPAMD_WORKER_UNIQUE) {
 		if (cf->count > 1) {
 			msg_warn_main (
@@ -589,7 +722,7 @@ spawn_workers (struct rspamd_main *rspamd_main, struct event_base *ev_base)
 						if (!bcf->is_systemd) {
 							/* Create listen socket */
 							ls = create_listen_socket (bcf->addrs, bcf->cnt,
-									cf->worker->listen_type);
+									cf->worker->listen_type, cf->reuseport);
 						}
 						else {
 							ls = systemd_get_socket (rspamd_main, bcf->cnt);
@@ -770,6 +903,11 @@ wait_for_workers (gpointer key, gpointer value, gpointer unused)
 		g_ptr_array_free (w->finish_actions, TRUE);
 	}
 
+	if (w->log_ring) {
+		rspamd_log_ring_drain (rspamd_main->logger, w->log_ring);
+		rspamd_log_ring_free (w->log_ring);
+	}
+
 	REF_RELEASE (w->cf);
 	g_free (w);
 
@@ -886,8 +1024,11 @@ load_rspamd_config (struct rspamd_main *rspamd_main,
 		enum rspamd_post_load_options opts,
 		gboolean reload)
 {
+	gdouble start;
+
 	cfg->compiled_modules = modules;
 	cfg->compiled_workers = workers;
+	cfg->config_cache = config_cache;
 
 	if (!rspamd_config_read (cfg, cfg->cfg_name, config_logger, rspamd_main, ucl_vars)) {
 		return FALSE;
@@ -909,7 +1050,10 @@ load_rspamd_config (struct rspamd_main *rspamd_main,
 	 * As some rules are defined in lua, we need to process them, then init
 	 * modules and merely afterwards to init modules
 	 */
+	start = rspamd_get_ticks (FALSE);
 	rspamd_lua_post_load_config (cfg);
+	rspamd_config_profile_phase (cfg, RSPAMD_CONFIG_PHASE_CORE,
+			"lua_post_load", start);
 
 	if (init_modules) {
 		rspamd_init_filters (cfg, reload);
@@ -917,6 +1061,7 @@ load_rspamd_config (struct rspamd_main *rspamd_main,
 
 	/* Do post-load actions */
 	rspamd_config_post_load (cfg, opts);
+	rspamd_config_profile_log (cfg);
 
 	return TRUE;
 }
@@ -941,6 +1086,44 @@ do_encrypt_password (void)
 	rspamd_fprintf (stderr, "use rspamadm pw for this operation\n");
 }
 
+static void
+rspamd_log_rings_handler (gint fd, short what, gpointer arg)
+{
+	struct rspamd_main *rspamd_main = arg;
+	struct rspamd_worker *w;
+	GHashTableIter it;
+	gpointer k, v;
+
+	g_hash_table_iter_init (&it, rspamd_main->workers);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		w = v;
+
+		if (w->log_ring) {
+			rspamd_log_ring_drain (rspamd_main->logger, w->log_ring);
+		}
+	}
+
+	/* Own messages of the main process are buffered as well */
+	rspamd_log_flush (rspamd_main->logger);
+}
+
+static void
+rspamd_log_rings_watch (struct rspamd_main *rspamd_main,
+		struct event_base *ev_base)
+{
+	struct timeval tv;
+
+	if (rspamd_main->cfg->log_async && !log_rings_watched) {
+		double_to_tv (LOG_RINGS_DRAIN_INTERVAL, &tv);
+		event_set (&log_rings_ev, -1, EV_TIMEOUT|EV_PERSIST,
+				rspamd_log_rings_handler, rspamd_main);
+		event_base_set (ev_base, &log_rings_ev);
+		event_add (&log_rings_ev, &tv);
+		log_rings_watched = TRUE;
+	}
+}
+
 /* Signal handlers */
 static void
 rspamd_term_handler (gint signo, short what, gpointer arg)
@@ -981,135 +1164,234 @@ rspamd_hup_handler (gint signo, short what, gpointer arg)
 				rspamd_main->workers_gid);
 	reread_config (rspamd_main);
 	rspamd_check_core_limits (rspamd_main);
+	rspamd_log_rings_watch (rspamd_main, rspamd_main->ev_base);
+	rspamd_caches_snapshot_watch (rspamd_main, rspamd_main->ev_base);
 	spawn_workers (rspamd_main, rspamd_main->ev_base);
 }
 
 static void
-rspamd_cld_handler (gint signo, short what, gpointer arg)
+rspamd_worker_free_dead (struct rspamd_main *rspamd_main,
+		struct rspamd_worker *cur)
 {
-	struct rspamd_main *rspamd_main = arg;
-	guint i;
-	gint res = 0;
+	if (cur->srv_pipe[0] != -1) {
+		/* Ugly workaround */
+		if (cur->tmp_data) {
+			g_free (cur->tmp_data);
+		}
+		event_del (&cur->srv_ev);
+	}
+
+	if (cur->control_pipe[0] != -1) {
+		/* We also need to clean descriptors left */
+		close (cur->control_pipe[0]);
+		close (cur->srv_pipe[0]);
+	}
+
+	REF_RELEASE (cur->cf);
+
+	if (cur->finish_actions) {
+		g_ptr_array_free (cur->finish_actions, TRUE);
+	}
+
+	g_free (cur);
+}
+
+/*
+ * Workers of a dead template are reparented to init and cannot be tracked,
+ * so they are terminated and replaced
+ */
+static void
+rspamd_template_orphans_terminate (struct rspamd_main *rspamd_main,
+		struct rspamd_worker *tpl_wrk)
+{
+	GHashTableIter it;
+	gpointer k, v;
 	struct rspamd_worker *cur;
-	pid_t wrk;
-	gboolean need_refork = TRUE;
+	GPtrArray *orphans;
+	guint i;
 
-	/* Turn off locking for logger */
-	rspamd_log_nolock (rspamd_main->logger);
+	orphans = g_ptr_array_new ();
+	g_hash_table_iter_init (&it, rspamd_main->workers);
 
-	msg_info_main ("catch SIGCHLD signal, finding terminated workers");
-	/* Remove dead child form children list */
-	while ((wrk = waitpid (0, &res, WNOHANG)) > 0) {
-		if ((cur =
-				g_hash_table_lookup (rspamd_main->workers,
-						GSIZE_TO_POINTER (wrk))) != NULL) {
-			/* Unlink dead process from queue and hash table */
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		cur = v;
 
-			g_hash_table_remove (rspamd_main->workers, GSIZE_TO_POINTER (
-					wrk));
+		if (cur->ppid == tpl_wrk->pid) {
+			g_ptr_array_add (orphans, cur);
+		}
+	}
 
-			if (cur->wanna_die) {
-				/* Do not refork workers that are intended to be terminated */
-				need_refork = FALSE;
-			}
+	for (i = 0; i < orphans->len; i ++) {
+		cur = g_ptr_array_index (orphans, i);
+		msg_warn_main ("terminate %s process %P as its template has died",
+				g_quark_to_string (cur->type), cur->pid);
+		kill (cur->pid, SIGTERM);
+		g_hash_table_remove (rspamd_main->workers, GSIZE_TO_POINTER (cur->pid));
+		rspamd_worker_release_stat_slot (rspamd_main, cur);
+
+		if (!cur->wanna_die && !workers_terminating) {
+			rspamd_fork_delayed (cur->cf, cur->index, rspamd_main,
+					SOFT_FORK_TIME, FALSE);
+		}
+
+		rspamd_worker_free_dead (rspamd_main, cur);
+	}
+
+	g_ptr_array_free (orphans, TRUE);
+}
+
+static void
+rspamd_worker_terminated (struct rspamd_main *rspamd_main,
+		struct rspamd_worker *cur, gint res)
+{
+	gboolean need_refork = TRUE;
+
+	/* Unlink dead process from queue and hash table */
+	g_hash_table_remove (rspamd_main->workers, GSIZE_TO_POINTER (cur->pid));
+	rspamd_worker_release_stat_slot (rspamd_main, cur);
+
+	if (cur->log_ring) {
+		/* Write the last messages of the dead worker */
+		rspamd_log_ring_drain (rspamd_main->logger, cur->log_ring);
+		rspamd_log_ring_free (cur->log_ring);
+		cur->log_ring = NULL;
+	}
+
+	if (cur->wanna_die) {
+		/* Do not refork workers that are intended to be terminated */
+		need_refork = FALSE;
+	}
 
-			if (WIFEXITED (res) && WEXITSTATUS (res) == 0) {
-				/* Normal worker termination, do not fork one more */
-				msg_info_main ("%s process %P terminated normally",
+	if (WIFEXITED (res) && WEXITSTATUS (res) == 0) {
+		/* Normal worker termination, do not fork one more */
+		msg_info_main ("%s process %P terminated normally",
+				g_quark_to_string (cur->type),
+				cur->pid);
+	}
+	else {
+		if (WIFSIGNALED (res)) {
+#ifdef WCOREDUMP
+			if (WCOREDUMP (res)) {
+				msg_warn_main (
+						"%s process %P terminated abnormally by signal: %s"
+						" and created core file",
 						g_quark_to_string (cur->type),
-						cur->pid);
+						cur->pid,
+						g_strsignal (WTERMSIG (res)));
 			}
 			else {
-				if (WIFSIGNALED (res)) {
-#ifdef WCOREDUMP
-					if (WCOREDUMP (res)) {
-						msg_warn_main (
-								"%s process %P terminated abnormally by signal: %s"
-								" and created core file",
-								g_quark_to_string (cur->type),
-								cur->pid,
-								g_strsignal (WTERMSIG (res)));
-					}
-					else {
 #ifdef HAVE_SYS_RESOURCE_H
-						struct rlimit rlmt;
-						(void)getrlimit (RLIMIT_CORE, &rlmt);
-
-						msg_warn_main (
-								"%s process %P terminated abnormally by signal: %s"
-								" but NOT created core file (throttled=%s); "
-								"core file limits: %L current, %L max",
-								g_quark_to_string (cur->type),
-								cur->pid,
-								g_strsignal (WTERMSIG (res)),
-								cur->cores_throttled ? "yes" : "no",
-								(gint64)rlmt.rlim_cur,
-								(gint64)rlmt.rlim_max);
+				struct rlimit rlmt;
+				(void)getrlimit (RLIMIT_CORE, &rlmt);
+
+				msg_warn_main (
+						"%s process %P terminated abnormally by signal: %s"
+						" but NOT created core file (throttled=%s); "
+						"core file limits: %L current, %L max",
+						g_quark_to_string (cur->type),
+						cur->pid,
+						g_strsignal (WTERMSIG (res)),
+						cur->cores_throttled ? "yes" : "no",
+						(gint64)rlmt.rlim_cur,
+						(gint64)rlmt.rlim_max);
 #else
-						msg_warn_main (
-								"%s process %P terminated abnormally by signal: %s"
-								" but NOT created core file (throttled=%s); ",
-								g_quark_to_string (cur->type),
-								cur->pid,
-								g_strsignal (WTERMSIG (res)),
-								cur->cores_throttled ? "yes" : "no");
+				msg_warn_main (
+						"%s process %P terminated abnormally by signal: %s"
+						" but NOT created core file (throttled=%s); ",
+						g_quark_to_string (cur->type),
+						cur->pid,
+						g_strsignal (WTERMSIG (res)),
+						cur->cores_throttled ? "yes" : "no");
 #endif
-					}
+			}
 #else
-					msg_warn_main (
-							"%s process %P terminated abnormally by signal: %s",
-							g_quark_to_string (cur->type),
-							cur->pid,
-							g_strsignal (WTERMSIG (res)));
+			msg_warn_main (
+					"%s process %P terminated abnormally by signal: %s",
+					g_quark_to_string (cur->type),
+					cur->pid,
+					g_strsignal (WTERMSIG (res)));
 #endif
-					if (WTERMSIG (res) == SIGUSR2) {
-						/*
-						 * It is actually race condition when not started process
-						 * has been requested to be reloaded.
-						 *
-						 * We shouldn't refork on this
-						 */
-						need_refork = FALSE;
-					}
-				}
-				else {
-					msg_warn_main ("%s process %P terminated abnormally "
-							"with exit code %d",
-							g_quark_to_string (cur->type),
-							cur->pid,
-							WEXITSTATUS (res));
-				}
-
-				if (need_refork) {
-					/* Fork another worker in replace of dead one */
-					rspamd_check_core_limits (rspamd_main);
+			if (WTERMSIG (res) == SIGUSR2) {
+				/*
+				 * It is actually race condition when not started process
+				 * has been requested to be reloaded.
+				 *
+				 * We shouldn't refork on this
+				 */
+				need_refork = FALSE;
+			}
+		}
+		else {
+			msg_warn_main ("%s process %P terminated abnormally "
+					"with exit code %d",
+					g_quark_to_string (cur->type),
+					cur->pid,
+					WEXITSTATUS (res));
+		}
 
+		if (need_refork) {
+			/* Fork another worker in replace of dead one */
+			rspamd_check_core_limits (rspamd_main);
 
-					rspamd_fork_delayed (cur->cf, cur->index, rspamd_main);
-				}
+			if (cur->flags & RSPAMD_WORKER_TEMPLATE) {
+				rspamd_fork_delayed (cur->cf, 0, rspamd_main,
+						SOFT_FORK_TIME, TRUE);
 			}
-
-			if (cur->srv_pipe[0] != -1) {
-				/* Ugly workaround */
-				if (cur->tmp_data) {
-					g_free (cur->tmp_data);
-				}
-				event_del (&cur->srv_ev);
+			else {
+				rspamd_fork_delayed (cur->cf, cur->index, rspamd_main,
+						cur->cf->tpl ? PREFORK_SOFT_FORK_TIME : SOFT_FORK_TIME,
+						FALSE);
 			}
+		}
+	}
 
-			if (cur->control_pipe[0] != -1) {
-				/* We also need to clean descriptors left */
-				close (cur->control_pipe[0]);
-				close (cur->srv_pipe[0]);
-			}
+	if (cur->flags & RSPAMD_WORKER_TEMPLATE) {
+		rspamd_worker_template_terminated (rspamd_main, cur);
+		rspamd_template_orphans_terminate (rspamd_main, cur);
+	}
 
-			REF_RELEASE (cur->cf);
+	rspamd_worker_free_dead (rspamd_main, cur);
+}
 
-			if (cur->finish_actions) {
-				g_ptr_array_free (cur->finish_actions, TRUE);
-			}
+static void
+rspamd_template_child_dead (struct rspamd_main *rspamd_main,
+		pid_t pid, gint status)
+{
+	struct rspamd_worker *cur;
+
+	if (workers_terminating) {
+		/* Workers are waited for by the termination handler */
+		return;
+	}
+
+	cur = g_hash_table_lookup (rspamd_main->workers, GSIZE_TO_POINTER (pid));
+
+	if (cur != NULL) {
+		rspamd_log_nolock (rspamd_main->logger);
+		rspamd_worker_terminated (rspamd_main, cur, status);
+		rspamd_log_lock (rspamd_main->logger);
+	}
+}
+
+static void
+rspamd_cld_handler (gint signo, short what, gpointer arg)
+{
+	struct rspamd_main *rspamd_main = arg;
+	guint i;
+	gint res = 0;
+	struct rspamd_worker *cur;
+	pid_t wrk;
+
+	/* Turn off locking for logger */
+	rspamd_log_nolock (rspamd_main->logger);
 
-			g_free (cur);
+	msg_info_main ("catch SIGCHLD signal, finding terminated workers");
+	/* Remove dead child form children list */
+	while ((wrk = waitpid (0, &res, WNOHANG)) > 0) {
+		if ((cur =
+				g_hash_table_lookup (rspamd_main->workers,
+						GSIZE_TO_POINTER (wrk))) != NULL) {
+			rspamd_worker_terminated (rspamd_main, cur, res);
 		}
 		else {
 			for (i = 0; i < other_workers->len; i++) {
@@ -1217,6 +1499,9 @@ main (gint argc, gchar **argv, gchar **env)
 			"main");
 	rspamd_main->stat = rspamd_mempool_alloc0_shared (rspamd_main->server_pool,
 			sizeof (struct rspamd_stat));
+	rspamd_main->stat->stages = rspamd_mempool_alloc0_shared (
+			rspamd_main->server_pool,
+			sizeof (struct rspamd_worker_stages_stat) * RSPAMD_MAX_WORKERS_STAT);
 	rspamd_main->cfg = rspamd_config_new (RSPAMD_CONFIG_INIT_DEFAULT);
 	rspamd_main->spairs = g_hash_table_new_full (rspamd_spair_hash,
 			rspamd_spair_equal, g_free, rspamd_spair_close);
@@ -1379,6 +1664,8 @@ main (gint argc, gchar **argv, gchar **env)
 			rspamd_main->cfg->libs_ctx->crypto_ctx->siphash_impl,
 			rspamd_main->cfg->libs_ctx->crypto_ctx->blake2_impl,
 			rspamd_main->cfg->libs_ctx->crypto_ctx->base64_impl);
+	msg_info_main ("string functions: %s",
+			rspamd_main->cfg->libs_ctx->crypto_ctx->str_util_impl);
 	msg_info_main ("libottery prf: %s", ottery_get_impl_name ());
 
 	/* Daemonize */
@@ -1447,7 +1734,7 @@ main (gint argc, gchar **argv, gchar **env)
 	/* Maybe read roll history */
 	if (rspamd_main->cfg->history_file) {
 		rspamd_roll_history_load (rspamd_main->history,
-			rspamd_main->cfg->history_file);
+			rspamd_main->cfg->history_file, rspamd_main->cfg);
 	}
 
 #if defined(WITH_GPERF_TOOLS)
@@ -1481,6 +1768,9 @@ main (gint argc, gchar **argv, gchar **env)
 	event_add (&usr1_ev, NULL);
 
 	rspamd_check_core_limits (rspamd_main);
+	rspamd_log_rings_watch (rspamd_main, ev_base);
+	rspamd_caches_snapshot_load (rspamd_main);
+	rspamd_caches_snapshot_watch (rspamd_main, ev_base);
 	rspamd_mempool_lock_mutex (rspamd_main->start_mtx);
 	spawn_workers (rspamd_main, ev_base);
 	rspamd_mempool_unlock_mutex (rspamd_main->start_mtx);
@@ -1497,6 +1787,7 @@ main (gint argc, gchar **argv, gchar **env)
 	event_base_loop (ev_base, 0);
 	/* We need to block signals unless children are waited for */
 	rspamd_worker_block_signals ();
+	workers_terminating = TRUE;
 
 	event_del (&term_ev);
 	event_del (&int_ev);
@@ -1504,6 +1795,14 @@ main (gint argc, gchar **argv, gchar **env)
 	event_del (&cld_ev);
 	event_del (&usr1_ev);
 
+	if (log_rings_watched) {
+		event_del (&log_rings_ev);
+	}
+
+	if (caches_snapshot_watched) {
+		event_del (&caches_snapshot_ev);
+	}
+
 	if (control_fd != -1) {
 		event_del (&control_ev);
 		close (control_fd);
@@ -1535,9 +1834,10 @@ main (gint argc, gchar **argv, gchar **env)
 	/* Maybe save roll history */
 	if (rspamd_main->cfg->history_file) {
 		rspamd_roll_history_save (rspamd_main->history,
-			rspamd_main->cfg->history_file);
+			rspamd_main->cfg->history_file, rspamd_main->cfg);
 	}
 
+	rspamd_caches_snapshot_save (rspamd_main);
 	msg_info_main ("terminating...");
 
 	REF_RELEASE (rspamd_main->cfg);
@@ -60,6 +60,7 @@ enum rspamd_worker_flags {
 	RSPAMD_WORKER_ALWAYS_START = (1 << 4),
 	RSPAMD_WORKER_SCANNER = (1 << 5),
 	RSPAMD_WORKER_CONTROLLER = (1 << 6),
+	RSPAMD_WORKER_TEMPLATE = (1 << 7), /* set for prefork template processes only */
 };
 
 
@@ -89,6 +90,9 @@ struct rspamd_worker {
 	gpointer control_data;          /**< used by control protocol to handle commands	*/
 	gpointer tmp_data;              /**< used to avoid race condition to deal with control messages */
 	GPtrArray *finish_actions;      /**< called when worker is terminated				*/
+	GList *reuseport_socks;         /**< own listening sockets (SO_REUSEPORT)			*/
+	gint stat_slot;                 /**< index in workers stat or -1					*/
+	struct rspamd_log_ring *log_ring; /**< asynchronous log records or NULL			*/
 };
 
 struct rspamd_abstract_worker_ctx {
@@ -247,12 +251,52 @@ struct rspamd_cryptobox_library_ctx;
 /**
  * Server statistics
  */
+#define RSPAMD_MAX_WORKERS_STAT 128
+
+/* Resources usage published by a worker, see `rspamd_worker_publish_usage` */
+struct rspamd_worker_usage {
+	guint conns;                                        /**< current connections count						*/
+	gdouble start_time;                                 /**< worker's start time							*/
+	gdouble utime;                                      /**< user cpu time									*/
+	gdouble systime;                                    /**< system cpu time								*/
+	gulong maxrss;                                      /**< max resident set size in kilobytes			*/
+	gulong lua_mem;                                     /**< lua memory in kilobytes						*/
+	guint64 lua_gc_steps;                               /**< lua gc steps									*/
+	gdouble lua_gc_time;                                /**< total lua gc time								*/
+	gdouble lua_gc_max_pause;                           /**< max lua gc pause								*/
+};
+
+struct rspamd_worker_stat {
+	pid_t pid;                                          /**< worker's pid, 0 if slot is free				*/
+	GQuark type;                                        /**< worker's type									*/
+	guint index;                                        /**< worker's index									*/
+	guint connections_count;                            /**< connections accepted by this worker			*/
+	guint inflight;                                     /**< tasks being processed now						*/
+	guint shed_count;                                   /**< tasks rejected by admission control			*/
+	gboolean overloaded;                                /**< worker is shedding load now					*/
+	gdouble loop_lag;                                   /**< smoothed event loop lag in seconds			*/
+	gdouble cpu_load;                                   /**< smoothed share of cpu time used				*/
+	gint numa_node;                                     /**< numa node of worker's memory, -1 if not set	*/
+	gchar cpus[64];                                     /**< cpus the worker runs on, empty if not set		*/
+	guint usage_seq;                                    /**< seqlock of usage, odd while it is written		*/
+	struct rspamd_worker_usage usage;                   /**< resources usage								*/
+};
+
+/* Durations of task stages in a worker, stored apart from `rspamd_stat` as it is large */
+struct rspamd_worker_stages_stat {
+	guint hist[RSPAMD_TASK_STAGES_COUNT][RSPAMD_TASK_STAGE_HIST_BUCKETS];
+	guint64 sum_usec[RSPAMD_TASK_STAGES_COUNT]; /* total durations in microseconds */
+};
+
 struct rspamd_stat {
 	guint messages_scanned;                             /**< total number of messages scanned				*/
 	guint actions_stat[METRIC_ACTION_MAX];              /**< statistic for each action						*/
 	guint connections_count;                            /**< total connections count						*/
 	guint control_connections_count;                    /**< connections count to control interface			*/
 	guint messages_learned;                             /**< messages learned								*/
+	guint64 actions_time[METRIC_ACTION_MAX];            /**< scan time for each action in microseconds		*/
+	struct rspamd_worker_stat workers[RSPAMD_MAX_WORKERS_STAT]; /**< per worker counters				*/
+	struct rspamd_worker_stages_stat *stages;           /**< per worker stages histograms (shared)			*/
 };
 
 /**
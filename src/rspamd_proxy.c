@@ -47,6 +47,19 @@
 /* Rotate keys each minute by default */
 #define DEFAULT_ROTATION_TIME 60.0
 #define DEFAULT_RETRIES 5
+/* Close idle backend connections after 30 seconds */
+#define DEFAULT_KEEPALIVE_TIMEOUT 30.0
+/* Maximum number of idle connections per backend server */
+#define DEFAULT_KEEPALIVE_MAX_IDLE 64
+/* Results cache defaults */
+#define DEFAULT_CACHE_SIZE (16 * 1024 * 1024)
+#define DEFAULT_CACHE_MAX_REPLY (16 * 1024)
+#define DEFAULT_CACHE_TTL 10.0
+/* Limits for detached mirror requests */
+#define DEFAULT_MIRROR_MAX_MEMORY (64 * 1024 * 1024)
+#define DEFAULT_MIRROR_MAX_PENDING 256
+/* Number of slots probed for a single digest */
+#define PROXY_CACHE_BUCKET 4
 
 #define msg_err_session(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
         session->pool->tag.tagname, session->pool->tag.uid, \
@@ -106,6 +119,39 @@ struct rspamd_http_mirror {
 	gint parser_to_ref;
 	gboolean local;
 	gboolean compress;
+	/* Do not bind mirror requests to client sessions */
+	gboolean detached;
+	gsize max_memory;
+	guint max_pending;
+	/* Detached requests in flight within this process */
+	gsize pending_memory;
+	guint pending;
+	guint dropped;
+};
+
+/*
+ * Cached reply, slots are stored in the shared memory and hence are
+ * shared between all proxy processes
+ */
+struct rspamd_proxy_cache_elt {
+	guchar digest[rspamd_cryptobox_HASHBYTES];
+	gdouble expire;
+	guint32 len;
+	gchar ctype[64];
+	gchar data[]; /* max_reply bytes */
+};
+
+struct rspamd_proxy_cache {
+	guchar *slots;
+	rspamd_mempool_mutex_t *lock;
+	gsize slot_size;
+	gsize max_reply;
+	guint nslots;
+	gdouble ttl;
+	/* Request headers that are mixed into the digest */
+	GPtrArray *key_headers;
+	/* Results with these symbols are never cached */
+	GPtrArray *exclude_symbols;
 };
 
 static const guint64 rspamd_rspamd_proxy_magic = 0xcdeb4fd1fc351980ULL;
@@ -159,12 +205,29 @@ struct rspamd_proxy_ctx {
 	struct rspamd_milter_context milter_ctx;
 	/* Language detector */
 	struct rspamd_lang_detector *lang_det;
+	/* Reuse connections to backends */
+	gboolean keepalive;
+	gdouble keepalive_timeout;
+	struct timeval keepalive_tv;
+	/* Idle backend connections: struct upstream * -> GQueue */
+	GHashTable *backend_pool;
+	/* Results cache, NULL if disabled */
+	struct rspamd_proxy_cache *cache;
 };
 
 enum rspamd_backend_flags {
 	RSPAMD_BACKEND_REPLIED = 1 << 0,
 	RSPAMD_BACKEND_CLOSED = 1 << 1,
 	RSPAMD_BACKEND_PARSED = 1 << 2,
+	RSPAMD_BACKEND_REUSED = 1 << 3,
+};
+
+struct rspamd_proxy_idle_connection {
+	struct rspamd_http_connection *backend_conn;
+	GQueue *pool;
+	GList *link;
+	struct event ev;
+	gint backend_sock;
 };
 
 struct rspamd_proxy_session;
@@ -183,6 +246,8 @@ struct rspamd_proxy_backend_connection {
 	enum rspamd_backend_flags flags;
 	gint parser_from_ref;
 	gint parser_to_ref;
+	/* Time when the current request has been sent, 0 if none is pending */
+	gdouble start_ts;
 	struct rspamd_task *task;
 };
 
@@ -210,6 +275,8 @@ struct rspamd_proxy_session {
 	gint client_sock;
 	enum rspamd_proxy_legacy_support legacy_support;
 	gint retries;
+	gboolean cacheable;
+	guchar cache_digest[rspamd_cryptobox_HASHBYTES];
 	ref_entry_t ref;
 };
 
@@ -456,6 +523,22 @@ rspamd_proxy_parse_upstream (rspamd_mempool_t *pool,
 		up->settings_id = rspamd_mempool_strdup (pool, ucl_object_tostring (elt));
 	}
 
+	elt = ucl_object_lookup (obj, "rotation");
+	if (elt && up->u) {
+		enum rspamd_upstream_rotation rot;
+
+		if (ucl_object_type (elt) != UCL_STRING ||
+				!rspamd_upstreams_parse_rotation (ucl_object_tostring (elt),
+						&rot)) {
+			g_set_error (err, rspamd_proxy_quark (), 100,
+					"upstream has bad rotation definition");
+
+			goto err;
+		}
+
+		rspamd_upstreams_set_rotation (up->u, rot);
+	}
+
 	/*
 	 * Accept lua function here in form
 	 * fun :: String -> UCL
@@ -604,6 +687,23 @@ rspamd_proxy_parse_mirror (rspamd_mempool_t *pool,
 		ucl_object_todouble_safe (elt, &up->timeout);
 	}
 
+	elt = ucl_object_lookup (obj, "detached");
+	if (elt && ucl_object_toboolean (elt)) {
+		up->detached = TRUE;
+	}
+
+	up->max_memory = DEFAULT_MIRROR_MAX_MEMORY;
+	elt = ucl_object_lookup (obj, "max_memory");
+	if (elt) {
+		up->max_memory = ucl_object_toint (elt);
+	}
+
+	up->max_pending = DEFAULT_MIRROR_MAX_PENDING;
+	elt = ucl_object_lookup (obj, "max_pending");
+	if (elt) {
+		up->max_pending = ucl_object_toint (elt);
+	}
+
 	/*
 	 * Accept lua function here in form
 	 * fun :: String -> UCL
@@ -728,6 +828,119 @@ err:
 	return FALSE;
 }
 
+static gboolean
+rspamd_proxy_parse_cache (rspamd_mempool_t *pool,
+	const ucl_object_t *obj,
+	gpointer ud,
+	struct rspamd_rcl_section *section,
+	GError **err)
+{
+	const ucl_object_t *elt, *cur;
+	struct rspamd_proxy_cache *cache;
+	struct rspamd_proxy_ctx *ctx;
+	struct rspamd_rcl_struct_parser *pd = ud;
+	ucl_object_iter_t it = NULL;
+	gint64 size = DEFAULT_CACHE_SIZE, max_reply = DEFAULT_CACHE_MAX_REPLY;
+	static const gchar *default_key_headers[] = {
+		"Host", "IP", "From", "Rcpt", "Helo", "Hostname", "User", "Pass",
+		"Settings", "Settings-ID", "Content-Type", NULL
+	};
+	guint i;
+
+	ctx = pd->user_struct;
+
+	if (ucl_object_type (obj) != UCL_OBJECT) {
+		g_set_error (err, rspamd_proxy_quark (), 100,
+				"cache option must be an object");
+
+		return FALSE;
+	}
+
+	cache = rspamd_mempool_alloc0 (pool, sizeof (*cache));
+	cache->ttl = DEFAULT_CACHE_TTL;
+	cache->key_headers = g_ptr_array_new ();
+	rspamd_mempool_add_destructor (pool,
+			(rspamd_mempool_destruct_t)rspamd_ptr_array_free_hard,
+			cache->key_headers);
+	cache->exclude_symbols = g_ptr_array_new ();
+	rspamd_mempool_add_destructor (pool,
+			(rspamd_mempool_destruct_t)rspamd_ptr_array_free_hard,
+			cache->exclude_symbols);
+
+	elt = ucl_object_lookup (obj, "size");
+	if (elt) {
+		ucl_object_toint_safe (elt, &size);
+	}
+
+	elt = ucl_object_lookup (obj, "max_reply");
+	if (elt) {
+		ucl_object_toint_safe (elt, &max_reply);
+	}
+
+	elt = ucl_object_lookup (obj, "ttl");
+	if (elt) {
+		ucl_object_todouble_safe (elt, &cache->ttl);
+	}
+
+	elt = ucl_object_lookup (obj, "key_headers");
+	if (elt) {
+		while ((cur = ucl_object_iterate (elt, &it, true)) != NULL) {
+			if (ucl_object_type (cur) == UCL_STRING) {
+				g_ptr_array_add (cache->key_headers,
+						rspamd_mempool_strdup (pool, ucl_object_tostring (cur)));
+			}
+		}
+	}
+	else {
+		for (i = 0; default_key_headers[i] != NULL; i ++) {
+			g_ptr_array_add (cache->key_headers,
+					(gpointer)default_key_headers[i]);
+		}
+	}
+
+	elt = ucl_object_lookup (obj, "exclude_symbols");
+	if (elt) {
+		it = NULL;
+
+		while ((cur = ucl_object_iterate (elt, &it, true)) != NULL) {
+			if (ucl_object_type (cur) == UCL_STRING) {
+				g_ptr_array_add (cache->exclude_symbols,
+						rspamd_mempool_strdup (pool, ucl_object_tostring (cur)));
+			}
+		}
+	}
+
+	if (max_reply <= 0 || cache->ttl <= 0) {
+		g_set_error (err, rspamd_proxy_quark (), 100,
+				"cache must have positive max_reply and ttl");
+
+		return FALSE;
+	}
+
+	cache->max_reply = max_reply;
+	cache->slot_size = sizeof (struct rspamd_proxy_cache_elt) + max_reply;
+	/* Align slots to keep doubles aligned */
+	cache->slot_size = (cache->slot_size + 7) & ~(gsize)7;
+	cache->nslots = size / cache->slot_size;
+	cache->nslots -= cache->nslots % PROXY_CACHE_BUCKET;
+
+	if (size <= 0 || cache->nslots == 0) {
+		g_set_error (err, rspamd_proxy_quark (), 100,
+				"cache size is too small for %d replies of %" G_GINT64_FORMAT
+				" bytes", PROXY_CACHE_BUCKET, max_reply);
+
+		return FALSE;
+	}
+
+	/* Allocated before workers are forked, so it is shared between them */
+	cache->slots = rspamd_mempool_alloc0_shared (ctx->cfg->cfg_pool,
+			cache->nslots * cache->slot_size);
+	cache->lock = rspamd_mempool_get_mutex (ctx->cfg->cfg_pool);
+	ctx->cache = cache;
+
+	return TRUE;
+}
+
 gpointer
 init_rspamd_proxy (struct rspamd_config *cfg)
 {
@@ -754,6 +967,7 @@ init_rspamd_proxy (struct rspamd_config *cfg)
 			(rspamd_mempool_destruct_t)rspamd_array_free_hard, ctx->cmp_refs);
 	ctx->max_retries = DEFAULT_RETRIES;
 	ctx->spam_header = RSPAMD_MILTER_SPAM_HEADER;
+	ctx->keepalive_timeout = DEFAULT_KEEPALIVE_TIMEOUT;
 
 	rspamd_rcl_register_worker_option (cfg,
 			type,
@@ -796,6 +1010,14 @@ init_rspamd_proxy (struct rspamd_config *cfg)
 			0,
 			RSPAMD_CL_FLAG_MULTIPLE,
 			"List of mirrors");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"cache",
+			rspamd_proxy_parse_cache,
+			ctx,
+			0,
+			0,
+			"Cache results for identical requests in shared memory");
 
 	rspamd_rcl_register_worker_option (cfg,
 			type,
@@ -813,6 +1035,23 @@ init_rspamd_proxy (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_proxy_ctx, max_retries),
 			RSPAMD_CL_FLAG_UINT,
 			"Maximum number of retries for master connection");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"keepalive",
+			rspamd_rcl_parse_struct_boolean,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_proxy_ctx, keepalive),
+			0,
+			"Keep connections to backends alive and reuse them for new requests");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"keepalive_timeout",
+			rspamd_rcl_parse_struct_time,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_proxy_ctx, keepalive_timeout),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Close idle backend connections after this time, default: "
+			G_STRINGIFY (DEFAULT_KEEPALIVE_TIMEOUT) " seconds");
 	rspamd_rcl_register_worker_option (cfg,
 			type,
 			"milter",
@@ -865,9 +1104,133 @@ init_rspamd_proxy (struct rspamd_config *cfg)
 	return ctx;
 }
 
+static void
+proxy_idle_connection_free (struct rspamd_proxy_idle_connection *ic)
+{
+	if (rspamd_event_pending (&ic->ev, EV_READ|EV_TIMEOUT)) {
+		event_del (&ic->ev);
+	}
+
+	rspamd_http_connection_unref (ic->backend_conn);
+	close (ic->backend_sock);
+	g_free (ic);
+}
+
+static void
+proxy_backend_pool_dtor (gpointer p)
+{
+	GQueue *pool = (GQueue *)p;
+
+	g_queue_free_full (pool, (GDestroyNotify)proxy_idle_connection_free);
+}
+
+static void
+proxy_idle_connection_handler (gint fd, short what, gpointer ud)
+{
+	struct rspamd_proxy_idle_connection *ic = ud;
+
+	/*
+	 * Idle connection is either timed out or closed by a backend, any data
+	 * received here is unexpected as well
+	 */
+	g_queue_delete_link (ic->pool, ic->link);
+	proxy_idle_connection_free (ic);
+}
+
+/*
+ * Moves connection to the pool of idle connections of its upstream
+ */
+static gboolean
+proxy_backend_release_connection (struct rspamd_proxy_ctx *ctx,
+		struct rspamd_proxy_backend_connection *conn)
+{
+	struct rspamd_proxy_idle_connection *ic;
+	GQueue *pool;
+
+	pool = g_hash_table_lookup (ctx->backend_pool, conn->up);
+
+	if (pool == NULL) {
+		pool = g_queue_new ();
+		g_hash_table_insert (ctx->backend_pool, conn->up, pool);
+	}
+
+	if (pool->length >= DEFAULT_KEEPALIVE_MAX_IDLE) {
+		return FALSE;
+	}
+
+	ic = g_malloc0 (sizeof (*ic));
+	ic->backend_conn = conn->backend_conn;
+	ic->backend_sock = conn->backend_sock;
+	ic->pool = pool;
+	/* The most recently used connections are reused first */
+	g_queue_push_head (pool, ic);
+	ic->link = pool->head;
+
+	event_set (&ic->ev, ic->backend_sock, EV_READ, proxy_idle_connection_handler,
+			ic);
+	event_base_set (ctx->ev_base, &ic->ev);
+	event_add (&ic->ev, &ctx->keepalive_tv);
+
+	conn->backend_conn = NULL;
+	conn->flags |= RSPAMD_BACKEND_CLOSED;
+
+	return TRUE;
+}
+
+/*
+ * Takes an idle connection for the specified upstream if we have any
+ */
+static gboolean
+proxy_backend_reuse_connection (struct rspamd_proxy_ctx *ctx,
+		struct rspamd_proxy_backend_connection *conn)
+{
+	struct rspamd_proxy_idle_connection *ic;
+	GQueue *pool;
+
+	pool = g_hash_table_lookup (ctx->backend_pool, conn->up);
+
+	if (pool == NULL || pool->length == 0) {
+		return FALSE;
+	}
+
+	ic = g_queue_pop_head (pool);
+	event_del (&ic->ev);
+	conn->backend_conn = ic->backend_conn;
+	conn->backend_sock = ic->backend_sock;
+	g_free (ic);
+
+	return TRUE;
+}
+
+static void
+proxy_backend_request_start (struct rspamd_proxy_backend_connection *conn)
+{
+	conn->start_ts = rspamd_get_ticks (FALSE);
+	rspamd_upstream_request_start (conn->up);
+}
+
+/*
+ * Feeds upstream with the pending request timing, aborted requests are not
+ * accounted as they tell nothing about the backend latency
+ */
+static void
+proxy_backend_request_finish (struct rspamd_proxy_backend_connection *conn,
+		gboolean aborted)
+{
+	if (conn->start_ts > 0 && conn->up) {
+		rspamd_upstream_request_finish (conn->up, aborted ? -1.0 :
+				rspamd_get_ticks (FALSE) - conn->start_ts);
+		conn->start_ts = 0;
+	}
+}
+
 static void
 proxy_backend_close_connection (struct rspamd_proxy_backend_connection *conn)
 {
+	if (conn) {
+		proxy_backend_request_finish (conn, TRUE);
+	}
+
 	if (conn && !(conn->flags & RSPAMD_BACKEND_CLOSED)) {
 		if (conn->backend_conn) {
 			rspamd_http_connection_reset (conn->backend_conn);
@@ -883,11 +1246,19 @@ static gboolean
 proxy_backend_parse_results (struct rspamd_proxy_session *session,
 		struct rspamd_proxy_backend_connection *conn,
 		lua_State *L, gint parser_ref,
-		const gchar *in, gsize inlen)
+		struct rspamd_http_message *msg)
 {
 	struct ucl_parser *parser;
 	GString *tb = NULL;
 	gint err_idx;
+	const gchar *in;
+	gsize inlen;
+	const rspamd_ftok_t *ctype;
+	rspamd_ftok_t srch;
+	enum ucl_parse_type parse_type = UCL_PARSE_UCL;
+
+	in = msg->body_buf.begin;
+	inlen = msg->body_buf.len;
 
 	if (inlen == 0 || in == NULL) {
 		return FALSE;
@@ -917,9 +1288,17 @@ proxy_backend_parse_results (struct rspamd_proxy_session *session,
 		lua_settop (L, 0);
 	}
 	else {
+		ctype = rspamd_http_message_find_header (msg, "Content-Type");
+		RSPAMD_FTOK_ASSIGN (&srch, MSGPACK_CONTENT_TYPE);
+
+		if (ctype && rspamd_ftok_casecmp (ctype, &srch) == 0) {
+			parse_type = UCL_PARSE_MSGPACK;
+		}
+
 		parser = ucl_parser_new (0);
 
-		if (!ucl_parser_add_chunk (parser, in, inlen)) {
+		if (!ucl_parser_add_chunk_full (parser, in, inlen, 0,
+				UCL_DUPLICATE_APPEND, parse_type)) {
 			gchar *encoded;
 
 			encoded = rspamd_encode_base64 (in, inlen, 0, NULL);
@@ -1334,7 +1713,7 @@ proxy_backend_mirror_finish_handler (struct rspamd_http_connection *conn,
 	proxy_request_decompress (msg);
 
 	if (!proxy_backend_parse_results (session, bk_conn, session->ctx->lua_state,
-			bk_conn->parser_from_ref, msg->body_buf.begin, msg->body_buf.len)) {
+			bk_conn->parser_from_ref, msg)) {
 		msg_warn_session ("cannot parse results from the mirror backend %s:%s",
 				bk_conn->name,
 				rspamd_inet_address_to_string (rspamd_upstream_addr (bk_conn->up)));
@@ -1350,6 +1729,169 @@ proxy_backend_mirror_finish_handler (struct rspamd_http_connection *conn,
 	return 0;
 }
 
+/*
+ * Mirror request that lives on its own after it has been sent, so the client
+ * session is not delayed nor kept in memory by slow mirrors
+ */
+struct rspamd_proxy_detached_mirror {
+	struct rspamd_http_mirror *m;
+	struct upstream *up;
+	struct rspamd_http_connection *conn;
+	gsize size;
+	gint sock;
+};
+
+static void
+proxy_detached_mirror_free (struct rspamd_proxy_detached_mirror *dm)
+{
+	dm->m->pending --;
+	dm->m->pending_memory -= dm->size;
+	rspamd_http_connection_reset (dm->conn);
+	rspamd_http_connection_unref (dm->conn);
+	close (dm->sock);
+	g_free (dm);
+}
+
+static void
+proxy_detached_mirror_error_handler (struct rspamd_http_connection *conn,
+		GError *err)
+{
+	struct rspamd_proxy_detached_mirror *dm = conn->ud;
+
+	msg_info ("abnormally closing connection from detached mirror: %s:%s, "
+			"error: %e",
+			dm->m->name,
+			rspamd_inet_address_to_string (rspamd_upstream_addr (dm->up)),
+			err);
+	rspamd_upstream_fail (dm->up, FALSE);
+	proxy_detached_mirror_free (dm);
+}
+
+static gint
+proxy_detached_mirror_finish_handler (struct rspamd_http_connection *conn,
+		struct rspamd_http_message *msg)
+{
+	struct rspamd_proxy_detached_mirror *dm = conn->ud;
+
+	/* Reply is not interesting, the mirror is fed merely for its own sake */
+	rspamd_upstream_ok (dm->up);
+	proxy_detached_mirror_free (dm);
+
+	return 0;
+}
+
+static void
+proxy_send_detached_mirror (struct rspamd_proxy_session *session,
+		struct rspamd_http_mirror *m)
+{
+	struct rspamd_proxy_detached_mirror *dm;
+	struct rspamd_http_message *msg;
+	struct upstream *up;
+	GError *err = NULL;
+	gsize size;
+	gint sock;
+
+	size = session->fname ? session->map_len :
+			session->client_message->body_buf.len;
+
+	if (m->pending >= m->max_pending ||
+			m->pending_memory + size > m->max_memory) {
+		/* Report drops periodically instead of spamming each of them */
+		if (m->dropped ++ % 1000 == 0) {
+			msg_info_session ("drop request to detached mirror %s: %ud "
+					"requests and %z bytes are pending, %ud dropped",
+					m->name, m->pending, m->pending_memory, m->dropped);
+		}
+
+		return;
+	}
+
+	up = rspamd_upstream_get (m->u, RSPAMD_UPSTREAM_ROUND_ROBIN, NULL, 0);
+
+	if (up == NULL) {
+		msg_err_session ("cannot select upstream for %s", m->name);
+		return;
+	}
+
+	sock = rspamd_inet_address_connect (rspamd_upstream_addr (up),
+			SOCK_STREAM, TRUE);
+
+	if (sock == -1) {
+		msg_err_session ("cannot connect upstream for %s", m->name);
+		rspamd_upstream_fail (up, TRUE);
+		return;
+	}
+
+	msg = rspamd_http_connection_copy_msg (session->client_message, &err);
+
+	if (msg == NULL) {
+		msg_err_session ("cannot copy message to send to a mirror %s: %e",
+				m->name, err);
+
+		if (err) {
+			g_error_free (err);
+		}
+
+		close (sock);
+		return;
+	}
+
+	if (msg->url->len == 0) {
+		msg->url = rspamd_fstring_append (msg->url, "/check", strlen ("/check"));
+	}
+
+	if (m->settings_id != NULL) {
+		rspamd_http_message_remove_header (msg, "Settings-ID");
+		rspamd_http_message_add_header (msg, "Settings-ID", m->settings_id);
+	}
+
+	/*
+	 * File passed by the client might be gone before the mirror reads it,
+	 * so the content is always sent in the body
+	 */
+	if (session->fname) {
+		msg->flags &= ~RSPAMD_HTTP_FLAG_SHMEM;
+		rspamd_http_message_set_body (msg, session->map, session->map_len);
+	}
+
+	msg->method = HTTP_POST;
+
+	if (m->compress) {
+		proxy_request_compress (msg);
+	}
+
+	if (session->client_milter_conn) {
+		rspamd_http_message_add_header (msg, "Content-Type",
+				m->compress ? "application/octet-stream" : "text/plain");
+	}
+
+	dm = g_malloc0 (sizeof (*dm));
+	dm->m = m;
+	dm->up = up;
+	dm->sock = sock;
+	dm->size = size;
+	dm->conn = rspamd_http_connection_new (NULL,
+			proxy_detached_mirror_error_handler,
+			proxy_detached_mirror_finish_handler,
+			RSPAMD_HTTP_CLIENT_SIMPLE,
+			RSPAMD_HTTP_CLIENT,
+			session->ctx->keys_cache,
+			NULL);
+
+	if (m->key) {
+		rspamd_http_connection_set_key (dm->conn, session->ctx->local_key);
+		msg->peer_key = rspamd_pubkey_ref (m->key);
+	}
+
+	m->pending ++;
+	m->pending_memory += size;
+
+	rspamd_http_connection_write_message (dm->conn,
+			msg, NULL, NULL, dm, sock,
+			&m->io_tv, session->ctx->ev_base);
+	msg_info_session ("send detached request to %s", m->name);
+}
+
 static void
 proxy_open_mirror_connections (struct rspamd_proxy_session *session)
 {
@@ -1370,6 +1912,11 @@ proxy_open_mirror_connections (struct rspamd_proxy_session *session)
 			continue;
 		}
 
+		if (m->detached) {
+			proxy_send_detached_mirror (session, m);
+			continue;
+		}
+
 		bk_conn = rspamd_mempool_alloc0 (session->pool,
 				sizeof (*bk_conn));
 		bk_conn->s = session;
@@ -1500,6 +2047,211 @@ proxy_client_write_error (struct rspamd_proxy_session *session, gint code,
 	}
 }
 
+static inline struct rspamd_proxy_cache_elt *
+proxy_cache_slot (struct rspamd_proxy_cache *cache, guint idx)
+{
+	return (struct rspamd_proxy_cache_elt *)(cache->slots +
+			idx * cache->slot_size);
+}
+
+static guint
+proxy_cache_bucket (struct rspamd_proxy_cache *cache, const guchar *digest)
+{
+	guint64 h;
+
+	memcpy (&h, digest, sizeof (h));
+
+	return (h % (cache->nslots / PROXY_CACHE_BUCKET)) * PROXY_CACHE_BUCKET;
+}
+
+/*
+ * Digest covers the message itself, the command and the request headers that
+ * can change the scan results, e.g. settings id or envelope
+ */
+static void
+proxy_cache_digest (struct rspamd_proxy_session *session,
+		struct rspamd_http_message *msg)
+{
+	rspamd_cryptobox_hash_state_t st;
+	struct rspamd_proxy_cache *cache = session->ctx->cache;
+	GPtrArray *hdrs;
+	const rspamd_ftok_t *tok;
+	const gchar *name, *body;
+	gsize blen;
+	guint i, j;
+	guint64 len;
+
+	rspamd_cryptobox_hash_init (&st, NULL, 0);
+	rspamd_cryptobox_hash_update (&st,
+			(const guchar *)&session->legacy_support,
+			sizeof (session->legacy_support));
+	len = msg->url->len;
+	rspamd_cryptobox_hash_update (&st, (const guchar *)&len, sizeof (len));
+	rspamd_cryptobox_hash_update (&st, (const guchar *)msg->url->str,
+			msg->url->len);
+
+	PTR_ARRAY_FOREACH (cache->key_headers, i, name) {
+		hdrs = rspamd_http_message_find_header_multiple (msg, name);
+
+		if (hdrs) {
+			PTR_ARRAY_FOREACH (hdrs, j, tok) {
+				/* Prefix values so they cannot be shifted between headers */
+				len = ((guint64)i << 32) | tok->len;
+				rspamd_cryptobox_hash_update (&st, (const guchar *)&len,
+						sizeof (len));
+				rspamd_cryptobox_hash_update (&st, (const guchar *)tok->begin,
+						tok->len);
+			}
+
+			g_ptr_array_free (hdrs, TRUE);
+		}
+	}
+
+	if (session->map) {
+		body = session->map;
+		blen = session->map_len;
+	}
+	else {
+		body = rspamd_http_message_get_body (msg, &blen);
+	}
+
+	if (body) {
+		rspamd_cryptobox_hash_update (&st, (const guchar *)body, blen);
+	}
+
+	rspamd_cryptobox_hash_final (&st, session->cache_digest);
+	session->cacheable = TRUE;
+}
+
+static gboolean
+proxy_cache_reply (struct rspamd_proxy_session *session)
+{
+	struct rspamd_proxy_cache *cache = session->ctx->cache;
+	struct rspamd_proxy_cache_elt *elt;
+	struct rspamd_http_message *reply = NULL;
+	gchar ctype[sizeof (elt->ctype)];
+	gdouble now;
+	guint i, start;
+
+	now = rspamd_get_calendar_ticks ();
+	start = proxy_cache_bucket (cache, session->cache_digest);
+
+	rspamd_mempool_lock_mutex (cache->lock);
+
+	for (i = start; i < start + PROXY_CACHE_BUCKET; i ++) {
+		elt = proxy_cache_slot (cache, i);
+
+		if (elt->expire > now && memcmp (elt->digest, session->cache_digest,
+				sizeof (elt->digest)) == 0) {
+			reply = rspamd_http_new_message (HTTP_RESPONSE);
+			reply->date = time (NULL);
+			reply->code = 200;
+			rspamd_http_message_set_body (reply, elt->data, elt->len);
+			rspamd_strlcpy (ctype, elt->ctype, sizeof (ctype));
+			break;
+		}
+	}
+
+	rspamd_mempool_unlock_mutex (cache->lock);
+
+	if (reply == NULL) {
+		return FALSE;
+	}
+
+	if (session->legacy_support == LEGACY_SUPPORT_SPAMC) {
+		reply->flags |= RSPAMD_HTTP_FLAG_SPAMC;
+	}
+
+	if (session->legacy_support > LEGACY_SUPPORT_NO) {
+		reply->method = HTTP_SYMBOLS;
+	}
+
+	msg_info_session ("reply from the results cache");
+	rspamd_http_connection_reset (session->client_conn);
+	rspamd_http_connection_write_message (session->client_conn,
+			reply, NULL, ctype[0] != '\0' ? ctype : NULL,
+			session, session->client_sock,
+			&session->ctx->io_tv, session->ctx->ev_base);
+
+	return TRUE;
+}
+
+static void
+proxy_cache_store (struct rspamd_proxy_session *session,
+		struct rspamd_proxy_backend_connection *bk_conn,
+		struct rspamd_http_message *msg)
+{
+	struct rspamd_proxy_cache *cache = session->ctx->cache;
+	struct rspamd_proxy_cache_elt *elt, *victim = NULL;
+	const ucl_object_t *syms;
+	const rspamd_ftok_t *ctype;
+	const gchar *body, *sym;
+	gsize blen;
+	gdouble now;
+	guint i, start;
+
+	body = rspamd_http_message_get_body (msg, &blen);
+
+	if (msg->code != 200 || bk_conn->results == NULL || body == NULL ||
+			blen > cache->max_reply ||
+			ucl_object_lookup (bk_conn->results, "error") != NULL) {
+		return;
+	}
+
+	if (cache->exclude_symbols->len > 0) {
+		syms = ucl_object_lookup_any (bk_conn->results, "symbols",
+				DEFAULT_METRIC, NULL);
+
+		if (syms == NULL) {
+			/* Cannot check excluded symbols */
+			return;
+		}
+
+		PTR_ARRAY_FOREACH (cache->exclude_symbols, i, sym) {
+			if (ucl_object_lookup (syms, sym) != NULL) {
+				msg_debug_session ("do not cache reply with symbol %s", sym);
+				return;
+			}
+		}
+	}
+
+	ctype = rspamd_http_message_find_header (msg, "Content-Type");
+	now = rspamd_get_calendar_ticks ();
+	start = proxy_cache_bucket (cache, session->cache_digest);
+
+	rspamd_mempool_lock_mutex (cache->lock);
+
+	/* Replace the same digest, otherwise the slot that expires first */
+	for (i = start; i < start + PROXY_CACHE_BUCKET; i ++) {
+		elt = proxy_cache_slot (cache, i);
+
+		if (memcmp (elt->digest, session->cache_digest,
+				sizeof (elt->digest)) == 0) {
+			victim = elt;
+			break;
+		}
+
+		if (victim == NULL || elt->expire < victim->expire) {
+			victim = elt;
+		}
+	}
+
+	memcpy (victim->digest, session->cache_digest, sizeof (victim->digest));
+	victim->expire = now + cache->ttl;
+	victim->len = blen;
+	memcpy (victim->data, body, blen);
+
+	if (ctype && ctype->len < sizeof (victim->ctype)) {
+		memcpy (victim->ctype, ctype->begin, ctype->len);
+		victim->ctype[ctype->len] = '\0';
+	}
+	else {
+		victim->ctype[0] = '\0';
+	}
+
+	rspamd_mempool_unlock_mutex (cache->lock);
+}
+
 static void
 proxy_backend_master_error_handler (struct rspamd_http_connection *conn, GError *err)
 {
@@ -1507,13 +2259,31 @@ proxy_backend_master_error_handler (struct rspamd_http_connection *conn, GError
 	struct rspamd_proxy_session *session;
 
 	session = bk_conn->s;
-	msg_info_session ("abnormally closing connection from backend: %s, error: %e,"
-			" retries left: %d",
-		rspamd_inet_address_to_string (rspamd_upstream_addr (session->master_conn->up)),
-		err,
-		session->ctx->max_retries - session->retries);
-	session->retries ++;
-	rspamd_upstream_fail (bk_conn->up, FALSE);
+	/* Failed reused connections tell nothing about the backend */
+	proxy_backend_request_finish (bk_conn,
+			(bk_conn->flags & RSPAMD_BACKEND_REUSED) != 0);
+
+	if (bk_conn->flags & RSPAMD_BACKEND_REUSED) {
+		/*
+		 * Backend might close an idle connection just before we have
+		 * reused it, so we do not blame upstream and retry with a new one
+		 */
+		msg_info_session ("cannot reuse connection to backend: %s, error: %e",
+				rspamd_inet_address_to_string (
+						rspamd_upstream_addr (session->master_conn->up)),
+				err);
+	}
+	else {
+		msg_info_session ("abnormally closing connection from backend: %s, "
+				"error: %e, retries left: %d",
+				rspamd_inet_address_to_string (
+						rspamd_upstream_addr (session->master_conn->up)),
+				err,
+				session->ctx->max_retries - session->retries);
+		session->retries ++;
+		rspamd_upstream_fail (bk_conn->up, FALSE);
+	}
+
 	proxy_backend_close_connection (session->master_conn);
 
 	if (session->ctx->max_retries &&
@@ -1546,15 +2316,21 @@ proxy_backend_master_finish_handler (struct rspamd_http_connection *conn,
 	rspamd_fstring_t *reply;
 
 	session = bk_conn->s;
+	proxy_backend_request_finish (bk_conn, FALSE);
 	rspamd_http_connection_steal_msg (session->master_conn->backend_conn);
 	proxy_request_decompress (msg);
 
 	rspamd_http_message_remove_header (msg, "Content-Length");
 	rspamd_http_message_remove_header (msg, "Key");
+	rspamd_http_message_remove_header (msg, "Connection");
 	rspamd_http_connection_reset (session->master_conn->backend_conn);
 
+	if (rspamd_http_connection_is_keepalive (session->master_conn->backend_conn)) {
+		proxy_backend_release_connection (session->ctx, session->master_conn);
+	}
+
 	if (!proxy_backend_parse_results (session, bk_conn, session->ctx->lua_state,
-			bk_conn->parser_from_ref, msg->body_buf.begin, msg->body_buf.len)) {
+			bk_conn->parser_from_ref, msg)) {
 		msg_warn_session ("cannot parse results from the master backend");
 	}
 
@@ -1583,6 +2359,10 @@ proxy_backend_master_finish_handler (struct rspamd_http_connection *conn,
 
 	rspamd_upstream_ok (bk_conn->up);
 
+	if (session->cacheable) {
+		proxy_cache_store (session, bk_conn, msg);
+	}
+
 	if (session->client_milter_conn) {
 		nsession = proxy_session_refresh (session);
 		rspamd_milter_send_task_results (nsession->client_milter_conn,
@@ -1622,6 +2402,10 @@ rspamd_proxy_scan_self_reply (struct rspamd_task *task)
 		rspamd_task_set_finish_time (task);
 		rspamd_protocol_http_reply (msg, task, &rep);
 		rspamd_protocol_write_log_pipe (task);
+
+		if (RSPAMD_TASK_IS_MSGPACK (task)) {
+			ctype = MSGPACK_CONTENT_TYPE;
+		}
 		break;
 	case CMD_PING:
 		rspamd_http_message_set_body (msg, "pong" CRLF, 6);
@@ -1809,9 +2593,21 @@ retry:
 			goto err;
 		}
 
-		session->master_conn->backend_sock = rspamd_inet_address_connect (
-				rspamd_upstream_addr (session->master_conn->up),
-				SOCK_STREAM, TRUE);
+		if (session->ctx->keepalive &&
+				proxy_backend_reuse_connection (session->ctx,
+						session->master_conn)) {
+			msg_debug_session ("reuse idle connection to %s",
+					rspamd_inet_address_to_string (rspamd_upstream_addr (
+							session->master_conn->up)));
+			session->master_conn->flags |= RSPAMD_BACKEND_REUSED;
+		}
+		else {
+			session->master_conn->flags &= ~RSPAMD_BACKEND_REUSED;
+			session->master_conn->backend_sock = rspamd_inet_address_connect (
+					rspamd_upstream_addr (session->master_conn->up),
+					SOCK_STREAM, TRUE);
+			session->master_conn->backend_conn = NULL;
+		}
 
 		if (session->master_conn->backend_sock == -1) {
 			msg_err_session ("cannot connect upstream: %s(%s)",
@@ -1835,22 +2631,34 @@ retry:
 			goto err; /* No fallback here */
 		}
 
-		session->master_conn->backend_conn = rspamd_http_connection_new (
-				NULL,
-				proxy_backend_master_error_handler,
-				proxy_backend_master_finish_handler,
-				RSPAMD_HTTP_CLIENT_SIMPLE,
-				RSPAMD_HTTP_CLIENT,
-				session->ctx->keys_cache,
-				NULL);
+		/* We manage connection to the backend on our own */
+		rspamd_http_message_remove_header (msg, "Connection");
+
+		if (!(session->master_conn->flags & RSPAMD_BACKEND_REUSED)) {
+			session->master_conn->backend_conn = rspamd_http_connection_new (
+					NULL,
+					proxy_backend_master_error_handler,
+					proxy_backend_master_finish_handler,
+					RSPAMD_HTTP_CLIENT_SIMPLE |
+					(session->ctx->keepalive ? RSPAMD_HTTP_KEEP_ALIVE : 0),
+					RSPAMD_HTTP_CLIENT,
+					session->ctx->keys_cache,
+					NULL);
+
+			if (backend->key) {
+				/* Reused connections keep their local keys */
+				rspamd_http_connection_set_key (
+						session->master_conn->backend_conn,
+						session->ctx->local_key);
+			}
+		}
+
 		session->master_conn->flags &= ~RSPAMD_BACKEND_CLOSED;
 		session->master_conn->parser_from_ref = backend->parser_from_ref;
 		session->master_conn->parser_to_ref = backend->parser_to_ref;
 
 		if (backend->key) {
 			msg->peer_key = rspamd_pubkey_ref (backend->key);
-			rspamd_http_connection_set_key (session->master_conn->backend_conn,
-					session->ctx->local_key);
 		}
 
 		if (backend->settings_id != NULL) {
@@ -1904,6 +2712,8 @@ retry:
 					session->master_conn->backend_sock,
 					session->master_conn->io_tv, session->ctx->ev_base);
 		}
+
+		proxy_backend_request_start (session->master_conn);
 	}
 
 	return TRUE;
@@ -1979,6 +2789,15 @@ proxy_client_finish_handler (struct rspamd_http_connection *conn,
 		rspamd_http_message_remove_header (msg, "Connection");
 		rspamd_http_message_remove_header (msg, "Key");
 
+		if (session->ctx->cache) {
+			proxy_cache_digest (session, session->client_message);
+
+			if (proxy_cache_reply (session)) {
+				/* No backends are contacted for cached replies */
+				return 0;
+			}
+		}
+
 		proxy_open_mirror_connections (session);
 		rspamd_http_connection_reset (session->client_conn);
 
@@ -2072,6 +2891,7 @@ proxy_accept_socket (gint fd, short what, void *arg)
 		return;
 	}
 
+	rspamd_worker_count_connection (worker);
 	session = g_malloc0 (sizeof (*session));
 	REF_INIT_RETAIN (session, proxy_session_dtor);
 	session->client_sock = nfd;
@@ -2201,6 +3021,9 @@ start_rspamd_proxy (struct rspamd_worker *worker) {
 			ctx->ev_base,
 			worker->srv->cfg);
 	double_to_tv (ctx->timeout, &ctx->io_tv);
+	double_to_tv (ctx->keepalive_timeout, &ctx->keepalive_tv);
+	ctx->backend_pool = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+			NULL, proxy_backend_pool_dtor);
 	rspamd_map_watch (worker->srv->cfg, ctx->ev_base, ctx->resolver, worker, 0);
 
 	rspamd_upstreams_library_config (worker->srv->cfg, ctx->cfg->ups_ctx,
@@ -2247,6 +3070,7 @@ start_rspamd_proxy (struct rspamd_worker *worker) {
 		rspamd_stat_close ();
 	}
 
+	g_hash_table_unref (ctx->backend_pool);
 	rspamd_keypair_cache_destroy (ctx->keys_cache);
 	REF_RELEASE (ctx->cfg);
 	rspamd_log_close (worker->srv->logger, TRUE);
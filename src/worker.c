@@ -22,6 +22,7 @@
 #include "libutil/map.h"
 #include "libutil/upstream.h"
 #include "libserver/protocol.h"
+#include "libserver/protocol_internal.h"
 #include "libserver/cfg_file.h"
 #include "libserver/url.h"
 #include "libserver/dns.h"
@@ -37,15 +38,30 @@
 #include "libmime/lang_detection.h"
 #include "unix-std.h"
 
+#include <sys/resource.h>
+
 #include "lua/lua_common.h"
 
 /* 60 seconds for worker's IO */
 #define DEFAULT_WORKER_IO_TIMEOUT 60000
 /* Timeout for task processing */
 #define DEFAULT_TASK_TIMEOUT 8.0
+/* Period of event loop lag and cpu load measurements */
+#define WORKER_LOAD_CHECK_INTERVAL 0.25
+/* Weight of the new measurement in moving averages */
+#define WORKER_LOAD_EWMA_ALPHA 0.5
+/* Overload ends when load drops below this share of the limits */
+#define WORKER_LOAD_HYSTERESIS 0.8
+/* 16Mb of freed mempool chunks are reused by new tasks */
+#define DEFAULT_MEMPOOL_CACHE (16 * 1024 * 1024)
+/* Mempool chunks cache is trimmed after this number of idle load checks */
+#define WORKER_IDLE_CHECKS 4
 
 gpointer init_worker (struct rspamd_config *cfg);
 void start_worker (struct rspamd_worker *worker);
+static void rspamd_worker_task_new (struct rspamd_worker *worker, gint nfd,
+		rspamd_inet_addr_t *addr, struct rspamd_http_connection *conn);
+static void rspamd_worker_keepalive (struct rspamd_task *task);
 
 worker_t normal_worker = {
 		"normal",                   /* Name */
@@ -127,9 +143,14 @@ static void
 reduce_tasks_count (gpointer arg)
 {
 	struct rspamd_worker *worker = arg;
+	struct rspamd_worker_stat *ws;
 
 	worker->nconns --;
 
+	if ((ws = rspamd_worker_get_stat (worker)) != NULL) {
+		ws->inflight = worker->nconns;
+	}
+
 	if (worker->wanna_die && worker->nconns == 0) {
 		msg_info ("performing finishing actions");
 		rspamd_worker_call_finish_handlers (worker);
@@ -213,6 +234,180 @@ rspamd_worker_guard_handler (gint fd, short what, void *data)
 	}
 }
 
+static gboolean
+rspamd_worker_check_overload (struct rspamd_worker_ctx *ctx)
+{
+	gdouble k = ctx->overloaded ? WORKER_LOAD_HYSTERESIS : 1.0;
+
+	if (ctx->overload_loop_lag > 0 &&
+			ctx->loop_lag > ctx->overload_loop_lag * k) {
+		return TRUE;
+	}
+
+	if (ctx->overload_cpu > 0 && ctx->cpu_load > ctx->overload_cpu * k) {
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/*
+ * Measures how late the periodic event fires (the time tasks wait for the
+ * event loop) and the cpu time consumed since the previous measurement
+ */
+static void
+rspamd_worker_load_handler (gint fd, short what, gpointer ud)
+{
+	struct rspamd_worker *worker = ud;
+	struct rspamd_worker_ctx *ctx = worker->ctx;
+	struct rspamd_worker_stat *ws;
+	struct rusage ru;
+	struct timeval tv;
+	gdouble now, cpu, lag, elapsed;
+	gboolean overloaded;
+
+	now = rspamd_get_ticks (FALSE);
+	elapsed = now - ctx->last_check;
+	lag = MAX (elapsed - WORKER_LOAD_CHECK_INTERVAL, 0.0);
+	ctx->loop_lag += WORKER_LOAD_EWMA_ALPHA * (lag - ctx->loop_lag);
+
+	if (getrusage (RUSAGE_SELF, &ru) != -1) {
+		cpu = tv_to_double (&ru.ru_utime) + tv_to_double (&ru.ru_stime);
+
+		if (elapsed > 0 && ctx->last_cpu > 0) {
+			ctx->cpu_load += WORKER_LOAD_EWMA_ALPHA *
+					((cpu - ctx->last_cpu) / elapsed - ctx->cpu_load);
+		}
+
+		ctx->last_cpu = cpu;
+	}
+
+	ctx->last_check = now;
+	overloaded = rspamd_worker_check_overload (ctx);
+
+	if (worker->nconns == 0) {
+		/* Return cached chunks to the system gradually when idle */
+		if (++ctx->idle_checks >= WORKER_IDLE_CHECKS) {
+			rspamd_mempool_chunks_cache_trim (
+					rspamd_mempool_chunks_cache_size () / 2);
+		}
+	}
+	else {
+		ctx->idle_checks = 0;
+	}
+
+	if (overloaded != ctx->overloaded) {
+		if (overloaded) {
+			msg_warn ("worker is overloaded: loop lag %.3f sec, cpu load "
+					"%.2f, %ud tasks in flight; start shedding load",
+					ctx->loop_lag, ctx->cpu_load, worker->nconns);
+		}
+		else {
+			msg_info ("worker is no longer overloaded: loop lag %.3f sec, "
+					"cpu load %.2f", ctx->loop_lag, ctx->cpu_load);
+		}
+
+		ctx->overloaded = overloaded;
+	}
+
+	if ((ws = rspamd_worker_get_stat (worker)) != NULL) {
+		ws->loop_lag = ctx->loop_lag;
+		ws->cpu_load = ctx->cpu_load;
+		ws->overloaded = ctx->overloaded;
+	}
+
+	double_to_tv (WORKER_LOAD_CHECK_INTERVAL, &tv);
+	event_add (&ctx->load_ev, &tv);
+}
+
+/*
+ * Replies with the overload action or scans with the reduced settings
+ */
+static void
+rspamd_worker_shed_task (struct rspamd_task *task,
+		struct rspamd_worker_ctx *ctx)
+{
+	struct rspamd_worker_stat *ws;
+	rspamd_fstring_t *hn, *hv;
+
+	if (ctx->overload_settings_id) {
+		/* Do not override settings explicitly requested by client */
+		if (rspamd_task_get_request_header (task, SETTINGS_ID_HEADER) != NULL) {
+			return;
+		}
+
+		msg_info_task ("worker is overloaded, use settings id %s",
+				ctx->overload_settings_id);
+		hn = rspamd_fstring_new_init (SETTINGS_ID_HEADER,
+				sizeof (SETTINGS_ID_HEADER) - 1);
+		hv = rspamd_fstring_new_init (ctx->overload_settings_id,
+				strlen (ctx->overload_settings_id));
+		rspamd_task_add_request_header (task, rspamd_ftok_map (hn),
+				rspamd_ftok_map (hv));
+	}
+	else {
+		rspamd_add_passthrough_result (task, ctx->overload_action_type,
+				RSPAMD_PASSTHROUGH_CRITICAL, NAN,
+				"Server is overloaded, try again later", "admission control");
+		/* Message is not even parsed */
+		task->flags |= RSPAMD_TASK_FLAG_SKIP;
+		task->processed_stages |= RSPAMD_TASK_STAGE_READ_MESSAGE;
+
+		if (task->message_id == NULL) {
+			task->message_id = "undef";
+		}
+
+		if (task->queue_id == NULL) {
+			task->queue_id = "undef";
+		}
+	}
+
+	if ((ws = rspamd_worker_get_stat (task->worker)) != NULL) {
+		ws->shed_count ++;
+	}
+}
+
+/*
+ * Controller forwards learn requests with `Learn-Type` header to workers
+ * that allow learning, so it is not blocked by the messages processing
+ */
+static gboolean
+rspamd_worker_is_learn_request (struct rspamd_task *task,
+		struct rspamd_worker_ctx *ctx, struct rspamd_http_message *msg)
+{
+	const rspamd_ftok_t *hdr;
+	const gchar *classifier = NULL;
+	gboolean is_spam;
+
+	if (!ctx->allow_learn ||
+			(hdr = rspamd_http_message_find_header (msg, "Learn-Type")) == NULL) {
+		return FALSE;
+	}
+
+	if (rspamd_ftok_cstr_equal (hdr, "spam", TRUE)) {
+		is_spam = TRUE;
+	}
+	else if (rspamd_ftok_cstr_equal (hdr, "ham", TRUE)) {
+		is_spam = FALSE;
+	}
+	else {
+		g_set_error (&task->err, g_quark_from_static_string ("learn"), 400,
+				"invalid learn type: %.*s", (gint)hdr->len, hdr->begin);
+		task->flags |= RSPAMD_TASK_FLAG_SKIP;
+
+		return FALSE;
+	}
+
+	/* Explicit learns must report their errors */
+	task->flags &= ~RSPAMD_TASK_FLAG_LEARN_AUTO;
+
+	if ((hdr = rspamd_http_message_find_header (msg, "Classifier")) != NULL) {
+		classifier = rspamd_mempool_ftokdup (task->task_pool, hdr);
+	}
+
+	return rspamd_learn_task_spam (task, is_spam, classifier, NULL);
+}
+
 static gint
 rspamd_worker_body_handler (struct rspamd_http_connection *conn,
 	struct rspamd_http_message *msg,
@@ -222,6 +417,7 @@ rspamd_worker_body_handler (struct rspamd_http_connection *conn,
 	struct rspamd_worker_ctx *ctx;
 	struct timeval task_tv;
 	struct event *guard_ev;
+	gboolean is_learn = FALSE;
 
 	ctx = task->worker->ctx;
 
@@ -238,6 +434,13 @@ rspamd_worker_body_handler (struct rspamd_http_connection *conn,
 				msg_err_task ("cannot load message: %e", task->err);
 				task->flags |= RSPAMD_TASK_FLAG_SKIP;
 			}
+			else if (rspamd_worker_is_learn_request (task, ctx, msg)) {
+				/* Learns are not shed as they are not latency sensitive */
+				is_learn = TRUE;
+			}
+			else if (ctx->overloaded) {
+				rspamd_worker_shed_task (task, ctx);
+			}
 		}
 	}
 
@@ -251,19 +454,36 @@ rspamd_worker_body_handler (struct rspamd_http_connection *conn,
 	}
 
 	/* Set socket guard */
-	guard_ev = rspamd_mempool_alloc (task->task_pool, sizeof (*guard_ev));
+	if (!rspamd_http_connection_is_keepalive (conn)) {
+		guard_ev = rspamd_mempool_alloc (task->task_pool, sizeof (*guard_ev));
 #ifdef EV_CLOSED
-	event_set (guard_ev, task->sock, EV_READ|EV_PERSIST|EV_CLOSED,
+		event_set (guard_ev, task->sock, EV_READ|EV_PERSIST|EV_CLOSED,
 				rspamd_worker_guard_handler, task);
 #else
-	event_set (guard_ev, task->sock, EV_READ|EV_PERSIST,
-			rspamd_worker_guard_handler, task);
+		event_set (guard_ev, task->sock, EV_READ|EV_PERSIST,
+				rspamd_worker_guard_handler, task);
+#endif
+		event_base_set (task->ev_base, guard_ev);
+		event_add (guard_ev, NULL);
+		task->guard_ev = guard_ev;
+	}
+	else {
+		/*
+		 * Guard reads from the socket and it would eat the next pipelined
+		 * request, so we can only wait for the peer's close here
+		 */
+#ifdef EV_CLOSED
+		guard_ev = rspamd_mempool_alloc (task->task_pool, sizeof (*guard_ev));
+		event_set (guard_ev, task->sock, EV_PERSIST|EV_CLOSED,
+				rspamd_worker_guard_handler, task);
+		event_base_set (task->ev_base, guard_ev);
+		event_add (guard_ev, NULL);
+		task->guard_ev = guard_ev;
 #endif
-	event_base_set (task->ev_base, guard_ev);
-	event_add (guard_ev, NULL);
-	task->guard_ev = guard_ev;
+	}
 
-	rspamd_task_process (task, RSPAMD_TASK_PROCESS_ALL);
+	rspamd_task_process (task, is_learn ?
+			RSPAMD_TASK_PROCESS_LEARN : RSPAMD_TASK_PROCESS_ALL);
 
 	return 0;
 }
@@ -275,8 +495,20 @@ rspamd_worker_error_handler (struct rspamd_http_connection *conn, GError *err)
 	struct rspamd_http_message *msg;
 	rspamd_fstring_t *reply;
 
+	if (task->processed_stages == 0 && rspamd_http_connection_is_keepalive (conn)) {
+		/* Peer has closed an idle kept alive connection or it has timed out */
+		msg_debug_task ("closing idle connection from: %s, error: %e",
+				rspamd_inet_address_to_string (task->client_addr), err);
+		rspamd_session_destroy (task->s);
+
+		return;
+	}
+
 	msg_info_task ("abnormally closing connection from: %s, error: %e",
 		rspamd_inet_address_to_string (task->client_addr), err);
+	/* Connection state is unknown after an error, so we close it after reply */
+	conn->opts &= ~RSPAMD_HTTP_KEEP_ALIVE;
+
 	if (task->processed_stages & RSPAMD_TASK_STAGE_REPLIED) {
 		/* Terminate session immediately */
 		rspamd_session_destroy (task->s);
@@ -321,9 +553,15 @@ rspamd_worker_finish_handler (struct rspamd_http_connection *conn,
 
 	if (task->processed_stages & RSPAMD_TASK_STAGE_REPLIED) {
 		/* We are done here */
-		msg_debug_task ("normally closing connection from: %s",
-			rspamd_inet_address_to_string (task->client_addr));
-		rspamd_session_destroy (task->s);
+		if (rspamd_http_connection_is_keepalive (conn) &&
+				!task->worker->wanna_die) {
+			rspamd_worker_keepalive (task);
+		}
+		else {
+			msg_debug_task ("normally closing connection from: %s",
+					rspamd_inet_address_to_string (task->client_addr));
+			rspamd_session_destroy (task->s);
+		}
 	}
 	else if (task->processed_stages & RSPAMD_TASK_STAGE_DONE) {
 		rspamd_session_pending (task->s);
@@ -333,42 +571,48 @@ rspamd_worker_finish_handler (struct rspamd_http_connection *conn,
 }
 
 /*
- * Accept new connection and construct task
+ * Start reading of the next request from a kept alive connection
  */
 static void
-accept_socket (gint fd, short what, void *arg)
+rspamd_worker_keepalive (struct rspamd_task *task)
 {
-	struct rspamd_worker *worker = (struct rspamd_worker *) arg;
-	struct rspamd_worker_ctx *ctx;
-	struct rspamd_task *task;
+	struct rspamd_http_connection *conn;
+	struct rspamd_worker *worker = task->worker;
 	rspamd_inet_addr_t *addr;
 	gint nfd;
 
-	ctx = worker->ctx;
+	/* Steal socket and connection from the finished task */
+	conn = task->http_conn;
+	task->http_conn = NULL;
+	nfd = task->sock;
+	task->sock = -1;
+	addr = rspamd_inet_address_copy (task->client_addr);
 
-	if (ctx->max_tasks != 0 && worker->nconns > ctx->max_tasks) {
-		msg_info_ctx ("current tasks is now: %uD while maximum is: %uD",
-				worker->nconns,
-			ctx->max_tasks);
-		return;
-	}
+	msg_debug_task ("keep connection from: %s alive",
+			rspamd_inet_address_to_string (task->client_addr));
+	rspamd_session_destroy (task->s);
 
-	if ((nfd =
-		rspamd_accept_from_socket (fd, &addr, worker->accept_events)) == -1) {
-		msg_warn_ctx ("accept failed: %s", strerror (errno));
-		return;
-	}
-	/* Check for EAGAIN */
-	if (nfd == 0) {
-		return;
-	}
+	rspamd_worker_task_new (worker, nfd, addr, conn);
+}
+
+static void
+rspamd_worker_task_new (struct rspamd_worker *worker, gint nfd,
+		rspamd_inet_addr_t *addr, struct rspamd_http_connection *conn)
+{
+	struct rspamd_worker_ctx *ctx;
+	struct rspamd_task *task;
+	struct rspamd_worker_stat *ws;
+	guint opts = 0;
 
+	ctx = worker->ctx;
 	task = rspamd_task_new (worker, ctx->cfg, NULL, ctx->lang_det, ctx->ev_base);
 
-	msg_info_task ("accepted connection from %s port %d, task ptr: %p",
-		rspamd_inet_address_to_string (addr),
-		rspamd_inet_address_get_port (addr),
-		task);
+	if (conn == NULL) {
+		msg_info_task ("accepted connection from %s port %d, task ptr: %p",
+				rspamd_inet_address_to_string (addr),
+				rspamd_inet_address_get_port (addr),
+				task);
+	}
 
 	/* Copy some variables */
 	if (ctx->is_mime) {
@@ -381,20 +625,44 @@ accept_socket (gint fd, short what, void *arg)
 	task->sock = nfd;
 	task->client_addr = addr;
 
-	worker->srv->stat->connections_count++;
 	task->resolver = ctx->resolver;
 	/* TODO: allow to disable autolearn in protocol */
 	task->flags |= RSPAMD_TASK_FLAG_LEARN_AUTO;
 
-	task->http_conn = rspamd_http_connection_new (rspamd_worker_body_handler,
-			rspamd_worker_error_handler,
-			rspamd_worker_finish_handler,
-			0,
-			RSPAMD_HTTP_SERVER,
-			ctx->keys_cache,
-			NULL);
-	rspamd_http_connection_set_max_size (task->http_conn, task->cfg->max_message);
+	if (conn == NULL) {
+		worker->srv->stat->connections_count++;
+		rspamd_worker_count_connection (worker);
+
+		if (ctx->keepalive) {
+			opts |= RSPAMD_HTTP_KEEP_ALIVE;
+		}
+
+		task->http_conn = rspamd_http_connection_new (rspamd_worker_body_handler,
+				rspamd_worker_error_handler,
+				rspamd_worker_finish_handler,
+				opts,
+				RSPAMD_HTTP_SERVER,
+				ctx->keys_cache,
+				NULL);
+		rspamd_http_connection_set_max_size (task->http_conn,
+				task->cfg->max_message);
+
+		if (ctx->key) {
+			rspamd_http_connection_set_key (task->http_conn, ctx->key);
+		}
+	}
+	else {
+		/* Reuse connection with its keys and pipelined data */
+		task->http_conn = conn;
+		rspamd_http_connection_reset (task->http_conn);
+	}
+
 	worker->nconns++;
+
+	if ((ws = rspamd_worker_get_stat (worker)) != NULL) {
+		ws->inflight = worker->nconns;
+	}
+
 	rspamd_mempool_add_destructor (task->task_pool,
 		(rspamd_mempool_destruct_t)reduce_tasks_count, worker);
 
@@ -402,10 +670,6 @@ accept_socket (gint fd, short what, void *arg)
 	task->s = rspamd_session_create (task->task_pool, rspamd_task_fin,
 			rspamd_task_restore, (event_finalizer_t )rspamd_task_free, task);
 
-	if (ctx->key) {
-		rspamd_http_connection_set_key (task->http_conn, ctx->key);
-	}
-
 	rspamd_http_connection_read_message (task->http_conn,
 			task,
 			nfd,
@@ -413,6 +677,39 @@ accept_socket (gint fd, short what, void *arg)
 			ctx->ev_base);
 }
 
+/*
+ * Accept new connection and construct task
+ */
+static void
+accept_socket (gint fd, short what, void *arg)
+{
+	struct rspamd_worker *worker = (struct rspamd_worker *) arg;
+	struct rspamd_worker_ctx *ctx;
+	rspamd_inet_addr_t *addr;
+	gint nfd;
+
+	ctx = worker->ctx;
+
+	if (ctx->max_tasks != 0 && worker->nconns > ctx->max_tasks) {
+		msg_info_ctx ("current tasks is now: %uD while maximum is: %uD",
+				worker->nconns,
+			ctx->max_tasks);
+		return;
+	}
+
+	if ((nfd =
+		rspamd_accept_from_socket (fd, &addr, worker->accept_events)) == -1) {
+		msg_warn_ctx ("accept failed: %s", strerror (errno));
+		return;
+	}
+	/* Check for EAGAIN */
+	if (nfd == 0) {
+		return;
+	}
+
+	rspamd_worker_task_new (worker, nfd, addr, NULL);
+}
+
 #ifdef WITH_HYPERSCAN
 static gboolean
 rspamd_worker_hyperscan_ready (struct rspamd_main *rspamd_main,
@@ -535,6 +832,7 @@ init_worker (struct rspamd_config *cfg)
 	ctx->timeout = DEFAULT_WORKER_IO_TIMEOUT;
 	ctx->cfg = cfg;
 	ctx->task_timeout = DEFAULT_TASK_TIMEOUT;
+	ctx->mempool_cache = DEFAULT_MEMPOOL_CACHE;
 
 	rspamd_rcl_register_worker_option (cfg,
 			type,
@@ -570,7 +868,8 @@ init_worker (struct rspamd_config *cfg)
 			ctx,
 			G_STRUCT_OFFSET (struct rspamd_worker_ctx, allow_learn),
 			0,
-			"Deprecated: disabled and forgotten");
+			"Allow learning of messages forwarded by controller with "
+			"Learn-Type header");
 
 	rspamd_rcl_register_worker_option (cfg,
 			type,
@@ -604,6 +903,15 @@ init_worker (struct rspamd_config *cfg)
 			RSPAMD_CL_FLAG_INT_32,
 			"Maximum count of parallel tasks processed by a single worker process");
 
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"keepalive",
+			rspamd_rcl_parse_struct_boolean,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx, keepalive),
+			0,
+			"Keep connections alive and allow pipelining if clients ask for it");
+
 	rspamd_rcl_register_worker_option (cfg,
 			type,
 			"keypair",
@@ -614,6 +922,59 @@ init_worker (struct rspamd_config *cfg)
 			0,
 			"Encryption keypair");
 
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"overload_loop_lag",
+			rspamd_rcl_parse_struct_time,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+						overload_loop_lag),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Shed load when event loop lag exceeds this time (disabled by default)");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"overload_cpu",
+			rspamd_rcl_parse_struct_double,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+						overload_cpu),
+			0,
+			"Shed load when share of cpu time used exceeds this value, "
+			"e.g. 0.95 (disabled by default)");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"overload_action",
+			rspamd_rcl_parse_struct_string,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+						overload_action),
+			0,
+			"Action returned for messages when overloaded, default: soft reject");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"overload_settings_id",
+			rspamd_rcl_parse_struct_string,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+						overload_settings_id),
+			0,
+			"Scan messages with these settings when overloaded instead of "
+			"replying with the overload action");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"mempool_cache",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+						mempool_cache),
+			RSPAMD_CL_FLAG_INT_SIZE,
+			"Size of freed memory pool chunks reused by new tasks, "
+			"default: 16Mb (0 to disable)");
+
 	return ctx;
 }
 
@@ -664,6 +1025,7 @@ void
 start_worker (struct rspamd_worker *worker)
 {
 	struct rspamd_worker_ctx *ctx = worker->ctx;
+	struct timeval tv;
 
 	ctx->cfg = worker->srv->cfg;
 	ctx->ev_base = rspamd_prepare_worker (worker, "normal", accept_socket);
@@ -685,6 +1047,26 @@ start_worker (struct rspamd_worker *worker)
 	rspamd_lua_run_postloads (ctx->cfg->lua_state, ctx->cfg, ctx->ev_base,
 			worker);
 
+	ctx->overload_action_type = METRIC_ACTION_SOFT_REJECT;
+
+	if (ctx->overload_action &&
+			!rspamd_action_from_str (ctx->overload_action,
+					&ctx->overload_action_type)) {
+		msg_err ("invalid overload action: %s, use soft reject",
+				ctx->overload_action);
+		ctx->overload_action_type = METRIC_ACTION_SOFT_REJECT;
+	}
+
+	rspamd_mempool_chunks_cache_limit (ctx->mempool_cache);
+
+	/* Load is measured even without limits to export it in stats */
+	ctx->last_check = rspamd_get_ticks (FALSE);
+	event_set (&ctx->load_ev, -1, EV_TIMEOUT, rspamd_worker_load_handler,
+			worker);
+	event_base_set (ctx->ev_base, &ctx->load_ev);
+	double_to_tv (WORKER_LOAD_CHECK_INTERVAL, &tv);
+	event_add (&ctx->load_ev, &tv);
+
 	event_base_loop (ctx->ev_base, 0);
 	rspamd_worker_block_signals ();
 
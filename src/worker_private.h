@@ -46,6 +46,8 @@ struct rspamd_worker_ctx {
 	gboolean is_json;
 	/* Allow learning through worker				*/
 	gboolean allow_learn;
+	/* Allow keep-alive connections					*/
+	gboolean keepalive;
 	/* Limit of tasks */
 	guint32 max_tasks;
 	/* Maximum time for task processing */
@@ -56,6 +58,23 @@ struct rspamd_worker_ctx {
 	struct rspamd_keypair_cache *keys_cache;
 	/* Language detector */
 	struct rspamd_lang_detector *lang_det;
+	/* Admission control: limits, 0 means no limit */
+	gdouble overload_loop_lag;
+	gdouble overload_cpu;
+	/* Action or settings id applied to tasks when overloaded */
+	gchar *overload_action;
+	gchar *overload_settings_id;
+	gint overload_action_type;
+	/* Admission control: current state */
+	gboolean overloaded;
+	gdouble loop_lag;
+	gdouble cpu_load;
+	gdouble last_check;
+	gdouble last_cpu;
+	struct event load_ev;
+	/* Size of freed mempool chunks kept for new tasks */
+	gsize mempool_cache;
+	guint idle_checks;
 };
 /*
  * Init scanning routines
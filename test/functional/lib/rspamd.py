@@ -133,6 +133,88 @@ def rspamc(addr, port, filename):
     r = s.recv(2048)
     return r.decode('utf-8')
 
+def get_perf_corpus(corpus_dir, tmp_dir):
+    """Returns sorted corpus messages and a generated message with many parts
+
+    The generated message makes costs that grow faster than the message size
+    visible, e.g. quadratic MIME parsing
+    """
+    files = sorted(glob.glob("%s/*.eml" % corpus_dir))
+    generated = "%s/perf_many_parts.eml" % tmp_dir
+    boundary = "perf-boundary"
+    with open(generated, 'w') as f:
+        f.write("From: perf@example.com\r\nTo: perf@example.net\r\n"
+                "Subject: performance corpus\r\nMIME-Version: 1.0\r\n"
+                "Content-Type: multipart/mixed; boundary=\"%s\"\r\n\r\n" % boundary)
+        for i in range(500):
+            f.write("--%s\r\nContent-Type: text/plain; charset=utf-8\r\n\r\n" % boundary)
+            f.write(" ".join("word%d" % ((i * 31 + j) % 997) for j in range(200)))
+            f.write("\r\nhttp://example%d.com/path\r\n" % (i % 50))
+        f.write("--%s--\r\n" % boundary)
+    files.append(generated)
+    return files
+
+def get_stage_timings(addr, port):
+    """Returns {stage: [count, sum]} from the controller metrics"""
+    timings = {}
+    s, t = HTTP("GET", addr, port, "/metrics")
+    assert s == 200, "cannot get metrics: %s" % s
+    for line in t.decode('utf-8').splitlines():
+        for suffix, idx in (("_count", 0), ("_sum", 1)):
+            name = "rspamd_task_stage_duration_seconds%s{stage=\"" % suffix
+            if line.startswith(name):
+                stage, value = line[len(name):].split("\"} ")
+                timings.setdefault(stage, [0, 0.0])[idx] = float(value)
+    return timings
+
+def stage_timings_difference(before, after):
+    """Returns mean duration of each stage between two snapshots"""
+    means = {}
+    for stage, (count, total) in after.items():
+        prev_count, prev_total = before.get(stage, [0, 0.0])
+        if count > prev_count:
+            means[stage] = (total - prev_total) / (count - prev_count)
+    return means
+
+def scan_perf_corpus(addr, port, files, iterations):
+    scanned = 0
+    for _ in range(int(iterations)):
+        for filename in files:
+            with open(filename, 'rb') as f:
+                s, t = HTTP("POST", addr, port, "/checkv2", f.read())
+            assert s == 200, "cannot scan %s: %s" % (filename, s)
+            scanned += 1
+    return scanned
+
+def check_stage_timings(timings, baseline_file):
+    """Checks stage means against a baseline within its tolerance band
+
+    With RSPAMD_PERF_RECORD set the baseline is overwritten instead
+    """
+    with open(baseline_file, 'r') as f:
+        baseline = demjson.decode(f.read())
+    if os.environ.get('RSPAMD_PERF_RECORD'):
+        baseline['stages'] = dict((k, round(v, 6)) for k, v in timings.items())
+        with open(baseline_file, 'w') as f:
+            f.write(demjson.encode(baseline, compactly=False, sort_keys=demjson.SORT_ALPHA))
+        logger.warn("recorded performance baseline to %s" % baseline_file)
+        return
+    assert len(baseline['stages']) > 0, \
+        "no baseline in %s, record it with RSPAMD_PERF_RECORD=1" % baseline_file
+    tolerance = float(baseline.get('tolerance', 0.3))
+    min_delta = float(baseline.get('min_delta', 0.0))
+    failed = []
+    for stage, expected in sorted(baseline['stages'].items()):
+        actual = timings.get(stage)
+        if actual is None:
+            failed.append("%s: not measured" % stage)
+            continue
+        delta = max(expected * tolerance, min_delta)
+        logger.info("%s: %.6f sec, baseline %.6f +- %.6f" % (stage, actual, expected, delta))
+        if abs(actual - expected) > delta:
+            failed.append("%s: %.6f sec is out of %.6f +- %.6f" % (stage, actual, expected, delta))
+    assert not failed, "stage timings regressed: " + "; ".join(failed)
+
 def scan_file(addr, port, filename):
     return str(urlopen("http://%s:%s/symbols?file=%s" % (addr, port, filename)).read())
 
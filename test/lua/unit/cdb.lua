@@ -0,0 +1,22 @@
+context("CDB API", function()
+  local rspamd_cdb = require "rspamd_cdb"
+
+  test("CDB build and typed lookup", function()
+    local builder = rspamd_cdb.build('test')
+    assert_not_nil(builder, "should be able to create cdb builder")
+
+    builder:add('str', 'value')
+      :add('num', 42.5)
+      :add('bool', true)
+      :add('tbl', {a = 1, b = {'x', 'y'}})
+    local db = builder:finalize()
+    assert_not_nil(db, "should be able to finalize cdb")
+
+    assert_equal(db:get('str'), 'value')
+    assert_equal(db:get('num'), 42.5)
+    assert_true(db:get('bool'))
+    assert_rspamd_table_eq({expect = {a = 1, b = {'x', 'y'}}, actual = db:get('tbl')})
+    assert_nil(db:get('absent'))
+    assert_equal(db:get_name(), 'anonymous')
+  end)
+end)
@@ -0,0 +1,42 @@
+context("DMARC record parser unit tests", function()
+  local rspamd_dmarc = require "rspamd_dmarc"
+
+  test("Parse valid records", function()
+    local rec = rspamd_dmarc.parse('v=DMARC1; p=reject; sp=none; adkim=s; pct=50; rua=mailto:a@example.com')
+    assert_not_nil(rec)
+
+    local ok, pol = rec:to_table(false)
+    assert_true(ok)
+    assert_equal(pol.dmarc_policy, 'reject')
+    assert_true(pol.strict_dkim)
+    assert_nil(pol.strict_spf)
+    assert_nil(pol.subdomain_policy)
+    assert_equal(pol.pct, 50)
+    assert_equal(pol.rua, 'mailto:a@example.com')
+
+    ok, pol = rec:to_table(true)
+    assert_true(ok)
+    assert_equal(pol.dmarc_policy, 'none')
+    assert_equal(pol.subdomain_policy, 'none')
+
+    ok, pol = rspamd_dmarc.parse('v=DMARC1;'):to_table(false)
+    assert_true(ok)
+    assert_equal(pol.dmarc_policy, 'none')
+  end)
+
+  test("Garbage and invalid records", function()
+    assert_nil(rspamd_dmarc.parse('v=spf1 -all'))
+    assert_nil(rspamd_dmarc.parse('v=DMARC1'))
+
+    local ok, err = rspamd_dmarc.parse('v=DMARC1; p=deny'):to_table(false)
+    assert_false(ok)
+    assert_equal(err, 'p tag has invalid value: deny')
+
+    local rec = rspamd_dmarc.parse('v=DMARC1; p=none; sp=bad')
+    ok = rec:to_table(false)
+    assert_true(ok)
+    ok, err = rec:to_table(true)
+    assert_false(ok)
+    assert_equal(err, 'sp tag has invalid value: bad')
+  end)
+end)
@@ -0,0 +1,36 @@
+-- Edit distance tests
+
+context("Levenshtein distance", function()
+  local util = require "rspamd_util"
+
+  local cases = {
+    -- s1, s2, replace cost, distance
+    {'', 'abc', 1, 3},
+    {'abc', 'abc', 1, 0},
+    {'kitten', 'sitting', 1, 3},
+    {'abcd', 'abdc', 1, 1},
+    {'ca', 'abc', 1, 3},
+    {'example', 'exmaple', 2, 2},
+    {'kitten', 'sitting', 2, 5},
+    {'paypal', 'paypa1', 2, 2},
+    {'abc', 'xyz', 2, 6},
+  }
+
+  for i,c in ipairs(cases) do
+    test("Distance " .. tostring(i), function()
+      assert_equal(util.levenshtein_distance(c[1], c[2], c[3]), c[4])
+      assert_equal(util.levenshtein_distance(c[2], c[1], c[3]), c[4])
+    end)
+  end
+
+  test("Long strings", function()
+    local s1 = string.rep('abcdefgh', 10)
+    local s2 = string.rep('abcdefgh', 9) .. 'abcdfegh'
+
+    -- Generic and bit-parallel paths must agree
+    assert_equal(util.levenshtein_distance(s1, s2, 1), 1)
+    assert_equal(util.levenshtein_distance(s1, s2, 2), 2)
+    assert_equal(util.levenshtein_distance(s1:sub(1, 64), s2:sub(1, 64), 1), 0)
+    assert_equal(util.levenshtein_distance(s1:sub(1, 60), s2, 1), 20)
+  end)
+end)
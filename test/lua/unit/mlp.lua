@@ -0,0 +1,20 @@
+context("Native MLP", function()
+  local rspamd_mlp = require "rspamd_mlp"
+
+  test("MLP create and serialize", function()
+    local ann = rspamd_mlp.create(3, {4, 2, 1})
+    assert_not_nil(ann, "should be able to create mlp")
+    assert_equal(ann:get_inputs(), 4)
+    assert_equal(ann:get_outputs(), 1)
+    assert_rspamd_table_eq({expect = {4, 2, 1}, actual = ann:get_layers()})
+
+    local out = ann:test({1, 0, 0.5, -1})
+    assert_equal(#out, 1)
+    assert_true(out[1] >= -1 and out[1] <= 1, "output should be in [-1, 1]")
+
+    local loaded = rspamd_mlp.load_data(ann:data())
+    assert_not_nil(loaded, "should be able to load serialized mlp")
+    assert_equal(loaded:test({1, 0, 0.5, -1})[1], out[1])
+    assert_nil(rspamd_mlp.load_data('garbage'))
+  end)
+end)
@@ -0,0 +1,18 @@
+context("Rows batch unit tests", function()
+  local rspamd_rows = require "rspamd_rows"
+
+  test("Rows serialisation", function()
+    local rows = rspamd_rows.create()
+
+    assert_not_nil(rows)
+    rows:add_row({1, 1.5, 'a\tb\\c', {'SYM\'1', 'sym2'}, {1, -0.25}, {}, true})
+    rows:add_row({'', 100000000000})
+    assert_equal(#rows, 2)
+
+    local body = tostring(rows:flush())
+    assert_equal(body, "1\t1.5\ta\\tb\\\\c\t['sym\\'1','sym2']\t[1,-0.25]\t[]\t1\n" ..
+        "\t100000000000\n")
+    assert_equal(#rows, 0)
+    assert_equal(rows:bytes(), 0)
+  end)
+end)
@@ -0,0 +1,45 @@
+context("SpamAssassin rules engine unit tests", function()
+  local rspamd_sa_rules = require "rspamd_sa_rules"
+  local rspamd_task = require "rspamd_task"
+
+  local msg = [[
+From: <a@example.com>
+To: <b@example.com>
+Subject: test
+
+Hello
+]]
+
+  test("Meta rules dependencies and externals", function()
+    local sa = rspamd_sa_rules.create()
+    local ncalls = 0
+
+    sa:add_function('__A', function() ncalls = ncalls + 1; return 1 end)
+    sa:add_function('__B', function() return 0 end)
+    -- Meta depending on meta that is defined later
+    assert_true(sa:add_meta('META_OUTER', 'META_INNER && __A'))
+    assert_true(sa:add_meta('META_INNER', '__A || __B'))
+    assert_true(sa:add_meta('META_EXT', '__A && SA_EXTERNAL'))
+    -- Cyclic metas are never matched
+    assert_true(sa:add_meta('META_CYCLE1', 'META_CYCLE2 || __A'))
+    assert_true(sa:add_meta('META_CYCLE2', 'META_CYCLE1'))
+
+    local ok = sa:add_meta('META_BAD', '__A &&')
+    assert_false(ok)
+
+    local externals = sa:compile({SA_EXTERNAL = 'RSPAMD_EXTERNAL'})
+    assert_rspamd_table_eq({expect = {'RSPAMD_EXTERNAL'}, actual = externals})
+
+    local res, task = rspamd_task.load_from_string(msg, rspamd_config)
+    assert_true(res)
+
+    assert_equal(sa:process(task), 2)
+    assert_true(task:has_symbol('META_INNER'))
+    assert_true(task:has_symbol('META_OUTER'))
+    assert_false(task:has_symbol('META_EXT'))
+    assert_false(task:has_symbol('META_CYCLE1'))
+    assert_true(ncalls > 0)
+
+    task:destroy()
+  end)
+end)
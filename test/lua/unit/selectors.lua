@@ -216,6 +216,22 @@ context("Selectors test", function()
     ["transformation substring -4"] = {
                 selector = "header(Subject, strong).substring(-4)",
                 expect = {'ject'}},
+
+    ["from domain"] = {
+                selector = "from:domain",
+                expect = {'nowhere.com'}},
+
+    ["rcpts user join"] = {
+                selector = "rcpts:user.join(',')",
+                expect = {'nobody,no-one'}},
+
+    ["rcpts last"] = {
+                selector = "rcpts.drop_n(1).last",
+                expect = {'no-one@example.com'}},
+
+    ["transformation digest md5"] = {
+                selector = "header(Subject, strong).digest(hex, md5)",
+                expect = {'88faab088998bafc324306e8190ddff5'}},
   }
 
   for case_name, case in pairs(cases) do
@@ -225,6 +241,22 @@ context("Selectors test", function()
       assert_rspamd_table_eq({actual = elts, expect = case.expect})
     end)
   end
+
+  test("compiled selectors", function()
+    local sels = lua_selectors.parse_selector(cfg, "rcpts:addr.lower.first")
+    assert_not_nil(sels[1].compiled)
+    sels = lua_selectors.parse_selector(cfg, "urls:get_tld.regexp('\\.([\\w]+)$')")
+    assert_nil(sels[1].compiled)
+    sels = lua_selectors.parse_selector(cfg, "header(Subject, 'full')")
+    assert_nil(sels[1].compiled)
+  end)
+
+  test("memoized values", function()
+    local first = check_selector("rcpts:addr")
+    local second = check_selector("rcpts:addr")
+    assert_not_nil(first)
+    assert_equal(first[1], second[1])
+  end)
 end)
 
 
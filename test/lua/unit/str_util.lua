@@ -0,0 +1,72 @@
+context("String primitives", function()
+  local ffi = require("ffi")
+  ffi.cdef[[
+    void rspamd_cryptobox_init (void);
+    size_t rspamd_str_util_test (const char *func, bool generic,
+      size_t niters, size_t len);
+    double rspamd_get_ticks (void);
+    uint64_t rspamd_icase_hash_fast (const char *in, size_t len,
+      uint64_t seed);
+  ]]
+
+  ffi.C.rspamd_cryptobox_init()
+
+  local funcs = {
+    'lc',
+    'lc_cmp',
+    'memcspn',
+    'memspn',
+    'has_8bit',
+    'substring_caseless',
+    'utf8_validate',
+  }
+  local sizes = {
+    {'16', 16, 1000000},
+    {'100', 100, 100000},
+    {'1K', 1024, 10000},
+    {'64K', 65536, 100},
+  }
+
+  test("Caseless hash is stable", function()
+    local cases = {
+      {"received", 0xAF1F72BD45F2BC84ULL},
+      {"Received", 0xAF1F72BD45F2BC84ULL},
+      {"CONTENT-TRANSFER-ENCODING", 0x75DE247B49D344B8ULL},
+    }
+
+    for _,c in ipairs(cases) do
+      local h = ffi.C.rspamd_icase_hash_fast(c[1], #c[1], 0xdeadbabe)
+      assert_equal(h, c[2], c[1] .. " has unexpected hash " .. tostring(h))
+    end
+
+    -- Inputs longer than a single lowercasing block
+    local long = string.rep("Header-Name-", 100)
+    assert_equal(ffi.C.rspamd_icase_hash_fast(long, #long, 0),
+        ffi.C.rspamd_icase_hash_fast(long:lower(), #long, 0))
+  end)
+
+  for _,f in ipairs(funcs) do
+    for _,sz in ipairs(sizes) do
+      local name, len, iters = sz[1], sz[2], sz[3]
+
+      test(string.format("%s reference (%s)", f, name), function()
+        local t1 = ffi.C.rspamd_get_ticks()
+        local res = ffi.C.rspamd_str_util_test(f, true, iters, len)
+        local t2 = ffi.C.rspamd_get_ticks()
+
+        print(string.format("Reference %s (%s): %s sec", f, name,
+            tostring(t2 - t1)))
+        assert_not_equal(res, 0)
+      end)
+      test(string.format("%s optimized (%s)", f, name), function()
+        local t1 = ffi.C.rspamd_get_ticks()
+        local res = ffi.C.rspamd_str_util_test(f, false, iters, len)
+        local t2 = ffi.C.rspamd_get_ticks()
+
+        print(string.format("Optimized %s (%s): %s sec", f, name,
+            tostring(t2 - t1)))
+        assert_not_equal(res, 0)
+      end)
+    end
+  end
+end)
@@ -53,6 +53,18 @@ context("URL check functions", function()
     end)
   end
 
+  test("Get url fields as text", function()
+    local util = require("rspamd_util")
+    local res = url.create(pool, "http://user@Example.com/path?query")
+    assert_not_nil(res)
+    local host = res:get_host(true)
+    assert_equal('userdata', type(host))
+    assert_equal(res:get_host(), tostring(host))
+    assert_equal(#res:get_path(), #res:get_path(true))
+    assert_equal(util.strlen_utf8(res:get_host()), util.strlen_utf8(host))
+    assert_true(util.strequal_caseless(host, 'EXAMPLE.COM'))
+  end)
+
   cases = {
     {"http://%30%78%63%30%2e%30%32%35%30.01", true, { --0xc0.0250.01
       host = '192.168.0.1',
@@ -0,0 +1,76 @@
+/*-
+ * Copyright 2019 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "rspamd.h"
+#include "libstat/classifiers/classifiers.h"
+#include "ottery.h"
+#include "tests.h"
+#include <math.h>
+
+static const gdouble test_weights[] = { 1, 4, 27, 256, 3125, 46656, 823543 };
+
+static void
+test_bayes_kernel (gsize n, gdouble spam_learns, gdouble ham_learns)
+{
+	gdouble *spam_counts, *ham_counts, *weights;
+	gdouble sl_ref, hl_ref, sl, hl, ts1, ts2, ts3;
+	gsize i;
+
+	spam_counts = g_malloc (n * sizeof (gdouble));
+	ham_counts = g_malloc (n * sizeof (gdouble));
+	weights = g_malloc (n * sizeof (gdouble));
+
+	for (i = 0; i < n; i ++) {
+		spam_counts[i] = ottery_rand_range (1000);
+		ham_counts[i] = ottery_rand_range (1000);
+
+		if (spam_counts[i] + ham_counts[i] == 0) {
+			spam_counts[i] = 1;
+		}
+
+		weights[i] = test_weights[ottery_rand_range (
+				G_N_ELEMENTS (test_weights) - 1)];
+	}
+
+	ts1 = rspamd_get_virtual_ticks ();
+	bayes_accumulate_probs_ref (spam_counts, ham_counts, weights, n,
+			spam_learns, ham_learns, &sl_ref, &hl_ref);
+	ts2 = rspamd_get_virtual_ticks ();
+	bayes_accumulate_probs (spam_counts, ham_counts, weights, n,
+			spam_learns, ham_learns, &sl, &hl);
+	ts3 = rspamd_get_virtual_ticks ();
+
+	msg_info ("bayes kernel (%z tokens): reference: spam %.6f, ham %.6f, "
+			"%.6f sec; batched: spam %.6f, ham %.6f, %.6f sec",
+			n, sl_ref, hl_ref, ts2 - ts1, sl, hl, ts3 - ts2);
+
+	g_assert (fabs (sl - sl_ref) <= 1e-9 * MAX (1.0, fabs (sl_ref)));
+	g_assert (fabs (hl - hl_ref) <= 1e-9 * MAX (1.0, fabs (hl_ref)));
+
+	g_free (spam_counts);
+	g_free (ham_counts);
+	g_free (weights);
+}
+
+void
+rspamd_bayes_test_func (void)
+{
+	test_bayes_kernel (0, 100, 100);
+	test_bayes_kernel (1, 100, 100);
+	test_bayes_kernel (7, 1000, 10);
+	test_bayes_kernel (1000, 10000, 5000);
+	test_bayes_kernel (100000, 100000, 200000);
+}
@@ -0,0 +1,149 @@
+/*-
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "bloom.h"
+#include "tests.h"
+#include "ottery.h"
+
+static const guint nelts = 100000;
+static const guint nchecks = 1000000;
+
+static void
+rspamd_bloom_blocked_test (guint64 *keys)
+{
+	rspamd_bloom_blocked_t *bloom;
+	guint i, fp = 0;
+	gchar buf[32];
+
+	bloom = rspamd_bloom_blocked_create (nelts, 0.01);
+	g_assert (bloom != NULL);
+
+	for (i = 0; i < nelts; i ++) {
+		rspamd_bloom_blocked_add_hash (bloom, keys[i]);
+	}
+
+	for (i = 0; i < nelts; i ++) {
+		g_assert (rspamd_bloom_blocked_check_hash (bloom, keys[i]));
+	}
+
+	for (i = 0; i < nchecks; i ++) {
+		if (rspamd_bloom_blocked_check_hash (bloom, ottery_rand_uint64 ())) {
+			fp ++;
+		}
+	}
+
+	msg_info ("blocked bloom: %.4f false positives for 0.01 requested",
+			(gdouble)fp / nchecks);
+	g_assert (fp < nchecks / 50);
+
+	rspamd_bloom_blocked_clear (bloom);
+	rspamd_snprintf (buf, sizeof (buf), "key");
+	g_assert (!rspamd_bloom_blocked_check_buf (bloom, buf, strlen (buf)));
+	rspamd_bloom_blocked_add_buf (bloom, buf, strlen (buf));
+	g_assert (rspamd_bloom_blocked_check_buf (bloom, buf, strlen (buf)));
+
+	rspamd_bloom_blocked_destroy (bloom);
+}
+
+static void
+rspamd_cuckoo_filter_test (guint64 *keys)
+{
+	rspamd_cuckoo_filter_t *filter;
+	guint i, fp = 0, added = 0;
+	gchar buf[32];
+
+	filter = rspamd_cuckoo_filter_create (nelts);
+
+	for (i = 0; i < nelts; i ++) {
+		g_assert (rspamd_cuckoo_filter_add_hash (filter, keys[i]));
+	}
+
+	g_assert (filter->nitems == nelts);
+
+	for (i = 0; i < nelts; i ++) {
+		g_assert (rspamd_cuckoo_filter_check_hash (filter, keys[i]));
+	}
+
+	for (i = 0; i < nchecks; i ++) {
+		if (rspamd_cuckoo_filter_check_hash (filter, ottery_rand_uint64 ())) {
+			fp ++;
+		}
+	}
+
+	msg_info ("cuckoo filter: %.5f false positives", (gdouble)fp / nchecks);
+	g_assert (fp < nchecks / 1000);
+
+	/* Deletion of even keys must not affect odd ones */
+	for (i = 0; i < nelts; i += 2) {
+		g_assert (rspamd_cuckoo_filter_del_hash (filter, keys[i]));
+	}
+
+	for (i = 1; i < nelts; i += 2) {
+		g_assert (rspamd_cuckoo_filter_check_hash (filter, keys[i]));
+	}
+
+	g_assert (filter->nitems == nelts / 2);
+	rspamd_cuckoo_filter_destroy (filter);
+
+	/* Filter is filled until insertion fails, nothing is lost */
+	filter = rspamd_cuckoo_filter_create (1000);
+
+	for (i = 0; i < nelts; i ++) {
+		if (!rspamd_cuckoo_filter_add_hash (filter, keys[i])) {
+			break;
+		}
+
+		added ++;
+	}
+
+	g_assert (added >= 1000 && added < nelts);
+
+	for (i = 0; i < added; i ++) {
+		g_assert (rspamd_cuckoo_filter_check_hash (filter, keys[i]));
+	}
+
+	for (i = 0; i < added; i ++) {
+		g_assert (rspamd_cuckoo_filter_del_hash (filter, keys[i]));
+	}
+
+	g_assert (filter->nitems == 0);
+
+	rspamd_snprintf (buf, sizeof (buf), "key");
+	g_assert (rspamd_cuckoo_filter_add_buf (filter, buf, strlen (buf)));
+	g_assert (rspamd_cuckoo_filter_check_buf (filter, buf, strlen (buf)));
+	g_assert (rspamd_cuckoo_filter_del_buf (filter, buf, strlen (buf)));
+	g_assert (!rspamd_cuckoo_filter_check_buf (filter, buf, strlen (buf)));
+
+	rspamd_cuckoo_filter_destroy (filter);
+}
+
+void
+rspamd_bloom_test_func (void)
+{
+	guint64 *keys;
+	guint i;
+
+	keys = g_malloc (sizeof (*keys) * nelts);
+
+	for (i = 0; i < nelts; i ++) {
+		keys[i] = ottery_rand_uint64 ();
+	}
+
+	rspamd_bloom_blocked_test (keys);
+	rspamd_cuckoo_filter_test (keys);
+
+	g_free (keys);
+}
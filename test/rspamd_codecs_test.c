@@ -0,0 +1,126 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "cryptobox.h"
+#include "ottery.h"
+#include "tests.h"
+
+static const gsize codecs_input_len = 4 * 1024 * 1024;
+static const guint codecs_niters = 10;
+
+/* Simple qp encoder that escapes every non alphanumeric character */
+static gchar *
+codecs_encode_qp (const guchar *in, gsize inlen, gsize *outlen)
+{
+	static const gchar hexdigits[] = "0123456789ABCDEF";
+	gchar *out, *o;
+	gsize i, linelen = 0;
+
+	out = g_malloc (inlen * 4 + 1);
+	o = out;
+
+	for (i = 0; i < inlen; i ++) {
+		if (linelen >= 72) {
+			*o++ = '=';
+			*o++ = '\r';
+			*o++ = '\n';
+			linelen = 0;
+		}
+
+		if (g_ascii_isalnum (in[i])) {
+			*o++ = in[i];
+			linelen ++;
+		}
+		else {
+			*o++ = '=';
+			*o++ = hexdigits[in[i] >> 4];
+			*o++ = hexdigits[in[i] & 0xF];
+			linelen += 3;
+		}
+	}
+
+	*outlen = o - out;
+
+	return out;
+}
+
+static void
+codecs_report (const gchar *codec, gsize len, gdouble t1, gdouble t2)
+{
+	msg_info ("%s decode: %.2f MB/s", codec,
+			(gdouble)len * codecs_niters / (t2 - t1) / (1024.0 * 1024.0));
+}
+
+void
+rspamd_codecs_test_func (void)
+{
+	guchar *in, *out;
+	gchar *enc;
+	gsize enclen, outlen;
+	gssize r;
+	gdouble t1, t2;
+	guint i;
+
+	in = g_malloc (codecs_input_len);
+	out = g_malloc (codecs_input_len * 2);
+	ottery_rand_bytes (in, codecs_input_len);
+
+	/* Base64 folded to 76 characters as in mime parts */
+	enc = rspamd_encode_base64 (in, codecs_input_len, 76, &enclen);
+	t1 = rspamd_get_ticks (FALSE);
+
+	for (i = 0; i < codecs_niters; i ++) {
+		outlen = codecs_input_len * 2;
+		rspamd_cryptobox_base64_decode (enc, enclen, out, &outlen);
+	}
+
+	t2 = rspamd_get_ticks (FALSE);
+	g_assert (outlen == codecs_input_len);
+	g_assert (memcmp (in, out, codecs_input_len) == 0);
+	codecs_report ("base64", enclen, t1, t2);
+	g_free (enc);
+
+	/* Quoted printable with soft line breaks */
+	enc = codecs_encode_qp (in, codecs_input_len, &enclen);
+	t1 = rspamd_get_ticks (FALSE);
+
+	for (i = 0; i < codecs_niters; i ++) {
+		r = rspamd_decode_qp_buf (enc, enclen, out, codecs_input_len * 2);
+	}
+
+	t2 = rspamd_get_ticks (FALSE);
+	g_assert (r == (gssize)codecs_input_len);
+	g_assert (memcmp (in, out, codecs_input_len) == 0);
+	codecs_report ("qp", enclen, t1, t2);
+
+	/* RFC 2047 quoted printable decoder */
+	t1 = rspamd_get_ticks (FALSE);
+
+	for (i = 0; i < codecs_niters; i ++) {
+		r = rspamd_decode_qp2047_buf (enc, enclen, out, codecs_input_len * 2);
+	}
+
+	t2 = rspamd_get_ticks (FALSE);
+	g_assert (r == (gssize)codecs_input_len);
+	g_assert (memcmp (in, out, codecs_input_len) == 0);
+	codecs_report ("qp2047", enclen, t1, t2);
+	g_free (enc);
+
+	g_free (in);
+	g_free (out);
+}
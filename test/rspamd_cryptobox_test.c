@@ -24,6 +24,7 @@
 static const int mapping_size = 64 * 8192 + 1;
 static const int max_seg = 32;
 static const int random_fuzz_cnt = 10000;
+#define BATCH_SIGS 64
 enum rspamd_cryptobox_mode mode = RSPAMD_CRYPTOBOX_MODE_25519;
 
 static void *
@@ -152,6 +153,86 @@ create_constrainted_split (struct rspamd_cryptobox_segment *seg, int mseg,
 	return used;
 }
 
+static void
+check_batch_verify (void)
+{
+	rspamd_sig_pk_t pk;
+	rspamd_sig_sk_t sk;
+	guchar *sigs, *msgs;
+	const guchar *psigs[BATCH_SIGS], *pmsgs[BATCH_SIGS], *ppks[BATCH_SIGS];
+	gsize siglens[BATCH_SIGS], mlens[BATCH_SIGS];
+	bool valid[BATCH_SIGS];
+	double t1, t2;
+	gint i;
+
+	sigs = g_malloc (BATCH_SIGS * rspamd_cryptobox_MAX_SIGBYTES);
+	msgs = g_malloc (BATCH_SIGS * 64);
+	rspamd_cryptobox_keypair_sig (pk, sk, RSPAMD_CRYPTOBOX_MODE_25519);
+
+	for (i = 0; i < BATCH_SIGS; i ++) {
+		ottery_rand_bytes (msgs + i * 64, 64);
+		psigs[i] = sigs + i * rspamd_cryptobox_MAX_SIGBYTES;
+		pmsgs[i] = msgs + i * 64;
+		ppks[i] = pk;
+		mlens[i] = 64;
+		rspamd_cryptobox_sign ((guchar *)psigs[i], &siglens[i], pmsgs[i],
+				mlens[i], sk, RSPAMD_CRYPTOBOX_MODE_25519);
+	}
+
+	t1 = rspamd_get_ticks (TRUE);
+	for (i = 0; i < BATCH_SIGS; i ++) {
+		g_assert (rspamd_cryptobox_verify (psigs[i], siglens[i], pmsgs[i],
+				mlens[i], pk, RSPAMD_CRYPTOBOX_MODE_25519));
+	}
+	t2 = rspamd_get_ticks (TRUE);
+	msg_info ("verification of %d signatures: %.0f", BATCH_SIGS, t2 - t1);
+
+	t1 = rspamd_get_ticks (TRUE);
+	g_assert (rspamd_cryptobox_verify_batch (psigs, siglens, pmsgs, mlens,
+			ppks, BATCH_SIGS, valid, RSPAMD_CRYPTOBOX_MODE_25519));
+	t2 = rspamd_get_ticks (TRUE);
+	msg_info ("batch verification of %d signatures: %.0f", BATCH_SIGS, t2 - t1);
+
+	/* Corrupted message must be found */
+	msgs[7 * 64] ^= 0x1;
+	g_assert (!rspamd_cryptobox_verify_batch (psigs, siglens, pmsgs, mlens,
+			ppks, BATCH_SIGS, valid, RSPAMD_CRYPTOBOX_MODE_25519));
+
+	for (i = 0; i < BATCH_SIGS; i ++) {
+		g_assert (valid[i] == (i != 7));
+	}
+
+	g_free (sigs);
+	g_free (msgs);
+}
+
+static void
+check_fast_hash_multi (void)
+{
+	guchar buf[256];
+	const void *data[37];
+	gsize lens[37];
+	guint64 seeds[37], out[37];
+	gint i;
+
+	ottery_rand_bytes (buf, sizeof (buf));
+
+	/* Both lanes of the same length and diverging lengths */
+	for (i = 0; i < (gint)G_N_ELEMENTS (data); i ++) {
+		data[i] = buf + i;
+		lens[i] = i < 16 ? 7 : (i * 13) % 200;
+		seeds[i] = ottery_rand_uint64 ();
+	}
+
+	rspamd_cryptobox_fast_hash_multi (RSPAMD_CRYPTOBOX_XXHASH64, data, lens,
+			seeds, G_N_ELEMENTS (data), out);
+
+	for (i = 0; i < (gint)G_N_ELEMENTS (data); i ++) {
+		g_assert (out[i] == rspamd_cryptobox_fast_hash_specific (
+				RSPAMD_CRYPTOBOX_XXHASH64, data[i], lens[i], seeds[i]));
+	}
+}
+
 void
 rspamd_cryptobox_test_func (void)
 {
@@ -173,6 +254,9 @@ rspamd_cryptobox_test_func (void)
 	memset (mac, 0, sizeof (mac));
 	seg = g_slice_alloc0 (sizeof (*seg) * max_seg * 10);
 
+	check_batch_verify ();
+	check_fast_hash_multi ();
+
 	/* Test baseline */
 	t1 = rspamd_get_ticks (TRUE);
 	rspamd_cryptobox_encrypt_nm_inplace (begin, end - begin, nonce, key, mac,
@@ -77,6 +77,7 @@ rspamd_dns_test_func ()
 	cfg->cfg_pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), NULL);
 	cfg->dns_retransmits = 2;
 	cfg->dns_timeout = 0.5;
+	cfg->dns_coalesce_requests = TRUE;
 
 	pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), NULL);
 
@@ -84,6 +85,9 @@ rspamd_dns_test_func ()
 
 	resolver = dns_resolver_init (NULL, base, cfg);
 
+	requests ++;
+	g_assert (make_dns_request (resolver, s, pool, test_dns_cb, NULL, RDNS_REQUEST_A, "google.com"));
+	/* Joins the previous request */
 	requests ++;
 	g_assert (make_dns_request (resolver, s, pool, test_dns_cb, NULL, RDNS_REQUEST_A, "google.com"));
 	requests ++;
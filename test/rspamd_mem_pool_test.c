@@ -17,6 +17,9 @@ rspamd_mem_pool_test_func ()
 	rspamd_mempool_t *pool;
 	rspamd_mempool_stat_t st;
 	char *tmp, *tmp2, *tmp3;
+	GArray *prof;
+	GPtrArray *parr;
+	struct rspamd_mempool_profile_elt *elt;
 	pid_t pid;
 	int ret;
 
@@ -35,5 +38,55 @@ rspamd_mem_pool_test_func ()
 	
 	rspamd_mempool_delete (pool);
 	rspamd_mempool_stat (&st);
-	
+
+	/* Freed chunks are reused by the next pool */
+	rspamd_mempool_chunks_cache_limit (1024 * 1024);
+	pool = rspamd_mempool_new (4096, NULL);
+	tmp = rspamd_mempool_alloc (pool, sizeof (TEST_BUF));
+	rspamd_mempool_delete (pool);
+	g_assert (rspamd_mempool_chunks_cache_size () > 0);
+
+	pool = rspamd_mempool_new (4096, NULL);
+	tmp2 = rspamd_mempool_alloc (pool, sizeof (TEST_BUF));
+	g_assert (tmp2 == tmp);
+	g_assert (rspamd_mempool_chunks_cache_size () == 0);
+	rspamd_mempool_delete (pool);
+
+	rspamd_mempool_chunks_cache_trim (0);
+	g_assert (rspamd_mempool_chunks_cache_size () == 0);
+	rspamd_mempool_chunks_cache_limit (0);
+
+	/* Allocations are attributed to their call sites */
+	rspamd_mempool_profile_reset ();
+	rspamd_mempool_profile_enable (TRUE);
+	pool = rspamd_mempool_new (4096, NULL);
+
+	for (ret = 0; ret < 4; ret ++) {
+		tmp = rspamd_mempool_alloc (pool, 100);
+	}
+
+	tmp = rspamd_mempool_strdup (pool, TEST_BUF);
+	rspamd_mempool_delete (pool);
+	rspamd_mempool_profile_enable (FALSE);
+
+	prof = rspamd_mempool_profile_get ();
+	g_assert (prof->len == 2);
+	elt = &g_array_index (prof, struct rspamd_mempool_profile_elt, 0);
+	g_assert (elt->bytes == 400);
+	g_assert (elt->count == 4);
+	elt = &g_array_index (prof, struct rspamd_mempool_profile_elt, 1);
+	g_assert (elt->bytes == sizeof (TEST_BUF));
+	g_assert (elt->count == 1);
+	g_array_free (prof, TRUE);
+
+	rspamd_mempool_profile_reset ();
+
+	/* Pointer arrays backed by pool */
+	pool = rspamd_mempool_new (4096, NULL);
+	parr = rspamd_mempool_ptr_array_new (pool, 2);
+	parr->pdata[parr->len ++] = tmp;
+	parr->pdata[parr->len ++] = tmp2;
+	g_assert (parr->len == 2);
+	g_assert (g_ptr_array_index (parr, 1) == tmp2);
+	rspamd_mempool_delete (pool);
 }
@@ -0,0 +1,960 @@
+/*-
+ * Copyright 2019 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Micro benchmarks for the core primitives: each case is repeated until it
+ * runs for at least `-T` seconds and reports ns/op and MB/s (if a case
+ * processes some input). The report emitted with `-o` can be passed as `-b`
+ * to a subsequent run to find regressions.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "libmime/message.h"
+#include "libserver/task.h"
+#include "libserver/url.h"
+#include "libstat/stat_internal.h"
+#include "libstat/tokenizers/tokenizers.h"
+#include "libutil/map_helpers.h"
+#include "libutil/radix.h"
+#include "libcryptobox/cryptobox.h"
+#include "ottery.h"
+#include "unix-std.h"
+
+#ifndef MICRO_BENCH_MESSAGES
+#define MICRO_BENCH_MESSAGES "test/functional/messages"
+#endif
+
+/* Size of the synthetic inputs */
+#define MICRO_BENCH_BUF_SIZE (64 * 1024)
+#define MICRO_BENCH_KEYS 10000
+#define MICRO_BENCH_LOOKUPS 4096
+
+struct rspamd_main *rspamd_main = NULL;
+worker_t *workers[] = { NULL };
+
+static gchar *messages_dir = MICRO_BENCH_MESSAGES;
+static gchar *filter = NULL;
+static gchar *output = NULL;
+static gchar *baseline = NULL;
+static gdouble min_time = 0.5;
+static gdouble threshold = 10.0;
+static gboolean json = FALSE;
+
+static GOptionEntry entries[] = {
+		{"messages", 'm', 0, G_OPTION_ARG_FILENAME, &messages_dir,
+				"Directory with messages for mime benchmarks", NULL},
+		{"filter", 'f', 0, G_OPTION_ARG_STRING, &filter,
+				"Run only cases matching the glob pattern (e.g. \"str/*\")", NULL},
+		{"time", 'T', 0, G_OPTION_ARG_DOUBLE, &min_time,
+				"Minimum time to run each case in seconds (default: 0.5)", NULL},
+		{"json", 'j', 0, G_OPTION_ARG_NONE, &json,
+				"Print JSON report instead of text", NULL},
+		{"output", 'o', 0, G_OPTION_ARG_FILENAME, &output,
+				"Write JSON report to the specified file", NULL},
+		{"baseline", 'b', 0, G_OPTION_ARG_FILENAME, &baseline,
+				"Compare results with the JSON report of a previous run", NULL},
+		{"threshold", 0, 0, G_OPTION_ARG_DOUBLE, &threshold,
+				"Slowdown in percents treated as regression (default: 10)", NULL},
+		{NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
+};
+
+/* Runs `n` operations and returns the number of bytes processed */
+typedef guint64 (*micro_bench_func) (gpointer ud, guint64 n);
+
+struct micro_bench_result {
+	gchar *name;
+	guint64 ops;
+	guint64 bytes;
+	gdouble time;
+};
+
+struct micro_bench_ctx {
+	struct rspamd_config *cfg;
+	GPtrArray *results;
+	guchar *random;
+	gchar *text;
+	gsize text_len;
+};
+
+static volatile guint64 micro_bench_sink;
+
+static gdouble
+micro_bench_ns (struct micro_bench_result *res)
+{
+	return res->time * 1e9 / res->ops;
+}
+
+static gdouble
+micro_bench_mbps (struct micro_bench_result *res)
+{
+	if (res->time <= 0) {
+		return 0;
+	}
+
+	return (gdouble)res->bytes / res->time / (1024.0 * 1024.0);
+}
+
+static void
+micro_bench_run (struct micro_bench_ctx *ctx, const gchar *name,
+		micro_bench_func func, gpointer ud)
+{
+	struct micro_bench_result *res;
+	guint64 n = 1, bytes;
+	gdouble t1, elapsed;
+
+	if (filter && !g_pattern_match_simple (filter, name)) {
+		return;
+	}
+
+	/* Warm up caches and lazy initialisation */
+	micro_bench_sink += func (ud, 1);
+
+	for (;;) {
+		t1 = rspamd_get_ticks (FALSE);
+		bytes = func (ud, n);
+		elapsed = rspamd_get_ticks (FALSE) - t1;
+
+		if (elapsed >= min_time || n >= G_MAXUINT32) {
+			break;
+		}
+
+		/* Aim a bit above the minimum time to avoid an extra round */
+		if (elapsed < min_time / 100.0) {
+			n *= 100;
+		}
+		else {
+			n = MAX (n + 1, n * min_time * 1.2 / elapsed);
+		}
+	}
+
+	res = g_malloc0 (sizeof (*res));
+	res->name = g_strdup (name);
+	res->ops = n;
+	res->bytes = bytes;
+	res->time = elapsed;
+	g_ptr_array_add (ctx->results, res);
+
+	if (!json) {
+		if (res->bytes > 0) {
+			rspamd_printf ("%-32s %12.1f ns/op %10.2f MB/s\n", name,
+					micro_bench_ns (res), micro_bench_mbps (res));
+		}
+		else {
+			rspamd_printf ("%-32s %12.1f ns/op\n", name, micro_bench_ns (res));
+		}
+	}
+}
+
+/* Mempool */
+
+static guint64
+mb_mempool_alloc (gpointer ud, guint64 n)
+{
+	rspamd_mempool_t *pool = rspamd_mempool_new (rspamd_mempool_suggest_size (),
+			"bench");
+	guint64 i;
+
+	for (i = 0; i < n; i ++) {
+		micro_bench_sink += (uintptr_t)rspamd_mempool_alloc (pool, 64);
+
+		/* Keep the pool of a size typical for a task */
+		if ((i & 4095) == 4095) {
+			rspamd_mempool_delete (pool);
+			pool = rspamd_mempool_new (rspamd_mempool_suggest_size (),
+					"bench");
+		}
+	}
+
+	rspamd_mempool_delete (pool);
+
+	return 0;
+}
+
+static guint64
+mb_mempool_new_delete (gpointer ud, guint64 n)
+{
+	rspamd_mempool_t *pool;
+	guint64 i;
+	guint j;
+
+	for (i = 0; i < n; i ++) {
+		pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "bench");
+
+		for (j = 0; j < 16; j ++) {
+			micro_bench_sink += (uintptr_t)rspamd_mempool_alloc (pool, 128);
+		}
+
+		rspamd_mempool_delete (pool);
+	}
+
+	return 0;
+}
+
+/* Strings */
+
+static guint64
+mb_str_lc (gpointer ud, guint64 n)
+{
+	struct micro_bench_ctx *ctx = ud;
+	gchar *buf = g_malloc (ctx->text_len);
+	guint64 i;
+
+	for (i = 0; i < n; i ++) {
+		memcpy (buf, ctx->text, ctx->text_len);
+		rspamd_str_lc (buf, ctx->text_len);
+	}
+
+	micro_bench_sink += buf[0];
+	g_free (buf);
+
+	return n * ctx->text_len;
+}
+
+static const gchar needle[] = "Content-Transfer-Encoding: quoted-printable";
+
+static guint64
+mb_str_search (gpointer ud, guint64 n)
+{
+	struct micro_bench_ctx *ctx = ud;
+	guint64 i;
+
+	for (i = 0; i < n; i ++) {
+		micro_bench_sink += rspamd_substring_search (ctx->text, ctx->text_len,
+				needle, sizeof (needle) - 1);
+	}
+
+	return n * ctx->text_len;
+}
+
+static guint64
+mb_str_search_caseless (gpointer ud, guint64 n)
+{
+	struct micro_bench_ctx *ctx = ud;
+	guint64 i;
+
+	for (i = 0; i < n; i ++) {
+		micro_bench_sink += rspamd_substring_search_caseless (ctx->text,
+				ctx->text_len, needle, sizeof (needle) - 1);
+	}
+
+	return n * ctx->text_len;
+}
+
+/* Codecs */
+
+struct mb_codec_data {
+	gchar *in;
+	gsize inlen;
+	guchar *out;
+	gsize outlen;
+};
+
+static guint64
+mb_base64_decode (gpointer ud, guint64 n)
+{
+	struct mb_codec_data *cd = ud;
+	gsize outlen;
+	guint64 i;
+
+	for (i = 0; i < n; i ++) {
+		outlen = cd->outlen;
+		micro_bench_sink += rspamd_cryptobox_base64_decode (cd->in, cd->inlen,
+				cd->out, &outlen);
+	}
+
+	return n * cd->inlen;
+}
+
+static guint64
+mb_base64_encode (gpointer ud, guint64 n)
+{
+	struct micro_bench_ctx *ctx = ud;
+	gchar *out;
+	gsize outlen;
+	guint64 i;
+
+	for (i = 0; i < n; i ++) {
+		out = rspamd_encode_base64 (ctx->random, MICRO_BENCH_BUF_SIZE, 76,
+				&outlen);
+		micro_bench_sink += outlen;
+		g_free (out);
+	}
+
+	return n * MICRO_BENCH_BUF_SIZE;
+}
+
+static guint64
+mb_qp_decode (gpointer ud, guint64 n)
+{
+	struct mb_codec_data *cd = ud;
+	guint64 i;
+
+	for (i = 0; i < n; i ++) {
+		micro_bench_sink += rspamd_decode_qp_buf (cd->in, cd->inlen,
+				(gchar *)cd->out, cd->outlen);
+	}
+
+	return n * cd->inlen;
+}
+
+/* Mostly ASCII text with some escaped bytes and soft line breaks */
+static gchar *
+mb_qp_encode (struct micro_bench_ctx *ctx, gsize *outlen)
+{
+	static const gchar hexdigests[] = "0123456789ABCDEF";
+	GString *out = g_string_sized_new (ctx->text_len * 2);
+	gsize i, line = 0;
+	guchar c;
+
+	for (i = 0; i < ctx->text_len; i ++) {
+		c = ctx->text[i];
+
+		if (line >= 72) {
+			g_string_append (out, "=\r\n");
+			line = 0;
+		}
+
+		if (c == '=' || c == '\n' || (ctx->random[i] & 0xf) == 0) {
+			g_string_append_c (out, '=');
+			g_string_append_c (out, hexdigests[c >> 4]);
+			g_string_append_c (out, hexdigests[c & 0xf]);
+			line += 3;
+		}
+		else {
+			g_string_append_c (out, c);
+			line ++;
+		}
+	}
+
+	*outlen = out->len;
+
+	return g_string_free (out, FALSE);
+}
+
+/* URLs */
+
+static void
+mb_url_cb (struct rspamd_url *url, gsize start_offset, gsize end_offset,
+		void *ud)
+{
+	guint *nurls = ud;
+
+	(*nurls) ++;
+}
+
+static guint64
+mb_url_find (gpointer ud, guint64 n)
+{
+	struct micro_bench_ctx *ctx = ud;
+	rspamd_mempool_t *pool;
+	guint nurls = 0;
+	guint64 i;
+
+	for (i = 0; i < n; i ++) {
+		pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "bench");
+		rspamd_url_find_multiple (pool, ctx->text, ctx->text_len, FALSE, NULL,
+				mb_url_cb, &nurls);
+		rspamd_mempool_delete (pool);
+	}
+
+	micro_bench_sink += nurls;
+
+	return n * ctx->text_len;
+}
+
+/* Mime */
+
+struct mb_messages {
+	struct rspamd_config *cfg;
+	GPtrArray *data;
+	GArray *sizes;
+};
+
+static guint64
+mb_mime_parse (gpointer ud, guint64 n)
+{
+	struct mb_messages *msgs = ud;
+	struct rspamd_task *task;
+	guint64 i, bytes = 0;
+	guint idx;
+
+	for (i = 0; i < n; i ++) {
+		idx = i % msgs->data->len;
+		task = rspamd_task_new (NULL, msgs->cfg, NULL, NULL,
+				rspamd_main->ev_base);
+		task->msg.begin = g_ptr_array_index (msgs->data, idx);
+		task->msg.len = g_array_index (msgs->sizes, gsize, idx);
+		micro_bench_sink += rspamd_message_parse (task);
+		bytes += task->msg.len;
+		rspamd_task_free (task);
+	}
+
+	return bytes;
+}
+
+static void
+mb_load_messages (struct mb_messages *msgs, const gchar *path)
+{
+	GDir *dir;
+	const gchar *name;
+	gchar *fpath;
+	gpointer map;
+	gsize sz;
+
+	dir = g_dir_open (path, 0, NULL);
+
+	if (dir == NULL) {
+		return;
+	}
+
+	while ((name = g_dir_read_name (dir)) != NULL) {
+		fpath = g_build_filename (path, name, NULL);
+
+		if (g_file_test (fpath, G_FILE_TEST_IS_DIR)) {
+			mb_load_messages (msgs, fpath);
+		}
+		else if (g_str_has_suffix (name, ".eml")) {
+			map = rspamd_file_xmap (fpath, PROT_READ, &sz, TRUE);
+
+			if (map != NULL) {
+				g_ptr_array_add (msgs->data, map);
+				g_array_append_val (msgs->sizes, sz);
+			}
+		}
+
+		g_free (fpath);
+	}
+
+	g_dir_close (dir);
+}
+
+/* Lookups */
+
+struct mb_lookup_data {
+	radix_compressed_t *radix;
+	struct rspamd_hash_map_helper *hash;
+	guint32 addrs[MICRO_BENCH_LOOKUPS];
+	gchar *keys[MICRO_BENCH_LOOKUPS];
+};
+
+static guint64
+mb_radix_lookup (gpointer ud, guint64 n)
+{
+	struct mb_lookup_data *ld = ud;
+	guint64 i;
+
+	for (i = 0; i < n; i ++) {
+		micro_bench_sink += radix_find_compressed (ld->radix,
+				(const guint8 *)&ld->addrs[i % MICRO_BENCH_LOOKUPS],
+				sizeof (guint32));
+	}
+
+	return 0;
+}
+
+static guint64
+mb_hash_lookup (gpointer ud, guint64 n)
+{
+	struct mb_lookup_data *ld = ud;
+	guint64 i;
+
+	for (i = 0; i < n; i ++) {
+		micro_bench_sink += (uintptr_t)rspamd_match_hash_map (ld->hash,
+				ld->keys[i % MICRO_BENCH_LOOKUPS]);
+	}
+
+	return 0;
+}
+
+static void
+mb_lookup_init (struct mb_lookup_data *ld)
+{
+	guint32 addr;
+	gchar key[64];
+	guint i;
+
+	ld->radix = radix_create_compressed ();
+	ld->hash = rspamd_map_helper_new_hash (NULL);
+
+	for (i = 0; i < MICRO_BENCH_KEYS; i ++) {
+		addr = ottery_rand_uint32 ();
+		/* Prefixes from /16 to /32 */
+		radix_insert_compressed (ld->radix, (guint8 *)&addr, sizeof (addr),
+				ottery_rand_range (16), i + 1);
+		rspamd_snprintf (key, sizeof (key), "host%ud.example.com", i);
+		rspamd_map_helper_insert_hash (ld->hash, key, "1");
+	}
+
+	for (i = 0; i < MICRO_BENCH_LOOKUPS; i ++) {
+		ld->addrs[i] = ottery_rand_uint32 ();
+		/* Half of lookups are hits */
+		ld->keys[i] = g_strdup_printf ("host%ud.example.%s",
+				ottery_rand_range (MICRO_BENCH_KEYS - 1),
+				(i & 1) ? "com" : "net");
+	}
+}
+
+static void
+mb_lookup_destroy (struct mb_lookup_data *ld)
+{
+	guint i;
+
+	radix_destroy_compressed (ld->radix);
+	rspamd_map_helper_destroy_hash (ld->hash);
+
+	for (i = 0; i < MICRO_BENCH_LOOKUPS; i ++) {
+		g_free (ld->keys[i]);
+	}
+}
+
+/* Tokenization */
+
+struct mb_tokenize_data {
+	struct micro_bench_ctx *ctx;
+	struct rspamd_stat_ctx st_ctx;
+	GArray *words;
+};
+
+static guint64
+mb_tokenize_words (gpointer ud, guint64 n)
+{
+	struct mb_tokenize_data *td = ud;
+	GArray *words;
+	guint64 i;
+
+	for (i = 0; i < n; i ++) {
+		words = rspamd_tokenize_text (td->ctx->text, td->ctx->text_len, NULL,
+				RSPAMD_TOKENIZE_RAW, td->ctx->cfg, NULL, NULL);
+		micro_bench_sink += words->len;
+		g_array_free (words, TRUE);
+	}
+
+	return n * td->ctx->text_len;
+}
+
+static guint64
+mb_tokenize_osb (gpointer ud, guint64 n)
+{
+	struct mb_tokenize_data *td = ud;
+	rspamd_mempool_t *pool;
+	GPtrArray *tokens;
+	guint64 i;
+
+	tokens = g_ptr_array_sized_new (td->words->len * 5);
+
+	for (i = 0; i < n; i ++) {
+		pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "bench");
+		rspamd_tokenizer_osb (&td->st_ctx, pool, td->words, FALSE, NULL,
+				tokens);
+		micro_bench_sink += tokens->len;
+		g_ptr_array_set_size (tokens, 0);
+		rspamd_mempool_delete (pool);
+	}
+
+	g_ptr_array_free (tokens, TRUE);
+
+	return n * td->ctx->text_len;
+}
+
+/* Cryptobox */
+
+struct mb_crypto_data {
+	guchar *buf;
+	rspamd_nm_t nm;
+	rspamd_nonce_t nonce;
+	rspamd_mac_t mac;
+	guchar sipkey[16];
+};
+
+static guint64
+mb_crypto_hash (gpointer ud, guint64 n)
+{
+	struct mb_crypto_data *cd = ud;
+	guchar out[rspamd_cryptobox_HASHBYTES];
+	guint64 i;
+
+	for (i = 0; i < n; i ++) {
+		rspamd_cryptobox_hash (out, cd->buf, MICRO_BENCH_BUF_SIZE, NULL, 0);
+		micro_bench_sink += out[0];
+	}
+
+	return n * MICRO_BENCH_BUF_SIZE;
+}
+
+static guint64
+mb_crypto_fast_hash (gpointer ud, guint64 n)
+{
+	struct mb_crypto_data *cd = ud;
+	guint64 i;
+
+	for (i = 0; i < n; i ++) {
+		micro_bench_sink += rspamd_cryptobox_fast_hash (cd->buf,
+				MICRO_BENCH_BUF_SIZE, i);
+	}
+
+	return n * MICRO_BENCH_BUF_SIZE;
+}
+
+static guint64
+mb_crypto_siphash (gpointer ud, guint64 n)
+{
+	struct mb_crypto_data *cd = ud;
+	guint64 i, out;
+
+	for (i = 0; i < n; i ++) {
+		rspamd_cryptobox_siphash ((guchar *)&out, cd->buf, 64, cd->sipkey);
+		micro_bench_sink += out;
+	}
+
+	return n * 64;
+}
+
+static guint64
+mb_crypto_encrypt (gpointer ud, guint64 n)
+{
+	struct mb_crypto_data *cd = ud;
+	guint64 i;
+
+	for (i = 0; i < n; i ++) {
+		rspamd_cryptobox_encrypt_nm_inplace (cd->buf, MICRO_BENCH_BUF_SIZE,
+				cd->nonce, cd->nm, cd->mac, RSPAMD_CRYPTOBOX_MODE_25519);
+	}
+
+	micro_bench_sink += cd->mac[0];
+
+	return n * MICRO_BENCH_BUF_SIZE;
+}
+
+static guint64
+mb_crypto_nm (gpointer ud, guint64 n)
+{
+	struct mb_crypto_data *cd = ud;
+	rspamd_pk_t pk;
+	rspamd_sk_t sk;
+	guint64 i;
+
+	rspamd_cryptobox_keypair (pk, sk, RSPAMD_CRYPTOBOX_MODE_25519);
+
+	for (i = 0; i < n; i ++) {
+		rspamd_cryptobox_nm (cd->nm, pk, sk, RSPAMD_CRYPTOBOX_MODE_25519);
+	}
+
+	return 0;
+}
+
+/* Synthetic text that looks like a message body with some urls */
+static void
+micro_bench_make_text (struct micro_bench_ctx *ctx)
+{
+	static const gchar *words[] = {
+		"Hello", "world", "the", "Quick", "brown", "fox", "jumps", "over",
+		"lazy", "dog", "Please", "visit", "http://example.com/path?q=1",
+		"or", "write", "to", "user@example.org", "for", "details,",
+		"Content-Type:", "text/plain;", "charset=utf-8", "www.rspamd.com",
+		"offer", "FREE", "money", "click", "here", "=", "and", "unsubscribe."
+	};
+	GString *out = g_string_sized_new (MICRO_BENCH_BUF_SIZE + 64);
+	guint i = 0;
+
+	while (out->len < MICRO_BENCH_BUF_SIZE) {
+		g_string_append (out,
+				words[ctx->random[i % MICRO_BENCH_BUF_SIZE] % G_N_ELEMENTS (words)]);
+		g_string_append_c (out, (++i % 12) == 0 ? '\n' : ' ');
+	}
+
+	/* The needle for search benchmarks is at the very end */
+	g_string_append (out, needle);
+	ctx->text_len = out->len;
+	ctx->text = g_string_free (out, FALSE);
+}
+
+static void
+micro_bench_all (struct micro_bench_ctx *ctx)
+{
+	struct mb_codec_data cd;
+	struct mb_messages msgs;
+	struct mb_lookup_data *ld;
+	struct mb_tokenize_data td;
+	struct mb_crypto_data crd;
+	rspamd_pk_t pk;
+	rspamd_sk_t sk;
+	guint i;
+
+	micro_bench_run (ctx, "mempool/alloc", mb_mempool_alloc, ctx);
+	micro_bench_run (ctx, "mempool/new_delete", mb_mempool_new_delete, ctx);
+
+	micro_bench_run (ctx, "str/lowercase", mb_str_lc, ctx);
+	micro_bench_run (ctx, "str/search", mb_str_search, ctx);
+	micro_bench_run (ctx, "str/search_caseless", mb_str_search_caseless, ctx);
+
+	memset (&cd, 0, sizeof (cd));
+	/* Decode unfolded input to measure the decoder itself */
+	cd.in = rspamd_encode_base64 (ctx->random, MICRO_BENCH_BUF_SIZE, 0,
+			&cd.inlen);
+	cd.outlen = cd.inlen;
+	cd.out = g_malloc (cd.outlen);
+	micro_bench_run (ctx, "codecs/base64_encode", mb_base64_encode, ctx);
+	micro_bench_run (ctx, "codecs/base64_decode", mb_base64_decode, &cd);
+	g_free (cd.in);
+	g_free (cd.out);
+
+	cd.in = mb_qp_encode (ctx, &cd.inlen);
+	cd.outlen = cd.inlen;
+	cd.out = g_malloc (cd.outlen);
+	micro_bench_run (ctx, "codecs/qp_decode", mb_qp_decode, &cd);
+	g_free (cd.in);
+	g_free (cd.out);
+
+	micro_bench_run (ctx, "url/find", mb_url_find, ctx);
+
+	memset (&msgs, 0, sizeof (msgs));
+	msgs.cfg = ctx->cfg;
+	msgs.data = g_ptr_array_new ();
+	msgs.sizes = g_array_new (FALSE, FALSE, sizeof (gsize));
+	mb_load_messages (&msgs, messages_dir);
+
+	if (msgs.data->len > 0) {
+		micro_bench_run (ctx, "mime/parse", mb_mime_parse, &msgs);
+	}
+	else {
+		rspamd_fprintf (stderr, "no messages found in %s, skip mime/parse\n",
+				messages_dir);
+	}
+
+	for (i = 0; i < msgs.data->len; i ++) {
+		munmap (g_ptr_array_index (msgs.data, i),
+				g_array_index (msgs.sizes, gsize, i));
+	}
+
+	g_ptr_array_free (msgs.data, TRUE);
+	g_array_free (msgs.sizes, TRUE);
+
+	ld = g_malloc0 (sizeof (*ld));
+	mb_lookup_init (ld);
+	micro_bench_run (ctx, "lookup/radix", mb_radix_lookup, ld);
+	micro_bench_run (ctx, "lookup/hash_map", mb_hash_lookup, ld);
+	mb_lookup_destroy (ld);
+	g_free (ld);
+
+	memset (&td, 0, sizeof (td));
+	td.ctx = ctx;
+	td.st_ctx.tkcf = rspamd_tokenizer_osb_get_config (ctx->cfg->cfg_pool,
+			NULL, NULL);
+	td.words = rspamd_tokenize_text (ctx->text, ctx->text_len, NULL,
+			RSPAMD_TOKENIZE_RAW, ctx->cfg, NULL, NULL);
+	micro_bench_run (ctx, "tokenize/words", mb_tokenize_words, &td);
+	micro_bench_run (ctx, "tokenize/osb", mb_tokenize_osb, &td);
+	g_array_free (td.words, TRUE);
+
+	memset (&crd, 0, sizeof (crd));
+	crd.buf = g_malloc (MICRO_BENCH_BUF_SIZE);
+	memcpy (crd.buf, ctx->random, MICRO_BENCH_BUF_SIZE);
+	ottery_rand_bytes (crd.nonce, sizeof (crd.nonce));
+	ottery_rand_bytes (crd.sipkey, sizeof (crd.sipkey));
+	rspamd_cryptobox_keypair (pk, sk, RSPAMD_CRYPTOBOX_MODE_25519);
+	rspamd_cryptobox_nm (crd.nm, pk, sk, RSPAMD_CRYPTOBOX_MODE_25519);
+	micro_bench_run (ctx, "cryptobox/hash", mb_crypto_hash, &crd);
+	micro_bench_run (ctx, "cryptobox/fast_hash", mb_crypto_fast_hash, &crd);
+	micro_bench_run (ctx, "cryptobox/siphash64", mb_crypto_siphash, &crd);
+	micro_bench_run (ctx, "cryptobox/encrypt_nm", mb_crypto_encrypt, &crd);
+	micro_bench_run (ctx, "cryptobox/nm", mb_crypto_nm, &crd);
+	g_free (crd.buf);
+}
+
+static ucl_object_t *
+micro_bench_report (struct micro_bench_ctx *ctx)
+{
+	ucl_object_t *top, *ar, *obj;
+	struct micro_bench_result *res;
+	guint i;
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+	ar = ucl_object_typed_new (UCL_ARRAY);
+
+	PTR_ARRAY_FOREACH (ctx->results, i, res) {
+		obj = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (obj, ucl_object_fromstring (res->name),
+				"name", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (res->ops),
+				"ops", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromdouble (micro_bench_ns (res)),
+				"ns_per_op", 0, false);
+
+		if (res->bytes > 0) {
+			ucl_object_insert_key (obj,
+					ucl_object_fromdouble (micro_bench_mbps (res)),
+					"mbps", 0, false);
+		}
+
+		ucl_array_append (ar, obj);
+	}
+
+	ucl_object_insert_key (top, ucl_object_fromstring (RVERSION),
+			"version", 0, false);
+	ucl_object_insert_key (top, ar, "results", 0, false);
+
+	return top;
+}
+
+static guint
+micro_bench_compare (struct micro_bench_ctx *ctx, const ucl_object_t *base)
+{
+	const ucl_object_t *ar, *cur, *elt;
+	ucl_object_iter_t it = NULL;
+	GHashTable *base_ns;
+	struct micro_bench_result *res;
+	gdouble *pns, ns;
+	guint i, nregressions = 0;
+
+	base_ns = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_free);
+	ar = ucl_object_lookup (base, "results");
+
+	while ((cur = ucl_object_iterate (ar, &it, true)) != NULL) {
+		elt = ucl_object_lookup (cur, "name");
+
+		if (elt && ucl_object_type (elt) == UCL_STRING) {
+			pns = g_malloc (sizeof (*pns));
+			*pns = ucl_object_todouble (ucl_object_lookup (cur, "ns_per_op"));
+			g_hash_table_insert (base_ns,
+					(gpointer)ucl_object_tostring (elt), pns);
+		}
+	}
+
+	PTR_ARRAY_FOREACH (ctx->results, i, res) {
+		pns = g_hash_table_lookup (base_ns, res->name);
+		ns = micro_bench_ns (res);
+
+		if (pns == NULL) {
+			rspamd_printf ("NEW %s: %.1f ns/op\n", res->name, ns);
+		}
+		else if (*pns > 0 && ns > *pns * (1.0 + threshold / 100.0)) {
+			rspamd_printf ("REGRESSION %s: %.1f ns/op, baseline %.1f ns/op\n",
+					res->name, ns, *pns);
+			nregressions ++;
+		}
+	}
+
+	g_hash_table_unref (base_ns);
+
+	return nregressions;
+}
+
+int
+main (int argc, char **argv)
+{
+	struct rspamd_config *cfg;
+	struct micro_bench_ctx ctx;
+	struct micro_bench_result *res;
+	struct ucl_parser *parser;
+	ucl_object_t *report;
+	GOptionContext *context;
+	GError *error = NULL;
+	guchar *emitted;
+	FILE *out;
+	guint i, nregressions = 0;
+
+	context = g_option_context_new ("- rspamd micro benchmarks");
+	g_option_context_add_main_entries (context, entries, NULL);
+
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		fprintf (stderr, "option parsing failed: %s\n", error->message);
+		g_error_free (error);
+		exit (EXIT_FAILURE);
+	}
+
+	if (min_time <= 0) {
+		min_time = 0.5;
+	}
+
+	rspamd_main = g_malloc0 (sizeof (*rspamd_main));
+	rspamd_main->server_pool = rspamd_mempool_new (
+			rspamd_mempool_suggest_size (), "micro-bench");
+	rspamd_main->ev_base = event_init ();
+	cfg = rspamd_config_new (RSPAMD_CONFIG_INIT_DEFAULT);
+	cfg->libs_ctx = rspamd_init_libs ();
+	rspamd_main->cfg = cfg;
+	cfg->log_type = RSPAMD_LOG_CONSOLE;
+	cfg->log_level = G_LOG_LEVEL_WARNING;
+	rspamd_set_logger (cfg, g_quark_from_static_string ("rspamd-micro-bench"),
+			&rspamd_main->logger, rspamd_main->server_pool);
+	(void)rspamd_log_open (rspamd_main->logger);
+	g_log_set_default_handler (rspamd_glib_log_function, rspamd_main->logger);
+	rspamd_url_init (NULL);
+
+	memset (&ctx, 0, sizeof (ctx));
+	ctx.cfg = cfg;
+	ctx.results = g_ptr_array_new ();
+	ctx.random = g_malloc (MICRO_BENCH_BUF_SIZE);
+	ottery_rand_bytes (ctx.random, MICRO_BENCH_BUF_SIZE);
+	micro_bench_make_text (&ctx);
+
+	micro_bench_all (&ctx);
+	report = micro_bench_report (&ctx);
+
+	if (json) {
+		emitted = ucl_object_emit (report, UCL_EMIT_JSON);
+		rspamd_printf ("%s\n", emitted);
+		free (emitted);
+	}
+
+	if (output) {
+		out = fopen (output, "w");
+
+		if (out == NULL) {
+			fprintf (stderr, "cannot open %s: %s\n", output, strerror (errno));
+		}
+		else {
+			emitted = ucl_object_emit (report, UCL_EMIT_JSON);
+			fputs ((const gchar *)emitted, out);
+			fclose (out);
+			free (emitted);
+		}
+	}
+
+	if (baseline) {
+		parser = ucl_parser_new (0);
+
+		if (!ucl_parser_add_file (parser, baseline)) {
+			fprintf (stderr, "cannot load baseline %s: %s\n", baseline,
+					ucl_parser_get_error (parser));
+		}
+		else {
+			ucl_object_t *base = ucl_parser_get_object (parser);
+
+			rspamd_printf ("\ncomparing with %s:\n", baseline);
+			nregressions = micro_bench_compare (&ctx, base);
+			rspamd_printf ("%ud regressions found\n", nregressions);
+			ucl_object_unref (base);
+		}
+
+		ucl_parser_free (parser);
+	}
+
+	ucl_object_unref (report);
+
+	PTR_ARRAY_FOREACH (ctx.results, i, res) {
+		g_free (res->name);
+		g_free (res);
+	}
+
+	g_ptr_array_free (ctx.results, TRUE);
+	g_free (ctx.random);
+	g_free (ctx.text);
+	REF_RELEASE (cfg);
+
+	return nregressions > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
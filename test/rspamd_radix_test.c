@@ -134,6 +134,21 @@ rspamd_radix_test_vec (void)
 		t ++;
 	}
 
+	/* Flat tables must give the same results */
+	radix_compile_compressed (tree);
+
+	i = 0;
+	t = &test_vec[0];
+	while (t->ip != NULL) {
+		val = radix_find_compressed (tree, t->addr, t->len);
+		g_assert (val == ++i);
+		if (t->nip != NULL) {
+			val = radix_find_compressed (tree, t->naddr, t->len);
+			g_assert (val != i);
+		}
+		t ++;
+	}
+
 	radix_destroy_compressed (tree);
 }
 
@@ -330,6 +345,42 @@ rspamd_radix_test_func (void)
 
 	g_assert (all_good);
 
+	msg_notice ("Checked %hz elements in %.0f ticks",
+			nelts * lookup_cycles / lookup_divisor, diff);
+
+	msg_notice ("flat radix performance (%z elts)", nelts);
+	ts1 = rspamd_get_ticks (TRUE);
+	radix_compile_compressed (comp_tree);
+	ts2 = rspamd_get_ticks (TRUE);
+	msg_notice ("Compiled %hz elements in %.0f ticks", nelts, ts2 - ts1);
+	diff = 0;
+
+	for (lc = 0; lc < lookup_cycles && all_good; lc ++) {
+		for (i = 0; i < nelts / lookup_divisor; i ++) {
+			guint8 rnd[16];
+			gpointer bval;
+			uintptr_t rval;
+
+			check = ottery_rand_range (nelts - 1);
+
+			ts1 = rspamd_get_ticks (TRUE);
+			rval = radix_find_compressed (comp_tree, addrs[check].addr6,
+					sizeof (addrs[check].addr6));
+			ts2 = rspamd_get_ticks (TRUE);
+			diff += ts2 - ts1;
+
+			bval = btrie_lookup (btrie, addrs[check].addr6,
+					sizeof (addrs[check].addr6) * NBBY);
+			g_assert (rval == (bval ? GPOINTER_TO_SIZE (bval) : RADIX_NO_VALUE));
+
+			/* Random addresses must match the trie as well */
+			ottery_rand_bytes (rnd, sizeof (rnd));
+			rval = radix_find_compressed (comp_tree, rnd, sizeof (rnd));
+			bval = btrie_lookup (btrie, rnd, sizeof (rnd) * NBBY);
+			g_assert (rval == (bval ? GPOINTER_TO_SIZE (bval) : RADIX_NO_VALUE));
+		}
+	}
+
 	msg_notice ("Checked %hz elements in %.0f ticks",
 			nelts * lookup_cycles / lookup_divisor, diff);
 	radix_destroy_compressed (comp_tree);
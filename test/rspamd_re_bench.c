@@ -0,0 +1,708 @@
+/*-
+ * Copyright 2019 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Replays a corpus of messages over the regexp cache of some configuration
+ * and reports per class and per regexp throughput. The report emitted with
+ * `-o` can be passed as `-b` to a subsequent run to find regressions.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "libmime/message.h"
+#include "libserver/cfg_file.h"
+#include "libserver/cfg_rcl.h"
+#include "libserver/re_cache.h"
+#include "libserver/task.h"
+#include "lua/lua_common.h"
+#include "unix-std.h"
+
+/* Defined in modules.c */
+extern module_t *modules[];
+extern worker_t *workers[];
+
+struct rspamd_main *rspamd_main = NULL;
+
+static gchar *config = NULL;
+static gchar *hs_dir = NULL;
+static gchar *output = NULL;
+static gchar *baseline = NULL;
+static gint iterations = 1;
+static gint top = 20;
+static gdouble threshold = 10.0;
+static gboolean no_hyperscan = FALSE;
+static gboolean verbose = FALSE;
+
+static GOptionEntry entries[] = {
+		{"config", 'c', 0, G_OPTION_ARG_STRING, &config,
+				"Config file to use", NULL},
+		{"hs-dir", 0, 0, G_OPTION_ARG_STRING, &hs_dir,
+				"Directory with compiled hyperscan databases", NULL},
+		{"no-hyperscan", 0, 0, G_OPTION_ARG_NONE, &no_hyperscan,
+				"Use pcre only", NULL},
+		{"iterations", 'n', 0, G_OPTION_ARG_INT, &iterations,
+				"Number of passes over the corpus (default: 1)", NULL},
+		{"top", 't', 0, G_OPTION_ARG_INT, &top,
+				"Number of the slowest regexps to print (default: 20)", NULL},
+		{"output", 'o', 0, G_OPTION_ARG_FILENAME, &output,
+				"Write JSON report to the specified file", NULL},
+		{"baseline", 'b', 0, G_OPTION_ARG_FILENAME, &baseline,
+				"Compare results with the JSON report of a previous run", NULL},
+		{"threshold", 0, 0, G_OPTION_ARG_DOUBLE, &threshold,
+				"Slowdown in percents treated as regression (default: 10)", NULL},
+		{"verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose,
+				"Enable verbose logging", NULL},
+		{NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
+};
+
+struct re_bench_class {
+	gchar *name;
+	const gchar *hash;
+	gsize scratch_size;
+	guint nre;
+	guint nhs;
+	guint64 bytes;
+	guint64 bytes_hs;
+	guint64 bytes_pcre;
+	gdouble time;
+	gdouble time_hs;
+	gdouble time_pcre;
+};
+
+struct re_bench_elt {
+	struct rspamd_re_cache_elt_info info;
+	struct re_bench_class *cls;
+	gchar *key;
+	guint64 bytes;
+	guint64 matches;
+	gdouble time;
+};
+
+struct re_bench_ctx {
+	GPtrArray *elts;
+	GPtrArray *classes;
+	GHashTable *classes_by_hash;
+	guint64 bytes;
+	gdouble time;
+	guint messages;
+};
+
+static gdouble
+re_bench_mbps (guint64 bytes, gdouble time)
+{
+	if (time <= 0) {
+		return 0;
+	}
+
+	return (gdouble)bytes / time / (1024.0 * 1024.0);
+}
+
+static void
+re_bench_add_elt (const struct rspamd_re_cache_elt_info *info, gpointer ud)
+{
+	struct re_bench_ctx *ctx = ud;
+	struct re_bench_elt *elt;
+	struct re_bench_class *cls;
+
+	cls = g_hash_table_lookup (ctx->classes_by_hash, info->class_hash);
+
+	if (cls == NULL) {
+		cls = g_malloc0 (sizeof (*cls));
+		cls->hash = info->class_hash;
+		cls->scratch_size = info->scratch_size;
+
+		if (info->type_len > 0) {
+			cls->name = g_strdup_printf ("%s(%.*s)",
+					rspamd_re_cache_type_to_string (info->type),
+					(gint)info->type_len, (const gchar *)info->type_data);
+		}
+		else {
+			cls->name = g_strdup (rspamd_re_cache_type_to_string (info->type));
+		}
+
+		g_hash_table_insert (ctx->classes_by_hash, (gpointer)cls->hash, cls);
+		g_ptr_array_add (ctx->classes, cls);
+	}
+
+	elt = g_malloc0 (sizeof (*elt));
+	memcpy (&elt->info, info, sizeof (*info));
+	elt->cls = cls;
+	/* Class hashes depend on all regexps in a class, so use names as keys */
+	elt->key = g_strdup_printf ("%s/%s/", cls->name,
+			rspamd_regexp_get_pattern (info->re));
+	cls->nre ++;
+
+	if (info->hyperscan) {
+		cls->nhs ++;
+	}
+
+	g_ptr_array_add (ctx->elts, elt);
+}
+
+static void
+re_bench_task (struct re_bench_ctx *ctx, struct rspamd_task *task)
+{
+	struct re_bench_elt *elt;
+	struct re_bench_class *cls;
+	const struct rspamd_re_cache_stat *stat;
+	GHashTable *cls_bytes;
+	guint64 bytes, bytes_pcre, *pmax;
+	gdouble t1, t2;
+	gint ret;
+	guint i;
+
+	cls_bytes = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+			NULL, g_free);
+	stat = rspamd_re_cache_get_stat (task->re_rt);
+
+	PTR_ARRAY_FOREACH (ctx->elts, i, elt) {
+		bytes = stat->bytes_scanned;
+		bytes_pcre = stat->bytes_scanned_pcre;
+		t1 = rspamd_get_ticks (FALSE);
+		ret = rspamd_re_cache_process (task, elt->info.re, elt->info.type,
+				elt->info.type_data, elt->info.type_len, FALSE);
+		t2 = rspamd_get_ticks (FALSE);
+
+		bytes = stat->bytes_scanned - bytes;
+		bytes_pcre = stat->bytes_scanned_pcre - bytes_pcre;
+		cls = elt->cls;
+		elt->time += t2 - t1;
+		elt->bytes += bytes;
+		elt->matches += ret;
+		cls->time += t2 - t1;
+		cls->bytes_pcre += bytes_pcre;
+		cls->bytes_hs += bytes - bytes_pcre;
+
+		if (elt->info.hyperscan) {
+			cls->time_hs += t2 - t1;
+		}
+		else {
+			cls->time_pcre += t2 - t1;
+		}
+
+		/*
+		 * All regexps of a class process the same inputs, so the class input
+		 * size is the largest amount of data scanned by any of its regexps
+		 */
+		pmax = g_hash_table_lookup (cls_bytes, cls);
+
+		if (pmax == NULL) {
+			pmax = g_malloc0 (sizeof (*pmax));
+			g_hash_table_insert (cls_bytes, cls, pmax);
+		}
+
+		if (bytes > *pmax) {
+			*pmax = bytes;
+		}
+
+		ctx->time += t2 - t1;
+	}
+
+	PTR_ARRAY_FOREACH (ctx->classes, i, cls) {
+		pmax = g_hash_table_lookup (cls_bytes, cls);
+
+		if (pmax) {
+			cls->bytes += *pmax;
+		}
+	}
+
+	g_hash_table_unref (cls_bytes);
+}
+
+static void
+re_bench_file (struct re_bench_ctx *ctx, struct rspamd_config *cfg,
+		const gchar *fname)
+{
+	struct rspamd_task *task;
+	gpointer map;
+	gsize sz;
+	gint i;
+
+	map = rspamd_file_xmap (fname, PROT_READ, &sz, TRUE);
+
+	if (map == NULL) {
+		rspamd_fprintf (stderr, "cannot map %s: %s\n", fname, strerror (errno));
+		return;
+	}
+
+	task = rspamd_task_new (NULL, cfg, NULL, NULL, rspamd_main->ev_base);
+	task->msg.begin = map;
+	task->msg.len = sz;
+
+	if (!rspamd_message_parse (task)) {
+		rspamd_fprintf (stderr, "cannot parse %s\n", fname);
+	}
+	else {
+		rspamd_message_process (task);
+
+		for (i = 0; i < iterations; i ++) {
+			/* Start each pass with the clean runtime */
+			rspamd_re_cache_runtime_destroy (task->re_rt);
+			task->re_rt = rspamd_re_cache_runtime_new (cfg->re_cache);
+			re_bench_task (ctx, task);
+			ctx->bytes += sz;
+		}
+
+		ctx->messages ++;
+	}
+
+	rspamd_task_free (task);
+	munmap (map, sz);
+}
+
+static void
+re_bench_path (struct re_bench_ctx *ctx, struct rspamd_config *cfg,
+		const gchar *path)
+{
+	GDir *dir;
+	const gchar *name;
+	gchar *fpath;
+
+	if (!g_file_test (path, G_FILE_TEST_IS_DIR)) {
+		re_bench_file (ctx, cfg, path);
+		return;
+	}
+
+	dir = g_dir_open (path, 0, NULL);
+
+	if (dir == NULL) {
+		rspamd_fprintf (stderr, "cannot open %s: %s\n", path, strerror (errno));
+		return;
+	}
+
+	while ((name = g_dir_read_name (dir)) != NULL) {
+		fpath = g_build_filename (path, name, NULL);
+
+		if (g_file_test (fpath, G_FILE_TEST_IS_REGULAR)) {
+			re_bench_file (ctx, cfg, fpath);
+		}
+
+		g_free (fpath);
+	}
+
+	g_dir_close (dir);
+}
+
+static gint
+re_bench_elt_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct re_bench_elt *e1 = *(const struct re_bench_elt **)a,
+			*e2 = *(const struct re_bench_elt **)b;
+
+	if (e1->time > e2->time) {
+		return -1;
+	}
+	else if (e1->time < e2->time) {
+		return 1;
+	}
+
+	return 0;
+}
+
+static ucl_object_t *
+re_bench_report (struct re_bench_ctx *ctx)
+{
+	ucl_object_t *top_obj, *ar, *obj;
+	struct re_bench_elt *elt;
+	struct re_bench_class *cls;
+	gsize scratch = 0;
+	guint i;
+
+	top_obj = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (top_obj, ucl_object_fromint (ctx->messages),
+			"messages", 0, false);
+	ucl_object_insert_key (top_obj, ucl_object_fromint (iterations),
+			"iterations", 0, false);
+	ucl_object_insert_key (top_obj, ucl_object_fromint (ctx->bytes),
+			"bytes", 0, false);
+	ucl_object_insert_key (top_obj, ucl_object_fromdouble (ctx->time),
+			"time", 0, false);
+	ucl_object_insert_key (top_obj,
+			ucl_object_fromdouble (re_bench_mbps (ctx->bytes, ctx->time)),
+			"mbps", 0, false);
+
+	ar = ucl_object_typed_new (UCL_ARRAY);
+
+	PTR_ARRAY_FOREACH (ctx->classes, i, cls) {
+		obj = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (obj, ucl_object_fromstring (cls->name),
+				"class", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromstring (cls->hash),
+				"hash", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (cls->nre),
+				"regexps", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (cls->nhs),
+				"hyperscan_regexps", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (cls->scratch_size),
+				"scratch_size", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (cls->bytes),
+				"bytes", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (cls->bytes_hs),
+				"bytes_hyperscan", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (cls->bytes_pcre),
+				"bytes_pcre", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromdouble (cls->time),
+				"time", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromdouble (cls->time_hs),
+				"time_hyperscan", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromdouble (cls->time_pcre),
+				"time_pcre", 0, false);
+		ucl_object_insert_key (obj,
+				ucl_object_fromdouble (re_bench_mbps (cls->bytes, cls->time)),
+				"mbps", 0, false);
+		ucl_array_append (ar, obj);
+		scratch += cls->scratch_size;
+	}
+
+	ucl_object_insert_key (top_obj, ar, "classes", 0, false);
+	ucl_object_insert_key (top_obj, ucl_object_fromint (scratch),
+			"scratch_size", 0, false);
+
+	ar = ucl_object_typed_new (UCL_ARRAY);
+
+	PTR_ARRAY_FOREACH (ctx->elts, i, elt) {
+		obj = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (obj, ucl_object_fromstring (elt->key),
+				"key", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromstring (elt->cls->name),
+				"class", 0, false);
+		ucl_object_insert_key (obj,
+				ucl_object_fromstring (
+						elt->info.prefilter ? "prefilter" :
+						(elt->info.hyperscan ? "hyperscan" : "pcre")),
+				"engine", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (elt->bytes),
+				"bytes", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (elt->matches),
+				"matches", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromdouble (elt->time),
+				"time", 0, false);
+		ucl_object_insert_key (obj,
+				ucl_object_fromdouble (re_bench_mbps (elt->bytes, elt->time)),
+				"mbps", 0, false);
+		ucl_array_append (ar, obj);
+	}
+
+	ucl_object_insert_key (top_obj, ar, "regexps", 0, false);
+
+	return top_obj;
+}
+
+static gboolean
+re_bench_slower (gdouble cur, gdouble base)
+{
+	return base > 0 && cur < base * (1.0 - threshold / 100.0);
+}
+
+/*
+ * Returns number of regressions found
+ */
+static guint
+re_bench_compare (struct re_bench_ctx *ctx, const ucl_object_t *base)
+{
+	const ucl_object_t *ar, *cur, *elt;
+	ucl_object_iter_t it = NULL;
+	GHashTable *base_mbps;
+	struct re_bench_elt *e;
+	struct re_bench_class *cls;
+	gdouble *pmbps, mbps, base_total;
+	guint i, nregressions = 0;
+
+	base_mbps = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_free);
+
+	ar = ucl_object_lookup (base, "regexps");
+
+	while ((cur = ucl_object_iterate (ar, &it, true)) != NULL) {
+		elt = ucl_object_lookup (cur, "key");
+
+		if (elt && ucl_object_type (elt) == UCL_STRING) {
+			pmbps = g_malloc (sizeof (*pmbps));
+			*pmbps = ucl_object_todouble (ucl_object_lookup (cur, "mbps"));
+			g_hash_table_insert (base_mbps,
+					(gpointer)ucl_object_tostring (elt), pmbps);
+		}
+	}
+
+	it = NULL;
+	ar = ucl_object_lookup (base, "classes");
+
+	while ((cur = ucl_object_iterate (ar, &it, true)) != NULL) {
+		elt = ucl_object_lookup (cur, "class");
+
+		if (elt && ucl_object_type (elt) == UCL_STRING) {
+			pmbps = g_malloc (sizeof (*pmbps));
+			*pmbps = ucl_object_todouble (ucl_object_lookup (cur, "mbps"));
+			g_hash_table_insert (base_mbps,
+					(gpointer)ucl_object_tostring (elt), pmbps);
+		}
+	}
+
+	base_total = ucl_object_todouble (ucl_object_lookup (base, "mbps"));
+	mbps = re_bench_mbps (ctx->bytes, ctx->time);
+
+	if (re_bench_slower (mbps, base_total)) {
+		rspamd_printf ("REGRESSION total: %.2f MB/s, baseline %.2f MB/s\n",
+				mbps, base_total);
+		nregressions ++;
+	}
+
+	PTR_ARRAY_FOREACH (ctx->classes, i, cls) {
+		pmbps = g_hash_table_lookup (base_mbps, cls->name);
+		mbps = re_bench_mbps (cls->bytes, cls->time);
+
+		if (pmbps && re_bench_slower (mbps, *pmbps)) {
+			rspamd_printf ("REGRESSION class %s: %.2f MB/s, baseline %.2f MB/s\n",
+					cls->name, mbps, *pmbps);
+			nregressions ++;
+		}
+	}
+
+	PTR_ARRAY_FOREACH (ctx->elts, i, e) {
+		pmbps = g_hash_table_lookup (base_mbps, e->key);
+		mbps = re_bench_mbps (e->bytes, e->time);
+
+		if (pmbps == NULL) {
+			rspamd_printf ("NEW %s: %.2f MB/s\n", e->key, mbps);
+		}
+		else if (re_bench_slower (mbps, *pmbps)) {
+			rspamd_printf ("REGRESSION %s: %.2f MB/s, baseline %.2f MB/s\n",
+					e->key, mbps, *pmbps);
+			nregressions ++;
+		}
+	}
+
+	g_hash_table_unref (base_mbps);
+
+	return nregressions;
+}
+
+static void
+re_bench_print (struct re_bench_ctx *ctx)
+{
+	struct re_bench_elt *elt;
+	struct re_bench_class *cls;
+	GPtrArray *sorted;
+	gsize scratch = 0;
+	guint i;
+
+	rspamd_printf ("%ud messages, %ud passes, %uL bytes in %.3f seconds: "
+			"%.2f MB/s\n",
+			ctx->messages, iterations, ctx->bytes, ctx->time,
+			re_bench_mbps (ctx->bytes, ctx->time));
+	rspamd_printf ("\nclasses:\n");
+
+	PTR_ARRAY_FOREACH (ctx->classes, i, cls) {
+		rspamd_printf ("%s: %ud regexps (%ud hyperscan), %.2f MB/s, "
+				"hyperscan %.3f s (%uL bytes), pcre %.3f s (%uL bytes), "
+				"scratch %z bytes\n",
+				cls->name, cls->nre, cls->nhs,
+				re_bench_mbps (cls->bytes, cls->time),
+				cls->time_hs, cls->bytes_hs,
+				cls->time_pcre, cls->bytes_pcre,
+				cls->scratch_size);
+		scratch += cls->scratch_size;
+	}
+
+	rspamd_printf ("total scratch size: %z bytes\n", scratch);
+
+	sorted = g_ptr_array_sized_new (ctx->elts->len);
+
+	PTR_ARRAY_FOREACH (ctx->elts, i, elt) {
+		g_ptr_array_add (sorted, elt);
+	}
+
+	g_ptr_array_sort (sorted, re_bench_elt_cmp);
+	rspamd_printf ("\nslowest regexps:\n");
+
+	PTR_ARRAY_FOREACH (sorted, i, elt) {
+		if (top > 0 && i >= (guint)top) {
+			break;
+		}
+
+		rspamd_printf ("%.3f s, %.2f MB/s, %uL matches, %s: %s\n",
+				elt->time, re_bench_mbps (elt->bytes, elt->time),
+				elt->matches,
+				elt->info.prefilter ? "prefilter" :
+						(elt->info.hyperscan ? "hyperscan" : "pcre"),
+				elt->key);
+	}
+
+	g_ptr_array_free (sorted, TRUE);
+}
+
+static void
+config_logger (rspamd_mempool_t *pool, gpointer ud)
+{
+	struct rspamd_main *rm = ud;
+
+	rm->cfg->log_type = RSPAMD_LOG_CONSOLE;
+	rm->cfg->log_level = verbose ? G_LOG_LEVEL_DEBUG : G_LOG_LEVEL_WARNING;
+
+	rspamd_set_logger (rm->cfg, g_quark_from_static_string ("rspamd-re-bench"),
+			&rm->logger, rm->server_pool);
+
+	if (rspamd_log_open (rm->logger) == -1) {
+		fprintf (stderr, "Fatal error, cannot open logfile, exiting\n");
+		exit (EXIT_FAILURE);
+	}
+}
+
+int
+main (int argc, char **argv)
+{
+	struct rspamd_config *cfg;
+	struct re_bench_ctx ctx;
+	struct ucl_parser *parser;
+	ucl_object_t *report;
+	GOptionContext *context;
+	GError *error = NULL;
+	worker_t **pworker;
+	FILE *out;
+	guint nregressions = 0;
+	gint i;
+
+	context = g_option_context_new ("[messages...] - rspamd regexps benchmark");
+	g_option_context_add_main_entries (context, entries, NULL);
+
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		fprintf (stderr, "option parsing failed: %s\n", error->message);
+		g_error_free (error);
+		exit (EXIT_FAILURE);
+	}
+
+	if (argc < 2) {
+		fprintf (stderr, "no messages specified\n");
+		exit (EXIT_FAILURE);
+	}
+
+	if (iterations < 1) {
+		iterations = 1;
+	}
+
+	rspamd_main = g_malloc0 (sizeof (*rspamd_main));
+	rspamd_main->server_pool = rspamd_mempool_new (
+			rspamd_mempool_suggest_size (), "re-bench");
+	rspamd_main->ev_base = event_init ();
+	cfg = rspamd_config_new (RSPAMD_CONFIG_INIT_DEFAULT);
+	cfg->libs_ctx = rspamd_init_libs ();
+	rspamd_main->cfg = cfg;
+	cfg->log_type = RSPAMD_LOG_CONSOLE;
+	cfg->log_level = verbose ? G_LOG_LEVEL_DEBUG : G_LOG_LEVEL_WARNING;
+	rspamd_set_logger (cfg, g_quark_from_static_string ("rspamd-re-bench"),
+			&rspamd_main->logger, rspamd_main->server_pool);
+	(void)rspamd_log_open (rspamd_main->logger);
+	g_log_set_default_handler (rspamd_glib_log_function, rspamd_main->logger);
+
+	pworker = &workers[0];
+	while (*pworker) {
+		/* Init string quarks */
+		(void) g_quark_from_static_string ((*pworker)->name);
+		pworker++;
+	}
+
+	cfg->cache = rspamd_symcache_new (cfg);
+	cfg->compiled_modules = modules;
+	cfg->compiled_workers = workers;
+	cfg->cfg_name = config ? config :
+			g_strdup_printf ("%s%c%s", RSPAMD_CONFDIR, G_DIR_SEPARATOR,
+					"rspamd.conf");
+
+	if (!rspamd_config_read (cfg, cfg->cfg_name, config_logger, rspamd_main,
+			NULL)) {
+		fprintf (stderr, "cannot load config %s\n", cfg->cfg_name);
+		exit (EXIT_FAILURE);
+	}
+
+	rspamd_lua_post_load_config (cfg);
+
+	if (!rspamd_init_filters (cfg, FALSE)) {
+		fprintf (stderr, "cannot init filters\n");
+		exit (EXIT_FAILURE);
+	}
+
+	if (no_hyperscan) {
+		cfg->disable_hyperscan = TRUE;
+	}
+
+	if (!rspamd_config_post_load (cfg,
+			RSPAMD_CONFIG_INIT_URL|RSPAMD_CONFIG_INIT_LIBS|
+			RSPAMD_CONFIG_INIT_SYMCACHE)) {
+		fprintf (stderr, "cannot init config\n");
+		exit (EXIT_FAILURE);
+	}
+
+#ifdef WITH_HYPERSCAN
+	if (!no_hyperscan) {
+		if (!rspamd_re_cache_load_hyperscan (cfg->re_cache,
+				hs_dir ? hs_dir : cfg->hs_cache_dir)) {
+			fprintf (stderr, "cannot load hyperscan databases, using pcre\n");
+		}
+	}
+#endif
+
+	memset (&ctx, 0, sizeof (ctx));
+	ctx.elts = g_ptr_array_new ();
+	ctx.classes = g_ptr_array_new ();
+	ctx.classes_by_hash = g_hash_table_new (g_str_hash, g_str_equal);
+	rspamd_re_cache_foreach (cfg->re_cache, re_bench_add_elt, &ctx);
+
+	for (i = 1; i < argc; i ++) {
+		re_bench_path (&ctx, cfg, argv[i]);
+	}
+
+	re_bench_print (&ctx);
+	report = re_bench_report (&ctx);
+
+	if (output) {
+		out = fopen (output, "w");
+
+		if (out == NULL) {
+			fprintf (stderr, "cannot open %s: %s\n", output, strerror (errno));
+		}
+		else {
+			guchar *json = ucl_object_emit (report, UCL_EMIT_JSON);
+
+			fputs ((const gchar *)json, out);
+			fclose (out);
+			free (json);
+		}
+	}
+
+	if (baseline) {
+		parser = ucl_parser_new (0);
+
+		if (!ucl_parser_add_file (parser, baseline)) {
+			fprintf (stderr, "cannot load baseline %s: %s\n", baseline,
+					ucl_parser_get_error (parser));
+		}
+		else {
+			ucl_object_t *base = ucl_parser_get_object (parser);
+
+			rspamd_printf ("\ncomparing with %s:\n", baseline);
+			nregressions = re_bench_compare (&ctx, base);
+			rspamd_printf ("%ud regressions found\n", nregressions);
+			ucl_object_unref (base);
+		}
+
+		ucl_parser_free (parser);
+	}
+
+	ucl_object_unref (report);
+	REF_RELEASE (cfg);
+	rspamd_regexp_library_finalize ();
+
+	return nregressions > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
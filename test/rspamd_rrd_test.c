@@ -34,6 +34,7 @@ rspamd_rrd_test_func ()
 	gdouble ticks;
 	gint i;
 	gdouble t[2], cnt = 0.0;
+	struct rspamd_rrd_query_result *res;
 
 	rspamd_snprintf (tmpfile, sizeof (tmpfile), "/tmp/rspamd_rrd.rrd");
 	unlink (tmpfile);
@@ -98,6 +99,28 @@ rspamd_rrd_test_func ()
 
 	}
 
+	/* Add queued points */
+	for (i = 0; i < pdp_per_cdp * rows_cnt / 8; i ++) {
+		t[0] = i;
+		t[1] = cnt ++;
+		ar.data = t;
+		ar.len = sizeof (t);
+		ticks += 1.0;
+		g_assert (rspamd_rrd_queue_record (rrd, &ar, ticks, &err));
+
+	}
+
+	g_assert (rspamd_rrd_flush (rrd, &err));
+	g_assert (rrd->live_head->last_up == (glong)ticks);
+
+	/* Query the last ten rows of the finest archive */
+	res = rspamd_rrd_query_window (rrd, 3,
+			ticks - pdp_per_cdp / 10 * 10, ticks);
+	g_assert (res != NULL);
+	g_assert (res->rows == 10);
+	g_assert (res->first_cdp == (gulong)(ticks / (pdp_per_cdp / 10)) - 10);
+	g_free (res);
+
 	/* Finish */
 	rspamd_rrd_close (rrd);
 	/* unlink (tmpfile); */
@@ -0,0 +1,122 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "shared_cache.h"
+#include "tests.h"
+#include "unix-std.h"
+
+#ifdef HAVE_SYS_WAIT_H
+#include <sys/wait.h>
+#endif
+
+static const guint nelts = 64;
+
+void
+rspamd_shared_cache_test_func (void)
+{
+	rspamd_mempool_t *pool;
+	rspamd_shared_cache_t *cache;
+	struct rspamd_shared_cache_stat st;
+	gchar key[32], value[32];
+	gsize vlen;
+	guint i, ttl, found = 0;
+	time_t now = 1000;
+	pid_t pid;
+	gint status;
+	gchar snapshot[] = "/tmp/rspamd-cache-snapshot-XXXXXX";
+
+	pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), NULL);
+	cache = rspamd_shared_cache_new (pool, "test", nelts, sizeof (value));
+
+	/* Values are visible in processes forked after cache creation */
+	pid = fork ();
+	g_assert (pid != -1);
+
+	if (pid == 0) {
+		rspamd_shared_cache_insert (cache, "key", 3, "value", 6, now, 10);
+		_exit (0);
+	}
+
+	g_assert (waitpid (pid, &status, 0) == pid);
+	vlen = sizeof (value);
+	g_assert (rspamd_shared_cache_lookup (cache, "key", 3, now + 1,
+			value, &vlen, &ttl));
+	g_assert (vlen == 6);
+	g_assert (strcmp (value, "value") == 0);
+	g_assert (ttl == 9);
+
+	/* Expired values are not returned */
+	vlen = sizeof (value);
+	g_assert (!rspamd_shared_cache_lookup (cache, "key", 3, now + 10,
+			value, &vlen, NULL));
+
+	/* Values larger than slots are not stored */
+	g_assert (!rspamd_shared_cache_insert (cache, "big", 3, value,
+			sizeof (value) + 1, now, 0));
+
+	/* Cache keeps no more than its size */
+	for (i = 0; i < nelts * 4; i ++) {
+		rspamd_snprintf (key, sizeof (key), "key%ud", i);
+		g_assert (rspamd_shared_cache_insert (cache, key, strlen (key),
+				&i, sizeof (i), now, 0));
+	}
+
+	for (i = 0; i < nelts * 4; i ++) {
+		rspamd_snprintf (key, sizeof (key), "key%ud", i);
+		vlen = sizeof (value);
+
+		if (rspamd_shared_cache_lookup (cache, key, strlen (key), now,
+				value, &vlen, NULL)) {
+			g_assert (vlen == sizeof (i));
+			g_assert (memcmp (value, &i, sizeof (i)) == 0);
+			found ++;
+		}
+	}
+
+	g_assert (found > 0 && found <= nelts);
+
+	rspamd_shared_cache_get_stat (cache, &st, TRUE);
+	g_assert (st.stores == nelts * 4 + 1);
+	g_assert (st.evictions == nelts * 4 - nelts);
+	g_assert (st.hits == found + 1);
+	rspamd_shared_cache_get_stat (cache, &st, FALSE);
+	g_assert (st.hits == 0 && st.stores == 0);
+
+	/* Snapshot keeps expiration time of elements */
+	g_assert (rspamd_shared_cache_insert (cache, "long", 4, "value", 6, now, 100));
+	g_assert (rspamd_shared_cache_insert (cache, "short", 5, "value", 6, now, 10));
+	status = mkstemp (snapshot);
+	g_assert (status != -1);
+	close (status);
+	g_assert (rspamd_shared_caches_save (snapshot, now, NULL));
+	rspamd_mempool_delete (pool);
+
+	pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), NULL);
+	cache = rspamd_shared_cache_new (pool, "test", nelts, sizeof (value));
+	g_assert (rspamd_shared_caches_load (snapshot, now + 40, NULL) > 0);
+	vlen = sizeof (value);
+	g_assert (rspamd_shared_cache_lookup (cache, "long", 4, now + 40,
+			value, &vlen, &ttl));
+	g_assert (ttl == 60);
+	vlen = sizeof (value);
+	g_assert (!rspamd_shared_cache_lookup (cache, "short", 5, now + 40,
+			value, &vlen, NULL));
+	unlink (snapshot);
+
+	rspamd_mempool_delete (pool);
+}
@@ -136,6 +136,46 @@ test_case (gsize cnt, gsize max_len, gdouble perm_factor,
 	g_free (sgl_permuted);
 }
 
+/* Same as default filter but forces generation of all hashes */
+static guint64
+test_min_filter (guint64 *input, gsize count,
+		gint shno, const guchar *key, gpointer ud)
+{
+	return rspamd_shingles_default_filter (input, count, shno, key, ud);
+}
+
+static void
+test_fused_case (gsize cnt, gsize max_len, enum rspamd_shingle_alg alg)
+{
+	GArray *input;
+	struct rspamd_shingle *sgl, *sgl_generic;
+	guchar key[16];
+	gdouble ts1, ts2, ts3;
+	gint i;
+
+	ottery_rand_bytes (key, sizeof (key));
+	input = generate_fuzzy_words (cnt, max_len);
+	ts1 = rspamd_get_virtual_ticks ();
+	sgl = rspamd_shingles_from_text (input, key, NULL,
+			rspamd_shingles_default_filter, NULL, alg);
+	ts2 = rspamd_get_virtual_ticks ();
+	sgl_generic = rspamd_shingles_from_text (input, key, NULL,
+			test_min_filter, NULL, alg);
+	ts3 = rspamd_get_virtual_ticks ();
+
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+		g_assert (sgl->hashes[i] == sgl_generic->hashes[i]);
+	}
+
+	msg_info ("%s (%z words of %z max len): fused filter time: %.4f sec, "
+			"generic filter time: %.4f sec",
+			algorithm_to_string (alg), cnt, max_len, ts2 - ts1, ts3 - ts2);
+
+	free_fuzzy_words (input);
+	g_free (sgl);
+	g_free (sgl_generic);
+}
+
 static const guint64 expected_old[RSPAMD_SHINGLE_SIZE] = {
 	0x2a97e024235cedc5, 0x46238acbcc55e9e0, 0x2378ff151af075b3, 0xde1f29a95cad109,
 	0x5d3bbbdb5db5d19f, 0x4d75a0ec52af10a6, 0x215ecd6372e755b5, 0x7b52295758295350,
@@ -241,4 +281,10 @@ rspamd_shingles_test_func (void)
 		test_case (50000, 5, 0.02, alg);
 		test_case (50000, 16, 0.02, alg);
 	}
+
+	for (alg = RSPAMD_SHINGLES_OLD; alg <= RSPAMD_SHINGLES_FAST; alg ++) {
+		test_fused_case (2, 10, alg);
+		test_fused_case (5000, 20, alg);
+		test_fused_case (200000, 16, alg);
+	}
 }
@@ -76,7 +76,11 @@ main (int argc, char **argv)
 	g_test_add_func ("/rspamd/http", rspamd_http_test_func);
 	g_test_add_func ("/rspamd/lua", rspamd_lua_test_func);
 	g_test_add_func ("/rspamd/cryptobox", rspamd_cryptobox_test_func);
+	g_test_add_func ("/rspamd/codecs", rspamd_codecs_test_func);
 	g_test_add_func ("/rspamd/heap", rspamd_heap_test_func);
+	g_test_add_func ("/rspamd/shared_cache", rspamd_shared_cache_test_func);
+	g_test_add_func ("/rspamd/bloom", rspamd_bloom_test_func);
+	g_test_add_func ("/rspamd/bayes", rspamd_bayes_test_func);
 	g_test_add_func ("/rspamd/lua_pcall", rspamd_lua_lua_pcall_vs_resume_test_func);
 
 #if 0
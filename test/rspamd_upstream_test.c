@@ -159,6 +159,55 @@ rspamd_upstream_test_func (void)
 
 	rspamd_upstreams_destroy (nls);
 
+	/* Test weighted rendezvous hashing, the new upstream has weight 1 of 7 */
+	nls = rspamd_upstreams_create (cfg->ups_ctx);
+	g_assert (rspamd_upstreams_parse_line (nls, test_upstream_list, 443, NULL));
+	g_assert (rspamd_upstreams_parse_line (nls, new_upstream_list, 443, NULL));
+	success = 0;
+
+	for (i = 0; i < assumptions; i ++) {
+		ottery_rand_bytes (test_key, sizeof (test_key));
+		up = rspamd_upstream_get_forced (ls, RSPAMD_UPSTREAM_RENDEZVOUS,
+				test_key, sizeof (test_key));
+		upn = rspamd_upstream_get_forced (nls, RSPAMD_UPSTREAM_RENDEZVOUS,
+				test_key, sizeof (test_key));
+
+		if (strcmp (rspamd_upstream_name (up), rspamd_upstream_name (upn)) == 0) {
+			success ++;
+		}
+		else {
+			/* Keys could be moved to the new upstream only */
+			g_assert (strcmp (rspamd_upstream_name (upn), "freebsd.org") == 0);
+		}
+	}
+
+	p = 1.0 - fabs (6.0 / 7.0 - (gdouble)success / (gdouble)assumptions);
+	msg_debug ("p value for rendezvous hash consistency: %.6f", p);
+	g_assert (p > 0.9);
+
+	rspamd_upstreams_destroy (nls);
+
+	/* Test least loaded rotation */
+	nls = rspamd_upstreams_create (cfg->ups_ctx);
+	g_assert (rspamd_upstreams_parse_line (nls,
+			"least-loaded:127.0.0.1,127.0.0.2", 0, NULL));
+	up = rspamd_upstream_get (nls, RSPAMD_UPSTREAM_RANDOM, NULL, 0);
+	rspamd_upstream_request_start (up);
+	/* Unmeasured upstreams are selected by outstanding requests */
+	upn = rspamd_upstream_get (nls, RSPAMD_UPSTREAM_RANDOM, NULL, 0);
+	g_assert (upn != up);
+	rspamd_upstream_request_start (upn);
+	rspamd_upstream_request_finish (up, 0.01);
+	rspamd_upstream_request_finish (upn, 1.0);
+
+	for (i = 0; i < 3; i ++) {
+		g_assert (rspamd_upstream_get (nls, RSPAMD_UPSTREAM_RANDOM,
+				NULL, 0) == up);
+		rspamd_upstream_request_start (up);
+	}
+
+	rspamd_upstreams_destroy (nls);
+
 
 	/* Upstream fail test */
 	evtimer_set (&ev, rspamd_upstream_timeout_handler, resolver);
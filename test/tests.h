@@ -39,8 +39,16 @@ void rspamd_lua_test_func (void);
 
 void rspamd_cryptobox_test_func (void);
 
+void rspamd_codecs_test_func (void);
+
 void rspamd_heap_test_func (void);
 
+void rspamd_shared_cache_test_func (void);
+
+void rspamd_bloom_test_func (void);
+
+void rspamd_bayes_test_func (void);
+
 void rspamd_lua_lua_pcall_vs_resume_test_func(void);
 
 #endif